@@ -426,6 +426,21 @@ int coap_make_response(coap_rw_buffer_t *scratch, coap_packet_t *pkt, const uint
     return 0;
 }
 
+// Insert an option keeping the list ordered by number, as coap_build() expects.
+// The value is not copied and must stay valid until the packet is built.
+int coap_add_option(coap_packet_t *pkt, uint8_t num, const uint8_t *value, size_t len)
+{
+    int i;
+    if (pkt->numopts >= MAXOPT)
+        return COAP_ERR_BUFFER_TOO_SMALL;
+    for (i = pkt->numopts; i > 0 && pkt->opts[i-1].num > num; i--)
+        pkt->opts[i] = pkt->opts[i-1];
+    pkt->opts[i].num = num;
+    pkt->opts[i].buf.p = value;
+    pkt->opts[i].buf.len = len;
+    pkt->numopts++;
+    return 0;
+}
 
 unsigned int coap_encode_var_bytes(unsigned char *buf, unsigned int val) {
   unsigned int n, i;
@@ -446,6 +461,11 @@ static uint8_t _token_data[4] = {'n','o','d','e'};
 coap_buffer_t the_token = { _token_data, 4 };
 static unsigned short message_id;
 
+unsigned short coap_next_message_id(void)
+{
+    return message_id++;
+}
+
 int coap_make_request(coap_rw_buffer_t *scratch, coap_packet_t *pkt, coap_msgtype_t t, coap_method_t m, coap_uri_t *uri, const uint8_t *payload, size_t payload_len)
 {
     int res;
@@ -453,10 +473,10 @@ int coap_make_request(coap_rw_buffer_t *scratch, coap_packet_t *pkt, coap_msgtyp
     pkt->hdr.t = t;
     pkt->hdr.tkl = 0;
     pkt->hdr.code = m;
-    pkt->hdr.id[0] = (message_id >> 8) & 0xFF;  //msgid_hi;
-    pkt->hdr.id[1] = message_id & 0xFF; //msgid_lo;
-    message_id++;
-    NODE_DBG("message_id: %d.\n", message_id);
+    unsigned short id = coap_next_message_id();
+    pkt->hdr.id[0] = (id >> 8) & 0xFF;  //msgid_hi;
+    pkt->hdr.id[1] = id & 0xFF; //msgid_lo;
+    NODE_DBG("message_id: %d.\n", id);
     pkt->numopts = 0;
 
     if (the_token.len) {
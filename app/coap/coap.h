@@ -76,8 +76,12 @@ typedef enum
     COAP_OPTION_URI_QUERY = 15,
     COAP_OPTION_ACCEPT = 17,
     COAP_OPTION_LOCATION_QUERY = 20,
+    COAP_OPTION_BLOCK2 = 23,        // http://tools.ietf.org/html/rfc7959#section-2.1
+    COAP_OPTION_BLOCK1 = 27,
+    COAP_OPTION_SIZE2 = 28,
     COAP_OPTION_PROXY_URI = 35,
-    COAP_OPTION_PROXY_SCHEME = 39
+    COAP_OPTION_PROXY_SCHEME = 39,
+    COAP_OPTION_SIZE1 = 60
 } coap_option_num_t;
 
 //http://tools.ietf.org/html/rfc7252#section-12.1.1
@@ -106,7 +110,11 @@ typedef enum
     COAP_RSPCODE_CONTENT = MAKE_RSPCODE(2, 5),
     COAP_RSPCODE_NOT_FOUND = MAKE_RSPCODE(4, 4),
     COAP_RSPCODE_BAD_REQUEST = MAKE_RSPCODE(4, 0),
-    COAP_RSPCODE_CHANGED = MAKE_RSPCODE(2, 4)
+    COAP_RSPCODE_CHANGED = MAKE_RSPCODE(2, 4),
+    COAP_RSPCODE_CONTINUE = MAKE_RSPCODE(2, 31),
+    COAP_RSPCODE_METHOD_NOT_ALLOWED = MAKE_RSPCODE(4, 5),
+    COAP_RSPCODE_REQUEST_ENTITY_INCOMPLETE = MAKE_RSPCODE(4, 8),
+    COAP_RSPCODE_INTERNAL_SERVER_ERROR = MAKE_RSPCODE(5, 0)
 } coap_responsecode_t;
 
 //http://tools.ietf.org/html/rfc7252#section-12.3
@@ -151,14 +159,35 @@ typedef struct
     const char *elems[MAX_SEGMENTS];
 } coap_endpoint_path_t;
 
+// http://tools.ietf.org/html/rfc7641
+#define COAP_MAX_OBSERVERS 8        // per resource
+#define COAP_OBSERVE_REGISTER 0
+#define COAP_OBSERVE_DEREGISTER 1
+
+typedef struct coap_observer coap_observer;
+
+struct coap_observer{
+    coap_observer *next;
+    uint32_t ip;
+    uint16_t port;
+    uint8_t tkl;
+    uint8_t tok[8];
+    uint8_t id[2];                      // message id of the last notification, matched against a RST
+};
+
 typedef struct coap_luser_entry coap_luser_entry;
 
 struct coap_luser_entry{
-    // int ref;
+    int ref;                            // blobs: the generator function or file name
     // char name[MAX_SEGMENTS_SIZE+1];         // +1 for string '\0'
     const char *name;
     coap_luser_entry *next;
     int content_type;
+    coap_observer *observers;
+    uint32_t observe_seq;
+    coap_luser_entry *hash_next;        // next entry in the same bucket
+    const coap_luser_entry *list;       // head of the list it is on
+    uint32_t key;                       // coap_hash() of the name
 };
 
 struct coap_endpoint_t{
@@ -186,12 +215,23 @@ void coap_dump(const uint8_t *buf, size_t buflen, bool bare);
 int coap_make_response(coap_rw_buffer_t *scratch, coap_packet_t *pkt, const uint8_t *content, size_t content_len, uint8_t msgid_hi, uint8_t msgid_lo, const coap_buffer_t* tok, coap_responsecode_t rspcode, coap_content_type_t content_type);
 int coap_handle_req(coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt);
 void coap_option_nibble(uint32_t value, uint8_t *nibble);
+int coap_add_option(coap_packet_t *pkt, uint8_t num, const uint8_t *value, size_t len);
+unsigned int coap_encode_var_bytes(unsigned char *buf, unsigned int val);
+unsigned short coap_next_message_id(void);
 void coap_setup(void);
 void endpoint_setup(void);
 
 int coap_buildOptionHeader(uint32_t optDelta, size_t length, uint8_t *buf, size_t buflen);
 int check_token(coap_packet_t *pkt);
 
+void coap_observe_source(uint32_t ip, uint16_t port);
+void coap_observe_reset(uint32_t ip, uint16_t port, const uint8_t id[2]);
+void coap_observe_clear(void);
+
+// Entries are found by a hash of their list and name, and never removed
+coap_luser_entry *coap_luser_find(const coap_luser_entry *head, const char *name, size_t len);
+void coap_luser_add(coap_luser_entry *head, coap_luser_entry *e);
+
 #include "uri.h"
 int coap_make_request(coap_rw_buffer_t *scratch, coap_packet_t *pkt, coap_msgtype_t t, coap_method_t m, coap_uri_t *uri, const uint8_t *payload, size_t payload_len);
 
@@ -5,14 +5,14 @@
 
 #include "coap.h"
 
-size_t coap_server_respond(char *req, unsigned short reqlen, char *rsp, unsigned short rsplen)
+size_t coap_server_respond(char *req, unsigned short reqlen, char *rsp, unsigned short rsplen, uint32_t ip, uint16_t port)
 {
   NODE_DBG("coap_server_respond is called.\n");
   size_t rlen = rsplen;
   coap_packet_t pkt;
   pkt.content.p = NULL;
   pkt.content.len = 0;
-  uint8_t scratch_raw[4];
+  uint8_t scratch_raw[12];   // content format, observe and block option values
   coap_rw_buffer_t scratch_buf = {scratch_raw, sizeof(scratch_raw)};
   int rc;
 
@@ -26,6 +26,13 @@ size_t coap_server_respond(char *req, unsigned short reqlen, char *rsp, unsigned
     NODE_DBG("Bad packet rc=%d\n", rc);
     return 0;
   }
+  else if (pkt.hdr.t == COAP_TYPE_RESET || pkt.hdr.t == COAP_TYPE_ACK)
+  {
+    // the only messages we send unasked are notifications
+    if (pkt.hdr.t == COAP_TYPE_RESET)
+      coap_observe_reset(ip, port, pkt.hdr.id);
+    return 0;
+  }
   else
   {
     coap_packet_t rsppkt;
@@ -34,6 +41,7 @@ size_t coap_server_respond(char *req, unsigned short reqlen, char *rsp, unsigned
 #ifdef COAP_DEBUG
     coap_dumpPacket(&pkt);
 #endif
+    coap_observe_source(ip, port);
     coap_handle_req(&scratch_buf, &pkt, &rsppkt);
     if (0 != (rc = coap_build(rsp, &rlen, &rsppkt))){
       NODE_DBG("coap_build failed rc=%d\n", rc);
@@ -5,7 +5,7 @@
 extern "C" {
 #endif
 
-size_t coap_server_respond(char *req, unsigned short reqlen, char *rsp, unsigned short rsplen);
+size_t coap_server_respond(char *req, unsigned short reqlen, char *rsp, unsigned short rsplen, uint32_t ip, uint16_t port);
 
 #ifdef __cplusplus
 }
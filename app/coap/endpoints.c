@@ -2,6 +2,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include "coap.h"
+#include "hash.h"
+#include "pdu.h"
+#include "vfs.h"
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -17,147 +20,215 @@ void endpoint_setup(void)
     coap_setup();
 }
 
+// The listing only changes when a resource is registered, see coap_luser_add()
+static char *well_known_core;
+static size_t well_known_core_len;
+
 static const coap_endpoint_path_t path_well_known_core = {2, {".well-known", "core"}};
 static int handle_get_well_known_core(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
 {
-    outpkt->content.p = (uint8_t *)calloc(1,MAX_PAYLOAD_SIZE);      // this should be free-ed when outpkt is built in coap_server_respond()
-    if(outpkt->content.p == NULL){
-        NODE_DBG("not enough memory\n");
-        return COAP_ERR_BUFFER_TOO_SMALL;
+    if (well_known_core == NULL) {
+        char *rsp = (char *)malloc(MAX_PAYLOAD_SIZE);
+        if (rsp == NULL) {
+            NODE_DBG("not enough memory\n");
+            return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+        build_well_known_rsp(rsp, MAX_PAYLOAD_SIZE);
+        well_known_core_len = strlen(rsp);
+        well_known_core = (char *)realloc(rsp, well_known_core_len + 1);
+        if (well_known_core == NULL)
+            well_known_core = rsp;
     }
-    outpkt->content.len = MAX_PAYLOAD_SIZE;
-    build_well_known_rsp(outpkt->content.p, outpkt->content.len);
-    return coap_make_response(scratch, outpkt, (const uint8_t *)outpkt->content.p, strlen(outpkt->content.p), id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_APPLICATION_LINKFORMAT);
+    return coap_make_response(scratch, outpkt, (const uint8_t *)well_known_core, well_known_core_len, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_APPLICATION_LINKFORMAT);
 }
 
-static const coap_endpoint_path_t path_variable = {2, {"v1", "v"}};
-static int handle_get_variable(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+// Source of the request being handled, set by coap_server_respond()
+static uint32_t source_ip;
+static uint16_t source_port;
+
+void coap_observe_source(uint32_t ip, uint16_t port)
+{
+    source_ip = ip;
+    source_port = port;
+}
+
+static coap_observer **find_observer(coap_luser_entry *h, const coap_buffer_t *tok)
+{
+    coap_observer **o = &h->observers;
+    while (*o) {
+        if ((*o)->ip == source_ip && (*o)->port == source_port &&
+            (*o)->tkl == tok->len && 0 == memcmp((*o)->tok, tok->p, tok->len))
+            break;
+        o = &(*o)->next;
+    }
+    return o;
+}
+
+// Track the Observe option of a GET on a variable, http://tools.ietf.org/html/rfc7641#section-3.1
+// Returns true if the response should carry an Observe option.
+static bool observe_request(coap_luser_entry *h, const coap_packet_t *inpkt)
 {
     const coap_option_t *opt;
     uint8_t count;
-    int n;
-    lua_State *L = lua_getstate();
-    if (NULL != (opt = coap_findOptions(inpkt, COAP_OPTION_URI_PATH, &count)))
-    {
-        if ((count != ep->path->count ) && (count != ep->path->count + 1)) // +1 for /f/[function], /v/[variable]
-        {
-            NODE_DBG("should never happen.\n");
-            goto end;
+    uint32_t value = 0;
+    int i, n = 0;
+    coap_observer **o = find_observer(h, &inpkt->tok);
+
+    if (NULL == (opt = coap_findOptions(inpkt, COAP_OPTION_OBSERVE, &count)) || opt->buf.len > 3)
+        value = COAP_OBSERVE_DEREGISTER;    // a plain GET also ends an observation with the same token
+    else
+        for (i = 0; i < opt->buf.len; i++)
+            value = (value << 8) | opt->buf.p[i];
+
+    if (value != COAP_OBSERVE_REGISTER) {
+        if (*o) {
+            coap_observer *dead = *o;
+            *o = dead->next;
+            free(dead);
+            NODE_DBG("observer removed.\n");
         }
-        if (count == ep->path->count + 1)
-        {
-            coap_luser_entry *h = ep->user_entry->next;     // ->next: skip the first entry(head)
-            while(NULL != h){
-                if (opt[count-1].buf.len != strlen(h->name))
-                {
-                    h = h->next;
-                    continue;
-                }
-                if (0 == memcmp(h->name, opt[count-1].buf.p, opt[count-1].buf.len))
-                {
-                    NODE_DBG("/v1/v/");
-                    NODE_DBG((char *)h->name);
-                    NODE_DBG(" match.\n");
-                    if(strlen(h->name))
-                    {
-                        n = lua_gettop(L);
-                        lua_getglobal(L, h->name);
-                        if (!lua_isnumber(L, -1) && !lua_isstring(L, -1)) {
-                            NODE_DBG ("should be a number or string.\n");
-                            lua_settop(L, n);
-                            return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
-                        } else {
-                            const char *res = lua_tostring(L,-1);
-                            lua_settop(L, n);
-                            return coap_make_response(scratch, outpkt, (const uint8_t *)res, strlen(res), id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, h->content_type);
-                        }
-                    }
-                } else {
-                    h = h->next;
-                }
+        return false;
+    }
+
+    if (NULL == *o) {
+        coap_observer *p;
+        for (p = h->observers; p; p = p->next)
+            n++;
+        if (n >= COAP_MAX_OBSERVERS || inpkt->tok.len > sizeof(p->tok) ||
+            NULL == (*o = (coap_observer *)calloc(1, sizeof(coap_observer)))) {
+            NODE_DBG("observer not added.\n");
+            return false;   // answer as a plain GET
+        }
+        (*o)->ip = source_ip;
+        (*o)->port = source_port;
+        (*o)->tkl = inpkt->tok.len;
+        memcpy((*o)->tok, inpkt->tok.p, inpkt->tok.len);
+        NODE_DBG("observer added.\n");
+    }
+    return true;
+}
+
+extern coap_luser_entry *variable_entry;
+
+// A RST in reply to a notification cancels the observation, http://tools.ietf.org/html/rfc7641#section-3.6
+void coap_observe_reset(uint32_t ip, uint16_t port, const uint8_t id[2])
+{
+    coap_luser_entry *h;
+    for (h = variable_entry->next; h; h = h->next) {
+        coap_observer **o = &h->observers;
+        while (*o) {
+            if ((*o)->ip == ip && (*o)->port == port &&
+                (*o)->id[0] == id[0] && (*o)->id[1] == id[1]) {
+                coap_observer *dead = *o;
+                *o = dead->next;
+                free(dead);
+                NODE_DBG("observer reset.\n");
+            } else {
+                o = &(*o)->next;
             }
-        }else{
-            NODE_DBG("/v1/v match.\n");
-            goto end;
         }
     }
-    NODE_DBG("none match.\n");
-end:
-    return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
 }
 
-static const coap_endpoint_path_t path_function = {2, {"v1", "f"}};
-static int handle_post_function(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+void coap_observe_clear(void)
+{
+    coap_luser_entry *h;
+    for (h = variable_entry->next; h; h = h->next) {
+        while (h->observers) {
+            coap_observer *dead = h->observers;
+            h->observers = dead->next;
+            free(dead);
+        }
+    }
+}
+
+// Find the user entry named by the last Uri-Path segment
+static coap_luser_entry *find_user_entry(const coap_endpoint_t *ep, const coap_packet_t *inpkt)
 {
     const coap_option_t *opt;
     uint8_t count;
+    if (NULL == (opt = coap_findOptions(inpkt, COAP_OPTION_URI_PATH, &count)) || count != ep->path->count + 1)
+        return NULL;
+    return coap_luser_find(ep->user_entry, (const char *)opt[count-1].buf.p, opt[count-1].buf.len);
+}
+
+static const coap_endpoint_path_t path_variable = {2, {"v1", "v"}};
+static int handle_get_variable(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+{
     int n;
     lua_State *L = lua_getstate();
-    if (NULL != (opt = coap_findOptions(inpkt, COAP_OPTION_URI_PATH, &count)))
-    {
-        if ((count != ep->path->count ) && (count != ep->path->count + 1)) // +1 for /f/[function], /v/[variable]
-        {
-            NODE_DBG("should never happen.\n");
-            goto end;
+    coap_luser_entry *h = find_user_entry(ep, inpkt);
+    if (h == NULL) {
+        NODE_DBG("none match.\n");
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
+    }
+    NODE_DBG("/v1/v/");
+    NODE_DBG((char *)h->name);
+    NODE_DBG(" match.\n");
+
+    n = lua_gettop(L);
+    lua_getglobal(L, h->name);
+    if (!lua_isnumber(L, -1) && !lua_isstring(L, -1)) {
+        NODE_DBG ("should be a number or string.\n");
+        lua_settop(L, n);
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+    } else {
+        const char *res = lua_tostring(L,-1);
+        lua_settop(L, n);
+        int rc = coap_make_response(scratch, outpkt, (const uint8_t *)res, strlen(res), id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, h->content_type);
+        if (rc == 0 && observe_request(h, inpkt) && scratch->len >= 5) {
+            // scratch[0..1] holds the content format
+            int len = coap_encode_var_bytes(scratch->p + 2, h->observe_seq);
+            coap_add_option(outpkt, COAP_OPTION_OBSERVE, scratch->p + 2, len);
         }
-        if (count == ep->path->count + 1)
+        return rc;
+    }
+}
+
+static const coap_endpoint_path_t path_function = {2, {"v1", "f"}};
+static int handle_post_function(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+{
+    int n;
+    lua_State *L = lua_getstate();
+    coap_luser_entry *h = find_user_entry(ep, inpkt);
+    if (h == NULL) {
+        NODE_DBG("none match.\n");
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+    }
+    NODE_DBG("/v1/f/");
+    NODE_DBG((char *)h->name);
+    NODE_DBG(" match.\n");
+
+    n = lua_gettop(L);
+    lua_getglobal(L, h->name);
+    if (lua_type(L, -1) != LUA_TFUNCTION) {
+        NODE_DBG ("should be a function\n");
+        lua_settop(L, n);
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+    }
+    lua_pushlstring(L, inpkt->payload.p, inpkt->payload.len);     // make sure payload.p is filled with '\0' after payload.len, or use lua_pushlstring
+    lua_call(L, 1, 1);
+    if (!lua_isnil(L, -1)){  /* get return? */
+        if( lua_isstring(L, -1) )   // deal with the return string
         {
-            coap_luser_entry *h = ep->user_entry->next;     // ->next: skip the first entry(head)
-            while(NULL != h){
-                if (opt[count-1].buf.len != strlen(h->name))
-                {
-                    h = h->next;
-                    continue;
-                }
-                if (0 == memcmp(h->name, opt[count-1].buf.p, opt[count-1].buf.len))
-                {
-                    NODE_DBG("/v1/f/");
-                    NODE_DBG((char *)h->name);
-                    NODE_DBG(" match.\n");
-
-                    if(strlen(h->name))
-                    {
-                        n = lua_gettop(L);
-                        lua_getglobal(L, h->name);
-                        if (lua_type(L, -1) != LUA_TFUNCTION) {
-                            NODE_DBG ("should be a function\n");
-                            lua_settop(L, n);
-                            return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
-                        } else {
-                            lua_pushlstring(L, inpkt->payload.p, inpkt->payload.len);     // make sure payload.p is filled with '\0' after payload.len, or use lua_pushlstring
-                            lua_call(L, 1, 1);
-                            if (!lua_isnil(L, -1)){  /* get return? */
-                                if( lua_isstring(L, -1) )   // deal with the return string
-                                {
-                                    size_t len = 0;
-                                    const char *ret = luaL_checklstring( L, -1, &len );
-                                    if(len > MAX_PAYLOAD_SIZE){
-                                        lua_settop(L, n);
-                                        luaL_error( L, "return string:<MAX_PAYLOAD_SIZE" );
-                                        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
-                                    }
-                                    NODE_DBG((char *)ret);
-                                    NODE_DBG("\n");
-                                    lua_settop(L, n);
-                                    return coap_make_response(scratch, outpkt, ret, len, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
-                                }
-                            } else {
-                                lua_settop(L, n);
-                                return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
-                            }
-                        }
-                    }
-                } else {
-                    h = h->next;
-                }
+            size_t len = 0;
+            const char *ret = luaL_checklstring( L, -1, &len );
+            if(len > MAX_PAYLOAD_SIZE){
+                lua_settop(L, n);
+                luaL_error( L, "return string:<MAX_PAYLOAD_SIZE" );
+                return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
             }
-        }else{
-            NODE_DBG("/v1/f match.\n");
-            goto end;
+            NODE_DBG((char *)ret);
+            NODE_DBG("\n");
+            lua_settop(L, n);
+            return coap_make_response(scratch, outpkt, ret, len, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
         }
+    } else {
+        lua_settop(L, n);
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
     }
-    NODE_DBG("none match.\n");
-end:
+    NODE_DBG("should return a string\n");
+    lua_settop(L, n);
     return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
 }
 
@@ -197,12 +268,134 @@ static int handle_get_id(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, c
     return coap_make_response(scratch, outpkt, (const uint8_t *)(&id), sizeof(uint32_t), id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN);
 }
 
-coap_luser_entry var_head = {NULL,NULL,0};
+// Blobs are read with Block2, http://tools.ietf.org/html/rfc7959#section-2.4
+// Each block is read on its own so memory use is bounded by the block size.
+static const coap_endpoint_path_t path_blob = {2, {"v1", "b"}};
+static int handle_get_blob(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+{
+    coap_luser_entry *h = find_user_entry(ep, inpkt);
+    coap_block_t block = {0, 0, COAP_BLOCK_SZX_DEFAULT};
+    int requested, n, rc, len = 0, more = 0, total = -1;
+    uint32_t offset, size;
+    lua_State *L = lua_getstate();
+
+    if (h == NULL)
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+
+    requested = coap_get_block(inpkt, COAP_OPTION_BLOCK2, &block);
+    offset = block.num * COAP_BLOCK_SIZE(block.szx);
+    if (block.szx > COAP_BLOCK_SZX_DEFAULT) {  // answer with smaller blocks, the client follows
+        block.szx = COAP_BLOCK_SZX_DEFAULT;
+        block.num = offset / COAP_BLOCK_SIZE(block.szx);
+    }
+    size = COAP_BLOCK_SIZE(block.szx);
+
+    outpkt->content.p = (uint8_t *)malloc(size);    // free-ed in coap_server_respond()
+    if (outpkt->content.p == NULL) {
+        NODE_DBG("not enough memory\n");
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_INTERNAL_SERVER_ERROR, COAP_CONTENTTYPE_NONE);
+    }
+    outpkt->content.len = size;
+
+    n = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, h->ref);
+    if (lua_type(L, -1) == LUA_TFUNCTION) {
+        size_t l = 0;
+        lua_pushinteger(L, offset);
+        lua_pushinteger(L, size);
+        if (luaL_pcallx(L, 2, 1) != LUA_OK || (!lua_isnil(L, -1) && !lua_isstring(L, -1))) {
+            lua_settop(L, n);
+            return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_INTERNAL_SERVER_ERROR, COAP_CONTENTTYPE_NONE);
+        }
+        const char *chunk = lua_tolstring(L, -1, &l);
+        len = l < size ? l : size;
+        if (len)
+            memcpy(outpkt->content.p, chunk, len);
+        more = (len == size);   // a generator ends with a short or empty block
+    } else {
+        int fd = vfs_open(lua_tostring(L, -1), "r");
+        if (!fd) {
+            lua_settop(L, n);
+            return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+        }
+        total = vfs_size(fd);
+        if (offset > (uint32_t)total || (offset == (uint32_t)total && offset > 0) || vfs_lseek(fd, offset, VFS_SEEK_SET) < 0 ||
+            (len = vfs_read(fd, outpkt->content.p, size)) < 0) {
+            vfs_close(fd);
+            lua_settop(L, n);
+            return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_BAD_REQUEST, COAP_CONTENTTYPE_NONE);
+        }
+        vfs_close(fd);
+        more = (offset + len < (uint32_t)total);
+    }
+    lua_settop(L, n);
+
+    rc = coap_make_response(scratch, outpkt, outpkt->content.p, len, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_CONTENT, h->content_type);
+    if (rc == 0 && (requested || more) && scratch->len >= 9) {
+        // scratch[0..1] holds the content format
+        block.m = more;
+        coap_add_block(outpkt, COAP_OPTION_BLOCK2, &block, scratch->p + 2);
+        if (block.num == 0 && total >= 0)
+            coap_add_option(outpkt, COAP_OPTION_SIZE2, scratch->p + 5, coap_encode_var_bytes(scratch->p + 5, total));
+    }
+    return rc;
+}
+
+// Blobs backed by a file can be written with Block1, http://tools.ietf.org/html/rfc7959#section-2.5
+// Block 0 truncates the file, the others are written at their offset in any order
+// that does not leave a hole.
+static int handle_put_blob(const coap_endpoint_t *ep, coap_rw_buffer_t *scratch, const coap_packet_t *inpkt, coap_packet_t *outpkt, uint8_t id_hi, uint8_t id_lo)
+{
+    coap_luser_entry *h = find_user_entry(ep, inpkt);
+    coap_block_t block = {0, 0, COAP_BLOCK_SZX_MAX};
+    int has_block, n, fd, rc;
+    uint32_t offset;
+    coap_responsecode_t code;
+    lua_State *L = lua_getstate();
+
+    if (h == NULL)
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_NOT_FOUND, COAP_CONTENTTYPE_NONE);
+
+    has_block = coap_get_block(inpkt, COAP_OPTION_BLOCK1, &block);
+    offset = block.num * COAP_BLOCK_SIZE(block.szx);
+    if (has_block && block.m && inpkt->payload.len != COAP_BLOCK_SIZE(block.szx))
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_BAD_REQUEST, COAP_CONTENTTYPE_NONE);
+
+    n = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, h->ref);
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        lua_settop(L, n);
+        return coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, COAP_RSPCODE_METHOD_NOT_ALLOWED, COAP_CONTENTTYPE_NONE);
+    }
+
+    code = block.m ? COAP_RSPCODE_CONTINUE : COAP_RSPCODE_CHANGED;
+    fd = vfs_open(lua_tostring(L, -1), offset == 0 ? "w" : "r+");
+    lua_settop(L, n);
+    if (!fd)
+        code = COAP_RSPCODE_INTERNAL_SERVER_ERROR;
+    else if (vfs_size(fd) < offset)
+        code = COAP_RSPCODE_REQUEST_ENTITY_INCOMPLETE;
+    else if (vfs_lseek(fd, offset, VFS_SEEK_SET) < 0 ||
+             vfs_write(fd, inpkt->payload.p, inpkt->payload.len) != (sint32_t)inpkt->payload.len)
+        code = COAP_RSPCODE_INTERNAL_SERVER_ERROR;
+    if (fd)
+        vfs_close(fd);
+
+    rc = coap_make_response(scratch, outpkt, NULL, 0, id_hi, id_lo, &inpkt->tok, code, COAP_CONTENTTYPE_NONE);
+    if (rc == 0 && has_block && scratch->len >= 5)
+        coap_add_block(outpkt, COAP_OPTION_BLOCK1, &block, scratch->p + 2);
+    return rc;
+}
+
+coap_luser_entry var_head = {LUA_NOREF,NULL,NULL,0,NULL,0};
 coap_luser_entry *variable_entry = &var_head;
 
-coap_luser_entry func_head = {NULL,NULL,0};
+coap_luser_entry func_head = {LUA_NOREF,NULL,NULL,0,NULL,0};
 coap_luser_entry *function_entry = &func_head;
 
+coap_luser_entry blob_head = {LUA_NOREF,NULL,NULL,0,NULL,0};
+coap_luser_entry *blob_entry = &blob_head;
+
 const coap_endpoint_t endpoints[] =
 {
     {COAP_METHOD_GET, handle_get_well_known_core, &path_well_known_core, "ct=40", NULL},
@@ -210,9 +403,56 @@ const coap_endpoint_t endpoints[] =
     {COAP_METHOD_POST, handle_post_function, &path_function, NULL, &func_head},
     {COAP_METHOD_POST, handle_post_command, &path_command, NULL, NULL},
     {COAP_METHOD_GET, handle_get_id, &path_id, "ct=0", NULL},
+    {COAP_METHOD_GET, handle_get_blob, &path_blob, "ct=42", &blob_head},
+    {COAP_METHOD_PUT, handle_put_blob, &path_blob, NULL, &blob_head},
     {(coap_method_t)0, NULL, NULL, NULL, NULL}
 };
 
+#define LUSER_BUCKETS 16
+static coap_luser_entry *luser_buckets[LUSER_BUCKETS];
+
+static uint32_t luser_key(const char *name, size_t len)
+{
+    coap_key_t h = {0};
+    coap_hash((const unsigned char *)name, len, h);
+    return h[0] | (h[1] << 8) | (h[2] << 16) | ((uint32_t)h[3] << 24);
+}
+
+static unsigned luser_bucket(const coap_luser_entry *head, uint32_t key)
+{
+    return (key ^ ((uint32_t)head >> 2)) % LUSER_BUCKETS;
+}
+
+coap_luser_entry *coap_luser_find(const coap_luser_entry *head, const char *name, size_t len)
+{
+    uint32_t key = luser_key(name, len);
+    coap_luser_entry *e;
+    for (e = luser_buckets[luser_bucket(head, key)]; e; e = e->hash_next)
+        if (e->key == key && e->list == head && strlen(e->name) == len && 0 == memcmp(e->name, name, len))
+            return e;
+    return NULL;
+}
+
+// Append e, whose name is set, to the list of head
+void coap_luser_add(coap_luser_entry *head, coap_luser_entry *e)
+{
+    coap_luser_entry **tail = &head->next;
+    unsigned b;
+    while (*tail)
+        tail = &(*tail)->next;
+    e->next = NULL;
+    *tail = e;
+
+    e->list = head;
+    e->key = luser_key(e->name, strlen(e->name));
+    b = luser_bucket(head, e->key);
+    e->hash_next = luser_buckets[b];
+    luser_buckets[b] = e;
+
+    free(well_known_core);
+    well_known_core = NULL;
+}
+
 void build_well_known_rsp(char *rsp, uint16_t rsplen)
 {
     const coap_endpoint_t *ep = endpoints;
@@ -9,6 +9,8 @@ extern "C" {
 
 typedef unsigned char coap_key_t[4];
 
+void coap_hash(const unsigned char *s, unsigned int len, coap_key_t h);
+
 /* CoAP transaction id */
 /*typedef unsigned short coap_tid_t; */
 typedef int coap_tid_t;
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include "pdu.h"
 
 coap_pdu_t * coap_new_pdu(void) {
@@ -63,3 +64,62 @@ void coap_delete_pdu(coap_pdu_t *pdu){
   free(pdu);
   pdu = NULL;
 }
+
+// buflen is the size of buf on entry and the size of the shared part on return
+int coap_build_shared(uint8_t *buf, size_t *buflen, const coap_packet_t *pkt){
+  int rc;
+  size_t len;
+
+  if(pkt->hdr.tkl != 0 || *buflen < COAP_SHARED_HEADROOM)
+    return COAP_ERR_UNSUPPORTED;
+
+  len = *buflen - COAP_SHARED_HEADROOM;
+  if(0 != (rc = coap_build(buf + COAP_SHARED_HEADROOM, &len, pkt)))
+    return rc;
+  *buflen = len;
+  return 0;
+}
+
+// Returns the start of the message for one peer and its length in msglen
+uint8_t *coap_address_shared(uint8_t *buf, size_t buflen, const coap_packet_t *pkt, const uint8_t *tok, uint8_t tkl, const uint8_t id[2], size_t *msglen){
+  uint8_t *p;
+
+  if(tkl > COAP_SHARED_HEADROOM)
+    return NULL;
+
+  // the header is 4 bytes long, the options and payload follow the token
+  p = buf + COAP_SHARED_HEADROOM - tkl;
+  p[0] = ((pkt->hdr.ver & 0x03) << 6) | ((pkt->hdr.t & 0x03) << 4) | tkl;
+  p[1] = pkt->hdr.code;
+  p[2] = id[0];
+  p[3] = id[1];
+  memcpy(p + 4, tok, tkl);
+  *msglen = buflen + tkl;
+  return p;
+}
+
+// Returns 1 and fills block if the option is present and valid, 0 otherwise
+int coap_get_block(const coap_packet_t *pkt, uint8_t num, coap_block_t *block){
+  const coap_option_t *opt;
+  uint8_t count;
+  uint32_t value = 0;
+  size_t i;
+
+  if(NULL == (opt = coap_findOptions(pkt, num, &count)) || opt->buf.len > 3)
+    return 0;
+  for(i = 0; i < opt->buf.len; i++)
+    value = (value << 8) | opt->buf.p[i];
+  if((value & 0x07) == 7)   // reserved size
+    return 0;
+
+  block->num = value >> 4;
+  block->m = (value >> 3) & 0x01;
+  block->szx = value & 0x07;
+  return 1;
+}
+
+// buf holds the encoded value, at least 3 bytes, until the packet is built
+int coap_add_block(coap_packet_t *pkt, uint8_t num, const coap_block_t *block, uint8_t *buf){
+  uint32_t value = (block->num << 4) | (block->m ? 0x08 : 0) | (block->szx & 0x07);
+  return coap_add_option(pkt, num, buf, coap_encode_var_bytes(buf, value));
+}
@@ -18,6 +18,32 @@ coap_pdu_t *coap_new_pdu(void);
 
 void coap_delete_pdu(coap_pdu_t *pdu);
 
+/*
+ * A packet sent to many peers, such as an observe notification, is built once
+ * without a token. Room for the longest token is kept in front of it, so
+ * coap_address_shared() only has to write the header and token of each copy.
+ */
+#define COAP_SHARED_HEADROOM 8
+
+int coap_build_shared(uint8_t *buf, size_t *buflen, const coap_packet_t *pkt);
+
+uint8_t *coap_address_shared(uint8_t *buf, size_t buflen, const coap_packet_t *pkt, const uint8_t *tok, uint8_t tkl, const uint8_t id[2], size_t *msglen);
+
+/** Block1/Block2 option value, http://tools.ietf.org/html/rfc7959#section-2.2 */
+typedef struct {
+  uint32_t num;   /**< block number */
+  uint8_t m;      /**< more blocks follow */
+  uint8_t szx;    /**< block size is 2**(szx+4) bytes */
+} coap_block_t;
+
+#define COAP_BLOCK_SIZE(szx) (1U << ((szx) + 4))
+#define COAP_BLOCK_SZX_MAX 6    // 1024 bytes, MAX_PAYLOAD_SIZE
+#define COAP_BLOCK_SZX_DEFAULT 5
+
+int coap_get_block(const coap_packet_t *pkt, uint8_t num, coap_block_t *block);
+
+int coap_add_block(coap_packet_t *pkt, uint8_t num, const coap_block_t *block, uint8_t *buf);
+
 #ifdef __cplusplus
 }
 #endif
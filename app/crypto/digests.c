@@ -194,6 +194,29 @@ void crypto_hmac_finalize (void *ctx, const digest_mech_info_t *mi,
 }
 
 
+void crypto_hmac_key (const digest_mech_info_t *mi,
+  const char *key, size_t key_len, void *ictx, void *octx)
+{
+  uint8_t k_opad[mi->block_size];
+
+  mi->create (ictx);
+  crypto_hmac_begin (ictx, mi, key, key_len, k_opad);
+  mi->create (octx);
+  mi->update (octx, k_opad, mi->block_size);
+}
+
+
+void crypto_hmac_keyed_finalize (void *ctx, const digest_mech_info_t *mi,
+  const void *octx, uint8_t *digest)
+{
+  mi->finalize (digest, ctx);
+
+  os_memcpy (ctx, octx, mi->ctx_size);
+  mi->update (ctx, digest, mi->digest_size);
+  mi->finalize (digest, ctx);
+}
+
+
 int crypto_hmac (const digest_mech_info_t *mi,
    const char *data, size_t data_len,
    const char *key, size_t key_len,
@@ -93,6 +93,28 @@ void crypto_hmac_begin (void *ctx, const digest_mech_info_t *mi, const char *key
  */
 void crypto_hmac_finalize (void *ctx, const digest_mech_info_t *mi, const uint8_t *k_opad, uint8_t *digest);
 
+/**
+ * Absorbs a HMAC key into an inner and an outer hash state once, for signing
+ * many messages with the same key.  A copy of @c ictx is updated with each
+ * message and finished with @c crypto_hmac_keyed_finalize(), which saves
+ * hashing the two padded key blocks for every message.
+ * @param mi      The mech to use.
+ * @param key     The key to use.
+ * @param key_len Number of bytes the @c key comprises.
+ * @param ictx    Context block of @c mi->ctx_size, set to the inner state.
+ * @param octx    Context block of @c mi->ctx_size, set to the outer state.
+ */
+void crypto_hmac_key (const digest_mech_info_t *mi, const char *key, size_t key_len, void *ictx, void *octx);
+
+/**
+ * Finalizes a HMAC signature started from a copy of the inner state.
+ * @param ctx     The copy of the inner state, updated with the message.
+ * @param mi      The mech used with @c crypto_hmac_key().
+ * @param octx    The outer state from @c crypto_hmac_key(); it is not changed.
+ * @param digest  Output buffer, must be at least @c mi->digest_size in size.
+ */
+void crypto_hmac_keyed_finalize (void *ctx, const digest_mech_info_t *mi, const void *octx, uint8_t *digest);
+
 /**
  * Generate a HMAC signature in one pass.
  * Implemented in terms of @c crypto_hmac_begin() / @c crypto_hmac_end().
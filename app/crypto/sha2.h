@@ -3,21 +3,20 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "mbedtls/sha256.h"
+#include "mbedtls/sha512.h"
 
 /**************************************************************************
  * SHA256/384/512 declarations
+ *
+ * These share the mbedTLS implementation used by the TLS stack, so that
+ * the firmware carries only one copy of each compression function.
  **************************************************************************/
 
 #define SHA256_BLOCK_LENGTH  64
 #define SHA256_DIGEST_LENGTH 32
 
-typedef struct
-{
-  uint32_t state[8];
-  uint64_t bitcount;
-  uint8_t  buffer[SHA256_BLOCK_LENGTH];
-} SHA256_CTX;
-
+typedef mbedtls_sha256_context SHA256_CTX;
 
 void SHA256_Init(SHA256_CTX *);
 void SHA256_Update(SHA256_CTX *, const uint8_t *msg, size_t len);
@@ -26,12 +25,7 @@ void SHA256_Final(uint8_t[SHA256_DIGEST_LENGTH], SHA256_CTX*);
 #define SHA384_BLOCK_LENGTH  128
 #define SHA384_DIGEST_LENGTH  48
 
-typedef struct
-{
-  uint64_t state[8];
-  uint64_t bitcount[2];
-  uint8_t  buffer[SHA384_BLOCK_LENGTH];
-} SHA384_CTX;
+typedef mbedtls_sha512_context SHA384_CTX;
 
 void SHA384_Init(SHA384_CTX*);
 void SHA384_Update(SHA384_CTX*, const uint8_t *msg, size_t len);
@@ -84,11 +84,29 @@ int dht_read(uint8_t pin, dht_type type)
     
     if (rv != DHTLIB_OK)
     {
-        dht_humidity    = DHTLIB_INVALID_VALUE;  // invalid value, or is NaN prefered?
-        dht_temperature = DHTLIB_INVALID_VALUE;  // invalid value
+        dht_decode_failed();
         return rv; // propagate error value
     }
 
+    return dht_decode(dht_bytes, type);
+}
+
+void dht_decode_failed(void)
+{
+    dht_humidity    = DHTLIB_INVALID_VALUE;  // invalid value, or is NaN prefered?
+    dht_temperature = DHTLIB_INVALID_VALUE;  // invalid value
+}
+
+// return values:
+// DHTLIB_OK
+// DHTLIB_ERROR_CHECKSUM
+int dht_decode(const uint8_t *bytes, dht_type type)
+{
+    if (bytes != dht_bytes)
+    {
+        memcpy(dht_bytes, bytes, sizeof(dht_bytes));
+    }
+
     NODE_DBG("DHT registers: %x\t%x\t%x\t%x\t%x == %x\n", dht_bytes[0], dht_bytes[1], dht_bytes[2], dht_bytes[3], dht_bytes[4], (uint8_t)(dht_bytes[0] + dht_bytes[1] + dht_bytes[2] + dht_bytes[3]));
 
     // Assume it is special case of DHT11,
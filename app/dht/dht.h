@@ -58,6 +58,9 @@ typedef enum {
 // DHTLIB_ERROR_CHECKSUM
 // DHTLIB_ERROR_TIMEOUT
 int dht_read(uint8_t pin, dht_type type);
+// decodes the 5 bytes of a reading made elsewhere, such as from interrupts
+int dht_decode(const uint8_t *bytes, dht_type type);
+void dht_decode_failed(void);
 double dht_getHumidity(void);
 double dht_getTemperature(void);
 
@@ -54,6 +54,7 @@
   #include <stdint.h>
   #include <stdlib.h>
   #include <stdio.h>
+  #include <string.h>
   #include "platform.h"
   #include "user_interface.h"
   #include "task/task.h"
@@ -417,6 +418,69 @@ void IRAM_ATTR ExternalInterruptHandler(void)
 void ICACHE_RAM_ATTR ExternalInterruptHandler(void)
 #elif defined(NODEMCUDCC)
 task_handle_t   DataReady_taskid;
+
+// Packets are filtered in the ISR, so that only those of interest cost a task
+// post: an optional list of decoder addresses, and a window within which a
+// packet the same as the last one passed on is dropped, as command stations
+// repeat every packet continuously. Service mode and reset packets, which
+// are acted upon in pairs, always go through.
+static struct {
+  uint8_t   count;
+  uint16_t  addr[DCC_FILTER_MAX];
+  uint32_t  window;
+  uint32_t  lastTime;
+  DCC_MSG   last;
+} DccFilter;
+
+static bool ICACHE_RAM_ATTR packetWanted(DCC_MSG *pMsg, uint32_t now)
+{
+  uint8_t *d = pMsg->Data;
+  uint8_t i;
+
+  if( ( d[0] == 0 && d[1] == 0 ) || DccProcState.inServiceMode )
+    return true;
+
+  if( DccFilter.count && d[0] != 0 && d[0] != 0xff ) {
+    uint16_t addr;
+    if( d[0] < 128 )                    // multi function, short address
+      addr = d[0];
+    else if( d[0] < 192 )               // accessory, board address
+      addr = ( ( ~d[1] & 0x70 ) << 2 ) | ( d[0] & 0x3f );
+    else if( d[0] < 232 )               // multi function, long address
+      addr = ( ( d[0] & 0x3f ) << 8 ) | d[1];
+    else
+      addr = 0xffff;
+    for( i = 0; i < DccFilter.count && DccFilter.addr[i] != addr; i++ )
+      ;
+    if( i == DccFilter.count )
+      return false;
+  }
+
+  if( DccFilter.window ) {
+    bool same = pMsg->Size == DccFilter.last.Size;
+    for( i = 0; same && i < pMsg->Size; i++ )
+      same = d[i] == DccFilter.last.Data[i];
+    if( same && now - DccFilter.lastTime < DccFilter.window )
+      return false;
+    DccFilter.last = *pMsg;
+    DccFilter.lastTime = now;
+  }
+  return true;
+}
+
+void dcc_filter(const uint16_t *addr, uint8_t count, uint32_t window_us)
+{
+  if( count > DCC_FILTER_MAX )
+    count = DCC_FILTER_MAX;
+  ETS_GPIO_INTR_DISABLE();
+  if( count )
+    memcpy( DccFilter.addr, addr, count * sizeof( addr[0] ) );
+  DccFilter.count = count;
+  DccFilter.window = window_us;
+  DccFilter.last.Size = 0;
+  ETS_GPIO_INTR_ENABLE();
+}
+
 static uint32_t ICACHE_RAM_ATTR InterruptHandler (uint32_t ret_gpio_status)
 #else
 void ExternalInterruptHandler(void)
@@ -758,7 +822,11 @@ void ExternalInterruptHandler(void)
       bitMax = MAX_PRAEAMBEL;
       bitMin = MIN_ONEBITFULL;
       SET_TP1;
-      if ( DccRx.chkSum == 0 ) { 
+      if ( DccRx.chkSum == 0 
+        #ifdef NODEMCUDCC
+           && packetWanted( &DccRx.PacketBuf, actMicros )
+        #endif
+         ) { 
         // Packet is valid
         #ifdef ESP32
         portENTER_CRITICAL_ISR(&mux);
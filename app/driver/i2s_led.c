@@ -0,0 +1,143 @@
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+#include "driver/i2s_led.h"
+#include "driver/i2s_register.h"
+#include "driver/slc_register.h"
+#include "cpu_esp8266_irq.h"
+
+/*
+ * 160MHz / (10 * 5) gives the 3.2MHz bit clock.  The frame is followed by a
+ * block at the idle level long enough to latch it, raising the EOF interrupt,
+ * and the output then idles in a loop of the same block.
+ */
+#define I2S_CLKM_DIV       10
+#define I2S_BCK_DIV        5
+#define I2S_RESET_BYTES    200       // 500us at 3.2MHz
+#define I2S_BLOCK_MAX      4092      // largest 4 byte multiple a descriptor holds
+
+extern void rom_i2c_writeReg_Mask(uint32_t block, uint32_t host_id, uint32_t reg_add,
+                                  uint32_t msb, uint32_t lsb, uint32_t indata);
+
+static struct {
+  struct slc_queue_item *desc;   // descriptors, followed by the encoded frame
+  size_t size;                   // bytes allocated at desc
+  size_t length;                 // bytes in the frame
+  volatile bool busy;            // a frame is being sent
+  platform_task_handle_t task;   // to tell once it is
+  platform_task_param_t param;
+} i2s;
+static uint32_t i2s_idle[I2S_RESET_BYTES / 4];
+static struct slc_queue_item i2s_reset_desc, i2s_idle_desc;
+
+static void ICACHE_RAM_ATTR i2s_slc_isr(void *arg) {
+  uint32_t status = READ_PERI_REG(SLC_INT_STATUS);
+  WRITE_PERI_REG(SLC_INT_CLR, 0xffffffff);
+  if ((status & SLC_RX_EOF_INT_ST) && i2s.busy) {
+    i2s.busy = false;
+    if (i2s.task)
+      platform_post_low(i2s.task, i2s.param);
+  }
+}
+
+static void i2s_link_start(struct slc_queue_item *desc) {
+  SET_PERI_REG_MASK(SLC_RX_LINK, SLC_RXLINK_STOP);
+  CLEAR_PERI_REG_MASK(SLC_RX_LINK, SLC_RXLINK_DESCADDR_MASK);
+  SET_PERI_REG_MASK(SLC_RX_LINK, ((uint32_t)desc) & SLC_RXLINK_DESCADDR_MASK);
+  SET_PERI_REG_MASK(SLC_RX_LINK, SLC_RXLINK_START);
+}
+
+void i2s_led_init(void) {
+  while (i2s.busy) {}
+  memset(i2s_idle, 0, sizeof(i2s_idle));
+  i2s_reset_desc = (struct slc_queue_item){
+    .blocksize = I2S_RESET_BYTES, .datalen = I2S_RESET_BYTES, .eof = 1, .owner = 1,
+    .buf_ptr = (uint8_t *)i2s_idle, .next_link_ptr = &i2s_idle_desc };
+  i2s_idle_desc = (struct slc_queue_item){
+    .blocksize = I2S_RESET_BYTES, .datalen = I2S_RESET_BYTES, .owner = 1,
+    .buf_ptr = (uint8_t *)i2s_idle, .next_link_ptr = &i2s_idle_desc };
+
+  // Reset the DMA engine and feed the I2S FIFO from the SLC RX link
+  SET_PERI_REG_MASK(SLC_CONF0, SLC_RXLINK_RST | SLC_TXLINK_RST);
+  CLEAR_PERI_REG_MASK(SLC_CONF0, SLC_RXLINK_RST | SLC_TXLINK_RST);
+  WRITE_PERI_REG(SLC_INT_CLR, 0xffffffff);
+  CLEAR_PERI_REG_MASK(SLC_CONF0, SLC_MODE << SLC_MODE_S);
+  SET_PERI_REG_MASK(SLC_CONF0, 1 << SLC_MODE_S);
+  SET_PERI_REG_MASK(SLC_RX_DSCR_CONF, SLC_INFOR_NO_REPLACE | SLC_TOKEN_NO_REPLACE);
+  CLEAR_PERI_REG_MASK(SLC_RX_DSCR_CONF, SLC_RX_FILL_EN | SLC_RX_EOF_MODE | SLC_RX_FILL_MODE);
+  CLEAR_PERI_REG_MASK(SLC_TX_LINK, SLC_TXLINK_DESCADDR_MASK);
+  SET_PERI_REG_MASK(SLC_TX_LINK, ((uint32_t)&i2s_idle_desc) & SLC_TXLINK_DESCADDR_MASK);
+
+  ETS_SLC_INTR_ATTACH(i2s_slc_isr, NULL);
+  WRITE_PERI_REG(SLC_INT_ENA, SLC_RX_EOF_INT_ENA);
+  ETS_SLC_INTR_ENABLE();
+
+  // Route I2S data out to GPIO3 and enable the I2S clock
+  PIN_FUNC_SELECT(PERIPHS_IO_MUX_U0RXD_U, FUNC_I2SO_DATA);
+  rom_i2c_writeReg_Mask(i2c_bbpll, i2c_bbpll_hostid, i2c_bbpll_en_audio_clock_out,
+                        i2c_bbpll_en_audio_clock_out_msb, i2c_bbpll_en_audio_clock_out_lsb, 1);
+
+  WRITE_PERI_REG(I2SINT_CLR, I2S_I2S_INT_MASK);
+  WRITE_PERI_REG(I2SINT_ENA, 0);
+  CLEAR_PERI_REG_MASK(I2SCONF, I2S_I2S_RESET_MASK);
+  SET_PERI_REG_MASK(I2SCONF, I2S_I2S_RESET_MASK);
+  CLEAR_PERI_REG_MASK(I2SCONF, I2S_I2S_RESET_MASK);
+
+  // DMA mode, 16 bit dual channel, MSB first
+  CLEAR_PERI_REG_MASK(I2S_FIFO_CONF, I2S_I2S_DSCR_EN |
+      (I2S_I2S_TX_FIFO_MOD << I2S_I2S_TX_FIFO_MOD_S) | (I2S_I2S_RX_FIFO_MOD << I2S_I2S_RX_FIFO_MOD_S));
+  SET_PERI_REG_MASK(I2S_FIFO_CONF, I2S_I2S_DSCR_EN);
+  CLEAR_PERI_REG_MASK(I2SCONF_CHAN, (I2S_TX_CHAN_MOD << I2S_TX_CHAN_MOD_S) | (I2S_RX_CHAN_MOD << I2S_RX_CHAN_MOD_S));
+  CLEAR_PERI_REG_MASK(I2SCONF, I2S_TRANS_SLAVE_MOD | I2S_RECE_SLAVE_MOD |
+      (I2S_BITS_MOD << I2S_BITS_MOD_S) | (I2S_BCK_DIV_NUM << I2S_BCK_DIV_NUM_S) |
+      (I2S_CLKM_DIV_NUM << I2S_CLKM_DIV_NUM_S));
+  SET_PERI_REG_MASK(I2SCONF, I2S_RIGHT_FIRST | I2S_MSB_RIGHT | I2S_RECE_MSB_SHIFT | I2S_TRANS_MSB_SHIFT |
+      (I2S_BCK_DIV << I2S_BCK_DIV_NUM_S) | (I2S_CLKM_DIV << I2S_CLKM_DIV_NUM_S));
+
+  // Idle until the first frame
+  i2s_link_start(&i2s_idle_desc);
+  SET_PERI_REG_MASK(I2SCONF, I2S_I2S_TX_START);
+}
+
+uint32_t *i2s_led_frame(size_t length) {
+  size_t ndesc = (4 * length + I2S_BLOCK_MAX - 1) / I2S_BLOCK_MAX;
+  size_t need = ndesc * sizeof(struct slc_queue_item) + 4 * length;
+
+  /* A frame takes 40us per LED, so wait for the previous one rather than fail */
+  while (i2s.busy) {}
+
+  if (need > i2s.size) {
+    free(i2s.desc);
+    i2s.size = 0;
+    i2s.desc = malloc(need);
+    if (!i2s.desc)
+      return NULL;
+    i2s.size = need;
+  }
+  i2s.length = length;
+  return (uint32_t *)(i2s.desc + ndesc);
+}
+
+void i2s_led_send(bool idle_high, platform_task_handle_t task, platform_task_param_t param) {
+  size_t ndesc = (4 * i2s.length + I2S_BLOCK_MAX - 1) / I2S_BLOCK_MAX;
+  struct slc_queue_item *desc = i2s.desc, *next = &i2s_reset_desc;
+  uint8_t *data = (uint8_t *)(desc + ndesc);
+  size_t i, left = 4 * i2s.length;
+
+  // The output is idling on this block, which may show the change early
+  memset(i2s_idle, idle_high ? 0xff : 0, sizeof(i2s_idle));
+
+  for (i = 0; i < ndesc; i++) {
+    size_t n = left < I2S_BLOCK_MAX ? left : I2S_BLOCK_MAX;
+    desc[i] = (struct slc_queue_item){
+      .blocksize = n, .datalen = n, .owner = 1,
+      .buf_ptr = data, .next_link_ptr = i + 1 < ndesc ? &desc[i + 1] : next };
+    data += n;
+    left -= n;
+  }
+
+  i2s.task = task;
+  i2s.param = param;
+  i2s.busy = true;
+  i2s_link_start(ndesc ? desc : next);
+}
@@ -10,12 +10,14 @@ static struct input_state {
   char       *data;
   int         line_pos;
   size_t      len;
+  size_t      data_size;
   const char *prompt;
   uart_cb_t   uart_cb;
   platform_task_handle_t input_sig;
   int         data_len;
   bool        run_input;
   bool        uart_echo;
+  bool        idle_flush;
   char        last_char;
   char        end_char;
   uint8       input_sig_flag;
@@ -42,7 +44,7 @@ static bool uart_getc(char *c){
     // ETS_UART_INTR_DISABLE();
     ETS_INTR_LOCK();
     *c = (char)*(pRxBuff->pReadPos);
-    if (pRxBuff->pReadPos == (pRxBuff->pRcvMsgBuff + RX_BUFF_SIZE)) {
+    if (pRxBuff->pReadPos == (pRxBuff->pRcvMsgBuff + pRxBuff->RcvBuffSize)) {
         pRxBuff->pReadPos = pRxBuff->pRcvMsgBuff ;
     } else {
         pRxBuff->pReadPos++;
@@ -87,6 +89,7 @@ void input_setup(int bufsize, const char *prompt) {
   ins.uart_echo = true;
   ins.data      = os_malloc(bufsize);
   ins.len       = bufsize;
+  ins.data_size = bufsize;
   ins.prompt    = prompt;
   ins.input_sig = platform_task_get_id(input_handler);
   // pass the task CB parameters to the uart driver
@@ -99,6 +102,44 @@ void input_setup_receive(uart_cb_t uart_on_data_cb, int data_len, char end_char,
   ins.data_len  = data_len;
   ins.end_char  = end_char;
   ins.run_input = run_input;
+  if (ins.idle_flush) {
+    ins.idle_flush = false;
+    uart_set_rx_timeout(0);
+  }
+}
+
+/*
+** In idle mode the received bytes are collected until the line has been
+** quiet for byte_times, and each burst is passed to the callback as one
+** block.  Bursts longer than the receive buffer are split.
+*/
+void input_setup_idle(uart_cb_t uart_on_data_cb, int byte_times) {
+  ins.uart_cb    = uart_on_data_cb;
+  ins.data_len   = ins.data_size;
+  ins.end_char   = 0;
+  ins.run_input  = false;
+  ins.idle_flush = true;
+  uart_set_rx_timeout(byte_times);
+}
+
+/*
+** Resize the UART0 receive ring and the burst buffer.  The line buffer used
+** for interactive input keeps its size, so this only matters for binary
+** receive modes.  Pending input is dropped.
+*/
+bool input_setup_rxbuf(size_t size) {
+  if (size > ins.data_size) {
+    char *data = os_malloc(size);
+    if (!data)
+      return false;
+    os_free(ins.data);
+    ins.data      = data;
+    ins.data_size = size;
+    ins.line_pos  = 0;
+    if (ins.idle_flush)
+      ins.data_len = size;
+  }
+  return uart_set_rx_buffer(size);
 }
 
 void input_setecho (bool flag) {
@@ -173,6 +214,20 @@ static bool input_readline(void) {
 
     if (!ins.uart_cb) {
       while (uart_getc(&ch)) {}
+    } else if (ins.idle_flush) {
+      /* take the flag first so that bytes behind it are part of this burst */
+      bool idle = uart_rx_take_idle();
+      while (uart_getc(&ch)) {
+        ins.data[ins.line_pos++] = ch;
+        if (ins.line_pos >= ins.data_size) {
+          ins.uart_cb(ins.data, ins.line_pos);
+          ins.line_pos = 0;
+        }
+      }
+      if (idle && ins.line_pos > 0) {
+        ins.uart_cb(ins.data, ins.line_pos);
+        ins.line_pos = 0;
+      }
     } else if (ins.data_len == 0) {
       while (uart_getc(&ch)) {
         ins.uart_cb(&ch, 1);
@@ -180,7 +235,7 @@ static bool input_readline(void) {
     } else {
       while (uart_getc(&ch)) {
         ins.data[ins.line_pos++] = ch;
-        if( ins.line_pos >= ins.len ||
+        if( ins.line_pos >= ins.data_size ||
            (ins.data_len >= 0 && ins.line_pos >= ins.data_len) ||
            (ins.data_len  < 0 && ch == ins.end_char )) {
           ins.uart_cb(ins.data, ins.line_pos);
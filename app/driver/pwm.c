@@ -185,6 +185,7 @@ pwm_start(void)
 	  }
 	  pwm_timer_down = 0;
 	  platform_hw_timer_set_func(TIMER_OWNER, pwm_tim1_intr_handler, 0);
+	  platform_hw_timer_set_priority(TIMER_OWNER, 150, "pwm");
 	  platform_hw_timer_arm_ticks(TIMER_OWNER, local_single[0].h_time);
 	} else {
 	  PWM_DBG("Timer left idle\n");
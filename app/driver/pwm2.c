@@ -18,6 +18,17 @@
 #define PWM2_TMR_MAGIC_80MHZ 16
 #define PWM2_TMR_MAGIC_160MHZ 32
 
+// The timer is shared with the other owners. Its edges are the most
+// sensitive to jitter, so it is called ahead of them.
+#define TIMER_OWNER ((os_param_t) &moduleData)
+#define PWM2_TIMER_PRIORITY 200
+
+// Edges this close are waited for in the interrupt rather than re-armed
+#define PWM2_EDGE_SPIN_US 4
+// The longest schedule, so that CPU tick differences fit a signed int
+#define PWM2_SCHEDULE_MAX_CPU_TICKS 0x40000000
+#define PWM2_ARM_MAX_TICKS 0x7fffff
+
 // module vars, lazy initialized, allocated only if pwm2 is being used
 
 static pwm2_module_data_t *moduleData = NULL;
@@ -97,15 +108,50 @@ static void updatePinOffCounter(pwm2_pin_interrupt_t *iPin, pwm2_pin_setup_t *sP
   iPin->offInterruptCounter = (sPin->duty + getDutyAdjustment(sPin->duty, sPin->pulseResolutions)) * sPin->resolutionInterruptCounterMultiplier;
 }
 
+static uint64_t getPinPeriodCPUTicks(const pwm2_pin_setup_t *sPin) {
+  return (uint64_t)sPin->pulseResolutions * sPin->resolutionCPUTicks;
+}
+
+// The common period of all pins, or 0 if it would have more edges than a
+// schedule holds. Every pin is counted as switching twice per own period,
+// so that no duty set later can overflow the schedule.
+static uint32_t findSchedulePeriodCPUTicks(pwm2_module_data_t *moduleData) {
+  uint64_t period = 0;
+  for (int i = 1; i < GPIO_PIN_NUM; i++) {
+    if (isPinSetup(moduleData, i)) {
+      const uint64_t pinPeriod = getPinPeriodCPUTicks(&moduleData->setupData.pin[i]);
+      if (pinPeriod == 0 || pinPeriod > PWM2_SCHEDULE_MAX_CPU_TICKS) {
+        return 0;
+      }
+      period = period == 0 ? pinPeriod : period / findGCD(period, pinPeriod) * pinPeriod;
+      if (period > PWM2_SCHEDULE_MAX_CPU_TICKS) {
+        return 0;
+      }
+    }
+  }
+  uint32_t edges = 1;
+  for (int i = 1; i < GPIO_PIN_NUM; i++) {
+    if (isPinSetup(moduleData, i)) {
+      edges += 2 * (period / getPinPeriodCPUTicks(&moduleData->setupData.pin[i]));
+      if (edges > PWM2_EDGES_MAX) {
+        return 0;
+      }
+    }
+  }
+  return period;
+}
+
 static void reCalculateCommonToAllPinsData(pwm2_module_data_t *moduleData) {
   moduleData->interruptData.enabledGpioMask = findAllEnabledGpioMask(moduleData);
   moduleData->setupData.interruptTimerCPUTicks = findCommonCPUTicksDivisor(moduleData);
+  moduleData->setupData.scheduleCPUTicks = findSchedulePeriodCPUTicks(moduleData);
   moduleData->setupData.interruptTimerTicks = cpuToTimerTicks(moduleData->setupData.interruptTimerCPUTicks);
   for (int i = 1; i < GPIO_PIN_NUM; i++) {
     if (isPinSetup(moduleData, i)) {
       updatePinResolutionToInterruptsMultiplier(&moduleData->setupData.pin[i], moduleData->setupData.interruptTimerCPUTicks);
       updatePinPulseToInterruptsCounter(&moduleData->interruptData.pin[i], &moduleData->setupData.pin[i]);
       updatePinOffCounter(&moduleData->interruptData.pin[i], &moduleData->setupData.pin[i]);
+      moduleData->interruptData.pin[i].pendingOffInterruptCounter = moduleData->interruptData.pin[i].offInterruptCounter;
     }
   }
 }
@@ -118,11 +164,79 @@ static uint16_t getPinGpioMask(uint8_t pin) {
   return 1 << GPIO_ID_PIN(pin_num[pin]);
 }
 
-static void set_duty(pwm2_module_data_t *moduleData, const uint8_t pin, const uint32_t duty) {
+// The new off counter and phase are picked up by the interrupt handler in
+// one pass, see apply_duty()
+static void stage_duty(pwm2_module_data_t *moduleData, const uint8_t pin, const uint32_t duty, const uint32_t phase) {
   pwm2_pin_setup_t *sPin = &moduleData->setupData.pin[pin];
   pwm2_pin_interrupt_t *iPin = &moduleData->interruptData.pin[pin];
+  moduleData->interruptData.pendingUpdate = false;
+  const uint32_t offInterruptCounter = iPin->offInterruptCounter;
   sPin->duty = duty;
   updatePinOffCounter(iPin, sPin);
+  iPin->pendingOffInterruptCounter = iPin->offInterruptCounter;
+  iPin->offInterruptCounter = offInterruptCounter;
+  iPin->pendingPhaseShift += ((int32_t)sPin->phase - (int32_t)phase) * (int32_t)sPin->resolutionInterruptCounterMultiplier;
+  sPin->phase = phase;
+}
+
+static void addEdge(pwm2_schedule_t *s, const uint32_t cpuTicks, const uint16_t setMask, const uint16_t clearMask) {
+  uint32_t i;
+  for (i = 0; i < s->edgeCount; i++) {
+    if (s->edge[i].cpuTicks == cpuTicks) {
+      s->edge[i].setMask |= setMask;
+      s->edge[i].clearMask |= clearMask;
+      return;
+    }
+  }
+  // keep the edges sorted by time
+  for (i = s->edgeCount++; i > 0 && s->edge[i - 1].cpuTicks > cpuTicks; i--) {
+    s->edge[i] = s->edge[i - 1];
+  }
+  s->edge[i].cpuTicks = cpuTicks;
+  s->edge[i].setMask = setMask;
+  s->edge[i].clearMask = clearMask;
+}
+
+// Lists the edges of all pins over the common period. The first one, at the
+// start of the period, sets the state of every pin, so that a new schedule
+// takes over cleanly from the old one.
+static void buildSchedule(pwm2_module_data_t *moduleData, pwm2_schedule_t *s) {
+  const uint32_t period = moduleData->setupData.scheduleCPUTicks;
+  s->periodCPUTicks = period;
+  s->edgeCount = 1;
+  s->edge[0].cpuTicks = 0;
+  s->edge[0].setMask = 0;
+  s->edge[0].clearMask = 0;
+  for (int i = 1; i < GPIO_PIN_NUM; i++) {
+    if (!isPinSetup(moduleData, i)) {
+      continue;
+    }
+    const pwm2_pin_setup_t *sPin = &moduleData->setupData.pin[i];
+    const uint16_t mask = moduleData->interruptData.pin[i].gpioMask;
+    const uint32_t pinPeriod = getPinPeriodCPUTicks(sPin);
+    const uint32_t on = sPin->duty * sPin->resolutionCPUTicks;
+    const uint32_t start = sPin->phase * sPin->resolutionCPUTicks;
+    if (sPin->duty == sPin->pulseResolutions || (sPin->duty > 0 && (start == 0 || start + on > pinPeriod))) {
+      s->edge[0].setMask |= mask;
+    } else {
+      s->edge[0].clearMask |= mask;
+    }
+    if (sPin->duty == 0 || sPin->duty == sPin->pulseResolutions) {
+      continue;
+    }
+    for (uint32_t base = 0; base < period; base += pinPeriod) {
+      if (base + start > 0) {
+        addEdge(s, base + start, mask, 0);
+      }
+      uint32_t off = base + start + on;
+      if (off >= period) {
+        off -= period;
+      }
+      if (off > 0) {
+        addEdge(s, off, 0, mask);
+      }
+    }
+  }
 }
 
 static void configureAllPinsAsGpioOutput(pwm2_module_data_t *moduleData) {
@@ -134,10 +248,16 @@ static void configureAllPinsAsGpioOutput(pwm2_module_data_t *moduleData) {
   }
 }
 
+static void applyPendingCounters(pwm2_interrupt_handler_data_t *data);
+
 static void resetPinCounters(pwm2_module_data_t *moduleData) {
+  applyPendingCounters(&moduleData->interruptData);
   for (int i = 1; i < GPIO_PIN_NUM; i++) {
     if (isPinSetup(moduleData, i)) {
-      moduleData->interruptData.pin[i].currentInterruptCounter = 0;
+      pwm2_pin_interrupt_t *iPin = &moduleData->interruptData.pin[i];
+      const uint32_t phaseCounter = moduleData->setupData.pin[i].phase * moduleData->setupData.pin[i].resolutionInterruptCounterMultiplier;
+      iPin->currentInterruptCounter = phaseCounter == 0 ? 0 : iPin->pulseInterruptCcounter - phaseCounter;
+      iPin->pendingPhaseShift = 0;
     }
   }
 }
@@ -177,11 +297,74 @@ static inline void setGpioPins(const uint16_t enabledGpioMask, const register ui
   GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, maskOff);
 }
 
+// Takes all staged duties and phases over at once
+static void ICACHE_RAM_ATTR applyPendingCounters(pwm2_interrupt_handler_data_t *data) {
+  for (int i = 1; i < GPIO_PIN_NUM; i++) {
+    pwm2_pin_interrupt_t *pin = &data->pin[i];
+    if (isPinSetup2(data, i)) {
+      pin->offInterruptCounter = pin->pendingOffInterruptCounter;
+      if (pin->pendingPhaseShift != 0) {
+        pin->currentInterruptCounter = ((int32_t)(pin->currentInterruptCounter + pin->pulseInterruptCcounter) + pin->pendingPhaseShift) % pin->pulseInterruptCcounter;
+        pin->pendingPhaseShift = 0;
+      }
+    }
+  }
+  data->pendingUpdate = false;
+}
+
 static void ICACHE_RAM_ATTR timerInterruptHandler(os_param_t arg) {
   pwm2_interrupt_handler_data_t *data = (pwm2_interrupt_handler_data_t *)arg;
+  if (data->pendingUpdate) {
+    applyPendingCounters(data);
+  }
   setGpioPins(data->enabledGpioMask, findAllPinOns(data));
 }
 
+static inline int32_t getNextEdgeAhead(const pwm2_interrupt_handler_data_t *data) {
+  const pwm2_schedule_t *s = &data->schedule[data->activeSchedule];
+  return (int32_t)(data->periodStart + s->edge[data->nextEdge].cpuTicks - CCOUNT_REG);
+}
+
+static inline void applyNextEdge(pwm2_interrupt_handler_data_t *data) {
+  const pwm2_schedule_t *s = &data->schedule[data->activeSchedule];
+  const pwm2_edge_t *edge = &s->edge[data->nextEdge];
+  GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, edge->setMask);
+  GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, edge->clearMask);
+  if (++data->nextEdge == s->edgeCount) {
+    // a new schedule starts with the next period
+    data->nextEdge = 0;
+    data->periodStart += s->periodCPUTicks;
+    if (data->pendingUpdate) {
+      data->activeSchedule ^= 1;
+      data->pendingUpdate = false;
+    }
+  }
+}
+
+// Applies every edge which is due, all pins switching at the same time in
+// one write, and arms the timer for the next one. The edges are timed from
+// CCOUNT, so the interrupt latency does not add up over the periods.
+static void ICACHE_RAM_ATTR edgeInterruptHandler(os_param_t arg) {
+  pwm2_interrupt_handler_data_t *data = (pwm2_interrupt_handler_data_t *)arg;
+  int32_t ahead = getNextEdgeAhead(data);
+  if (ahead < -(int32_t)data->schedule[data->activeSchedule].periodCPUTicks) {
+    // held off for more than a period, start a new one rather than catch up
+    data->nextEdge = 0;
+    data->periodStart = CCOUNT_REG;
+    ahead = 0;
+  }
+  // at most a period in one pass, so that edges too close together cannot hold it
+  for (int n = 0; ahead <= (int32_t)data->spinCPUTicks && n < PWM2_EDGES_MAX; n++) {
+    while (ahead > 0) {
+      ahead = getNextEdgeAhead(data);
+    }
+    applyNextEdge(data);
+    ahead = getNextEdgeAhead(data);
+  }
+  const uint32_t ticks = ahead > (int32_t)data->spinCPUTicks ? (ahead - data->spinCPUTicks / 2) / data->cpuTicksPerTimerTick : 1;
+  platform_hw_timer_arm_ticks(TIMER_OWNER, ticks > PWM2_ARM_MAX_TICKS ? PWM2_ARM_MAX_TICKS : ticks);
+}
+
 //############################
 // driver's public API
 
@@ -210,9 +393,11 @@ void pwm2_setup_pin(
   moduleData->setupData.pin[pin].divisableFrequency = divisableFreq;
   moduleData->setupData.pin[pin].frequencyDivisor = freqDivisor;
   moduleData->setupData.pin[pin].resolutionCPUTicks = enduserFreqToCPUTicks(divisableFreq, freqDivisor, resolution);
+  moduleData->setupData.pin[pin].phase = 0;
   moduleData->interruptData.pin[pin].gpioMask = getPinGpioMask(pin);
+  moduleData->interruptData.pin[pin].pendingPhaseShift = 0;
   reCalculateCommonToAllPinsData(moduleData);
-  set_duty(moduleData, pin, initDuty);
+  pwm2_set_duty(pin, initDuty);
 }
 
 void pwm2_release_pin(const uint8_t pin) {
@@ -224,7 +409,7 @@ void pwm2_stop() {
   if (!moduleData->setupData.isStarted) {
     return;
   }
-  platform_hw_timer_close_exclusive();
+  platform_hw_timer_close(TIMER_OWNER);
   GPIO_REG_WRITE(GPIO_ENABLE_W1TC_ADDRESS, moduleData->interruptData.enabledGpioMask);  // clear pins of being gpio output
   moduleData->setupData.isStarted = false;
 }
@@ -233,14 +418,26 @@ bool pwm2_start() {
   if (moduleData->setupData.isStarted) {
     return true;
   }
-  if (!platform_hw_timer_init_exclusive(FRC1_SOURCE, TRUE, timerInterruptHandler, (os_param_t)&moduleData->interruptData, (void (*)(void))NULL)) {
+  pwm2_interrupt_handler_data_t *data = &moduleData->interruptData;
+  data->isEdgeMode = moduleData->setupData.scheduleCPUTicks > 0;
+  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, !data->isEdgeMode)) {
     return false;
   }
+  platform_hw_timer_set_func(TIMER_OWNER, data->isEdgeMode ? edgeInterruptHandler : timerInterruptHandler, (os_param_t)data);
+  platform_hw_timer_set_priority(TIMER_OWNER, PWM2_TIMER_PRIORITY, "pwm2");
   configureAllPinsAsGpioOutput(moduleData);
   resetPinCounters(moduleData);
-  GPIO_REG_WRITE(GPIO_ENABLE_W1TS_ADDRESS, moduleData->interruptData.enabledGpioMask);  // set pins as gpio output
+  if (data->isEdgeMode) {
+    data->activeSchedule = 0;
+    buildSchedule(moduleData, &data->schedule[0]);
+    data->nextEdge = 0;
+    data->cpuTicksPerTimerTick = getCpuTimerTicksDivisor();
+    data->spinCPUTicks = PWM2_EDGE_SPIN_US * system_get_cpu_freq();
+    data->periodStart = CCOUNT_REG + data->spinCPUTicks;
+  }
+  GPIO_REG_WRITE(GPIO_ENABLE_W1TS_ADDRESS, data->enabledGpioMask);  // set pins as gpio output
   moduleData->setupData.isStarted = true;
-  platform_hw_timer_arm_ticks_exclusive(moduleData->setupData.interruptTimerTicks);
+  platform_hw_timer_arm_ticks(TIMER_OWNER, data->isEdgeMode ? 1 : moduleData->setupData.interruptTimerTicks);
   return true;
 }
 
@@ -249,5 +446,25 @@ bool pwm2_is_started() {
 }
 
 void pwm2_set_duty(const uint8_t pin, const uint32_t duty) {
-  set_duty(moduleData, pin, duty);
+  pwm2_stage_duty(pin, duty, moduleData->setupData.pin[pin].phase);
+  pwm2_apply_duty();
+}
+
+void pwm2_stage_duty(const uint8_t pin, const uint32_t duty, const uint32_t phase) {
+  stage_duty(moduleData, pin, duty, phase);
+}
+
+// Hands the staged duties to the interrupt handler, which switches to all of
+// them in the same pass. In edge mode that is at the start of the next period.
+void pwm2_apply_duty() {
+  pwm2_interrupt_handler_data_t *data = &moduleData->interruptData;
+  if (!moduleData->setupData.isStarted) {
+    applyPendingCounters(data);
+    return;
+  }
+  if (data->isEdgeMode) {
+    data->pendingUpdate = false;
+    buildSchedule(moduleData, &data->schedule[data->activeSchedule ^ 1]);
+  }
+  data->pendingUpdate = true;
 }
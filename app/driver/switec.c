@@ -46,6 +46,17 @@
 // 5      1 0 0 0  - .  0x8
 static const uint8_t stateMap[N_STATES] = {0x9, 0x1, 0x7, 0x6, 0xE, 0x8};
 
+#define MAXVEL 255
+
+// Channels due within this many uSec of each other are stepped in the same
+// timer interrupt, with one write to the GPIO outputs
+#define COALESCE_US 40
+
+typedef struct {
+  int16_t  pos;
+  uint16_t seq;
+} MOVE;
+
 typedef struct {
   uint8_t  current_state;
   uint8_t  stopped;
@@ -57,15 +68,19 @@ typedef struct {
   int16_t  current_step;
   uint16_t vel;
   uint16_t max_vel;
-  uint16_t min_delay;
+  uint16_t seq;           // of the move to target_step
+  volatile uint16_t done_seq;  // of the last move completed
+  uint16_t next_seq;
+  uint8_t  qhead;
+  uint8_t  qcount;
+  MOVE     queue[SWITEC_QUEUE_LEN];
   task_handle_t task_number;
+  uint16_t delay[MAXVEL + 1];  // uSec between steps at each velocity
 } DATA;
 
 static DATA *data[SWITEC_CHANNEL_COUNT];
 static volatile char timer_active;
 
-#define MAXVEL 255
-
 // Note that this has to be global so that the compiler does not
 // put it into ROM.
 uint8_t switec_accel_table[][2] = {
@@ -119,25 +134,24 @@ int switec_close(uint32_t channel)
   return 0;
 }
 
-static __attribute__((always_inline)) inline void write_io(DATA *d)
-{
-  uint32_t pin_state = d->pinstate[d->current_state];
-
-  gpio_output_set(pin_state, d->mask & ~pin_state, 0, 0);
-}
-
 static __attribute__((always_inline)) inline  void step_up(DATA *d)
 {
   d->current_step++;
-  d->current_state = (d->current_state + 1) % N_STATES;
-  write_io(d);
+  d->current_state = d->current_state == N_STATES - 1 ? 0 : d->current_state + 1;
 }
 
 static __attribute__((always_inline)) inline  void step_down(DATA *d)
 {
   d->current_step--;
-  d->current_state = (d->current_state + N_STATES - 1) % N_STATES;
-  write_io(d);
+  d->current_state = d->current_state == 0 ? N_STATES - 1 : d->current_state - 1;
+}
+
+static __attribute__((always_inline)) inline void set_target(DATA *d, int pos, uint16_t seq)
+{
+  // This ensures that we don't slam into the endstop
+  d->max_vel = pos < 0 ? 50 : MAXVEL;
+  d->target_step = pos;
+  d->seq = seq;
 }
 
 static void ICACHE_RAM_ATTR timer_interrupt(os_param_t p)
@@ -148,32 +162,46 @@ static void ICACHE_RAM_ATTR timer_interrupt(os_param_t p)
   (void) p;
 
   int i;
-  uint32_t delay = 0xffffffff;
+  int32_t delay = 1000000;
+  uint32_t now = system_get_time();
+  uint32_t set = 0, clear = 0;
 
-  // Loop over the channels to figure out which one needs action
+  // Loop over the channels to step all those that need action now
   for (i = 0; i < sizeof(data) / sizeof(data[0]); i++) {
     DATA *d = data[i];
     if (!d || d->stopped) {
       continue;
     }
 
-    uint32_t now = system_get_time();
-    if (now < d->next_time) {
-      int need_to_wait = d->next_time - now;
+    int32_t need_to_wait = d->next_time - now;
+    if (need_to_wait > COALESCE_US) {
       if (need_to_wait < delay) {
-	delay = need_to_wait;
+        delay = need_to_wait;
       }
       continue;
     }
 
     // This channel is past it's action time. Need to process it
 
-    // Are we done yet?
+    // Are we done yet? Then go on with the next move queued, if any
     if (d->current_step == d->target_step && d->vel == 0) {
-      d->stopped = 1;
-      d->dir = 0;
-      task_post_low(d->task_number, 0);
-      continue;
+      do {
+        d->done_seq = d->seq;
+        if (!d->qcount) {
+          break;
+        }
+        MOVE *m = &d->queue[d->qhead];
+        set_target(d, m->pos, m->seq);
+        d->qhead = (d->qhead + 1) % SWITEC_QUEUE_LEN;
+        d->qcount--;
+      } while (d->current_step == d->target_step);
+      task_post_low(d->task_number, i);
+
+      if (d->current_step == d->target_step) {
+        d->stopped = 1;
+        d->dir = 0;
+        continue;
+      }
     }
 
     // if stopped, determine direction
@@ -189,6 +217,9 @@ static void ICACHE_RAM_ATTR timer_interrupt(os_param_t p)
     } else {
       step_down(d);
     }
+    uint32_t pin_state = d->pinstate[d->current_state];
+    set |= pin_state;
+    clear |= d->mask & ~pin_state;
 
     // determine delta, number of steps in current direction to target.
     // may be negative if we are headed away from target
@@ -211,30 +242,26 @@ static void ICACHE_RAM_ATTR timer_interrupt(os_param_t p)
     }
 
     // vel now defines delay
-    uint8_t row = 0;
-    // this is why vel must not be greater than the last vel in the table.
-    while (switec_accel_table[row][0] < d->vel) {
-      row++;
-    }
-
-    uint32_t micro_delay = switec_accel_table[row][1] << 4;
-    if (micro_delay < d->min_delay) {
-      micro_delay = d->min_delay;
-    }
+    uint32_t micro_delay = d->delay[d->vel];
 
     // Figure out when we next need to take action
     d->next_time = d->next_time + micro_delay;
-    if (d->next_time < now) {
+    need_to_wait = d->next_time - now;
+    if (need_to_wait < 0) {
       d->next_time = now + micro_delay;
+      need_to_wait = micro_delay;
     }
 
     // Figure out how long to wait
-    int need_to_wait = d->next_time - now;
     if (need_to_wait < delay) {
       delay = need_to_wait;
     }
   }
 
+  if (set | clear) {
+    gpio_output_set(set, clear, 0, 0);
+  }
+
   if (delay < 1000000) {
     if (delay < 50) {
       delay = 50;
@@ -295,9 +322,21 @@ int switec_setup(uint32_t channel, int *pin, int max_deg_per_sec, task_handle_t
   if (max_deg_per_sec == 0) {
     max_deg_per_sec = 400;
   }
-  d->min_delay = 1000000 / (3 * max_deg_per_sec);
+  uint32_t min_delay = 1000000 / (3 * max_deg_per_sec);
   d->task_number = task_number;
 
+  // Precompute the delay for each velocity, so that the interrupt has just
+  // to look it up
+  uint8_t row = 0;
+  for (i = 0; i <= MAXVEL; i++) {
+    // this is why vel must not be greater than the last vel in the table.
+    while (switec_accel_table[row][0] < i) {
+      row++;
+    }
+    uint32_t micro_delay = switec_accel_table[row][1] << 4;
+    d->delay[i] = micro_delay < min_delay ? min_delay : micro_delay;
+  }
+
 #ifdef SWITEC_DEBUG
   for (i = 0; i < 4; i++) {
     printf("pin[%d]=%d\n", i, pin[i]);
@@ -313,6 +352,7 @@ int switec_setup(uint32_t channel, int *pin, int max_deg_per_sec, task_handle_t
   gpio_output_set(0, 0, d->mask, 0);
 
   platform_hw_timer_set_func(TIMER_OWNER, timer_interrupt, 0);
+  platform_hw_timer_set_priority(TIMER_OWNER, 50, "switec");
 
   return 0;
 }
@@ -335,8 +375,23 @@ int switec_reset(uint32_t channel)
   return 0;
 }
 
-// Just takes the channel number and the position
-int switec_moveto(uint32_t channel, int pos)
+static void start(DATA *d)
+{
+  // If the pointer is not moving, setup so that we start it
+  if (d->stopped) {
+    // reset the timer to avoid possible time overflow giving spurious deltas
+    d->next_time = system_get_time() + 1000;
+    d->stopped = false;
+
+    if (!timer_active) {
+      timer_interrupt(0);
+    }
+  }
+}
+
+// Takes the channel number and the position, and replaces the current move
+// and any queued ones. The sequence number of the move is returned in seq.
+int switec_moveto(uint32_t channel, int pos, uint16_t *seq)
 {
   if (channel >= sizeof(data) / sizeof(data[0])) {
     return -1;
@@ -348,26 +403,54 @@ int switec_moveto(uint32_t channel, int pos)
     return -1;
   }
 
-  if (pos < 0) {
-    // This ensures that we don't slam into the endstop
-    d->max_vel = 50;
-  } else {
-    d->max_vel = MAXVEL;
+  *seq = ++d->next_seq;
+
+  ETS_FRC1_INTR_DISABLE();
+  d->qcount = 0;
+  set_target(d, pos, *seq);
+  ETS_FRC1_INTR_ENABLE();
+
+  start(d);
+  return 0;
+}
+
+// As moveto, but the move starts when the ones before have completed
+int switec_queue(uint32_t channel, int pos, uint16_t *seq)
+{
+  if (channel >= sizeof(data) / sizeof(data[0])) {
+    return -1;
   }
 
-  d->target_step = pos;
+  DATA *d = data[channel];
+
+  if (!d || d->qcount == SWITEC_QUEUE_LEN) {
+    return -1;
+  }
 
-  // If the pointer is not moving, setup so that we start it
   if (d->stopped) {
-    // reset the timer to avoid possible time overflow giving spurious deltas
-    d->next_time = system_get_time() + 1000;
-    d->stopped = false;
+    return switec_moveto(channel, pos, seq);
+  }
 
-    if (!timer_active) {
-      timer_interrupt(0);
-    }
+  *seq = ++d->next_seq;
+
+  ETS_FRC1_INTR_DISABLE();
+  MOVE *m = &d->queue[(d->qhead + d->qcount) % SWITEC_QUEUE_LEN];
+  m->pos = pos;
+  m->seq = *seq;
+  d->qcount++;
+  ETS_FRC1_INTR_ENABLE();
+
+  return 0;
+}
+
+// The sequence number of the last move completed
+int switec_done(uint32_t channel, uint16_t *seq)
+{
+  if (channel >= sizeof(data) / sizeof(data[0]) || !data[channel]) {
+    return -1;
   }
 
+  *seq = data[channel]->done_seq;
   return 0;
 }
 
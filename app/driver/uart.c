@@ -16,6 +16,7 @@
 #include "user_config.h"
 #include "user_interface.h"
 #include "osapi.h"
+#include "mem.h"
 
 #define UART0   0
 #define UART1   1
@@ -33,6 +34,23 @@ static platform_task_handle_t sig = 0;
 static uint8 *sig_flag;
 static uint8 isr_flag = 0;
 
+// Idle line detection on UART0, in byte times (0 = off)
+static uint8 rx_tout = 0;
+static volatile bool rx_idle = false;
+// Set once the ROM receive buffer has been replaced by a heap one
+static uint8 *rx_heap_buff = NULL;
+
+// Optional transmit rings, drained by the TX FIFO empty interrupt
+typedef struct {
+    uint8 *buf;
+    uint16 size;
+    volatile uint16 head;   // next slot to write
+    volatile uint16 tail;   // next slot to send
+    volatile bool flushing; // ring empty, waiting for the FIFO to drain
+} uart_tx_ring_t;
+static uart_tx_ring_t tx_ring[2];
+static platform_task_handle_t tx_sig = 0;
+
 // UartDev is defined and initialized in rom code.
 extern UartDevice UartDev;
 #ifdef BIT_RATE_AUTOBAUD
@@ -43,6 +61,57 @@ static void (*alt_uart0_tx)(char txchar);
 LOCAL void ICACHE_RAM_ATTR
 uart0_rx_intr_handler(void *para);
 
+#define UART_TX_FIFO_MAX      126
+#define UART_TX_REFILL_THRHD  32
+
+static inline uint32 ICACHE_RAM_ATTR
+uart_tx_fifo_count(uint8 uart_no)
+{
+    return (READ_PERI_REG(UART_STATUS(uart_no)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT;
+}
+
+/******************************************************************************
+ * FunctionName : uart_tx_refill
+ * Description  : Internal used function
+ *                Move bytes from the transmit ring into the TX FIFO while it
+ *                has room. Callers must hold off the UART interrupt.
+ * Parameters   : uart_no, use UART0 or UART1 defined ahead
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void ICACHE_RAM_ATTR
+uart_tx_refill(uint8 uart_no)
+{
+    uart_tx_ring_t *tx = &tx_ring[uart_no];
+    uint16 tail = tx->tail;
+
+    while (tail != tx->head && uart_tx_fifo_count(uart_no) < UART_TX_FIFO_MAX) {
+        WRITE_PERI_REG(UART_FIFO(uart_no), tx->buf[tail]);
+        if (++tail == tx->size)
+            tail = 0;
+    }
+    tx->tail = tail;
+}
+
+/******************************************************************************
+ * FunctionName : uart_tx_arm
+ * Description  : Internal used function
+ *                Enable the TX FIFO empty interrupt, either to refill the FIFO
+ *                from the ring or, with flushing set, to report once it is empty
+ * Parameters   : uart_no, use UART0 or UART1 defined ahead
+ *                bool flushing - the ring is already empty
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void ICACHE_RAM_ATTR
+uart_tx_arm(uint8 uart_no, bool flushing)
+{
+    uint32 thrhd = flushing ? 1 : UART_TX_REFILL_THRHD;
+    tx_ring[uart_no].flushing = flushing;
+    WRITE_PERI_REG(UART_CONF1(uart_no),
+        (READ_PERI_REG(UART_CONF1(uart_no)) & ~(UART_TXFIFO_EMPTY_THRHD << UART_TXFIFO_EMPTY_THRHD_S)) |
+        (thrhd << UART_TXFIFO_EMPTY_THRHD_S));
+    SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_TXFIFO_EMPTY_INT_ENA);
+}
+
 
 /******************************************************************************
  * FunctionName : uart_wait_tx_empty
@@ -54,11 +123,47 @@ uart0_rx_intr_handler(void *para);
 LOCAL void ICACHE_FLASH_ATTR
 uart_wait_tx_empty(uint8 uart_no)
 {
+    uart_tx_ring_t *tx = &tx_ring[uart_no];
+    while (tx->buf && tx->head != tx->tail) {
+        ETS_INTR_LOCK();
+        uart_tx_refill(uart_no);
+        ETS_INTR_UNLOCK();
+    }
     while ((READ_PERI_REG(UART_STATUS(uart_no)) & (UART_TXFIFO_CNT<<UART_TXFIFO_CNT_S)) > 0)
         ;
 }
 
 
+/******************************************************************************
+ * FunctionName : uart_rx_trigger
+ * Description  : Internal used function
+ *                Set the rx fifo trigger level and rx interrupts. With idle
+ *                detection on, the FIFO is allowed to fill further since the
+ *                timeout interrupt picks up the tail of each burst.
+ * Parameters   : uart_no, use UART0 or UART1 defined ahead
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void ICACHE_FLASH_ATTR
+uart_rx_trigger(uint8 uart_no)
+{
+    uint32 conf1 = (UartDev.rcv_buff.TrigLvl & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S;
+    uint32 ena = UART_RXFIFO_FULL_INT_ENA;
+
+    // keep the TX FIFO empty threshold used by the transmit ring
+    conf1 |= READ_PERI_REG(UART_CONF1(uart_no)) & (UART_TXFIFO_EMPTY_THRHD << UART_TXFIFO_EMPTY_THRHD_S);
+
+    if (uart_no == UART0 && rx_tout) {
+        conf1 = ((UART_RX_IDLE_TRIGLVL & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S)
+              | ((rx_tout & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S)
+              | UART_RX_TOUT_EN;
+        ena |= UART_RXFIFO_TOUT_INT_ENA;
+    }
+    WRITE_PERI_REG(UART_CONF1(uart_no), conf1);
+    CLEAR_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA);
+    SET_PERI_REG_MASK(UART_INT_ENA(uart_no), ena);
+}
+
+
 /******************************************************************************
  * FunctionName : uart_config
  * Description  : Internal used function
@@ -95,13 +200,10 @@ uart_config(uint8 uart_no)
     SET_PERI_REG_MASK(UART_CONF0(uart_no), UART_RXFIFO_RST | UART_TXFIFO_RST);
     CLEAR_PERI_REG_MASK(UART_CONF0(uart_no), UART_RXFIFO_RST | UART_TXFIFO_RST);
 
-    //set rx fifo trigger
-    WRITE_PERI_REG(UART_CONF1(uart_no), (UartDev.rcv_buff.TrigLvl & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S);
-
     //clear all interrupt
     WRITE_PERI_REG(UART_INT_CLR(uart_no), 0xffff);
-    //enable rx_interrupt
-    SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA);
+    //set rx fifo trigger and enable rx_interrupt
+    uart_rx_trigger(uart_no);
 }
 
 
@@ -154,6 +256,25 @@ uart_tx_one_char(uint8 uart, uint8 TxChar)
       return OK;
     }
 
+    uart_tx_ring_t *tx = &tx_ring[uart];
+    if (tx->buf) {
+      uint16 next = tx->head + 1 == tx->size ? 0 : tx->head + 1;
+      ETS_INTR_LOCK();
+      if (tx->head == tx->tail && uart_tx_fifo_count(uart) < UART_TX_FIFO_MAX) {
+        WRITE_PERI_REG(UART_FIFO(uart), TxChar);
+      } else {
+        // if the ring is full then drain it here, which also works with
+        // interrupts already masked
+        while (next == tx->tail)
+          uart_tx_refill(uart);
+        tx->buf[tx->head] = TxChar;
+        tx->head = next;
+      }
+      uart_tx_arm(uart, tx->head == tx->tail);
+      ETS_INTR_UNLOCK();
+      return OK;
+    }
+
     while (true)
     {
       uint32 fifo_cnt = READ_PERI_REG(UART_STATUS(uart)) & (UART_TXFIFO_CNT<<UART_TXFIFO_CNT_S);
@@ -246,12 +367,35 @@ uart0_rx_intr_handler(void *para)
     RcvMsgBuff *pRxBuff = (RcvMsgBuff *)para;
     uint8 RcvChar;
     bool got_input = false;
+    uint8 uart_no;
+
+    for (uart_no = UART0; uart_no <= UART1; uart_no++) {
+        uart_tx_ring_t *tx = &tx_ring[uart_no];
+        if (!tx->buf || !(READ_PERI_REG(UART_INT_ST(uart_no)) & UART_TXFIFO_EMPTY_INT_ST))
+            continue;
+        WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_TXFIFO_EMPTY_INT_CLR);
+        uart_tx_refill(uart_no);
+        if (tx->head != tx->tail) {
+            continue;
+        } else if (!tx->flushing) {
+            // all queued, now wait for the FIFO itself to run dry
+            uart_tx_arm(uart_no, true);
+        } else {
+            CLEAR_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_TXFIFO_EMPTY_INT_ENA);
+            tx->flushing = false;
+            if (tx_sig)
+                platform_post_low(tx_sig, uart_no);
+        }
+    }
+
+    uint32 status = READ_PERI_REG(UART_INT_ST(UART0)) &
+                    (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST);
 
-    if (UART_RXFIFO_FULL_INT_ST != (READ_PERI_REG(UART_INT_ST(UART0)) & UART_RXFIFO_FULL_INT_ST)) {
+    if (!status) {
         return;
     }
 
-    WRITE_PERI_REG(UART_INT_CLR(UART0), UART_RXFIFO_FULL_INT_CLR);
+    WRITE_PERI_REG(UART_INT_CLR(UART0), UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR);
 
     while (READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) {
         RcvChar = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
@@ -265,7 +409,7 @@ uart0_rx_intr_handler(void *para)
             pRxBuff->BuffState = WRITE_OVER;
         }
 
-        if (pRxBuff->pWritePos == (pRxBuff->pRcvMsgBuff + RX_BUFF_SIZE)) {
+        if (pRxBuff->pWritePos == (pRxBuff->pRcvMsgBuff + pRxBuff->RcvBuffSize)) {
             // overflow ...we may need more error handle here.
             pRxBuff->pWritePos = pRxBuff->pRcvMsgBuff ;
         } else {
@@ -273,7 +417,7 @@ uart0_rx_intr_handler(void *para)
         }
 
         if (pRxBuff->pWritePos == pRxBuff->pReadPos){   // overflow one byte, need push pReadPos one byte ahead
-            if (pRxBuff->pReadPos == (pRxBuff->pRcvMsgBuff + RX_BUFF_SIZE)) {
+            if (pRxBuff->pReadPos == (pRxBuff->pRcvMsgBuff + pRxBuff->RcvBuffSize)) {
                 pRxBuff->pReadPos = pRxBuff->pRcvMsgBuff ;
             } else {
                 pRxBuff->pReadPos++;
@@ -283,6 +427,12 @@ uart0_rx_intr_handler(void *para)
         got_input = true;
     }
 
+    if (status & UART_RXFIFO_TOUT_INT_ST) {
+        // the line went quiet, so the consumer can flush the burst
+        rx_idle = true;
+        got_input = true;
+    }
+
     if (got_input && sig) {
       // Only post a new handler request once the handler has fired clearing the last post
       if (isr_flag == *sig_flag) {
@@ -336,6 +486,7 @@ void ICACHE_FLASH_ATTR
 uart_init(UartBautRate uart0_br, UartBautRate uart1_br)
 {
     // rom use 74880 baut_rate, here reinitialize
+    UartDev.rcv_buff.RcvBuffSize = RX_BUFF_SIZE;
     UartDev.baut_rate = uart0_br;
     uart_config(UART0);
     UartDev.baut_rate = uart1_br;
@@ -371,6 +522,103 @@ void ICACHE_FLASH_ATTR uart_init_task(os_signal_t sig_input, uint8 *flag_input)
     sig_flag = flag_input;
 }
 
+/******************************************************************************
+ * FunctionName : uart_set_rx_buffer
+ * Description  : replace the UART0 receive ring, dropping any pending input
+ * Parameters   : uint32 size - ring size in bytes
+ * Returns      : false if the ring could not be allocated
+*******************************************************************************/
+bool ICACHE_FLASH_ATTR uart_set_rx_buffer(uint32 size) {
+    RcvMsgBuff *pRxBuff = &(UartDev.rcv_buff);
+    if (size == pRxBuff->RcvBuffSize)
+        return true;
+    // the ring indexes run from 0 to RcvBuffSize inclusive
+    uint8 *buff = (uint8 *)os_malloc(size + 1);
+    if (!buff)
+        return false;
+
+    ETS_UART_INTR_DISABLE();
+    pRxBuff->pRcvMsgBuff = buff;
+    pRxBuff->pWritePos = buff;
+    pRxBuff->pReadPos = buff;
+    pRxBuff->RcvBuffSize = size;
+    ETS_UART_INTR_ENABLE();
+
+    if (rx_heap_buff)
+        os_free(rx_heap_buff);
+    rx_heap_buff = buff;
+    return true;
+}
+
+/******************************************************************************
+ * FunctionName : uart_set_rx_timeout
+ * Description  : enable idle line detection on UART0
+ * Parameters   : uint8 byte_times - silence that ends a burst, 0 to disable
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR uart_set_rx_timeout(uint8 byte_times) {
+    ETS_UART_INTR_DISABLE();
+    rx_tout = byte_times;
+    rx_idle = false;
+    uart_rx_trigger(UART0);
+    ETS_UART_INTR_ENABLE();
+}
+
+/******************************************************************************
+ * FunctionName : uart_rx_take_idle
+ * Description  : check and clear the idle line flag set by the rx interrupt
+ * Returns      : true if the line has gone idle since the last call
+*******************************************************************************/
+bool ICACHE_FLASH_ATTR uart_rx_take_idle(void) {
+    bool idle;
+    ETS_INTR_LOCK();
+    idle = rx_idle;
+    rx_idle = false;
+    ETS_INTR_UNLOCK();
+    return idle;
+}
+
+/******************************************************************************
+ * FunctionName : uart_set_tx_buffer
+ * Description  : queue output in a ring drained by the TX FIFO empty
+ *                interrupt, so that writes do not wait for the line
+ * Parameters   : uint8 uart_no - UART0 or UART1
+ *                uint16 size - ring size in bytes, 0 to send synchronously
+ * Returns      : false if the ring could not be allocated
+*******************************************************************************/
+bool ICACHE_FLASH_ATTR uart_set_tx_buffer(uint8 uart_no, uint16 size) {
+    uart_tx_ring_t *tx = &tx_ring[uart_no];
+    uint8 *buf = NULL, *old;
+
+    if (size && !(buf = (uint8 *)os_malloc(size)))
+        return false;
+
+    uart_wait_tx_empty(uart_no);
+    ETS_UART_INTR_DISABLE();
+    CLEAR_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_TXFIFO_EMPTY_INT_ENA);
+    old = tx->buf;
+    tx->buf = buf;
+    tx->size = size;
+    tx->head = tx->tail = 0;
+    tx->flushing = false;
+    ETS_UART_INTR_ENABLE();
+
+    if (old)
+        os_free(old);
+    return true;
+}
+
+/******************************************************************************
+ * FunctionName : uart_init_tx_task
+ * Description  : set the task posted with the UART id once buffered output
+ *                has left the TX FIFO
+ * Parameters   : os_signal_t sig_input - signal to post
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR uart_init_tx_task(os_signal_t sig_input) {
+    tx_sig = sig_input;
+}
+
 void ICACHE_FLASH_ATTR uart_set_alt_output_uart0(void (*fn)(char)) {
   alt_uart0_tx = fn;
 }
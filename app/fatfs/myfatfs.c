@@ -100,6 +100,7 @@ struct myvfs_vol {
 struct myvfs_file {
   struct vfs_file vfs_file;
   FIL fp;
+  BYTE no_linkmap;        // building the cluster link map failed
 };
 
 struct myvfs_dir {
@@ -174,11 +175,60 @@ static int32_t myfatfs_umount( const struct vfs_vol *vol )
   const struct myvfs_file *myfd = (const struct myvfs_file *)descr; \
   FIL *fp = (FIL *)&(myfd->fp);
 
+// ---------------------------------------------------------------------------
+// fast seek
+//
+// Seeking backwards or far ahead follows the file's cluster chain through
+// the FAT from its start, so random access into a large file costs FAT
+// sector reads in proportion to the offset.  On the first such seek a
+// cluster link map (one pair of words per contiguous fragment) is built and
+// handed to FatFs, after which seeks and reads find clusters without
+// touching the FAT.  FatFs cannot grow a file while the map is in use, so
+// it is dropped before anything is written past the end.
+//
+#define LINKMAP_INIT 16   // words, enough for 7 fragments
+#define LINKMAP_MAX  512  // words, larger maps are not worth the heap
+
+static void myfatfs_drop_linkmap( FIL *fp )
+{
+  free( fp->cltbl );
+  fp->cltbl = NULL;
+}
+
+static void myfatfs_build_linkmap( struct myvfs_file *myfd )
+{
+  FIL *fp = &(myfd->fp);
+  DWORD len = LINKMAP_INIT, *tbl;
+  FRESULT res;
+
+  // a single cluster has no chain to walk
+  if (fp->cltbl || myfd->no_linkmap ||
+      f_size( fp ) <= (FSIZE_t)fp->obj.fs->csize * FF_MAX_SS) {
+    return;
+  }
+  do {
+    if (!(tbl = malloc( len * sizeof( DWORD ) ))) {
+      break;
+    }
+    tbl[0] = len;
+    fp->cltbl = tbl;
+    res = f_lseek( fp, CREATE_LINKMAP );
+    if (res == FR_OK) {
+      return;
+    }
+    len = tbl[0];         // the size it needs
+    myfatfs_drop_linkmap( fp );
+  } while (res == FR_NOT_ENOUGH_CORE && len <= LINKMAP_MAX);
+
+  myfd->no_linkmap = 1;
+}
+
 static int32_t myfatfs_close( const struct vfs_file *fd )
 {
   GET_FIL_FP(fd)
 
   last_result = f_close( fp );
+  myfatfs_drop_linkmap( fp );
 
   // free descriptor memory
   free( (void *)fd );
@@ -201,6 +251,9 @@ static int32_t myfatfs_write( const struct vfs_file *fd, const void *ptr, size_t
   GET_FIL_FP(fd);
   UINT act_written;
 
+  if (fp->cltbl && f_tell( fp ) + len > f_size( fp )) {
+    myfatfs_drop_linkmap( fp );
+  }
   last_result = f_write( fp, ptr, len, &act_written );
 
   return last_result == FR_OK ? act_written : VFS_RES_ERR;
@@ -226,6 +279,12 @@ static int32_t myfatfs_lseek( const struct vfs_file *fd, int32_t off, int whence
     break;
   };
 
+  if (new_pos > f_size( fp )) {
+    // the map cannot extend the file
+    myfatfs_drop_linkmap( fp );
+  } else if (new_pos < f_tell( fp ) || new_pos - f_tell( fp ) > (FSIZE_t)fp->obj.fs->csize * FF_MAX_SS) {
+    myfatfs_build_linkmap( (struct myvfs_file *)myfd );
+  }
   last_result = f_lseek( fp, new_pos );
   new_pos = f_tell( fp );
 
@@ -400,6 +459,7 @@ static vfs_file *myfatfs_open( const char *name, const char *mode )
   const BYTE flags = myfatfs_mode2flag( mode );
 
   if (fd = malloc( sizeof( struct myvfs_file ) )) {
+    fd->no_linkmap = 0;
     if (FR_OK == (last_result = f_open( &(fd->fp), name, flags ))) {
       // skip to end of file for append mode
       if (flags & FA_OPEN_ALWAYS)
@@ -55,18 +55,25 @@ static const char log_prefix[] = "HTTP client: ";
  */
 typedef void (* http_callback_t)(char * response_body, int http_status, char ** full_response_p, int body_size);
 
+/*
+ * Optional streaming callback. When given, the response body is passed to it
+ * piece by piece as it arrives, with any chunked encoding already removed,
+ * and "response_body" is left empty.
+ */
+typedef void (* http_data_callback_t)(const char * data, int len);
+
 /*
  * Call this function to skip URL parsing if the arguments are already in separate variables.
  */
-void ICACHE_FLASH_ATTR http_raw_request(const char * hostname, int port, bool secure, const char * method, const char * path, const char * headers, const char * post_data, http_callback_t callback_handle, int redirect_follow_count);
+void ICACHE_FLASH_ATTR http_raw_request(const char * hostname, int port, bool secure, const char * method, const char * path, const char * headers, const char * post_data, http_callback_t callback_handle, http_data_callback_t data_handle, int redirect_follow_count);
 
 /*
  * Request data from URL use custom method.
  * The data should be encoded as any format.
  * Try:
- * http_request("http://httpbin.org/post", "OPTIONS", "Content-type: text/plain", "Hello world", http_callback_example, 0);
+ * http_request("http://httpbin.org/post", "OPTIONS", "Content-type: text/plain", "Hello world", http_callback_example, NULL, 0);
  */
-void ICACHE_FLASH_ATTR http_request(const char * url, const char * method, const char * headers, const char * post_data, http_callback_t callback_handle, int redirect_follow_count);
+void ICACHE_FLASH_ATTR http_request(const char * url, const char * method, const char * headers, const char * post_data, http_callback_t callback_handle, http_data_callback_t data_handle, int redirect_follow_count);
 
 /*
  * Post data to a web form.
@@ -96,6 +103,31 @@ void ICACHE_FLASH_ATTR http_delete(const char * url, const char * headers, const
  */
 void ICACHE_FLASH_ATTR http_put(const char * url, const char * headers, const char * post_data, http_callback_t callback_handle);
 
+/*
+ * A persistent connection to one server. Requests are queued and sent one at
+ * a time, reusing the socket while the server keeps it open and reconnecting
+ * when it does not. "headers" holds the response status line and headers.
+ */
+typedef struct http_conn_t http_conn_t;
+
+typedef void (* http_conn_callback_t)(void * arg, int http_status, char * headers, char * body, int body_size);
+
+/*
+ * Returns NULL if the URL is not valid. Nothing is sent until the first request.
+ */
+http_conn_t * ICACHE_FLASH_ATTR http_conn_new(const char * url);
+
+/*
+ * Queue a request. A NULL path uses the one from the URL; "body" may hold
+ * NUL characters. Returns -1 if the connection is closed or out of memory.
+ */
+int ICACHE_FLASH_ATTR http_conn_request(http_conn_t * conn, const char * method, const char * path, const char * headers, const char * body, int body_len, http_conn_callback_t callback_handle, void * arg);
+
+/*
+ * Fail the queued requests and free the connection once its socket is closed.
+ */
+void ICACHE_FLASH_ATTR http_conn_close(http_conn_t * conn);
+
 /*
  * Output on the UART.
  */
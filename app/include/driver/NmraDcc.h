@@ -441,6 +441,11 @@ void pin( uint8_t ExtIntPinNum, uint8_t EnablePullup);
     void dcc_close();
 
     void dcc_init();
+
+    // Pass on only the packets for one of count decoder addresses (all if
+    // count is 0), and drop repeats of a packet within window_us (none if 0)
+    #define DCC_FILTER_MAX 8
+    void dcc_filter(const uint16_t *addr, uint8_t count, uint32_t window_us);
 #endif //#ifndef NODEMCUDCC
 
 /************************************************************************************
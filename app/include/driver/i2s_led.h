@@ -0,0 +1,37 @@
+#ifndef __I2S_LED_H__
+#define __I2S_LED_H__
+
+/*
+ * LED strip output by I2S DMA, shared by the ws2812 and tm1829 modules.
+ * Each data bit goes out as 4 bits at 3.2MHz, so 1.25us, from a DMA buffer
+ * on GPIO3 (I2SO_DATA).  A frame is followed by 500us at the idle level to
+ * latch it, and the output then stays at that level until the next frame.
+ * The CPU only encodes the frame, and interrupts stay enabled throughout.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "platform.h"
+
+// Routes the I2S output to GPIO3 and starts it idling low
+void i2s_led_init(void);
+
+// Waits for the frame being sent, and returns room for the next one of
+// length bytes, one word each, or NULL if there is no memory
+uint32_t *i2s_led_frame(size_t length);
+
+// A byte as 8 nibbles, MSB first, with the patterns for a 0 and a 1 bit
+static inline uint32_t i2s_led_code(uint8_t value, uint8_t zero, uint8_t one) {
+  uint32_t word = 0;
+  int bit;
+  for (bit = 0; bit < 8; bit++, value <<= 1)
+    word = (word << 4) | ((value & 0x80) ? one : zero);
+  return word;
+}
+
+// Sends the frame from i2s_led_frame() and returns at once.  The output
+// idles high or low afterwards, and param is posted to task, if not 0,
+// once the frame has latched.
+void i2s_led_send(bool idle_high, platform_task_handle_t task, platform_task_param_t param);
+
+#endif
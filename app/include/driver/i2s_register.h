@@ -0,0 +1,70 @@
+/*
+ *  Copyright (c) 2010 - 2011 Espressif System
+ *
+ */
+
+#ifndef I2S_REGISTER_H_INCLUDED
+#define I2S_REGISTER_H_INCLUDED
+
+#define REG_I2S_BASE                          0x60000e00
+
+#define I2STXFIFO                             (REG_I2S_BASE + 0x0000)
+#define I2SRXFIFO                             (REG_I2S_BASE + 0x0004)
+
+#define I2SCONF                               (REG_I2S_BASE + 0x0008)
+#define I2S_BCK_DIV_NUM 0x0000003F
+#define I2S_BCK_DIV_NUM_S 22
+#define I2S_CLKM_DIV_NUM 0x0000003F
+#define I2S_CLKM_DIV_NUM_S 16
+#define I2S_BITS_MOD 0x0000000F
+#define I2S_BITS_MOD_S 12
+#define I2S_RECE_MSB_SHIFT (BIT(11))
+#define I2S_TRANS_MSB_SHIFT (BIT(10))
+#define I2S_I2S_RX_START (BIT(9))
+#define I2S_I2S_TX_START (BIT(8))
+#define I2S_MSB_RIGHT (BIT(7))
+#define I2S_RIGHT_FIRST (BIT(6))
+#define I2S_RECE_SLAVE_MOD (BIT(5))
+#define I2S_TRANS_SLAVE_MOD (BIT(4))
+#define I2S_I2S_RX_FIFO_RESET (BIT(3))
+#define I2S_I2S_TX_FIFO_RESET (BIT(2))
+#define I2S_I2S_RX_RESET (BIT(1))
+#define I2S_I2S_TX_RESET (BIT(0))
+#define I2S_I2S_RESET_MASK 0x0000000F
+
+#define I2SINT_RAW                            (REG_I2S_BASE + 0x000c)
+#define I2SINT_ST                             (REG_I2S_BASE + 0x0010)
+#define I2SINT_ENA                            (REG_I2S_BASE + 0x0014)
+#define I2SINT_CLR                            (REG_I2S_BASE + 0x0018)
+#define I2S_I2S_INT_MASK 0x0000003F
+
+#define I2STIMING                             (REG_I2S_BASE + 0x001c)
+
+#define I2S_FIFO_CONF                         (REG_I2S_BASE + 0x0020)
+#define I2S_I2S_RX_FIFO_MOD 0x00000007
+#define I2S_I2S_RX_FIFO_MOD_S 16
+#define I2S_I2S_TX_FIFO_MOD 0x00000007
+#define I2S_I2S_TX_FIFO_MOD_S 13
+#define I2S_I2S_DSCR_EN (BIT(12))
+#define I2S_I2S_TX_DATA_NUM 0x0000003F
+#define I2S_I2S_TX_DATA_NUM_S 6
+#define I2S_I2S_RX_DATA_NUM 0x0000003F
+#define I2S_I2S_RX_DATA_NUM_S 0
+
+#define I2SRXEOF_NUM                          (REG_I2S_BASE + 0x0024)
+#define I2SCONF_SIGLE_DATA                    (REG_I2S_BASE + 0x0028)
+
+#define I2SCONF_CHAN                          (REG_I2S_BASE + 0x002c)
+#define I2S_RX_CHAN_MOD 0x00000003
+#define I2S_RX_CHAN_MOD_S 3
+#define I2S_TX_CHAN_MOD 0x00000007
+#define I2S_TX_CHAN_MOD_S 0
+
+/* The I2S module clock is gated by the audio clock output of the BBPLL */
+#define i2c_bbpll                                 0x67
+#define i2c_bbpll_hostid                          4
+#define i2c_bbpll_en_audio_clock_out              4
+#define i2c_bbpll_en_audio_clock_out_msb          7
+#define i2c_bbpll_en_audio_clock_out_lsb          7
+
+#endif // I2S_REGISTER_H_INCLUDED
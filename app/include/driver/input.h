@@ -4,6 +4,8 @@ typedef void (*uart_cb_t)(const char *buf, size_t len);
 
 extern void input_setup(int bufsize, const char *prompt);
 extern void input_setup_receive(uart_cb_t uart_on_data_cb, int data_len, char end_char, bool run_input);
+extern void input_setup_idle(uart_cb_t uart_on_data_cb, int byte_times);
+extern bool input_setup_rxbuf(size_t size);
 extern void input_setecho (bool flag);
 extern void input_setprompt (const char *prompt);
 
@@ -11,16 +11,43 @@
 #include <stdint.h>
 #include "pin_map.h"
 
+// Enough for every pin to switch on and off once in a common period
+#define PWM2_EDGES_MAX 32
+
 typedef struct {
   uint32_t offInterruptCounter;
   uint32_t pulseInterruptCcounter;
   uint32_t currentInterruptCounter;
+  uint32_t pendingOffInterruptCounter;
+  int32_t pendingPhaseShift;
   uint16_t gpioMask;
 } pwm2_pin_interrupt_t;
 
+// The pins switching at the same time in the period, as CPU ticks from its start
+typedef struct {
+  uint32_t cpuTicks;
+  uint16_t setMask;
+  uint16_t clearMask;
+} pwm2_edge_t;
+
+typedef struct {
+  uint32_t periodCPUTicks;
+  uint32_t edgeCount;
+  pwm2_edge_t edge[PWM2_EDGES_MAX];
+} pwm2_schedule_t;
+
 typedef struct {
   pwm2_pin_interrupt_t pin[GPIO_PIN_NUM];
   uint16_t enabledGpioMask;
+  volatile bool pendingUpdate;
+  // edge mode, used when the periods of all pins fit one schedule
+  bool isEdgeMode;
+  volatile uint8_t activeSchedule;
+  uint32_t nextEdge;
+  uint32_t periodStart;
+  uint32_t spinCPUTicks;
+  uint32_t cpuTicksPerTimerTick;
+  pwm2_schedule_t schedule[2];
 } pwm2_interrupt_handler_data_t;
 
 typedef struct {
@@ -28,6 +55,7 @@ typedef struct {
   uint32_t divisableFrequency;
   uint32_t frequencyDivisor;
   uint32_t duty;
+  uint32_t phase;
   uint32_t resolutionCPUTicks;
   uint32_t resolutionInterruptCounterMultiplier;
 } pwm2_pin_setup_t;
@@ -36,6 +64,7 @@ typedef struct {
   pwm2_pin_setup_t pin[GPIO_PIN_NUM];
   uint32_t interruptTimerCPUTicks;
   uint32_t interruptTimerTicks;
+  uint32_t scheduleCPUTicks;
   bool isStarted;
 } pwm2_setup_data_t;
 
@@ -61,5 +90,7 @@ void pwm2_stop();
 bool pwm2_start();
 bool pwm2_is_started();
 void pwm2_set_duty(const uint8_t pin, const uint32_t duty);
+void pwm2_stage_duty(const uint8_t pin, const uint32_t duty, const uint32_t phase);
+void pwm2_apply_duty();
 
 #endif
@@ -0,0 +1,76 @@
+/*
+ *  Copyright (c) 2010 - 2011 Espressif System
+ *
+ */
+
+#ifndef SLC_REGISTER_H_INCLUDED
+#define SLC_REGISTER_H_INCLUDED
+
+#define REG_SLC_BASE                          0x60000B00
+
+#define SLC_CONF0                             (REG_SLC_BASE + 0x0)
+#define SLC_MODE 0x00000003
+#define SLC_MODE_S 12
+#define SLC_DATA_BURST_EN (BIT(9))
+#define SLC_DSCR_BURST_EN (BIT(8))
+#define SLC_RX_NO_RESTART_CLR (BIT(7))
+#define SLC_RX_AUTO_WRBACK (BIT(6))
+#define SLC_RX_LOOP_TEST (BIT(5))
+#define SLC_TX_LOOP_TEST (BIT(4))
+#define SLC_AHBM_RST (BIT(3))
+#define SLC_AHBM_FIFO_RST (BIT(2))
+#define SLC_RXLINK_RST (BIT(1))
+#define SLC_TXLINK_RST (BIT(0))
+
+#define SLC_INT_RAW                           (REG_SLC_BASE + 0x4)
+#define SLC_INT_STATUS                        (REG_SLC_BASE + 0x8)
+#define SLC_INT_ENA                           (REG_SLC_BASE + 0xC)
+#define SLC_INT_CLR                           (REG_SLC_BASE + 0x10)
+#define SLC_RX_EOF_INT_ST (BIT(17))
+#define SLC_TX_EOF_INT_ST (BIT(16))
+#define SLC_RX_EOF_INT_ENA (BIT(17))
+#define SLC_TX_EOF_INT_ENA (BIT(16))
+
+#define SLC_RX_STATUS                         (REG_SLC_BASE + 0x14)
+#define SLC_TX_STATUS                         (REG_SLC_BASE + 0x1C)
+
+#define SLC_RX_LINK                           (REG_SLC_BASE + 0x24)
+#define SLC_RXLINK_PARK (BIT(31))
+#define SLC_RXLINK_RESTART (BIT(30))
+#define SLC_RXLINK_START (BIT(29))
+#define SLC_RXLINK_STOP (BIT(28))
+#define SLC_RXLINK_DESCADDR_MASK 0x000FFFFF
+#define SLC_RXLINK_ADDR_S 0
+
+#define SLC_TX_LINK                           (REG_SLC_BASE + 0x28)
+#define SLC_TXLINK_PARK (BIT(31))
+#define SLC_TXLINK_RESTART (BIT(30))
+#define SLC_TXLINK_START (BIT(29))
+#define SLC_TXLINK_STOP (BIT(28))
+#define SLC_TXLINK_DESCADDR_MASK 0x000FFFFF
+#define SLC_TXLINK_ADDR_S 0
+
+#define SLC_RX_EOF_DES_ADDR                   (REG_SLC_BASE + 0x48)
+#define SLC_TX_EOF_DES_ADDR                   (REG_SLC_BASE + 0x4C)
+
+#define SLC_RX_DSCR_CONF                      (REG_SLC_BASE + 0x90)
+#define SLC_RX_FILL_EN (BIT(20))
+#define SLC_RX_EOF_MODE (BIT(17))
+#define SLC_RX_FILL_MODE (BIT(16))
+#define SLC_INFOR_NO_REPLACE (BIT(9))
+#define SLC_TOKEN_NO_REPLACE (BIT(8))
+#define SLC_POP_IDLE_CNT 0x000000FF
+
+/* DMA descriptor, chained through next_link_ptr */
+struct slc_queue_item {
+  uint32_t blocksize : 12;
+  uint32_t datalen   : 12;
+  uint32_t unused    :  5;
+  uint32_t sub_sof   :  1;
+  uint32_t eof       :  1;
+  uint32_t owner     :  1;
+  uint8_t *buf_ptr;
+  struct slc_queue_item *next_link_ptr;
+};
+
+#endif // SLC_REGISTER_H_INCLUDED
@@ -7,12 +7,17 @@
 #include <stdint.h>
 
 #define SWITEC_CHANNEL_COUNT	3
+#define SWITEC_QUEUE_LEN	8
 
 int switec_setup(uint32_t channel, int *pin, int max_deg_per_sec, task_handle_t taskNumber );
 
 int switec_close(uint32_t channel);
 
-int switec_moveto(uint32_t channel, int pos);
+int switec_moveto(uint32_t channel, int pos, uint16_t *seq);
+
+int switec_queue(uint32_t channel, int pos, uint16_t *seq);
+
+int switec_done(uint32_t channel, uint16_t *seq);
 
 int switec_reset(uint32_t channel);
 
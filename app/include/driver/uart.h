@@ -8,6 +8,8 @@
 
 #define RX_BUFF_SIZE    0x100
 #define TX_BUFF_SIZE    100
+// RX FIFO trigger level while idle line detection is on
+#define UART_RX_IDLE_TRIGLVL  64
 
 typedef enum {
     FIVE_BITS = 0x0,
@@ -121,5 +123,10 @@ void uart0_tx_buffer(uint8 *buf, uint16 len);
 void uart_setup(uint8 uart_no);
 STATUS uart_tx_one_char(uint8 uart, uint8 TxChar);
 void uart_set_alt_output_uart0(void (*fn)(char));
+bool uart_set_rx_buffer(uint32 size);
+void uart_set_rx_timeout(uint8 byte_times);
+bool uart_rx_take_idle(void);
+bool uart_set_tx_buffer(uint8 uart_no, uint16 size);
+void uart_init_tx_task(os_signal_t sig_input);
 #endif
 
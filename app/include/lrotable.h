@@ -0,0 +1,94 @@
+#ifndef __LROTABLE_H__
+#define __LROTABLE_H__
+/*
+ * ROTable key search, shared by the Lua 5.1 and 5.3 VMs (rotable_findentry()
+ * in app/lua/ltable.c and app/lua53/ltable.c), so that a change to how
+ * ROTables are searched lands for both at once.
+ *
+ * A ROTable is a vector of { const char *key; TValue value; } entries.  The
+ * size of a TValue differs between the VMs, so the entries are walked with a
+ * stride.  Each VM keeps a key cache of lines of slots, selected by a hash of
+ * the table and key addresses; a slot holds the low 24 bits of the table
+ * address and the entry index above them.
+ *
+ * Keys are compared 4 bytes at a time before any strcmp(), which relies on
+ * the key strings being readable as words (true of TStrings and of ROTable
+ * keys in ROM) and on a little-endian host.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LROT_NDX_SHFT  24
+#define LROT_ADDR_MASK (((size_t) 1<<LROT_NDX_SHFT)-1)
+
+#define lrot_key(e, stride, i) \
+  (*(const char * const *)((const char *)(e) + (size_t)(i) * (stride)))
+
+/* Return the index of key in table t from cache line cl, or -1 on a miss */
+static inline int lrot_cache_probe (const size_t *cl, int slots, const void *t,
+                                    const void *e, size_t stride, int n,
+                                    const char *key) {
+  int i;
+  for (i = 0; i < slots; i++) {
+    int ndx = cl[i] >> LROT_NDX_SHFT;
+    if ((((size_t)t - cl[i]) & LROT_ADDR_MASK) == 0 && ndx < n &&
+        strcmp(lrot_key(e, stride, ndx), key) == 0)
+      return ndx;
+  }
+  return -1;
+}
+
+/* Record a hit of entry ndx of table t at the front of cache line cl */
+static inline void lrot_cache_update (size_t *cl, int slots, const void *t,
+                                      int ndx) {
+  int j;
+  for (j = slots-1; j > 0; j--)
+    cl[j] = cl[j-1];
+  cl[0] = ((size_t)t & LROT_ADDR_MASK) + ((size_t)ndx << LROT_NDX_SHFT);
+}
+
+/*
+ * Return the index of key, of length len, among the n entries at e, or -1.
+ * Tables with sorted set, as generated for an LFS index, are binary searched.
+ * Otherwise keys can be unsorted for legacy compatibility, but metavalues
+ * (keys starting with "__"), which most misses are for, must all be at the
+ * front, so that a metavalue search stops at the first ordinary key.
+ */
+static inline int lrot_search (const void *e, size_t stride, int n,
+                               const char *key, size_t len, int sorted) {
+  uint32_t name4 = *(const uint32_t *)key;
+  uint32_t mask4 = len > 2 ? (~0u) : (~0u)>>((3-len)*8);
+  int i;
+#define lrot_eq4(s)   (((*(const uint32_t *)(s) ^ name4) & mask4) == 0)
+#define lrot_ismeta(s) ((*(const uint32_t *)(s) & 0xffff) == *(const uint32_t *)"__\0")
+
+  if (sorted) {
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+      int c;
+      i = (lo + hi) >> 1;
+      c = strcmp(lrot_key(e, stride, i), key);
+      if (c == 0)
+        return i;
+      if (c < 0) lo = i + 1; else hi = i - 1;
+    }
+  } else if (lrot_ismeta(&name4)) {
+    for (i = 0; i < n && lrot_ismeta(lrot_key(e, stride, i)); i++) {
+      const char *k = lrot_key(e, stride, i);
+      if (lrot_eq4(k) && !strcmp(k, key))
+        return i;
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      const char *k = lrot_key(e, stride, i);
+      if (lrot_eq4(k) && !strcmp(k, key))
+        return i;
+    }
+  }
+  return -1;
+#undef lrot_eq4
+#undef lrot_ismeta
+}
+
+#endif /* __LROTABLE_H__ */
@@ -65,6 +65,9 @@ struct ping_msg{
 	uint32 max_count;
 	uint32 sent_count;
 	uint32 coarse_time;
+	u16_t id;		/* echo identifier, unique to this session */
+	u16_t seqno;		/* of the last echo request sent */
+	u16_t replied;		/* seqno of the last reply reported */
 };
 
 struct ping_resp{
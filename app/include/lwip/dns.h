@@ -110,6 +110,23 @@ ip_addr_t      dns_getserver(u8_t numdns);
 err_t          dns_gethostbyname(const char *hostname, ip_addr_t *addr,
                                  dns_found_callback found, void *callback_arg);
 
+#if DNS_CACHE_SIZE
+/** Counters of the cache of resolved names, returned by dns_cache_getstats() */
+struct dns_cache_stats {
+  u32_t hits;       /* names answered with an address from the cache */
+  u32_t misses;     /* names that were not cached and were queried */
+  u32_t negative;   /* names answered as not existing from the cache */
+  u32_t prefetches; /* cached names queried again before they expired */
+  u16_t prefetch;   /* seconds before expiry of those queries, 0 if off */
+  u8_t  size;       /* number of entries */
+  u8_t  used;       /* number of entries holding a name */
+};
+
+void           dns_cache_getstats(struct dns_cache_stats *stats);
+void           dns_cache_flush(void);
+void           dns_cache_setprefetch(u16_t secs);
+#endif /* DNS_CACHE_SIZE */
+
 #if DNS_LOCAL_HOSTLIST && DNS_LOCAL_HOSTLIST_IS_DYNAMIC
 int            dns_local_removehost(const char *hostname, const ip_addr_t *addr);
 err_t          dns_local_addhost(const char *hostname, const ip_addr_t *addr);
@@ -209,6 +209,7 @@ struct tcp_pcb {
 
   s16_t rto;    /* retransmission time-out */
   u8_t nrtx;    /* number of retransmissions */
+  u32_t rexmits; /* retransmissions over the life of the connection */
 
   /* fast retransmit/recovery */
   u32_t lastack; /* Highest acknowledged seqno. */
@@ -38,6 +38,52 @@
 #ifndef __LWIPOPTS_H__
 #define __LWIPOPTS_H__
 
+#include "user_config.h"
+
+/*
+   -----------------------------------------------
+   ---------- TCP memory profiles ----------------
+   -----------------------------------------------
+*/
+
+/*
+ * The LWIP_PROFILE_xxx options of user_config.h set the TCP segment size,
+ * send buffer and segment queue, and the initial receive window and number
+ * of connections.  The window and connection count are kept in the SDK
+ * registers behind TCP_WND and MEMP_NUM_TCP_PCB, which are set from
+ * LWIP_TCP_WND_DEFAULT and LWIP_TCP_MAXCONN_DEFAULT in lwip_init() and can be
+ * changed by net.config() later on.  As the pools are allocated from the heap
+ * (MEMP_MEM_MALLOC), these figures rather than the MEMP_NUM_xxx pool sizes
+ * are what bound the memory that the stack uses.
+ */
+#if defined(LWIP_PROFILE_BULK)
+#define LWIP_PROFILE_NAME               "bulk"
+#define TCP_MSS                         1460
+#define TCP_SND_BUF                     (4 * TCP_MSS)
+#define MEMP_NUM_TCP_SEG                32
+#define LWIP_TCP_WND_DEFAULT            (6 * TCP_MSS)
+#define LWIP_TCP_MAXCONN_DEFAULT        4
+#elif defined(LWIP_PROFILE_MANYCONN)
+#define LWIP_PROFILE_NAME               "many-conn"
+#define TCP_MSS                         1460
+#define TCP_SND_BUF                     (2 * TCP_MSS)
+#define MEMP_NUM_TCP_SEG                24
+#define MEMP_NUM_TCP_PCB_LISTEN         4
+#define LWIP_TCP_WND_DEFAULT            (2 * TCP_MSS)
+#define LWIP_TCP_MAXCONN_DEFAULT        10
+#elif defined(LWIP_PROFILE_LOWMEM)
+#define LWIP_PROFILE_NAME               "low-mem"
+#define TCP_MSS                         536
+#define TCP_SND_BUF                     (2 * TCP_MSS)
+#define MEMP_NUM_TCP_SEG                8
+#define LWIP_TCP_WND_DEFAULT            (4 * TCP_MSS)
+#define LWIP_TCP_MAXCONN_DEFAULT        3
+#else
+#define LWIP_PROFILE_NAME               "default"
+#define LWIP_TCP_WND_DEFAULT            (4 * TCP_MSS)
+#define LWIP_TCP_MAXCONN_DEFAULT        5
+#endif
+
 
 /*
    -----------------------------------------------
@@ -827,6 +873,26 @@
 #define DNS_MSG_SIZE                    512
 #endif
 
+/** DNS_CACHE_SIZE: number of resolved names that dns_gethostbyname() answers
+ * without a query until their TTL expires, apart from the DNS_TABLE_SIZE
+ * entries of the queries. 0 disables the cache. */
+#ifndef DNS_CACHE_SIZE
+#define DNS_CACHE_SIZE                  8
+#endif
+
+/** DNS_CACHE_NEG_TTL: seconds for which a name that the server reported as not
+ * existing, or as having no address, is answered as such from the cache. */
+#ifndef DNS_CACHE_NEG_TTL
+#define DNS_CACHE_NEG_TTL               60
+#endif
+
+/** DNS_CACHE_PREFETCH: seconds before expiry at which a cached name that has
+ * been looked up is queried again, so that it does not drop out of the cache.
+ * 0 lets the names expire. It can be changed with dns_cache_setprefetch(). */
+#ifndef DNS_CACHE_PREFETCH
+#define DNS_CACHE_PREFETCH              0
+#endif
+
 /** DNS_LOCAL_HOSTLIST: Implements a local host-to-address list. If enabled,
  *  you have to define
  *    #define DNS_LOCAL_HOSTLIST_INIT {{"host1", 0x123}, {"host2", 0x234}}
@@ -1484,9 +1550,19 @@
 */
 /**
  * LWIP_STATS==1: Enable statistics collection in lwip_stats.
+ * They are read by net.stats(). Only the IP, UDP and TCP counters and the
+ * allocation counters are kept, which costs about 300 bytes of RAM.
  */
 #ifndef LWIP_STATS
-#define LWIP_STATS                      0
+#define LWIP_STATS                      1
+#endif
+
+/**
+ * LWIP_STATS_LARGE==1: Use 32-bit counters, so that they do not wrap after
+ * a few minutes of traffic.
+ */
+#ifndef LWIP_STATS_LARGE
+#define LWIP_STATS_LARGE                1
 #endif
 
 #if LWIP_STATS
@@ -1502,14 +1578,14 @@
  * LINK_STATS==1: Enable link stats.
  */
 #ifndef LINK_STATS
-#define LINK_STATS                      1
+#define LINK_STATS                      0
 #endif
 
 /**
  * ETHARP_STATS==1: Enable etharp stats.
  */
 #ifndef ETHARP_STATS
-#define ETHARP_STATS                    (LWIP_ARP)
+#define ETHARP_STATS                    0
 #endif
 
 /**
@@ -1524,21 +1600,21 @@
  * on if using either frag or reass.
  */
 #ifndef IPFRAG_STATS
-#define IPFRAG_STATS                    (IP_REASSEMBLY || IP_FRAG)
+#define IPFRAG_STATS                    0
 #endif
 
 /**
  * ICMP_STATS==1: Enable ICMP stats.
  */
 #ifndef ICMP_STATS
-#define ICMP_STATS                      1
+#define ICMP_STATS                      0
 #endif
 
 /**
  * IGMP_STATS==1: Enable IGMP stats.
  */
 #ifndef IGMP_STATS
-#define IGMP_STATS                      (LWIP_IGMP)
+#define IGMP_STATS                      0
 #endif
 
 /**
@@ -1559,16 +1635,19 @@
 
 /**
  * MEM_STATS==1: Enable mem.c stats.
+ * With MEM_LIBC_MALLOC only the failed pbuf allocations are counted, as err.
  */
 #ifndef MEM_STATS
-#define MEM_STATS                       ((MEM_LIBC_MALLOC == 0) && (MEM_USE_POOLS == 0))
+#define MEM_STATS                       1
 #endif
 
 /**
  * MEMP_STATS==1: Enable memp.c pool stats.
+ * With MEMP_MEM_MALLOC the pools are on the heap, so the counters show how
+ * many elements of each type are in use and how many allocations failed.
  */
 #ifndef MEMP_STATS
-#define MEMP_STATS                      (MEMP_MEM_MALLOC == 0)
+#define MEMP_STATS                      1
 #endif
 
 /**
@@ -1087,6 +1087,9 @@ struct mbedtls_ssl_context
     unsigned char *in_iv;       /*!< ivlen-byte IV                    */
     unsigned char *in_msg;      /*!< message contents (in_iv+ivlen)   */
     unsigned char *in_offt;     /*!< read offset in application data  */
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    size_t in_buf_len;          /*!< length of input buffer           */
+#endif
 
     int in_msgtype;             /*!< record header: message type      */
     size_t in_msglen;           /*!< record header: message length    */
@@ -1122,6 +1125,9 @@ struct mbedtls_ssl_context
     unsigned char *out_len;     /*!< two-bytes message length field   */
     unsigned char *out_iv;      /*!< ivlen-byte IV                    */
     unsigned char *out_msg;     /*!< message contents (out_iv+ivlen)  */
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    size_t out_buf_len;         /*!< length of output buffer          */
+#endif
 
     int out_msgtype;            /*!< record header: message type      */
     size_t out_msglen;          /*!< record header: message length    */
@@ -2876,6 +2882,29 @@ size_t mbedtls_ssl_get_max_frag_len( const mbedtls_ssl_context *ssl );
  */
 int mbedtls_ssl_get_max_out_record_payload( const mbedtls_ssl_context *ssl );
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+/**
+ * \brief          Shrink the record buffers of an established connection,
+ *                 e.g. to the negotiated maximum fragment length.
+ *
+ * \note           Buffers are never grown, so this is only allowed once
+ *                 the handshake is over and renegotiation is disabled.
+ *                 Outgoing records are limited to the new size; incoming
+ *                 records that do not fit are rejected.
+ *
+ * \param ssl      SSL context
+ * \param in_len   maximum content length of incoming records
+ * \param out_len  maximum content length of outgoing records
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_SSL_BAD_INPUT_DATA if
+ *                 the handshake is not over or a record is in flight.
+ *                 MBEDTLS_ERR_SSL_ALLOC_FAILED leaves the buffers as they
+ *                 were.
+ */
+int mbedtls_ssl_shrink_buffers( mbedtls_ssl_context *ssl,
+                                size_t in_len, size_t out_len );
+#endif
+
 #if defined(MBEDTLS_X509_CRT_PARSE_C)
 /**
  * \brief          Return the peer certificate from the current connection
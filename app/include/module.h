@@ -54,4 +54,22 @@
   const LOCK_IN_SECTION(rotable) \
     ROTable_entry MODULE_EXPAND_PASTE_(cfgname,MODULE_EXPAND_PASTE_(_module_selected,MODULE_PASTE_(LUA_USE_MODULES_,cfgname))) \
     = {luaname, LRO_ROVAL(map)}
+
+/* A module whose init function only needs to run once the module is in use
+ * (for example to register the metatables of its object types) can instead
+ * be declared with:
+ *
+ *   NODEMCU_MODULE_LAZY(MYNAME, "myname", myname, luaopen_myname);
+ *
+ * Its map is then left out of the ROM table and luaopen_myname is deferred
+ * from startup until the first reference to myname, saving both boot time and
+ * heap for applications which never use it.  Modules whose init function sets
+ * up hardware or SDK state at boot must use NODEMCU_MODULE as before.
+ */
+#define NODEMCU_MODULE_LAZY(cfgname, luaname, map, initfunc) \
+  const LOCK_IN_SECTION(libs) \
+    ROTable_entry MODULE_PASTE_(lua_lib_,cfgname) = { luaname, LRO_FUNCVAL(initfunc) }; \
+  const LOCK_IN_SECTION(lazy) \
+    ROTable_entry MODULE_EXPAND_PASTE_(cfgname,MODULE_EXPAND_PASTE_(_module_selected,MODULE_PASTE_(LUA_USE_MODULES_,cfgname))) \
+    = {luaname, LRO_ROVAL(map)}
 #endif
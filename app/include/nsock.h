@@ -0,0 +1,50 @@
+#ifndef __NSOCK_H__
+#define __NSOCK_H__
+
+#include "lwip/err.h"
+#include "lwip/pbuf.h"
+#include <stdbool.h>
+
+/*
+ * A TCP client connection straight on lwIP, in plain text or over TLS, for
+ * the C modules that talk to servers.  Received data is handed up in the
+ * pbufs it arrived in, and the pbufs that are sent are queued and given to
+ * lwIP without another copy.  With TLS, records are decrypted into and
+ * encrypted from the same queues, through the certificates and session cache
+ * of the tls module.
+ *
+ * The callbacks run in the lwIP context, all but closed optionally.  closed
+ * is called once for every socket, from a task, whether the connection
+ * failed, was closed by the server or by nsock_close(); the socket is gone
+ * once it returns.
+ */
+
+/* Codes given to closed besides the lwIP ones */
+#define NSOCK_ERR_DNS   (-20) /* the host name could not be resolved */
+#define NSOCK_ERR_TLS   (-28) /* the TLS handshake or a record failed */
+
+typedef struct nsock nsock;
+
+typedef struct {
+  void (*connected)(void *arg);             /* connected, and TLS negotiated */
+  void (*recv)(void *arg, struct pbuf *p);  /* data arrived, to be freed by the callee */
+  void (*sent)(void *arg);                  /* everything sent has gone to lwIP */
+  void (*closed)(void *arg, err_t err);     /* the connection is over, ERR_OK if closed cleanly */
+} nsock_callbacks;
+
+/* Resolve host and connect to it; NULL if out of memory */
+nsock *nsock_connect(const char *host, u16_t port, bool secure,
+                     const nsock_callbacks *cb, void *arg);
+
+/* Queue p to be sent, taking it over; data sent before connected waits */
+err_t nsock_send(nsock *s, struct pbuf *p);
+
+/* Queue a copy of data to be sent */
+err_t nsock_write(nsock *s, const void *data, u16_t len);
+
+/* Close the connection and have closed called with err.  With ERR_OK the
+ * data already given to lwIP is still delivered, otherwise the connection is
+ * reset; queued data that lwIP had no room for yet is dropped. */
+void nsock_close(nsock *s, err_t err);
+
+#endif /* __NSOCK_H__ */
@@ -0,0 +1,56 @@
+#ifndef __PLATFORM_TRACE_H__
+#define __PLATFORM_TRACE_H__
+/*
+ * Binary event trace.  With PLATFORM_TRACE defined in user_config.h, the
+ * instrumentation points below record an entry of the CPU cycle count, the
+ * event and two arguments into a RAM ring, which is read out by perf.trace.
+ * A point costs a load and a branch while tracing is off, and nothing at all
+ * without PLATFORM_TRACE.
+ */
+#include "user_config.h"
+#include <stdint.h>
+#include <stddef.h>
+
+enum {                   /* a                      b */
+  TRACE_TASK_POST = 1,   /* priority               task handle */
+  TRACE_TASK_DISPATCH,   /* priority               task handle */
+  TRACE_TASK_DONE,       /* priority               task handle */
+  TRACE_GC_STEP,         /* 0                      GC debt in bytes */
+  TRACE_GC_STEP_DONE,    /* 0                      bytes in use */
+  TRACE_NET_RX,          /* length                 source IP address */
+  TRACE_NET_TX,          /* length                 destination IP address */
+  TRACE_FLASH_ERASE,     /* 0                      sector */
+  TRACE_FLASH_WRITE,     /* length                 flash address */
+  TRACE_LUA_CB,          /* number of arguments    stack depth */
+  TRACE_LUA_CB_DONE,     /* status                 stack depth */
+  TRACE_GPIO_ISR,        /* 0                      GPIO interrupt status */
+  TRACE_USER,            /* from perf.trace.mark(a, b) */
+  TRACE_EVENT_COUNT
+};
+
+/* 12 bytes, and the little-endian record format read by tools/trace_decode.py */
+typedef struct {
+  uint32_t ccount;
+  uint16_t id;
+  uint16_t a;
+  uint32_t b;
+} platform_trace_entry_t;
+
+#if defined(PLATFORM_TRACE) && !defined(LUA_CROSS_COMPILER)
+extern volatile uint32_t platform_trace_mask;
+void platform_trace_event(unsigned id, unsigned a, uint32_t b);
+#define PLATFORM_TRACE_EVENT(id, a, b) do { \
+    if (platform_trace_mask & (1u << (id))) \
+      platform_trace_event((id), (a), (uint32_t)(b)); } while (0)
+#else
+#define PLATFORM_TRACE_EVENT(id, a, b)
+#endif
+
+/* Start tracing the events in mask into a ring of entries (a power of 2) */
+int platform_trace_start(unsigned entries, uint32_t mask);
+void platform_trace_stop(void);
+/* Take up to max of the oldest entries out of the ring, and the number lost
+ * to the ring wrapping since the last read */
+size_t platform_trace_read(platform_trace_entry_t *to, size_t max, uint32_t *lost);
+
+#endif /* __PLATFORM_TRACE_H__ */
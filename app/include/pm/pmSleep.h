@@ -47,6 +47,18 @@ typedef struct pmSleep_param{
 }pmSleep_param_t; //structure to hold pmSleep configuration
 
 
+typedef struct pmSleep_autosleep_param{
+  uint32 min_idle_ms;
+  uint8 wake_pin;
+  uint8 int_type;
+  void (*resume_cb_ptr)(uint32 slept_ms);
+}pmSleep_autosleep_param_t; //structure to hold the automatic idle sleep configuration
+
+typedef struct pmSleep_autosleep_stats{
+  uint32 sleeps;
+  uint32 slept_ms;
+}pmSleep_autosleep_stats_t;
+
 enum PMSLEEP_STATE{
   PMSLEEP_AWAKE = 0,
   PMSLEEP_SUSPENSION_PENDING = 1,
@@ -57,6 +69,10 @@ uint8 pmSleep_get_state(void);
 void pmSleep_resume(void (*resume_cb_ptr)(void));
 void pmSleep_suspend(pmSleep_param_t *param);
 void pmSleep_execute_lua_cb(int* cb_ref);
+void pmSleep_autosleep_enable(pmSleep_autosleep_param_t *cfg);
+void pmSleep_autosleep_disable(void);
+bool pmSleep_autosleep_enabled(void);
+void pmSleep_autosleep_get_stats(pmSleep_autosleep_stats_t *stats);
 int pmSleep_parse_table_lua( lua_State* L, int table_idx, pmSleep_param_t *cfg, int *suspend_lua_cb_ref, int *resume_lua_cb_ref);
 
 
@@ -44,7 +44,7 @@
 // 4: Reload value for (10). Needs to be applied by the firmware in the real boot (rtc_restart_samples_to_take())
 //
 // 5: FIFO location. First FIFO address in bits 0:7, first non-FIFO address in bits 8:15.
-//                   Number of tag spaces in bits 16:23
+//                   Number of tag spaces in bits 16:23, RTC_FIFO_PACKED in bit 24
 // 6: Number of samples in FIFO.
 // 7: FIFO tail (where next sample will be written. Increments by 1 for each sample)
 // 8: FIFO head (where next sample will be read. Increments by 1 for each sample)
@@ -80,6 +80,18 @@
 //     Bits 16:24  -> delta-t in seconds from previous entry
 //     Bits 0:15   -> sample value
 
+//     In the packed format (bit 24 of (5) set) the tag spaces are followed by one word per tag
+//     holding the last value read from the FIFO for that tag in bits 16:31, and the last value
+//     written in bits 0:15. Head and tail are then byte addresses (word address * 4 + byte),
+//     and each entry is a byte sequence of
+//     header    -> bits 0:3 tag index, bits 4:6 decimals, bit 7 set if delta-t is 0
+//     delta-t   -> varint, omitted if 0
+//     value     -> zigzag varint of the 16 bit difference to the previous value of the same tag
+//     so a periodic sample typically takes 3 bytes, or 2 when several sensors share a timestamp
+
+#define RTC_FIFO_PACKED        (1<<24)
+#define RTC_FIFO_PACKED_MAX    6   // bytes in the longest packed entry
+
 #define RTC_DEFAULT_FIFO_START 32
 #define RTC_DEFAULT_FIFO_END  128
 #define RTC_DEFAULT_TAGCOUNT    5
@@ -166,9 +178,20 @@ static inline uint32_t rtc_fifo_get_last(void)
   return (rtc_mem_read(RTC_FIFOLOC_POS)>>8)&0xff;
 }
 
+static inline uint32_t rtc_fifo_is_packed(void)
+{
+  return rtc_mem_read(RTC_FIFOLOC_POS)&RTC_FIFO_PACKED;
+}
+
+// Number of words used by the tag spaces, and in the packed format the tag values
+static inline uint32_t rtc_fifo_get_tagwords(void)
+{
+  return rtc_fifo_get_tagcount()*(rtc_fifo_is_packed() ? 2 : 1);
+}
+
 static inline uint32_t rtc_fifo_get_first(void)
 {
-  return rtc_fifo_get_tagpos()+rtc_fifo_get_tagcount();
+  return rtc_fifo_get_tagpos()+rtc_fifo_get_tagwords();
 }
 
 static inline void rtc_fifo_put_loc(uint32_t first, uint32_t last, uint32_t tagcount)
@@ -183,6 +206,52 @@ static inline uint32_t rtc_fifo_normalise_index(uint32_t index)
   return index;
 }
 
+static inline uint32_t rtc_fifo_normalise_byte(uint32_t at)
+{
+  if (at>=rtc_fifo_get_last()*4)
+    at=rtc_fifo_get_first()*4;
+  return at;
+}
+
+static inline uint32_t rtc_fifo_get_valpos(void)
+{
+  return rtc_fifo_get_tagpos()+rtc_fifo_get_tagcount();
+}
+
+static inline uint32_t rtc_fifo_get_head_val(uint32_t index)
+{
+  return rtc_mem_read(rtc_fifo_get_valpos()+index)>>16;
+}
+
+static inline uint32_t rtc_fifo_get_tail_val(uint32_t index)
+{
+  return rtc_mem_read(rtc_fifo_get_valpos()+index)&0xffff;
+}
+
+static inline void rtc_fifo_put_head_val(uint32_t index, uint32_t val)
+{
+  uint32_t at=rtc_fifo_get_valpos()+index;
+  rtc_mem_write(at,(rtc_mem_read(at)&0xffff)|(val<<16));
+}
+
+static inline void rtc_fifo_put_tail_val(uint32_t index, uint32_t val)
+{
+  uint32_t at=rtc_fifo_get_valpos()+index;
+  rtc_mem_write(at,(rtc_mem_read(at)&0xffff0000)|(val&0xffff));
+}
+
+static inline uint32_t rtc_fifo_read_byte(uint32_t at)
+{
+  return (rtc_mem_read(at>>2)>>((at&3)*8))&0xff;
+}
+
+static inline void rtc_fifo_write_byte(uint32_t at, uint32_t b)
+{
+  uint32_t shift=(at&3)*8;
+  uint32_t word=rtc_mem_read(at>>2);
+  rtc_mem_write(at>>2,(word&~(0xffu<<shift))|((b&0xff)<<shift));
+}
+
 static inline void rtc_fifo_increment_count(void)
 {
   rtc_fifo_put_count(rtc_fifo_get_count()+1);
@@ -242,6 +311,47 @@ static inline uint32_t rtc_fifo_get_tag_from_entry(uint32_t entry)
   return rtc_mem_read(tags_at+index);
 }
 
+static uint32_t rtc_fifo_construct_entry(uint32_t val, uint32_t tagindex, uint32_t decimals, uint32_t deltat);
+
+static inline uint32_t rtc_fifo_read_varint(uint32_t* at)
+{
+  uint32_t v=0, shift=0, b;
+  do
+  {
+    b=rtc_fifo_read_byte(*at);
+    *at=rtc_fifo_normalise_byte(*at+1);
+    v|=(b&0x7f)<<shift;
+    shift+=7;
+  } while ((b&0x80) && shift<21);
+  return v;
+}
+
+// Reads the entry at *at in the 32 bit format and moves *at on to the next one. Packed entries
+// are decoded against vals, the values of the tags before *at, or if vals is NULL against the
+// values kept for the FIFO head, which are then updated.
+static inline uint32_t rtc_fifo_next_entry(uint32_t* at, uint16_t* vals)
+{
+  if (!rtc_fifo_is_packed())
+  {
+    uint32_t entry=rtc_mem_read(*at);
+    *at=rtc_fifo_normalise_index(*at+1);
+    return entry;
+  }
+
+  uint32_t hdr=rtc_fifo_read_byte(*at);
+  *at=rtc_fifo_normalise_byte(*at+1);
+  uint32_t tagindex=hdr&0x0f;
+  uint32_t deltat=(hdr&0x80) ? 0 : rtc_fifo_read_varint(at);
+  uint32_t z=rtc_fifo_read_varint(at);
+  uint32_t val=vals ? vals[tagindex] : rtc_fifo_get_head_val(tagindex);
+  val=(val+((z>>1)^-(z&1)))&0xffff;
+  if (vals)
+    vals[tagindex]=val;
+  else
+    rtc_fifo_put_head_val(tagindex,val);
+  return rtc_fifo_construct_entry(val,tagindex,(hdr>>4)&0x07,deltat);
+}
+
 static inline void rtc_fifo_fill_sample(sample_t* dst, uint32_t entry, uint32_t timestamp)
 {
   dst->timestamp=timestamp;
@@ -260,12 +370,10 @@ static inline int8_t rtc_fifo_pop_sample(sample_t* dst)
     return 0;
   uint32_t head=rtc_fifo_get_head();
   uint32_t timestamp=rtc_fifo_get_head_t();
-  uint32_t entry=rtc_mem_read(head);
+  uint32_t entry=rtc_fifo_next_entry(&head,NULL);
   timestamp+=rtc_fifo_get_deltat(entry);
   rtc_fifo_fill_sample(dst,entry,timestamp);
 
-  head=rtc_fifo_normalise_index(head+1);
-
   rtc_fifo_put_head(head);
   rtc_fifo_put_head_t(timestamp);
   rtc_fifo_decrement_count();
@@ -277,15 +385,20 @@ static inline int8_t rtc_fifo_peek_sample(sample_t* dst, uint32_t from_top)
 {
   if (rtc_fifo_get_count()<=from_top)
     return 0;
+  uint16_t vals[16];
+  uint32_t i;
+  if (rtc_fifo_is_packed())
+    for (i=0;i<rtc_fifo_get_tagcount() && i<16;i++)
+      vals[i]=rtc_fifo_get_head_val(i);
+
   uint32_t head=rtc_fifo_get_head();
-  uint32_t entry=rtc_mem_read(head);
+  uint32_t entry=rtc_fifo_next_entry(&head,vals);
   uint32_t timestamp=rtc_fifo_get_head_t();
   timestamp+=rtc_fifo_get_deltat(entry);
 
   while (from_top--)
   {
-    head=rtc_fifo_normalise_index(head+1);
-    entry=rtc_mem_read(head);
+    entry=rtc_fifo_next_entry(&head,vals);
     timestamp+=rtc_fifo_get_deltat(entry);
   }
 
@@ -304,9 +417,8 @@ static inline void rtc_fifo_drop_samples(uint32_t from_top)
 
   while (from_top--)
   {
-    uint32_t entry=rtc_mem_read(head);
+    uint32_t entry=rtc_fifo_next_entry(&head,NULL);
     head_t+=rtc_fifo_get_deltat(entry);
-    head=rtc_fifo_normalise_index(head+1);
     rtc_fifo_decrement_count();
   }
   rtc_fifo_put_head(head);
@@ -348,6 +460,61 @@ static uint32_t rtc_fifo_construct_entry(uint32_t val, uint32_t tagindex, uint32
          ((decimals & 0x7)<<25) + ((tagindex & 0xf)<<28);
 }
 
+// Bytes in use in the packed format
+static inline uint32_t rtc_fifo_packed_used(void)
+{
+  uint32_t size=(rtc_fifo_get_last()-rtc_fifo_get_first())*4;
+  uint32_t head=rtc_fifo_get_head();
+  uint32_t tail=rtc_fifo_get_tail();
+  if (rtc_fifo_get_count()==0)
+    return 0;
+  return tail>head ? tail-head : size-(head-tail);
+}
+
+static inline uint32_t rtc_fifo_put_varint(uint8_t* p, uint32_t v)
+{
+  uint32_t n=0;
+  while (v>=0x80)
+  {
+    p[n++]=(v&0x7f)|0x80;
+    v>>=7;
+  }
+  p[n++]=v;
+  return n;
+}
+
+static inline void rtc_fifo_store_packed(uint32_t val, uint32_t tagindex, uint32_t decimals, uint32_t deltat)
+{
+  uint8_t buf[RTC_FIFO_PACKED_MAX];
+  uint32_t n=0, i;
+  int32_t d=(int16_t)(val-rtc_fifo_get_tail_val(tagindex));
+  uint32_t z=(((uint32_t)d<<1)^(uint32_t)(d>>15))&0xffff;
+
+  buf[n++]=(tagindex&0x0f)|((decimals&0x07)<<4)|(deltat ? 0 : 0x80);
+  if (deltat)
+    n+=rtc_fifo_put_varint(buf+n,deltat);
+  n+=rtc_fifo_put_varint(buf+n,z);
+
+  uint32_t size=(rtc_fifo_get_last()-rtc_fifo_get_first())*4;
+  if (n>size)
+    return;
+  while (size-rtc_fifo_packed_used()<n)
+  { // Full! Need to remove samples
+    sample_t dummy;
+    rtc_fifo_pop_sample(&dummy);
+  }
+
+  uint32_t tail=rtc_fifo_get_tail();
+  for (i=0;i<n;i++)
+  {
+    rtc_fifo_write_byte(tail,buf[i]);
+    tail=rtc_fifo_normalise_byte(tail+1);
+  }
+  rtc_fifo_put_tail(tail);
+  rtc_fifo_put_tail_val(tagindex,val);
+  rtc_fifo_increment_count();
+}
+
 static inline void rtc_fifo_store_sample(const sample_t* s)
 {
   uint32_t head=rtc_fifo_get_head();
@@ -379,6 +546,13 @@ static inline void rtc_fifo_store_sample(const sample_t* s)
       return; // Uh-oh! This should never happen
   }
 
+  if (rtc_fifo_is_packed())
+  {
+    rtc_fifo_store_packed(s->value&0xffff,tagindex,s->decimals,deltat);
+    rtc_fifo_put_tail_t(s->timestamp);
+    return;
+  }
+
   if (head==tail && count>0)
   { // Full! Need to remove a sample
     sample_t dummy;
@@ -424,14 +598,14 @@ static inline uint32_t rtc_fifo_get_divisor(const sample_t* s)
 static inline void rtc_fifo_clear_tags(void)
 {
   uint32_t tags_at=rtc_fifo_get_tagpos();
-  uint32_t count=rtc_fifo_get_tagcount();
+  uint32_t count=rtc_fifo_get_tagwords();
   while (count--)
     rtc_mem_write(tags_at++,0);
 }
 
 static inline void rtc_fifo_clear_content(void)
 {
-  uint32_t first=rtc_fifo_get_first();
+  uint32_t first=rtc_fifo_get_first()*(rtc_fifo_is_packed() ? 4 : 1);
   rtc_fifo_put_tail(first);
   rtc_fifo_put_head(first);
   rtc_fifo_put_count(0);
@@ -446,6 +620,13 @@ static inline void rtc_fifo_init(uint32_t first, uint32_t last, uint32_t tagcoun
   rtc_fifo_clear_content();
 }
 
+// Switches the FIFO to the packed format, which empties it
+static inline void rtc_fifo_use_packed(void)
+{
+  rtc_mem_write(RTC_FIFOLOC_POS,rtc_mem_read(RTC_FIFOLOC_POS)|RTC_FIFO_PACKED);
+  rtc_fifo_clear_content();
+}
+
 static inline void rtc_fifo_init_default(uint32_t tagcount)
 {
   if (tagcount==0)
@@ -70,5 +70,7 @@ bool rtctime_have_time (void);
 void rtctime_deep_sleep_us (uint32_t us);
 void rtctime_deep_sleep_until_aligned_us (uint32_t align_us, uint32_t min_us);
 void rtctime_gmtime (const int32 stamp, struct rtc_tm *r);
+void rtctime_clock_sync (uint64_t ntp_us);
+bool rtctime_clock_gettime (struct rtc_timeval *tv);
 
 #endif
@@ -44,6 +44,8 @@ typedef struct{
 	mbedtls_x509_crt cacert;
 	mbedtls_x509_crt clicert;
 	mbedtls_pk_context pkey;
+	bool ca_cached;		/* borrows the parsed CA chain in flash */
+	bool own_cached;	/* borrows the parsed own certificate and key */
 }mbedtls_session, *pmbedtls_session;
 
 typedef struct{
@@ -215,6 +217,59 @@ extern void espconn_ssl_sent(void *arg, uint8 *psent, uint16 length);
 
 extern void espconn_ssl_disconnect(espconn_msg *pdis);
 
+/******************************************************************************
+ * FunctionName : espconn_ssl_session_flush
+ * Description  : Forget all cached client sessions, so that the next
+ *                connection to every server does a full handshake
+ * Parameters   : none
+ * Returns      : none
+*******************************************************************************/
+
+extern void espconn_ssl_session_flush(void);
+
+/******************************************************************************
+ * FunctionName : espconn_mbedtls_client_new
+ * Description  : Set up the TLS state of a client that carries the records
+ *                over its own pcb (app/net/nsock.c), with the certificates and
+ *                cached session that espconn_secure_connect would use.  The
+ *                caller sets the bio.
+ * Parameters   : tcp -- the remote address and port of the connection
+ * Returns      : the TLS state, or NULL if out of memory or a certificate
+ *                failed to load
+*******************************************************************************/
+
+extern pmbedtls_msg espconn_mbedtls_client_new(const esp_tcp *tcp);
+
+/******************************************************************************
+ * FunctionName : espconn_mbedtls_client_handshaked
+ * Description  : Check the result of a completed handshake, keep its session
+ *                and release the memory that only the handshake needed
+ * Parameters   : msg -- the TLS state
+ *                tcp -- the remote address and port of the connection
+ * Returns      : false if the server certificate was not accepted
+*******************************************************************************/
+
+extern bool espconn_mbedtls_client_handshaked(pmbedtls_msg msg, const esp_tcp *tcp);
+
+/******************************************************************************
+ * FunctionName : espconn_mbedtls_client_free
+ * Description  : Free the TLS state of espconn_mbedtls_client_new
+ * Parameters   : msg -- the TLS state, set to NULL
+ * Returns      : none
+*******************************************************************************/
+
+extern void espconn_mbedtls_client_free(pmbedtls_msg *msg);
+
+/******************************************************************************
+ * FunctionName : espconn_mbedtls_cert_flush
+ * Description  : Drop the parsed copy of the certificates in a flash sector,
+ *                after the sector was written or disabled
+ * Parameters   : ca -- true for the CA sector, false for the own certificate
+ * Returns      : none
+*******************************************************************************/
+
+extern void espconn_mbedtls_cert_flush(bool ca);
+
 #endif
 
 
@@ -71,6 +71,17 @@
 // material RAM saving with no performance loss.
 //
 
+// Lua 5.3 hashes only every other character of short strings over 32 characters
+// long. If many of the strings interned differ in only a few characters, such as
+// generated MQTT topics holding sensor IDs, LUA_FULL_STRING_HASH hashes them all
+// so that they do not collide in the string table. An LFS image has to be
+// reloaded after changing it. LUA_STRTAB_LOAD is the number of strings per 100
+// chains of the string table at which it grows; lower values give shorter chains
+// for 4 bytes of RAM per chain. node.info("strings") shows how the table is used.
+
+//#define LUA_FULL_STRING_HASH
+//#define LUA_STRTAB_LOAD 100
+
 
 // The Lua Flash Store (LFS) allows you to store Lua code in Flash memory and
 // the Lua VMS will execute this code directly from flash without needing any
@@ -111,6 +122,11 @@
 
 #define BUILD_SPIFFS
 #define SPIFFS_CACHE 1          // Enable if you use you SPIFFS in R/W mode
+#define SPIFFS_CACHE_PAGES 4    // number of 256 byte pages in the SPIFFS cache
+#define SPIFFS_READ_AHEAD_PAGES 4 // pages read at once on sequential access, 0 = off
+#define SPIFFS_NAME_INDEX       // keep a RAM index of file names to speed up open and stat
+#define SPIFFS_IDLE_GC_BLOCKS 4 // free blocks garbage collection keeps when idle, 0 = off
+#define SPIFFS_MOUNT_SNAPSHOT   // save the mount scan results so that clean boots skip it
 //#define SPIFFS_MAX_FILESYSTEM_SIZE 0x20000
 #define SPIFFS_MAX_OPEN_FILES 4 // maximum number of open files for SPIFFS
 #define FS_OBJ_NAME_LEN 31      // maximum length of a filename
@@ -130,6 +146,7 @@
 #define SHA2_ENABLE
 #define SSL_BUFFER_SIZE 4096
 #define SSL_MAX_FRAGMENT_LENGTH_CODE	MBEDTLS_SSL_MAX_FRAG_LEN_4096
+#define SSL_SESSION_CACHE_SIZE 2 // servers whose TLS sessions are kept for resumption, 0 = off
 
 
 // GPIO_INTERRUPT_ENABLE needs to be defined if your application uses the
@@ -142,6 +159,25 @@
 #define GPIO_INTERRUPT_HOOK_ENABLE
 
 
+// Each of the three task priorities has an SDK event queue whose length is
+// fixed at start-up (8 events by default).  If you have bursty event sources
+// such as a fast GPIO interrupt then you can increase the length of the
+// relevant queue here.  The queues can also be extended at runtime using
+// node.task.queuelen(), and node.task.stats() reports the high-water mark,
+// post failures and dispatch latency so you can size them from field data.
+
+//#define PLATFORM_TASK_QUEUE_LEN_LOW     8
+//#define PLATFORM_TASK_QUEUE_LEN_MEDIUM  8
+//#define PLATFORM_TASK_QUEUE_LEN_HIGH    8
+
+// Lua tasks posted by node.task.post() and the C modules are queued on the Lua
+// side and run in slices which yield back to the SDK after this many
+// microseconds (4000 by default), so that a flood of posts can neither fill
+// the SDK queues nor hold off Wi-Fi for long.
+
+//#define LUA_TASK_SLICE_US               4000
+
+
 // If your application uses the light sleep functions and you wish the
 // firmware to manage timer rescheduling over sleeps (the CPU clock is
 // suspended so timers get out of sync) then enable the following options
@@ -149,6 +185,18 @@
 //#define TIMER_SUSPEND_ENABLE
 //#define PMSLEEP_ENABLE
 
+// The TCP/IP stack is tuned by default for a few connections of moderate
+// throughput.  One of the following memory profiles can be selected instead:
+// "bulk" doubles the send buffer and enlarges the receive window for large
+// transfers, "many-conn" keeps every connection small so that a server can
+// hold 10, and "low-mem" uses 536 byte segments and small buffers throughout.
+// The receive window and the connection limit can also be changed at runtime
+// with net.config().  See docs/modules/net.md for the figures.
+
+//#define LWIP_PROFILE_BULK
+//#define LWIP_PROFILE_MANYCONN
+//#define LWIP_PROFILE_LOWMEM
+
 // The net module optionally offers net info functionnality. Uncomment the following
 // to enable the functionnality.
 #define NET_PING_ENABLE
@@ -207,6 +255,13 @@
 
 #define I2C_MASTER_OLD_VERSION
 
+// bme280_math.read() returns the readings as scaled integers (0.01 DegC,
+// 0.001 hPa, 0.001 %), like the bme280 module.  Define this to have them
+// returned as floats in DegC, hPa and % as in earlier releases, at the cost
+// of soft-float arithmetic on every reading.
+
+//#define BME280_MATH_FLOAT
+
 
 // The following sections are only relevant for those developers who are
 // developing modules or core Lua changes and configure how extra diagnostics
@@ -225,6 +280,16 @@
 // The DEVELOP_VERSION option enables lots of debug output, and is normally
 // only used by hardcore developers.
 
+// DEVELOPMENT_HEAP_PROFILE adds node.heapsites() and node.heapdump() to track
+// heap use by Lua source line and by C source line respectively.  Every Lua
+// heap block then carries a small header, so this costs RAM.  The SDK heap
+// only records C allocation sites if this is defined for the whole build (as
+// the SDK mem.h is included ahead of this file), so set it in the DEFINES of
+// the top level Makefile rather than here.
+
+// DEVELOPMENT_FLOAT_PROFILE adds node.floatsites() to count, per function, the
+// Lua 5.3 arithmetic operations that fall back to (soft) float arithmetic.
+
 // These options can be enabled globally here or you can alternatively use
 // the DEFINES variable in the relevant Makefile to set these on a per
 // directory basis. If you do this then you can also set the corresponding
@@ -234,6 +299,8 @@
 //#define DEVELOPMENT_USE_GDB
 //#define DEVELOPMENT_BREAK_ON_STARTUP_PIN 1
 //#define DEVELOP_VERSION
+//#define DEVELOPMENT_HEAP_PROFILE
+//#define DEVELOPMENT_FLOAT_PROFILE
 
 
 // *** Heareafter, there be demons ***
@@ -269,6 +336,11 @@
 // consumed. It enables a nice node.startupcounts() function to get the results.
 //#define PLATFORM_STARTUP_COUNT
 
+// The following define enables a binary trace of firmware events, such as task
+// dispatch, GC steps, network packets and flash writes, into a RAM ring that is
+// read with perf.trace.read().  See docs/modules/perf.md.
+//#define PLATFORM_TRACE
+
 #define LUA_TASK_PRIO             USER_TASK_PRIO_0
 #define LUA_PROCESS_LINE_SIG      2
 // LUAI_OPTIMIZE_DEBUG 0 = Keep all debug; 1 = keep line number info; 2 = remove all debug
@@ -130,7 +130,7 @@
 #undef MBEDTLS_RSA_NO_CRT
 #undef MBEDTLS_SELF_TEST
 
-#define MBEDTLS_SHA256_SMALLER
+#undef MBEDTLS_SHA256_SMALLER
 
 #define MBEDTLS_SSL_ALL_ALERT_MESSAGES
 #undef MBEDTLS_SSL_DEBUG_ALL
@@ -148,6 +148,7 @@
 #undef MBEDTLS_SSL_SRV_RESPECT_CLIENT_PREFERENCE
 
 #define MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
 
 #undef MBEDTLS_SSL_PROTO_SSL3
 #undef MBEDTLS_SSL_PROTO_TLS1
@@ -18,6 +18,8 @@
 //#define LUA_USE_MODULES_BME280
 //#define LUA_USE_MODULES_BME280_MATH
 //#define LUA_USE_MODULES_BME680
+//#define LUA_USE_MODULES_CBOR
+//#define LUA_USE_MODULES_CLUSTER
 //#define LUA_USE_MODULES_COAP
 //#define LUA_USE_MODULES_COLOR_UTILS
 //#define LUA_USE_MODULES_CRON
@@ -26,6 +28,7 @@
 #define LUA_USE_MODULES_DHT
 //#define LUA_USE_MODULES_ENCODER
 //#define LUA_USE_MODULES_ENDUSER_SETUP // USE_DNS in dhcpserver.h needs to be enabled for this module to work.
+//#define LUA_USE_MODULES_FIFOSOCK
 #define LUA_USE_MODULES_FILE
 //#define LUA_USE_MODULES_GDBSTUB
 #define LUA_USE_MODULES_GPIO
@@ -33,6 +36,7 @@
 //#define LUA_USE_MODULES_HDC1080
 //#define LUA_USE_MODULES_HMC5883L
 //#define LUA_USE_MODULES_HTTP
+//#define LUA_USE_MODULES_HTTPD
 //#define LUA_USE_MODULES_HX711
 #define LUA_USE_MODULES_I2C
 //#define LUA_USE_MODULES_L3G4200D
@@ -41,13 +45,17 @@
 #define LUA_USE_MODULES_MQTT
 #define LUA_USE_MODULES_NET
 #define LUA_USE_MODULES_NODE
+//#define LUA_USE_MODULES_NUMBUF
 #define LUA_USE_MODULES_OW
+//#define LUA_USE_MODULES_OTA
 //#define LUA_USE_MODULES_PCM
 //#define LUA_USE_MODULES_PERF
 //#define LUA_USE_MODULES_PIPE
 //#define LUA_USE_MODULES_PIXBUF
 //#define LUA_USE_MODULES_PWM
 //#define LUA_USE_MODULES_PWM2
+//#define LUA_USE_MODULES_REDIS
+//#define LUA_USE_MODULES_RFRECV
 //#define LUA_USE_MODULES_RFSWITCH
 //#define LUA_USE_MODULES_ROTARY
 //#define LUA_USE_MODULES_RTCFIFO
@@ -79,6 +87,7 @@
 //#define LUA_USE_MODULES_WS2812
 //#define LUA_USE_MODULES_WS2812_EFFECTS
 //#define LUA_USE_MODULES_XPT2046
+//#define LUA_USE_MODULES_ZLIB
 
 //debug modules
 //#define LUA_USE_MODULES_SWTMR_DBG //SWTMR timer suspend Debug functions
@@ -11,6 +11,9 @@
 
 #include <math.h>
 #include <string.h>
+#ifndef LUA_CROSS_COMPILER
+#include "user_interface.h"
+#endif
 #include "lapi.h"
 #include "ldebug.h"
 #include "ldo.h"
@@ -1224,3 +1227,26 @@ LUA_API void lua_getegcinfo (lua_State *L, int *totals) {
   }
 }
 
+LUA_API void lua_setegcpressure (lua_State *L, int rate, lua_EGCHook hook) {
+  G(L)->egcthrash = rate;
+  G(L)->egchook = hook;
+  if (rate == 0)
+    G(L)->egclevel = 0;
+}
+
+/* stats[] is the collection count, the rate per second and the level */
+LUA_API void lua_getegcstats (lua_State *L, int *stats) {
+  global_State *g = G(L);
+  int rate = g->egcrate > g->egcwindow ? g->egcrate : g->egcwindow;
+#ifndef LUA_CROSS_COMPILER
+  unsigned int elapsed = system_get_time() - g->egcstart;
+  if (elapsed >= 2000000)
+    rate = 0;  /* no collection for a whole second */
+  else if (elapsed >= 1000000)
+    rate = g->egcwindow;  /* the window is the last whole second */
+#endif
+  stats[0] = g->egccount;
+  stats[1] = rate;
+  stats[2] = g->egclevel;
+}
+
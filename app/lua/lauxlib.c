@@ -853,6 +853,36 @@ LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s) {
 /* }====================================================== */
 
 
+/*
+** Count an emergency collection.  Reaching the thrash rate within a second
+** halves the heap reserve of a negative memlimit, as collecting evidently
+** does not recover it, and tells the hook; a second without reaching half
+** the rate takes one halving back, and a quiet one all of them.
+*/
+static void l_egc_note(lua_State *L) {
+  global_State *g = G(L);
+  g->egccount++;
+#ifndef LUA_CROSS_COMPILER
+  unsigned int now = system_get_time(), elapsed = now - g->egcstart;
+  if (elapsed >= 1000000) {
+    g->egcrate = elapsed < 2000000 ? g->egcwindow : 0;
+    if (elapsed >= 2000000)
+      g->egclevel = 0;
+    else if (g->egclevel > 0 && 2 * g->egcrate < g->egcthrash)
+      g->egclevel--;
+    g->egcwindow = 0;
+    g->egcstart = now;
+  }
+  if (++g->egcwindow == g->egcthrash) {
+    if (g->egclevel < EGC_MAX_LEVEL)
+      g->egclevel++;
+    if (g->egchook)
+      g->egchook(L, g->egcwindow, g->egclevel);
+  }
+#endif
+}
+
+
 static int l_check_memlimit(lua_State *L, size_t needbytes) {
   global_State *g = G(L);
   int cycle_count = 0;
@@ -861,6 +891,8 @@ static int l_check_memlimit(lua_State *L, size_t needbytes) {
   if (needbytes > g->memlimit) return 1;
   /* make sure the GC is not disabled. */
   if (!is_block_gc(L)) {
+    if (g->totalbytes >= limit)
+      l_egc_note(L);
     while (g->totalbytes >= limit) {
       /* only allow the GC to finished atleast 1 full cycle. */
       if (g->gcstate == GCSpause && ++cycle_count > 1) break;
@@ -888,8 +920,10 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
     luaC_fullgc(L);
 #ifndef LUA_CROSS_COMPILER
   if (L != NULL && (mode & EGC_ON_MEM_LIMIT) && G(L)->memlimit < 0 &&
-      (system_get_free_heap_size() < (-G(L)->memlimit)))
+      (system_get_free_heap_size() < ((-G(L)->memlimit) >> G(L)->egclevel))) {
+    l_egc_note(L);
     luaC_fullgc(L);
+  }
 #endif
   if(nsize > osize && L != NULL) {
 #if defined(LUA_STRESS_EMERGENCY_GC)
@@ -900,6 +934,7 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
   }
   nptr = (void *)this_realloc(ptr, osize, nsize);
   if (nptr == NULL && L != NULL && (mode & EGC_ON_ALLOC_FAILURE)) {
+    l_egc_note(L);
     luaC_fullgc(L); /* emergency full collection. */
     nptr = (void *)this_realloc(ptr, osize, nsize); /* try allocation again */
   }
@@ -175,6 +175,39 @@ LUALIB_API int  (luaL_pushlfsdts) (lua_State *L);
 LUALIB_API void (luaL_lfsreload) (lua_State *L);
 LUALIB_API int  (luaL_pcallx) (lua_State *L, int narg, int nres);
 LUALIB_API int  (luaL_posttask) ( lua_State* L, int prio );
+
+/*
+** A callback slot holds a value, usually an event callback or the self
+** userdata passed to it, anchored in the registry together with a copy of
+** the value itself, so that events push it without a registry lookup.
+** Only change a slot through these functions.
+*/
+typedef struct luaL_Slot {
+  int ref;        /* registry anchor, LUA_NOREF if empty */
+  int tt;         /* type tag of the copy, LUA_TNONE to use the anchor */
+  void *p;        /* the copied value */
+} luaL_Slot;
+
+#define LUAL_SLOT_INIT      {LUA_NOREF, LUA_TNONE, NULL}
+#define luaL_slotisset(s)   ((s)->ref != LUA_NOREF)
+
+LUALIB_API void (luaL_setslot) (lua_State *L, luaL_Slot *s);
+LUALIB_API void (luaL_unsetslot) (lua_State *L, luaL_Slot *s);
+LUALIB_API void (luaL_pushslot) (lua_State *L, const luaL_Slot *s);
+LUALIB_API int  (luaL_callslot) (lua_State *L, const luaL_Slot *fn,
+                                 const luaL_Slot *self, int narg);
+
+/*
+** Long running C functions can be split into slices, see the Lua 5.3
+** lauxlib.h.  Lua 5.1 can't yield across C functions, so here
+** luaL_sliceexpired() just feeds the soft watchdog and never reports an
+** expired slice; the types let the same sliced code build against both.
+*/
+typedef ptrdiff_t lua_KContext;
+typedef int (*lua_KFunction) (lua_State *L, int status, lua_KContext ctx);
+
+LUALIB_API int  (luaL_sliceexpired) (lua_State *L);
+#define luaL_yieldslice(L,ctx,k)  ((k)((L), LUA_YIELD, (ctx)))
 #define  LUA_TASK_LOW    0
 #define  LUA_TASK_MEDIUM 1
 #define  LUA_TASK_HIGH   2
@@ -20,6 +20,7 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "platform_trace.h"
 
 #define GCSTEPSIZE	1024u
 #define GCSWEEPMAX	40
@@ -634,6 +635,7 @@ void luaC_step (lua_State *L) {
   global_State *g = G(L);
   if(is_block_gc(L)) return;
   set_block_gc(L);
+  PLATFORM_TRACE_EVENT(TRACE_GC_STEP, 0, g->totalbytes - g->GCthreshold);
   l_mem lim = (GCSTEPSIZE/100) * g->gcstepmul;
   if (lim == 0)
     lim = (MAX_LUMEM-1)/2;  /* no limit */
@@ -657,6 +659,7 @@ void luaC_step (lua_State *L) {
     lua_assert(g->totalbytes >= g->estimate);
     setthreshold(g);
   }
+  PLATFORM_TRACE_EVENT(TRACE_GC_STEP_DONE, 0, g->totalbytes);
   unset_block_gc(L);
 }
 
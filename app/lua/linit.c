@@ -32,6 +32,7 @@
 ** table, hence the LROT_BREAK() macros which don't 0 terminate the lists and
 ** skip generating the ROtable header.
  */
+#include <string.h>
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -68,7 +69,7 @@ extern LROT_TABLE(math);
   LUALIB_API int initfunc(lua_State *L);
 
 #ifndef __MINGW32__
-LUAC_MODULE(thislib) // module struct
+LUAC_MODULE_INIT(thislib, luaopen_struct) // module struct
 LUAC_MODULE(bit)
 LUAC_MODULE(color_utils)
 LUAC_MODULE_INIT(sjson, luaopen_sjson)
@@ -107,7 +108,7 @@ LROT_BEGIN(lua_libs, NULL, 0)
   LROT_FUNCENTRY( io, luaopen_io )
 #ifndef __MINGW32__
   // modules
-  LROT_FUNCENTRY(struct, NULL)
+  LROT_FUNCENTRY(struct, luaopen_struct)
   LROT_FUNCENTRY(bit, NULL)
   LROT_FUNCENTRY(color_utils, NULL)
   LROT_FUNCENTRY(sjson, luaopen_sjson)
@@ -122,6 +123,7 @@ LROT_END(lua_libs, NULL, 0)
 
 extern const ROTable_entry lua_libs_base[];
 extern const ROTable_entry lua_rotable_base[];
+extern const ROTable_entry lua_lazy_base[];
 ROTable rotables_ROTable;
 
 LROT_ENTRIES_IN_SECTION(rotables, rotable)
@@ -132,6 +134,50 @@ LROT_ENTRIES_IN_SECTION(lua_libs, libs)
   LROT_LIB_ENTRIES
 LROT_BREAK(lua_libs)
 
+/*
+** Modules declared with NODEMCU_MODULE_LAZY are kept out of the ROM table, so
+** a reference to one misses and falls through to lazy_index().  This runs the
+** module's luaopen_ function on first use and caches the module in _G, so that
+** later references resolve directly and the open function runs once only.
+*/
+static const ROTable_entry *lazy_find (const ROTable_entry *e,
+                                       const char *name) {
+  for (; e->key; e++) {
+    if (!strcmp(e->key, name))
+      return e;
+  }
+  return NULL;
+}
+
+static int lazy_index (lua_State *L) {
+  const char *name = lua_type(L, 2) == LUA_TSTRING ? lua_tostring(L, 2) : NULL;
+  const ROTable_entry *e = name ? lazy_find(lua_lazy_base, name) : NULL;
+  if (e == NULL)
+    return 0;
+  lua_pushrotable(L, cast(ROTable *, gcvalue(&e->value)));
+  luaL_findtable(L, LUA_REGISTRYINDEX, "_LOADED", 1);
+  lua_getfield(L, -1, name);
+  if (lua_isnil(L, -1)) {
+    const ROTable_entry *lib = lazy_find(lua_libs_base, name);
+    lua_pushvalue(L, -3);
+    lua_setfield(L, -3, name);             /* LOADED[name] = module */
+    if (lib && ttislightfunction(&lib->value) && fvalue(&lib->value)) {
+      lua_pushcfunction(L, fvalue(&lib->value));
+      lua_pushstring(L, name);
+      lua_call(L, 1, 0);                   /* call luaopen_XXX(name) */
+    }
+  }
+  lua_pop(L, 2);                           /* remove LOADED[name] and LOADED */
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, LUA_GLOBALSINDEX);        /* _G[name] = module */
+  return 1;
+}
+
+LROT_BEGIN(rotables_meta, NULL, LROT_MASK_INDEX)
+  LROT_FUNCENTRY( __index, lazy_index )
+LROT_END(rotables_meta, NULL, LROT_MASK_INDEX)
+
 #endif
 
 
@@ -140,14 +186,18 @@ void luaL_openlibs (lua_State *L) {
   const ROTable_entry *p = LROT_TABLEREF(lua_libs)->entry;
 #else
   const ROTable_entry *p = lua_libs_base;
-  lua_createrotable(L, LROT_TABLEREF(rotables), lua_rotable_base, NULL);
+  lua_createrotable(L, LROT_TABLEREF(rotables), lua_rotable_base,
+                    cast(ROTable *, LROT_TABLEREF(rotables_meta)));
+#endif
+  for ( ; p->key; p++) {
+#ifndef LUA_CROSS_COMPILER
+    if (lazy_find(lua_lazy_base, p->key))
+      continue;                            /* opened on first use */
 #endif
-  while (p->key) {
     if (ttislightfunction(&p->value) && fvalue(&p->value)) {
       lua_pushcfunction(L, fvalue(&p->value));
       lua_pushstring(L, p->key);
       lua_call(L, 1, 0);  // call luaopen_XXX(libname)
     }
-    p++;
   }
 }
@@ -8,6 +8,8 @@
 #define lmem_c
 #define LUA_CORE
 
+#include <string.h>
+
 #include "lua.h"
 
 #include "ldebug.h"
@@ -68,13 +70,201 @@ void *luaM_toobig (lua_State *L) {
 
 
 
+/*
+** {======================================================
+** Small object slabs
+** =======================================================
+*/
+#if LUAI_SLABMAX > 0
+/*
+** Blocks of up to LUAI_SLABMAX bytes are carved from LUAI_SLABSIZE slabs,
+** one set of slabs per 8 byte size class, rather than each being a separate
+** heap allocation.  This avoids the heap overhead per block and keeps small
+** objects from fragmenting the heap.  Each class keeps a list of the slabs
+** with free slots, and all slabs are also kept in an address-ordered vector
+** so that the slab holding a freed block is found by a binary search.  A
+** slab is released back to the heap when it becomes empty, unless it is the
+** only one of its class with free slots.
+*/
+typedef struct Slab {
+  struct Slab *next, *prev;  /* list of slabs with free slots */
+  void *free;  /* list of free slots */
+  unsigned short nfree;
+  lu_byte c;  /* size class */
+} Slab;
+
+#define NSLABCLASS      (LUAI_SLABMAX / 8)
+#define slabclass(s)    (((s) == 0 || (s) > LUAI_SLABMAX) ? -1 : \
+                         cast_int(((s) - 1) >> 3))
+#define slotsize(c)     (cast(size_t, (c) + 1) << 3)
+#define slabhdr         ((sizeof(Slab) + 7) & ~cast(size_t, 7))
+#define slabslots(c)    cast_int((LUAI_SLABSIZE - slabhdr) / slotsize(c))
+#define slabslot(s,i)   (cast(char *, s) + slabhdr + (i) * slotsize((s)->c))
+
+
+/* Index of the first slab in the vector above p */
+static int slab_search (global_State *g, const void *p) {
+  int lo = 0, hi = g->nslabs;
+  while (lo < hi) {
+    int m = (lo + hi) >> 1;
+    if (cast(const char *, g->slabv[m]) <= cast(const char *, p))
+      lo = m + 1;
+    else
+      hi = m;
+  }
+  return lo;
+}
+
+
+static Slab *slab_new (global_State *g, int c) {
+  Slab *s;
+  int i;
+  if (g->nslabs == g->sizeslabv) {  /* grow the slab vector */
+    int n = (g->sizeslabv) ? 2 * g->sizeslabv : 8;
+    struct Slab **v = cast(struct Slab **, (*g->frealloc)(g->ud, g->slabv,
+                          g->sizeslabv * sizeof(Slab *), n * sizeof(Slab *)));
+    if (v == NULL)
+      return NULL;
+    g->slabv = v;
+    g->sizeslabv = n;
+  }
+  s = cast(Slab *, (*g->frealloc)(g->ud, NULL, 0, LUAI_SLABSIZE));
+  if (s == NULL)
+    return NULL;
+  s->c = cast_byte(c);
+  s->free = NULL;
+  for (i = slabslots(c) - 1; i >= 0; i--) {
+    void **slot = cast(void **, slabslot(s, i));
+    *slot = s->free;
+    s->free = slot;
+  }
+  s->nfree = slabslots(c);
+  i = slab_search(g, s);
+  memmove(g->slabv + i + 1, g->slabv + i, (g->nslabs - i) * sizeof(Slab *));
+  g->slabv[i] = s;
+  g->nslabs++;
+  s->prev = NULL;
+  s->next = g->slabs[c];
+  if (s->next)
+    s->next->prev = s;
+  g->slabs[c] = s;
+  return s;
+}
+
+
+static void *slab_alloc (global_State *g, int c) {
+  Slab *s = g->slabs[c];
+  void *p;
+  if (s == NULL && (s = slab_new(g, c)) == NULL)
+    return NULL;
+  p = s->free;
+  s->free = *cast(void **, p);
+  if (--s->nfree == 0) {  /* now full, so drop it from the free list */
+    g->slabs[c] = s->next;
+    if (s->next)
+      s->next->prev = NULL;
+  }
+  return p;
+}
+
+
+/* Return p to its slab; 0 if p isn't in a slab */
+static int slab_free (global_State *g, void *p) {
+  int i = slab_search(g, p) - 1;
+  Slab *s;
+  int c;
+  if (i < 0 || cast(char *, p) >= cast(char *, g->slabv[i]) + LUAI_SLABSIZE)
+    return 0;
+  s = g->slabv[i];
+  c = s->c;
+  *cast(void **, p) = s->free;
+  s->free = p;
+  if (s->nfree++ == 0) {  /* was full, so back on the free list */
+    s->prev = NULL;
+    s->next = g->slabs[c];
+    if (s->next)
+      s->next->prev = s;
+    g->slabs[c] = s;
+  }
+  else if (s->nfree == slabslots(c) && (s->prev || s->next)) {  /* empty? */
+    if (s->prev)
+      s->prev->next = s->next;
+    else
+      g->slabs[c] = s->next;
+    if (s->next)
+      s->next->prev = s->prev;
+    g->nslabs--;
+    memmove(g->slabv + i, g->slabv + i + 1, (g->nslabs - i) * sizeof(Slab *));
+    (*g->frealloc)(g->ud, s, LUAI_SLABSIZE, 0);
+  }
+  return 1;
+}
+
+
+/*
+** frealloc front end for the slabs.  A small block is always given at least
+** the slot size of its class, even when it comes from the allocator, so it
+** can be resized within its class without being moved.
+*/
+static void *slab_realloc (global_State *g, void *block, size_t osize,
+                           size_t nsize) {
+  size_t realosize = (block) ? osize : 0;
+  int oc = slabclass(realosize), nc = slabclass(nsize);
+  void *newblock = NULL;
+  if (oc < 0 && nc < 0)  /* neither is small? */
+    return (*g->frealloc)(g->ud, block, osize, nsize);
+  if (oc == nc)
+    return block;
+  if (nc >= 0) {
+    newblock = slab_alloc(g, nc);
+    if (newblock == NULL)
+      newblock = (*g->frealloc)(g->ud, NULL, 0, slotsize(nc));
+  }
+  else if (nsize > 0)
+    newblock = (*g->frealloc)(g->ud, NULL, 0, nsize);
+  if (newblock == NULL && nsize > 0)  /* keep the block if shrinking */
+    return (nsize <= realosize) ? block : NULL;
+  if (block) {
+    if (newblock)
+      memcpy(newblock, block, (realosize < nsize) ? realosize : nsize);
+    if (oc < 0)
+      (*g->frealloc)(g->ud, block, osize, 0);
+    else if (!slab_free(g, block))
+      (*g->frealloc)(g->ud, block, slotsize(oc), 0);
+  }
+  return newblock;
+}
+
+
+/*
+** Release the slabs when the state is closed; all slots are free by then
+*/
+void luaM_closeslabs (lua_State *L) {
+  global_State *g = G(L);
+  int i;
+  for (i = 0; i < g->nslabs; i++)
+    (*g->frealloc)(g->ud, g->slabv[i], LUAI_SLABSIZE, 0);
+  (*g->frealloc)(g->ud, g->slabv, g->sizeslabv * sizeof(Slab *), 0);
+  g->slabv = NULL;
+  g->nslabs = g->sizeslabv = 0;
+  memset(g->slabs, 0, sizeof(g->slabs));
+}
+
+#define l_realloc(g,b,os,ns)	slab_realloc(g,b,os,ns)
+#else
+void luaM_closeslabs (lua_State *L) { UNUSED(L); }
+#define l_realloc(g,b,os,ns)	(*(g)->frealloc)((g)->ud,b,os,ns)
+#endif
+/* }====================================================== */
+
+
 /*
 ** generic allocation routine.
 */
 void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   global_State *g = G(L);
   lua_assert((osize == 0) == (block == NULL));
-  block = (*g->frealloc)(g->ud, block, osize, nsize);
+  block = l_realloc(g, block, osize, nsize);
   if (block == NULL && nsize > 0)
     luaD_throw(L, LUA_ERRMEM);
   lua_assert((nsize == 0) == (block == NULL));
@@ -14,6 +14,7 @@
 #include "lobject.h"
 #include "lstate.h"
 #include "lauxlib.h"
+#include "lapi.h"
 #include "lgc.h"
 #include "lstring.h"
 #include "ltable.h"
@@ -23,6 +24,7 @@
 //== NodeMCU lauxlib.h API extensions ========================================//
 #ifdef LUA_USE_ESP
 #include "platform.h"
+#include "platform_trace.h"
 /*
 ** Error Reporting Task.  We can't pass a string parameter to the error reporter
 ** directly through the task interface the call is wrapped in a C closure with
@@ -68,7 +70,9 @@ LUALIB_API int luaL_pcallx (lua_State *L, int narg, int nres) { // [-narg, +0, v
   int base = lua_gettop(L) - narg;
   lua_pushcfunction(L, errhandler);
   lua_insert(L, base);                                      /* put under args */
+  PLATFORM_TRACE_EVENT(TRACE_LUA_CB, narg, base);
   status = lua_pcall(L, narg, nres, base);
+  PLATFORM_TRACE_EVENT(TRACE_LUA_CB_DONE, status, base);
   lua_remove(L, base);                           /* remove traceback function */
   if (status != LUA_OK && status != LUA_ERRRUN) {  
     lua_gc(L, LUA_GCCOLLECT, 0);   /* call onerror directly if handler failed */
@@ -79,47 +83,188 @@ LUALIB_API int luaL_pcallx (lua_State *L, int narg, int nres) { // [-narg, +0, v
   return status;
 }
 
+/*
+** Posted tasks are queued in a Lua table per priority rather than taking an
+** SDK event each, so that a burst of posts can't fill the SDK task queues.
+** One event drains a queue, running tasks until LUA_TASK_SLICE_US have passed
+** or a task of higher priority is waiting, and then reposts itself so that the
+** SDK and Wi-Fi get their turn between slices.
+*/
+#ifndef LUA_TASK_SLICE_US
+#define LUA_TASK_SLICE_US 4000
+#endif
+
+typedef struct {
+  int ref;                                 /* Registry ref of the queue table */
+  int head, tail;               /* Slot of the next task, and next free slot */
+  int posted;                           /* An SDK event is pending for it */
+} runQueue;
+
 static platform_task_handle_t task_handle = 0;
+static runQueue runq[LUA_TASK_HIGH+1];
+static global_State *runq_owner = NULL;
+static uint32_t slicestart;                   /* when the current task began */
+
+static runQueue *getrunq (lua_State *L, int prio) {
+  runQueue *q;
+  if (runq_owner != G(L)) {         /* a new Lua state, so any queues are void */
+    int i;
+    for (i = LUA_TASK_LOW; i <= LUA_TASK_HIGH; i++)
+      runq[i] = (runQueue) {LUA_NOREF, 1, 1, 0};
+    runq_owner = G(L);
+  }
+  q = runq + prio;
+  if (q->ref == LUA_NOREF) {
+    lua_createtable(L, 8, 0);
+    q->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  return q;
+}
+
+static int higherwaiting (int prio) {
+  while (++prio <= LUA_TASK_HIGH)
+    if (runq[prio].head != runq[prio].tail)
+      return 1;
+  return 0;
+}
 
 /*
-** Task callback handler. Uses luaN_call to do a protected call with full traceback
+** Task callback handler. Runs the queued tasks with luaL_pcallx
 */
-static void do_task (platform_task_param_t task_fn_ref, uint8_t prio) {
+static void do_task (platform_task_param_t param, uint8_t prio) {
   lua_State* L = lua_getstate();
-  if (prio < 0|| prio > 2)
+  runQueue *q;
+  uint32_t start = system_get_time();
+  int n = 0;
+  (void) param;
+  if (prio < LUA_TASK_LOW|| prio > LUA_TASK_HIGH)
     luaL_error(L, "invalid posk task");
-
-/* Pop the CB func from the Reg */
-//dbg_printf("calling Reg[%u]\n", task_fn_ref);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, (int) task_fn_ref);
-  luaL_checkfunction(L, -1);
-  luaL_unref(L, LUA_REGISTRYINDEX, (int) task_fn_ref);
-  lua_pushinteger(L, prio);
-  luaL_pcallx(L, 1, 0);
+  q = getrunq(L, prio);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, q->ref);
+  while (q->head != q->tail) {
+    if (n++ &&
+        (system_get_time() - start >= LUA_TASK_SLICE_US || higherwaiting(prio))) {
+      if (platform_post(prio, task_handle, 0)) {
+        lua_pop(L, 1);                      /* continue in the next slice */
+        return;
+      }
+      start = system_get_time();  /* SDK queue full, so carry on meanwhile */
+    }
+    lua_rawgeti(L, -1, q->head);                     /* Pop the task function */
+    lua_pushnil(L);
+    lua_rawseti(L, -3, q->head++);
+    lua_pushinteger(L, prio);
+    slicestart = system_get_time();
+    luaL_pcallx(L, 1, 0);
+  }
+  q->head = q->tail = 1;
+  q->posted = 0;
+  lua_pop(L, 1);
 }
 
 /*
 ** Schedule a Lua function for task execution
 */
 LUALIB_API int luaL_posttask( lua_State* L, int prio ) {          // [-1, +0, -]
+  runQueue *q;
   if (!task_handle)
     task_handle = platform_task_get_id(do_task);
 
   if (!lua_isfunction(L, -1) || prio < LUA_TASK_LOW|| prio > LUA_TASK_HIGH)
     luaL_error(L, "invalid posk task");
-//void *cl = clvalue(L->top-1);
-  int task_fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-//dbg_printf("posting Reg[%u]=%p\n",task_fn_ref,cl);
-  if(!platform_post(prio, task_handle, (platform_task_param_t)task_fn_ref)) {
-    luaL_unref(L, LUA_REGISTRYINDEX, task_fn_ref);
-    luaL_error(L, "Task queue overflow. Task not posted");
+  q = getrunq(L, prio);
+  if (!q->posted) {
+    if (!platform_post(prio, task_handle, 0))
+      luaL_error(L, "Task queue overflow. Task not posted");
+    q->posted = 1;
   }
-  return task_fn_ref;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, q->ref);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, q->tail);
+  lua_pop(L, 1);
+  return q->tail++;
+}
+
+/*
+** A C function can't yield in Lua 5.1, so once the running task has used up
+** its slice just keep the watchdog fed
+*/
+LUALIB_API int luaL_sliceexpired (lua_State *L) {
+  (void) L;
+  if (system_get_time() - slicestart >= LUA_TASK_SLICE_US)
+    system_soft_wdt_feed();
+  return 0;
 }
 #else
 LUALIB_API int luaL_posttask( lua_State* L, int prio ) { 
   return 0;
 } /* Dummy stub on host */
+
+LUALIB_API int luaL_sliceexpired (lua_State *L) {
+  return 0;
+}
+#endif
+
+/*
+** Callback slots.  The copy of the value can be pushed as it is, since the
+** anchor keeps it alive; numbers, which need the whole Value, are pushed from
+** the anchor instead.  Setting a slot to nil empties it.
+*/
+LUALIB_API void luaL_setslot (lua_State *L, luaL_Slot *s) {      // [-1, +0, m]
+  const TValue *o = L->top - 1;
+  if (ttisnil(o)) {
+    lua_pop(L, 1);
+    luaL_unsetslot(L, s);
+    return;
+  }
+  s->tt = ttisnumber(o) ? LUA_TNONE : ttype(o);
+  s->p = ttisnumber(o) ? NULL : o->value.p;
+  luaL_reref(L, LUA_REGISTRYINDEX, &s->ref);
+}
+
+LUALIB_API void luaL_unsetslot (lua_State *L, luaL_Slot *s) {    // [-0, +0, -]
+  luaL_unref(L, LUA_REGISTRYINDEX, s->ref);
+  s->ref = LUA_NOREF;
+  s->tt = LUA_TNONE;
+  s->p = NULL;
+}
+
+LUALIB_API void luaL_pushslot (lua_State *L, const luaL_Slot *s) { // [-0, +1, -]
+  TValue o;
+  if (s->tt == LUA_TNONE) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->ref);     /* a number, or nil if empty */
+    return;
+  }
+  o.value.p = s->p;
+  o.tt = s->tt;
+  lua_lock(L);
+  luaA_pushobject(L, &o);
+  lua_unlock(L);
+}
+
+#ifdef LUA_USE_ESP
+/*
+** Call the function in slot fn, given the value in slot self (if any and set)
+** and then the narg values on the top of the stack, through luaL_pcallx() so
+** that errors are reported in the usual way.  With fn empty the arguments are
+** just dropped.
+*/
+LUALIB_API int luaL_callslot (lua_State *L, const luaL_Slot *fn,
+                              const luaL_Slot *self, int narg) {  // [-narg, +0, v]
+  int base = lua_gettop(L) - narg + 1;
+  if (!luaL_slotisset(fn)) {
+    lua_pop(L, narg);
+    return LUA_OK;
+  }
+  luaL_pushslot(L, fn);
+  lua_insert(L, base);
+  if (self && luaL_slotisset(self)) {
+    luaL_pushslot(L, self);
+    lua_insert(L, base + 1);
+    narg++;
+  }
+  return luaL_pcallx(L, narg, 0);
+}
 #endif
 
 #ifdef LUA_USE_ESP
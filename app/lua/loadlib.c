@@ -387,12 +387,114 @@ static void loaderror (lua_State *L, const char *filename) {
 }
 
 
+#ifndef LUA_CROSS_COMPILER
+/*
+** Bytecode cache for modules loaded from source.  When a module is loaded
+** from a ".lua" file its compiled chunk is also dumped to a ".lcc" file,
+** headed by a key made from the source's size and modification time, and
+** later loads use this for as long as the key still matches.  If the file
+** system doesn't keep modification times, a hash of the source is used in
+** its place.  The cache is only a hint: any failure falls back to compiling
+** the source.
+*/
+#define CACHE_SIG  0x1B4C4343  /* '\33LCC' */
+
+typedef struct CacheKey {
+  unsigned int sig, size, stamp;
+} CacheKey;
+
+typedef struct CacheF {
+  int f;
+  char buff[LUAL_BUFFERSIZE];
+} CacheF;
+
+
+static int cachekey (const char *filename, CacheKey *k) {
+  struct vfs_stat st;
+  if (vfs_stat(filename, &st) != VFS_RES_OK)
+    return 0;
+  k->sig = CACHE_SIG;
+  k->size = st.size;
+  if (st.tm_valid) {
+    vfs_time *t = &st.tm;
+    k->stamp = ((((t->year * 12 + t->mon) * 31 + t->day) * 24 + t->hour) * 60 +
+                t->min) * 60 + t->sec;
+  } else {  /* FNV-1a hash of the source */
+    char buff[LUAL_BUFFERSIZE];
+    int f = vfs_open(filename, "r"), n, i;
+    if (!f)
+      return 0;
+    k->stamp = 2166136261u;
+    while ((n = vfs_read(f, buff, sizeof(buff))) > 0) {
+      for (i = 0; i < n; i++)
+        k->stamp = (k->stamp ^ (unsigned char) buff[i]) * 16777619u;
+    }
+    vfs_close(f);
+  }
+  return 1;
+}
+
+
+static const char *getCache (lua_State *L, void *ud, size_t *size) {
+  CacheF *cf = (CacheF *)ud;
+  int n = vfs_read(cf->f, cf->buff, sizeof(cf->buff));
+  (void)L;  /* not used */
+  *size = (n > 0) ? n : 0;
+  return (n > 0) ? cf->buff : NULL;
+}
+
+
+static int putCache (lua_State *L, const void *p, size_t size, void *ud) {
+  (void)L;  /* not used */
+  return vfs_write(*(int *)ud, p, size) != size;
+}
+
+
+static int loadcached (lua_State *L, const char *filename) {
+  size_t l = strlen(filename);
+  CacheKey key, ck;
+  CacheF cf;
+  const char *cname;
+  int status;
+  if (l < 4 || strcmp(filename + l - 4, ".lua") != 0 || !cachekey(filename, &key))
+    return luaL_loadfile(L, filename);
+  lua_pushlstring(L, filename, l - 4);
+  cname = lua_pushfstring(L, "%s.lcc", lua_tostring(L, -1));
+  lua_remove(L, -2);
+  if ((cf.f = vfs_open(cname, "r")) != 0) {  /* try the cached chunk */
+    status = (vfs_read(cf.f, &ck, sizeof(ck)) == sizeof(ck) &&
+              memcmp(&ck, &key, sizeof(ck)) == 0)
+           ? lua_load(L, getCache, &cf, filename) : LUA_ERRFILE;
+    vfs_close(cf.f);
+    if (status == 0) {
+      lua_remove(L, -2);  /* remove cache name */
+      return 0;
+    }
+    if (status != LUA_ERRFILE)
+      lua_pop(L, 1);  /* remove error message */
+  }
+  status = luaL_loadfile(L, filename);
+  if (status == 0 && (cf.f = vfs_open(cname, "w")) != 0) {
+    int ok = vfs_write(cf.f, &key, sizeof(key)) == sizeof(key) &&
+             lua_dump(L, putCache, &cf.f, 0) == 0;
+    vfs_close(cf.f);
+    if (!ok)
+      vfs_remove(cname);
+  }
+  lua_remove(L, -2);  /* remove cache name */
+  return status;
+}
+#else
+#define loadcached(L,f)  luaL_loadfile(L,f)
+#endif
+
+
 static int loader_Lua (lua_State *L) {
   const char *filename;
   const char *name = luaL_checkstring(L, 1);
   filename = findfile(L, name, "path");
   if (filename == NULL) return 1;  /* library not found in this path */
-  if (luaL_loadfile(L, filename) != 0)
+  if (loadcached(L, filename) != 0)
     loaderror(L, filename);
   return 1;  /* library loaded successfully */
 }
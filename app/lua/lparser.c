@@ -356,6 +356,16 @@ static void open_func (LexState *ls, FuncState *fs) {
 }
 
 
+/*
+** Each function is stripped as soon as it is closed, since its debug info is
+** no longer needed by the parser, rather than holding it all until the end
+*/
+static void compile_stripdebug(lua_State *L, Proto *f) {
+  int level =  G(L)->stripdefault;
+  if (level > 0)
+    luaG_stripdebug(L, f, level, 0);
+}
+
 static void close_func (LexState *ls) {
   lua_State *L = ls->L;
   FuncState *fs = ls->fs;
@@ -377,18 +387,13 @@ static void close_func (LexState *ls) {
   f->sizeupvalues = f->nups;
   lua_assert(luaG_checkcode(f));
   lua_assert(fs->bl == NULL);
+  compile_stripdebug(L, f);
   ls->fs = fs->prev;
   /* last token read was anchored in defunct function; must reanchor it */
   if (fs) anchor_token(ls);
   L->top -= 2;  /* remove table and prototype from the stack */
 }
 
-static void compile_stripdebug(lua_State *L, Proto *f) {
-  int level =  G(L)->stripdefault;
-  if (level > 0)
-    luaG_stripdebug(L, f, level, 1);
-}
-
 
 Proto *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff, const char *name) {
   struct LexState lexstate;
@@ -404,7 +409,6 @@ Proto *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff, const char *name) {
   chunk(&lexstate);
   check(&lexstate, TK_EOS);
   close_func(&lexstate);
-  compile_stripdebug(L, funcstate.f);
   L->top--; /* remove 'name' from stack */
   lua_assert(funcstate.prev == NULL);
   lua_assert(funcstate.f->nups == 0);
@@ -112,6 +112,7 @@ static void close_state (lua_State *L) {
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size, TString *);
   luaZ_freebuffer(L, &g->buff);
   freestack(L, L);
+  luaM_closeslabs(L);
   lua_assert(g->totalbytes == sizeof(LG));
   (*g->frealloc)(g->ud, fromstate(L), state_size(LG), 0);
 }
@@ -160,6 +161,12 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   preinit_state(L, g);
   g->frealloc = f;
   g->ud = ud;
+#if LUAI_SLABMAX > 0
+  for (i = 0; i < LUAI_SLABMAX / 8; i++)
+    g->slabs[i] = NULL;
+  g->slabv = NULL;
+  g->nslabs = g->sizeslabv = 0;
+#endif
   g->mainthread = L;
   g->uvhead.u.l.prev = &g->uvhead;
   g->uvhead.u.l.next = &g->uvhead;
@@ -196,6 +203,9 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
 #else
   g->memlimit = 0;
 #endif
+  g->egcthrash = g->egccount = g->egcwindow = g->egcrate = g->egclevel = 0;
+  g->egcstart = 0;
+  g->egchook = NULL;
 #ifndef LUA_CROSS_COMPILER
   g->ROstrt.size    = 0;
   g->ROstrt.nuse    = 0;
@@ -69,6 +69,11 @@ typedef struct global_State {
   stringtable strt;  /* hash table for strings */
   lua_Alloc frealloc;  /* function to reallocate memory */
   void *ud;         /* auxiliary data to `frealloc' */
+#if LUAI_SLABMAX > 0
+  struct Slab *slabs[LUAI_SLABMAX / 8];  /* slabs with free slots by class */
+  struct Slab **slabv;  /* all slabs in address order */
+  int nslabs, sizeslabv;
+#endif
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gcflags;  /* flags for the garbage collector */
@@ -89,6 +94,13 @@ typedef struct global_State {
   int gcstepmul;  /* GC `granularity' */
   int stripdefault;  /* default stripping level for compilation */
   int egcmode;    /* emergency garbage collection operation mode */
+  int egcthrash;  /* emergency collections per second taken as thrashing, 0 = never */
+  int egccount;   /* emergency collections since start */
+  int egcwindow;  /* emergency collections in the second from egcstart */
+  int egcrate;    /* emergency collections in the last whole second */
+  unsigned int egcstart;  /* system_get_time() at the start of egcwindow */
+  int egclevel;   /* halvings of a negative memlimit while thrashing */
+  lua_EGCHook egchook;  /* told when egcwindow reaches egcthrash */
   lua_CFunction panic;  /* to be called in unprotected errors */
   TValue l_registry;
   struct lua_State *mainthread;
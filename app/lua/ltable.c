@@ -33,6 +33,7 @@
 #include "lstate.h"
 #include "ltable.h"
 #include "lstring.h"
+#include "lrotable.h"
 
 
 /*
@@ -748,7 +749,8 @@ int luaH_isdummy (Node *n) { return n == dummynode; }
 **
 ** If a match is found and the table addresses match, then this entry is
 ** probed first. In practice the hit-rate here is over 99% so the code
-** rarely fails back to doing the linear scan in ROM.
+** rarely fails back to doing the linear scan in ROM.  The cache probe and
+** the scan are shared with the Lua 5.3 VM, see lrotable.h.
 ** Note that this hash does a couple of prime multiples and a modulus 2^X
 ** with is all evaluated in H/W, and adequately randomizes the lookup.
 */
@@ -757,72 +759,31 @@ int luaH_isdummy (Node *n) { return n == dummynode; }
 static size_t cache [LA_LINES][LA_SLOTS];
 
 #define HASH(a,b) ((((29*(size_t)(a)) ^ (37*((b)->tsv.hash)))>>4) % LA_LINES)
-#define NDX_SHFT 24
-#define ADDR_MASK (((size_t) 1<<24)-1)
 
 /*
- * Find a string key entry in a rotable and return it.  Note that this internally
- * uses a null key to denote a metatable search.
+ * Find a string key entry in a rotable and return it.
  */
 static const TValue* rotable_findentry(ROTable *t, TString *key, unsigned *ppos) {
   const ROTable_entry *e = cast(const ROTable_entry *, t->entry);
   const int tl = getlsizenode(t);
   const char *strkey = getstr(key);
   size_t *cl = cache[HASH(t, key)];
-  int i, j = 1, l;
+  int i;
 
   if (!e || gettt(key) != LUA_TSTRING)
     return luaO_nilobject;
 
-  l = key->tsv.len;
   /* scan the ROTable lookaside cache and return if hit found */
-  for (i=0; i<LA_SLOTS; i++) {
-    int cl_ndx = cl[i] >> NDX_SHFT;
-    if ((((size_t)t - cl[i]) & ADDR_MASK) == 0 && cl_ndx < tl &&
-        strcmp(e[cl_ndx].key, strkey) == 0) {
-       if (ppos)
-          *ppos = cl_ndx;
-      return &e[cl_ndx].value;
-    }
-  }
-
- /*
-  * A lot of search misses are metavalues, but tables typically only have at
-  * most a couple of them, so these are always put at the front of the table
-  * in ascending order and the metavalue scan short circuits using a straight
-  * strcmp()
-  */
-  lu_int32 name4 = *(lu_int32 *) strkey;
-  if (*(char*)&name4  == '_') {
-    for(i = 0; i < tl; i++) {
-      j = strcmp(e[i].key, strkey);
-      if (j>=0)
-        break;
-    }
-  } else {
- /*
-  * Ordinary (non-meta) keys can be unsorted.  This is for legacy compatiblity,
-  * plus misses are pretty rare in this case.  The masked name4 comparison is
-  * safe 4-byte comparison that nearly always avoids the more costly strcmp()
-  * for an actual hit validation.
-  */
-    lu_int32 mask4 = l > 2 ? (~0u) : (~0u)>>((3-l)*8);
-    for(i = 0; i < tl; i++) {
-      if (((*(lu_int32 *)e[i].key ^ name4) & mask4) != 0)
-        continue;
-      j = strcmp(e[i].key, strkey);
-      if (j==0)
-        break;
-    }
+  i = lrot_cache_probe(cl, LA_SLOTS, t, e, sizeof(*e), tl, strkey);
+  if (i < 0) {
+    i = lrot_search(e, sizeof(*e), tl, strkey, key->tsv.len, 0);
+    if (i < 0)
+      return luaO_nilobject;
+    /* In the case of a hit, update the lookaside cache */
+    lrot_cache_update(cl, LA_SLOTS, t, i);
   }
-  if (j)
-    return luaO_nilobject;
   if (ppos)
     *ppos = i;
-  /* In the case of a hit, update the lookaside cache */
-  for (j = LA_SLOTS-1; j>0; j--)
-    cl[j] = cl[j-1];
-  cl[0] = ((size_t)t & ADDR_MASK) + (i << NDX_SHFT);
   return &e[i].value;
 }
 
@@ -407,6 +407,11 @@ LUA_API int  (lua_pushlfsindex) (lua_State *L);
 #define EGC_ON_MEM_LIMIT      2   // run EGC when an upper memory limit is hit
 #define EGC_ALWAYS            4   // always run EGC before an allocation
 
+#define EGC_MAX_LEVEL         3   // most halvings of an ON_MEM_LIMIT heap reserve
+
+/* called by the allocator when emergency collections reach the thrash rate */
+typedef void (*lua_EGCHook) (lua_State *L, int count, int level);
+
 #ifdef LUA_USE_ESP
 
 #define LUA_QUEUE_APP   0
@@ -418,6 +423,8 @@ LUA_API int  (lua_pushlfsindex) (lua_State *L);
 
 LUA_API void (lua_setegcmode) (lua_State *L, int mode, int limit);
 LUA_API void (lua_getegcinfo) (lua_State *L, int *totals);
+LUA_API void (lua_setegcpressure) (lua_State *L, int rate, lua_EGCHook hook);
+LUA_API void (lua_getegcstats) (lua_State *L, int *stats);
 
 #else
 
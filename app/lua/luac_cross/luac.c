@@ -18,11 +18,13 @@
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
+#include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lopcodes.h"
+#include "lstate.h"
 #include "lstring.h"
 #include "lundump.h"
 
@@ -39,6 +41,7 @@ static int lookup=0;			/* output lookup-style master combination header */
 static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* execute;       /* executed a Lua file */
+static const char* mapfile;       /* file to write the size map to */
 static const char* progname=PROGNAME;	/* actual program name */
 static DumpTargetInfo target;
 
@@ -73,6 +76,8 @@ static void usage(const char* message)
  "  -a addr  generate an absolute, rather than position independent flash image file\n"
  "  -i       generate lookup combination master (default with option -f)\n"
  "  -m size  maximum LFS image in bytes\n"
+ "  -M name  write a map of the bytes each module and function takes\n"
+ "           in flash to file " LUA_QL("name") " ('-' for stdout)\n"
  "  -p       parse only\n"
  "  -s       strip debug information\n"
  "  -v       show version information\n"
@@ -131,6 +136,11 @@ static int doargs(int argc, char* argv[])
    if (maxSize & 0xFFF)
      usage(LUA_QL("-e") " maximum size must be a multiple of 4,096");
   }
+  else if (IS("-M"))			/* size map file */
+  {
+   mapfile=argv[++i];
+   if (mapfile==NULL || *mapfile==0) usage(LUA_QL("-M") " needs argument");
+  }
   else if (IS("-o"))			/* output file */
   {
    output=argv[++i];
@@ -267,6 +277,211 @@ static int writer(lua_State* L, const void* p, size_t size, void* u)
  return (fwrite(p,size,1,(FILE*)u)!=1) && (size!=0);
 }
 
+/*
+ * Size map (-M).  Lists the bytes that each module and function takes in LFS
+ * on the 32-bit target, in the layout that lflashimg.c builds: its code; its
+ * constants, counting the Proto itself and its vector of subfunctions; its
+ * line information; its local and upvalue names; and the strings that it uses.
+ * Strings are shared across the image, so each is counted against the first
+ * function that uses it, and one that is only used as a name is counted as a
+ * name, since stripping drops it.
+ */
+#define MAP_PTR      4
+#define MAP_PROTO    72                         /* PROTO_COPY_MASK words */
+#define MAP_TSTRING  16                         /* sizeof(FlashTS) */
+#define MAP_ALIGN(n) (((n)+3) & ~3)
+#define MAP_STR(l)   (MAP_TSTRING + MAP_ALIGN((l)+1))
+#if defined(LUA_PACK_TVALUES)
+#define MAP_TVALUE   (sizeof(lua_Number)+sizeof(lu_int32))
+#else
+#define MAP_TVALUE   (2*sizeof(lua_Number))
+#endif
+
+#define MAP_RUNTIME  1                   /* string flags in the map table */
+#define MAP_NAME     2
+#define MAP_COUNTED  4
+
+enum { MAP_CODE, MAP_CONST, MAP_LINES, MAP_NAMES, MAP_STRINGS, MAP_N };
+
+typedef struct MapModule {
+ TString *name;
+ int size[MAP_N];
+} MapModule;
+
+static int maptable;               /* stack index of the string flag table */
+static int maplines;           /* line information strings in the ROstrt */
+
+/* Add flags to those of string ts, and return its previous flags */
+static int mapflags(lua_State* L, TString *ts, int flags)
+{
+ int old;
+ setsvalue2s(L,L->top,ts); incr_top(L);
+ lua_pushvalue(L,-1);
+ lua_rawget(L,maptable);
+ old=(int)lua_tointeger(L,-1);
+ lua_pop(L,1);
+ lua_pushinteger(L,old|flags);
+ lua_rawset(L,maptable);
+ return old;
+}
+
+/* Flag the strings of f and its subfunctions that the image will hold */
+static void mapscan(lua_State* L, const Proto* f)
+{
+ int i;
+ if (f->source) mapflags(L,f->source,MAP_RUNTIME);
+ for (i=0; i<f->sizek; i++)
+  if (ttisstring(f->k+i)) mapflags(L,rawtsvalue(f->k+i),MAP_RUNTIME);
+ for (i=0; i<f->sizeupvalues; i++)
+  if (f->upvalues[i]) mapflags(L,f->upvalues[i],MAP_NAME);
+ for (i=0; i<f->sizelocvars; i++)
+  if (f->locvars[i].varname) mapflags(L,f->locvars[i].varname,MAP_NAME);
+ for (i=0; i<f->sizep; i++)
+  mapscan(L,f->p[i]);
+}
+
+static void mapstring(lua_State* L, TString *ts, int *size)
+{
+ int flags;
+ if (ts==NULL) return;
+ flags=mapflags(L,ts,MAP_COUNTED);
+ if (!(flags & MAP_COUNTED))
+  size[(flags & MAP_RUNTIME) ? MAP_STRINGS : MAP_NAMES]+=MAP_STR(ts->tsv.len);
+}
+
+static void maprow(FILE* out, const char* label, const int *size)
+{
+ int i, total=0;
+ fprintf(out,"%-32s",label);
+ for (i=0; i<MAP_N; i++)
+ {
+  fprintf(out,"%8d",size[i]);
+  total+=size[i];
+ }
+ fprintf(out,"%8d\n",total);
+}
+
+/* Count f, adding it to size, and print its row if out is not NULL */
+static void mapproto(lua_State* L, FILE* out, const Proto* f, int *size)
+{
+ int fsize[MAP_N]={0};
+ int i;
+ fsize[MAP_CODE]=f->sizecode*MAP_PTR;
+ fsize[MAP_CONST]=MAP_PROTO+f->sizek*MAP_TVALUE+f->sizep*MAP_PTR;
+ if (f->packedlineinfo)
+ {
+  fsize[MAP_LINES]=MAP_STR(strlen(cast(const char *,f->packedlineinfo)));
+  maplines++;
+ }
+ fsize[MAP_NAMES]=f->sizelocvars*(MAP_PTR+8)+f->sizeupvalues*MAP_PTR;
+ for (i=0; i<f->sizeupvalues; i++)
+  mapstring(L,f->upvalues[i],fsize);
+ for (i=0; i<f->sizelocvars; i++)
+  mapstring(L,f->locvars[i].varname,fsize);
+ mapstring(L,f->source,fsize);
+ for (i=0; i<f->sizek; i++)
+  if (ttisstring(f->k+i)) mapstring(L,rawtsvalue(f->k+i),fsize);
+ if (out)
+ {
+  char label[32];
+  snprintf(label,sizeof(label),"  function at line %d",f->linedefined);
+  maprow(out,label,fsize);
+ }
+ for (i=0; i<MAP_N; i++)
+  size[i]+=fsize[i];
+}
+
+static void mapmodule(lua_State* L, FILE* out, const Proto* f, int *size)
+{
+ int i;
+ mapproto(L,out,f,size);
+ for (i=0; i<f->sizep; i++)
+  mapmodule(L,out,f->p[i],size);
+}
+
+static int mapcompare(const void* a, const void* b)
+{
+ const int *sa=cast(const MapModule *,a)->size;
+ const int *sb=cast(const MapModule *,b)->size;
+ int i, d=0;
+ for (i=0; i<MAP_N; i++)
+  d+=sb[i]-sa[i];
+ return d;
+}
+
+/*
+ * Write the map of f, which is either a single module or the main function
+ * that combine() made of the modules.
+ */
+static void sizemap(lua_State* L, const Proto* f)
+{
+ Proto* const* mod=cast(Proto* const*,&f);
+ int i, j, n=1, index=(f->source!=NULL &&
+                       strcmp(getstr(f->source),"=(" PROGNAME ")")==0);
+ int total[MAP_N]={0}, hashsave;
+ MapModule* m;
+ FILE* out=strcmp(mapfile,"-") ? fopen(mapfile,"w") : stdout;
+ if (out==NULL) fatal(lua_pushfstring(L,"cannot open %s",mapfile));
+ if (index)
+ {
+  mod=f->p;
+  n=f->sizep;
+ }
+ if (!lua_checkstack(L,n+4)) fatal("not enough stack for the size map");
+ lua_newtable(L);
+ maptable=lua_gettop(L);
+ mapscan(L,f);
+ m=cast(MapModule *,lua_newuserdata(L,(n+2)*sizeof(MapModule)));
+ memset(m,0,(n+2)*sizeof(MapModule));
+ maplines=0;
+ fprintf(out,"Estimated bytes in flash for each module and function\n\n"
+             "%-32s%8s%8s%8s%8s%8s%8s\n",
+             "","code","const","lines","names","strings","total");
+ for (i=0; i<n; i++)
+ {
+  m[i].name=corename(L,mod[i]->source);      /* anchored by f or the stack */
+  setsvalue2s(L,L->top,m[i].name); incr_top(L);
+  fprintf(out,"%s\n",getstr(m[i].name));
+  mapmodule(L,out,mod[i],m[i].size);
+ }
+ if (index)
+ {
+  m[n].name=luaS_newliteral(L,"(module index)");
+  setsvalue2s(L,L->top,m[n].name); incr_top(L);
+  mapproto(L,NULL,f,m[n++].size);
+ }
+ m[n].name=luaS_newliteral(L,"(string table)");   /* the ROstrt hash vector */
+ setsvalue2s(L,L->top,m[n].name); incr_top(L);
+ lua_pushnil(L);
+ for (i=maplines, j=0; lua_next(L,maptable)!=0; lua_pop(L,1))
+ {
+  i++;
+  if (lua_tointeger(L,-1) & MAP_RUNTIME) j++;
+ }
+ m[n++].size[MAP_STRINGS]=MAP_PTR*(2<<luaO_log2(i));
+ hashsave=MAP_PTR*((2<<luaO_log2(i))-(2<<luaO_log2(j)));
+ qsort(m,n,sizeof(MapModule),mapcompare);
+ fprintf(out,"\nModules by size\n");
+ for (i=0; i<n; i++)
+ {
+  maprow(out,getstr(m[i].name),m[i].size);
+  for (j=0; j<MAP_N; j++)
+   total[j]+=m[i].size[j];
+ }
+ maprow(out,"total",total);
+ fprintf(out,"\n");
+ if (G(L)->stripdefault>0)
+  fprintf(out,"The compiler strips %s (LUAI_OPTIMIZE_DEBUG %d)\n",
+          G(L)->stripdefault==1 ? "names" : "all debug information",
+          G(L)->stripdefault);
+ if (total[MAP_NAMES]+total[MAP_LINES]>0)
+  fprintf(out,"-s would save %d bytes of debug information\n",
+          total[MAP_NAMES]+total[MAP_LINES]+hashsave);
+ lua_settop(L,maptable-1);
+ if (out!=stdout && fclose(out))
+  fatal(lua_pushfstring(L,"cannot write %s",mapfile));
+}
+
 struct Smain {
  int argc;
  char** argv;
@@ -306,6 +521,8 @@ static int pmain(lua_State* L)
  }
  f=combine(L,argc + (execute ? 1: 0), lookup);
  if (listing) luaU_print(f,listing>1);
+ if (stripping) luaG_stripdebug(L,cast(Proto *,f),2,1);
+ if (mapfile) sizemap(L,f);
  if (dumping)
  {
   int result;
@@ -0,0 +1,1444 @@
+/*
+** Emulation of the NodeMCU firmware environment for the host build, which
+** `make EMU=1` links into nodemcu.emu instead of luac.cross.  The `-e` script
+** runs as init.lua would on the ESP, and then an event loop runs the posted
+** tasks, the timers and the socket callbacks until there are none left, so
+** that an application can be exercised and profiled on the host.
+**
+** The node, tmr, file and net modules emulated below cover the common API of
+** the firmware modules, with timers on the host clock, files in a host
+** directory and TCP sockets on host sockets.  A count hook tallies the Lua VM
+** instructions that each callback executes and converts them into ESP cycles
+** at a configurable cost per instruction, so that tmr.ccount() and the task
+** timings that are reported give an estimate of the time on the device.  See
+** the "Host Emulator" section of docs/lua53.md.
+*/
+#define lemu_c
+#define LUA_CORE
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lstate.h"
+#include "lnodemcu.h"
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define EMU_HOOKSTEP    100      /* VM instructions counted per hook call */
+#define EMU_CPI         80       /* default ESP cycles per VM instruction */
+#define EMU_WARN_US     10000    /* default task length that is reported */
+#define EMU_WDT_US      3200000  /* task length that trips the watchdog */
+#define EMU_QUEUELEN    8        /* as PLATFORM_TASK_QUEUE_LEN_xxx */
+#define EMU_FS_SIZE     0x300000
+#define EMU_NAMELEN     31       /* as FS_OBJ_NAME_LEN */
+#define EMU_READ_CHUNK  1024     /* as FILE_READ_CHUNK */
+#define EMU_TCP_MSS     1460
+#define EMU_TCP_SNDBUF  (2*EMU_TCP_MSS)
+#define EMU_MAX_TIMEOUT 0x68D7A3 /* the SDK limit on timer intervals */
+
+#define TIMER_MODE_SINGLE 0
+#define TIMER_MODE_AUTO   1
+#define TIMER_MODE_SEMI   2
+#define TIMER_MODE_OFF    3
+#define TIMER_IDLE_FLAG (1<<7)
+
+#define ERR_MEM   -1             /* the lwIP error codes passed to Lua */
+#define ERR_RTE   -4
+#define ERR_ABRT  -8
+#define ERR_RST   -9
+#define ERR_CONN  -11
+
+typedef struct emu_timer {
+  struct emu_timer *next;        /* in the list of armed timers */
+  uint64_t due;                  /* host time in us */
+  int lua_ref, self_ref;
+  uint32_t interval;
+  uint8_t mode;
+} emu_timer_t;
+
+enum { EMU_TCP_CLIENT, EMU_TCP_SERVER };
+enum { EMU_IDLE, EMU_CONNECTING, EMU_CONNECTED, EMU_LISTENING,
+       EMU_CLOSING, EMU_FAILED };
+enum { ON_CONNECTION, ON_RECONNECTION, ON_DISCONNECTION, ON_RECEIVE, ON_SENT,
+       ON_ACCEPT, EMU_EVENTS };
+
+static const char *const emu_events[] = {
+  "connection", "reconnection", "disconnection", "receive", "sent", NULL
+};
+
+typedef struct emu_sock {
+  struct emu_sock *next;         /* in the list of open sockets */
+  int fd, type, state, err, hold;
+  int self_ref;
+  int cb_ref[EMU_EVENTS];
+  char *out;                     /* data accepted by send() not yet written */
+  size_t outlen;
+} emu_sock_t;
+
+typedef struct {
+  int ref, prio;
+} emu_task_t;
+
+static struct {
+  lua_State *L;
+  emu_timer_t *timers;
+  emu_sock_t *socks;
+  emu_task_t queue[3][EMU_QUEUELEN];
+  int head[3], len[3];
+  uint64_t start;                /* host time at startup in us */
+  uint64_t instr;                /* VM instructions executed */
+  uint64_t busy;                 /* cycles spent in tmr.delay() */
+  uint64_t idle;                 /* host time spent waiting in us */
+  uint64_t taskstart, wdtstart;  /* cycle counts */
+  uint64_t maxtask;
+  char maxsrc[LUA_IDSIZE + 12];
+  unsigned long calls, warnings;
+  size_t used, peak, limit;      /* Lua heap in bytes */
+  unsigned cpi, freq, warn;
+  int incall, wdt, stop, status;
+  const char *root;
+} emu;
+
+static uint64_t emu_now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static uint64_t emu_cycles (void) {
+  return emu.instr*emu.cpi + emu.busy + emu.idle*emu.freq;
+}
+
+static unsigned emu_envint (const char *name, unsigned dflt) {
+  const char *s = getenv(name);
+  return s && *s ? (unsigned) strtoul(s, NULL, 0) : dflt;
+}
+
+
+/*
+** The Lua heap.  With NODEMCU_EMU_HEAP set, allocations fail once the heap
+** would exceed it, so that the emergency GC and out of memory errors can be
+** exercised as on the ESP.
+*/
+static void *emu_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  size_t old = ptr ? osize : 0;
+  void *p;
+  (void) ud;
+  if (nsize == 0) {
+    free(ptr);
+    emu.used -= old;
+    return NULL;
+  }
+  if (emu.limit && nsize > old && emu.used + nsize - old > emu.limit)
+    return NULL;
+  p = realloc(ptr, nsize);
+  if (p) {
+    emu.used += nsize - old;
+    if (emu.used > emu.peak)
+      emu.peak = emu.used;
+  }
+  return p;
+}
+
+LUAI_FUNC int luaE_freeheap (void) {
+  if (!emu.limit)
+    return MAX_INT;
+  return emu.used < emu.limit ? (int)(emu.limit - emu.used) : 0;
+}
+
+
+/*
+** Cost accounting.  The count hook is inherited by coroutines, so the
+** instructions of all threads are counted, EMU_HOOKSTEP at a time.
+*/
+static void emu_hook (lua_State *L, lua_Debug *ar) {
+  (void) ar;
+  emu.instr += EMU_HOOKSTEP;
+  if (emu.incall &&
+      (emu.wdt || emu_cycles() - emu.wdtstart > (uint64_t)EMU_WDT_US*emu.freq)) {
+    emu.wdt = 1;               /* repeated until the callback has unwound */
+    luaL_error(L, "watchdog timeout");
+  }
+}
+
+static int emu_traceback (lua_State *L) {
+  const char *msg = lua_tostring(L, 1);
+  if (msg == NULL)
+    msg = lua_pushfstring(L, "(error object is a %s value)", luaL_typename(L, 1));
+  luaL_traceback(L, L, msg, 1);
+  return 1;
+}
+
+/*
+** Report an error as the firmware does: call the node.setonerror() function,
+** or print the error and restart, which here ends the emulation.
+*/
+static void emu_onerror (lua_State *L) {
+  if (!emu.wdt) {
+    if (lua_getfield(L, LUA_REGISTRYINDEX, "onerror") == LUA_TFUNCTION) {
+      lua_insert(L, -2);
+      if (lua_pcall(L, 1, 0, 0) == LUA_OK)
+        return;
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+  fprintf(stderr, "%s\n", lua_tostring(L, -1));
+  fprintf(stderr, "emu: restart\n");
+  lua_pop(L, 1);
+  emu.stop = 1;
+  emu.status = 1;
+}
+
+/*
+** Call a callback of the event loop, with the function and narg arguments on
+** the stack, timing it in emulated cycles.
+*/
+static void emu_call (lua_State *L, int narg) {
+  lua_Debug ar;
+  uint64_t us;
+  int base = lua_gettop(L) - narg, status;
+  lua_pushvalue(L, base);
+  lua_getinfo(L, ">S", &ar);
+  lua_pushcfunction(L, emu_traceback);
+  lua_insert(L, base);
+  emu.calls++;
+  emu.incall = 1;
+  emu.taskstart = emu.wdtstart = emu_cycles();
+  status = lua_pcall(L, narg, 0, base);
+  emu.incall = 0;
+  lua_remove(L, base);
+  us = (emu_cycles() - emu.taskstart)/emu.freq;
+  if (us > emu.maxtask) {
+    emu.maxtask = us;
+    snprintf(emu.maxsrc, sizeof(emu.maxsrc), "%s:%d", ar.short_src, ar.linedefined);
+  }
+  if (emu.warn && us > emu.warn) {
+    emu.warnings++;
+    fprintf(stderr, "emu: callback at %s:%d ran for %lu us\n",
+            ar.short_src, ar.linedefined, (unsigned long) us);
+  }
+  if (status != LUA_OK)
+    emu_onerror(L);
+  emu.wdt = 0;
+}
+
+
+/* ===== node ===== */
+
+// Lua: node.task.post([priority], function)
+static int emu_node_post (lua_State *L) {
+  int n = 1, prio = LUA_TASK_MEDIUM, i;
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    prio = (int) luaL_checkinteger(L, 1);
+    luaL_argcheck(L, prio >= LUA_TASK_LOW && prio <= LUA_TASK_HIGH, 1,
+                  "invalid  priority");
+    n++;
+  }
+  luaL_checktype(L, n, LUA_TFUNCTION);
+  lua_settop(L, n);
+  if (emu.len[prio] == EMU_QUEUELEN)
+    return luaL_error(L, "Task queue overflow. Task not posted");
+  i = (emu.head[prio] + emu.len[prio]++) % EMU_QUEUELEN;
+  emu.queue[prio][i].ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  emu.queue[prio][i].prio = prio;
+  return 0;
+}
+
+// Lua: node.setonerror([function])
+static int emu_node_setonerror (lua_State *L) {
+  lua_settop(L, 1);
+  if (!lua_isfunction(L, 1)) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  lua_setfield(L, LUA_REGISTRYINDEX, "onerror");
+  return 0;
+}
+
+// Lua: node.heap()
+static int emu_node_heap (lua_State *L) {
+  lua_pushinteger(L, luaE_freeheap());
+  return 1;
+}
+
+// Lua: node.restart()
+static int emu_node_restart (lua_State *L) {
+  (void) L;
+  fprintf(stderr, "emu: restart\n");
+  emu.stop = 1;
+  return 0;
+}
+
+// Lua: node.getcpufreq()
+static int emu_node_getcpufreq (lua_State *L) {
+  lua_pushinteger(L, emu.freq);
+  return 1;
+}
+
+// Lua: node.setcpufreq(freq)
+static int emu_node_setcpufreq (lua_State *L) {
+  lua_Integer f = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, f == 80 || f == 160, 1, "invalid frequency");
+  emu.wdtstart = emu_cycles();    /* the emulated clock jumps, so restart */
+  emu.freq = (unsigned) f;
+  lua_pushinteger(L, emu.freq);
+  return 1;
+}
+
+// Lua: node.chipid()
+static int emu_node_chipid (lua_State *L) {
+  lua_pushinteger(L, 0xE3E3E3);
+  return 1;
+}
+
+// Lua: node.egc.setmode(mode[, param]), a no-op on the host
+static int emu_node_egc_setmode (lua_State *L) {
+  luaL_checkinteger(L, 1);
+  return 0;
+}
+
+LROT_BEGIN(emu_node_task, NULL, 0)
+  LROT_FUNCENTRY( post, emu_node_post )
+  LROT_NUMENTRY( LOW_PRIORITY, LUA_TASK_LOW )
+  LROT_NUMENTRY( MEDIUM_PRIORITY, LUA_TASK_MEDIUM )
+  LROT_NUMENTRY( HIGH_PRIORITY, LUA_TASK_HIGH )
+LROT_END(emu_node_task, NULL, 0)
+
+LROT_BEGIN(emu_node_egc, NULL, 0)
+  LROT_FUNCENTRY( setmode, emu_node_egc_setmode )
+  LROT_NUMENTRY( NOT_ACTIVE, 0 )
+  LROT_NUMENTRY( ON_ALLOC_FAILURE, 1 )
+  LROT_NUMENTRY( ON_MEM_LIMIT, 2 )
+  LROT_NUMENTRY( ALWAYS, 4 )
+LROT_END(emu_node_egc, NULL, 0)
+
+LROT_BEGIN(emu_node, NULL, 0)
+  LROT_FUNCENTRY( heap, emu_node_heap )
+  LROT_TABENTRY( task, emu_node_task )
+  LROT_TABENTRY( egc, emu_node_egc )
+  LROT_FUNCENTRY( setonerror, emu_node_setonerror )
+  LROT_FUNCENTRY( restart, emu_node_restart )
+  LROT_FUNCENTRY( chipid, emu_node_chipid )
+  LROT_NUMENTRY( CPU80MHZ, 80 )
+  LROT_NUMENTRY( CPU160MHZ, 160 )
+  LROT_FUNCENTRY( setcpufreq, emu_node_setcpufreq )
+  LROT_FUNCENTRY( getcpufreq, emu_node_getcpufreq )
+LROT_END(emu_node, NULL, 0)
+
+
+/* ===== tmr ===== */
+
+static void emu_timer_disarm (emu_timer_t *t) {
+  emu_timer_t **p;
+  for (p = &emu.timers; *p; p = &(*p)->next) {
+    if (*p == t) {
+      *p = t->next;
+      break;
+    }
+  }
+}
+
+static void emu_timer_arm (emu_timer_t *t) {
+  t->due = emu_now() + (uint64_t)t->interval*1000;
+  t->next = emu.timers;
+  emu.timers = t;
+}
+
+// Lua: t:register(interval, mode, function)
+static int emu_tmr_register (lua_State *L) {
+  emu_timer_t *t = (emu_timer_t *)luaL_checkudata(L, 1, "tmr.timer");
+  lua_Integer interval = luaL_checkinteger(L, 2);
+  lua_Integer mode = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, interval > 0 && interval <= EMU_MAX_TIMEOUT, 2, "Range: 1-6870947");
+  luaL_argcheck(L, mode == TIMER_MODE_SINGLE || mode == TIMER_MODE_SEMI ||
+                   mode == TIMER_MODE_AUTO, 3, "Invalid mode");
+  luaL_argcheck(L, lua_isfunction(L, 4), 4, "Must be function");
+  lua_pushvalue(L, 4);
+  if (!(t->mode & TIMER_IDLE_FLAG) && t->mode != TIMER_MODE_OFF)
+    emu_timer_disarm(t);
+  luaL_unref(L, LUA_REGISTRYINDEX, t->lua_ref);
+  t->lua_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  t->mode = (uint8_t) mode | TIMER_IDLE_FLAG;
+  t->interval = (uint32_t) interval;
+  return 0;
+}
+
+// Lua: t:start([restart])
+static int emu_tmr_start (lua_State *L) {
+  emu_timer_t *t = (emu_timer_t *)luaL_checkudata(L, 1, "tmr.timer");
+  int restart = lua_toboolean(L, 2), idle = t->mode & TIMER_IDLE_FLAG;
+  lua_settop(L, 1);
+  if (t->mode == TIMER_MODE_OFF) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  if (t->self_ref == LUA_NOREF)
+    t->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (!(idle || restart)) {
+    lua_pushboolean(L, 0);
+  } else {
+    if (!idle)
+      emu_timer_disarm(t);
+    t->mode &= ~TIMER_IDLE_FLAG;
+    emu_timer_arm(t);
+    lua_pushboolean(L, 1);
+  }
+  return 1;
+}
+
+// Lua: t:alarm(interval, mode, function)
+static int emu_tmr_alarm (lua_State *L) {
+  emu_tmr_register(L);
+  lua_settop(L, 1);
+  return emu_tmr_start(L);
+}
+
+// Lua: t:stop()
+static int emu_tmr_stop (lua_State *L) {
+  emu_timer_t *t = (emu_timer_t *)luaL_checkudata(L, 1, "tmr.timer");
+  int idle = t->mode == TIMER_MODE_OFF || (t->mode & TIMER_IDLE_FLAG);
+  luaL_unref(L, LUA_REGISTRYINDEX, t->self_ref);
+  t->self_ref = LUA_NOREF;
+  if (!idle)
+    emu_timer_disarm(t);
+  t->mode |= TIMER_IDLE_FLAG;
+  lua_pushboolean(L, !idle);
+  return 1;
+}
+
+// Lua: t:unregister()
+static int emu_tmr_unregister (lua_State *L) {
+  emu_timer_t *t = (emu_timer_t *)luaL_checkudata(L, 1, "tmr.timer");
+  luaL_unref(L, LUA_REGISTRYINDEX, t->self_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, t->lua_ref);
+  t->self_ref = t->lua_ref = LUA_NOREF;
+  if (!(t->mode & TIMER_IDLE_FLAG) && t->mode != TIMER_MODE_OFF)
+    emu_timer_disarm(t);
+  t->mode = TIMER_MODE_OFF;
+  return 0;
+}
+
+// Lua: t:interval(interval)
+static int emu_tmr_interval (lua_State *L) {
+  emu_timer_t *t = (emu_timer_t *)luaL_checkudata(L, 1, "tmr.timer");
+  lua_Integer interval = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, interval > 0 && interval <= EMU_MAX_TIMEOUT, 2, "Range: 1-6870947");
+  if (t->mode != TIMER_MODE_OFF) {
+    t->interval = (uint32_t) interval;
+    if (!(t->mode & TIMER_IDLE_FLAG)) {
+      emu_timer_disarm(t);
+      emu_timer_arm(t);
+    }
+  }
+  return 0;
+}
+
+// Lua: t:state()
+static int emu_tmr_state (lua_State *L) {
+  emu_timer_t *t = (emu_timer_t *)luaL_checkudata(L, 1, "tmr.timer");
+  if (t->mode == TIMER_MODE_OFF) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushboolean(L, (t->mode & TIMER_IDLE_FLAG) == 0);
+  lua_pushinteger(L, t->mode & ~TIMER_IDLE_FLAG);
+  return 2;
+}
+
+// Lua: tmr.create()
+static int emu_tmr_create (lua_State *L) {
+  emu_timer_t *t = (emu_timer_t *)lua_newuserdata(L, sizeof(*t));
+  luaL_getmetatable(L, "tmr.timer");
+  lua_setmetatable(L, -2);
+  *t = (emu_timer_t) {NULL, 0, LUA_NOREF, LUA_NOREF, 0, TIMER_MODE_OFF};
+  return 1;
+}
+
+// Lua: tmr.now()
+static int emu_tmr_now (lua_State *L) {
+  lua_pushinteger(L, (uint32_t)(0x7FFFFFFF & (emu_now() - emu.start)));
+  return 1;
+}
+
+// Lua: tmr.time()
+static int emu_tmr_time (lua_State *L) {
+  lua_pushinteger(L, (emu_now() - emu.start)/1000000);
+  return 1;
+}
+
+// Lua: tmr.ccount(), the emulated cycles: Lua run time plus idle time
+static int emu_tmr_ccount (lua_State *L) {
+  lua_pushinteger(L, (uint32_t) emu_cycles());
+  return 1;
+}
+
+// Lua: tmr.delay(us), a busy wait on the ESP so it is charged as run time
+static int emu_tmr_delay (lua_State *L) {
+  lua_Integer us = luaL_checkinteger(L, 1);
+  struct timespec ts;
+  luaL_argcheck(L, us > 0, 1, "wrong arg range");
+  ts.tv_sec = us/1000000;
+  ts.tv_nsec = (us%1000000)*1000;
+  nanosleep(&ts, NULL);
+  emu.busy += (uint64_t)us*emu.freq;
+  return 0;
+}
+
+// Lua: tmr.wdclr()
+static int emu_tmr_wdclr (lua_State *L) {
+  (void) L;
+  emu.wdtstart = emu_cycles();
+  return 0;
+}
+
+LROT_BEGIN(emu_tmr_dyn, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, emu_tmr_unregister )
+  LROT_TABENTRY( __index, emu_tmr_dyn )
+  LROT_FUNCENTRY( register, emu_tmr_register )
+  LROT_FUNCENTRY( alarm, emu_tmr_alarm )
+  LROT_FUNCENTRY( start, emu_tmr_start )
+  LROT_FUNCENTRY( stop, emu_tmr_stop )
+  LROT_FUNCENTRY( unregister, emu_tmr_unregister )
+  LROT_FUNCENTRY( state, emu_tmr_state )
+  LROT_FUNCENTRY( interval, emu_tmr_interval )
+LROT_END(emu_tmr_dyn, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(emu_tmr, NULL, 0)
+  LROT_FUNCENTRY( create, emu_tmr_create )
+  LROT_FUNCENTRY( now, emu_tmr_now )
+  LROT_FUNCENTRY( time, emu_tmr_time )
+  LROT_FUNCENTRY( ccount, emu_tmr_ccount )
+  LROT_FUNCENTRY( delay, emu_tmr_delay )
+  LROT_FUNCENTRY( wdclr, emu_tmr_wdclr )
+  LROT_NUMENTRY( ALARM_SINGLE, TIMER_MODE_SINGLE )
+  LROT_NUMENTRY( ALARM_SEMI, TIMER_MODE_SEMI )
+  LROT_NUMENTRY( ALARM_AUTO, TIMER_MODE_AUTO )
+LROT_END(emu_tmr, NULL, 0)
+
+/* Fire the earliest timer that is due, if any */
+static int emu_tmr_fire (lua_State *L, uint64_t now) {
+  emu_timer_t *t, *due = NULL;
+  for (t = emu.timers; t; t = t->next)
+    if (t->due <= now && (!due || t->due < due->due))
+      due = t;
+  if (!due)
+    return 0;
+  emu_timer_disarm(due);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, due->lua_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, due->self_ref);
+  if (due->mode == TIMER_MODE_AUTO) {
+    due->next = emu.timers;
+    emu.timers = due;
+    due->due += (uint64_t)due->interval*1000;
+    if (due->due <= now)
+      due->due = now + (uint64_t)due->interval*1000;
+  } else if (due->mode == TIMER_MODE_SINGLE) {
+    luaL_unref(L, LUA_REGISTRYINDEX, due->lua_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, due->self_ref);
+    due->lua_ref = due->self_ref = LUA_NOREF;
+    due->mode = TIMER_MODE_OFF;
+  } else {
+    due->mode |= TIMER_IDLE_FLAG;
+    luaL_unref(L, LUA_REGISTRYINDEX, due->self_ref);
+    due->self_ref = LUA_NOREF;
+  }
+  emu_call(L, 1);
+  return 1;
+}
+
+
+/* ===== file ===== */
+
+typedef struct {
+  FILE *f;
+} emu_file_t;
+
+static const char *emu_path (lua_State *L, int ndx) {
+  size_t l;
+  const char *name = luaL_checklstring(L, ndx, &l);
+  while (*name == '/')
+    name++, l--;
+  luaL_argcheck(L, l > 0 && l <= EMU_NAMELEN && strlen(name) == l &&
+                   !strstr(name, ".."), ndx, "filename invalid");
+  return lua_pushfstring(L, "%s/%s", emu.root, name);
+}
+
+static FILE *emu_getfile (lua_State *L, int *argpos) {
+  emu_file_t *ud;
+  if (lua_type(L, 1) == LUA_TUSERDATA) {
+    ud = (emu_file_t *)luaL_checkudata(L, 1, "file.obj");
+    *argpos = 2;
+  } else {
+    lua_getfield(L, LUA_REGISTRYINDEX, "file.default");
+    ud = (emu_file_t *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    *argpos = 1;
+  }
+  if (!ud || !ud->f)
+    luaL_error(L, "open a file first");
+  return ud->f;
+}
+
+// Lua: file.open(filename[, mode])
+static int emu_file_open (lua_State *L) {
+  const char *mode = luaL_optstring(L, 2, "r");
+  const char *path = emu_path(L, 1);
+  emu_file_t *ud;
+  FILE *f;
+  luaL_argcheck(L, strchr("rwa", mode[0]) && (!mode[1] ||
+                   (mode[1] == '+' && !mode[2])), 2, "invalid mode");
+  if ((f = fopen(path, mode)) == NULL)
+    return 0;
+  ud = (emu_file_t *)lua_newuserdata(L, sizeof(*ud));
+  ud->f = f;
+  luaL_getmetatable(L, "file.obj");
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, "file.default");
+  return 1;
+}
+
+// Lua: file.close(), fd:close()
+static int emu_file_close (lua_State *L) {
+  int argpos;
+  FILE *f = emu_getfile(L, &argpos);
+  emu_file_t *ud;
+  if (argpos == 1) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "file.default");
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, "file.default");
+  } else {
+    lua_pushvalue(L, 1);
+  }
+  ud = (emu_file_t *)lua_touserdata(L, -1);
+  ud->f = NULL;
+  fclose(f);
+  return 0;
+}
+
+static int emu_file_gc (lua_State *L) {
+  emu_file_t *ud = (emu_file_t *)luaL_checkudata(L, 1, "file.obj");
+  if (ud->f)
+    fclose(ud->f);
+  ud->f = NULL;
+  return 0;
+}
+
+static int emu_file_g_read (lua_State *L, FILE *f, size_t n, int end) {
+  luaL_Buffer b;
+  size_t i = 0;
+  int c = EOF;
+  luaL_buffinit(L, &b);
+  while (i < n && (c = getc(f)) != EOF) {
+    luaL_addchar(&b, c);
+    i++;
+    if (c == end)
+      break;
+  }
+  if (i == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// Lua: file.read([n or char]), fd:read([n or char])
+static int emu_file_read (lua_State *L) {
+  int argpos, end = EOF;
+  size_t n = EMU_READ_CHUNK, l;
+  FILE *f = emu_getfile(L, &argpos);
+  if (lua_type(L, argpos) == LUA_TNUMBER) {
+    n = (size_t) luaL_checkinteger(L, argpos);
+  } else if (lua_isstring(L, argpos)) {
+    const char *s = lua_tolstring(L, argpos, &l);
+    luaL_argcheck(L, l == 1, argpos, "wrong arg range");
+    end = (unsigned char) s[0];
+  }
+  return emu_file_g_read(L, f, n, end);
+}
+
+// Lua: file.readline(), fd:readline()
+static int emu_file_readline (lua_State *L) {
+  int argpos;
+  FILE *f = emu_getfile(L, &argpos);
+  return emu_file_g_read(L, f, EMU_READ_CHUNK, '\n');
+}
+
+static int emu_file_g_write (lua_State *L, const char *nl) {
+  int argpos;
+  size_t l;
+  FILE *f = emu_getfile(L, &argpos);
+  const char *s = luaL_checklstring(L, argpos, &l);
+  int ok = fwrite(s, 1, l, f) == l && (!nl || fputs(nl, f) >= 0);
+  if (ok)
+    lua_pushboolean(L, 1);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+// Lua: file.write(s), fd:write(s)
+static int emu_file_write (lua_State *L) {
+  return emu_file_g_write(L, NULL);
+}
+
+// Lua: file.writeline(s), fd:writeline(s)
+static int emu_file_writeline (lua_State *L) {
+  return emu_file_g_write(L, "\n");
+}
+
+// Lua: file.seek([whence[, offset]]), fd:seek([whence[, offset]])
+static int emu_file_seek (lua_State *L) {
+  static const int mode[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+  static const char *const modenames[] = {"set", "cur", "end", NULL};
+  int argpos;
+  FILE *f = emu_getfile(L, &argpos);
+  int op = luaL_checkoption(L, argpos, "cur", modenames);
+  long offset = (long) luaL_optinteger(L, argpos + 1, 0);
+  if (fseek(f, offset, mode[op]) != 0)
+    return 0;
+  lua_pushinteger(L, ftell(f));
+  return 1;
+}
+
+// Lua: file.flush(), fd:flush()
+static int emu_file_flush (lua_State *L) {
+  int argpos;
+  FILE *f = emu_getfile(L, &argpos);
+  if (fflush(f) == 0)
+    lua_pushboolean(L, 1);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+// Lua: file.exists(filename)
+static int emu_file_exists (lua_State *L) {
+  struct stat st;
+  lua_pushboolean(L, stat(emu_path(L, 1), &st) == 0 && S_ISREG(st.st_mode));
+  return 1;
+}
+
+// Lua: file.remove(filename)
+static int emu_file_remove (lua_State *L) {
+  remove(emu_path(L, 1));
+  return 0;
+}
+
+// Lua: file.rename(oldname, newname)
+static int emu_file_rename (lua_State *L) {
+  const char *from = emu_path(L, 1), *to = emu_path(L, 2);
+  struct stat st;
+  lua_pushboolean(L, stat(to, &st) != 0 && rename(from, to) == 0);
+  return 1;
+}
+
+// Lua: file.getcontents(filename)
+static int emu_file_getcontents (lua_State *L) {
+  FILE *f = fopen(emu_path(L, 1), "r");
+  luaL_Buffer b;
+  size_t n;
+  if (f == NULL)
+    return 0;
+  luaL_buffinit(L, &b);
+  do {
+    char *p = luaL_prepbuffer(&b);
+    n = fread(p, 1, LUAL_BUFFERSIZE, f);
+    luaL_addsize(&b, n);
+  } while (n == LUAL_BUFFERSIZE);
+  fclose(f);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// Lua: file.putcontents(filename, contents)
+static int emu_file_putcontents (lua_State *L) {
+  size_t l;
+  const char *path = emu_path(L, 1);
+  const char *s = luaL_checklstring(L, 2, &l);
+  FILE *f = fopen(path, "w");
+  int ok = f && fwrite(s, 1, l, f) == l;
+  if (f && fclose(f) != 0)
+    ok = 0;
+  if (ok)
+    lua_pushboolean(L, 1);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+// Lua: file.list([pattern])
+static int emu_file_list (lua_State *L) {
+  DIR *dir = opendir(emu.root);
+  struct dirent *e;
+  struct stat st;
+  int pattern = !lua_isnoneornil(L, 1);
+  if (pattern)
+    luaL_checkstring(L, 1);
+  lua_settop(L, 1);
+  lua_newtable(L);
+  if (dir == NULL)
+    return 1;
+  while ((e = readdir(dir)) != NULL) {
+    lua_pushfstring(L, "%s/%s", emu.root, e->d_name);
+    if (stat(lua_tostring(L, -1), &st) != 0 || !S_ISREG(st.st_mode)) {
+      lua_pop(L, 1);
+      continue;
+    }
+    lua_pop(L, 1);
+    if (pattern) {
+      lua_getfield(L, 1, "match");
+      lua_pushstring(L, e->d_name);
+      lua_pushvalue(L, 1);
+      lua_call(L, 2, 1);
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        continue;
+      }
+      lua_pop(L, 1);
+    }
+    lua_pushinteger(L, st.st_size);
+    lua_setfield(L, 2, e->d_name);
+  }
+  closedir(dir);
+  return 1;
+}
+
+// Lua: file.stat(filename)
+static int emu_file_stat (lua_State *L) {
+  struct stat st;
+  struct tm *tm;
+  if (stat(emu_path(L, 1), &st) != 0 || !S_ISREG(st.st_mode))
+    return 0;
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, st.st_size);
+  lua_setfield(L, -2, "size");
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "name");
+  lua_pushboolean(L, 0);
+  lua_setfield(L, -2, "is_dir");
+  tm = gmtime(&st.st_mtime);
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, tm->tm_year + 1900);
+  lua_setfield(L, -2, "year");
+  lua_pushinteger(L, tm->tm_mon + 1);
+  lua_setfield(L, -2, "mon");
+  lua_pushinteger(L, tm->tm_mday);
+  lua_setfield(L, -2, "day");
+  lua_pushinteger(L, tm->tm_hour);
+  lua_setfield(L, -2, "hour");
+  lua_pushinteger(L, tm->tm_min);
+  lua_setfield(L, -2, "min");
+  lua_pushinteger(L, tm->tm_sec);
+  lua_setfield(L, -2, "sec");
+  lua_setfield(L, -2, "time");
+  return 1;
+}
+
+// Lua: remaining, used, total = file.fsinfo()
+static int emu_file_fsinfo (lua_State *L) {
+  lua_Integer used = 0;
+  lua_settop(L, 0);
+  emu_file_list(L);                             /* the table is at 2 */
+  lua_pushnil(L);
+  while (lua_next(L, 2)) {
+    used += lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  }
+  if (used > EMU_FS_SIZE)
+    used = EMU_FS_SIZE;
+  lua_pushinteger(L, EMU_FS_SIZE - used);
+  lua_pushinteger(L, used);
+  lua_pushinteger(L, EMU_FS_SIZE);
+  return 3;
+}
+
+LROT_BEGIN(emu_file_obj, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, emu_file_gc )
+  LROT_TABENTRY( __index, emu_file_obj )
+  LROT_FUNCENTRY( close, emu_file_close )
+  LROT_FUNCENTRY( read, emu_file_read )
+  LROT_FUNCENTRY( readline, emu_file_readline )
+  LROT_FUNCENTRY( write, emu_file_write )
+  LROT_FUNCENTRY( writeline, emu_file_writeline )
+  LROT_FUNCENTRY( seek, emu_file_seek )
+  LROT_FUNCENTRY( flush, emu_file_flush )
+LROT_END(emu_file_obj, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(emu_file, NULL, 0)
+  LROT_FUNCENTRY( list, emu_file_list )
+  LROT_FUNCENTRY( open, emu_file_open )
+  LROT_FUNCENTRY( close, emu_file_close )
+  LROT_FUNCENTRY( write, emu_file_write )
+  LROT_FUNCENTRY( writeline, emu_file_writeline )
+  LROT_FUNCENTRY( read, emu_file_read )
+  LROT_FUNCENTRY( readline, emu_file_readline )
+  LROT_FUNCENTRY( remove, emu_file_remove )
+  LROT_FUNCENTRY( seek, emu_file_seek )
+  LROT_FUNCENTRY( flush, emu_file_flush )
+  LROT_FUNCENTRY( rename, emu_file_rename )
+  LROT_FUNCENTRY( exists, emu_file_exists )
+  LROT_FUNCENTRY( getcontents, emu_file_getcontents )
+  LROT_FUNCENTRY( putcontents, emu_file_putcontents )
+  LROT_FUNCENTRY( fsinfo, emu_file_fsinfo )
+  LROT_FUNCENTRY( stat, emu_file_stat )
+LROT_END(emu_file, NULL, 0)
+
+
+/* ===== net ===== */
+
+static emu_sock_t *emu_sock_new (lua_State *L, int type) {
+  emu_sock_t *s = (emu_sock_t *)lua_newuserdata(L, sizeof(*s));
+  int i;
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  s->type = type;
+  s->self_ref = LUA_NOREF;
+  for (i = 0; i < EMU_EVENTS; i++)
+    s->cb_ref[i] = LUA_NOREF;
+  luaL_getmetatable(L, type == EMU_TCP_SERVER ? "net.tcpserver" : "net.tcpsocket");
+  lua_setmetatable(L, -2);
+  return s;
+}
+
+static emu_sock_t *emu_sock_check (lua_State *L) {
+  emu_sock_t *s = (emu_sock_t *)luaL_testudata(L, 1, "net.tcpsocket");
+  if (!s)
+    s = (emu_sock_t *)luaL_checkudata(L, 1, "net.tcpserver");
+  return s;
+}
+
+/* Add a socket to the list polled by the event loop, holding a reference */
+static void emu_sock_open (lua_State *L, emu_sock_t *s, int ndx) {
+  fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+  if (s->self_ref == LUA_NOREF) {
+    lua_pushvalue(L, ndx);
+    s->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    s->next = emu.socks;
+    emu.socks = s;
+  }
+}
+
+/* Close the host socket and drop the socket from the list */
+static void emu_sock_release (lua_State *L, emu_sock_t *s) {
+  emu_sock_t **p;
+  if (s->fd >= 0)
+    close(s->fd);
+  s->fd = -1;
+  s->state = EMU_IDLE;
+  free(s->out);
+  s->out = NULL;
+  s->outlen = 0;
+  if (s->self_ref != LUA_NOREF) {
+    for (p = &emu.socks; *p; p = &(*p)->next) {
+      if (*p == s) {
+        *p = s->next;
+        break;
+      }
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, s->self_ref);
+    s->self_ref = LUA_NOREF;
+  }
+}
+
+/* Push the callback for event ev and the socket, or return 0 if none */
+static int emu_sock_pushcb (lua_State *L, emu_sock_t *s, int ev) {
+  if (s->cb_ref[ev] == LUA_NOREF || s->self_ref == LUA_NOREF)
+    return 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s->cb_ref[ev]);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s->self_ref);
+  return 1;
+}
+
+/* End a connection from the far side or on an error */
+static void emu_sock_end (lua_State *L, emu_sock_t *s, int err) {
+  int ev = err && s->cb_ref[ON_RECONNECTION] != LUA_NOREF ?
+           ON_RECONNECTION : ON_DISCONNECTION;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s->self_ref);     /* keep it until done */
+  if (emu_sock_pushcb(L, s, ev)) {
+    emu_sock_release(L, s);
+    lua_pushinteger(L, err);
+    emu_call(L, 2);
+  } else {
+    emu_sock_release(L, s);
+  }
+  lua_pop(L, 1);
+}
+
+static int emu_lwip_err (int e) {
+  switch (e) {
+    case ECONNREFUSED: return ERR_RST;
+    case ECONNRESET: return ERR_RST;
+    case ENETUNREACH: case EHOSTUNREACH: return ERR_RTE;
+    case ENOMEM: case ENOBUFS: return ERR_MEM;
+    default: return ERR_ABRT;
+  }
+}
+
+// Lua: net.createServer([type[, timeout]])
+static int emu_net_createServer (lua_State *L) {
+  luaL_argcheck(L, luaL_optinteger(L, 1, 1) == 1, 1, "only TCP is emulated");
+  emu_sock_new(L, EMU_TCP_SERVER);
+  return 1;
+}
+
+// Lua: net.createConnection([type[, secure]])
+static int emu_net_createConnection (lua_State *L) {
+  luaL_argcheck(L, luaL_optinteger(L, 1, 1) == 1, 1, "only TCP is emulated");
+  emu_sock_new(L, EMU_TCP_CLIENT);
+  return 1;
+}
+
+static int emu_net_resolve (const char *host, struct in_addr *a) {
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0)
+    return 0;
+  *a = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+  return 1;
+}
+
+// Lua: server:listen([port][, ip], function(socket))
+static int emu_net_listen (lua_State *L) {
+  emu_sock_t *s = (emu_sock_t *)luaL_checkudata(L, 1, "net.tcpserver");
+  struct sockaddr_in sa;
+  int stack = 2, one = 1;
+  const char *ip = "0.0.0.0";
+  if (s->fd >= 0)
+    return luaL_error(L, "already listening");
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  if (lua_type(L, stack) == LUA_TNUMBER)
+    sa.sin_port = htons((uint16_t) lua_tointeger(L, stack++));
+  if (lua_type(L, stack) == LUA_TSTRING)
+    ip = lua_tostring(L, stack++);
+  if (!inet_aton(ip, &sa.sin_addr))
+    return luaL_error(L, "invalid IP address");
+  if (!lua_isfunction(L, stack))
+    return luaL_error(L, "need callback");
+  lua_pushvalue(L, stack);
+  luaL_unref(L, LUA_REGISTRYINDEX, s->cb_ref[ON_ACCEPT]);
+  s->cb_ref[ON_ACCEPT] = luaL_ref(L, LUA_REGISTRYINDEX);
+  s->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (s->fd < 0)
+    return luaL_error(L, "cannot allocate PCB");
+  setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(s->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+      listen(s->fd, 4) != 0) {
+    close(s->fd);
+    s->fd = -1;
+    return luaL_error(L, "address in use");
+  }
+  s->state = EMU_LISTENING;
+  emu_sock_open(L, s, 1);
+  return 0;
+}
+
+// Lua: socket:connect(port, host)
+static int emu_net_connect (lua_State *L) {
+  emu_sock_t *s = (emu_sock_t *)luaL_checkudata(L, 1, "net.tcpsocket");
+  lua_Integer port = luaL_checkinteger(L, 2);
+  const char *host = luaL_checkstring(L, 3);
+  struct sockaddr_in sa;
+  if (s->fd >= 0 || s->state == EMU_FAILED)
+    return luaL_error(L, "already connected");
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons((uint16_t) port);
+  s->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (s->fd < 0)
+    return luaL_error(L, "cannot allocate PCB");
+  emu_sock_open(L, s, 1);
+  s->state = EMU_CONNECTING;
+  if (!emu_net_resolve(host, &sa.sin_addr)) {
+    s->state = EMU_FAILED;      /* reported from the event loop */
+    s->err = ERR_RTE;
+  } else if (connect(s->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 &&
+             errno != EINPROGRESS) {
+    s->state = EMU_FAILED;
+    s->err = emu_lwip_err(errno);
+  }
+  return 0;
+}
+
+// Lua: socket:on(event, function)
+static int emu_net_on (lua_State *L) {
+  emu_sock_t *s = (emu_sock_t *)luaL_checkudata(L, 1, "net.tcpsocket");
+  int ev = luaL_checkoption(L, 2, NULL, emu_events);
+  luaL_argcheck(L, lua_isfunction(L, 3) || lua_isnil(L, 3), 3, "expected function");
+  lua_settop(L, 3);
+  luaL_unref(L, LUA_REGISTRYINDEX, s->cb_ref[ev]);
+  s->cb_ref[ev] = lua_isnil(L, 3) ? LUA_NOREF : luaL_ref(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+// Lua: socket:send(data[, ...][, function(socket)])
+static int emu_net_send (lua_State *L) {
+  emu_sock_t *s = (emu_sock_t *)luaL_checkudata(L, 1, "net.tcpsocket");
+  int last = lua_gettop(L), i;
+  size_t len = 0;
+  while (last >= 2 && lua_isnil(L, last))
+    last--;
+  if (last >= 2 && lua_isfunction(L, last)) {
+    lua_pushvalue(L, last--);
+    luaL_unref(L, LUA_REGISTRYINDEX, s->cb_ref[ON_SENT]);
+    s->cb_ref[ON_SENT] = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  for (i = 2; i <= last; i++) {
+    size_t l;
+    luaL_checklstring(L, i, &l);
+    len += l;
+  }
+  if (len == 0)
+    return luaL_error(L, "no data to send");
+  if (s->state != EMU_CONNECTED)
+    return luaL_error(L, "not connected");
+  if (s->outlen + len > EMU_TCP_SNDBUF)
+    return luaL_error(L, "out of memory");      /* as ERR_MEM from tcp_write */
+  s->out = (char *)realloc(s->out, s->outlen + len);
+  if (s->out == NULL)
+    return luaL_error(L, "out of memory");
+  for (i = 2; i <= last; i++) {
+    size_t l;
+    const char *p = lua_tolstring(L, i, &l);
+    memcpy(s->out + s->outlen, p, l);
+    s->outlen += l;
+  }
+  return 0;
+}
+
+// Lua: socket:close(), server:close()
+static int emu_net_close (lua_State *L) {
+  emu_sock_t *s = emu_sock_check(L);
+  if (s->fd < 0 && s->state != EMU_FAILED)
+    return luaL_error(L, "not connected");
+  if (s->outlen && s->state == EMU_CONNECTED) {
+    s->state = EMU_CLOSING;       /* written out first, without callbacks */
+    return 0;
+  }
+  emu_sock_release(L, s);
+  return 0;
+}
+
+static int emu_net_gc (lua_State *L) {
+  emu_sock_t *s = emu_sock_check(L);
+  int i;
+  emu_sock_release(L, s);
+  for (i = 0; i < EMU_EVENTS; i++) {
+    luaL_unref(L, LUA_REGISTRYINDEX, s->cb_ref[i]);
+    s->cb_ref[i] = LUA_NOREF;
+  }
+  return 0;
+}
+
+static int emu_net_pushaddr (lua_State *L, emu_sock_t *s, int peer) {
+  struct sockaddr_in sa;
+  socklen_t l = sizeof(sa);
+  if (s->fd < 0 || (peer ? getpeername(s->fd, (struct sockaddr *)&sa, &l) :
+                           getsockname(s->fd, (struct sockaddr *)&sa, &l)) != 0) {
+    lua_pushnil(L);
+    lua_pushnil(L);
+    return 2;
+  }
+  lua_pushinteger(L, ntohs(sa.sin_port));
+  lua_pushstring(L, inet_ntoa(sa.sin_addr));
+  return 2;
+}
+
+// Lua: port, ip = socket:getpeer()
+static int emu_net_getpeer (lua_State *L) {
+  return emu_net_pushaddr(L, (emu_sock_t *)luaL_checkudata(L, 1, "net.tcpsocket"), 1);
+}
+
+// Lua: port, ip = socket:getaddr(), server:getaddr()
+static int emu_net_getaddr (lua_State *L) {
+  return emu_net_pushaddr(L, emu_sock_check(L), 0);
+}
+
+// Lua: socket:hold()
+static int emu_net_hold (lua_State *L) {
+  ((emu_sock_t *)luaL_checkudata(L, 1, "net.tcpsocket"))->hold = 1;
+  return 0;
+}
+
+// Lua: socket:unhold()
+static int emu_net_unhold (lua_State *L) {
+  ((emu_sock_t *)luaL_checkudata(L, 1, "net.tcpsocket"))->hold = 0;
+  return 0;
+}
+
+// Lua: net.dns.resolve(host, function(sk, ip)), called before it returns
+static int emu_net_dns_resolve (lua_State *L) {
+  const char *host = luaL_checkstring(L, 1);
+  struct in_addr a;
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_pushvalue(L, 2);
+  lua_pushnil(L);
+  if (emu_net_resolve(host, &a))
+    lua_pushstring(L, inet_ntoa(a));
+  else
+    lua_pushnil(L);
+  lua_call(L, 2, 0);
+  return 0;
+}
+
+LROT_BEGIN(emu_net_tcpserver, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, emu_net_gc )
+  LROT_TABENTRY( __index, emu_net_tcpserver )
+  LROT_FUNCENTRY( listen, emu_net_listen )
+  LROT_FUNCENTRY( getaddr, emu_net_getaddr )
+  LROT_FUNCENTRY( close, emu_net_close )
+LROT_END(emu_net_tcpserver, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(emu_net_tcpsocket, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, emu_net_gc )
+  LROT_TABENTRY( __index, emu_net_tcpsocket )
+  LROT_FUNCENTRY( connect, emu_net_connect )
+  LROT_FUNCENTRY( close, emu_net_close )
+  LROT_FUNCENTRY( on, emu_net_on )
+  LROT_FUNCENTRY( send, emu_net_send )
+  LROT_FUNCENTRY( hold, emu_net_hold )
+  LROT_FUNCENTRY( unhold, emu_net_unhold )
+  LROT_FUNCENTRY( getpeer, emu_net_getpeer )
+  LROT_FUNCENTRY( getaddr, emu_net_getaddr )
+LROT_END(emu_net_tcpsocket, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(emu_net_dns, NULL, 0)
+  LROT_FUNCENTRY( resolve, emu_net_dns_resolve )
+LROT_END(emu_net_dns, NULL, 0)
+
+LROT_BEGIN(emu_net, NULL, 0)
+  LROT_FUNCENTRY( createServer, emu_net_createServer )
+  LROT_FUNCENTRY( createConnection, emu_net_createConnection )
+  LROT_TABENTRY( dns, emu_net_dns )
+  LROT_NUMENTRY( TCP, 1 )
+  LROT_NUMENTRY( UDP, 2 )
+LROT_END(emu_net, NULL, 0)
+
+static void emu_net_accept (lua_State *L, emu_sock_t *srv) {
+  emu_sock_t *s;
+  int fd = accept(srv->fd, NULL, NULL);
+  if (fd < 0)
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, srv->cb_ref[ON_ACCEPT]);
+  s = emu_sock_new(L, EMU_TCP_CLIENT);
+  s->fd = fd;
+  s->state = EMU_CONNECTED;
+  emu_sock_open(L, s, -1);
+  lua_pushvalue(L, -1);
+  lua_insert(L, -3);                        /* keep the socket below the call */
+  emu_call(L, 1);
+  if (s->state == EMU_CONNECTED && emu_sock_pushcb(L, s, ON_CONNECTION))
+    emu_call(L, 1);
+  lua_pop(L, 1);
+}
+
+/* Handle the events of a socket that select() has reported */
+static void emu_net_event (lua_State *L, emu_sock_t *s, int rd, int wr) {
+  char buf[EMU_TCP_MSS];
+  ssize_t n;
+  if (s->state == EMU_LISTENING) {
+    if (rd)
+      emu_net_accept(L, s);
+    return;
+  }
+  if (s->state == EMU_CONNECTING && wr) {
+    int err = 0;
+    socklen_t l = sizeof(err);
+    getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &l);
+    if (err) {
+      emu_sock_end(L, s, emu_lwip_err(err));
+      return;
+    }
+    s->state = EMU_CONNECTED;
+    if (emu_sock_pushcb(L, s, ON_CONNECTION))
+      emu_call(L, 1);
+    return;
+  }
+  if (wr && s->outlen) {
+    n = write(s->fd, s->out, s->outlen);
+    if (n < 0 && errno != EAGAIN) {
+      emu_sock_end(L, s, emu_lwip_err(errno));
+      return;
+    }
+    if (n > 0) {
+      memmove(s->out, s->out + n, s->outlen - n);
+      s->outlen -= n;
+    }
+    if (s->outlen == 0) {
+      if (s->state == EMU_CLOSING) {
+        emu_sock_release(L, s);
+        return;
+      }
+      if (emu_sock_pushcb(L, s, ON_SENT))
+        emu_call(L, 1);
+    }
+  }
+  if (rd && s->state == EMU_CONNECTED) {
+    n = read(s->fd, buf, sizeof(buf));
+    if (n == 0 || (n < 0 && errno != EAGAIN)) {
+      emu_sock_end(L, s, n == 0 ? 0 : emu_lwip_err(errno));
+      return;
+    }
+    if (n > 0 && emu_sock_pushcb(L, s, ON_RECEIVE)) {
+      lua_pushlstring(L, buf, n);
+      emu_call(L, 2);
+    }
+  }
+}
+
+
+/* ===== emu ===== */
+
+// Lua: emu.stats()
+static int emu_stats (lua_State *L) {
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, emu.instr);
+  lua_setfield(L, -2, "instructions");
+  lua_pushinteger(L, emu.instr*emu.cpi + emu.busy);
+  lua_setfield(L, -2, "cycles");
+  lua_pushinteger(L, emu.calls);
+  lua_setfield(L, -2, "callbacks");
+  lua_pushinteger(L, emu.warnings);
+  lua_setfield(L, -2, "warnings");
+  lua_pushinteger(L, emu.maxtask);
+  lua_setfield(L, -2, "maxtask");
+  lua_pushstring(L, emu.maxsrc);
+  lua_setfield(L, -2, "maxsrc");
+  lua_pushinteger(L, emu.used);
+  lua_setfield(L, -2, "heap");
+  lua_pushinteger(L, emu.peak);
+  lua_setfield(L, -2, "peakheap");
+  return 1;
+}
+
+LROT_BEGIN(emu, NULL, 0)
+  LROT_FUNCENTRY( stats, emu_stats )
+LROT_END(emu, NULL, 0)
+
+LUALIB_API int luaopen_emu (lua_State *L) {
+  memset(&emu, 0, sizeof(emu));
+  emu.L = L;
+  emu.start = emu_now();
+  emu.cpi = emu_envint("NODEMCU_EMU_CPI", EMU_CPI);
+  emu.warn = emu_envint("NODEMCU_EMU_WARN", EMU_WARN_US);
+  emu.limit = emu_envint("NODEMCU_EMU_HEAP", 0);
+  emu.freq = 80;
+  emu.root = getenv("NODEMCU_EMU_FS");
+  if (!emu.root || !*emu.root)
+    emu.root = ".";
+  if (emu.cpi == 0)
+    emu.cpi = 1;
+  emu.used = emu.peak = (size_t)lua_gc(L, LUA_GCCOUNT, 0)*1024 +
+                        lua_gc(L, LUA_GCCOUNTB, 0);
+  lua_setallocf(L, emu_alloc, NULL);
+  lua_sethook(L, emu_hook, LUA_MASKCOUNT, EMU_HOOKSTEP);
+  luaL_rometatable(L, "tmr.timer", LROT_TABLEREF(emu_tmr_dyn));
+  luaL_rometatable(L, "file.obj", LROT_TABLEREF(emu_file_obj));
+  luaL_rometatable(L, "net.tcpserver", LROT_TABLEREF(emu_net_tcpserver));
+  luaL_rometatable(L, "net.tcpsocket", LROT_TABLEREF(emu_net_tcpsocket));
+  return 0;
+}
+
+
+/*
+** The event loop, which runs once the -e script has returned.  Each pass
+** waits for the sockets, or for the next timer if no task is queued, handles
+** the socket events and the due timers, and then runs the task at the head of
+** the highest priority queue.  It ends when nothing is left that could call
+** back into Lua, or on an error that would restart the ESP.
+*/
+LUALIB_API int luaE_loop (lua_State *L) {
+  while (!emu.stop) {
+    fd_set rd, wr;
+    struct timeval tv, *tvp = NULL;
+    emu_sock_t *s, *next;
+    emu_timer_t *t;
+    uint64_t now = emu_now(), due = 0, t0;
+    int prio, maxfd = -1, queued = emu.len[0] + emu.len[1] + emu.len[2], fired;
+    FD_ZERO(&rd);
+    FD_ZERO(&wr);
+    for (s = emu.socks; s; s = s->next) {
+      if (s->state == EMU_FAILED) {
+        queued = 1;             /* report it without waiting */
+        continue;
+      }
+      if (s->state == EMU_LISTENING || (s->state == EMU_CONNECTED && !s->hold))
+        FD_SET(s->fd, &rd);
+      if (s->state == EMU_CONNECTING || s->outlen)
+        FD_SET(s->fd, &wr);
+      if (s->fd > maxfd)
+        maxfd = s->fd;
+    }
+    for (t = emu.timers; t; t = t->next)
+      if (!due || t->due < due)
+        due = t->due;
+    if (!queued && !due && maxfd < 0)
+      break;
+    if (queued || due) {
+      uint64_t wait = queued || due <= now ? 0 : due - now;
+      tv.tv_sec = wait/1000000;
+      tv.tv_usec = wait%1000000;
+      tvp = &tv;
+    }
+    t0 = emu_now();
+    if (select(maxfd + 1, &rd, &wr, NULL, tvp) < 0 && errno != EINTR)
+      break;
+    now = emu_now();
+    emu.idle += now - t0;
+    for (s = emu.socks; s && !emu.stop; s = next) {
+      next = s->next;            /* s may be released by its callbacks */
+      if (s->state == EMU_FAILED) {
+        emu_sock_end(L, s, s->err);
+        break;                   /* the list may have changed */
+      }
+      if (s->fd >= 0 && (FD_ISSET(s->fd, &rd) || FD_ISSET(s->fd, &wr))) {
+        int r = FD_ISSET(s->fd, &rd), w = FD_ISSET(s->fd, &wr);
+        FD_CLR(s->fd, &rd);
+        FD_CLR(s->fd, &wr);
+        emu_net_event(L, s, r, w);
+        break;
+      }
+    }
+    for (fired = 0; fired < 8 && !emu.stop && emu_tmr_fire(L, now); fired++)
+      {}
+    for (prio = LUA_TASK_HIGH; prio >= LUA_TASK_LOW && !emu.stop; prio--) {
+      if (emu.len[prio]) {
+        emu_task_t task = emu.queue[prio][emu.head[prio]];
+        emu.head[prio] = (emu.head[prio] + 1) % EMU_QUEUELEN;
+        emu.len[prio]--;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, task.ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, task.ref);
+        lua_pushinteger(L, task.prio);
+        emu_call(L, 1);
+        break;
+      }
+    }
+  }
+  if (getenv("NODEMCU_EMU_STATS"))
+    fprintf(stderr, "emu: %lu callbacks, %llu instructions, %llu cycles, "
+            "longest %llu us at %s, peak heap %lu bytes\n", emu.calls,
+            (unsigned long long) emu.instr,
+            (unsigned long long) (emu.instr*emu.cpi + emu.busy),
+            (unsigned long long) emu.maxtask, emu.maxsrc[0] ? emu.maxsrc : "-",
+            (unsigned long) emu.peak);
+  return emu.status;
+}
@@ -21,10 +21,13 @@
 #include "lualib.h"
 #include "lauxlib.h"
 #include "ldebug.h"
+#include "llex.h"
 #include "lnodemcu.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "lstring.h"
+#include "ltm.h"
 #include "lundump.h"
 
 static void PrintFunction(const Proto* f, int full);
@@ -36,6 +39,8 @@ static void PrintFunction(const Proto* f, int full);
 static int listing=0;			/* list bytecodes? */
 static int dumping=1;			/* dump bytecodes? */
 static int stripping=0;			/* strip debug information? */
+static int optimizing=0;		/* minimise image size? */
+static int floatwarn=0;			/* warn of float arithmetic? */
 static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* progname=PROGNAME;	/* actual program name */
@@ -44,6 +49,11 @@ static lu_int32 address = 0;		/* output flash image at absolute location */
 static lu_int32 maxSize = 0x40000;	/* maximuum uncompressed image size */
 static int lookup = 0;			/* output lookup-style master combination header */
 static const char *execute;		/* executed a Lua file */
+#ifdef LUA_USE_EMU
+static int exitstatus = EXIT_SUCCESS;	/* of the emulated firmware */
+#endif
+static const char *strings;		/* file of strings to add to the ROstrt */
+static const char *mapfile;		/* file to write the size map to */
 char *LFSimageName;
 
 #define IROM0_SEG    0x40200000ul
@@ -80,8 +90,15 @@ static void usage(const char *message) {
                "convert an image to absolute format)\n"
     "  -i       generate lookup combination master (default with option -f)\n"
     "  -m size  maximum LFS image in bytes\n"
+    "  -M name  write a map of the bytes each module and function takes\n"
+    "           in flash to file 'name' ('-' for stdout)\n"
     "  -p       parse only\n"
-    "  -s       strip debug information\n"
+    "  -S name  add the strings listed one per line in file 'name' to the\n"
+    "           flash image's ROM string table\n"
+    "  -O       minimise image size: strip local and upvalue names and\n"
+    "           trim source file names to their base name\n"
+    "  -s       strip debug information (use -s -s to also strip line info)\n"
+    "  -W       warn of arithmetic that will use floats\n"
     "  -v       show version information\n"
     "  --       stop handling options\n"
     "  -        stop handling options and process stdin\n", progname, Output);
@@ -129,6 +146,10 @@ static int doargs(int argc, char *argv[]) {
       maxSize = strtol(argv[++i], NULL, 0);
       if (maxSize & 0xFFF)
         usage("\"-e\" maximum size must be a multiple of 4,096");
+    } else if (IS("-M")) {                                   /* size map file */
+      mapfile = argv[++i];
+      if (mapfile == NULL || *mapfile == 0)
+        usage("'-M' needs argument");
     } else if (IS("-o")) {                                     /* output file */
       output = argv[++i];
       if (output == NULL || *output == 0 || ( *output == '-' && output[1] != 0))
@@ -136,8 +157,17 @@ static int doargs(int argc, char *argv[]) {
       if (IS("-")) output = NULL;
     } else if (IS("-p")) {                                      /* parse only */
       dumping = 0;
+    } else if (IS("-O")) {                             /* minimise image size */
+      optimizing = 1;
+    } else if (IS("-S")) {                       /* strings to add to ROstrt */
+      strings = argv[++i];
+      if (strings == NULL || *strings == 0)
+        usage("'-S' needs argument");
     } else if (IS("-s")) {                         /* strip debug information */
-      stripping = 1;
+      if (stripping < 2)
+        stripping++;
+    } else if (IS("-W")) {                     /* warn of float arithmetic */
+      floatwarn = 1;
     } else if (IS("-v")) {                                    /* show version */
       ++version;
     } else {                                                /* unknown option */
@@ -145,6 +175,9 @@ static int doargs(int argc, char *argv[]) {
     }
   }
 
+  if (optimizing && stripping == 0)
+    stripping = 1;
+
   if (offset>0 && (output == NULL || LFSimageName == NULL ||
                    execute != NULL || i != argc))
     usage("'-a' also requires '-o' and '-f' options without lua source files");
@@ -259,6 +292,302 @@ static int dofile (lua_State *L, const char *name) {
   return status;
 }
 
+/*
+** Give f and its children with the same source the base name of the source
+** file, so each function doesn't carry the full path given on the command line
+** into the image.  The core names used for the LFS index are unchanged.
+*/
+static void basesource(Proto *f, TString *from, TString *to) {
+  int i;
+  if (f->source == from)
+    f->source = to;
+  for (i = 0; i < f->sizep; i++)
+    basesource(f->p[i], from, to);
+}
+
+static void trimsource(lua_State *L, Proto *f) {
+  const char *fn = getstr(f->source);
+  const char *s = strrchr(fn, '/');
+  if (!s) s = strrchr(fn, '\\');
+  if (*fn != '@' || !s)
+    return;
+  lua_pushfstring(L, "@%s", s + 1);
+  basesource(f, f->source, tsvalue(L->top - 1));
+  lua_pop(L, 1);  /* the string is now anchored by f */
+}
+
+/*
+** Warn of the arithmetic in f and its subfunctions that is certain to use
+** floats, and hence soft-float on the ESP8266: '/' and '^', which always
+** give a float result, and operations on float constants.
+*/
+static void floatwarnings(const Proto *f) {
+  const char *src = (f->source) ? getstr(f->source) : "=?";
+  int pc, i;
+  if (*src == '@' || *src == '=')
+    src++;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction in = f->code[pc];
+    const char *what = NULL;
+    switch (GET_OPCODE(in)) {
+      case OP_DIV:
+        what = "'/' always gives a float (use '//' for integer division)";
+        break;
+      case OP_POW:
+        what = "'^' always gives a float";
+        break;
+      case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_IDIV:
+        if ((ISK(GETARG_B(in)) && ttisfloat(&f->k[INDEXK(GETARG_B(in))])) ||
+            (ISK(GETARG_C(in)) && ttisfloat(&f->k[INDEXK(GETARG_C(in))])))
+          what = "arithmetic on a float constant";
+        break;
+      case OP_LOADK:
+        if (ttisfloat(&f->k[GETARG_Bx(in)]))
+          what = "float constant";
+        break;
+      default:
+        break;
+    }
+    if (what)
+      fprintf(stderr, "%s:%d: warning: %s\n", src, getfuncline(f, pc), what);
+  }
+  for (i = 0; i < f->sizep; i++)
+    floatwarnings(f->p[i]);
+}
+
+/*
+** Compile the list of strings in file fn into a Proto whose constants are
+** these strings, leaving its closure on the stack.  This is never dumped, but
+** just passes its strings to luaU_DumpAllProtos().
+*/
+static const Proto *loadstrings(lua_State *L, const char *fn) {
+  luaL_Buffer b;
+  char line[LUAI_MAXSHORTLEN + 2];
+  FILE *f = fopen(fn, "r");
+  if (f == NULL)
+    fatal(lua_pushfstring(L, "cannot open %s", fn));
+  luaL_buffinit(L, &b);
+  luaL_addstring(&b, "return{");
+  while (fgets(line, sizeof(line), f)) {
+    size_t i, l = strcspn(line, "\r\n");
+    if (line[l] == 0 && !feof(f)) {    /* longer than a short string, so skip */
+      int c;
+      while ((c = fgetc(f)) != EOF && c != '\n') {}
+      continue;
+    }
+    if (l == 0)
+      continue;
+    luaL_addchar(&b, '"');
+    for (i = 0; i < l; i++) {            /* escape as decimal byte values */
+      char esc[5];
+      sprintf(esc, "\\%03u", (unsigned char) line[i]);
+      luaL_addstring(&b, esc);
+    }
+    luaL_addstring(&b, "\",");
+  }
+  fclose(f);
+  luaL_addchar(&b, '}');
+  luaL_pushresult(&b);
+  if (luaL_loadbuffer(L, lua_tostring(L, -1), lua_rawlen(L, -1), "=S") != LUA_OK)
+    fatal(lua_tostring(L, -1));
+  lua_remove(L, -2);
+  return toproto(L, -1);
+}
+
+/*
+** Size map (-M).  Lists the bytes that each module and function takes in LFS
+** on the 32-bit target: its code; its constants, counting the Proto itself
+** and its vectors of upvalues and subfunctions; its line information; its
+** local variable names; and the strings that it uses.  Strings are shared
+** across the image, so each is counted against the first function that uses
+** it.  Note that luaU_DumpAllProtos() keeps the strings of the names that -s
+** strips.  These are estimates of the layout that the LFS loader builds, and
+** not the size of the compressed image file.
+*/
+#define MAP_PTR       4
+#define MAP_PROTO     76                        /* sizeof(Proto) on target */
+#define MAP_TSTRING   16                      /* sizeof(TString) on target */
+#define MAP_ROTABLE   16                       /* sizeof(ROTable) on target */
+#define MAP_TVALUE    (sizeof(lua_Number) > 4 ? 16 : 8)
+#define MAP_ROTENTRY  (sizeof(lua_Number) > 4 ? 24 : 12)
+#define MAP_STR(ts)   (MAP_TSTRING + ((tsslen(ts) + 1 + 3) & ~3))
+
+enum { MAP_CODE, MAP_CONST, MAP_LINES, MAP_NAMES, MAP_STRINGS, MAP_N };
+
+typedef struct MapModule {
+  const char *name;
+  int len;
+  int size[MAP_N];
+} MapModule;
+
+static int maptable;                /* stack index of the counted strings */
+static int mapstrip;          /* debug information level left in the image */
+
+/* Count string ts in size, unless an earlier function used it */
+static void mapstring (lua_State *L, TString *ts, int *size) {
+  if (ts == NULL)
+    return;
+  setsvalue2s(L, L->top, ts);
+  L->top++;
+  if (lua_rawget(L, maptable) == LUA_TNIL) {
+    size[MAP_STRINGS] += MAP_STR(ts);
+    setsvalue2s(L, L->top - 1, ts);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, maptable);
+  } else {
+    lua_pop(L, 1);
+  }
+}
+
+static void maprow (FILE *out, const char *label, int len, const int *size) {
+  int i, total = 0;
+  fprintf(out, "%-32.*s", len, label);
+  for (i = 0; i < MAP_N; i++) {
+    fprintf(out, "%8d", size[i]);
+    total += size[i];
+  }
+  fprintf(out, "%8d\n", total);
+}
+
+/* Count f, adding it to size, and print its row if out is not NULL */
+static void mapproto (lua_State *L, FILE *out, const Proto *f, int *size) {
+  int fsize[MAP_N] = {0};
+  int i;
+  fsize[MAP_CODE] = f->sizecode * MAP_PTR;
+  fsize[MAP_CONST] = MAP_PROTO + f->sizek * MAP_TVALUE +
+                     f->sizeupvalues * (MAP_PTR + 4) + f->sizep * MAP_PTR;
+  if (mapstrip < 2)
+    fsize[MAP_LINES] = (f->sizelineinfo + 3) & ~3;
+  if (mapstrip == 0)
+    fsize[MAP_NAMES] = f->sizelocvars * (MAP_PTR + 8);
+  mapstring(L, f->source, fsize);
+  for (i = 0; i < f->sizek; i++) {
+    if (ttisstring(f->k + i))
+      mapstring(L, tsvalue(f->k + i), fsize);
+  }
+  for (i = 0; i < f->sizeupvalues; i++)
+    mapstring(L, f->upvalues[i].name, fsize);
+  for (i = 0; i < f->sizelocvars; i++)
+    mapstring(L, f->locvars[i].varname, fsize);
+  if (out) {
+    char label[32];
+    snprintf(label, sizeof(label), "  function at line %d", f->linedefined);
+    maprow(out, label, sizeof(label), fsize);
+  }
+  for (i = 0; i < MAP_N; i++)
+    size[i] += fsize[i];
+}
+
+static void mapmodule (lua_State *L, FILE *out, const Proto *f, int *size) {
+  int i;
+  mapproto(L, out, f, size);
+  for (i = 0; i < f->sizep; i++)
+    mapmodule(L, out, f->p[i], size);
+}
+
+static int mapcompare (const void *a, const void *b) {
+  const int *sa = cast(const MapModule *, a)->size;
+  const int *sb = cast(const MapModule *, b)->size;
+  int i, d = 0;
+  for (i = 0; i < MAP_N; i++)
+    d += sb[i] - sa[i];
+  return d;
+}
+
+/*
+** Write the map of f, which is either a single module or the main function
+** that combine() made of the modules, and of the strings of s from -S.
+*/
+static void sizemap (lua_State *L, const Proto *f, const Proto *s) {
+  const Proto *const *mod = &f;
+  int i, j, n = 1, index = (f->source != NULL &&
+                     strcmp(getstr(f->source), "=(" PROGNAME ")") == 0);
+  int total[MAP_N] = {0};
+  const char *p;
+  MapModule *m;
+  FILE *out = strcmp(mapfile, "-") ? fopen(mapfile, "w") : stdout;
+  if (out == NULL)
+    fatal(lua_pushfstring(L, "cannot open %s", mapfile));
+  if (!lua_checkstack(L, 4))
+    fatal("not enough stack for the size map");
+  mapstrip = G(L)->stripdefault > stripping ? G(L)->stripdefault : stripping;
+  lua_newtable(L);
+  maptable = lua_gettop(L);
+  if (index) {
+    mod = cast(const Proto *const *, f->p);
+    n = f->sizep;
+  }
+  m = alloca((n + 4) * sizeof(MapModule));
+  memset(m, 0, (n + 4) * sizeof(MapModule));
+  fprintf(out, "Estimated bytes in flash for each module and function%s\n\n"
+               "%-32s%8s%8s%8s%8s%8s%8s\n", mapstrip == 0 ? "" :
+               mapstrip == 1 ? " (names stripped)" : " (all debug stripped)",
+               "", "code", "const", "lines", "names", "strings", "total");
+  m[n].name = "(fixed strings)";      /* as added by addFixedStrings() */
+  for (i = 0; (p = luaX_getstr(i, NULL)) != NULL; i++)
+    mapstring(L, luaS_new(L, p), m[n].size);
+  mapstring(L, G(L)->memerrmsg, m[n].size);
+  mapstring(L, luaS_new(L, LUA_ENV), m[n].size);
+  for (i = 0; (p = luaT_getstr(i)) != NULL; i++)
+    mapstring(L, luaS_new(L, p), m[n].size);
+  for (i = 0; i < n; i++) {
+    m[i].name = corename(L, mod[i]->source, &m[i].len);
+    fprintf(out, "%.*s\n", m[i].len, m[i].name);
+    mapmodule(L, out, mod[i], m[i].size);
+  }
+  n++;
+  if (index) {                   /* the index is a ROTable, not the Proto */
+    m[n].name = "(module index)";
+    m[n].size[MAP_CONST] = MAP_ROTABLE + (f->sizep + 1) * MAP_ROTENTRY;
+    mapstring(L, f->source, m[n].size);
+    for (i = 0; i < f->sizek; i++) {
+      if (ttisstring(f->k + i))
+        mapstring(L, tsvalue(f->k + i), m[n].size);
+    }
+    n++;
+  }
+  if (s) {
+    m[n].name = "(-S strings)";
+    for (i = 0; i < s->sizek; i++) {
+      if (ttisstring(s->k + i))
+        mapstring(L, tsvalue(s->k + i), m[n].size);
+    }
+    n++;
+  }
+  m[n].name = "(string table)";           /* the ROstrt hash of short strings */
+  lua_pushnil(L);
+  for (i = 0; lua_next(L, maptable) != 0; lua_pop(L, 1))
+    if (ttisshrstring(L->top - 2)) i++;
+  m[n++].size[MAP_STRINGS] = MAP_PTR << luaO_ceillog2(i);
+  for (i = 0; i < n; i++) {
+    if (m[i].len == 0)
+      m[i].len = strlen(m[i].name);
+  }
+  qsort(m, n, sizeof(MapModule), mapcompare);
+  fprintf(out, "\nModules by size\n");
+  for (i = 0; i < n; i++) {
+    maprow(out, m[i].name, m[i].len, m[i].size);
+    for (j = 0; j < MAP_N; j++)
+      total[j] += m[i].size[j];
+  }
+  maprow(out, "total", 5, total);
+  fprintf(out, "\n");
+  if (G(L)->stripdefault > stripping)
+    fprintf(out, "The compiler strips %s (LUAI_OPTIMIZE_DEBUG %d)\n",
+            G(L)->stripdefault == 1 ? "names" : "all debug information",
+            G(L)->stripdefault);
+  if (mapstrip == 0)
+    fprintf(out, "-s would save %d bytes of local variable names\n",
+            total[MAP_NAMES]);
+  if (mapstrip < 2)
+    fprintf(out, "-s -s would save %d bytes of %sline information\n",
+            total[MAP_NAMES] + total[MAP_LINES],
+            mapstrip == 0 ? "names and " : "");
+  lua_pop(L, 1);
+  if (out != stdout && fclose(out))
+    fatal(lua_pushfstring(L, "cannot write %s", mapfile));
+}
+
 /*
 ** This function is an inintended consequence of constraints in ltable.c
 ** rotable_findentry().  The file list generates a ROTable in LFS and the
@@ -285,27 +614,39 @@ static int pmain(lua_State *L) {
   int argc = (int) lua_tointeger(L, 1);
   char **argv = (char **) lua_touserdata(L, 2);
   char **filelist = alloca(argc * sizeof(char *));
-  const Proto *f;
+  const Proto *f, *s = NULL;
   int i, status;
-  if (!lua_checkstack(L, argc + 1))
+  if (!lua_checkstack(L, argc + 2))
     fatal("too many input files");
   if (execute || address) {
     luaL_openlibs(L);  /* the nodemcu open will throw to signal an LFS reload */
     status = dofile(L, execute);
+#ifdef LUA_USE_EMU
+    if (status == LUA_OK && luaE_loop(L))
+      status = LUA_ERRRUN;
+    if (status != LUA_OK)
+      exitstatus = EXIT_FAILURE;
+#endif
     if (status != LUA_OK)
       return 0;
   }
   if (argc == 0)
     return 0;
+  if (strings && flash)
+    s = loadstrings(L, strings);
   reorderfiles(L, argc, filelist, argv);
   for (i = 0; i < argc; i++) {
     const char *filename = IS("-") ? NULL : filelist[i];
     if (luaL_loadfile(L, filename) != LUA_OK)
       fatal(lua_tostring(L, -1));
-//TODO: if strip = 2, replace proto->source by basename
+    if (floatwarn)
+      floatwarnings(toproto(L, -1));
+    if (optimizing)
+      trimsource(L, toproto(L, -1));
   }
   f = combine(L, argc + (execute ? 1 : 0), lookup);
   if (listing) luaU_print(f, listing > 1);
+  if (mapfile) sizemap(L, f, s);
   if (dumping) {
     int result;
     FILE *D = (output == NULL) ? stdout : fopen(output, "wb");
@@ -314,7 +655,7 @@ static int pmain(lua_State *L) {
     if (flash) {
       UNUSED(address);
       UNUSED(maxSize);
-      result = luaU_DumpAllProtos(L, f, writer, &D, stripping);
+      result = luaU_DumpAllProtos(L, f, s, writer, &D, stripping);
     } else {
       result = luaU_dump(L, f, writer, cast(void *, &D), stripping);
     }
@@ -366,7 +707,11 @@ int main(int argc, char *argv[]) {
     lua_close(L);
     break;
   }
+#ifdef LUA_USE_EMU
+  return exitstatus;
+#else
   return EXIT_SUCCESS;
+#endif
 }
 
 /*
@@ -1143,6 +1143,22 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       break;
     }
 
+    case LUA_GCSETSTEPTIME: {
+      res = g->gcsteptime;
+      g->gcsteptime = (data > 0) ? data : 0;
+      break;
+    }
+    case LUA_GCSETSTACKINIT: {
+      res = g->stackinit;
+      if (data > 0)
+        g->stackinit = (data < MIN_STACK_INIT) ? MIN_STACK_INIT :
+                       (data > LUAI_MAXSTACK) ? LUAI_MAXSTACK : data;
+      break;
+    }
+    case LUA_GCSTACKCOUNT: {
+      res = cast_int(g->stackbytes);
+      break;
+    }
     case LUA_GCISRUNNING: {
       res = g->gcrunning;
       break;
@@ -32,6 +32,7 @@
 
 #ifdef LUA_USE_ESP
 #include "platform.h"
+#include "platform_trace.h"
 #include "user_interface.h"
 #ifdef LUA_USE_ESP8266
 #include "vfs.h"
@@ -1180,7 +1181,9 @@ LUALIB_API int luaL_pcallx (lua_State *L, int narg, int nres) {
   int base = lua_gettop(L) - narg;                          /* function index */
   lua_pushcfunction(L, errhandler);                   /* push message handler */
   lua_insert(L, base);                      /* put it under function and args */
+  PLATFORM_TRACE_EVENT(TRACE_LUA_CB, narg, base);
   status = lua_pcall(L, narg, nres, base);
+  PLATFORM_TRACE_EVENT(TRACE_LUA_CB_DONE, status, base);
   lua_remove(L, base);               /* remove message handler from the stack */
   if (status != LUA_OK && status != LUA_ERRRUN) {  
     lua_gc(L, LUA_GCCOLLECT, 0);   /* call onerror directly if handler failed */
@@ -288,9 +288,43 @@ extern void dbg_printf(const char *fmt, ...);
 LUALIB_API int  (luaL_pushlfsmodules) (lua_State *L);
 LUALIB_API int  (luaL_pushlfsdts) (lua_State *L);
 LUALIB_API void (luaL_lfsreload) (lua_State *L);
+LUALIB_API int  (luaL_lfsload) (lua_State *L);
+LUALIB_API int  (luaL_lfsrollback) (lua_State *L);
 LUALIB_API int  (luaL_posttask) (lua_State* L, int prio);
 LUALIB_API int  (luaL_pcallx) (lua_State *L, int narg, int nres);
 
+/*
+** A callback slot holds a value, usually an event callback or the self
+** userdata passed to it, anchored in the registry together with a copy of
+** the value itself, so that events push it without a registry lookup.
+** Only change a slot through these functions.
+*/
+typedef struct luaL_Slot {
+  int ref;        /* registry anchor, LUA_NOREF if empty */
+  int tt;         /* type tag of the copy, LUA_TNONE to use the anchor */
+  void *p;        /* the copied value */
+} luaL_Slot;
+
+#define LUAL_SLOT_INIT      {LUA_NOREF, LUA_TNONE, NULL}
+#define luaL_slotisset(s)   ((s)->ref != LUA_NOREF)
+
+LUALIB_API void (luaL_setslot) (lua_State *L, luaL_Slot *s);
+LUALIB_API void (luaL_unsetslot) (lua_State *L, luaL_Slot *s);
+LUALIB_API void (luaL_pushslot) (lua_State *L, const luaL_Slot *s);
+LUALIB_API int  (luaL_callslot) (lua_State *L, const luaL_Slot *fn,
+                                 const luaL_Slot *self, int narg);
+
+/*
+** Long running C functions can be split into slices.  At a convenient point
+** the function asks luaL_sliceexpired() whether the current task has run for
+** its time slice, and if it has returns luaL_yieldslice(), which yields the
+** running coroutine and posts a task to resume it, carrying on in k.  Outside
+** a coroutine nothing can be suspended, so the soft watchdog is fed instead.
+*/
+LUALIB_API int  (luaL_sliceexpired) (lua_State *L);
+LUALIB_API int  (luaL_yieldslice) (lua_State *L, lua_KContext ctx,
+                                   lua_KFunction k);
+
 #define luaL_pushlfsmodule(l) lua_pushlfsfunc(L)
 
 /* }============================================================ */
@@ -172,10 +172,11 @@ static int luaB_rawset (lua_State *L) {
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul", "setmemlimit",
-    "isrunning", NULL};
+    "isrunning", "setsteptime", "setstackinit", "stackcount", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCSETMEMLIMIT, LUA_GCISRUNNING, LUA_GCSETSTEPTIME,
+    LUA_GCSETSTACKINIT, LUA_GCSTACKCOUNT};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   int ex = (int)luaL_optinteger(L, 2, 0);
   int res = lua_gc(L, o, ex);
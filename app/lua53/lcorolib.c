@@ -147,6 +147,59 @@ static int luaB_corunning (lua_State *L) {
   return 2;
 }
 
+
+/*
+** NodeMCU extension: coroutine.await(f, ...) calls f(..., cb) and suspends
+** the running coroutine until the callback cb is called, then returns the
+** arguments passed to cb.  The pending operation holds just the coroutine
+** rather than a chain of closures.  cb is one-shot, and the resume is posted
+** as a task so that it never nests inside the C callback which invoked cb.
+*/
+static int auxawake (lua_State *L) {
+  int n = (int)lua_tointeger(L, lua_upvalueindex(1));
+  lua_State *co = lua_tothread(L, lua_upvalueindex(2));
+  int i;
+  lua_settop(L, 0);  /* discard task priority */
+  luaL_checkstack(L, n, "too many arguments to resume");
+  for (i = 1; i <= n; i++)
+    lua_pushvalue(L, lua_upvalueindex(i + 2));
+  if (auxresume(L, co, n) < 0)
+    return lua_error(L);  /* propagate error to the task handler */
+  return 0;
+}
+
+
+static int auxwake (lua_State *L) {
+  int n = lua_gettop(L);
+  if (lua_isnil(L, lua_upvalueindex(1)))
+    return 0;  /* coroutine already woken */
+  luaL_argcheck(L, n <= 253, 254, "too many arguments");
+  lua_pushinteger(L, n);
+  lua_insert(L, 1);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 2);
+  lua_pushnil(L);
+  lua_replace(L, lua_upvalueindex(1));
+  lua_pushcclosure(L, auxawake, n + 2);
+  if (luaL_posttask(L, LUA_TASK_MEDIUM) < 0) {  /* no tasks on host builds */
+    lua_pushinteger(L, LUA_TASK_MEDIUM);
+    lua_call(L, 1, 0);
+  }
+  return 0;
+}
+
+
+static int luaB_await (lua_State *L) {
+  int n = lua_gettop(L);
+  luaL_checkany(L, 1);
+  if (!lua_isyieldable(L))
+    return luaL_error(L, "attempt to await outside a coroutine");
+  lua_pushthread(L);
+  lua_pushcclosure(L, auxwake, 1);
+  lua_call(L, n, 0);  /* f(..., cb) */
+  return lua_yield(L, 0);  /* results are the arguments of cb */
+}
+
 LROT_BEGIN(co_funcs, NULL, 0)
   LROT_FUNCENTRY( create, luaB_cocreate )
   LROT_FUNCENTRY( resume, luaB_coresume )
@@ -155,5 +208,6 @@ LROT_BEGIN(co_funcs, NULL, 0)
   LROT_FUNCENTRY( wrap, luaB_cowrap )
   LROT_FUNCENTRY( yield, luaB_yield )
   LROT_FUNCENTRY( isyieldable, luaB_yieldable)
+  LROT_FUNCENTRY( await, luaB_await )
 LROT_END(co_funcs, NULL, 0)
 
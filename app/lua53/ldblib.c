@@ -58,6 +58,13 @@ static int db_getstrings (lua_State *L) {
   return 1;
 }
 
+static int db_strprofile (lua_State *L) {
+  if (lua_isnoneornil(L, 1))
+    return lua_pushstringprofile(L);
+  lua_stringprofile(L, luaL_checkinteger(L, 1));
+  return 0;
+}
+
 static int db_getmetatable (lua_State *L) {
   luaL_checkany(L, 1);
   if (!lua_getmetatable(L, 1)) {
@@ -451,6 +458,7 @@ LROT_BEGIN(dblib, NULL, 0)
   LROT_FUNCENTRY( getlocal, db_getlocal )
   LROT_FUNCENTRY( getregistry, db_getregistry )
   LROT_FUNCENTRY( getstrings, db_getstrings )
+  LROT_FUNCENTRY( strprofile, db_strprofile )
   LROT_FUNCENTRY( getmetatable, db_getmetatable )
   LROT_FUNCENTRY( getupvalue, db_getupvalue )
   LROT_FUNCENTRY( upvaluejoin, db_upvaluejoin )
@@ -184,6 +184,7 @@ void luaD_reallocstack (lua_State *L, int newsize) {
   lua_assert(newsize <= LUAI_MAXSTACK || newsize == ERRORSTACKSIZE);
   lua_assert(L->stack_last - L->stack == L->stacksize - EXTRA_STACK);
   luaM_reallocvector(L, L->stack, L->stacksize, newsize, TValue);
+  G(L)->stackbytes += (newsize - L->stacksize) * sizeof(TValue);
   for (; lim < newsize; lim++)
     setnilvalue(L->stack + lim); /* erase new segment */
   L->stacksize = newsize;
@@ -241,6 +242,18 @@ void luaD_shrinkstack (lua_State *L) {
 }
 
 
+/*
+** A suspended coroutine would otherwise keep its stack at the largest size
+** that it needed until the next GC cycle, so it is shrunk when it yields if
+** it has grown past the initial size and less than half of it is in use.
+*/
+static void shrinkidlestack (lua_State *L) {
+  if (L->stacksize > G(L)->stackinit && L->stacksize <= LUAI_MAXSTACK &&
+      2 * (stackinuse(L) + 2*EXTRA_STACK) < L->stacksize)
+    luaD_shrinkstack(L);
+}
+
+
 void luaD_inctop (lua_State *L) {
   luaD_checkstack(L, 1);
   L->top++;
@@ -679,6 +692,8 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
       L->ci->top = L->top;
     }
     else lua_assert(status == L->status);  /* normal end or yield */
+    if (status == LUA_YIELD)
+      shrinkidlestack(L);
   }
   L->nny = oldnny;  /* restore 'nny' */
   L->nCcalls--;
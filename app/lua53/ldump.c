@@ -11,6 +11,7 @@
 
 
 #include <stddef.h>
+#include <string.h>
 
 #include "lua.h"
 #include "lapi.h"
@@ -31,6 +32,10 @@ typedef struct {
   void *data;
   int strip;
   int status;
+  int useRefs;          /* repeated strings are dumped as LUAU_TSTRREF */
+  struct StrRef *refs;  /* hash of the strings dumped so far */
+  int sizerefs;
+  int nrefs;
 #ifdef LUA_USE_HOST
   int useStrRefs;
   Table *stringIndex;
@@ -117,6 +122,53 @@ static void DumpIntTT (lu_byte tt, lua_Integer y, DumpState *D) {
 #define DumpInteger(i, D)  DumpIntTT(LUAU_TNUMPINT, i, D);
 
 
+/*
+** Any repeats of a string in a standard dump are written as a LUAU_TSTRREF
+** index to its first copy, as the loader keeps a list of the strings loaded.
+** While dumping, all strings are reachable from the Proto, so the strings
+** dumped are hashed by address in a plain vector; this can't be a Table on
+** the stack as the writer often uses the stack for a luaL_Buffer.
+*/
+struct StrRef {
+  const TString *s;
+  int ndx;
+};
+
+#define refhash(s,D) ((cast(size_t, (s)) >> 3) & ((D)->sizerefs - 1))
+
+static int findStrRef (const TString *s, DumpState *D) {
+  size_t i;
+  if (!D->refs)   /* also when not useRefs */
+    return -1;
+  for (i = refhash(s, D); D->refs[i].s; i = (i + 1) & (D->sizerefs - 1)) {
+    if (D->refs[i].s == s)
+      return D->refs[i].ndx;
+  }
+  return -1;
+}
+
+static void addStrRef (const TString *s, DumpState *D) {
+  size_t i;
+  if (2 * (D->nrefs + 1) > D->sizerefs) {  /* keep the hash at most half full */
+    struct StrRef *old = D->refs;
+    int j, oldsize = D->sizerefs;
+    D->sizerefs = oldsize ? 2 * oldsize : 64;
+    D->refs = luaM_newvector(D->L, D->sizerefs, struct StrRef);
+    memset(D->refs, 0, D->sizerefs * sizeof(struct StrRef));
+    for (j = 0; j < oldsize; j++) {
+      if (old[j].s) {
+        for (i = refhash(old[j].s, D); D->refs[i].s; i = (i + 1) & (D->sizerefs - 1)) {}
+        D->refs[i] = old[j];
+      }
+    }
+    luaM_freearray(D->L, old, oldsize);
+  }
+  for (i = refhash(s, D); D->refs[i].s; i = (i + 1) & (D->sizerefs - 1)) {}
+  D->refs[i].s = s;
+  D->refs[i].ndx = D->nrefs++;
+}
+
+
 /*
 ** Strings are stored in LFS uniquely, any string references use this index.
 ** The table at D->stringIndex is used to lookup this unique index.
@@ -136,8 +188,15 @@ static void DumpString (const TString *s, DumpState *D) {
       return;
     }
 #endif
+    int ndx = findStrRef(s, D);
+    if (ndx >= 0) {
+      DumpIntTT(LUAU_TSTRREF, ndx, D);
+      return;
+    }
     DumpIntTT(tt, l + 1, D);   /* include trailing '\0' */
     DumpVector(str, l, D);  /* no need to save '\0' */
+    if (D->useRefs)
+      addStrRef(s, D);
   }
 }
 
@@ -259,9 +318,11 @@ int luaU_dump (lua_State *L, const Proto *f, lua_Writer w, void *data,
   D.writer = w;
   D.data = data;
   D.strip = strip;
+  D.useRefs = 1;
   DumpHeader(&D, LUAC_FORMAT);
   DumpByte(f->sizeupvalues, &D);
   DumpFunction(f, NULL, &D);
+  luaM_freearray(L, D.refs, D.sizerefs);
   return D.status;
 }
 
@@ -418,9 +479,12 @@ static void scanProtoStrings(const Proto *f, DumpState *D) {
 ** into the image.  The Proto main itself is not callable; it is used as the
 ** image Proto index and only contains a Proto vector and a constant vector
 ** where each constant in the string names the corresponding Proto.
+**
+** The strings of the optional Proto s are also added to the image, though s
+** itself isn't dumped.  These are strings to preload into the ROstrt.
 */
-int luaU_DumpAllProtos(lua_State *L, const Proto *m, lua_Writer w,
-                       void *data, int strip) {
+int luaU_DumpAllProtos(lua_State *L, const Proto *m, const Proto *s,
+                       lua_Writer w, void *data, int strip) {
   DumpState D = {0};
   D.L = L;
   D.writer = w;
@@ -435,6 +499,8 @@ int luaU_DumpAllProtos(lua_State *L, const Proto *m, lua_Writer w,
   /* Add fixed strings + strings used in the Protos, then swap fixed/added blocks */
   addFixedStrings(&D);
   scanProtoStrings(m, &D);
+  if (s)
+    scanProtoStrings(s, &D);
   /* Dump out all non-fixed strings */
   DumpLiteral(LUA_STRING_SIG, &D);
   DumpLFSstrings(&D);
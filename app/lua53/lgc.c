@@ -21,9 +21,11 @@
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
+#include "platform_trace.h"
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "lnodemcu.h"
 
 
 /*
@@ -437,21 +439,47 @@ static int traverseephemeron (global_State *g, Table *h) {
 }
 
 
+/*
+** A table that has held many entries keeps its parts when they are all
+** removed, as tables are only resized when a key is added.  So the parts
+** of a table found empty by two traversals, with no key added between
+** them, are released.  Not in an emergency collection, which may be
+** running inside a resize of the very table.
+*/
+static void checkemptytable (global_State *g, Table *h, int empty) {
+  if (!empty)
+    h->flags &= cast_byte(~TBL_EMPTYSEEN);
+  else if (h->sizearray == 0 && isdummy(h))
+    return;  /* nothing to release */
+  else if (!(h->flags & TBL_EMPTYSEEN))
+    h->flags |= TBL_EMPTYSEEN;
+  else if (g->gckind != KGC_EMERGENCY)
+    luaH_release(g->mainthread, h);
+}
+
+
 static void traversestrongtable (global_State *g, Table *h) {
   Node *n, *limit = gnodelast(h);
   unsigned int i;
-  for (i = 0; i < h->sizearray; i++)  /* traverse array part */
-    markvalue(g, &h->array[i]);
+  int empty = 1;
+  for (i = 0; i < h->sizearray; i++) {  /* traverse array part */
+    if (!ttisnil(&h->array[i])) {
+      empty = 0;
+      markvalue(g, &h->array[i]);
+    }
+  }
   for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
       removeentry(n);  /* remove it */
     else {
       lua_assert(!ttisnil(gkey(n)));
+      empty = 0;
       markvalue(g, gkey(n));  /* mark key */
       markvalue(g, gval(n));  /* mark value */
     }
   }
+  checkemptytable(g, h, empty);
 }
 
 
@@ -785,7 +813,8 @@ static GCObject **sweeptolive (lua_State *L, GCObject **p) {
 static void checkSizes (lua_State *L, global_State *g) {
   if (g->gckind != KGC_EMERGENCY) {
     l_mem olddebt = g->GCdebt;
-    if (g->strt.nuse < g->strt.size / 4)  /* string table too big? */
+    if (cast(l_mem, g->strt.nuse) * 400 <    /* string table too big? */
+        cast(l_mem, g->strt.size) * LUA_STRTAB_LOAD)
       luaS_resize(L, g->strt.size / 2);  /* shrink it a little */
     g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
   }
@@ -1131,7 +1160,10 @@ static l_mem getdebt (global_State *g) {
 }
 
 /*
-** performs a basic GC step when collector is running
+** performs a basic GC step when collector is running.  If 'gcsteptime' is
+** set, the step stops once it has run for that many microseconds, and any
+** work still owed is handed to an idle task so that long steps don't land
+** in the middle of time critical callbacks.
 */
 #ifdef LUA_USE_ESP8266 /*DEBUG*/
 extern void dbg_printf(const char *fmt, ...);
@@ -1143,18 +1175,27 @@ extern void dbg_printf(const char *fmt, ...);
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
   l_mem debt = getdebt(g);  /* GC deficit (be paid now) */
+  lu_int32 start = g->gcsteptime ? luaN_clock() : 0;
   if (!g->gcrunning) {  /* not running? */
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  PLATFORM_TRACE_EVENT(TRACE_GC_STEP, 0, debt);
   do {  /* repeat until pause or enough "credit" (negative debt) */
 /*DEBUG  int32_t start = CCOUNT_REG; */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
 /*DEBUG  dbg_printf("singlestep - %d, %d, %u \n", debt, lua_freeheap(), CCOUNT_REG-start); */
+    if (g->gcsteptime &&
+        cast(lu_int32, luaN_clock() - start) >= cast(lu_int32, g->gcsteptime))
+      break;  /* out of time */
   } while (debt > -GCSTEPSIZE && g->gcstate != GCSpause);
   if (g->gcstate == GCSpause)
     setpause(g);  /* pause until next cycle */
+  else if (debt > -GCSTEPSIZE) {  /* stopped early; finish the work later */
+    luaE_setdebt(g, -GCSTEPSIZE);
+    luaN_postgcstep(L);
+  }
   else {
 /*DEBUG  int32_t start = CCOUNT_REG; */
     debt = (debt / g->gcstepmul) * STEPMULADJ;  /* convert 'work units' to Kb */
@@ -1162,6 +1203,7 @@ void luaC_step (lua_State *L) {
     runafewfinalizers(L);
 /*DEBUG  dbg_printf("new debt - %d, %d, %u \n", debt, lua_freeheap(), CCOUNT_REG-start); */
   }
+  PLATFORM_TRACE_EVENT(TRACE_GC_STEP_DONE, 0, gettotalbytes(g));
 }
 
 
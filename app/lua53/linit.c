@@ -35,6 +35,7 @@
 
 #include "lprefix.h"
 #include <stddef.h>
+#include <string.h>
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -79,12 +80,19 @@ extern LROT_TABLE(utf8);
   LUAC_MODULE(map);\
   LUALIB_API int initfunc(lua_State *L);
 
-LUAC_MODULE(thislib) // module struct
+LUAC_MODULE_INIT(thislib, luaopen_struct) // module struct
 LUAC_MODULE(bit)
 LUAC_MODULE(color_utils)
 LUAC_MODULE_INIT(sjson, luaopen_sjson)
 LUAC_MODULE(pipe)
 LUAC_MODULE_INIT(pixbuf, luaopen_pixbuf)
+#ifdef LUA_USE_EMU
+LUAC_MODULE_INIT(emu, luaopen_emu)
+LUAC_MODULE(emu_node)
+LUAC_MODULE(emu_tmr)
+LUAC_MODULE(emu_file)
+LUAC_MODULE(emu_net)
+#endif
 
 LUAC_MODULE(rotables_meta);
 LUAC_MODULE(base_func);
@@ -102,6 +110,13 @@ LROT_BEGIN(rotables, LROT_TABLEREF(rotables_meta), 0)
   LROT_TABENTRY(sjson, sjson)
   LROT_TABENTRY(pipe, pipe)
   LROT_TABENTRY(pixbuf, pixbuf)
+#ifdef LUA_USE_EMU
+  LROT_TABENTRY(emu, emu)
+  LROT_TABENTRY(node, emu_node)
+  LROT_TABENTRY(tmr, emu_tmr)
+  LROT_TABENTRY(file, emu_file)
+  LROT_TABENTRY(net, emu_net)
+#endif
 LROT_END(rotables, LROT_TABLEREF(rotables_meta), 0)
 
 LROT_BEGIN(lua_libs, NULL, 0)
@@ -109,12 +124,15 @@ LROT_BEGIN(lua_libs, NULL, 0)
   LROT_FUNCENTRY( io, luaopen_io )
   LROT_FUNCENTRY( os, luaopen_os )
   // modules
-  LROT_FUNCENTRY(struct, NULL)
+  LROT_FUNCENTRY(struct, luaopen_struct)
   LROT_FUNCENTRY(bit, NULL)
   LROT_FUNCENTRY(color_utils, NULL)
   LROT_FUNCENTRY(sjson, luaopen_sjson)
   LROT_FUNCENTRY(pipe, NULL)
   LROT_FUNCENTRY(pixbuf, luaopen_pixbuf)
+#ifdef LUA_USE_EMU
+  LROT_FUNCENTRY(emu, luaopen_emu)
+#endif
 LROT_END(lua_libs, NULL, 0)
 
 #else /* LUA_USE_ESP */
@@ -122,6 +140,7 @@ LROT_END(lua_libs, NULL, 0)
 /* _G __index -> rotables __index (rotables includes base_func) */
 extern const ROTable_entry lua_libs_base[];
 extern const ROTable_entry lua_rotable_base[];
+extern const ROTable_entry lua_lazy_base[];
 
 ROTable rotables_ROTable;   /* NOT const in this case */
 
@@ -132,6 +151,51 @@ LROT_BREAK(rotables)
 LROT_ENTRIES_IN_SECTION(lua_libs, libs)
   LROT_LIB_ENTRIES
 LROT_BREAK(lua_libs)
+
+/*
+** Modules declared with NODEMCU_MODULE_LAZY are kept out of the ROM table, so
+** a reference to one misses and falls through to lazy_index().  This runs the
+** module's luaopen_ function on first use and caches the module in _G, so that
+** later references resolve directly and the open function runs once only.
+*/
+static const ROTable_entry *lazy_find (const ROTable_entry *e,
+                                       const char *name) {
+  for (; e->key; e++) {
+    if (!strcmp(e->key, name))
+      return e;
+  }
+  return NULL;
+}
+
+static int lazy_index (lua_State *L) {
+  const char *name = lua_type(L, 2) == LUA_TSTRING ? lua_tostring(L, 2) : NULL;
+  const ROTable_entry *e = name ? lazy_find(lua_lazy_base, name) : NULL;
+  if (e == NULL)
+    return 0;
+  lua_pushrotable(L, cast(ROTable *, gcvalue(&e->value)));
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+  if (lua_getfield(L, -1, name) == LUA_TNIL) {
+    const ROTable_entry *lib = lazy_find(lua_libs_base, name);
+    lua_pushvalue(L, -3);
+    lua_setfield(L, -3, name);             /* LOADED[name] = module */
+    if (lib && ttislcf(&lib->value) && fvalue(&lib->value)) {
+      lua_pushcfunction(L, fvalue(&lib->value));
+      lua_pushstring(L, name);
+      lua_call(L, 1, 0);                   /* call luaopen_XXX(name) */
+    }
+  }
+  lua_pop(L, 2);                           /* remove LOADED[name] and LOADED */
+  lua_pushglobaltable(L);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, -3);
+  lua_rawset(L, -3);                     /* _G[name] = module */
+  lua_pop(L, 1);
+  return 1;
+}
+
+LROT_BEGIN(rotables_meta, NULL, LROT_MASK_INDEX)
+  LROT_FUNCENTRY( __index, lazy_index )
+LROT_END(rotables_meta, NULL, LROT_MASK_INDEX)
 #endif
 
 
@@ -140,10 +204,15 @@ void luaL_openlibs (lua_State *L) {
   const ROTable_entry *p = LROT_TABLEREF(lua_libs)->entry;
 #else
   const ROTable_entry *p = lua_libs_base;
-  lua_createrotable(L, LROT_TABLEREF(rotables), lua_rotable_base, NULL);
+  lua_createrotable(L, LROT_TABLEREF(rotables), lua_rotable_base,
+                    cast(ROTable *, LROT_TABLEREF(rotables_meta)));
 #endif
   /* Now do lua opens */
   for ( ; p->key; p++) {
+#ifndef LUA_CROSS_COMPILER
+    if (lazy_find(lua_lazy_base, p->key))
+      continue;                            /* opened on first use */
+#endif
     if (ttislcf(&p->value) && fvalue(&p->value))
       luaL_requiref(L, p->key, fvalue(&p->value), 1);
   }
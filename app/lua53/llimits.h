@@ -195,6 +195,15 @@ typedef unsigned long Instruction;
 #endif
 
 
+/*
+** Load factor of the string table, in strings per 100 chains, at which
+** it is doubled. The GC halves it when it falls below a quarter of that.
+*/
+#if !defined(LUA_STRTAB_LOAD)
+#define LUA_STRTAB_LOAD	100
+#endif
+
+
 /*
 ** Size of cache for strings in the API. 'N' is the number of
 ** sets (better be a prime) and "M" is the size of each set (M == 1
@@ -205,6 +214,14 @@ typedef unsigned long Instruction;
 #define KEYCACHE_M		4
 #endif
 
+/*
+** Number of lines in the per-instruction cache of ROTable field lookups
+** in lvm.c (must be a power of 2).
+*/
+#if !defined(ROSITECACHE_N)
+#define ROSITECACHE_N	    32
+#endif
+
 
 /* minimum size for string buffer */
 #if !defined(LUA_MINBUFFER)
@@ -57,6 +57,10 @@
    ((v)=cast(t *, luaM_reallocv(L, v, oldn, n, sizeof(t))))
 
 LUAI_FUNC l_noret luaM_toobig (lua_State *L);
+LUAI_FUNC void luaM_closeslabs (lua_State *L);
+#ifdef DEVELOPMENT_HEAP_PROFILE
+LUAI_FUNC int luaM_heapsite (int i, const char **name, int *line, l_mem *live);
+#endif
 
 /* not to be called directly */
 LUAI_FUNC void *luaM_realloc_ (lua_State *L, void *block, size_t oldsize,
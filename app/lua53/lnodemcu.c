@@ -11,12 +11,16 @@
 #include "lapi.h"
 #include "lauxlib.h"
 #include "lfunc.h"
+#include "ldebug.h"
+#include "ldo.h"
 #include "lgc.h"
+#include "lmem.h"
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
 #include "lnodemcu.h"
 #include "lundump.h"
+#include "lvm.h"
 #include "lzio.h"
 
 #ifdef LUA_USE_ESP
@@ -72,7 +76,7 @@ extern void dbg_printf(const char *fmt, ...);                // DEBUG
 /* Erasing the LFS invalidates ESP instruction cache,  so doing a block 64Kb */
 /* read is the simplest way to flush the icache, restoring cache coherency */
 #define flush_icache(F) \
-  UNUSED(memcmp(F->addr, F->addr+(0x8000/sizeof(*F->addr)), 0x8000));
+  UNUSED(memcmp(F->base, F->base+(0x8000/sizeof(*F->base)), 0x8000));
 #define unlockFlashWrite()
 #define lockFlashWrite()
 
@@ -208,7 +212,9 @@ LUALIB_API void lua_debugbreak(void) {
 //===================== NodeMCU lua.h API extensions =========================//
 
 LUA_API int lua_freeheap (void) {
-#ifdef LUA_USE_HOST
+#if defined(LUA_USE_EMU)
+  return luaE_freeheap();
+#elif defined(LUA_USE_HOST)
   return MAX_INT;
 #else
   return (int) platform_freeheap();
@@ -253,6 +259,211 @@ LUA_API int lua_pushstringsarray(lua_State *L, int opt) {
   return 1;
 }
 
+/*
+** Start (n > 0) or stop (n == 0) profiling the creation of RAM short strings
+*/
+LUA_API void lua_stringprofile (lua_State *L, int n) {
+  lua_lock(L);
+  luaS_profile(L, n);
+  lua_unlock(L);
+}
+
+/*
+** Push a table of {string = creation count} for the profiled strings
+*/
+LUA_API int lua_pushstringprofile (lua_State *L) {
+  const char *s;
+  size_t l;
+  int i, n;
+  lua_newtable(L);
+  for (i = 0; (n = luaS_getprofile(i, &s, &l)) >= 0; i++) {
+    if (n > 0) {
+      lua_pushlstring(L, s, l);
+      lua_pushinteger(L, n);
+      lua_rawset(L, -3);
+    }
+  }
+  return 1;
+}
+
+/*
+** Push a table of the use of the RAM (opt 0) or ROM (opt 1) string table:
+** its chains, the strings in it, the chains in use, the longest chain and
+** the string comparisons for finding every string in it once.
+*/
+LUA_API int lua_pushstrtstats (lua_State *L, int opt) {
+  stringtable *strt = NULL;
+  int i, used = 0, longest = 0;
+  lu_mem probes = 0;
+  if (opt == 0)
+    strt = &G(L)->strt;
+#ifdef LUA_USE_ESP
+  else if (opt == 1 && G(L)->ROstrt.hash)
+    strt = &G(L)->ROstrt;
+#endif
+  if (strt == NULL) {
+    lua_pushnil(L);
+    return 0;
+  }
+  for (i = 0; i < strt->size; i++) {
+    TString *e;
+    int n = 0;
+    for (e = strt->hash[i]; e; e = e->u.hnext)
+      probes += ++n;
+    if (n) {
+      used++;
+      if (n > longest)
+        longest = n;
+    }
+  }
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, strt->size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, strt->nuse);
+  lua_setfield(L, -2, "nuse");
+  lua_pushinteger(L, used);
+  lua_setfield(L, -2, "chains");
+  lua_pushinteger(L, longest);
+  lua_setfield(L, -2, "maxchain");
+  lua_pushinteger(L, probes);
+  lua_setfield(L, -2, "probes");
+  return 1;
+}
+
+/*
+** Profiler support:  lua_sampleci() is called from a timer interrupt to note
+** the Lua function and instruction being executed, and lua_pushsamples()
+** later turns the accumulated samples into per line and per function counts.
+*/
+#ifdef LUA_USE_ESP
+#define isRAMaddr(p) (cast(size_t, p) >= 0x3FFE8000 && cast(size_t, p) < 0x40000000)
+#else
+#define isRAMaddr(p) ((p) != NULL)
+#endif
+
+/*
+** The sample can interrupt the VM anywhere, so each pointer is range checked
+** before it is followed.  The Proto may be in flash and is only recorded, not
+** read, as interrupt code can't rely on the flash cache.
+*/
+LUA_API int ICACHE_RAM_ATTR lua_sampleci (lua_State *L, const void **f,
+                                          const void **pc) {
+  CallInfo *ci = L->ci;
+  const TValue *func;
+  if (!isRAMaddr(ci) || !isLua(ci))
+    return 0;
+  func = ci->func;
+  if (!isRAMaddr(func) || !ttisLclosure(func) || !isRAMaddr(clLvalue(func)))
+    return 0;
+  *f = clLvalue(func)->p;
+  *pc = ci->u.l.savedpc;
+  return 1;
+}
+
+/* Count of samples at key in the table at ToS */
+static void addsample (lua_State *L, const char *src, int line, unsigned n) {
+  lua_pushfstring(L, "%s:%d", src, line);
+  lua_pushvalue(L, -1);
+  lua_rawget(L, -3);
+  n += (unsigned) lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  lua_pushinteger(L, n);
+  lua_rawset(L, -3);
+}
+
+/*
+** Push tables of {"source:line" = count} and {"source:linedefined" = count}
+** for the n samples in s.  A sampled Proto may have been collected since,
+** so only those found in LFS or on the allgc list are used; the count of the
+** rest is cleared.  Returns the number of tables pushed.
+*/
+LUA_API int lua_pushsamples (lua_State *L, lua_Sample *s, int n) {
+  global_State *g = G(L);
+  LFSHeader *fh = g->l_LFS;
+  GCObject *o;
+  int i;
+  for (i = 0; i < n; i++) {  /* first mark the samples not in LFS */
+    const char *a = cast(const char *, s[i].f);
+    if (!fh || a < cast(char *, fh) || a >= cast(char *, fh) + fh->flash_size ||
+        !isLFSobj(a) || gettt(cast(GCObject *, a)) != LUA_TPROTO)
+      s[i].count |= ~(~0u >> 1);
+  }
+  for (o = g->allgc; o; o = o->next) {  /* and clear the mark of live Protos */
+    if (gettt(o) == LUA_TPROTO) {
+      for (i = 0; i < n; i++)
+        if (s[i].f == o)
+          s[i].count &= ~0u >> 1;
+    }
+  }
+  lua_newtable(L);
+  lua_newtable(L);
+  for (i = 0; i < n; i++) {
+    const Proto *p = cast(const Proto *, s[i].f);
+    const char *src;
+    int pc;
+    if (s[i].count == 0 || (s[i].count & ~(~0u >> 1))) {
+      s[i].count = 0;
+      continue;
+    }
+    pc = pcRel(cast(const Instruction *, s[i].pc), p);
+    if (pc < 0)  /* not yet started */
+      pc = 0;
+    src = (p->source) ? getstr(p->source) : "?";
+    if (*src == '@' || *src == '=')
+      src++;
+    lua_insert(L, -2);
+    addsample(L, src, (pc < p->sizecode) ? getfuncline(p, pc) : 0, s[i].count);
+    lua_insert(L, -2);
+    addsample(L, src, p->linedefined, s[i].count);
+  }
+  return 2;
+}
+
+#ifdef DEVELOPMENT_HEAP_PROFILE
+/*
+** Push a table of {"source:line" = live bytes} for the heap profile sites
+*/
+LUA_API int lua_pushheapsites (lua_State *L) {
+  const char *name;
+  int i, line;
+  l_mem live;
+  lua_newtable(L);
+  for (i = 0; luaM_heapsite(i, &name, &line, &live); i++) {
+    if (name && live > 0) {
+      if (line)
+        lua_pushfstring(L, "%s:%d", name, line);
+      else
+        lua_pushstring(L, name);
+      lua_pushinteger(L, live);
+      lua_rawset(L, -3);
+    }
+  }
+  return 1;
+}
+#endif
+
+#ifdef DEVELOPMENT_FLOAT_PROFILE
+/*
+** Push a table of {"source:line" = float ops} for the functions counted by
+** the float profile, then clear the profile and set its warning mode
+*/
+LUA_API int lua_pushfloatsites (lua_State *L, int warn) {
+  const char *name;
+  int i, line;
+  lu_int32 count;
+  lua_newtable(L);
+  for (i = 0; luaV_floatsite(i, &name, &line, &count); i++) {
+    if (name && count > 0) {
+      lua_pushfstring(L, "%s:%d", name, line);
+      lua_pushinteger(L, count);
+      lua_rawset(L, -3);
+    }
+  }
+  luaV_floatreset(warn);
+  return 1;
+}
+#endif
+
 LUA_API void lua_createrotable (lua_State *L, ROTable *t,
                                 const ROTable_entry *e, ROTable *mt) {
   int i, j;
@@ -382,6 +593,15 @@ LUALIB_API int  (luaL_pushlfsdts) (lua_State *L) {
 ** FlashState used to share context with the low level lua_load write routines
 ** is passed as a ZIO data field.  Note this is only within the phase
 ** processing and not across phases.
+**
+** A reload doesn't erase and rewrite the whole partition.  The new image is
+** appended at the first flash page after the live one, so it only erases the
+** pages that it uses out of the free space.  Its header signature is written
+** last, and at startup the live image is the last of the chain of valid
+** headers starting at the base of the partition, so the switch to the new
+** image is atomic and an interrupted reload leaves the previous one in place.
+** Only when an image doesn't fit into the free space is the partition
+** compacted: erased and then reloaded from its base.
 */
 
 
@@ -396,9 +616,16 @@ typedef struct LFSflashState {
   lu_int32   *oBuff;              /* FLASH_PAGE_SIZE bytes */
   lu_byte    *inBuff;             /* FLASH_PAGE_SIZE bytes */
   lu_int32    inNdx;              /* in bytes */
+  int         reader;             /* ref of a Lua reader function */
+  int         chunk;              /* ref of the last chunk that it returned */
   lu_int32    addrPhys;
   lu_int32    size;
+  lu_int32    erased;             /* phys address that the slot is erased to */
+  lu_int32   *base;               /* mapped address of the LFS partition */
+  lu_int32    basePhys;
+  lu_int32    baseSize;
   lu_int32    allocmask;
+  lu_byte     full;               /* image overflowed its slot */
   stringtable ROstrt;
   GCObject   *pLTShead;
 } LFSflashState;
@@ -410,12 +637,26 @@ typedef struct LFSflashState {
 #else
 #define ALIGN(F,n) ((n + F->allocmask) & ~(F->allocmask)) / WORDSIZE;
 #endif
+#define PAGE_ALIGN(n) (((n) + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1))
+
+/* Read the next image chunk from the Lua reader; nil or "" ends the image */
+static const char *readFn (lua_State *L, LFSflashState *F, size_t *size) {
+  const char *s;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, F->reader);
+  lua_call(L, 0, 1);
+  s = lua_tolstring(L, -1, size);
+  luaL_unref(L, LUA_REGISTRYINDEX, F->chunk);
+  F->chunk = luaL_ref(L, LUA_REGISTRYINDEX);    /* keep the chunk alive */
+  return (s && *size) ? s : NULL;
+}
 
 /* This conforms to the ZIO lua_Reader spec, hence the L parameter */
 static const char *readF (lua_State *L, void *ud, size_t *size) {
   UNUSED(L);
   LFSflashState *F = cast(LFSflashState *, ud);
-  if (F->inNdx > 0) {
+  if (F->reader != LUA_NOREF) {
+    return readFn(L, F, size);
+  } else if (F->inNdx > 0) {
     *size = F->inNdx;
     F->inNdx = 0;
   } else {
@@ -445,6 +686,45 @@ static void eraseLFS(LFSflashState *F) {
   lockFlashWrite();
 }
 
+/*
+** A load erases the pages of its slot just ahead of the writes into them,
+** rather than the whole slot first, so it only erases what the image uses.
+*/
+static void eraseAhead(LFSflashState *F, lu_int32 end) {
+  while (F->erased < end) {
+    lu_int32 o = F->erased - F->addrPhys;
+#ifdef LUA_USE_ESP
+    size_t *f = cast(size_t *, F->addr + o/sizeof(*f));
+    /* it is far faster not erasing if you don't need to */
+    if (!(*f == ~0 && !memcmp(f, f + 1, FLASH_PAGE_SIZE - sizeof(*f))))
+#endif
+    {
+      unlockFlashWrite();
+      platform_flash_erase_sector(platform_flash_get_sector_of_address(F->erased));
+      lockFlashWrite();
+      printf(".");
+    }
+    F->erased += FLASH_PAGE_SIZE;
+    UNUSED(o);
+  }
+}
+
+/*
+** As the slot is no longer erased as a whole, the headers of any earlier
+** images in it are erased first, so that the chain of valid headers can't
+** run on from the image being loaded into an old one.
+*/
+static void eraseStaleHeaders(LFSflashState *F) {
+  lu_int32 o;
+  for (o = 0; o + sizeof(LFSHeader) <= F->size; o += FLASH_PAGE_SIZE) {
+    if (cast(LFSHeader *, F->addr + o/WORDSIZE)->flash_sig == FLASH_SIG) {
+      unlockFlashWrite();
+      platform_flash_erase_sector(platform_flash_get_sector_of_address(F->addrPhys + o));
+      lockFlashWrite();
+    }
+  }
+}
+
 LUAI_FUNC void  luaN_setFlash(void *F, unsigned int o) {
   luaN_flushFlash(F);  /* flush the pending write buffer */
   lua_assert((o & (WORDSIZE-1))==0);
@@ -455,8 +735,12 @@ LUAI_FUNC void luaN_flushFlash(void *vF) {
   LFSflashState *F = cast(LFSflashState *, vF);
   lu_int32 start   = F->addrPhys + F->oChunkNdx*WORDSIZE;
   lu_int32 size    = F->oNdx * WORDSIZE;
-  lua_assert(start + size < F->addrPhys + F->size); /* is write in bounds? */
+  if (start + size > F->addrPhys + F->size) {   /* image doesn't fit the slot */
+    F->full = 1;
+    luaD_throw(F->L, LUA_ERRMEM);
+  }
 //printf("Flush Buf: %6x (%u)\n", F->oNdx, size);                      //DEBUG
+  eraseAhead(F, start + size);
   platform_s_flash_write(F->oBuff, start, size);
   F->oChunkNdx += F->oNdx;
   F->oNdx = 0;
@@ -494,6 +778,73 @@ LUAI_FUNC void *luaN_writeFlash(void *vF, const void *rec, size_t n) {
 }
 
 
+/* Point the flash state at the slot starting o bytes into the partition */
+static void setSlot (LFSflashState *F, lu_int32 o) {
+  F->addr     = F->base + o/WORDSIZE;
+  F->addrPhys = F->basePhys + o;
+  F->size     = F->baseSize - o;
+  F->erased   = F->addrPhys + F->size;  /* only a load erases ahead */
+}
+
+#ifdef LUA_USE_ESP
+/* Return the live image: the last in the chain of valid image headers */
+static LFSHeader *liveLFS (LFSflashState *F) {
+  LFSHeader *fh = cast(LFSHeader *, F->base);
+  lu_int32 o = 0;
+  while (fh->flash_size > 0) {
+    o += PAGE_ALIGN(fh->flash_size);
+    if (o + sizeof(LFSHeader) > F->baseSize)
+      break;
+    LFSHeader *nh = cast(LFSHeader *, F->base + o/WORDSIZE);
+    if (nh->flash_sig != FLASH_SIG || nh->flash_size > F->baseSize - o)
+      break;
+    fh = nh;
+  }
+  return fh;
+}
+#endif
+
+/* Erase and load the LFS image into the slot starting o bytes in */
+static int loadSlot (lua_State *L, LFSflashState *F, lu_int32 o) {
+  ZIO z;
+  int status;
+  setSlot(F, o);
+  F->full = 0;
+  F->erased = F->addrPhys;
+  printf("\nLoading LFS into flash addr 0x%06x", F->addrPhys);
+  flush_icache(F);  /* so that no stale page is taken as erased */
+  eraseStaleHeaders(F);
+  luaZ_init(L, &z, readF, F);
+  lua_lock(L);
+#ifdef LUA_USE_HOST
+  F->allocmask = (LFSaddr == LFSregion) ? sizeof(size_t) - 1 :
+                                          sizeof(lu_int32) - 1;
+  status = luaU_undumpLFS(L, &z, LFSaddr != LFSregion);
+#else
+  status = luaU_undumpLFS(L, &z, 0);
+#endif
+  lua_unlock(L);
+  printf(" to 0x%06x\n", F->erased - 1);
+  flush_icache(F);
+  return status;
+}
+
+/* Allocate a flash state with its buffers for the LFS partition */
+static LFSflashState *newFlashState (void) {
+  size_t Fsize = sizeof(LFSflashState) + OSIZE*WORDSIZE + ISIZE;
+  /* outlining the buffers just makes debugging easier.  Sorry */
+  LFSflashState *F = calloc(Fsize, 1);
+  if (F) {
+    F->oBuff = wordptr(F + 1);
+    F->inBuff = byteptr(F->oBuff + OSIZE);
+    F->reader = F->chunk = LUA_NOREF;
+    F->baseSize = platform_flash_get_partition (NODEMCU_LFS0_PARTITION, &F->basePhys);
+    if (F->baseSize)
+      F->base = cast(lu_int32 *, platform_flash_phys2mapped(F->basePhys));
+  }
+  return F;
+}
+
 /*
 ** Hook used in Lua Startup to carry out the optional LFS startup processes.
 */
@@ -506,16 +857,15 @@ LUAI_FUNC int luaN_init (lua_State *L) {
   * are initialised.  This is detected because F is NULL on first entry.
   */
   if (F == NULL) {
-    size_t Fsize = sizeof(LFSflashState) + OSIZE*WORDSIZE + ISIZE;
-    /* outlining the buffers just makes debugging easier.  Sorry */
-    F = calloc(Fsize, 1);
-    F->oBuff = wordptr(F + 1);
-    F->inBuff = byteptr(F->oBuff + OSIZE);
+    F = newFlashState();
     n = platform_rcr_read(PLATFORM_RCR_FLASHLFS, cast(void**, &F->LFSfileName));
-    F->size = platform_flash_get_partition (NODEMCU_LFS0_PARTITION, &F->addrPhys);
-    if (F->size) {
-      F->addr  = cast(lu_int32 *, platform_flash_phys2mapped(F->addrPhys));
-      fh = cast(LFSHeader *, F->addr);
+    if (F->baseSize) {
+      fh = cast(LFSHeader *, F->base);
+#ifdef LUA_USE_ESP
+      if (fh->flash_sig == FLASH_SIG)
+        fh = liveLFS(F);
+#endif
+      setSlot(F, byteoffset(fh, F->base));
       if (n < 0) {
         global_State *g = G(L);
         g->LFSsize     = F->size;
@@ -530,6 +880,7 @@ LUAI_FUNC int luaN_init (lua_State *L) {
            lua_writestringerror("LFS image %s\n", "loaded");
         } else if ((fh->flash_sig != 0 && fh->flash_sig != ~0)) {
           lua_writestringerror("LFS image %s\n", "corrupted.");
+          setSlot(F, 0);
           eraseLFS(F);
         }
       }
@@ -538,7 +889,7 @@ LUAI_FUNC int luaN_init (lua_State *L) {
   } else {  /* hook 2 called from protected pmain, so can throw errors. */
     int status = 0;
     if (F->LFSfileName) {                         /* hook == 2 LFS image load */
-      ZIO z;
+      lu_int32 o = 0;
      /*
       * To avoid reboot loops, the load is only attempted once, so we
       * always deleted the RCR record if we enter this path. Also note
@@ -560,17 +911,20 @@ LUAI_FUNC int luaN_init (lua_State *L) {
         free(F);
         return luaL_error(L, "cannot open %s", F->LFSfileName);
       }
-      eraseLFS(F);
-      luaZ_init(L, &z, readF, F);
-      lua_lock(L);
-#ifdef LUA_USE_HOST
-      F->allocmask = (LFSaddr == LFSregion) ? sizeof(size_t) - 1 :
-                                              sizeof(lu_int32) - 1;
-      status = luaU_undumpLFS(L, &z, LFSaddr != LFSregion);
-#else
-      status = luaU_undumpLFS(L, &z, 0);
+      F->L = L;
+#ifdef LUA_USE_ESP
+      if (fh && fh->flash_sig == FLASH_SIG)    /* append after the live image */
+        o = byteoffset(fh, F->base) + PAGE_ALIGN(fh->flash_size);
 #endif
-      lua_unlock(L);
+      status = (o < F->baseSize) ? loadSlot(L, F, o) : LUA_ERRMEM;
+      if (status == LUA_ERRMEM && (F->full || o >= F->baseSize)) {
+        if (o < F->baseSize)
+          lua_pop(L, 1);                          /* dump the error message */
+        lua_writestringerror("LFS %s\n", "full, compacting");
+        l_rewind(F->f);               /* no room to append, so reload at base */
+        F->inNdx = 0;
+        status = loadSlot(L, F, 0);
+      }
       l_close(F->f);
       free(F);
       F = NULL;
@@ -621,49 +975,284 @@ LUALIB_API void luaL_lfsreload (lua_State *L) {
 #endif
 }
 
+/*
+** Load an LFS image into the free space after the live image while the live
+** one stays in use.  The new image becomes live at the next restart.  This
+** cannot compact the partition, so if the image doesn't fit then an error is
+** returned and node.LFS.reload() must be used instead.  The image is read
+** from the file named by the first argument or, if this is a function, from
+** the chunks that it returns, so no copy of the image is needed in the file
+** system.  Returns the number of results pushed: none on success, else an
+** error string.
+*/
+LUALIB_API int luaL_lfsload (lua_State *L) {
+#ifdef LUA_USE_ESP
+  const char *img = lua_isfunction(L, 1) ? NULL : luaL_checkstring(L, 1);
+  LFSHeader *fh = G(L)->l_LFS;
+  LFSflashState *F;
+  lu_int32 o = 0;
+  int status;
+  if (G(L)->LFSsize == 0) {
+    lua_pushstring(L, "No LFS partition allocated");
+    return 1;
+  }
+  if (G(L)->ROstrt.hash && fh->flash_sig != FLASH_SIG) {
+    lua_pushstring(L, "LFS rolled back, restart required");
+    return 1;
+  }
+  if ((F = newFlashState()) == NULL)
+    return luaL_error(L, "not enough memory");
+  if (fh->flash_sig == FLASH_SIG)
+    o = byteoffset(fh, F->base) + PAGE_ALIGN(fh->flash_size);
+  if (o >= F->baseSize) {
+    free(F);
+    lua_pushstring(L, "LFS full");
+    return 1;
+  }
+  if (img == NULL) {
+    lua_pushvalue(L, 1);
+    F->reader = luaL_ref(L, LUA_REGISTRYINDEX);
+  } else if (!(F->f = l_open(img))) {
+    free(F);
+    lua_pushfstring(L, "cannot open %s", img);
+    return 1;
+  }
+  F->L = L;
+  status = loadSlot(L, F, o);
+  if (img) {
+    l_close(F->f);
+  } else {
+    luaL_unref(L, LUA_REGISTRYINDEX, F->reader);
+    luaL_unref(L, LUA_REGISTRYINDEX, F->chunk);
+  }
+  if (status == LUA_ERRMEM && F->full) {
+    lua_pop(L, 1);
+    lua_pushstring(L, "LFS full");
+  }
+  free(F);
+  return status == LUA_OK ? 0 : 1;
+#else
+  return 0;
+#endif
+}
+
+/*
+** Make the image before the live one live again at the next restart, by
+** clearing the signature of the live image.  Returns false if there isn't a
+** previous image, as there is none after the partition has been compacted.
+*/
+LUALIB_API int luaL_lfsrollback (lua_State *L) {
+#ifdef LUA_USE_ESP
+  LFSHeader *fh = G(L)->l_LFS;
+  LFSflashState *F;
+  lu_int32 sig = 0;
+  int ok;
+  if ((F = newFlashState()) == NULL)
+    return luaL_error(L, "not enough memory");
+  ok = F->baseSize && fh->flash_sig == FLASH_SIG && fh == liveLFS(F) &&
+       cast(lu_int32 *, fh) != F->base;
+  if (ok)
+    platform_s_flash_write(&sig, platform_flash_mapped2phys(cast(lu_int32, fh)),
+                           sizeof(sig));
+  free(F);
+  return ok;
+#else
+  return 0;
+#endif
+}
+
 
 #ifdef LUA_USE_ESP
 extern void lua_main(void);
+
+/*
+** Posted tasks are queued in a Lua table per priority rather than taking an
+** SDK event each, so that a burst of posts can't fill the SDK task queues.
+** One event drains a queue, running tasks until LUA_TASK_SLICE_US have passed
+** or a task of higher priority is waiting, and then reposts itself so that the
+** SDK and Wi-Fi get their turn between slices.
+*/
+#ifndef LUA_TASK_SLICE_US
+#define LUA_TASK_SLICE_US 4000
+#endif
+
+typedef struct {
+  int ref;                                 /* Registry ref of the queue table */
+  int head, tail;               /* Slot of the next task, and next free slot */
+  int posted;                           /* An SDK event is pending for it */
+} runQueue;
+
+static platform_task_handle_t task_handle = 0;
+static runQueue runq[LUA_TASK_HIGH+1];
+static global_State *runq_owner = NULL;
+static lu_int32 slicestart;                   /* when the current task began */
+
+static runQueue *getrunq (lua_State *L, int prio) {
+  runQueue *q;
+  if (runq_owner != G(L)) {         /* a new Lua state, so any queues are void */
+    int i;
+    for (i = LUA_TASK_LOW; i <= LUA_TASK_HIGH; i++)
+      runq[i] = (runQueue) {LUA_NOREF, 1, 1, 0};
+    runq_owner = G(L);
+  }
+  q = runq + prio;
+  if (q->ref == LUA_NOREF) {
+    lua_createtable(L, 8, 0);
+    q->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  return q;
+}
+
+static int higherwaiting (int prio) {
+  while (++prio <= LUA_TASK_HIGH)
+    if (runq[prio].head != runq[prio].tail)
+      return 1;
+  return 0;
+}
+
 /*
-** Task callback handler. Uses luaN_call to do a protected call with full traceback
+** Task callback handler. Runs the queued tasks with luaL_pcallx
 */
-static void do_task (platform_task_param_t task_fn_ref, uint8_t prio) {
+static void do_task (platform_task_param_t param, uint8_t prio) {
   lua_State* L = lua_getstate();
-  if(task_fn_ref == (platform_task_param_t)~0 && prio == LUA_TASK_HIGH) {
+  runQueue *q;
+  lu_int32 start = system_get_time();
+  int n = 0;
+  if(param == (platform_task_param_t)~0 && prio == LUA_TASK_HIGH) {
     lua_main();                   /* Undocumented hook for lua_main() restart */
     return;
   }
   if (prio < LUA_TASK_LOW|| prio > LUA_TASK_HIGH)
     luaL_error(L, "invalid posk task");
-/* Pop the CB func from the Reg */
-  lua_rawgeti(L, LUA_REGISTRYINDEX, (int) task_fn_ref);
-  luaL_checktype(L, -1, LUA_TFUNCTION);
-  luaL_unref(L, LUA_REGISTRYINDEX, (int) task_fn_ref);
-  lua_pushinteger(L, prio);
-  luaL_pcallx(L, 1, 0);
+  q = getrunq(L, prio);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, q->ref);
+  while (q->head != q->tail) {
+    if (n++ &&
+        (system_get_time() - start >= LUA_TASK_SLICE_US || higherwaiting(prio))) {
+      if (platform_post(prio, task_handle, 0)) {
+        lua_pop(L, 1);                      /* continue in the next slice */
+        return;
+      }
+      start = system_get_time();  /* SDK queue full, so carry on meanwhile */
+    }
+    lua_rawgeti(L, -1, q->head);                     /* Pop the task function */
+    lua_pushnil(L);
+    lua_rawseti(L, -3, q->head++);
+    lua_pushinteger(L, prio);
+    slicestart = system_get_time();
+    luaL_pcallx(L, 1, 0);
+  }
+  q->head = q->tail = 1;
+  q->posted = 0;
+  lua_pop(L, 1);
 }
 
 /*
 ** Schedule a Lua function for task execution
 */
 LUALIB_API int luaL_posttask ( lua_State* L, int prio ) {         // [-1, +0, -]
-  static platform_task_handle_t task_handle = 0;
+  runQueue *q;
   if (!task_handle)
     task_handle = platform_task_get_id(do_task);
   if (L == NULL && prio == LUA_TASK_HIGH+1) { /* Undocumented hook for lua_main */
     platform_post(LUA_TASK_HIGH, task_handle, (platform_task_param_t)~0);
     return -1;
   }
-  if (lua_isfunction(L, -1) && prio >= LUA_TASK_LOW && prio <= LUA_TASK_HIGH) {
-    int task_fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    if(!platform_post(prio, task_handle, (platform_task_param_t)task_fn_ref)) {
-      luaL_unref(L, LUA_REGISTRYINDEX, task_fn_ref);
-      luaL_error(L, "Task queue overflow. Task not posted");
-    }
-    return task_fn_ref;
-  } else {
+  if (!lua_isfunction(L, -1) || prio < LUA_TASK_LOW || prio > LUA_TASK_HIGH)
     return luaL_error(L, "invalid posk task");
+  q = getrunq(L, prio);
+  if (!q->posted) {
+    if (!platform_post(prio, task_handle, 0))
+      luaL_error(L, "Task queue overflow. Task not posted");
+    q->posted = 1;
   }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, q->ref);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, q->tail);
+  lua_pop(L, 1);
+  return q->tail++;
+}
+
+/*
+** Has the running task used up its slice?  Only a coroutine can be suspended,
+** so otherwise the watchdog is fed and the caller carries on.
+*/
+LUALIB_API int luaL_sliceexpired (lua_State *L) {
+  if (system_get_time() - slicestart < LUA_TASK_SLICE_US)
+    return 0;
+  if (lua_isyieldable(L))
+    return 1;
+  system_soft_wdt_feed();
+  return 0;
+}
+
+static int sliceresume (lua_State *L) {
+  lua_State *co = lua_tothread(L, lua_upvalueindex(1));
+  int status;
+  if (lua_status(co) != LUA_YIELD)
+    return 0;                      /* already resumed by someone else */
+  status = lua_resume(co, L, 0);
+  if (status != LUA_OK && status != LUA_YIELD) {
+    lua_xmove(co, L, 1);                                 /* move error message */
+    return lua_error(L);         /* and report it through the task handler */
+  }
+  lua_settop(co, 0);   /* the coroutine is detached, so drop anything it gave */
+  return 0;
+}
+
+/*
+** Suspend the running coroutine until a low priority task resumes it, which
+** carries on in k.  coroutine.resume() returns to its caller meanwhile.
+*/
+LUALIB_API int luaL_yieldslice (lua_State *L, lua_KContext ctx,
+                                lua_KFunction k) {
+  lua_pushthread(L);
+  lua_pushcclosure(L, sliceresume, 1);
+  luaL_posttask(L, LUA_TASK_LOW);
+  return lua_yieldk(L, 0, ctx, k);
+}
+
+/*
+** Time in microseconds, used to bound the length of GC steps
+*/
+LUAI_FUNC lu_int32 luaN_clock (void) {
+  return system_get_time();
+}
+
+/*
+** Idle task which continues a GC cycle left unfinished by a time-bounded
+** luaC_step().  Each run does another bounded step and reposts itself at low
+** priority until the cycle completes, so the collector only uses the gaps
+** between other tasks.
+*/
+static int gcidle = 0;
+
+static int gc_stepfn (lua_State *L) {
+  lua_gc(L, LUA_GCSTEP, 0);
+  return 0;
+}
+
+static void gc_task (platform_task_param_t param, uint8_t prio) {
+  lua_State *L = lua_getstate();
+  global_State *g = G(L);
+  UNUSED(param); UNUSED(prio);
+  gcidle = 0;
+  if (g->gcrunning && g->gcsteptime && g->gcstate != GCSpause) {
+    lua_pushcfunction(L, gc_stepfn);
+    luaL_pcallx(L, 0, 0);
+    if (g->gcstate != GCSpause)
+      luaN_postgcstep(L);
+  }
+}
+
+LUAI_FUNC void luaN_postgcstep (lua_State *L) {
+  static platform_task_handle_t task_handle = 0;
+  UNUSED(L);
+  if (gcidle)
+    return;
+  if (!task_handle)
+    task_handle = platform_task_get_id(gc_task);
+  gcidle = platform_post(LUA_TASK_LOW, task_handle, 0);
 }
 #else
 /*
@@ -672,4 +1261,89 @@ LUALIB_API int luaL_posttask ( lua_State* L, int prio ) {         // [-1, +0, -]
 LUALIB_API int luaL_posttask( lua_State* L, int prio ) {            // [-1, +0, -]
   return -1;
 }
+
+/*
+** HOST builds have no watchdog and no tasks to resume from, so run to the end
+*/
+LUALIB_API int luaL_sliceexpired (lua_State *L) {
+  UNUSED(L);
+  return 0;
+}
+
+LUALIB_API int luaL_yieldslice (lua_State *L, lua_KContext ctx,
+                                lua_KFunction k) {
+  return k(L, LUA_YIELD, ctx);
+}
+
+/*
+** On HOST builds GC steps are unbounded, so there is no deferred GC work
+*/
+LUAI_FUNC lu_int32 luaN_clock (void) {
+  return 0;
+}
+
+LUAI_FUNC void luaN_postgcstep (lua_State *L) {
+  UNUSED(L);
+}
+#endif
+
+/*
+** Callback slots.  The copy of the value can be pushed as it is, since the
+** anchor keeps it alive; numbers, which need the whole Value, are pushed from
+** the anchor instead.  Setting a slot to nil empties it.
+*/
+LUALIB_API void luaL_setslot (lua_State *L, luaL_Slot *s) {      // [-1, +0, m]
+  const TValue *o = L->top - 1;
+  if (ttisnil(o)) {
+    lua_pop(L, 1);
+    luaL_unsetslot(L, s);
+    return;
+  }
+  s->tt = ttisnumber(o) ? LUA_TNONE : rttype(o);
+  s->p = ttisnumber(o) ? NULL : val_(o).p;
+  luaL_reref(L, LUA_REGISTRYINDEX, &s->ref);
+}
+
+LUALIB_API void luaL_unsetslot (lua_State *L, luaL_Slot *s) {    // [-0, +0, -]
+  luaL_unref(L, LUA_REGISTRYINDEX, s->ref);
+  s->ref = LUA_NOREF;
+  s->tt = LUA_TNONE;
+  s->p = NULL;
+}
+
+LUALIB_API void luaL_pushslot (lua_State *L, const luaL_Slot *s) { // [-0, +1, -]
+  if (s->tt == LUA_TNONE) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->ref);     /* a number, or nil if empty */
+    return;
+  }
+  lua_lock(L);
+  val_(L->top).p = s->p;
+  settt_(L->top, s->tt);
+  api_incr_top(L);
+  lua_unlock(L);
+}
+
+#ifdef LUA_USE_ESP
+/*
+** Call the function in slot fn, given the value in slot self (if any and set)
+** and then the narg values on the top of the stack, through luaL_pcallx() so
+** that errors are reported in the usual way.  With fn empty the arguments are
+** just dropped.
+*/
+LUALIB_API int luaL_callslot (lua_State *L, const luaL_Slot *fn,
+                              const luaL_Slot *self, int narg) {  // [-narg, +0, v]
+  int base = lua_gettop(L) - narg + 1;
+  if (!luaL_slotisset(fn)) {
+    lua_pop(L, narg);
+    return LUA_OK;
+  }
+  luaL_pushslot(L, fn);
+  lua_insert(L, base);
+  if (self && luaL_slotisset(self)) {
+    luaL_pushslot(L, self);
+    lua_insert(L, base + 1);
+    narg++;
+  }
+  return luaL_pcallx(L, narg, 0);
+}
 #endif
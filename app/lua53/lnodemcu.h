@@ -28,6 +28,7 @@
 #define LRO_ROVAL(v)         {{.gc = cast(GCObject *, &(v ## _ROTable))}, LUA_TTBLROF}
 
 #define LROT_MARKED          0 //<<<<<<<<<<  *** TBD *** >>>>>>>>>>>
+#define LROT_SORTED          (1<<6) /* marked flag: keys are in strcmp() order */
 
 #define LROT_FUNCENTRY(n,f)  {LRO_STRKEY(#n), LRO_FUNCVAL(f)},
 #define LROT_LUDENTRY(n,x)   {LRO_STRKEY(#n), LRO_LUDATA(x)},
@@ -77,6 +78,14 @@ LUAI_FUNC int luaN_init (lua_State *L);
 LUAI_FUNC void *luaN_writeFlash (void *data, const void *rec, size_t n);
 LUAI_FUNC void luaN_flushFlash (void *);
 LUAI_FUNC void luaN_setFlash (void *, unsigned int o);
+LUAI_FUNC lu_int32 luaN_clock (void);
+LUAI_FUNC void luaN_postgcstep (lua_State *L);
+
+#ifdef LUA_USE_EMU
+/* The host firmware emulator, see host/lemu.c */
+LUAI_FUNC int luaE_freeheap (void);
+LUAI_FUNC int luaE_loop (lua_State *L);
+#endif
 
 #endif
 #endif
@@ -556,6 +556,16 @@ static void open_func (LexState *ls, FuncState *fs, BlockCnt *bl) {
 }
 
 
+/*
+** Each function is stripped as soon as it is closed, since its debug info is
+** no longer needed by the parser, rather than holding it all until the end
+*/
+static void compile_stripdebug(lua_State *L, Proto *f) {
+  int level =  G(L)->stripdefault;
+  if (level > 0)
+    luaU_stripdebug(L, f, level, 0);
+}
+
 static void close_func (LexState *ls) {
   lua_State *L = ls->L;
   FuncState *fs = ls->fs;
@@ -579,6 +589,7 @@ static void close_func (LexState *ls) {
   luaM_reallocvector(L, f->upvalues, f->sizeupvalues, fs->nups, Upvaldesc);
   f->sizeupvalues = fs->nups;
   lua_assert(fs->bl == NULL);
+  compile_stripdebug(L, f);
   ls->fs = fs->prev;
   luaC_checkGC(L);
 }
@@ -1635,13 +1646,6 @@ static void mainfunc (LexState *ls, FuncState *fs) {
 }
 
 
-static void compile_stripdebug(lua_State *L, Proto *f) {
-  int level =  G(L)->stripdefault;
-  if (level > 0)
-    luaU_stripdebug(L, f, level, 1);
-}
-
-
 LClosure *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff,
                        Dyndata *dyd, const char *name, int firstchar) {
   LexState lexstate;
@@ -1664,7 +1668,6 @@ LClosure *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff,
   lua_assert(!funcstate.prev && funcstate.nups == 1 && !lexstate.fs);
   /* all scopes should be correctly finished */
   lua_assert(dyd->actvar.n == 0 && dyd->gt.n == 0 && dyd->label.n == 0);
-  compile_stripdebug(L, funcstate.f);
   L->top--;  /* remove scanner's table */
   return cl;  /* closure is on the stack, too */
 }
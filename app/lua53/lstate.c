@@ -158,10 +158,12 @@ void luaE_shrinkCI (lua_State *L) {
 
 static void stack_init (lua_State *L1, lua_State *L) {
   int i; CallInfo *ci;
+  int size = G(L)->stackinit;
   /* initialize stack array */
-  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE, TValue);
-  L1->stacksize = BASIC_STACK_SIZE;
-  for (i = 0; i < BASIC_STACK_SIZE; i++)
+  L1->stack = luaM_newvector(L, size, TValue);
+  L1->stacksize = size;
+  G(L)->stackbytes += size * sizeof(TValue);
+  for (i = 0; i < size; i++)
     setnilvalue(L1->stack + i);  /* erase new stack */
   L1->top = L1->stack;
   L1->stack_last = L1->stack + L1->stacksize - EXTRA_STACK;
@@ -183,6 +185,7 @@ static void freestack (lua_State *L) {
   luaE_freeCI(L);
   lua_assert(L->nci == 0);
   luaM_freearray(L, L->stack, L->stacksize);  /* free stack array */
+  G(L)->stackbytes -= L->stacksize * sizeof(TValue);
 }
 
 
@@ -259,6 +262,7 @@ static void close_state (lua_State *L) {
     luai_userstateclose(L);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
   freestack(L);
+  luaM_closeslabs(L);
   if (L == L0) {
     (*g->frealloc)(g->ud, g->cache, KEYCACHE_N * sizeof(KeyCacheLine), 0);
     L0 = NULL;  /* so reopening state initialises properly */
@@ -326,6 +330,11 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   preinit_thread(L, g);
   g->frealloc = f;
   g->ud = ud;
+#if LUAI_SLABMAX > 0
+  memset(g->slabs, 0, sizeof(g->slabs));
+  g->slabv = NULL;
+  g->nslabs = g->sizeslabv = 0;
+#endif
   g->mainthread = L;
   g->seed = makeseed(L);            /* overwritten by LFS value if LFS loaded */
   g->gcrunning = 0;                             /* no GC while building state */
@@ -347,6 +356,9 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->gcsteptime = 0;
+  g->stackinit = BASIC_STACK_SIZE;
+  g->stackbytes = 0;
   g->stripdefault = LUAI_OPTIMIZE_DEBUG;
   g->ROstrt.size = 0;
   g->ROstrt.nuse = 0;
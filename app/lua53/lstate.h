@@ -70,6 +70,9 @@ struct lua_longjmp;  /* defined in ldo.c */
 
 #define BASIC_STACK_SIZE        (2*LUA_MINSTACK)
 
+/* smallest initial stack: the first ci of a thread needs LUA_MINSTACK slots */
+#define MIN_STACK_INIT          (LUA_MINSTACK + EXTRA_STACK + 1)
+
 
 /* kinds of Garbage Collection */
 #define KGC_NORMAL	0
@@ -148,6 +151,11 @@ typedef struct FlashHeader LFSHeader;
 typedef struct global_State {
   lua_Alloc frealloc;  /* function to reallocate memory */
   void *ud;         /* auxiliary data to 'frealloc' */
+#if LUAI_SLABMAX > 0
+  struct Slab *slabs[LUAI_SLABMAX / 8];  /* slabs with free slots by class */
+  struct Slab **slabv;  /* all slabs in address order */
+  int nslabs, sizeslabv;
+#endif
   l_mem totalbytes;  /* number of bytes currently allocated - GCdebt */
   l_mem GCdebt;  /* bytes allocated not yet compensated by the collector */
   lu_mem GCmemtrav;  /* memory traversed by the GC */
@@ -173,6 +181,9 @@ typedef struct global_State {
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int gcsteptime;  /* time limit (us) of one GC step; 0 if unbounded */
+  int stackinit;  /* stack size of new threads */
+  lu_mem stackbytes;  /* bytes in the stacks of all threads */
   int stripdefault;  /* default stripping level for compilation */
   l_mem gcmemfreeboard;  /* Free board which triggers EGC */
   lua_CFunction panic;  /* to be called in unprotected errors */
@@ -46,9 +46,18 @@ int luaS_eqlngstr (TString *a, TString *b) {
 }
 
 
+/*
+** With LUA_FULL_STRING_HASH all the characters of short strings are used,
+** so that interned strings differing in a few characters do not collide.
+** This changes the hashes held in LFS, so it is part of FLASH_SIG.
+*/
 unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
   unsigned int h = seed ^ cast(unsigned int, l);
+#ifdef LUA_FULL_STRING_HASH
+  size_t step = l <= LUAI_MAXSHORTLEN ? 1 : (l >> LUAI_HASHLIMIT) + 1;
+#else
   size_t step = (l >> LUAI_HASHLIMIT) + 1;
+#endif
   for (; l >= step; l -= step)
     h ^= ((h<<5) + (h>>2) + cast_byte(str[l - 1]));
   return h;
@@ -153,6 +162,63 @@ void luaS_remove (lua_State *L, TString *ts) {
 }
 
 
+/*
+** Optional profile of RAM short string creation, used to find the strings
+** worth adding to the LFS ROstrt.  Each slot counts the creations of one
+** string and holds a copy of it, as the TString itself may be collected and
+** recreated many times.  Strings are dropped once all slots are in use.
+*/
+typedef struct StrProfile {
+  unsigned int hash;
+  unsigned short count;
+  lu_byte len;
+  char s[LUAI_MAXSHORTLEN];
+} StrProfile;
+
+static StrProfile *strprof = NULL;
+static int strprofsize = 0;
+
+static void profileshrstr (const char *str, size_t l, unsigned int h) {
+  int i;
+  for (i = 0; i < strprofsize; i++) {
+    StrProfile *p = &strprof[lmod(h + i, strprofsize)];
+    if (p->count == 0) {
+      p->hash = h;
+      p->count = 1;
+      p->len = cast_byte(l);
+      memcpy(p->s, str, l);
+      return;
+    }
+    if (p->hash == h && p->len == l && memcmp(p->s, str, l) == 0) {
+      if (p->count < (unsigned short) ~0)
+        p->count++;
+      return;
+    }
+  }
+}
+
+/* Start profiling with (at least) n slots, or stop if n is 0 */
+void luaS_profile (lua_State *L, int n) {
+  strprof = luaM_freearray(L, strprof, strprofsize);
+  strprofsize = 0;
+  if (n > 0) {
+    n = 1 << luaO_ceillog2(n);
+    strprof = luaM_newvector(L, n, StrProfile);
+    memset(strprof, 0, n * sizeof(StrProfile));
+    strprofsize = n;
+  }
+}
+
+/* Return the count of profile slot i and its string, or -1 past the end */
+int luaS_getprofile (int i, const char **s, size_t *l) {
+  if (i >= strprofsize)
+    return -1;
+  *s = strprof[i].s;
+  *l = strprof[i].len;
+  return strprof[i].count;
+}
+
+
 /*
 ** checks whether short string exists and reuses it or creates a new one
 */
@@ -186,10 +252,13 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
       }
     }
   }
-  if (g->strt.nuse >= g->strt.size && g->strt.size <= MAX_INT/2) {
+  if (cast(l_mem, g->strt.nuse) * 100 >= cast(l_mem, g->strt.size) * LUA_STRTAB_LOAD &&
+      g->strt.size <= MAX_INT/2) {
     luaS_resize(L, g->strt.size * 2);
     list = &g->strt.hash[lmod(h, g->strt.size)];  /* recompute with new size */
   }
+  if (strprof)
+    profileshrstr(str, l, h);
   ts = createstrobj(L, l, LUA_TSHRSTR, h);
   memcpy(getstr(ts), str, l * sizeof(char));
   ts->shrlen = cast_byte(l);
@@ -46,6 +46,8 @@ LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
 LUAI_FUNC TString *luaS_new (lua_State *L, const char *str);
 LUAI_FUNC TString *luaS_createlngstrobj (lua_State *L, size_t l);
+LUAI_FUNC void luaS_profile (lua_State *L, int n);
+LUAI_FUNC int luaS_getprofile (int i, const char **s, size_t *l);
 
 
 #endif
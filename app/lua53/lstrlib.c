@@ -611,18 +611,123 @@ static void reprepstate (MatchState *ms) {
 }
 
 
+/*
+** {======================================================
+** Pattern cache
+** Parsers tend to match the same few patterns over and over, so what
+** can be learnt from a pattern before matching is kept for the last
+** few patterns seen, keyed by the address of the pattern string.  The
+** strings are anchored in a registry table while cached, so an address
+** cannot be reused by another string until its entry is evicted.
+** =======================================================
+*/
+
+#if !defined(LUA_PATCACHE)
+#define LUA_PATCACHE	8
+#endif
+
+
+typedef struct PatInfo {
+  unsigned char anchor;  /* pattern starts with '^' */
+  unsigned char plain;  /* pattern has no special characters */
+  unsigned short plen;  /* length of literal prefix after any anchor */
+} PatInfo;
+
+
+static struct {
+  const char *p;
+  size_t lp;
+  unsigned int used;  /* 'patclock' at last use, for LRU eviction */
+  PatInfo info;
+} patcache[LUA_PATCACHE];
+
+static unsigned int patclock;
+
+
+/*
+** The literal prefix is the run of plain characters that every match
+** must start with: it stops at the first special character, and leaves
+** out a character that may be repeated zero times.
+*/
+static void analysepattern (PatInfo *pi, const char *p, size_t lp) {
+  const char *q, *end = p + lp;
+  size_t n = 0;
+  pi->anchor = (*p == '^');
+  pi->plain = nospecials(p, lp);
+  q = p + pi->anchor;
+  while (q + n < end && n < USHRT_MAX && q[n] && !strchr(SPECIALS, q[n])) {
+    char next = (q + n + 1 < end) ? q[n + 1] : '\0';
+    if (next == '*' || next == '?' || next == '-')
+      break;
+    n++;
+    if (next == '+')
+      break;
+  }
+  pi->plen = (unsigned short)n;
+}
+
+
+static const PatInfo *getpatinfo (lua_State *L, int arg,
+                                  const char *p, size_t lp) {
+  unsigned int i, lru = 0;
+  for (i = 0; i < LUA_PATCACHE; i++) {
+    if (patcache[i].p == p && patcache[i].lp == lp) {
+      patcache[i].used = ++patclock;
+      return &patcache[i].info;
+    }
+    if (patcache[i].used < patcache[lru].used)
+      lru = i;
+  }
+  /* miss: replace the least recently used entry */
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, patcache) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_createtable(L, LUA_PATCACHE, 0);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, patcache);
+  }
+  lua_pushvalue(L, arg);
+  lua_rawseti(L, -2, lru + 1);
+  lua_pop(L, 1);
+  patcache[lru].p = p;
+  patcache[lru].lp = lp;
+  patcache[lru].used = ++patclock;
+  analysepattern(&patcache[lru].info, p, lp);
+  return &patcache[lru].info;
+}
+
+
+/*
+** Advance 's' to the first place at or after it where a match can
+** start, given the literal prefix 'p' of 'pi', or return NULL if none
+*/
+static const char *skiptoprefix (const PatInfo *pi, const char *p,
+                                 const char *s, const char *e) {
+  if (pi->plen == 0)
+    return s;
+  if (pi->anchor)
+    return ((size_t)(e - s) >= pi->plen && memcmp(s, p, pi->plen) == 0)
+           ? s : NULL;
+  return lmemfind(s, e - s, p, pi->plen);
+}
+
+/* }====================================================== */
+
+
 static int str_find_aux (lua_State *L, int find) {
   size_t ls, lp;
   const char *s = luaL_checklstring(L, 1, &ls);
   const char *p = luaL_checklstring(L, 2, &lp);
+  const PatInfo *pi = NULL;
   lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), ls);
   if (init < 1) init = 1;
   else if (init > (lua_Integer)ls + 1) {  /* start after string's end? */
     lua_pushnil(L);  /* cannot find anything */
     return 1;
   }
+  if (!(find && lua_toboolean(L, 4)))
+    pi = getpatinfo(L, 2, p, lp);
   /* explicit request or no special characters? */
-  if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
+  if (find && (pi == NULL || pi->plain)) {
     /* do a plain search */
     const char *s2 = lmemfind(s + init - 1, ls - (size_t)init + 1, p, lp);
     if (s2) {
@@ -634,13 +739,15 @@ static int str_find_aux (lua_State *L, int find) {
   else {
     MatchState ms;
     const char *s1 = s + init - 1;
-    int anchor = (*p == '^');
+    int anchor = pi->anchor;
     if (anchor) {
       p++; lp--;  /* skip anchor character */
     }
     prepstate(&ms, L, s, ls, p, lp);
     do {
       const char *res;
+      if ((s1 = skiptoprefix(pi, p, s1, ms.src_end)) == NULL)
+        break;  /* literal prefix appears nowhere further on */
       reprepstate(&ms);
       if ((res=match(&ms, s1, p)) != NULL) {
         if (find) {
@@ -673,6 +780,7 @@ typedef struct GMatchState {
   const char *src;  /* current position */
   const char *p;  /* pattern */
   const char *lastmatch;  /* end of last match */
+  PatInfo pi;  /* copy, as the cache entry may be evicted meanwhile */
   MatchState ms;  /* match state */
 } GMatchState;
 
@@ -683,6 +791,8 @@ static int gmatch_aux (lua_State *L) {
   gm->ms.L = L;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    if ((src = skiptoprefix(&gm->pi, gm->p, src, gm->ms.src_end)) == NULL)
+      break;
     reprepstate(&gm->ms);
     if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
@@ -702,6 +812,9 @@ static int gmatch (lua_State *L) {
   gm = (GMatchState *)lua_newuserdata(L, sizeof(GMatchState));
   prepstate(&gm->ms, L, s, ls, p, lp);
   gm->src = s; gm->p = p; gm->lastmatch = NULL;
+  gm->pi = *getpatinfo(L, 2, p, lp);
+  if (gm->pi.anchor)  /* 'gmatch' takes a leading '^' literally */
+    gm->pi.anchor = gm->pi.plen = 0;
   lua_pushcclosure(L, gmatch_aux, 3);
   return 1;
 }
@@ -1585,6 +1698,7 @@ LUAMOD_API int luaopen_string (lua_State *L) {
   lua_pushrotable(L, LROT_TABLEREF(strlib));
   lua_setmetatable(L, -2);  /* set table as metatable for strings */
   lua_pop(L, 1);  /* pop dummy string */
+  memset(patcache, 0, sizeof(patcache));  /* entries of any earlier state */
   return 0;
 }
 
@@ -33,11 +33,13 @@
 #include "ldo.h"
 #include "lgc.h"
 #include "lmem.h"
+#include "lnodemcu.h"
 #include "lobject.h"
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
 #include "lvm.h"
+#include "lrotable.h"
 
 
 /*
@@ -176,6 +178,8 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
         return (i + 1) + t->sizearray;
       }
       nx = gnext(n);
+      if (nx == 0 && isdummy(t) && t->sizearray == 0)
+        return 1;  /* emptied and released by the GC, so nothing follows */
       if (nx == 0)
         luaG_runerror(L, "invalid key to 'next'");  /* key not found */
       else n += nx;
@@ -429,7 +433,7 @@ Table *luaH_new (lua_State *L) {
   GCObject *o = luaC_newobj(L, LUA_TTABLE, sizeof(Table));
   Table *t = gco2t(o);
   t->metatable = NULL;
-  t->flags = cast_byte(~0);
+  t->flags = cast_byte(~TBL_EMPTYSEEN);
   t->array = NULL;
   t->sizearray = 0;
   setnodevector(L, t, 0);
@@ -437,6 +441,20 @@ Table *luaH_new (lua_State *L) {
 }
 
 
+/*
+** Free the parts of a table that has no entries, leaving it as new.  This
+** allocates nothing, so the GC can call it.
+*/
+void luaH_release (lua_State *L, Table *t) {
+  if (!isdummy(t))
+    luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
+  luaM_freearray(L, t->array, t->sizearray);
+  t->array = NULL;
+  t->sizearray = 0;
+  setnodevector(L, t, 0);
+}
+
+
 void luaH_free (lua_State *L, Table *t) {
   if (!isdummy(t))
     luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
@@ -723,13 +741,14 @@ int luaH_isdummy (const Table *t) { return isdummy(t); }
 **
 ** If a match is found and the table addresses match, then this entry is
 ** probed first. In practice the hit-rate here is over 99% so the code
-** rarely fails back to doing the linear scan in ROM.
+** rarely fails back to doing the linear scan in ROM.  ROTables flagged as
+** LROT_SORTED (such as the LFS index generated on load) are binary searched
+** instead of scanned.  The cache probe and the search are shared with the
+** Lua 5.1 VM, see lrotable.h.
 ** Note that this hash does a couple of prime multiples and a modulus 2^X
 ** with is all evaluated in H/W, and adequately randomizes the lookup.
 */
 #define HASH(a,b) ((((29*(size_t)(a)) ^ (37*((b)->hash)))>>4)&(KEYCACHE_N-1))
-#define NDX_SHFT 24
-#define ADDR_MASK (((size_t) 1<<24)-1)
 
 /*
  * Find a string key entry in a rotable and return it.
@@ -738,65 +757,25 @@ static const TValue* rotable_findentry(ROTable *t, TString *key, unsigned *ppos)
   const ROTable_entry *e = cast(const ROTable_entry *, t->entry);
   const int tl = gettbllsizenode((struct Table *)t);
   const char *strkey = getstr(key);
-  const int hash = HASH(t, key);
-  KeyCache *cl = luaE_getcache(hash);
-  int i, j = 1, l;
+  KeyCache *cl = luaE_getcache(HASH(t, key));
+  int i;
 
   if (!e || gettt((struct GCObject *)key) != LUA_TSHRSTR)
     return luaO_nilobject;
 
-  l = getstrshrlen(key);
+  lua_assert(*(int*)"abcd" == 0x64636261);  /* lrot_search() is endian sensitive */
   /* scan the ROTable key cache and return if hit found */
-  for (i = 0; i < KEYCACHE_M; i++) {
-    int cl_ndx = cl[i] >> NDX_SHFT;
-    if ((((size_t)t - cl[i]) & ADDR_MASK) == 0 && cl_ndx < tl &&
-        strcmp(e[cl_ndx].key, strkey) == 0) {
-      if (ppos)
-        *ppos = cl_ndx;
-      return &e[cl_ndx].value;
-    }
-  }
- /*
-  * In practice most table scans are from a table miss due to the key cache
-  * short-circuiting almost all table hits. ROTable keys can be unsorted
-  * because of legacy compatibility, so the search must use a sequential
-  * equality match.
-  *
-  * The masked name4 comparison is a safe 4-byte comparison for all supported
-  * NodeMCU hosts and targets; It generate fast efficient access that avoids
-  * unaligned exceptions and costly strcmp() except for a last hit validation.
-  * However, this is ENDIAN SENSITIVE which is validate during initialisation.
-  *
-  * The majority of search misses are for metavalues (keys starting with __),
-  * so all metavalues if any must be at the front of each entry list.
-  */
-  lu_int32 name4 = *(lu_int32 *)strkey;
-  lu_int32 mask4 = l > 2 ? (~0u) : (~0u)>>((3-l)*8);
-  lua_assert(*(int*)"abcd" == 0x64636261);
-#define eq4(s)   (((*(lu_int32 *)s ^ name4) & mask4) == 0)
-#define ismeta(s) ((*(lu_int32 *)s & 0xffff) == *(lu_int32 *)"__\0")
-
-  if (ismeta(&name4)) {
-    for(i = 0; i < tl && ismeta(e[i].key); i++) {
-      if (eq4(e[i].key) && !strcmp(e[i].key, strkey)) {
-        j = 0; break;
-      }
-    }
-  } else {
-    for(i = 0; i < tl; i++) {
-      if (eq4(e[i].key) && !strcmp(e[i].key, strkey)) {
-        j = 0; break;
-      }
-    }
+  i = lrot_cache_probe(cl, KEYCACHE_M, t, e, sizeof(*e), tl, strkey);
+  if (i < 0) {
+    i = lrot_search(e, sizeof(*e), tl, strkey, getstrshrlen(key),
+                    getmarked((struct GCObject *)t) & LROT_SORTED);
+    if (i < 0)
+      return luaO_nilobject;
+    /* In the case of a hit, update the lookaside cache */
+    lrot_cache_update(cl, KEYCACHE_M, t, i);
   }
-  if (j)
-    return luaO_nilobject;
   if (ppos)
     *ppos = i;
-  /* In the case of a hit, update the lookaside cache */
-  for (j = KEYCACHE_M-1; j>0; j--)
-    cl[j] = cl[j-1];
-  cl[0] = ((size_t)t & ADDR_MASK) + (i << NDX_SHFT);
   return &e[i].value;
 }
 
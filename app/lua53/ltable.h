@@ -26,6 +26,12 @@
 
 #define invalidateTMcache(t)	((t)->flags = 0)
 
+/*
+** flag set by the GC on finding a table empty; as new keys invalidate the
+** TM cache, it is still set if the table has stayed empty since
+*/
+#define TBL_EMPTYSEEN	(1u << 7)
+
 
 /* true when 't' is using 'dummynode' as its hash part */
 #define isdummy(t)		((t)->lastfree == NULL)
@@ -56,6 +62,7 @@ LUAI_FUNC Table *luaH_new (lua_State *L);
 LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                                     unsigned int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
+LUAI_FUNC void luaH_release (lua_State *L, Table *t);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC lua_Unsigned luaH_getn (Table *t);
@@ -241,15 +241,20 @@ static int pmain (lua_State *L) {
   * LUA_INIT_STRING is a file reference and the file system is uninitialised
   * then attempting the open will trigger a file system format.
   */
-  platform_rcr_read(PLATFORM_RCR_INITSTR, (void**) &init);
+  const char *lfsmodule = platform_fastwake_name();  /* takes precedence */
+  if (!lfsmodule) {
+    platform_rcr_read(PLATFORM_RCR_INITSTR, (void**) &init);
+    if (init[0] == '!')  /* !module is a compile-free way of executing LFS module */
+      lfsmodule = init+1;
+  }
   STARTUP_COUNT;
-  if (init[0] == '!') { /* !module is a compile-free way of executing LFS module */
+  if (lfsmodule) {
     luaL_pushlfsmodule(L);
-    lua_pushstring(L, init+1);
+    lua_pushstring(L, lfsmodule);
     lua_call(L, 1, 1);  /* return LFS.module or nil */
     status = LUA_OK;
     if (!lua_isfunction(L, -1)) {
-      lua_pushfstring(L, "cannot load LFS.%s", init+1);
+      lua_pushfstring(L, "cannot load LFS.%s", lfsmodule);
       status = LUA_ERRRUN;
     }
   } else {
@@ -317,6 +317,9 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCSETMEMLIMIT 8
 #define LUA_GCISRUNNING		9
+#define LUA_GCSETSTEPTIME	10
+#define LUA_GCSETSTACKINIT	11
+#define LUA_GCSTACKCOUNT	12
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -476,8 +479,26 @@ LUA_API void (lua_pushrotable) (lua_State *L, const ROTable *p);
 LUA_API void (lua_createrotable) (lua_State *L, ROTable *t, const ROTable_entry *e, ROTable *mt);
 LUA_API lua_State *(lua_getstate) (void);
 LUA_API int (lua_pushstringsarray) (lua_State *L, int opt);
+LUA_API void (lua_stringprofile) (lua_State *L, int n);
+LUA_API int (lua_pushstringprofile) (lua_State *L);
+LUA_API int (lua_pushstrtstats) (lua_State *L, int opt);
 LUA_API int (lua_freeheap) (void);
 
+typedef struct lua_Sample {
+  const void *f;    /* Proto of the sampled Lua function */
+  const void *pc;   /* its savedpc */
+  unsigned count;
+} lua_Sample;
+
+LUA_API int (lua_sampleci) (lua_State *L, const void **f, const void **pc);
+LUA_API int (lua_pushsamples) (lua_State *L, lua_Sample *s, int n);
+#ifdef DEVELOPMENT_HEAP_PROFILE
+LUA_API int (lua_pushheapsites) (lua_State *L);
+#endif
+#ifdef DEVELOPMENT_FLOAT_PROFILE
+LUA_API int (lua_pushfloatsites) (lua_State *L, int warn);
+#endif
+
 LUA_API void (lua_getlfsconfig) (lua_State *L, int *);
 LUA_API int  (lua_pushlfsindex) (lua_State *L);
 LUA_API int  (lua_pushlfsfunc) (lua_State *L);
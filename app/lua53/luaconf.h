@@ -249,6 +249,14 @@ static inline lu_int32 fn(const type *o) { \
 
 #define LUAI_GCPAUSE	110  /* 110% (wait memory to grow 10% before next gc) */
 
+/*
+@@ LUAI_SLABMAX is the largest block (a multiple of 8) allocated from the
+** small object slabs in lmem.c, and LUAI_SLABSIZE the size of each slab.
+** Define LUAI_SLABMAX as 0 to allocate every block from the heap.
+*/
+#define LUAI_SLABMAX	40
+#define LUAI_SLABSIZE	512
+
 /* }================================================================== */
 
 /*
@@ -16,6 +16,7 @@
 #include "lnodemcu.h"
 #include "lobject.h"
 #include "lstring.h"
+#include "ltable.h"
 #include "lundump.h"
 #include "lzio.h"
 /*
@@ -81,6 +82,8 @@ typedef struct {
   lu_int32    TSlen;       /* Length of the same */
   lu_int32    TSndx;       /* Index into the same */
   lu_int32    TSnFixed;    /* Number of "fixed" TS */
+  Table      *strings;     /* Strings loaded so far, for LUAU_TSTRREF */
+  lu_int32    nstrings;    /* Number of the same */
   char        *buff;       /* Working buffer for assembling a TString */
   lu_int32    buffLen;     /* Maximum length of TS used in the image */
   TString   **list;        /* TS list used to index the ROstrt */
@@ -90,6 +93,7 @@ typedef struct {
   GCObject   *protogc;     /* LFS proto linked list */
   lu_byte     useStrRefs;  /* Flag if set then TStings are a index into TS */
   lu_byte     mode;        /* Either LFS or RAM */
+  lu_byte     sortIndex;   /* Flag if set then the LFS index is key sorted */
 } LoadState;
 static l_noret error(LoadState *S, const char *why) {
   luaO_pushfstring(S->L, "%s: %s precompiled chunk", S->name, why);
@@ -186,9 +190,10 @@ static void LoadBlock (LoadState *S, void *b, size_t size) {
 }
 #define LoadVar(S,x)		LoadVector(S,&x,1)
 static lu_byte LoadByte (LoadState *S) {
-  lu_byte x;
-  LoadVar(S, x);
-  return x;
+  int b = zgetc(S->Z);  /* inline read from the ZIO buffer */
+  if (b == EOZ)
+    error(S, "truncated");
+  return cast_byte(b);
 }
 static lua_Integer LoadInt (LoadState *S) {
   lu_byte b;
@@ -209,14 +214,27 @@ static lua_Integer LoadInteger (LoadState *S, lu_byte tt_data) {
   }
   return (tt_data & LUAU_TMASK) == LUAU_TNUMNINT ? -x-1 : x;
 }
+/*
+** In RAM loads, the strings already loaded are kept in S->strings, so that
+** any repeats can be dumped as a LUAU_TSTRREF index to the first copy.
+*/
 static TString *LoadString_ (LoadState *S, int prelen) {
   lua_State *L = S->L;
-  int n = LoadInteger(S, (prelen < 0 ? LoadByte(S) : prelen)) - 1;
+  int tt = prelen < 0 ? LoadByte(S) : prelen;
+  int n;
   TString *ts;
+  if ((tt & LUAU_TMASK) == LUAU_TSTRREF) {
+    const TValue *o = S->strings ?
+                      luaH_getint(S->strings, LoadInteger(S, tt) + 1) : NULL;
+    if (!o || !ttisstring(o))
+      error(S, "bad string reference in");
+    return tsvalue(o);
+  }
+  n = LoadInteger(S, tt) - 1;
   if (n < 0)
     return NULL;
   if  (S->useStrRefs)
-    ts = S->TS[n];
+    return S->TS[n];
   else if (n <= LUAI_MAXSHORTLEN) {  /* short string? */
     char buff[LUAI_MAXSHORTLEN];
     LoadVector(S, buff, n);
@@ -228,6 +246,12 @@ static TString *LoadString_ (LoadState *S, int prelen) {
     LoadVector(S, getstr(ts), n);             /* load directly in final place */
     L->top--;  /* pop string */
   }
+  if (S->strings) {
+    TValue o;
+    setsvalue(L, &o, ts);
+    luaH_setint(L, S->strings, ++S->nstrings, &o);
+    luaC_barrierback(L, S->strings, &o);
+  }
   return ts;
 }
 #define LoadString(S) LoadString_(S,-1)
@@ -278,6 +302,11 @@ static void LoadConstants (LoadState *S, Proto *f) {
       o.value_.gc = cast(GCObject *, LoadString2(S, tt));
       o.tt_ = ctb(LUA_TLNGSTR);
       break;
+    case LUAU_TSTRREF: {
+      TString *ts = LoadString2(S, tt);
+      setsvalue(S->L, &o, ts);
+      break;
+      }
     default:
       lua_assert(0);
     }
@@ -402,11 +431,13 @@ static void fchecksize (LoadState *S, size_t size, const char *tname) {
     error(S, luaO_pushfstring(S->L, "%s size mismatch in", tname));
 }
 #define checksize(S,t)	fchecksize(S,sizeof(t),#t)
-static void checkHeader (LoadState *S, int format) {
+static int checkHeader (LoadState *S, int format) {
+  int f;
   checkliteral(S, LUA_SIGNATURE + 1, "not a");  /* 1st char already checked */
   if (LoadByte(S) != LUAC_VERSION)
     error(S, "version mismatch in");
-  if (LoadByte(S) != format)
+  f = LoadByte(S);
+  if (f != format && !(format == LUAC_FORMAT && f == LUAC_FORMAT_NOREFS))
     error(S, "format mismatch in");
   checkliteral(S, LUAC_DATA, "corrupted");
   checksize(S, int);
@@ -421,6 +452,7 @@ static void checkHeader (LoadState *S, int format) {
   LoadByte(S);  /* skip number tt field */
   if (LoadNumber(S) != LUAC_NUM)
     error(S, "float format mismatch in");
+  return f;
 }
 /*
 ** Load precompiled chunk to support standard LUA_API load functions. The
@@ -429,6 +461,7 @@ static void checkHeader (LoadState *S, int format) {
 LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
   LoadState S = {0};
   LClosure *cl;
+  int format;
   if (*name == '@' || *name == '=')
     S.name = name + 1;
   else if (*name == LUA_SIGNATURE[0])
@@ -440,14 +473,21 @@ LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
   S.mode = MODE_RAM;
   S.fh = NULL;
   S.useStrRefs = 0;
-  checkHeader(&S, LUAC_FORMAT);
+  format = checkHeader(&S, LUAC_FORMAT);
   cl = luaF_newLclosure(L, LoadByte(&S));
   setclLvalue(L, L->top, cl);
   luaD_inctop(L);
+  if (format == LUAC_FORMAT) {
+    S.strings = luaH_new(L);
+    sethvalue(L, L->top, S.strings);   /* anchor it */
+    luaD_inctop(L);
+  }
   cl->p = luaF_newproto(L);
   luaC_objbarrier(L, cl, cl->p);
   cl->p = LoadFunction(&S, cl->p, NULL);
   lua_assert(cl->nupvalues == cl->p->sizeupvalues);
+  if (S.strings)
+    L->top--;  /* pop the strings table */
   return cl;
 }
 /*============================================================================**
@@ -507,15 +547,16 @@ static void addTS(LoadState *S, int l, int extra) {
 ** functions have been added to these modules.  These tokens aren't unique as
 ** ("nil" and "function" are both tokens and typenames), hardwiring this
 ** duplication debounce as a wrapper around addTS() is the simplest way of
-** voiding the need for extra lookup resources.
+** voiding the need for extra lookup resources.  The found flags are reset at
+** the start of each load, as an image can also be loaded at runtime.
 */
+static struct {const char *k; int found; } dupTS[] = {{"nil", 0},{"function", 0}};
 static void addTSnodup(LoadState *S, const char *s, int extra) {
   int i, l = strlen(s);
-  static struct {const char *k; int found; } t[] = {{"nil", 0},{"function", 0}};
-  for (i = 0; i < sizeof(t)/sizeof(*t); i++) {
-    if (!strcmp(t[i].k, s)) {
-      if (t[i].found) return;  /* ignore the duplicate copy */
-      t[i].found = 1; /* flag that this constant is already loaded */
+  for (i = 0; i < sizeof(dupTS)/sizeof(*dupTS); i++) {
+    if (!strcmp(dupTS[i].k, s)) {
+      if (dupTS[i].found) return;  /* ignore the duplicate copy */
+      dupTS[i].found = 1; /* flag that this constant is already loaded */
       break;
       }
   }
@@ -557,6 +598,8 @@ static void LoadAllStrings (LoadState *S) {
     addTS(S, l, 0);
   }
   /* add the fixed strings to LFS */
+  for (i = 0; i < sizeof(dupTS)/sizeof(*dupTS); i++)
+    dupTS[i].found = 0;
   for (i = 0; (p = luaX_getstr(i, &extra))!=NULL; i++) {
     addTSnodup(S, p, extra);
   }
@@ -589,18 +632,37 @@ static void LoadAllProtos (LoadState *S) {
   /* generate the ROTable entries from first N constants; the last is a timestamp */
   int nk = LoadInt(S);
   lua_assert(n+1 == nk);
+ /*
+  * The entries are collected in RAM (in S->buff, so collected on error) and
+  * insertion sorted by key, so that the index can be binary searched.  This
+  * is skipped for absolute images, as their keys can't be read on the host.
+  */
   ROTable_entry *entry_list = cast(ROTable_entry *, StoreGetPos(S));
+  ROTable_entry *ev_list = NULL;
+  S->buff = luaM_newvector(L, n*sizeof(ROTable_entry), char);
+  S->buffLen = n*sizeof(ROTable_entry);
+  ev_list = cast(ROTable_entry *, S->buff);
   for (i = 0; i < nk - 1; i++) { // -1 to ignore timestamp
     lu_byte tt_data = LoadByte(S);
     TString *Tname = LoadString2(S, tt_data);
     const char *name = getstr(Tname) + OFFSET_TSTRING;
     lua_assert((tt_data & LUAU_TMASK) == LUAU_TSSTRING);
     ROTable_entry me = {name, LRO_LUDATA(S->pv[i])};
-    StoreR(S, NULL, 0, me, FMT_ROTENTRY);
+    int j = i;
+    if (S->sortIndex) {
+      for (; j > 0 && strcmp(ev_list[j-1].key, name) > 0; j--)
+        memcpy(cast(void *, ev_list + j), ev_list + j - 1, sizeof(me));
+    }
+    memcpy(cast(void *, ev_list + j), &me, sizeof(me));
   }
+  for (i = 0; i < n; i++)
+    StoreR(S, NULL, 0, ev_list[i], FMT_ROTENTRY);
+  S->buff = luaM_freearray(L, S->buff, S->buffLen);
+  S->buffLen = 0;
   StoreR(S, NULL, 0, eol, FMT_ROTENTRY);
   /* terminate the ROTable entry list and store the ROTable header */
-  ROTable ev = { (GCObject *)1, LUA_TTBLROF, LROT_MARKED,
+  ROTable ev = { (GCObject *)1, LUA_TTBLROF,
+                 LROT_MARKED | (S->sortIndex ? LROT_SORTED : 0),
                  (lu_byte) ~0, n, NULL, entry_list};
   S->fh->protoROTable = FHoffset(S, StoreR(S, NULL, 0, ev, FMT_ROTABLE));
   /* last const is timestamp */
@@ -621,9 +683,13 @@ static void undumpLFS(lua_State *L, void *ud) {
   checkliteral(S, LUA_PROTO_SIG,"no Proto vector");
   LoadAllProtos(S);
   S->fh->flash_size = byteptr(StoreGetPos(S)) - byteptr(S->startLFS);
-  luaN_setFlash(F, 0);
+  S->fh->flash_sig = ~0;      /* the signature is written last to commit the */
+  luaN_setFlash(F, 0);        /* image, as flash bits can still be cleared   */
   StoreN(S, S->fh, 1);
   luaN_setFlash(F, 0);
+  S->fh->flash_sig = FLASH_SIG;
+  StoreN(S, &S->fh->flash_sig, 1);
+  luaN_setFlash(F, 0);
   S->TS = luaM_freearray(L, S->TS, S->TSlen);
 }
 /*
@@ -638,6 +704,7 @@ LUAI_FUNC int luaU_undumpLFS(lua_State *L, ZIO *Z, int isabs) {
   S.Z = Z;
   S.mode = isabs && sizeof(size_t) != sizeof(lu_int32) ? MODE_LFSA : MODE_LFS;
   S.useStrRefs = 1;
+  S.sortIndex = !isabs;
   S.fh = &fh;
   L->nny++;                                 /* do not yield during undump LFS */
   status = luaD_pcall(L, undumpLFS, &S, savestack(L, L->top), L->errfunc);
@@ -19,6 +19,7 @@
 #define LUAU_TNUMNINT		(4<<4)
 #define LUAU_TSSTRING		(5<<4)
 #define LUAU_TLSTRING		(6<<4)
+#define LUAU_TSTRREF		(7<<4)   /* index of a string already loaded */
 #define LUAU_TMASK      (7<<4)
 #define LUAU_DMASK      0x0f
 
@@ -33,7 +34,8 @@
 
 #define MYINT(s)	(s[0]-'0')
 #define LUAC_VERSION	(MYINT(LUA_VERSION_MAJOR)*16+MYINT(LUA_VERSION_MINOR))
-#define LUAC_FORMAT         	10	     /* this is the NodeMCU format */
+#define LUAC_FORMAT         	12	     /* this is the NodeMCU format */
+#define LUAC_FORMAT_NOREFS    10       /* the same without string references */
 #define LUAC_LFS_IMAGE_FORMAT 11
 #define LUA_STRING_SIG       "\x19ss"
 #define LUA_PROTO_SIG        "\x19pr"
@@ -44,8 +46,8 @@ LUAI_FUNC LClosure* luaU_undump (lua_State* L, ZIO* Z, const char* name);
 /* dump one chunk; from ldump.c */
 LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w,
                          void* data, int strip);
-LUAI_FUNC int luaU_DumpAllProtos(lua_State *L, const Proto *m, lua_Writer w,
-                         void *data, int strip);
+LUAI_FUNC int luaU_DumpAllProtos(lua_State *L, const Proto *m, const Proto *s,
+                         lua_Writer w, void *data, int strip);
 
 LUAI_FUNC int luaU_undumpLFS(lua_State *L, ZIO *Z, int isabs);
 LUAI_FUNC int luaU_stripdebug (lua_State *L, Proto *f, int level, int recv);
@@ -87,7 +89,12 @@ LUAI_FUNC void luaN_setabsolute(lu_int32 addr);
 #define FLASH_SIG_B2_MASK     0x04
 #define FLASH_SIG_ABSOLUTE    0x01
 #define FLASH_SIG_IN_PROGRESS 0x08
-#define FLASH_SIG  (0xfafaa050 | FLASH_FORMAT_VERSION)
+#ifdef LUA_FULL_STRING_HASH
+#define FLASH_SIG_HASH        0x20    /* images hash strings differently */
+#else
+#define FLASH_SIG_HASH        0
+#endif
+#define FLASH_SIG  (0xfafaa050 | FLASH_FORMAT_VERSION | FLASH_SIG_HASH)
 
 #define FLASH_FORMAT_MASK    0xF00
 
@@ -688,6 +688,100 @@ void luaV_finishOp (lua_State *L) {
 */
 
 
+#ifdef DEVELOPMENT_FLOAT_PROFILE
+/*
+** {======================================================
+** Float profile (development builds only)
+** =======================================================
+*/
+/*
+** Counts the arithmetic operations that took a float (soft-float on the
+** ESP8266) path in each Lua function, keyed by source and line defined.
+** Once the site table is full, further functions are counted against site 0.
+** In warning mode each function is also reported on its first float op.
+*/
+#ifdef LUA_USE_ESP8266
+extern void dbg_printf(const char *fmt, ...);
+#else
+#define dbg_printf printf
+#endif
+
+#define FLOATSITE_N        32  /* must be a power of 2 */
+#define FLOATSITE_NAMELEN  24
+
+typedef struct FloatSite {
+  const TString *source;
+  int line;
+  lu_int32 count;
+  char name[FLOATSITE_NAMELEN];
+} FloatSite;
+
+static FloatSite floatsite[FLOATSITE_N];
+static int floatwarn = 0;
+
+
+static void floatop (const Proto *p) {
+  unsigned int h = point2uint(p->source) + cast(unsigned int, p->linedefined);
+  FloatSite *s;
+  int i;
+  for (i = 0; i < FLOATSITE_N; i++) {
+    int j = lmod(h + i, FLOATSITE_N);
+    s = &floatsite[j];
+    if (j == 0)
+      continue;  /* site 0 is the catch-all */
+    if (s->source == p->source && s->line == p->linedefined + 1)
+      break;
+    if (s->source == NULL && s->line == 0) {  /* unused, so claim it */
+      const char *src = (p->source) ? getstr(p->source) : "?";
+      size_t l = strlen(src);
+      if (*src == '@' || *src == '=')
+        src++, l--;
+      if (l >= FLOATSITE_NAMELEN)  /* keep the end of long names */
+        src += l - (FLOATSITE_NAMELEN - 1);
+      strncpy(s->name, src, FLOATSITE_NAMELEN - 1);
+      s->source = p->source;
+      s->line = p->linedefined + 1;  /* so that main chunks are nonzero */
+      if (floatwarn)
+        dbg_printf("float arithmetic in function at %s:%d\n",
+                   s->name, p->linedefined);
+      break;
+    }
+  }
+  if (i == FLOATSITE_N)
+    s = &floatsite[0];
+  s->count++;
+}
+
+
+/*
+** Return the name, line defined and float op count of site i, or 0 past the
+** end.  Unused sites have a NULL name.
+*/
+int luaV_floatsite (int i, const char **name, int *line, lu_int32 *count) {
+  if (i >= FLOATSITE_N)
+    return 0;
+  *name = (i == 0) ? "?" : (floatsite[i].line) ? floatsite[i].name : NULL;
+  *line = (i == 0) ? 0 : floatsite[i].line - 1;
+  *count = floatsite[i].count;
+  return 1;
+}
+
+
+/*
+** Clear all sites and set the warning mode
+*/
+void luaV_floatreset (int warn) {
+  memset(floatsite, 0, sizeof(floatsite));
+  floatwarn = warn;
+}
+
+#define countfloat()	floatop(cl->p)
+#else
+#define countfloat()	((void)0)
+#endif
+/* }====================================================== */
+
+
 /*
 ** some macros for common tasks in 'luaV_execute'
 */
@@ -750,6 +844,47 @@ void luaV_finishOp (lua_State *L) {
     Protect(luaV_finishset(L,t,k,v,slot)); }
 
 
+/*
+** Inline cache of ROTable field lookups, selected by the address of the
+** instruction doing the lookup.  ROTables are immutable, so a line stays
+** valid as long as its table and key do.  Only LFS keys are cached, since
+** these also live until restart; a RAM key could be collected and its
+** address reused by a different string.  Each line is verified against
+** the table and key, so colliding sites just displace each other.
+*/
+typedef struct ROSite {
+  const Table *t;
+  const TString *key;
+  const TValue *slot;
+} ROSite;
+
+static ROSite rosite[ROSITECACHE_N];
+
+static const TValue *rosite_get (const Instruction *pc, Table *t, TString *key) {
+  ROSite *site = &rosite[(cast(size_t, pc) / sizeof(Instruction)) &
+                         (ROSITECACHE_N - 1)];
+  if (site->t != t || site->key != key) {
+    const TValue *slot = luaH_getstr(t, key);
+    if (ttisnil(slot))
+      return slot;
+    site->t = t;
+    site->key = key;
+    site->slot = slot;
+  }
+  return site->slot;
+}
+
+#define isrositekey(t,k) \
+  (ttisrotable(t) && ttisshrstring(k) && isLFSobj(tsvalue(k)))
+
+/* 'gettableProtected' using the inline cache for ROTable fields */
+#define gettableCached(L,t,k,v) { const TValue *rslot; \
+  if (isrositekey(t,k) && \
+      !ttisnil(rslot = rosite_get(ci->u.l.savedpc, hvalue(t), tsvalue(k)))) \
+    { setobj2s(L, v, rslot); } \
+  else gettableProtected(L,t,k,v) }
+
+
 
 void luaV_execute (lua_State *L) {
   CallInfo *ci = L->ci;
@@ -804,13 +939,13 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_GETTABUP) {
         TValue *upval = cl->upvals[GETARG_B(i)]->v;
         TValue *rc = RKC(i);
-        gettableProtected(L, upval, rc, ra);
+        gettableCached(L, upval, rc, ra);
         vmbreak;
       }
       vmcase(OP_GETTABLE) {
         StkId rb = RB(i);
         TValue *rc = RKC(i);
-        gettableProtected(L, rb, rc, ra);
+        gettableCached(L, rb, rc, ra);
         vmbreak;
       }
       vmcase(OP_SETTABUP) {
@@ -848,7 +983,11 @@ void luaV_execute (lua_State *L) {
         TValue *rc = RKC(i);
         TString *key = tsvalue(rc);  /* key must be a string */
         setobjs2s(L, ra + 1, rb);
-        if (luaV_fastget(L, rb, key, aux, luaH_getstr)) {
+        if (isrositekey(rb, rc) &&
+            !ttisnil(aux = rosite_get(ci->u.l.savedpc, hvalue(rb), key))) {
+          setobj2s(L, ra, aux);
+        }
+        else if (luaV_fastget(L, rb, key, aux, luaH_getstr)) {
           setobj2s(L, ra, aux);
         }
         else Protect(luaV_finishget(L, rb, rc, ra, aux));
@@ -863,6 +1002,7 @@ void luaV_execute (lua_State *L) {
           setivalue(ra, intop(+, ib, ic));
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
+          countfloat();
           setfltvalue(ra, luai_numadd(L, nb, nc));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_ADD)); }
@@ -877,6 +1017,7 @@ void luaV_execute (lua_State *L) {
           setivalue(ra, intop(-, ib, ic));
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
+          countfloat();
           setfltvalue(ra, luai_numsub(L, nb, nc));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_SUB)); }
@@ -891,6 +1032,7 @@ void luaV_execute (lua_State *L) {
           setivalue(ra, intop(*, ib, ic));
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
+          countfloat();
           setfltvalue(ra, luai_nummul(L, nb, nc));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_MUL)); }
@@ -901,6 +1043,7 @@ void luaV_execute (lua_State *L) {
         TValue *rc = RKC(i);
         lua_Number nb; lua_Number nc;
         if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
+          countfloat();
           setfltvalue(ra, luai_numdiv(L, nb, nc));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_DIV)); }
@@ -966,6 +1109,7 @@ void luaV_execute (lua_State *L) {
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
           lua_Number m;
+          countfloat();
           luai_nummod(L, nb, nc, m);
           setfltvalue(ra, m);
         }
@@ -981,6 +1125,7 @@ void luaV_execute (lua_State *L) {
           setivalue(ra, luaV_div(L, ib, ic));
         }
         else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
+          countfloat();
           setfltvalue(ra, luai_numidiv(L, nb, nc));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_IDIV)); }
@@ -991,6 +1136,7 @@ void luaV_execute (lua_State *L) {
         TValue *rc = RKC(i);
         lua_Number nb; lua_Number nc;
         if (tonumber(rb, &nb) && tonumber(rc, &nc)) {
+          countfloat();
           setfltvalue(ra, luai_numpow(L, nb, nc));
         }
         else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_POW)); }
@@ -1004,6 +1150,7 @@ void luaV_execute (lua_State *L) {
           setivalue(ra, intop(-, 0, ib));
         }
         else if (tonumber(rb, &nb)) {
+          countfloat();
           setfltvalue(ra, luai_numunm(L, nb));
         }
         else {
@@ -1170,6 +1317,7 @@ void luaV_execute (lua_State *L) {
           lua_Number step = fltvalue(ra + 2);
           lua_Number idx = luai_numadd(L, fltvalue(ra), step); /* inc. index */
           lua_Number limit = fltvalue(ra + 1);
+          countfloat();
           if (luai_numlt(0, step) ? luai_numle(idx, limit)
                                   : luai_numle(limit, idx)) {
             ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
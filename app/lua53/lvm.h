@@ -109,5 +109,10 @@ LUAI_FUNC lua_Integer luaV_div (lua_State *L, lua_Integer x, lua_Integer y);
 LUAI_FUNC lua_Integer luaV_mod (lua_State *L, lua_Integer x, lua_Integer y);
 LUAI_FUNC lua_Integer luaV_shiftl (lua_Integer x, lua_Integer y);
 LUAI_FUNC void luaV_objlen (lua_State *L, StkId ra, const TValue *rb);
+#ifdef DEVELOPMENT_FLOAT_PROFILE
+LUAI_FUNC int luaV_floatsite (int i, const char **name, int *line,
+                              lu_int32 *count);
+LUAI_FUNC void luaV_floatreset (int warn);
+#endif
 
 #endif
@@ -68,7 +68,7 @@ static const char mem_debug_file[] ICACHE_RODATA_ATTR = __FILE__;
 #endif
 
 /* ping variables */
-static u16_t ping_seq_num = 0;
+static u16_t ping_next_id = PING_ID;
 static u32_t ping_time;
 
 static void ICACHE_FLASH_ATTR ping_timeout(void* arg)
@@ -87,7 +87,7 @@ static void ICACHE_FLASH_ATTR ping_timeout(void* arg)
 
 /** Prepare a echo ICMP request */
 static void ICACHE_FLASH_ATTR
-ping_prepare_echo( struct icmp_echo_hdr *iecho, u16_t len)
+ping_prepare_echo(struct ping_msg *pingmsg, struct icmp_echo_hdr *iecho, u16_t len)
 {
   size_t i = 0;
   size_t data_len = len - sizeof(struct icmp_echo_hdr);
@@ -95,12 +95,12 @@ ping_prepare_echo( struct icmp_echo_hdr *iecho, u16_t len)
   ICMPH_TYPE_SET(iecho, ICMP_ECHO);
   ICMPH_CODE_SET(iecho, 0);
   iecho->chksum = 0;
-  iecho->id     = PING_ID;
-  ++ ping_seq_num;
-  if (ping_seq_num == 0x7fff)
-	  ping_seq_num = 0;
+  iecho->id     = pingmsg->id;
+  ++ pingmsg->seqno;
+  if (pingmsg->seqno == 0x7fff)
+	  pingmsg->seqno = 1;
 
-  iecho->seqno  = htons(ping_seq_num);
+  iecho->seqno  = htons(pingmsg->seqno);
 
   /* fill the additional data buffer with some data */
   for(i = 0; i < data_len; i++) {
@@ -126,7 +126,6 @@ static u8_t ICACHE_FLASH_ATTR
 ping_recv(void *arg, struct raw_pcb *pcb, struct pbuf *p, ip_addr_t *addr)
 {
   struct icmp_echo_hdr *iecho = NULL;
-  static u16_t seqno = 0;
   struct ping_msg *pingmsg = (struct ping_msg*)arg;
 
   LWIP_UNUSED_ARG(arg);
@@ -137,11 +136,15 @@ ping_recv(void *arg, struct raw_pcb *pcb, struct pbuf *p, ip_addr_t *addr)
   if (pbuf_header( p, -PBUF_IP_HLEN)==0) {
     iecho = (struct icmp_echo_hdr *)p->payload;
 
-    if ((iecho->id == PING_ID) && (iecho->seqno == htons(ping_seq_num)) && iecho->type == ICMP_ER) {
+    /* Every session has a pcb of its own and sees every ICMP packet, so the
+       reply must match this session's identifier, sequence and target */
+    struct ip_hdr *reply_hdr = (struct ip_hdr*)((u8*)iecho - PBUF_IP_HLEN);
+    if ((iecho->id == pingmsg->id) && (iecho->seqno == htons(pingmsg->seqno)) && iecho->type == ICMP_ER &&
+        reply_hdr->src.addr == pingmsg->ping_opt->ip) {
       LWIP_DEBUGF( PING_DEBUG, ("ping: recv "));
       ip_addr_debug_print(PING_DEBUG, addr);
       LWIP_DEBUGF( PING_DEBUG, (" %"U32_F" ms\n", (sys_now()-ping_time)));
-	  if (iecho->seqno != seqno){
+	  if (pingmsg->replied != pingmsg->seqno){
 		  /* do some ping result processing */
 		  {
 			  struct ip_hdr *iphdr = NULL;
@@ -167,7 +170,7 @@ ping_recv(void *arg, struct raw_pcb *pcb, struct pbuf *p, ip_addr_t *addr)
 				  pingmsg->ping_opt->recv_function(pingmsg->ping_opt,(void*) &pingresp);
 			  }
 		  }
-		  seqno = iecho->seqno;
+		  pingmsg->replied = pingmsg->seqno;
 	  }
 
       PING_RESULT(1);
@@ -188,14 +191,17 @@ ping_recv(void *arg, struct raw_pcb *pcb, struct pbuf *p, ip_addr_t *addr)
 //        pbuf_free(p);
 //        return 1;
 //    }
+    /* leave the packet as it came for the other pcbs */
+    pbuf_header(p, PBUF_IP_HLEN);
   }
 
   return 0; /* don't eat the packet */
 }
 
 static void ICACHE_FLASH_ATTR
-ping_send(struct raw_pcb *raw, ip_addr_t *addr)
+ping_send(struct ping_msg *pingmsg, ip_addr_t *addr)
 {
+  struct raw_pcb *raw = pingmsg->ping_pcb;
   struct pbuf *p = NULL;
   struct icmp_echo_hdr *iecho = NULL;
   size_t ping_size = sizeof(struct icmp_echo_hdr) + PING_DATA_SIZE;
@@ -212,7 +218,7 @@ ping_send(struct raw_pcb *raw, ip_addr_t *addr)
   if ((p->len == p->tot_len) && (p->next == NULL)) {
     iecho = (struct icmp_echo_hdr *)p->payload;
 
-    ping_prepare_echo(iecho, (u16_t)ping_size);
+    ping_prepare_echo(pingmsg, iecho, (u16_t)ping_size);
 
     raw_sendto(raw, p, addr);
     ping_time = sys_now();
@@ -233,7 +239,7 @@ ping_coarse_tmr(void *arg)
 	ping_opt = pingmsg->ping_opt;
 	if (--pingmsg->sent_count != 0){
 		pingmsg ->ping_sent = system_get_time();
-		ping_send(pingmsg->ping_pcb, &ping_target);
+		ping_send(pingmsg, &ping_target);
 
 		sys_timeout(PING_TIMEOUT_MS, ping_timeout, pingmsg);
 		sys_timeout(pingmsg->coarse_time, ping_coarse_tmr, pingmsg);
@@ -275,7 +281,7 @@ ping_raw_init(struct ping_msg *pingmsg)
 
 	ping_target.addr = pingmsg->ping_opt->ip;
 	pingmsg ->ping_sent = system_get_time();
-	ping_send(pingmsg->ping_pcb, &ping_target);
+	ping_send(pingmsg, &ping_target);
 
 	sys_timeout(PING_TIMEOUT_MS, ping_timeout, pingmsg);
 	sys_timeout(pingmsg->coarse_time, ping_coarse_tmr, pingmsg);
@@ -303,6 +309,7 @@ ping_start(struct ping_option *ping_opt)
 
 	pingmsg->ping_start = system_get_time();
 	pingmsg->sent_count = pingmsg->max_count;
+	pingmsg->id = ping_next_id++;
 	return ping_raw_init(pingmsg);
 }
 
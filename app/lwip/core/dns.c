@@ -125,6 +125,11 @@ static const char mem_debug_file[] ICACHE_RODATA_ATTR = __FILE__;
 #define DNS_STATE_NEW             1
 #define DNS_STATE_ASKING          2
 #define DNS_STATE_DONE            3
+#define DNS_STATE_FAILED          4
+
+/* DNS cache entry flags */
+#define DNS_CACHE_NEGATIVE        0x01
+#define DNS_CACHE_USED            0x02
 
 #ifdef PACK_STRUCT_USE_INCLUDES
 #  include "arch/bpstruct.h"
@@ -184,6 +189,16 @@ struct dns_table_entry {
   void *arg;
 };
 
+#if DNS_CACHE_SIZE
+/** DNS cache entry: a resolved name kept for its TTL, apart from the queries */
+struct dns_cache_entry {
+  u32_t ttl;
+  ip_addr_t ipaddr;
+  u8_t  flags;
+  char *name;
+};
+#endif /* DNS_CACHE_SIZE */
+
 #if DNS_LOCAL_HOSTLIST
 
 #if DNS_LOCAL_HOSTLIST_IS_DYNAMIC
@@ -214,6 +229,10 @@ static void dns_init_local();
 /* forward declarations */
 static void dns_recv(void *s, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t port);
 static void dns_check_entries(void);
+static err_t dns_enqueue(const char *name, dns_found_callback found, void *callback_arg, u8_t state);
+#if DNS_CACHE_SIZE
+static void dns_cache_tmr(void);
+#endif /* DNS_CACHE_SIZE */
 
 /*-----------------------------------------------------------------------------
  * Globales
@@ -228,6 +247,11 @@ static ip_addr_t              dns_servers[DNS_MAX_SERVERS];
 //static u8_t                   dns_payload_buffer[LWIP_MEM_ALIGN_BUFFER(DNS_MSG_SIZE)];
 static u8_t*                  dns_payload;
 static u16_t					  dns_random;
+#if DNS_CACHE_SIZE
+static struct dns_cache_entry dns_cache[DNS_CACHE_SIZE];
+static struct dns_cache_stats dns_cache_counts;
+static u16_t                  dns_cache_prefetch = DNS_CACHE_PREFETCH;
+#endif /* DNS_CACHE_SIZE */
 /**
  * Initialize the resolver: set up the UDP pcb and configure the default server
  * (DNS_SERVER_ADDRESS).
@@ -317,6 +341,9 @@ dns_tmr(void)
   if (dns_pcb != NULL) {
     LWIP_DEBUGF(DNS_DEBUG, ("dns_tmr: dns_check_entries\n"));
     dns_check_entries();
+#if DNS_CACHE_SIZE
+    dns_cache_tmr();
+#endif /* DNS_CACHE_SIZE */
   }
 }
 
@@ -490,6 +517,150 @@ dns_lookup(const char *name)
   return IPADDR_NONE;
 }
 
+#if DNS_CACHE_SIZE
+/**
+ * Look up a name in the DNS cache.
+ *
+ * @param name the hostname to look up
+ * @param addr where to store the address of a positive entry
+ * @return the entry, or NULL if the name is not cached
+ */
+static struct dns_cache_entry * ICACHE_FLASH_ATTR
+dns_cache_lookup(const char *name, ip_addr_t *addr)
+{
+  u8_t i;
+
+  for (i = 0; i < DNS_CACHE_SIZE; ++i) {
+    struct dns_cache_entry *pCache = &dns_cache[i];
+    if ((pCache->ttl != 0) && (strcmp(name, pCache->name) == 0)) {
+      pCache->flags |= DNS_CACHE_USED;
+      if (!(pCache->flags & DNS_CACHE_NEGATIVE)) {
+        ip_addr_copy(*addr, pCache->ipaddr);
+      }
+      return pCache;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Store the answer for a name in the DNS cache, replacing the entry of the
+ * same name, a free one, or else the one that expires first.
+ *
+ * @param name the hostname that was resolved
+ * @param addr its address, or NULL if the server reported that it has none
+ * @param ttl the number of seconds to keep it
+ */
+static void ICACHE_FLASH_ATTR
+dns_cache_store(const char *name, ip_addr_t *addr, u32_t ttl)
+{
+  u8_t i, lttli = 0;
+  struct dns_cache_entry *pCache;
+  size_t namelen;
+
+  if (ttl == 0) {
+    return;
+  }
+  for (i = 0; i < DNS_CACHE_SIZE; ++i) {
+    pCache = &dns_cache[i];
+    if ((pCache->ttl != 0) && (strcmp(name, pCache->name) == 0)) {
+      break;
+    }
+    if (pCache->ttl < dns_cache[lttli].ttl) {
+      lttli = i;
+    }
+  }
+  if (i == DNS_CACHE_SIZE) {
+    pCache = &dns_cache[lttli];
+    namelen = os_strlen(name);
+    if ((pCache->name = (char *) mem_realloc(pCache->name, namelen+1)) == NULL) {
+      pCache->ttl = 0;
+      return;
+    }
+    MEMCPY(pCache->name, name, namelen+1);
+  }
+  pCache->ttl   = ttl;
+  pCache->flags = addr ? 0 : DNS_CACHE_NEGATIVE;
+  if (addr) {
+    ip_addr_copy(pCache->ipaddr, *addr);
+  }
+}
+
+/**
+ * Age the DNS cache by DNS_TMR_INTERVAL and query again the names that have
+ * been used and are dns_cache_prefetch seconds from expiry.
+ */
+static void ICACHE_FLASH_ATTR
+dns_cache_tmr(void)
+{
+  u8_t i;
+
+  for (i = 0; i < DNS_CACHE_SIZE; ++i) {
+    struct dns_cache_entry *pCache = &dns_cache[i];
+    if (pCache->ttl == 0) {
+      continue;
+    }
+    if ((--pCache->ttl == dns_cache_prefetch) && (pCache->ttl != 0) &&
+        ((pCache->flags & (DNS_CACHE_USED | DNS_CACHE_NEGATIVE)) == DNS_CACHE_USED)) {
+      LWIP_DEBUGF(DNS_DEBUG, ("dns_cache_tmr: \"%s\": prefetch\n", pCache->name));
+      if (dns_enqueue(pCache->name, NULL, NULL, DNS_STATE_NEW) == ERR_INPROGRESS) {
+        dns_cache_counts.prefetches++;
+      }
+    }
+  }
+}
+
+/**
+ * Return the counters of the DNS cache.
+ *
+ * @param stats where to store them
+ */
+void ICACHE_FLASH_ATTR
+dns_cache_getstats(struct dns_cache_stats *stats)
+{
+  u8_t i;
+
+  *stats = dns_cache_counts;
+  stats->size = DNS_CACHE_SIZE;
+  stats->used = 0;
+  for (i = 0; i < DNS_CACHE_SIZE; ++i) {
+    if (dns_cache[i].ttl != 0) {
+      stats->used++;
+    }
+  }
+  stats->prefetch = dns_cache_prefetch;
+}
+
+/**
+ * Empty the DNS cache, so that every name is queried again.
+ */
+void ICACHE_FLASH_ATTR
+dns_cache_flush(void)
+{
+  u8_t i;
+
+  for (i = 0; i < DNS_CACHE_SIZE; ++i) {
+    dns_cache[i].ttl = 0;
+    if (dns_cache[i].name != NULL) {
+      mem_free(dns_cache[i].name);
+      dns_cache[i].name = NULL;
+    }
+  }
+}
+
+/**
+ * Set how many seconds before it expires that a cached name that has been
+ * used is queried again, 0 to let the names expire.
+ *
+ * @param secs the number of seconds
+ */
+void ICACHE_FLASH_ATTR
+dns_cache_setprefetch(u16_t secs)
+{
+  dns_cache_prefetch = secs;
+}
+#endif /* DNS_CACHE_SIZE */
+
 #if DNS_DOES_NAME_CHECK
 /**
  * Compare the "dotted" name "query" with the encoded name "response"
@@ -714,6 +885,14 @@ dns_check_entry(u8_t i)
       }
       break;
     }
+    case DNS_STATE_FAILED: {
+      /* answer a name that is cached as not existing */
+      if (pEntry->found)
+        (*pEntry->found)(pEntry->name, NULL, pEntry->arg);
+      pEntry->state = DNS_STATE_UNUSED;
+      pEntry->found = NULL;
+      break;
+    }
     case DNS_STATE_UNUSED:
       /* nothing to do */
       break;
@@ -792,6 +971,13 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t
         /* Check for error. If so, call callback to inform. */
         if (((hdr->flags1 & DNS_FLAG1_RESPONSE) == 0) || (pEntry->err != 0) || (nquestions != 1)) {
           LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": error in flags\n", pEntry->name));
+#if DNS_CACHE_SIZE
+          if ((hdr->flags1 & DNS_FLAG1_RESPONSE) && (pEntry->err == DNS_FLAG2_ERR_NAME)) {
+            /* the name does not exist: remember that for a while */
+            dns_cache_store(pEntry->name, NULL, DNS_CACHE_NEG_TTL);
+            goto responseerr;
+          }
+#endif /* DNS_CACHE_SIZE */
           /* call callback to indicate error, clean up memory and return */
           //goto responseerr;
           goto memerr;
@@ -829,6 +1015,9 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t
             LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": response = ", pEntry->name));
             ip_addr_debug_print(DNS_DEBUG, (&(pEntry->ipaddr)));
             LWIP_DEBUGF(DNS_DEBUG, ("\n"));
+#if DNS_CACHE_SIZE
+            dns_cache_store(pEntry->name, &pEntry->ipaddr, pEntry->ttl);
+#endif /* DNS_CACHE_SIZE */
             /* call specified callback function if provided */
             if (pEntry->found) {
               (*pEntry->found)(pEntry->name, &pEntry->ipaddr, pEntry->arg);
@@ -848,6 +1037,10 @@ dns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t
           --nanswers;
         }
         LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: \"%s\": error in response\n", pEntry->name));
+#if DNS_CACHE_SIZE
+        /* the name exists but has no address */
+        dns_cache_store(pEntry->name, NULL, DNS_CACHE_NEG_TTL);
+#endif /* DNS_CACHE_SIZE */
         /* call callback to indicate error, clean up memory and return */
         goto responseerr;
       }
@@ -880,10 +1073,12 @@ memerr:
  * @param name the hostname that is to be queried
  * @param found a callback founction to be called on success, failure or timeout
  * @param callback_arg argument to pass to the callback function
+ * @param state DNS_STATE_NEW to send the query, DNS_STATE_FAILED to call
+ *              the callback with the failure on the next dns_tmr()
  * @return @return a err_t return code.
  */
 static err_t ICACHE_FLASH_ATTR
-dns_enqueue(const char *name, dns_found_callback found, void *callback_arg)
+dns_enqueue(const char *name, dns_found_callback found, void *callback_arg, u8_t state)
 {
   u8_t i;
   u8_t lseq, lseqi;
@@ -928,7 +1123,7 @@ dns_enqueue(const char *name, dns_found_callback found, void *callback_arg)
   if ((pEntry->name = (char *) mem_realloc(pEntry->name, namelen+1)) == NULL) {
     return ERR_MEM;
   }
-  pEntry->state = DNS_STATE_NEW;
+  pEntry->state = state;
   pEntry->seqno = dns_seqno++;
   pEntry->found = found;
   pEntry->arg   = callback_arg;
@@ -936,7 +1131,9 @@ dns_enqueue(const char *name, dns_found_callback found, void *callback_arg)
   pEntry->name[namelen] = 0;
 
   /* force to send query without waiting timer */
-  dns_check_entry(i);
+  if (state == DNS_STATE_NEW) {
+    dns_check_entry(i);
+  }
 
   /* dns query is enqueued */
   return ERR_INPROGRESS;
@@ -992,8 +1189,24 @@ dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback foun
     return ERR_OK;
   }
 
+#if DNS_CACHE_SIZE
+  {
+    struct dns_cache_entry *pCache = dns_cache_lookup(hostname, addr);
+    if (pCache == NULL) {
+      dns_cache_counts.misses++;
+    } else if (!(pCache->flags & DNS_CACHE_NEGATIVE)) {
+      dns_cache_counts.hits++;
+      return ERR_OK;
+    } else {
+      /* known not to exist: fail through the callback, as a query would */
+      dns_cache_counts.negative++;
+      return dns_enqueue(hostname, found, callback_arg, DNS_STATE_FAILED);
+    }
+  }
+#endif /* DNS_CACHE_SIZE */
+
   /* queue query with specified callback */
-  return dns_enqueue(hostname, found, callback_arg);
+  return dns_enqueue(hostname, found, callback_arg, DNS_STATE_NEW);
 }
 
 #endif /* LWIP_DNS */
@@ -259,8 +259,8 @@ lwip_sanity_check(void)
 void
 lwip_init(void)
 {
-  MEMP_NUM_TCP_PCB = 5;
-  TCP_WND = (4 * TCP_MSS);
+  MEMP_NUM_TCP_PCB = LWIP_TCP_MAXCONN_DEFAULT;
+  TCP_WND = LWIP_TCP_WND_DEFAULT;
   TCP_MAXRTX = 12;
   TCP_SYNMAXRTX = 6;
 
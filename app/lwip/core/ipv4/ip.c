@@ -48,6 +48,7 @@
 #include "lwip/icmp.h"
 #include "lwip/igmp.h"
 #include "lwip/raw.h"
+#include "platform_trace.h"
 #include "lwip/udp.h"
 #include "lwip/tcp_impl.h"
 #include "lwip/snmp.h"
@@ -307,6 +308,7 @@ ip_input(struct pbuf *p, struct netif *inp)
 
   /* identify the IP header */
   iphdr = (struct ip_hdr *)p->payload;
+  PLATFORM_TRACE_EVENT(TRACE_NET_RX, p->tot_len, iphdr->src.addr);
   if (IPH_V(iphdr) != 4) {
     LWIP_DEBUGF(IP_DEBUG | LWIP_DBG_LEVEL_WARNING, ("IP packet dropped due to bad version number %"U16_F"\n", IPH_V(iphdr)));
     ip_debug_print(p);
@@ -652,6 +654,7 @@ err_t ip_output_if_opt(struct pbuf *p, ip_addr_t *src, ip_addr_t *dest,
   LWIP_ASSERT("p->ref == 1", p->ref == 1);
 
   snmp_inc_ipoutrequests();
+  PLATFORM_TRACE_EVENT(TRACE_NET_TX, p->tot_len, dest != IP_HDRINCL ? dest->addr : 0);
 
   /* Should the IP header be generated or is it already included in p? */
   if (dest != IP_HDRINCL) {
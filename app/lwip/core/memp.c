@@ -471,6 +471,39 @@ memp_free(memp_t type, void *mem)
 }
 
 #endif /* MEMP_MEM_MALLOC */
+
+#if MEMP_MEM_MALLOC && MEMP_STATS
+/**
+ * Get an element of the given type from the heap, counting it in the stats
+ * of its pool as if the pools had been kept.
+ */
+void * ICACHE_FLASH_ATTR
+memp_malloc(memp_t type)
+{
+  void *mem;
+  LWIP_ERROR("memp_malloc: type < MEMP_MAX", (type < MEMP_MAX), return NULL;);
+
+  mem = mem_malloc(memp_sizes[type]);
+  if (mem != NULL) {
+    MEMP_STATS_INC_USED(used, type);
+  } else {
+    MEMP_STATS_INC(err, type);
+  }
+  return mem;
+}
+
+void ICACHE_FLASH_ATTR
+memp_free(memp_t type, void *mem)
+{
+  LWIP_ERROR("memp_free: type < MEMP_MAX", (type < MEMP_MAX), return;);
+
+  if (mem == NULL) {
+    return;
+  }
+  MEMP_STATS_DEC(used, type);
+  mem_free(mem);
+}
+#endif /* MEMP_MEM_MALLOC && MEMP_STATS */
 #if 0
 void memp_dump(void)
 {
@@ -365,6 +365,7 @@ pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
     /* If pbuf is to be allocated in RAM, allocate memory for it. */
     p = (struct pbuf*)mem_malloc(LWIP_MEM_ALIGN_SIZE(SIZEOF_STRUCT_PBUF + offset) + LWIP_MEM_ALIGN_SIZE(length));
     if (p == NULL) {
+      MEM_STATS_INC(err);
       return NULL;
     }
     /* Set up internal structure of the pbuf. */
@@ -35,6 +35,7 @@
 #include "mem.h"
 
 #include "lauxlib.h"
+#include "platform.h"
 
 #ifdef MEMLEAK_DEBUG
 static const char mem_debug_file[] ICACHE_RODATA_ATTR = __FILE__;
@@ -174,6 +175,45 @@ static void mbedtls_espconn_free(pmbedtls_espconn *mbedtlsconn)
 	*mbedtlsconn = NULL;
 }
 
+/*
+ * The certificates and key that tls.cert.verify() and tls.cert.auth() keep in
+ * flash are parsed by the first handshake that uses them and kept for the
+ * handshakes after it, which borrow them instead of reading and parsing the
+ * sector again.  Rewriting or disabling a sector drops its parsed copy, or
+ * marks it stale until the handshakes still borrowing it are over.
+ */
+typedef struct {
+	mbedtls_x509_crt crt;
+	mbedtls_pk_context pk;
+	uint8 users;		/* sessions borrowing crt and pk */
+	bool parsed;
+	bool stale;		/* flash changed while borrowed */
+} cert_cache;
+
+static cert_cache ca_cache, own_cache;
+
+static void cert_cache_drop(cert_cache *c)
+{
+	mbedtls_x509_crt_free(&c->crt);
+	mbedtls_pk_free(&c->pk);
+	c->parsed = c->stale = false;
+}
+
+static void cert_cache_release(cert_cache *c)
+{
+	if (--c->users == 0 && c->stale)
+		cert_cache_drop(c);
+}
+
+void espconn_mbedtls_cert_flush(bool ca)
+{
+	cert_cache *c = ca ? &ca_cache : &own_cache;
+	if (c->users)
+		c->stale = true;
+	else if (c->parsed)
+		cert_cache_drop(c);
+}
+
 static pmbedtls_session mbedtls_session_new(void)
 {
 	pmbedtls_session session = (pmbedtls_session)os_zalloc(sizeof(mbedtls_session));
@@ -194,6 +234,10 @@ static void mbedtls_session_free(pmbedtls_session *session)
 	mbedtls_x509_crt_free(&(*session)->cacert);
 	mbedtls_x509_crt_free(&(*session)->clicert);
 	mbedtls_pk_free(&(*session)->pkey);
+	if ((*session)->ca_cached)
+		cert_cache_release(&ca_cache);
+	if ((*session)->own_cached)
+		cert_cache_release(&own_cache);
 //	mbedtls_entropy_free(&(*session)->entropy);
 	os_free(*session);
 	*session = NULL;
@@ -374,6 +418,130 @@ static void mbedtls_handshake_succ(mbedtls_ssl_context *ssl)
 #endif
 }
 
+/*
+ * The record buffers are sized for the handshake.  Afterwards we never send
+ * more than MBEDTLS_SSL_PLAIN_ADD bytes per record, and the server sends no
+ * more than the fragment length it agreed to, so give the rest back.
+ */
+static void mbedtls_shrink_buffers(mbedtls_ssl_context *ssl)
+{
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+	size_t in_len = MBEDTLS_SSL_IN_CONTENT_LEN;
+	size_t out_len = MBEDTLS_SSL_PLAIN_ADD;
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+	size_t mfl = mbedtls_ssl_get_max_frag_len(ssl);
+	if (ssl->session && ssl->session->mfl_code != MBEDTLS_SSL_MAX_FRAG_LEN_NONE && mfl < in_len)
+		in_len = mfl;
+	if (mfl < out_len)
+		out_len = mfl;
+#endif
+	/* On failure the connection simply keeps its full size buffers */
+	mbedtls_ssl_shrink_buffers(ssl, in_len, out_len);
+#endif
+}
+
+#if defined(SSL_SESSION_CACHE_SIZE) && SSL_SESSION_CACHE_SIZE > 0
+/*
+ * Client sessions, keyed by the server address, so that reconnecting to the
+ * same server resumes the session (by session ID or RFC 5077 ticket) instead
+ * of repeating the key exchange.  The peer certificate is not kept: it is
+ * only needed by a full handshake and would cost more heap than the rest.
+ */
+typedef struct {
+	uint8 ip[4];
+	int port;
+	uint32 used;
+	mbedtls_ssl_session session;
+} session_cache_entry;
+
+static session_cache_entry *session_cache[SSL_SESSION_CACHE_SIZE];
+static uint32 session_cache_clock;
+
+static session_cache_entry **session_cache_find(const esp_tcp *tcp)
+{
+	int i;
+	for (i = 0; i < SSL_SESSION_CACHE_SIZE; i++) {
+		session_cache_entry *e = session_cache[i];
+		if (e && e->port == tcp->remote_port && os_memcmp(e->ip, tcp->remote_ip, 4) == 0)
+			return &session_cache[i];
+	}
+	return NULL;
+}
+
+static void session_cache_drop(session_cache_entry **slot)
+{
+	mbedtls_ssl_session_free(&(*slot)->session);
+	os_free(*slot);
+	*slot = NULL;
+}
+
+/* Offer the cached session for this server, if any, in the ClientHello */
+static void session_cache_resume(pmbedtls_msg msg, const esp_tcp *tcp)
+{
+	session_cache_entry **slot = session_cache_find(tcp);
+	if (slot && mbedtls_ssl_set_session(&msg->ssl, &(*slot)->session) == 0)
+		(*slot)->used = ++session_cache_clock;
+}
+
+/* Keep the session of a completed handshake, evicting the least recently used */
+static void session_cache_store(pmbedtls_msg msg, const esp_tcp *tcp)
+{
+	session_cache_entry **slot = session_cache_find(tcp);
+	int i;
+
+	if (slot == NULL) {
+		slot = &session_cache[0];
+		for (i = 0; i < SSL_SESSION_CACHE_SIZE && *slot; i++) {
+			if (session_cache[i] == NULL || session_cache[i]->used < (*slot)->used)
+				slot = &session_cache[i];
+		}
+		if (*slot)
+			session_cache_drop(slot);
+		*slot = (session_cache_entry *)os_zalloc(sizeof(session_cache_entry));
+		if (*slot == NULL)
+			return;
+		mbedtls_ssl_session_init(&(*slot)->session);
+		os_memcpy((*slot)->ip, tcp->remote_ip, 4);
+		(*slot)->port = tcp->remote_port;
+	}
+
+	if (mbedtls_ssl_get_session(&msg->ssl, &(*slot)->session) != 0) {
+		session_cache_drop(slot);
+		return;
+	}
+	(*slot)->used = ++session_cache_clock;
+#if defined(MBEDTLS_X509_CRT_PARSE_C)
+	if ((*slot)->session.peer_cert) {
+		mbedtls_x509_crt_free((*slot)->session.peer_cert);
+		os_free((*slot)->session.peer_cert);
+		(*slot)->session.peer_cert = NULL;
+	}
+#endif
+}
+
+/* A failed handshake must not be retried with the same session */
+static void session_cache_forget(const esp_tcp *tcp)
+{
+	session_cache_entry **slot = session_cache_find(tcp);
+	if (slot)
+		session_cache_drop(slot);
+}
+
+void espconn_ssl_session_flush(void)
+{
+	int i;
+	for (i = 0; i < SSL_SESSION_CACHE_SIZE; i++) {
+		if (session_cache[i])
+			session_cache_drop(&session_cache[i]);
+	}
+}
+#else
+#define session_cache_resume(msg, tcp)
+#define session_cache_store(msg, tcp)
+#define session_cache_forget(tcp)
+void espconn_ssl_session_flush(void) {}
+#endif
+
 /******************************************************************************
  * FunctionName : espconn_ssl_reconnect
  * Description  : reconnect with host
@@ -453,19 +621,17 @@ static bool espconn_ssl_read_param_from_flash(void *param, uint16 len, int32 off
 }
 
 static bool
-espconn_mbedtls_parse(mbedtls_msg *msg, mbedtls_auth_type auth_type, const uint8_t *buf, size_t len)
+espconn_mbedtls_parse_into(mbedtls_x509_crt *crt, mbedtls_pk_context *pk, mbedtls_auth_type auth_type, const uint8_t *buf, size_t len)
 {
 	int ret;
 
 	switch (auth_type) {
 	case ESPCONN_CERT_AUTH:
-		ret = mbedtls_x509_crt_parse(&msg->psession->cacert, buf, len);
-		break;
 	case ESPCONN_CERT_OWN:
-		ret = mbedtls_x509_crt_parse(&msg->psession->clicert, buf, len);
+		ret = mbedtls_x509_crt_parse(crt, buf, len);
 		break;
 	case ESPCONN_PK:
-		ret = mbedtls_pk_parse_key(&msg->psession->pkey, buf, len, NULL, 0);
+		ret = mbedtls_pk_parse_key(pk, buf, len, NULL, 0);
 		break;
 	default:
 		return false;
@@ -475,6 +641,14 @@ exit:
 	return (ret >= 0);
 }
 
+static bool
+espconn_mbedtls_parse(mbedtls_msg *msg, mbedtls_auth_type auth_type, const uint8_t *buf, size_t len)
+{
+	return espconn_mbedtls_parse_into(auth_type == ESPCONN_CERT_AUTH ?
+	                                  &msg->psession->cacert : &msg->psession->clicert,
+	                                  &msg->psession->pkey, auth_type, buf, len);
+}
+
 /*
  * Three-way return:
  *   0 for no commitment, -1 to fail the connection, 1 on success
@@ -549,7 +723,7 @@ nodemcu_tls_cert_get(mbedtls_msg *msg, mbedtls_auth_type auth_type)
 	return 1;
 }
 
-static bool mbedtls_msg_info_load(mbedtls_msg *msg, mbedtls_auth_type auth_type)
+static bool mbedtls_msg_info_load(mbedtls_x509_crt *crt, mbedtls_pk_context *pk, mbedtls_auth_type auth_type)
 {
 	const char* const begin = "-----BEGIN";
 	const char* const type_name  = "private_key";
@@ -597,7 +771,7 @@ again:
 		load_buf[load_len - 1] = '\0';
 	}
 
-	ret = espconn_mbedtls_parse(msg, auth_type, load_buf, load_len) ? 0 : -1;
+	ret = espconn_mbedtls_parse_into(crt, pk, auth_type, load_buf, load_len) ? 0 : -1;
 
 exit:
 	os_free(load_buf);
@@ -608,6 +782,43 @@ exit:
 	}
 }
 
+/*
+ * Point crt and pk at the parsed certificates of a flash sector, parsing them
+ * into the cache unless its copy is stale, in which case the session gets its
+ * own as before.
+ */
+static bool mbedtls_msg_cert_load(mbedtls_msg *msg, bool ca, mbedtls_x509_crt **crt, mbedtls_pk_context **pk)
+{
+	cert_cache *c = ca ? &ca_cache : &own_cache;
+
+	if (c->stale) {
+		*crt = ca ? &msg->psession->cacert : &msg->psession->clicert;
+		*pk = &msg->psession->pkey;
+	} else {
+		if (!c->parsed) {
+			mbedtls_x509_crt_init(&c->crt);
+			mbedtls_pk_init(&c->pk);
+			c->parsed = true;
+			if (!mbedtls_msg_info_load(&c->crt, &c->pk, ca ? ESPCONN_CERT_AUTH : ESPCONN_CERT_OWN) ||
+			    (!ca && !mbedtls_msg_info_load(&c->crt, &c->pk, ESPCONN_PK))) {
+				cert_cache_drop(c);
+				return false;
+			}
+		}
+		c->users++;
+		if (ca)
+			msg->psession->ca_cached = true;
+		else
+			msg->psession->own_cached = true;
+		*crt = &c->crt;
+		*pk = &c->pk;
+		return true;
+	}
+	if (!mbedtls_msg_info_load(*crt, *pk, ca ? ESPCONN_CERT_AUTH : ESPCONN_CERT_OWN))
+		return false;
+	return ca || mbedtls_msg_info_load(*crt, *pk, ESPCONN_PK);
+}
+
 static void
 mbedtls_dbg(void *p, int level, const char *file, int line, const char *str)
 {
@@ -616,6 +827,8 @@ mbedtls_dbg(void *p, int level, const char *file, int line, const char *str)
 
 static bool mbedtls_msg_config(mbedtls_msg *msg)
 {
+	mbedtls_x509_crt *crt;
+	mbedtls_pk_context *pk;
 	bool load_flag = false;
 	int ret = ESPCONN_OK;
 
@@ -647,11 +860,9 @@ static bool mbedtls_msg_config(mbedtls_msg *msg)
 		}
 	}
 	if (ret == 0 && ssl_client_options.cert_req_sector.flag) {
-		load_flag = mbedtls_msg_info_load(msg, ESPCONN_CERT_OWN);
-		lwIP_REQUIRE_ACTION(load_flag, exit, ret = ESPCONN_MEM);
-		load_flag = mbedtls_msg_info_load(msg, ESPCONN_PK);
+		load_flag = mbedtls_msg_cert_load(msg, false, &crt, &pk);
 		lwIP_REQUIRE_ACTION(load_flag, exit, ret = ESPCONN_MEM);
-		ret = mbedtls_ssl_conf_own_cert(&msg->conf, &msg->psession->clicert, &msg->psession->pkey);
+		ret = mbedtls_ssl_conf_own_cert(&msg->conf, crt, pk);
 		lwIP_REQUIRE_ACTION(ret == 0, exit, ret = ESPCONN_ABRT);
 	}
 
@@ -671,10 +882,10 @@ static bool mbedtls_msg_config(mbedtls_msg *msg)
 		}
 	}
 	if(ret == 0 && ssl_client_options.cert_ca_sector.flag) {
-		load_flag = mbedtls_msg_info_load(msg, ESPCONN_CERT_AUTH);
+		load_flag = mbedtls_msg_cert_load(msg, true, &crt, &pk);
 		lwIP_REQUIRE_ACTION(load_flag, exit, ret = ESPCONN_MEM);
 		mbedtls_ssl_conf_authmode(&msg->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
-		mbedtls_ssl_conf_ca_chain(&msg->conf, &msg->psession->cacert, NULL);
+		mbedtls_ssl_conf_ca_chain(&msg->conf, crt, NULL);
 	} else if (ret == 0) {
 		/*
 		 * OPTIONAL is not optimal for security, but makes interop easier in this session
@@ -698,6 +909,38 @@ exit:
 	}
 }
 
+pmbedtls_msg espconn_mbedtls_client_new(const esp_tcp *tcp)
+{
+	pmbedtls_msg msg = mbedtls_msg_new();
+	if (msg == NULL)
+		return NULL;
+	if (!mbedtls_msg_config(msg)) {
+		mbedtls_msg_free(&msg);
+		return NULL;
+	}
+	session_cache_resume(msg, tcp);
+	return msg;
+}
+
+bool espconn_mbedtls_client_handshaked(pmbedtls_msg msg, const esp_tcp *tcp)
+{
+	if (!mbedtls_handshake_result(msg)) {
+		session_cache_forget(tcp);
+		return false;
+	}
+	mbedtls_session_free(&msg->psession);
+	session_cache_store(msg, tcp);
+	mbedtls_shrink_buffers(&msg->ssl);
+	mbedtls_handshake_succ(&msg->ssl);
+	msg->quiet = true;
+	return true;
+}
+
+void espconn_mbedtls_client_free(pmbedtls_msg *msg)
+{
+	mbedtls_msg_free(msg);
+}
+
 int espconn_mbedtls_parse_internal(int socket, sint8 error)
 {
 	int ret = ERR_OK;
@@ -740,6 +983,7 @@ int espconn_mbedtls_parse_internal(int socket, sint8 error)
 				os_printf("client handshake start.\n");
 				config_flag = mbedtls_msg_config(TLSmsg);
 				if (config_flag) {
+					session_cache_resume(TLSmsg, Threadmsg->pespconn->proto.tcp);
 //					mbedtls_keep_alive(TLSmsg->fd.fd, 1, SSL_KEEP_IDLE, SSL_KEEP_INTVL, SSL_KEEP_CNT);
 					system_overclock();
 				} else {
@@ -749,6 +993,7 @@ int espconn_mbedtls_parse_internal(int socket, sint8 error)
 			}
 
 			system_soft_wdt_stop();
+			platform_cpufreq_boost();
 			uint8 cpu_freq;
 			cpu_freq = system_get_cpu_freq();
 			system_update_cpu_freq(160);
@@ -770,6 +1015,8 @@ int espconn_mbedtls_parse_internal(int socket, sint8 error)
 				os_printf("client handshake ok!\n");
 //				mbedtls_keep_alive(TLSmsg->fd.fd, 0, SSL_KEEP_IDLE, SSL_KEEP_INTVL, SSL_KEEP_CNT);
 				mbedtls_session_free(&TLSmsg->psession);
+				session_cache_store(TLSmsg, Threadmsg->pespconn->proto.tcp);
+				mbedtls_shrink_buffers(&TLSmsg->ssl);
 				mbedtls_handshake_succ(&TLSmsg->ssl);
 				system_restoreclock();
 
@@ -791,6 +1038,8 @@ int espconn_mbedtls_parse_internal(int socket, sint8 error)
 
 exit:
 	if (ret != ESPCONN_OK) {
+		if (TLSmsg && !TLSmsg->quiet)
+			session_cache_forget(Threadmsg->pespconn->proto.tcp);
 		mbedtls_fail_info(Threadmsg, ret);
 		if(ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
 			Threadmsg->hs_status = ESPCONN_OK;
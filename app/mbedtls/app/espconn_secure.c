@@ -187,6 +187,7 @@ bool ICACHE_FLASH_ATTR espconn_secure_ca_enable(uint8 level, uint32 flash_sector
 	if (level == ESPCONN_CLIENT){
 		ssl_client_options.cert_ca_sector.sector = flash_sector;
 		ssl_client_options.cert_ca_sector.flag = true;
+		espconn_mbedtls_cert_flush(true);
 		return true;
 	}
 
@@ -204,6 +205,7 @@ bool ICACHE_FLASH_ATTR espconn_secure_ca_disable(uint8 level)
 {
 	if (level == ESPCONN_CLIENT) {
 		ssl_client_options.cert_ca_sector.flag = false;
+		espconn_mbedtls_cert_flush(true);
 		return true;
 	}
 
@@ -227,6 +229,7 @@ bool ICACHE_FLASH_ATTR espconn_secure_cert_req_enable(uint8 level, uint32 flash_
 	if (level == ESPCONN_CLIENT){
 		ssl_client_options.cert_req_sector.sector = flash_sector;
 		ssl_client_options.cert_req_sector.flag = true;
+		espconn_mbedtls_cert_flush(false);
 		return true;
 	}
 
@@ -244,6 +247,7 @@ bool ICACHE_FLASH_ATTR espconn_secure_cert_req_disable(uint8 level)
 {
 	if (level == ESPCONN_CLIENT) {
 		ssl_client_options.cert_req_sector.flag = false;
+		espconn_mbedtls_cert_flush(false);
 		return true;
 	}
 
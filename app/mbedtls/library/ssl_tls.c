@@ -57,6 +57,17 @@
 static void ssl_reset_in_out_pointers( mbedtls_ssl_context *ssl );
 static uint32_t ssl_get_hs_total_len( mbedtls_ssl_context const *ssl );
 
+/* Size of the record buffers, which may shrink once the handshake is over */
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+#define SSL_IN_BUFFER_LEN( ssl )    ( ( ssl )->in_buf_len )
+#define SSL_OUT_BUFFER_LEN( ssl )   ( ( ssl )->out_buf_len )
+#else
+#define SSL_IN_BUFFER_LEN( ssl )    MBEDTLS_SSL_IN_BUFFER_LEN
+#define SSL_OUT_BUFFER_LEN( ssl )   MBEDTLS_SSL_OUT_BUFFER_LEN
+#endif
+#define SSL_OUT_CONTENT_LEN( ssl )  ( SSL_OUT_BUFFER_LEN( ssl ) - \
+        ( MBEDTLS_SSL_OUT_BUFFER_LEN - MBEDTLS_SSL_OUT_CONTENT_LEN ) )
+
 /* Length of the "epoch" field in the record header */
 static inline size_t ssl_ep_len( const mbedtls_ssl_context *ssl )
 {
@@ -125,10 +136,10 @@ static size_t ssl_get_maximum_datagram_size( mbedtls_ssl_context const *ssl )
 {
     size_t mtu = ssl_get_current_mtu( ssl );
 
-    if( mtu != 0 && mtu < MBEDTLS_SSL_OUT_BUFFER_LEN )
+    if( mtu != 0 && mtu < SSL_OUT_BUFFER_LEN( ssl ) )
         return( mtu );
 
-    return( MBEDTLS_SSL_OUT_BUFFER_LEN );
+    return( SSL_OUT_BUFFER_LEN( ssl ) );
 }
 
 static int ssl_get_remaining_space_in_datagram( mbedtls_ssl_context const *ssl )
@@ -151,7 +162,7 @@ static int ssl_get_remaining_payload_in_datagram( mbedtls_ssl_context const *ssl
 {
     int ret;
     size_t remaining, expansion;
-    size_t max_len = MBEDTLS_SSL_OUT_CONTENT_LEN;
+    size_t max_len = SSL_OUT_CONTENT_LEN( ssl );
 
 #if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
     const size_t mfl = mbedtls_ssl_get_max_frag_len( ssl );
@@ -2410,7 +2421,7 @@ static int ssl_compress_buf( mbedtls_ssl_context *ssl )
     ssl->transform_out->ctx_deflate.next_in = msg_pre;
     ssl->transform_out->ctx_deflate.avail_in = len_pre;
     ssl->transform_out->ctx_deflate.next_out = msg_post;
-    ssl->transform_out->ctx_deflate.avail_out = MBEDTLS_SSL_OUT_BUFFER_LEN - bytes_written;
+    ssl->transform_out->ctx_deflate.avail_out = SSL_OUT_BUFFER_LEN( ssl ) - bytes_written;
 
     ret = deflate( &ssl->transform_out->ctx_deflate, Z_SYNC_FLUSH );
     if( ret != Z_OK )
@@ -2419,7 +2430,7 @@ static int ssl_compress_buf( mbedtls_ssl_context *ssl )
         return( MBEDTLS_ERR_SSL_COMPRESSION_FAILED );
     }
 
-    ssl->out_msglen = MBEDTLS_SSL_OUT_BUFFER_LEN -
+    ssl->out_msglen = SSL_OUT_BUFFER_LEN( ssl ) -
                       ssl->transform_out->ctx_deflate.avail_out - bytes_written;
 
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "after compression: msglen = %d, ",
@@ -2457,7 +2468,7 @@ static int ssl_decompress_buf( mbedtls_ssl_context *ssl )
     ssl->transform_in->ctx_inflate.next_in = msg_pre;
     ssl->transform_in->ctx_inflate.avail_in = len_pre;
     ssl->transform_in->ctx_inflate.next_out = msg_post;
-    ssl->transform_in->ctx_inflate.avail_out = MBEDTLS_SSL_IN_BUFFER_LEN -
+    ssl->transform_in->ctx_inflate.avail_out = SSL_IN_BUFFER_LEN( ssl ) -
                                                header_bytes;
 
     ret = inflate( &ssl->transform_in->ctx_inflate, Z_SYNC_FLUSH );
@@ -2467,7 +2478,7 @@ static int ssl_decompress_buf( mbedtls_ssl_context *ssl )
         return( MBEDTLS_ERR_SSL_COMPRESSION_FAILED );
     }
 
-    ssl->in_msglen = MBEDTLS_SSL_IN_BUFFER_LEN -
+    ssl->in_msglen = SSL_IN_BUFFER_LEN( ssl ) -
                      ssl->transform_in->ctx_inflate.avail_out - header_bytes;
 
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "after decompression: msglen = %d, ",
@@ -2542,7 +2553,7 @@ int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
     }
 
-    if( nb_want > MBEDTLS_SSL_IN_BUFFER_LEN - (size_t)( ssl->in_hdr - ssl->in_buf ) )
+    if( nb_want > SSL_IN_BUFFER_LEN( ssl ) - (size_t)( ssl->in_hdr - ssl->in_buf ) )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "requesting more data than fits" ) );
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
@@ -2628,7 +2639,7 @@ int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
         }
         else
         {
-            len = MBEDTLS_SSL_IN_BUFFER_LEN - ( ssl->in_hdr - ssl->in_buf );
+            len = SSL_IN_BUFFER_LEN( ssl ) - ( ssl->in_hdr - ssl->in_buf );
 
             if( ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER )
                 timeout = ssl->handshake->retransmit_timeout;
@@ -3229,12 +3240,12 @@ int mbedtls_ssl_write_handshake_msg( mbedtls_ssl_context *ssl )
      *
      * Note: We deliberately do not check for the MTU or MFL here.
      */
-    if( ssl->out_msglen > MBEDTLS_SSL_OUT_CONTENT_LEN )
+    if( ssl->out_msglen > SSL_OUT_CONTENT_LEN( ssl ) )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "Record too large: "
                                     "size %u, maximum %u",
                                     (unsigned) ssl->out_msglen,
-                                    (unsigned) MBEDTLS_SSL_OUT_CONTENT_LEN ) );
+                                    (unsigned) SSL_OUT_CONTENT_LEN( ssl ) ) );
         return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
     }
 
@@ -4088,7 +4099,7 @@ static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
     }
 
     /* Check length against the size of our buffer */
-    if( ssl->in_msglen > MBEDTLS_SSL_IN_BUFFER_LEN
+    if( ssl->in_msglen > SSL_IN_BUFFER_LEN( ssl )
                          - (size_t)( ssl->in_msg - ssl->in_buf ) )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad message length" ) );
@@ -4877,7 +4888,7 @@ static int ssl_load_buffered_record( mbedtls_ssl_context *ssl )
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "Found buffered record from current epoch - load" ) );
 
     /* Double-check that the record is not too large */
-    if( rec_len > MBEDTLS_SSL_IN_BUFFER_LEN -
+    if( rec_len > SSL_IN_BUFFER_LEN( ssl ) -
         (size_t)( ssl->in_hdr - ssl->in_buf ) )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
@@ -6895,6 +6906,11 @@ int mbedtls_ssl_setup( mbedtls_ssl_context *ssl,
         goto error;
     }
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    ssl->in_buf_len = MBEDTLS_SSL_IN_BUFFER_LEN;
+    ssl->out_buf_len = MBEDTLS_SSL_OUT_BUFFER_LEN;
+#endif
+
     ssl_reset_in_out_pointers( ssl );
 
     if( ( ret = ssl_handshake_init( ssl ) ) != 0 )
@@ -6991,14 +7007,14 @@ static int ssl_session_reset_int( mbedtls_ssl_context *ssl, int partial )
     ssl->session_in = NULL;
     ssl->session_out = NULL;
 
-    memset( ssl->out_buf, 0, MBEDTLS_SSL_OUT_BUFFER_LEN );
+    memset( ssl->out_buf, 0, SSL_OUT_BUFFER_LEN( ssl ) );
 
 #if defined(MBEDTLS_SSL_DTLS_CLIENT_PORT_REUSE) && defined(MBEDTLS_SSL_SRV_C)
     if( partial == 0 )
 #endif /* MBEDTLS_SSL_DTLS_CLIENT_PORT_REUSE && MBEDTLS_SSL_SRV_C */
     {
         ssl->in_left = 0;
-        memset( ssl->in_buf, 0, MBEDTLS_SSL_IN_BUFFER_LEN );
+        memset( ssl->in_buf, 0, SSL_IN_BUFFER_LEN( ssl ) );
     }
 
 #if defined(MBEDTLS_SSL_HW_RECORD_ACCEL)
@@ -7981,7 +7997,7 @@ static size_t ssl_get_current_mtu( const mbedtls_ssl_context *ssl )
 
 int mbedtls_ssl_get_max_out_record_payload( const mbedtls_ssl_context *ssl )
 {
-    size_t max_len = MBEDTLS_SSL_OUT_CONTENT_LEN;
+    size_t max_len = SSL_OUT_CONTENT_LEN( ssl );
 
 #if !defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH) && \
     !defined(MBEDTLS_SSL_PROTO_DTLS)
@@ -8024,6 +8040,88 @@ int mbedtls_ssl_get_max_out_record_payload( const mbedtls_ssl_context *ssl )
     return( (int) max_len );
 }
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+static int ssl_shrink_buffer( unsigned char **buf, size_t *buf_len,
+                              size_t len, size_t used )
+{
+    unsigned char *p;
+
+    if( len >= *buf_len )
+        return( 0 );
+    if( used > len )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    /* Allocate and copy rather than realloc, so the old contents can be wiped */
+    p = mbedtls_calloc( 1, len );
+    if( p == NULL )
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+    memcpy( p, *buf, used );
+    mbedtls_platform_zeroize( *buf, *buf_len );
+    mbedtls_free( *buf );
+    *buf = p;
+    *buf_len = len;
+    return( 0 );
+}
+
+int mbedtls_ssl_shrink_buffers( mbedtls_ssl_context *ssl,
+                                size_t in_len, size_t out_len )
+{
+    unsigned char *old;
+    size_t in_used, out_used;
+    int ret;
+
+#if defined(MBEDTLS_SSL_RENEGOTIATION)
+    /* A renegotiation handshake would need the full size buffers again */
+    if( ssl->conf->disable_renegotiation != MBEDTLS_SSL_RENEGOTIATION_DISABLED )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+#endif
+    if( ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER || ssl->out_left != 0 )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    in_len += MBEDTLS_SSL_IN_BUFFER_LEN - MBEDTLS_SSL_IN_CONTENT_LEN;
+    out_len += MBEDTLS_SSL_OUT_BUFFER_LEN - MBEDTLS_SSL_OUT_CONTENT_LEN;
+
+    /* Keep any input that has been read but not yet consumed */
+    in_used = (size_t)( ssl->in_hdr - ssl->in_buf ) + ssl->in_left;
+    if( ssl->in_offt != NULL &&
+        (size_t)( ssl->in_offt - ssl->in_buf ) + ssl->in_msglen > in_used )
+        in_used = (size_t)( ssl->in_offt - ssl->in_buf ) + ssl->in_msglen;
+    out_used = (size_t)( ssl->out_msg - ssl->out_buf );
+
+    old = ssl->in_buf;
+    ret = ssl_shrink_buffer( &ssl->in_buf, &ssl->in_buf_len, in_len, in_used );
+    if( ret != 0 )
+        return( ret );
+    if( ssl->in_buf != old )
+    {
+        ssl->in_ctr = ssl->in_buf + ( ssl->in_ctr - old );
+        ssl->in_hdr = ssl->in_buf + ( ssl->in_hdr - old );
+        ssl->in_len = ssl->in_buf + ( ssl->in_len - old );
+        ssl->in_iv  = ssl->in_buf + ( ssl->in_iv  - old );
+        ssl->in_msg = ssl->in_buf + ( ssl->in_msg - old );
+        if( ssl->in_offt != NULL )
+            ssl->in_offt = ssl->in_buf + ( ssl->in_offt - old );
+    }
+
+    old = ssl->out_buf;
+    ret = ssl_shrink_buffer( &ssl->out_buf, &ssl->out_buf_len, out_len, out_used );
+    if( ret != 0 )
+        return( ret );
+    if( ssl->out_buf != old )
+    {
+        ssl->out_ctr = ssl->out_buf + ( ssl->out_ctr - old );
+        ssl->out_hdr = ssl->out_buf + ( ssl->out_hdr - old );
+        ssl->out_len = ssl->out_buf + ( ssl->out_len - old );
+        ssl->out_iv  = ssl->out_buf + ( ssl->out_iv  - old );
+        ssl->out_msg = ssl->out_buf + ( ssl->out_msg - old );
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "record buffers shrunk to %d/%d bytes",
+                           (int) ssl->in_buf_len, (int) ssl->out_buf_len ) );
+    return( 0 );
+}
+#endif /* MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
+
 #if defined(MBEDTLS_X509_CRT_PARSE_C)
 const mbedtls_x509_crt *mbedtls_ssl_get_peer_cert( const mbedtls_ssl_context *ssl )
 {
@@ -8935,13 +9033,13 @@ void mbedtls_ssl_free( mbedtls_ssl_context *ssl )
 
     if( ssl->out_buf != NULL )
     {
-        mbedtls_platform_zeroize( ssl->out_buf, MBEDTLS_SSL_OUT_BUFFER_LEN );
+        mbedtls_platform_zeroize( ssl->out_buf, SSL_OUT_BUFFER_LEN( ssl ) );
         mbedtls_free( ssl->out_buf );
     }
 
     if( ssl->in_buf != NULL )
     {
-        mbedtls_platform_zeroize( ssl->in_buf, MBEDTLS_SSL_IN_BUFFER_LEN );
+        mbedtls_platform_zeroize( ssl->in_buf, SSL_IN_BUFFER_LEN( ssl ) );
         mbedtls_free( ssl->in_buf );
     }
 
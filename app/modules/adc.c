@@ -6,17 +6,99 @@
 
 #include <stdint.h>
 #include "user_interface.h"
+#ifdef LUA_USE_MODULES_NUMBUF
+#include "numbuf.h"
+#include "hw_timer.h"
 
-// Lua: read(id) , return system adc
+#define TIMER_OWNER ((os_param_t) 'a')
+#define ADC_SAMPLE_MAX_RATE 10000
+
+/* State of the timed capture started by adc.sample() */
+static struct {
+  numbuf *buf;
+  uint32_t remaining;
+  int buf_ref;
+  int cb_ref;
+} sampler = { NULL, 0, LUA_NOREF, LUA_NOREF };
+static platform_task_handle_t sample_task;
+#endif
+
+// Lua: read(id [, buf [, n]]) , return system adc
 static int adc_sample( lua_State* L )
 {
   unsigned id = luaL_checkinteger( L, 1 );
   MOD_CHECK_ID( adc, id );
   unsigned val = 0xFFFF & system_adc_read();
+#ifdef LUA_USE_MODULES_NUMBUF
+  if (!lua_isnoneornil(L, 2)) {
+    numbuf *buf = numbuf_from_lua_arg(L, 2);
+    int n = luaL_optinteger(L, 3, 1);
+    luaL_argcheck(L, n > 0, 3, "should be a positive integer");
+    numbuf_push(buf, val);
+    while (--n) {
+      val = 0xFFFF & system_adc_read();
+      numbuf_push(buf, val);
+    }
+  }
+#endif
   lua_pushinteger( L, val );
   return 1;
 }
 
+#ifdef LUA_USE_MODULES_NUMBUF
+static void ICACHE_RAM_ATTR adc_sample_timer( os_param_t p )
+{
+  (void)p;
+  if (!sampler.remaining)
+    return;
+  numbuf_push(sampler.buf, 0xFFFF & system_adc_read());
+  if (--sampler.remaining == 0) {
+    platform_hw_timer_close(TIMER_OWNER);
+    platform_post_low(sample_task, 0);
+  }
+}
+
+static void adc_sample_done( platform_task_param_t param, uint8_t prio )
+{
+  lua_State *L = lua_getstate();
+  (void)param; (void)prio;
+  sampler.buf = NULL;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sampler.cb_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sampler.buf_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, sampler.cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, sampler.buf_ref);
+  sampler.cb_ref = sampler.buf_ref = LUA_NOREF;
+  luaL_pcallx(L, 1, 0);
+}
+
+// Lua: sample(rate, count, buf, callback)
+static int adc_sample_timed( lua_State* L )
+{
+  int rate = luaL_checkinteger( L, 1 );
+  int count = luaL_checkinteger( L, 2 );
+  numbuf *buf = numbuf_from_lua_arg( L, 3 );
+  luaL_argcheck( L, rate > 0 && rate <= ADC_SAMPLE_MAX_RATE, 1, "rate out of range" );
+  luaL_argcheck( L, count > 0, 2, "should be a positive integer" );
+  luaL_checktype( L, 4, LUA_TFUNCTION );
+  if (sampler.buf)
+    return luaL_error( L, "sampling in progress" );
+
+  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, TRUE))
+    return luaL_error( L, "Unable to initialize timer" );
+
+  /* the buffer is anchored in the registry until the callback runs */
+  lua_settop( L, 4 );
+  sampler.cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  sampler.buf_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  sampler.buf = buf;
+  sampler.remaining = count;
+  platform_hw_timer_set_func(TIMER_OWNER, adc_sample_timer, 0);
+  platform_hw_timer_set_priority(TIMER_OWNER, 20, "adc");
+  platform_hw_timer_arm_ticks(TIMER_OWNER, (APB_CLK_FREQ >> 4) / rate);
+  return 0;
+}
+#endif
+
 // Lua: readvdd33()
 static int adc_readvdd33( lua_State* L )
 {
@@ -62,10 +144,20 @@ static int adc_init107( lua_State *L )
 LROT_BEGIN(adc, NULL, 0)
   LROT_FUNCENTRY( read, adc_sample )
   LROT_FUNCENTRY( readvdd33, adc_readvdd33 )
+#ifdef LUA_USE_MODULES_NUMBUF
+  LROT_FUNCENTRY( sample, adc_sample_timed )
+#endif
   LROT_FUNCENTRY( force_init_mode, adc_init107 )
   LROT_NUMENTRY( INIT_ADC, 0x00 )
   LROT_NUMENTRY( INIT_VDD33, 0xff )
 LROT_END(adc, NULL, 0)
 
+int luaopen_adc( lua_State *L )
+{
+#ifdef LUA_USE_MODULES_NUMBUF
+  sample_task = platform_task_get_id(adc_sample_done);
+#endif
+  return 0;
+}
 
-NODEMCU_MODULE(ADC, "adc", adc, NULL);
+NODEMCU_MODULE(ADC, "adc", adc, luaopen_adc);
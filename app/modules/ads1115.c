@@ -9,6 +9,9 @@
 #include "platform.h"
 #include "osapi.h"
 #include <stdlib.h>
+#ifdef LUA_USE_MODULES_NUMBUF
+#include "numbuf.h"
+#endif
 
 
 //***************************************************************************
@@ -107,6 +110,8 @@
 
 // #define ADS1115_INCLUDE_TEST_FUNCTION
 
+#define ADS1115_SCAN_MAX            8           // channels in one scan
+
 //***************************************************************************
 
 static const uint8_t ads1115_i2c_id = 0;
@@ -128,6 +133,19 @@ typedef struct {
     uint16_t config;
     int timer_ref;
     os_timer_t timer;
+#ifdef GPIO_INTERRUPT_ENABLE
+    // scan(), see below
+    int scan_ref;           // callback, or LUA_NOREF when not scanning
+    int scan_self_ref;
+    int scan_buf_ref;
+    void *scan_buf;
+    uint32_t scan_pin_mask;
+    uint8_t scan_pin;
+    uint8_t scan_n;
+    uint8_t scan_pos;
+    uint16_t scan_mux[ADS1115_SCAN_MAX];
+    uint16_t scan_raw[ADS1115_SCAN_MAX];
+#endif
 } ads_ctrl_ud_t;
 
 
@@ -265,6 +283,11 @@ static int ads1115_lua_register(lua_State *L, uint8_t chip_id) {
     ads_ctrl->threshold_hi = 0x7FFF;
     ads_ctrl->config = ADS1115_DEFAULT_CONFIG_REG;
     ads_ctrl->timer_ref = LUA_NOREF;
+#ifdef GPIO_INTERRUPT_ENABLE
+    ads_ctrl->scan_ref = LUA_NOREF;
+    ads_ctrl->scan_self_ref = LUA_NOREF;
+    ads_ctrl->scan_buf_ref = LUA_NOREF;
+#endif
     return 1;
 }
 
@@ -500,14 +523,167 @@ static int ads1115_lua_readoutdone(void * param) {
 }
 
 // Read the conversion register from the ADC device
-// Lua:     volt,voltdec,adc,sign = ads1115.device:read()
+// Lua:     volt,voltdec,adc,sign = ads1115.device:read([buf])
 static int ads1115_lua_read(lua_State *L) {
     ads_ctrl_ud_t *ads_ctrl = luaL_checkudata(L, 1, metatable_name);
     uint16_t raw = read_reg(ads_ctrl->i2c_addr, ADS1115_POINTER_CONVERSION);
+#ifdef LUA_USE_MODULES_NUMBUF
+    if (!lua_isnoneornil(L, 2))
+        numbuf_push(numbuf_from_lua_arg(L, 2), (int16_t)raw);
+#endif
     read_common(ads_ctrl, raw, L);
     return 4;
 }
 
+#ifdef GPIO_INTERRUPT_ENABLE
+/*
+ * A scan converts a list of channels over and over, chained in C by the
+ * conversion ready pulses on ALERT/RDY.  Each falling edge posts a task that
+ * reads the result and starts the conversion of the next channel, in single
+ * shot mode as the multiplexer has to change between them, and after the
+ * last channel hands the readings of the cycle to Lua in one callback.  A
+ * single channel is left in continuous mode.  Each device has its own
+ * address, so the scanners are kept by the two low bits of it for the
+ * interrupt hook.
+ */
+static ads_ctrl_ud_t *scanners[4];
+static platform_task_handle_t scan_task;
+
+static uint32_t ICACHE_RAM_ATTR ads1115_interrupt(uint32_t ret_gpio_status) {
+    uint32_t gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        ads_ctrl_ud_t *ads_ctrl = scanners[i];
+        if (ads_ctrl && (gpio_status & ads_ctrl->scan_pin_mask)) {
+            GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, ads_ctrl->scan_pin_mask);
+            platform_post_medium(scan_task, i);
+            ret_gpio_status &= ~ads_ctrl->scan_pin_mask;
+        }
+    }
+    return ret_gpio_status;
+}
+
+static void scan_hooks(void) {
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < 4; i++)
+        if (scanners[i])
+            mask |= scanners[i]->scan_pin_mask;
+    platform_gpio_register_intr_hook(mask, ads1115_interrupt);
+}
+
+static void scan_convert(ads_ctrl_ud_t *ads_ctrl) {
+    uint16_t config = ads_ctrl->config & ~(ADS1115_OS_MASK | ADS1115_MUX_MASK | ADS1115_MODE_MASK |
+                                           ADS1115_CPOL_MASK | ADS1115_CLAT_MASK | ADS1115_CQUE_MASK);
+    config |= ads_ctrl->scan_mux[ads_ctrl->scan_pos] | ADS1115_CPOL_ACTVLOW | ADS1115_CLAT_NONLAT | ADS1115_CQUE_1CONV;
+    config |= ads_ctrl->scan_n == 1 ? ADS1115_MODE_CONTIN : (ADS1115_MODE_SINGLE | ADS1115_OS_SINGLE);
+    write_reg(ads_ctrl->i2c_addr, ADS1115_POINTER_CONFIG, config);
+}
+
+static void ads1115_scan_done(platform_task_param_t param, uint8_t prio) {
+    ads_ctrl_ud_t *ads_ctrl = scanners[param & 3];
+    lua_State *L = lua_getstate();
+    int i, n;
+    (void)prio;
+
+    if (!ads_ctrl)
+        return;
+    ads_ctrl->scan_raw[ads_ctrl->scan_pos] = read_reg(ads_ctrl->i2c_addr, ADS1115_POINTER_CONVERSION);
+    if (++ads_ctrl->scan_pos < ads_ctrl->scan_n) {
+        scan_convert(ads_ctrl);
+        return;
+    }
+    // Start the next cycle, so that it converts while Lua runs
+    n = ads_ctrl->scan_n;
+    ads_ctrl->scan_pos = 0;
+    if (n > 1)
+        scan_convert(ads_ctrl);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ads_ctrl->scan_ref);
+    for (i = 0; i < n; i++) {
+#ifdef LUA_USE_MODULES_NUMBUF
+        if (ads_ctrl->scan_buf)
+            numbuf_push((numbuf *)ads_ctrl->scan_buf, (int16_t)ads_ctrl->scan_raw[i]);
+#endif
+        lua_pushnumber(L, get_mvolt(ads_ctrl->gain, ads_ctrl->scan_raw[i]));
+    }
+    luaL_pcallx(L, n, 0);
+}
+
+static void scan_stop(lua_State *L, ads_ctrl_ud_t *ads_ctrl) {
+    if (ads_ctrl->scan_ref == LUA_NOREF)
+        return;
+    scanners[ads_ctrl->i2c_addr & 3] = NULL;
+    scan_hooks();
+    platform_gpio_intr_init(ads_ctrl->scan_pin, GPIO_PIN_INTR_DISABLE);
+    // Back to the thresholds and the power down mode of setting()
+    write_reg(ads_ctrl->i2c_addr, ADS1115_POINTER_THRESH_LOW, ads_ctrl->threshold_low);
+    write_reg(ads_ctrl->i2c_addr, ADS1115_POINTER_THRESH_HI, ads_ctrl->threshold_hi);
+    write_reg(ads_ctrl->i2c_addr, ADS1115_POINTER_CONFIG,
+              (ads_ctrl->config & ~(ADS1115_OS_MASK | ADS1115_MODE_MASK)) | ADS1115_MODE_SINGLE);
+    ads_ctrl->mode = ADS1115_MODE_SINGLE;
+    luaL_unref(L, LUA_REGISTRYINDEX, ads_ctrl->scan_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ads_ctrl->scan_buf_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ads_ctrl->scan_self_ref);
+    ads_ctrl->scan_ref = ads_ctrl->scan_buf_ref = ads_ctrl->scan_self_ref = LUA_NOREF;
+    ads_ctrl->scan_buf = NULL;
+}
+
+// Convert channels over and over, each cycle calling back with their readings
+// Lua:     ads1115.device:scan(PIN, {CHANNEL, ...}, function(volt, ...) end[, buffer]), device:scan()
+static int ads1115_lua_scan(lua_State *L) {
+    ads_ctrl_ud_t *ads_ctrl = luaL_checkudata(L, 1, metatable_name);
+    int i, n;
+
+    scan_stop(L, ads_ctrl);
+    if (lua_isnoneornil(L, 2))
+        return 0;
+
+    int pin = luaL_checkinteger(L, 2);
+    MOD_CHECK_ID(gpio, pin);
+    luaL_argcheck(L, pin > 0, 2, "no interrupts on pin 0");
+    luaL_checktype(L, 3, LUA_TTABLE);
+    n = lua_objlen(L, 3);
+    luaL_argcheck(L, n > 0 && n <= ADS1115_SCAN_MAX, 3, "1 to 8 channels expected");
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, 3, i + 1);
+        uint16_t channel = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, IS_CHANNEL_VALID(channel), 3, unexpected_value);
+        ads_ctrl->scan_mux[i] = channel;
+        lua_pop(L, 1);
+    }
+    luaL_checktype(L, 4, LUA_TFUNCTION);
+#ifdef LUA_USE_MODULES_NUMBUF
+    if (!lua_isnoneornil(L, 5)) {
+        ads_ctrl->scan_buf = numbuf_from_lua_arg(L, 5);
+        lua_pushvalue(L, 5);
+        ads_ctrl->scan_buf_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+#endif
+    lua_pushvalue(L, 4);
+    ads_ctrl->scan_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 1);
+    ads_ctrl->scan_self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ads_ctrl->scan_pin = pin;
+    ads_ctrl->scan_pin_mask = 1 << pin_num[pin];
+    ads_ctrl->scan_n = n;
+    ads_ctrl->scan_pos = 0;
+
+    // A high threshold with its MSB set and a low one without it make ALERT/RDY
+    // pulse low when a conversion is ready
+    write_reg(ads_ctrl->i2c_addr, ADS1115_POINTER_THRESH_LOW, 0x0000);
+    write_reg(ads_ctrl->i2c_addr, ADS1115_POINTER_THRESH_HI, 0x8000);
+
+    scanners[ads_ctrl->i2c_addr & 3] = ads_ctrl;
+    scan_hooks();
+    platform_gpio_mode(pin, PLATFORM_GPIO_INT, PLATFORM_GPIO_PULLUP);
+    platform_gpio_intr_init(pin, GPIO_PIN_INTR_NEGEDGE);
+    scan_convert(ads_ctrl);
+    return 0;
+}
+#endif
+
 #ifdef ADS1115_INCLUDE_TEST_FUNCTION
 // this function simulates conversion using raw value provided as argument
 // Lua:  volt,volt_dec,adc,sign = ads1115.test_volt_conversion(-1)
@@ -582,6 +758,9 @@ LROT_BEGIN(ads1115_instance, NULL, LROT_MASK_GC_INDEX)
   LROT_FUNCENTRY( setting, ads1115_lua_setting )
   LROT_FUNCENTRY( startread, ads1115_lua_startread )
   LROT_FUNCENTRY( read, ads1115_lua_read )
+#ifdef GPIO_INTERRUPT_ENABLE
+  LROT_FUNCENTRY( scan, ads1115_lua_scan )
+#endif
 #ifdef ADS1115_INCLUDE_TEST_FUNCTION
   LROT_FUNCENTRY( test_volt_conversion, test_volt_conversion )
 #endif
@@ -589,6 +768,9 @@ LROT_END(ads1115_instance, NULL, LROT_MASK_GC_INDEX)
 
 int luaopen_ads1115(lua_State *L) {
     luaL_rometatable(L, metatable_name, LROT_TABLEREF(ads1115_instance));
+#ifdef GPIO_INTERRUPT_ENABLE
+    scan_task = platform_task_get_id(ads1115_scan_done);
+#endif
     return 0;
 }
 
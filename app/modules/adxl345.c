@@ -8,10 +8,25 @@
 #include "platform.h"
 #include <stdlib.h>
 #include <string.h>
+#ifdef LUA_USE_MODULES_NUMBUF
+#include "numbuf.h"
+#endif
 
 static const uint32_t adxl345_i2c_id = 0;
 static const uint8_t adxl345_i2c_addr = 0x53;
 
+#define ADXL345_BW_RATE         0x2C
+#define ADXL345_POWER_CTL       0x2D
+#define ADXL345_INT_ENABLE      0x2E
+#define ADXL345_INT_MAP         0x2F
+#define ADXL345_DATAX0          0x32
+#define ADXL345_FIFO_CTL        0x38
+#define ADXL345_FIFO_STATUS     0x39
+
+#define ADXL345_INT_WATERMARK   0x02
+#define ADXL345_FIFO_STREAM     0x80
+#define ADXL345_FIFO_SIZE       32
+
 static uint8_t r8u(uint32_t id, uint8_t reg) {
     uint8_t ret;
 
@@ -26,8 +41,42 @@ static uint8_t r8u(uint32_t id, uint8_t reg) {
     return ret;
 }
 
+static void w8u(uint32_t id, uint8_t reg, uint8_t val) {
+    platform_i2c_send_start(id);
+    platform_i2c_send_address(id, adxl345_i2c_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
+    platform_i2c_send_byte(id, reg);
+    platform_i2c_send_byte(id, val);
+    platform_i2c_send_stop(id);
+}
+
+// Reads the six data registers, after a start or a repeated start
+static void read_xyz(uint32_t id, uint8_t *data) {
+    int i;
+
+    platform_i2c_send_start(id);
+    platform_i2c_send_address(id, adxl345_i2c_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
+    platform_i2c_send_byte(id, ADXL345_DATAX0);
+    platform_i2c_send_start(id);
+    platform_i2c_send_address(id, adxl345_i2c_addr, PLATFORM_I2C_DIRECTION_RECEIVER);
+
+    for (i=0; i<5; i++) {
+	data[i] = platform_i2c_recv_byte(id, 1);
+    }
+
+    data[5] = platform_i2c_recv_byte(id, 0);
+}
+
+// Lua: adxl345.setup([rate])
 static int adxl345_setup(lua_State* L) {
     uint8_t  devid;
+    int rate = luaL_optinteger(L, 1, 0);
+    uint8_t code = 0;
+
+    if (rate) {
+        // The rates are 3200Hz halved down to 6.25Hz, given as 12 and 6
+        for (code = 0x0F; code >= 0x06 && (3200 >> (0x0F - code)) != rate; code--);
+        luaL_argcheck(L, code >= 0x06, 1, "unsupported rate");
+    }
 
     devid = r8u(adxl345_i2c_id, 0x00);
 
@@ -35,12 +84,11 @@ static int adxl345_setup(lua_State* L) {
         return luaL_error(L, "device not found");
     }
 
+    if (code)
+        w8u(adxl345_i2c_id, ADXL345_BW_RATE, code);
+
     // Enable sensor
-    platform_i2c_send_start(adxl345_i2c_id);
-    platform_i2c_send_address(adxl345_i2c_id, adxl345_i2c_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
-    platform_i2c_send_byte(adxl345_i2c_id, 0x2D);
-    platform_i2c_send_byte(adxl345_i2c_id, 0x08);
-    platform_i2c_send_stop(adxl345_i2c_id);
+    w8u(adxl345_i2c_id, ADXL345_POWER_CTL, 0x08);
 
     return 0;
 }
@@ -49,20 +97,8 @@ static int adxl345_read(lua_State* L) {
 
     uint8_t data[6];
     int x,y,z;
-    int i;
-
-    platform_i2c_send_start(adxl345_i2c_id);
-    platform_i2c_send_address(adxl345_i2c_id, adxl345_i2c_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
-    platform_i2c_send_byte(adxl345_i2c_id, 0x32);
-    platform_i2c_send_start(adxl345_i2c_id);
-    platform_i2c_send_address(adxl345_i2c_id, adxl345_i2c_addr, PLATFORM_I2C_DIRECTION_RECEIVER);
-
-    for (i=0; i<5; i++) {
-	data[i] = platform_i2c_recv_byte(adxl345_i2c_id, 1);
-    }
-
-    data[5] = platform_i2c_recv_byte(adxl345_i2c_id, 0);
 
+    read_xyz(adxl345_i2c_id, data);
     platform_i2c_send_stop(adxl345_i2c_id);
 
     x = (int16_t) ((data[1] << 8) | data[0]);
@@ -76,10 +112,141 @@ static int adxl345_read(lua_State* L) {
     return 3;
 }
 
+#if defined(LUA_USE_MODULES_NUMBUF) && defined(GPIO_INTERRUPT_ENABLE)
+/*
+ * In stream mode the ADXL345 keeps the last 32 samples in its FIFO and raises
+ * INT1 once watermark of them are queued.  The rising edge posts a task that
+ * drains the FIFO into the buffers, a six byte burst per sample with repeated
+ * starts in a single I2C transaction, and calls back with the count.  INT1
+ * stays high while the watermark is still reached, so the task runs again
+ * rather than wait for an edge that will not come.
+ */
+static struct {
+    numbuf *buf[3];
+    int buf_ref[3];
+    int cb_ref;
+    uint8_t pin;
+    uint32_t pin_mask;
+    volatile bool posted;
+} fifo = { { NULL }, { LUA_NOREF, LUA_NOREF, LUA_NOREF }, LUA_NOREF };
+static platform_task_handle_t fifo_task;
+
+static uint32_t ICACHE_RAM_ATTR adxl345_interrupt(uint32_t ret_gpio_status) {
+    uint32_t gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
+
+    if (gpio_status & fifo.pin_mask) {
+        GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, fifo.pin_mask);
+        if (!fifo.posted) {
+            fifo.posted = true;
+            platform_post_medium(fifo_task, 0);
+        }
+    }
+    return ret_gpio_status & ~fifo.pin_mask;
+}
+
+static int adxl345_fifo_drain(void) {
+    uint8_t data[6];
+    int i, j, n = r8u(adxl345_i2c_id, ADXL345_FIFO_STATUS) & 0x3F;
+
+    for (i = 0; i < n; i++) {
+        read_xyz(adxl345_i2c_id, data);
+        for (j = 0; j < 3; j++)
+            numbuf_push(fifo.buf[j], (int16_t) ((data[2 * j + 1] << 8) | data[2 * j]));
+    }
+    platform_i2c_send_stop(adxl345_i2c_id);
+    return n;
+}
+
+static void adxl345_fifo_done(platform_task_param_t param, uint8_t prio) {
+    lua_State *L = lua_getstate();
+    (void)param; (void)prio;
+
+    fifo.posted = false;
+    if (fifo.cb_ref == LUA_NOREF)
+        return;
+    int n = adxl345_fifo_drain();
+    if (platform_gpio_read(fifo.pin) && !fifo.posted) {
+        fifo.posted = true;
+        platform_post_medium(fifo_task, 0);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fifo.cb_ref);
+    lua_pushinteger(L, n);
+    luaL_pcallx(L, 1, 0);
+}
+
+static void adxl345_fifo_stop(lua_State *L) {
+    int i;
+
+    if (fifo.cb_ref == LUA_NOREF)
+        return;
+    w8u(adxl345_i2c_id, ADXL345_INT_ENABLE, 0);
+    w8u(adxl345_i2c_id, ADXL345_FIFO_CTL, 0);
+    platform_gpio_intr_init(fifo.pin, GPIO_PIN_INTR_DISABLE);
+    platform_gpio_unregister_intr_hook(adxl345_interrupt);
+    luaL_unref(L, LUA_REGISTRYINDEX, fifo.cb_ref);
+    fifo.cb_ref = LUA_NOREF;
+    for (i = 0; i < 3; i++) {
+        luaL_unref(L, LUA_REGISTRYINDEX, fifo.buf_ref[i]);
+        fifo.buf_ref[i] = LUA_NOREF;
+        fifo.buf[i] = NULL;
+    }
+}
+
+// Lua: adxl345.fifo(pin, watermark, xbuf, ybuf, zbuf, function(n)), adxl345.fifo()
+static int adxl345_fifo(lua_State* L) {
+    int i;
+
+    adxl345_fifo_stop(L);
+    if (lua_isnoneornil(L, 1))
+        return 0;
+
+    int pin = luaL_checkinteger(L, 1);
+    MOD_CHECK_ID(gpio, pin);
+    luaL_argcheck(L, pin > 0, 1, "no interrupts on pin 0");
+    int watermark = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, watermark > 0 && watermark < ADXL345_FIFO_SIZE, 2, "out of range");
+    for (i = 0; i < 3; i++)
+        numbuf_from_lua_arg(L, 3 + i);
+    luaL_checktype(L, 6, LUA_TFUNCTION);
+
+    lua_settop(L, 6);
+    fifo.cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    for (i = 2; i >= 0; i--) {
+        fifo.buf[i] = numbuf_from_lua_arg(L, 3 + i);
+        fifo.buf_ref[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    fifo.pin = pin;
+    fifo.pin_mask = 1 << pin_num[pin];
+    fifo.posted = false;
+
+    // Bypass mode empties the FIFO, so that INT1 starts low
+    w8u(adxl345_i2c_id, ADXL345_FIFO_CTL, 0);
+    w8u(adxl345_i2c_id, ADXL345_INT_MAP, 0);
+    w8u(adxl345_i2c_id, ADXL345_INT_ENABLE, ADXL345_INT_WATERMARK);
+
+    platform_gpio_register_intr_hook(fifo.pin_mask, adxl345_interrupt);
+    platform_gpio_mode(pin, PLATFORM_GPIO_INT, PLATFORM_GPIO_FLOAT);
+    platform_gpio_intr_init(pin, GPIO_PIN_INTR_POSEDGE);
+
+    w8u(adxl345_i2c_id, ADXL345_FIFO_CTL, ADXL345_FIFO_STREAM | watermark);
+    return 0;
+}
+#endif
+
 LROT_BEGIN(adxl345, NULL, 0)
   LROT_FUNCENTRY( read, adxl345_read )
   LROT_FUNCENTRY( setup, adxl345_setup )
+#if defined(LUA_USE_MODULES_NUMBUF) && defined(GPIO_INTERRUPT_ENABLE)
+  LROT_FUNCENTRY( fifo, adxl345_fifo )
+#endif
 LROT_END(adxl345, NULL, 0)
 
 
-NODEMCU_MODULE(ADXL345, "adxl345", adxl345, NULL);
+int luaopen_adxl345(lua_State *L) {
+#if defined(LUA_USE_MODULES_NUMBUF) && defined(GPIO_INTERRUPT_ENABLE)
+  fifo_task = platform_task_get_id(adxl345_fifo_done);
+#endif
+  return 0;
+}
+
+NODEMCU_MODULE(ADXL345, "adxl345", adxl345, luaopen_adxl345);
@@ -4,12 +4,24 @@
 #include "module.h"
 #include "platform.h"
 #include "user_interface.h"
+#include "driver/spi.h"
 
 #include "pixbuf.h"
 
 
 #define NOP asm volatile(" nop \n\t")
 
+/*
+ * With apa102.init(apa102.HSPI), write() without pins clocks the frames out
+ * of HSPI, MOSI on GPIO13 and SCLK on GPIO14, 64 bytes at a time through the
+ * SPI W buffers.  The LEDs latch on their own, so the gaps between chunks
+ * do not matter.
+ */
+#define APA102_HSPI             (-1)
+#define APA102_HSPI_CLOCK_DIV   8       // 80MHz / 8 = 10MHz
+
+static bool apa102_hspi;
+
 
 static inline void apa102_send_byte(uint32_t data_pin, uint32_t clock_pin, uint8_t byte) {
   int i;
@@ -64,7 +76,46 @@ static void apa102_send_buffer(uint32_t data_pin, uint32_t clock_pin, uint32_t *
 }
 
 
-// Lua: apa102.write(data_pin, clock_pin, "string")
+static void apa102_spi_send_buffer(const uint8_t *buf, uint32_t nbr_frames) {
+  uint8_t chunk[64];
+  size_t n = 0;
+  uint32_t i, end = (nbr_frames + 1) / 2;
+
+  // The start frame, the LED frames and the end frames, as above
+  memset(chunk, 0, 4);
+  n = 4;
+  for (i = 0; i < nbr_frames + end; i++) {
+    if (n == sizeof(chunk)) {
+      platform_spi_blkwrite(SPI_HSPI, n, chunk);
+      n = 0;
+    }
+    if (i < nbr_frames) {
+      chunk[n] = buf[0] | 0xE0;
+      chunk[n + 1] = buf[1];
+      chunk[n + 2] = buf[2];
+      chunk[n + 3] = buf[3];
+      buf += 4;
+    } else {
+      memset(chunk + n, 0xFF, 4);
+    }
+    n += 4;
+  }
+  platform_spi_blkwrite(SPI_HSPI, n, chunk);
+}
+
+
+// Lua: apa102.init(apa102.HSPI[, clock_div])
+static int apa102_init(lua_State* L) {
+  luaL_argcheck(L, luaL_checkinteger(L, 1) == APA102_HSPI, 1, "apa102.HSPI expected");
+  uint32_t clock_div = luaL_optinteger(L, 2, APA102_HSPI_CLOCK_DIV);
+  luaL_argcheck(L, clock_div >= 2, 2, "out of range");
+  platform_spi_setup(SPI_HSPI, PLATFORM_SPI_MASTER, PLATFORM_SPI_CPOL_LOW, PLATFORM_SPI_CPHA_LOW, clock_div);
+  apa102_hspi = true;
+  return 0;
+}
+
+
+// Lua: apa102.write([data_pin, clock_pin, ]"string")
 // Byte quads in the string are interpreted as (brightness, B, G, R) values.
 // Only the first 5 bits of the brightness value is actually used (0-31).
 // This function does not corrupt your buffer.
@@ -73,37 +124,48 @@ static void apa102_send_buffer(uint32_t data_pin, uint32_t clock_pin, uint32_t *
 // apa102.write(5, 6, string.char(255, 0, 0, 255):rep(10)) uses GPIO14 for DATA and GPIO12 for CLOCK and sets ten LED to red, with the brightness 31 (out of 0-32).
 //                                                         Brightness values are clamped to 0-31.
 static int apa102_write(lua_State* L) {
-  uint8_t data_pin = luaL_checkinteger(L, 1);
-  MOD_CHECK_ID(gpio, data_pin);
-  uint32_t alt_data_pin = pin_num[data_pin];
-
-  uint8_t clock_pin = luaL_checkinteger(L, 2);
-  MOD_CHECK_ID(gpio, clock_pin);
-  uint32_t alt_clock_pin = pin_num[clock_pin];
+  // Without pins, the data is the only argument and goes out of HSPI
+  int spi = lua_gettop(L) == 1;
+  int arg = spi ? 1 : 3;
+  if (spi && !apa102_hspi)
+    return luaL_error(L, "apa102.init(apa102.HSPI) not called");
 
   const char *buf;
   uint32_t nbr_frames;
 
-  switch(lua_type(L, 3)) {
+  switch(lua_type(L, arg)) {
   case LUA_TSTRING: {
     size_t buf_len;
-    buf = luaL_checklstring(L, 3, &buf_len);
+    buf = luaL_checklstring(L, arg, &buf_len);
     nbr_frames = buf_len / 4;
     break;
    }
 #ifdef LUA_USE_MODULES_PIXBUF      
   case LUA_TUSERDATA: {
-    pixbuf *buffer = pixbuf_from_lua_arg(L, 3);
-    luaL_argcheck(L, buffer->nchan == 4, 3, "Pixbuf not 4-channel");
+    pixbuf *buffer = pixbuf_from_lua_arg(L, arg);
+    luaL_argcheck(L, buffer->nchan == 4, arg, "Pixbuf not 4-channel");
     buf = (const char *)buffer->values;
     nbr_frames = buffer->npix;
     break;
    }
 #endif
   default:
-    return luaL_argerror(L, 3, "String or pixbuf expected");
+    return luaL_argerror(L, arg, "String or pixbuf expected");
+  }
+
+  if (spi) {
+    apa102_spi_send_buffer((const uint8_t *) buf, nbr_frames);
+    return 0;
   }
 
+  uint8_t data_pin = luaL_checkinteger(L, 1);
+  MOD_CHECK_ID(gpio, data_pin);
+  uint32_t alt_data_pin = pin_num[data_pin];
+
+  uint8_t clock_pin = luaL_checkinteger(L, 2);
+  MOD_CHECK_ID(gpio, clock_pin);
+  uint32_t alt_clock_pin = pin_num[clock_pin];
+
   // Initialize the output pins
   platform_gpio_mode(data_pin, PLATFORM_GPIO_OUTPUT, PLATFORM_GPIO_FLOAT);
   GPIO_OUTPUT_SET(alt_data_pin, PLATFORM_GPIO_HIGH); // Set pin high
@@ -117,7 +179,9 @@ static int apa102_write(lua_State* L) {
 
 
 LROT_BEGIN(apa102, NULL, 0)
+  LROT_FUNCENTRY( init, apa102_init )
   LROT_FUNCENTRY( write, apa102_write )
+  LROT_NUMENTRY( HSPI, APA102_HSPI )
 LROT_END(apa102, NULL, 0)
 
 
@@ -9,19 +9,45 @@
 #include <string.h>
 #include <stdint.h>
 #include "../crypto/sha2.h"
+#include "rtc/rtcaccess.h"
 
 #if defined(LUA_USE_MODULES_BLOOM) && !defined(SHA2_ENABLE)
 #error Must have SHA2_ENABLE set for BLOOM module
 #endif
 
+// A plain filter is one slice of bits. A rotating one has several slices,
+// new entries go to the current slice and the oldest one is cleared on each
+// rotation. A counting filter keeps a 4-bit counter instead of each bit.
+#define BLOOM_PLAIN     0
+#define BLOOM_ROTATING  1
+#define BLOOM_COUNTING  2
+
+#define BLOOM_MAX_FNS 15
+#define BLOOM_MAX_GENERATIONS 8
+#define COUNTER_MAX 15
+
+// Leading word of a serialized filter, followed by the header words and buf
+#define BLOOM_MAGIC 0xB1000000
+#define BLOOM_HEADER_WORDS 3
+
 typedef struct {
   uint8 fns;
-  uint16 size;
-  uint32 occupancy;
+  uint8 kind;
+  uint8 generations;
+  uint8 current;        // slice of a rotating filter that is added to
+  uint16 size;          // 32-bit words in one slice of bits
+  uint32 occupancy;     // bits set, or counters in use, over all slices
   uint32 buf[];
 } bloom_t;
 
-static bool add_or_check(const uint8 *buf, size_t len, bloom_t *filter, bool add) {
+static uint32 buf_words(const bloom_t *filter) {
+  if (filter->kind == BLOOM_COUNTING) {
+    return filter->size << 2;
+  }
+  return filter->size * filter->generations;
+}
+
+static void hash_positions(const uint8 *buf, size_t len, const bloom_t *filter, uint32 *pos) {
   SHA256_CTX ctx;
   SHA256_Init(&ctx);
   SHA256_Update(&ctx, buf, len);
@@ -32,20 +58,83 @@ static bool add_or_check(const uint8 *buf, size_t len, bloom_t *filter, bool add
   int i;
   uint32 bits = filter->size << 5;
   uint8 *h = hash;
-  bool prev = true;
   int hstep = filter->fns > 10 ? 2 : 3;
   for (i = 0; i < filter->fns; i++) {
     uint32 val = (((h[0] << 8) + h[1]) << 8) + h[2];
     h += hstep;
-    val = val % bits;
+    pos[i] = val % bits;
+  }
+}
+
+static bool slice_check(const uint32 *slice, const uint32 *pos, int fns) {
+  int i;
+  for (i = 0; i < fns; i++) {
+    if (!(slice[pos[i] >> 5] & (1 << (pos[i] & 31)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint8 counter_get(const bloom_t *filter, uint32 pos) {
+  return (filter->buf[pos >> 3] >> ((pos & 7) << 2)) & 0xf;
+}
+
+static void counter_set(bloom_t *filter, uint32 pos, uint8 val) {
+  uint32 shift = (pos & 7) << 2;
+  filter->buf[pos >> 3] = (filter->buf[pos >> 3] & ~((uint32) 0xf << shift)) | ((uint32) val << shift);
+}
+
+static bool add_or_check(const uint8 *buf, size_t len, bloom_t *filter, bool add) {
+  uint32 pos[BLOOM_MAX_FNS];
+  hash_positions(buf, len, filter, pos);
+
+  int i;
+  bool prev = true;
+
+  if (filter->kind == BLOOM_COUNTING) {
+    for (i = 0; i < filter->fns && prev; i++) {
+      prev = counter_get(filter, pos[i]) != 0;
+    }
+    if (add) {
+      for (i = 0; i < filter->fns; i++) {
+        uint8 c = counter_get(filter, pos[i]);
+        // A saturated counter sticks, as it can no longer be decremented safely
+        if (c < COUNTER_MAX) {
+          counter_set(filter, pos[i], c + 1);
+          if (c == 0) {
+            filter->occupancy++;
+          }
+        }
+      }
+    }
+    return prev;
+  }
+
+  if (filter->kind == BLOOM_ROTATING) {
+    int g;
+    for (g = 0; g < filter->generations; g++) {
+      if (slice_check(filter->buf + g * filter->size, pos, filter->fns)) {
+        break;
+      }
+    }
+    prev = g < filter->generations;
+    if (!add || (prev && g == filter->current)) {
+      return prev;
+    }
+  }
 
-    uint32 offset = val >> 5;
-    uint32 bit = 1 << (val & 31);
+  uint32 *slice = filter->buf + filter->current * filter->size;
+  for (i = 0; i < filter->fns; i++) {
+    uint32 offset = pos[i] >> 5;
+    uint32 bit = 1 << (pos[i] & 31);
 
-    if (!(filter->buf[offset] & bit)) {
-      prev = false;
+    if (!(slice[offset] & bit)) {
+      if (filter->kind == BLOOM_PLAIN) {
+        prev = false;
+      }
       if (add) {
-        filter->buf[offset] |= bit;
+        slice[offset] |= bit;
         filter->occupancy++;
       } else {
         break;
@@ -78,17 +167,76 @@ static int bloom_filter_add(lua_State *L) {
   return 1;
 }
 
+static int bloom_filter_remove(lua_State *L) {
+  bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
+  size_t length;
+  const uint8 *buffer = (uint8 *) luaL_checklstring(L, 2, &length);
+
+  luaL_argcheck(L, filter->kind == BLOOM_COUNTING, 1, "not a counting filter");
+
+  uint32 pos[BLOOM_MAX_FNS];
+  hash_positions(buffer, length, filter, pos);
+
+  int i;
+  // Only a string that is (probably) present may be removed, or other
+  // strings' counters would be taken down with it
+  for (i = 0; i < filter->fns; i++) {
+    if (counter_get(filter, pos[i]) == 0) {
+      lua_pushboolean(L, false);
+      return 1;
+    }
+  }
+  for (i = 0; i < filter->fns; i++) {
+    uint8 c = counter_get(filter, pos[i]);
+    if (c < COUNTER_MAX) {
+      counter_set(filter, pos[i], c - 1);
+      if (c == 1) {
+        filter->occupancy--;
+      }
+    }
+  }
+
+  lua_pushboolean(L, true);
+  return 1;
+}
+
+static uint32 slice_occupancy(const uint32 *slice, int words) {
+  uint32 n = 0;
+  int i;
+  for (i = 0; i < words; i++) {
+    n += __builtin_popcount(slice[i]);
+  }
+  return n;
+}
+
+static int bloom_filter_rotate(lua_State *L) {
+  bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
+
+  luaL_argcheck(L, filter->kind == BLOOM_ROTATING, 1, "not a rotating filter");
+
+  filter->current = (filter->current + 1) % filter->generations;
+  uint32 *slice = filter->buf + filter->current * filter->size;
+  filter->occupancy -= slice_occupancy(slice, filter->size);
+  memset(slice, 0, filter->size << 2);
+
+  return 0;
+}
+
 static int bloom_filter_reset(lua_State *L) {
   bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
 
-  memset(filter->buf, 0, filter->size << 2);
+  memset(filter->buf, 0, buf_words(filter) << 2);
   filter->occupancy = 0;
+  filter->current = 0;
 
   return 0;
 }
 
 static int bloom_filter_info(lua_State *L) {
   bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
+  // The chance of a false positive is worked out for one slice, with the
+  // average occupancy, and multiplied by the number of slices that are checked
+  uint32 occupancy = filter->occupancy / filter->generations;
 
   lua_pushinteger(L, filter->size << 5);
   lua_pushinteger(L, filter->fns);
@@ -96,8 +244,8 @@ static int bloom_filter_info(lua_State *L) {
 
   // Now calculate the chance that a FP will be returned
   uint64 prob = 1000000;
-  if (filter->occupancy > 0) {
-    unsigned int ratio = (filter->size << 5) / filter->occupancy;
+  if (occupancy > 0) {
+    unsigned int ratio = (filter->size << 5) / occupancy;
     int i;
 
     prob = ratio;
@@ -108,7 +256,7 @@ static int bloom_filter_info(lua_State *L) {
 
     if (prob < 1000000) {
       // try again with some scaling
-      unsigned int ratio256 = (filter->size << 13) / filter->occupancy;
+      unsigned int ratio256 = (filter->size << 13) / occupancy;
 
       uint64 prob256 = ratio256;
 
@@ -118,6 +266,10 @@ static int bloom_filter_info(lua_State *L) {
 
       prob = prob256 >> 8;
     }
+    prob /= filter->generations;
+    if (prob < 1) {
+      prob = 1;
+    }
   }
 
   lua_pushinteger(L, prob > 1000000 ? 1000000 : (int) prob);
@@ -125,7 +277,23 @@ static int bloom_filter_info(lua_State *L) {
   return 4;
 }
 
-static int bloom_create(lua_State *L) {
+static bloom_t *new_filter(lua_State *L, uint8 kind, uint8 generations, uint16 size, uint8 fns) {
+  bloom_t header = { .fns = fns, .kind = kind, .generations = generations, .size = size };
+  size_t bytes = buf_words(&header) << 2;
+
+  bloom_t *filter = (bloom_t *) lua_newuserdata(L, sizeof(bloom_t) + bytes);
+  //
+  // Associate its metatable
+  luaL_getmetatable(L, "bloom.filter");
+  lua_setmetatable(L, -2);
+
+  memset(filter, 0, sizeof(bloom_t) + bytes);
+  *filter = header;
+
+  return filter;
+}
+
+static int create(lua_State *L, uint8 kind, uint8 generations) {
   int items = luaL_checkinteger(L, 1);
   int error = luaL_checkinteger(L, 2);
 
@@ -153,19 +321,126 @@ static int bloom_create(lua_State *L) {
   if (fns < 2) {
     fns = 2;
   }
-  if (fns > 15) {
-    fns = 15;
+  if (fns > BLOOM_MAX_FNS) {
+    fns = BLOOM_MAX_FNS;
   }
 
-  bloom_t *filter = (bloom_t *) lua_newuserdata(L, sizeof(bloom_t) + size);
-  //
-  // Associate its metatable
-  luaL_getmetatable(L, "bloom.filter");
-  lua_setmetatable(L, -2);
+  luaL_argcheck(L, (size >> 2) <= 0xffff, 1, "too many elements");
+  new_filter(L, kind, generations, size >> 2, fns);
+
+  return 1;
+}
+
+static int bloom_create(lua_State *L) {
+  int generations = luaL_optinteger(L, 3, 1);
+
+  luaL_argcheck(L, generations >= 1 && generations <= BLOOM_MAX_GENERATIONS, 3, "generations: 1-8");
+
+  return create(L, generations > 1 ? BLOOM_ROTATING : BLOOM_PLAIN, generations);
+}
+
+static int bloom_create_counting(lua_State *L) {
+  return create(L, BLOOM_COUNTING, 1);
+}
+
+static void serialize_header(const bloom_t *filter, uint32 *hdr) {
+  hdr[0] = BLOOM_MAGIC | (filter->kind << 16) | (filter->generations << 12) |
+           (filter->current << 8) | filter->fns;
+  hdr[1] = filter->size;
+  hdr[2] = filter->occupancy;
+}
+
+static int bloom_filter_serialize(lua_State *L) {
+  bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
+  uint32 hdr[BLOOM_HEADER_WORDS];
+
+  serialize_header(filter, hdr);
 
-  memset(filter, 0, sizeof(bloom_t) + size);
-  filter->size = size >> 2;
-  filter->fns = fns;
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, (const char *) hdr, sizeof(hdr));
+  luaL_addlstring(&b, (const char *) filter->buf, buf_words(filter) << 2);
+  luaL_pushresult(&b);
+
+  return 1;
+}
+
+// Checks a serialized header and creates an empty filter to match it
+static bloom_t *deserialize_header(lua_State *L, const uint32 *hdr, size_t words) {
+  uint8 kind = (hdr[0] >> 16) & 0xff;
+  uint8 generations = (hdr[0] >> 12) & 0xf;
+  uint8 current = (hdr[0] >> 8) & 0xf;
+  uint8 fns = hdr[0] & 0xff;
+
+  if ((hdr[0] & 0xff000000) != BLOOM_MAGIC || kind > BLOOM_COUNTING ||
+      generations < 1 || generations > BLOOM_MAX_GENERATIONS || current >= generations ||
+      fns < 2 || fns > BLOOM_MAX_FNS || hdr[1] == 0 || hdr[1] > 0xffff) {
+    luaL_error(L, "not a serialized filter");
+  }
+  bloom_t *filter = new_filter(L, kind, generations, hdr[1], fns);
+  if (words != BLOOM_HEADER_WORDS + buf_words(filter)) {
+    luaL_error(L, "serialized filter has the wrong length");
+  }
+  filter->current = current;
+  filter->occupancy = hdr[2];
+
+  return filter;
+}
+
+static int bloom_deserialize(lua_State *L) {
+  size_t length;
+  const char *data = luaL_checklstring(L, 1, &length);
+  uint32 hdr[BLOOM_HEADER_WORDS];
+
+  luaL_argcheck(L, length >= sizeof(hdr) && (length & 3) == 0, 1, "not a serialized filter");
+  memcpy(hdr, data, sizeof(hdr));
+  bloom_t *filter = deserialize_header(L, hdr, length >> 2);
+  memcpy(filter->buf, data + sizeof(hdr), length - sizeof(hdr));
+
+  return 1;
+}
+
+static int bloom_filter_tortc(lua_State *L) {
+  bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
+  int slot = luaL_checkinteger(L, 2);
+  uint32 words = buf_words(filter);
+  uint32 hdr[BLOOM_HEADER_WORDS];
+  int i;
+
+  luaL_argcheck(L, slot >= 0 && slot + BLOOM_HEADER_WORDS + words <= RTC_USER_MEM_NUM_DWORDS, 2, "filter does not fit in RTC memory");
+
+  serialize_header(filter, hdr);
+  for (i = 0; i < BLOOM_HEADER_WORDS; i++) {
+    rtc_mem_write(slot + i, hdr[i]);
+  }
+  for (i = 0; i < words; i++) {
+    rtc_mem_write(slot + BLOOM_HEADER_WORDS + i, filter->buf[i]);
+  }
+
+  lua_pushinteger(L, BLOOM_HEADER_WORDS + words);
+  return 1;
+}
+
+static int bloom_fromrtc(lua_State *L) {
+  int slot = luaL_checkinteger(L, 1);
+  uint32 hdr[BLOOM_HEADER_WORDS];
+  int i;
+
+  luaL_argcheck(L, slot >= 0 && slot + BLOOM_HEADER_WORDS <= RTC_USER_MEM_NUM_DWORDS, 1, "slot out of range");
+  for (i = 0; i < BLOOM_HEADER_WORDS; i++) {
+    hdr[i] = rtc_mem_read(slot + i);
+  }
+  // Work out the length from the header alone, before anything is allocated
+  bloom_t probe = { .kind = (hdr[0] >> 16) & 0xff, .generations = (hdr[0] >> 12) & 0xf, .size = hdr[1] & 0xffff };
+  uint32 words = buf_words(&probe);
+  if (slot + BLOOM_HEADER_WORDS + words > RTC_USER_MEM_NUM_DWORDS) {
+    return luaL_error(L, "not a serialized filter");
+  }
+
+  bloom_t *filter = deserialize_header(L, hdr, BLOOM_HEADER_WORDS + words);
+  for (i = 0; i < words; i++) {
+    filter->buf[i] = rtc_mem_read(slot + BLOOM_HEADER_WORDS + i);
+  }
 
   return 1;
 }
@@ -175,14 +450,21 @@ LROT_BEGIN(bloom_filter, NULL, LROT_MASK_INDEX)
   LROT_TABENTRY( __index, bloom_filter )
   LROT_FUNCENTRY( add, bloom_filter_add )
   LROT_FUNCENTRY( check, bloom_filter_check )
+  LROT_FUNCENTRY( remove, bloom_filter_remove )
+  LROT_FUNCENTRY( rotate, bloom_filter_rotate )
   LROT_FUNCENTRY( reset, bloom_filter_reset )
   LROT_FUNCENTRY( info, bloom_filter_info )
+  LROT_FUNCENTRY( serialize, bloom_filter_serialize )
+  LROT_FUNCENTRY( tortc, bloom_filter_tortc )
 LROT_END(bloom_filter, NULL, LROT_MASK_INDEX)
 
 
 // Module function map
 LROT_BEGIN(bloom, NULL, 0)
   LROT_FUNCENTRY( create, bloom_create )
+  LROT_FUNCENTRY( createcounting, bloom_create_counting )
+  LROT_FUNCENTRY( deserialize, bloom_deserialize )
+  LROT_FUNCENTRY( fromrtc, bloom_fromrtc )
 LROT_END(bloom, NULL, 0)
 
 
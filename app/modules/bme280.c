@@ -23,6 +23,7 @@
 #define BME280_REGISTER_CHIPID                (0xD0)
 #define BME280_REGISTER_VERSION               (0xD1)
 #define BME280_REGISTER_SOFTRESET             (0xE0)
+#define BME280_REGISTER_STATUS                (0xF3)
 #define BME280_REGISTER_CAL26                 (0xE1)
 #define BME280_REGISTER_PRESS                 (0xF7)	// 0xF7-0xF9
 #define BME280_REGISTER_TEMP                  (0xFA)	// 0xFA-0xFC
@@ -45,6 +46,8 @@
 #define BME280_FORCED_MODE                   (0x01)
 #define BME280_NORMAL_MODE                   (0x03)
 #define BME280_SOFT_RESET_CODE               (0xB6)
+#define BME280_STATUS_MEASURING              (0x08)
+#define BME280_MAX_POLLS                     (50)
 /****************************************************/
 /**\name	OVER SAMPLING DEFINITIONS  */
 /***************************************************/
@@ -79,8 +82,6 @@
 #define BME280_U32_t uint32_t
 #define BME280_S64_t int64_t
 
-#define BME280_SAMPLING_DELAY  113 //maximum measurement time in ms for maximum oversampling for all measures = 1.25 + 2.3*16 + 2.3*16 + 0.575 + 2.3*16 + 0.575 ms
-
 // #define r16s(reg)  ((int16_t)r16u(reg))
 // #define r16sLE(reg)  ((int16_t)r16uLE(reg))
 
@@ -95,7 +96,10 @@ static uint8_t bme280_isbme = 0; // 1 if the chip is BME280, 0 for BMP280
 static uint8_t bme280_mode = 0; // stores oversampling settings
 static uint8_t bme280_ossh = 0; // stores humidity oversampling settings
 os_timer_t bme280_timer; // timer for forced mode readout
-int lua_connected_readout_ref; // callback when readout is ready
+static int lua_connected_readout_ref = LUA_NOREF; // callback when readout is ready
+static uint8_t bme280_polls; // status checks after the delay ran out
+static uint8_t bme280_readout_qnh; // 1 if QNH is wanted for this readout
+static int32_t bme280_readout_alt; // altitude for the QNH
 
 static struct {
 	uint16_t  dig_T1;
@@ -119,8 +123,8 @@ static struct {
 } bme280_data;
 
 static BME280_S32_t bme280_t_fine;
-static uint32_t bme280_h = 0;
-static double bme280_hc = 1.0;
+static int32_t bme280_h = 0;
+static uint32_t bme280_hc = 1 << 24; // sea level factor for bme280_h in Q8.24
 
 // return 0 if good
 static int r8u_n(uint8_t reg, int n, uint8_t *buf) {
@@ -216,16 +220,14 @@ static double ln(double x) {
 	return 2*y*r;
 }
 
-static double bme280_qfe2qnh(int32_t qfe, int32_t h) {
-	double hc;
-	if (bme280_h == h) {
-		hc = bme280_hc;
-	} else {
-		hc = pow((double)(1.0 - 2.25577e-5 * h), (double)(-5.25588));
-		bme280_hc = hc; bme280_h = h;
+// The factor is only worked out again when the altitude changes, the
+// conversion itself is an integer multiply
+static uint32_t bme280_qfe2qnh(uint32_t qfe, int32_t h) {
+	if (bme280_h != h) {
+		bme280_hc = (uint32_t)(pow((double)(1.0 - 2.25577e-5 * h), (double)(-5.25588)) * (1 << 24) + 0.5);
+		bme280_h = h;
 	}
-	double qnh = (double)qfe * hc;
-	return qnh;
+	return (uint32_t)(((uint64_t)qfe * bme280_hc + (1 << 23)) >> 24);
 }
 
 static int bme280_lua_setup(lua_State* L) {
@@ -317,23 +319,57 @@ static int bme280_lua_setup(lua_State* L) {
 	return 1;
 }
 
+static int bme280_push_readout(lua_State* L, int alt);
+
+// Maximum measurement time in ms for the current oversampling settings,
+// from appendix B of the datasheet
+static uint32_t bme280_sampling_delay(void) {
+	static const uint8_t oss[] = { 0, 1, 2, 4, 8, 16, 16, 16 };
+	uint32_t t = oss[(bme280_mode >> 5) & 7], p = oss[(bme280_mode >> 2) & 7];
+	uint32_t h = bme280_isbme ? oss[bme280_ossh & 7] : 0;
+	uint32_t us = 1250 + 2300 * t + (p ? 2300 * p + 575 : 0) + (h ? 2300 * h + 575 : 0);
+	return (us + 999) / 1000;
+}
+
 static void bme280_readoutdone (void *arg)
 {
 	NODE_DBG("timer out\n");
+	uint8_t status = 0;
+	r8u_n(BME280_REGISTER_STATUS, 1, &status);
+	if ((status & BME280_STATUS_MEASURING) && bme280_polls++ < BME280_MAX_POLLS) {
+		// the conversion took longer than the delay, poll until it is done
+		os_timer_arm (&bme280_timer, 2, 0);
+		return;
+	}
 	lua_State *L = lua_getstate();
+	int alt = 0;
+	if (bme280_readout_qnh) {
+		lua_pushinteger (L, bme280_readout_alt);
+		alt = lua_gettop (L);
+	}
 	lua_rawgeti (L, LUA_REGISTRYINDEX, lua_connected_readout_ref);
 	luaL_unref (L, LUA_REGISTRYINDEX, lua_connected_readout_ref);
+	lua_connected_readout_ref = LUA_NOREF;
 	os_timer_disarm (&bme280_timer);
-	luaL_pcallx (L, 0, 0);
+	luaL_pcallx (L, bme280_push_readout(L, alt), 0);
+	if (alt)
+		lua_pop (L, 1);
 }
 
 static int bme280_lua_startreadout(lua_State* L) {
-	uint32_t delay;
+	uint32_t delay = 0;
 
 	if (lua_isnumber(L, 1)) {
 		delay = luaL_checkinteger(L, 1);
-		if (!delay) {delay = BME280_SAMPLING_DELAY;} // if delay is 0 then set the default delay
 	}
+	if (!delay) {delay = bme280_sampling_delay();} // if delay is 0 then set the default delay
+
+	os_timer_disarm (&bme280_timer);
+	luaL_unref(L, LUA_REGISTRYINDEX, lua_connected_readout_ref);
+	bme280_polls = 0;
+	bme280_readout_qnh = lua_isnumber(L, 3);
+	if (bme280_readout_qnh)
+		bme280_readout_alt = luaL_checkinteger(L, 3);
 
 	if (!lua_isnoneornil(L, 2)) {
 		lua_pushvalue(L, 2);
@@ -359,9 +395,14 @@ static int bme280_lua_startreadout(lua_State* L) {
 // Return T, QFE, H if no altitude given
 // Return T, QFE, H, QNH if altitude given
 static int bme280_lua_read(lua_State* L) {
+	return bme280_push_readout(L, 1);
+}
+
+// Push the values read() returns, taking the altitude from stack index alt
+static int bme280_push_readout(lua_State* L, int alt) {
 	uint8_t buf[8];
 	uint32_t qfe;
-	uint8_t calc_qnh = lua_isnumber(L, 1);
+	uint8_t calc_qnh = alt && lua_isnumber(L, alt);
 
 	r8u_n(BME280_REGISTER_PRESS, 8, buf);	// registers are P[3], T[3], H[2]
 
@@ -387,9 +428,8 @@ static int bme280_lua_read(lua_State* L) {
 		lua_pushinteger(L, bme280_compensate_H(adc_H));
 
 	if (calc_qnh) { // have altitude
-		int32_t h = luaL_checkinteger(L, 1);
-		double qnh = bme280_qfe2qnh(qfe, h);
-		lua_pushinteger(L, (int32_t)(qnh + 0.5));
+		int32_t h = luaL_checkinteger(L, alt);
+		lua_pushinteger(L, bme280_qfe2qnh(qfe, h));
 		return 4;
 	}
 	return 3;
@@ -440,8 +480,7 @@ static int bme280_lua_qfe2qnh(lua_State* L) {
 	}
 	int32_t qfe = luaL_checkinteger(L, 1);
 	int32_t h = luaL_checkinteger(L, 2);
-	double qnh = bme280_qfe2qnh(qfe, h);
-	lua_pushinteger(L, (int32_t)(qnh + 0.5));
+	lua_pushinteger(L, bme280_qfe2qnh(qfe, h));
 	return 1;
 }
 
@@ -175,7 +175,8 @@ double ln(double x) {
   return 2*y*r;
 }
 
-uint32_t bme280_h = 0; // buffer last qfe2qnh calculation
+int32_t bme280_h = 0; // buffer last qfe2qnh calculation
+#ifdef BME280_MATH_FLOAT
 double bme280_hc = 1.0;
 
 double bme280_qfe2qnh(double qfe, double h) {
@@ -189,6 +190,19 @@ double bme280_qfe2qnh(double qfe, double h) {
   double qnh = (double)qfe * hc;
   return qnh;
 }
+#else
+uint32_t bme280_hc = 1 << 24; // sea level factor for bme280_h in Q8.24
+
+// The factor is only worked out again when the altitude changes, the
+// conversion itself is an integer multiply
+uint32_t bme280_qfe2qnh(uint32_t qfe, int32_t h) {
+  if (bme280_h != h) {
+    bme280_hc = (uint32_t)(pow((double)(1.0 - 2.25577e-5 * h), (double)(-5.25588)) * (1 << 24) + 0.5);
+    bme280_h = h;
+  }
+  return (uint32_t)(((uint64_t)qfe * bme280_hc + (1 << 23)) >> 24);
+}
+#endif
 
 int bme280_lua_setup(lua_State* L) {
   uint8_t bme280_mode = 0; // stores oversampling settings
@@ -260,10 +274,16 @@ int bme280_lua_setup(lua_State* L) {
   return 2;
 }
 
+#ifdef BME280_MATH_FLOAT
+#define bme280_push(L, v, scale)  lua_pushnumber(L, (v)/scale)
+#else
+#define bme280_push(L, v, scale)  lua_pushinteger(L, v)
+#endif
+
 // Return T, QFE, H if no altitude given
 // Return T, QFE, H, QNH if altitude given
 int bme280_lua_read(lua_State* L) {
-  double qfe;
+  uint32_t qfe;
 
   bme280_data = (bme280_data_p)lua_touserdata(L, 1);
   
@@ -280,7 +300,7 @@ int bme280_lua_read(lua_State* L) {
   uint32_t adc_T = (uint32_t)(((buf[3] << 16) | (buf[4] << 8) | buf[5]) >> 4);
   if (adc_T == 0x80000 || adc_T == 0xfffff)
     return 0;
-  lua_pushnumber(L, bme280_compensate_T(adc_T)/100.0);
+  bme280_push(L, bme280_compensate_T(adc_T), 100.0);
 
   uint32_t adc_P = (uint32_t)(((buf[0] << 16) | (buf[1] << 8) | buf[2]) >> 4);
   NODE_DBG("adc_P: %d\n", adc_P);
@@ -288,20 +308,23 @@ int bme280_lua_read(lua_State* L) {
     lua_pushnil(L);
     calc_qnh = 0;
   } else {
-    qfe = bme280_compensate_P(adc_P)/1000.0;
-    lua_pushnumber (L, qfe);
+    qfe = bme280_compensate_P(adc_P);
+    bme280_push(L, qfe, 1000.0);
   }
 
   uint32_t adc_H = (uint32_t)((buf[6] << 8) | buf[7]);
   if (reg_len!=8 || adc_H == 0x8000 || adc_H == 0xffff)
     lua_pushnil(L);
   else
-    lua_pushnumber (L, bme280_compensate_H(adc_H)/1000.0);
+    bme280_push(L, bme280_compensate_H(adc_H), 1000.0);
 
   if (calc_qnh) { // have altitude
-    int32_t h = luaL_checknumber(L, 3);
-    double qnh = bme280_qfe2qnh(qfe, h);
-    lua_pushnumber (L, qnh);
+    int32_t h = luaL_checkinteger(L, 3);
+#ifdef BME280_MATH_FLOAT
+    lua_pushnumber(L, bme280_qfe2qnh(qfe/1000.0, h));
+#else
+    lua_pushinteger(L, bme280_qfe2qnh(qfe, h));
+#endif
     return 4;
   }
   return 3;
@@ -311,10 +334,16 @@ int bme280_lua_qfe2qnh(lua_State* L) {
   if (lua_isuserdata(L, 1) || lua_istable(L, 1)) {  // allow to call it as object method, userdata have no use here
      lua_remove(L, 1);
   }
+#ifdef BME280_MATH_FLOAT
   double  qfe = luaL_checknumber(L, 1);
   double h = luaL_checknumber(L, 2);
   double qnh = bme280_qfe2qnh(qfe, h);
   lua_pushnumber(L, qnh);
+#else
+  uint32_t qfe = luaL_checkinteger(L, 1);
+  int32_t h = luaL_checkinteger(L, 2);
+  lua_pushinteger(L, bme280_qfe2qnh(qfe, h));
+#endif
   return 1;
 }
 
@@ -325,7 +354,12 @@ int bme280_lua_altitude(lua_State* L) {
   double P = luaL_checknumber(L, 1);
   double qnh = luaL_checknumber(L, 2);
   double h = (1.0 - pow((double)P/(double)qnh, 1.0/5.25588)) / 2.25577e-5;
+#ifdef BME280_MATH_FLOAT
   lua_pushnumber (L, h);
+#else
+  h *= 100.0; // centimeters
+  lua_pushinteger(L, (int32_t)(h + (((h<0)?-1:(h>0)) * 0.5)));
+#endif
   return 1;
 }
 
@@ -333,15 +367,25 @@ int bme280_lua_dewpoint(lua_State* L) {
   if (lua_isuserdata(L, 1) || lua_istable(L, 1)) {  // allow to call it as object method, userdata have no use here
      lua_remove(L, 1);
   }
+#ifdef BME280_MATH_FLOAT
   double H = luaL_checknumber(L, 1)/100.0; // percent
   double T = luaL_checknumber(L, 2);
+#else
+  double H = luaL_checkinteger(L, 1)/100000.0; // 0.001 percent
+  double T = luaL_checkinteger(L, 2)/100.0;
+#endif
 
   const double c243 = 243.5;
   const double c17 = 17.67;
   double c = ln(H) + ((c17 * T) / (c243 + T));
   double d = (c243 * c)/(c17 - c);  
 
+#ifdef BME280_MATH_FLOAT
   lua_pushnumber (L, d);
+#else
+  d *= 100.0;
+  lua_pushinteger(L, (int32_t)(d + (((d<0)?-1:(d>0)) * 0.5)));
+#endif
   return 1;
 }
 
@@ -17,12 +17,16 @@
 #define DEFAULT_HEATER_DUR 100
 #define DEFAULT_HEATER_TEMP 300
 #define DEFAULT_AMBIENT_TEMP 23
+#define BME680_MAX_POLLS 50
 
 static const uint32_t bme680_i2c_id = BME680_CHIP_ID_ADDR;
 
 static uint8_t bme680_i2c_addr = BME680_I2C_ADDR_PRIMARY;
 os_timer_t bme680_timer; // timer for forced mode readout
-int lua_connected_readout_ref; // callback when readout is ready
+static int lua_connected_readout_ref = LUA_NOREF; // callback when readout is ready
+static uint8_t bme680_polls; // status checks after the delay ran out
+static uint8_t bme680_readout_qnh; // 1 if QNH is wanted for this readout
+static int32_t bme680_readout_alt; // altitude for the QNH
 
 static struct bme680_calib_data bme680_data;
 static uint8_t bme680_mode = 0; // stores oversampling settings
@@ -32,8 +36,8 @@ static uint8 os_hum = 0; // stores humidity oversampling settings
 static uint16_t heatr_dur;
 static int8_t amb_temp = 23; //DEFAULT_AMBIENT_TEMP;
 
-static uint32_t bme680_h = 0;
-static double bme680_hc = 1.0;
+static int32_t bme680_h = 0;
+static uint32_t bme680_hc = 1 << 24; // sea level factor for bme680_h in Q8.24
 
 // return 0 if good
 static int r8u_n(uint8_t reg, int n, uint8_t *buff) {
@@ -309,16 +313,14 @@ static double ln(double x) {
 	return 2*y*r;
 }
 
-static double bme280_qfe2qnh(int32_t qfe, int32_t h) {
-	double hc;
-	if (bme680_h == h) {
-		hc = bme680_hc;
-	} else {
-		hc = pow((double)(1.0 - 2.25577e-5 * h), (double)(-5.25588));
-		bme680_hc = hc; bme680_h = h;
+// The factor is only worked out again when the altitude changes, the
+// conversion itself is an integer multiply
+static uint32_t bme280_qfe2qnh(uint32_t qfe, int32_t h) {
+	if (bme680_h != h) {
+		bme680_hc = (uint32_t)(pow((double)(1.0 - 2.25577e-5 * h), (double)(-5.25588)) * (1 << 24) + 0.5);
+		bme680_h = h;
 	}
-	double qnh = (double)qfe * hc;
-	return qnh;
+	return (uint32_t)(((uint64_t)qfe * bme680_hc + (1 << 23)) >> 24);
 }
 
 static int bme680_lua_setup(lua_State* L) {
@@ -425,23 +427,47 @@ static int bme680_lua_setup(lua_State* L) {
 	return 1;
 }
 
+static int bme680_push_readout(lua_State* L, int alt);
+
 static void bme280_readoutdone (void *arg)
 {
 	NODE_DBG("timer out\n");
+	uint8_t status = 0;
+	r8u_n(BME680_FIELD0_ADDR, 1, &status);
+	if (!(status & BME680_NEW_DATA_MSK) && bme680_polls++ < BME680_MAX_POLLS) {
+		// the conversion took longer than the delay, poll until it is done
+		os_timer_arm (&bme680_timer, 2, 0);
+		return;
+	}
 	lua_State *L = lua_getstate();
+	int alt = 0;
+	if (bme680_readout_qnh) {
+		lua_pushinteger (L, bme680_readout_alt);
+		alt = lua_gettop (L);
+	}
 	lua_rawgeti (L, LUA_REGISTRYINDEX, lua_connected_readout_ref);
 	luaL_unref (L, LUA_REGISTRYINDEX, lua_connected_readout_ref);
+	lua_connected_readout_ref = LUA_NOREF;
 	os_timer_disarm (&bme680_timer);
-	luaL_pcallx (L, 0, 0);
+	luaL_pcallx (L, bme680_push_readout(L, alt), 0);
+	if (alt)
+		lua_pop (L, 1);
 }
 
 static int bme680_lua_startreadout(lua_State* L) {
-	uint32_t delay;
+	uint32_t delay = 0;
 
 	if (lua_isnumber(L, 1)) {
 		delay = luaL_checkinteger(L, 1);
-		if (!delay) {delay = calc_dur();} // if delay is 0 then set the default delay
 	}
+	if (!delay) {delay = calc_dur();} // if delay is 0 then set the default delay
+
+	os_timer_disarm (&bme680_timer);
+	luaL_unref(L, LUA_REGISTRYINDEX, lua_connected_readout_ref);
+	bme680_polls = 0;
+	bme680_readout_qnh = lua_isnumber(L, 3);
+	if (bme680_readout_qnh)
+		bme680_readout_alt = luaL_checkinteger(L, 3);
 
 	if (!lua_isnoneornil(L, 2)) {
 		lua_pushvalue(L, 2);
@@ -468,6 +494,11 @@ static int bme680_lua_startreadout(lua_State* L) {
 // Return T, QFE, H if no altitude given
 // Return T, QFE, H, QNH if altitude given
 static int bme680_lua_read(lua_State* L) {
+	return bme680_push_readout(L, 1);
+}
+
+// Push the values read() returns, taking the altitude from stack index alt
+static int bme680_push_readout(lua_State* L, int alt) {
 	uint8_t buff[BME680_FIELD_LENGTH] = { 0 };
 	uint8_t gas_range;
 	uint32_t adc_temp;
@@ -477,7 +508,7 @@ static int bme680_lua_read(lua_State* L) {
   uint8_t status;
 
 	uint32_t qfe;
-	uint8_t calc_qnh = lua_isnumber(L, 1);
+	uint8_t calc_qnh = alt && lua_isnumber(L, alt);
 
 	r8u_n(BME680_FIELD0_ADDR, BME680_FIELD_LENGTH, buff);
 
@@ -507,9 +538,8 @@ static int bme680_lua_read(lua_State* L) {
   lua_pushinteger(L, calc_gas_resistance(adc_gas_res, gas_range));
 
 	if (calc_qnh) { // have altitude
-		int32_t h = luaL_checkinteger(L, 1);
-		double qnh = bme280_qfe2qnh(qfe, h);
-		lua_pushinteger(L, (int32_t)(qnh + 0.5));
+		int32_t h = luaL_checkinteger(L, alt);
+		lua_pushinteger(L, bme280_qfe2qnh(qfe, h));
 		return 5;
 	}
 	return 4;
@@ -521,8 +551,7 @@ static int bme680_lua_qfe2qnh(lua_State* L) {
 	}
 	int32_t qfe = luaL_checkinteger(L, 1);
 	int32_t h = luaL_checkinteger(L, 2);
-	double qnh = bme280_qfe2qnh(qfe, h);
-	lua_pushinteger(L, (int32_t)(qnh + 0.5));
+	lua_pushinteger(L, bme280_qfe2qnh(qfe, h));
 	return 1;
 }
 
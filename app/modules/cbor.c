@@ -0,0 +1,980 @@
+// Module for CBOR (RFC 8949) encoding and decoding
+
+#include "module.h"
+#include "lauxlib.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#ifdef LUA_USE_MODULES_NUMBUF
+#include "numbuf.h"
+#endif
+
+#define DEFAULT_DEPTH   20
+
+#define CBOR_ENCODER_METATABLE  "cbor.encoder"
+#define CBOR_DECODER_METATABLE  "cbor.decoder"
+#define CBOR_BYTES_METATABLE    "cbor.bytes"
+
+// Major types
+#define CBOR_UINT       0
+#define CBOR_NINT       1
+#define CBOR_BYTES      2
+#define CBOR_TEXT       3
+#define CBOR_ARRAY      4
+#define CBOR_MAP        5
+#define CBOR_TAG        6
+#define CBOR_SIMPLE     7
+
+#define CBOR_FALSE      0xf4
+#define CBOR_TRUE       0xf5
+#define CBOR_NULL       0xf6
+#define CBOR_FLOAT16    0xf9
+#define CBOR_FLOAT32    0xfa
+#define CBOR_FLOAT64    0xfb
+#define CBOR_INDEFINITE 31
+
+// RFC 8746 tags for little endian typed arrays
+#define CBOR_TAG_SINT8    72
+#define CBOR_TAG_SINT16LE 77
+#define CBOR_TAG_SINT32LE 78
+#define CBOR_TAG_FLOAT32LE 85
+
+#if LUA_VERSION_NUM == 501
+#ifdef LUA_NUMBER_INTEGRAL
+#define cbor_isinteger(L, i) 1
+#else
+#define cbor_isinteger(L, i) 0
+#endif
+#else
+#define cbor_isinteger(L, i) lua_isinteger(L, i)
+#endif
+
+#pragma mark - Byte strings
+
+/*
+ * Lua strings are encoded as text strings when they are valid UTF-8 and as
+ * byte strings otherwise.  cbor.bytes() marks a string, such as the output of
+ * struct.pack(), that must always go as a byte string.
+ */
+typedef struct {
+  int ref;
+} cbor_bytes;
+
+// Lua: b = cbor.bytes(string)
+static int cbor_bytes_new(lua_State *L) {
+  luaL_checkstring(L, 1);
+  cbor_bytes *b = (cbor_bytes *)lua_newuserdata(L, sizeof(cbor_bytes));
+  luaL_getmetatable(L, CBOR_BYTES_METATABLE);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 1);
+  b->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+static int cbor_bytes_gc(lua_State *L) {
+  cbor_bytes *b = (cbor_bytes *)luaL_checkudata(L, 1, CBOR_BYTES_METATABLE);
+  luaL_unref(L, LUA_REGISTRYINDEX, b->ref);
+  b->ref = LUA_NOREF;
+  return 0;
+}
+
+static int is_utf8(const uint8_t *s, size_t len) {
+  while (len) {
+    int n = *s < 0x80 ? 0 : (*s & 0xe0) == 0xc0 ? 1 :
+            (*s & 0xf0) == 0xe0 ? 2 : (*s & 0xf8) == 0xf0 ? 3 : -1;
+    if (n < 0 || (size_t) n >= len)
+      return n == 0;
+    s++; len--;
+    while (n--) {
+      if ((*s++ & 0xc0) != 0x80)
+        return 0;
+      len--;
+    }
+  }
+  return 1;
+}
+
+#pragma mark - Encoder
+
+/*
+ * The encoder has the same shape as the sjson one: it walks the tables one
+ * step at a time, each step making one small item head in the carry, and a
+ * string or typed array body is then copied straight into the reader's
+ * buffer.  Arrays and maps are written with definite lengths, so a map is
+ * counted when the walk enters it.
+ */
+typedef struct {
+  int object_ref;
+  int key_ref;          // key of the entry being written
+  uint32_t size;        // elements or entries
+  uint32_t done;        // elements or entries written
+  uint8_t is_map;
+  uint8_t started;      // the head has been written
+  uint8_t want_value;   // the key of the current entry has been written
+} ENC_LEVEL;
+
+typedef struct {
+  ENC_LEVEL *stack;
+  int nlevels;
+  int level;
+  int null_ref;
+  // Body being copied: body_len bytes of a ring of body_size from body_start
+  int body_ref;
+  const uint8_t *body;
+  uint32_t body_size;
+  uint32_t body_start;
+  uint32_t body_len;
+  uint32_t body_pos;
+  // Output already generated but not yet taken by the reader
+  uint8_t carry_pos;
+  uint8_t carry_len;
+  uint8_t carry[16];
+} ENC_DATA;
+
+static void enc_putc(ENC_DATA *e, uint8_t c) {
+  e->carry[e->carry_len++] = c;
+}
+
+static void enc_put_be(ENC_DATA *e, uint64_t v, int n) {
+  uint8_t *p = e->carry + e->carry_len;
+  e->carry_len += n;
+  while (n--) {
+    p[n] = (uint8_t) v;
+    v >>= 8;
+  }
+}
+
+// The head of an item, with its argument in the shortest form
+static void enc_head(ENC_DATA *e, int major, uint64_t v) {
+  major <<= 5;
+  if (v < 24) {
+    enc_putc(e, major | v);
+  } else if (v <= 0xff) {
+    enc_putc(e, major | 24);
+    enc_put_be(e, v, 1);
+  } else if (v <= 0xffff) {
+    enc_putc(e, major | 25);
+    enc_put_be(e, v, 2);
+  } else if (v <= 0xffffffff) {
+    enc_putc(e, major | 26);
+    enc_put_be(e, v, 4);
+  } else {
+    enc_putc(e, major | 27);
+    enc_put_be(e, v, 8);
+  }
+}
+
+static void enc_int(ENC_DATA *e, int64_t v) {
+  if (v < 0) {
+    enc_head(e, CBOR_NINT, (uint64_t)(-(v + 1)));
+  } else {
+    enc_head(e, CBOR_UINT, (uint64_t) v);
+  }
+}
+
+// A float as float16 when that is exact, otherwise as float32
+static void enc_float(ENC_DATA *e, float s) {
+  uint32_t u;
+  memcpy(&u, &s, sizeof(u));
+  uint32_t sign = (u >> 16) & 0x8000, mant = u & 0x7fffff;
+  int exp = (int)((u >> 23) & 0xff) - 127 + 15;
+
+  if ((u & 0x7fffffff) == 0 || exp == 255 - 127 + 15) {
+    // zero, infinity or nan
+    enc_putc(e, CBOR_FLOAT16);
+    enc_put_be(e, sign | (u & 0x7fffffff ? 0x7c00 : 0) | (mant ? 0x200 : 0), 2);
+  } else if (exp >= 1 && exp <= 30 && (mant & 0x1fff) == 0) {
+    enc_putc(e, CBOR_FLOAT16);
+    enc_put_be(e, sign | (exp << 10) | (mant >> 13), 2);
+  } else {
+    enc_putc(e, CBOR_FLOAT32);
+    enc_put_be(e, u, 4);
+  }
+}
+
+// Integral floats go as integers, and others in the shortest exact float
+static void enc_number(lua_State *L, ENC_DATA *e, int argno) {
+  if (cbor_isinteger(L, argno)) {
+    enc_int(e, lua_tointeger(L, argno));
+    return;
+  }
+  lua_Number f = lua_tonumber(L, argno);
+  if (f >= -9223372036854775808.0 && f < 9223372036854775808.0 &&
+      f == (lua_Number)(int64_t) f && (f != 0 || 1 / f > 0)) {
+    enc_int(e, (int64_t) f);
+    return;
+  }
+  float s = (float) f;
+  if (sizeof(lua_Number) == sizeof(float) || (lua_Number) s == f || f != f) {
+    enc_float(e, s);
+  } else {
+    double d = (double) f;
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    enc_putc(e, CBOR_FLOAT64);
+    enc_put_be(e, u, 8);
+  }
+}
+
+// Head of a string of len bytes from a ring of size, whose bytes are anchored by argno
+static void enc_body(lua_State *L, ENC_DATA *e, int argno, int major,
+                     const void *base, uint32_t size, uint32_t start, uint32_t len) {
+  enc_head(e, major, len);
+  if (len) {
+    lua_pushvalue(L, argno);
+    e->body_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    e->body = (const uint8_t *) base;
+    e->body_size = size;
+    e->body_start = start;
+    e->body_len = len;
+    e->body_pos = 0;
+  }
+}
+
+#ifdef LUA_USE_MODULES_NUMBUF
+static void enc_numbuf(lua_State *L, ENC_DATA *e, int argno, numbuf *b) {
+  static const uint8_t tags[] = {
+    CBOR_TAG_SINT8, CBOR_TAG_SINT16LE, CBOR_TAG_SINT32LE, CBOR_TAG_FLOAT32LE
+  };
+  enc_head(e, CBOR_TAG, tags[b->type]);
+  enc_body(L, e, argno, CBOR_BYTES, b->values, b->size * b->width,
+           b->head * b->width, b->count * b->width);
+}
+#endif
+
+static void enc_value(lua_State *L, ENC_DATA *e, int argno) {
+  int type = lua_type(L, argno);
+
+  if (type == LUA_TSTRING && e->null_ref != LUA_REFNIL) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, e->null_ref);
+    if (lua_rawequal(L, -1, argno < 0 ? argno - 1 : argno)) {
+      type = LUA_TNIL;
+    }
+    lua_pop(L, 1);
+  }
+
+  switch (type) {
+    case LUA_TNIL:
+    case LUA_TLIGHTUSERDATA:
+      enc_putc(e, CBOR_NULL);
+      return;
+
+    case LUA_TBOOLEAN:
+      enc_putc(e, lua_toboolean(L, argno) ? CBOR_TRUE : CBOR_FALSE);
+      return;
+
+    case LUA_TNUMBER:
+      enc_number(L, e, argno);
+      return;
+
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, argno, &len);
+      enc_body(L, e, argno, is_utf8((const uint8_t *) s, len) ? CBOR_TEXT : CBOR_BYTES,
+               s, len, 0, len);
+      return;
+    }
+
+    case LUA_TUSERDATA: {
+      cbor_bytes *b = (cbor_bytes *)luaL_testudata(L, argno, CBOR_BYTES_METATABLE);
+      if (b) {
+        size_t len;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, b->ref);
+        const char *s = lua_tolstring(L, -1, &len);
+        enc_body(L, e, -1, CBOR_BYTES, s, len, 0, len);
+        lua_pop(L, 1);
+        return;
+      }
+#ifdef LUA_USE_MODULES_NUMBUF
+      numbuf *nb = numbuf_opt_from_lua_arg(L, argno);
+      if (nb) {
+        enc_numbuf(L, e, argno, nb);
+        return;
+      }
+#endif
+      break;
+    }
+  }
+
+  luaL_error(L, "cannot encode %s", lua_typename(L, type));
+}
+
+// Replace function values by their results; true if the value is then a table
+static int enc_is_table(lua_State *L) {
+  int count = 10;
+
+  while (lua_isfunction(L, -1) && count-- > 0) {
+    lua_call(L, 0, 1);
+  }
+
+  return lua_type(L, -1) == LUA_TTABLE;
+}
+
+static void enc_push_level(lua_State *L, ENC_DATA *e, int argno) {
+  if (++e->level >= e->nlevels) {
+    luaL_error(L, "encoder stack overflow");
+  }
+  ENC_LEVEL *lv = &e->stack[e->level];
+
+  // A table with keys 1..n only (or no keys) is an array; anything else a map
+  uint32_t entries = 0;
+  lua_Integer maxkey = 0;
+  int is_map = 0;
+  lua_pushnil(L);
+  while (lua_next(L, argno < 0 ? argno - 1 : argno)) {
+    lua_pop(L, 1);
+    entries++;
+    if (!is_map && lua_type(L, -1) == LUA_TNUMBER) {
+      lua_Number k = lua_tonumber(L, -1);
+      if (k >= 1 && k == (lua_Integer) k) {
+        if ((lua_Integer) k > maxkey) {
+          maxkey = (lua_Integer) k;
+        }
+        continue;
+      }
+    }
+    is_map = 1;
+  }
+
+  lua_pushvalue(L, argno);
+  lv->object_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lv->key_ref = LUA_REFNIL;
+  lv->is_map = is_map;
+  lv->size = is_map ? entries : (uint32_t) maxkey;
+  lv->done = 0;
+  lv->started = 0;
+  lv->want_value = 0;
+}
+
+static void enc_pop_level(lua_State *L, ENC_DATA *e) {
+  ENC_LEVEL *lv = &e->stack[e->level--];
+
+  luaL_unref(L, LUA_REGISTRYINDEX, lv->object_ref);
+  lv->object_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, lv->key_ref);
+  lv->key_ref = LUA_REFNIL;
+}
+
+// Advance the walk by one step
+static void enc_step(lua_State *L, ENC_DATA *e) {
+  ENC_LEVEL *lv = &e->stack[e->level];
+
+  if (!lv->started) {
+    enc_head(e, lv->is_map ? CBOR_MAP : CBOR_ARRAY, lv->size);
+    lv->started = 1;
+    return;
+  }
+  if (lv->done == lv->size && !lv->want_value) {
+    enc_pop_level(L, e);
+    return;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, lv->object_ref);
+  if (!lv->is_map) {
+    lua_rawgeti(L, -1, ++lv->done);
+  } else if (!lv->want_value) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lv->key_ref);
+    if (!lua_next(L, -2)) {
+      luaL_error(L, "table changed while encoding");
+    }
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, lv->key_ref);
+    lua_pushvalue(L, -1);
+    lv->key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lv->want_value = 1;
+    enc_value(L, e, -1);
+    lua_pop(L, 2);
+    return;
+  } else {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lv->key_ref);
+    lua_rawget(L, -2);
+    lv->want_value = 0;
+    lv->done++;
+  }
+
+  // stack now contains: -1 => value; -2 => table
+  if (enc_is_table(L)) {
+    enc_push_level(L, e, -1);
+  } else {
+    enc_value(L, e, -1);
+  }
+  lua_pop(L, 2);
+}
+
+// Write up to len bytes of output to buf; fewer only at the end of the item
+static size_t enc_fill(lua_State *L, ENC_DATA *e, char *buf, size_t len) {
+  size_t n = 0;
+
+  while (n < len) {
+    if (e->carry_pos < e->carry_len) {
+      size_t amnt = e->carry_len - e->carry_pos;
+      if (amnt > len - n) {
+        amnt = len - n;
+      }
+      memcpy(buf + n, e->carry + e->carry_pos, amnt);
+      e->carry_pos += amnt;
+      n += amnt;
+      continue;
+    }
+    e->carry_pos = e->carry_len = 0;
+
+    if (e->body_ref != LUA_NOREF) {
+      while (e->body_pos < e->body_len && n < len) {
+        uint32_t off = e->body_start + e->body_pos;
+        if (off >= e->body_size) {
+          off -= e->body_size;
+        }
+        size_t amnt = e->body_len - e->body_pos;
+        if (amnt > e->body_size - off) {
+          amnt = e->body_size - off;
+        }
+        if (amnt > len - n) {
+          amnt = len - n;
+        }
+        memcpy(buf + n, e->body + off, amnt);
+        e->body_pos += amnt;
+        n += amnt;
+      }
+      if (e->body_pos == e->body_len) {
+        luaL_unref(L, LUA_REGISTRYINDEX, e->body_ref);
+        e->body_ref = LUA_NOREF;
+      }
+    } else if (e->level >= 0) {
+      enc_step(L, e);
+    } else {
+      break;
+    }
+  }
+
+  return n;
+}
+
+static int opt_depth(lua_State *L, int opts) {
+  int depth = DEFAULT_DEPTH;
+
+  if (lua_type(L, opts) == LUA_TTABLE) {
+    lua_getfield(L, opts, "depth");
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+      depth = lua_tointeger(L, -1);
+      depth = depth < 4 ? 4 : depth > 1000 ? 1000 : depth;
+    }
+    lua_pop(L, 1);
+  }
+  return depth;
+}
+
+static int opt_null(lua_State *L, int opts) {
+  if (lua_type(L, opts) != LUA_TTABLE) {
+    return LUA_REFNIL;
+  }
+  lua_getfield(L, opts, "null");
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+// Lua: encoder = cbor.encoder(value[, opts])
+static int cbor_encoder(lua_State *L) {
+  luaL_checkany(L, 1);
+  int nlevels = opt_depth(L, 2);
+
+  ENC_DATA *e = (ENC_DATA *)lua_newuserdata(L, sizeof(ENC_DATA) + nlevels * sizeof(ENC_LEVEL));
+  luaL_getmetatable(L, CBOR_ENCODER_METATABLE);
+  lua_setmetatable(L, -2);
+
+  e->stack = (ENC_LEVEL *)(e + 1);
+  e->nlevels = nlevels;
+  e->level = -1;
+  e->body_ref = LUA_NOREF;
+  e->carry_pos = e->carry_len = 0;
+  int i;
+  for (i = 0; i < nlevels; i++) {
+    e->stack[i].object_ref = LUA_NOREF;
+    e->stack[i].key_ref = LUA_REFNIL;
+  }
+  e->null_ref = opt_null(L, 2);
+
+  lua_pushvalue(L, 1);
+  if (enc_is_table(L)) {
+    enc_push_level(L, e, -1);
+  } else {
+    enc_value(L, e, -1);
+  }
+  lua_pop(L, 1);
+
+  return 1;
+}
+
+static int enc_read(lua_State *L, ENC_DATA *e, size_t readsize) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+
+  size_t total = 0;
+
+  while (readsize > 0) {
+    size_t want = readsize < LUAL_BUFFERSIZE ? readsize : LUAL_BUFFERSIZE;
+    size_t got = enc_fill(L, e, luaL_prepbuffer(&b), want);
+
+    luaL_addsize(&b, got);
+    total += got;
+    readsize -= got;
+    if (got < want) {
+      break;
+    }
+  }
+
+  luaL_pushresult(&b);
+
+  if (total == 0) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+// Lua: s = encoder:read([size])
+static int cbor_encoder_read(lua_State *L) {
+  ENC_DATA *e = (ENC_DATA *)luaL_checkudata(L, 1, CBOR_ENCODER_METATABLE);
+  int readsize = luaL_optinteger(L, 2, 1024);
+
+  return enc_read(L, e, readsize < 1 ? 1 : readsize);
+}
+
+// Lua: s = cbor.encode(value[, opts])
+static int cbor_encode(lua_State *L) {
+  lua_settop(L, 2);
+  cbor_encoder(L);
+  ENC_DATA *e = (ENC_DATA *)lua_touserdata(L, -1);
+
+  enc_read(L, e, (size_t) -1);
+  if (lua_isnil(L, -1)) {
+    lua_pushliteral(L, "");
+  }
+  return 1;
+}
+
+static int cbor_encoder_gc(lua_State *L) {
+  ENC_DATA *e = (ENC_DATA *)luaL_checkudata(L, 1, CBOR_ENCODER_METATABLE);
+  int i;
+
+  for (i = 0; i < e->nlevels; i++) {
+    luaL_unref(L, LUA_REGISTRYINDEX, e->stack[i].object_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, e->stack[i].key_ref);
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, e->body_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, e->null_ref);
+  e->nlevels = 0;
+  e->body_ref = e->null_ref = LUA_NOREF;
+  return 0;
+}
+
+#pragma mark - Decoder
+
+/*
+ * The decoder takes its input in pieces of any size.  Only an item head,
+ * at most 9 bytes, is ever held over between writes; a string body is copied
+ * into a buffer of its declared length as it arrives, and each container is
+ * a Lua table being filled in on the decoder's stack.  Tags are skipped, so
+ * a typed array decodes as its byte string.
+ */
+#define DEC_ARRAY   0
+#define DEC_MAP     1
+#define DEC_CHUNKS  2     // pieces of an indefinite length string
+
+typedef struct {
+  int table_ref;
+  int key_ref;          // key awaiting its value, or LUA_NOREF
+  uint32_t left;        // items still to come, unless indefinite
+  uint32_t index;       // items stored in an array or chunk list
+  uint8_t kind;
+  uint8_t major;        // of the chunks of an indefinite string
+  uint8_t indefinite;
+} DEC_LEVEL;
+
+typedef struct {
+  DEC_LEVEL *stack;
+  int nlevels;
+  int level;
+  int null_ref;
+  int result_ref;
+  uint8_t complete;
+  uint8_t failed;
+  // Item head being collected
+  uint8_t head_len;
+  uint8_t head_need;
+  uint8_t head[9];
+  // String body being collected
+  int str_ref;
+  char *str;
+  uint32_t str_len;
+  uint32_t str_pos;
+} DEC_DATA;
+
+static int dec_error(lua_State *L, DEC_DATA *d, const char *msg) {
+  d->failed = 1;
+  return luaL_error(L, "cbor: %s", msg);
+}
+
+// Store the value on top of the stack in the current container, closing it when full
+static void dec_emit(lua_State *L, DEC_DATA *d) {
+  for (;;) {
+    if (d->level < 0) {
+      d->result_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      d->complete = 1;
+      return;
+    }
+    DEC_LEVEL *lv = &d->stack[d->level];
+
+    if (lv->kind == DEC_MAP && lv->key_ref == LUA_NOREF) {
+      if (lua_isnil(L, -1) || lua_type(L, -1) == LUA_TTABLE) {
+        dec_error(L, d, "unsupported map key");
+      }
+      lv->key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, lv->table_ref);
+      lua_insert(L, -2);
+      if (lv->kind == DEC_MAP) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lv->key_ref);
+        lua_insert(L, -2);
+        lua_rawset(L, -3);
+        luaL_unref(L, LUA_REGISTRYINDEX, lv->key_ref);
+        lv->key_ref = LUA_NOREF;
+      } else {
+        lua_rawseti(L, -2, ++lv->index);
+      }
+      lua_pop(L, 1);
+    }
+
+    if (lv->indefinite || --lv->left > 0) {
+      return;
+    }
+
+    // The container is complete, so it becomes a value of its parent
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lv->table_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, lv->table_ref);
+    lv->table_ref = LUA_NOREF;
+    d->level--;
+  }
+}
+
+static void dec_push_level(lua_State *L, DEC_DATA *d, int kind, uint64_t count) {
+  if (++d->level >= d->nlevels) {
+    dec_error(L, d, "nested too deeply");
+  }
+  DEC_LEVEL *lv = &d->stack[d->level];
+
+  lua_newtable(L);
+  lv->table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lv->key_ref = LUA_NOREF;
+  lv->kind = kind;
+  lv->indefinite = count == (uint64_t) -1;
+  lv->left = kind == DEC_MAP ? (uint32_t) count * 2 : (uint32_t) count;
+  lv->index = 0;
+}
+
+// Close an indefinite length item at a break
+static void dec_break(lua_State *L, DEC_DATA *d) {
+  DEC_LEVEL *lv = d->level >= 0 ? &d->stack[d->level] : NULL;
+
+  if (!lv || !lv->indefinite || lv->key_ref != LUA_NOREF) {
+    dec_error(L, d, "unexpected break");
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, lv->table_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, lv->table_ref);
+  lv->table_ref = LUA_NOREF;
+  if (lv->kind == DEC_CHUNKS) {
+    // join the chunks
+    luaL_Buffer b;
+    uint32_t i;
+    int t = lua_gettop(L);
+    luaL_buffinit(L, &b);
+    for (i = 1; i <= lv->index; i++) {
+      lua_rawgeti(L, t, i);
+      luaL_addvalue(&b);
+    }
+    luaL_pushresult(&b);
+    lua_remove(L, t);
+  }
+  d->level--;
+  dec_emit(L, d);
+}
+
+static lua_Number dec_half(uint16_t h) {
+  int exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  union { uint32_t u; float f; } v;
+
+  if (exp == 0) {
+    // zero or subnormal
+    lua_Number n = (lua_Number) mant / 16777216;
+    return (h & 0x8000) ? -n : n;
+  }
+  v.u = ((uint32_t)(h & 0x8000) << 16) | (mant << 13) |
+        (exp == 31 ? 0x7f800000 : (uint32_t)(exp + 112) << 23);
+  return v.f;
+}
+
+// Decode the complete item head in d->head
+static void dec_item(lua_State *L, DEC_DATA *d) {
+  int major = d->head[0] >> 5;
+  int info = d->head[0] & 31;
+  uint64_t v = 0;
+  int i;
+
+  for (i = 1; i < d->head_need; i++) {
+    v = (v << 8) | d->head[i];
+  }
+  if (info < 24) {
+    v = info;
+  }
+
+  DEC_LEVEL *lv = d->level >= 0 ? &d->stack[d->level] : NULL;
+  if (lv && lv->kind == DEC_CHUNKS && d->head[0] != 0xff &&
+      (major != lv->major || info == CBOR_INDEFINITE)) {
+    dec_error(L, d, "invalid string chunk");
+  }
+
+  switch (major) {
+    case CBOR_UINT:
+    case CBOR_NINT:
+      if ((lua_Integer) v >= 0 && (uint64_t)(lua_Integer) v == v) {
+        lua_pushinteger(L, major == CBOR_UINT ? (lua_Integer) v : -1 - (lua_Integer) v);
+      } else {
+        lua_pushnumber(L, major == CBOR_UINT ? (lua_Number) v : -1 - (lua_Number) v);
+      }
+      break;
+
+    case CBOR_BYTES:
+    case CBOR_TEXT:
+      if (info == CBOR_INDEFINITE) {
+        dec_push_level(L, d, DEC_CHUNKS, (uint64_t) -1);
+        d->stack[d->level].major = major;
+        return;
+      }
+      if (v == 0) {
+        lua_pushliteral(L, "");
+        break;
+      }
+      if (v > 0x7fffffff) {
+        dec_error(L, d, "string too long");
+      }
+      d->str = (char *)lua_newuserdata(L, (size_t) v);
+      d->str_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      d->str_len = (uint32_t) v;
+      d->str_pos = 0;
+      return;
+
+    case CBOR_ARRAY:
+    case CBOR_MAP:
+      if (info == CBOR_INDEFINITE) {
+        v = (uint64_t) -1;
+      } else if (v > 0x7fffffff) {
+        dec_error(L, d, "container too large");
+      }
+      if (v == 0) {
+        lua_newtable(L);
+        break;
+      }
+      dec_push_level(L, d, major == CBOR_MAP ? DEC_MAP : DEC_ARRAY, v);
+      return;
+
+    case CBOR_TAG:
+      return;       // the tagged item follows
+
+    default:
+      switch (info) {
+        case 20: lua_pushboolean(L, 0); break;
+        case 21: lua_pushboolean(L, 1); break;
+        case 22:
+        case 23: lua_rawgeti(L, LUA_REGISTRYINDEX, d->null_ref); break;
+        case 25: lua_pushnumber(L, dec_half((uint16_t) v)); break;
+        case 26: {
+          union { uint32_t u; float f; } f;
+          f.u = (uint32_t) v;
+          lua_pushnumber(L, f.f);
+          break;
+        }
+        case 27: {
+          union { uint64_t u; double f; } f;
+          f.u = v;
+          lua_pushnumber(L, f.f);
+          break;
+        }
+        case CBOR_INDEFINITE:
+          dec_break(L, d);
+          return;
+        default:
+          dec_error(L, d, "unsupported simple value");
+      }
+      break;
+  }
+
+  dec_emit(L, d);
+}
+
+static void dec_feed(lua_State *L, DEC_DATA *d, const uint8_t *s, size_t len) {
+  while (len) {
+    if (d->complete) {
+      dec_error(L, d, "data after the end");
+    }
+
+    if (d->str) {
+      size_t amnt = d->str_len - d->str_pos;
+      if (amnt > len) {
+        amnt = len;
+      }
+      memcpy(d->str + d->str_pos, s, amnt);
+      d->str_pos += amnt;
+      s += amnt;
+      len -= amnt;
+      if (d->str_pos == d->str_len) {
+        lua_pushlstring(L, d->str, d->str_len);
+        luaL_unref(L, LUA_REGISTRYINDEX, d->str_ref);
+        d->str_ref = LUA_NOREF;
+        d->str = NULL;
+        dec_emit(L, d);
+      }
+      continue;
+    }
+
+    if (d->head_len == 0) {
+      int info = *s & 31;
+      if (info >= 28 && info < 31) {
+        dec_error(L, d, "invalid item head");
+      }
+      d->head_need = info < 24 || info == 31 ? 1 : 1 + (1 << (info - 24));
+    }
+    d->head[d->head_len++] = *s++;
+    len--;
+    if (d->head_len == d->head_need) {
+      d->head_len = 0;
+      dec_item(L, d);
+    }
+  }
+}
+
+static DEC_DATA *dec_new(lua_State *L, int opts) {
+  int nlevels = opt_depth(L, opts);
+
+  DEC_DATA *d = (DEC_DATA *)lua_newuserdata(L, sizeof(DEC_DATA) + nlevels * sizeof(DEC_LEVEL));
+  luaL_getmetatable(L, CBOR_DECODER_METATABLE);
+  lua_setmetatable(L, -2);
+
+  memset(d, 0, sizeof(*d));
+  d->stack = (DEC_LEVEL *)(d + 1);
+  d->nlevels = nlevels;
+  d->level = -1;
+  d->result_ref = LUA_NOREF;
+  d->str_ref = LUA_NOREF;
+  int i;
+  for (i = 0; i < nlevels; i++) {
+    d->stack[i].table_ref = LUA_NOREF;
+    d->stack[i].key_ref = LUA_NOREF;
+  }
+  d->null_ref = opt_null(L, opts);
+
+  return d;
+}
+
+// Lua: decoder = cbor.decoder([opts])
+static int cbor_decoder(lua_State *L) {
+  dec_new(L, 1);
+  return 1;
+}
+
+static DEC_DATA *dec_check(lua_State *L) {
+  DEC_DATA *d = (DEC_DATA *)luaL_checkudata(L, 1, CBOR_DECODER_METATABLE);
+  if (d->failed) {
+    luaL_error(L, "cbor: decoder has failed");
+  }
+  return d;
+}
+
+// Lua: value = decoder:write(string)
+static int cbor_decoder_write(lua_State *L) {
+  DEC_DATA *d = dec_check(L);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+
+  dec_feed(L, d, (const uint8_t *) s, len);
+  if (!d->complete) {
+    return 0;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, d->result_ref);
+  return 1;
+}
+
+// Lua: value = decoder:result()
+static int cbor_decoder_result(lua_State *L) {
+  DEC_DATA *d = dec_check(L);
+
+  if (!d->complete) {
+    return luaL_error(L, "cbor: decode not complete");
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, d->result_ref);
+  return 1;
+}
+
+// Lua: value = cbor.decode(string[, opts])
+static int cbor_decode(lua_State *L) {
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  DEC_DATA *d = dec_new(L, 2);
+
+  dec_feed(L, d, (const uint8_t *) s, len);
+  if (!d->complete) {
+    return luaL_error(L, "cbor: truncated data");
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, d->result_ref);
+  return 1;
+}
+
+static int cbor_decoder_gc(lua_State *L) {
+  DEC_DATA *d = (DEC_DATA *)luaL_checkudata(L, 1, CBOR_DECODER_METATABLE);
+  int i;
+
+  for (i = 0; i < d->nlevels; i++) {
+    luaL_unref(L, LUA_REGISTRYINDEX, d->stack[i].table_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, d->stack[i].key_ref);
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, d->str_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, d->result_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, d->null_ref);
+  d->nlevels = 0;
+  d->str_ref = d->result_ref = d->null_ref = LUA_NOREF;
+  return 0;
+}
+
+LROT_BEGIN(cbor_bytes_map, NULL, LROT_MASK_GC)
+  LROT_FUNCENTRY( __gc, cbor_bytes_gc )
+LROT_END(cbor_bytes_map, NULL, LROT_MASK_GC)
+
+LROT_BEGIN(cbor_encoder_map, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, cbor_encoder_gc )
+  LROT_TABENTRY(  __index, cbor_encoder_map )
+  LROT_FUNCENTRY( read, cbor_encoder_read )
+LROT_END(cbor_encoder_map, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(cbor_decoder_map, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, cbor_decoder_gc )
+  LROT_TABENTRY(  __index, cbor_decoder_map )
+  LROT_FUNCENTRY( write, cbor_decoder_write )
+  LROT_FUNCENTRY( result, cbor_decoder_result )
+LROT_END(cbor_decoder_map, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(cbor, NULL, 0)
+  LROT_FUNCENTRY( encode, cbor_encode )
+  LROT_FUNCENTRY( encoder, cbor_encoder )
+  LROT_FUNCENTRY( decode, cbor_decode )
+  LROT_FUNCENTRY( decoder, cbor_decoder )
+  LROT_FUNCENTRY( bytes, cbor_bytes_new )
+LROT_END(cbor, NULL, 0)
+
+int luaopen_cbor(lua_State *L) {
+  luaL_rometatable(L, CBOR_BYTES_METATABLE, LROT_TABLEREF(cbor_bytes_map));
+  luaL_rometatable(L, CBOR_ENCODER_METATABLE, LROT_TABLEREF(cbor_encoder_map));
+  luaL_rometatable(L, CBOR_DECODER_METATABLE, LROT_TABLEREF(cbor_decoder_map));
+  lua_pushrotable(L, LROT_TABLEREF(cbor));
+  return 1;
+}
+
+NODEMCU_MODULE(CBOR, "cbor", cbor, luaopen_cbor);
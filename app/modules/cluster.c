@@ -0,0 +1,545 @@
+// Module for cluster membership by gossip over UDP, see lua_modules/gossip
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "vfs.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "lwip/ip_addr.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef LUA_USE_MODULES_CLUSTER
+#if !defined(LUA_USE_MODULES_NET)
+#error Must have NET if using CLUSTER module
+#endif
+#endif
+
+/*
+ * Every round this node sends a SYN to a random known node or seed, carrying
+ * a digest of all the nodes it knows: per node the address, the revision (a
+ * generation counted over restarts), the heartbeat (counted in rounds), the
+ * version of the node's data and the node's state. That is 15 bytes a node
+ * rather than the whole state. The digest entries update the liveness of the
+ * nodes directly, so heartbeats travel on every message.
+ *
+ * The receiver replies with an ACK holding the full entries, with data, of
+ * the nodes for which it has newer data than the digest, and the list of
+ * nodes whose data it wants. Those are then sent in a DATA message. So only
+ * the data that has changed crosses the network.
+ *
+ * Each SYN sent to a node ticks its state towards REMOVE, and any message
+ * from it returns it to UP. Lua is only called when a node joins, changes
+ * state or changes its data.
+ */
+
+extern int net_createUDPSocket(lua_State *L);
+extern int net_listen(lua_State *L);
+extern int net_on(lua_State *L);
+extern int net_send(lua_State *L);
+extern int net_close(lua_State *L);
+
+#define CLUSTER_MAGIC     0x67
+#define CLUSTER_SYN       1
+#define CLUSTER_ACK       2
+#define CLUSTER_DATA      3
+
+#define CLUSTER_DIGEST    15     // ip, revision, heartbeat, version, state
+#define CLUSTER_PACKET    1400
+#define CLUSTER_MAXDATA   128
+#define CLUSTER_MAXSEEDS  8
+
+#define CLUSTER_REVFILE   "cluster/rev.dat"
+
+enum { STATE_UP = 0, STATE_TICK = 1, STATE_SUSPECT = 2, STATE_DOWN = 3, STATE_REMOVE = 4 };
+
+typedef struct {
+  uint32_t ip;
+  uint32_t revision;
+  uint32_t heartbeat;
+  uint32_t drev;        // the revision and version of the data held
+  uint16_t dver;
+  uint8_t state;
+  uint8_t len;
+  uint8_t *data;
+} cluster_node_t;
+
+static struct {
+  cluster_node_t *nodes;        // nodes[0] is this node
+  int count, max;
+  uint32_t seeds[CLUSTER_MAXSEEDS];
+  int nseeds;
+  int port;
+  int sock_ref;
+  int cb_ref;
+  os_timer_t timer;
+} cl = { NULL, 0, 0, {0}, 0, 0, LUA_NOREF, LUA_NOREF };
+
+#pragma mark - Nodes
+
+static cluster_node_t *cluster_find(uint32_t ip) {
+  int i;
+  for (i = 0; i < cl.count; i++)
+    if (cl.nodes[i].ip == ip)
+      return cl.nodes + i;
+  return NULL;
+}
+
+// The state as Lua sees it; a node waiting for its first reply is still up
+static int cluster_shown(int state) {
+  return state == STATE_TICK ? STATE_UP : state;
+}
+
+static void cluster_notify(lua_State *L, cluster_node_t *n) {
+  if (cl.cb_ref == LUA_NOREF)
+    return;
+  char ipstr[16];
+  ets_sprintf(ipstr, IPSTR, IP2STR(&n->ip));
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cl.cb_ref);
+  lua_pushstring(L, ipstr);
+  lua_pushinteger(L, cluster_shown(n->state));
+  if (n->len)
+    lua_pushlstring(L, (const char *)n->data, n->len);
+  else
+    lua_pushnil(L);
+  lua_pushinteger(L, n->revision);
+  luaL_pcallx(L, 4, 0);
+}
+
+static void cluster_set_state(lua_State *L, cluster_node_t *n, int state) {
+  int shown = cluster_shown(n->state);
+  n->state = state;
+  if (cluster_shown(state) != shown)
+    cluster_notify(L, n);
+}
+
+static int cluster_set_data(cluster_node_t *n, const uint8_t *data, int len) {
+  uint8_t *copy = NULL;
+  if (len && !(copy = malloc(len)))
+    return 0;
+  if (len)
+    memcpy(copy, data, len);
+  free(n->data);
+  n->data = copy;
+  n->len = len;
+  return 1;
+}
+
+static void cluster_free(void) {
+  int i;
+  for (i = 0; i < cl.count; i++)
+    free(cl.nodes[i].data);
+  free(cl.nodes);
+  cl.nodes = NULL;
+  cl.count = cl.max = 0;
+}
+
+#pragma mark - Encoding
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+  return p + 4;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// The address stays in network order, as lwIP keeps it
+static uint8_t *put_ip(uint8_t *p, uint32_t ip) {
+  memcpy(p, &ip, 4);
+  return p + 4;
+}
+
+static uint32_t get_ip(const uint8_t *p) {
+  uint32_t ip;
+  memcpy(&ip, p, 4);
+  return ip;
+}
+
+// Data held from an earlier revision of the node is as good as none
+static int cluster_current(const cluster_node_t *n) {
+  return n->drev == n->revision;
+}
+
+static uint8_t *put_digest(uint8_t *p, const cluster_node_t *n) {
+  uint16_t ver = cluster_current(n) ? n->dver : 0;
+  p = put_ip(p, n->ip);
+  p = put32(p, n->revision);
+  p = put32(p, n->heartbeat);
+  *p++ = ver >> 8;
+  *p++ = ver;
+  *p++ = n->state;
+  return p;
+}
+
+static size_t full_len(const cluster_node_t *n) {
+  return CLUSTER_DIGEST + 1 + (cluster_current(n) ? n->len : 0);
+}
+
+static uint8_t *put_full(uint8_t *p, const cluster_node_t *n) {
+  int len = cluster_current(n) ? n->len : 0;
+  p = put_digest(p, n);
+  *p++ = len;
+  memcpy(p, n->data, len);
+  return p + len;
+}
+
+#pragma mark - Protocol
+
+static void cluster_send(lua_State *L, uint32_t ip, const uint8_t *buf, size_t len) {
+  char ipstr[16];
+  ets_sprintf(ipstr, IPSTR, IP2STR(&ip));
+  lua_pushcfunction(L, net_send);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cl.sock_ref);
+  lua_pushinteger(L, cl.port);
+  lua_pushstring(L, ipstr);
+  lua_pushlstring(L, (const char *)buf, len);
+  if (lua_pcall(L, 4, 0, 0) != LUA_OK)
+    lua_pop(L, 1);                     // a lost datagram is gossip as usual
+}
+
+static void cluster_syn(lua_State *L, uint32_t ip) {
+  uint8_t buf[CLUSTER_PACKET], *p = buf + 4;
+  int i, n = 0;
+  for (i = 0; i < cl.count && n < 255 && p + CLUSTER_DIGEST <= buf + sizeof(buf); i++, n++)
+    p = put_digest(p, cl.nodes + i);
+  buf[0] = CLUSTER_MAGIC; buf[1] = CLUSTER_SYN; buf[2] = n; buf[3] = 0;
+  cluster_send(L, ip, buf, p - buf);
+}
+
+/*
+ * Merges an entry from a peer. The liveness (revision, heartbeat, state) is
+ * taken if it is fresher than ours, comparing in that order, and the data of
+ * a full entry if its (revision, version) is newer than that held. Returns
+ * the node, or NULL for this node or a full table.
+ */
+static cluster_node_t *cluster_merge(lua_State *L, const uint8_t *rec, int full) {
+  uint32_t ip = get_ip(rec), rev = get32(rec + 4), hb = get32(rec + 8);
+  uint16_t ver = (rec[12] << 8) | rec[13];
+  uint8_t state = rec[14] > STATE_REMOVE ? STATE_REMOVE : rec[14];
+  if (!ip || ip == cl.nodes[0].ip || ip == IPADDR_BROADCAST)
+    return NULL;
+  cluster_node_t *n = cluster_find(ip);
+  int joined = !n;
+  if (!n) {
+    if (cl.count == cl.max)
+      return NULL;
+    n = cl.nodes + cl.count++;
+    memset(n, 0, sizeof(*n));
+    n->ip = ip;
+    n->state = state;
+  }
+  int changed = joined;
+  if (rev > n->revision || (rev == n->revision &&
+      (hb > n->heartbeat || (hb == n->heartbeat && state > n->state)))) {
+    changed |= cluster_shown(state) != cluster_shown(n->state);
+    if (rev > n->revision && !ver && n->len) {   // restarted without data
+      cluster_set_data(n, NULL, 0);
+      changed = 1;
+    }
+    n->revision = rev;
+    n->heartbeat = hb;
+    n->state = state;
+  }
+  if (full && (rev > n->drev || (rev == n->drev && ver > n->dver))) {
+    int len = rec[CLUSTER_DIGEST];
+    if (cluster_set_data(n, rec + CLUSTER_DIGEST + 1, len)) {
+      n->drev = rev;
+      n->dver = ver;
+      changed = 1;
+    }
+  }
+  if (changed)
+    cluster_notify(L, n);
+  return n;
+}
+
+// Whether the data held for the node is newer than version ver of revision rev
+static int cluster_newer(const cluster_node_t *n, uint32_t rev, uint16_t ver) {
+  return cluster_current(n) && (n->drev > rev || (n->drev == rev && n->dver > ver));
+}
+
+static void cluster_got_syn(lua_State *L, uint32_t from, const uint8_t *d, int count) {
+  uint8_t buf[CLUSTER_PACKET], *p = buf + 4, *end = buf + sizeof(buf);
+  uint32_t want[64];
+  int i, nwant = 0, nfull = 0;
+  char *uptodate = calloc(cl.max, 1);     // the peer needs no full entry
+  if (!uptodate)
+    return;
+  for (i = 0; i < count; i++, d += CLUSTER_DIGEST) {
+    uint32_t ip = get_ip(d), rev = get32(d + 4);
+    uint16_t ver = (d[12] << 8) | d[13];
+    cluster_node_t *n = ip == cl.nodes[0].ip ? cl.nodes : cluster_merge(L, d, 0);
+    if (!n)
+      continue;
+    if (n != cl.nodes && ver && nwant < 64 &&
+        (rev > n->drev || (rev == n->drev && ver > n->dver)))
+      want[nwant++] = ip;
+    uptodate[n - cl.nodes] = !cluster_newer(n, rev, ver);
+  }
+  // the entries the peer lacks or has older data for, this node's first
+  for (i = 0; i < cl.count && nfull < 255; i++) {
+    cluster_node_t *n = cl.nodes + i;
+    if (uptodate[i] || n->ip == from || n->state == STATE_REMOVE)
+      continue;
+    if (p + full_len(n) + 4 * nwant > end)
+      break;
+    p = put_full(p, n);
+    nfull++;
+  }
+  free(uptodate);
+  for (i = 0; i < nwant; i++)
+    p = put_ip(p, want[i]);
+  buf[0] = CLUSTER_MAGIC; buf[1] = CLUSTER_ACK; buf[2] = nfull; buf[3] = nwant;
+  cluster_send(L, from, buf, p - buf);
+}
+
+static void cluster_got_data(lua_State *L, uint32_t from, const uint8_t *d, size_t len,
+                             int count, int nwant) {
+  const uint8_t *end = d + len;
+  int i;
+  for (i = 0; i < count; i++) {
+    if (end - d < CLUSTER_DIGEST + 1 || end - d < CLUSTER_DIGEST + 1 + d[CLUSTER_DIGEST])
+      return;                                                   // truncated
+    cluster_merge(L, d, 1);
+    d += CLUSTER_DIGEST + 1 + d[CLUSTER_DIGEST];
+  }
+  if (!nwant || end - d < 4 * nwant)
+    return;
+  uint8_t buf[CLUSTER_PACKET], *p = buf + 4;
+  int n = 0;
+  for (i = 0; i < nwant; i++, d += 4) {
+    cluster_node_t *node = cluster_find(get_ip(d));
+    if (!node || p + full_len(node) > buf + sizeof(buf) || n == 255)
+      continue;
+    p = put_full(p, node);
+    n++;
+  }
+  if (n) {
+    buf[0] = CLUSTER_MAGIC; buf[1] = CLUSTER_DATA; buf[2] = n; buf[3] = 0;
+    cluster_send(L, from, buf, p - buf);
+  }
+}
+
+// The receive callback of the UDP socket: (sock, data, port, ip)
+static int cluster_receive(lua_State *L) {
+  size_t len;
+  const uint8_t *d = (const uint8_t *)luaL_checklstring(L, 2, &len);
+  ip_addr_t from;
+  if (!cl.nodes || len < 4 || d[0] != CLUSTER_MAGIC ||
+      !ipaddr_aton(luaL_checkstring(L, 4), &from) || from.addr == cl.nodes[0].ip)
+    return 0;
+  cluster_node_t *n = cluster_find(from.addr);
+  if (n)
+    cluster_set_state(L, n, STATE_UP);           // proof that it is alive
+  switch (d[1]) {
+    case CLUSTER_SYN:
+      if (len >= 4 + (size_t)d[2] * CLUSTER_DIGEST)
+        cluster_got_syn(L, from.addr, d + 4, d[2]);
+      break;
+    case CLUSTER_ACK:
+    case CLUSTER_DATA:
+      cluster_got_data(L, from.addr, d + 4, len - 4, d[2], d[1] == CLUSTER_ACK ? d[3] : 0);
+      break;
+  }
+  return 0;
+}
+
+// A random seed or known node other than this one, or the broadcast address
+static uint32_t cluster_pick(void) {
+  int candidates = cl.nseeds + cl.count - 1;
+  if (candidates <= 0)
+    return IPADDR_BROADCAST;
+  int r = os_random() % candidates;
+  return r < cl.nseeds ? cl.seeds[r] : cl.nodes[1 + r - cl.nseeds].ip;
+}
+
+static void cluster_round(lua_State *L, uint32_t ip) {
+  cl.nodes[0].heartbeat++;
+  if (!ip)
+    ip = cluster_pick();
+  cluster_syn(L, ip);
+  cluster_node_t *n = cluster_find(ip);
+  if (n && n->state < STATE_REMOVE)
+    cluster_set_state(L, n, n->state + STATE_TICK);
+}
+
+static void cluster_timer_cb(void *arg) {
+  (void) arg;
+  if (cl.nodes)
+    cluster_round(lua_getstate(), 0);
+}
+
+#pragma mark - Lua API
+
+// The revision counts the restarts, kept in a file as gossip.lua does
+static uint32_t cluster_next_revision(void) {
+  char buf[12] = {0};
+  uint32_t rev = 1;
+  int fd = vfs_open(CLUSTER_REVFILE, "r");
+  if (fd) {
+    if (vfs_read(fd, buf, sizeof(buf) - 1) > 0)
+      rev = strtoul(buf, NULL, 10) + 1;
+    vfs_close(fd);
+  }
+  if ((fd = vfs_open(CLUSTER_REVFILE, "w"))) {
+    int l = sprintf(buf, "%u", (unsigned)rev);
+    vfs_write(fd, buf, l);
+    vfs_close(fd);
+  }
+  return rev;
+}
+
+static int cluster_stop(lua_State *L);
+
+// Lua: cluster.start({seeds=, port=, interval=, maxnodes=}, function(ip, state, data, revision))
+static int cluster_start(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (!lua_isnoneornil(L, 2))
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  struct ip_info info;
+  if (!wifi_get_ip_info(STATION_IF, &info) || !info.ip.addr)
+    return luaL_error(L, "not connected");
+
+  lua_getfield(L, 1, "port");
+  int port = luaL_optinteger(L, -1, 5000);
+  lua_getfield(L, 1, "interval");
+  int interval = luaL_optinteger(L, -1, 15000);
+  lua_getfield(L, 1, "maxnodes");
+  int max = luaL_optinteger(L, -1, 32);
+  lua_pop(L, 3);
+  luaL_argcheck(L, port > 0 && port < 65536, 1, "invalid port");
+  luaL_argcheck(L, interval >= 100, 1, "interval too short");
+  luaL_argcheck(L, max >= 2 && max <= 255, 1, "maxnodes out of range");
+
+  uint32_t seeds[CLUSTER_MAXSEEDS];
+  int nseeds = 0;
+  lua_getfield(L, 1, "seeds");
+  if (lua_istable(L, -1)) {
+    int i, n = lua_objlen(L, -1);
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, -1, i);
+      ip_addr_t addr;
+      if (!lua_isstring(L, -1) || !ipaddr_aton(lua_tostring(L, -1), &addr))
+        return luaL_error(L, "invalid seed %d", i);
+      lua_pop(L, 1);
+      if (addr.addr != info.ip.addr && nseeds < CLUSTER_MAXSEEDS)
+        seeds[nseeds++] = addr.addr;
+    }
+  }
+  lua_pop(L, 1);
+
+  cluster_stop(L);
+  lua_pushcfunction(L, net_createUDPSocket);
+  lua_call(L, 0, 1);
+  lua_pushcfunction(L, net_listen);
+  lua_pushvalue(L, -2);
+  lua_pushinteger(L, port);
+  lua_call(L, 2, 0);
+  lua_pushcfunction(L, net_on);
+  lua_pushvalue(L, -2);
+  lua_pushliteral(L, "receive");
+  lua_pushcfunction(L, cluster_receive);
+  lua_call(L, 3, 0);
+
+  if (!(cl.nodes = calloc(max, sizeof(cluster_node_t)))) {
+    lua_pushcfunction(L, net_close);
+    lua_insert(L, -2);
+    lua_call(L, 1, 0);
+    return luaL_error(L, "out of memory");
+  }
+  cl.sock_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (!lua_isnoneornil(L, 2)) {
+    lua_pushvalue(L, 2);
+    cl.cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  cl.max = max;
+  cl.count = 1;
+  cl.nodes[0].ip = info.ip.addr;
+  cl.nodes[0].revision = cl.nodes[0].drev = cluster_next_revision();
+  cl.nodes[0].state = STATE_UP;
+  memcpy(cl.seeds, seeds, sizeof(seeds));
+  cl.nseeds = nseeds;
+  cl.port = port;
+
+  os_timer_disarm(&cl.timer);
+  os_timer_setfn(&cl.timer, cluster_timer_cb, NULL);
+  os_timer_arm(&cl.timer, interval, 1);
+  cluster_round(L, 0);
+  return 0;
+}
+
+// Lua: cluster.stop()
+static int cluster_stop(lua_State *L) {
+  os_timer_disarm(&cl.timer);
+  if (cl.sock_ref != LUA_NOREF) {
+    lua_pushcfunction(L, net_close);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cl.sock_ref);
+    if (lua_pcall(L, 1, 0, 0) != LUA_OK)
+      lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, cl.sock_ref);
+    cl.sock_ref = LUA_NOREF;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, cl.cb_ref);
+  cl.cb_ref = LUA_NOREF;
+  cluster_free();
+  return 0;
+}
+
+// Lua: cluster.push(data[, ip])
+static int cluster_push(lua_State *L) {
+  size_t len = 0;
+  const char *data = luaL_optlstring(L, 1, NULL, &len);
+  ip_addr_t addr = { 0 };
+  if (!lua_isnoneornil(L, 2) && !ipaddr_aton(luaL_checkstring(L, 2), &addr))
+    return luaL_argerror(L, 2, "invalid IP address");
+  if (!cl.nodes)
+    return luaL_error(L, "not started");
+  luaL_argcheck(L, len <= CLUSTER_MAXDATA, 1, "data too long");
+  cluster_node_t *self = cl.nodes;
+  if (!cluster_set_data(self, (const uint8_t *)data, len))
+    return luaL_error(L, "out of memory");
+  self->dver++;
+  cluster_round(L, addr.addr);
+  return 0;
+}
+
+// Lua: cluster.nodes()
+static int cluster_nodes(lua_State *L) {
+  int i;
+  lua_createtable(L, 0, cl.count);
+  for (i = 0; i < cl.count; i++) {
+    cluster_node_t *n = cl.nodes + i;
+    char ipstr[16];
+    ets_sprintf(ipstr, IPSTR, IP2STR(&n->ip));
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, cluster_shown(n->state));
+    lua_setfield(L, -2, "state");
+    lua_pushinteger(L, n->revision);
+    lua_setfield(L, -2, "revision");
+    lua_pushinteger(L, n->heartbeat);
+    lua_setfield(L, -2, "heartbeat");
+    if (n->len) {
+      lua_pushlstring(L, (const char *)n->data, n->len);
+      lua_setfield(L, -2, "data");
+    }
+    lua_setfield(L, -2, ipstr);
+  }
+  return 1;
+}
+
+LROT_BEGIN(cluster, NULL, 0)
+  LROT_FUNCENTRY( start, cluster_start )
+  LROT_FUNCENTRY( stop, cluster_stop )
+  LROT_FUNCENTRY( push, cluster_push )
+  LROT_FUNCENTRY( nodes, cluster_nodes )
+  LROT_NUMENTRY( UP, STATE_UP )
+  LROT_NUMENTRY( SUSPECT, STATE_SUSPECT )
+  LROT_NUMENTRY( DOWN, STATE_DOWN )
+  LROT_NUMENTRY( REMOVE, STATE_REMOVE )
+LROT_END(cluster, NULL, 0)
+
+NODEMCU_MODULE(CLUSTER, "cluster", cluster, NULL);
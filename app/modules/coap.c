@@ -44,8 +44,6 @@ static void coap_received(void *arg, char *pdata, unsigned short len)
   }
   // memcpy(buf, pdata, len);
 
-  size_t rsplen = coap_server_respond(pdata, len, buf, MAX_MESSAGE_SIZE+1);
-
   // SDK 1.4.0 changed behaviour, for UDP server need to look up remote ip/port
   remot_info *pr = 0;
   if (espconn_get_connection_info (pesp_conn, &pr, 0) != ESPCONN_OK)
@@ -54,6 +52,12 @@ static void coap_received(void *arg, char *pdata, unsigned short len)
   os_memmove (pesp_conn->proto.udp->remote_ip, pr->remote_ip, 4);
   // The remot_info apparently should *not* be free()d, fyi
 
+  uint32_t ip;
+  memcpy(&ip, pr->remote_ip, sizeof(ip));
+  size_t rsplen = coap_server_respond(pdata, len, buf, MAX_MESSAGE_SIZE+1, ip, pr->remote_port);
+  if (rsplen == 0)
+    return;
+
   espconn_sent(pesp_conn, (unsigned char *)buf, rsplen);
 
   // memset(buf, 0, sizeof(buf));
@@ -131,6 +135,8 @@ static int coap_delete( lua_State* L, const char* mt )
   {
     if(cud->pesp_conn->proto.udp->remote_port || cud->pesp_conn->proto.udp->local_port)
       espconn_delete(cud->pesp_conn);
+    if(strcmp(mt, "coap_server") == 0)
+      coap_observe_clear();
     free(cud->pesp_conn->proto.udp);
     cud->pesp_conn->proto.udp = NULL;
     free(cud->pesp_conn);
@@ -208,6 +214,7 @@ static int coap_close( lua_State* L, const char* mt )
     if(cud->pesp_conn->proto.udp->remote_port || cud->pesp_conn->proto.udp->local_port)
       espconn_delete(cud->pesp_conn);
   }
+  coap_observe_clear();
 
   if(LUA_NOREF!=cud->self_ref){
     luaL_unref(L, LUA_REGISTRYINDEX, cud->self_ref);
@@ -439,35 +446,116 @@ static int coap_regist( lua_State* L, const char* mt, int isvar )
   if (name == NULL)
     return luaL_error( L, "name must be set." );
 
-  coap_luser_entry *h = NULL;
-  // if(lua_isstring(L, 3))
-  if(isvar)
-    h = variable_entry;
-  else
-    h = function_entry;
-
-  while(NULL!=h->next){  // goto the end of the list
-    if(h->name!= NULL && strcmp(h->name, name)==0)  // key exist, override it
-      break;
-    h = h->next;
-  }
+  coap_luser_entry *head = isvar ? variable_entry : function_entry;
+  coap_luser_entry *h = coap_luser_find(head, name, l);
 
-  if(h->name==NULL || strcmp(h->name, name)!=0){   // not exists. make a new one.
-    h->next = (coap_luser_entry *)calloc(1,sizeof(coap_luser_entry));
-    h = h->next;
-    if(h == NULL)
+  if(h == NULL){   // not exists. make a new one.
+    h = (coap_luser_entry *)calloc(1,sizeof(coap_luser_entry));
+    if(h == NULL || (h->name = strdup(name)) == NULL){
+      free(h);
       return luaL_error(L, "not enough memory");
-    h->next = NULL;
-    h->name = NULL;
+    }
+    h->ref = LUA_NOREF;
+    coap_luser_add(head, h);
   }
 
-  h->name = name;
   h->content_type = content_type;
 
   NODE_DBG("coap_regist is called.\n");
   return 0;
 }
 
+extern coap_luser_entry *blob_entry;
+// Lua: server:blob( "name", function(offset, size) or "filename"[, content_type] )
+static int coap_server_blob( lua_State* L )
+{
+  luaL_checkudata(L, 1, "coap_server");
+  size_t l;
+  const char *name = luaL_checklstring( L, 2, &l );
+  luaL_argcheck(L, lua_type(L, 3) == LUA_TFUNCTION || lua_type(L, 3) == LUA_TSTRING, 3, "function or filename expected");
+  int content_type = luaL_optint(L, 4, COAP_CONTENTTYPE_APPLICATION_OCTET_STREAM);
+
+  coap_luser_entry *h = coap_luser_find(blob_entry, name, l);
+
+  if(h == NULL){   // not exists. make a new one.
+    h = (coap_luser_entry *)calloc(1,sizeof(coap_luser_entry));
+    if(h == NULL || (h->name = strdup(name)) == NULL){
+      free(h);
+      return luaL_error(L, "not enough memory");
+    }
+    h->ref = LUA_NOREF;
+    coap_luser_add(blob_entry, h);
+  }
+
+  luaL_unref(L, LUA_REGISTRYINDEX, h->ref);
+  lua_pushvalue(L, 3);
+  h->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  h->content_type = content_type;
+  return 0;
+}
+
+// Lua: n = server:notify( "name" )
+static int coap_server_notify( lua_State* L )
+{
+  lcoap_userdata *cud;
+  size_t l, vl;
+  int n = 0;
+
+  cud = (lcoap_userdata *)luaL_checkudata(L, 1, "coap_server");
+  const char *name = luaL_checklstring( L, 2, &l );
+
+  coap_luser_entry *h = coap_luser_find(variable_entry, name, l);
+  if(h == NULL)
+    return luaL_error( L, "not a registered variable" );
+  if(h->observers == NULL || cud->pesp_conn == NULL){
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+
+  lua_getglobal(L, h->name);
+  if (!lua_isnumber(L, -1) && !lua_isstring(L, -1))
+    return luaL_error( L, "variable must be a number or string" );
+  const char *value = lua_tolstring(L, -1, &vl);
+  if (vl > MAX_PAYLOAD_SIZE)
+    return luaL_error( L, "value too long" );
+
+  // build the notification once, then only the header and token change per observer
+  uint8_t scratch_raw[5];
+  coap_rw_buffer_t scratch = {scratch_raw, 2};
+  coap_packet_t pkt;
+  h->observe_seq = (h->observe_seq + 1) & 0xFFFFFF;
+  coap_make_response(&scratch, &pkt, (const uint8_t *)value, vl, 0, 0, NULL, COAP_RSPCODE_CONTENT, h->content_type);
+  pkt.hdr.t = COAP_TYPE_NONCON;
+  coap_add_option(&pkt, COAP_OPTION_OBSERVE, scratch_raw + 2, coap_encode_var_bytes(scratch_raw + 2, h->observe_seq));
+
+  size_t len = COAP_SHARED_HEADROOM + MAX_MESSAGE_SIZE;
+  uint8_t *buf = (uint8_t *)malloc(len);
+  if (!buf)
+    return luaL_error(L, "not enough memory");
+  if (0 != coap_build_shared(buf, &len, &pkt)){
+    free(buf);
+    return luaL_error(L, "value too long");
+  }
+
+  struct espconn *pesp_conn = cud->pesp_conn;
+  coap_observer *o;
+  for (o = h->observers; o; o = o->next){
+    size_t msglen;
+    unsigned short id = coap_next_message_id();
+    o->id[0] = (id >> 8) & 0xFF;
+    o->id[1] = id & 0xFF;
+    uint8_t *msg = coap_address_shared(buf, len, &pkt, o->tok, o->tkl, o->id, &msglen);
+    memcpy(pesp_conn->proto.udp->remote_ip, &o->ip, 4);
+    pesp_conn->proto.udp->remote_port = o->port;
+    if (msg && espconn_sent(pesp_conn, msg, msglen) == ESPCONN_OK)
+      n++;
+  }
+  free(buf);
+
+  lua_pushinteger(L, n);
+  return 1;
+}
+
 // Lua: s = coap.createServer(function(conn))
 static int coap_createServer( lua_State* L )
 {
@@ -564,6 +652,8 @@ LROT_BEGIN(coap_server, NULL, LROT_MASK_GC_INDEX)
   LROT_FUNCENTRY( close, coap_server_close )
   LROT_FUNCENTRY( var, coap_server_var )
   LROT_FUNCENTRY( func, coap_server_func )
+  LROT_FUNCENTRY( notify, coap_server_notify )
+  LROT_FUNCENTRY( blob, coap_server_blob )
 LROT_END(coap_server, NULL, LROT_MASK_GC_INDEX)
 
 
@@ -6,6 +6,9 @@
 #include <string.h>
 
 #include "color_utils.h"
+#ifdef LUA_USE_MODULES_PIXBUF
+#include "pixbuf.h"
+#endif
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #define max(a,b) ((a) > (b) ? (a) : (b))
@@ -141,6 +144,66 @@ uint32_t color_wheel(uint16_t pos) {
   return hsv2grb(pos, 255, 255);
 }
 
+static void put_grb(uint8_t *p, size_t nchan, uint32_t grb, bool white) {
+  uint8_t g = (grb & 0x00FF0000) >> 16;
+  uint8_t r = (grb & 0x0000FF00) >> 8;
+  uint8_t b = (grb & 0x000000FF);
+  size_t j = 3;
+
+  if (white && nchan > 3) {
+    uint8_t w = min3(g, r, b);
+    g -= w;
+    r -= w;
+    b -= w;
+    p[j++] = w;
+  }
+  p[0] = g;
+  p[1] = r;
+  p[2] = b;
+  for (; j < nchan; j++)
+    p[j] = 0;
+}
+
+void hsv_fill(uint8_t *p, size_t nchan, size_t n, uint32_t hue, int32_t hue_step,
+              uint8_t sat, uint8_t val, bool white) {
+  const uint32_t turn = 360 << 8;
+  uint32_t step = hue_step < 0 ? turn - (uint32_t)(-hue_step) % turn : (uint32_t)hue_step % turn;
+
+  hue %= turn;
+  if (step == turn || step == 0) {
+    // one colour: work it out once and copy it along
+    put_grb(p, nchan, hsv2grb(hue >> 8, sat, val), white);
+    for (size_t i = 1; i < n; i++)
+      memcpy(p + i * nchan, p, nchan);
+    return;
+  }
+  for (; n; n--, p += nchan) {
+    put_grb(p, nchan, hsv2grb(hue >> 8, sat, val), white);
+    hue += step;
+    if (hue >= turn)
+      hue -= turn;
+  }
+}
+
+void hue_rotate(uint8_t *p, size_t nchan, size_t n, int16_t degrees) {
+  uint16_t d = degrees < 0 ? 360 - (-degrees) % 360 : degrees % 360;
+
+  if (d == 360 || d == 0)
+    return;
+  for (; n; n--, p += nchan) {
+    if (p[0] == p[1] && p[1] == p[2])
+      continue;  // grey has no hue
+    uint32_t hsv = grb2hsv(p[0], p[1], p[2]);
+    uint16_t h = ((hsv & 0xFFFF0000) >> 16) + d;
+    if (h >= 360)
+      h -= 360;
+    uint32_t grb = hsv2grb(h, (hsv & 0x0000FF00) >> 8, hsv & 0x000000FF);
+    p[0] = (grb & 0x00FF0000) >> 16;
+    p[1] = (grb & 0x0000FF00) >> 8;
+    p[2] = (grb & 0x000000FF);
+  }
+}
+
 
 // convert hsv to grb value
 static int cu_hsv2grb(lua_State *L) {
@@ -230,12 +293,65 @@ static int cu_grb2hsv(lua_State *L) {
   return 3;
 }
 
+#ifdef LUA_USE_MODULES_PIXBUF
+// Check a pixbuf of at least 3 channels and the pixel range [first, last]
+// given at index arg and after, 1-based and negative from the end as for
+// string.sub; returns the first pixel and sets *n to the number of pixels
+static uint8_t *cu_pixel_range(lua_State *L, pixbuf *buf, int arg, size_t *n) {
+  ssize_t len = buf->npix;
+  ssize_t first = luaL_optinteger(L, arg, 1);
+  ssize_t last = luaL_optinteger(L, arg + 1, -1);
+
+  luaL_argcheck(L, buf->nchan >= 3, 1, "needs 3 or more channels");
+  if (first < 0) first += len + 1;
+  if (last < 0) last += len + 1;
+  if (first < 1) first = 1;
+  if (last > len) last = len;
+  *n = last >= first ? last - first + 1 : 0;
+  return buf->values + (first - 1) * buf->nchan;
+}
+
+// fill a pixbuf with a run of hues
+static int cu_hsv_fill(lua_State *L) {
+  pixbuf *buf = pixbuf_from_lua_arg(L, 1);
+  const lua_Number hue = luaL_checknumber(L, 2);
+  const lua_Number hue_step = luaL_checknumber(L, 3);
+  const int sat = luaL_checkint(L, 4);
+  const int val = luaL_checkint(L, 5);
+  size_t n;
+
+  luaL_argcheck(L, hue >= 0 && hue <= 360, 2, "should be a 0-360");
+  luaL_argcheck(L, hue_step >= -360 && hue_step <= 360, 3, "should be -360-360");
+  luaL_argcheck(L, sat >= 0 && sat <= 255, 4, "should be 0-255");
+  luaL_argcheck(L, val >= 0 && val <= 255, 5, "should be 0-255");
+
+  uint8_t *p = cu_pixel_range(L, buf, 6, &n);
+  hsv_fill(p, buf->nchan, n, hue * 256, hue_step * 256, sat, val, buf->nchan == 4);
+  return 0;
+}
+
+// rotate the hue of the pixels in a pixbuf
+static int cu_hue_rotate(lua_State *L) {
+  pixbuf *buf = pixbuf_from_lua_arg(L, 1);
+  const int degrees = luaL_checkint(L, 2);
+  size_t n;
+
+  uint8_t *p = cu_pixel_range(L, buf, 3, &n);
+  hue_rotate(p, buf->nchan, n, degrees % 360);
+  return 0;
+}
+#endif
+
 
 LROT_BEGIN(color_utils, NULL, 0)
   LROT_FUNCENTRY( hsv2grb, cu_hsv2grb )
   LROT_FUNCENTRY( hsv2grbw, cu_hsv2grbw )
   LROT_FUNCENTRY( colorWheel, cu_color_wheel )
   LROT_FUNCENTRY( grb2hsv, cu_grb2hsv )
+#ifdef LUA_USE_MODULES_PIXBUF
+  LROT_FUNCENTRY( hsv_fill, cu_hsv_fill )
+  LROT_FUNCENTRY( hue_rotate, cu_hue_rotate )
+#endif
 LROT_END(color_utils, NULL, 0)
 
 
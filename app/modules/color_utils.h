@@ -2,6 +2,8 @@
 #define APP_MODULES_COLOR_UTILS_H_
 
 #include "lnodemcu.h"
+#include <stdbool.h>
+#include <stddef.h>
 
 /**
 * Convert hsv to grb
@@ -27,5 +29,20 @@ uint32_t grb2hsv(uint8_t g, uint8_t r, uint8_t b);
 */
 uint32_t color_wheel(uint16_t degree);
 
+/**
+* Fill n pixels of nchan (at least 3) channels with a run of hues, starting
+* at hue and advancing by hue_step, both in 1/256 degree, at sat and val.
+* The pixels are stored as grb; with white set the fourth channel gets the
+* white part as hsv2grbw() does, any other channels are cleared.
+*/
+void hsv_fill(uint8_t *p, size_t nchan, size_t n, uint32_t hue, int32_t hue_step,
+              uint8_t sat, uint8_t val, bool white);
+
+/**
+* Rotate the hue of n grb pixels of nchan channels by degrees, keeping their
+* saturation and value. Grey pixels and channels past the third are left alone.
+*/
+void hue_rotate(uint8_t *p, size_t nchan, size_t n, int16_t degrees);
+
 
 #endif /* APP_MODULES_COLOR_UTILS_H_ */
@@ -20,15 +20,31 @@ struct cronent_desc {
   uint8_t  dow;  // Day-of-week repeat - bits 0-6
 };
 
+// Minutes are counted from the epoch. 0 stands for a minute that is not
+// known yet, because there has been no RTC time.
+#define CRON_UNKNOWN 0
+#define CRON_NEVER UINT32_MAX
+// Furthest ahead a match is looked for, enough for "0 0 29 2 *" across 2100
+#define CRON_SEARCH_DAYS (9 * 366)
+
 typedef struct cronent_ud {
   struct cronent_desc desc;
   int cb_ref;
+  uint32_t next;    // minute of the next match
 } cronent_ud_t;
 
+typedef struct {
+  int ref;
+  cronent_ud_t *ud;
+} cronent_t;
+
 static ETSTimer cron_timer;
 
-static int *cronent_list = 0;
+// Scheduled entries, in order of their next match, so that each minute only
+// the entries that are due need to be looked at
+static cronent_t *cronent_list = 0;
 static size_t cronent_count = 0;
+static uint32_t cron_minute = CRON_UNKNOWN;  // last minute handled
 
 static uint64_t lcron_parsepart(lua_State *L, char *str, char **end, uint8_t min, uint8_t max) {
   uint64_t res = 0;
@@ -83,10 +99,75 @@ static int lcron_parsedesc(lua_State *L, char *str, struct cronent_desc *desc) {
   return 0;
 }
 
+// Returns the first minute from `from` on that matches the entry
+static uint32_t cron_next(const struct cronent_desc *desc, uint32_t from) {
+  if (from == CRON_UNKNOWN) {
+    return CRON_UNKNOWN;
+  }
+  time_t t = (time_t) from * 60;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  int hour = tm.tm_hour;
+  int min = tm.tm_min;
+  for (int day = 0; day < CRON_SEARCH_DAYS; day++) {
+    if ((desc->mon & (1 << tm.tm_mon)) && (desc->dom & ((uint32_t)1 << (tm.tm_mday - 1))) &&
+        (desc->dow & (1 << tm.tm_wday))) {
+      for (; hour < 24; hour++, min = 0) {
+        if (!(desc->hour & ((uint32_t)1 << hour))) continue;
+        uint64_t mins = desc->min >> min;
+        if (mins) {
+          return (uint32_t)((t - (time_t)tm.tm_hour * 3600 - tm.tm_min * 60) / 60) +
+                 hour * 60 + min + __builtin_ctzll(mins);
+        }
+      }
+    }
+    // On to midnight of the next day
+    t += 86400 - ((time_t)tm.tm_hour * 3600 + tm.tm_min * 60);
+    gmtime_r(&t, &tm);
+    hour = min = 0;
+  }
+  return CRON_NEVER;
+}
+
+static size_t lcron_findindex(cronent_ud_t *ud) {
+  size_t i;
+  for (i = 0; i < cronent_count; i++) {
+    if (cronent_list[i].ud == ud) break;
+  }
+  if (i == cronent_count) return -1;
+  return i;
+}
+
+// Moves entry i to its place in the list after its next match has changed
+static void lcron_reposition(size_t i) {
+  cronent_t ent = cronent_list[i];
+  while (i > 0 && cronent_list[i - 1].ud->next > ent.ud->next) {
+    cronent_list[i] = cronent_list[i - 1];
+    i--;
+  }
+  while (i + 1 < cronent_count && cronent_list[i + 1].ud->next < ent.ud->next) {
+    cronent_list[i] = cronent_list[i + 1];
+    i++;
+  }
+  cronent_list[i] = ent;
+}
+
+// Adds the entry at the top of the stack to the list
+static int lcron_insert(lua_State *L, cronent_ud_t *ud) {
+  void *newlist = os_realloc(cronent_list, sizeof(cronent_t) * (cronent_count + 1));
+  if (newlist == NULL) {
+    return luaL_error(L, "out of memory");
+  }
+  cronent_list = newlist;
+  cronent_list[cronent_count].ud = ud;
+  cronent_list[cronent_count].ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lcron_reposition(cronent_count++);
+  return 0;
+}
+
 static int lcron_create(lua_State *L) {
   // Check arguments
   char *strdesc = (char*)luaL_checkstring(L, 1);
-  void *newlist;
   luaL_checktype(L, 2, LUA_TFUNCTION);
   // Parse description
   struct cronent_desc desc;
@@ -101,46 +182,26 @@ static int lcron_create(lua_State *L) {
   ud->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   // Set entry
   ud->desc = desc;
+  ud->next = cron_next(&desc, cron_minute + (cron_minute != CRON_UNKNOWN));
   // Store entry
-  newlist = os_realloc(cronent_list, sizeof(int) * (cronent_count + 1));
-  if (newlist == NULL) {
-    return luaL_error(L, "out of memory");
-  }
   lua_pushvalue(L, -1);
-  cronent_list = newlist;
-  cronent_list[cronent_count++] = luaL_ref(L, LUA_REGISTRYINDEX);
+  lcron_insert(L, ud);
   return 1;
 }
 
-static size_t lcron_findindex(lua_State *L, cronent_ud_t *ud) {
-  cronent_ud_t *eud;
-  size_t i;
-  for (i = 0; i < cronent_count; i++) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, cronent_list[i]);
-    eud = lua_touserdata(L, -1);
-    lua_pop(L, 1);
-    if (eud == ud) break;
-  }
-  if (i == cronent_count) return -1;
-  return i;
-}
-
 static int lcron_schedule(lua_State *L) {
   cronent_ud_t *ud = luaL_checkudata(L, 1, "cron.entry");
   char *strdesc = (char*)luaL_checkstring(L, 2);
   struct cronent_desc desc;
   lcron_parsedesc(L, strdesc, &desc);
   ud->desc = desc;
-  size_t i = lcron_findindex(L, ud);
+  ud->next = cron_next(&desc, cron_minute + (cron_minute != CRON_UNKNOWN));
+  size_t i = lcron_findindex(ud);
   if (i == -1) {
-    void *newlist;
-    newlist = os_realloc(cronent_list, sizeof(int) * (cronent_count + 1));
-    if (newlist == NULL) {
-      return luaL_error(L, "out of memory");
-    }
-    cronent_list = newlist;
     lua_pushvalue(L, 1);
-    cronent_list[cronent_count++] = luaL_ref(L, LUA_REGISTRYINDEX);
+    lcron_insert(L, ud);
+  } else {
+    lcron_reposition(i);
   }
   return 0;
 }
@@ -156,10 +217,10 @@ static int lcron_handler(lua_State *L) {
 
 static int lcron_unschedule(lua_State *L) {
   cronent_ud_t *ud = luaL_checkudata(L, 1, "cron.entry");
-  size_t i = lcron_findindex(L, ud);
+  size_t i = lcron_findindex(ud);
   if (i == -1) return 0;
-  luaL_unref(L, LUA_REGISTRYINDEX, cronent_list[i]);
-  memmove(cronent_list + i, cronent_list + i + 1, sizeof(int) * (cronent_count - i - 1));
+  luaL_unref(L, LUA_REGISTRYINDEX, cronent_list[i].ref);
+  memmove(cronent_list + i, cronent_list + i + 1, sizeof(cronent_t) * (cronent_count - i - 1));
   cronent_count--;
   return 0;
 }
@@ -173,7 +234,7 @@ static int lcron_delete(lua_State *L) {
 
 static int lcron_reset(lua_State *L) {
   for (size_t i = 0; i < cronent_count; i++) {
-    luaL_unref(L, LUA_REGISTRYINDEX, cronent_list[i]);
+    luaL_unref(L, LUA_REGISTRYINDEX, cronent_list[i].ref);
   }
   cronent_count = 0;
   free(cronent_list);
@@ -181,25 +242,33 @@ static int lcron_reset(lua_State *L) {
   return 0;
 }
 
-static void cron_handle_time(uint8_t mon, uint8_t dom, uint8_t dow, uint8_t hour, uint8_t min) {
+static void cron_handle_time(uint32_t minute) {
   lua_State *L = lua_getstate();
-  struct cronent_desc desc;
-  desc.mon  = (uint16_t)1 << (mon - 1);
-  desc.dom  = (uint32_t)1 << (dom - 1);
-  desc.dow  = ( uint8_t)1 << dow;
-  desc.hour = (uint32_t)1 << hour;
-  desc.min  = (uint64_t)1 << min;
-  for (size_t i = 0; i < cronent_count; i++) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, cronent_list[i]);
-    cronent_ud_t *ent = lua_touserdata(L, -1);
-    lua_pop(L, 1);
-    if ((ent->desc.mon  & desc.mon ) == 0) continue;
-    if ((ent->desc.dom  & desc.dom ) == 0) continue;
-    if ((ent->desc.dow  & desc.dow ) == 0) continue;
-    if ((ent->desc.hour & desc.hour) == 0) continue;
-    if ((ent->desc.min  & desc.min ) == 0) continue;
+
+  if (minute == cron_minute) {
+    return;
+  }
+  // The first time, and after the clock has been set, every entry needs its
+  // next match worked out afresh
+  if (minute != cron_minute + 1) {
+    for (size_t i = 0; i < cronent_count; i++) {
+      cronent_list[i].ud->next = cron_next(&cronent_list[i].ud->desc, minute);
+    }
+    for (size_t i = 1; i < cronent_count; i++) {
+      lcron_reposition(i);
+    }
+  }
+  cron_minute = minute;
+
+  // Each due entry moves on to its next match before its callback runs, so
+  // the list is in order whatever the callback does to it
+  while (cronent_count > 0 && cronent_list[0].ud->next <= minute) {
+    cronent_ud_t *ent = cronent_list[0].ud;
+    int ref = cronent_list[0].ref;
+    ent->next = cron_next(&ent->desc, minute + 1);
+    lcron_reposition(0);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ent->cb_ref);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, cronent_list[i]);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
     luaL_pcallx(L, 1, 0);
   }
 }
@@ -211,17 +280,15 @@ static void cron_handle_tmr() {
     os_timer_arm(&cron_timer, 1000, 0);
     return;
   }
-  time_t t = tv.tv_sec;
-  struct tm tm;
-  gmtime_r(&t, &tm);
-  uint32_t diff = 60000 - tm.tm_sec * 1000 - tv.tv_usec / 1000;
-  if (tm.tm_sec == 59) {
-    t++;
+  uint32_t minute = tv.tv_sec / 60;
+  uint32_t sec = tv.tv_sec % 60;
+  uint32_t diff = 60000 - sec * 1000 - tv.tv_usec / 1000;
+  if (sec == 59) {
+    minute++;
     diff += 60000;
-    gmtime_r(&t, &tm);
   }
   os_timer_arm(&cron_timer, diff, 0);
-  cron_handle_time(tm.tm_mon + 1, tm.tm_mday, tm.tm_wday, tm.tm_hour, tm.tm_min);
+  cron_handle_time(minute);
 }
 
 
@@ -6,6 +6,8 @@
 #include "platform.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include "vfs.h"
 #include "../crypto/digests.h"
 #include "../crypto/mech.h"
@@ -14,11 +16,22 @@
 #include "user_interface.h"
 
 #include "rom.h"
+#include "flash_api.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+
+#ifndef CRYPTO_ASYNC_CHUNK
+#define CRYPTO_ASYNC_CHUNK    512   // bytes read per step by update_async()
+#endif
+#ifndef CRYPTO_ASYNC_SLICE_US
+#define CRYPTO_ASYNC_SLICE_US 4000  // hashing time per task run
+#endif
 
 typedef struct {
   const digest_mech_info_t *mech_info;
   void *ctx;
   uint8_t *k_opad;
+  int busy;         // an update_async() is in progress
 } digest_user_datum_t;
 
 /**
@@ -71,6 +84,7 @@ static int crypto_mask( lua_State* L )
 static inline int bad_mech (lua_State *L) { return luaL_error (L, "unknown hash mech"); }
 static inline int bad_mem  (lua_State *L) { return luaL_error (L, "insufficient memory"); }
 static inline int bad_file (lua_State *L) { return luaL_error (L, "file does not exist"); }
+static inline int bad_read (lua_State *L) { return luaL_error (L, "read failed"); }
 
 /* rawdigest = crypto.hash("MD5", str)
  * strdigest = encoder.toHex(rawdigest)
@@ -140,6 +154,7 @@ static int crypto_new_hash_hmac (lua_State *L, int what)
   dudat->mech_info = mi;
   dudat->ctx       = ctx;
   dudat->k_opad    = k_opad;
+  dudat->busy      = 0;
 
   return 1; // Pass userdata object back
 }
@@ -157,19 +172,38 @@ static int crypto_new_hmac (lua_State *L)
 }
 
 
+static digest_user_datum_t *check_hash (lua_State *L)
+{
+  digest_user_datum_t *dudat = (digest_user_datum_t *)luaL_checkudata(L, 1, "crypto.hash");
+  if (dudat->busy)
+    luaL_error (L, "hash busy");
+  return dudat;
+}
+
+extern int pipe_drain(lua_State *L, int ndx,
+                      int (*fn)(void *, const char *, size_t), void *arg);
+
+static int hash_pipe_chunk (void *arg, const char *s, size_t l)
+{
+  digest_user_datum_t *dudat = (digest_user_datum_t *)arg;
+  dudat->mech_info->update (dudat->ctx, s, l);
+  return 0;
+}
+
 /* Called as object, params:
    1 - userdata "this"
-   2 - new string to add to the hash state  */
+   2 - new string or pipe to add to the hash state; a pipe is emptied  */
 static int crypto_hash_update (lua_State *L)
 {
   NODE_DBG("enter crypto_hash_update.\n");
-  digest_user_datum_t *dudat;
-  size_t sl;
-
-  dudat = (digest_user_datum_t *)luaL_checkudata(L, 1, "crypto.hash");
-
+  digest_user_datum_t *dudat = check_hash (L);
   const digest_mech_info_t *mi = dudat->mech_info;
 
+  if (lua_istable (L, 2)) {
+    luaL_argcheck (L, pipe_drain (L, 2, hash_pipe_chunk, dudat) >= 0, 2, "string or pipe expected");
+    return 0;
+  }
+
   size_t len = 0;
   const char *data = luaL_checklstring (L, 2, &len);
 
@@ -178,15 +212,8 @@ static int crypto_hash_update (lua_State *L)
   return 0;  // No return value
 }
 
-/* Called as object, no params. Returns digest of default size. */
-static int crypto_hash_finalize (lua_State *L)
+static void push_digest (lua_State *L, digest_user_datum_t *dudat)
 {
-  NODE_DBG("enter crypto_hash_update.\n");
-  digest_user_datum_t *dudat;
-  size_t sl;
-
-  dudat = (digest_user_datum_t *)luaL_checkudata(L, 1, "crypto.hash");
-
   const digest_mech_info_t *mi = dudat->mech_info;
 
   uint8_t digest[mi->digest_size]; // Allocate as local
@@ -196,18 +223,176 @@ static int crypto_hash_finalize (lua_State *L)
     mi->finalize (digest, dudat->ctx);
 
   lua_pushlstring (L, digest, sizeof (digest));
+}
+
+/* Called as object, no params. Returns digest of default size. */
+static int crypto_hash_finalize (lua_State *L)
+{
+  NODE_DBG("enter crypto_hash_finalize.\n");
+  push_digest (L, check_hash (L));
   return 1;
 }
 
+/*
+ * Files and flash regions are hashed CRYPTO_ASYNC_CHUNK bytes at a time in
+ * low priority tasks of about CRYPTO_ASYNC_SLICE_US each, so hashing a 1MB
+ * OTA image neither blocks the network stack nor costs a Lua call per chunk.
+ * The hash object is busy while the job runs and is anchored in the registry.
+ */
+typedef struct {
+  digest_user_datum_t *dudat;
+  int obj_ref, cb_ref;
+  int fd;               // file being hashed, or 0 for a flash region
+  uint32_t addr, left;  // rest of the flash region
+  uint8_t buf[CRYPTO_ASYNC_CHUNK];
+} hash_job;
+
+#define HASH_NO_SLICE 0xffffffff
+
+static platform_task_handle_t hash_task_id;
+
+static const char *const partition_names[] = { "lfs", "lfs1", "spiffs", "spiffs1", NULL };
+static const uint8_t partition_ids[] = {
+  NODEMCU_LFS0_PARTITION, NODEMCU_LFS1_PARTITION,
+  NODEMCU_SPIFFS0_PARTITION, NODEMCU_SPIFFS1_PARTITION
+};
+
+static uint32_t opt_field (lua_State *L, int ndx, const char *name, uint32_t def)
+{
+  lua_getfield (L, ndx, name);
+  uint32_t v = luaL_optinteger (L, -1, def);
+  lua_pop (L, 1);
+  return v;
+}
+
+/* The source is a filename, or a table giving a flash region as either
+ * { partition = name [, offset = n] [, size = n] } or { addr = n, size = n } */
+static hash_job *hash_job_new (lua_State *L, int src)
+{
+  int fd = 0;
+  uint32_t addr = 0, size = 0;
+
+  if (lua_istable (L, src)) {
+    lua_getfield (L, src, "partition");
+    const char *name = lua_tostring (L, -1);
+    lua_pop (L, 1);
+    if (name) {
+      int i;
+      for (i = 0; partition_names[i] && strcmp (partition_names[i], name); i++) {}
+      luaL_argcheck (L, partition_names[i], src, "unknown partition");
+      uint32_t psize = platform_flash_get_partition (partition_ids[i], &addr);
+      luaL_argcheck (L, psize, src, "partition not present");
+      uint32_t offset = opt_field (L, src, "offset", 0);
+      luaL_argcheck (L, offset <= psize, src, "offset out of range");
+      addr += offset;
+      size = opt_field (L, src, "size", psize - offset);
+      luaL_argcheck (L, size <= psize - offset, src, "size out of range");
+    } else {
+      addr = opt_field (L, src, "addr", 0);
+      size = opt_field (L, src, "size", 0);
+      luaL_argcheck (L, addr < flash_rom_get_size_byte () &&
+                        size <= flash_rom_get_size_byte () - addr, src, "region out of range");
+    }
+  } else {
+    fd = vfs_open (luaL_checkstring (L, src), "r");
+    if (!fd)
+      bad_file (L);
+  }
+
+  hash_job *j = (hash_job *)malloc (sizeof (hash_job));
+  if (!j) {
+    if (fd)
+      vfs_close (fd);
+    bad_mem (L);
+  }
+  j->obj_ref = j->cb_ref = LUA_NOREF;
+  j->fd   = fd;
+  j->addr = addr;
+  j->left = size;
+  return j;
+}
+
+static void hash_job_free (lua_State *L, hash_job *j)
+{
+  if (j->fd)
+    vfs_close (j->fd);
+  j->dudat->busy = 0;
+  luaL_unref (L, LUA_REGISTRYINDEX, j->obj_ref);
+  luaL_unref (L, LUA_REGISTRYINDEX, j->cb_ref);
+  free (j);
+}
+
+/* Hashes until the source is exhausted or the slice is used up. Returns 1
+ * when done, 0 if there is more to do and -1 if a read failed. */
+static int hash_step (hash_job *j, uint32_t slice_us)
+{
+  uint32_t start = system_get_time ();
+  do {
+    int32_t n;
+    if (j->fd) {
+      n = vfs_read (j->fd, j->buf, sizeof (j->buf));
+      if (n <= 0)
+        return n < 0 ? -1 : 1;
+    } else {
+      if (!j->left)
+        return 1;
+      n = j->left < sizeof (j->buf) ? j->left : sizeof (j->buf);
+      if (platform_flash_read (j->buf, j->addr, n) != n)
+        return -1;
+      j->addr += n;
+      j->left -= n;
+    }
+    j->dudat->mech_info->update (j->dudat->ctx, j->buf, n);
+  } while (system_get_time () - start < slice_us);
+  return 0;
+}
+
+static void hash_task (platform_task_param_t param, uint8_t prio)
+{
+  (void)prio;
+  hash_job *j = (hash_job *)param;
+  int res = hash_step (j, CRYPTO_ASYNC_SLICE_US);
+  if (res == 0) {
+    platform_post_low (hash_task_id, param);
+    return;
+  }
+
+  lua_State *L = lua_getstate ();
+  lua_rawgeti (L, LUA_REGISTRYINDEX, j->cb_ref);
+  if (res > 0)
+    push_digest (L, j->dudat);
+  else
+    lua_pushnil (L);
+  hash_job_free (L, j);
+  luaL_pcallx (L, 1, 0);
+}
+
+static void hash_job_start (lua_State *L, hash_job *j, int obj, int cb)
+{
+  j->dudat = (digest_user_datum_t *)lua_touserdata (L, obj);
+  j->dudat->busy = 1;
+  lua_pushvalue (L, obj);
+  j->obj_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  lua_pushvalue (L, cb);
+  j->cb_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  platform_post_low (hash_task_id, (platform_task_param_t)j);
+}
+
+/* hashobj:update_async(source, function(digest) end) */
+static int crypto_hash_update_async (lua_State *L)
+{
+  check_hash (L);
+  luaL_checktype (L, 3, LUA_TFUNCTION);
+  hash_job_start (L, hash_job_new (L, 2), 1, 3);
+  return 0;
+}
+
 static sint32_t vfs_read_wrap (int fd, void *ptr, size_t len)
 {
   return vfs_read (fd, ptr, len);
 }
 
-/* rawdigest = crypto.hash("MD5", filename)
- * strdigest = encoder.toHex(rawdigest)
- */
-static int crypto_flhash (lua_State *L)
+static int crypto_fhash_file (lua_State *L)
 {
   const digest_mech_info_t *mi = crypto_digest_mech (luaL_checkstring (L, 1));
   if (!mi)
@@ -238,6 +423,35 @@ static int crypto_flhash (lua_State *L)
 }
 
 
+/* rawdigest = crypto.fhash("MD5", filename)
+ * rawdigest = crypto.fhash("MD5", { partition = "lfs" })
+ * crypto.fhash("MD5", source, function(rawdigest) end)
+ * strdigest = encoder.toHex(rawdigest)
+ */
+static int crypto_flhash (lua_State *L)
+{
+  if (lua_isnoneornil (L, 3) && lua_type (L, 2) == LUA_TSTRING)
+    return crypto_fhash_file (L);
+
+  lua_settop (L, 3);
+  luaL_argcheck (L, lua_isnil (L, 3) || lua_isfunction (L, 3), 3, "function expected");
+  crypto_new_hash_hmac (L, WANT_HASH);   // hash object at [4]
+  hash_job *j = hash_job_new (L, 2);
+  if (lua_isfunction (L, 3)) {
+    hash_job_start (L, j, 4, 3);
+    return 0;
+  }
+
+  j->dudat = (digest_user_datum_t *)lua_touserdata (L, 4);
+  int res = hash_step (j, HASH_NO_SLICE);
+  hash_job_free (L, j);
+  if (res < 0)
+    return bad_read (L);
+  push_digest (L, (digest_user_datum_t *)lua_touserdata (L, 4));
+  return 1;
+}
+
+
 /* rawsignature = crypto.hmac("SHA1", str, key)
  * strsignature = encoder.toHex(rawsignature)
  */
@@ -260,6 +474,71 @@ static int crypto_lhmac (lua_State *L)
 }
 
 
+/*
+ * A HMAC key object holds the hash states after the padded key blocks, and
+ * signs each message from a copy of them, which saves two compression calls
+ * per message over crypto.hmac() with the same key.
+ */
+typedef struct {
+  const digest_mech_info_t *mech_info;
+  uint32_t ctx[];       // inner state, then outer state, of ctx_size each
+} hmac_key_datum_t;
+
+#define HMAC_KEY_OUTER(hk) ((char *)(hk)->ctx + (hk)->mech_info->ctx_size)
+
+/* hmackey = crypto.new_hmac_key("MECHTYPE", "KEY") */
+static int crypto_new_hmac_key (lua_State *L)
+{
+  const digest_mech_info_t *mi = crypto_digest_mech (luaL_checkstring (L, 1));
+  if (!mi)
+    return bad_mech (L);
+  size_t klen = 0;
+  const char *key = luaL_checklstring (L, 2, &klen);
+
+  hmac_key_datum_t *hk = (hmac_key_datum_t *)lua_newuserdata (L,
+                           sizeof (hmac_key_datum_t) + 2 * mi->ctx_size);
+  luaL_getmetatable (L, "crypto.hmackey");
+  lua_setmetatable (L, -2);
+  hk->mech_info = mi;
+  crypto_hmac_key (mi, key, klen, hk->ctx, HMAC_KEY_OUTER (hk));
+  return 1;
+}
+
+typedef struct {
+  const digest_mech_info_t *mi;
+  void *ctx;
+} hmac_sign_t;
+
+static int hmac_sign_chunk (void *arg, const char *s, size_t l)
+{
+  hmac_sign_t *hs = (hmac_sign_t *)arg;
+  hs->mi->update (hs->ctx, s, l);
+  return 0;
+}
+
+/* rawsignature = hmackey:sign(str or pipe) */
+static int crypto_hmac_key_sign (lua_State *L)
+{
+  hmac_key_datum_t *hk = (hmac_key_datum_t *)luaL_checkudata (L, 1, "crypto.hmackey");
+  const digest_mech_info_t *mi = hk->mech_info;
+  uint32_t ctx[(mi->ctx_size + 3) / 4];
+  uint8_t digest[mi->digest_size];
+
+  memcpy (ctx, hk->ctx, mi->ctx_size);
+  if (lua_istable (L, 2)) {
+    hmac_sign_t hs = { mi, ctx };
+    luaL_argcheck (L, pipe_drain (L, 2, hmac_sign_chunk, &hs) >= 0, 2, "string or pipe expected");
+  } else {
+    size_t len = 0;
+    const char *data = luaL_checklstring (L, 2, &len);
+    mi->update (ctx, data, len);
+  }
+  crypto_hmac_keyed_finalize (ctx, mi, HMAC_KEY_OUTER (hk), digest);
+
+  lua_pushlstring (L, digest, sizeof (digest));
+  return 1;
+}
+
 
 static const crypto_mech_t *get_mech (lua_State *L, int idx)
 {
@@ -313,15 +592,236 @@ static int lcrypto_decrypt (lua_State *L)
   return crypto_encdec (L, false);
 }
 
+/* Streaming ciphers:
+ * cipher = crypto.new_encrypt("AES-GCM", key, iv[, aad])
+ * out = cipher:update(data)
+ * out, tag = cipher:finalize()
+ *
+ * The state is a fixed size userdata, so memory use does not depend on the
+ * length of the data. Input is ciphered straight from the Lua string into
+ * the result buffer. GCM is fed whole 16 byte blocks, as mbedTLS requires,
+ * with any part block carried over to the next update.
+ */
+#define CIPHER_CTR 0
+#define CIPHER_GCM 1
+
+static const char *const cipher_names[] = { "AES-CTR", "AES-GCM", NULL };
+
+typedef struct {
+  uint8_t mode, op, active;
+  uint8_t npend;      // GCM: bytes of a part block; CTR: unused
+  size_t nc_off;      // CTR: offset in the key stream block
+  uint8_t block[16];  // CTR: counter; GCM: part block
+  uint8_t stream[16]; // CTR: key stream block
+  union {
+    mbedtls_aes_context aes;
+    mbedtls_gcm_context gcm;
+  } u;
+} cipher_user_datum_t;
+
+static void cipher_free (cipher_user_datum_t *c)
+{
+  if (!c->active)
+    return;
+  if (c->mode == CIPHER_GCM)
+    mbedtls_gcm_free (&c->u.gcm);
+  else
+    mbedtls_aes_free (&c->u.aes);
+  c->active = 0;
+}
+
+static int crypto_new_cipher (lua_State *L, int op)
+{
+  const char *name = luaL_checkstring (L, 1);
+  int mode;
+  for (mode = 0; cipher_names[mode] && strcasecmp (cipher_names[mode], name); mode++) {}
+  if (!cipher_names[mode])
+    return luaL_error (L, "unknown cipher: %s", name);
+
+  size_t klen, ivlen, aadlen;
+  const char *key = luaL_checklstring (L, 2, &klen);
+  const char *iv = luaL_checklstring (L, 3, &ivlen);
+  const char *aad = luaL_optlstring (L, 4, "", &aadlen);
+  luaL_argcheck (L, klen == 16 || klen == 24 || klen == 32, 2, "key must be 16, 24 or 32 bytes");
+  luaL_argcheck (L, mode == CIPHER_GCM ? ivlen > 0 : ivlen <= 16, 3, "invalid iv");
+  luaL_argcheck (L, mode == CIPHER_GCM || !aadlen, 4, "only GCM takes additional data");
+
+  cipher_user_datum_t *c = (cipher_user_datum_t *)lua_newuserdata (L, sizeof (cipher_user_datum_t));
+  memset (c, 0, sizeof (*c));
+  c->mode = mode;
+  c->op = op;
+  luaL_getmetatable (L, "crypto.cipher");
+  lua_setmetatable (L, -2);
+
+  int res;
+  if (mode == CIPHER_GCM) {
+    mbedtls_gcm_init (&c->u.gcm);
+    c->active = 1;
+    res = mbedtls_gcm_setkey (&c->u.gcm, MBEDTLS_CIPHER_ID_AES, (const unsigned char *)key, klen * 8);
+    if (!res)
+      res = mbedtls_gcm_starts (&c->u.gcm, op == OP_ENCRYPT ? MBEDTLS_GCM_ENCRYPT : MBEDTLS_GCM_DECRYPT,
+                                (const unsigned char *)iv, ivlen, (const unsigned char *)aad, aadlen);
+  } else {
+    // CTR uses the encryption key schedule in both directions
+    mbedtls_aes_init (&c->u.aes);
+    c->active = 1;
+    memcpy (c->block, iv, ivlen);
+    res = mbedtls_aes_setkey_enc (&c->u.aes, (const unsigned char *)key, klen * 8);
+  }
+  if (res) {
+    cipher_free (c);
+    return bad_mem (L);
+  }
+  return 1;
+}
+
+/* crypto.new_encrypt("AES-CTR", key, iv) */
+static int crypto_new_encrypt (lua_State *L)
+{
+  return crypto_new_cipher (L, OP_ENCRYPT);
+}
+
+/* crypto.new_decrypt("AES-GCM", key, iv[, aad]) */
+static int crypto_new_decrypt (lua_State *L)
+{
+  return crypto_new_cipher (L, OP_DECRYPT);
+}
+
+static cipher_user_datum_t *check_cipher (lua_State *L)
+{
+  cipher_user_datum_t *c = (cipher_user_datum_t *)luaL_checkudata (L, 1, "crypto.cipher");
+  if (!c->active)
+    luaL_error (L, "cipher finalized");
+  return c;
+}
+
+static void cipher_run (lua_State *L, cipher_user_datum_t *c, luaL_Buffer *b,
+                        const uint8_t *in, size_t len)
+{
+  if (c->mode == CIPHER_CTR) {
+    while (len) {
+      size_t n = len < LUAL_BUFFERSIZE ? len : LUAL_BUFFERSIZE;
+      mbedtls_aes_crypt_ctr (&c->u.aes, n, &c->nc_off, c->block, c->stream,
+                             in, (unsigned char *)luaL_prepbuffer (b));
+      luaL_addsize (b, n);
+      in += n;
+      len -= n;
+    }
+    return;
+  }
+
+  if (c->npend) {   // complete the part block from the last update
+    while (c->npend < 16 && len) {
+      c->block[c->npend++] = *in++;
+      len--;
+    }
+    if (c->npend < 16)
+      return;
+    mbedtls_gcm_update (&c->u.gcm, 16, c->block, (unsigned char *)luaL_prepbuffer (b));
+    luaL_addsize (b, 16);
+    c->npend = 0;
+  }
+  while (len >= 16) {
+    size_t n = len & ~15;
+    if (n > (LUAL_BUFFERSIZE & ~15))
+      n = LUAL_BUFFERSIZE & ~15;
+    mbedtls_gcm_update (&c->u.gcm, n, in, (unsigned char *)luaL_prepbuffer (b));
+    luaL_addsize (b, n);
+    in += n;
+    len -= n;
+  }
+  memcpy (c->block, in, len);
+  c->npend = len;
+}
+
+/* out = cipher:update(data) */
+static int crypto_cipher_update (lua_State *L)
+{
+  cipher_user_datum_t *c = check_cipher (L);
+  size_t len;
+  const uint8_t *data = (const uint8_t *)luaL_checklstring (L, 2, &len);
+  luaL_Buffer b;
+
+  luaL_buffinit (L, &b);
+  cipher_run (L, c, &b, data, len);
+  luaL_pushresult (&b);
+  return 1;
+}
+
+/* out[, tag] = cipher:finalize([data]) for encryption
+ * out = cipher:finalize(tag[, data]) for GCM decryption */
+static int crypto_cipher_finalize (lua_State *L)
+{
+  cipher_user_datum_t *c = check_cipher (L);
+  int gcm_decrypt = c->mode == CIPHER_GCM && c->op == OP_DECRYPT;
+  size_t len, taglen = 0;
+  const char *want = gcm_decrypt ? luaL_checklstring (L, 2, &taglen) : NULL;
+  const uint8_t *data = (const uint8_t *)luaL_optlstring (L, gcm_decrypt ? 3 : 2, "", &len);
+  luaL_Buffer b;
+
+  if (gcm_decrypt)
+    luaL_argcheck (L, taglen >= 4 && taglen <= 16, 2, "invalid tag");
+
+  luaL_buffinit (L, &b);
+  cipher_run (L, c, &b, data, len);
+  if (c->mode == CIPHER_CTR) {
+    cipher_free (c);
+    luaL_pushresult (&b);
+    return 1;
+  }
+
+  uint8_t tag[16];
+  if (c->npend) {
+    mbedtls_gcm_update (&c->u.gcm, c->npend, c->block, (unsigned char *)luaL_prepbuffer (&b));
+    luaL_addsize (&b, c->npend);
+  }
+  mbedtls_gcm_finish (&c->u.gcm, tag, sizeof (tag));
+  cipher_free (c);
+
+  if (gcm_decrypt) {
+    uint8_t diff = 0;
+    size_t i;
+    for (i = 0; i < taglen; i++)   // constant time compare
+      diff |= tag[i] ^ (uint8_t)want[i];
+    if (diff)
+      return luaL_error (L, "authentication failed");
+    luaL_pushresult (&b);
+    return 1;
+  }
+  luaL_pushresult (&b);
+  lua_pushlstring (L, (const char *)tag, sizeof (tag));
+  return 2;
+}
+
+static int crypto_cipher_gc (lua_State *L)
+{
+  cipher_free ((cipher_user_datum_t *)luaL_checkudata (L, 1, "crypto.cipher"));
+  return 0;
+}
+
+
 // Hash function map
 
 LROT_BEGIN(crypto_hash_map, NULL, LROT_MASK_INDEX)
   LROT_TABENTRY( __index, crypto_hash_map )
   LROT_FUNCENTRY( update, crypto_hash_update )
+  LROT_FUNCENTRY( update_async, crypto_hash_update_async )
   LROT_FUNCENTRY( finalize, crypto_hash_finalize )
 LROT_END(crypto_hash_map, NULL, LROT_MASK_INDEX)
 
 
+LROT_BEGIN(crypto_hmac_key_map, NULL, LROT_MASK_INDEX)
+  LROT_TABENTRY( __index, crypto_hmac_key_map )
+  LROT_FUNCENTRY( sign, crypto_hmac_key_sign )
+LROT_END(crypto_hmac_key_map, NULL, LROT_MASK_INDEX)
+
+
+LROT_BEGIN(crypto_cipher_map, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, crypto_cipher_gc )
+  LROT_TABENTRY( __index, crypto_cipher_map )
+  LROT_FUNCENTRY( update, crypto_cipher_update )
+  LROT_FUNCENTRY( finalize, crypto_cipher_finalize )
+LROT_END(crypto_cipher_map, NULL, LROT_MASK_GC_INDEX)
 
 // Module function map
 LROT_BEGIN(crypto, NULL, 0)
@@ -332,14 +832,20 @@ LROT_BEGIN(crypto, NULL, 0)
   LROT_FUNCENTRY( new_hash, crypto_new_hash )
   LROT_FUNCENTRY( hmac, crypto_lhmac )
   LROT_FUNCENTRY( new_hmac, crypto_new_hmac )
+  LROT_FUNCENTRY( new_hmac_key, crypto_new_hmac_key )
   LROT_FUNCENTRY( encrypt, lcrypto_encrypt )
   LROT_FUNCENTRY( decrypt, lcrypto_decrypt )
+  LROT_FUNCENTRY( new_encrypt, crypto_new_encrypt )
+  LROT_FUNCENTRY( new_decrypt, crypto_new_decrypt )
 LROT_END(crypto, NULL, 0)
 
 
 int luaopen_crypto ( lua_State *L )
 {
   luaL_rometatable(L, "crypto.hash", LROT_TABLEREF(crypto_hash_map));
+  luaL_rometatable(L, "crypto.hmackey", LROT_TABLEREF(crypto_hmac_key_map));
+  luaL_rometatable(L, "crypto.cipher", LROT_TABLEREF(crypto_cipher_map));
+  hash_task_id = platform_task_get_id(hash_task);
   return 0;
 }
 
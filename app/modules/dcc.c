@@ -348,6 +348,7 @@ static int dcc_lua_setup(lua_State* L) {
     }
 
     platform_hw_timer_set_func(TIMER_OWNER, cvAckComplete, 0);
+    platform_hw_timer_set_priority(TIMER_OWNER, 50, "dcc");
 
     platform_gpio_write(ackpin, 0);
     platform_gpio_mode(ackpin, PLATFORM_GPIO_OUTPUT, PLATFORM_GPIO_FLOAT);
@@ -363,12 +364,37 @@ static int dcc_lua_setup(lua_State* L) {
 
 static int dcc_lua_close(lua_State* L) {
   dcc_close();
+  dcc_filter(NULL, 0, 0);
   unregister_lua_cb(L, &notify_cb);
   unregister_lua_cb(L, &CV_cb);
   unregister_lua_cb(L, &CV_ref);
   return 0;
 }
 
+// Lua: dcc.filter([addresses][, window])
+static int dcc_lua_filter(lua_State* L) {
+  uint16_t addr[DCC_FILTER_MAX];
+  int i, n = 0;
+
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = lua_objlen(L, 1);
+    luaL_argcheck(L, n <= DCC_FILTER_MAX, 1, "too many addresses");
+    for (i = 0; i < n; i++) {
+      lua_rawgeti(L, 1, i + 1);
+      int a = luaL_checkinteger(L, -1);
+      luaL_argcheck(L, a > 0 && a < 0x4000, 1, "invalid address");
+      addr[i] = a;
+      lua_pop(L, 1);
+    }
+  }
+  int window = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, window >= 0 && window <= 60000, 2, "out of range");
+
+  dcc_filter(addr, n, window * 1000);
+  return 0;
+}
+
 static void dcc_task(os_param_t param, uint8_t prio)
 {
   (void) prio;
@@ -387,6 +413,7 @@ int dcc_lua_init( lua_State *L ) {
 LROT_BEGIN(dcc, NULL, 0)
   LROT_FUNCENTRY( setup, dcc_lua_setup )
   LROT_FUNCENTRY( close, dcc_lua_close )
+  LROT_FUNCENTRY( filter, dcc_lua_filter )
   
   LROT_NUMENTRY( DCC_RESET, DCC_RESET )
   LROT_NUMENTRY( DCC_IDLE, DCC_IDLE )
@@ -4,7 +4,10 @@
 #include "lauxlib.h"
 #include "platform.h"
 #include "cpu_esp8266.h"
+#include "user_interface.h"
+#include "pm/swtimer.h"
 #include "dht/dht.h"
+#include <stdlib.h>
 
 #define NUM_DHT GPIO_PIN_NUM
 
@@ -67,16 +70,210 @@ static int dht_lapi_readxx( lua_State *L )
   return 5;
 }
 
+#if defined(GPIO_INTERRUPT_ENABLE) && defined(GPIO_INTERRUPT_HOOK_ENABLE)
+// ****************************************************************************
+// Reads timed by the GPIO interrupt
+//
+// Every bit starts with the sensor pulling the line low for 50us, and then
+// leaving it high for 26-28us for a 0 or 70us for a 1. The falling edges are
+// timestamped by the interrupt, so that the line does not have to be polled
+// with interrupts disabled. The first edge starts the response of the sensor,
+// the second the first bit, and the last one ends the 40th bit.
+
+#define DHT_ASYNC_EDGES     42
+#define DHT_ASYNC_ONE_US    100   // falling edges further apart than this frame a 1
+#define DHT_ASYNC_TIMEOUT   20    // ms from the release of the line
+
+enum { DHT_ASYNC_WAKEUP, DHT_ASYNC_READING, DHT_ASYNC_DONE, DHT_ASYNC_TIMEDOUT };
+
+typedef struct {
+  os_timer_t timer;
+  int cb_ref;
+  uint8_t pin;
+  uint8_t type;
+  volatile uint8_t state;
+  volatile uint8_t edges;
+  uint32_t stamp[DHT_ASYNC_EDGES];
+} dht_async_t;
+
+static dht_async_t *dht_async[NUM_DHT];
+static uint32_t dht_async_bits;
+static platform_task_handle_t dht_async_task_id;
+
+static uint32_t ICACHE_RAM_ATTR dht_async_interrupt(uint32_t ret_gpio_status)
+{
+  uint32_t now = system_get_time();
+  uint32_t handled = ret_gpio_status & dht_async_bits;
+  unsigned id;
+
+  for (id = 1; handled && id < NUM_DHT; id++) {
+    dht_async_t *d = dht_async[id];
+    uint32_t bit = BIT(pin_num[id]);
+    if (!d || !(handled & bit)) {
+      continue;
+    }
+    if (d->state == DHT_ASYNC_READING && d->edges < DHT_ASYNC_EDGES) {
+      d->stamp[d->edges++] = now;
+      if (d->edges == DHT_ASYNC_EDGES) {
+        d->state = DHT_ASYNC_DONE;
+        gpio_pin_intr_state_set(GPIO_ID_PIN(pin_num[id]), GPIO_PIN_INTR_DISABLE);
+        platform_post_medium(dht_async_task_id, id);
+      }
+    }
+    GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, bit);
+  }
+
+  return ret_gpio_status & ~handled;
+}
+
+static void dht_async_set_bits(uint32_t bits)
+{
+  dht_async_bits = bits;
+  if (bits) {
+    platform_gpio_register_intr_hook(bits, dht_async_interrupt);
+  } else {
+    platform_gpio_unregister_intr_hook(dht_async_interrupt);
+  }
+}
+
+static void dht_async_timeout(void *arg)
+{
+  dht_async_t *d = (dht_async_t *)arg;
+
+  ETS_GPIO_INTR_DISABLE();
+  if (d->state == DHT_ASYNC_READING) {
+    d->state = DHT_ASYNC_TIMEDOUT;
+    gpio_pin_intr_state_set(GPIO_ID_PIN(pin_num[d->pin]), GPIO_PIN_INTR_DISABLE);
+    platform_post_medium(dht_async_task_id, d->pin);
+  }
+  ETS_GPIO_INTR_ENABLE();
+}
+
+// The line has been held low long enough to wake the sensor, so it is
+// released and the edges of the response are timed from here on
+static void dht_async_release(void *arg)
+{
+  dht_async_t *d = (dht_async_t *)arg;
+
+  d->state = DHT_ASYNC_READING;
+  platform_gpio_mode(d->pin, PLATFORM_GPIO_INT, PLATFORM_GPIO_PULLUP);
+  platform_gpio_intr_init(d->pin, GPIO_PIN_INTR_NEGEDGE);
+
+  os_timer_setfn(&d->timer, dht_async_timeout, d);
+  SWTIMER_REG_CB(dht_async_timeout, SWTIMER_IMMEDIATE);
+    //a read cut short by a suspend times out as soon as the timers resume
+  os_timer_arm(&d->timer, DHT_ASYNC_TIMEOUT, 0);
+}
+
+static int dht_async_decode(dht_async_t *d)
+{
+  uint8_t bytes[5] = {0};
+  int i;
+
+  if (d->state != DHT_ASYNC_DONE) {
+    return DHTLIB_ERROR_TIMEOUT;
+  }
+  for (i = 0; i < 40; i++) {
+    if (d->stamp[i + 2] - d->stamp[i + 1] > DHT_ASYNC_ONE_US) {
+      bytes[i / 8] |= 0x80 >> (i % 8);
+    }
+  }
+  return dht_decode(bytes, d->type);
+}
+
+static void dht_async_task(platform_task_param_t param, uint8_t prio)
+{
+  (void) prio;
+  dht_async_t *d = dht_async[param];
+  if (!d) {
+    return;
+  }
+
+  os_timer_disarm(&d->timer);
+  dht_async[param] = NULL;
+  dht_async_set_bits(dht_async_bits & ~BIT(pin_num[param]));
+  platform_gpio_mode(param, PLATFORM_GPIO_INPUT, PLATFORM_GPIO_PULLUP);
+
+  lua_State *L = lua_getstate();
+  int status = dht_async_decode(d);
+  if (status != DHTLIB_OK) {
+    dht_decode_failed();
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, d->cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, d->cb_ref);
+  free(d);
+
+  lua_pushinteger(L, status);
+  aux_read(L);
+  luaL_pcallx(L, 5, 0);
+}
+
+// Lua: dht.readasync( id, [model,] callback )
+static int dht_lapi_readasync( lua_State *L )
+{
+  unsigned id = luaL_checkinteger( L, 1 );
+  MOD_CHECK_ID( dht, id );
+  int type = DHT_NON11;
+  int cb = 2;
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    type = lua_tointeger(L, 2);
+    luaL_argcheck(L, type >= DHT11 && type <= DHT_NON11, 2, "invalid model");
+    cb = 3;
+  }
+  luaL_checktype(L, cb, LUA_TFUNCTION);
+  if (dht_async[id]) {
+    return luaL_error(L, "pin %d is already being read", id);
+  }
+
+  dht_async_t *d = (dht_async_t *) calloc(1, sizeof(dht_async_t));
+  if (!d) {
+    return luaL_error(L, "out of memory");
+  }
+  lua_pushvalue(L, cb);
+  d->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  d->pin = id;
+  d->type = type;
+  d->state = DHT_ASYNC_WAKEUP;
+  dht_async[id] = d;
+  dht_async_set_bits(dht_async_bits | BIT(pin_num[id]));
+
+  // Hold the line low to wake the sensor, with a ms to spare on the timer
+  platform_gpio_mode(id, PLATFORM_GPIO_OUTPUT, PLATFORM_GPIO_PULLUP);
+  DIRECT_WRITE_LOW(id);
+  os_timer_disarm(&d->timer);
+  os_timer_setfn(&d->timer, dht_async_release, d);
+  SWTIMER_REG_CB(dht_async_release, SWTIMER_RESUME);
+  os_timer_arm(&d->timer, 1 + (type == DHT22 ? DHTLIB_DHT_WAKEUP :
+                               type == DHT11 ? DHTLIB_DHT11_WAKEUP : DHTLIB_DHT_UNI_WAKEUP), 0);
+  return 0;
+}
+
+static int dht_lapi_open( lua_State *L )
+{
+  dht_async_task_id = platform_task_get_id(dht_async_task);
+  return 0;
+}
+#else
+#define dht_lapi_open NULL
+#endif
+
 // Module function map
 LROT_BEGIN(dht, NULL, 0)
   LROT_FUNCENTRY( read, dht_lapi_read )
   LROT_FUNCENTRY( read11, dht_lapi_read11 )
   LROT_FUNCENTRY( read12, dht_lapi_read12 )
   LROT_FUNCENTRY( readxx, dht_lapi_read )
+#if defined(GPIO_INTERRUPT_ENABLE) && defined(GPIO_INTERRUPT_HOOK_ENABLE)
+  LROT_FUNCENTRY( readasync, dht_lapi_readasync )
+#endif
+  LROT_NUMENTRY( DHT11, DHT11 )
+  LROT_NUMENTRY( DHT12, DHT12 )
+  LROT_NUMENTRY( DHT22, DHT22 )
+  LROT_NUMENTRY( DHTXX, DHT_NON11 )
   LROT_NUMENTRY( OK, DHTLIB_OK )
   LROT_NUMENTRY( ERROR_CHECKSUM, DHTLIB_ERROR_CHECKSUM )
   LROT_NUMENTRY( ERROR_TIMEOUT, DHTLIB_ERROR_TIMEOUT )
 LROT_END(dht, NULL, 0)
 
 
-NODEMCU_MODULE(DHT, "dht", dht, NULL);
+NODEMCU_MODULE(DHT, "dht", dht, dht_lapi_open);
@@ -2,155 +2,290 @@
 
 #include "module.h"
 #include "lauxlib.h"
-#include "lmem.h"
 #include <string.h>
-#define BASE64_INVALID '\xff'
+#define BASE64_INVALID 0xff
 #define BASE64_PADDING '='
-#define ISBASE64(c) (unbytes64[c] != BASE64_INVALID)
+#define CONV_INVALID(a) ((a) & 0x80)   // LUT entries of invalid characters have the top bit set
+#define ENCODER_STREAM_METATABLE "encoder.stream"
 
 static const uint8 b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const uint8 hexdigits[] = "0123456789abcdef";
 
-static uint8 *toBase64 ( lua_State* L, const uint8 *msg, size_t *len){
-  size_t i, n = *len;
-
-  if (!n)  // handle empty string case
-    return NULL;
-
-  int buf_size = (n + 2) / 3 * 4; // estimated encoded size
-  uint8 * q, *out = (uint8 *)luaM_malloc(L, buf_size);
-  uint8 bytes64[sizeof(b64)];
-  memcpy(bytes64, b64, sizeof(b64));   //Avoid lots of flash unaligned fetches
-
-  for (i = 0, q = out; i < n; i += 3) {
-    int a = msg[i];
-    int b = (i + 1 < n) ? msg[i + 1] : 0;
-    int c = (i + 2 < n) ? msg[i + 2] : 0;
-    *q++ = bytes64[a >> 2];
-    *q++ = bytes64[((a & 3) << 4) | (b >> 4)];
-    *q++ = (i + 1 < n) ? bytes64[((b & 15) << 2) | (c >> 6)] : BASE64_PADDING;
-    *q++ = (i + 2 < n) ? bytes64[(c & 63)] : BASE64_PADDING;
-  }
-  *len = q - out;
-  out = luaM_realloc_(L, out, buf_size, *len); //reallocate to actual encoded length
-  return out;
+enum { TO_BASE64, FROM_BASE64, TO_HEX, FROM_HEX };
+static const char *const conv_names[] = { "toBase64", "fromBase64", "toHex", "fromHex", NULL };
+
+// The state carried from one piece of input to the next. The one-shot
+// functions use a fresh state on the C stack and finish it straight away;
+// encoder.stream() objects keep theirs in a userdata.
+typedef struct {
+  uint8 kind;
+  uint8 ncarry;     // bytes or characters of an incomplete group
+  uint8 padded;     // base64 padding has been seen, so nothing may follow
+  uint8 carry[4];
+} conv_state;
+
+// Converters write straight into the Lua buffer a LUAL_BUFFERSIZE block at a
+// time, so the only copy of the output is the one luaL_pushresult makes.
+
+static void base64_group(const uint8 *t, const uint8 *in, uint8 *q) {
+  uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+  q[0] = t[v >> 18];
+  q[1] = t[(v >> 12) & 63];
+  q[2] = t[(v >> 6) & 63];
+  q[3] = t[v & 63];
 }
 
-static uint8 *fromBase64 ( lua_State* L, const uint8 *enc_msg, size_t *len){
-  int i, n = *len, blocks = (n>>2), pad = 0;
-  const uint8 *p;
-  uint8 unbytes64[UCHAR_MAX+1], *msg, *q;
+static void toBase64 (lua_State *L, conv_state *s, luaL_Buffer *b,
+                      const uint8 *in, size_t n, int final) {
+  uint8 t[sizeof(b64)];
+  memcpy(t, b64, sizeof(b64));   //Avoid lots of flash unaligned fetches
+
+  if (s->ncarry) {  // top up the group left over from the last piece
+    while (s->ncarry < 3 && n) {
+      s->carry[s->ncarry++] = *in++;
+      n--;
+    }
+    if (s->ncarry == 3) {
+      base64_group(t, s->carry, (uint8 *)luaL_prepbuffer(b));
+      luaL_addsize(b, 4);
+      s->ncarry = 0;
+    }
+  }
+
+  while (n >= 3) {
+    size_t i, groups = n / 3;
+    if (groups > LUAL_BUFFERSIZE / 4)
+      groups = LUAL_BUFFERSIZE / 4;
+    uint8 *q = (uint8 *)luaL_prepbuffer(b);
+    for (i = 0; i < groups; i++, in += 3, q += 4)
+      base64_group(t, in, q);
+    luaL_addsize(b, groups * 4);
+    n -= groups * 3;
+  }
+
+  while (n--)
+    s->carry[s->ncarry++] = *in++;
+
+  if (final && s->ncarry) {
+    uint32_t v = (s->carry[0] << 16) | ((s->ncarry > 1 ? s->carry[1] : 0) << 8);
+    luaL_addchar(b, t[v >> 18]);
+    luaL_addchar(b, t[(v >> 12) & 63]);
+    luaL_addchar(b, s->ncarry > 1 ? t[(v >> 6) & 63] : BASE64_PADDING);
+    luaL_addchar(b, BASE64_PADDING);
+    s->ncarry = 0;
+  }
+}
 
-  if (!n)  // handle empty string case
-    return NULL;
+// Decodes a single group, which may be padded, off the fast path
+static void base64_quad (lua_State *L, conv_state *s, luaL_Buffer *b,
+                         const uint8 *lut, const uint8 *g) {
+  uint8 a = lut[g[0]], c = lut[g[1]], d = lut[g[2]], e = lut[g[3]];
 
-  if (n & 3)
+  if (!CONV_INVALID(a | c | d | e)) {
+    luaL_addchar(b, (a << 2) | (c >> 4));
+    luaL_addchar(b, (c << 4) | (d >> 2));
+    luaL_addchar(b, (d << 6) | e);
+    return;
+  }
+  if (CONV_INVALID(a | c) || g[3] != BASE64_PADDING ||
+      (g[2] != BASE64_PADDING && CONV_INVALID(d)))
     luaL_error (L, "Invalid base64 string");
 
-  memset(unbytes64, BASE64_INVALID, sizeof(unbytes64));
-  for (i = 0; i < sizeof(b64)-1; i++) unbytes64[b64[i]] = i;  // sequential so no exceptions
+  luaL_addchar(b, (a << 2) | (c >> 4));
+  if (g[2] != BASE64_PADDING)
+    luaL_addchar(b, (c << 4) | (d >> 2));
+  s->padded = 1;
+}
+
+static void fromBase64 (lua_State *L, conv_state *s, luaL_Buffer *b,
+                        const uint8 *in, size_t n, int final) {
+  uint8 lut[UCHAR_MAX+1];
+  int i;
+
+  memset(lut, BASE64_INVALID, sizeof(lut));
+  for (i = 0; i < sizeof(b64)-1; i++) lut[b64[i]] = i;  // sequential so no exceptions
 
-  if (enc_msg[n-1] == BASE64_PADDING) {
-    pad =  (enc_msg[n-2] != BASE64_PADDING) ? 1 : 2;
-    blocks--;  //exclude padding block
+  if (s->ncarry) {
+    while (s->ncarry < 4 && n) {
+      s->carry[s->ncarry++] = *in++;
+      n--;
+    }
+    if (s->ncarry == 4) {
+      s->ncarry = 0;
+      base64_quad(L, s, b, lut, s->carry);
+    }
   }
 
- for (i = 0; i < n - pad; i++) if (!ISBASE64(enc_msg[i])) luaL_error (L, "Invalid base64 string");
-  unbytes64[BASE64_PADDING] = 0;
-
-  int buf_size=1+ (3 * n / 4); // estimate decoded length
-  msg = q = (uint8 *) luaM_malloc(L, buf_size);
-  for (i = 0, p = enc_msg; i<blocks; i++)  {
-    uint8 a = unbytes64[*p++];
-    uint8 b = unbytes64[*p++];
-    uint8 c = unbytes64[*p++];
-    uint8 d = unbytes64[*p++];
-    *q++ = (a << 2) | (b >> 4);
-    *q++ = (b << 4) | (c >> 2);
-    *q++ = (c << 6) | d;
+  while (n >= 4) {
+    size_t j, groups = n / 4;
+    if (s->padded)
+      break;
+    if (groups > LUAL_BUFFERSIZE / 3)
+      groups = LUAL_BUFFERSIZE / 3;
+    uint8 *q = (uint8 *)luaL_prepbuffer(b);
+    for (j = 0; j < groups; j++, in += 4, q += 3) {
+      uint8 a = lut[in[0]], c = lut[in[1]], d = lut[in[2]], e = lut[in[3]];
+      if (CONV_INVALID(a | c | d | e))
+        break;
+      uint32_t v = (a << 18) | (c << 12) | (d << 6) | e;
+      q[0] = v >> 16;
+      q[1] = v >> 8;
+      q[2] = v;
+    }
+    luaL_addsize(b, j * 3);
+    n -= j * 4;
+    if (j < groups) {
+      base64_quad(L, s, b, lut, in);
+      in += 4;
+      n -= 4;
+    }
   }
 
-  if (pad) { //now process padding block bytes
-    uint8 a = unbytes64[*p++];
-    uint8 b = unbytes64[*p++];
-    *q++ = (a << 2) | (b >> 4);
-    if (pad == 1) *q++ = (b << 4) | (unbytes64[*p] >> 2);
+  if (n && s->padded)
+    luaL_error (L, "Invalid base64 string");
+  while (n--)
+    s->carry[s->ncarry++] = *in++;
+
+  if (final && s->ncarry)
+    luaL_error (L, "Invalid base64 string");
+}
+
+static void toHex (lua_State *L, conv_state *s, luaL_Buffer *b,
+                   const uint8 *in, size_t n, int final) {
+  uint8 t[sizeof(hexdigits)];
+  memcpy(t, hexdigits, sizeof(hexdigits));
+
+  while (n) {
+    size_t i, m = n;
+    if (m > LUAL_BUFFERSIZE / 2)
+      m = LUAL_BUFFERSIZE / 2;
+    uint8 *q = (uint8 *)luaL_prepbuffer(b);
+    for (i = 0; i < m; i++, q += 2) {
+      q[0] = t[in[i] >> 4];
+      q[1] = t[in[i] & 0xf];
+    }
+    luaL_addsize(b, m * 2);
+    in += m;
+    n -= m;
   }
-  *len = q - msg;
-  msg = luaM_realloc_(L, msg, buf_size, *len); //reallocate to actual decoded length
-  return msg;
 }
 
-static inline uint8 to_hex_nibble(uint8 b) {
-  return b + ( b < 10 ? '0' : 'a' - 10 );
+static void fromHex (lua_State *L, conv_state *s, luaL_Buffer *b,
+                     const uint8 *in, size_t n, int final) {
+  uint8 lut[UCHAR_MAX+1];
+  int i;
+
+  memset(lut, BASE64_INVALID, sizeof(lut));
+  for (i = 0; i < 10; i++) lut['0' + i] = i;
+  for (i = 0; i < 6; i++) lut['a' + i] = lut['A' + i] = 10 + i;
+
+  if (s->ncarry && n) {
+    uint8 hi = lut[s->carry[0]], lo = lut[*in++];
+    n--;
+    if (CONV_INVALID(hi | lo))
+      luaL_error (L, "Invalid hex string");
+    luaL_addchar(b, (hi << 4) | lo);
+    s->ncarry = 0;
   }
 
-static uint8 *toHex ( lua_State* L, const uint8 *msg, size_t *len){
-  int i, n = *len;
-  *len <<= 1;
-  uint8 *q, *out = (uint8 *)luaM_malloc(L, *len);
-  for (i = 0, q = out; i < n; i++) {
-    *q++ = to_hex_nibble(msg[i] >> 4);
-    *q++ = to_hex_nibble(msg[i] & 0xf);
+  while (n >= 2) {
+    size_t j, m = n / 2;
+    if (m > LUAL_BUFFERSIZE)
+      m = LUAL_BUFFERSIZE;
+    uint8 *q = (uint8 *)luaL_prepbuffer(b);
+    for (j = 0; j < m; j++, in += 2) {
+      uint8 hi = lut[in[0]], lo = lut[in[1]];
+      if (CONV_INVALID(hi | lo))
+        luaL_error (L, "Invalid hex string");
+      q[j] = (hi << 4) | lo;
+    }
+    luaL_addsize(b, m);
+    n -= m * 2;
   }
-  return out;
-}
 
-static uint8 *fromHex ( lua_State* L, const uint8 *msg, size_t *len){
-  int i, n = *len;
-  const uint8 *p;
+  if (n)
+    s->carry[s->ncarry++] = *in;
 
-  if (n &1)
+  if (final && s->ncarry)
     luaL_error (L, "Invalid hex string");
+}
 
-  *len >>= 1;
-  uint8 b, *q, *out = (uint8 *)luaM_malloc(L, *len);
-  uint8 c = 0;
-
-  for (i = 0, p = msg, q = out; i < n; i++) {
-     if (*p >= '0' && *p <= '9') {
-       b = *p++ - '0';
-     } else if (*p >= 'a' && *p <= 'f') {
-       b = *p++ - ('a' - 10);
-     } else if (*p >= 'A' && *p <= 'F') {
-       b = *p++ - ('A' - 10);
-     } else {
-       luaN_freearray(L, out, *len);
-       luaL_error (L, "Invalid hex string");
-     }
-     if ((i&1) == 0) {
-       c = b<<4;
-     } else {
-       *q++ = c+ b;
-     }
+static void convert (lua_State *L, conv_state *s, luaL_Buffer *b,
+                     const uint8 *in, size_t n, int final) {
+  switch (s->kind) {
+    case TO_BASE64:   toBase64(L, s, b, in, n, final);   break;
+    case FROM_BASE64: fromBase64(L, s, b, in, n, final); break;
+    case TO_HEX:      toHex(L, s, b, in, n, final);      break;
+    case FROM_HEX:    fromHex(L, s, b, in, n, final);    break;
   }
-  return out;
 }
 
 // All encoder functions are of the form:
 // Lua:  output_string = encoder.function(input_string)
 // Where input string maybe empty, but not nil
 // Hence these all call the do_func wrapper
-static int do_func (lua_State *L, uint8 * (*conv_func)(lua_State *, const uint8 *, size_t *)) {
+static int do_func (lua_State *L, int kind) {
   size_t len;
-  const uint8 *input = luaL_checklstring(L, 1, &len);
-  uint8 *output = conv_func(L, input, &len);
-
-  if (output) {
-    lua_pushlstring(L, output, len);
-    luaN_freearray(L, output, len);
-  } else {
-    lua_pushstring(L, "");
-  }
+  const uint8 *input = (const uint8 *)luaL_checklstring(L, 1, &len);
+  conv_state s = { kind, 0, 0, { 0 } };
+  luaL_Buffer b;
+
+  luaL_buffinit(L, &b);
+  convert(L, &s, &b, input, len, 1);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+#define DECLARE_FUNCTION(f, kind) static int encoder_ ## f (lua_State *L) \
+{ return do_func(L, kind); }
+
+  DECLARE_FUNCTION(fromBase64, FROM_BASE64);
+  DECLARE_FUNCTION(toBase64, TO_BASE64);
+  DECLARE_FUNCTION(fromHex, FROM_HEX);
+  DECLARE_FUNCTION(toHex, TO_HEX);
+
+// Lua: stream = encoder.stream(function_name)
+static int encoder_stream (lua_State *L) {
+  int kind = luaL_checkoption(L, 1, NULL, conv_names);
+  conv_state *s = (conv_state *)lua_newuserdata(L, sizeof(conv_state));
+
+  memset(s, 0, sizeof(*s));
+  s->kind = kind;
+  luaL_getmetatable(L, ENCODER_STREAM_METATABLE);
+  lua_setmetatable(L, -2);
   return 1;
 }
 
-#define DECLARE_FUNCTION(f) static int encoder_ ## f (lua_State *L) \
-{ return do_func(L, f); }
+// Lua: output_string = stream:write(input_string)
+static int encoder_stream_write (lua_State *L) {
+  conv_state *s = (conv_state *)luaL_checkudata(L, 1, ENCODER_STREAM_METATABLE);
+  size_t len;
+  const uint8 *input = (const uint8 *)luaL_checklstring(L, 2, &len);
+  luaL_Buffer b;
+
+  luaL_buffinit(L, &b);
+  convert(L, s, &b, input, len, 0);
+  luaL_pushresult(&b);
+  return 1;
+}
 
-  DECLARE_FUNCTION(fromBase64);
-  DECLARE_FUNCTION(toBase64);
-  DECLARE_FUNCTION(fromHex);
-  DECLARE_FUNCTION(toHex);
+// Lua: output_string = stream:finish()
+static int encoder_stream_finish (lua_State *L) {
+  conv_state *s = (conv_state *)luaL_checkudata(L, 1, ENCODER_STREAM_METATABLE);
+  luaL_Buffer b;
+
+  luaL_buffinit(L, &b);
+  convert(L, s, &b, NULL, 0, 1);
+  luaL_pushresult(&b);
+  s->ncarry = s->padded = 0;   // ready for the next conversion
+  return 1;
+}
+
+LROT_BEGIN(encoder_stream_map, NULL, LROT_MASK_INDEX)
+  LROT_TABENTRY( __index, encoder_stream_map )
+  LROT_FUNCENTRY( write, encoder_stream_write )
+  LROT_FUNCENTRY( finish, encoder_stream_finish )
+LROT_END(encoder_stream_map, NULL, LROT_MASK_INDEX)
 
 // Module function map
 LROT_BEGIN(encoder, NULL, 0)
@@ -158,7 +293,13 @@ LROT_BEGIN(encoder, NULL, 0)
   LROT_FUNCENTRY( toBase64, encoder_toBase64 )
   LROT_FUNCENTRY( fromHex, encoder_fromHex )
   LROT_FUNCENTRY( toHex, encoder_toHex )
+  LROT_FUNCENTRY( stream, encoder_stream )
 LROT_END(encoder, NULL, 0)
 
+int luaopen_encoder(lua_State *L) {
+  luaL_rometatable(L, ENCODER_STREAM_METATABLE, LROT_TABLEREF(encoder_stream_map));
+  lua_pushrotable(L, LROT_TABLEREF(encoder));
+  return 1;
+}
 
-NODEMCU_MODULE(ENCODER, "encoder", encoder, NULL);
+NODEMCU_MODULE(ENCODER, "encoder", encoder, luaopen_encoder);
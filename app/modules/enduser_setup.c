@@ -56,6 +56,12 @@
 #define ENDUSER_SETUP_DEBUG_SHOW_HTTP_REQUEST 0
 
 
+/* How long the result of a Wi-Fi scan is served to /aplist before scanning again */
+#define ENDUSER_SETUP_APLIST_TTL_MS 10000
+
+/* The largest piece of the portal page read from SPIFFS at a time */
+#define ENDUSER_SETUP_STREAM_CHUNK  512
+
 #define MIN(x, y)  (((x) < (y)) ? (x) : (y))
 #define LITLEN(strliteral) (sizeof (strliteral) -1)
 #define STRINGIFY(x) #x
@@ -129,12 +135,25 @@ typedef struct {
   char data[0];
 } http_request_buffer_t;
 
+/* A prebuilt HTTP response, along with the station status it reports */
+typedef struct {
+  char *data;
+  uint16_t len;
+  uint8_t status;
+} cached_response_t;
+
 typedef struct
 {
   struct espconn *espconn_dns_udp;
   struct tcp_pcb *http_pcb;
-  char *http_payload_data;
-  uint32_t http_payload_len;
+  char *http_html_header;     /* the response header for the portal page */
+  uint32_t http_html_header_len;
+  int http_html_fd;           /* the page in SPIFFS, or 0 for the built-in one */
+  uint32_t http_html_len;
+  cached_response_t status_rsp;
+  cached_response_t status_json_rsp;
+  cached_response_t aplist_rsp;
+  uint32_t aplist_time;       /* system_get_time() of the scan in aplist_rsp */
   char *ap_ssid;
   os_timer_t check_station_timer;
   os_timer_t shutdown_timer;
@@ -163,6 +182,7 @@ static void enduser_setup_ap_start(void);
 static void enduser_setup_ap_stop(void);
 static void enduser_setup_check_station(void *p);
 static void enduser_setup_debug(int line, const char *str);
+static void enduser_setup_invalidate_status(void);
 
 static char ipaddr[16];
 
@@ -442,9 +462,32 @@ static int enduser_setup_get_lenth_of_param_value(const char *str)
   }
 }
 
+/* Open a page in SPIFFS and find its length, or return 0 */
+static int enduser_setup_http_open_payload(const char *name, int *len)
+{
+  int f = vfs_open(name, "r");
+
+  if (f)
+  {
+    int err = vfs_lseek(f, 0, VFS_SEEK_END);
+    *len = (int) vfs_tell(f);
+    if (err == VFS_RES_ERR || vfs_lseek(f, 0, VFS_SEEK_SET) == VFS_RES_ERR)
+    {
+      vfs_close(f);
+      f = 0;
+    }
+  }
+
+  return f;
+}
+
 /**
  * Load HTTP Payload
  *
+ * Finds the portal page and builds its response header once.  The page
+ * itself is streamed to each client from SPIFFS or from the built-in copy
+ * by streamout_sent(), so it is never held in RAM.
+ *
  * @return - 0 if payload loaded successfully
  *           1 if default html was loaded
  *           2 if out of memory
@@ -453,125 +496,54 @@ static int enduser_setup_http_load_payload(void)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_http_load_payload");
 
-  int err = VFS_RES_ERR;
-  int err2 = VFS_RES_ERR;
+  int ret = 0;
   int file_len = 0;
+  bool gzipped;
 
-  /* Try to open enduser_setup.html.gz from SPIFFS first */
-  int f = vfs_open(http_html_gz_filename, "r");
-
-  if (f)
+  /* Try to open enduser_setup.html.gz from SPIFFS first, then enduser_setup.html */
+  int f = enduser_setup_http_open_payload(http_html_gz_filename, &file_len);
+  if (!f)
   {
-      err = vfs_lseek(f, 0, VFS_SEEK_END);
-      file_len = (int) vfs_tell(f);
-      err2 = vfs_lseek(f, 0, VFS_SEEK_SET);
+    f = enduser_setup_http_open_payload(http_html_filename, &file_len);
   }
 
-  if (!f || err == VFS_RES_ERR || err2 == VFS_RES_ERR)
+  if (f)
   {
-    if (f)
-    {
-      vfs_close(f);
-    }
-
-    /* If that didn't work, try to open enduser_setup.html from SPIFFS */
-    f = vfs_open(http_html_filename, "r");
-
-    if (f)
-    {
-        err = vfs_lseek(f, 0, VFS_SEEK_END);
-        file_len = (int) vfs_tell(f);
-        err2 = vfs_lseek(f, 0, VFS_SEEK_SET);
-    }
+    char magic[2];
+    gzipped = vfs_read(f, magic, 2) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
   }
-
-  char cl_hdr[30];
-  size_t ce_len = 0;
-
-  sprintf(cl_hdr, http_header_content_len_fmt, file_len);
-  size_t cl_len = strlen(cl_hdr);
-
-  if (!f || err == VFS_RES_ERR || err2 == VFS_RES_ERR)
+  else
   {
     ENDUSER_SETUP_DEBUG("Unable to load file enduser_setup.html, loading default HTML...");
-
-    if (f)
-    {
-      vfs_close(f);
-    }
-
-    sprintf(cl_hdr, http_header_content_len_fmt, sizeof(enduser_setup_html_default));
-    cl_len = strlen(cl_hdr);
-    int html_len = LITLEN(enduser_setup_html_default);
-
-    if (enduser_setup_html_default[0] == 0x1f && enduser_setup_html_default[1] == 0x8b)
-    {
-        ce_len = strlen(http_html_gzip_contentencoding);
-        html_len = enduser_setup_html_default_len; /* Defined in enduser_setup/enduser_setup.html.gz.def.h by xxd -i */
-        ENDUSER_SETUP_DEBUG("Content is gzipped");
-    }
-
-    int payload_len = LITLEN(http_header_200) + cl_len + ce_len + html_len;
-    state->http_payload_len = payload_len;
-    state->http_payload_data = (char *) malloc(payload_len);
-
-    if (state->http_payload_data == NULL)
-    {
-      return 2;
-    }
-
-    int offset = 0;
-    memcpy(&(state->http_payload_data[offset]), &(http_header_200), LITLEN(http_header_200));
-    offset += LITLEN(http_header_200);
-
-    if (ce_len > 0)
-    {
-        offset += sprintf(state->http_payload_data + offset, http_html_gzip_contentencoding, ce_len);
-    }
-
-    memcpy(&(state->http_payload_data[offset]), &(cl_hdr), cl_len);
-    offset += cl_len;
-    memcpy(&(state->http_payload_data[offset]), &(enduser_setup_html_default), sizeof(enduser_setup_html_default));
-
-    return 1;
+    file_len = sizeof(enduser_setup_html_default);
+    gzipped = enduser_setup_html_default[0] == 0x1f && enduser_setup_html_default[1] == 0x8b;
+    ret = 1;
   }
 
-  char magic[2];
-  vfs_read(f, magic, 2);
-
-  if (magic[0] == 0x1f && magic[1] == 0x8b)
+  if (gzipped)
   {
-    ce_len = strlen(http_html_gzip_contentencoding);
     ENDUSER_SETUP_DEBUG("Content is gzipped");
   }
 
-  int payload_len = LITLEN(http_header_200) + cl_len + ce_len + file_len;
-  state->http_payload_len = payload_len;
-  state->http_payload_data = (char *) malloc(payload_len);
-
-  if (state->http_payload_data == NULL)
+  char *header = malloc(LITLEN(http_header_200) + LITLEN(http_html_gzip_contentencoding) + 30);
+  if (header == NULL)
   {
+    if (f)
+    {
+      vfs_close(f);
+    }
     return 2;
   }
 
-  vfs_lseek(f, 0, VFS_SEEK_SET);
-
-  int offset = 0;
+  int header_len = sprintf(header, "%s%s", http_header_200, gzipped ? http_html_gzip_contentencoding : "");
+  header_len += sprintf(header + header_len, http_header_content_len_fmt, file_len);
 
-  memcpy(&(state->http_payload_data[offset]), &(http_header_200), LITLEN(http_header_200));
-  offset += LITLEN(http_header_200);
+  state->http_html_header = header;
+  state->http_html_header_len = header_len;
+  state->http_html_fd = f;
+  state->http_html_len = file_len;
 
-  if (ce_len > 0)
-  {
-    offset += sprintf(state->http_payload_data + offset, http_html_gzip_contentencoding, ce_len);
-  }
-
-  memcpy(&(state->http_payload_data[offset]), &(cl_hdr), cl_len);
-  offset += cl_len;
-  vfs_read(f, &(state->http_payload_data[offset]), file_len);
-  vfs_close(f);
-
-  return 0;
+  return ret;
 }
 
 
@@ -831,6 +803,7 @@ static int enduser_setup_http_handle_credentials(char *data, unsigned short data
 
   state->success = 0;
   state->lastStationStatus = 0;
+  enduser_setup_invalidate_status();
 
 
   char *name_str = strstr(data, "wifi_ssid=");
@@ -907,6 +880,7 @@ static int enduser_setup_http_serve_header(struct tcp_pcb *http_client, const ch
 }
 
 
+/* Send the next part of the portal page, as much as the send buffer has room for */
 static err_t streamout_sent (void *arg, struct tcp_pcb *pcb, u16_t len)
 {
   ENDUSER_SETUP_DEBUG("streamout_sent");
@@ -914,34 +888,64 @@ static err_t streamout_sent (void *arg, struct tcp_pcb *pcb, u16_t len)
   (void)len;
   unsigned offs = (unsigned)arg;
 
-  if (!state || !state->http_payload_data)
+  if (!state || !state->http_html_header)
   {
     tcp_abort (pcb);
     return ERR_ABRT;
   }
 
-  unsigned wanted_len = state->http_payload_len - offs;
+  unsigned hdr_len = state->http_html_header_len;
+  unsigned total_len = hdr_len + state->http_html_len;
   unsigned buf_free = tcp_sndbuf (pcb);
-  if (buf_free < wanted_len)
-    wanted_len = buf_free;
+  char chunk[ENDUSER_SETUP_STREAM_CHUNK];
 
-  /* no-copy write */
-  err_t err = tcp_write (pcb, state->http_payload_data + offs, wanted_len, 0);
-  if (err != ERR_OK)
+  while (offs < total_len && buf_free > 0)
   {
-    ENDUSER_SETUP_DEBUG("streaming out html failed");
-    tcp_abort (pcb);
-    return ERR_ABRT;
-  }
+    const char *src;
+    unsigned n;
+
+    if (offs < hdr_len)
+    {
+      src = state->http_html_header + offs;
+      n = MIN(hdr_len - offs, buf_free);
+    }
+    else if (state->http_html_fd)
+    {
+      n = MIN(MIN(total_len - offs, buf_free), sizeof(chunk));
+      if (vfs_lseek(state->http_html_fd, offs - hdr_len, VFS_SEEK_SET) == VFS_RES_ERR ||
+          vfs_read(state->http_html_fd, chunk, n) != n)
+      {
+        ENDUSER_SETUP_DEBUG("reading html failed");
+        tcp_abort (pcb);
+        return ERR_ABRT;
+      }
+      src = chunk;
+    }
+    else
+    {
+      src = enduser_setup_html_default + (offs - hdr_len);
+      n = MIN(total_len - offs, buf_free);
+    }
+
+    u8_t flags = TCP_WRITE_FLAG_COPY | (offs + n < total_len ? TCP_WRITE_FLAG_MORE : 0);
+    if (tcp_write (pcb, src, n, flags) != ERR_OK)
+    {
+      /* Out of segments for now; the next sent callback carries on */
+      if (pcb->unsent || pcb->unacked)
+        break;
+      ENDUSER_SETUP_DEBUG("streaming out html failed");
+      tcp_abort (pcb);
+      return ERR_ABRT;
+    }
 
-  offs += wanted_len;
+    offs += n;
+    buf_free -= n;
+  }
 
-  if (offs >= state->http_payload_len)
+  if (offs >= total_len)
   {
     tcp_sent (pcb, 0);
     deferred_close (pcb);
-    free(state->http_payload_data);
-    state->http_payload_data = NULL;
   }
   else
     tcp_arg (pcb, (void *)offs);
@@ -953,29 +957,57 @@ static err_t streamout_sent (void *arg, struct tcp_pcb *pcb, u16_t len)
 /**
  * Serve HTML
  *
- * @return - return 0 if html was served successfully
+ * @return - ERR_OK if the page is being streamed out, ERR_ABRT if the
+ *           connection had to be aborted
  */
-static int enduser_setup_http_serve_html(struct tcp_pcb *http_client)
+static err_t enduser_setup_http_serve_html(struct tcp_pcb *http_client)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_http_serve_html");
 
-  if (state->http_payload_data == NULL)
+  if (state->http_html_header == NULL && enduser_setup_http_load_payload() == 2)
   {
-    enduser_setup_http_load_payload();
+    enduser_setup_http_serve_header(http_client, http_header_500, LITLEN(http_header_500));
+    deferred_close (http_client);
+    return ERR_OK;
   }
 
-  unsigned chunklen = tcp_sndbuf (http_client);
-  tcp_arg (http_client, (void *)chunklen);
   tcp_recv (http_client, 0); /* avoid confusion about the tcp_arg */
   tcp_sent (http_client, streamout_sent);
-  /* Begin the no-copy stream-out here */
-  err_t err = tcp_write (http_client, state->http_payload_data, chunklen, 0);
-  if (err != 0)
+  /* Begin the stream-out here, the sent callback continues it */
+  return streamout_sent ((void *)0, http_client, 0);
+}
+
+
+/* Serve a prebuilt response if there is one for the given station status */
+static bool enduser_setup_serve_cached(struct tcp_pcb *conn, const cached_response_t *c, uint8_t status)
+{
+  if (c->data == NULL || c->status != status)
   {
-    ENDUSER_SETUP_ERROR("http_serve_html failed. tcp_write failed", ENDUSER_SETUP_ERR_UNKOWN_ERROR, ENDUSER_SETUP_ERR_NONFATAL);
+    return false;
   }
+  enduser_setup_http_serve_header(conn, c->data, c->len);
+  return true;
+}
 
-  return 0;
+static void enduser_setup_cache_response(cached_response_t *c, const char *data, size_t len, uint8_t status)
+{
+  free(c->data);
+  c->data = malloc(len);
+  if (c->data)
+  {
+    memcpy(c->data, data, len);
+    c->len = len;
+    c->status = status;
+  }
+}
+
+/* Drop the status responses, when what they report may have changed */
+static void enduser_setup_invalidate_status(void)
+{
+  free(state->status_rsp.data);
+  state->status_rsp.data = NULL;
+  free(state->status_json_rsp.data);
+  state->status_json_rsp.data = NULL;
 }
 
 
@@ -1004,6 +1036,10 @@ static void enduser_setup_serve_status(struct tcp_pcb *conn)
 
   const size_t num_states = sizeof(states)/sizeof(states[0]);
   uint8_t curr_state = state->lastStationStatus > 0 ? state->lastStationStatus : wifi_station_get_connect_status ();
+  if (enduser_setup_serve_cached(conn, &state->status_rsp, curr_state))
+  {
+    return;
+  }
   if (curr_state < num_states)
   {
     switch (curr_state)
@@ -1042,6 +1078,7 @@ static void enduser_setup_serve_status(struct tcp_pcb *conn)
         memset(buf, 0, buf_len);
         int output_len = sprintf(buf, fmt, status_len, status_buf);
 
+        enduser_setup_cache_response(&state->status_rsp, buf, output_len, curr_state);
         enduser_setup_http_serve_header(conn, buf, output_len);
       }
       break;
@@ -1056,6 +1093,7 @@ static void enduser_setup_serve_status(struct tcp_pcb *conn)
         memset(buf, 0, buf_len);
         int output_len = sprintf(buf, fmt, status_len, s);
 
+        enduser_setup_cache_response(&state->status_rsp, buf, output_len, curr_state);
         enduser_setup_http_serve_header(conn, buf, output_len);
       }
       break;
@@ -1073,6 +1111,10 @@ static void enduser_setup_serve_status_as_json (struct tcp_pcb *http_client)
 
   /* If the station is currently shut down because of wi-fi channel issue, use the cached status */
   uint8_t curr_status = state->lastStationStatus > 0 ? state->lastStationStatus : wifi_station_get_connect_status ();
+  if (enduser_setup_serve_cached(http_client, &state->status_json_rsp, curr_status))
+  {
+    return;
+  }
 
   char json_payload[64];
 
@@ -1106,6 +1148,7 @@ static void enduser_setup_serve_status_as_json (struct tcp_pcb *http_client)
   int len = strlen(json_payload);
   char buf[strlen(fmt) + NUMLEN(len) + len - 4];
   len = sprintf (buf, fmt, len, json_payload);
+  enduser_setup_cache_response (&state->status_json_rsp, buf, len, curr_status);
   enduser_setup_http_serve_header (http_client, buf, len);
 }
 
@@ -1266,92 +1309,123 @@ static void notify_scan_listeners (const char *payload, size_t sz)
 }
 
 
-static void on_scan_done (void *arg, STATUS status)
+/* Build the /aplist response from a scan, or return NULL if out of memory */
+static char *build_aplist_response (struct bss_info *list, size_t *len)
 {
-  ENDUSER_SETUP_DEBUG("on_scan_done");
+  unsigned num_nets = 0;
+  for (struct bss_info *wn = list; wn; wn = wn->next.stqe_next)
+  {
+    ++num_nets;
+  }
 
-  if (!state || !state->scan_listeners)
+  const char header_fmt[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Connection:close\r\n"
+    "Cache-control:no-cache\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Content-type:application/json\r\n"
+    "Content-length:%4d\r\n"
+    "\r\n";
+  const size_t hdr_sz = sizeof (header_fmt) +1 -1; /* +expand %4d, -\0 */
+
+  /* To be able to safely escape a pathological SSID, we need 2*32 bytes */
+  const size_t max_entry_sz = 35 + 2*32 + 9; /* {"ssid":"","rssi":,"chan":,"auth":} */
+  const size_t alloc_sz = hdr_sz + num_nets * max_entry_sz + 3;
+  char *http = calloc (1, alloc_sz);
+  if (!http)
   {
-    return;
+    return NULL;
   }
 
-  if (status == OK)
+  char *p = http + hdr_sz; /* start body where we know it will be */
+  /* p[0] will be clobbered when we print the header, so fill it in last */
+  ++p;
+  for (struct bss_info *wn = list; wn; wn = wn->next.stqe_next)
   {
-    unsigned num_nets = 0;
-    for (struct bss_info *wn = arg; wn; wn = wn->next.stqe_next)
+    if (wn != list)
     {
-      ++num_nets;
+      *p++ = ',';
     }
 
-    const char header_fmt[] =
-      "HTTP/1.1 200 OK\r\n"
-      "Connection:close\r\n"
-      "Cache-control:no-cache\r\n"
-      "Access-Control-Allow-Origin: *\r\n"
-      "Content-type:application/json\r\n"
-      "Content-length:%4d\r\n"
-      "\r\n";
-    const size_t hdr_sz = sizeof (header_fmt) +1 -1; /* +expand %4d, -\0 */
-
-    /* To be able to safely escape a pathological SSID, we need 2*32 bytes */
-    const size_t max_entry_sz = 35 + 2*32 + 9; /* {"ssid":"","rssi":,"chan":,"auth":} */
-    const size_t alloc_sz = hdr_sz + num_nets * max_entry_sz + 3;
-    char *http = calloc (1, alloc_sz);
-    if (!http)
-    {
-      goto serve_500;
-    }
+    const char entry_start[] = "{\"ssid\":\"";
+    strcpy (p, entry_start);
+    p += sizeof (entry_start) -1;
 
-    char *p = http + hdr_sz; /* start body where we know it will be */
-    /* p[0] will be clobbered when we print the header, so fill it in last */
-    ++p;
-    for (struct bss_info *wn = arg; wn; wn = wn->next.stqe_next)
-    {
-      if (wn != arg)
-      {
-        *p++ = ',';
-      }
+    p = escape_ssid (p, wn->ssid);
 
-      const char entry_start[] = "{\"ssid\":\"";
-      strcpy (p, entry_start);
-      p += sizeof (entry_start) -1;
+    const char entry_mid[] = "\",\"rssi\":";
+    strcpy (p, entry_mid);
+    p += sizeof (entry_mid) -1;
 
-      p = escape_ssid (p, wn->ssid);
+    p += sprintf (p, "%d", wn->rssi);
 
-      const char entry_mid[] = "\",\"rssi\":";
-      strcpy (p, entry_mid);
-      p += sizeof (entry_mid) -1;
+    const char entry_chan[] = ",\"chan\":";
+    strcpy (p, entry_chan);
+    p += sizeof (entry_chan) -1;
 
-      p += sprintf (p, "%d", wn->rssi);
+    p += sprintf (p, "%d", wn->channel);
 
-      const char entry_chan[] = ",\"chan\":";
-      strcpy (p, entry_chan);
-      p += sizeof (entry_chan) -1;
+    const char entry_auth[] = ",\"auth\":";
+    strcpy (p, entry_auth);
+    p += sizeof (entry_auth) -1;
 
-      p += sprintf (p, "%d", wn->channel);
+    p += sprintf (p, "%d", wn->authmode);
 
-      const char entry_auth[] = ",\"auth\":";
-      strcpy (p, entry_auth);
-      p += sizeof (entry_auth) -1;
+    *p++ = '}';
+  }
+  *p++ = ']';
 
-      p += sprintf (p, "%d", wn->authmode);
+  size_t body_sz = (p - http) - hdr_sz;
+  sprintf (http, header_fmt, body_sz);
+  http[hdr_sz] = '['; /* Rewrite the \0 with the correct start of body */
 
-      *p++ = '}';
-    }
-    *p++ = ']';
+  ENDUSER_SETUP_DEBUG(http + hdr_sz);
+  *len = hdr_sz + body_sz;
+  return http;
+}
 
-    size_t body_sz = (p - http) - hdr_sz;
-    sprintf (http, header_fmt, body_sz);
-    http[hdr_sz] = '['; /* Rewrite the \0 with the correct start of body */
 
-    notify_scan_listeners (http, hdr_sz + body_sz);
-    ENDUSER_SETUP_DEBUG(http + hdr_sz);
+/* Keep a scan result to answer /aplist requests for ENDUSER_SETUP_APLIST_TTL_MS */
+static void cache_aplist (struct bss_info *list)
+{
+  size_t len;
+  char *http = build_aplist_response (list, &len);
+  if (http)
+  {
+    free (state->aplist_rsp.data);
+    state->aplist_rsp.data = http;
+    state->aplist_rsp.len = len;
+    state->aplist_time = system_get_time ();
+  }
+}
+
+
+static bool aplist_is_fresh (void)
+{
+  return state->aplist_rsp.data &&
+    system_get_time () - state->aplist_time < ENDUSER_SETUP_APLIST_TTL_MS * 1000;
+}
+
+
+static void on_scan_done (void *arg, STATUS status)
+{
+  ENDUSER_SETUP_DEBUG("on_scan_done");
 
-    free (http);
+  if (!state || !state->scan_listeners)
+  {
     return;
   }
 
-serve_500:
+  if (status == OK)
+  {
+    cache_aplist (arg);
+    if (aplist_is_fresh ())
+    {
+      notify_scan_listeners (state->aplist_rsp.data, state->aplist_rsp.len);
+      return;
+    }
+  }
+
   notify_scan_listeners (http_header_500, LITLEN(http_header_500));
 }
 
@@ -1525,19 +1599,18 @@ static err_t enduser_setup_http_recvcb(void *arg, struct tcp_pcb *http_client, s
   {
     if (strncmp(data + 4, "/ ", 2) == 0 || strncmp(data + 4, "/?", 2) == 0)
     {
-      if (enduser_setup_http_serve_html(http_client) != 0)
-      {
-        goto general_fail;
-      }
-      else
-      {
-        goto free_out; /* streaming now in progress */
-      }
+      ret = enduser_setup_http_serve_html(http_client);
+      goto free_out; /* streaming now in progress */
     }
     else if (strncmp(data + 4, "/aplist", 7) == 0)
     {
+      /* Answer from a recent scan, otherwise queue up for a new one */
+      if (aplist_is_fresh())
+      {
+        enduser_setup_http_serve_header(http_client, state->aplist_rsp.data, state->aplist_rsp.len);
+      }
       /* Don't do an AP Scan while station is trying to connect to Wi-Fi */
-      if (state->connecting == 0)
+      else if (state->connecting == 0)
       {
         scan_listener_t *sl = malloc (sizeof (scan_listener_t));
         if (!sl)
@@ -1779,6 +1852,9 @@ static void on_initial_scan_done (void *arg, STATUS status)
         rssi = wn->rssi;
       }
     }
+
+    /* and the first phones to connect get the network list straight away */
+    cache_aplist (arg);
   }
 
   enduser_setup_ap_start();
@@ -1908,7 +1984,14 @@ static void enduser_setup_free(void)
     free(state->espconn_dns_udp);
   }
 
-  free(state->http_payload_data);
+  free(state->http_html_header);
+  if (state->http_html_fd)
+  {
+    vfs_close(state->http_html_fd);
+  }
+  free(state->status_rsp.data);
+  free(state->status_json_rsp.data);
+  free(state->aplist_rsp.data);
 
   free_scan_listeners ();
 
@@ -0,0 +1,197 @@
+// Module for queueing the output of a TCP socket in C, see lua_modules/fifo/fifosock.lua
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+
+#include <string.h>
+
+#ifdef LUA_USE_MODULES_FIFOSOCK
+#if !defined(LUA_USE_MODULES_NET) || !defined(LUA_USE_MODULES_PIPE)
+#error Must have NET and PIPE if using FIFOSOCK module
+#endif
+#endif
+
+/*
+ * A drop in replacement for the fifosock Lua module. The queue is a table of
+ * pipes and functions. Consecutive strings are written into the same pipe, so
+ * they are coalesced in its chunks without being concatenated, and the chunks
+ * are handed to tcp_write() by net_send_pipe() as the send window opens: on
+ * the "sent" callback of the socket, or in a task posted by the first write so
+ * that everything written in one task goes out together. A function in the
+ * queue is called once everything ahead of it has been acknowledged, and the
+ * string that it returns is queued in its place, ahead of the rest.
+ *
+ * The send function and the "sent" callback are C closures sharing, as
+ * upvalues, the state, the socket and the queue table (Lua 5.1 C closures
+ * cannot share upvalues as such).
+ */
+
+extern int pipe_create(lua_State *L);
+extern int pipe_drain(lua_State *L, int ndx,
+                      int (*fn)(void *, const char *, size_t), void *arg);
+extern int net_send_pipe(lua_State *L, int ndx, int pndx);
+
+#define FIFOSOCK_STATE  lua_upvalueindex(1)
+#define FIFOSOCK_SOCK   lua_upvalueindex(2)
+#define FIFOSOCK_QUEUE  lua_upvalueindex(3)
+
+typedef struct {
+  int head, tail;          // the queue is in [head, tail] of the table
+  int unacked;             // data has been sent since the last ack
+  int posted_ref;          // the "sent" closure while a task is posted for it
+} fifosock_t;
+
+static platform_task_handle_t fifosock_task_id;
+
+static void fifosock_pump(lua_State *L) {
+  fifosock_t *q = (fifosock_t *)lua_touserdata(L, FIFOSOCK_STATE);
+  while (q->head <= q->tail) {
+    lua_rawgeti(L, FIFOSOCK_QUEUE, q->head);
+    if (lua_isfunction(L, -1)) {
+      if (q->unacked) {           // wait for what is ahead of it to be acked
+        lua_pop(L, 1);
+        break;
+      }
+      lua_call(L, 0, 2);                            // s, ns = f()
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, FIFOSOCK_QUEUE, q->head);    // ns or nil takes its place
+      if (lua_isnil(L, -1))
+        q->head++;
+      size_t l = 0;
+      if (lua_isstring(L, -2) && (lua_tolstring(L, -2, &l), l)) {
+        lua_pushcfunction(L, pipe_create);
+        lua_call(L, 0, 1);
+        lua_rawgeti(L, -1, 1);                    // pipe:write(s)
+        lua_pushvalue(L, -2);
+        lua_pushvalue(L, -5);
+        lua_call(L, 2, 0);
+        lua_rawseti(L, FIFOSOCK_QUEUE, --q->head);
+      }
+      lua_pop(L, 2);
+      continue;
+    }
+    int n = net_send_pipe(L, FIFOSOCK_SOCK, -1);
+    if (n < 0) {                  // the socket has gone, so drop the queue
+      lua_pop(L, 1);
+      for (; q->head <= q->tail; q->head++) {
+        lua_pushnil(L);
+        lua_rawseti(L, FIFOSOCK_QUEUE, q->head);
+      }
+      break;
+    }
+    if (n)
+      q->unacked = 1;
+    int left = pipe_drain(L, -1, NULL, NULL);
+    lua_pop(L, 1);
+    if (left)
+      break;                              // the send buffer is full for now
+    lua_pushnil(L);
+    lua_rawseti(L, FIFOSOCK_QUEUE, q->head++);
+  }
+  if (q->head > q->tail)
+    q->head = 1, q->tail = 0;
+}
+
+// The "sent" callback of the socket, and called with no arguments by the task
+static int fifosock_sent(lua_State *L) {
+  fifosock_t *q = (fifosock_t *)lua_touserdata(L, FIFOSOCK_STATE);
+  if (lua_gettop(L))
+    q->unacked = 0;
+  fifosock_pump(L);
+  return 0;
+}
+
+static void fifosock_task(platform_task_param_t param, uint8_t prio) {
+  (void) prio;
+  lua_State *L = lua_getstate();
+  lua_rawgeti(L, LUA_REGISTRYINDEX, (int)param);
+  luaL_unref(L, LUA_REGISTRYINDEX, (int)param);
+  if (lua_getupvalue(L, -1, 1)) {
+    ((fifosock_t *)lua_touserdata(L, -1))->posted_ref = LUA_NOREF;
+    lua_pop(L, 1);
+  }
+  luaL_pcallx(L, 0, 0);
+}
+
+// Lua: ssend(string or function)
+static int fifosock_send(lua_State *L) {
+  fifosock_t *q = (fifosock_t *)lua_touserdata(L, FIFOSOCK_STATE);
+  lua_settop(L, 1);
+  if (lua_isnil(L, 1))
+    return 0;
+  if (lua_isfunction(L, 1)) {
+    lua_rawseti(L, FIFOSOCK_QUEUE, ++q->tail);
+  } else {
+    size_t l;
+    if (!lua_isstring(L, 1)) {                          // as tostring(s) would
+      lua_getglobal(L, "tostring");
+      lua_insert(L, 1);
+      lua_call(L, 1, 1);
+    }
+    if (!lua_tolstring(L, 1, &l) || !l)
+      return 0;
+    lua_rawgeti(L, FIFOSOCK_QUEUE, q->tail);
+    if (q->head > q->tail || !lua_istable(L, -1)) {  // a new pipe at the tail
+      lua_pop(L, 1);
+      lua_pushcfunction(L, pipe_create);
+      lua_call(L, 0, 1);
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, FIFOSOCK_QUEUE, ++q->tail);
+    }
+    lua_rawgeti(L, -1, 1);                        // pipe:write(s)
+    lua_insert(L, -2);
+    lua_pushvalue(L, -3);
+    lua_call(L, 2, 0);
+  }
+  if (q->posted_ref == LUA_NOREF && !q->unacked) {
+    lua_pushvalue(L, FIFOSOCK_STATE);
+    lua_pushvalue(L, FIFOSOCK_SOCK);
+    lua_pushvalue(L, FIFOSOCK_QUEUE);
+    lua_pushcclosure(L, fifosock_sent, 3);
+    q->posted_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (!platform_post_low(fifosock_task_id, q->posted_ref)) {
+      luaL_unref(L, LUA_REGISTRYINDEX, q->posted_ref);
+      q->posted_ref = LUA_NOREF;
+      fifosock_pump(L);
+    }
+  }
+  return 0;
+}
+
+// Lua: ssend = fifosock.wrap(sock)
+static int fifosock_wrap(lua_State *L) {
+  lua_settop(L, 1);
+  luaL_checktype(L, 1, LUA_TUSERDATA);
+  fifosock_t *q = (fifosock_t *)lua_newuserdata(L, sizeof(fifosock_t));
+  q->head = 1;
+  q->tail = 0;
+  q->unacked = 0;
+  q->posted_ref = LUA_NOREF;
+  lua_pushvalue(L, 1);
+  lua_newtable(L);
+
+  lua_getfield(L, 1, "on");                          // sock:on("sent", sent)
+  lua_pushvalue(L, 1);
+  lua_pushliteral(L, "sent");
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_pushvalue(L, 4);
+  lua_pushcclosure(L, fifosock_sent, 3);
+  lua_call(L, 3, 0);
+
+  lua_pushcclosure(L, fifosock_send, 3);
+  return 1;
+}
+
+static int fifosock_open(lua_State *L) {
+  (void) L;
+  fifosock_task_id = platform_task_get_id(fifosock_task);
+  return 0;
+}
+
+LROT_BEGIN(fifosock, NULL, 0)
+  LROT_FUNCENTRY( wrap, fifosock_wrap )
+LROT_END(fifosock, NULL, 0)
+
+NODEMCU_MODULE(FIFOSOCK, "fifosock", fifosock, fifosock_open);
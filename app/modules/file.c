@@ -7,12 +7,14 @@
 #include "spiffs/nodemcu_spiffs.h"
 
 #include <stdint.h>
+#include <stdlib.h>
 #include "vfs.h"
 #include <string.h>
 
 #include <alloca.h>
 
 #define FILE_READ_CHUNK 1024
+#define FILE_ASYNC_CHUNK 512    // bytes moved per task run by read_async/write_async
 
 // use this time/date in absence of a timestamp
 #define FILE_TIMEDEF_YEAR 1970
@@ -197,7 +199,124 @@ static int file_fscfg (lua_State *L)
   return 2;
 }
 
-// Lua: open(filename, mode)
+#ifdef BUILD_SPIFFS
+// Lua: t = file.stats()
+static int file_stats (lua_State *L)
+{
+  myspiffs_stats_t st;
+
+  myspiffs_get_stats(&st);
+  lua_createtable (L, 0, 16);
+  lua_pushinteger (L, st.cache_pages);
+  lua_setfield (L, -2, "cache_pages");
+  lua_pushinteger (L, st.cache_hits);
+  lua_setfield (L, -2, "cache_hits");
+  lua_pushinteger (L, st.cache_misses);
+  lua_setfield (L, -2, "cache_misses");
+  lua_pushinteger (L, st.readahead_pages);
+  lua_setfield (L, -2, "readahead_pages");
+  lua_pushinteger (L, st.readahead_hits);
+  lua_setfield (L, -2, "readahead_hits");
+  lua_pushinteger (L, st.flash_reads);
+  lua_setfield (L, -2, "flash_reads");
+  lua_pushinteger (L, st.idle_gc_blocks);
+  lua_setfield (L, -2, "idle_gc_blocks");
+  lua_pushinteger (L, st.idle_gc_runs);
+  lua_setfield (L, -2, "idle_gc_runs");
+  lua_pushinteger (L, st.gc_runs);
+  lua_setfield (L, -2, "gc_runs");
+  lua_pushinteger (L, st.gc_waits);
+  lua_setfield (L, -2, "gc_waits");
+  lua_pushinteger (L, st.gc_time_us);
+  lua_setfield (L, -2, "gc_time_us");
+  lua_pushinteger (L, st.gc_max_us);
+  lua_setfield (L, -2, "gc_max_us");
+  lua_pushinteger (L, st.written);
+  lua_setfield (L, -2, "written");
+  lua_pushinteger (L, st.flash_written);
+  lua_setfield (L, -2, "flash_written");
+  lua_pushinteger (L, st.flash_erases);
+  lua_setfield (L, -2, "flash_erases");
+  lua_pushinteger (L, st.erase_count);
+  lua_setfield (L, -2, "erase_count");
+  return 1;
+}
+
+// Lua: t = file.wear([width])
+static int file_wear (lua_State *L)
+{
+  int width = luaL_optint (L, 1, 0);
+  const uint8_t *erases;
+  int i, n, buckets, erased = 0, total = 0;
+
+  luaL_argcheck (L, width >= 0, 1, "invalid width");
+  n = myspiffs_get_wear (NULL, NULL);
+  if (n == 0)
+    return luaL_error (L, "file system not mounted");
+  int32_t *age = (int32_t *)lua_newuserdata (L, n * sizeof(int32_t));
+  myspiffs_get_wear (age, &erases);
+  if (width == 0)
+    width = n;
+
+  lua_createtable (L, 0, 4);
+  lua_createtable (L, n, 0);
+  buckets = 0;
+  for (i = 0; i < n; i++) {
+    lua_pushinteger (L, age[i]);
+    lua_rawseti (L, -2, i + 1);
+    if (age[i] >= 0 && age[i] / width + 1 > buckets)
+      buckets = age[i] / width + 1;
+  }
+  lua_setfield (L, -2, "age");
+
+  // ages in buckets of width blocks, leaving out blocks never erased
+  lua_createtable (L, buckets, 0);
+  for (i = 1; i <= buckets; i++) {
+    lua_pushinteger (L, 0);
+    lua_rawseti (L, -2, i);
+  }
+  for (i = 0; i < n; i++) {
+    if (age[i] >= 0) {
+      lua_rawgeti (L, -1, age[i] / width + 1);
+      lua_pushinteger (L, lua_tointeger (L, -1) + 1);
+      lua_rawseti (L, -3, age[i] / width + 1);
+      lua_pop (L, 1);
+    }
+  }
+  lua_setfield (L, -2, "hist");
+
+  if (erases) {
+    lua_createtable (L, n, 0);
+    for (i = 0; i < n; i++) {
+      lua_pushinteger (L, erases[i]);
+      lua_rawseti (L, -2, i + 1);
+      total += erases[i];
+    }
+    lua_setfield (L, -2, "erases");
+
+    // blocks erased at least 4 times and more than twice as often as the average
+    lua_newtable (L);
+    for (i = 0; i < n; i++) {
+      if (erases[i] >= 4 && erases[i] * n > 2 * total) {
+        lua_pushinteger (L, i + 1);
+        lua_rawseti (L, -2, ++erased);
+      }
+    }
+    lua_setfield (L, -2, "hot");
+  }
+  return 1;
+}
+#endif
+
+static int opt_field( lua_State *L, int idx, const char *key, int dflt )
+{
+  lua_getfield( L, idx, key );
+  int v = luaL_optint( L, -1, dflt );
+  lua_pop( L, 1 );
+  return v;
+}
+
+// Lua: open(filename, mode[, logcfg])
 static int file_open( lua_State* L )
 {
   size_t len;
@@ -211,9 +330,27 @@ static int file_open( lua_State* L )
   luaL_argcheck(L, strlen(basename) <= FS_OBJ_NAME_LEN && strlen(fname) == len, 1, "filename invalid");
 
   const char *mode = luaL_optstring(L, 2, "r");
+  int logcfg = !lua_isnoneornil(L, 3);
+  if (logcfg) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    luaL_argcheck(L, strchr(mode, 'l'), 3, "only for log modes");
+  }
 
   file_fd = vfs_open(fname, mode);
 
+  if (file_fd && logcfg) {
+    int size  = opt_field(L, 3, "bufsize", 1024);
+    int every = opt_field(L, 3, "interval", 10000);
+    int max   = opt_field(L, 3, "maxsize", 0);
+    int files = opt_field(L, 3, "files", 0);
+    if (size <= 0 || size > 0xFFFF || every < 0 || max < 0 || files < 0 || files > 255 ||
+        vfs_logcfg(file_fd, size, every, max, files) != VFS_RES_OK) {
+      vfs_close(file_fd);
+      file_fd = 0;
+      return luaL_argerror(L, 3, "invalid log settings");
+    }
+  }
+
   if(!file_fd){
     lua_pushnil(L);
   } else {
@@ -230,12 +367,16 @@ static int file_open( lua_State* L )
 }
 
 // Lua: list()
+#define FILE_LIST_BATCH 4
 static int file_list( lua_State* L )
 {
   vfs_dir  *dir;
-  const char *pattern;
-  struct vfs_stat stat;
-  int pcres;
+  const char *pattern, *rec, *end;
+  struct vfs_stat stat[FILE_LIST_BATCH];
+  luaL_Buffer b;
+  size_t len;
+  int32_t i, got;
+  int n = 0, pcres;
 
   lua_settop(L, 1);
   pattern = luaL_optstring(L, 1, NULL);   /* Pattern (arg) or nil (not) at 1 */
@@ -244,41 +385,182 @@ static int file_list( lua_State* L )
   if (dir == NULL) {
     return 0;
   }
+  /*
+   * Read the directory once, packing each entry as its name, a NUL and its
+   * size into a buffer, so that the table is only sized once
+   */
+  luaL_buffinit( L, &b );
+  do {
+    got = vfs_readdir_batch( dir, stat, FILE_LIST_BATCH );
+    for (i = 0; i < got; i++) {
+      uint32_t size = stat[i].size;
+      luaL_addlstring( &b, stat[i].name, strlen( stat[i].name ) + 1 );
+      luaL_addlstring( &b, (const char *)&size, sizeof( size ) );
+    }
+    n += got;
+  } while (got == FILE_LIST_BATCH);
+  vfs_closedir(dir);
+  luaL_pushresult( &b );                  /* Entries at 2 */
+  rec = lua_tolstring( L, 2, &len );
+  end = rec + len;
 
-  lua_newtable( L );                      /* Table at 2 */
+  lua_createtable( L, 0, n );             /* Table at 3 */
 
   if (pattern) {
     /*
      * We know that pattern is a string, and so the "match" method will always
      * exist.  No need to check return value here
      */
-    luaL_getmetafield( L, 1, "match" );  /* Function at 3 */
+    luaL_getmetafield( L, 1, "match" );  /* Function at 4 */
   }
 
-  while (vfs_readdir(dir, &stat) == VFS_RES_OK) {
+  for (; rec < end; rec += strlen( rec ) + 1 + sizeof( uint32_t )) {
+    const char *name = rec;
+    uint32_t size;
+    memcpy( &size, rec + strlen( rec ) + 1, sizeof( size ) );
     if (pattern) {
-      lua_settop( L, 3 );                 /* Ensure nothing else on stack */
+      lua_settop( L, 4 );                 /* Ensure nothing else on stack */
 
       /* Construct and pcall(string.match,name,pattern) */
-      lua_pushvalue( L, 3 );
-      lua_pushstring( L, stat.name );
+      lua_pushvalue( L, 4 );
+      lua_pushstring( L, name );
       lua_pushvalue( L, 1 );
       pcres = lua_pcall( L, 2, 1, 0 );
       if (pcres != 0) {
-        vfs_closedir(dir);
         lua_error( L );
       }
       if (lua_isnil( L, -1 )) {
         continue;
       }
     }
-    lua_pushinteger( L, stat.size );
-    lua_setfield( L, 2, stat.name );
+    lua_pushinteger( L, size );
+    lua_setfield( L, 3, name );
   }
 
   /* Shed everything back to Table */
-  lua_settop( L, 2 );
-  vfs_closedir(dir);
+  lua_settop( L, 3 );
+  return 1;
+}
+
+typedef struct {
+  vfs_dir *dir;
+  int skip;                               // matches still to pass over
+  int left;                               // matches still to return, or -1
+} file_iter_ud;
+
+/*
+ * Shell style match of name against pattern: '*' any run of characters, '?'
+ * any one, "[a-z0-9]" one of a set, "[!...]" one not in it.  A '*' that fails
+ * later is retried one character further on, so this never recurses.
+ */
+static int file_glob( const char *p, const char *s )
+{
+  const char *star_p = NULL, *star_s = NULL;
+
+  while (*s) {
+    if (*p == '*') {
+      star_p = ++p;
+      star_s = s;
+      continue;
+    }
+    if (*p == '[') {
+      const char *q = p + 1;
+      int neg = (*q == '!'), hit = 0;
+      if (neg) q++;
+      while (*q && *q != ']') {
+        if (q[1] == '-' && q[2] && q[2] != ']') {
+          hit |= (unsigned char)*s >= (unsigned char)q[0] &&
+                 (unsigned char)*s <= (unsigned char)q[2];
+          q += 3;
+        } else {
+          hit |= (*s == *q++);
+        }
+      }
+      if (*q && hit != neg) {
+        p = q + 1;
+        s++;
+        continue;
+      }
+    } else if (*p && (*p == '?' || *p == *s)) {
+      p++;
+      s++;
+      continue;
+    }
+    if (!star_p) {
+      return 0;
+    }
+    p = star_p;
+    s = ++star_s;
+  }
+  while (*p == '*') {
+    p++;
+  }
+  return *p == 0;
+}
+
+static int file_iter_free( lua_State *L )
+{
+  file_iter_ud *ud = (file_iter_ud *)luaL_checkudata(L, 1, "file.dir");
+  if (ud->dir) {
+    vfs_closedir(ud->dir);
+    ud->dir = NULL;
+  }
+  return 0;
+}
+
+static int file_iter_next( lua_State *L )
+{
+  file_iter_ud *ud = (file_iter_ud *)lua_touserdata(L, lua_upvalueindex(1));
+  const char *pattern = lua_tostring(L, lua_upvalueindex(2));
+  struct vfs_stat stat;
+
+  while (ud->dir && ud->left != 0 && vfs_readdir(ud->dir, &stat) == VFS_RES_OK) {
+    if (pattern && !file_glob(pattern, stat.name)) {
+      continue;
+    }
+    if (ud->skip > 0) {
+      ud->skip--;
+      continue;
+    }
+    if (ud->left > 0) {
+      ud->left--;
+    }
+    lua_pushstring(L, stat.name);
+    lua_pushinteger(L, stat.size);
+    return 2;
+  }
+  // done, let the directory go now rather than at the next collection
+  if (ud->dir) {
+    vfs_closedir(ud->dir);
+    ud->dir = NULL;
+  }
+  return 0;
+}
+
+// Lua: iter([pattern[, skip[, count]]])
+static int file_iter( lua_State* L )
+{
+  const char *pattern = luaL_optstring(L, 1, NULL);
+  int skip  = luaL_optinteger(L, 2, 0);
+  int count = luaL_optinteger(L, 3, -1);
+  luaL_argcheck(L, skip >= 0, 2, "negative skip");
+  luaL_argcheck(L, count >= -1, 3, "invalid count");
+  lua_settop(L, 1);
+
+  file_iter_ud *ud = (file_iter_ud *)lua_newuserdata(L, sizeof(file_iter_ud));
+  ud->dir = NULL;
+  ud->skip = skip;
+  ud->left = count;
+  luaL_getmetatable(L, "file.dir");
+  lua_setmetatable(L, -2);
+  ud->dir = vfs_opendir("");             // NULL gives an empty iteration
+
+  if (pattern) {
+    lua_pushvalue(L, 1);
+  } else {
+    lua_pushnil(L);
+  }
+  lua_pushcclosure(L, file_iter_next, 2);
   return 1;
 }
 
@@ -354,6 +636,131 @@ static int file_flush( lua_State* L )
   return 1;
 }
 
+/*
+ * Asynchronous reads and writes are queued and run FILE_ASYNC_CHUNK bytes
+ * per low priority task, so callbacks and network traffic get a turn
+ * between chunks.  The queue is shared by all files, which keeps the
+ * transfers on one file in the order they were issued.
+ */
+typedef struct file_job {
+  struct file_job *next;
+  int obj_ref;          // the file object, kept alive until completion
+  int cb_ref;
+  int data_ref;         // string being written, LUA_NOREF for reads
+  const char *data;
+  char *buf;            // read buffer, NULL for writes
+  size_t len, done;
+} file_job;
+
+static file_job *job_head, *job_tail;
+static platform_task_handle_t file_async_task_id;
+
+static void file_async_task( platform_task_param_t param, uint8_t prio )
+{
+  (void)param; (void)prio;
+  file_job *j = job_head;
+  if (!j)
+    return;
+
+  lua_State *L = lua_getstate();
+  lua_rawgeti(L, LUA_REGISTRYINDEX, j->obj_ref);
+  int fd = ((file_fd_ud *)lua_touserdata(L, -1))->fd;
+  lua_pop(L, 1);
+
+  size_t n = j->len - j->done;
+  if (n > FILE_ASYNC_CHUNK)
+    n = FILE_ASYNC_CHUNK;
+  int32_t res = !fd ? VFS_RES_ERR :
+                j->buf ? vfs_read(fd, j->buf + j->done, n) : vfs_write(fd, j->data + j->done, n);
+  if (res > 0)
+    j->done += res;
+  int failed = res < 0 || (!j->buf && res != n);
+  if (!failed && res == n && j->done < j->len) {
+    platform_post_low(file_async_task_id, 0);
+    return;
+  }
+
+  // finished, short read at end of file or failed
+  if (!(job_head = j->next))
+    job_tail = NULL;
+  else
+    platform_post_low(file_async_task_id, 0);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, j->cb_ref);
+  if (failed || (j->buf && j->done == 0))
+    lua_pushnil(L);
+  else if (j->buf)
+    lua_pushlstring(L, j->buf, j->done);
+  else
+    lua_pushinteger(L, j->done);
+  luaL_unref(L, LUA_REGISTRYINDEX, j->obj_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, j->cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, j->data_ref);
+  free(j->buf);
+  free(j);
+  luaL_pcallx(L, 1, 0);
+}
+
+static int file_async_queue( lua_State *L, file_job *j )
+{
+  lua_pushvalue(L, 1);
+  j->obj_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 3);
+  j->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  j->next = NULL;
+  j->done = 0;
+  if (job_tail) {
+    job_tail->next = j;
+  } else {
+    job_head = j;
+    platform_post_low(file_async_task_id, 0);
+  }
+  job_tail = j;
+  return 0;
+}
+
+// Lua: obj:read_async(n, function(data) end)
+static int file_read_async( lua_State* L )
+{
+  file_fd_ud *ud = (file_fd_ud *)luaL_checkudata(L, 1, "file.obj");
+  int n = luaL_checkinteger(L, 2);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  luaL_argcheck(L, n > 0, 2, "should be a positive integer");
+  if (!ud->fd)
+    return luaL_error(L, "open a file first");
+
+  file_job *j = (file_job *)malloc(sizeof(file_job));
+  if (!j || !(j->buf = (char *)malloc(n))) {
+    free(j);
+    return luaL_error(L, "out of memory");
+  }
+  j->data_ref = LUA_NOREF;
+  j->data = NULL;
+  j->len = n;
+  return file_async_queue(L, j);
+}
+
+// Lua: obj:write_async("string", function(written) end)
+static int file_write_async( lua_State* L )
+{
+  file_fd_ud *ud = (file_fd_ud *)luaL_checkudata(L, 1, "file.obj");
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  if (!ud->fd)
+    return luaL_error(L, "open a file first");
+
+  file_job *j = (file_job *)malloc(sizeof(file_job));
+  if (!j)
+    return luaL_error(L, "out of memory");
+  lua_pushvalue(L, 2);   // the reference keeps data valid
+  j->data_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  j->data = data;
+  j->buf = NULL;
+  j->len = len;
+  return file_async_queue(L, j);
+}
+
 // Lua: rename("oldname", "newname")
 static int file_rename( lua_State* L )
 {
@@ -514,6 +921,28 @@ static int file_readline( lua_State* L )
 }
 
 // Lua: getfile(filename)
+// Read the rest of the file with a single read into a buffer of the right
+// size, so the heap briefly holds two copies and not a growing buffer too.
+static int file_g_readall( lua_State* L, int fd )
+{
+  int32_t size = vfs_size(fd) - vfs_tell(fd);
+
+  if (size <= 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  // a userdata rather than malloc as pushing the string may throw
+  char *p = (char *)lua_newuserdata(L, size);
+  int32_t n = vfs_read(fd, p, size);
+  if (n > 0) {
+    lua_pushlstring(L, p, n);
+  } else {
+    lua_pushnil(L);
+  }
+  lua_remove(L, -2);
+  return 1;
+}
+
 static int file_getfile( lua_State* L )
 {
   // Warning this code C calls other file_* routines to avoid duplication code.  These
@@ -527,7 +956,7 @@ static int file_getfile( lua_State* L )
   if (!lua_isnil(L, -1)) {
     lua_remove(L, 1);  // dump filename, so [1] = FD
     file_fd_ud *ud = (file_fd_ud *)luaL_checkudata(L, 1, "file.obj");
-    ret_cnt = file_g_read(L, LUAI_MAXINT32, EOF, ud->fd);
+    ret_cnt = file_g_readall(L, ud->fd);
     // Stack [1] = FD; [2] = contents if ret_cnt = 1;
     file_close(L);     // leaves Stack unchanged if [1] = FD
     lua_remove(L, 1);  // Dump FD leaving contents as [1] / ToS
@@ -536,6 +965,22 @@ static int file_getfile( lua_State* L )
 }
 
 // Lua: write("string")
+extern int pipe_drain(lua_State *L, int ndx,
+                      int (*fn)(void *, const char *, size_t), void *arg);
+
+static int file_write_chunk( void *arg, const char *s, size_t l )
+{
+  return vfs_write(*(int *)arg, s, l) != l;
+}
+
+#ifdef LUA_USE_MODULES_SJSON
+extern int sjson_encoder_fill(lua_State *L, int ndx, char *buf, size_t len);
+
+#ifndef FILE_ENCODER_CHUNK
+#define FILE_ENCODER_CHUNK 256
+#endif
+#endif
+
 static int file_write( lua_State* L )
 {
   GET_FILE_OBJ;
@@ -543,6 +988,33 @@ static int file_write( lua_State* L )
   if(!fd)
     return luaL_error(L, "open a file first");
   size_t l, rl;
+  if (lua_istable(L, argpos)) {
+    /* write a pipe's chunks in place, removing them from the pipe */
+    int n = pipe_drain(L, argpos, NULL, NULL);
+    luaL_argcheck(L, n >= 0, argpos, "string or pipe expected");
+    if (pipe_drain(L, argpos, file_write_chunk, &fd) == n)
+      lua_pushboolean(L, 1);
+    else
+      lua_pushnil(L);
+    return 1;
+  }
+#ifdef LUA_USE_MODULES_SJSON
+  if (lua_isuserdata(L, argpos) &&
+      sjson_encoder_fill(L, argpos, NULL, 0) == 0) {
+    /* encode the rest of the document through a stack buffer */
+    char chunk[FILE_ENCODER_CHUNK];
+    int n;
+    do {
+      n = sjson_encoder_fill(L, argpos, chunk, sizeof(chunk));
+      if (n > 0 && vfs_write(fd, chunk, n) != n) {
+        lua_pushnil(L);
+        return 1;
+      }
+    } while (n == (int) sizeof(chunk));
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+#endif
   const char *s = luaL_checklstring(L, argpos, &l);
   rl = vfs_write(fd, s, l);
   if(rl==l)
@@ -560,6 +1032,23 @@ static int file_writeline( lua_State* L )
   if(!fd)
     return luaL_error(L, "open a file first");
   size_t l, rl;
+#ifdef LUA_USE_MODULES_SJSON
+  if (lua_isuserdata(L, argpos) &&
+      sjson_encoder_fill(L, argpos, NULL, 0) == 0) {
+    /* encode the rest of the document through a stack buffer */
+    char chunk[FILE_ENCODER_CHUNK];
+    int n;
+    do {
+      n = sjson_encoder_fill(L, argpos, chunk, sizeof(chunk));
+      if (n > 0 && vfs_write(fd, chunk, n) != n) {
+        lua_pushnil(L);
+        return 1;
+      }
+    } while (n == (int) sizeof(chunk));
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+#endif
   const char *s = luaL_checklstring(L, argpos, &l);
   rl = vfs_write(fd, s, l);
   if(rl==l){
@@ -671,14 +1160,21 @@ LROT_BEGIN(file_obj, NULL, LROT_MASK_GC_INDEX)
   LROT_TABENTRY(  __index, file_obj )
   LROT_FUNCENTRY( close, file_close )
   LROT_FUNCENTRY( read, file_read )
+  LROT_FUNCENTRY( read_async, file_read_async )
   LROT_FUNCENTRY( readline, file_readline )
   LROT_FUNCENTRY( write, file_write )
+  LROT_FUNCENTRY( write_async, file_write_async )
   LROT_FUNCENTRY( writeline, file_writeline )
   LROT_FUNCENTRY( seek, file_seek )
   LROT_FUNCENTRY( flush, file_flush )
 LROT_END(file_obj, NULL, LROT_MASK_GC_INDEX)
 
 
+LROT_BEGIN(file_dir, NULL, LROT_MASK_GC)
+  LROT_FUNCENTRY( __gc, file_iter_free )
+LROT_END(file_dir, NULL, LROT_MASK_GC)
+
+
 LROT_BEGIN(file_vol, NULL, LROT_MASK_INDEX)
   LROT_TABENTRY( __index, file_vol )
   LROT_FUNCENTRY( umount, file_vol_umount )
@@ -687,6 +1183,7 @@ LROT_END(file_vol, NULL, LROT_MASK_INDEX)
 // Module function map
 LROT_BEGIN(file, NULL, 0)
   LROT_FUNCENTRY( list, file_list )
+  LROT_FUNCENTRY( iter, file_iter )
   LROT_FUNCENTRY( open, file_open )
   LROT_FUNCENTRY( close, file_close )
   LROT_FUNCENTRY( write, file_write )
@@ -696,6 +1193,8 @@ LROT_BEGIN(file, NULL, 0)
 #ifdef BUILD_SPIFFS
   LROT_FUNCENTRY( format, file_format )
   LROT_FUNCENTRY( fscfg, file_fscfg )
+  LROT_FUNCENTRY( stats, file_stats )
+  LROT_FUNCENTRY( wear, file_wear )
 #endif
   LROT_FUNCENTRY( remove, file_remove )
   LROT_FUNCENTRY( seek, file_seek )
@@ -721,8 +1220,10 @@ int luaopen_file( lua_State *L ) {
   } else {
       myspiffs_set_automount(do_flash_mount);
   }
+  file_async_task_id = platform_task_get_id(file_async_task);
   luaL_rometatable( L, "file.vol",  LROT_TABLEREF(file_vol));
   luaL_rometatable( L, "file.obj",  LROT_TABLEREF(file_obj));
+  luaL_rometatable( L, "file.dir",  LROT_TABLEREF(file_dir));
   return 0;
 }
 
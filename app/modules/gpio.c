@@ -28,7 +28,7 @@
 // going to change.
 #define INTERRUPT_TYPE_IS_LEVEL(x)	((x) >= GPIO_PIN_INTR_LOLEVEL)
 
-static int gpio_cb_ref[GPIO_PIN_NUM];
+static luaL_Slot gpio_cb[GPIO_PIN_NUM];
 
 // This task is scheduled by the ISR and is used
 // to initiate the Lua-land gpio.trig() callback function
@@ -50,10 +50,10 @@ static void gpio_intr_callback_task (task_param_t param, uint8 priority)
   then = (then + (now & 0x7f000000)) & 0x7fffffff;
 
   NODE_DBG("pin:%d, level:%d \n", pin, level);
-  if(gpio_cb_ref[pin] != LUA_NOREF) {
+  if(luaL_slotisset(&gpio_cb[pin])) {
     // GPIO callbacks are run in L0 and include the level as a parameter
     lua_State *L = lua_getstate();
-    NODE_DBG("Calling: %08x\n", gpio_cb_ref[pin]);
+    NODE_DBG("Calling: %08x\n", gpio_cb[pin].ref);
 
     bool needs_callback = 1;
 
@@ -62,7 +62,6 @@ static void gpio_intr_callback_task (task_param_t param, uint8 priority)
       // the base level only modifies 'reported'.
 
       // Do the actual callback
-      lua_rawgeti(L, LUA_REGISTRYINDEX, gpio_cb_ref[pin]);
       lua_pushinteger(L, level);
       lua_pushinteger(L, then);
       uint16_t seen = pin_counter[pin].seen;
@@ -77,7 +76,7 @@ static void gpio_intr_callback_task (task_param_t param, uint8 priority)
         then = system_get_time() & 0x7fffffff;
       }
 
-      if(luaL_pcallx(L, 3, 0) != LUA_OK)
+      if(luaL_callslot(L, &gpio_cb[pin], NULL, 3) != LUA_OK)
         return;
     }
 
@@ -88,7 +87,54 @@ static void gpio_intr_callback_task (task_param_t param, uint8 priority)
   }
 }
 
-// Lua: trig( pin, type, function )
+// This task is posted by the ISR once per batch for pins in batched mode.  It
+// drains the pin's event ring and passes the levels and timestamps to the
+// gpio.trig() callback as arrays, together with the count of dropped events.
+#define GPIO_BATCH_CHUNK 16
+static void gpio_batch_callback_task (task_param_t param, uint8 priority)
+{
+  uint32_t pin = param, ev[GPIO_BATCH_CHUNK], dropped, total_dropped = 0;
+  unsigned i, n, count = 0;
+  UNUSED(priority);
+
+  if (pin >= GPIO_PIN_NUM || !luaL_slotisset(&gpio_cb[pin]))
+    return;
+
+  lua_State *L = lua_getstate();
+  lua_createtable(L, GPIO_BATCH_CHUNK, 0);
+  lua_createtable(L, GPIO_BATCH_CHUNK, 0);
+
+  while ((n = platform_gpio_get_batch(pin, ev, GPIO_BATCH_CHUNK, &dropped)) > 0 ||
+         dropped) {
+    total_dropped += dropped;
+    for (i = 0; i < n; i++) {
+      lua_pushinteger(L, PLATFORM_GPIO_BATCH_LEVEL(ev[i]));
+      lua_rawseti(L, -3, count + 1);
+      lua_pushinteger(L, PLATFORM_GPIO_BATCH_TIME(ev[i]));
+      lua_rawseti(L, -2, count + 1);
+      count++;
+    }
+    if (n < GPIO_BATCH_CHUNK)
+      break;
+  }
+
+  if (count || total_dropped) {
+    lua_pushinteger(L, count);
+    lua_pushinteger(L, total_dropped);
+    luaL_callslot(L, &gpio_cb[pin], NULL, 4);
+  } else {
+    lua_pop(L, 2);
+  }
+
+  if (INTERRUPT_TYPE_IS_LEVEL(pin_int_type[pin])) {
+    // Level triggered -- re-enable the interrupt
+    platform_gpio_intr_init(pin, pin_int_type[pin]);
+  }
+}
+
+static task_handle_t gpio_batch_task;
+
+// Lua: trig( pin, type, function[, batch] )
 static int lgpio_trig( lua_State* L )
 {
   unsigned pin = luaL_checkinteger( L, 1 );
@@ -99,31 +145,29 @@ static int lgpio_trig( lua_State* L )
     };
   luaL_argcheck(L, platform_gpio_exists(pin) && pin>0, 1, "Invalid interrupt pin");
 
-  int old_pin_ref = gpio_cb_ref[pin];
   int type = opts_type[luaL_checkoption(L, 2, "none", opts)];
+  unsigned batch = luaL_optinteger(L, 4, 0);
+  luaL_argcheck(L, batch <= PLATFORM_GPIO_BATCH_MAX, 4, "batch size too large");
+  lua_settop(L, 3);
 
   if (type == GPIO_PIN_INTR_DISABLE) {
     // "none" clears the callback
-    gpio_cb_ref[pin] = LUA_NOREF;
+    luaL_unsetslot(L, &gpio_cb[pin]);
 
-  } else if (lua_gettop(L)==2 && old_pin_ref != LUA_NOREF) {
+  } else if (lua_isnil(L, 3) && luaL_slotisset(&gpio_cb[pin])) {
     // keep the old one if no callback
-    old_pin_ref = LUA_NOREF;
 
   } else if (lua_isfunction(L, 3)) {
-    // set up the new callback if present
+    // set up the new callback if present, replacing any old one
     lua_pushvalue(L, 3);
-    gpio_cb_ref[pin] = luaL_ref(L, LUA_REGISTRYINDEX);
+    luaL_setslot(L, &gpio_cb[pin]);
 
   } else {
      // invalid combination, so clear down any old callback and throw an error
-    if(old_pin_ref != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, old_pin_ref);
+    luaL_unsetslot(L, &gpio_cb[pin]);
     luaL_argcheck(L,  0, 3, "invalid callback type");
   }
 
-  // unreference any overwritten callback
-  if(old_pin_ref != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, old_pin_ref);
-
   uint16_t seen;
 
   // Make sure that we clear out any queued interrupts
@@ -132,8 +176,12 @@ static int lgpio_trig( lua_State* L )
     pin_counter[pin].reported = seen & 0x7fff;
   } while (seen != pin_counter[pin].seen);
 
+  if (!platform_gpio_set_batch(pin, type == GPIO_PIN_INTR_DISABLE ? 0 : batch,
+                               gpio_batch_task))
+    return luaL_error(L, "cannot allocate event ring");
+
   NODE_DBG("Pin data: %d %d %08x, %d %d %d, %08x\n",
-          pin, type, pin_mux[pin], pin_num[pin], pin_func[pin], pin_int_type[pin], gpio_cb_ref[pin]);
+          pin, type, pin_mux[pin], pin_num[pin], pin_func[pin], pin_int_type[pin], gpio_cb[pin].ref);
   platform_gpio_intr_init(pin, type);
   return 0;
 }
@@ -158,7 +206,7 @@ NODE_DBG("pin,mode,pullup= %d %d %d\n",pin,mode,pullup);
 NODE_DBG("Pin data at mode: %d %08x, %d %d %d, %08x\n",
           pin, pin_mux[pin], pin_num[pin], pin_func[pin],
 #ifdef GPIO_INTERRUPT_ENABLE
-          pin_int_type[pin], gpio_cb_ref[pin]
+          pin_int_type[pin], gpio_cb[pin].ref
 #else
           0, 0
 #endif
@@ -166,10 +214,7 @@ NODE_DBG("Pin data at mode: %d %08x, %d %d %d, %08x\n",
 
 #ifdef GPIO_INTERRUPT_ENABLE
   if (mode != INTERRUPT){     // disable interrupt
-    if(gpio_cb_ref[pin] != LUA_NOREF){
-      luaL_unref(L, LUA_REGISTRYINDEX, gpio_cb_ref[pin]);
-      gpio_cb_ref[pin] = LUA_NOREF;
-    }
+    luaL_unsetslot(L, &gpio_cb[pin]);
   }
 #endif
 
@@ -201,6 +246,105 @@ static int lgpio_write( lua_State* L )
   return 0;
 }
 
+// Lua: write_mask( set_mask [, clear_mask] )
+static int lgpio_write_mask( lua_State* L )
+{
+  uint32_t set = luaL_checkinteger( L, 1 );
+  uint32_t clear = luaL_optinteger( L, 2, 0 );
+  luaL_argcheck(L, set < (1 << NUM_GPIO), 1, "Invalid pin");
+  luaL_argcheck(L, clear < (1 << NUM_GPIO), 2, "Invalid pin");
+
+  platform_gpio_write_mask(set, clear);
+  return 0;
+}
+
+// A parallel bus of up to 8 data pins, which bus:write() latches a byte at a
+// time with a pulse on the strobe pin
+#define BUS_MAX_PINS 8
+typedef struct {
+  uint32_t data;          // GPIO register bits of the data pins
+  uint32_t strobe;        // and of the strobe pin
+  uint32_t delay;         // us of each phase of the strobe
+  uint8_t active;         // level that latches the data
+  uint32_t nibble[2][16]; // GPIO register bits of the pins set by each nibble
+} gpio_bus_t;
+
+// Lua: bus = gpio.bus( {pin0, ..., pin7}, strobe [, delay [, active]] )
+static int lgpio_bus( lua_State* L )
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  unsigned n = lua_objlen(L, 1);
+  unsigned strobe = luaL_checkinteger( L, 2 );
+  uint32_t delay = luaL_optinteger( L, 3, 0 );
+  unsigned active = luaL_optinteger( L, 4, HIGH );
+  uint32_t used;
+  unsigned pins[BUS_MAX_PINS];
+  unsigned i, b;
+
+  luaL_argcheck(L, n > 0 && n <= BUS_MAX_PINS, 1, "1 to 8 pins expected");
+  luaL_argcheck(L, strobe > 0 && platform_gpio_exists(strobe), 2, "Invalid pin");
+  luaL_argcheck(L, active==HIGH || active==LOW, 4, "wrong level type" );
+  used = 1 << strobe;
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    pins[i] = luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    // Pin 0 is not on the GPIO register, so could not change with the others
+    luaL_argcheck(L, pins[i] > 0 && platform_gpio_exists(pins[i]) && !(used & (1 << pins[i])), 1, "Invalid pin");
+    used |= 1 << pins[i];
+  }
+
+  gpio_bus_t *bus = (gpio_bus_t *)lua_newuserdata(L, sizeof(gpio_bus_t));
+  memset(bus, 0, sizeof(*bus));
+  for (i = 0; i < n; i++) {
+    uint32_t bit = platform_gpio_pin_bits(1 << pins[i]);
+    for (b = 0; b < 16; b++)
+      if (b & (1 << (i % 4)))
+        bus->nibble[i / 4][b] |= bit;
+    bus->data |= bit;
+    platform_gpio_mode(pins[i], OUTPUT, FLOAT);
+  }
+  bus->strobe = platform_gpio_pin_bits(1 << strobe);
+  bus->delay = delay;
+  bus->active = active;
+  platform_gpio_write(strobe, !active);
+  platform_gpio_mode(strobe, OUTPUT, FLOAT);
+
+  luaL_getmetatable(L, "gpio.bus");
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+// Lua: bus:write( data )
+static int lgpio_bus_write( lua_State* L )
+{
+  gpio_bus_t *bus = (gpio_bus_t *)luaL_checkudata(L, 1, "gpio.bus");
+  size_t len, i;
+  const uint8_t *data = (const uint8_t *)luaL_checklstring(L, 2, &len);
+  uint32_t latch = bus->active == HIGH ? GPIO_OUT_W1TS_ADDRESS : GPIO_OUT_W1TC_ADDRESS;
+  uint32_t release = bus->active == HIGH ? GPIO_OUT_W1TC_ADDRESS : GPIO_OUT_W1TS_ADDRESS;
+
+  for (i = 0; i < len; i++) {
+    uint32_t set = bus->nibble[0][data[i] & 0xf] | bus->nibble[1][data[i] >> 4];
+    GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, set);
+    GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, bus->data & ~set);
+    if (bus->delay)
+      os_delay_us(bus->delay);
+    GPIO_REG_WRITE(latch, bus->strobe);
+    if (bus->delay)
+      os_delay_us(bus->delay);
+    GPIO_REG_WRITE(release, bus->strobe);
+    if ((i & 0x3ff) == 0x3ff)
+      system_soft_wdt_feed();
+  }
+  return 0;
+}
+
+LROT_BEGIN(gpio_bus, NULL, LROT_MASK_INDEX)
+  LROT_TABENTRY( __index, gpio_bus )
+  LROT_FUNCENTRY( write, lgpio_bus_write )
+LROT_END(gpio_bus, NULL, LROT_MASK_INDEX)
+
 #define DELAY_TABLE_MAX_LEN 256
 #define delayMicroseconds os_delay_us
 // Lua: serout( pin, firstLevel, delay_table[, repeat_num[, callback]])
@@ -299,6 +443,7 @@ static int lgpio_serout( lua_State* L )
       luaL_error(L, "Unable to initialize timer");
     }
     platform_hw_timer_set_func(TIMER_OWNER, seroutasync_cb, 0);
+    platform_hw_timer_set_priority(TIMER_OWNER, 100, "gpio.serout");
     serout.index = 0;
     seroutasync_cb(0);
   } else { // sync version for sub-50 µs resolution & total duration < 15 mSec
@@ -327,6 +472,8 @@ LROT_BEGIN(gpio, NULL, 0)
   LROT_FUNCENTRY( mode, lgpio_mode )
   LROT_FUNCENTRY( read, lgpio_read )
   LROT_FUNCENTRY( write, lgpio_write )
+  LROT_FUNCENTRY( write_mask, lgpio_write_mask )
+  LROT_FUNCENTRY( bus, lgpio_bus )
   LROT_FUNCENTRY( serout, lgpio_serout )
 #ifdef LUA_USE_MODULES_GPIO_PULSE
   LROT_TABENTRY( pulse, gpio_pulse )
@@ -352,10 +499,12 @@ int luaopen_gpio( lua_State *L ) {
 #ifdef GPIO_INTERRUPT_ENABLE
   int i;
   for(i=0;i<GPIO_PIN_NUM;i++){
-    gpio_cb_ref[i] = LUA_NOREF;
+    gpio_cb[i] = (luaL_Slot) LUAL_SLOT_INIT;
   }
   platform_gpio_init(task_get_id(gpio_intr_callback_task));
+  gpio_batch_task = task_get_id(gpio_batch_callback_task);
 #endif
+  luaL_rometatable(L, "gpio.bus", LROT_TABLEREF(gpio_bus));
   serout.done_taskid = task_get_id((task_callback_t) seroutasync_done);
   serout.lua_done_ref = LUA_NOREF;
   return 0;
@@ -18,6 +18,17 @@
 // Maximum delay in microseconds
 #define DELAY_LIMIT 64000000
 
+// Limits of a compiled sequence. A step has to fit the 23 bit timer.
+#define SEQ_STEP_LIMIT 2048
+#define SEQ_DELAY_LIMIT 1000000
+
+// A compiled sequence is woken this early by the timer and then spins on
+// CCOUNT to the exact time of the step, so that the interrupt latency does
+// not show on the edges. Steps closer together than this are spun to.
+#define SEQ_WAKE_EARLY_TICKS US_TO_RTC_TIMER_TICKS(10)
+
+#define GPIO16_MASK 0x10000
+
 typedef struct {
   uint32_t gpio_set;
   uint32_t gpio_clr;
@@ -43,8 +54,30 @@ typedef struct {
   volatile int cb_ref;
 } pulse_t;
 
+// A step of a compiled sequence, with the loops unrolled
+typedef struct {
+  uint32_t gpio_set;
+  uint32_t gpio_clr;
+  uint32_t delay;             // in timer ticks
+} pulse_step_t;
+
+typedef struct {
+  uint32_t step_count;
+  uint32_t repeat;            // playbacks left after this one, or forever if SEQ_FOREVER
+  volatile uint32_t pos;
+  volatile uint32_t steps;
+  uint32_t due;               // CCOUNT of the next step
+  uint32_t cycles_per_tick;
+  int cb_ref;
+  pulse_step_t step[1];
+} pulse_seq_t;
+
+#define SEQ_FOREVER 0xffffffff
+
 static int active_pulser_ref;
 static pulse_t *active_pulser;
+static int active_seq_ref = LUA_NOREF;
+static pulse_seq_t *active_seq;
 static platform_task_handle_t tasknumber;
 
 static int gpio_pulse_push_state(lua_State *L, pulse_t *pulser) {
@@ -196,7 +229,7 @@ static void fill_entry_from_table(lua_State *L, pulse_entry_t *entry) {
   lua_pop(L, 1);
 }
 
-static int gpio_pulse_build(lua_State *L) {
+static size_t check_entry_count(lua_State *L) {
   // Take a table argument
   luaL_checktype(L, 1, LUA_TTABLE);
 
@@ -204,8 +237,25 @@ static int gpio_pulse_build(lua_State *L) {
   size_t size = lua_objlen(L, 1);
 
   if (size > 100) {
-    return luaL_error(L, "table is too large: %d entries is more than 100", size);
+    luaL_error(L, "table is too large: %d entries is more than 100", size);
   }
+  return size;
+}
+
+static void fill_entries(lua_State *L, pulse_entry_t *entry, size_t size) {
+  size_t i;
+  for (i = 0; i < size; i++, entry++) {
+    entry->delay_min = -1;
+    entry->delay_max = -1;
+
+    lua_rawgeti(L, 1, i + 1);
+
+    fill_entry_from_table(L, entry);
+  }
+}
+
+static int gpio_pulse_build(lua_State *L) {
+  size_t size = check_entry_count(L);
 
   size_t memsize = sizeof(pulse_t) + size * sizeof(pulse_entry_t);
   pulse_t *pulser = (pulse_t *) lua_newuserdata(L, memsize);
@@ -218,18 +268,93 @@ static int gpio_pulse_build(lua_State *L) {
   pulser->entry = (pulse_entry_t *) (pulser + 1);
   pulser->entry_count = size;
 
+  fill_entries(L, pulser->entry, size);
+
+  return 1;
+}
+
+// Runs the entries in the same order as gpio_pulse_timeout, merging each step
+// with no delay into the one after it. The steps are only counted if step is NULL.
+static uint32_t unroll_entries(lua_State *L, pulse_entry_t *entry, size_t size, pulse_step_t *step) {
+  uint32_t n = 0;
+  uint32_t pos = 0;
+  uint32_t visits = 0;
+  pulse_step_t cur = { 0, 0, 0 };
   size_t i;
+
   for (i = 0; i < size; i++) {
-    pulse_entry_t *entry = pulser->entry + i;
+    entry[i].count_left = 0;
+  }
 
-    entry->delay_min = -1;
-    entry->delay_max = -1;
+  while (pos < size) {
+    pulse_entry_t *e = entry + pos;
 
-    lua_rawgeti(L, 1, i + 1);
+    if (++visits > 4 * SEQ_STEP_LIMIT) {
+      luaL_error(L, "sequence has too many entries without a delay");
+    }
+    cur.gpio_set = (cur.gpio_set & ~e->gpio_clr) | e->gpio_set;
+    cur.gpio_clr = (cur.gpio_clr & ~e->gpio_set) | e->gpio_clr;
 
-    fill_entry_from_table(L, entry);
+    if (e->loop) {
+      if (e->count_left == 0) {
+        e->count_left = e->count + 1;
+      }
+      if (--e->count_left >= 1) {
+        pos = e->loop - 1;
+      } else {
+        pos++;
+      }
+    } else {
+      pos++;
+    }
+
+    if (e->delay || pos >= size) {
+      if (n == SEQ_STEP_LIMIT) {
+        luaL_error(L, "sequence has more than %d steps", SEQ_STEP_LIMIT);
+      }
+      cur.delay = US_TO_RTC_TIMER_TICKS(e->delay);
+      if (step) {
+        step[n] = cur;
+      }
+      n++;
+      cur.gpio_set = cur.gpio_clr = 0;
+    }
   }
 
+  return n;
+}
+
+// Lua: seq = gpio.pulse.compile(table)
+static int gpio_pulse_compile(lua_State *L) {
+  size_t size = check_entry_count(L);
+  pulse_entry_t *entry = (pulse_entry_t *) lua_newuserdata(L, size * sizeof(pulse_entry_t) + 1);
+  size_t i;
+
+  memset(entry, 0, size * sizeof(pulse_entry_t));
+  fill_entries(L, entry, size);
+  for (i = 0; i < size; i++) {
+    if (entry[i].delay_min != -1) {
+      return luaL_error(L, "min and max cannot be compiled");
+    }
+    if (entry[i].delay > SEQ_DELAY_LIMIT) {
+      return luaL_error(L, "delay of %d must be at most " xstr(SEQ_DELAY_LIMIT) " microseconds to be compiled", entry[i].delay);
+    }
+  }
+
+  uint32_t n = unroll_entries(L, entry, size, NULL);
+  if (n == 0) {
+    return luaL_error(L, "sequence is empty");
+  }
+
+  size_t memsize = sizeof(pulse_seq_t) + (n - 1) * sizeof(pulse_step_t);
+  pulse_seq_t *seq = (pulse_seq_t *) lua_newuserdata(L, memsize);
+  memset(seq, 0, memsize);
+  seq->cb_ref = LUA_NOREF;
+  seq->step_count = n;
+  unroll_entries(L, entry, size, seq->step);
+
+  luaL_getmetatable(L, "gpio.pulse.sequence");
+  lua_setmetatable(L, -2);
   return 1;
 }
 
@@ -395,10 +520,147 @@ static void ICACHE_RAM_ATTR gpio_pulse_timeout(os_param_t p) {
   platform_hw_timer_arm_us(TIMER_OWNER, delay);
 }
 
+// The playback of a compiled sequence only writes the output registers, so
+// that steps a few microseconds apart can be made.
+static void ICACHE_RAM_ATTR gpio_pulse_seq_timeout(os_param_t p) {
+  (void) p;
+  pulse_seq_t *seq = active_seq;
+
+  if (!seq) {
+    return;
+  }
+
+  for (;;) {
+    while ((int32_t) (CCOUNT_REG - seq->due) < 0) {
+    }
+
+    if (seq->pos >= seq->step_count) {
+      if (seq->repeat == 0) {
+        platform_hw_timer_close(TIMER_OWNER);
+        platform_post_low(tasknumber, 0);
+        return;
+      }
+      if (seq->repeat != SEQ_FOREVER) {
+        seq->repeat--;
+      }
+      seq->pos = 0;
+    }
+
+    pulse_step_t *step = seq->step + seq->pos;
+
+    GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, step->gpio_set);
+    GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, step->gpio_clr);
+    if ((step->gpio_set | step->gpio_clr) & GPIO16_MASK) {
+      WRITE_PERI_REG(RTC_GPIO_OUT, (READ_PERI_REG(RTC_GPIO_OUT) & ~1) | !!(step->gpio_set & GPIO16_MASK));
+    }
+    seq->pos++;
+    seq->steps++;
+    seq->due += step->delay * seq->cycles_per_tick;
+
+    int32_t ticks = (int32_t) (seq->due - CCOUNT_REG) / (int32_t) seq->cycles_per_tick - SEQ_WAKE_EARLY_TICKS;
+    if (ticks > 0) {
+      platform_hw_timer_arm_ticks(TIMER_OWNER, ticks);
+      return;
+    }
+  }
+}
+
+static int gpio_pulse_seq_push_state(lua_State *L, pulse_seq_t *seq) {
+  uint32_t pos, steps;
+  do {
+    pos = seq->pos;
+    steps = seq->steps;
+  } while (pos != seq->pos || steps != seq->steps);
+
+  if (seq != active_seq) {
+    lua_pushnil(L);
+  } else {
+    lua_pushinteger(L, pos);   // the step being output, 1 offset
+  }
+  lua_pushinteger(L, steps);
+  return 2;
+}
+
+// Lua: seq:start([repeat, ] callback)
+static int gpio_pulse_seq_start(lua_State *L) {
+  pulse_seq_t *seq = luaL_checkudata(L, 1, "gpio.pulse.sequence");
+  int argno = 2;
+  uint32_t repeat = 0;
+
+  if (active_pulser || active_seq) {
+    return luaL_error(L, "pulse operation already in progress");
+  }
+
+  if (lua_type(L, argno) == LUA_TNUMBER) {
+    int n = luaL_checkinteger(L, argno);
+    luaL_argcheck(L, n >= 0, argno, "must be 0 or more");
+    repeat = n ? n - 1 : SEQ_FOREVER;
+    argno++;
+  }
+
+  luaL_checktype(L, argno, LUA_TFUNCTION);
+  lua_pushvalue(L, argno);
+  luaL_unref(L, LUA_REGISTRYINDEX, seq->cb_ref);
+  seq->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, FALSE)) {
+    return luaL_error(L, "Unable to initialize timer");
+  }
+
+  seq->repeat = repeat;
+  seq->pos = 0;
+  seq->steps = 0;
+  seq->cycles_per_tick = system_get_cpu_freq() / US_TO_RTC_TIMER_TICKS(1);
+  seq->due = CCOUNT_REG;
+
+  active_seq = seq;
+  lua_pushvalue(L, 1);
+  active_seq_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  platform_hw_timer_set_func(TIMER_OWNER, gpio_pulse_seq_timeout, 0);
+  platform_hw_timer_set_priority(TIMER_OWNER, 100, "gpio.pulse");
+  gpio_pulse_seq_timeout(0);
+
+  return 0;
+}
+
+// Lua: pos, steps = seq:getstate()
+static int gpio_pulse_seq_getstate(lua_State *L) {
+  pulse_seq_t *seq = luaL_checkudata(L, 1, "gpio.pulse.sequence");
+
+  return gpio_pulse_seq_push_state(L, seq);
+}
+
+// Lua: pos, steps = seq:cancel()
+static int gpio_pulse_seq_cancel(lua_State *L) {
+  pulse_seq_t *seq = luaL_checkudata(L, 1, "gpio.pulse.sequence");
+
+  if (seq != active_seq) {
+    return 0;
+  }
+
+  platform_hw_timer_close(TIMER_OWNER);
+
+  int rc = gpio_pulse_seq_push_state(L, seq);
+
+  active_seq = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, active_seq_ref);
+  active_seq_ref = LUA_NOREF;
+
+  return rc;
+}
+
+static int gpio_pulse_seq_delete(lua_State *L) {
+  pulse_seq_t *seq = luaL_checkudata(L, 1, "gpio.pulse.sequence");
+
+  luaL_unref(L, LUA_REGISTRYINDEX, seq->cb_ref);
+  return 0;
+}
+
 static int gpio_pulse_start(lua_State *L) {
   pulse_t *pulser = luaL_checkudata(L, 1, "gpio.pulse");
 
-  if (active_pulser) {
+  if (active_pulser || active_seq) {
     return luaL_error(L, "pulse operation already in progress");
   }
 
@@ -443,6 +705,7 @@ static int gpio_pulse_start(lua_State *L) {
 
   active_pulser->expected_end_time = 0x7fffffff & system_get_time();
   platform_hw_timer_set_func(TIMER_OWNER, gpio_pulse_timeout, 0);
+  platform_hw_timer_set_priority(TIMER_OWNER, 100, "gpio.pulse");
   gpio_pulse_timeout(0);
 
   return 0;
@@ -465,6 +728,20 @@ static void gpio_pulse_task(os_param_t param, uint8_t prio)
     active_pulser_ref = LUA_NOREF;
     luaL_unref(L, LUA_REGISTRYINDEX, pulser_ref);
 
+    luaL_pcallx(L, rc, 0);
+  } else if (active_seq) {
+    lua_State *L = lua_getstate();
+    pulse_seq_t *seq = active_seq;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, seq->cb_ref);
+    active_seq = NULL;
+
+    int rc = gpio_pulse_seq_push_state(L, seq);
+
+    int seq_ref = active_seq_ref;
+    active_seq_ref = LUA_NOREF;
+    luaL_unref(L, LUA_REGISTRYINDEX, seq_ref);
+
     luaL_pcallx(L, rc, 0);
   }
 }
@@ -482,14 +759,25 @@ LROT_BEGIN(pulse, NULL, LROT_MASK_GC_INDEX)
 LROT_END(pulse, NULL, LROT_MASK_GC_INDEX)
 
 
+LROT_BEGIN(pulse_seq, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, gpio_pulse_seq_delete )
+  LROT_TABENTRY(  __index, pulse_seq )
+  LROT_FUNCENTRY( getstate, gpio_pulse_seq_getstate )
+  LROT_FUNCENTRY( cancel, gpio_pulse_seq_cancel )
+  LROT_FUNCENTRY( start, gpio_pulse_seq_start )
+LROT_END(pulse_seq, NULL, LROT_MASK_GC_INDEX)
+
+
 LROT_BEGIN(gpio_pulse, NULL, 0)
   LROT_FUNCENTRY( build, gpio_pulse_build )
+  LROT_FUNCENTRY( compile, gpio_pulse_compile )
 LROT_END(gpio_pulse, NULL, 0)
 
 
 int gpio_pulse_init(lua_State *L)
 {
   luaL_rometatable(L, "gpio.pulse", LROT_TABLEREF(pulse));
+  luaL_rometatable(L, "gpio.pulse.sequence", LROT_TABLEREF(pulse_seq));
   tasknumber = platform_task_get_id(gpio_pulse_task);
   return 0;
 }
@@ -34,20 +34,84 @@ static int hdc1080_setup(lua_State* L) {
     return 0;
 }
 
-static int hdc1080_read(lua_State* L) {
-
-    uint8_t data[2];
+static void push_temp(lua_State* L, const uint8_t *data) {
+	#ifdef LUA_NUMBER_INTEGRAL
+    	lua_pushinteger(L, ((((data[0]<<8)|data[1])*165)>>16)-40);
+    #else
+    	lua_pushnumber(L, ((float)((data[0]<<8)|data[1])/(float)pow(2,16))*165.0f-40.0f);
+    #endif
+}
 
-    #ifdef LUA_NUMBER_INTEGRAL
-    	int temp;
-    	int humidity;
+static void push_humidity(lua_State* L, const uint8_t *data) {
+	#ifdef LUA_NUMBER_INTEGRAL
+    	lua_pushinteger(L, ((((data[0]<<8)|data[1]))*100)>>16);
     #else
-    	float temp;
-    	float humidity;
+    	lua_pushnumber(L, ((float)((data[0]<<8)|data[1])/(float)pow(2,16))*100.0f);
     #endif
+}
+
+// Non-blocking read: a temperature job whose callback submits a humidity job
+static struct {
+    platform_i2c_job_t job;
+    uint8_t reg;
+    uint8_t temp[2];
+    uint8_t humidity[2];
+    int cb_ref;
+} async = { .cb_ref = LUA_NOREF };
+
+static void hdc1080_job_done(platform_i2c_job_t *job, int ok) {
+    if (ok && async.reg == HDC1080_TEMPERATURE_REGISTER) {
+        async.reg = HDC1080_HUMIDITY_REGISTER;
+        job->rdata = async.humidity;
+        if (platform_i2c_submit(job) == PLATFORM_OK)
+            return;
+        ok = 0;
+    }
+
+    lua_State* L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, async.cb_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, async.cb_ref);
+    async.cb_ref = LUA_NOREF;
+    if (ok) {
+        push_temp(L, async.temp);
+        push_humidity(L, async.humidity);
+    } else {
+        lua_pushnil(L);
+        lua_pushnil(L);
+    }
+    luaL_pcallx(L, 2, 0);
+}
+
+static int hdc1080_read_async(lua_State* L) {
+    if (async.cb_ref != LUA_NOREF)
+        return luaL_error(L, "read in progress");
+
+    async.reg = HDC1080_TEMPERATURE_REGISTER;
+    async.job.id = hdc1080_i2c_id;
+    async.job.address = hdc1080_i2c_addr;
+    async.job.wdata = &async.reg;
+    async.job.wlen = 1;
+    async.job.rdata = async.temp;
+    async.job.rlen = 2;
+    async.job.delay_us = 7000;
+    async.job.cb = hdc1080_job_done;
+
+    if (platform_i2c_submit(&async.job) != PLATFORM_OK)
+        return luaL_error(L, "i2c %d is not configured", hdc1080_i2c_id);
+    lua_pushvalue(L, 1);
+    async.cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 0;
+}
+
+static int hdc1080_read(lua_State* L) {
+
+    uint8_t data[2];
 
     int i;
 
+    if (lua_isfunction(L, 1))
+        return hdc1080_read_async(L);
+
     platform_i2c_send_start(hdc1080_i2c_id);
     platform_i2c_send_address(hdc1080_i2c_id, hdc1080_i2c_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
     platform_i2c_send_byte(hdc1080_i2c_id, HDC1080_TEMPERATURE_REGISTER);
@@ -64,13 +128,7 @@ static int hdc1080_read(lua_State* L) {
 
     platform_i2c_send_stop(hdc1080_i2c_id);
 
-	#ifdef LUA_NUMBER_INTEGRAL
-    	temp = ((((data[0]<<8)|data[1])*165)>>16)-40;
-    	lua_pushinteger(L, (int)temp);
-    #else
-    	temp = ((float)((data[0]<<8)|data[1])/(float)pow(2,16))*165.0f-40.0f;
-    	lua_pushnumber(L, temp);
-    #endif
+    push_temp(L, data);
 
 
     platform_i2c_send_start(hdc1080_i2c_id);
@@ -89,13 +147,7 @@ static int hdc1080_read(lua_State* L) {
 
     platform_i2c_send_stop(hdc1080_i2c_id);
 
-	#ifdef LUA_NUMBER_INTEGRAL
-    	humidity = ((((data[0]<<8)|data[1]))*100)>>16;
-    	lua_pushinteger(L, (int)humidity);
-    #else
-    	humidity = ((float)((data[0]<<8)|data[1])/(float)pow(2,16))*100.0f;
-    	lua_pushnumber(L, humidity);
-    #endif
+    push_humidity(L, data);
 
     return 2;
 }
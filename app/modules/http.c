@@ -12,6 +12,90 @@
 #include "http/httpclient.h"
 #include <ctype.h>
 static int http_callback_registry  = LUA_NOREF;
+static int http_data_registry      = LUA_NOREF;
+
+static void http_data_callback( const char * data, int len )
+{
+  if (http_data_registry != LUA_NOREF)
+  {
+    lua_State *L = lua_getstate();
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, http_data_registry);
+    lua_pushlstring(L, data, (size_t)len);
+    luaL_pcallx(L, 1, 0);
+  }
+}
+
+static void http_data_clear( lua_State *L )
+{
+  luaL_unref(L, LUA_REGISTRYINDEX, http_data_registry);
+  http_data_registry = LUA_NOREF;
+}
+
+// Remember the optional streaming callback at stack index arg
+static http_data_callback_t http_data_arg( lua_State *L, int arg )
+{
+  http_data_clear(L);
+  if (lua_isfunction(L, arg)) {
+    lua_pushvalue(L, arg);
+    http_data_registry = luaL_ref(L, LUA_REGISTRYINDEX);
+    return http_data_callback;
+  }
+  return NULL;
+}
+
+// Push a table of the response headers, keyed by lower case name
+static void http_push_headers( lua_State *L, const char *full_response )
+{
+  lua_newtable(L);
+
+  const char *p = full_response;
+
+  // Need to skip the HTTP/1.1 header line
+  while (*p && *p != '\n') {
+    p++;
+  }
+  if (*p == '\n') {
+    p++;
+  }
+
+  while (*p && *p != '\r' && *p != '\n') {
+    const char *eol = p;
+    while (*eol && *eol != '\r') {
+      eol++;
+    }
+
+    const char *colon = p;
+    while (*colon != ':' && colon < eol) {
+      colon++;
+    }
+
+    if (*colon != ':') {
+      break;
+    }
+
+    const char *value = colon + 1;
+    while (*value == ' ') {
+      value++;
+    }
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    while (p < colon) {
+      luaL_addchar(&b, tolower((unsigned char) *p));
+      p++;
+    }
+    luaL_pushresult(&b);
+
+    lua_pushlstring(L, value, eol - value);
+    lua_settable(L, -3);
+
+    p = eol + 1;
+    if (*p == '\n') {
+      p++;
+    }
+  }
+}
 
 static void http_callback( char * response, int http_status, char ** full_response_p, int body_size )
 {
@@ -37,54 +121,7 @@ static void http_callback( char * response, int http_status, char ** full_respon
     if ( http_status != HTTP_STATUS_GENERIC_ERROR && response)
     {
       lua_pushlstring(L, response, (size_t)body_size);
-      lua_newtable(L);
-
-      const char *p = full_response;
-
-      // Need to skip the HTTP/1.1 header line
-      while (*p && *p != '\n') {
-        p++;
-      }
-      if (*p == '\n') {
-        p++;
-      }
-
-      while (*p && *p != '\r' && *p != '\n') {
-        const char *eol = p;
-        while (*eol && *eol != '\r') {
-          eol++;
-        }
-
-        const char *colon = p;
-        while (*colon != ':' && colon < eol) {
-          colon++;
-        }
-
-        if (*colon != ':') {
-          break;
-        }
-
-        const char *value = colon + 1;
-        while (*value == ' ') {
-          value++;
-        }
-
-        luaL_Buffer b;
-        luaL_buffinit(L, &b);
-        while (p < colon) {
-          luaL_addchar(&b, tolower((unsigned char) *p));
-          p++;
-        }
-        luaL_pushresult(&b);
-
-        lua_pushlstring(L, value, eol - value);
-        lua_settable(L, -3);
-
-        p = eol + 1;
-        if (*p == '\n') {
-          p++;
-        }
-      }
+      http_push_headers(L, full_response);
     }
     else
     {
@@ -99,12 +136,14 @@ static void http_callback( char * response, int http_status, char ** full_respon
 
     luaL_unref(L, LUA_REGISTRYINDEX, http_callback_registry);
     http_callback_registry = LUA_NOREF;
+    luaL_unref(L, LUA_REGISTRYINDEX, http_data_registry);
+    http_data_registry = LUA_NOREF;
 
     luaL_pcallx(L, 3, 0); // With 3 arguments and 0 result
   }
 }
 
-// Lua: http.request( url, method, header, body, function(status, reponse) end )
+// Lua: http.request( url, method, header, body, function(status, reponse) end [, function(chunk) end] )
 static int http_lapi_request( lua_State *L )
 {
   int length;
@@ -134,7 +173,7 @@ static int http_lapi_request( lua_State *L )
     http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
   }
 
-  http_request(url, method, headers, body, http_callback, 0);
+  http_request(url, method, headers, body, http_callback, http_data_arg(L, 6), 0);
   return 0;
 }
 
@@ -168,6 +207,7 @@ static int http_lapi_post( lua_State *L )
     http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
   }
 
+  http_data_clear(L);
   http_post(url, headers, body, http_callback);
   return 0;
 }
@@ -202,6 +242,7 @@ static int http_lapi_put( lua_State *L )
     http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
   }
 
+  http_data_clear(L);
   http_put(url, headers, body, http_callback);
   return 0;
 }
@@ -236,11 +277,12 @@ static int http_lapi_delete( lua_State *L )
     http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
   }
 
+  http_data_clear(L);
   http_delete(url, headers, body, http_callback);
   return 0;
 }
 
-// Lua: http.get( url, header, function(status, reponse) end )
+// Lua: http.get( url, header, function(status, reponse) end [, function(chunk) end] )
 static int http_lapi_get( lua_State *L )
 {
   int length;
@@ -265,10 +307,131 @@ static int http_lapi_get( lua_State *L )
     http_callback_registry = luaL_ref(L, LUA_REGISTRYINDEX);
   }
 
-  http_get(url, headers, http_callback);
+  http_request(url, "GET", headers, NULL, http_callback, http_data_arg(L, 4), 0);
   return 0;
 }
 
+#define HTTP_CONN_METATABLE "http.conn"
+
+typedef struct {
+  http_conn_t *conn;
+  int self_ref;     // keeps the object alive while requests are pending
+  int pending;
+} http_lconn_t;
+
+typedef struct {
+  http_lconn_t *ud;
+  int cb_ref;
+} http_lreq_t;
+
+static void http_conn_callback( void *arg, int http_status, char *headers, char *body, int body_size )
+{
+  http_lreq_t *req = (http_lreq_t *)arg;
+  http_lconn_t *ud = req->ud;
+  int cb_ref = req->cb_ref;
+  lua_State *L = lua_getstate();
+
+  free(req);
+  if (--ud->pending == 0) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
+    ud->self_ref = LUA_NOREF;
+  }
+  if (cb_ref == LUA_NOREF) {
+    return;
+  }
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, cb_ref);
+  lua_pushinteger(L, http_status);
+  if (http_status != HTTP_STATUS_GENERIC_ERROR) {
+    lua_pushlstring(L, body, (size_t)body_size);
+    http_push_headers(L, headers);
+  } else {
+    lua_pushnil(L);
+    lua_pushnil(L);
+  }
+  luaL_pcallx(L, 3, 0);
+}
+
+// Lua: conn = http.createConnection( url )
+static int http_lapi_createconnection( lua_State *L )
+{
+  const char *url = luaL_checkstring(L, 1);
+  http_lconn_t *ud = (http_lconn_t *)lua_newuserdata(L, sizeof(http_lconn_t));
+  ud->conn = NULL;
+  ud->self_ref = LUA_NOREF;
+  ud->pending = 0;
+  luaL_getmetatable(L, HTTP_CONN_METATABLE);
+  lua_setmetatable(L, -2);
+
+  ud->conn = http_conn_new(url);
+  if (ud->conn == NULL) {
+    return luaL_error(L, "invalid URL");
+  }
+  return 1;
+}
+
+// Lua: conn:request( method, path, header, body, function(status, body, headers) end )
+static int http_lconn_request( lua_State *L )
+{
+  http_lconn_t *ud = (http_lconn_t *)luaL_checkudata(L, 1, HTTP_CONN_METATABLE);
+  const char *method  = luaL_checkstring(L, 2);
+  const char *path    = luaL_optstring(L, 3, NULL);
+  const char *headers = luaL_optstring(L, 4, NULL);
+  size_t body_len = 0;
+  const char *body    = luaL_optlstring(L, 5, NULL, &body_len);
+
+  if (ud->conn == NULL) {
+    return luaL_error(L, "connection closed");
+  }
+
+  http_lreq_t *req = (http_lreq_t *)malloc(sizeof(http_lreq_t));
+  if (req == NULL) {
+    return luaL_error(L, "out of memory");
+  }
+  req->ud = ud;
+  req->cb_ref = LUA_NOREF;
+  if (lua_isfunction(L, 6)) {
+    lua_pushvalue(L, 6);
+    req->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  if (ud->pending++ == 0) {
+    lua_pushvalue(L, 1);
+    ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  if (http_conn_request(ud->conn, method, path, headers, body, body_len, http_conn_callback, req) != 0) {
+    // The callback was not queued, so undo the bookkeeping it would do
+    luaL_unref(L, LUA_REGISTRYINDEX, req->cb_ref);
+    free(req);
+    if (--ud->pending == 0) {
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
+      ud->self_ref = LUA_NOREF;
+    }
+    return luaL_error(L, "out of memory");
+  }
+  return 0;
+}
+
+// Lua: conn:close()
+static int http_lconn_close( lua_State *L )
+{
+  http_lconn_t *ud = (http_lconn_t *)luaL_checkudata(L, 1, HTTP_CONN_METATABLE);
+  http_conn_t *conn = ud->conn;
+  if (conn != NULL) {
+    ud->conn = NULL;
+    http_conn_close(conn);  // calls back any pending requests with http.ERROR
+  }
+  return 0;
+}
+
+LROT_BEGIN(http_conn, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, http_lconn_close )
+  LROT_TABENTRY( __index, http_conn )
+  LROT_FUNCENTRY( request, http_lconn_request )
+  LROT_FUNCENTRY( close, http_lconn_close )
+LROT_END(http_conn, NULL, LROT_MASK_GC_INDEX)
+
 // Module function map
 LROT_BEGIN(http, NULL, 0)
   LROT_FUNCENTRY( request, http_lapi_request )
@@ -276,6 +439,7 @@ LROT_BEGIN(http, NULL, 0)
   LROT_FUNCENTRY( put, http_lapi_put )
   LROT_FUNCENTRY( delete, http_lapi_delete )
   LROT_FUNCENTRY( get, http_lapi_get )
+  LROT_FUNCENTRY( createConnection, http_lapi_createconnection )
 
   LROT_NUMENTRY( OK, 0 )
   LROT_NUMENTRY( ERROR, HTTP_STATUS_GENERIC_ERROR )
@@ -283,4 +447,10 @@ LROT_BEGIN(http, NULL, 0)
 LROT_END(http, NULL, 0)
 
 
-NODEMCU_MODULE(HTTP, "http", http, NULL);
+int luaopen_http( lua_State *L )
+{
+  luaL_rometatable(L, HTTP_CONN_METATABLE, LROT_TABLEREF(http_conn));
+  return 0;
+}
+
+NODEMCU_MODULE(HTTP, "http", http, luaopen_http);
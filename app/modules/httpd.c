@@ -0,0 +1,906 @@
+// Module for a native HTTP/1.1 server
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "vfs.h"
+#include "lwip/pbuf.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#ifdef LUA_USE_MODULES_HTTPD
+#if !defined(LUA_USE_MODULES_NET)
+#error Must have NET if using HTTPD module
+#endif
+#endif
+
+/*
+ * The server takes the connections of a net.tcpserver, and their received
+ * data through a net C sink, so the request line and headers are parsed in
+ * C as the data comes in. The path is routed by prefix through a trie with
+ * one node per path segment. Files are sent with the sendfile() of the
+ * socket, so only the dynamic routes call Lua, once per request with the
+ * request already parsed into a table. Connections are kept alive between
+ * requests unless the client asks otherwise.
+ *
+ * The receive window of a connection is only opened as the data is used, so
+ * requests pipelined behind one that is being answered wait in lwIP.
+ */
+
+extern void *net_sink_attach( lua_State *L, int ndx, void (*fn)(void *, struct pbuf *), void *arg );
+extern void net_sink_recved( void *sock, u16_t len );
+extern void net_sink_detach( void *sock );
+extern int net_createServer( lua_State *L );
+extern int net_listen( lua_State *L );
+extern int net_send( lua_State *L );
+extern int net_stream( lua_State *L );
+extern int net_sendfile( lua_State *L );
+extern int net_close( lua_State *L );
+extern int net_getpeer( lua_State *L );
+
+#define HTTPD_SERVER "httpd.server"
+#define HTTPD_CONN   "httpd.conn"
+
+#define HTTPD_HEAD_MAX 1024
+#define HTTPD_BODY_MAX 4096
+#define HTTPD_NAME_MAX 64
+
+#define HTTPD_STATE_HEAD   0
+#define HTTPD_STATE_BODY   1
+#define HTTPD_STATE_BUSY   2
+#define HTTPD_STATE_CLOSED 3
+
+typedef struct httpd_node {
+  struct httpd_node *child;
+  struct httpd_node *next;
+  int ref;              // the handler or static directory, or LUA_NOREF
+  uint8_t is_static;
+  char seg[1];
+} httpd_node_t;
+
+typedef struct {
+  int net_ref;          // the net.tcpserver while listening
+  httpd_node_t *root;
+  uint16_t head_max;
+  uint32_t body_max;
+  int timeout;
+  uint32_t requests;
+  uint32_t errors;
+  uint32_t connections;
+} httpd_server_t;
+
+typedef struct {
+  httpd_server_t *srv;
+  int self_ref, srv_ref, sock_ref;
+  void *sock;
+  struct pbuf *rx;      // received, from rx_off into the first pbuf
+  u16_t rx_off;
+  uint8_t state;
+  uint8_t keep_alive;
+  uint8_t is_head;      // a HEAD request, so the body is not sent
+  uint8_t in_process;
+  char *head;
+  u16_t head_len;
+  int route_ref;        // copy of the routed handler or directory
+  uint8_t route_static;
+  int req_ref;
+  u16_t rest_off;       // where the path after the route prefix starts in head
+  char *body;
+  uint32_t body_len, body_left;
+} httpd_conn_t;
+
+static void httpd_process( lua_State *L, httpd_conn_t *c );
+
+static const struct {
+  uint16_t code;
+  const char *text;
+} httpd_status[] = {
+  { 200, "OK" }, { 201, "Created" }, { 204, "No Content" },
+  { 301, "Moved Permanently" }, { 302, "Found" }, { 304, "Not Modified" },
+  { 400, "Bad Request" }, { 401, "Unauthorized" }, { 403, "Forbidden" },
+  { 404, "Not Found" }, { 405, "Method Not Allowed" }, { 411, "Length Required" },
+  { 413, "Payload Too Large" }, { 431, "Request Header Fields Too Large" },
+  { 500, "Internal Server Error" }, { 501, "Not Implemented" },
+  { 503, "Service Unavailable" },
+};
+
+static const char *httpd_status_text( int code ) {
+  unsigned i;
+  for (i = 0; i < sizeof(httpd_status) / sizeof(httpd_status[0]); i++) {
+    if (httpd_status[i].code == code)
+      return httpd_status[i].text;
+  }
+  return "";
+}
+
+static const char *httpd_types[][2] = {
+  { "html", "text/html" }, { "htm", "text/html" }, { "css", "text/css" },
+  { "js", "application/javascript" }, { "json", "application/json" },
+  { "txt", "text/plain" }, { "xml", "text/xml" }, { "svg", "image/svg+xml" },
+  { "png", "image/png" }, { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" },
+  { "gif", "image/gif" }, { "ico", "image/x-icon" },
+};
+
+// The content type from the extension of name[0..len)
+static const char *httpd_content_type( const char *name, size_t len ) {
+  const char *ext = NULL, *p;
+  unsigned i;
+  for (p = name; p < name + len; p++) {
+    if (*p == '.')
+      ext = p + 1;
+    else if (*p == '/')
+      ext = NULL;
+  }
+  for (i = 0; ext && i < sizeof(httpd_types) / sizeof(httpd_types[0]); i++) {
+    size_t l = strlen(httpd_types[i][0]);
+    if (l == (size_t)(name + len - ext) && strncasecmp(ext, httpd_types[i][0], l) == 0)
+      return httpd_types[i][1];
+  }
+  return "application/octet-stream";
+}
+
+#pragma mark - Routes
+
+static httpd_node_t *httpd_node_new( const char *seg, size_t len ) {
+  httpd_node_t *n = (httpd_node_t *)malloc(sizeof(httpd_node_t) + len);
+  if (n) {
+    n->child = n->next = NULL;
+    n->ref = LUA_NOREF;
+    n->is_static = 0;
+    memcpy(n->seg, seg, len);
+    n->seg[len] = 0;
+  }
+  return n;
+}
+
+static void httpd_node_free( lua_State *L, httpd_node_t *n ) {
+  while (n) {
+    httpd_node_t *next = n->next;
+    httpd_node_free(L, n->child);
+    luaL_unref(L, LUA_REGISTRYINDEX, n->ref);
+    free(n);
+    n = next;
+  }
+}
+
+static httpd_node_t *httpd_node_child( httpd_node_t *n, const char *seg, size_t len ) {
+  for (n = n->child; n; n = n->next) {
+    if (strlen(n->seg) == len && memcmp(n->seg, seg, len) == 0)
+      return n;
+  }
+  return NULL;
+}
+
+// The node with the longest route prefix of path, setting *rest to what follows
+static httpd_node_t *httpd_route_find( httpd_node_t *root, const char *path, const char **rest ) {
+  httpd_node_t *n = root, *best = root->ref != LUA_NOREF ? root : NULL;
+  const char *p = path;
+  *rest = path;
+  while (*p == '/') {
+    const char *seg = ++p;
+    while (*p && *p != '/')
+      p++;
+    if (p == seg)
+      continue;
+    if (!(n = httpd_node_child(n, seg, p - seg)))
+      break;
+    if (n->ref != LUA_NOREF) {
+      best = n;
+      *rest = p;
+    }
+  }
+  return best;
+}
+
+#pragma mark - Connections
+
+static httpd_conn_t *httpd_check_conn( lua_State *L, int ndx ) {
+  return (httpd_conn_t *)luaL_checkudata(L, ndx, HTTPD_CONN);
+}
+
+// Drops the received data, the request and the buffers
+static void httpd_conn_release( lua_State *L, httpd_conn_t *c ) {
+  if (c->rx) {
+    pbuf_free(c->rx);
+    c->rx = NULL;
+  }
+  free(c->head);
+  c->head = NULL;
+  c->head_len = 0;
+  free(c->body);
+  c->body = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, c->req_ref);
+  c->req_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, c->route_ref);
+  c->route_ref = LUA_NOREF;
+}
+
+// The socket has gone, so let the connection be collected
+static void httpd_conn_end( lua_State *L, httpd_conn_t *c ) {
+  if (c->state == HTTPD_STATE_CLOSED)
+    return;
+  c->state = HTTPD_STATE_CLOSED;
+  c->sock = NULL;
+  c->srv->connections--;
+  httpd_conn_release(L, c);
+  luaL_unref(L, LUA_REGISTRYINDEX, c->sock_ref);
+  c->sock_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, c->srv_ref);
+  c->srv_ref = LUA_NOREF;
+  int ref = c->self_ref;
+  c->self_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
+static void httpd_close( lua_State *L, httpd_conn_t *c ) {
+  if (c->state == HTTPD_STATE_CLOSED)
+    return;
+  int top = lua_gettop(L);
+  net_sink_detach(c->sock);
+  lua_pushcfunction(L, net_close);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->sock_ref);
+  lua_pcall(L, 1, 0, 0);
+  lua_settop(L, top);
+  httpd_conn_end(L, c);
+}
+
+static void httpd_sink( void *arg, struct pbuf *p ) {
+  httpd_conn_t *c = (httpd_conn_t *)arg;
+  lua_State *L = lua_getstate();
+  if (!p) {
+    httpd_conn_end(L, c);
+  } else if (c->state == HTTPD_STATE_CLOSED) {
+    pbuf_free(p);
+  } else {
+    if (c->rx) {
+      pbuf_cat(c->rx, p);
+    } else {
+      c->rx = p;
+      c->rx_off = 0;
+    }
+    httpd_process(L, c);
+  }
+}
+
+static u16_t httpd_rx_avail( httpd_conn_t *c ) {
+  return c->rx ? c->rx->tot_len - c->rx_off : 0;
+}
+
+// Uses n received bytes, opening the window by as much
+static void httpd_rx_consume( httpd_conn_t *c, u16_t n ) {
+  net_sink_recved(c->sock, n);
+  c->rx_off += n;
+  while (c->rx && c->rx_off >= c->rx->len) {
+    struct pbuf *p = c->rx;
+    c->rx_off -= p->len;
+    c->rx = p->next;
+    if (p->next)
+      pbuf_ref(p->next);
+    pbuf_free(p);
+  }
+}
+
+#pragma mark - Responses
+
+// Lua: the reader of a response, returning each of its upvalues once
+static int httpd_reader( lua_State *L ) {
+  int i;
+  for (i = 1; i <= 2; i++) {
+    if (!lua_isnil(L, lua_upvalueindex(i))) {
+      lua_pushvalue(L, lua_upvalueindex(i));
+      lua_pushnil(L);
+      lua_replace(L, lua_upvalueindex(i));
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Lua: called once the response has been acknowledged
+static int httpd_sent( lua_State *L ) {
+  httpd_conn_t *c = (httpd_conn_t *)lua_touserdata(L, lua_upvalueindex(1));
+  if (c->state != HTTPD_STATE_BUSY)
+    return 0;
+  if (!c->keep_alive) {
+    httpd_close(L, c);
+    return 0;
+  }
+  free(c->body);
+  c->body = NULL;
+  c->head_len = 0;
+  c->state = HTTPD_STATE_HEAD;
+  httpd_process(L, c);
+  return 0;
+}
+
+// Pushes the status line and headers, adding those of the table at hdrs if not 0
+static void httpd_push_head( lua_State *L, httpd_conn_t *c, int status, const char *type,
+                             uint32_t len, int gzip, int hdrs ) {
+  char line[80];
+  int base = lua_gettop(L);
+  ets_sprintf(line, "HTTP/1.1 %d %s\r\nContent-Length: %u\r\n", status, httpd_status_text(status), len);
+  lua_pushstring(L, line);
+  if (type) {
+    lua_pushliteral(L, "Content-Type: ");
+    lua_pushstring(L, type);
+    lua_pushliteral(L, "\r\n");
+  }
+  if (gzip)
+    lua_pushliteral(L, "Content-Encoding: gzip\r\n");
+  if (c->keep_alive)
+    lua_pushliteral(L, "Connection: keep-alive\r\n");
+  else
+    lua_pushliteral(L, "Connection: close\r\n");
+  lua_concat(L, lua_gettop(L) - base);
+  if (hdrs) {
+    lua_pushnil(L);
+    while (lua_next(L, hdrs)) {
+      if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+        lua_pushvalue(L, base + 1);
+        lua_pushvalue(L, -3);
+        lua_pushliteral(L, ": ");
+        lua_pushvalue(L, -4);
+        lua_pushliteral(L, "\r\n");
+        lua_concat(L, 5);
+        lua_replace(L, base + 1);
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pushliteral(L, "\r\n");
+  lua_concat(L, 2);
+}
+
+// Streams the head and body on the top of the stack, then waits for the ack
+static void httpd_respond( lua_State *L, httpd_conn_t *c ) {
+  if (c->is_head) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  lua_pushcclosure(L, httpd_reader, 2);
+  lua_pushcfunction(L, net_stream);
+  lua_insert(L, -2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->sock_ref);
+  lua_insert(L, -2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->self_ref);
+  lua_pushcclosure(L, httpd_sent, 1);
+  c->state = HTTPD_STATE_BUSY;
+  if (lua_pcall(L, 3, 0, 0)) {
+    lua_pop(L, 1);
+    httpd_close(L, c);
+  }
+}
+
+static void httpd_error( lua_State *L, httpd_conn_t *c, int status ) {
+  const char *text = httpd_status_text(status);
+  c->srv->errors++;
+  c->keep_alive = 0;
+  httpd_push_head(L, c, status, "text/plain", strlen(text), 0, 0);
+  lua_pushstring(L, text);
+  httpd_respond(L, c);
+}
+
+// Sends the file routed to, or the file with .gz added if only that exists
+static void httpd_send_file( lua_State *L, httpd_conn_t *c, const char *rest ) {
+  size_t dl, rl;
+  struct vfs_stat st;
+  int gzip = 0;
+  char name[HTTPD_NAME_MAX];
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->route_ref);
+  const char *dir = lua_tolstring(L, -1, &dl);
+  while (*rest == '/')
+    rest++;
+  rl = strlen(rest);
+  if (strstr(rest, "..")) {
+    lua_pop(L, 1);
+    httpd_error(L, c, 403);
+    return;
+  }
+  if (dl + rl + sizeof("index.html.gz") > sizeof(name)) {
+    lua_pop(L, 1);
+    httpd_error(L, c, 404);
+    return;
+  }
+  memcpy(name, dir, dl);
+  memcpy(name + dl, rest, rl + 1);
+  lua_pop(L, 1);
+  if (rl == 0 || rest[rl - 1] == '/')
+    strcat(name, "index.html");
+  size_t nl = strlen(name);
+
+  if (vfs_stat(name, &st) != VFS_RES_OK || st.is_dir) {
+    strcat(name, ".gz");
+    if (vfs_stat(name, &st) != VFS_RES_OK || st.is_dir) {
+      httpd_error(L, c, 404);
+      return;
+    }
+    gzip = 1;
+  }
+
+  httpd_push_head(L, c, 200, httpd_content_type(name, nl), st.size, gzip, 0);
+  if (c->is_head || st.size == 0) {
+    lua_pushnil(L);
+    httpd_respond(L, c);
+    return;
+  }
+  c->state = HTTPD_STATE_BUSY;
+  lua_pushcfunction(L, net_send);
+  lua_insert(L, -2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->sock_ref);
+  lua_insert(L, -2);
+  if (lua_pcall(L, 2, 0, 0) == 0) {
+    lua_pushcfunction(L, net_sendfile);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->sock_ref);
+    lua_pushstring(L, name);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->self_ref);
+    lua_pushcclosure(L, httpd_sent, 1);
+    if (lua_pcall(L, 3, 0, 0) == 0)
+      return;
+  }
+  lua_pop(L, 1);
+  httpd_close(L, c);
+}
+
+// Calls the handler with the request table, and sends what it returns
+static void httpd_call( lua_State *L, httpd_conn_t *c ) {
+  int top = lua_gettop(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->route_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->req_ref);
+  if (c->body) {
+    lua_pushlstring(L, c->body, c->body_len);
+    lua_setfield(L, -2, "body");
+    free(c->body);
+    c->body = NULL;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, c->req_ref);
+  c->req_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, c->route_ref);
+  c->route_ref = LUA_NOREF;
+
+  if (luaL_pcallx(L, 1, 3) || c->state == HTTPD_STATE_CLOSED || !lua_isnumber(L, top + 1)) {
+    lua_settop(L, top);
+    if (c->state != HTTPD_STATE_CLOSED)
+      httpd_error(L, c, 500);
+    return;
+  }
+  int status = lua_tointeger(L, top + 1);
+  size_t len = 0;
+  if (lua_isstring(L, top + 2)) {
+    lua_tolstring(L, top + 2, &len);
+  } else {
+    lua_pushnil(L);
+    lua_replace(L, top + 2);
+  }
+  const char *type = lua_type(L, top + 3) == LUA_TSTRING ? lua_tostring(L, top + 3) : NULL;
+  int hdrs = lua_istable(L, top + 3) ? top + 3 : 0;
+  if (hdrs) {
+    lua_getfield(L, hdrs, "Content-Type");
+    if (lua_isnil(L, -1) && len)
+      type = "text/html";
+    lua_pop(L, 1);
+  } else if (!type && len) {
+    type = "text/html";
+  }
+  httpd_push_head(L, c, status, type, len, 0, hdrs);
+  lua_pushvalue(L, top + 2);
+  httpd_respond(L, c);
+  lua_settop(L, top);
+}
+
+#pragma mark - Requests
+
+static int httpd_hex( char ch ) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
+
+// Decodes %xx in place; returns 0 if malformed or if it decodes a NUL
+static int httpd_unescape( char *s ) {
+  char *d = s;
+  for (; *s; s++) {
+    if (*s == '%') {
+      int h = httpd_hex(s[1]), l = h < 0 ? -1 : httpd_hex(s[2]);
+      if (l < 0 || (h | l) == 0)
+        return 0;
+      *d++ = (h << 4) | l;
+      s += 2;
+    } else {
+      *d++ = *s;
+    }
+  }
+  *d = 0;
+  return 1;
+}
+
+// Parses the head, whose lines end in CR LF and which ends with an empty line
+static int httpd_parse( lua_State *L, httpd_conn_t *c ) {
+  char *p = c->head, *end = c->head + c->head_len - 2;
+  char *method, *target, *version, *query;
+  const char *rest = "";
+  int chunked = 0;
+  int32_t length = 0;
+
+  // request line
+  char *eol = strstr(p, "\r\n");
+  *eol = 0;
+  method = p;
+  if (!(target = strchr(method, ' ')))
+    return 400;
+  *target++ = 0;
+  if (!(version = strchr(target, ' ')))
+    return 400;
+  *version++ = 0;
+  if (strncmp(version, "HTTP/1.", 7) || !version[7] || version[8] || *target != '/')
+    return 400;
+  c->keep_alive = version[7] != '0';
+  c->is_head = strcmp(method, "HEAD") == 0;
+  if ((query = strchr(target, '?')))
+    *query++ = 0;
+  if (!httpd_unescape(target))
+    return 400;
+
+  httpd_node_t *route = httpd_route_find(c->srv->root, target, &rest);
+  if (!route)
+    return 404;
+  c->route_static = route->is_static;
+  if (c->route_static && !c->is_head && strcmp(method, "GET"))
+    return 405;
+  c->rest_off = rest - c->head;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, route->ref);
+  c->route_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  int tbl = 0;
+  if (!c->route_static) {
+    lua_createtable(L, 0, 8);
+    tbl = lua_gettop(L);
+    lua_pushstring(L, method);
+    lua_setfield(L, tbl, "method");
+    lua_pushstring(L, target);
+    lua_setfield(L, tbl, "path");
+    lua_pushstring(L, rest);
+    lua_setfield(L, tbl, "subpath");
+    if (query) {
+      lua_pushstring(L, query);
+      lua_setfield(L, tbl, "query");
+    }
+    lua_pushstring(L, version + 5);
+    lua_setfield(L, tbl, "version");
+    lua_pushcfunction(L, net_getpeer);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->sock_ref);
+    if (lua_pcall(L, 1, 2, 0) == 0) {
+      lua_setfield(L, tbl, "ip");
+      lua_setfield(L, tbl, "port");
+    } else {
+      lua_pop(L, 1);
+    }
+    lua_newtable(L);
+  }
+
+  // header lines
+  for (p = eol + 2; p < end; p = eol + 2) {
+    eol = strstr(p, "\r\n");
+    *eol = 0;
+    char *name = p, *value = strchr(p, ':');
+    if (!value || value == name)
+      return 400;
+    *value++ = 0;
+    while (*value == ' ' || *value == '\t')
+      value++;
+    char *v_end = eol;
+    while (v_end > value && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+      *--v_end = 0;
+    for (p = name; *p; p++) {
+      if (*p >= 'A' && *p <= 'Z')
+        *p += 'a' - 'A';
+    }
+
+    if (strcmp(name, "content-length") == 0) {
+      char *e;
+      length = strtol(value, &e, 10);
+      if (*e || length < 0)
+        return 400;
+    } else if (strcmp(name, "transfer-encoding") == 0) {
+      chunked = 1;
+    } else if (strcmp(name, "connection") == 0) {
+      if (strcasecmp(value, "close") == 0)
+        c->keep_alive = 0;
+      else if (strcasecmp(value, "keep-alive") == 0)
+        c->keep_alive = 1;
+    }
+    if (tbl) {
+      lua_pushstring(L, value);
+      lua_setfield(L, -2, name);
+    }
+  }
+
+  if (tbl) {
+    lua_setfield(L, tbl, "headers");
+    c->req_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  if (chunked)
+    return 501;
+  if ((uint32_t)length > c->srv->body_max)
+    return 413;
+  c->body_len = 0;
+  c->body_left = length;
+  if (length && !c->route_static && !(c->body = (char *)malloc(length)))
+    return 503;
+  return 0;
+}
+
+// The request is complete
+static void httpd_dispatch( lua_State *L, httpd_conn_t *c ) {
+  c->srv->requests++;
+  if (c->route_static) {
+    httpd_send_file(L, c, c->head + c->rest_off);
+    luaL_unref(L, LUA_REGISTRYINDEX, c->route_ref);
+    c->route_ref = LUA_NOREF;
+  } else {
+    httpd_call(L, c);
+  }
+}
+
+static void httpd_process( lua_State *L, httpd_conn_t *c ) {
+  if (c->in_process)
+    return;           // the outer call carries on with the new state
+  c->in_process = 1;
+  // a close below must not let the connection be collected while in use
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->self_ref);
+  int top = lua_gettop(L);
+
+  while (c->state == HTTPD_STATE_HEAD || c->state == HTTPD_STATE_BODY) {
+    u16_t avail = httpd_rx_avail(c);
+    if (!avail)
+      break;
+
+    if (c->state == HTTPD_STATE_BODY) {
+      u16_t n = avail > c->body_left ? c->body_left : avail;
+      if (c->body)
+        pbuf_copy_partial(c->rx, c->body + c->body_len, n, c->rx_off);
+      c->body_len += n;
+      c->body_left -= n;
+      httpd_rx_consume(c, n);
+      if (!c->body_left)
+        httpd_dispatch(L, c);
+      continue;
+    }
+
+    if (!c->head && !(c->head = (char *)malloc(c->srv->head_max + 1))) {
+      httpd_close(L, c);
+      break;
+    }
+    if (c->head_len == 0) {
+      // skip the line ends that may follow the previous request
+      char ch = pbuf_get_at(c->rx, c->rx_off);
+      if (ch == '\r' || ch == '\n') {
+        httpd_rx_consume(c, 1);
+        continue;
+      }
+    }
+    u16_t room = c->srv->head_max - c->head_len;
+    u16_t n = avail > room ? room : avail;
+    pbuf_copy_partial(c->rx, c->head + c->head_len, n, c->rx_off);
+    // look for the empty line, which may have started in the earlier data
+    u16_t i = c->head_len > 3 ? c->head_len - 3 : 0, len = c->head_len + n;
+    while (i + 4 <= len && memcmp(c->head + i, "\r\n\r\n", 4))
+      i++;
+    if (i + 4 > len) {
+      httpd_rx_consume(c, n);
+      c->head_len = len;
+      if (len == c->srv->head_max)
+        httpd_error(L, c, 431);
+      continue;
+    }
+    httpd_rx_consume(c, i + 4 - c->head_len);
+    c->head_len = i + 4;
+    c->head[c->head_len] = 0;
+    if (memchr(c->head, 0, c->head_len)) {
+      httpd_error(L, c, 400);
+      continue;
+    }
+    int status = httpd_parse(L, c);
+    lua_settop(L, top);
+    if (status) {
+      httpd_error(L, c, status);
+    } else if (c->body_left) {
+      c->state = HTTPD_STATE_BODY;
+    } else {
+      httpd_dispatch(L, c);
+    }
+  }
+
+  c->in_process = 0;
+  lua_settop(L, top - 1);
+}
+
+// Lua: accept callback of the net.tcpserver, with the server as upvalue
+static int httpd_accept( lua_State *L ) {
+  httpd_server_t *srv = (httpd_server_t *)lua_touserdata(L, lua_upvalueindex(1));
+  httpd_conn_t *c = (httpd_conn_t *)lua_newuserdata(L, sizeof(httpd_conn_t));
+  memset(c, 0, sizeof(*c));
+  c->self_ref = c->srv_ref = c->sock_ref = c->route_ref = c->req_ref = LUA_NOREF;
+  c->state = HTTPD_STATE_CLOSED;
+  luaL_getmetatable(L, HTTPD_CONN);
+  lua_setmetatable(L, -2);
+  if (!(c->sock = net_sink_attach(L, 1, httpd_sink, c))) {
+    lua_pushcfunction(L, net_close);
+    lua_pushvalue(L, 1);
+    lua_pcall(L, 1, 0, 0);
+    return 0;
+  }
+  c->srv = srv;
+  c->state = HTTPD_STATE_HEAD;
+  srv->connections++;
+  c->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 1);
+  c->sock_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  c->srv_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+static int httpd_conn_gc( lua_State *L ) {
+  httpd_conn_t *c = httpd_check_conn(L, 1);
+  httpd_conn_release(L, c);
+  return 0;
+}
+
+#pragma mark - Lua API
+
+static httpd_server_t *httpd_check_server( lua_State *L, int ndx ) {
+  return (httpd_server_t *)luaL_checkudata(L, ndx, HTTPD_SERVER);
+}
+
+// Lua: httpd.create([{timeout=, maxhead=, maxbody=}])
+static int httpd_create( lua_State *L ) {
+  int timeout = 30, head_max = HTTPD_HEAD_MAX, body_max = HTTPD_BODY_MAX;
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "timeout");
+    timeout = luaL_optinteger(L, -1, timeout);
+    lua_getfield(L, 1, "maxhead");
+    head_max = luaL_optinteger(L, -1, head_max);
+    lua_getfield(L, 1, "maxbody");
+    body_max = luaL_optinteger(L, -1, body_max);
+    lua_pop(L, 3);
+    luaL_argcheck(L, timeout > 0, 1, "invalid timeout");
+    luaL_argcheck(L, head_max >= 64 && head_max <= 8192, 1, "invalid maxhead");
+    luaL_argcheck(L, body_max >= 0, 1, "invalid maxbody");
+  } else if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+  }
+
+  httpd_server_t *srv = (httpd_server_t *)lua_newuserdata(L, sizeof(httpd_server_t));
+  memset(srv, 0, sizeof(*srv));
+  srv->net_ref = LUA_NOREF;
+  srv->root = httpd_node_new("", 0);
+  srv->head_max = head_max;
+  srv->body_max = body_max;
+  srv->timeout = timeout;
+  luaL_getmetatable(L, HTTPD_SERVER);
+  lua_setmetatable(L, -2);
+  if (!srv->root)
+    return luaL_error(L, "out of memory");
+  return 1;
+}
+
+// Lua: server:route(prefix, handler(req) or directory), server:route(prefix, nil)
+static int httpd_route( lua_State *L ) {
+  httpd_server_t *srv = httpd_check_server(L, 1);
+  const char *p = luaL_checkstring(L, 2);
+  luaL_argcheck(L, *p == '/', 2, "must start with /");
+  int is_static = lua_type(L, 3) == LUA_TSTRING;
+  if (!is_static && !lua_isnoneornil(L, 3))
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+
+  httpd_node_t *n = srv->root;
+  while (*p) {
+    while (*p == '/')
+      p++;
+    const char *seg = p;
+    while (*p && *p != '/')
+      p++;
+    if (p == seg)
+      break;
+    httpd_node_t *child = httpd_node_child(n, seg, p - seg);
+    if (!child) {
+      if (lua_isnoneornil(L, 3))
+        return 0;
+      if (!(child = httpd_node_new(seg, p - seg)))
+        return luaL_error(L, "out of memory");
+      child->next = n->child;
+      n->child = child;
+    }
+    n = child;
+  }
+
+  luaL_unref(L, LUA_REGISTRYINDEX, n->ref);
+  n->ref = LUA_NOREF;
+  if (!lua_isnoneornil(L, 3)) {
+    lua_pushvalue(L, 3);
+    n->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    n->is_static = is_static;
+  }
+  return 0;
+}
+
+// Lua: server:listen(port[, ip])
+static int httpd_listen( lua_State *L ) {
+  httpd_server_t *srv = httpd_check_server(L, 1);
+  int port = luaL_checkinteger(L, 2);
+  const char *ip = luaL_optstring(L, 3, "0.0.0.0");
+  if (srv->net_ref != LUA_NOREF)
+    return luaL_error(L, "already listening");
+
+  lua_pushcfunction(L, net_createServer);
+  lua_pushinteger(L, srv->timeout);
+  lua_call(L, 1, 1);
+  int net = lua_gettop(L);
+  lua_pushcfunction(L, net_listen);
+  lua_pushvalue(L, net);
+  lua_pushinteger(L, port);
+  lua_pushstring(L, ip);
+  lua_pushvalue(L, 1);
+  lua_pushcclosure(L, httpd_accept, 1);
+  lua_call(L, 4, 0);
+  srv->net_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+// Lua: server:close() -- stops listening, and lets open connections finish
+static int httpd_server_close( lua_State *L ) {
+  httpd_server_t *srv = httpd_check_server(L, 1);
+  if (srv->net_ref != LUA_NOREF) {
+    lua_pushcfunction(L, net_close);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, srv->net_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, srv->net_ref);
+    srv->net_ref = LUA_NOREF;
+    lua_call(L, 1, 0);
+  }
+  return 0;
+}
+
+// Lua: requests, errors, connections = server:stats()
+static int httpd_stats( lua_State *L ) {
+  httpd_server_t *srv = httpd_check_server(L, 1);
+  lua_pushinteger(L, srv->requests);
+  lua_pushinteger(L, srv->errors);
+  lua_pushinteger(L, srv->connections);
+  return 3;
+}
+
+static int httpd_server_gc( lua_State *L ) {
+  httpd_server_t *srv = httpd_check_server(L, 1);
+  httpd_node_free(L, srv->root);
+  srv->root = NULL;
+  return 0;
+}
+
+LROT_BEGIN(httpd_conn, NULL, LROT_MASK_GC)
+  LROT_FUNCENTRY( __gc, httpd_conn_gc )
+LROT_END(httpd_conn, NULL, LROT_MASK_GC)
+
+LROT_BEGIN(httpd_server, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, httpd_server_gc )
+  LROT_TABENTRY( __index, httpd_server )
+  LROT_FUNCENTRY( route, httpd_route )
+  LROT_FUNCENTRY( listen, httpd_listen )
+  LROT_FUNCENTRY( close, httpd_server_close )
+  LROT_FUNCENTRY( stats, httpd_stats )
+LROT_END(httpd_server, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(httpd, NULL, 0)
+  LROT_FUNCENTRY( create, httpd_create )
+LROT_END(httpd, NULL, 0)
+
+static int httpd_open( lua_State *L ) {
+  luaL_rometatable(L, HTTPD_SERVER, LROT_TABLEREF(httpd_server));
+  luaL_rometatable(L, HTTPD_CONN, LROT_TABLEREF(httpd_conn));
+  return 0;
+}
+
+NODEMCU_MODULE(HTTPD, "httpd", httpd, httpd_open);
@@ -8,6 +8,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include "user_interface.h"
+#ifdef LUA_USE_MODULES_NUMBUF
+#include "numbuf.h"
+#endif
 static uint8_t data_pin;
 static uint8_t clk_pin;
 // The fields below are after the pin_num conversion
@@ -20,6 +23,27 @@ static platform_task_handle_t tasknumber;
 // HX711_STATUS can be defined to enable the hx711.status() function to get debug info
 #undef HX711_STATUS
 #define BUFFERS 2
+#define MEDIAN_MAX 15
+#define AVERAGE_MAX 64
+
+// Optional filtering of the samples of each buffer down to one reading
+typedef struct {
+  uint8_t median_n;  // window of the running median, 1 for none
+  uint8_t average_n; // window of the moving average of the medians
+  uint8_t median_count;
+  uint8_t median_pos;
+  uint8_t average_count;
+  uint8_t average_pos;
+  bool has_value;
+  bool has_reported;
+  int32_t tare;
+  int32_t deadband;  // a reading is only reported once it moves by this much
+  int32_t value;     // latest output of the filter, before the tare
+  int32_t reported;
+  int64_t average_sum;
+  int32_t median[MEDIAN_MAX];
+  int32_t average[AVERAGE_MAX];
+} FILTER;
 
 typedef struct {
   char *buf[BUFFERS];
@@ -35,6 +59,7 @@ typedef struct {
   uint8_t mode;
   uint8_t dropping;  // is non zero when there is no space
   int cb_ref;
+  FILTER *filter;
 } CONTROL;
 
 static CONTROL *control;
@@ -156,11 +181,58 @@ static uint32_t ICACHE_RAM_ATTR hx711_interrupt(uint32_t ret_gpio_status)
   return gpio_status & ~pin_mask;
 }
 
-// Lua: hx711.start( mode, samples, callback ) 
+static int32_t filter_median(FILTER *f, int32_t sample) {
+  f->median[f->median_pos] = sample;
+  f->median_pos = (f->median_pos + 1) % f->median_n;
+  if (f->median_count < f->median_n) {
+    f->median_count++;
+  }
+
+  // insertion sort of a copy, the window is small
+  int32_t sorted[MEDIAN_MAX];
+  int i, j;
+  for (i = 0; i < f->median_count; i++) {
+    int32_t v = f->median[i];
+    for (j = i; j > 0 && sorted[j - 1] > v; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = v;
+  }
+  return sorted[f->median_count / 2];
+}
+
+static void filter_sample(FILTER *f, int32_t sample) {
+  int32_t median = filter_median(f, sample);
+
+  if (f->average_count == f->average_n) {
+    f->average_sum -= f->average[f->average_pos];
+  } else {
+    f->average_count++;
+  }
+  f->average[f->average_pos] = median;
+  f->average_sum += median;
+  f->average_pos = (f->average_pos + 1) % f->average_n;
+
+  f->value = f->average_sum / f->average_count;
+  f->has_value = true;
+}
+
+static int get_filter_field(lua_State *L, int idx, const char *name, int dflt, int min, int max) {
+  lua_getfield(L, idx, name);
+  int v = luaL_optinteger(L, -1, dflt);
+  lua_pop(L, 1);
+  if (v < min || v > max) {
+    return luaL_error(L, "%s out of range (%d-%d)", name, min, max);
+  }
+  return v;
+}
+
+// Lua: hx711.start( mode, samples, callback [, filter] )
 static int hx711_start( lua_State* L )
 {
   uint32_t mode = luaL_checkint( L, 1 );
   uint32_t samples = luaL_checkint( L, 2 );
+  bool filtered = !lua_isnoneornil(L, 4);
 
   if (mode > 2) {
     return luaL_argerror( L, 1, "Mode value out of range" );
@@ -174,9 +246,21 @@ static int hx711_start( lua_State* L )
     return luaL_error( L, "Already running" );
   }
 
+  FILTER filter = { .median_n = 1, .average_n = 1 };
+  if (filtered) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    filter.median_n = get_filter_field(L, 4, "median", 1, 1, MEDIAN_MAX);
+    filter.average_n = get_filter_field(L, 4, "average", 1, 1, AVERAGE_MAX);
+    filter.deadband = get_filter_field(L, 4, "deadband", 0, 0, 0x7fffff);
+    lua_getfield(L, 4, "tare");
+    filter.tare = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+  }
+
   int buflen = 3 * samples;
 
-  control = (CONTROL *) luaM_malloc(L, sizeof(CONTROL) + BUFFERS * buflen);
+  size_t size = sizeof(CONTROL) + (filtered ? sizeof(FILTER) : 0) + BUFFERS * buflen;
+  control = (CONTROL *) luaM_malloc(L, size);
   if (!control) {
     return luaL_error( L, "Failed to allocate memory" );
   }
@@ -187,13 +271,18 @@ static int hx711_start( lua_State* L )
     lua_pushvalue(L, 3);  // copy argument (func) to the top of stack
     cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   } else {
-    luaM_free(L, control);
+    luaM_freemem(L, control, size);
     control = NULL;
     return luaL_argerror( L, 3, "Not a callback function" );
   }
 
   memset(control, 0, sizeof(*control));
   control->buf[0] = (char *) (control + 1);
+  if (filtered) {
+    control->filter = (FILTER *) (control + 1);
+    *control->filter = filter;
+    control->buf[0] = (char *) (control->filter + 1);
+  }
   control->buflen = buflen;
   int i;
 
@@ -224,12 +313,33 @@ static int hx711_stop( lua_State* L )
     CONTROL *to_free = control;
     control = NULL;
     luaL_unref(L, LUA_REGISTRYINDEX, to_free->cb_ref);
-    luaM_free(L, to_free);
+    luaM_freemem(L, to_free, sizeof(CONTROL) + (to_free->filter ? sizeof(FILTER) : 0) + BUFFERS * to_free->buflen);
   }
 
   return 0;
 }
 
+// Lua: tare = hx711.tare( [tare] )
+static int hx711_tare( lua_State* L )
+{
+  if (!control || !control->filter) {
+    return luaL_error( L, "Not running with a filter" );
+  }
+  FILTER *f = control->filter;
+  if (lua_isnoneornil(L, 1)) {
+    if (!f->has_value) {
+      return luaL_error( L, "No reading yet" );
+    }
+    f->tare = f->value;
+  } else {
+    f->tare = luaL_checkinteger(L, 1);
+  }
+  // the next reading is reported whatever the dead band
+  f->has_reported = false;
+  lua_pushinteger(L, f->tare);
+  return 1;
+}
+
 static int hx711_status( lua_State* L )
 {
   if (control) {
@@ -249,6 +359,32 @@ static void hx711_task(platform_task_param_t param, uint8_t prio)
 
   lua_State *L = lua_getstate();
 
+  FILTER *f = control->filter;
+  if (f) {
+    const unsigned char *p = (const unsigned char *) control->buf[param];
+    int i;
+    for (i = 0; i < control->buflen; i += 3) {
+      filter_sample(f, (int32_t) ((uint32_t) (p[i] | (p[i + 1] << 8) | (p[i + 2] << 16)) << 8) >> 8);
+    }
+    control->freed = param;
+
+    int32_t reading = f->value - f->tare;
+    if (f->has_reported && abs(reading - f->reported) < f->deadband) {
+      return;
+    }
+    f->reported = reading;
+    f->has_reported = true;
+
+    if (control->cb_ref != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, control->cb_ref);
+      lua_pushinteger(L, reading);
+      lua_pushinteger(L, control->timestamp[param]);
+      lua_pushinteger(L, control->dropped[param]);
+      luaL_pcallx(L, 3, 0);
+    }
+    return;
+  }
+
   if (control->cb_ref != LUA_NOREF) {
     lua_rawgeti(L, LUA_REGISTRYINDEX, control->cb_ref);
 
@@ -265,7 +401,7 @@ static void hx711_task(platform_task_param_t param, uint8_t prio)
 
 #define HX711_MAX_WAIT 1000000
 /*will only read chA@128gain*/
-/*Lua: result = hx711.read()*/
+/*Lua: result = hx711.read([mode [, buf]])*/
 static int hx711_read(lua_State* L) {
   int j;
   //TODO: double check init has happened first.
@@ -309,6 +445,10 @@ static int hx711_read(lua_State* L) {
 
   //sleep -- unfortunately, this resets the mode to 0
   platform_gpio_write(clk_pin, 1);
+#ifdef LUA_USE_MODULES_NUMBUF
+  if (!lua_isnoneornil(L, 2))
+    numbuf_push(numbuf_from_lua_arg(L, 2), data);
+#endif
   lua_pushinteger(L, data);
   return 1;
 }
@@ -323,6 +463,7 @@ LROT_BEGIN(hx711, NULL, 0)
   LROT_FUNCENTRY( status, hx711_status )
 #endif
   LROT_FUNCENTRY( stop,  hx711_stop )
+  LROT_FUNCENTRY( tare,  hx711_tare )
 #endif
 LROT_END(hx711, NULL, 0)
 
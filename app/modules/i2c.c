@@ -145,6 +145,210 @@ static int i2c_read( lua_State *L )
   return 1;
 }
 
+// Push the write data argument at arg as a string: a string, a table of
+// bytes, a single byte or nil for nothing
+static void pushdata( lua_State *L, int arg )
+{
+  int t = lua_type( L, arg );
+  if( t == LUA_TNONE || t == LUA_TNIL )
+    lua_pushliteral( L, "" );
+  else if( t == LUA_TSTRING )
+    lua_pushvalue( L, arg );
+  else
+  {
+    luaL_Buffer b;
+    size_t i, n = t == LUA_TTABLE ? lua_objlen( L, arg ) : 1;
+    if( t != LUA_TTABLE )
+      luaL_checkinteger( L, arg );
+    luaL_buffinit( L, &b );
+    for( i = 0; i < n; i ++ )
+    {
+      int numdata;
+      if( t == LUA_TTABLE )
+      {
+        lua_rawgeti( L, arg, i + 1 );
+        numdata = ( int )luaL_checkinteger( L, -1 );
+        lua_pop( L, 1 );
+      }
+      else
+        numdata = ( int )lua_tointeger( L, arg );
+      if( numdata < 0 || numdata > 255 )
+        luaL_error( L, "wrong arg range" );
+      luaL_addchar( &b, ( char )numdata );
+    }
+    luaL_pushresult( &b );
+  }
+}
+
+static int checkaddress( lua_State *L, int arg )
+{
+  int address = luaL_checkinteger( L, arg );
+  luaL_argcheck( L, address >= 0 && address <= 127, arg, "wrong arg range" );
+  return address;
+}
+
+// Run one transfer, pushing the bytes read or nil if the device did not ack
+static void transfer( lua_State *L, unsigned id, int address, const char *wdata, size_t wlen, size_t rlen )
+{
+  uint8_t *rdata = rlen ? ( uint8_t * )lua_newuserdata( L, rlen ) : NULL;
+  int ok = platform_i2c_transfer( id, address, ( const uint8_t * )wdata, wlen, rdata, rlen );
+  if( ok )
+    lua_pushlstring( L, ( const char * )rdata, rlen );
+  else
+    lua_pushnil( L );
+  if( rlen )
+    lua_remove( L, -2 );
+}
+
+// Batches are queued as job tables and run from a task, one transfer per
+// task call so that other tasks can run in between
+enum { JOB_ID = 1, JOB_STEPS, JOB_CB, JOB_RESULTS, JOB_NEXT };
+
+static platform_task_handle_t i2c_batch_task;
+static int i2c_queue_ref = LUA_NOREF;
+static int i2c_queue_head = 1, i2c_queue_tail = 1;
+
+static lua_Integer job_field( lua_State *L, int job, int field )
+{
+  lua_rawgeti( L, job, field );
+  lua_Integer v = lua_tointeger( L, -1 );
+  lua_pop( L, 1 );
+  return v;
+}
+
+static void i2c_batch_step( platform_task_param_t param, uint8_t prio )
+{
+  (void)param;
+  (void)prio;
+  lua_State *L = lua_getstate();
+  int top = lua_gettop( L );
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, i2c_queue_ref );
+  lua_rawgeti( L, -1, i2c_queue_head );
+  int job = lua_gettop( L );
+  int next = job_field( L, job, JOB_NEXT );
+
+  // each step is stored as address, write data and read length
+  lua_rawgeti( L, job, JOB_STEPS );
+  lua_rawgeti( L, -1, next * 3 - 2 );
+  lua_rawgeti( L, -2, next * 3 - 1 );
+  lua_rawgeti( L, -3, next * 3 );
+  unsigned id = job_field( L, job, JOB_ID );
+  int address = lua_tointeger( L, -3 );
+  size_t wlen, rlen = lua_tointeger( L, -1 );
+  const char *wdata = lua_tolstring( L, -2, &wlen );
+  transfer( L, id, address, wdata, wlen, rlen );
+
+  lua_rawgeti( L, job, JOB_RESULTS );
+  lua_pushvalue( L, -2 );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    lua_pushboolean( L, 0 );
+  }
+  lua_rawseti( L, -2, next );
+
+  lua_rawgeti( L, job, JOB_STEPS );
+  int done = next * 3 >= lua_objlen( L, -1 );
+  lua_pushinteger( L, next + 1 );
+  lua_rawseti( L, job, JOB_NEXT );
+
+  if( done )
+  {
+    lua_pushnil( L );
+    lua_rawseti( L, job - 1, i2c_queue_head++ );
+    if( i2c_queue_head < i2c_queue_tail )
+      platform_post_low( i2c_batch_task, 0 );
+    lua_rawgeti( L, job, JOB_CB );
+    lua_rawgeti( L, job, JOB_RESULTS );
+    luaL_pcallx( L, 1, 0 );
+  }
+  else
+  {
+    platform_post_low( i2c_batch_task, 0 );
+  }
+  lua_settop( L, top );
+}
+
+// Lua: i2c.transfer( id, batch, callback )
+static int i2c_transfer_batch( lua_State *L, unsigned id )
+{
+  size_t i, n = lua_objlen( L, 2 );
+
+  luaL_argcheck( L, n > 0, 2, "empty batch" );
+  luaL_checktype( L, 3, LUA_TFUNCTION );
+  lua_settop( L, 3 );
+
+  lua_createtable( L, 5, 0 );
+  lua_pushinteger( L, id );
+  lua_rawseti( L, -2, JOB_ID );
+  lua_createtable( L, n * 3, 0 );
+  for( i = 1; i <= n; i ++ )
+  {
+    lua_rawgeti( L, 2, i );
+    luaL_argcheck( L, lua_istable( L, -1 ), 2, "entries should be tables" );
+    int entry = lua_gettop( L );
+    lua_rawgeti( L, entry, 1 );
+    lua_rawgeti( L, entry, 2 );
+    lua_rawgeti( L, entry, 3 );
+    int address = luaL_optinteger( L, entry + 1, -1 );
+    int rlen = luaL_optinteger( L, entry + 3, 0 );
+    luaL_argcheck( L, address >= 0 && address <= 127 && rlen >= 0, 2, "wrong arg range" );
+    lua_pushinteger( L, address );
+    lua_rawseti( L, entry - 1, i * 3 - 2 );
+    pushdata( L, entry + 2 );
+    lua_rawseti( L, entry - 1, i * 3 - 1 );
+    lua_pushinteger( L, rlen );
+    lua_rawseti( L, entry - 1, i * 3 );
+    lua_settop( L, entry - 1 );
+  }
+  lua_rawseti( L, -2, JOB_STEPS );
+  lua_pushvalue( L, 3 );
+  lua_rawseti( L, -2, JOB_CB );
+  lua_createtable( L, n, 0 );
+  lua_rawseti( L, -2, JOB_RESULTS );
+  lua_pushinteger( L, 1 );
+  lua_rawseti( L, -2, JOB_NEXT );
+
+  if( i2c_queue_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    i2c_queue_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  if( i2c_queue_head == i2c_queue_tail )
+  {
+    i2c_queue_head = i2c_queue_tail = 1;
+    platform_post_low( i2c_batch_task, 0 );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, i2c_queue_ref );
+  lua_insert( L, -2 );
+  lua_rawseti( L, -2, i2c_queue_tail++ );
+  return 0;
+}
+
+// Lua: data = i2c.transfer( id, address, [write_data], [read_len] )
+// Lua: i2c.transfer( id, batch, callback )
+static int i2c_transfer( lua_State *L )
+{
+  unsigned id = luaL_checkinteger( L, 1 );
+
+  MOD_CHECK_ID( i2c, id );
+  if( !platform_i2c_configured( id ) )
+    return luaL_error( L, "i2c %d is not configured", id );
+
+  if( lua_istable( L, 2 ) )
+    return i2c_transfer_batch( L, id );
+
+  int address = checkaddress( L, 2 );
+  int rlen = luaL_optinteger( L, 4, 0 );
+  luaL_argcheck( L, rlen >= 0, 4, "wrong arg range" );
+  pushdata( L, 3 );
+  size_t wlen;
+  const char *wdata = lua_tolstring( L, -1, &wlen );
+  transfer( L, id, address, wdata, wlen, rlen );
+  return 1;
+}
+
 // Module function map
 LROT_BEGIN(i2c, NULL, 0)
   LROT_FUNCENTRY( setup, i2c_setup )
@@ -153,6 +357,7 @@ LROT_BEGIN(i2c, NULL, 0)
   LROT_FUNCENTRY( address, i2c_address )
   LROT_FUNCENTRY( write, i2c_write )
   LROT_FUNCENTRY( read, i2c_read )
+  LROT_FUNCENTRY( transfer, i2c_transfer )
   LROT_NUMENTRY( FASTPLUS, PLATFORM_I2C_SPEED_FASTPLUS )
   LROT_NUMENTRY( FAST, PLATFORM_I2C_SPEED_FAST )
   LROT_NUMENTRY( SLOW, PLATFORM_I2C_SPEED_SLOW )
@@ -161,4 +366,9 @@ LROT_BEGIN(i2c, NULL, 0)
 LROT_END(i2c, NULL, 0)
 
 
-NODEMCU_MODULE(I2C, "i2c", i2c, NULL);
+int luaopen_i2c( lua_State *L ) {
+  i2c_batch_task = platform_task_get_id( i2c_batch_step );
+  return 0;
+}
+
+NODEMCU_MODULE(I2C, "i2c", i2c, luaopen_i2c);
@@ -8,10 +8,28 @@
 #include "platform.h"
 #include <stdlib.h>
 #include <string.h>
+#ifdef LUA_USE_MODULES_NUMBUF
+#include "numbuf.h"
+#endif
 
 static const uint32_t i2c_id = 0;
 static const uint8_t i2c_addr = 0x69;
 
+#define L3G4200D_CTRL_REG1      0x20
+#define L3G4200D_CTRL_REG3      0x22
+#define L3G4200D_CTRL_REG5      0x24
+#define L3G4200D_OUT_X_L        0x28
+#define L3G4200D_FIFO_CTRL_REG  0x2E
+#define L3G4200D_FIFO_SRC_REG   0x2F
+#define L3G4200D_AUTO_INCREMENT 0x80
+
+#define L3G4200D_I2_WTM         0x04
+#define L3G4200D_FIFO_EN        0x40
+#define L3G4200D_FIFO_STREAM    0x40
+#define L3G4200D_FIFO_SIZE      32
+#define L3G4200D_FIFO_OVRN      0x40
+#define L3G4200D_FIFO_FSS       0x1F
+
 static uint8_t r8u(uint32_t id, uint8_t reg) {
     uint8_t ret;
 
@@ -43,22 +61,27 @@ static int l3g4200d_setup(lua_State* L) {
         return luaL_error(L, "device not found");
     }
 
-    w8u(i2c_id, 0x20, 0xF);
+    w8u(i2c_id, L3G4200D_CTRL_REG1, 0xF);
 
     return 0;
 }
 
+// Starts a burst read of the output registers, which repeat once read
+static void read_start(uint32_t id) {
+    platform_i2c_send_start(id);
+    platform_i2c_send_address(id, i2c_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
+    platform_i2c_send_byte(id, L3G4200D_OUT_X_L | L3G4200D_AUTO_INCREMENT);
+    platform_i2c_send_start(id);
+    platform_i2c_send_address(id, i2c_addr, PLATFORM_I2C_DIRECTION_RECEIVER);
+}
+
 static int l3g4200d_read(lua_State* L) {
 
     uint8_t data[6];
     int x,y,z;
     int i;
 
-    platform_i2c_send_start(i2c_id);
-    platform_i2c_send_address(i2c_id, i2c_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
-    platform_i2c_send_byte(i2c_id, 0xA8);
-    platform_i2c_send_start(i2c_id);
-    platform_i2c_send_address(i2c_id, i2c_addr, PLATFORM_I2C_DIRECTION_RECEIVER);
+    read_start(i2c_id);
 
     for (i=0; i<5; i++) {
 	data[i] = platform_i2c_recv_byte(i2c_id, 1);
@@ -79,10 +102,149 @@ static int l3g4200d_read(lua_State* L) {
     return 3;
 }
 
+#if defined(LUA_USE_MODULES_NUMBUF) && defined(GPIO_INTERRUPT_ENABLE)
+/*
+ * In stream mode the L3G4200D keeps the last 32 samples in its FIFO and
+ * raises INT2 once watermark of them are queued.  The rising edge
+ * posts a task that drains the FIFO into the buffers and calls back with the
+ * count.  With the FIFO on, a burst read wraps from OUT_Z_H back to OUT_X_L
+ * and moves to the next sample, so every queued sample comes in one burst.
+ * INT2 stays high while the watermark is still reached, so the task then
+ * runs again rather than wait for an edge that will not come.
+ */
+static struct {
+    numbuf *buf[3];
+    int buf_ref[3];
+    int cb_ref;
+    uint8_t pin;
+    uint32_t pin_mask;
+    volatile bool posted;
+} fifo = { { NULL }, { LUA_NOREF, LUA_NOREF, LUA_NOREF }, LUA_NOREF };
+static platform_task_handle_t fifo_task;
+
+static uint32_t ICACHE_RAM_ATTR l3g4200d_interrupt(uint32_t ret_gpio_status) {
+    uint32_t gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
+
+    if (gpio_status & fifo.pin_mask) {
+        GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, fifo.pin_mask);
+        if (!fifo.posted) {
+            fifo.posted = true;
+            platform_post_medium(fifo_task, 0);
+        }
+    }
+    return ret_gpio_status & ~fifo.pin_mask;
+}
+
+static int l3g4200d_fifo_drain(void) {
+    uint8_t lo = 0;
+    int i, n, src = r8u(i2c_id, L3G4200D_FIFO_SRC_REG);
+
+    n = (src & L3G4200D_FIFO_OVRN) ? L3G4200D_FIFO_SIZE : (src & L3G4200D_FIFO_FSS);
+    if (n == 0)
+        return 0;
+    read_start(i2c_id);
+    for (i = 0; i < 6 * n; i++) {
+        uint8_t b = platform_i2c_recv_byte(i2c_id, i < 6 * n - 1);
+        if (i & 1)
+            numbuf_push(fifo.buf[(i >> 1) % 3], (int16_t) ((b << 8) | lo));
+        else
+            lo = b;
+    }
+    platform_i2c_send_stop(i2c_id);
+    return n;
+}
+
+static void l3g4200d_fifo_done(platform_task_param_t param, uint8_t prio) {
+    lua_State *L = lua_getstate();
+    (void)param; (void)prio;
+
+    fifo.posted = false;
+    if (fifo.cb_ref == LUA_NOREF)
+        return;
+    int n = l3g4200d_fifo_drain();
+    if (platform_gpio_read(fifo.pin) && !fifo.posted) {
+        fifo.posted = true;
+        platform_post_medium(fifo_task, 0);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fifo.cb_ref);
+    lua_pushinteger(L, n);
+    luaL_pcallx(L, 1, 0);
+}
+
+static void l3g4200d_fifo_stop(lua_State *L) {
+    int i;
+
+    if (fifo.cb_ref == LUA_NOREF)
+        return;
+    w8u(i2c_id, L3G4200D_CTRL_REG3, 0);
+    w8u(i2c_id, L3G4200D_FIFO_CTRL_REG, 0);
+    w8u(i2c_id, L3G4200D_CTRL_REG5, r8u(i2c_id, L3G4200D_CTRL_REG5) & ~L3G4200D_FIFO_EN);
+    platform_gpio_intr_init(fifo.pin, GPIO_PIN_INTR_DISABLE);
+    platform_gpio_unregister_intr_hook(l3g4200d_interrupt);
+    luaL_unref(L, LUA_REGISTRYINDEX, fifo.cb_ref);
+    fifo.cb_ref = LUA_NOREF;
+    for (i = 0; i < 3; i++) {
+        luaL_unref(L, LUA_REGISTRYINDEX, fifo.buf_ref[i]);
+        fifo.buf_ref[i] = LUA_NOREF;
+        fifo.buf[i] = NULL;
+    }
+}
+
+// Lua: l3g4200d.fifo(pin, watermark, xbuf, ybuf, zbuf, function(n)), l3g4200d.fifo()
+static int l3g4200d_fifo(lua_State* L) {
+    int i;
+
+    l3g4200d_fifo_stop(L);
+    if (lua_isnoneornil(L, 1))
+        return 0;
+
+    int pin = luaL_checkinteger(L, 1);
+    MOD_CHECK_ID(gpio, pin);
+    luaL_argcheck(L, pin > 0, 1, "no interrupts on pin 0");
+    int watermark = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, watermark > 0 && watermark < L3G4200D_FIFO_SIZE, 2, "out of range");
+    for (i = 0; i < 3; i++)
+        numbuf_from_lua_arg(L, 3 + i);
+    luaL_checktype(L, 6, LUA_TFUNCTION);
+
+    lua_settop(L, 6);
+    fifo.cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    for (i = 2; i >= 0; i--) {
+        fifo.buf[i] = numbuf_from_lua_arg(L, 3 + i);
+        fifo.buf_ref[i] = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    fifo.pin = pin;
+    fifo.pin_mask = 1 << pin_num[pin];
+    fifo.posted = false;
+
+    // Bypass mode empties the FIFO, so that INT2 starts low
+    w8u(i2c_id, L3G4200D_FIFO_CTRL_REG, 0);
+    w8u(i2c_id, L3G4200D_CTRL_REG5, r8u(i2c_id, L3G4200D_CTRL_REG5) | L3G4200D_FIFO_EN);
+    w8u(i2c_id, L3G4200D_CTRL_REG3, L3G4200D_I2_WTM);
+
+    platform_gpio_register_intr_hook(fifo.pin_mask, l3g4200d_interrupt);
+    platform_gpio_mode(pin, PLATFORM_GPIO_INT, PLATFORM_GPIO_FLOAT);
+    platform_gpio_intr_init(pin, GPIO_PIN_INTR_POSEDGE);
+
+    w8u(i2c_id, L3G4200D_FIFO_CTRL_REG, L3G4200D_FIFO_STREAM | watermark);
+    return 0;
+}
+#endif
+
 LROT_BEGIN(l3g4200d, NULL, 0)
   LROT_FUNCENTRY( read, l3g4200d_read )
   LROT_FUNCENTRY( setup, l3g4200d_setup )
+#if defined(LUA_USE_MODULES_NUMBUF) && defined(GPIO_INTERRUPT_ENABLE)
+  LROT_FUNCENTRY( fifo, l3g4200d_fifo )
+#endif
 LROT_END(l3g4200d, NULL, 0)
 
 
-NODEMCU_MODULE(L3G4200D, "l3g4200d", l3g4200d, NULL);
+int luaopen_l3g4200d(lua_State *L) {
+#if defined(LUA_USE_MODULES_NUMBUF) && defined(GPIO_INTERRUPT_ENABLE)
+  fifo_task = platform_task_get_id(l3g4200d_fifo_done);
+#endif
+  return 0;
+}
+
+NODEMCU_MODULE(L3G4200D, "l3g4200d", l3g4200d, luaopen_l3g4200d);
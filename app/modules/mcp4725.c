@@ -6,6 +6,7 @@
 #include "lauxlib.h"
 #include "platform.h"
 #include "osapi.h"
+#include "waveform.h"
 
 #define MCP4725_I2C_ADDR_BASE      (0x60)
 #define MCP4725_I2C_ADDR_A0_MASK   (0x01) // user configurable
@@ -20,8 +21,14 @@
 #define MCP4725_POWER_DOWN_RES_100K (0x04)
 #define MCP4725_POWER_DOWN_RES_500K (0x06)
 
+#define MCP4725_PLAY_MAX_RATE 8000
+
 static const unsigned mcp4725_i2c_id = 0;
 
+/* Device and power down bits of the waveform being played */
+static uint8 play_address;
+static uint8 play_pwrdn;
+
 static uint8 get_address(lua_State* L, uint8 i2c_address){
   uint8 addr_temp = i2c_address;
   uint16 temp_var = 0;
@@ -203,10 +210,42 @@ static int mcp4725_read(lua_State* L){
   return 6;
 }
 
+// Each sample is one fast mode write: the power down bits and the 12 bit value
+static void mcp4725_out(uint16 sample){
+  uint8 data[2] = { (play_pwrdn << 4) | (sample >> 8), sample & 0xff };
+  platform_i2c_transfer(mcp4725_i2c_id, play_address, data, sizeof(data), NULL, 0);
+}
+
+// Lua: play({[A0=], [A1=], [A2=], [pwrdn=]}, samples, rate[, loops[, callback]])
+static int mcp4725_play(lua_State* L){
+  uint8 i2c_address = MCP4725_I2C_ADDR_BASE;
+  lua_Integer pwrdn = 0;
+
+  if(!lua_isnoneornil(L, 1))
+  {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    i2c_address = get_address(L, i2c_address);
+    lua_getfield(L, 1, "pwrdn");
+    pwrdn = luaL_optinteger(L, -1, 0);
+    luaL_argcheck(L, pwrdn >= 0 && pwrdn <= 3, 1, "pwrdn: Valid range 0-3");
+    lua_pop(L, 1);
+  }
+  if(!platform_i2c_configured(mcp4725_i2c_id))
+    return luaL_error(L, "i2c not set up");
+
+  if(waveform_busy())
+    return luaL_error(L, "waveform playing");
+
+  play_address = i2c_address;
+  play_pwrdn = pwrdn;
+  return waveform_play(L, 2, 4095, MCP4725_PLAY_MAX_RATE, mcp4725_out);
+}
 
 LROT_BEGIN(mcp4725, NULL, 0)
   LROT_FUNCENTRY( write, mcp4725_write )
   LROT_FUNCENTRY( read, mcp4725_read )
+  LROT_FUNCENTRY( play, mcp4725_play )
+  LROT_FUNCENTRY( stop, waveform_stop )
   LROT_NUMENTRY( PWRDN_NONE, MCP4725_POWER_DOWN_NORMAL )
   LROT_NUMENTRY( PWRDN_1K, MCP4725_POWER_DOWN_RES_1K>>1 )
   LROT_NUMENTRY( PWRDN_100K, MCP4725_POWER_DOWN_RES_100K>>1 )
@@ -14,8 +14,11 @@
 
 #include "mqtt/mqtt_msg.h"
 #include "mqtt/msg_queue.h"
+#include "mqtt/topic_trie.h"
 
 #include "user_interface.h"
+#include "vfs.h"
+#include "timer_wheel.h"
 
 #define MQTT_BUF_SIZE 1460
 #define MQTT_DEFAULT_KEEPALIVE 60
@@ -23,6 +26,14 @@
 #define MQTT_MAX_USER_LEN     64
 #define MQTT_MAX_PASS_LEN     64
 #define MQTT_SEND_TIMEOUT     5 /* seconds */
+#define MQTT_DEFAULT_QUEUE_SIZE 2048     /* bytes of outbound message storage */
+#define MQTT_QUEUE_BYTES_PER_NODE 64     /* assumed average queued message size */
+#define MQTT_QUEUE_MIN_NODES  4
+#define MQTT_BATCH_MAX        MQTT_BUF_SIZE  /* batch at most one segment per send */
+#define MQTT_SPOOL_DEFAULT_SIZE 65536    /* bytes of spool file */
+#define MQTT_SPOOL_BUF_SIZE   512        /* spooled messages collected per flash write */
+#define MQTT_SPOOL_FLUSH_MS   1000       /* longest a spooled message waits in RAM */
+#define MQTT_SPOOL_ACK_EVERY  16         /* acknowledgements per progress record */
 
 typedef enum {
   MQTT_INIT,
@@ -46,11 +57,12 @@ typedef enum {
     MQTT_RECV_BUFFERING_SHORT,
     MQTT_RECV_BUFFERING,
     MQTT_RECV_SKIPPING,
+    MQTT_RECV_STREAMING,
 } tReceiveState;
 
 typedef struct mqtt_state_t
 {
-  msg_queue_t* pending_msg_q;
+  msg_pool_t pending_msg_q;
   uint16_t next_message_id;
 
   uint8_t * recv_buffer; // heap buffer for multi-packet rx
@@ -61,21 +73,28 @@ typedef struct mqtt_state_t
   };
   tReceiveState recv_buffer_state;
 
+  // PUBLISH being delivered in chunks, in streaming state
+  int stream_topic_ref;
+  uint32_t stream_offset;
+  uint32_t stream_total;
 } mqtt_state_t;
 
 
 typedef struct lmqtt_userdata
 {
   struct espconn pesp_conn;
-  int self_ref;
-  int cb_connect_ref;
-  int cb_connect_fail_ref;
-  int cb_disconnect_ref;
-  int cb_message_ref;
-  int cb_overflow_ref;
-  int cb_suback_ref;
-  int cb_unsuback_ref;
-  int cb_puback_ref;
+  luaL_Slot self;
+  luaL_Slot cb_connect;
+  luaL_Slot cb_connect_fail;
+  luaL_Slot cb_disconnect;
+  luaL_Slot cb_message;
+  luaL_Slot cb_overflow;
+  luaL_Slot cb_suback;
+  luaL_Slot cb_unsuback;
+  luaL_Slot cb_puback;
+  luaL_Slot cb_drain;
+  luaL_Slot cb_message_chunk;
+  topic_node_t *handlers;   // per-subscription message callbacks
 
   /* Configuration options */
   struct {
@@ -91,6 +110,7 @@ typedef struct lmqtt_userdata
       bool will_retain : 1;
       bool clean_session : 1;
       bool secure : 1;
+      bool batch : 1;
     } flags;
   } conf;
 
@@ -98,7 +118,19 @@ typedef struct lmqtt_userdata
   bool connected;     // indicate socket connected, not mqtt prot connected.
   bool keepalive_sent;
   bool sending;  // data sent to network stack, awaiting local acknowledge
-  ETSTimer mqttTimer;
+  bool queue_full;  // an enqueue has failed, so signal "drain" on the next dequeue
+  struct {
+    int fd;           // spool file, see mqtt:spool(), 0 if none
+    char *name;
+    uint32_t max;     // size limit of the file
+    uint32_t rd;      // offset of the next record to queue
+    uint32_t acked;   // offset up to which the broker has acknowledged
+    uint32_t last;    // offset after the last message record
+    uint32_t end;     // size of the file
+    uint8_t unsaved;  // acknowledgements not yet recorded in the file
+  } spool;
+  twheel_timer_t mqttTimer;
+  uint32_t last_tx;   // twheel_now() when the last packet was sent
   tConnState connState;
 }lmqtt_userdata;
 
@@ -109,6 +141,7 @@ static sint8 mqtt_socket_do_connect(struct lmqtt_userdata *);
 static void mqtt_socket_reconnected(void *arg, sint8_t err);
 static void mqtt_socket_connected(void *arg);
 static void mqtt_connack_fail(lmqtt_userdata * mud, int reason_code);
+static void mqtt_stream_reset(lmqtt_userdata * mud);
 
 static uint16_t mqtt_next_message_id(lmqtt_userdata * mud)
 {
@@ -119,16 +152,251 @@ static uint16_t mqtt_next_message_id(lmqtt_userdata * mud)
   return mud->mqtt_state.next_message_id;
 }
 
-static void mqtt_socket_cb_lua_noarg(lua_State *L, lmqtt_userdata *mud, int cb)
+static void mqtt_socket_cb_lua_noarg(lua_State *L, lmqtt_userdata *mud, const luaL_Slot *cb)
+{
+  luaL_callslot(L, cb, &mud->self, 0);
+}
+
+/*
+ * The spool is an append-only file of records, each a header and a PUBLISH
+ * message as it is sent, with its message id patched in when it is moved into
+ * the queue.  A header of length 0 is instead followed by the 4 byte offset up
+ * to which the broker has acknowledged the messages, written every
+ * MQTT_SPOOL_ACK_EVERY acknowledgements, so that at most that many are sent
+ * again after a reboot.  The file is emptied once everything in it has been
+ * acknowledged, and the acknowledged part is compacted out when it is full.
+ */
+typedef struct {
+  uint16_t length;      // of the message, 0 for a progress record
+  uint16_t id_offset;   // of the message id in the message
+} spool_record_t;
+
+static bool spool_read(int fd, uint32_t off, void *buf, uint32_t len)
+{
+  return vfs_lseek(fd, off, VFS_SEEK_SET) >= 0 && vfs_read(fd, buf, len) == (int32_t)len;
+}
+
+static int spool_open_file(const char *name)
+{
+  int fd = vfs_open(name, "a+l");
+  if (fd)
+    vfs_logcfg(fd, MQTT_SPOOL_BUF_SIZE, MQTT_SPOOL_FLUSH_MS, 0, 0);
+  return fd;
+}
+
+// Move the spool offsets of the queued messages back by shift, or forget them
+static void mqtt_spool_shift(lmqtt_userdata *mud, uint32_t shift, bool forget)
+{
+  msg_pool_t *q = &(mud->mqtt_state.pending_msg_q);
+  msg_queue_t *node;
+  for (node = msg_peek(q); node; node = msg_next(q, node)) {
+    if (node->spool_end)
+      node->spool_end = forget ? 0 : node->spool_end - shift;
+  }
+}
+
+static void mqtt_spool_save(lmqtt_userdata *mud)
+{
+  spool_record_t r = { 0, 0 };
+  if (vfs_write(mud->spool.fd, &r, sizeof(r)) == sizeof(r) &&
+      vfs_write(mud->spool.fd, &mud->spool.acked, sizeof(uint32_t)) == sizeof(uint32_t))
+    mud->spool.end += sizeof(r) + sizeof(uint32_t);
+  mud->spool.unsaved = 0;
+}
+
+// Start the file again once everything in it is acknowledged
+static void mqtt_spool_reset(lmqtt_userdata *mud)
+{
+  vfs_close(mud->spool.fd);
+  vfs_remove(mud->spool.name);
+  mud->spool.fd = spool_open_file(mud->spool.name);
+  mud->spool.rd = mud->spool.acked = mud->spool.last = mud->spool.end = 0;
+  mud->spool.unsaved = 0;
+}
+
+// Rewrite the file without the records before the acknowledged offset
+static bool mqtt_spool_compact(lmqtt_userdata *mud)
+{
+  uint32_t shift = mud->spool.acked, off = shift;
+  size_t n = strlen(mud->spool.name);
+  char *tmp = malloc(n + 2);
+  spool_record_t *r = malloc(sizeof(spool_record_t) + MQTT_BUF_SIZE);
+  int out = 0;
+
+  if (tmp && r) {
+    strcpy(tmp, mud->spool.name);
+    strcpy(tmp + n, "~");
+    out = vfs_open(tmp, "w");
+  }
+  while (out && off < mud->spool.end) {
+    uint32_t len;
+    if (!spool_read(mud->spool.fd, off, r, sizeof(*r)))
+      break;
+    len = r->length ? r->length : sizeof(uint32_t);
+    if (len > MQTT_BUF_SIZE || !spool_read(mud->spool.fd, off + sizeof(*r), r + 1, len))
+      break;
+    if (!r->length)
+      *(uint32_t *)(r + 1) = 0;   // progress up to at most the new start
+    if (vfs_write(out, r, sizeof(*r) + len) != (sint32_t)(sizeof(*r) + len))
+      break;
+    off += sizeof(*r) + len;
+  }
+  free(r);
+  if (out)
+    vfs_close(out);
+  bool ok = out && off == mud->spool.end;
+  if (ok) {
+    vfs_close(mud->spool.fd);
+    vfs_remove(mud->spool.name);
+    ok = vfs_rename(tmp, mud->spool.name) == VFS_RES_OK;
+    if (!(mud->spool.fd = spool_open_file(mud->spool.name)) || !ok) {
+      mqtt_spool_shift(mud, 0, true);
+      mud->spool.rd = mud->spool.acked = mud->spool.last = mud->spool.end = 0;
+      ok = false;
+    } else {
+      mqtt_spool_shift(mud, shift, false);
+      mud->spool.rd -= shift;
+      mud->spool.last = mud->spool.last > shift ? mud->spool.last - shift : 0;
+      mud->spool.end -= shift;
+      mud->spool.acked = 0;
+    }
+  } else if (out) {
+    vfs_remove(tmp);
+  }
+  free(tmp);
+  return ok;
+}
+
+// Open the spool file and find where the broker's acknowledgements got to
+static bool mqtt_spool_open(lmqtt_userdata *mud)
 {
-  if (cb == LUA_NOREF)
+  spool_record_t r;
+  uint32_t off = 0, size;
+
+  if (!(mud->spool.fd = spool_open_file(mud->spool.name)))
+    return false;
+  size = vfs_size(mud->spool.fd);
+  while (off + sizeof(r) <= size && spool_read(mud->spool.fd, off, &r, sizeof(r))) {
+    uint32_t len = r.length ? r.length : sizeof(uint32_t);
+    if (off + sizeof(r) + len > size)
+      break;
+    if (r.length)
+      mud->spool.last = off + sizeof(r) + len;
+    else if (!spool_read(mud->spool.fd, off + sizeof(r), &mud->spool.acked, sizeof(uint32_t)))
+      break;
+    off += sizeof(r) + len;
+  }
+  if (mud->spool.acked > mud->spool.last)
+    mud->spool.acked = mud->spool.last;
+  mud->spool.rd = mud->spool.acked;
+  mud->spool.end = off;
+  if (mud->spool.acked == mud->spool.last)
+    mqtt_spool_reset(mud);
+  else if (off != size)          // cut short by a reset, so drop the partial record
+    mqtt_spool_compact(mud);
+  return mud->spool.fd != 0;
+}
+
+static void mqtt_spool_close(lmqtt_userdata *mud)
+{
+  if (mud->spool.fd) {
+    if (mud->spool.unsaved)
+      mqtt_spool_save(mud);
+    vfs_close(mud->spool.fd);
+  }
+  mqtt_spool_shift(mud, 0, true);
+  free(mud->spool.name);
+  memset(&mud->spool, 0, sizeof(mud->spool));
+}
+
+static bool mqtt_spool_append(lmqtt_userdata *mud, mqtt_message_t *msg)
+{
+  uint16_t topic_length = msg->length;
+  const char *topic = mqtt_get_publish_topic(msg->data, &topic_length);
+  spool_record_t r = { msg->length, (uint8_t *)topic - msg->data + topic_length };
+  uint32_t need = sizeof(r) + msg->length;
+
+  if (!mud->spool.fd || !topic)
+    return false;
+  if (mud->spool.end + need > mud->spool.max && mud->spool.acked)
+    mqtt_spool_compact(mud);
+  if (!mud->spool.fd || mud->spool.end + need > mud->spool.max ||
+      vfs_write(mud->spool.fd, &r, sizeof(r)) != sizeof(r) ||
+      vfs_write(mud->spool.fd, msg->data, msg->length) != msg->length)
+    return false;
+  mud->spool.end += need;
+  mud->spool.last = mud->spool.end;
+  return true;
+}
+
+static void mqtt_spool_ack(lmqtt_userdata *mud, uint32_t end)
+{
+  if (!mud->spool.fd)
     return;
+  mud->spool.acked = end;
+  if (end == mud->spool.last)
+    mqtt_spool_reset(mud);
+  else if (++mud->spool.unsaved >= MQTT_SPOOL_ACK_EVERY)
+    mqtt_spool_save(mud);
+}
+
+/*
+ * Move spooled messages into the queue, leaving half of it for everything
+ * else, such as the acknowledgements of incoming messages.
+ */
+static void mqtt_spool_fill(lmqtt_userdata *mud)
+{
+  msg_pool_t *q = &(mud->mqtt_state.pending_msg_q);
+  uint8_t *buf = NULL;
+  spool_record_t r;
+
+  while (mud->spool.rd < mud->spool.end && msg_size(q) < q->nodes / 2 &&
+         spool_read(mud->spool.fd, mud->spool.rd, &r, sizeof(r))) {
+    if (!r.length) {
+      mud->spool.rd += sizeof(r) + sizeof(uint32_t);
+      continue;
+    }
+    if (r.length > MQTT_BUF_SIZE || r.id_offset + 2 > r.length ||
+        (!buf && !(buf = malloc(MQTT_BUF_SIZE))) ||
+        !spool_read(mud->spool.fd, mud->spool.rd + sizeof(r), buf, r.length))
+      break;
+    uint16_t msg_id = mqtt_next_message_id(mud);
+    buf[r.id_offset] = msg_id >> 8;
+    buf[r.id_offset + 1] = msg_id & 0xff;
+    mqtt_message_t msg = { buf, r.length };
+    msg_queue_t *node = msg_enqueue(q, &msg, msg_id, MQTT_MSG_TYPE_PUBLISH,
+                                    (int)mqtt_get_qos(buf));
+    if (!node)
+      break;
+    mud->spool.rd += sizeof(r) + r.length;
+    node->spool_end = mud->spool.rd;
+  }
+  free(buf);
+}
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cb);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);
-  lua_call(L, 1, 0);
+// Retire the message at the head of the outbound queue
+static void mqtt_msg_dequeue(lmqtt_userdata *mud)
+{
+  msg_queue_t *node = msg_peek(&(mud->mqtt_state.pending_msg_q));
+  if (node && node->spool_end)
+    mqtt_spool_ack(mud, node->spool_end);
+  msg_dequeue(&(mud->mqtt_state.pending_msg_q));
+  if (mud->queue_full) {
+    mud->queue_full = false;
+    mqtt_socket_cb_lua_noarg(lua_getstate(), mud, &mud->cb_drain);
+  }
 }
 
+// Queue an outbound message, remembering a failure so that "drain" can follow
+static msg_queue_t *mqtt_msg_enqueue(lmqtt_userdata *mud, mqtt_message_t *msg,
+                                     uint16_t msg_id, int msg_type, int publish_qos)
+{
+  msg_queue_t *node = msg_enqueue(&(mud->mqtt_state.pending_msg_q), msg,
+                                  msg_id, msg_type, publish_qos);
+  if (!node)
+    mud->queue_full = true;
+  return node;
+}
 
 static void mqtt_socket_disconnected(void *arg)    // tcp only
 {
@@ -137,11 +405,10 @@ static void mqtt_socket_disconnected(void *arg)    // tcp only
   if(mud == NULL)
     return;
 
-  os_timer_disarm(&mud->mqttTimer);
+  twheel_disarm(&mud->mqttTimer);
 
-  while (mud->mqtt_state.pending_msg_q) {
-    msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
-  }
+  msg_flush(&(mud->mqtt_state.pending_msg_q));
+  mud->spool.rd = mud->spool.acked;   // send the unacknowledged ones again
 
   if(mud->mqtt_state.recv_buffer) {
     free(mud->mqtt_state.recv_buffer);
@@ -149,27 +416,25 @@ static void mqtt_socket_disconnected(void *arg)    // tcp only
   }
   mud->mqtt_state.recv_buffer_size = 0;
   mud->mqtt_state.recv_buffer_state = MQTT_RECV_NORMAL;
+  mqtt_stream_reset(mud);
 
   if(mud->pesp_conn.proto.tcp)
     free(mud->pesp_conn.proto.tcp);
   mud->pesp_conn.proto.tcp = NULL;
 
-  int selfref = mud->self_ref;
-  mud->self_ref = LUA_NOREF;
+  luaL_Slot self = mud->self;
+  mud->self = (luaL_Slot) LUAL_SLOT_INIT;
 
   lua_State *L = lua_getstate();
 
   if(mud->connected){     // call back only called when socket is from connection to disconnection.
     mud->connected = false;
-    if((mud->cb_disconnect_ref != LUA_NOREF) && (selfref != LUA_NOREF)) {
-      lua_rawgeti(L, LUA_REGISTRYINDEX, mud->cb_disconnect_ref);
-      lua_rawgeti(L, LUA_REGISTRYINDEX, selfref);
-      lua_call(L, 1, 0);
-    }
+    if(luaL_slotisset(&self))
+      luaL_callslot(L, &mud->cb_disconnect, &self, 0);
   }
 
   // unref this, and the mqtt.socket userdata will delete it self
-  luaL_unref(L, LUA_REGISTRYINDEX, selfref);
+  luaL_unsetslot(L, &self);
 
   NODE_DBG("leave mqtt_socket_disconnected.\n");
 }
@@ -193,13 +458,23 @@ static void mqtt_socket_reconnected(void *arg, sint8_t err)
   if(mud == NULL)
     return;
 
-  os_timer_disarm(&mud->mqttTimer);
+  twheel_disarm(&mud->mqttTimer);
   mqtt_connack_fail(mud, MQTT_CONN_FAIL_SERVER_NOT_FOUND);
 
   mqtt_socket_disconnected(arg);
   NODE_DBG("leave mqtt_socket_reconnected.\n");
 }
 
+static void mqtt_push_handler(void *arg, int ref)
+{
+  lua_rawgeti((lua_State *)arg, LUA_REGISTRYINDEX, ref);
+}
+
+static void mqtt_unref_handler(void *arg, int ref)
+{
+  luaL_unref((lua_State *)arg, LUA_REGISTRYINDEX, ref);
+}
+
 static void deliver_publish(lmqtt_userdata * mud, uint8_t* message, uint16_t length, uint8_t is_overflow)
 {
   NODE_DBG("enter deliver_publish (len=%d, overflow=%d).\n", length, is_overflow);
@@ -213,50 +488,169 @@ static void deliver_publish(lmqtt_userdata * mud, uint8_t* message, uint16_t len
   event_data.data_length = length;
   event_data.data = mqtt_get_publish_data(message, &event_data.data_length);
 
-  int cb_ref = !is_overflow ? mud->cb_message_ref : mud->cb_overflow_ref;
+  const luaL_Slot *cb = !is_overflow ? &mud->cb_message : &mud->cb_overflow;
 
-  if(cb_ref == LUA_NOREF)
+  if(!luaL_slotisset(&mud->self))
     return;
-  if(mud->self_ref == LUA_NOREF)
+  if(!event_data.topic || (event_data.topic_length == 0)){
+    NODE_DBG("get wrong packet.\n");
     return;
+  }
   lua_State *L = lua_getstate();
-  if(event_data.topic && (event_data.topic_length > 0)){
-    lua_rawgeti(L, LUA_REGISTRYINDEX, cb_ref);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);
+  int top = lua_gettop(L), i, n = 0;
+
+  // Subscriptions with their own callback take the message; else "message"
+  if(!is_overflow && mud->handlers)
+    n = topic_trie_match(mud->handlers, event_data.topic, event_data.topic_length,
+                         mqtt_push_handler, L);
+  if(n == 0){
+    if(!luaL_slotisset(cb))
+      return;
+    luaL_pushslot(L, cb);
+    n = 1;
+  }
+  for(i = 1; i <= n; i++){
+    lua_pushvalue(L, top + i);
+    luaL_pushslot(L, &mud->self);
     lua_pushlstring(L, event_data.topic, event_data.topic_length);
-  } else {
-    NODE_DBG("get wrong packet.\n");
-    return;
+    if(event_data.data && (event_data.data_length > 0)){
+      lua_pushlstring(L, event_data.data, event_data.data_length);
+      luaL_pcallx(L, 3, 0);
+    } else {
+      luaL_pcallx(L, 2, 0);
+    }
+  }
+  lua_settop(L, top);
+  NODE_DBG("leave deliver_publish.\n");
+}
+
+
+/*
+ * With a "message_chunk" callback, PUBLISH payloads are handed to Lua as they
+ * arrive instead of being reassembled, so the payload is never buffered and
+ * is not limited by max_message_length.  The topic is kept in the registry
+ * while later chunks arrive.
+ */
+static void deliver_publish_chunk(lmqtt_userdata * mud, const char *data, uint16_t length)
+{
+  mqtt_state_t *st = &mud->mqtt_state;
+  if(luaL_slotisset(&mud->self)) {
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, st->stream_topic_ref);
+    lua_pushlstring(L, data, length);
+    lua_pushinteger(L, st->stream_offset);
+    lua_pushinteger(L, st->stream_total);
+    luaL_callslot(L, &mud->cb_message_chunk, &mud->self, 4);
   }
-  if(event_data.data && (event_data.data_length > 0)){
-    lua_pushlstring(L, event_data.data, event_data.data_length);
-    lua_call(L, 3, 0);
+  st->stream_offset += length;
+}
+
+// Start chunked delivery; returns false if the header is not all in the buffer
+static bool deliver_publish_start(lmqtt_userdata * mud, uint8_t* message, uint16_t length, int32_t message_length)
+{
+  mqtt_state_t *st = &mud->mqtt_state;
+  uint16_t topic_length = length, data_length = length;
+  const char *topic = mqtt_get_publish_topic(message, &topic_length);
+  const char *data = mqtt_get_publish_data(message, &data_length);
+  if(!topic || !data)
+    return false;
+
+  lua_State *L = lua_getstate();
+  lua_pushlstring(L, topic, topic_length);
+  st->stream_topic_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  st->stream_offset = 0;
+  st->stream_total = message_length - (data - (const char *)message);
+  deliver_publish_chunk(mud, data, data_length);
+  if(st->stream_offset < st->stream_total) {
+    st->recv_buffer_state = MQTT_RECV_STREAMING;
   } else {
-    lua_call(L, 2, 0);
+    luaL_unref(L, LUA_REGISTRYINDEX, st->stream_topic_ref);
+    st->stream_topic_ref = LUA_NOREF;
   }
-  NODE_DBG("leave deliver_publish.\n");
+  return true;
 }
 
+static void mqtt_stream_reset(lmqtt_userdata * mud)
+{
+  luaL_unref(lua_getstate(), LUA_REGISTRYINDEX, mud->mqtt_state.stream_topic_ref);
+  mud->mqtt_state.stream_topic_ref = LUA_NOREF;
+}
 
 static void mqtt_connack_fail(lmqtt_userdata * mud, int reason_code)
 {
   NODE_DBG("enter mqtt_connack_fail\n");
 
-  if(mud->cb_connect_fail_ref == LUA_NOREF || mud->self_ref == LUA_NOREF)
+  if(!luaL_slotisset(&mud->cb_connect_fail) || !luaL_slotisset(&mud->self))
   {
     return;
   }
 
   lua_State *L = lua_getstate();
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, mud->cb_connect_fail_ref);
-  lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);
   lua_pushinteger(L, reason_code);
-  lua_call(L, 2, 0);
+  luaL_callslot(L, &mud->cb_connect_fail, &mud->self, 1);
 
   NODE_DBG("leave mqtt_connack_fail\n");
 }
 
+/*
+ * Messages which are retired as soon as they have been sent.  Anything else
+ * must stay at the head of the queue until its acknowledgement arrives.
+ */
+static bool mqtt_msg_is_fire_and_forget(msg_queue_t *node)
+{
+  switch (node->msg_type) {
+    case MQTT_MSG_TYPE_PUBLISH:
+      return node->publish_qos == 0;
+    case MQTT_MSG_TYPE_PUBACK:
+    case MQTT_MSG_TYPE_PUBCOMP:
+    case MQTT_MSG_TYPE_PINGREQ:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/*
+ * In batch mode, extend a send from the head message over the messages that
+ * follow it, for as long as they are contiguous in the queue arena and fit in
+ * one segment.  The batch can only continue past fire-and-forget messages, so
+ * a message awaiting acknowledgement still ends up at the head on its own.
+ */
+static uint16_t mqtt_batch_length(lmqtt_userdata *mud, msg_queue_t *node)
+{
+  msg_pool_t *q = &(mud->mqtt_state.pending_msg_q);
+  uint16_t len = node->msg.length;
+  msg_queue_t *next;
+
+  while (mqtt_msg_is_fire_and_forget(node) &&
+         (next = msg_next(q, node)) != NULL && !next->sent &&
+         next->msg.data == node->msg.data + node->msg.length &&
+         len + next->msg.length <= MQTT_BATCH_MAX) {
+    next->sent = 1;
+    len += next->msg.length;
+    node = next;
+  }
+  return len;
+}
+
+static void mqtt_timer_arm(lmqtt_userdata *mud, uint32_t ms, uint32_t slack)
+{
+  twheel_set_slack(&mud->mqttTimer, slack);
+  twheel_arm(&mud->mqttTimer, ms, false);
+}
+
+// While connected, the timer runs to the keepalive deadline, a period after
+// the last packet sent. Packets only move the deadline on; a timer that finds
+// it has moved is armed again for the rest. All the clients' timers share the
+// timer wheel, and the slack lets their wakeups coincide.
+static void mqtt_keepalive_arm(lmqtt_userdata *mud)
+{
+  uint32_t period = mud->conf.keepalive * 1000;
+  uint32_t idle = twheel_now() - mud->last_tx;
+  mqtt_timer_arm(mud, idle < period ? period - idle : 1, period / 8);
+}
+
 static sint8 mqtt_send_if_possible(struct lmqtt_userdata *mud)
 {
   /* Waiting for the local network stack to get back to us?  Can't send. */
@@ -265,24 +659,31 @@ static sint8 mqtt_send_if_possible(struct lmqtt_userdata *mud)
 
   sint8 espconn_status = ESPCONN_OK;
 
+  if (mud->spool.fd && mud->connState == MQTT_DATA)
+    mqtt_spool_fill(mud);
+
   msg_queue_t *pending_msg = msg_peek(&(mud->mqtt_state.pending_msg_q));
   if (pending_msg && !pending_msg->sent) {
     pending_msg->sent = 1;
-    NODE_DBG("Sent: %d\n", pending_msg->msg.length);
+    uint16_t length = mud->conf.flags.batch ?
+      mqtt_batch_length(mud, pending_msg) : pending_msg->msg.length;
+    NODE_DBG("Sent: %d\n", length);
 #ifdef CLIENT_SSL_ENABLE
     if( mud->conf.flags.secure )
     {
-      espconn_status = espconn_secure_send(&mud->pesp_conn, pending_msg->msg.data, pending_msg->msg.length );
+      espconn_status = espconn_secure_send(&mud->pesp_conn, pending_msg->msg.data, length );
     }
     else
 #endif
     {
-      espconn_status = espconn_send(&mud->pesp_conn, pending_msg->msg.data, pending_msg->msg.length );
+      espconn_status = espconn_send(&mud->pesp_conn, pending_msg->msg.data, length );
     }
     mud->sending = true;
 
-    os_timer_disarm(&mud->mqttTimer);
-    os_timer_arm(&mud->mqttTimer, MQTT_SEND_TIMEOUT * 1000, 0);
+    // Once connected, a send only moves the keepalive deadline on
+    mud->last_tx = twheel_now();
+    if (mud->connState != MQTT_DATA)
+      mqtt_timer_arm(mud, MQTT_SEND_TIMEOUT * 1000, 0);
   }
 
   NODE_DBG("send_if_poss, queue size: %d\n", msg_size(&(mud->mqtt_state.pending_msg_q)));
@@ -390,6 +791,21 @@ static void mqtt_socket_received(void *arg, char *pdata, unsigned short len)
       mud->mqtt_state.recv_buffer_skip = 0;
       mud->mqtt_state.recv_buffer_state = MQTT_RECV_NORMAL;
       break;
+
+    case MQTT_RECV_STREAMING: {
+      // Feed the next part of a chunked PUBLISH, then carry on after it
+      uint32_t left = mud->mqtt_state.stream_total - mud->mqtt_state.stream_offset;
+      uint16_t chunk = left < in_buffer_length ? (uint16_t)left : in_buffer_length;
+      deliver_publish_chunk(mud, (const char *)in_buffer, chunk);
+      if (mud->mqtt_state.stream_offset < mud->mqtt_state.stream_total)
+        goto RX_PACKET_FINISHED;
+
+      mqtt_stream_reset(mud);
+      mud->mqtt_state.recv_buffer_state = MQTT_RECV_NORMAL;
+      in_buffer += chunk;
+      in_buffer_length -= chunk;
+      break;
+    }
   }
 
 READPACKET:
@@ -409,8 +825,7 @@ READPACKET:
   switch(mud->connState){
     case MQTT_CONNECT_SENDING:
     case MQTT_CONNECT_SENT:
-      os_timer_disarm(&mud->mqttTimer);
-      os_timer_arm(&mud->mqttTimer, mud->conf.keepalive * 1000, 0);
+      mqtt_keepalive_arm(mud);
 
       if(mqtt_get_type(in_buffer) != MQTT_MSG_TYPE_CONNACK){
         NODE_DBG("MQTT: Invalid packet\r\n");
@@ -433,7 +848,7 @@ READPACKET:
         NODE_DBG("MQTT: Connected\r\n");
         mud->keepalive_sent = 0;
 
-        mqtt_socket_cb_lua_noarg(lua_getstate(), mud, mud->cb_connect_ref);
+        mqtt_socket_cb_lua_noarg(lua_getstate(), mud, &mud->cb_connect);
         break;
       }
       break;
@@ -448,7 +863,27 @@ READPACKET:
            message_length,
            in_buffer_length);
 
-      if (message_length > mud->conf.max_message_length) {
+      if (msg_type == MQTT_MSG_TYPE_PUBLISH && luaL_slotisset(&mud->cb_message_chunk) &&
+          message_length != -1) {
+        // Chunked delivery: hand over what is here now and stream the rest
+        if (!deliver_publish_start(mud, in_buffer, in_buffer_length, message_length)) {
+          message_length = -1;    // header incomplete, so buffer it and retry
+        } else {
+          if(msg_qos == 1){
+            temp_msg = mqtt_msg_puback(&msgb, msg_id);
+            msg_enqueue(&(mud->mqtt_state.pending_msg_q), temp_msg,
+                        msg_id, MQTT_MSG_TYPE_PUBACK, (int)mqtt_get_qos(temp_msg->data) );
+          }
+          else if(msg_qos == 2){
+            temp_msg = mqtt_msg_pubrec(&msgb, msg_id);
+            msg_enqueue(&(mud->mqtt_state.pending_msg_q), temp_msg,
+                        msg_id, MQTT_MSG_TYPE_PUBREC, (int)mqtt_get_qos(temp_msg->data) );
+          }
+          if (mud->mqtt_state.recv_buffer_state == MQTT_RECV_STREAMING)
+            goto RX_PACKET_FINISHED;
+          goto RX_MESSAGE_PROCESSED;
+        }
+      } else if (message_length > mud->conf.max_message_length) {
         // The pending message length is larger than we was configured to allow
         if(msg_qos > 0 && msg_id == 0) {
           NODE_DBG("MQTT: msg too long, but not enough data to get msg_id: total=%u, deliver=%u\r\n", message_length, in_buffer_length);
@@ -538,17 +973,17 @@ READPACKET:
         case MQTT_MSG_TYPE_SUBACK:
           if(pending_msg && pending_msg->msg_type == MQTT_MSG_TYPE_SUBSCRIBE && pending_msg->msg_id == msg_id){
             NODE_DBG("MQTT: Subscribe successful\r\n");
-            msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
+            mqtt_msg_dequeue(mud);
 
-            mqtt_socket_cb_lua_noarg(lua_getstate(), mud, mud->cb_suback_ref);
+            mqtt_socket_cb_lua_noarg(lua_getstate(), mud, &mud->cb_suback);
           }
           break;
         case MQTT_MSG_TYPE_UNSUBACK:
           if(pending_msg && pending_msg->msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE && pending_msg->msg_id == msg_id){
             NODE_DBG("MQTT: UnSubscribe successful\r\n");
-            msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
+            mqtt_msg_dequeue(mud);
 
-            mqtt_socket_cb_lua_noarg(lua_getstate(), mud, mud->cb_unsuback_ref);
+            mqtt_socket_cb_lua_noarg(lua_getstate(), mud, &mud->cb_unsuback);
           }
           break;
         case MQTT_MSG_TYPE_PUBLISH:
@@ -570,9 +1005,9 @@ READPACKET:
         case MQTT_MSG_TYPE_PUBACK:
           if(pending_msg && pending_msg->msg_type == MQTT_MSG_TYPE_PUBLISH && pending_msg->msg_id == msg_id){
             NODE_DBG("MQTT: Publish with QoS = 1 successful\r\n");
-            msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
+            mqtt_msg_dequeue(mud);
 
-            mqtt_socket_cb_lua_noarg(lua_getstate(), mud, mud->cb_puback_ref);
+            mqtt_socket_cb_lua_noarg(lua_getstate(), mud, &mud->cb_puback);
           }
 
           break;
@@ -580,7 +1015,7 @@ READPACKET:
           if(pending_msg && pending_msg->msg_type == MQTT_MSG_TYPE_PUBLISH && pending_msg->msg_id == msg_id){
             NODE_DBG("MQTT: Publish  with QoS = 2 Received PUBREC\r\n");
             // Note: actually, should not destroy the msg until PUBCOMP is received.
-            msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
+            mqtt_msg_dequeue(mud);
             temp_msg = mqtt_msg_pubrel(&msgb, msg_id);
             msg_enqueue(&(mud->mqtt_state.pending_msg_q), temp_msg,
                       msg_id, MQTT_MSG_TYPE_PUBREL, (int)mqtt_get_qos(temp_msg->data) );
@@ -589,7 +1024,7 @@ READPACKET:
           break;
         case MQTT_MSG_TYPE_PUBREL:
           if(pending_msg && pending_msg->msg_type == MQTT_MSG_TYPE_PUBREC && pending_msg->msg_id == msg_id){
-            msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
+            mqtt_msg_dequeue(mud);
             temp_msg = mqtt_msg_pubcomp(&msgb, msg_id);
             msg_enqueue(&(mud->mqtt_state.pending_msg_q), temp_msg,
                       msg_id, MQTT_MSG_TYPE_PUBCOMP, (int)mqtt_get_qos(temp_msg->data) );
@@ -599,9 +1034,9 @@ READPACKET:
         case MQTT_MSG_TYPE_PUBCOMP:
           if(pending_msg && pending_msg->msg_type == MQTT_MSG_TYPE_PUBREL && pending_msg->msg_id == msg_id){
             NODE_DBG("MQTT: Publish  with QoS = 2 successful\r\n");
-            msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
+            mqtt_msg_dequeue(mud);
 
-            mqtt_socket_cb_lua_noarg(lua_getstate(), mud, mud->cb_puback_ref);
+            mqtt_socket_cb_lua_noarg(lua_getstate(), mud, &mud->cb_puback);
           }
           break;
         case MQTT_MSG_TYPE_PINGREQ:
@@ -664,46 +1099,38 @@ static void mqtt_socket_sent(void *arg)
 
   mud->sending = false;
 
-  os_timer_disarm(&mud->mqttTimer);
-
   if(mud->connState == MQTT_CONNECT_SENDING){
     mud->connState = MQTT_CONNECT_SENT;
-    os_timer_arm(&mud->mqttTimer, MQTT_SEND_TIMEOUT * 1000, 0);
+    mqtt_timer_arm(mud, MQTT_SEND_TIMEOUT * 1000, 0);
     // MQTT_CONNECT not queued.
     return;
   }
 
   /* Ready for timeout */
-  os_timer_arm(&mud->mqttTimer, mud->conf.keepalive * 1000, 0);
+  if (!twheel_armed(&mud->mqttTimer))
+    mqtt_keepalive_arm(mud);
 
   NODE_DBG("sent1, queue size: %d\n", msg_size(&(mud->mqtt_state.pending_msg_q)));
 
-  msg_queue_t *node = msg_peek(&(mud->mqtt_state.pending_msg_q));
-  if (node) {
-    switch (node->msg_type) {
-    case MQTT_MSG_TYPE_PUBLISH:
-      // qos = 0, publish and forget.  Run the callback now because we
-      // won't get a puback from the server and it's not clear when else
-      // we should tell the user the message drained from the egress queue
-      if (node->publish_qos == 0) {
-        msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
-        mqtt_socket_cb_lua_noarg(lua_getstate(), mud, mud->cb_puback_ref);
-        mqtt_send_if_possible(mud);
-      }
-      break;
-    case MQTT_MSG_TYPE_PUBACK:
-      /* FALLTHROUGH */
-    case MQTT_MSG_TYPE_PUBCOMP:
-      /* FALLTHROUGH */
-    case MQTT_MSG_TYPE_PINGREQ:
-      msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
-      mqtt_send_if_possible(mud);
-      break;
-    case MQTT_MSG_TYPE_DISCONNECT:
-      msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
-      mqtt_socket_do_disconnect(mud);
-      break;
-    }
+  // A batched send covers several messages, so retire every one sent
+  msg_queue_t *node;
+  bool retired = false;
+  while ((node = msg_peek(&(mud->mqtt_state.pending_msg_q))) && node->sent &&
+         mqtt_msg_is_fire_and_forget(node)) {
+    bool is_publish = node->msg_type == MQTT_MSG_TYPE_PUBLISH;
+    mqtt_msg_dequeue(mud);
+    // qos = 0, publish and forget.  Run the callback now because we
+    // won't get a puback from the server and it's not clear when else
+    // we should tell the user the message drained from the egress queue
+    if (is_publish)
+      mqtt_socket_cb_lua_noarg(lua_getstate(), mud, &mud->cb_puback);
+    retired = true;
+  }
+  if (node && node->sent && node->msg_type == MQTT_MSG_TYPE_DISCONNECT) {
+    mqtt_msg_dequeue(mud);
+    mqtt_socket_do_disconnect(mud);
+  } else if (retired) {
+    mqtt_send_if_possible(mud);
   }
 
   NODE_DBG("sent2, queue size: %d\n", msg_size(&(mud->mqtt_state.pending_msg_q)));
@@ -763,9 +1190,9 @@ static void mqtt_socket_connected(void *arg)
     espconn_send(pesp_conn, temp_msg->data, temp_msg->length);
   }
   mud->sending = true;
+  mud->last_tx = twheel_now();
 
-  os_timer_disarm(&mud->mqttTimer);
-  os_timer_arm(&mud->mqttTimer, MQTT_SEND_TIMEOUT * 1000, 0);
+  mqtt_timer_arm(mud, MQTT_SEND_TIMEOUT * 1000, 0);
 
   mud->connState = MQTT_CONNECT_SENDING;
 
@@ -799,7 +1226,13 @@ void mqtt_socket_timer(void *arg)
     mqtt_socket_do_disconnect(mud);
     mqtt_connack_fail(mud, MQTT_CONN_FAIL_TIMEOUT_RECEIVING);
   } else if(mud->connState == MQTT_DATA){
-    if(!msg_peek(&(mud->mqtt_state.pending_msg_q))) {
+    if (twheel_now() - mud->last_tx < mud->conf.keepalive * 1000) {
+      // packets went out since the timer was armed
+      mqtt_keepalive_arm(mud);
+    } else if(msg_peek(&(mud->mqtt_state.pending_msg_q))) {
+      // waiting for the broker; look again a period later
+      mqtt_timer_arm(mud, mud->conf.keepalive * 1000, mud->conf.keepalive * 1000 / 8);
+    } else {
       // no queued event.
       if (mud->keepalive_sent) {
         // Oh dear -- keepalive timer expired and still no ack of previous message
@@ -834,16 +1267,19 @@ static int mqtt_socket_client( lua_State* L )
   mud = (lmqtt_userdata *)lua_newuserdata(L, sizeof(lmqtt_userdata));
   memset(mud, 0, sizeof(*mud));
   // pre-initialize it, in case of errors
-  mud->self_ref = LUA_NOREF;
-  mud->cb_connect_ref = LUA_NOREF;
-  mud->cb_connect_fail_ref = LUA_NOREF;
-  mud->cb_disconnect_ref = LUA_NOREF;
-
-  mud->cb_message_ref = LUA_NOREF;
-  mud->cb_overflow_ref = LUA_NOREF;
-  mud->cb_suback_ref = LUA_NOREF;
-  mud->cb_unsuback_ref = LUA_NOREF;
-  mud->cb_puback_ref = LUA_NOREF;
+  mud->self = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->cb_connect = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->cb_connect_fail = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->cb_disconnect = (luaL_Slot) LUAL_SLOT_INIT;
+
+  mud->cb_message = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->cb_overflow = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->cb_suback = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->cb_unsuback = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->cb_puback = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->cb_drain = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->cb_message_chunk = (luaL_Slot) LUAL_SLOT_INIT;
+  mud->mqtt_state.stream_topic_ref = LUA_NOREF;
 
   mud->conf.client_id_ref = LUA_NOREF;
   mud->conf.username_ref = LUA_NOREF;
@@ -904,7 +1340,20 @@ static int mqtt_socket_client( lua_State* L )
     mud->conf.max_message_length = DEFAULT_MAX_MESSAGE_LENGTH;
   }
 
-  mud->mqtt_state.pending_msg_q = NULL;
+  int queue_size = MQTT_DEFAULT_QUEUE_SIZE;
+  if(lua_isnumber( L, stack ))
+  {
+    queue_size = luaL_checkinteger( L, stack);
+    luaL_argcheck(L, queue_size >= MQTT_QUEUE_BYTES_PER_NODE && queue_size <= 0xFFFF,
+                  stack, "invalid queue size");
+    stack++;
+  }
+  int queue_nodes = queue_size / MQTT_QUEUE_BYTES_PER_NODE;
+  if (queue_nodes < MQTT_QUEUE_MIN_NODES)
+    queue_nodes = MQTT_QUEUE_MIN_NODES;
+  if (!msg_pool_init(&(mud->mqtt_state.pending_msg_q), queue_nodes, queue_size))
+    return luaL_error(L, "not enough memory");
+
   mud->mqtt_state.recv_buffer = NULL;
   mud->mqtt_state.recv_buffer_size = 0;
   mud->mqtt_state.recv_buffer_state = MQTT_RECV_NORMAL;
@@ -922,17 +1371,17 @@ static int mqtt_delete( lua_State* L )
 
   lmqtt_userdata *mud = (lmqtt_userdata *)luaL_checkudata(L, 1, "mqtt.socket");
 
-  os_timer_disarm(&mud->mqttTimer);
+  twheel_disarm(&mud->mqttTimer);
   mud->connected = false;
 
+  mqtt_spool_close(mud);
+
   // ---- alloc-ed in mqtt_socket_connect()
   if(mud->pesp_conn.proto.tcp)
     free(mud->pesp_conn.proto.tcp);
   mud->pesp_conn.proto.tcp = NULL;
 
-  while(mud->mqtt_state.pending_msg_q) {
-    msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
-  }
+  msg_pool_free(&(mud->mqtt_state.pending_msg_q));
 
   //--------- alloc-ed in mqtt_socket_received()
   if(mud->mqtt_state.recv_buffer) {
@@ -942,22 +1391,19 @@ static int mqtt_delete( lua_State* L )
   // ----
 
   // free (unref) callback ref
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_connect_ref);
-  mud->cb_connect_ref = LUA_NOREF;
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_connect_fail_ref);
-  mud->cb_connect_fail_ref = LUA_NOREF;
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_disconnect_ref);
-  mud->cb_disconnect_ref = LUA_NOREF;
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_message_ref);
-  mud->cb_message_ref = LUA_NOREF;
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_overflow_ref);
-  mud->cb_overflow_ref = LUA_NOREF;
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_suback_ref);
-  mud->cb_suback_ref = LUA_NOREF;
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_unsuback_ref);
-  mud->cb_unsuback_ref = LUA_NOREF;
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_puback_ref);
-  mud->cb_puback_ref = LUA_NOREF;
+  luaL_unsetslot(L, &mud->cb_connect);
+  luaL_unsetslot(L, &mud->cb_connect_fail);
+  luaL_unsetslot(L, &mud->cb_disconnect);
+  luaL_unsetslot(L, &mud->cb_message);
+  luaL_unsetslot(L, &mud->cb_overflow);
+  luaL_unsetslot(L, &mud->cb_suback);
+  luaL_unsetslot(L, &mud->cb_unsuback);
+  luaL_unsetslot(L, &mud->cb_puback);
+  luaL_unsetslot(L, &mud->cb_drain);
+  luaL_unsetslot(L, &mud->cb_message_chunk);
+  luaL_unref(L, LUA_REGISTRYINDEX, mud->mqtt_state.stream_topic_ref);
+  mud->mqtt_state.stream_topic_ref = LUA_NOREF;
+  topic_trie_free(&mud->handlers, mqtt_unref_handler, L);
 
   luaL_unref(L, LUA_REGISTRYINDEX, mud->conf.client_id_ref);
   mud->conf.client_id_ref = LUA_NOREF;
@@ -970,9 +1416,7 @@ static int mqtt_delete( lua_State* L )
   luaL_unref(L, LUA_REGISTRYINDEX, mud->conf.will_message_ref);
   mud->conf.will_message_ref = LUA_NOREF;
 
-  int selfref = mud->self_ref;
-  mud->self_ref = LUA_NOREF;
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->self_ref);
+  luaL_unsetslot(L, &mud->self);
 
   NODE_DBG("leave mqtt_delete.\n");
   return 0;
@@ -1089,8 +1533,7 @@ static int mqtt_socket_connect( lua_State* L )
   // call back function when a connection is obtained, tcp only
   if ((stack<=top) && (lua_isfunction(L, stack))){
     lua_pushvalue(L, stack);  // copy argument (func) to the top of stack
-    luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_connect_ref);
-    mud->cb_connect_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    luaL_setslot(L, &mud->cb_connect);
   }
 
   stack++;
@@ -1098,8 +1541,7 @@ static int mqtt_socket_connect( lua_State* L )
   // call back function when a connection fails
   if ((stack<=top) && (lua_isfunction(L, stack))){
     lua_pushvalue(L, stack);  // copy argument (func) to the top of stack
-    luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_connect_fail_ref);
-    mud->cb_connect_fail_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    luaL_setslot(L, &mud->cb_connect_fail);
   }
 
   if (!pesp_conn->proto.tcp)
@@ -1109,9 +1551,8 @@ static int mqtt_socket_connect( lua_State* L )
     return luaL_error(L, "not enough memory");
   }
 
-  luaL_unref(L, LUA_REGISTRYINDEX, mud->self_ref);
   lua_pushvalue(L, 1);  // copy userdata and persist it in the registry
-  mud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  luaL_setslot(L, &mud->self);
 
   pesp_conn->type = ESPCONN_TCP;
   pesp_conn->state = ESPCONN_NONE;
@@ -1123,11 +1564,8 @@ static int mqtt_socket_connect( lua_State* L )
   espconn_regist_connectcb(pesp_conn, mqtt_socket_connected);
   espconn_regist_reconcb(pesp_conn, mqtt_socket_reconnected);
 
-  os_timer_disarm(&mud->mqttTimer);
-  os_timer_setfn(&mud->mqttTimer, (os_timer_func_t *)mqtt_socket_timer, mud);
-  SWTIMER_REG_CB(mqtt_socket_timer, SWTIMER_RESUME);
-    //I assume that mqtt_socket_timer connects to the mqtt server, but I'm not really sure what impact light_sleep will have on it.
-    //My guess: If in doubt, resume the timer
+  // the timer wheel resumes its timers along with its own os_timer
+  twheel_setfn(&mud->mqttTimer, mqtt_socket_timer, mud);
   // timer started in socket_connect()
 
   ip_addr_t host_ip;
@@ -1202,40 +1640,39 @@ static int mqtt_socket_on( lua_State* L )
     "connect", "connfail", "offline",
     "message", "overflow",
     "puback", "suback", "unsuback",
+    "drain", "message_chunk",
     NULL
   };
   switch (luaL_checkoption(L, 2, NULL, cbnames)) {
     case 0:
-      luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_connect_ref);
-      mud->cb_connect_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_setslot(L, &mud->cb_connect);
       break;
     case 1:
-      luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_connect_fail_ref);
-      mud->cb_connect_fail_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_setslot(L, &mud->cb_connect_fail);
       break;
     case 2:
-      luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_disconnect_ref);
-      mud->cb_disconnect_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_setslot(L, &mud->cb_disconnect);
       break;
     case 3:
-      luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_message_ref);
-      mud->cb_message_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_setslot(L, &mud->cb_message);
       break;
     case 4:
-      luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_overflow_ref);
-      mud->cb_overflow_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_setslot(L, &mud->cb_overflow);
       break;
     case 5:
-      luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_puback_ref);
-      mud->cb_puback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_setslot(L, &mud->cb_puback);
       break;
     case 6:
-      luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_suback_ref);
-      mud->cb_suback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_setslot(L, &mud->cb_suback);
       break;
     case 7:
-      luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_unsuback_ref);
-      mud->cb_unsuback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      luaL_setslot(L, &mud->cb_unsuback);
+      break;
+    case 8:
+      luaL_setslot(L, &mud->cb_drain);
+      break;
+    case 9:
+      luaL_setslot(L, &mud->cb_message_chunk);
       break;
   }
 
@@ -1243,6 +1680,13 @@ static int mqtt_socket_on( lua_State* L )
   return 0;
 }
 
+static void mqtt_remove_handler(lua_State *L, lmqtt_userdata *mud, const char *topic, size_t len)
+{
+  int ref;
+  if (topic_trie_remove(&mud->handlers, topic, len, &ref))
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
 // Lua: bool = mqtt:unsubscribe(topic, function())
 static int mqtt_socket_unsubscribe( lua_State* L ) {
   NODE_DBG("enter mqtt_socket_unsubscribe.\n");
@@ -1275,7 +1719,8 @@ static int mqtt_socket_unsubscribe( lua_State* L ) {
     uint8_t overflow = 0;
 
     while( lua_next( L, stack ) != 0 ) {
-      topic = luaL_checkstring( L, -2 );
+      topic = luaL_checklstring( L, -2, &il );
+      mqtt_remove_handler(L, mud, topic, il);
 
       if (topic_count == 0) {
         msg_id = mqtt_next_message_id(mud);
@@ -1315,17 +1760,17 @@ static int mqtt_socket_unsubscribe( lua_State* L ) {
     if( topic == NULL ){
       return luaL_error( L, "need topic name" );
     }
+    mqtt_remove_handler(L, mud, topic, il);
     msg_id = mqtt_next_message_id(mud);
     temp_msg = mqtt_msg_unsubscribe( &msgb, topic, msg_id );
   }
 
   if (lua_isfunction(L, stack)) {    // TODO: this will overwrite the previous one.
     lua_pushvalue( L, stack );          // copy argument (func) to the top of stack
-    luaL_unref( L, LUA_REGISTRYINDEX, mud->cb_unsuback_ref );
-    mud->cb_unsuback_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    luaL_setslot(L, &mud->cb_unsuback);
   }
 
-  msg_queue_t *node = msg_enqueue( &(mud->mqtt_state.pending_msg_q), temp_msg,
+  msg_queue_t *node = mqtt_msg_enqueue( mud, temp_msg,
                                    msg_id, MQTT_MSG_TYPE_UNSUBSCRIBE, (int)mqtt_get_qos(temp_msg->data) );
 
   NODE_DBG("topic: %s - id: %d - qos: %d, length: %d\n", topic, node->msg_id, node->publish_qos, node->msg.length);
@@ -1345,7 +1790,7 @@ static int mqtt_socket_unsubscribe( lua_State* L ) {
   return 1;
 }
 
-// Lua: bool = mqtt:subscribe(topic, qos, function())
+// Lua: bool = mqtt:subscribe(topic, qos, function(), function(client, topic, message))
 static int mqtt_socket_subscribe( lua_State* L ) {
   NODE_DBG("enter mqtt_socket_subscribe.\n");
 
@@ -1422,15 +1867,25 @@ static int mqtt_socket_subscribe( lua_State* L ) {
     msg_id = mqtt_next_message_id(mud);
     temp_msg = mqtt_msg_subscribe( &msgb, topic, qos, msg_id );
     stack++;
+
+    if (lua_isfunction(L, stack + 1)) {    // this subscription's own message handler
+      int ref, previous = LUA_NOREF;
+      lua_pushvalue( L, stack + 1 );
+      ref = luaL_ref( L, LUA_REGISTRYINDEX );
+      if (!topic_trie_set(&mud->handlers, topic, il, ref, &previous)) {
+        luaL_unref( L, LUA_REGISTRYINDEX, ref );
+        return luaL_error( L, "not enough memory" );
+      }
+      luaL_unref( L, LUA_REGISTRYINDEX, previous );
+    }
   }
 
   if (lua_isfunction(L, stack)) {    // TODO: this will overwrite the previous one.
     lua_pushvalue( L, stack );  // copy argument (func) to the top of stack
-    luaL_unref( L, LUA_REGISTRYINDEX, mud->cb_suback_ref );
-    mud->cb_suback_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    luaL_setslot(L, &mud->cb_suback);
   }
 
-  msg_queue_t *node = msg_enqueue( &(mud->mqtt_state.pending_msg_q), temp_msg,
+  msg_queue_t *node = mqtt_msg_enqueue( mud, temp_msg,
                                    msg_id, MQTT_MSG_TYPE_SUBSCRIBE, (int)mqtt_get_qos(temp_msg->data) );
 
   NODE_DBG("topic: %s - id: %d - qos: %d, length: %d\n", topic, node->msg_id, node->publish_qos, node->msg.length);
@@ -1462,10 +1917,6 @@ static int mqtt_socket_publish( lua_State* L )
   mud = (lmqtt_userdata *)luaL_checkudata(L, stack, "mqtt.socket");
   stack++;
 
-  if(!mud->connected){
-    return luaL_error( L, "not connected" );
-  }
-
   const char *topic = luaL_checklstring( L, stack, &l );
   stack ++;
   if (topic == NULL){
@@ -1479,6 +1930,12 @@ static int mqtt_socket_publish( lua_State* L )
   uint8_t retain = luaL_checkinteger( L, stack);
   stack ++;
 
+  // QoS 1 and 2 messages go to the spool, if there is one, while offline
+  bool spool = qos != 0 && mud->spool.fd;
+  if(!mud->connected && !spool){
+    return luaL_error( L, "not connected" );
+  }
+
   if (qos != 0) {
     msg_id = mqtt_next_message_id(mud);
   }
@@ -1493,18 +1950,26 @@ static int mqtt_socket_publish( lua_State* L )
 
   if (lua_isfunction(L, stack)){
     lua_pushvalue(L, stack);  // copy argument (func) to the top of stack
-    luaL_unref(L, LUA_REGISTRYINDEX, mud->cb_puback_ref);
-    mud->cb_puback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    luaL_setslot(L, &mud->cb_puback);
   }
 
-  msg_queue_t *node = msg_enqueue(&(mud->mqtt_state.pending_msg_q), temp_msg,
-                      msg_id, MQTT_MSG_TYPE_PUBLISH, (int)qos );
+  msg_queue_t *node = NULL;
+  if (!spool) {
+    node = mqtt_msg_enqueue(mud, temp_msg,
+                        msg_id, MQTT_MSG_TYPE_PUBLISH, (int)qos );
+  } else if (mud->connected && mud->connState == MQTT_DATA && mud->spool.rd == mud->spool.end) {
+    // straight into the queue while that keeps the order of the spool
+    node = msg_enqueue(&(mud->mqtt_state.pending_msg_q), temp_msg,
+                       msg_id, MQTT_MSG_TYPE_PUBLISH, (int)qos );
+  }
+  bool queued = node || (spool && mqtt_spool_append(mud, temp_msg));
 
   sint8 espconn_status = ESPCONN_OK;
 
-  espconn_status = mqtt_send_if_possible(mud);
+  if (mud->connected)
+    espconn_status = mqtt_send_if_possible(mud);
 
-  if(!node || espconn_status != ESPCONN_OK){
+  if(!queued || espconn_status != ESPCONN_OK){
     lua_pushboolean(L, 0);
   } else {
     lua_pushboolean(L, 1);  // enqueued succeed.
@@ -1546,6 +2011,38 @@ static int mqtt_socket_lwt( lua_State* L )
   return 0;
 }
 
+// Lua: mqtt:batch(enable)
+static int mqtt_socket_batch( lua_State* L )
+{
+  lmqtt_userdata *mud = luaL_checkudata( L, 1, "mqtt.socket" );
+  mud->conf.flags.batch = lua_toboolean(L, 2);
+  return 0;
+}
+
+// Lua: pending = mqtt:spool(filename[, max_size]) or mqtt:spool(false)
+static int mqtt_socket_spool( lua_State* L )
+{
+  lmqtt_userdata *mud = luaL_checkudata( L, 1, "mqtt.socket" );
+
+  if (lua_isstring(L, 2)) {
+    const char *name = lua_tostring(L, 2);
+    uint32_t max = luaL_optinteger(L, 3, MQTT_SPOOL_DEFAULT_SIZE);
+    luaL_argcheck(L, max >= 2 * MQTT_BUF_SIZE, 3, "too small");
+    mqtt_spool_close(mud);
+    mud->spool.max = max;
+    if (!(mud->spool.name = strdup(name)) || !mqtt_spool_open(mud)) {
+      mqtt_spool_close(mud);
+      return luaL_error(L, "cannot open %s", name);
+    }
+    if (mud->connected)
+      mqtt_send_if_possible(mud);
+  } else if (!lua_isnoneornil(L, 2) && !lua_toboolean(L, 2)) {
+    mqtt_spool_close(mud);
+  }
+  lua_pushinteger(L, mud->spool.last - mud->spool.acked);
+  return 1;
+}
+
 // Module function map
 
 LROT_BEGIN(mqtt_socket, NULL, LROT_MASK_GC_INDEX)
@@ -1557,6 +2054,8 @@ LROT_BEGIN(mqtt_socket, NULL, LROT_MASK_GC_INDEX)
   LROT_FUNCENTRY( subscribe, mqtt_socket_subscribe )
   LROT_FUNCENTRY( unsubscribe, mqtt_socket_unsubscribe )
   LROT_FUNCENTRY( lwt, mqtt_socket_lwt )
+  LROT_FUNCENTRY( batch, mqtt_socket_batch )
+  LROT_FUNCENTRY( spool, mqtt_socket_spool )
   LROT_FUNCENTRY( on, mqtt_socket_on )
 LROT_END(mqtt_socket, NULL, LROT_MASK_GC_INDEX)
 
@@ -1584,4 +2083,4 @@ int luaopen_mqtt( lua_State *L )
   return 0;
 }
 
-NODEMCU_MODULE(MQTT, "mqtt", mqtt, luaopen_mqtt);
+NODEMCU_MODULE_LAZY(MQTT, "mqtt", mqtt, luaopen_mqtt);
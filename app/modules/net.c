@@ -10,17 +10,25 @@
 #include <stddef.h>
 
 #include <stdint.h>
+#include <stdlib.h>
 #include "mem.h"
+#include "vfs.h"
 #include "osapi.h"
 #include "lwip/err.h"
 #include "lwip/ip_addr.h"
 #include "lwip/dns.h"
 #include "lwip/igmp.h"
 #include "lwip/tcp.h"
+#include "lwip/tcp_impl.h"
 #include "lwip/udp.h"
 #include "lwip/dhcp.h"
+#include "lwip/memp.h"
+#include "lwip/stats.h"
 
 #include "net_ping.h"
+#ifdef LUA_USE_MODULES_PIXBUF
+#include "pixbuf.h"
+#endif
 
 typedef enum net_type {
   TYPE_TCP_SERVER = 0,
@@ -42,6 +50,24 @@ static const net_table_name NET_TABLES[] = {
 #define TYPE_TCP TYPE_TCP_CLIENT
 #define TYPE_UDP TYPE_UDP_SOCKET
 
+#define NET_TABLE_PBUF "net.pbuf"
+
+#define NET_STREAM_IDLE     0
+#define NET_STREAM_ACTIVE   1
+#define NET_STREAM_DRAINING 2
+
+// The datagrams queued for a receive_batch callback, by default
+#define NET_BATCH_MAX 16
+
+typedef struct net_dgram {
+  struct pbuf *p;
+  ip_addr_t addr;
+  u16_t port;
+} net_dgram;
+
+// A C consumer of the data received on a TCP socket, see net_sink_attach()
+typedef void (*net_sink_fn)(void *arg, struct pbuf *p);
+
 typedef struct lnet_userdata {
   enum net_type type;
   int self_ref;
@@ -60,11 +86,50 @@ typedef struct lnet_userdata {
       int cb_dns_ref;
       int cb_receive_ref;
       int cb_sent_ref;
+      int rx_buffered;
+      int pin_ref;
+      struct tcp_pcb *closing;
       // Only for TCP:
       int hold;
+      int pin_head, pin_tail;
+      u32_t pin_acked;
+      int stream;
+      int stream_ref;
+      int stream_carry_ref;
+      int stream_done_ref;
+      int stream_fd;
+      int stream_fd_owned;
+      int stream_enc;         // stream_ref is an sjson.encoder
+      int stream_filling;     // the encoder is writing into stream_buf
+      u16_t stream_held;      // bytes in stream_buf refused by tcp_write()
+      u32_t stream_left;
+      char *stream_buf;
       int cb_connect_ref;
       int cb_disconnect_ref;
       int cb_reconnect_ref;
+      net_sink_fn sink;
+      void *sink_arg;
+      int recv_fd;            // recvfile() writes the received data here
+      int recv_fd_owned;
+      int recv_ref;
+      int recv_done_ref;
+      u32_t recv_bytes;
+      u32_t bytes_in;   // received, whether or not a callback took them
+      u32_t bytes_out;  // sent over UDP, or acknowledged over TCP
+      // Only for UDP:
+      int cb_batch_ref;
+      int batch_ref;          // holds the socket while a batch is queued
+      int batch_max, batch_n;
+      net_dgram *batch;
+      u32_t dropped;          // datagrams that did not fit in the batch
+      int dmx_ref;            // the pixbuf that DMX data is copied into
+      int dmx_cb_ref;
+      int dmx_write_ref;      // the write function, after its arguments
+      void *dmx;
+      u32_t dmx_offset;
+      u32_t dmx_synced;       // when an ArtSync was last received
+      u16_t dmx_universe;
+      u8_t dmx_pending;       // data has arrived since the last write
     } client;
   };
 } lnet_userdata;
@@ -112,12 +177,40 @@ lnet_userdata *net_create( lua_State *L, enum net_type type ) {
       ud->client.cb_reconnect_ref = LUA_NOREF;
       ud->client.cb_disconnect_ref = LUA_NOREF;
       ud->client.hold = 0;
+      ud->client.stream = NET_STREAM_IDLE;
+      ud->client.stream_ref = LUA_NOREF;
+      ud->client.stream_carry_ref = LUA_NOREF;
+      ud->client.stream_done_ref = LUA_NOREF;
+      ud->client.stream_fd = 0;
+      ud->client.stream_enc = 0;
+      ud->client.stream_filling = 0;
+      ud->client.stream_held = 0;
+      ud->client.stream_buf = NULL;
+      ud->client.sink = NULL;
+      ud->client.recv_fd = 0;
+      ud->client.recv_ref = LUA_NOREF;
+      ud->client.recv_done_ref = LUA_NOREF;
       /* FALLTHROUGH */
     case TYPE_UDP_SOCKET:
+      ud->client.pin_ref = LUA_NOREF;
+      ud->client.closing = NULL;
       ud->client.wait_dns = 0;
+      ud->client.rx_buffered = 0;
       ud->client.cb_dns_ref = LUA_NOREF;
       ud->client.cb_receive_ref = LUA_NOREF;
       ud->client.cb_sent_ref = LUA_NOREF;
+      ud->client.bytes_in = 0;
+      ud->client.bytes_out = 0;
+      ud->client.cb_batch_ref = LUA_NOREF;
+      ud->client.batch_ref = LUA_NOREF;
+      ud->client.batch_max = NET_BATCH_MAX;
+      ud->client.batch_n = 0;
+      ud->client.batch = NULL;
+      ud->client.dropped = 0;
+      ud->client.dmx_ref = LUA_NOREF;
+      ud->client.dmx_cb_ref = LUA_NOREF;
+      ud->client.dmx_write_ref = LUA_NOREF;
+      ud->client.dmx = NULL;
       break;
     case TYPE_TCP_SERVER:
       ud->server.cb_accept_ref = LUA_NOREF;
@@ -126,13 +219,430 @@ lnet_userdata *net_create( lua_State *L, enum net_type type ) {
   return ud;
 }
 
+#pragma mark - Receive buffers
+
+/*
+ * A receive buffer wraps a received pbuf chain so that a receive callback can
+ * inspect and slice the data, only copying into Lua strings the bytes that it
+ * actually keeps.  The chain is released on free() or when the buffer is GCed.
+ */
+typedef struct lnet_pbuf {
+  struct pbuf *p;
+} lnet_pbuf;
+
+static void net_push_pbuf( lua_State *L, struct pbuf *p ) {
+  lnet_pbuf *b = (lnet_pbuf *)lua_newuserdata(L, sizeof(lnet_pbuf));
+  b->p = NULL;
+  luaL_getmetatable(L, NET_TABLE_PBUF);
+  lua_setmetatable(L, -2);
+  b->p = p;
+}
+
+static struct pbuf *net_check_pbuf( lua_State *L ) {
+  lnet_pbuf *b = (lnet_pbuf *)luaL_checkudata(L, 1, NET_TABLE_PBUF);
+  if (!b->p)
+    luaL_error(L, "buffer has been freed");
+  return b->p;
+}
+
+// Lua: buf:free()
+static int net_pbuf_free( lua_State *L ) {
+  lnet_pbuf *b = (lnet_pbuf *)luaL_checkudata(L, 1, NET_TABLE_PBUF);
+  if (b->p) {
+    pbuf_free(b->p);
+    b->p = NULL;
+  }
+  return 0;
+}
+
+// Lua: buf:len(), #buf
+static int net_pbuf_len( lua_State *L ) {
+  lua_pushinteger(L, net_check_pbuf(L)->tot_len);
+  return 1;
+}
+
+// Lua: buf:sub(i[, j]) -- as string.sub(), but only copies the slice
+static int net_pbuf_sub( lua_State *L ) {
+  struct pbuf *p = net_check_pbuf(L);
+  lua_Integer len = p->tot_len;
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer j = luaL_optinteger(L, 3, -1);
+  if (i < 0) i = len + i + 1;
+  if (j < 0) j = len + j + 1;
+  if (i < 1) i = 1;
+  if (j > len) j = len;
+  if (i > j) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  luaL_Buffer b;
+  u16_t offset = i - 1, n = j - i + 1;
+  luaL_buffinit(L, &b);
+  while (n) {
+    u16_t k = n > LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE : n;
+    pbuf_copy_partial(p, luaL_prepbuffer(&b), k, offset);
+    luaL_addsize(&b, k);
+    offset += k;
+    n -= k;
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// Lua: buf:tostring(), tostring(buf)
+static int net_pbuf_tostring( lua_State *L ) {
+  lua_settop(L, 1);
+  return net_pbuf_sub(L);
+}
+
+// Lua: buf:byte(i) -- the byte at offset i, or nil if out of range
+static int net_pbuf_byte( lua_State *L ) {
+  struct pbuf *p = net_check_pbuf(L);
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  if (i < 0) i = p->tot_len + i + 1;
+  if (i < 1 || i > p->tot_len)
+    return 0;
+  lua_pushinteger(L, pbuf_get_at(p, i - 1));
+  return 1;
+}
+
+// Lua: buf:find(s[, init]) -- plain search, returns the start and end offsets or nil
+static int net_pbuf_find( lua_State *L ) {
+  struct pbuf *p = net_check_pbuf(L);
+  size_t sl;
+  const char *str = luaL_checklstring(L, 2, &sl);
+  lua_Integer init = luaL_optinteger(L, 3, 1);
+  if (init < 0) init = p->tot_len + init + 1;
+  if (init < 1) init = 1;
+  if (sl == 0 || init + sl - 1 > p->tot_len)
+    return 0;
+  u16_t pos = pbuf_memfind(p, str, sl, init - 1);
+  if (pos == 0xFFFF)
+    return 0;
+  lua_pushinteger(L, pos + 1);
+  lua_pushinteger(L, pos + sl);
+  return 2;
+}
+
+#pragma mark - Send pinning
+
+/*
+ * Larger RAM strings are handed to tcp_write() without copying, so they must
+ * stay reachable until the peer has acknowledged them.  They are kept in a
+ * per-socket FIFO table in the registry, where each entry is either a pinned
+ * string or a count of the copied bytes queued in between, and the entries
+ * are retired as the sent callback reports acknowledged bytes.  Strings in
+ * LFS are mapped from flash, which the WiFi driver cannot read bytewise, so
+ * these are always copied.
+ */
+#ifndef NET_NOCOPY_MIN
+#define NET_NOCOPY_MIN 128
+#endif
+#define NET_CAN_PIN(s,l) \
+  ((l) >= NET_NOCOPY_MIN && (uint32_t)(s) < INTERNAL_FLASH_MAPPED_ADDRESS)
+
+static void net_pin_release( lua_State *L, lnet_userdata *ud ) {
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->client.pin_ref);
+  ud->client.pin_ref = LUA_NOREF;
+}
+
+// Record len bytes just written, pinning the string at ndx if ndx != 0
+static void net_pin_push( lua_State *L, lnet_userdata *ud, int ndx, size_t len ) {
+  int n;
+  if (ud->client.pin_ref == LUA_NOREF) {
+    if (!ndx) return;         // nothing pinned, so copies need no tracking
+    lua_createtable(L, 4, 0);
+    ud->client.pin_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ud->client.pin_head = ud->client.pin_tail = 1;
+    ud->client.pin_acked = 0;
+    // Account for everything already in flight ahead of this string
+    u32_t ahead = ud->tcp_pcb->snd_lbb - ud->tcp_pcb->lastack - len;
+    if (ahead) net_pin_push(L, ud, 0, ahead);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.pin_ref);
+  n = ud->client.pin_tail;
+  if (ndx) {
+    lua_pushvalue(L, ndx);
+  } else {
+    // merge with a preceding count
+    lua_rawgeti(L, -1, n - 1);
+    if (n > ud->client.pin_head && lua_type(L, -1) == LUA_TNUMBER) {
+      len += lua_tointeger(L, -1);
+      n--;
+    }
+    lua_pop(L, 1);
+    lua_pushinteger(L, len);
+  }
+  lua_rawseti(L, -2, n);
+  lua_pop(L, 1);
+  ud->client.pin_tail = n + 1;
+}
+
+static void net_pin_ack( lua_State *L, lnet_userdata *ud, u16_t len ) {
+  if (ud->client.pin_ref == LUA_NOREF) return;
+  u32_t acked = ud->client.pin_acked + len;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.pin_ref);
+  while (ud->client.pin_head < ud->client.pin_tail) {
+    lua_rawgeti(L, -1, ud->client.pin_head);
+    size_t n = lua_type(L, -1) == LUA_TNUMBER ?
+                 (size_t)lua_tointeger(L, -1) : lua_objlen(L, -1);
+    lua_pop(L, 1);
+    if (acked < n) break;
+    acked -= n;
+    lua_pushnil(L);
+    lua_rawseti(L, -2, ud->client.pin_head++);
+  }
+  lua_pop(L, 1);
+  ud->client.pin_acked = acked;
+  if (ud->client.pin_head == ud->client.pin_tail)
+    net_pin_release(L, ud);
+}
+
+typedef struct net_writer {
+  lua_State *L;
+  lnet_userdata *ud;
+  char *buf;            // UDP: the datagram being assembled
+  size_t len;           // bytes measured or written so far
+  int measure;
+  err_t err;
+} net_writer_t;
+
+// The string at ndx (or 0 if not a Lua string) may be pinned rather than copied
+static int net_write_chunk( net_writer_t *w, const char *s, size_t l, int ndx ) {
+  if (w->buf) {
+    memcpy(w->buf + w->len, s, l);
+  } else if (!w->measure) {
+    int pin = ndx && NET_CAN_PIN(s, l);
+    w->err = tcp_write(w->ud->tcp_pcb, s, l,
+                       TCP_WRITE_FLAG_MORE | (pin ? 0 : TCP_WRITE_FLAG_COPY));
+    if (w->err != ERR_OK) return 1;
+    net_pin_push(w->L, w->ud, pin ? ndx : 0, l);
+  }
+  w->len += l;
+  return 0;
+}
+
+// A closed socket whose pinned data lwIP no longer needs can now be released
+static void net_closing_done( lua_State *L, lnet_userdata *ud ) {
+  struct tcp_pcb *pcb = ud->client.closing;
+  ud->client.closing = NULL;
+  tcp_arg(pcb, NULL);
+  net_pin_release(L, ud);
+  if (!ud->pcb && ud->client.wait_dns == 0) {
+    int selfref = ud->self_ref;
+    ud->self_ref = LUA_NOREF;
+    luaL_unref(L, LUA_REGISTRYINDEX, selfref);
+  }
+}
+
+#pragma mark - Streaming
+
+/*
+ * A stream pulls its data from a Lua reader whenever the send window opens,
+ * both when it is started and from the sent callback, so a bulk transfer keeps
+ * the window full without a Lua round trip per segment.  The reader is called
+ * as reader(socket, maxlen); any excess over maxlen is carried over to the next
+ * pump.  A nil or empty result ends the stream, and the completion callback is
+ * called once all of the streamed data has been acknowledged.
+ *
+ * sendfile() uses the same machinery with a VFS file as the source in place of
+ * the reader, reading a segment at a time into a scratch buffer that is copied
+ * by tcp_write(), so no file content passes through Lua strings.  An
+ * sjson.encoder is streamed the same way, encoding each segment straight into
+ * the scratch buffer.
+ */
+#ifndef NET_SENDFILE_CHUNK
+#define NET_SENDFILE_CHUNK TCP_MSS
+#endif
+
+static void net_stream_stop( lua_State *L, lnet_userdata *ud ) {
+  if (ud->client.stream_fd && ud->client.stream_fd_owned)
+    vfs_close(ud->client.stream_fd);
+  ud->client.stream_fd = 0;
+  ud->client.stream_enc = 0;
+  ud->client.stream_held = 0;
+  if (!ud->client.stream_filling) {   // else freed once the encoder returns
+    free(ud->client.stream_buf);
+    ud->client.stream_buf = NULL;
+  }
+  ud->client.stream = NET_STREAM_IDLE;
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->client.stream_ref);
+  ud->client.stream_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->client.stream_carry_ref);
+  ud->client.stream_carry_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->client.stream_done_ref);
+  ud->client.stream_done_ref = LUA_NOREF;
+}
+
+// Tells the sink that no more data will come
+static void net_sink_end( lnet_userdata *ud ) {
+  net_sink_fn sink = ud->client.sink;
+  if (sink) {
+    ud->client.sink = NULL;
+    sink(ud->client.sink_arg, NULL);
+  }
+}
+
+static void net_stream_check_done( lua_State *L, lnet_userdata *ud ) {
+  struct tcp_pcb *pcb = ud->tcp_pcb;
+  if (ud->client.stream != NET_STREAM_DRAINING || !pcb ||
+      pcb->unsent || pcb->unacked)
+    return;
+  int ref = ud->client.stream_done_ref;
+  ud->client.stream_done_ref = LUA_NOREF;
+  net_stream_stop(L, ud);
+  if (ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_call(L, 1, 0);
+  }
+}
+
+// Queue the next file segment; returns bytes queued, 0 at EOF and -1 if full
+static int net_stream_file( lnet_userdata *ud, u16_t avail ) {
+  int fd = ud->client.stream_fd;
+  u32_t n = avail > NET_SENDFILE_CHUNK ? NET_SENDFILE_CHUNK : avail;
+  if (n > ud->client.stream_left)
+    n = ud->client.stream_left;
+  sint32_t got = n ? vfs_read(fd, ud->client.stream_buf, n) : 0;
+  if (got <= 0)
+    return 0;
+  if (tcp_write(ud->tcp_pcb, ud->client.stream_buf, got,
+                TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE) != ERR_OK) {
+    vfs_lseek(fd, -got, VFS_SEEK_CUR);
+    return -1;
+  }
+  ud->client.stream_left -= got;
+  return got;
+}
+
+#ifdef LUA_USE_MODULES_SJSON
+extern int sjson_encoder_fill(lua_State *L, int ndx, char *buf, size_t len);
+
+// Queue the next encoded segment; returns bytes queued, 0 at the end and -1 if full
+static int net_stream_encoder( lua_State *L, lnet_userdata *ud, u16_t avail ) {
+  u16_t n = ud->client.stream_held;   // a segment refused by the last pump
+  if (n > avail)
+    return -1;
+  if (!n) {
+    u16_t want = avail > NET_SENDFILE_CHUNK ? NET_SENDFILE_CHUNK : avail;
+    // function values in the document may stop the stream meanwhile
+    ud->client.stream_filling = 1;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.stream_ref);
+    int got = sjson_encoder_fill(L, -1, ud->client.stream_buf, want);
+    lua_pop(L, 1);
+    ud->client.stream_filling = 0;
+    if (ud->client.stream != NET_STREAM_ACTIVE || !ud->tcp_pcb) {
+      free(ud->client.stream_buf);
+      ud->client.stream_buf = NULL;
+      return -1;
+    }
+    if (got <= 0)
+      return 0;
+    n = got;
+  }
+  if (tcp_write(ud->tcp_pcb, ud->client.stream_buf, n,
+                TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE) != ERR_OK) {
+    ud->client.stream_held = n;
+    return -1;
+  }
+  ud->client.stream_held = 0;
+  return n;
+}
+#endif
+
+// Fetch the next piece from the carry slot or the reader; 0 at end of stream
+static int net_stream_next( lua_State *L, lnet_userdata *ud, u16_t avail ) {
+  if (ud->client.stream_carry_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.stream_carry_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ud->client.stream_carry_ref);
+    ud->client.stream_carry_ref = LUA_NOREF;
+    return 1;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.stream_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+  lua_pushinteger(L, avail);
+  lua_call(L, 2, 1);
+  if (lua_type(L, -1) == LUA_TSTRING && lua_objlen(L, -1) > 0)
+    return 1;
+  lua_pop(L, 1);
+  return 0;
+}
+
+static void net_stream_pump( lua_State *L, lnet_userdata *ud ) {
+  int top = lua_gettop(L), written = 0;
+  while (ud->tcp_pcb && ud->client.stream == NET_STREAM_ACTIVE) {
+    struct tcp_pcb *pcb = ud->tcp_pcb;
+    u16_t avail = tcp_sndbuf(pcb);
+    // Wait for a worthwhile window rather than dribbling out small segments
+    if (avail == 0 || tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN - 1 ||
+        (avail < TCP_MSS && (pcb->unsent || pcb->unacked)))
+      break;
+    if (ud->client.stream_fd) {
+      int n = net_stream_file(ud, avail);
+      if (n < 0)
+        break;
+      if (n > 0) {
+        written += n;
+        continue;
+      }
+    }
+#ifdef LUA_USE_MODULES_SJSON
+    if (ud->client.stream_enc) {
+      int n = net_stream_encoder(L, ud, avail);
+      if (n < 0)
+        break;
+      if (n > 0) {
+        written += n;
+        continue;
+      }
+    }
+#endif
+    if (ud->client.stream_fd || ud->client.stream_enc ||
+        !net_stream_next(L, ud, avail)) {
+      ud->client.stream = NET_STREAM_DRAINING;
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.stream_ref);
+      ud->client.stream_ref = LUA_NOREF;
+      break;
+    }
+    if (!ud->tcp_pcb || ud->client.stream != NET_STREAM_ACTIVE)
+      break;                    // the reader closed the socket or the stream
+    size_t l;
+    const char *p = lua_tolstring(L, -1, &l);
+    size_t n = l > avail ? avail : l;
+    net_writer_t w = { L, ud, NULL, 0, 0, ERR_OK };
+    if (net_write_chunk(&w, p, n, n == l ? lua_gettop(L) : 0))
+      n = 0;                    // out of queue space, so retry it all later
+    if (n < l) {
+      lua_pushlstring(L, p + n, l - n);
+      ud->client.stream_carry_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_settop(L, top);
+    written += n;
+    if (n == 0)
+      break;
+  }
+  lua_settop(L, top);
+  if (written && ud->tcp_pcb)
+    tcp_output(ud->tcp_pcb);
+  net_stream_check_done(L, ud);
+}
+
 #pragma mark - LWIP callbacks
 
 static void net_err_cb(void *arg, err_t err) {
   lnet_userdata *ud = (lnet_userdata*)arg;
   if (!ud || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF) return;
-  ud->pcb = NULL; // Will be freed at LWIP level
   lua_State *L = lua_getstate();
+  if (ud->client.closing && !ud->pcb) {
+    net_closing_done(L, ud);   // already closed from Lua, so no callbacks
+    return;
+  }
+  ud->pcb = NULL; // Will be freed at LWIP level
+  net_pin_release(L, ud);
+  net_stream_stop(L, ud);
+  net_sink_end(ud);
   int ref;
   if (err != ERR_OK && ud->client.cb_reconnect_ref != LUA_NOREF)
     ref = ud->client.cb_reconnect_ref;
@@ -189,7 +699,7 @@ static void net_dns_cb(const char *name, ip_addr_t *ipaddr, void *arg) {
   ud->client.wait_dns --;
   if (ud->pcb && ud->type == TYPE_TCP_CLIENT && ud->tcp_pcb->state == CLOSED) {
     tcp_connect(ud->tcp_pcb, &addr, ud->tcp_pcb->remote_port, net_connected_cb);
-  } else if (!ud->pcb && ud->client.wait_dns == 0) {
+  } else if (!ud->pcb && ud->client.wait_dns == 0 && !ud->client.closing) {
     int selfref = ud->self_ref;
     ud->self_ref = LUA_NOREF;
     luaL_unref(L, LUA_REGISTRYINDEX, selfref);
@@ -211,6 +721,18 @@ static void net_recv_cb(lnet_userdata *ud, struct pbuf *p, ip_addr_t *addr, u16_
   }
 
   lua_State *L = lua_getstate();
+  if (ud->client.rx_buffered) {
+    // One callback for the whole chain; the buffer now owns the pbuf
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_receive_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    net_push_pbuf(L, p);
+    if (ud->type == TYPE_UDP_SOCKET) {
+      lua_pushinteger(L, port);
+      lua_pushstring(L, iptmp);
+    }
+    lua_call(L, num_args, 0);
+    return;
+  }
   struct pbuf *pp = p;
   while (pp)
   {
@@ -227,23 +749,257 @@ static void net_recv_cb(lnet_userdata *ud, struct pbuf *p, ip_addr_t *addr, u16_
   pbuf_free(p);
 }
 
+/*
+ * With a receive_batch callback, the datagrams are queued and handed to Lua
+ * together from a task, once per turn of the event loop, so that a burst
+ * costs one call and the source of each is only formatted when it changes.
+ * The socket is held by batch_ref until the task has run.
+ */
+static platform_task_handle_t net_batch_task_id;
+
+static void net_push_dgram( lua_State *L, struct pbuf *p ) {
+  if (p->len == p->tot_len) {
+    lua_pushlstring(L, p->payload, p->len);
+  } else {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (struct pbuf *q = p; q; q = q->next)
+      luaL_addlstring(&b, q->payload, q->len);
+    luaL_pushresult(&b);
+  }
+}
+
+static void net_batch_task( platform_task_param_t param, uint8 prio ) {
+  lnet_userdata *ud = (lnet_userdata *)param;
+  lua_State *L = lua_getstate();
+  net_dgram *d = ud->client.batch;
+  int i, n = ud->client.batch_n;
+  ud->client.batch = NULL;
+  ud->client.batch_n = 0;
+  int ref = ud->client.batch_ref;
+  ud->client.batch_ref = LUA_NOREF;
+
+  if (ud->self_ref == LUA_NOREF || ud->client.cb_batch_ref == LUA_NOREF) {
+    for (i = 0; i < n; i++)
+      pbuf_free(d[i].p);
+    free(d);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_batch_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  int base = lua_gettop(L);
+  lua_createtable(L, n, 0);
+  lua_createtable(L, n, 0);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    net_push_dgram(L, d[i].p);
+    lua_rawseti(L, base + 1, i + 1);
+    pbuf_free(d[i].p);
+    lua_pushinteger(L, d[i].port);
+    lua_rawseti(L, base + 2, i + 1);
+    if (i > 0 && ip_addr_cmp(&d[i].addr, &d[i - 1].addr)) {
+      lua_rawgeti(L, base + 3, i);
+    } else {
+      char iptmp[16];
+      ets_sprintf(iptmp, IPSTR, IP2STR(&d[i].addr.addr));
+      lua_pushstring(L, iptmp);
+    }
+    lua_rawseti(L, base + 3, i + 1);
+  }
+  free(d);
+  lua_call(L, 4, 0);
+}
+
+static void net_batch_add(lnet_userdata *ud, struct pbuf *p, ip_addr_t *addr, u16_t port) {
+  if (!ud->client.batch) {
+    ud->client.batch = (net_dgram *)malloc(ud->client.batch_max * sizeof(net_dgram));
+    if (ud->client.batch &&
+        !platform_post_low(net_batch_task_id, (platform_task_param_t)ud)) {
+      free(ud->client.batch);
+      ud->client.batch = NULL;
+    }
+    if (ud->client.batch) {
+      lua_State *L = lua_getstate();
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+      ud->client.batch_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  }
+  if (!ud->client.batch || ud->client.batch_n == ud->client.batch_max) {
+    ud->client.dropped++;
+    pbuf_free(p);
+    return;
+  }
+  net_dgram *d = &ud->client.batch[ud->client.batch_n++];
+  d->p = p;
+  d->addr = *addr;
+  d->port = port;
+}
+
+#ifdef LUA_USE_MODULES_PIXBUF
+/*
+ * The DMX data of the Art-Net and E1.31 (sACN) packets for the universes
+ * mapped by dmx() is copied into its pixbuf here, 512 bytes to a universe
+ * from the offset given, and not passed on to Lua.  The buffer is written
+ * out by the write function given once a frame is complete: on a sync packet
+ * (ArtSync, or an E1.31 synchronization packet) if the controller sends them,
+ * otherwise when the universe reaching the end of the buffer arrives.
+ *
+ * Art-Net has "Art-Net\0", the opcode and the universe little endian and the
+ * data length big endian.  E1.31 is big endian throughout, a root layer
+ * followed by a framing layer and, for data, a DMP layer whose property
+ * values are the start code and the channels.
+ */
+#define DMX_UNIVERSE        512
+#define ARTNET_OP_DMX       0x5000
+#define ARTNET_OP_SYNC      0x5200
+#define ARTNET_DMX_HDR      18
+#define E131_ROOT_DATA      0x00000004
+#define E131_ROOT_EXTENDED  0x00000008
+#define E131_FRAME_DATA     0x00000002
+#define E131_FRAME_SYNC     0x00000001
+#define E131_DATA_HDR       126
+#define E131_SYNC_LEN       49
+#define DMX_SYNC_TIMEOUT_US 4000000    // Art-Net drops out of sync mode after 4s
+
+static const char e131_acn_id[12] = "ASC-E1.17\0\0";
+
+static u32_t dmx_be32(const u8_t *b) {
+  return ((u32_t)b[0] << 24) | ((u32_t)b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static void net_dmx_write(lnet_userdata *ud) {
+  ud->client.dmx_pending = 0;
+  if (ud->client.dmx_write_ref == LUA_NOREF)
+    return;
+  lua_State *L = lua_getstate();
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.dmx_write_ref);
+  int i, n = lua_objlen(L, -1);
+  for (i = 1; i <= n; i++)
+    lua_rawgeti(L, -i, i);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.dmx_ref);
+  lua_call(L, n, 0);
+  lua_pop(L, 1);
+}
+
+// Copies the channels of one universe, at off in p, into the buffer
+static void net_dmx_data(lnet_userdata *ud, struct pbuf *p, u16_t off,
+                         u16_t len, u16_t universe, u8_t sequence, bool synced) {
+  pixbuf *buffer = (pixbuf *)ud->client.dmx;
+  size_t size = pixbuf_size(buffer);
+  if (universe < ud->client.dmx_universe)
+    return;
+  size_t at = ud->client.dmx_offset +
+              (size_t)(universe - ud->client.dmx_universe) * DMX_UNIVERSE;
+  if (at >= size)
+    return;
+  if (len > p->tot_len - off)
+    len = p->tot_len - off;
+  if (len > size - at)
+    len = size - at;
+  pbuf_copy_partial(p, buffer->values + at, len, off);
+  ud->client.dmx_pending = 1;
+
+  if (ud->client.dmx_cb_ref != LUA_NOREF) {
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.dmx_cb_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_pushinteger(L, universe);
+    lua_pushinteger(L, sequence);
+    lua_call(L, 3, 0);
+  }
+  if (!synced && at + DMX_UNIVERSE >= size)
+    net_dmx_write(ud);
+}
+
+static bool net_dmx_artnet(lnet_userdata *ud, struct pbuf *p, const u8_t *h) {
+  if (p->len < 10 || memcmp(h, "Art-Net", 8) != 0)
+    return false;
+  u16_t op = h[8] | (h[9] << 8);
+  if (op == ARTNET_OP_SYNC) {
+    ud->client.dmx_synced = system_get_time();
+    if (ud->client.dmx_pending)
+      net_dmx_write(ud);
+    return true;
+  }
+  if (op != ARTNET_OP_DMX || p->len < ARTNET_DMX_HDR)
+    return false;
+  bool synced = ud->client.dmx_synced &&
+                system_get_time() - ud->client.dmx_synced < DMX_SYNC_TIMEOUT_US;
+  if (!synced)
+    ud->client.dmx_synced = 0;
+  net_dmx_data(ud, p, ARTNET_DMX_HDR, (h[16] << 8) | h[17],
+               h[14] | (h[15] << 8), h[12], synced);
+  return true;
+}
+
+static bool net_dmx_e131(lnet_userdata *ud, struct pbuf *p, const u8_t *h) {
+  if (p->len < E131_SYNC_LEN || memcmp(h + 4, e131_acn_id, sizeof(e131_acn_id)) != 0)
+    return false;
+  u32_t root = dmx_be32(h + 18), frame = dmx_be32(h + 40);
+  if (root == E131_ROOT_EXTENDED && frame == E131_FRAME_SYNC) {
+    if (ud->client.dmx_pending)
+      net_dmx_write(ud);
+    return true;
+  }
+  if (root != E131_ROOT_DATA || frame != E131_FRAME_DATA ||
+      p->len < E131_DATA_HDR || h[125] != 0)   // only DMX, start code 0
+    return false;
+  u16_t count = (h[123] << 8) | h[124];
+  if (count == 0 || (h[112] & 0x80))      // the preview data is not shown
+    return true;
+  net_dmx_data(ud, p, E131_DATA_HDR, count - 1, (h[113] << 8) | h[114],
+               h[111], h[109] || h[110]);
+  return true;
+}
+
+static bool net_dmx(lnet_userdata *ud, struct pbuf *p) {
+  const u8_t *h = (const u8_t *)p->payload;
+  return net_dmx_artnet(ud, p, h) || net_dmx_e131(ud, p, h);
+}
+#endif
+
 static void net_udp_recv_cb(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t port) {
   lnet_userdata *ud = (lnet_userdata*)arg;
   if (!ud || !ud->pcb || ud->type != TYPE_UDP_SOCKET || ud->self_ref == LUA_NOREF) {
     if (p) pbuf_free(p);
     return;
   }
-  net_recv_cb(ud, p, addr, port);
+  ud->client.bytes_in += p->tot_len;
+#ifdef LUA_USE_MODULES_PIXBUF
+  if (ud->client.dmx && net_dmx(ud, p)) {
+    pbuf_free(p);
+    return;
+  }
+#endif
+  if (ud->client.cb_batch_ref != LUA_NOREF)
+    net_batch_add(ud, p, addr, port);
+  else
+    net_recv_cb(ud, p, addr, port);
 }
 
 static err_t net_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
   lnet_userdata *ud = (lnet_userdata*)arg;
+  if (ud && ud->client.closing == tpcb) {
+    if (p) {
+      tcp_recved(tpcb, p->tot_len);
+      pbuf_free(p);
+    }
+    return ERR_OK;
+  }
   if (!ud || !ud->pcb || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF)
     return ERR_ABRT;
   if (!p) {
     net_err_cb(arg, err);
     return tcp_close(tpcb);
   }
+  ud->client.bytes_in += p->tot_len;
+  if (ud->client.sink) {
+    // the window is opened as the sink reports the data used
+    ud->client.sink(ud->client.sink_arg, p);
+    return ERR_OK;
+  }
   net_recv_cb(ud, p, 0, 0);
   tcp_recved(tpcb, ud->client.hold ? 0 : TCP_WND);
   return ERR_OK;
@@ -251,9 +1007,22 @@ static err_t net_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
 
 static err_t net_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
   lnet_userdata *ud = (lnet_userdata*)arg;
+  lua_State *L = lua_getstate();
+  if (ud && ud->client.closing == tpcb) {
+    ud->client.bytes_out += len;
+    net_pin_ack(L, ud, len);
+    if (ud->client.pin_ref == LUA_NOREF)
+      net_closing_done(L, ud);
+    return ERR_OK;
+  }
   if (!ud || !ud->pcb || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF) return ERR_ABRT;
+  ud->client.bytes_out += len;
+  net_pin_ack(L, ud, len);
+  if (ud->client.stream != NET_STREAM_IDLE) {
+    net_stream_pump(L, ud);
+    return ERR_OK;
+  }
   if (ud->client.cb_sent_ref == LUA_NOREF) return ERR_OK;
-  lua_State *L = lua_getstate();
   lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
   lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
   lua_call(L, 1, 0);
@@ -265,6 +1034,12 @@ static err_t net_accept_cb(void *arg, struct tcp_pcb *newpcb, err_t err) {
   if (!ud || ud->type != TYPE_TCP_SERVER || !ud->pcb) return ERR_ABRT;
   if (ud->self_ref == LUA_NOREF || ud->server.cb_accept_ref == LUA_NOREF) return ERR_ABRT;
 
+  // newpcb is on the active list, so this holds connections to the limit
+  int active = 0;
+  for (struct tcp_pcb *pcb = tcp_active_pcbs; pcb; pcb = pcb->next)
+    active++;
+  if (active > MEMP_NUM_TCP_PCB) return ERR_MEM;   // lwIP aborts newpcb
+
   lua_State *L = lua_getstate();
   lua_rawgeti(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
 
@@ -330,6 +1105,133 @@ lnet_userdata *net_get_udata_s( lua_State *L, int stack ) {
 }
 #define net_get_udata(L) net_get_udata_s(L, 1)
 
+#pragma mark - C sinks
+
+/*
+ * Lets C code, such as pcm, take the data received on a TCP socket in place of
+ * the receive callback, without it passing through Lua. The sink is given each
+ * pbuf chain, which it then owns, and reports the bytes it has used with
+ * net_sink_recved() so that the receive window only opens as fast as the data
+ * is consumed. It is called with NULL once the connection has ended. The caller
+ * has to keep a reference to the socket. Returns NULL if the value at ndx is not
+ * a connected TCP socket or already has a sink.
+ */
+void *net_sink_attach( lua_State *L, int ndx, net_sink_fn fn, void *arg ) {
+  lnet_userdata *ud = net_get_udata_s(L, ndx);
+  if (!ud || ud->type != TYPE_TCP_CLIENT || !ud->pcb || ud->client.sink)
+    return NULL;
+  ud->client.sink = fn;
+  ud->client.sink_arg = arg;
+  return ud;
+}
+
+void net_sink_recved( void *sock, u16_t len ) {
+  lnet_userdata *ud = (lnet_userdata *)sock;
+  if (ud->tcp_pcb && len)
+    tcp_recved(ud->tcp_pcb, len);
+}
+
+// Hands the socket back to its receive callback; the sink is not called again
+void net_sink_detach( void *sock ) {
+  lnet_userdata *ud = (lnet_userdata *)sock;
+  ud->client.sink = NULL;
+}
+
+/*
+ * The number of bytes that send() would take on the socket at ndx right now,
+ * or -1 if it is not a connected TCP socket. This lets C code, such as the
+ * node.output() console, pace what it sends by the send buffer.
+ */
+int net_sendroom( lua_State *L, int ndx ) {
+  lnet_userdata *ud = net_get_udata_s(L, ndx);
+  if (!ud || ud->type != TYPE_TCP_CLIENT || !ud->pcb || ud->self_ref == LUA_NOREF)
+    return -1;
+  return ud->client.stream == NET_STREAM_IDLE ? tcp_sndbuf(ud->tcp_pcb) : 0;
+}
+
+extern int pipe_drain(lua_State *L, int ndx,
+                      int (*fn)(void *, const char *, size_t), void *arg);
+
+static int net_write_pipe_room( void *arg, const char *s, size_t l ) {
+  net_writer_t *w = (net_writer_t *)arg;
+  if (l > tcp_sndbuf(w->ud->tcp_pcb))
+    return 1;                         // the rest waits for the window to open
+  return net_write_chunk(w, s, l, 0);
+}
+
+/*
+ * Sends as many whole chunks of the pipe at pndx as the send buffer takes on
+ * the TCP socket at ndx, and removes them from the pipe, so that C code such as
+ * fifosock can queue data without building strings. Returns the bytes sent, or
+ * -1 if the socket is not connected.
+ */
+int net_send_pipe( lua_State *L, int ndx, int pndx ) {
+  if (pndx < 0 && pndx > LUA_REGISTRYINDEX)
+    pndx = lua_gettop(L) + pndx + 1;
+  if (net_sendroom(L, ndx) <= 0)
+    return net_sendroom(L, ndx);
+  net_writer_t w = { L, net_get_udata_s(L, ndx), NULL, 0, 0, ERR_OK };
+  pipe_drain(L, pndx, net_write_pipe_room, &w);
+  if (w.len)
+    tcp_output(w.ud->tcp_pcb);
+  return w.len;
+}
+
+/*
+ * recvfile() is a sink of net.c itself, writing each pbuf to a VFS file as it
+ * arrives and only then opening the receive window by as much. A failed write
+ * releases the file and is reported at once; the rest of the data is then
+ * discarded.
+ */
+static void net_recvfile_close( lua_State *L, lnet_userdata *ud ) {
+  if (ud->client.recv_fd_owned)
+    vfs_close(ud->client.recv_fd);
+  else
+    vfs_flush(ud->client.recv_fd);
+  ud->client.recv_fd = 0;
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->client.recv_ref);
+  ud->client.recv_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->client.recv_done_ref);
+  ud->client.recv_done_ref = LUA_NOREF;
+}
+
+// Lets go of the file and tells Lua the outcome, so the file may be reused
+static void net_recvfile_end( lua_State *L, lnet_userdata *ud, const char *err ) {
+  int ref = ud->client.recv_done_ref;
+  ud->client.recv_done_ref = LUA_NOREF;
+  net_recvfile_close(L, ud);
+  if (ref != LUA_NOREF && ud->self_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_pushinteger(L, ud->client.recv_bytes);
+    if (err)
+      lua_pushstring(L, err);
+    lua_call(L, err ? 3 : 2, 0);
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
+static void net_recvfile_sink( void *arg, struct pbuf *p ) {
+  lnet_userdata *ud = (lnet_userdata *)arg;
+  lua_State *L = lua_getstate();
+  if (!p) {
+    if (ud->client.recv_fd)
+      net_recvfile_end(L, ud, NULL);
+    return;
+  }
+  u16_t len = p->tot_len;
+  struct pbuf *q;
+  for (q = p; q && ud->client.recv_fd; q = q->next) {
+    if (vfs_write(ud->client.recv_fd, q->payload, q->len) != q->len)
+      net_recvfile_end(L, ud, "write failed");
+    else
+      ud->client.recv_bytes += q->len;
+  }
+  pbuf_free(p);
+  if (ud->tcp_pcb)
+    tcp_recved(ud->tcp_pcb, len);
+}
+
 #pragma mark - Lua API
 
 // Lua: server:listen(port, addr, function(c)), socket:listen(port, addr)
@@ -428,6 +1330,12 @@ int net_connect( lua_State *L ) {
     luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_connect_ref);
     ud->client.cb_connect_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
+  if (ud->client.closing) {
+    // Reconnecting drops whatever the previous connection had left to send
+    struct tcp_pcb *pcb = ud->client.closing;
+    net_closing_done(L, ud);
+    tcp_abort(pcb);
+  }
   ud->tcp_pcb = tcp_new();
   if (!ud->tcp_pcb)
     return luaL_error(L, "cannot allocate PCB");
@@ -481,6 +1389,8 @@ int net_on( lua_State *L ) {
         { refptr = &ud->client.cb_dns_ref; break; }
       if (strcmp("receive",name)==0)
         { refptr = &ud->client.cb_receive_ref; break; }
+      if (ud->type == TYPE_UDP_SOCKET && strcmp("receive_batch",name)==0)
+        { refptr = &ud->client.cb_batch_ref; break; }
       if (strcmp("sent",name)==0)
         { refptr = &ud->client.cb_sent_ref; break; }
       break;
@@ -488,6 +1398,14 @@ int net_on( lua_State *L ) {
   }
   if (refptr == NULL)
     return luaL_error(L, "invalid callback name");
+  if (refptr == &ud->client.cb_receive_ref)
+    ud->client.rx_buffered = lua_toboolean(L, 4);
+  if (refptr == &ud->client.cb_batch_ref) {
+    int max = luaL_optinteger(L, 4, NET_BATCH_MAX);
+    luaL_argcheck(L, max > 0 && max <= 255, 4, "out of range");
+    if (!ud->client.batch)
+      ud->client.batch_max = max;
+  }
   if (lua_isfunction(L, 3)) {
     lua_pushvalue(L, 3);
     luaL_unref(L, LUA_REGISTRYINDEX, *refptr);
@@ -501,16 +1419,64 @@ int net_on( lua_State *L ) {
   return 0;
 }
 
-// Lua: client:send(data, function(c)), socket:send(port, ip, data, function(s))
+/*
+ * send() takes any mix of strings, pipes and arrays of these, queued in order
+ * as one write.  The pieces are walked twice: once to validate and measure
+ * them, so that a send which cannot fit fails before anything is queued, and
+ * once to write them.  Over TCP each piece goes straight to tcp_write() with
+ * a single tcp_output() at the end; a UDP datagram is assembled in one pbuf.
+ */
+static int net_write_pipe_chunk( void *arg, const char *s, size_t l ) {
+  return net_write_chunk((net_writer_t *)arg, s, l, 0);
+}
+
+// Returns 0 if the piece was handled, 1 on a write error and -1 if invalid
+static int net_write_piece( net_writer_t *w, int ndx ) {
+  lua_State *L = w->L;
+  if (lua_isstring(L, ndx)) {
+    size_t l;
+    const char *s = lua_tolstring(L, ndx, &l);
+    return l ? net_write_chunk(w, s, l, ndx) : 0;
+  }
+  if (w->measure) {
+    int l = pipe_drain(L, ndx, NULL, NULL);
+    if (l < 0) return -1;
+    w->len += l;
+    return 0;
+  }
+  pipe_drain(L, ndx, net_write_pipe_chunk, w);
+  return w->err != ERR_OK;
+}
+
+static int net_write_pieces( net_writer_t *w, int first, int last ) {
+  lua_State *L = w->L;
+  int i, j, n, r = 0;
+  for (i = first; i <= last && !r; i++) {
+    if (lua_istable(L, i) && pipe_drain(L, i, NULL, NULL) < 0) {
+      n = lua_objlen(L, i);
+      for (j = 1; j <= n && !r; j++) {
+        lua_rawgeti(L, i, j);
+        r = net_write_piece(w, lua_gettop(L));
+        lua_pop(L, 1);
+      }
+    } else {
+      r = net_write_piece(w, i);
+    }
+    if (r < 0)
+      return luaL_argerror(L, i, "string or pipe expected");
+  }
+  return r;
+}
+
+// Lua: client:send(data, ..., function(c)), socket:send(port, ip, data, ..., function(s))
 int net_send( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
   if (!ud || ud->type == TYPE_TCP_SERVER)
     return luaL_error(L, "invalid user data");
   ip_addr_t addr;
   uint16_t port;
-  const char *data;
-  size_t datalen = 0;
-  int stack = 2;
+  net_writer_t w = { L, ud, NULL, 0, 1, ERR_OK };
+  int stack = 2, last = lua_gettop(L);
   if (ud->type == TYPE_UDP_SOCKET) {
     size_t dl = 0;
     port = luaL_checkinteger(L, stack++);
@@ -519,10 +1485,12 @@ int net_send( lua_State *L ) {
     if (!domain) return luaL_error(L, "need IP address");
     if (!ipaddr_aton(domain, &addr)) return luaL_error(L, "invalid IP address");
   }
-  data = luaL_checklstring(L, stack++, &datalen);
-  if (!data || datalen == 0) return luaL_error(L, "no data to send");
-  if (lua_isfunction(L, stack)) {
-    lua_pushvalue(L, stack++);
+  while (last >= stack && lua_isnil(L, last)) last--;
+  int cb = last >= stack && lua_isfunction(L, last) ? last-- : 0;
+  net_write_pieces(&w, stack, last);
+  if (w.len == 0) return luaL_error(L, "no data to send");
+  if (cb) {
+    lua_pushvalue(L, cb);
     luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
     ud->client.cb_sent_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
@@ -546,24 +1514,159 @@ int net_send( lua_State *L ) {
   if (!ud->pcb || ud->self_ref == LUA_NOREF)
     return luaL_error(L, "not connected");
   err_t err;
+  size_t datalen = w.len;
+  w.measure = 0;
+  w.len = 0;
   if (ud->type == TYPE_UDP_SOCKET) {
     struct pbuf *pb = pbuf_alloc(PBUF_TRANSPORT, datalen, PBUF_RAM);
     if (!pb)
       return luaL_error(L, "cannot allocate message buffer");
-    pbuf_take(pb, data, datalen);
+    w.buf = pb->payload;
+    net_write_pieces(&w, stack, last);
     err = udp_sendto(ud->udp_pcb, pb, &addr, port);
     pbuf_free(pb);
+    if (err == ERR_OK)
+      ud->client.bytes_out += datalen;
     if (ud->client.cb_sent_ref != LUA_NOREF) {
       lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
       lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
       lua_call(L, 1, 0);
     }
   } else if (ud->type == TYPE_TCP_CLIENT) {
-    err = tcp_write(ud->tcp_pcb, data, datalen, TCP_WRITE_FLAG_COPY);
+    if (datalen > tcp_sndbuf(ud->tcp_pcb))
+      return lwip_lua_checkerr(L, ERR_MEM);
+    net_write_pieces(&w, stack, last);
+    if (w.len)
+      tcp_output(ud->tcp_pcb);
+    err = w.err;
   }
   return lwip_lua_checkerr(L, err);
 }
 
+// Lua: client:stream(reader(c, maxlen) or encoder[, function(c)]), client:stream(nil)
+int net_stream( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (lua_isnoneornil(L, 2)) {
+    net_stream_stop(L, ud);
+    return 0;
+  }
+  int enc = 0;
+#ifdef LUA_USE_MODULES_SJSON
+  enc = lua_isuserdata(L, 2) && sjson_encoder_fill(L, 2, NULL, 0) == 0;
+#endif
+  if (!enc)
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+  if (ud->client.stream != NET_STREAM_IDLE)
+    return luaL_error(L, "stream already active");
+  lua_settop(L, 3);
+  if (!lua_isnil(L, 3))
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+  if (enc && !ud->client.stream_buf &&
+      !(ud->client.stream_buf = malloc(NET_SENDFILE_CHUNK)))
+    return luaL_error(L, "out of memory");
+  if (lua_isnil(L, 3))
+    lua_pop(L, 1);
+  else
+    ud->client.stream_done_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ud->client.stream_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ud->client.stream_enc = enc;
+  ud->client.stream = NET_STREAM_ACTIVE;
+  net_stream_pump(L, ud);
+  return 0;
+}
+
+// Lua: client:sendfile(path or file[, offset[, len]][, function(c)])
+int net_sendfile( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+  if (ud->client.stream != NET_STREAM_IDLE)
+    return luaL_error(L, "stream already active");
+  int top = lua_gettop(L);
+  int cb = top > 2 && lua_isfunction(L, top) ? top : 0;
+  lua_Integer offset = (cb == 3) ? -1 : luaL_optinteger(L, 3, -1);
+  lua_Integer len = (cb && cb <= 4) ? -1 : luaL_optinteger(L, 4, -1);
+  int fd, owned = lua_type(L, 2) == LUA_TSTRING;
+  if (owned) {
+    fd = vfs_open(lua_tostring(L, 2), "r");
+    if (!fd)
+      return luaL_error(L, "cannot open %s", lua_tostring(L, 2));
+  } else {
+    // a file.obj userdata starts with its VFS descriptor
+    fd = *(int *)luaL_checkudata(L, 2, "file.obj");
+    if (!fd)
+      return luaL_error(L, "file is closed");
+  }
+  const char *err = NULL;
+  if (offset >= 0 && vfs_lseek(fd, offset, VFS_SEEK_SET) < 0)
+    err = "cannot seek";
+  else if (!(ud->client.stream_buf = malloc(NET_SENDFILE_CHUNK)))
+    err = "out of memory";
+  if (err) {
+    if (owned)
+      vfs_close(fd);
+    return luaL_error(L, err);
+  }
+  ud->client.stream_fd = fd;
+  ud->client.stream_fd_owned = owned;
+  ud->client.stream_left = len < 0 ? (u32_t)-1 : (u32_t)len;
+  if (cb) {
+    lua_pushvalue(L, cb);
+    ud->client.stream_done_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  if (!owned) {
+    lua_pushvalue(L, 2);                 // keep the file object alive
+    ud->client.stream_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  ud->client.stream = NET_STREAM_ACTIVE;
+  net_stream_pump(L, ud);
+  return 0;
+}
+
+// Lua: client:recvfile(path or file[, function(c, bytes[, err])])
+int net_recvfile( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+  if (ud->client.sink)
+    return luaL_error(L, "receiver already active");
+  lua_settop(L, 3);
+  if (!lua_isnil(L, 3))
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+  int fd, owned = lua_type(L, 2) == LUA_TSTRING;
+  if (owned) {
+    fd = vfs_open(lua_tostring(L, 2), "w");
+    if (!fd)
+      return luaL_error(L, "cannot open %s", lua_tostring(L, 2));
+  } else {
+    fd = *(int *)luaL_checkudata(L, 2, "file.obj");
+    if (!fd)
+      return luaL_error(L, "file is closed");
+  }
+  ud->client.recv_fd = fd;
+  ud->client.recv_fd_owned = owned;
+  ud->client.recv_bytes = 0;
+  if (lua_isnil(L, 3))
+    lua_pop(L, 1);
+  else
+    ud->client.recv_done_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (!owned) {
+    lua_pushvalue(L, 2);                 // keep the file object alive
+    ud->client.recv_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  ud->client.sink = net_recvfile_sink;
+  ud->client.sink_arg = ud;
+  return 0;
+}
+
 // Lua: client:hold()
 int net_hold( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
@@ -672,6 +1775,99 @@ int net_getpeer( lua_State *L ) {
   return 2;
 }
 
+static void net_dmx_stop( lua_State *L, lnet_userdata *ud ) {
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->client.dmx_ref);
+  ud->client.dmx_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->client.dmx_cb_ref);
+  ud->client.dmx_cb_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->client.dmx_write_ref);
+  ud->client.dmx_write_ref = LUA_NOREF;
+  ud->client.dmx = NULL;
+}
+
+#ifdef LUA_USE_MODULES_PIXBUF
+// Lua: socket:dmx(buffer, universe[, options]), socket:dmx(nil)
+int net_dmx_lua( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_UDP_SOCKET)
+    return luaL_error(L, "invalid user data");
+  net_dmx_stop(L, ud);
+  if (lua_isnoneornil(L, 2))
+    return 0;
+  pixbuf *buffer = pixbuf_from_lua_arg(L, 2);
+  int universe = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, universe >= 0 && universe < 0x10000, 3, "out of range");
+  int offset = 0;
+  if (!lua_isnoneornil(L, 4)) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_getfield(L, 4, "offset");
+    offset = luaL_optinteger(L, -1, 0);
+    luaL_argcheck(L, offset >= 0 && offset < pixbuf_size(buffer), 4, "offset out of range");
+    lua_getfield(L, 4, "callback");
+    if (!lua_isnil(L, -1)) {
+      luaL_argcheck(L, lua_isfunction(L, -1), 4, "callback must be a function");
+      lua_pushvalue(L, -1);
+      ud->client.dmx_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    // The write function is kept as an array of it and its arguments
+    lua_getfield(L, 4, "write");
+    if (!lua_isnil(L, -1)) {
+      luaL_argcheck(L, lua_isfunction(L, -1), 4, "write must be a function");
+      lua_getfield(L, 4, "args");
+      int n = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+      lua_createtable(L, n + 1, 0);
+      lua_pushvalue(L, -3);
+      lua_rawseti(L, -2, 1);
+      for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, -2, i);
+        lua_rawseti(L, -2, i + 1);
+      }
+      ud->client.dmx_write_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_settop(L, 4);
+  }
+  lua_pushvalue(L, 2);
+  ud->client.dmx_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ud->client.dmx = buffer;
+  ud->client.dmx_universe = universe;
+  ud->client.dmx_offset = offset;
+  ud->client.dmx_synced = 0;
+  ud->client.dmx_pending = 0;
+  return 0;
+}
+#endif
+
+// Lua: client/socket:stats()
+int net_sockstats( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type == TYPE_TCP_SERVER)
+    return luaL_error(L, "invalid user data");
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, ud->client.bytes_in);
+  lua_setfield(L, -2, "bytes_in");
+  lua_pushinteger(L, ud->client.bytes_out);
+  lua_setfield(L, -2, "bytes_out");
+  if (ud->type == TYPE_UDP_SOCKET) {
+    lua_pushinteger(L, ud->client.dropped);
+    lua_setfield(L, -2, "dropped");
+  }
+  if (ud->type == TYPE_TCP_CLIENT && ud->pcb) {
+    struct tcp_pcb *pcb = ud->tcp_pcb;
+    lua_pushinteger(L, pcb->rexmits);
+    lua_setfield(L, -2, "rexmit");
+    // sa holds eight times the smoothed RTT, in slow timer ticks
+    if (pcb->sa > 0) {
+      lua_pushinteger(L, (pcb->sa >> 3) * TCP_SLOW_INTERVAL);
+      lua_setfield(L, -2, "rtt");
+    }
+    lua_pushinteger(L, pcb->rto * TCP_SLOW_INTERVAL);
+    lua_setfield(L, -2, "rto");
+    lua_pushinteger(L, tcp_sndbuf(pcb));
+    lua_setfield(L, -2, "sndbuf");
+  }
+  return 1;
+}
+
 // Lua: client/server/socket:getaddr()
 int net_getaddr( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
@@ -725,8 +1921,14 @@ int net_close( lua_State *L ) {
         if (ERR_OK != tcp_close(ud->tcp_pcb)) {
           tcp_arg(ud->tcp_pcb, NULL);
           tcp_abort(ud->tcp_pcb);
+          net_pin_release(L, ud);
+        } else if (ud->client.pin_ref != LUA_NOREF) {
+          // lwIP still references pinned strings; hold them until acked
+          ud->client.closing = ud->tcp_pcb;
         }
         ud->tcp_pcb = NULL;
+        net_stream_stop(L, ud);
+        net_sink_end(ud);
         break;
       case TYPE_TCP_SERVER:
         tcp_close(ud->tcp_pcb);
@@ -741,7 +1943,8 @@ int net_close( lua_State *L ) {
     return luaL_error(L, "not connected");
   }
   if (ud->type == TYPE_TCP_SERVER ||
-     (ud->pcb == NULL && ud->client.wait_dns == 0)) {
+     (ud->pcb == NULL && ud->client.wait_dns == 0 &&
+      (ud->type != TYPE_TCP_CLIENT || !ud->client.closing))) {
 
     int selfref = ud->self_ref;
     ud->self_ref = LUA_NOREF;
@@ -762,6 +1965,12 @@ int net_delete( lua_State *L ) {
         tcp_arg(ud->tcp_pcb, NULL);
         tcp_abort(ud->tcp_pcb);
         ud->tcp_pcb = NULL;
+        net_pin_release(L, ud);
+        net_stream_stop(L, ud);
+        if (ud->client.recv_fd) {
+          ud->client.sink = NULL;
+          net_recvfile_close(L, ud);
+        }
         break;
       case TYPE_TCP_SERVER:
         tcp_close(ud->tcp_pcb);
@@ -788,6 +1997,11 @@ int net_delete( lua_State *L ) {
       ud->client.cb_receive_ref = LUA_NOREF;
       luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
       ud->client.cb_sent_ref = LUA_NOREF;
+      if (ud->type == TYPE_UDP_SOCKET) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_batch_ref);
+        ud->client.cb_batch_ref = LUA_NOREF;
+        net_dmx_stop(L, ud);
+      }
       break;
     case TYPE_TCP_SERVER:
       luaL_unref(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
@@ -954,6 +2168,43 @@ static int net_getdnsserver( lua_State* L ) {
   return 1;
 }
 
+// Lua: t = net.dns.cache([{flush=, prefetch=}])
+static int net_dns_cache( lua_State* L ) {
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "prefetch");
+    if (!lua_isnil(L, -1)) {
+      int secs = luaL_checkinteger(L, -1);
+      if (secs < 0 || secs > 0xFFFF)
+        return luaL_error(L, "prefetch must be in 0-65535");
+      dns_cache_setprefetch(secs);
+    }
+    lua_getfield(L, 1, "flush");
+    if (lua_toboolean(L, -1))
+      dns_cache_flush();
+    lua_pop(L, 2);
+  } else if (!lua_isnoneornil(L, 1)) {
+    return luaL_argerror(L, 1, "table expected");
+  }
+  struct dns_cache_stats st;
+  dns_cache_getstats(&st);
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, st.size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, st.used);
+  lua_setfield(L, -2, "used");
+  lua_pushinteger(L, st.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, st.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, st.negative);
+  lua_setfield(L, -2, "negative");
+  lua_pushinteger(L, st.prefetches);
+  lua_setfield(L, -2, "prefetches");
+  lua_pushinteger(L, st.prefetch);
+  lua_setfield(L, -2, "prefetch");
+  return 1;
+}
+
 #pragma mark - netif info
 
 /*
@@ -1013,6 +2264,156 @@ static int net_ifinfo( lua_State* L ) {
   return 1;
 }
 
+#pragma mark - Stack statistics
+
+#if LWIP_STATS
+static const char *const memp_names[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name,num,size,desc,attr) #name,
+#include "lwip/memp_std.h"
+};
+
+static void push_proto_stats(lua_State *L, struct stats_proto *proto, bool tcp) {
+  lua_createtable(L, 0, tcp ? 10 : 9);
+#define PROTO_FIELD(f) lua_pushinteger(L, proto->f); lua_setfield(L, -2, #f)
+  PROTO_FIELD(xmit);
+  PROTO_FIELD(recv);
+  PROTO_FIELD(drop);
+  PROTO_FIELD(chkerr);
+  PROTO_FIELD(lenerr);
+  PROTO_FIELD(memerr);
+  PROTO_FIELD(rterr);
+  PROTO_FIELD(proterr);
+  PROTO_FIELD(err);
+  if (tcp) {
+    PROTO_FIELD(rexmit);
+  }
+#undef PROTO_FIELD
+}
+
+// Lua: net.stats([reset])
+static int net_stats( lua_State *L ) {
+  bool reset = lua_toboolean(L, 1);
+  lua_createtable(L, 0, 5);
+
+#if IP_STATS
+  push_proto_stats(L, &lwip_stats.ip, false);
+  lua_setfield(L, -2, "ip");
+#endif
+#if UDP_STATS
+  push_proto_stats(L, &lwip_stats.udp, false);
+  lua_setfield(L, -2, "udp");
+#endif
+#if TCP_STATS
+  push_proto_stats(L, &lwip_stats.tcp, true);
+  lua_setfield(L, -2, "tcp");
+#endif
+
+  lua_createtable(L, 0, 2);
+  lua_pushinteger(L, system_get_free_heap_size());
+  lua_setfield(L, -2, "free");
+#if MEM_STATS
+  lua_pushinteger(L, lwip_stats.mem.err);
+  lua_setfield(L, -2, "err");
+#endif
+  lua_setfield(L, -2, "mem");
+
+#if MEMP_STATS
+  lua_createtable(L, 0, MEMP_MAX);
+  for (int i = 0; i < MEMP_MAX; i++) {
+    struct stats_mem *m = &lwip_stats.memp[i];
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, m->used);
+    lua_setfield(L, -2, "used");
+    lua_pushinteger(L, m->max);
+    lua_setfield(L, -2, "max");
+    lua_pushinteger(L, m->err);
+    lua_setfield(L, -2, "err");
+    lua_setfield(L, -2, memp_names[i]);
+  }
+  lua_setfield(L, -2, "memp");
+#endif
+
+  if (reset) {
+    // Elements in use stay counted, so that used stays right
+#if IP_STATS
+    memset(&lwip_stats.ip, 0, sizeof(lwip_stats.ip));
+#endif
+#if UDP_STATS
+    memset(&lwip_stats.udp, 0, sizeof(lwip_stats.udp));
+#endif
+#if TCP_STATS
+    memset(&lwip_stats.tcp, 0, sizeof(lwip_stats.tcp));
+#endif
+#if MEM_STATS
+    lwip_stats.mem.err = 0;
+#endif
+#if MEMP_STATS
+    for (int i = 0; i < MEMP_MAX; i++) {
+      lwip_stats.memp[i].max = lwip_stats.memp[i].used;
+      lwip_stats.memp[i].err = 0;
+    }
+#endif
+  }
+  return 1;
+}
+#endif
+
+// The runtime parts of the memory profiles of lwipopts.h, with the window in
+// segments so that it scales with the TCP_MSS the firmware was built with
+static const char *const net_profile_names[] = {
+  "default", "bulk", "many-conn", "low-mem", NULL
+};
+static const struct { uint8_t wnd, maxconn; } net_profiles[] = {
+  {4, 5}, {6, 4}, {2, 10}, {4, 3}
+};
+
+static int net_config_field( lua_State *L, const char *key, int lo, int hi, int v ) {
+  lua_getfield(L, 1, key);
+  if (!lua_isnil(L, -1)) {
+    v = luaL_checkinteger(L, -1);
+    if (v < lo || v > hi)
+      return luaL_error(L, "%s must be in %d-%d", key, lo, hi);
+  }
+  lua_pop(L, 1);
+  return v;
+}
+
+// Lua: net.config([profile or {wnd=, maxconn=, maxrtx=}])
+// The new settings apply to the connections that are made afterwards.
+static int net_config( lua_State *L ) {
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    int p = luaL_checkoption(L, 1, NULL, net_profile_names);
+    uint32_t wnd = net_profiles[p].wnd * TCP_MSS;
+    TCP_WND = wnd > 0xFFFF ? 0xFFFF : wnd;
+    MEMP_NUM_TCP_PCB = net_profiles[p].maxconn;
+  } else if (lua_istable(L, 1)) {
+    int wnd = net_config_field(L, "wnd", TCP_MSS, 0xFFFF, TCP_WND);
+    int maxconn = net_config_field(L, "maxconn", 1, 255, MEMP_NUM_TCP_PCB);
+    int maxrtx = net_config_field(L, "maxrtx", 1, 12, TCP_MAXRTX);
+    TCP_WND = wnd;
+    MEMP_NUM_TCP_PCB = maxconn;
+    TCP_MAXRTX = maxrtx;
+  } else if (!lua_isnoneornil(L, 1)) {
+    return luaL_argerror(L, 1, "profile name or table expected");
+  }
+  lua_createtable(L, 0, 7);
+  lua_pushstring(L, LWIP_PROFILE_NAME);
+  lua_setfield(L, -2, "profile");
+  lua_pushinteger(L, TCP_MSS);
+  lua_setfield(L, -2, "mss");
+  lua_pushinteger(L, TCP_SND_BUF);
+  lua_setfield(L, -2, "sndbuf");
+  lua_pushinteger(L, TCP_SND_QUEUELEN);
+  lua_setfield(L, -2, "sndqueue");
+  lua_pushinteger(L, TCP_WND);
+  lua_setfield(L, -2, "wnd");
+  lua_pushinteger(L, MEMP_NUM_TCP_PCB);
+  lua_setfield(L, -2, "maxconn");
+  lua_pushinteger(L, TCP_MAXRTX);
+  lua_setfield(L, -2, "maxrtx");
+  return 1;
+}
+
 #pragma mark - Tables
 
 // Module function map
@@ -1034,12 +2435,16 @@ LROT_BEGIN(net_tcpsocket, NULL, LROT_MASK_GC_INDEX)
   LROT_FUNCENTRY( close, net_close )
   LROT_FUNCENTRY( on, net_on )
   LROT_FUNCENTRY( send, net_send )
+  LROT_FUNCENTRY( stream, net_stream )
+  LROT_FUNCENTRY( sendfile, net_sendfile )
+  LROT_FUNCENTRY( recvfile, net_recvfile )
   LROT_FUNCENTRY( hold, net_hold )
   LROT_FUNCENTRY( unhold, net_unhold )
   LROT_FUNCENTRY( dns, net_dns )
   LROT_FUNCENTRY( ttl, net_ttl )
   LROT_FUNCENTRY( getpeer, net_getpeer )
   LROT_FUNCENTRY( getaddr, net_getaddr )
+  LROT_FUNCENTRY( stats, net_sockstats )
 LROT_END(net_tcpsocket, NULL, LROT_MASK_GC_INDEX)
 
 
@@ -1054,13 +2459,32 @@ LROT_BEGIN(net_udpsocket, NULL, LROT_MASK_GC_INDEX)
   LROT_FUNCENTRY( dns, net_dns )
   LROT_FUNCENTRY( ttl, net_ttl )
   LROT_FUNCENTRY( getaddr, net_getaddr )
+  LROT_FUNCENTRY( stats, net_sockstats )
+#ifdef LUA_USE_MODULES_PIXBUF
+  LROT_FUNCENTRY( dmx, net_dmx_lua )
+#endif
 LROT_END(net_udpsocket, NULL, LROT_MASK_GC_INDEX)
 
 
+LROT_BEGIN(net_pbuf, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, net_pbuf_free )
+  LROT_TABENTRY(  __index, net_pbuf )
+  LROT_FUNCENTRY( __len, net_pbuf_len )
+  LROT_FUNCENTRY( __tostring, net_pbuf_tostring )
+  LROT_FUNCENTRY( len, net_pbuf_len )
+  LROT_FUNCENTRY( sub, net_pbuf_sub )
+  LROT_FUNCENTRY( byte, net_pbuf_byte )
+  LROT_FUNCENTRY( find, net_pbuf_find )
+  LROT_FUNCENTRY( tostring, net_pbuf_tostring )
+  LROT_FUNCENTRY( free, net_pbuf_free )
+LROT_END(net_pbuf, NULL, LROT_MASK_GC_INDEX)
+
+
 LROT_BEGIN(net_dns_map, NULL, 0)
   LROT_FUNCENTRY( setdnsserver, net_setdnsserver )
   LROT_FUNCENTRY( getdnsserver, net_getdnsserver )
   LROT_FUNCENTRY( resolve, net_dns_static )
+  LROT_FUNCENTRY( cache, net_dns_cache )
 LROT_END(net_dns_map, NULL, 0)
 
 
@@ -1073,10 +2497,15 @@ LROT_BEGIN(net, NULL, 0)
   LROT_FUNCENTRY( createConnection, net_createConnection )
   LROT_FUNCENTRY( createUDPSocket, net_createUDPSocket )
   LROT_FUNCENTRY( ifinfo, net_ifinfo )
+  LROT_FUNCENTRY( config, net_config )
+#if LWIP_STATS
+  LROT_FUNCENTRY( stats, net_stats )
+#endif
   LROT_FUNCENTRY( multicastJoin, net_multicastJoin )
   LROT_FUNCENTRY( multicastLeave, net_multicastLeave )
 #ifdef NET_PING_ENABLE
   LROT_FUNCENTRY( ping, net_ping )
+  LROT_FUNCENTRY( pingstats, net_pingstats )
 #endif
   LROT_TABENTRY( dns, net_dns_map )
 #ifdef TLS_MODULE_PRESENT
@@ -1089,12 +2518,14 @@ LROT_END(net, NULL, 0)
 
 int luaopen_net( lua_State *L ) {
   igmp_init();
+  net_batch_task_id = platform_task_get_id(net_batch_task);
 
   luaL_rometatable(L, NET_TABLE_TCP_SERVER, LROT_TABLEREF(net_tcpserver));
   luaL_rometatable(L, NET_TABLE_TCP_CLIENT, LROT_TABLEREF(net_tcpsocket));
   luaL_rometatable(L, NET_TABLE_UDP_SOCKET, LROT_TABLEREF(net_udpsocket));
+  luaL_rometatable(L, NET_TABLE_PBUF, LROT_TABLEREF(net_pbuf));
 
   return 0;
 }
 
-NODEMCU_MODULE(NET, "net", net, luaopen_net);
+NODEMCU_MODULE_LAZY(NET, "net", net, luaopen_net);
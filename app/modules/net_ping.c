@@ -21,12 +21,25 @@ ping_opt needs to be the first element of the structure. It is a workaround to p
 callback reference and self_ref to the ping_received function. Pointer the ping_option 
 structure is equal to the pointer to net_ping_t structure.
 */
-typedef struct {
+typedef struct net_ping {
   struct ping_option ping_opt; 
   uint32_t ping_callback_ref; 
+  const char *host;          /* anchored by the closure, as an upvalue */
+  struct net_ping *dns_next; /* waiting for a free DNS table entry */
+  bool summary;              /* one callback with the statistics at the end */
+  uint32_t received;
+  uint32_t rtt_min;
+  uint32_t rtt_max;
+  uint32_t rtt_sum;
+  uint64_t rtt_sumsq;
  } net_ping_t;
 typedef net_ping_t* ping_t;  
 
+/* Sessions whose name lookup found the DNS table full, oldest first */
+static ping_t dns_waiting;
+static ping_t *dns_waiting_tail = &dns_waiting;
+static int dns_pending;  /* lookups started for pings and not yet answered */
+
 /*
  *  ping_received_sent(pingresp)
 */
@@ -80,8 +93,84 @@ static int ping_received_sent(lua_State *L) {
 }
 
 
+static uint32_t isqrt64(uint64_t x) {
+    uint64_t r = 0, bit = (uint64_t) 1 << 62;
+    while (bit > x)
+        bit >>= 2;
+    while (bit) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t) r;
+}
+
+/*
+ *  ping_summary(pingresp), the closure of net.pingstats() sessions
+*/
+#define LuaCBsummaryfunc  lua_upvalueindex(1)
+#define hostString  lua_upvalueindex(2)
+
+static int ping_summary(lua_State *L) {
+    struct ping_resp *resp = (struct ping_resp *) lua_touserdata (L, 1);
+    ping_t nip  = (ping_t) lua_touserdata (L, nipUD);
+
+    if (resp && resp->total_count == 0) { /* one reply or timeout */
+        if (resp->ping_err == 0) {
+            uint32_t rtt = resp->resp_time;
+            if (nip->received == 0 || rtt < nip->rtt_min)
+                nip->rtt_min = rtt;
+            if (rtt > nip->rtt_max)
+                nip->rtt_max = rtt;
+            nip->rtt_sum += rtt;
+            nip->rtt_sumsq += (uint64_t) rtt * rtt;
+            nip->received++;
+        }
+        return 0;
+    }
+
+    /* the session is over, or it never started if resp is NULL */
+    uint32_t sent = resp ? resp->total_count : 0;
+    uint32_t n = nip->received < sent ? nip->received : sent;
+
+    lua_pushvalue(L, LuaCBsummaryfunc);
+    lua_createtable(L, 0, 9);
+    lua_pushvalue(L, hostString);
+    lua_setfield(L, -2, "host");
+    if (nip->ping_opt.ip) {
+        char ipaddrstr[16];
+        ipaddr_ntoa_r((ip_addr_t *) &nip->ping_opt.ip, ipaddrstr, sizeof(ipaddrstr));
+        lua_pushstring(L, ipaddrstr);
+        lua_setfield(L, -2, "ip");
+    }
+    lua_pushinteger(L, sent);
+    lua_setfield(L, -2, "sent");
+    lua_pushinteger(L, n);
+    lua_setfield(L, -2, "received");
+    lua_pushinteger(L, sent ? (sent - n) * 100 / sent : 100);
+    lua_setfield(L, -2, "loss");
+    if (n) {
+        uint64_t var = (nip->rtt_sumsq * n - (uint64_t) nip->rtt_sum * nip->rtt_sum) / ((uint64_t) n * n);
+        lua_pushinteger(L, nip->rtt_min);
+        lua_setfield(L, -2, "min");
+        lua_pushnumber(L, (lua_Number) nip->rtt_sum / n);
+        lua_setfield(L, -2, "avg");
+        lua_pushinteger(L, nip->rtt_max);
+        lua_setfield(L, -2, "max");
+        lua_pushinteger(L, isqrt64(var));
+        lua_setfield(L, -2, "stddev");
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, nip->ping_callback_ref); /* unregister the closure */
+    luaL_pcallx(L, 1, 0);
+    return 0;
+}
+
 /*
- *  Wrapper to call ping_received_sent(pingresp)
+ *  Wrapper to call ping_received_sent(pingresp) or ping_summary(pingresp)
  */
 static void ping_CB(net_ping_t *nip, struct ping_resp *pingresp) {
     NODE_DBG("[net_info ping_CB] nip = %p, nip->ping_callback_ref = %p, pingresp= %p\n", nip, nip->ping_callback_ref, pingresp);
@@ -111,11 +200,42 @@ static void net_ping_raw(const char *name, ip_addr_t *ipaddr, ping_t nip) {
     nip->ping_opt.ip = ipaddr->addr;     
     NODE_DBG("[net_ping_raw] calling ping_start\n");
     if (!ping_start(&(nip->ping_opt))) {
+        if (nip->summary) {
+            ping_CB(nip, NULL);
+            return;
+        }
         luaL_unref(L, LUA_REGISTRYINDEX, nip->ping_callback_ref);
         luaL_error(L, "memory allocation error: cannot start ping");
     }
 }
 
+static void ping_dns_found(const char *name, ip_addr_t *ipaddr, ping_t nip);
+
+/*
+ *  Starts the lookups that were waiting for the DNS table, as far as it has room
+ */
+static void ping_dns_drain(void) {
+    while (dns_waiting) {
+        ping_t nip = dns_waiting;
+        ip_addr_t addr;
+        err_t err = dns_gethostbyname(nip->host, &addr, (dns_found_callback) ping_dns_found, nip);
+        if (err == ERR_MEM && dns_pending > 0)
+            return;  /* try again when the next lookup is answered */
+        if (!(dns_waiting = nip->dns_next))
+            dns_waiting_tail = &dns_waiting;
+        if (err == ERR_INPROGRESS)
+            dns_pending++;
+        else
+            net_ping_raw(nip->host, err == ERR_OK ? &addr : NULL, nip);
+    }
+}
+
+static void ping_dns_found(const char *name, ip_addr_t *ipaddr, ping_t nip) {
+    dns_pending--;
+    net_ping_raw(name, ipaddr, nip);
+    ping_dns_drain();
+}
+
 // Lua:  net.ping(domain, [count], callback)
 int net_ping(lua_State *L)
 {
@@ -142,7 +262,7 @@ int net_ping(lua_State *L)
     
     NODE_DBG("[net_ping] nip = %p, nip->ping_callback_ref = %p\n", nip, nip->ping_callback_ref);
 
-    err_t err = dns_gethostbyname(ping_target, &addr, (dns_found_callback) net_ping_raw, nip);
+    err_t err = dns_gethostbyname(ping_target, &addr, (dns_found_callback) ping_dns_found, nip);
     if (err != ERR_OK && err != ERR_INPROGRESS) {
         luaL_unref(L, LUA_REGISTRYINDEX, nip->ping_callback_ref);
         return luaL_error(L, "lwip error %d", err);
@@ -150,6 +270,65 @@ int net_ping(lua_State *L)
     if (err == ERR_OK) {
         NODE_DBG("[net_ping] No DNS resolution needed\n");
         net_ping_raw(ping_target, &addr, nip);
+    } else {
+        dns_pending++;
+    }
+    return 0;
+}
+
+/*
+ *  Starts one net.pingstats() session; the host name is on top of the stack
+ *  and the callback just below it. Both are popped.
+ */
+static void net_pingstats_start(lua_State *L, lua_Integer count) {
+    ping_t nip = (ping_t) memset(lua_newuserdata(L, sizeof(*nip)), 0, sizeof(*nip));
+    nip->host = lua_tostring(L, -2);
+    nip->summary = true;
+
+    /* Register C closure with 3 Upvals: (1) Lua CB summary function; (2) host name; (3) nip Userdata */
+    lua_pushcclosure(L, ping_summary, 3);
+
+    nip->ping_callback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    nip->ping_opt.count = count;
+    nip->ping_opt.coarse_time = 0;
+    nip->ping_opt.recv_function = (ping_recv_function) &ping_CB;
+    nip->ping_opt.sent_function = (ping_sent_function) &ping_CB;
+
+    /* queue behind earlier sessions, so that they are started in order */
+    nip->dns_next = NULL;
+    *dns_waiting_tail = nip;
+    dns_waiting_tail = &nip->dns_next;
+}
+
+// Lua:  net.pingstats(domain | {domain, ...}, [count], callback)
+int net_pingstats(lua_State *L)
+{
+    bool isf2 = lua_isfunction(L, 2);
+    lua_Integer l_count  = isf2 ? 0: luaL_optinteger(L, 2, 0);  /* use ping_start() default */
+    lua_settop(L, isf2 ? 2 : 3);
+    luaL_argcheck(L, l_count >= 0, 2, "invalid count");
+    luaL_argcheck(L, lua_isfunction(L, -1), lua_gettop(L), "no callback specified");
+    int cb = lua_gettop(L);
+
+    if (lua_istable(L, 1)) {
+        int n = lua_objlen(L, 1);
+        for (int i = 1; i <= n; i++) {
+            lua_rawgeti(L, 1, i);
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1, "host names expected");
+            lua_pop(L, 1);
+        }
+        for (int i = 1; i <= n; i++) {
+            lua_pushvalue(L, cb);
+            lua_rawgeti(L, 1, i);
+            net_pingstats_start(L, l_count);
+        }
+    } else {
+        luaL_checkstring(L, 1);
+        lua_pushvalue(L, cb);
+        lua_pushvalue(L, 1);
+        net_pingstats_start(L, l_count);
     }
+    /* a lookup fails only if the DNS table is full of lookups by other modules */
+    ping_dns_drain();
     return 0;
 }
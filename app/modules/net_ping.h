@@ -1,3 +1,4 @@
 #ifdef NET_PING_ENABLE
 int net_ping(lua_State *L);
+int net_pingstats(lua_State *L);
 #endif
@@ -5,6 +5,7 @@
 
 #include "platform.h"
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "user_interface.h"
 #include "flash_api.h"
@@ -13,9 +14,6 @@
 #include "rom.h"
 #include "task/task.h"
 
-#define CPU80MHZ 80
-#define CPU160MHZ 160
-
 #ifdef PLATFORM_STARTUP_COUNT
 platform_startup_counts_t platform_startup_counts;
 #endif
@@ -196,6 +194,17 @@ static int node_deepsleep( lua_State* L )
 }
 
 
+// Lua: fastwake( [lfsmodule] )
+static int node_fastwake( lua_State* L )
+{
+  size_t len = 0;
+  const char *name = luaL_optlstring(L, 1, NULL, &len);
+  luaL_argcheck(L, !name || (len > 0 && len <= PLATFORM_FASTWAKE_NAME_LEN), 1, "invalid module name");
+  platform_fastwake_set(name, len);
+  return 0;
+}
+
+
 #ifdef PMSLEEP_ENABLE
 #include "pm/pmSleep.h"
 
@@ -229,12 +238,82 @@ static int node_sleep( lua_State* L )
 #endif
   return 0;
 }
+
+static int node_autosleep_cb_ref = LUA_NOREF;
+static void node_autosleep_resume_cb(uint32 slept_ms)
+{
+  if (node_autosleep_cb_ref != LUA_NOREF) {
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, node_autosleep_cb_ref);
+    lua_pushinteger(L, slept_ms);
+    luaL_pcallx(L, 1, 0);
+  }
+}
+
+// Lua: sleeps, slept_ms = node.autosleep([table | false])
+static int node_autosleep( lua_State* L )
+{
+#ifdef TIMER_SUSPEND_ENABLE
+  if (lua_istable(L, 1)) {
+    pmSleep_autosleep_param_t cfg = {.min_idle_ms = 100, .wake_pin = 255, .int_type = GPIO_PIN_INTR_LOLEVEL};
+
+    lua_getfield(L, 1, "min_idle");
+    if (!lua_isnil(L, -1)) {
+      cfg.min_idle_ms = luaL_checkinteger(L, -1);
+      luaL_argcheck(L, cfg.min_idle_ms >= PMSLEEP_SLEEP_MIN_TIME / 1000 + 10, 1, "min_idle: too short");
+    }
+    lua_getfield(L, 1, "wake_pin");
+    if (!lua_isnil(L, -1)) {
+      int pin = luaL_checkinteger(L, -1);
+      luaL_argcheck(L, platform_gpio_exists(pin) && pin > 0, 1, "wake_pin: Invalid interrupt pin");
+      cfg.wake_pin = pin;
+    }
+    lua_getfield(L, 1, "int_type");
+    if (!lua_isnil(L, -1)) {
+      int type = luaL_checkinteger(L, -1);
+      luaL_argcheck(L, type == GPIO_PIN_INTR_ANYEDGE || type == GPIO_PIN_INTR_HILEVEL ||
+                       type == GPIO_PIN_INTR_LOLEVEL || type == GPIO_PIN_INTR_NEGEDGE ||
+                       type == GPIO_PIN_INTR_POSEDGE, 1, "int_type: invalid interrupt type");
+      cfg.int_type = type;
+    }
+    lua_getfield(L, 1, "resume_cb");
+    luaL_unref(L, LUA_REGISTRYINDEX, node_autosleep_cb_ref);
+    node_autosleep_cb_ref = LUA_NOREF;
+    if (!lua_isnil(L, -1)) {
+      luaL_checktype(L, -1, LUA_TFUNCTION);
+      lua_pushvalue(L, -1);
+      node_autosleep_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      cfg.resume_cb_ptr = node_autosleep_resume_cb;
+    }
+    lua_pop(L, 4);
+    pmSleep_autosleep_enable(&cfg);
+  } else if (!lua_isnoneornil(L, 1)) {
+    luaL_argcheck(L, lua_isboolean(L, 1) && !lua_toboolean(L, 1), 1, "must be table or false");
+    pmSleep_autosleep_disable();
+    luaL_unref(L, LUA_REGISTRYINDEX, node_autosleep_cb_ref);
+    node_autosleep_cb_ref = LUA_NOREF;
+  }
+
+  pmSleep_autosleep_stats_t stats;
+  pmSleep_autosleep_get_stats(&stats);
+  lua_pushinteger(L, stats.sleeps);
+  lua_pushinteger(L, stats.slept_ms);
+  return 2;
+#else
+  return luaL_error(L, "node.autosleep() is unavailable");
+#endif
+}
 #else
 static int node_sleep( lua_State* L )
 {
   dbg_printf("\n The options \"TIMER_SUSPEND_ENABLE\" and \"PMSLEEP_ENABLE\" in \"app/include/user_config.h\" were disabled during FW build!\n");
   return luaL_error(L, "node.sleep() is unavailable");
 }
+
+static int node_autosleep( lua_State* L )
+{
+  return luaL_error(L, "node.autosleep() is unavailable");
+}
 #endif //PMSLEEP_ENABLE
 
 static void add_int_field( lua_State* L, lua_Integer i, const char *name){
@@ -257,7 +336,7 @@ static void get_lfs_config ( lua_State* L ){
 }
 
 static int node_info( lua_State* L ){
-  const char* options[] = {"lfs", "hw", "sw_version", "build_config", "legacy", NULL};
+  const char* options[] = {"lfs", "hw", "sw_version", "build_config", "legacy", "strings", NULL};
   int option = luaL_checkoption (L, 1, options[4], options);
 
   switch (option) {
@@ -295,6 +374,18 @@ static int node_info( lua_State* L ){
       add_string_field(L, BUILDINFO_BUILD_TYPE, "number_type");
       return 1;
     }
+    case 5: { // strings
+#if LUA_VERSION_NUM > 501
+      lua_pushstrtstats(L, 0);
+      if (lua_pushstrtstats(L, 1))
+        lua_setfield(L, -2, "rom");
+      else
+        lua_pop(L, 1);
+      return 1;
+#else
+      return luaL_error(L, "not supported on Lua 5.1");
+#endif
+    }
     default: { // legacy
       platform_print_deprecation_note("node.info() without parameter", "in the next version");
       lua_pushinteger(L, NODE_VERSION_MAJOR);
@@ -342,6 +433,43 @@ static int node_flashsize( lua_State* L )
   return 1;
 }
 
+static const char *const flash_mode_names[] = {"qio", "qout", "dio", "dout", NULL};
+static const uint8_t flash_mode_vals[] = {MODE_QIO, MODE_QOUT, MODE_DIO, MODE_DOUT};
+
+// Lua: flashinfo()
+static int node_flashinfo( lua_State* L )
+{
+  uint32_t rate, miss;
+  uint8_t mode = flash_rom_get_mode();
+  unsigned i;
+  flash_rom_benchmark(&rate, &miss);
+
+  lua_createtable(L, 0, 6);
+  for (i = 0; i < sizeof(flash_mode_vals) && flash_mode_vals[i] != mode; i++) {}
+  lua_pushstring(L, i < sizeof(flash_mode_vals) ? flash_mode_names[i] : "unknown");
+  lua_setfield(L, -2, "mode");
+  add_int_field(L, flash_rom_get_speed(), "speed");
+  add_int_field(L, flash_rom_get_size_byte(), "size");
+  add_int_field(L, system_get_cpu_freq(), "cpu_mhz");
+  add_int_field(L, rate, "read_rate");
+  add_int_field(L, miss, "miss_ns");
+  return 1;
+}
+
+// Lua: setflashmode(mode, mhz)
+static int node_setflashmode( lua_State* L )
+{
+  uint8_t mode = flash_mode_vals[luaL_checkoption(L, 1, NULL, flash_mode_names)];
+  int mhz = luaL_checkinteger(L, 2);
+  uint8_t speed = mhz == 80 ? SPEED_80MHZ : mhz == 40 ? SPEED_40MHZ :
+                  mhz == 26 ? SPEED_26MHZ : SPEED_20MHZ;
+  luaL_argcheck(L, mhz == 80 || mhz == 40 || mhz == 26 || mhz == 20, 2,
+                "20, 26, 40 or 80");
+  if (!flash_rom_set_mode_speed(mode, speed))
+    return luaL_error(L, "flash header update failed");
+  return 0;
+}
+
 // Lua: heap()
 static int node_heap( lua_State* L )
 {
@@ -350,6 +478,92 @@ static int node_heap( lua_State* L )
   return 1;
 }
 
+// Lua: largest, histogram = node.heapinfo()
+// The SDK heap can't be walked, so its free blocks are found by repeatedly
+// claiming the largest block that malloc will return, and then releasing them
+// all.  Nothing may be allocated from the Lua heap until they are released.
+#define HEAPINFO_MINBLOCK  16
+#define HEAPINFO_MAXBLOCKS 64
+#define HEAPINFO_BINS      13   /* 16 bytes up to 64Kb */
+static int node_heapinfo( lua_State* L )
+{
+  uint32_t bins[HEAPINFO_BINS] = {0};
+  uint32_t largest = 0, avail = system_get_free_heap_size();
+  void *list = NULL;
+  int i, n;
+  for (n = 0; n < HEAPINFO_MAXBLOCKS; n++) {
+    uint32_t lo = HEAPINFO_MINBLOCK, hi = avail, sz = 0;
+    void *p;
+    while (lo <= hi) {  /* binary search for the largest allocatable size */
+      uint32_t mid = (lo + hi) / 2;
+      if ((p = malloc(mid)) != NULL) {
+        free(p);
+        sz = mid;
+        lo = mid + 1;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    if (sz == 0 || (p = malloc(sz)) == NULL)
+      break;
+    *(void **)p = list;
+    list = p;
+    if (sz > largest)
+      largest = sz;
+    for (i = 0; i < HEAPINFO_BINS - 1 && sz >= (HEAPINFO_MINBLOCK << (i + 1)); i++) {}
+    bins[i]++;
+    avail = sz;
+  }
+  while (list) {
+    void *next = *(void **)list;
+    free(list);
+    list = next;
+  }
+  lua_pushinteger(L, largest);
+  lua_createtable(L, 0, HEAPINFO_BINS);
+  for (i = 0; i < HEAPINFO_BINS; i++) {
+    if (bins[i]) {
+      lua_pushinteger(L, bins[i]);
+      lua_rawseti(L, -2, HEAPINFO_MINBLOCK << i);
+    }
+  }
+  return 2;
+}
+
+#ifdef DEVELOPMENT_HEAP_PROFILE
+// Lua: sites = node.heapsites()
+static int node_heapsites( lua_State* L )
+{
+#if LUA_VERSION_NUM > 501
+  return lua_pushheapsites(L);
+#else
+  return luaL_error(L, "not supported on Lua 5.1");
+#endif
+}
+
+// Lua: node.heapdump()
+// Lists every block in the SDK heap with the C source file and line that
+// allocated it.  The SDK only records these with MEMLEAK_DEBUG defined.
+static int node_heapdump( lua_State* L )
+{
+  UNUSED(L);
+  system_show_malloc();
+  return 0;
+}
+#endif
+
+#ifdef DEVELOPMENT_FLOAT_PROFILE
+// Lua: sites = node.floatsites([warn])
+static int node_floatsites( lua_State* L )
+{
+#if LUA_VERSION_NUM > 501
+  return lua_pushfloatsites(L, lua_toboolean(L, 1));
+#else
+  return luaL_error(L, "not supported on Lua 5.1");
+#endif
+}
+#endif
+
 // Lua: input("string")
 static int node_input( lua_State* L ) {
   luaL_checkstring(L, 1);
@@ -363,6 +577,153 @@ static int node_input( lua_State* L ) {
 
 static int serial_debug = 1;
 
+/*
+** Socket console. node.output(socket) copies the output into a ring buffer
+** that is sent in full segments as soon as there are enough, and otherwise once
+** the output has paused for NODE_CONSOLE_DELAY ms or the peer has acknowledged
+** the previous segment, much as Nagle's algorithm would. So printing in a loop
+** costs neither a Lua callback nor a TCP segment per print. Print cannot wait
+** for the peer, so once the buffer and the send window are both full the output
+** is dropped, and a note of how much was lost is sent when there is room.
+*/
+#ifndef NODE_CONSOLE_SIZE
+#define NODE_CONSOLE_SIZE    4096
+#endif
+#ifndef NODE_CONSOLE_DELAY
+#define NODE_CONSOLE_DELAY   20
+#endif
+#define NODE_CONSOLE_SEGMENT 1460
+
+extern int net_send(lua_State *L);
+extern int net_sendroom(lua_State *L, int ndx);
+
+static struct {
+  int sock_ref;                    /* LUA_NOREF unless output goes to a socket */
+  int sent_ref;
+  char *buf;
+  size_t head, fill;
+  uint32_t dropped;
+  int timer_armed;
+  os_timer_t timer;
+} console = { LUA_NOREF, LUA_NOREF };
+
+static void console_close(lua_State *L) {
+  os_timer_disarm(&console.timer);
+  console.timer_armed = 0;
+  luaL_unref(L, LUA_REGISTRYINDEX, console.sock_ref);
+  console.sock_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, console.sent_ref);
+  console.sent_ref = LUA_NOREF;
+  free(console.buf);
+  console.buf = NULL;
+}
+
+static size_t console_put(const char *str, size_t l) {
+  size_t room = NODE_CONSOLE_SIZE - console.fill;
+  if (l > room)
+    l = room;
+  size_t tail = (console.head + console.fill) % NODE_CONSOLE_SIZE;
+  size_t first = NODE_CONSOLE_SIZE - tail;
+  if (first > l)
+    first = l;
+  memcpy(console.buf + tail, str, first);
+  memcpy(console.buf, str + first, l - first);
+  console.fill += l;
+  return l;
+}
+
+/* Sends what the window takes, only full segments unless all is set */
+static void console_flush(lua_State *L, int all) {
+  int top = lua_gettop(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, console.sock_ref);
+  int room = net_sendroom(L, -1);
+  if (room < 0) {                   /* the socket has gone, back to the UART */
+    lua_settop(L, top);
+    console_close(L);
+    serial_debug = 1;
+    return;
+  }
+  while (console.fill && room > 0) {
+    size_t n = console.fill < NODE_CONSOLE_SEGMENT ? console.fill : NODE_CONSOLE_SEGMENT;
+    if (n > (size_t)room)
+      n = room;
+    if (n < NODE_CONSOLE_SEGMENT && !all)
+      break;
+    size_t first = NODE_CONSOLE_SIZE - console.head;
+    if (first > n)
+      first = n;
+    lua_pushcfunction(L, net_send);
+    lua_pushvalue(L, top + 1);
+    lua_pushlstring(L, console.buf + console.head, first);
+    if (first < n)                                /* the ring wrapped */
+      lua_pushlstring(L, console.buf, n - first);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, console.sent_ref);
+    if (lua_pcall(L, lua_gettop(L) - top - 2, 0, 0) != LUA_OK)
+      break;                         /* left for the next ack or timeout */
+    console.head = (console.head + n) % NODE_CONSOLE_SIZE;
+    console.fill -= n;
+    room -= n;
+  }
+  if (console.dropped) {
+    char note[32];
+    size_t l = sprintf(note, "\r\n[%u bytes lost]\r\n", (unsigned)console.dropped);
+    if (l <= NODE_CONSOLE_SIZE - console.fill) {
+      console_put(note, l);
+      console.dropped = 0;
+    }
+  }
+  lua_settop(L, top);
+}
+
+static void console_timeout(void *arg) {
+  UNUSED(arg);
+  lua_State *L = lua_getstate();
+  console.timer_armed = 0;
+  if (console.sock_ref == LUA_NOREF)
+    return;
+  console_flush(L, 1);
+  if (console.fill && console.sock_ref != LUA_NOREF) {
+    os_timer_arm(&console.timer, NODE_CONSOLE_DELAY, 0);
+    console.timer_armed = 1;
+  }
+}
+
+static void console_write(lua_State *L, const char *str, size_t l) {
+  if (l > NODE_CONSOLE_SIZE - console.fill)
+    console_flush(L, 1);                             /* make what room we can */
+  if (console.sock_ref == LUA_NOREF)
+    return;
+  console.dropped += l - console_put(str, l);
+  if (console.fill >= NODE_CONSOLE_SEGMENT)
+    console_flush(L, 0);
+  if (console.fill && !console.timer_armed && console.sock_ref != LUA_NOREF) {
+    os_timer_arm(&console.timer, NODE_CONSOLE_DELAY, 0);
+    console.timer_armed = 1;
+  }
+}
+
+/* The socket's sent callback: the peer has caught up, so send the rest */
+static int console_sent(lua_State *L) {
+  if (console.sock_ref != LUA_NOREF && console.fill)
+    console_flush(L, 1);
+  return 0;
+}
+
+static void console_open(lua_State *L, int ndx) {
+  if (net_sendroom(L, ndx) < 0)
+    luaL_argerror(L, ndx, "connected net.socket expected");
+  if (!(console.buf = malloc(NODE_CONSOLE_SIZE)))
+    luaL_error(L, "out of memory");
+  console.head = console.fill = 0;
+  console.dropped = 0;
+  lua_pushvalue(L, ndx);
+  console.sock_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushcfunction(L, console_sent);
+  console.sent_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  os_timer_disarm(&console.timer);
+  os_timer_setfn(&console.timer, console_timeout, NULL);
+}
+
 /*
 ** Output redirector. Note that panics in the output callback cannot be processed
 ** using luaL_pcallx() as this would create an infinite error loop, so they are
@@ -370,6 +731,13 @@ static int serial_debug = 1;
 */
 void output_redirect(const char *str, size_t l) {
   lua_State *L = lua_getstate();
+  if (console.sock_ref != LUA_NOREF) {
+    if (serial_debug) {
+      uart0_sendStrn(str, l);
+    }
+    console_write(L, str, l);
+    return;
+  }
   int n = lua_gettop(L);
   lua_pushliteral(L, "stdout");
   lua_rawget(L, LUA_REGISTRYINDEX);                       /* fetch reg.stdout */
@@ -392,20 +760,27 @@ void output_redirect(const char *str, size_t l) {
 
 extern int pipe_create(lua_State *L);
 
-// Lua: output(function(c), debug)
+// Lua: output(function(c) or socket, debug)
 static int node_output( lua_State* L )
 {
   serial_debug = (lua_isnumber(L, 2) && lua_tointeger(L, 2) == 0) ? 0 : 1;
   lua_settop(L, 1);
+  if (console.sock_ref != LUA_NOREF) {
+    console_flush(L, 1);                 /* send what is left before switching */
+    console_close(L);
+  }
   if (lua_isfunction(L, 1)) {
     lua_pushcfunction(L, pipe_create);
     lua_insert(L, 1);
     lua_pushinteger(L, LUA_TASK_MEDIUM);
     lua_call(L, 2, 1);      /* Any pipe.create() errors thrown back to caller */
   } else {    // remove the stdout pipe
+    if (!lua_isnil(L, 1))
+      console_open(L, 1);          /* errors are thrown back to the caller */
+    else
+      serial_debug = 1;
     lua_pop(L,1);
     lua_pushnil(L);                                             /* T[1] = nil */
-    serial_debug = 1;
   }
   lua_pushliteral(L, "stdout");
   lua_insert(L, 1);
@@ -413,17 +788,44 @@ static int node_output( lua_State* L )
   return 0;
 }
 
+// lua_dump() emits the bytecode a few bytes at a time, so node.compile()
+// gathers it into whole blocks before writing them to the file
+#define COMPILE_WRITE_BLOCK 256
+
+typedef struct {
+  int fd;
+  size_t n;
+  char buf[COMPILE_WRITE_BLOCK];
+} compile_out_t;
+
+static int writer_flush(compile_out_t *out)
+{
+  NODE_DBG("write fd:%d,size:%d\n", out->fd, out->n);
+  if (out->n != 0 && out->n != vfs_write(out->fd, out->buf, out->n))
+    return 1;
+  out->n = 0;
+  return 0;
+}
+
 static int writer(lua_State* L, const void* p, size_t size, void* u)
 {
   UNUSED(L);
-  int file_fd = *( (int *)u );
-  if (!file_fd)
+  compile_out_t *out = (compile_out_t *) u;
+  const char *s = (const char *) p;
+  if (!out->fd)
     return 1;
-  NODE_DBG("get fd:%d,size:%d\n", file_fd, size);
 
-  if (size != 0 && (size != vfs_write(file_fd, (const char *)p, size)) )
-    return 1;
-  NODE_DBG("write fd:%d,size:%d\n", file_fd, size);
+  while (size) {
+    size_t n = COMPILE_WRITE_BLOCK - out->n;
+    if (n > size)
+      n = size;
+    memcpy(out->buf + out->n, s, n);
+    out->n += n;
+    s += n;
+    size -= n;
+    if (out->n == COMPILE_WRITE_BLOCK && writer_flush(out))
+      return 1;
+  }
   return 0;
 }
 
@@ -431,52 +833,73 @@ static int writer(lua_State* L, const void* p, size_t size, void* u)
 #define getproto(o)	(clvalue(o)->l.p)
 #endif
 
+static int node_compile_k( lua_State* L, int status, lua_KContext ctx );
+
 // Lua: compile(filename) -- compile lua file into lua bytecode, and save to .lc
 static int node_compile( lua_State* L )
 {
-  Proto* f;
-  int file_fd = 0;
   size_t len;
   const char *fname = luaL_checklstring( L, 1, &len );
   const char *basename = vfs_basename( fname );
   luaL_argcheck(L, strlen(basename) <= FS_OBJ_NAME_LEN && strlen(fname) == len, 1, "filename invalid");
 
-  char *output = luaM_malloc( L, len+1 );
-  strcpy(output, fname);
   // check here that filename end with ".lua".
-  if (len < 4 || (strcmp( output + len - 4, ".lua") != 0) ) {
-    luaM_free( L, output );
+  if (len < 4 || (strcmp( fname + len - 4, ".lua") != 0) )
     return luaL_error(L, "not a .lua file");
-  }
 
-  output[strlen(output) - 2] = 'c';
-  output[strlen(output) - 1] = '\0';
-  NODE_DBG(output);
-  NODE_DBG("\n");
-  if (luaL_loadfile(L, fname) != 0) {
-    luaM_free( L, output );
+  // The .lc file is stripped anyway, so have the parser drop the debug info
+  // of each function as it is closed to keep the peak heap use down
+  lua_settop(L, 1);
+  lua_pushnil(L);
+  int strip = lua_stripdebug(L, 3);
+  lua_pushnil(L);
+  lua_stripdebug(L, 2);
+  int status = luaL_loadfile(L, fname);
+  lua_pushnil(L);
+  lua_stripdebug(L, strip);
+  if (status != 0)
     return luaL_error(L, lua_tostring(L, -1));
-  }
 
+  // Parsing a big file can use up the task slice, so then dump in the next
+  if (luaL_sliceexpired(L))
+    return luaL_yieldslice(L, 0, node_compile_k);
+  return node_compile_k(L, LUA_OK, 0);
+}
+
+static int node_compile_k( lua_State* L, int status, lua_KContext ctx )
+{
+  UNUSED(status);
+  UNUSED(ctx);
+  size_t len;
+  const char *fname = lua_tolstring( L, 1, &len );
+  compile_out_t out;
+
+  lua_pushlstring(L, fname, len - 3);
+  lua_pushliteral(L, "lc");
+  lua_concat(L, 2);
+  const char *output = lua_tostring(L, -1);
+  NODE_DBG(output);
+  NODE_DBG("\n");
 
   int stripping = 1;      /* strip debug information? */
 
-  file_fd = vfs_open(output, "w+");
-  if (!file_fd)
+  out.fd = vfs_open(output, "w+");
+  out.n = 0;
+  if (!out.fd)
   {
-    luaM_free( L, output );
     return luaL_error(L, "cannot open/write to file");
   }
 
-  int result = lua_dump(L, writer, &file_fd, stripping);
+  lua_pushvalue(L, 2);    /* the compiled function goes on top to be dumped */
+  int result = lua_dump(L, writer, &out, stripping);
 
-  if (vfs_flush(file_fd) != VFS_RES_OK) {
+  if (result == 0 && writer_flush(&out))
+    result = 1;
+  if (vfs_flush(out.fd) != VFS_RES_OK) {
     // overwrite Lua error, like writer() does in case of a file io error
     result = 1;
   }
-  vfs_close(file_fd);
-  file_fd = 0;
-  luaM_free( L, output );
+  vfs_close(out.fd);
 
   if (result == LUA_ERR_CC_INTOVERFLOW) {
     return luaL_error(L, "value too big or small for target integer type");
@@ -491,14 +914,20 @@ static int node_compile( lua_State* L )
   return 0;
 }
 
+static unsigned node_task_checkpriority( lua_State* L, int n )
+{
+  unsigned priority = (unsigned) luaL_checkint(L, n);
+  luaL_argcheck(L, priority <= TASK_PRIORITY_HIGH, n, "invalid  priority");
+  return priority;
+}
+
 // Lua: node.task.post([priority],task_cb) -- schedule a task for execution next
 static int node_task_post( lua_State* L )
 {
   int n=1;
   unsigned priority = TASK_PRIORITY_MEDIUM;
   if (lua_type(L, 1) == LUA_TNUMBER) {
-    priority = (unsigned) luaL_checkint(L, 1);
-    luaL_argcheck(L, priority <= TASK_PRIORITY_HIGH, 1, "invalid  priority");
+    priority = node_task_checkpriority(L, 1);
     n++;
   }
   luaL_checktype(L, n, LUA_TFUNCTION);
@@ -507,24 +936,72 @@ static int node_task_post( lua_State* L )
   return 0;
 }
 
+// Lua: node.task.queuelen(priority[, len]) -- get and optionally set the queue depth
+static int node_task_queuelen( lua_State* L )
+{
+  unsigned priority = node_task_checkpriority(L, 1);
+  platform_task_stats_t stats;
+  if (!lua_isnoneornil(L, 2)) {
+    int len = luaL_checkint(L, 2);
+    luaL_argcheck(L, len > 0 && len <= 0xFFFF, 2, "invalid queue length");
+    if (platform_task_set_queue_len(priority, len) != PLATFORM_OK)
+      return luaL_error(L, "cannot resize task queue");
+  }
+  platform_task_get_stats(priority, &stats, false);
+  lua_pushinteger(L, stats.depth);
+  return 1;
+}
+
+// Lua: node.task.stats(priority[, reset]) -- return the queue instrumentation counters
+static int node_task_stats( lua_State* L )
+{
+  unsigned priority = node_task_checkpriority(L, 1);
+  platform_task_stats_t stats;
+  platform_task_get_stats(priority, &stats, lua_toboolean(L, 2));
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, stats.depth);
+  lua_setfield(L, -2, "depth");
+  lua_pushinteger(L, stats.queued);
+  lua_setfield(L, -2, "queued");
+  lua_pushinteger(L, stats.high_water);
+  lua_setfield(L, -2, "high_water");
+  lua_pushinteger(L, stats.posted);
+  lua_setfield(L, -2, "posted");
+  lua_pushinteger(L, stats.failed);
+  lua_setfield(L, -2, "failed");
+  lua_pushinteger(L, stats.dispatched);
+  lua_setfield(L, -2, "dispatched");
+  lua_pushinteger(L, stats.latency_max);
+  lua_setfield(L, -2, "latency_max");
+  lua_pushinteger(L, stats.dispatched ? stats.latency_total / stats.dispatched : 0);
+  lua_setfield(L, -2, "latency_avg");
+  return 1;
+}
+
 // Lua: setcpufreq(mhz)
 // mhz is either CPU80MHZ od CPU160MHZ
 static int node_setcpufreq(lua_State* L)
 {
-  // http://www.esp8266.com/viewtopic.php?f=21&t=1369
   uint32_t new_freq = luaL_checkinteger(L, 1);
-  if (new_freq == CPU160MHZ){
-    REG_SET_BIT(0x3ff00014, BIT(0));
-    ets_update_cpu_frequency(CPU160MHZ);
-  } else {
-    REG_CLR_BIT(0x3ff00014,  BIT(0));
-    ets_update_cpu_frequency(CPU80MHZ);
-  }
+  platform_cpufreq_set(new_freq);
   new_freq = ets_get_cpu_frequency();
   lua_pushinteger(L, new_freq);
   return 1;
 }
 
+// Lua: backlog = node.cpugovernor([backlog | enable])
+static int node_cpugovernor(lua_State* L)
+{
+  if (!lua_isnoneornil(L, 1)) {
+    int backlog = lua_isboolean(L, 1) ? (lua_toboolean(L, 1) ? 4 : 0) :
+                                        luaL_checkinteger(L, 1);
+    luaL_argcheck(L, backlog >= 0 && backlog <= 0xFFFF, 1, "invalid backlog");
+    platform_cpufreq_governor(backlog);
+  }
+  lua_pushinteger(L, platform_cpufreq_get_governor());
+  return 1;
+}
+
 // Lua: freq = node.getcpufreq()
 static int node_getcpufreq(lua_State* L)
 {
@@ -610,13 +1087,59 @@ static int node_egc_setmode(lua_State* L) {
   lua_setegcmode( L, mode, limit );
   return 0;
 }
-// totalallocated, estimatedused = node.egc.meminfo()
+// totalallocated, estimatedused, egcs, rate, level = node.egc.meminfo()
 static int node_egc_meminfo(lua_State *L) {
-  int totals[2];
+  int totals[2], stats[3];
   lua_getegcinfo(L, totals);
+  lua_getegcstats(L, stats);
   lua_pushinteger(L, totals[0]);
   lua_pushinteger(L, totals[1]);
-  return 2;
+  lua_pushinteger(L, stats[0]);
+  lua_pushinteger(L, stats[1]);
+  lua_pushinteger(L, stats[2]);
+  return 5;
+}
+
+static int egc_pressure_ref = LUA_NOREF;
+static platform_task_handle_t egc_pressure_task_id;
+static bool egc_pressure_posted;
+
+static void egc_pressure_task(platform_task_param_t param, uint8_t prio) {
+  (void)prio;
+  egc_pressure_posted = false;
+  if (egc_pressure_ref != LUA_NOREF) {
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, egc_pressure_ref);
+    lua_pushinteger(L, param >> 8);
+    lua_pushinteger(L, param & 0xFF);
+    luaL_pcallx(L, 2, 0);
+  }
+}
+
+// Runs inside the allocator, so only posts the callback
+static void egc_pressure_hook(lua_State *L, int count, int level) {
+  (void)L;
+  if (egc_pressure_ref != LUA_NOREF && !egc_pressure_posted)
+    egc_pressure_posted = platform_post_low(egc_pressure_task_id,
+                                            ((platform_task_param_t)count << 8) | level);
+}
+
+// Lua: node.egc.setpressure(rate[, function(count, level)])
+static int node_egc_setpressure(lua_State *L) {
+  int rate = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, rate >= 0 && rate <= 0xFFFF, 1, "invalid rate");
+
+  luaL_unref(L, LUA_REGISTRYINDEX, egc_pressure_ref);
+  egc_pressure_ref = LUA_NOREF;
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_pushvalue(L, 2);
+    egc_pressure_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (!egc_pressure_task_id)
+      egc_pressure_task_id = platform_task_get_id(egc_pressure_task);
+  }
+  lua_setegcpressure(L, rate, egc_pressure_hook);
+  return 0;
 }
 #endif
 //
@@ -789,6 +1312,20 @@ static int node_lfsreload (lua_State *L) {
   return 1;
 }
 
+#if LUA_VERSION_NUM > 501
+// Lua: err = node.LFS.load(lfsimage)
+static int node_lfsload (lua_State *L) {
+  lua_settop(L, 1);
+  return luaL_lfsload(L);
+}
+
+// Lua: ok = node.LFS.rollback()
+static int node_lfsrollback (lua_State *L) {
+  lua_pushboolean(L, luaL_lfsrollback(L));
+  return 1;
+}
+#endif
+
 // Lua: n = node.flashreload(lfsimage)
 static int lua_lfsreload_deprecated (lua_State *L) {
   platform_print_deprecation_note("node.flashreload", "soon. Use node.LFS interface instead");
@@ -843,6 +1380,10 @@ LROT_BEGIN(node_lfs, LROT_TABLEREF(node_lfs_meta), 0)
   LROT_FUNCENTRY( list, node_lfslist)
   LROT_FUNCENTRY( get, node_lfsindex)
   LROT_FUNCENTRY( reload, node_lfsreload )
+#if LUA_VERSION_NUM > 501
+  LROT_FUNCENTRY( load, node_lfsload )
+  LROT_FUNCENTRY( rollback, node_lfsrollback )
+#endif
 LROT_END(node_lfs, LROT_TABLEREF(node_lfs_meta), 0)
 
 
@@ -997,6 +1538,7 @@ static int node_setpartitiontable (lua_State *L) {
 LROT_BEGIN(node_egc, NULL, 0)
   LROT_FUNCENTRY( meminfo, node_egc_meminfo )
   LROT_FUNCENTRY( setmode, node_egc_setmode )
+  LROT_FUNCENTRY( setpressure, node_egc_setpressure )
   LROT_NUMENTRY( NOT_ACTIVE, EGC_NOT_ACTIVE )
   LROT_NUMENTRY( ON_ALLOC_FAILURE, EGC_ON_ALLOC_FAILURE )
   LROT_NUMENTRY( ON_MEM_LIMIT, EGC_ON_MEM_LIMIT )
@@ -1006,6 +1548,8 @@ LROT_END(node_egc, NULL, 0)
 
 LROT_BEGIN(node_task, NULL, 0)
   LROT_FUNCENTRY( post, node_task_post )
+  LROT_FUNCENTRY( queuelen, node_task_queuelen )
+  LROT_FUNCENTRY( stats, node_task_stats )
   LROT_NUMENTRY( LOW_PRIORITY, TASK_PRIORITY_LOW )
   LROT_NUMENTRY( MEDIUM_PRIORITY, TASK_PRIORITY_MEDIUM )
   LROT_NUMENTRY( HIGH_PRIORITY, TASK_PRIORITY_HIGH )
@@ -1013,6 +1557,14 @@ LROT_END(node_task, NULL, 0)
 
 LROT_BEGIN(node, NULL, 0)
   LROT_FUNCENTRY( heap, node_heap )
+  LROT_FUNCENTRY( heapinfo, node_heapinfo )
+#ifdef DEVELOPMENT_HEAP_PROFILE
+  LROT_FUNCENTRY( heapsites, node_heapsites )
+  LROT_FUNCENTRY( heapdump, node_heapdump )
+#endif
+#ifdef DEVELOPMENT_FLOAT_PROFILE
+  LROT_FUNCENTRY( floatsites, node_floatsites )
+#endif
   LROT_FUNCENTRY( info, node_info )
   LROT_TABENTRY( task, node_task )
   LROT_FUNCENTRY( flashreload, lua_lfsreload_deprecated )
@@ -1024,7 +1576,9 @@ LROT_BEGIN(node, NULL, 0)
   LROT_FUNCENTRY( restart, node_restart )
   LROT_FUNCENTRY( dsleep, node_deepsleep )
   LROT_FUNCENTRY( dsleepMax, dsleepMax )
+  LROT_FUNCENTRY( fastwake, node_fastwake )
   LROT_FUNCENTRY( sleep, node_sleep )
+  LROT_FUNCENTRY( autosleep, node_autosleep )
 #ifdef PMSLEEP_ENABLE
   PMSLEEP_INT_MAP
 #endif
@@ -1038,6 +1592,8 @@ LROT_BEGIN(node, NULL, 0)
   LROT_FUNCENTRY( chipid, node_chipid )
   LROT_FUNCENTRY( flashid, node_flashid )
   LROT_FUNCENTRY( flashsize, node_flashsize )
+  LROT_FUNCENTRY( flashinfo, node_flashinfo )
+  LROT_FUNCENTRY( setflashmode, node_setflashmode )
   LROT_FUNCENTRY( input, node_input )
   LROT_FUNCENTRY( output, node_output )
 // Moved to adc module, use adc.readvdd33()
@@ -1047,6 +1603,7 @@ LROT_BEGIN(node, NULL, 0)
   LROT_NUMENTRY( CPU160MHZ, CPU160MHZ )
   LROT_FUNCENTRY( setcpufreq, node_setcpufreq )
   LROT_FUNCENTRY( getcpufreq, node_getcpufreq )
+  LROT_FUNCENTRY( cpugovernor, node_cpugovernor )
   LROT_FUNCENTRY( bootreason, node_bootreason )
   LROT_FUNCENTRY( restore, node_restore )
   LROT_FUNCENTRY( random, node_random )
@@ -0,0 +1,327 @@
+// Module for compact typed sample buffers
+
+#include "module.h"
+#include "lauxlib.h"
+
+#include <string.h>
+
+#include "numbuf.h"
+#define NUMBUF_METATABLE "numbuf.buf"
+
+static const uint8_t numbuf_width[] = { 1, 2, 4, 4 };
+static const int32_t numbuf_min[] = { INT8_MIN, INT16_MIN, INT32_MIN };
+static const int32_t numbuf_max[] = { INT8_MAX, INT16_MAX, INT32_MAX };
+
+numbuf *numbuf_from_lua_arg(lua_State *L, int arg) {
+  return luaL_checkudata(L, arg, NUMBUF_METATABLE);
+}
+
+numbuf *numbuf_opt_from_lua_arg(lua_State *L, int arg) {
+  return luaL_testudata(L, arg, NUMBUF_METATABLE);
+}
+
+/* Slot of the i'th oldest sample, counting from 0 */
+static unsigned slot(numbuf *b, unsigned i) {
+  i += b->head;
+  return i < b->size ? i : i - b->size;
+}
+
+static lua_Number getslot(numbuf *b, unsigned s) {
+  switch (b->type) {
+    case NUMBUF_INT8:  return ((int8_t *)b->values)[s];
+    case NUMBUF_INT16: return ((int16_t *)b->values)[s];
+    case NUMBUF_INT32: return ((int32_t *)b->values)[s];
+    default:           return ((float *)b->values)[s];
+  }
+}
+
+static void setslot(numbuf *b, unsigned s, lua_Number v) {
+  if (b->type != NUMBUF_FLOAT) {
+    /* saturate rather than wrap out of range values */
+    if (v < numbuf_min[b->type])
+      v = numbuf_min[b->type];
+    else if (v > numbuf_max[b->type])
+      v = numbuf_max[b->type];
+  }
+  switch (b->type) {
+    case NUMBUF_INT8:  ((int8_t *)b->values)[s] = (int8_t)v; break;
+    case NUMBUF_INT16: ((int16_t *)b->values)[s] = (int16_t)v; break;
+    case NUMBUF_INT32: ((int32_t *)b->values)[s] = (int32_t)v; break;
+    default:           ((float *)b->values)[s] = (float)v; break;
+  }
+}
+
+static void push(numbuf *b, lua_Number v) {
+  if (b->count < b->size) {
+    setslot(b, slot(b, b->count++), v);
+  } else {
+    setslot(b, b->head, v);
+    b->head = slot(b, 1);
+  }
+}
+
+void numbuf_push(numbuf *b, int32_t v) {
+  push(b, v);
+}
+
+lua_Number numbuf_get(numbuf *b, unsigned i) {
+  return getslot(b, slot(b, i));
+}
+
+/*
+ * Construct a numbuf newuserdata using C arguments.
+ *
+ * Allocates, so may throw!  Leaves new buffer at the top of the Lua stack
+ * and returns a C pointer.
+ */
+static numbuf *numbuf_new(lua_State *L, size_t size, unsigned type) {
+  if (size > UINT16_MAX) {
+    luaL_error(L, "numbuf size limits exceeded");
+    return NULL; // UNREACHED
+  }
+
+  numbuf *b = (numbuf *)lua_newuserdata(L, sizeof(numbuf) + size * numbuf_width[type]);
+  luaL_getmetatable(L, NUMBUF_METATABLE);
+  lua_setmetatable(L, -2);
+
+  b->size = size;
+  b->count = 0;
+  b->head = 0;
+  b->type = type;
+  b->width = numbuf_width[type];
+  return b;
+}
+
+/* Sum of n samples from the i'th oldest, exact for the integer types */
+static lua_Number sumrange(numbuf *b, unsigned i, unsigned n) {
+  if (b->type == NUMBUF_FLOAT) {
+    lua_Number sum = 0;
+    while (n--)
+      sum += getslot(b, slot(b, i++));
+    return sum;
+  }
+  int64_t sum = 0;
+  while (n--) {
+    unsigned s = slot(b, i++);
+    switch (b->type) {
+      case NUMBUF_INT8:  sum += ((int8_t *)b->values)[s]; break;
+      case NUMBUF_INT16: sum += ((int16_t *)b->values)[s]; break;
+      default:           sum += ((int32_t *)b->values)[s]; break;
+    }
+  }
+  return (lua_Number)sum;
+}
+
+/* Push a sample value, as an integer for the integer types */
+static void pushvalue(lua_State *L, numbuf *b, lua_Number v) {
+  if (b->type == NUMBUF_FLOAT)
+    lua_pushnumber(L, v);
+  else
+    lua_pushinteger(L, (lua_Integer)v);
+}
+
+/* Check the sample index at arg, negative counting back from the newest */
+static unsigned checkindex(lua_State *L, numbuf *b, int arg) {
+  int i = luaL_checkinteger(L, arg);
+  if (i < 0)
+    i += b->count + 1;
+  luaL_argcheck(L, i >= 1 && i <= b->count, arg, "index out of range");
+  return i - 1;
+}
+
+// Lua: buf = numbuf.new(type, size)
+static int numbuf_new_lua(lua_State *L) {
+  const int type = luaL_checkinteger(L, 1);
+  const int size = luaL_checkinteger(L, 2);
+
+  luaL_argcheck(L, type >= NUMBUF_INT8 && type <= NUMBUF_FLOAT, 1, "invalid type");
+  luaL_argcheck(L, size > 0, 2, "should be a positive integer");
+
+  numbuf_new(L, size, type);
+  return 1;
+}
+
+// Lua: buf:push(v [, v ...])
+static int numbuf_push_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  int i, n = lua_gettop(L);
+  for (i = 2; i <= n; i++)
+    push(b, luaL_checknumber(L, i));
+  return 0;
+}
+
+// Lua: v = buf:get(i)
+static int numbuf_get_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  unsigned i = checkindex(L, b, 2);
+  pushvalue(L, b, getslot(b, slot(b, i)));
+  return 1;
+}
+
+// Lua: buf:set(i, v)
+static int numbuf_set_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  unsigned i = checkindex(L, b, 2);
+  setslot(b, slot(b, i), luaL_checknumber(L, 3));
+  return 0;
+}
+
+// Lua: n = #buf
+static int numbuf_len_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  lua_pushinteger(L, b->count);
+  return 1;
+}
+
+// Lua: n = buf:size()
+static int numbuf_size_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  lua_pushinteger(L, b->size);
+  return 1;
+}
+
+// Lua: t = buf:type()
+static int numbuf_type_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  lua_pushinteger(L, b->type);
+  return 1;
+}
+
+// Lua: buf:clear()
+static int numbuf_clear_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  b->count = 0;
+  b->head = 0;
+  return 0;
+}
+
+// Lua: s = buf:sum()
+static int numbuf_sum_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  lua_pushnumber(L, sumrange(b, 0, b->count));
+  return 1;
+}
+
+// Lua: m = buf:mean()
+static int numbuf_mean_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  if (b->count == 0)
+    return 0;
+  lua_pushnumber(L, sumrange(b, 0, b->count) / b->count);
+  return 1;
+}
+
+static int minmax(lua_State *L, int sign) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  unsigned i, at = 0;
+  lua_Number best;
+  if (b->count == 0)
+    return 0;
+  best = getslot(b, b->head);
+  for (i = 1; i < b->count; i++) {
+    lua_Number v = getslot(b, slot(b, i));
+    if (sign > 0 ? v > best : v < best) {
+      best = v;
+      at = i;
+    }
+  }
+  pushvalue(L, b, best);
+  lua_pushinteger(L, at + 1);
+  return 2;
+}
+
+// Lua: v, i = buf:min()
+static int numbuf_min_lua(lua_State *L) {
+  return minmax(L, -1);
+}
+
+// Lua: v, i = buf:max()
+static int numbuf_max_lua(lua_State *L) {
+  return minmax(L, 1);
+}
+
+// Lua: avg = buf:movavg(window)
+static int numbuf_movavg_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  const int w = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, w > 0 && w <= b->count, 2, "window out of range");
+
+  unsigned i, n = b->count - w + 1;
+  numbuf *out = numbuf_new(L, n, NUMBUF_FLOAT);
+  lua_Number sum = sumrange(b, 0, w);
+  push(out, sum / w);
+  for (i = 1; i < n; i++) {
+    /* slide the window one sample at a time */
+    sum += getslot(b, slot(b, i + w - 1)) - getslot(b, slot(b, i - 1));
+    push(out, sum / w);
+  }
+  return 1;
+}
+
+// Lua: dec = buf:decimate(factor)
+static int numbuf_decimate_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  const int k = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, k > 0, 2, "should be a positive integer");
+
+  unsigned i, n = b->count / k;
+  numbuf *out = numbuf_new(L, n ? n : 1, b->type);
+  for (i = 0; i < n; i++)
+    push(out, sumrange(b, i * k, k) / k);
+  return 1;
+}
+
+// Lua: t = buf:totable()
+static int numbuf_totable_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  unsigned i;
+  lua_createtable(L, b->count, 0);
+  for (i = 0; i < b->count; i++) {
+    pushvalue(L, b, getslot(b, slot(b, i)));
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+static int numbuf_tostring_lua(lua_State *L) {
+  numbuf *b = numbuf_from_lua_arg(L, 1);
+  lua_pushfstring(L, "numbuf: %d/%d", b->count, b->size);
+  return 1;
+}
+
+LROT_BEGIN(numbuf_map, NULL, LROT_MASK_INDEX | LROT_MASK_LEN)
+  LROT_TABENTRY ( __index, numbuf_map )
+  LROT_FUNCENTRY( __len, numbuf_len_lua )
+  LROT_FUNCENTRY( __tostring, numbuf_tostring_lua )
+
+  LROT_FUNCENTRY( clear, numbuf_clear_lua )
+  LROT_FUNCENTRY( decimate, numbuf_decimate_lua )
+  LROT_FUNCENTRY( get, numbuf_get_lua )
+  LROT_FUNCENTRY( max, numbuf_max_lua )
+  LROT_FUNCENTRY( mean, numbuf_mean_lua )
+  LROT_FUNCENTRY( min, numbuf_min_lua )
+  LROT_FUNCENTRY( movavg, numbuf_movavg_lua )
+  LROT_FUNCENTRY( push, numbuf_push_lua )
+  LROT_FUNCENTRY( set, numbuf_set_lua )
+  LROT_FUNCENTRY( size, numbuf_size_lua )
+  LROT_FUNCENTRY( sum, numbuf_sum_lua )
+  LROT_FUNCENTRY( totable, numbuf_totable_lua )
+  LROT_FUNCENTRY( type, numbuf_type_lua )
+LROT_END(numbuf_map, NULL, LROT_MASK_INDEX | LROT_MASK_LEN)
+
+LROT_BEGIN(numbuf, NULL, 0)
+  LROT_NUMENTRY( INT8, NUMBUF_INT8 )
+  LROT_NUMENTRY( INT16, NUMBUF_INT16 )
+  LROT_NUMENTRY( INT32, NUMBUF_INT32 )
+  LROT_NUMENTRY( FLOAT, NUMBUF_FLOAT )
+
+  LROT_FUNCENTRY( new, numbuf_new_lua )
+LROT_END(numbuf, NULL, 0)
+
+int luaopen_numbuf(lua_State *L) {
+  luaL_rometatable(L, NUMBUF_METATABLE, LROT_TABLEREF(numbuf_map));
+  lua_pushrotable(L, LROT_TABLEREF(numbuf));
+  return 1;
+}
+
+NODEMCU_MODULE(NUMBUF, "numbuf", numbuf, luaopen_numbuf);
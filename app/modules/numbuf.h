@@ -0,0 +1,38 @@
+#ifndef APP_MODULES_NUMBUF_H_
+#define APP_MODULES_NUMBUF_H_
+
+#include <stdint.h>
+
+enum numbuf_type {
+  NUMBUF_INT8,
+  NUMBUF_INT16,
+  NUMBUF_INT32,
+  NUMBUF_FLOAT
+};
+
+/*
+ * A fixed size ring of samples of one numeric type.  Once full, each push
+ * overwrites the oldest sample, so a buffer always holds the most recent
+ * samples in arrival order.
+ */
+typedef struct numbuf {
+  uint16_t size;        // capacity in samples
+  uint16_t count;       // samples held
+  uint16_t head;        // slot of the oldest sample
+  uint8_t  type;        // enum numbuf_type
+  uint8_t  width;       // bytes per sample
+
+  /* Flexible Array Member; true size is size * width bytes */
+  uint32_t values[];
+} numbuf;
+
+numbuf *numbuf_from_lua_arg(lua_State *, int);
+numbuf *numbuf_opt_from_lua_arg(lua_State *, int);
+
+/* Append a sample, saturating it to the range of the buffer type */
+void numbuf_push(numbuf *, int32_t);
+
+/* The i'th oldest sample, counting from 0; i must be less than count */
+lua_Number numbuf_get(numbuf *, unsigned);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * Module for updating the firmware over the air.
+ *
+ * The image, as bin/nodemcu.bin (0x00000.bin and 0x10000.bin in one file),
+ * is streamed into flash that no partition uses, sector by sector.  Each
+ * sector is read back after it is written and hashed into a SHA-256 that is
+ * checked against the one given at the start.  The first sector of the
+ * staging area holds a header with the size, the hash and a bitmap of the
+ * sectors done, whose bits are cleared as they complete, so a transfer that
+ * was cut off resumes from the last whole sector after a reboot.
+ *
+ * The ESP8266 boots only from offset 0, so ota.apply() copies the verified
+ * image over the running firmware from IRAM with the cache off and resets.
+ * The RCR page at 0x10000 is kept, and with it the partition table.  After
+ * a reboot, ota.start() with the same size and hash finds the staged image
+ * again, and ota.finish() checks it before it can be applied.
+ */
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "user_interface.h"
+#include "flash_api.h"
+#include "rom.h"
+#include "../crypto/sha2.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define SECTOR          INTERNAL_FLASH_SECTOR_SIZE
+#define OTA_MAGIC       0x3141544f        /* "OTA1" */
+#define OTA_MAX_SECTORS 512               /* a 2MB image */
+#define OTA_VERIFIED    0x0000ffff        /* state once the hash matched */
+#define RCR_PAGE        0x10000
+
+typedef struct {
+  uint32_t magic;
+  uint32_t size;
+  uint8_t  sha[SHA256_DIGEST_LENGTH];
+  uint32_t state;
+  uint32_t done[OTA_MAX_SECTORS / 32];    /* bit clear once a sector is in */
+} ota_header_t;
+
+static struct {
+  uint32_t base;                          /* staging header sector address */
+  uint32_t size, offset;                  /* image size and bytes written */
+  uint32_t fill;                          /* bytes waiting in buf */
+  uint8_t  sha[SHA256_DIGEST_LENGTH];
+  SHA256_CTX ctx;
+  uint32_t *buf;                          /* one sector */
+} ota;
+
+/* Flash offset just past the partition holding the firmware */
+static uint32_t firmware_end (void) {
+  uint32_t addr, size = platform_flash_get_partition(NODEMCU_IROM0TEXT_PARTITION, &addr);
+  return addr + size;
+}
+
+/*
+ * Find room for the header and the image at the lowest address that no
+ * partition uses and that the image is not copied over.
+ */
+static uint32_t find_staging (uint32_t need) {
+  partition_item_t *pt = NULL;
+  uint32_t n = platform_rcr_read(PLATFORM_RCR_PT, (void **) &pt) / sizeof(*pt);
+  uint32_t flash = flash_rom_get_size_byte();
+  uint32_t addr = firmware_end(), i;
+  int moved;
+
+  do {
+    for (moved = 0, i = 0; i < n; i++) {
+      if (pt[i].size && addr < pt[i].addr + pt[i].size && pt[i].addr < addr + need) {
+        addr = (pt[i].addr + pt[i].size + SECTOR - 1) & ~(SECTOR - 1);
+        moved = 1;
+      }
+    }
+  } while (moved && addr + need <= flash);
+  return addr + need <= flash ? addr : 0;
+}
+
+static int write_word (uint32_t addr, uint32_t w) {
+  return platform_s_flash_write(&w, addr, sizeof(w)) == sizeof(w) ? 0 : 1;
+}
+
+/* Erase, write, read back and hash the sector buffered at offset */
+static int flush_sector (void) {
+  uint32_t sector = ota.offset / SECTOR;
+  uint32_t addr = ota.base + SECTOR + sector * SECTOR;
+  uint32_t len = (ota.fill + 3) & ~3;
+  if (ota.fill == 0)
+    return 0;
+  memset((uint8_t *) ota.buf + ota.fill, 0xff, len - ota.fill);
+  if (platform_flash_erase_sector(addr / SECTOR) != PLATFORM_OK ||
+      platform_s_flash_write(ota.buf, addr, len) != len ||
+      platform_s_flash_read(ota.buf, addr, len) != len)
+    return 1;
+  SHA256_Update(&ota.ctx, (const uint8_t *) ota.buf, ota.fill);
+  if (write_word(ota.base + offsetof(ota_header_t, done) + sector / 32 * 4,
+                 ~(1u << (sector % 32))))
+    return 1;
+  ota.offset += ota.fill;
+  ota.fill = 0;
+  return 0;
+}
+
+static int ota_append (void *arg, const char *s, size_t l) {
+  (void) arg;
+  if (ota.offset + ota.fill + l > ota.size)
+    return 1;
+  while (l) {
+    size_t n = SECTOR - ota.fill < l ? SECTOR - ota.fill : l;
+    if (ota.offset == 0 && ota.fill == 0 && (uint8_t) s[0] != 0xe9)
+      return 1;                           /* not a firmware image */
+    memcpy((uint8_t *) ota.buf + ota.fill, s, n);
+    ota.fill += n;
+    s += n;
+    l -= n;
+    if (ota.fill == SECTOR && flush_sector())
+      return 1;
+  }
+  return 0;
+}
+
+static void ota_release (void) {
+  free(ota.buf);
+  ota.buf = NULL;
+  ota.base = 0;
+}
+
+static ota_header_t *read_header (uint32_t base, ota_header_t *h) {
+  if (!base || platform_s_flash_read(h, base, sizeof(*h)) != sizeof(*h) ||
+      h->magic != OTA_MAGIC)
+    return NULL;
+  return h;
+}
+
+static void get_sha (lua_State *L, int ndx, uint8_t *sha) {
+  size_t l, i;
+  const char *s = luaL_checklstring(L, ndx, &l);
+  if (l == SHA256_DIGEST_LENGTH) {
+    memcpy(sha, s, l);
+    return;
+  }
+  luaL_argcheck(L, l == 2 * SHA256_DIGEST_LENGTH, ndx, "SHA-256 expected");
+  for (i = 0; i < l; i++) {
+    int c = s[i], v = c >= '0' && c <= '9' ? c - '0' :
+                       (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+    luaL_argcheck(L, v >= 0, ndx, "SHA-256 expected");
+    sha[i / 2] = (i & 1) ? sha[i / 2] | v : v << 4;
+  }
+}
+
+// Lua: offset = ota.start(size, sha256[, addr])
+static int ota_start (lua_State *L) {
+  uint32_t size = luaL_checkinteger(L, 1);
+  uint8_t sha[SHA256_DIGEST_LENGTH];
+  ota_header_t h;
+  get_sha(L, 2, sha);
+  luaL_argcheck(L, size > RCR_PAGE && size <= firmware_end() &&
+                   size <= OTA_MAX_SECTORS * SECTOR, 1, "image does not fit");
+
+  uint32_t need = SECTOR + ((size + SECTOR - 1) & ~(SECTOR - 1));
+  uint32_t base = luaL_optinteger(L, 3, 0);
+  if (base) {
+    luaL_argcheck(L, (base & (SECTOR - 1)) == 0 && base >= firmware_end() &&
+                     base + need <= flash_rom_get_size_byte(), 3, "invalid address");
+  } else if (!(base = find_staging(need))) {
+    return luaL_error(L, "no free flash for the image");
+  }
+
+  ota_release();
+  if (!(ota.buf = (uint32_t *) malloc(SECTOR)))
+    return luaL_error(L, "out of memory");
+  ota.base = base;
+  ota.size = size;
+  ota.offset = ota.fill = 0;
+  memcpy(ota.sha, sha, sizeof(sha));
+  SHA256_Init(&ota.ctx);
+
+  if (read_header(base, &h) && h.size == size && !memcmp(h.sha, sha, sizeof(sha))) {
+    /* resume after the sectors already done, hashing them again from flash */
+    uint32_t s, sectors = (size + SECTOR - 1) / SECTOR;
+    for (s = 0; s < sectors && !(h.done[s / 32] & (1u << (s % 32))); s++) {
+      uint32_t len = size - s * SECTOR < SECTOR ? size - s * SECTOR : SECTOR;
+      platform_s_flash_read(ota.buf, base + SECTOR + s * SECTOR, SECTOR);
+      SHA256_Update(&ota.ctx, (const uint8_t *) ota.buf, len);
+      ota.offset += len;
+    }
+  } else {
+    memset(&h, 0xff, sizeof(h));
+    h.magic = OTA_MAGIC;
+    h.size = size;
+    memcpy(h.sha, sha, sizeof(sha));
+    if (platform_flash_erase_sector(base / SECTOR) != PLATFORM_OK ||
+        platform_s_flash_write(&h, base, sizeof(h)) != sizeof(h)) {
+      ota_release();
+      return luaL_error(L, "flash write failed");
+    }
+  }
+  lua_pushinteger(L, ota.offset);
+  return 1;
+}
+
+extern int pipe_drain(lua_State *L, int ndx,
+                      int (*fn)(void *, const char *, size_t), void *arg);
+
+// Lua: offset = ota.write(data)
+static int ota_write (lua_State *L) {
+  int r;
+  if (!ota.buf)
+    return luaL_error(L, "no update started");
+  if ((r = pipe_drain(L, 1, NULL, NULL)) >= 0) {
+    r = pipe_drain(L, 1, ota_append, NULL) != r;
+  } else {
+    size_t l;
+    const char *s = luaL_checklstring(L, 1, &l);
+    r = l ? ota_append(NULL, s, l) : 0;
+  }
+  if (r) {
+    ota_release();
+    return luaL_error(L, "image write failed");
+  }
+  lua_pushinteger(L, ota.offset + ota.fill);
+  return 1;
+}
+
+// Lua: ota.finish()
+static int ota_finish (lua_State *L) {
+  uint8_t sha[SHA256_DIGEST_LENGTH];
+  if (!ota.buf)
+    return luaL_error(L, "no update started");
+  if (flush_sector())
+    goto fail;
+  if (ota.offset != ota.size) {
+    ota_release();
+    return luaL_error(L, "image incomplete");
+  }
+  SHA256_Final(sha, &ota.ctx);
+  if (memcmp(sha, ota.sha, sizeof(sha))) {
+    /* start again from scratch next time */
+    write_word(ota.base, 0);
+    ota_release();
+    return luaL_error(L, "SHA-256 mismatch");
+  }
+  if (write_word(ota.base + offsetof(ota_header_t, state), OTA_VERIFIED))
+    goto fail;
+  free(ota.buf);
+  ota.buf = NULL;                         /* base is kept for ota.apply() */
+  return 0;
+fail:
+  ota_release();
+  return luaL_error(L, "flash write failed");
+}
+
+/*
+ * Copy the image to offset 0, leaving the RCR page, and reset.  This runs
+ * from IRAM with interrupts and the flash cache off, so it can only call the
+ * ROM, and it feeds the hardware watchdog itself.
+ */
+static void NO_INTR_CODE __attribute__((noreturn))
+copy_image (uint32_t from, uint32_t size, uint32_t *buf) {
+  extern void _ResetHandler(void);
+  uint32_t off;
+  ets_intr_lock();
+  Cache_Read_Disable();
+  for (off = 0; off < size; off += SECTOR) {
+    WRITE_PERI_REG(0x60000914, 0x73);     /* feed the hardware watchdog */
+    if (off == RCR_PAGE)
+      continue;
+    SPIRead(from + off, buf, SECTOR);
+    SPIEraseSector(off / SECTOR);
+    SPIWrite(off, buf, SECTOR);
+  }
+  _ResetHandler();
+  while (1) {}
+}
+
+// Lua: ota.apply()
+static int ota_apply (lua_State *L) {
+  ota_header_t h;
+  if (ota.buf || !read_header(ota.base, &h) || h.state != OTA_VERIFIED)
+    return luaL_error(L, "no verified image");
+  uint32_t *buf = (uint32_t *) malloc(SECTOR);
+  if (!buf)
+    return luaL_error(L, "out of memory");
+  system_soft_wdt_stop();
+  copy_image(ota.base + SECTOR, h.size, buf);
+  return 0;
+}
+
+// Lua: ota.status() -> { addr=, size=, offset=, verified= } or nil
+static int ota_status (lua_State *L) {
+  ota_header_t h;
+  if (!read_header(ota.base, &h))
+    return 0;
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, ota.base);
+  lua_setfield(L, -2, "addr");
+  lua_pushinteger(L, h.size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, ota.buf ? ota.offset + ota.fill : h.size);
+  lua_setfield(L, -2, "offset");
+  lua_pushboolean(L, h.state == OTA_VERIFIED);
+  lua_setfield(L, -2, "verified");
+  return 1;
+}
+
+// Lua: ota.abort()
+static int ota_abort (lua_State *L) {
+  (void) L;
+  if (ota.base)
+    write_word(ota.base, 0);
+  ota_release();
+  return 0;
+}
+
+LROT_BEGIN(ota, NULL, 0)
+  LROT_FUNCENTRY( start, ota_start )
+  LROT_FUNCENTRY( write, ota_write )
+  LROT_FUNCENTRY( finish, ota_finish )
+  LROT_FUNCENTRY( apply, ota_apply )
+  LROT_FUNCENTRY( status, ota_status )
+  LROT_FUNCENTRY( abort, ota_abort )
+LROT_END(ota, NULL, 0)
+
+NODEMCU_MODULE(OTA, "ota", ota, NULL);
@@ -4,6 +4,8 @@
 #include "lauxlib.h"
 #include "platform.h"
 #include "driver/onewire.h"
+#include "user_interface.h"
+#include "pm/swtimer.h"
 
 // Lua: ow.setup( id )
 static int ow_setup( lua_State *L )
@@ -219,8 +221,143 @@ static int ow_search( lua_State *L )
   }
   return 1;
 }
+
+// Run a whole search in one call, keeping only ROMs with a valid CRC.
+// Lua: roms = ow.search_all( id, [family_code], [alarm_search] )
+static int ow_search_all( lua_State *L )
+{
+  unsigned id = luaL_checkinteger( L, 1 );
+  MOD_CHECK_ID( ow, id );
+
+  int family = luaL_optinteger( L, 2, -1 );
+  uint8_t alarm_search = luaL_optinteger( L, 3, 0 ) != 0;
+  uint8_t rom[8];
+  int n = 0;
+
+  if( family > 255 )
+    return luaL_error( L, "wrong arg range" );
+  if( family >= 0 )
+    onewire_target_search( id, family );
+  else
+    onewire_reset_search( id );
+
+  lua_newtable( L );
+  while( onewire_search( id, rom, alarm_search ) ) {
+    // a target search goes on to the following families
+    if( family >= 0 && rom[0] != family )
+      break;
+#if ONEWIRE_CRC
+    if( onewire_crc8( rom, 7 ) != rom[7] )
+      continue;
+#endif
+    lua_pushlstring( L, (const char *)rom, 8 );
+    lua_rawseti( L, -2, ++n );
+  }
+  return 1;
+}
 #endif
 
+// A bulk conversion starts a temperature conversion on every device at once,
+// then reads the scratchpads one device per task after the delay.
+#define OW_CONVERT_T        0x44
+#define OW_READ_SCRATCHPAD  0xBE
+#define OW_SCRATCHPAD_LEN   9
+
+static platform_task_handle_t bulk_task;
+static struct {
+  os_timer_t timer;
+  uint8_t pin;
+  int next, count;
+  int roms_ref, cb_ref, results_ref;
+} bulk = { .cb_ref = LUA_NOREF };
+
+static void bulk_read_next( platform_task_param_t param, uint8_t prio )
+{
+  (void)param;
+  (void)prio;
+  lua_State *L = lua_getstate();
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, bulk.results_ref );
+  if( bulk.next <= bulk.count ) {
+    uint8_t pad[OW_SCRATCHPAD_LEN];
+
+    lua_rawgeti( L, LUA_REGISTRYINDEX, bulk.roms_ref );
+    lua_rawgeti( L, -1, bulk.next );
+    if( onewire_reset( bulk.pin ) ) {
+      onewire_select( bulk.pin, (const uint8_t *)lua_tostring( L, -1 ) );
+      onewire_write( bulk.pin, OW_READ_SCRATCHPAD, 0 );
+      onewire_read_bytes( bulk.pin, pad, OW_SCRATCHPAD_LEN );
+      lua_pushlstring( L, (const char *)pad, OW_SCRATCHPAD_LEN );
+    } else {
+      lua_pushboolean( L, 0 );
+    }
+    lua_rawseti( L, -4, bulk.next++ );
+    lua_pop( L, 3 );
+    platform_post_low( bulk_task, 0 );
+    return;
+  }
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, bulk.cb_ref );
+  lua_insert( L, -2 );
+  luaL_unref( L, LUA_REGISTRYINDEX, bulk.roms_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, bulk.cb_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, bulk.results_ref );
+  bulk.cb_ref = LUA_NOREF;
+  luaL_pcallx( L, 1, 0 );
+}
+
+static void bulk_converted( void *arg )
+{
+  (void)arg;
+  platform_post_low( bulk_task, 0 );
+}
+
+// Lua: ow.convert_all( id, roms, callback, [delay_ms] )
+static int ow_convert_all( lua_State *L )
+{
+  unsigned id = luaL_checkinteger( L, 1 );
+  MOD_CHECK_ID( ow, id );
+  luaL_checktype( L, 2, LUA_TTABLE );
+  luaL_checktype( L, 3, LUA_TFUNCTION );
+  int delay = luaL_optinteger( L, 4, 750 );
+  int i, n = lua_objlen( L, 2 );
+
+  if( bulk.cb_ref != LUA_NOREF )
+    return luaL_error( L, "conversion in progress" );
+  luaL_argcheck( L, delay >= 0, 4, "wrong arg range" );
+
+  // keep a copy of the ROMs, without any bytes the caller appended
+  lua_createtable( L, n, 0 );
+  for( i = 1; i <= n; i++ ) {
+    size_t len;
+    lua_rawgeti( L, 2, i );
+    const char *rom = lua_tolstring( L, -1, &len );
+    luaL_argcheck( L, rom && len >= 8, 2, "ROMs should be strings of 8 bytes" );
+    lua_pushlstring( L, rom, 8 );
+    lua_rawseti( L, -3, i );
+    lua_pop( L, 1 );
+  }
+  bulk.roms_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_pushvalue( L, 3 );
+  bulk.cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_createtable( L, n, 0 );
+  bulk.results_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  bulk.pin = id;
+  bulk.next = 1;
+  bulk.count = n;
+
+  // keep the bus powered for parasite devices during the conversion
+  onewire_reset( id );
+  onewire_skip( id );
+  onewire_write( id, OW_CONVERT_T, 1 );
+
+  os_timer_disarm( &bulk.timer );
+  os_timer_setfn( &bulk.timer, bulk_converted, NULL );
+  SWTIMER_REG_CB( bulk_converted, SWTIMER_RESUME );
+  os_timer_arm( &bulk.timer, delay, 0 );
+  return 0;
+}
+
 #if ONEWIRE_CRC
 // uint8_t onewire_crc8(const uint8_t *addr, uint8_t len);
 // Lua: r = ow.crc8( buf )
@@ -330,7 +467,9 @@ LROT_BEGIN(ow, NULL, 0)
   LROT_FUNCENTRY( reset_search, ow_reset_search )
   LROT_FUNCENTRY( target_search, ow_target_search )
   LROT_FUNCENTRY( search, ow_search )
+  LROT_FUNCENTRY( search_all, ow_search_all )
 #endif
+  LROT_FUNCENTRY( convert_all, ow_convert_all )
 #if ONEWIRE_CRC
   LROT_FUNCENTRY( crc8, ow_crc8 )
 #if ONEWIRE_CRC16
@@ -342,4 +481,9 @@ LROT_BEGIN(ow, NULL, 0)
 LROT_END(ow, NULL, 0)
 
 
-NODEMCU_MODULE(OW, "ow", ow, NULL);
+int luaopen_ow( lua_State *L ) {
+  bulk_task = platform_task_get_id( bulk_read_next );
+  return 0;
+}
+
+NODEMCU_MODULE(OW, "ow", ow, luaopen_ow);
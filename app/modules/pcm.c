@@ -5,6 +5,7 @@
 #include "task/task.h"
 #include <string.h>
 #include <stdlib.h>
+#include "vfs.h"
 
 #include "pcm/pcm.h"
 #include "pcm/pcm_drv.h"
@@ -42,18 +43,29 @@ static int pcm_drv_free( lua_State *L )
   UNREF_CB( cfg->cb_vu_ref );
   UNREF_CB( cfg->self_ref );
 
-  if (cfg->bufs[0].data) {
-    free( cfg->bufs[0].data );
-    cfg->bufs[0].data = NULL;
-  }
-  if (cfg->bufs[1].data) {
-    free( cfg->bufs[1].data );
-    cfg->bufs[1].data = NULL;
+  pcm_source_close( cfg );
+
+  int i;
+  for (i = 0; i < PCM_DEPTH_MAX; i++) {
+    if (cfg->bufs[i].data) {
+      free( cfg->bufs[i].data );
+      cfg->bufs[i].data = NULL;
+    }
+    cfg->bufs[i].buf_size = 0;
   }
 
   return 0;
 }
 
+static void invalidate_bufs( cfg_t *cfg )
+{
+  int i;
+  for (i = 0; i < PCM_DEPTH_MAX; i++) {
+    cfg->bufs[i].empty = TRUE;
+  }
+  cfg->rbuf_idx = cfg->fbuf_idx = 0;
+}
+
 // Lua: drv:close()
 static int pcm_drv_close( lua_State *L )
 {
@@ -75,7 +87,7 @@ static int pcm_drv_stop( lua_State *L )
   pud->drv->stop( cfg );
 
   // invalidate the buffers
-  cfg->bufs[0].empty = cfg->bufs[1].empty = TRUE;
+  invalidate_bufs( cfg );
 
   dispatch_callback( L, cfg->self_ref, cfg->cb_stopped_ref, 0 );
 
@@ -181,6 +193,63 @@ static int pcm_drv_on( lua_State *L )
   return 0;
 }
 
+// Lua: drv:source(self, [src[, opts]])
+static int pcm_drv_source( lua_State *L )
+{
+  GET_PUD();
+
+  if (cfg->isr_throttled >= 0) {
+    return luaL_error( L, "playing" );
+  }
+
+  int depth = cfg->nbufs, chunk = cfg->chunk;
+  if (!lua_isnoneornil( L, 3 )) {
+    luaL_checktype( L, 3, LUA_TTABLE );
+    lua_getfield( L, 3, "depth" );
+    depth = luaL_optinteger( L, -1, depth );
+    luaL_argcheck( L, (depth >= 2) && (depth <= PCM_DEPTH_MAX), 3, "invalid depth" );
+    lua_getfield( L, 3, "chunk" );
+    chunk = luaL_optinteger( L, -1, chunk );
+    luaL_argcheck( L, (chunk >= 64) && (chunk <= 4096), 3, "invalid chunk" );
+    lua_pop( L, 2 );
+  }
+
+  pcm_source_close( cfg );
+  invalidate_bufs( cfg );
+  cfg->nbufs = depth;
+  cfg->chunk = chunk;
+
+  if (lua_type( L, 2 ) == LUA_TSTRING) {
+    cfg->src_fd = vfs_open( lua_tostring( L, 2 ), "r" );
+    if (!cfg->src_fd) {
+      return luaL_error( L, "cannot open %s", lua_tostring( L, 2 ) );
+    }
+    cfg->src_fd_owned = TRUE;
+    cfg->src = PCM_SRC_FILE;
+  } else if (luaL_testudata( L, 2, "file.obj" )) {
+    // a file.obj userdata starts with its VFS descriptor
+    cfg->src_fd = *(int *)lua_touserdata( L, 2 );
+    if (!cfg->src_fd) {
+      return luaL_error( L, "file is closed" );
+    }
+    cfg->src_fd_owned = FALSE;
+    cfg->src = PCM_SRC_FILE;
+  } else if (!lua_isnoneornil( L, 2 )) {
+    cfg->src_sock = pcm_socket_attach( L, cfg, 2 );
+    if (!cfg->src_sock) {
+      return luaL_error( L, "file, file name or connected TCP socket expected" );
+    }
+    cfg->src = PCM_SRC_SOCKET;
+  }
+
+  if (cfg->src != PCM_SRC_LUA) {
+    lua_pushvalue( L, 2 );  // keep the source alive while it is used
+    cfg->src_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+
+  return 0;
+}
+
 // Lua: pcm.new( type, pin )
 static int pcm_new( lua_State *L )
 {
@@ -199,21 +268,33 @@ static int pcm_new( lua_State *L )
   cfg->cb_paused_ref = cfg->cb_stopped_ref = LUA_NOREF;
   cfg->cb_vu_ref     = LUA_NOREF;
 
-  cfg->bufs[0].buf_size = cfg->bufs[1].buf_size = 0;
-  cfg->bufs[0].data     = cfg->bufs[1].data     = NULL;
-  cfg->bufs[0].len      = cfg->bufs[1].len      = 0;
-  cfg->bufs[0].rpos     = cfg->bufs[1].rpos     = 0;
-  cfg->bufs[0].empty    = cfg->bufs[1].empty    = TRUE;
+  memset( cfg->bufs, 0, sizeof( cfg->bufs ) );
+  invalidate_bufs( cfg );
+  cfg->nbufs = PCM_DEPTH_DEFAULT;
+
+  cfg->src     = PCM_SRC_LUA;
+  cfg->src_eof = FALSE;
+  cfg->src_fd  = 0;
+  cfg->src_ref = LUA_NOREF;
+  cfg->src_sock = NULL;
+  cfg->src_pbuf = NULL;
+  cfg->chunk   = PCM_CHUNK_DEFAULT;
 
   cfg->vu_freq         = 10;
 
-  if (driver == PCM_DRIVER_SD) {
-    cfg->pin = luaL_checkinteger( L, 2 );
-    MOD_CHECK_ID(sigma_delta, cfg->pin);
+  if (driver == PCM_DRIVER_SD || driver == PCM_DRIVER_I2S) {
+    if (driver == PCM_DRIVER_SD) {
+      cfg->pin = luaL_checkinteger( L, 2 );
+      MOD_CHECK_ID(sigma_delta, cfg->pin);
 
-    pud->drv = &pcm_drv_sd;
+      pud->drv = &pcm_drv_sd;
+    } else {
+      pud->drv = &pcm_drv_i2s;
+    }
 
-    pud->drv->init( cfg );
+    if (!pud->drv->init( cfg )) {
+      return luaL_error( L, "out of memory" );
+    }
 
     /* set its metatable */
     lua_pushvalue( L, -1 );  // copy self userdata to the top of stack
@@ -237,6 +318,7 @@ LROT_BEGIN(pcm_driver, NULL, LROT_MASK_GC_INDEX)
   LROT_FUNCENTRY( stop, pcm_drv_stop )
   LROT_FUNCENTRY( close, pcm_drv_close )
   LROT_FUNCENTRY( on, pcm_drv_on )
+  LROT_FUNCENTRY( source, pcm_drv_source )
 LROT_END(pcm_driver, NULL, LROT_MASK_GC_INDEX)
 
 
@@ -244,6 +326,7 @@ LROT_END(pcm_driver, NULL, LROT_MASK_GC_INDEX)
 LROT_BEGIN(pcm, NULL, 0)
   LROT_FUNCENTRY( new, pcm_new )
   LROT_NUMENTRY( SD, PCM_DRIVER_SD )
+  LROT_NUMENTRY( I2S, PCM_DRIVER_I2S )
   LROT_NUMENTRY( RATE_1K, PCM_RATE_1K )
   LROT_NUMENTRY( RATE_2K, PCM_RATE_2K )
   LROT_NUMENTRY( RATE_4K, PCM_RATE_4K )
@@ -4,6 +4,19 @@
 //
 // perf.start(start, end, nbins[, pc offset on stack])
 // perf.stop()  -> total sample, samples outside range, table { addr -> count , .. }
+//
+// perf.start("lua"[, slots])
+// perf.stop()  -> total sample, samples not in Lua, table { "source:line" -> count, .. },
+//                 table { "source:linedefined" -> count, .. }
+//
+// perf.start("stream"[, interval_us[, depth]])
+// perf.stop()  -> total samples, samples lost
+//
+// perf.hwtimer([reset]) -> array of { name=, owner=, priority=, open=, fires=, late=, maxlate= }
+//
+// perf.trace.start([entries[, events]]), perf.trace.stop()
+// perf.trace.read([max]) -> binary entries, lost count
+// perf.trace.mark(a[, b])
 
 
 #include "ets_sys.h"
@@ -16,6 +29,7 @@
 #include "platform.h"
 #include "hw_timer.h"
 #include "cpu_esp8266.h"
+#include "platform_trace.h"
 
 typedef struct {
   int ref;
@@ -28,8 +42,71 @@ typedef struct {
 } DATA;
 
 static DATA *data;
+
+#if LUA_VERSION_NUM > 501
+// Samples of the Lua function and instruction, hashed on both
+typedef struct {
+  int ref;
+  lua_State *L;
+  uint32_t mask;
+  uint32_t total_samples;
+  uint32_t outside_samples;
+  lua_Sample sample[1];
+} LDATA;
+
+#define LDATA_PROBES 8
+
+static LDATA *ldata;
+#endif
+
+/*
+ * Streamed samples of the PC and of the return addresses found on the stack
+ * above it.  The timer callback fills a small ring, and a task sends each
+ * sample as a GDB remote protocol packet on UART 0, so the firmware keeps
+ * running and the stream can share the UART with the console and gdbstub.
+ */
+#define STREAM_RING       32      // samples buffered between callback and task
+#define STREAM_MAX_DEPTH  8
+#define STREAM_SCAN       96      // stack words searched for return addresses
+
+typedef struct {
+  uint32_t pc;
+  uint32_t depth;
+  uint32_t ra[STREAM_MAX_DEPTH];
+} SAMPLE;
+
+typedef struct {
+  int ref;
+  platform_task_handle_t task;
+  uint32_t total_samples;
+  uint32_t lost_samples;
+  uint32_t reported_lost;
+  volatile uint16_t head, tail;
+  volatile uint8_t posted;
+  uint8_t depth;
+  SAMPLE ring[STREAM_RING];
+} SDATA;
+
+static SDATA *sdata;
 extern char _flash_used_end[];
 
+static inline __attribute__((always_inline)) bool is_code(uint32_t a)
+{
+  return (a >= 0x40100000 && a < 0x40108000) ||
+         (a >= 0x40201000 && a < (uint32_t) _flash_used_end);
+}
+
+static uint32_t ICACHE_RAM_ATTR stack_scan(uint32_t *sp, uint32_t *ra, uint32_t depth)
+{
+  uint32_t n = 0, i;
+  for (i = 0; i < STREAM_SCAN && n < depth && (uint32_t) (sp + i) < 0x40000000; i++) {
+    uint32_t w = sp[i];
+    if (is_code(w))
+      ra[n++] = w;
+  }
+  return n;
+}
+
 #define TIMER_OWNER ((os_param_t) 'p')
 
 static void ICACHE_RAM_ATTR hw_timer_cb(os_param_t p)
@@ -52,10 +129,216 @@ static void ICACHE_RAM_ATTR hw_timer_cb(os_param_t p)
     }
     data->total_samples++;
   }
+  if (sdata) {
+    uint16_t h = sdata->head;
+    sdata->total_samples++;
+    if ((uint16_t) (h - sdata->tail) >= STREAM_RING) {
+      sdata->lost_samples++;
+    } else {
+      SAMPLE *s = &sdata->ring[h % STREAM_RING];
+      asm ("rsr   %0, EPC1;" :"=r"(s->pc));
+      s->depth = stack_scan(&stackaddr, s->ra, sdata->depth);
+      sdata->head = h + 1;
+      if (!sdata->posted) {
+        sdata->posted = 1;
+        platform_post_low(sdata->task, 0);
+      }
+    }
+  }
+#if LUA_VERSION_NUM > 501
+  if (ldata) {
+    const void *f, *pc;
+    int i;
+    ldata->total_samples++;
+    if (lua_sampleci(ldata->L, &f, &pc)) {
+      uint32_t h = ((uint32_t) f ^ (uint32_t) pc) >> 2;
+      for (i = 0; i < LDATA_PROBES; i++) {
+        lua_Sample *s = &ldata->sample[(h + i) & ldata->mask];
+        if (s->count == 0) {
+          s->f = f;
+          s->pc = pc;
+        } else if (s->f != f || s->pc != pc) {
+          continue;
+        }
+        s->count++;
+        return;
+      }
+    }
+    ldata->outside_samples++;
+  }
+#endif
+}
+
+#if LUA_VERSION_NUM > 501
+static int perf_start_lua(lua_State *L)
+{
+  uint32_t slots = luaL_optinteger(L, 2, 256), n;
+  luaL_argcheck(L, slots > 0 && slots <= 4096, 2, "invalid slot count");
+  for (n = 1; n < slots; n <<= 1) {}
+
+  size_t data_size = sizeof(LDATA) + (n - 1) * sizeof(lua_Sample);
+  LDATA *d = (LDATA *) lua_newuserdata(L, data_size);
+  memset(d, 0, data_size);
+  d->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  d->L = lua_getstate();
+  d->mask = n - 1;
+
+  if (ldata) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ldata->ref);
+  }
+  if (data) {  // only one mode can run at a time
+    luaL_unref(L, LUA_REGISTRYINDEX, data->ref);
+    data = NULL;
+  }
+  if (sdata) {
+    luaL_unref(L, LUA_REGISTRYINDEX, sdata->ref);
+    sdata = NULL;
+  }
+  ldata = d;
+
+  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, TRUE)) {
+    ldata = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, d->ref);
+    luaL_error(L, "Unable to initialize timer");
+  }
+  platform_hw_timer_set_func(TIMER_OWNER, hw_timer_cb, 0);
+  platform_hw_timer_set_priority(TIMER_OWNER, 0, "perf");
+  platform_hw_timer_arm_us(TIMER_OWNER, 50);
+
+  return 0;
+}
+
+static int perf_stop_lua(lua_State *L)
+{
+  platform_hw_timer_close(TIMER_OWNER);
+
+  LDATA *d = ldata;
+  ldata = NULL;
+
+  lua_pushunsigned(L, d->total_samples);
+  lua_pushunsigned(L, d->outside_samples);
+  lua_pushsamples(L, d->sample, d->mask + 1);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, d->ref);
+
+  return 4;
+}
+#endif
+
+static const char hexchars[] = "0123456789abcdef";
+
+static void stream_hex(uint32_t v, uint8_t *sum)
+{
+  int i;
+  for (i = 28; i >= 0; i -= 4) {
+    char c = hexchars[(v >> i) & 0xf];
+    *sum += c;
+    platform_uart_send(0, c);
+  }
+}
+
+// Packets are $<tag><hex words>#<checksum>, as gdb frames its packets
+static void stream_packet(char tag, const uint32_t *w, uint32_t n)
+{
+  uint8_t sum = tag;
+  platform_uart_send(0, '$');
+  platform_uart_send(0, tag);
+  while (n--)
+    stream_hex(*w++, &sum);
+  platform_uart_send(0, '#');
+  platform_uart_send(0, hexchars[sum >> 4]);
+  platform_uart_send(0, hexchars[sum & 0xf]);
+}
+
+static void stream_task(platform_task_param_t param, uint8_t prio)
+{
+  (void) param; (void) prio;
+  SDATA *d = sdata;
+  if (!d)
+    return;
+  d->posted = 0;
+  while (d->tail != d->head) {
+    SAMPLE *s = &d->ring[d->tail % STREAM_RING];
+    stream_packet('S', &s->pc, 1);
+    if (s->depth)
+      stream_packet('s', s->ra, s->depth);
+    d->tail++;
+  }
+  if (d->lost_samples != d->reported_lost) {
+    d->reported_lost = d->lost_samples;
+    stream_packet('L', &d->reported_lost, 1);
+  }
+}
+
+static int perf_start_stream(lua_State *L)
+{
+  uint32_t interval = luaL_optinteger(L, 2, 20000);
+  uint32_t depth = luaL_optinteger(L, 3, 4);
+  luaL_argcheck(L, interval >= 1000 && interval <= 1000000, 2, "invalid interval");
+  luaL_argcheck(L, depth <= STREAM_MAX_DEPTH, 3, "invalid depth");
+
+  SDATA *d = (SDATA *) lua_newuserdata(L, sizeof(SDATA));
+  memset(d, 0, sizeof(SDATA));
+  d->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  d->task = platform_task_get_id(stream_task);
+  d->depth = depth;
+
+  if (sdata) {
+    luaL_unref(L, LUA_REGISTRYINDEX, sdata->ref);
+  }
+  if (data) {  // only one mode can run at a time
+    luaL_unref(L, LUA_REGISTRYINDEX, data->ref);
+    data = NULL;
+  }
+#if LUA_VERSION_NUM > 501
+  if (ldata) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ldata->ref);
+    ldata = NULL;
+  }
+#endif
+  sdata = d;
+
+  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, TRUE)) {
+    sdata = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, d->ref);
+    luaL_error(L, "Unable to initialize timer");
+  }
+  platform_hw_timer_set_func(TIMER_OWNER, hw_timer_cb, 0);
+  platform_hw_timer_set_priority(TIMER_OWNER, 0, "perf");
+  platform_hw_timer_arm_us(TIMER_OWNER, interval);
+
+  return 0;
+}
+
+static int perf_stop_stream(lua_State *L)
+{
+  platform_hw_timer_close(TIMER_OWNER);
+
+  SDATA *d = sdata;
+  stream_task(0, 0);                  // flush what is still buffered
+  sdata = NULL;
+
+  lua_pushunsigned(L, d->total_samples);
+  lua_pushunsigned(L, d->lost_samples);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, d->ref);
+
+  return 2;
 }
 
 static int perf_start(lua_State *L)
 {
+  if (lua_type(L, 1) == LUA_TSTRING && !strcmp(lua_tostring(L, 1), "stream")) {
+    return perf_start_stream(L);
+  }
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    luaL_argcheck(L, !strcmp(lua_tostring(L, 1), "lua"), 1, "invalid mode");
+#if LUA_VERSION_NUM > 501
+    return perf_start_lua(L);
+#else
+    return luaL_error(L, "Lua sampling needs Lua 5.3");
+#endif
+  }
   uint32_t start = luaL_optinteger(L, 1, 0x40000000);
   uint32_t end = luaL_optinteger(L, 2, (uint32_t) _flash_used_end);
   uint32_t bins = luaL_optinteger(L, 3, 1024);
@@ -86,6 +369,16 @@ static int perf_start(lua_State *L)
   if (data) {
     luaL_unref(L, LUA_REGISTRYINDEX, data->ref);
   }
+#if LUA_VERSION_NUM > 501
+  if (ldata) {  // only one mode can run at a time
+    luaL_unref(L, LUA_REGISTRYINDEX, ldata->ref);
+    ldata = NULL;
+  }
+#endif
+  if (sdata) {
+    luaL_unref(L, LUA_REGISTRYINDEX, sdata->ref);
+    sdata = NULL;
+  }
 
   data = d;
 
@@ -98,6 +391,7 @@ static int perf_start(lua_State *L)
   }
 
   platform_hw_timer_set_func(TIMER_OWNER, hw_timer_cb, 0);
+  platform_hw_timer_set_priority(TIMER_OWNER, 0, "perf");
   platform_hw_timer_arm_us(TIMER_OWNER, 50);
 
   return 0;
@@ -105,6 +399,14 @@ static int perf_start(lua_State *L)
 
 static int perf_stop(lua_State *L)
 {
+  if (sdata) {
+    return perf_stop_stream(L);
+  }
+#if LUA_VERSION_NUM > 501
+  if (ldata) {
+    return perf_stop_lua(L);
+  }
+#endif
   if (!data) {
     return 0;
   }
@@ -135,9 +437,124 @@ static int perf_stop(lua_State *L)
   return 4;
 }
 
+// Lua: perf.hwtimer([reset])
+static int perf_hwtimer(lua_State *L)
+{
+  bool reset = lua_toboolean(L, 1);
+  hw_timer_stats_t st;
+  uint32_t i;
+
+  lua_newtable(L);
+  for (i = 0; platform_hw_timer_get_stats(i, &st, reset); i++) {
+    lua_createtable(L, 0, 7);
+    if (st.name) {
+      lua_pushstring(L, st.name);
+      lua_setfield(L, -2, "name");
+    }
+    lua_pushunsigned(L, st.owner);
+    lua_setfield(L, -2, "owner");
+    lua_pushinteger(L, st.priority);
+    lua_setfield(L, -2, "priority");
+    lua_pushboolean(L, st.open);
+    lua_setfield(L, -2, "open");
+    lua_pushunsigned(L, st.fires);
+    lua_setfield(L, -2, "fires");
+    lua_pushunsigned(L, st.late);
+    lua_setfield(L, -2, "late");
+    lua_pushunsigned(L, st.max_late);
+    lua_setfield(L, -2, "maxlate");
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+#ifdef PLATFORM_TRACE
+#define TRACE_DEFAULT_ENTRIES 256
+#define TRACE_READ_MAX        64
+
+// Lua: perf.trace.start([entries[, events]])
+static int perf_trace_start(lua_State *L)
+{
+  int entries = luaL_optinteger(L, 1, TRACE_DEFAULT_ENTRIES);
+  uint32_t mask = ~0u;
+  luaL_argcheck(L, entries >= 0 && entries <= 8192, 1, "invalid size");
+  if (!lua_isnoneornil(L, 2)) {
+    int i, n;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_objlen(L, 2);
+    for (mask = 0, i = 1; i <= n; i++) {
+      lua_rawgeti(L, 2, i);
+      int id = luaL_checkinteger(L, -1);
+      luaL_argcheck(L, id > 0 && id < TRACE_EVENT_COUNT, 2, "invalid event");
+      mask |= 1u << id;
+      lua_pop(L, 1);
+    }
+  }
+  if (platform_trace_start(entries, mask) != PLATFORM_OK)
+    return luaL_error(L, "out of memory");
+  return 0;
+}
+
+// Lua: perf.trace.stop()
+static int perf_trace_stop(lua_State *L)
+{
+  (void) L;
+  platform_trace_stop();
+  return 0;
+}
+
+// Lua: data, lost = perf.trace.read([max])
+static int perf_trace_read(lua_State *L)
+{
+  platform_trace_entry_t e[TRACE_READ_MAX];
+  int max = luaL_optinteger(L, 1, TRACE_READ_MAX);
+  uint32_t lost;
+  luaL_argcheck(L, max > 0 && max <= TRACE_READ_MAX, 1, "invalid count");
+  size_t n = platform_trace_read(e, max, &lost);
+  if (n)
+    lua_pushlstring(L, (const char *) e, n * sizeof(e[0]));
+  else
+    lua_pushnil(L);
+  lua_pushinteger(L, lost);
+  return 2;
+}
+
+// Lua: perf.trace.mark(a[, b])
+static int perf_trace_mark(lua_State *L)
+{
+  PLATFORM_TRACE_EVENT(TRACE_USER, luaL_checkinteger(L, 1),
+                       luaL_optinteger(L, 2, 0));
+  return 0;
+}
+
+LROT_BEGIN(perf_trace, NULL, 0)
+  LROT_FUNCENTRY( start, perf_trace_start )
+  LROT_FUNCENTRY( stop, perf_trace_stop )
+  LROT_FUNCENTRY( read, perf_trace_read )
+  LROT_FUNCENTRY( mark, perf_trace_mark )
+  LROT_NUMENTRY( TASK_POST, TRACE_TASK_POST )
+  LROT_NUMENTRY( TASK_DISPATCH, TRACE_TASK_DISPATCH )
+  LROT_NUMENTRY( TASK_DONE, TRACE_TASK_DONE )
+  LROT_NUMENTRY( GC_STEP, TRACE_GC_STEP )
+  LROT_NUMENTRY( GC_STEP_DONE, TRACE_GC_STEP_DONE )
+  LROT_NUMENTRY( NET_RX, TRACE_NET_RX )
+  LROT_NUMENTRY( NET_TX, TRACE_NET_TX )
+  LROT_NUMENTRY( FLASH_ERASE, TRACE_FLASH_ERASE )
+  LROT_NUMENTRY( FLASH_WRITE, TRACE_FLASH_WRITE )
+  LROT_NUMENTRY( LUA_CB, TRACE_LUA_CB )
+  LROT_NUMENTRY( LUA_CB_DONE, TRACE_LUA_CB_DONE )
+  LROT_NUMENTRY( GPIO_ISR, TRACE_GPIO_ISR )
+  LROT_NUMENTRY( USER, TRACE_USER )
+LROT_END(perf_trace, NULL, 0)
+#endif
+
 LROT_BEGIN(perf, NULL, 0)
   LROT_FUNCENTRY( start, perf_start )
   LROT_FUNCENTRY( stop, perf_stop )
+  LROT_FUNCENTRY( hwtimer, perf_hwtimer )
+#ifdef PLATFORM_TRACE
+  LROT_TABENTRY( trace, perf_trace )
+#endif
 LROT_END(perf, NULL, 0)
 
 
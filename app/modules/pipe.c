@@ -43,7 +43,8 @@
 **
 ** Also note that the pipe module is used by the Lua VM and therefore the create
 ** read, and unread methods are exposed as directly callable C functions. (Write
-** is available through pipe[1].)
+** is available through pipe[1].)  pipe_drain() additionally lets C writers
+** consume the buffered chunks in place without collecting them into a string.
 **
 ** Read the docs/modules/pipe.md documentation for a functional description.
 */
@@ -373,14 +374,57 @@ int pipe_unread(lua_State *L) {
 	return 0;
 }
 
-// Lua: buf:write(some_string)
-static int pipe_write_aux(lua_State *L) {
+/*
+** C API for writers that can take the pipe content a chunk at a time, such as
+** net socket:send().  Each chunk of unread content is passed in order to
+** fn(arg, buf, len), which returns 0 if it has accepted the chunk.  Accepted
+** chunks are removed from the pipe, and draining stops at the first refusal.
+** If fn is NULL then the pipe is left unchanged.  Returns the number of bytes
+** accepted (or pending if fn is NULL), or -1 if ndx is not a pipe.
+*/
+int pipe_drain(lua_State *L, int ndx,                             // [-0, +0, -]
+               int (*fn)(void *, const char *, size_t), void *arg) {
+  int i, j, n, total = 0;
+  if (ndx < 0)
+    ndx = lua_gettop(L) + ndx + 1;
+  if (!lua_istable(L, ndx) || !lua_getmetatable(L, ndx))
+    return -1;
+  lua_pushrotable(L, LROT_TABLEREF(pipe_meta));
+  n = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  if (!n)
+    return -1;
+
+  n = lua_objlen(L, ndx);
+  for (i = 2; i <= n; i++) {
+    lua_rawgeti(L, ndx, i);                  /* UD stays anchored in T[i] */
+    buffer_t *ud = checkPipeUD(L, -1);
+    lua_pop(L, 1);
+    int len = ud->end - ud->start;
+    if (fn && len && fn(arg, ud->buf + ud->start, len))
+      break;
+    total += len;
+  }
+  if (fn && i > 2) {
+    /* shift the unaccepted T[i..n] down to T[2..] and clear the tail */
+    for (j = i; j <= n; j++) {
+      lua_rawgeti(L, ndx, j); lua_rawseti(L, ndx, j - i + 2);
+    }
+    for (j = n - i + 3; j <= n; j++) {
+      lua_pushnil(L); lua_rawseti(L, ndx, j);
+    }
+  }
+  return total;
+}
+
+// Append the string at stack ndx to the pipe at stack 1
+static int pipe_write_str(lua_State *L, int ndx) {
   size_t l = INVALID_LEN;
-  const char *s = lua_tolstring(L, 2, &l);
+  const char *s = lua_tolstring(L, ndx, &l);
 //dbg_printf("pipe write(%u): %s", l, s);
   if (l==0)
     return false;
-  luaL_argcheck(L, l != INVALID_LEN, 2, "must be a string");
+  luaL_argcheck(L, l != INVALID_LEN, ndx, "must be a string");
   buffer_t *ud = checkPipeTable(L, 1, AT_TAIL | WRITING);
 
   do {
@@ -415,6 +459,90 @@ static int pipe_write_aux(lua_State *L) {
 	return true;
 }
 
+#ifdef LUA_USE_MODULES_SJSON
+extern int sjson_encoder_fill(lua_State *L, int ndx, char *buf, size_t len);
+
+// Encode the rest of the sjson.encoder at stack ndx into the pipe at stack 1
+static int pipe_write_encoder(lua_State *L, int ndx) {
+  buffer_t *ud = checkPipeTable(L, 1, AT_TAIL | WRITING);
+  int written = false;
+
+  do {
+    if (ud->end == LUAL_BUFFERSIZE) {
+      if (ud->start == 0) {
+        ud = newPipeUD(L, 1, lua_objlen(L, 1)+1);
+      } else {
+        int used = ud->end - ud->start;
+        memmove(ud->buf, ud->buf + ud->start, used);
+        ud->start = 0; ud->end = used;
+      }
+    }
+    /* the encoder writes straight into the free tail of the UD buffer */
+    int room = LUAL_BUFFERSIZE - ud->end;
+    int n = sjson_encoder_fill(L, ndx, ud->buf + ud->end, room);
+    ud->end += n;
+    written |= n > 0;
+    if (n < room)
+      break;
+  } while(1);
+
+  return written;
+}
+#endif
+
+// Lua: buf:write(some_string or encoder[, ...])
+static int pipe_write_aux(lua_State *L) {
+  int i, n = lua_gettop(L), written = false;
+  for (i = 2; i <= n; i++) {
+#ifdef LUA_USE_MODULES_SJSON
+    if (lua_isuserdata(L, i) && sjson_encoder_fill(L, i, NULL, 0) == 0) {
+      written |= pipe_write_encoder(L, i);
+      continue;
+    }
+#endif
+    written |= pipe_write_str(L, i);
+  }
+  return written;
+}
+
+// Lua: buf:writef(format, ...)
+static int pipe_writef(lua_State *L) {
+  int n = lua_gettop(L);
+  checkPipeTable(L, 1, AT_TAIL);
+  luaL_checkstring(L, 2);
+  lua_rawgeti(L, 1, 1);                     /* the write function in pipe[1] */
+  lua_pushvalue(L, 1);
+  lua_getglobal(L, "string");
+  lua_getfield(L, -1, "format");
+  lua_remove(L, -2);
+  for (int i = 2; i <= n; i++)
+    lua_pushvalue(L, i);
+  lua_call(L, n - 1, 1);      /* a single string.format() result is written */
+  lua_call(L, 2, 0);
+  return 0;
+}
+
+// Lua: s = buf:concat()  -- the unread content, which is left in the pipe
+static int pipe_concat(lua_State *L) {
+  luaL_Buffer b;
+  int i, n;
+  checkPipeTable(L, 1, AT_HEAD);
+  n = lua_objlen(L, 1);
+#if LUA_VERSION_NUM > 501
+  luaL_buffinitsize(L, &b, pipe_drain(L, 1, NULL, NULL));
+#else
+  luaL_buffinit(L, &b);
+#endif
+  for (i = 2; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    buffer_t *ud = checkPipeUD(L, -1);
+    lua_pop(L, 1);                            /* UD stays anchored in T[i] */
+    luaL_addlstring(&b, ud->buf + ud->start, ud->end - ud->start);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
 // Lua: fread = pobj:reader(1400) -- or other number
 //      fread = pobj:reader('\n') -- or other delimiter (delim is stripped)
 //      fread = pobj:reader('\n+') -- or other delimiter (delim is retained)
@@ -447,6 +575,8 @@ LROT_BEGIN(pipe_funcs, NULL, 0)
   LROT_FUNCENTRY( reader, pipe_reader )
   LROT_FUNCENTRY( unread, pipe_unread )
   LROT_FUNCENTRY( nrec, pipe_nrec )
+  LROT_FUNCENTRY( writef, pipe_writef )
+  LROT_FUNCENTRY( concat, pipe_concat )
 LROT_END(pipe_funcs, NULL, 0)
 
 /* Using a index func is needed because the write method is at pipe[1] */
@@ -2,6 +2,7 @@
 #include "lauxlib.h"
 
 #include <string.h>
+#include <math.h>
 
 #include "pixbuf.h"
 #define PIXBUF_METATABLE "pixbuf.buf"
@@ -136,6 +137,61 @@ static int pixbuf_eq_lua(lua_State *L) {
   return 1;
 }
 
+/*
+ * Reciprocal for dividing a byte by fade with a multiply and shift:
+ * (v * m) >> 16 == v / fade holds exactly for all v < 256 and fade < 256.
+ */
+static uint32_t pixbuf_fade_recip(unsigned fade) {
+  return 65535 / fade + 1;
+}
+
+/* Saturate the two 16 bit lanes of x to 255 */
+static uint32_t pixbuf_sat_lanes(uint32_t x) {
+  uint32_t over = (x >> 8) & 0x00FF00FF;
+  over = ((over + 0x00FF00FF) >> 8) & 0x00010001;
+  return (x | (over * 0xFF)) & 0x00FF00FF;
+}
+
+/*
+ * The values array is word aligned, so whole words are handled four bytes at
+ * a time and only the tail byte by byte.
+ */
+static void pixbuf_fade_out(uint8_t *p, size_t n, unsigned fade) {
+  if (fade >= 256) {
+    memset(p, 0, n);
+    return;
+  }
+  const uint32_t m = pixbuf_fade_recip(fade);
+  uint32_t *w = (uint32_t *)p;
+  size_t i;
+  for (i = 0; i < n / 4; i++) {
+    uint32_t v = w[i];
+    w[i] =  (((v & 0xFF) * m) >> 16)
+         | ((((v >>  8) & 0xFF) * m) >> 16) <<  8
+         | ((((v >> 16) & 0xFF) * m) >> 16) << 16
+         | ((((v >> 24)       ) * m) >> 16) << 24;
+  }
+  for (i *= 4; i < n; i++) {
+    p[i] = (p[i] * m) >> 16;
+  }
+}
+
+static void pixbuf_fade_in(uint8_t *p, size_t n, unsigned fade) {
+  fade = MIN(fade, 255);  // 255 already saturates every non zero byte
+  uint32_t *w = (uint32_t *)p;
+  size_t i;
+  for (i = 0; i < n / 4; i++) {
+    uint32_t v = w[i];
+    uint32_t lo = pixbuf_sat_lanes((v & 0x00FF00FF) * fade);
+    uint32_t hi = pixbuf_sat_lanes(((v >> 8) & 0x00FF00FF) * fade);
+    w[i] = lo | (hi << 8);
+  }
+  for (i *= 4; i < n; i++) {
+    unsigned val = p[i] * fade;
+    p[i] = MIN(255, val);
+  }
+}
+
 static int pixbuf_fade_lua(lua_State *L) {
   pixbuf *buffer = pixbuf_from_lua_arg(L, 1);
   const int fade = luaL_checkinteger(L, 2);
@@ -143,19 +199,13 @@ static int pixbuf_fade_lua(lua_State *L) {
 
   luaL_argcheck(L, fade > 0, 2, "fade value should be a strictly positive int");
 
-  uint8_t *p = &buffer->values[0];
-  for (size_t i = 0; i < pixbuf_size(buffer); i++)
-  {
-    if (direction == PIXBUF_FADE_OUT)
-    {
-      *p++ /= fade;
-    }
-    else
-    {
-      // as fade in can result in value overflow, an int is used to perform the check afterwards
-      int val = *p * fade;
-      *p++ = MIN(255, val);
-    }
+  if (fade == 1) {
+    return 0;
+  }
+  if (direction == PIXBUF_FADE_OUT) {
+    pixbuf_fade_out(buffer->values, pixbuf_size(buffer), fade);
+  } else {
+    pixbuf_fade_in(buffer->values, pixbuf_size(buffer), fade);
   }
 
   return 0;
@@ -169,13 +219,14 @@ static int pixbuf_fadeI_lua(lua_State *L) {
 
   luaL_argcheck(L, fade > 0, 2, "fade value should be a strictly positive int");
 
+  const uint32_t m = fade < 256 ? pixbuf_fade_recip(fade) : 0;
   uint8_t *p = &buffer->values[0];
   for (size_t i = 0; i < buffer->npix; i++, p+=buffer->nchan) {
     if (direction == PIXBUF_FADE_OUT) {
-      *p /= fade;
+      *p = (*p * m) >> 16;
     } else {
       int val = *p * fade;
-      *p++ = MIN(255, val);
+      *p = MIN(255, val);
     }
   }
 
@@ -294,9 +345,9 @@ static void pixbuf_mix_raw(pixbuf *out, size_t n_src, struct mix_source* src) {
     }
 
     val += 128; // rounding instead of floor
-    val /= 256; // do not use implemetation dependant right shift
 
-    out->values[c] = (uint8_t)pixbuf_mix_clamp(val);
+    // negative sums clamp to 0, so only non negative ones need shifting
+    out->values[c] = val < 0 ? 0 : (uint8_t)pixbuf_mix_clamp(val >> 8);
   }
 }
 
@@ -327,7 +378,7 @@ static void pixbuf_mix_i3(pixbuf *out, size_t ibits, size_t n_src,
     if (pmaxc == 0) {
       /* Zero value */
       memset(&out->values[4*p], 0, 4);
-      return;
+      continue;
     } else if (pmaxc <= (1 << 16)) {
       /* Minimum global factor */
       maxgi = 1;
@@ -399,12 +450,23 @@ static int pixbuf_mix4I5_lua(lua_State *L) {
 static int pixbuf_power_lua(lua_State *L) {
   pixbuf *buffer = pixbuf_from_lua_arg(L, 1);
 
+  /*
+   * Sum a word at a time in two 16 bit lanes, each gaining at most 510 per
+   * word, so they are folded into the total every 128 words.
+   */
+  const uint32_t *w = (const uint32_t *)buffer->values;
+  size_t n = pixbuf_size(buffer), i = 0;
   int total = 0;
-  size_t p = 0;
-  for (size_t i = 0; i < buffer->npix; i++) {
-    for (size_t j = 0; j < buffer->nchan; j++, p++) {
-      total += buffer->values[p];
+  while (i < n / 4) {
+    size_t end = MIN(n / 4, i + 128);
+    uint32_t acc = 0;
+    for (; i < end; i++) {
+      acc += (w[i] & 0x00FF00FF) + ((w[i] >> 8) & 0x00FF00FF);
     }
+    total += (acc & 0xFFFF) + (acc >> 16);
+  }
+  for (i *= 4; i < n; i++) {
+    total += buffer->values[i];
   }
 
   lua_pushinteger(L, total);
@@ -428,6 +490,52 @@ static int pixbuf_powerI_lua(lua_State *L) {
   return 1;
 }
 
+// lut = pixbuf.lut(gamma, [brightness])
+static int pixbuf_lut_lua(lua_State *L) {
+  const lua_Number gamma = luaL_checknumber(L, 1);
+  const int brightness = luaL_optinteger(L, 2, 255);
+
+  luaL_argcheck(L, gamma > 0, 1, "gamma should be positive");
+  luaL_argcheck(L, brightness >= 0 && brightness <= 255, 2, "brightness out of range");
+
+  char lut[256];
+  for (size_t i = 0; i < sizeof(lut); i++) {
+    lut[i] = (uint8_t)(pow(i / 255.0, gamma) * brightness + 0.5);
+  }
+
+  lua_pushlstring(L, lut, sizeof(lut));
+  return 1;
+}
+
+// buffer:apply(lut) maps every byte through a 256 byte lookup table
+static int pixbuf_apply_lua(lua_State *L) {
+  pixbuf *buffer = pixbuf_from_lua_arg(L, 1);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+
+  luaL_argcheck(L, len == 256, 2, "lookup table should be 256 bytes");
+
+  /* copy the table to RAM, as the string may be in flash */
+  uint8_t lut[256];
+  memcpy(lut, s, sizeof(lut));
+
+  uint32_t *w = (uint32_t *)buffer->values;
+  size_t n = pixbuf_size(buffer), i;
+  for (i = 0; i < n / 4; i++) {
+    uint32_t v = w[i];
+    w[i] =  lut[v & 0xFF]
+         | (lut[(v >>  8) & 0xFF] <<  8)
+         | (lut[(v >> 16) & 0xFF] << 16)
+         | (lut[(v >> 24)       ] << 24);
+  }
+  for (i *= 4; i < n; i++) {
+    buffer->values[i] = lut[buffer->values[i]];
+  }
+
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int pixbuf_replace_lua(lua_State *L) {
   pixbuf *buffer = pixbuf_from_lua_arg(L, 1);
   ptrdiff_t start = posrelat(luaL_optinteger(L, 3, 1), buffer->npix);
@@ -679,6 +787,321 @@ static int pixbuf_tostring_lua(lua_State *L) {
   return 1;
 }
 
+/*
+ * Matrix views.  A view maps (x, y) on a width by height panel to the pixels
+ * of a buffer, from a first pixel on, in the order the panel is wired: along
+ * rows or down columns, each line reversed from the last if serpentine, and
+ * with either origin flipped.  The view holds a reference to its buffer, so
+ * the buffer lives at least as long as any view of it.
+ */
+#define PIXBUF_MATRIX_METATABLE "pixbuf.matrix"
+
+enum pixbuf_matrix_layout {
+  PIXBUF_MATRIX_COLUMNS    = 1,
+  PIXBUF_MATRIX_SERPENTINE = 2,
+  PIXBUF_MATRIX_FLIP_X     = 4,
+  PIXBUF_MATRIX_FLIP_Y     = 8
+};
+
+typedef struct pixbuf_matrix {
+  pixbuf *buf;
+  int buf_ref;
+  int width, height;
+  unsigned layout;
+  size_t first;
+} pixbuf_matrix;
+
+static pixbuf_matrix *pixbuf_matrix_from_lua_arg(lua_State *L, int arg) {
+  pixbuf_matrix *m = luaL_checkudata(L, arg, PIXBUF_MATRIX_METATABLE);
+  if (!m->buf) {
+    luaL_argerror(L, arg, "released matrix");
+  }
+  return m;
+}
+
+/* Byte offset of 0-based (x, y), which must be on the panel */
+static size_t pixbuf_matrix_offset(const pixbuf_matrix *m, int x, int y) {
+  int major, minor, len;
+
+  if (m->layout & PIXBUF_MATRIX_FLIP_X) x = m->width - 1 - x;
+  if (m->layout & PIXBUF_MATRIX_FLIP_Y) y = m->height - 1 - y;
+  if (m->layout & PIXBUF_MATRIX_COLUMNS) {
+    major = x; minor = y; len = m->height;
+  } else {
+    major = y; minor = x; len = m->width;
+  }
+  if ((m->layout & PIXBUF_MATRIX_SERPENTINE) && (major & 1)) {
+    minor = len - 1 - minor;
+  }
+  return (m->first + (size_t)major * len + minor) * m->buf->nchan;
+}
+
+/* Read a color into out[nchan], as a string of one pixel or channel values */
+static void pixbuf_matrix_color(lua_State *L, int arg, size_t nchan, uint8_t *out) {
+  if (lua_type(L, arg) == LUA_TSTRING) {
+    size_t len;
+    const char *s = lua_tolstring(L, arg, &len);
+    luaL_argcheck(L, len == nchan, arg, "string is not one pixel");
+    memcpy(out, s, nchan);
+  } else {
+    for (size_t i = 0; i < nchan; i++) {
+      out[i] = luaL_checkinteger(L, arg + i);
+    }
+  }
+}
+
+/*
+ * Clip the rectangle *x, *y (0-based), *w, *h to the panel; false if nothing
+ * is left.  sx, sy, if given, are moved along with the top left corner.
+ */
+static bool pixbuf_matrix_clip(const pixbuf_matrix *m, int *x, int *y,
+                               int *w, int *h, int *sx, int *sy) {
+  if (*x < 0) { *w += *x; if (sx) *sx -= *x; *x = 0; }
+  if (*y < 0) { *h += *y; if (sy) *sy -= *y; *y = 0; }
+  *w = MIN(*w, m->width - *x);
+  *h = MIN(*h, m->height - *y);
+  return *w > 0 && *h > 0;
+}
+
+// matrix = buffer:matrix(width, height[, layout[, first]])
+static int pixbuf_matrix_lua(lua_State *L) {
+  pixbuf *buffer = pixbuf_from_lua_arg(L, 1);
+  const int width  = luaL_checkinteger(L, 2);
+  const int height = luaL_checkinteger(L, 3);
+  const unsigned layout = luaL_optinteger(L, 4, 0);
+  const int first  = luaL_optinteger(L, 5, 1) - 1;
+
+  luaL_argcheck(L, width > 0, 2, "should be a positive integer");
+  luaL_argcheck(L, height > 0, 3, "should be a positive integer");
+  luaL_argcheck(L, layout < 16, 4, "invalid layout");
+  luaL_argcheck(L, first >= 0 && (size_t)first + (size_t)width * height <= buffer->npix,
+                5, "matrix does not fit into buffer");
+
+  pixbuf_matrix *m = (pixbuf_matrix *)lua_newuserdata(L, sizeof(pixbuf_matrix));
+  m->buf = buffer;
+  m->width = width;
+  m->height = height;
+  m->layout = layout;
+  m->first = first;
+  lua_pushvalue(L, 1);
+  m->buf_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  luaL_getmetatable(L, PIXBUF_MATRIX_METATABLE);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int pixbuf_matrix_free_lua(lua_State *L) {
+  pixbuf_matrix *m = luaL_checkudata(L, 1, PIXBUF_MATRIX_METATABLE);
+  luaL_unref(L, LUA_REGISTRYINDEX, m->buf_ref);
+  m->buf_ref = LUA_NOREF;
+  m->buf = NULL;
+  return 0;
+}
+
+// buffer, width, height = matrix:buffer()
+static int pixbuf_matrix_buffer_lua(lua_State *L) {
+  pixbuf_matrix *m = pixbuf_matrix_from_lua_arg(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, m->buf_ref);
+  lua_pushinteger(L, m->width);
+  lua_pushinteger(L, m->height);
+  return 3;
+}
+
+// index = matrix:index(x, y)
+static int pixbuf_matrix_index_lua(lua_State *L) {
+  pixbuf_matrix *m = pixbuf_matrix_from_lua_arg(L, 1);
+  const int x = luaL_checkinteger(L, 2) - 1;
+  const int y = luaL_checkinteger(L, 3) - 1;
+
+  luaL_argcheck(L, x >= 0 && x < m->width, 2, "index out of range");
+  luaL_argcheck(L, y >= 0 && y < m->height, 3, "index out of range");
+
+  lua_pushinteger(L, pixbuf_matrix_offset(m, x, y) / m->buf->nchan + 1);
+  return 1;
+}
+
+// matrix:get(x, y)
+static int pixbuf_matrix_get_lua(lua_State *L) {
+  pixbuf_matrix *m = pixbuf_matrix_from_lua_arg(L, 1);
+  const int x = luaL_checkinteger(L, 2) - 1;
+  const int y = luaL_checkinteger(L, 3) - 1;
+  const size_t channels = m->buf->nchan;
+
+  luaL_argcheck(L, x >= 0 && x < m->width, 2, "index out of range");
+  luaL_argcheck(L, y >= 0 && y < m->height, 3, "index out of range");
+
+  const uint8_t *p = &m->buf->values[pixbuf_matrix_offset(m, x, y)];
+  luaL_checkstack(L, channels, "too many channels");
+  for (size_t i = 0; i < channels; i++) {
+    lua_pushinteger(L, p[i]);
+  }
+  return channels;
+}
+
+// matrix:set(x, y, color); pixels off the panel are ignored
+static int pixbuf_matrix_set_lua(lua_State *L) {
+  pixbuf_matrix *m = pixbuf_matrix_from_lua_arg(L, 1);
+  const int x = luaL_checkinteger(L, 2) - 1;
+  const int y = luaL_checkinteger(L, 3) - 1;
+  const size_t channels = m->buf->nchan;
+  uint8_t color[channels];
+
+  pixbuf_matrix_color(L, 4, channels, color);
+  if (x >= 0 && x < m->width && y >= 0 && y < m->height) {
+    memcpy(&m->buf->values[pixbuf_matrix_offset(m, x, y)], color, channels);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+// matrix:fill_rect(x, y, w, h, color)
+static int pixbuf_matrix_fill_rect_lua(lua_State *L) {
+  pixbuf_matrix *m = pixbuf_matrix_from_lua_arg(L, 1);
+  int x = luaL_checkinteger(L, 2) - 1;
+  int y = luaL_checkinteger(L, 3) - 1;
+  int w = luaL_checkinteger(L, 4);
+  int h = luaL_checkinteger(L, 5);
+  const size_t channels = m->buf->nchan;
+  uint8_t color[channels];
+
+  pixbuf_matrix_color(L, 6, channels, color);
+  if (pixbuf_matrix_clip(m, &x, &y, &w, &h, NULL, NULL)) {
+    for (int j = y; j < y + h; j++) {
+      for (int i = x; i < x + w; i++) {
+        memcpy(&m->buf->values[pixbuf_matrix_offset(m, i, j)], color, channels);
+      }
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/*
+ * Copy the w by h rectangle at (sx, sy) of src to (dx, dy) of dst, all
+ * clipped and 0-based.  Pixels go through a small temporary run, lines and
+ * runs in the order that leaves a rectangle moved within one view intact.
+ */
+#define PIXBUF_MATRIX_RUN 16
+static void pixbuf_matrix_copy(pixbuf_matrix *dst, int dx, int dy,
+                               const pixbuf_matrix *src, int sx, int sy,
+                               int w, int h) {
+  const size_t channels = dst->buf->nchan;
+  uint8_t run[PIXBUF_MATRIX_RUN * channels];
+  const bool up = dy > sy, back = dx > sx;
+
+  for (int n = 0; n < h; n++) {
+    const int j = up ? h - 1 - n : n;
+    for (int done = 0; done < w; done += PIXBUF_MATRIX_RUN) {
+      const int len = MIN(PIXBUF_MATRIX_RUN, w - done);
+      const int i0 = back ? w - done - len : done;
+      for (int i = 0; i < len; i++) {
+        memcpy(&run[i * channels],
+               &src->buf->values[pixbuf_matrix_offset(src, sx + i0 + i, sy + j)], channels);
+      }
+      for (int i = 0; i < len; i++) {
+        memcpy(&dst->buf->values[pixbuf_matrix_offset(dst, dx + i0 + i, dy + j)],
+               &run[i * channels], channels);
+      }
+    }
+  }
+}
+
+// matrix:blit(source, x, y[, sx, sy, w, h])
+static int pixbuf_matrix_blit_lua(lua_State *L) {
+  pixbuf_matrix *dst = pixbuf_matrix_from_lua_arg(L, 1);
+  pixbuf_matrix *src = pixbuf_matrix_from_lua_arg(L, 2);
+  int dx = luaL_checkinteger(L, 3) - 1;
+  int dy = luaL_checkinteger(L, 4) - 1;
+  int sx = luaL_optinteger(L, 5, 1) - 1;
+  int sy = luaL_optinteger(L, 6, 1) - 1;
+  int w  = luaL_optinteger(L, 7, src->width);
+  int h  = luaL_optinteger(L, 8, src->height);
+
+  luaL_argcheck(L, src->buf->nchan == dst->buf->nchan, 2, "buffers have different channels");
+
+  /* clip to the source, then to the destination */
+  if (pixbuf_matrix_clip(src, &sx, &sy, &w, &h, &dx, &dy) &&
+      pixbuf_matrix_clip(dst, &dx, &dy, &w, &h, &sx, &sy)) {
+    pixbuf_matrix_copy(dst, dx, dy, src, sx, sy, w, h);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+// matrix:scroll(dx, dy[, mode])
+static int pixbuf_matrix_scroll_lua(lua_State *L) {
+  pixbuf_matrix *m = pixbuf_matrix_from_lua_arg(L, 1);
+  const int dx = luaL_checkinteger(L, 2);
+  const int dy = luaL_checkinteger(L, 3);
+  const unsigned mode = luaL_optinteger(L, 4, PIXBUF_SHIFT_LOGICAL);
+  const size_t channels = m->buf->nchan;
+
+  luaL_argcheck(L, mode == PIXBUF_SHIFT_LOGICAL || mode == PIXBUF_SHIFT_CIRCULAR,
+                4, "invalid shift type");
+
+  if (mode == PIXBUF_SHIFT_CIRCULAR) {
+    /* rotate through a copy of the panel, in panel order */
+    const int w = m->width, h = m->height;
+    uint8_t *copy = (uint8_t *)lua_newuserdata(L, (size_t)w * h * channels);
+    for (int j = 0; j < h; j++) {
+      for (int i = 0; i < w; i++) {
+        memcpy(&copy[((size_t)j * w + i) * channels],
+               &m->buf->values[pixbuf_matrix_offset(m, i, j)], channels);
+      }
+    }
+    const int ox = ((-dx % w) + w) % w, oy = ((-dy % h) + h) % h;
+    for (int j = 0; j < h; j++) {
+      const int sj = (j + oy) % h;
+      for (int i = 0; i < w; i++) {
+        memcpy(&m->buf->values[pixbuf_matrix_offset(m, i, j)],
+               &copy[((size_t)sj * w + (i + ox) % w) * channels], channels);
+      }
+    }
+  } else {
+    /* move what stays on the panel, then clear what was uncovered */
+    int sx = -dx, sy = -dy, x = 0, y = 0, w = m->width, h = m->height;
+    uint8_t off[channels];
+    if (pixbuf_matrix_clip(m, &sx, &sy, &w, &h, &x, &y) &&
+        pixbuf_matrix_clip(m, &x, &y, &w, &h, &sx, &sy)) {
+      pixbuf_matrix_copy(m, x, y, m, sx, sy, w, h);
+    } else {
+      x = y = w = h = 0;
+    }
+    memset(off, 0, channels);
+    for (int j = 0; j < m->height; j++) {
+      for (int i = 0; i < m->width; i++) {
+        if (i < x || i >= x + w || j < y || j >= y + h) {
+          memcpy(&m->buf->values[pixbuf_matrix_offset(m, i, j)], off, channels);
+        }
+      }
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+// width, height = matrix:size()
+static int pixbuf_matrix_size_lua(lua_State *L) {
+  pixbuf_matrix *m = pixbuf_matrix_from_lua_arg(L, 1);
+  lua_pushinteger(L, m->width);
+  lua_pushinteger(L, m->height);
+  return 2;
+}
+
+LROT_BEGIN(pixbuf_matrix_map, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, pixbuf_matrix_free_lua )
+  LROT_TABENTRY ( __index, pixbuf_matrix_map )
+
+  LROT_FUNCENTRY( blit, pixbuf_matrix_blit_lua )
+  LROT_FUNCENTRY( buffer, pixbuf_matrix_buffer_lua )
+  LROT_FUNCENTRY( fill_rect, pixbuf_matrix_fill_rect_lua )
+  LROT_FUNCENTRY( get, pixbuf_matrix_get_lua )
+  LROT_FUNCENTRY( index, pixbuf_matrix_index_lua )
+  LROT_FUNCENTRY( scroll, pixbuf_matrix_scroll_lua )
+  LROT_FUNCENTRY( set, pixbuf_matrix_set_lua )
+  LROT_FUNCENTRY( size, pixbuf_matrix_size_lua )
+LROT_END(pixbuf_matrix_map, NULL, LROT_MASK_GC_INDEX)
+
 LROT_BEGIN(pixbuf_map, NULL, LROT_MASK_INDEX | LROT_MASK_EQ)
   LROT_TABENTRY ( __index, pixbuf_map )
   LROT_FUNCENTRY( __eq, pixbuf_eq_lua )
@@ -686,6 +1109,7 @@ LROT_BEGIN(pixbuf_map, NULL, LROT_MASK_INDEX | LROT_MASK_EQ)
   LROT_FUNCENTRY( __concat, pixbuf_concat_lua )
   LROT_FUNCENTRY( __tostring, pixbuf_tostring_lua )
 
+  LROT_FUNCENTRY( apply, pixbuf_apply_lua )
   LROT_FUNCENTRY( channels, pixbuf_channels_lua )
   LROT_FUNCENTRY( dump, pixbuf_dump_lua )
   LROT_FUNCENTRY( fade, pixbuf_fade_lua )
@@ -694,6 +1118,7 @@ LROT_BEGIN(pixbuf_map, NULL, LROT_MASK_INDEX | LROT_MASK_EQ)
   LROT_FUNCENTRY( get, pixbuf_get_lua )
   LROT_FUNCENTRY( replace, pixbuf_replace_lua )
   LROT_FUNCENTRY( map, pixbuf_map_lua )
+  LROT_FUNCENTRY( matrix, pixbuf_matrix_lua )
   LROT_FUNCENTRY( mix, pixbuf_mix_lua )
   LROT_FUNCENTRY( mix4I5, pixbuf_mix4I5_lua )
   LROT_FUNCENTRY( power, pixbuf_power_lua )
@@ -711,11 +1136,18 @@ LROT_BEGIN(pixbuf, NULL, 0)
   LROT_NUMENTRY( SHIFT_CIRCULAR, PIXBUF_SHIFT_CIRCULAR )
   LROT_NUMENTRY( SHIFT_LOGICAL, PIXBUF_SHIFT_LOGICAL )
 
+  LROT_NUMENTRY( MATRIX_COLUMNS, PIXBUF_MATRIX_COLUMNS )
+  LROT_NUMENTRY( MATRIX_SERPENTINE, PIXBUF_MATRIX_SERPENTINE )
+  LROT_NUMENTRY( MATRIX_FLIP_X, PIXBUF_MATRIX_FLIP_X )
+  LROT_NUMENTRY( MATRIX_FLIP_Y, PIXBUF_MATRIX_FLIP_Y )
+
+  LROT_FUNCENTRY( lut, pixbuf_lut_lua )
   LROT_FUNCENTRY( newBuffer, pixbuf_new_lua )
 LROT_END(pixbuf, NULL, 0)
 
 int luaopen_pixbuf(lua_State *L) {
   luaL_rometatable(L, PIXBUF_METATABLE, LROT_TABLEREF(pixbuf_map));
+  luaL_rometatable(L, PIXBUF_MATRIX_METATABLE, LROT_TABLEREF(pixbuf_matrix_map));
   lua_pushrotable(L, LROT_TABLEREF(pixbuf));
   return 1;
 }
@@ -27,7 +27,9 @@ static int lpwm2_get_timer_data(lua_State *L) {
   lua_pushboolean(L, pwm2_get_module_data()->setupData.isStarted);
   lua_pushinteger(L, pwm2_get_module_data()->setupData.interruptTimerCPUTicks);
   lua_pushinteger(L, pwm2_get_module_data()->setupData.interruptTimerTicks);
-  return 3;
+  const pwm2_interrupt_handler_data_t *data = &pwm2_get_module_data()->interruptData;
+  lua_pushinteger(L, data->isEdgeMode ? data->schedule[data->activeSchedule].edgeCount : 0);
+  return 4;
 }
 
 static int lpwm2_get_pin_data(lua_State *L) {
@@ -40,7 +42,8 @@ static int lpwm2_get_pin_data(lua_State *L) {
   lua_pushinteger(L, pwm2_get_module_data()->setupData.pin[pin].frequencyDivisor);
   lua_pushinteger(L, pwm2_get_module_data()->setupData.pin[pin].resolutionCPUTicks);
   lua_pushinteger(L, pwm2_get_module_data()->setupData.pin[pin].resolutionInterruptCounterMultiplier);
-  return 7;
+  lua_pushinteger(L, pwm2_get_module_data()->setupData.pin[pin].phase);
+  return 8;
 }
 
 static int lpwm2_setup_pin_common(lua_State *L, const bool isFreqHz) {
@@ -75,23 +78,55 @@ static int lpwm2_setup_pin_sec(lua_State *L) {
   return lpwm2_setup_pin_common(L, false);
 }
 
+static uint32_t lpwm2_check_duty(lua_State *L, const int pin, const int duty, const int pos) {
+  luaL_argcheck2(L, pin > 0 && pin <= GPIO_PIN_NUM, pos, "invalid pin number");
+  if (!pwm2_is_pin_setup(pin)) {
+    return luaL_error(L, "pwm2 : pin=%d is not setup yet", pin);
+  }
+  luaL_argcheck2(L, duty >= 0 && duty <= pwm2_get_module_data()->setupData.pin[pin].pulseResolutions, pos, "invalid duty");
+  return 0;
+}
+
+// Each entry of the table is pin = duty or pin = {duty, phase}
+static int lpwm2_set_duty_table(lua_State *L) {
+  lua_pushnil(L);
+  while (lua_next(L, 1) != 0) {
+    const int pin = luaL_checkinteger(L, -2);
+    int duty, phase;
+    if (lua_istable(L, -1)) {
+      lua_rawgeti(L, -1, 1);
+      lua_rawgeti(L, -2, 2);
+      duty = luaL_checkinteger(L, -2);
+      phase = luaL_optinteger(L, -1, 0);
+      lua_pop(L, 2);
+    } else {
+      duty = luaL_checkinteger(L, -1);
+      phase = pwm2_get_module_data()->setupData.pin[pin > 0 && pin <= GPIO_PIN_NUM ? pin : 0].phase;
+    }
+    lpwm2_check_duty(L, pin, duty, 1);
+    luaL_argcheck2(L, phase >= 0 && phase < pwm2_get_module_data()->setupData.pin[pin].pulseResolutions, 1, "invalid phase");
+    pwm2_stage_duty(pin, duty, phase);
+    lua_pop(L, 1);
+  }
+  pwm2_apply_duty();
+  return 0;
+}
+
 static int lpwm2_set_duty(lua_State *L) {
+  if (lua_istable(L, 1)) {
+    return lpwm2_set_duty_table(L);
+  }
   int pos = 0;
   while (true) {
     int pin = luaL_optinteger(L, ++pos, -1);
     if (pin == -1) {
       break;
     }
-    luaL_argcheck2(L, pin > 0 && pin <= GPIO_PIN_NUM, pos, "invalid pin number");
-
     int duty = luaL_optinteger(L, ++pos, -1);
-    luaL_argcheck2(L, duty >= 0 && duty <= pwm2_get_module_data()->setupData.pin[pin].pulseResolutions, pos, "invalid duty");
-
-    if (!pwm2_is_pin_setup(pin)) {
-      return luaL_error(L, "pwm2 : pin=%d is not setup yet", pin);
-    }
-    pwm2_set_duty(pin, duty);
+    lpwm2_check_duty(L, pin, duty, pos);
+    pwm2_stage_duty(pin, duty, pwm2_get_module_data()->setupData.pin[pin].phase);
   }
+  pwm2_apply_duty();
   return 0;
 }
 
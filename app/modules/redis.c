@@ -0,0 +1,619 @@
+// Module for a pipelining Redis client, see lua_modules/redis
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "lwip/pbuf.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef LUA_USE_MODULES_REDIS
+#if !defined(LUA_USE_MODULES_NET)
+#error Must have NET if using REDIS module
+#endif
+#endif
+
+/*
+ * Commands are encoded in RESP into a send buffer as they are issued, and the
+ * buffer is written to the socket by a task posted by the first of them, so
+ * that all the commands issued in one task go out in one TCP write without
+ * waiting for each other's replies. What does not fit the send buffer follows
+ * on the "sent" callback. The reply callbacks wait in a queue in command
+ * order, as Redis replies in that order.
+ *
+ * The replies are taken from the receive pbufs by a net sink. They are
+ * collected in a buffer and scanned as they arrive, header line by header
+ * line, keeping count of the values still to come, so a partial reply is not
+ * scanned again when the rest arrives. A complete reply is converted to Lua
+ * values and handed to the callback at the head of the queue, or to the
+ * handler of its channel if it is the message of a subscription.
+ */
+
+extern int net_createConnection(lua_State *L);
+extern int net_connect(lua_State *L);
+extern int net_on(lua_State *L);
+extern int net_send(lua_State *L);
+extern int net_close(lua_State *L);
+extern int net_sendroom(lua_State *L, int ndx);
+extern void *net_sink_attach(lua_State *L, int ndx,
+                             void (*fn)(void *, struct pbuf *), void *arg);
+extern void net_sink_recved(void *sock, u16_t len);
+
+#define REDIS_CLIENT    "redis.client"
+#define REDIS_PORT      6379
+
+#ifndef REDIS_MAXREPLY
+#define REDIS_MAXREPLY  4096      // the largest reply, which is also buffered
+#endif
+#define REDIS_MAXDEPTH  4         // arrays nested deeper are returned as nil
+
+typedef struct {
+  size_t pos;                     // where the next header line starts
+  size_t skip;                    // bulk string bytes still to come
+  int need;                       // values still to come
+} redis_scan_t;
+
+typedef struct {
+  int sock_ref;
+  void *sock;                     // the net sink handle while connected
+  int queue_ref;                  // reply callbacks, or false, in [head, tail]
+  int head, tail;
+  int handlers_ref;               // channel -> message handler
+  int connect_ref;
+  int posted_ref;                 // the client while a flush is posted
+  int subscribed;
+  int busy;                       // in the sink, so the socket must stay
+  int closed;
+  char *tx;
+  size_t tx_len, tx_size;
+  char *rx;
+  size_t rx_len, rx_size;
+  redis_scan_t scan;
+} redis_t;
+
+static platform_task_handle_t redis_task_id;
+
+static redis_t *redis_check(lua_State *L, int ndx) {
+  return (redis_t *)luaL_checkudata(L, ndx, REDIS_CLIENT);
+}
+
+static void redis_close(lua_State *L, redis_t *c, const char *err);
+
+#pragma mark - Replies
+
+/*
+ * Scans on through the reply in b, returning 1 once it is complete, 0 if more
+ * is needed, or -1 if it is not RESP or cannot fit REDIS_MAXREPLY.
+ */
+static int redis_scan(const char *b, size_t len, redis_scan_t *s) {
+  while (s->need) {
+    if (s->skip) {
+      size_t n = len - s->pos;
+      if (n > s->skip)
+        n = s->skip;
+      s->pos += n;
+      s->skip -= n;
+      if (s->skip)
+        return 0;
+      s->need--;
+      continue;
+    }
+    const char *nl = memchr(b + s->pos, '\n', len - s->pos);
+    if (!nl)
+      return 0;
+    char type = b[s->pos];
+    long n = strtol(b + s->pos + 1, NULL, 10);
+    s->pos = nl + 1 - b;
+    switch (type) {
+      case '+':
+      case '-':
+      case ':':
+        s->need--;
+        break;
+      case '$':
+        if (n > REDIS_MAXREPLY)
+          return -1;
+        if (n >= 0)
+          s->skip = n + 2;
+        else
+          s->need--;
+        break;
+      case '*':
+        if (n > REDIS_MAXREPLY / 3)     // no value takes less than 3 bytes
+          return -1;
+        s->need += n > 0 ? n - 1 : -1;
+        break;
+      default:
+        return -1;
+    }
+  }
+  return 1;
+}
+
+static const char *redis_line(const char *p, long *n) {
+  *n = strtol(p + 1, NULL, 10);
+  return strchr(p, '\n') + 1;
+}
+
+// Pushes the complete value at p and returns where the next one starts
+static const char *redis_push(lua_State *L, const char *p, const char *end, int depth) {
+  const char *next;
+  long i, n;
+  switch (*p) {
+    case '+':
+    case '-':
+      next = strchr(p, '\n') + 1;
+      lua_pushlstring(L, p + 1, next - p - 3);
+      return next;
+    case ':':
+      next = redis_line(p, &n);
+      lua_pushinteger(L, n);
+      return next;
+    case '$':
+      next = redis_line(p, &n);
+      if (n < 0) {
+        lua_pushnil(L);
+        return next;
+      }
+      lua_pushlstring(L, next, n);
+      return next + n + 2;
+    default:                                                      /* '*' */
+      if (depth == REDIS_MAXDEPTH) {
+        redis_scan_t s = { 0, 0, 1 };
+        redis_scan(p, end - p, &s);
+        lua_pushnil(L);
+        return p + s.pos;
+      }
+      next = redis_line(p, &n);
+      if (n < 0) {
+        lua_pushnil(L);
+        return next;
+      }
+      lua_createtable(L, n, 0);
+      for (i = 1; i <= n; i++) {
+        next = redis_push(L, next, end, depth + 1);
+        lua_rawseti(L, -2, i);
+      }
+      return next;
+  }
+}
+
+// Hands the reply of len bytes at the start of rx to its handler or callback
+static void redis_dispatch(lua_State *L, redis_t *c, size_t len) {
+  int top = lua_gettop(L);
+  redis_push(L, c->rx, c->rx + len, 0);
+  if (c->subscribed && lua_istable(L, -1)) {         // {"message", chn, msg}
+    lua_rawgeti(L, -1, 1);
+    const char *kind = lua_tostring(L, -1);
+    if (kind && !strcmp(kind, "message")) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, c->handlers_ref);
+      lua_rawgeti(L, top + 1, 2);
+      lua_rawget(L, -2);
+      if (lua_isfunction(L, -1)) {
+        lua_rawgeti(L, top + 1, 2);
+        lua_rawgeti(L, top + 1, 3);
+        luaL_pcallx(L, 2, 0);
+      }
+      lua_settop(L, top);
+      return;
+    }
+    lua_pop(L, 1);
+  }
+  if (c->head > c->tail) {
+    lua_settop(L, top);
+    redis_close(L, c, "unexpected reply");
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->queue_ref);
+  lua_rawgeti(L, -1, c->head);
+  lua_pushnil(L);
+  lua_rawseti(L, -3, c->head++);
+  if (c->head > c->tail)
+    c->head = 1, c->tail = 0;
+  if (lua_isfunction(L, -1)) {
+    if (c->rx[0] == '-') {                   // callback(nil, err) for errors
+      lua_pushnil(L);
+      lua_pushvalue(L, top + 1);
+      luaL_pcallx(L, 2, 0);
+    } else {
+      lua_pushvalue(L, top + 1);
+      luaL_pcallx(L, 1, 0);
+    }
+  }
+  lua_settop(L, top);
+}
+
+static int redis_feed(lua_State *L, redis_t *c, const char *s, size_t l) {
+  while (l && !c->closed) {
+    if (c->rx_len == c->rx_size) {
+      size_t size = c->rx_size ? 2 * c->rx_size : 256;
+      char *rx = NULL;
+      if (c->rx_size < REDIS_MAXREPLY) {
+        if (size > REDIS_MAXREPLY)
+          size = REDIS_MAXREPLY;
+        rx = (char *)realloc(c->rx, size);
+      }
+      if (!rx) {
+        redis_close(L, c, c->rx_size < REDIS_MAXREPLY ? "out of memory"
+                                                      : "reply too long");
+        return 0;
+      }
+      c->rx = rx;
+      c->rx_size = size;
+    }
+    size_t take = c->rx_size - c->rx_len;
+    if (take > l)
+      take = l;
+    memcpy(c->rx + c->rx_len, s, take);
+    c->rx_len += take;
+    s += take;
+    l -= take;
+    int done;
+    while (!c->closed && (done = redis_scan(c->rx, c->rx_len, &c->scan))) {
+      if (done < 0) {
+        redis_close(L, c, "protocol error");
+        return 0;
+      }
+      size_t len = c->scan.pos;
+      redis_dispatch(L, c, len);
+      if (c->closed)
+        break;
+      memmove(c->rx, c->rx + len, c->rx_len - len);
+      c->rx_len -= len;
+      c->scan.pos = c->scan.skip = 0;
+      c->scan.need = 1;
+    }
+  }
+  return !c->closed;
+}
+
+static void redis_release(lua_State *L, redis_t *c) {
+  if (!c->busy) {
+    luaL_unref(L, LUA_REGISTRYINDEX, c->sock_ref);
+    c->sock_ref = LUA_NOREF;
+  }
+}
+
+// The net sink of the socket, called with NULL when the connection has ended
+static void redis_sink(void *arg, struct pbuf *p) {
+  redis_t *c = (redis_t *)arg;
+  lua_State *L = lua_getstate();
+  if (!p) {
+    c->sock = NULL;
+    redis_close(L, c, "closed");
+    return;
+  }
+  int top = lua_gettop(L);
+  u16_t len = p->tot_len;
+  struct pbuf *q;
+  c->busy++;
+  for (q = p; q && redis_feed(L, c, q->payload, q->len); q = q->next) {}
+  pbuf_free(p);
+  c->busy--;
+  if (c->sock)
+    net_sink_recved(c->sock, len);
+  else if (c->closed)
+    redis_release(L, c);
+  lua_settop(L, top);
+}
+
+#pragma mark - Commands
+
+static void redis_flush(lua_State *L, redis_t *c) {
+  if (!c->tx_len || c->sock_ref == LUA_NOREF)
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->sock_ref);
+  int room = c->sock ? net_sendroom(L, -1) : 0;
+  if (room > 0) {
+    size_t n = c->tx_len < (size_t)room ? c->tx_len : (size_t)room;
+    lua_pushcfunction(L, net_send);
+    lua_pushvalue(L, -2);
+    lua_pushlstring(L, c->tx, n);
+    lua_call(L, 2, 0);
+    memmove(c->tx, c->tx + n, c->tx_len - n);
+    c->tx_len -= n;
+  }
+  lua_pop(L, 1);
+}
+
+static void redis_task(platform_task_param_t param, uint8_t prio) {
+  (void) prio;
+  lua_State *L = lua_getstate();
+  lua_rawgeti(L, LUA_REGISTRYINDEX, (int)param);
+  luaL_unref(L, LUA_REGISTRYINDEX, (int)param);
+  redis_t *c = (redis_t *)lua_touserdata(L, -1);
+  c->posted_ref = LUA_NOREF;
+  if (!c->closed)
+    redis_flush(L, c);
+  lua_pop(L, 1);
+}
+
+static void redis_put(lua_State *L, redis_t *c, const char *s, size_t l) {
+  if (c->tx_len + l > c->tx_size) {
+    size_t size = c->tx_size ? c->tx_size : 128;
+    while (size < c->tx_len + l)
+      size *= 2;
+    char *tx = (char *)realloc(c->tx, size);
+    if (!tx)
+      luaL_error(L, "out of memory");
+    c->tx = tx;
+    c->tx_size = size;
+  }
+  memcpy(c->tx + c->tx_len, s, l);
+  c->tx_len += l;
+}
+
+/*
+ * Encodes the values from first to last as a command, queues the callback,
+ * or false, at cb, and posts the flush if there is none posted yet.
+ */
+static void redis_queue(lua_State *L, redis_t *c, int first, int last, int cb) {
+  char hdr[16];
+  int i;
+  if (c->closed)
+    luaL_error(L, "closed");
+  for (i = first; i <= last; i++)
+    luaL_argcheck(L, lua_isstring(L, i), i, "string expected");
+  redis_put(L, c, hdr, sprintf(hdr, "*%d\r\n", last - first + 1));
+  for (i = first; i <= last; i++) {
+    size_t l;
+    const char *s = lua_tolstring(L, i, &l);
+    redis_put(L, c, hdr, sprintf(hdr, "$%u\r\n", (unsigned)l));
+    redis_put(L, c, s, l);
+    redis_put(L, c, "\r\n", 2);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->queue_ref);
+  if (cb)
+    lua_pushvalue(L, cb);
+  else
+    lua_pushboolean(L, 0);
+  lua_rawseti(L, -2, ++c->tail);
+  lua_pop(L, 1);
+  if (c->posted_ref == LUA_NOREF && c->sock) {
+    lua_pushvalue(L, 1);
+    c->posted_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (!platform_post_low(redis_task_id, c->posted_ref)) {
+      luaL_unref(L, LUA_REGISTRYINDEX, c->posted_ref);
+      c->posted_ref = LUA_NOREF;
+      redis_flush(L, c);
+    }
+  }
+}
+
+// Fails the callbacks still queued and lets go of the socket
+static void redis_close(lua_State *L, redis_t *c, const char *err) {
+  if (c->closed)
+    return;
+  c->closed = 1;
+  if (c->sock) {                                // net_close() ends the sink
+    lua_pushcfunction(L, net_close);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->sock_ref);
+    luaL_pcallx(L, 1, 0);
+    c->sock = NULL;
+  }
+  free(c->tx);
+  c->tx = NULL;
+  c->tx_len = c->tx_size = 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->queue_ref);
+  while (c->head <= c->tail) {
+    lua_rawgeti(L, -1, c->head);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, c->head++);
+    if (lua_isfunction(L, -1)) {
+      lua_pushnil(L);
+      lua_pushstring(L, err);
+      luaL_pcallx(L, 2, 0);
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, c->connect_ref);
+  c->connect_ref = LUA_NOREF;
+  redis_release(L, c);
+}
+
+#pragma mark - Socket callbacks
+
+// The "connection" callback of the socket, with the client as upvalue
+static int redis_connected(lua_State *L) {
+  redis_t *c = (redis_t *)lua_touserdata(L, lua_upvalueindex(1));
+  if (c->closed)
+    return 0;
+  c->sock = net_sink_attach(L, 1, redis_sink, c);
+  if (!c->sock) {
+    redis_close(L, c, "closed");
+    return 0;
+  }
+  redis_flush(L, c);           // the commands issued before connecting
+  if (c->connect_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->connect_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, c->connect_ref);
+    c->connect_ref = LUA_NOREF;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    luaL_pcallx(L, 1, 0);
+  }
+  return 0;
+}
+
+// The "disconnection" and "reconnection" callbacks of the socket
+static int redis_disconnected(lua_State *L) {
+  redis_t *c = (redis_t *)lua_touserdata(L, lua_upvalueindex(1));
+  c->sock = NULL;
+  redis_close(L, c, "closed");
+  return 0;
+}
+
+// The "sent" callback of the socket
+static int redis_sent(lua_State *L) {
+  redis_t *c = (redis_t *)lua_touserdata(L, lua_upvalueindex(1));
+  if (!c->closed)
+    redis_flush(L, c);
+  return 0;
+}
+
+static void redis_on(lua_State *L, int sock, const char *event, lua_CFunction fn) {
+  lua_pushcfunction(L, net_on);
+  lua_pushvalue(L, sock);
+  lua_pushstring(L, event);
+  lua_pushvalue(L, -4);
+  lua_pushcclosure(L, fn, 1);
+  lua_call(L, 3, 0);
+}
+
+#pragma mark - Lua API
+
+// Lua: client = redis.connect(host[, port][, function(client)])
+static int redis_connect(lua_State *L) {
+  const char *host = luaL_checkstring(L, 1);
+  int port = REDIS_PORT, cb = 0;
+  if (lua_isnumber(L, 2)) {
+    port = lua_tointeger(L, 2);
+    cb = 3;
+  } else {
+    cb = 2;
+  }
+  if (lua_isnoneornil(L, cb))
+    cb = 0;
+  else
+    luaL_checktype(L, cb, LUA_TFUNCTION);
+
+  redis_t *c = (redis_t *)lua_newuserdata(L, sizeof(redis_t));
+  memset(c, 0, sizeof(redis_t));
+  c->sock_ref = c->queue_ref = c->handlers_ref = LUA_NOREF;
+  c->connect_ref = c->posted_ref = LUA_NOREF;
+  c->head = 1;
+  c->scan.need = 1;
+  luaL_getmetatable(L, REDIS_CLIENT);
+  lua_setmetatable(L, -2);
+  int client = lua_gettop(L);
+  lua_newtable(L);
+  c->queue_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_newtable(L);
+  c->handlers_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (cb) {
+    lua_pushvalue(L, cb);
+    c->connect_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  lua_pushcfunction(L, net_createConnection);
+  lua_call(L, 0, 1);
+  int sock = lua_gettop(L);
+  lua_pushvalue(L, sock);
+  c->sock_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, client);
+  redis_on(L, sock, "connection", redis_connected);
+  redis_on(L, sock, "disconnection", redis_disconnected);
+  redis_on(L, sock, "reconnection", redis_disconnected);
+  redis_on(L, sock, "sent", redis_sent);
+  lua_pop(L, 1);
+
+  lua_pushcfunction(L, net_connect);
+  lua_pushvalue(L, sock);
+  lua_pushinteger(L, port);
+  lua_pushstring(L, host);
+  lua_call(L, 3, 0);
+  lua_pushvalue(L, client);
+  return 1;
+}
+
+// Lua: client:command(name, args...[, function(reply, err)])
+static int redis_command(lua_State *L) {
+  redis_t *c = redis_check(L, 1);
+  int last = lua_gettop(L), cb = 0;
+  if (last > 1 && lua_isfunction(L, last))
+    cb = last--;
+  luaL_checkstring(L, 2);
+  redis_queue(L, c, 2, last, cb);
+  return 0;
+}
+
+// Lua: client:publish(channel, message[, function(reply, err)])
+static int redis_publish(lua_State *L) {
+  redis_t *c = redis_check(L, 1);
+  luaL_checkstring(L, 2);
+  luaL_checkstring(L, 3);
+  int cb = lua_isfunction(L, 4) ? 4 : 0;
+  lua_settop(L, 4);
+  lua_pushliteral(L, "PUBLISH");
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  redis_queue(L, c, 5, 7, cb);
+  return 0;
+}
+
+static void redis_channel(lua_State *L, redis_t *c, const char *cmd, int handler) {
+  luaL_checkstring(L, 2);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, c->handlers_ref);
+  lua_pushvalue(L, 2);
+  if (handler)
+    lua_pushvalue(L, handler);
+  else
+    lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  lua_pushstring(L, cmd);
+  lua_pushvalue(L, 2);
+  redis_queue(L, c, lua_gettop(L) - 1, lua_gettop(L), 0);
+}
+
+// Lua: client:subscribe(channel, function(channel, message))
+static int redis_subscribe(lua_State *L) {
+  redis_t *c = redis_check(L, 1);
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  lua_settop(L, 3);
+  c->subscribed = 1;
+  redis_channel(L, c, "SUBSCRIBE", 3);
+  return 0;
+}
+
+// Lua: client:unsubscribe(channel)
+static int redis_unsubscribe(lua_State *L) {
+  redis_t *c = redis_check(L, 1);
+  lua_settop(L, 2);
+  redis_channel(L, c, "UNSUBSCRIBE", 0);
+  return 0;
+}
+
+// Lua: client:close()
+static int redis_client_close(lua_State *L) {
+  redis_t *c = redis_check(L, 1);
+  redis_close(L, c, "closed");
+  return 0;
+}
+
+static int redis_gc(lua_State *L) {
+  redis_t *c = redis_check(L, 1);
+  luaL_unref(L, LUA_REGISTRYINDEX, c->queue_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, c->handlers_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, c->connect_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, c->sock_ref);
+  c->queue_ref = c->handlers_ref = c->connect_ref = c->sock_ref = LUA_NOREF;
+  free(c->tx);
+  free(c->rx);
+  c->tx = c->rx = NULL;
+  return 0;
+}
+
+LROT_BEGIN(redis_client, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, redis_gc )
+  LROT_TABENTRY( __index, redis_client )
+  LROT_FUNCENTRY( command, redis_command )
+  LROT_FUNCENTRY( publish, redis_publish )
+  LROT_FUNCENTRY( subscribe, redis_subscribe )
+  LROT_FUNCENTRY( unsubscribe, redis_unsubscribe )
+  LROT_FUNCENTRY( close, redis_client_close )
+LROT_END(redis_client, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(redis, NULL, 0)
+  LROT_FUNCENTRY( connect, redis_connect )
+LROT_END(redis, NULL, 0)
+
+static int redis_open(lua_State *L) {
+  luaL_rometatable(L, REDIS_CLIENT, LROT_TABLEREF(redis_client));
+  redis_task_id = platform_task_get_id(redis_task);
+  return 0;
+}
+
+NODEMCU_MODULE(REDIS, "redis", redis, redis_open);
@@ -0,0 +1,520 @@
+// Module for decoding RF and IR remote controls from receiver edges
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "user_interface.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef LUA_USE_MODULES_RFRECV
+#if !defined(GPIO_INTERRUPT_ENABLE)
+#error Must have GPIO_INTERRUPT_ENABLE if using RFRECV module
+#endif
+#endif
+
+/*
+ * The edges of the receiver output are timestamped by the GPIO interrupt into
+ * the batched event ring of the pin (see platform_gpio_set_batch()), and a
+ * task turns them into pulses, each a level and a length, which go through
+ * the state machine of every protocol enabled on the pin. Only the codes the
+ * decoders complete are handed to Lua, so a busy Lua does not miss frames as
+ * long as the ring does not overflow.
+ *
+ * "Mark" is the active level of the receiver: low for IR demodulators, high
+ * for 433MHz receivers, swapped by the invert option.
+ */
+
+#define RFRECV_RING   128     // edges the ISR can buffer per pin
+#define RFRECV_CHUNK  16      // edges taken from the ring at a time
+#define RFRECV_OUT    4       // codes decoded per chunk
+
+#define RFRECV_HOLDOFF_US 200000  // repeats of an rc-switch code ignored within
+#define NEC_REPEAT_US     150000  // a NEC repeat frame ends within this of the last frame
+
+enum { P_NEC, P_RC5, P_RCSWITCH, P_SOMFY };
+static const char * const proto_names[] = { "nec", "rc5", "rcswitch", "somfy", NULL };
+
+// Within 30% of the expected length
+static inline bool near(uint32_t d, uint32_t t) {
+  uint32_t tol = t * 3 / 10;
+  return d + tol >= t && d <= t + tol;
+}
+
+// Manchester coded bits, collected half bit by half bit; each bit is the
+// level of its second half
+typedef struct {
+  uint8_t halves;
+  uint8_t first;
+  uint64_t bits;
+} manchester_t;
+
+static bool man_push(manchester_t *m, uint8_t level, unsigned units) {
+  while (units--) {
+    if ((m->halves & 1) == 0) {
+      m->first = level;
+    } else if (m->first == level) {
+      return false;  // no transition in the middle of the bit
+    } else {
+      m->bits = (m->bits << 1) | level;
+    }
+    m->halves++;
+  }
+  return true;
+}
+
+typedef struct {
+  uint8_t proto;
+  uint32_t a, b, c;
+} rfrecv_code_t;
+
+// rc-switch protocols: pulse length and sync, zero and one as multiples of it
+typedef struct {
+  uint16_t pulse;
+  uint8_t sync[2], zero[2], one[2];
+  bool inverted;
+} rcswitch_proto_t;
+
+static const rcswitch_proto_t rcswitch_protos[] = {
+  { 350, {  1, 31 }, { 1,  3 }, { 3,  1 }, false },  // 1
+  { 650, {  1, 10 }, { 1,  2 }, { 2,  1 }, false },  // 2
+  { 100, { 30, 71 }, { 4, 11 }, { 9,  6 }, false },  // 3
+  { 380, {  1,  6 }, { 1,  3 }, { 3,  1 }, false },  // 4
+  { 500, {  6, 14 }, { 1,  2 }, { 2,  1 }, false },  // 5
+  { 450, { 23,  1 }, { 1,  2 }, { 2,  1 }, true },   // 6 (HT6P20B)
+  { 150, {  2, 62 }, { 1,  6 }, { 6,  1 }, false },  // 7 (HS2303-PT)
+};
+#define RCSWITCH_GAP_US   4300
+#define RCSWITCH_MAX      66      // pulses of a 32 bit code
+
+typedef struct {
+  uint8_t state, n;
+  bool valid;
+  uint8_t last_cmd;
+  uint16_t last_addr;
+  uint32_t code, last_time;
+} nec_t;
+
+typedef struct {
+  uint8_t state;
+  manchester_t m;
+} rc5_t;
+
+typedef struct {
+  uint8_t n;
+  uint16_t gap, t[RCSWITCH_MAX];
+  uint32_t last_code, last_time;
+} rcswitch_t;
+
+typedef struct {
+  uint8_t state, hw;
+  uint16_t last_rolling;
+  uint32_t last_addr;
+  manchester_t m;
+} somfy_t;
+
+typedef struct {
+  uint8_t protos, invert, level;
+  uint8_t nout;
+  int cb_ref;
+  uint32_t last;                  // time of the last edge
+  rfrecv_code_t out[RFRECV_OUT];
+  nec_t nec;
+  rc5_t rc5;
+  rcswitch_t rcsw;
+  somfy_t somfy;
+} rfrecv_t;
+
+static rfrecv_t *rx[GPIO_PIN_NUM];
+static platform_task_handle_t rfrecv_task_id;
+
+static void emit(rfrecv_t *r, uint8_t proto, uint32_t a, uint32_t b, uint32_t c) {
+  if (r->nout < RFRECV_OUT) {
+    rfrecv_code_t *o = &r->out[r->nout++];
+    o->proto = proto; o->a = a; o->b = b; o->c = c;
+  }
+}
+
+// ****************************************************************************
+// NEC: 9ms mark, 4.5ms space, 32 bits LSB first as 562us marks followed by
+// 562us (0) or 1687us (1) spaces, and a final mark. A held key sends repeat
+// frames of a 9ms mark, a 2.25ms space and a mark.
+
+enum { NEC_IDLE, NEC_LEADER, NEC_MARK, NEC_SPACE, NEC_REPEAT };
+
+static void nec_pulse(rfrecv_t *r, bool mark, uint32_t d) {
+  nec_t *s = &r->nec;
+
+  switch (s->state) {
+    case NEC_LEADER:
+      if (!mark && near(d, 4500)) {
+        s->state = NEC_MARK;
+        s->n = 0;
+        s->code = 0;
+        return;
+      }
+      if (!mark && near(d, 2250)) {
+        s->state = NEC_REPEAT;
+        return;
+      }
+      break;
+    case NEC_MARK:
+      if (mark && near(d, 562)) {
+        if (s->n < 32) {
+          s->state = NEC_SPACE;
+          return;
+        }
+        uint8_t cmd = s->code >> 16;
+        if ((cmd ^ (s->code >> 24)) == 0xff) {
+          // an address without its complement is the 16-bit extended one
+          uint8_t addr = s->code;
+          s->last_addr = (addr ^ (uint8_t)(s->code >> 8)) == 0xff ? addr : (uint16_t)s->code;
+          s->last_cmd = cmd;
+          s->last_time = r->last;
+          s->valid = true;
+          emit(r, P_NEC, s->last_addr, cmd, false);
+        }
+      }
+      break;
+    case NEC_SPACE:
+      if (!mark && (near(d, 562) || near(d, 1687))) {
+        if (d > 1100)
+          s->code |= 1UL << s->n;
+        s->n++;
+        s->state = NEC_MARK;
+        return;
+      }
+      break;
+    case NEC_REPEAT:
+      if (mark && near(d, 562) && s->valid &&
+          ((r->last - s->last_time) & 0x7fffffff) < NEC_REPEAT_US) {
+        s->last_time = r->last;
+        emit(r, P_NEC, s->last_addr, s->last_cmd, true);
+      }
+      break;
+  }
+  s->state = mark && near(d, 9000) ? NEC_LEADER : NEC_IDLE;
+}
+
+// ****************************************************************************
+// RC5: 14 Manchester bits of 1778us, a 1 being a space then a mark: start
+// bit (1), field bit (inverted bit 6 of the command), toggle, 5 bits of
+// address and 6 of command, MSB first.
+
+enum { RC5_IDLE, RC5_READY, RC5_DATA };
+#define RC5_HALVES 28
+
+static void rc5_pulse(rfrecv_t *r, bool mark, uint32_t d) {
+  rc5_t *s = &r->rc5;
+  unsigned units = near(d, 889) ? 1 : near(d, 1778) ? 2 : 0;
+  bool silence = !mark && !units;
+
+  switch (s->state) {
+    case RC5_READY:
+      if (mark && units) {
+        // the space before the first mark is the first half of the start bit
+        memset(&s->m, 0, sizeof(s->m));
+        man_push(&s->m, 0, 1);
+        s->state = RC5_DATA;
+      } else {
+        break;
+      }
+      // fall through
+    case RC5_DATA:
+      if (silence && s->m.halves == RC5_HALVES - 1) {
+        // the last half of a trailing 0 is the silence after the frame
+        units = 1;
+      }
+      if (!units || !man_push(&s->m, mark, units) || s->m.halves > RC5_HALVES) {
+        break;
+      }
+      if (s->m.halves == RC5_HALVES) {
+        uint32_t bits = s->m.bits;
+        if (bits & (1 << 13)) {
+          uint32_t cmd = (bits & 0x3f) | (bits & (1 << 12) ? 0 : 0x40);
+          emit(r, P_RC5, (bits >> 6) & 0x1f, cmd, (bits >> 11) & 1);
+        }
+        break;
+      }
+      return;
+  }
+  // a frame only starts after a silence
+  s->state = silence ? RC5_READY : RC5_IDLE;
+}
+
+// ****************************************************************************
+// rc-switch: the pulses between two similar gaps (the long half of the sync)
+// are decoded as pairs against each protocol, with a pulse length derived
+// from the gap, as the rc-switch library does.
+
+static bool rcswitch_try(const rcswitch_proto_t *p, uint32_t gap, const uint16_t *t,
+                         unsigned n, uint32_t *code) {
+  unsigned sync = p->sync[0] > p->sync[1] ? p->sync[0] : p->sync[1];
+  uint32_t delay = gap / sync, tol = delay * 60 / 100;
+  uint32_t c = 0;
+  unsigned i;
+
+#define MATCH(d, f) ((d) + tol >= delay * (f) && (d) <= delay * (f) + tol)
+  for (i = p->inverted ? 1 : 0; i + 1 < n; i += 2) {
+    c <<= 1;
+    if (MATCH(t[i], p->zero[0]) && MATCH(t[i + 1], p->zero[1]))
+      ;
+    else if (MATCH(t[i], p->one[0]) && MATCH(t[i + 1], p->one[1]))
+      c |= 1;
+    else
+      return false;
+  }
+#undef MATCH
+  *code = c;
+  return true;
+}
+
+static void rcswitch_pulse(rfrecv_t *r, uint32_t d) {
+  rcswitch_t *s = &r->rcsw;
+
+  if (d > RCSWITCH_GAP_US) {
+    uint32_t code;
+    unsigned p;
+    if (s->gap && s->n > 6 && d + 200 > s->gap && d < s->gap + 200u) {
+      for (p = 0; p < sizeof(rcswitch_protos) / sizeof(rcswitch_protos[0]); p++) {
+        if (!rcswitch_try(&rcswitch_protos[p], s->gap, s->t, s->n, &code))
+          continue;
+        if (code != s->last_code ||
+            ((r->last - s->last_time) & 0x7fffffff) > RFRECV_HOLDOFF_US)
+          emit(r, P_RCSWITCH, code, s->n / 2, p + 1);
+        s->last_code = code;
+        s->last_time = r->last;
+        break;
+      }
+    }
+    s->gap = d > 0xffff ? 0 : d;
+    s->n = 0;
+  } else if (s->n < RCSWITCH_MAX) {
+    s->t[s->n++] = d;
+  } else {
+    s->gap = 0;
+    s->n = 0;
+  }
+}
+
+// ****************************************************************************
+// Somfy RTS: hardware syncs of 2560us high and low, a 4550us software sync,
+// a 640us low and 56 Manchester bits of 1280us, a 1 being low then high,
+// MSB first. The 7 bytes are obfuscated by xoring each with the one before.
+
+enum { SOMFY_IDLE, SOMFY_SYNC, SOMFY_DATA };
+#define SOMFY_HALVES 112
+
+static void somfy_frame(rfrecv_t *r, uint64_t bits) {
+  somfy_t *s = &r->somfy;
+  uint8_t p[7], f[7], ck = 0;
+  int i;
+
+  for (i = 0; i < 7; i++)
+    p[i] = bits >> (8 * (6 - i));
+  f[0] = p[0];
+  for (i = 1; i < 7; i++)
+    f[i] = p[i] ^ p[i - 1];
+  for (i = 0; i < 7; i++)
+    ck ^= f[i] ^ (f[i] >> 4);
+  if (ck & 0x0f)
+    return;
+
+  uint16_t rolling = (f[2] << 8) | f[3];
+  uint32_t addr = ((uint32_t)f[4] << 16) | (f[5] << 8) | f[6];
+  // the frame is repeated while the button is held, with the same code
+  if (rolling == s->last_rolling && addr == s->last_addr)
+    return;
+  s->last_rolling = rolling;
+  s->last_addr = addr;
+  emit(r, P_SOMFY, addr, f[1] >> 4, rolling);
+}
+
+static void somfy_pulse(rfrecv_t *r, bool mark, uint32_t d) {
+  somfy_t *s = &r->somfy;
+  unsigned units;
+
+  switch (s->state) {
+    case SOMFY_IDLE:
+      if (mark && near(d, 4550) && s->hw >= 4) {
+        s->state = SOMFY_SYNC;
+      } else if (near(d, 2560)) {
+        s->hw++;
+        return;
+      }
+      s->hw = 0;
+      return;
+    case SOMFY_SYNC:
+      // the 640us low, merged with the first half of a leading 1
+      memset(&s->m, 0, sizeof(s->m));
+      if (!mark && (near(d, 640) || (near(d, 1280) && man_push(&s->m, 0, 1)))) {
+        s->state = SOMFY_DATA;
+        return;
+      }
+      break;
+    case SOMFY_DATA:
+      units = near(d, 640) ? 1 : near(d, 1280) ? 2 : 0;
+      if (!units && !mark && s->m.halves == SOMFY_HALVES - 1)
+        units = 1;  // a trailing 0 ends in the silence after the frame
+      if (!units || !man_push(&s->m, mark, units) || s->m.halves > SOMFY_HALVES)
+        break;
+      if (s->m.halves < SOMFY_HALVES)
+        return;
+      somfy_frame(r, s->m.bits);
+      break;
+  }
+  s->state = SOMFY_IDLE;
+  s->hw = 0;
+}
+
+// ****************************************************************************
+
+static void rfrecv_reset(rfrecv_t *r) {
+  r->nec.state = NEC_IDLE;
+  r->rc5.state = RC5_IDLE;
+  r->rcsw.gap = r->rcsw.n = 0;
+  r->somfy.state = SOMFY_IDLE;
+  r->somfy.hw = 0;
+}
+
+// An edge ends the pulse of the level since the edge before
+static void rfrecv_edge(rfrecv_t *r, uint32_t ev) {
+  uint8_t level = PLATFORM_GPIO_BATCH_LEVEL(ev);
+  uint32_t now = PLATFORM_GPIO_BATCH_TIME(ev);
+  uint32_t d = (now - r->last) & 0x7fffffff;
+  bool pulse = r->level ^ r->invert;  // high, except for IR receivers
+
+  r->last = now;
+  if (level == r->level) {
+    // an edge too short to be seen, so the length of the pulse is unknown
+    rfrecv_reset(r);
+    return;
+  }
+  r->level = level;
+
+  if (r->protos & (1 << P_NEC))
+    nec_pulse(r, !pulse, d);
+  if (r->protos & (1 << P_RC5))
+    rc5_pulse(r, !pulse, d);
+  if (r->protos & (1 << P_RCSWITCH))
+    rcswitch_pulse(r, d);
+  if (r->protos & (1 << P_SOMFY))
+    somfy_pulse(r, pulse, d);
+}
+
+// Call back with the codes decoded; false if the callback stopped the pin
+static bool rfrecv_deliver(rfrecv_t *r, unsigned pin) {
+  lua_State *L = lua_getstate();
+  rfrecv_code_t out[RFRECV_OUT];
+  unsigned i, n = r->nout;
+
+  memcpy(out, r->out, n * sizeof(out[0]));
+  r->nout = 0;
+  for (i = 0; i < n && rx[pin] == r; i++) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, r->cb_ref);
+    lua_pushstring(L, proto_names[out[i].proto]);
+    lua_pushinteger(L, out[i].a);
+    lua_pushinteger(L, out[i].b);
+    if (out[i].proto == P_NEC)
+      lua_pushboolean(L, out[i].c);
+    else
+      lua_pushinteger(L, out[i].c);
+    luaL_pcallx(L, 4, 0);
+  }
+  return rx[pin] == r;
+}
+
+static void rfrecv_task(platform_task_param_t param, uint8_t prio) {
+  unsigned pin = param, i, n;
+  uint32_t ev[RFRECV_CHUNK], dropped;
+  rfrecv_t *r = pin < GPIO_PIN_NUM ? rx[pin] : NULL;
+  (void)prio;
+
+  if (!r)
+    return;
+  do {
+    n = platform_gpio_get_batch(pin, ev, RFRECV_CHUNK, &dropped);
+    if (dropped)
+      rfrecv_reset(r);
+    for (i = 0; i < n; i++)
+      rfrecv_edge(r, ev[i]);
+    if (r->nout && !rfrecv_deliver(r, pin))
+      return;
+  } while (n == RFRECV_CHUNK);
+}
+
+static void rfrecv_stop(lua_State *L, unsigned pin) {
+  rfrecv_t *r = rx[pin];
+
+  if (!r)
+    return;
+  platform_gpio_intr_init(pin, GPIO_PIN_INTR_DISABLE);
+  platform_gpio_set_batch(pin, 0, 0);
+  rx[pin] = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, r->cb_ref);
+  free(r);
+}
+
+// Lua: rfrecv.on(pin, protocols, function(protocol, a, b, c)[, invert])
+static int rfrecv_on(lua_State *L) {
+  unsigned pin = luaL_checkinteger(L, 1);
+  uint8_t protos = 0;
+
+  luaL_argcheck(L, platform_gpio_exists(pin) && pin > 0, 1, "invalid interrupt pin");
+  if (lua_istable(L, 2)) {
+    int i, n = lua_objlen(L, 2);
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, 2, i);
+      protos |= 1 << luaL_checkoption(L, -1, NULL, proto_names);
+      lua_pop(L, 1);
+    }
+  } else {
+    protos = 1 << luaL_checkoption(L, 2, NULL, proto_names);
+  }
+  luaL_argcheck(L, protos, 2, "no protocol");
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  bool invert = lua_toboolean(L, 4);
+
+  rfrecv_stop(L, pin);
+  rfrecv_t *r = calloc(1, sizeof(rfrecv_t));
+  if (!r)
+    return luaL_error(L, "out of memory");
+  r->protos = protos;
+  r->invert = invert;
+  lua_pushvalue(L, 3);
+  r->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  if (!platform_gpio_set_batch(pin, RFRECV_RING, rfrecv_task_id)) {
+    luaL_unref(L, LUA_REGISTRYINDEX, r->cb_ref);
+    free(r);
+    return luaL_error(L, "cannot allocate event ring");
+  }
+  rx[pin] = r;
+  platform_gpio_mode(pin, PLATFORM_GPIO_INT, PLATFORM_GPIO_PULLUP);
+  r->level = platform_gpio_read(pin);
+  r->last = system_get_time() & 0x7fffffff;
+  platform_gpio_intr_init(pin, GPIO_PIN_INTR_ANYEDGE);
+  return 0;
+}
+
+// Lua: rfrecv.off(pin)
+static int rfrecv_off(lua_State *L) {
+  unsigned pin = luaL_checkinteger(L, 1);
+
+  luaL_argcheck(L, platform_gpio_exists(pin), 1, "invalid pin");
+  rfrecv_stop(L, pin);
+  return 0;
+}
+
+LROT_BEGIN(rfrecv, NULL, 0)
+  LROT_FUNCENTRY( on, rfrecv_on )
+  LROT_FUNCENTRY( off, rfrecv_off )
+LROT_END(rfrecv, NULL, 0)
+
+int luaopen_rfrecv(lua_State *L) {
+  rfrecv_task_id = platform_task_get_id(rfrecv_task);
+  return 0;
+}
+
+NODEMCU_MODULE(RFRECV, "rfrecv", rfrecv, luaopen_rfrecv);
@@ -49,12 +49,25 @@ typedef struct {
   uint32_t last_event_time;
   int callback[CALLBACK_COUNT];
   ETSTimer timer;
+  // TURN coalescing, only used when coalesce_us is set
+  uint32_t coalesce_us;
+  int turn_timer_running : 1;
+  int turn_reported : 1;
+  int32_t turn_pos;		// position at the last TURN callback
+  uint32_t turn_count;		// events accumulated since then
+  uint32_t turn_first_time;
+  uint32_t turn_last_time;
+  uint32_t turn_report_time;	// time of the last TURN callback
+  uint32_t turn_report_last_time;	// last event time in that callback
+  int32_t turn_velocity;	// velocity in that callback
+  ETSTimer turn_timer;
 } DATA;
 
 static DATA *data[ROTARY_CHANNEL_COUNT];
 static task_handle_t tasknumber;
 static void lrotary_timer_done(void *param);
 static void lrotary_check_timer(DATA *d, uint32_t time_us, bool dotimer);
+static void lrotary_turn_timer_done(void *param);
 
 static void callback_free_one(lua_State *L, int *cb_ptr)
 {
@@ -125,6 +138,87 @@ static void callback_call(lua_State* L, DATA *d, int cbnum, int arg, uint32_t ti
   }
 }
 
+// Reports the turning since the last TURN callback as one callback with the
+// delta, the velocity in steps/s and the acceleration in steps/s/s
+static void lrotary_turn_flush(lua_State* L, DATA *d)
+{
+  if (d->turn_timer_running) {
+    os_timer_disarm(&d->turn_timer);
+    d->turn_timer_running = 0;
+  }
+  if (!d->turn_count) {
+    return;
+  }
+
+  int32_t pos = (d->lastpos << 1) >> 1;
+  int32_t delta = pos - d->turn_pos;
+  int32_t previous = 0;
+  uint32_t start;
+
+  if (d->turn_reported && d->turn_first_time - d->turn_report_last_time <= d->coalesce_us) {
+    // still spinning, so measure from the last event already reported
+    start = d->turn_report_last_time;
+    previous = d->turn_velocity;
+  } else {
+    // a fresh spin is taken to have lasted at least one interval
+    start = d->turn_first_time - d->coalesce_us;
+  }
+  uint32_t span = d->turn_last_time - start;
+  if (span == 0) {
+    span = 1;
+  }
+  int32_t velocity = (int32_t) ((int64_t) delta * 1000000 / span);
+  int32_t acceleration = (int32_t) ((int64_t) (velocity - previous) * 1000000 / span);
+
+  d->turn_pos = pos;
+  d->turn_count = 0;
+  d->turn_reported = 1;
+  d->turn_report_time = system_get_time();
+  d->turn_report_last_time = d->turn_last_time;
+  d->turn_velocity = velocity;
+
+  int cb = d->callback[ROTARY_TURN_INDEX];
+  if (cb != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb);
+
+    lua_pushinteger(L, MASK(TURN));
+    lua_pushinteger(L, pos);
+    lua_pushinteger(L, d->turn_last_time);
+    lua_pushinteger(L, delta);
+    lua_pushinteger(L, velocity);
+    lua_pushinteger(L, acceleration);
+
+    luaL_pcallx(L, 6, 0);
+  }
+}
+
+// Accumulates a turn event, and reports at most once per interval
+static void lrotary_turn_coalesce(lua_State* L, DATA *d, uint32_t time_us)
+{
+  if (!d->turn_count) {
+    d->turn_first_time = time_us;
+  }
+  d->turn_count++;
+  d->turn_last_time = time_us;
+
+  uint32_t since = system_get_time() - d->turn_report_time;
+  if (!d->turn_reported || since >= d->coalesce_us) {
+    lrotary_turn_flush(L, d);
+  } else if (!d->turn_timer_running) {
+    d->turn_timer_running = 1;
+    os_timer_arm(&d->turn_timer, (d->coalesce_us - since + 999) / 1000, 0);
+  }
+}
+
+static void lrotary_turn_timer_done(void *param)
+{
+  DATA *d = (DATA *) param;
+
+  d->turn_timer_running = 0;
+
+  lrotary_turn_flush(lua_getstate(), d);
+}
+
 int platform_rotary_exists( unsigned int id )
 {
   return (id < ROTARY_CHANNEL_COUNT);
@@ -132,7 +226,7 @@ int platform_rotary_exists( unsigned int id )
 
 #include "pm/swtimer.h"
 
-// Lua: setup(id, phase_a, phase_b [, press])
+// Lua: setup(id, phase_a, phase_b [, press [, longpress_ms [, dblclick_ms [, coalesce_ms]]]])
 static int lrotary_setup( lua_State* L )
 {
   unsigned int id;
@@ -153,11 +247,15 @@ static int lrotary_setup( lua_State* L )
   }
 
   DATA *d = data[id];
+  os_timer_disarm(&d->timer);
+  os_timer_disarm(&d->turn_timer);
   memset(d, 0, sizeof(*d));
 
   d->id = id;
 
   os_timer_setfn(&d->timer, lrotary_timer_done, (void *) d);
+  os_timer_setfn(&d->turn_timer, lrotary_turn_timer_done, (void *) d);
+  SWTIMER_REG_CB(lrotary_turn_timer_done, SWTIMER_RESUME);
   SWTIMER_REG_CB(lrotary_timer_done, SWTIMER_RESUME);
     //lrotary_timer_done checks time elapsed since last event
     //My guess: Since proper functionality relies on some variables to be reset via timer callback and state would be invalid anyway.
@@ -194,6 +292,12 @@ static int lrotary_setup( lua_State* L )
     luaL_argcheck(L, d->click_delay_us > 0, 6, "Invalid timeout");
   }
 
+  if (lua_gettop(L) >= 7) {
+    int coalesce_ms = luaL_checkinteger(L, 7);
+    luaL_argcheck(L, coalesce_ms >= 0 && coalesce_ms <= 10000, 7, "Invalid interval");
+    d->coalesce_us = 1000 * coalesce_ms;
+  }
+
   if (rotary_setup(id, phase_a, phase_b, press, tasknumber)) {
     return luaL_error(L, "Unable to setup rotary switch.");
   }
@@ -211,6 +315,8 @@ static int lrotary_close( lua_State* L )
 
   DATA *d = data[id];
   if (d) {
+    os_timer_disarm(&d->timer);
+    os_timer_disarm(&d->turn_timer);
     data[id] = NULL;
     free(d);
   }
@@ -278,9 +384,18 @@ static bool lrotary_dequeue_single(lua_State* L, DATA *d)
 	// We have something to enqueue
 	if ((pos ^ d->lastpos) & 0x7fffffff) {
 	  // Some turning has happened
-	  callback_call(L, d, ROTARY_TURN_INDEX, (pos << 1) >> 1, result.time_us);
+	  if (d->coalesce_us) {
+	    d->lastpos = (d->lastpos & 0x80000000) | (pos & 0x7fffffff);
+	    lrotary_turn_coalesce(L, d, result.time_us);
+	  } else {
+	    callback_call(L, d, ROTARY_TURN_INDEX, (pos << 1) >> 1, result.time_us);
+	  }
 	}
 	if ((pos ^ d->lastpos) & 0x80000000) {
+	  // keep the turning in order with the press
+	  if (d->coalesce_us) {
+	    lrotary_turn_flush(L, d);
+	  }
 	  // pressing or releasing has happened
 	  callback_call(L, d, (pos & 0x80000000) ? ROTARY_PRESS_INDEX : ROTARY_RELEASE_INDEX, (pos << 1) >> 1, result.time_us);
 	  if (pos & 0x80000000) {
@@ -8,12 +8,13 @@
 #include "rtc/rtcfifo.h"
 #include <string.h>
 
-// rtcfifo.prepare ([{sensor_count=n, interval_us=m, storage_begin=x, storage_end=y}])
+// rtcfifo.prepare ([{sensor_count=n, interval_us=m, storage_begin=x, storage_end=y, packed=b}])
 static int rtcfifo_prepare (lua_State *L)
 {
   uint32_t sensor_count = RTC_DEFAULT_TAGCOUNT;
   uint32_t interval_us = 0;
   int first = -1, last = -1;
+  int packed = 0;
 
   if (lua_istable (L, 1))
   {
@@ -37,6 +38,10 @@ static int rtcfifo_prepare (lua_State *L)
     if (lua_isnumber (L, -1))
       last = lua_tointeger (L, -1);
     lua_pop (L, 1);
+
+    lua_getfield (L, 1, "packed");
+    packed = lua_toboolean (L, -1);
+    lua_pop (L, 1);
   }
   else if (!lua_isnone (L, 1))
     return luaL_error (L, "expected table as arg #1");
@@ -44,7 +49,12 @@ static int rtcfifo_prepare (lua_State *L)
   rtc_fifo_prepare (0, interval_us, sensor_count);
 
   if (first != -1 && last != -1)
+  {
     rtc_fifo_put_loc (first, last, sensor_count);
+    rtc_fifo_clear_content ();
+  }
+  if (packed)
+    rtc_fifo_use_packed ();
 
   return 0;
 }
@@ -64,29 +74,59 @@ static void check_fifo_magic (lua_State *L)
 }
 
 
-// rtcfifo.put (timestamp, value, decimals, sensor_name)
-static int rtcfifo_put (lua_State *L)
+// Fills in a sample from the four values at stack index ndx onwards
+static void check_sample (lua_State *L, int ndx, sample_t *s)
 {
-  check_fifo_magic (L);
-
-  sample_t s;
-  s.timestamp = luaL_checkinteger (L, 1);
-  s.value = luaL_checkinteger (L, 2);
-  s.decimals = luaL_checkinteger (L, 3);
+  s->timestamp = luaL_checkinteger (L, ndx);
+  s->value = luaL_checkinteger (L, ndx + 1);
+  s->decimals = luaL_checkinteger (L, ndx + 2);
   size_t len;
-  const char *str = luaL_checklstring (L, 4, &len);
+  const char *str = luaL_checklstring (L, ndx + 3, &len);
   union {
     uint32_t u;
     char s[4];
   } conv = { 0 };
   strncpy (conv.s, str, len > 4 ? 4 : len);
-  s.tag = conv.u;
+  s->tag = conv.u;
+}
+
+
+// rtcfifo.put (timestamp, value, decimals, sensor_name)
+static int rtcfifo_put (lua_State *L)
+{
+  check_fifo_magic (L);
+
+  sample_t s;
+  check_sample (L, 1, &s);
 
   rtc_fifo_store_sample (&s);
   return 0;
 }
 
 
+// rtcfifo.putmany ({timestamp1, value1, decimals1, sensor_name1, timestamp2, ...})
+static int rtcfifo_putmany (lua_State *L)
+{
+  check_fifo_magic (L);
+  luaL_checktype (L, 1, LUA_TTABLE);
+
+  int n = lua_objlen (L, 1);
+  luaL_argcheck (L, n % 4 == 0, 1, "expected groups of 4 values");
+
+  int i, j;
+  for (i = 1; i <= n; i += 4)
+  {
+    for (j = 0; j < 4; j++)
+      lua_rawgeti (L, 1, i + j);
+    sample_t s;
+    check_sample (L, 2, &s);
+    lua_settop (L, 1);
+    rtc_fifo_store_sample (&s);
+  }
+  return 0;
+}
+
+
 static int extract_sample (lua_State *L, const sample_t *s)
 {
   lua_pushinteger (L, s->timestamp);
@@ -104,6 +144,31 @@ static int extract_sample (lua_State *L, const sample_t *s)
 }
 
 
+// {timestamp1, value1, decimals1, sensor_name1, timestamp2, ...} = rtcfifo.popall ([max])
+static int rtcfifo_popall (lua_State *L)
+{
+  check_fifo_magic (L);
+
+  uint32_t count = rtc_fifo_get_count ();
+  if (lua_isnumber (L, 1) && lua_tointeger (L, 1) < count)
+    count = lua_tointeger (L, 1) > 0 ? lua_tointeger (L, 1) : 0;
+
+  lua_createtable (L, count * 4, 0);
+  uint32_t i;
+  int j;
+  for (i = 0; i < count; i++)
+  {
+    sample_t s;
+    if (!rtc_fifo_pop_sample (&s))
+      break;
+    extract_sample (L, &s);
+    for (j = 4; j >= 1; j--)
+      lua_rawseti (L, -1 - j, i * 4 + j);
+  }
+  return 1;
+}
+
+
 // timestamp, value, decimals, sensor_name = rtcfifo.pop ()
 static int rtcfifo_pop (lua_State *L)
 {
@@ -170,7 +235,9 @@ LROT_BEGIN(rtcfifo, NULL, 0)
   LROT_FUNCENTRY( prepare, rtcfifo_prepare )
   LROT_FUNCENTRY( ready, rtcfifo_ready )
   LROT_FUNCENTRY( put, rtcfifo_put )
+  LROT_FUNCENTRY( putmany, rtcfifo_putmany )
   LROT_FUNCENTRY( pop, rtcfifo_pop )
+  LROT_FUNCENTRY( popall, rtcfifo_popall )
   LROT_FUNCENTRY( peek, rtcfifo_peek )
   LROT_FUNCENTRY( drop, rtcfifo_drop )
   LROT_FUNCENTRY( count, rtcfifo_count )
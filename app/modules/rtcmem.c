@@ -3,6 +3,47 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "rtc/rtcaccess.h"
+#include "uzlib.h"
+#include <string.h>
+
+#define RTCMEM_BYTES (RTC_USER_MEM_NUM_DWORDS * 4)
+
+// Marks the header of a block stored by rtcmem.save(), with the length in
+// the low half
+#define RTCMEM_SAVED_MAGIC 0x53560000
+
+// The memory only takes 32bit accesses, so bytes are read and written
+// by the word
+static void rtcmem_get (luaL_Buffer *b, uint32_t off, uint32_t len, uint32_t *crc)
+{
+  while (len > 0)
+  {
+    uint32_t word = rtc_mem_read (off / 4);
+    uint32_t skip = off & 3;
+    uint32_t n = (len < 4 - skip) ? len : 4 - skip;
+    const char *p = (const char *) &word + skip;
+    if (crc)
+      *crc = uzlib_crc32 (p, n, *crc);
+    luaL_addlstring (b, p, n);
+    off += n;
+    len -= n;
+  }
+}
+
+static void rtcmem_put (uint32_t off, const char *data, uint32_t len)
+{
+  while (len > 0)
+  {
+    uint32_t skip = off & 3;
+    uint32_t n = (len < 4 - skip) ? len : 4 - skip;
+    uint32_t word = (n == 4) ? 0 : rtc_mem_read (off / 4);
+    memcpy ((char *) &word + skip, data, n);
+    rtc_mem_write (off / 4, word);
+    off += n;
+    data += n;
+    len -= n;
+  }
+}
 
 static int rtcmem_read32 (lua_State *L)
 {
@@ -38,10 +79,86 @@ static int rtcmem_write32 (lua_State *L)
 }
 
 
+// Lua: rtcmem.read(offset, len) -> string
+static int rtcmem_read (lua_State *L)
+{
+  int off = luaL_checkinteger (L, 1);
+  int len = luaL_checkinteger (L, 2);
+  luaL_argcheck (L, off >= 0 && off <= RTCMEM_BYTES, 1, "out of range");
+  luaL_argcheck (L, len >= 0, 2, "negative length");
+  if (len > RTCMEM_BYTES - off)
+    len = RTCMEM_BYTES - off;
+
+  luaL_Buffer b;
+  luaL_buffinit (L, &b);
+  rtcmem_get (&b, off, len, NULL);
+  luaL_pushresult (&b);
+  return 1;
+}
+
+
+// Lua: rtcmem.write(offset, data)
+static int rtcmem_write (lua_State *L)
+{
+  int off = luaL_checkinteger (L, 1);
+  size_t len;
+  const char *data = luaL_checklstring (L, 2, &len);
+  luaL_argcheck (L, off >= 0 && len <= RTCMEM_BYTES - off, 1, "RTC mem would overrun");
+  rtcmem_put (off, data, len);
+  return 0;
+}
+
+
+// Lua: rtcmem.save(idx, data)
+static int rtcmem_save (lua_State *L)
+{
+  int idx = luaL_checkinteger (L, 1);
+  size_t len;
+  const char *data = luaL_checklstring (L, 2, &len);
+  luaL_argcheck (L, idx >= 0 &&
+    2 + (len + 3) / 4 <= RTC_USER_MEM_NUM_DWORDS - idx, 1, "RTC mem would overrun");
+
+  uint32_t header = RTCMEM_SAVED_MAGIC | len;
+  uint32_t crc = uzlib_crc32 (&header, 4, ~0);
+  crc = ~uzlib_crc32 (data, len, crc);
+  rtcmem_put (idx * 4 + 8, data, len);
+  rtc_mem_write (idx + 1, crc);
+  rtc_mem_write (idx, header);
+  return 0;
+}
+
+
+// Lua: rtcmem.restore(idx) -> data, or nil if nothing valid was saved
+static int rtcmem_restore (lua_State *L)
+{
+  int idx = luaL_checkinteger (L, 1);
+  luaL_argcheck (L, idx >= 0 && idx + 2 <= RTC_USER_MEM_NUM_DWORDS, 1, "out of range");
+
+  uint32_t header = rtc_mem_read (idx);
+  uint32_t len = header & 0xffff;
+  if ((header & 0xffff0000) != RTCMEM_SAVED_MAGIC ||
+      2 + (len + 3) / 4 > RTC_USER_MEM_NUM_DWORDS - idx)
+    return 0;
+
+  uint32_t crc = uzlib_crc32 (&header, 4, ~0);
+  luaL_Buffer b;
+  luaL_buffinit (L, &b);
+  rtcmem_get (&b, idx * 4 + 8, len, &crc);
+  if (~crc != rtc_mem_read (idx + 1))
+    return 0;
+  luaL_pushresult (&b);
+  return 1;
+}
+
+
 // Module function map
 LROT_BEGIN(rtcmem, NULL, 0)
   LROT_FUNCENTRY( read32, rtcmem_read32 )
   LROT_FUNCENTRY( write32, rtcmem_write32 )
+  LROT_FUNCENTRY( read, rtcmem_read )
+  LROT_FUNCENTRY( write, rtcmem_write )
+  LROT_FUNCENTRY( save, rtcmem_save )
+  LROT_FUNCENTRY( restore, rtcmem_restore )
 LROT_END(rtcmem, NULL, 0)
 
 
@@ -126,6 +126,115 @@ void rtctime_gmtime (const int32 stamp, struct rtc_tm *r)
   r->tm_mday += work - __spm[i];
 }
 
+// ******* Disciplined clock *************
+
+/* A monotonic clock that follows NTP. It extends the microsecond system timer
+ * to 64 bits and scales it by a frequency correction learned across syncs.
+ * The offset found at a sync is slewed out rather than stepped, so the clock
+ * never goes backwards. It lives in RAM only and is lost across deep sleep.
+ */
+#define CLOCK_STEP_US     1000000   // larger offsets are stepped
+#define CLOCK_SLEW_SHIFT  11        // offsets are slewed at 1/2048, about 500ppm
+#define CLOCK_FREQ_MAX    2147484   // 500ppm in units of 1/2^32
+#define CLOCK_FOLD_MS     60000     // well within the 71 minute system timer wrap
+
+static struct {
+  uint64_t local;       // extended system timer
+  uint32_t raw_last;
+  uint64_t base_local;  // local time at the last fold
+  uint64_t base_ntp;    // clock value at the last fold
+  int64_t pending;      // offset still to be slewed out
+  int32_t freq;         // frequency correction in units of 1/2^32
+  uint64_t sync_local;  // local time of the last sync
+  uint8_t syncs;
+} clk;
+static os_timer_t clock_timer;
+
+static uint64_t clock_local_us (void)
+{
+  uint32_t raw = system_get_time ();
+  clk.local += (uint32_t)(raw - clk.raw_last);
+  clk.raw_last = raw;
+  return clk.local;
+}
+
+static uint64_t clock_at (uint64_t local, int64_t *slewed)
+{
+  uint64_t elapsed = local - clk.base_local;
+  int64_t slew = elapsed >> CLOCK_SLEW_SHIFT;
+  if (clk.pending >= 0)
+    slew = slew < clk.pending ? slew : clk.pending;
+  else
+    slew = slew < -clk.pending ? -slew : clk.pending;
+  if (slewed)
+    *slewed = slew;
+  return clk.base_ntp + elapsed + ((int64_t)elapsed * clk.freq >> 32) + slew;
+}
+
+// Start a new segment at local, so elapsed * freq cannot overflow
+static void clock_fold (uint64_t local)
+{
+  int64_t slewed;
+  clk.base_ntp = clock_at (local, &slewed);
+  clk.base_local = local;
+  clk.pending -= slewed;
+}
+
+static void clock_tick (void *arg)
+{
+  clock_fold (clock_local_us ());
+}
+
+#include "pm/swtimer.h"
+
+void rtctime_clock_sync (uint64_t ntp_us)
+{
+  uint64_t local = clock_local_us ();
+
+  if (clk.syncs == 0) {
+    os_timer_setfn (&clock_timer, clock_tick, NULL);
+    SWTIMER_REG_CB (clock_tick, SWTIMER_RESUME);
+      //clock_tick only folds the clock, so it resumes with the rest of time keeping
+    os_timer_arm (&clock_timer, CLOCK_FOLD_MS, 1);
+  }
+
+  clock_fold (local);
+  int64_t offset = (int64_t)(ntp_us - clk.base_ntp);
+
+  if (clk.syncs == 0 || offset > CLOCK_STEP_US || offset < -CLOCK_STEP_US) {
+    clk.base_ntp = ntp_us;
+    clk.pending = 0;
+  } else {
+    // Whatever the pending slew does not account for comes from the frequency
+    int64_t interval = local - clk.sync_local;
+    if (interval > 0) {
+      int64_t df = ((offset - clk.pending) << 32) / interval;
+      int64_t freq = clk.freq + (clk.syncs == 1 ? df : df / 4);
+      if (freq > CLOCK_FREQ_MAX)
+        freq = CLOCK_FREQ_MAX;
+      if (freq < -CLOCK_FREQ_MAX)
+        freq = -CLOCK_FREQ_MAX;
+      clk.freq = freq;
+    }
+    clk.pending = offset;
+  }
+
+  clk.sync_local = local;
+  if (clk.syncs < 255)
+    clk.syncs++;
+}
+
+bool rtctime_clock_gettime (struct rtc_timeval *tv)
+{
+  if (clk.syncs == 0) {
+    tv->tv_sec = tv->tv_usec = 0;
+    return false;
+  }
+  uint64_t now = clock_at (clock_local_us (), NULL);
+  tv->tv_sec = now / 1000000;
+  tv->tv_usec = now % 1000000;
+  return true;
+}
 
 
 // ******* Lua API functions *************
@@ -162,6 +271,17 @@ static int rtctime_get (lua_State *L)
   return 3;
 }
 
+// sec, usec, freq = rtctime.getus ()
+static int rtctime_getus (lua_State *L)
+{
+  struct rtc_timeval tv;
+  rtctime_clock_gettime (&tv);
+  lua_pushinteger (L, tv.tv_sec);
+  lua_pushinteger (L, tv.tv_usec);
+  lua_pushinteger (L, clk.freq);
+  return 3;
+}
+
 static void do_sleep_opt (lua_State *L, int idx)
 {
   if (lua_isnumber (L, idx))
@@ -237,6 +357,7 @@ static int rtctime_epoch2cal (lua_State *L)
 LROT_BEGIN(rtctime, NULL, 0)
   LROT_FUNCENTRY( set, rtctime_set )
   LROT_FUNCENTRY( get, rtctime_get )
+  LROT_FUNCENTRY( getus, rtctime_getus )
   LROT_FUNCENTRY( adjust_delta, rtctime_adjust_delta )
   LROT_FUNCENTRY( dsleep, rtctime_dsleep )
   LROT_FUNCENTRY( dsleep_aligned, rtctime_dsleep_aligned )
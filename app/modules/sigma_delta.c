@@ -3,6 +3,9 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "platform.h"
+#include "waveform.h"
+
+#define SIGMA_DELTA_MAX_RATE 20000
 
 
 // Lua: setup( pin )
@@ -72,6 +75,17 @@ static int sigma_delta_settarget( lua_State *L )
     return 0;
 }
 
+static void ICACHE_RAM_ATTR sigma_delta_out( uint16_t sample )
+{
+    platform_sigma_delta_set_target( sample );
+}
+
+// Lua: play( samples, rate [, loops [, callback]] )
+static int sigma_delta_play( lua_State *L )
+{
+    return waveform_play( L, 1, 255, SIGMA_DELTA_MAX_RATE, sigma_delta_out );
+}
+
 
 // Module function map
 LROT_BEGIN(sigma_delta, NULL, 0)
@@ -80,6 +94,8 @@ LROT_BEGIN(sigma_delta, NULL, 0)
   LROT_FUNCENTRY( setpwmduty, sigma_delta_setpwmduty )
   LROT_FUNCENTRY( setprescale, sigma_delta_setprescale )
   LROT_FUNCENTRY( settarget, sigma_delta_settarget )
+  LROT_FUNCENTRY( play, sigma_delta_play )
+  LROT_FUNCENTRY( stop, waveform_stop )
 LROT_END(sigma_delta, NULL, 0)
 
 
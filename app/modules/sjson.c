@@ -4,9 +4,18 @@
 
 #ifndef LOCAL_LUA
 #include "module.h"
+#ifndef LUA_CROSS_COMPILER
+#include "platform.h"
+#endif
 #include <string.h>
+#include <stdlib.h>
 #include <math.h>
 #include <limits.h>
+#include <stdint.h>
+#endif
+
+#if defined(LUA_CROSS_COMPILER) || defined(LOCAL_LUA)
+#define platform_cpufreq_boost()
 #endif
 
 #include "sjson/json_config.h"
@@ -20,6 +29,29 @@
 
 #define SJSON_FLOAT_FMT   ((sizeof(lua_Float) == 8) ? "%.19g" : "%.9g")
 
+// Projection: a list of paths such as "main.temp" or "list[*].dt". The
+// decoder keeps only the values on these paths, and everything else is
+// lexed by jsonsl with its callbacks turned off, so it is never allocated.
+#define PROJ_MAX_PATHS  31
+#define PROJ_ALL        0x80000000u   // the whole subtree is wanted
+
+#define PROJ_KEY        0
+#define PROJ_INDEX      1
+#define PROJ_ANY        2
+
+typedef struct {
+  const char *name;       // for PROJ_KEY, points into the path string
+  unsigned short len;
+  unsigned char kind;
+  int index;              // for PROJ_INDEX, counting from 1 as in Lua
+} PROJ_COMPONENT;
+
+typedef struct {
+  int npaths;
+  int ncomps[PROJ_MAX_PATHS];
+  PROJ_COMPONENT *comps[PROJ_MAX_PATHS];
+} PROJ_DATA;
+
 typedef struct {
   jsonsl_t jsn;
   int result_ref;
@@ -35,6 +67,8 @@ typedef struct {
   size_t buffer_len;
   const char *buffer; // Points into buffer_ref
   int buffer_ref;
+  PROJ_DATA *proj;    // NULL if every value is wanted
+  int proj_ref;       // anchors proj and the path strings it points into
 } JSN_DATA;
 
 #define get_parent_object_ref() ((state->level == 1) ? data->result_ref : state[-1].lua_object_ref)
@@ -71,6 +105,69 @@ create_table(JSN_DATA *data) {
   }
 }
 
+/*
+ * Works out which paths the new element is on, from those its parent is on.
+ * Must be called before the parent's used_count is incremented for it.
+ */
+static unsigned int proj_match(JSN_DATA *data, struct jsonsl_state_st *state) {
+  if (!data->proj || state->level == 1) {
+    return data->proj ? (1u << data->proj->npaths) - 1 : PROJ_ALL;
+  }
+  unsigned int parent = state[-1].proj;
+  if (parent & PROJ_ALL) {
+    return PROJ_ALL;
+  }
+
+  int depth = state->level - 2;   // component that the element must match
+  const char *key = NULL;
+  size_t keylen = 0;
+  if (data->hkey_ref != LUA_NOREF) {
+    lua_rawgeti(data->L, LUA_REGISTRYINDEX, data->hkey_ref);
+    key = lua_tolstring(data->L, -1, &keylen);
+    lua_pop(data->L, 1);          // still referenced by hkey_ref
+  }
+  int index = state[-1].used_count + 1;
+
+  unsigned int result = 0;
+  for (int i = 0; i < data->proj->npaths; i++) {
+    if (!(parent & (1u << i))) {
+      continue;
+    }
+    const PROJ_COMPONENT *c = &data->proj->comps[i][depth];
+    int match;
+    switch (c->kind) {
+      case PROJ_KEY:
+        match = key && c->len == keylen && memcmp(c->name, key, keylen) == 0;
+        break;
+      case PROJ_INDEX:
+        match = !key && c->index == index;
+        break;
+      default:
+        match = 1;
+        break;
+    }
+    if (match) {
+      if (depth + 1 == data->proj->ncomps[i]) {
+        return PROJ_ALL;
+      }
+      result |= 1u << i;
+    }
+  }
+  return result;
+}
+
+/*
+ * Accounts for an element that is not wanted in its parent, without storing it.
+ */
+static void proj_discard(JSN_DATA *data, struct jsonsl_state_st *state) {
+  if (data->hkey_ref == LUA_NOREF) {
+    get_parent_object_used_count_pre_inc();
+  } else {
+    luaL_unref(data->L, LUA_REGISTRYINDEX, data->hkey_ref);
+    data->hkey_ref = LUA_NOREF;
+  }
+}
+
 static void
 create_new_element(jsonsl_t jsn,
                    jsonsl_action_t action,
@@ -83,6 +180,9 @@ create_new_element(jsonsl_t jsn,
   DBG_PRINTF("buf: '%s' ('%.10s')\n", buf, get_state_buffer(data, state));
 
   state->lua_object_ref = LUA_NOREF;
+  if (state->type != JSONSL_T_HKEY) {
+    state->proj = proj_match(data, state);
+  }
 
   switch(state->type) {
     case JSONSL_T_SPECIAL:
@@ -92,6 +192,12 @@ create_new_element(jsonsl_t jsn,
 
     case JSONSL_T_LIST:
     case JSONSL_T_OBJECT:
+      if (!state->proj) {
+        // Nothing below is wanted: no callbacks until this element ends
+        proj_discard(data, state);
+        state->ignore_callback = 1;
+        break;
+      }
       create_table(data);
       state->lua_object_ref = luaL_ref(data->L, LUA_REGISTRYINDEX);
       state->used_count = 0;
@@ -246,6 +352,10 @@ cleanup_closing_element(jsonsl_t jsn,
       break;
 
    case JSONSL_T_STRING:
+      if (!state->proj) {
+        proj_discard(data, state);
+        break;
+      }
       lua_rawgeti(data->L, LUA_REGISTRYINDEX, get_parent_object_ref());
       if (data->hkey_ref == LUA_NOREF) {
         // list, so append
@@ -265,7 +375,9 @@ cleanup_closing_element(jsonsl_t jsn,
       DBG_PRINTF("Special flags = 0x%x\n", state->special_flags);
       // need to deal with true/false/null
 
-      if (state->special_flags & (JSONSL_SPECIALf_TRUE|JSONSL_SPECIALf_FALSE|JSONSL_SPECIALf_NUMERIC|JSONSL_SPECIALf_NULL)) {
+      if (!state->proj) {
+        proj_discard(data, state);
+      } else if (state->special_flags & (JSONSL_SPECIALf_TRUE|JSONSL_SPECIALf_FALSE|JSONSL_SPECIALf_NUMERIC|JSONSL_SPECIALf_NULL)) {
         if (state->special_flags & JSONSL_SPECIALf_TRUE) {
           lua_pushboolean(data->L, 1);
         } else if (state->special_flags & JSONSL_SPECIALf_FALSE) {
@@ -311,6 +423,87 @@ cleanup_closing_element(jsonsl_t jsn,
  }
 }
 
+/*
+ * Compiles the array of path strings at the top of the stack into data->proj,
+ * replacing the array with a table that anchors the result.
+ */
+static void proj_compile(lua_State *L, JSN_DATA *data) {
+  int npaths = lua_objlen(L, -1);
+  if (npaths == 0 || npaths > PROJ_MAX_PATHS) {
+    luaL_error(L, "select needs 1 to %d paths", PROJ_MAX_PATHS);
+  }
+
+  // Count the components first, so that one allocation holds them all
+  int total = 0;
+  for (int i = 1; i <= npaths; i++) {
+    lua_rawgeti(L, -1, i);
+    if (lua_type(L, -1) != LUA_TSTRING || !*lua_tostring(L, -1)) {
+      luaL_error(L, "path %d is not a string", i);
+    }
+    const char *p = lua_tostring(L, -1);
+    for (total++; *p; p++) {
+      total += (*p == '.' || *p == '[');
+    }
+    lua_pop(L, 1);
+  }
+
+  lua_createtable(L, npaths + 1, 0);
+  PROJ_DATA *proj = (PROJ_DATA *) lua_newuserdata(L, sizeof(PROJ_DATA) + total * sizeof(PROJ_COMPONENT));
+  lua_rawseti(L, -2, npaths + 1);
+  PROJ_COMPONENT *c = (PROJ_COMPONENT *) (proj + 1);
+  proj->npaths = npaths;
+
+  for (int i = 0; i < npaths; i++) {
+    lua_rawgeti(L, -2, i + 1);
+    const char *path = lua_tostring(L, -1);
+    lua_rawseti(L, -2, i + 1);    // the anchoring table keeps the string
+    const char *p = path;
+
+    proj->comps[i] = c;
+    while (*p) {
+      if (*p == '[') {
+        const char *end = strchr(p, ']');
+        if (!end) {
+          luaL_error(L, "bad path '%s'", path);
+        }
+        if (end - p == 2 && p[1] == '*') {
+          c->kind = PROJ_ANY;
+        } else {
+          char *num_end;
+          long n = strtol(p + 1, &num_end, 10);
+          if (num_end != end || n < 1) {
+            luaL_error(L, "bad index in path '%s'", path);
+          }
+          c->kind = PROJ_INDEX;
+          c->index = n;
+        }
+        p = end + 1;
+      } else {
+        size_t len = strcspn(p, ".[");
+        if (len == 0 || len > USHRT_MAX) {
+          luaL_error(L, "bad path '%s'", path);
+        }
+        c->kind = (len == 1 && *p == '*') ? PROJ_ANY : PROJ_KEY;
+        c->name = p;
+        c->len = len;
+        p += len;
+      }
+      c++;
+      if (*p == '.') {
+        if (!*++p) {
+          luaL_error(L, "bad path '%s'", path);
+        }
+      } else if (*p && *p != '[') {
+        luaL_error(L, "bad path '%s'", path);
+      }
+    }
+    proj->ncomps[i] = c - proj->comps[i];
+  }
+
+  lua_remove(L, -2);    // the array of paths
+  data->proj = proj;
+}
+
 static int sjson_decoder_int(lua_State *L, int argno) {
   int nlevels = DEFAULT_DEPTH;
 
@@ -349,6 +542,8 @@ static int sjson_decoder_int(lua_State *L, int argno) {
   data->hkey_ref = LUA_NOREF;
   data->pos_ref = LUA_NOREF;
   data->buffer_ref = LUA_NOREF;
+  data->proj = NULL;
+  data->proj_ref = LUA_NOREF;
   data->complete = 0;
   data->error = NULL;
   data->L = L;
@@ -382,6 +577,15 @@ static int sjson_decoder_int(lua_State *L, int argno) {
       lua_pop(L, 1);      // Throw away the checkpath value
     }
     lua_pop(L, 1);      // Throw away the metatable
+
+    lua_getfield(L, argno, "select");
+    if (lua_istable(L, -1)) {
+      proj_compile(L, data);
+      data->proj_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+      luaL_argcheck(L, lua_isnil(L, -1), argno, "select must be a table of paths");
+      lua_pop(L, 1);
+    }
   }
 
   jsonsl_enable_all_callbacks(data->jsn);
@@ -438,6 +642,9 @@ static void sjson_free_working_data(lua_State *L, JSN_DATA *data) {
   data->pos_ref = LUA_NOREF;
   luaL_unref(L, LUA_REGISTRYINDEX, data->buffer_ref);
   data->buffer_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, data->proj_ref);
+  data->proj_ref = LUA_NOREF;
+  data->proj = NULL;
 }
 
 static int sjson_decoder_write_int(lua_State *L, int udata_pos, int string_pos) {
@@ -485,11 +692,17 @@ static int sjson_decoder_write_int(lua_State *L, int udata_pos, int string_pos)
     data->buffer_len = blen;
     data->buffer_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
+    platform_cpufreq_boost();
     jsonsl_feed(data->jsn, str, len);
 
     if (data->error) {
       luaL_error(L, "JSON parse error: %s", data->error);
     }
+
+    // Inside an element that is skipped, none of the buffer is needed again
+    if (!data->complete && data->jsn->stack[data->jsn->level].ignore_callback) {
+      data->min_needed = data->jsn->pos;
+    }
   }
 
   if (data->complete) {
@@ -506,24 +719,57 @@ static int sjson_decoder_write(lua_State *L) {
   return sjson_decoder_write_int(L, 1, 2);
 }
 
-static int sjson_decode(lua_State *L) {
-  int push_count = sjson_decoder_int(L, 2);
-  if (push_count != 1) {
-    luaL_error(L, "Internal error in sjson.deocder");
+// sjson.decode() parses this many bytes between checks on the task slice
+#define DECODE_SLICE_BYTES  512
+
+static int sjson_decode_k(lua_State *L, int status, lua_KContext ctx) {
+  JSN_DATA *data = (JSN_DATA *)luaL_checkudata(L, 3, "sjson.decoder");
+  size_t len;
+  const char *str = lua_tolstring(L, 1, &len);
+  size_t pos = (size_t) ctx;
+  (void) status;
+
+  platform_cpufreq_boost();
+  // The whole string is held by buffer_ref, so it can be fed in pieces
+  while (pos < len) {
+    size_t n = len - pos < DECODE_SLICE_BYTES ? len - pos : DECODE_SLICE_BYTES;
+    jsonsl_feed(data->jsn, str + pos, n);
+    pos += n;
+
+    if (data->error) {
+      luaL_error(L, "JSON parse error: %s", data->error);
+    }
+    if (pos < len && luaL_sliceexpired(L)) {
+      return luaL_yieldslice(L, (lua_KContext) pos, sjson_decode_k);
+    }
+  }
+
+  if (!data->complete) {
+    luaL_error(L, "Incomplete JSON object passed to sjson.decode");
   }
 
-  luaL_checkudata(L, -1, "sjson.decoder");
+  sjson_free_working_data(L, data);
 
-  push_count = sjson_decoder_write_int(L, -1, 1);
+  return sjson_decoder_result_int(L, data);
+}
 
+static int sjson_decode(lua_State *L) {
+  size_t len;
+  const char *str = luaL_checklstring(L, 1, &len);
+
+  lua_settop(L, 2);
+  int push_count = sjson_decoder_int(L, 2);
   if (push_count != 1) {
-    luaL_error(L, "Incomplete JSON object passed to sjson.decode");
+    luaL_error(L, "Internal error in sjson.deocder");
   }
 
-  // Now we have two items on the stack -- the udata and the result
-  lua_remove(L, -2);
+  JSN_DATA *data = (JSN_DATA *)luaL_checkudata(L, 3, "sjson.decoder");
+  lua_pushvalue(L, 1);
+  data->buffer = str;
+  data->buffer_len = len;
+  data->buffer_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
-  return 1;
+  return sjson_decode_k(L, LUA_OK, 0);
 }
 
 static int sjson_decoder_destructor(lua_State *L) {
@@ -568,14 +814,22 @@ typedef struct {
   int lua_key_ref;
 } ENC_DATA_STATE;
 
+// Room for one token: a separator, a formatted number and a terminator
+#define ENC_CARRY_SIZE  40
+
 typedef struct {
   ENC_DATA_STATE *stack;
   int nlevels;
   int level;
-  int current_str_ref;
   int null_ref;
-  int offset;
-
+  // The string whose body is being written, escaped, straight to the output
+  int str_ref;
+  size_t str_pos;
+  char str_tail;
+  // Output already generated but not yet taken by the reader
+  unsigned char carry_pos;
+  unsigned char carry_len;
+  char carry[ENC_CARRY_SIZE];
 } ENC_DATA;
 
 static int sjson_encoder_get_table_size(lua_State *L, int argno) {
@@ -666,7 +920,8 @@ static int sjson_encoder(lua_State *L) {
   data->nlevels = nlevels;
   data->level = -1;
   data->stack = (ENC_DATA_STATE *) (data + 1);
-  data->current_str_ref = LUA_NOREF;
+  data->str_ref = LUA_NOREF;
+  data->carry_pos = data->carry_len = 0;
   int i;
   for (i = 0; i < nlevels; i++) {
     data->stack[i].lua_object_ref = LUA_NOREF;
@@ -686,19 +941,93 @@ static int sjson_encoder(lua_State *L) {
   return 1;
 }
 
-static void encode_lua_object(lua_State *L, ENC_DATA *data, int argno, const char *prefix, const char *suffix) {
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
+/*
+ * The encoder writes straight into the caller's buffer.  Each step of the walk
+ * below produces at most one small token into the carry, plus possibly the
+ * start of a string whose body is then escaped directly into the output, so
+ * encoding does not build a Lua string per value, and a chunk of any size can
+ * be taken without the document ever being held whole.
+ */
+static void enc_putc(ENC_DATA *data, char c) {
+  data->carry[data->carry_len++] = c;
+}
+
+static void enc_puts(ENC_DATA *data, const char *s) {
+  while (*s) {
+    data->carry[data->carry_len++] = *s++;
+  }
+}
 
-  luaL_addstring(&b, prefix);
+#if LUA_VERSION_NUM == 501
+#ifdef LUA_NUMBER_INTEGRAL
+#define enc_isinteger(L, i) 1
+#else
+#define enc_isinteger(L, i) 0
+#endif
+#else
+#define enc_isinteger(L, i) lua_isinteger(L, i)
+#endif
 
+static void enc_put_int32(ENC_DATA *data, int32_t v) {
+  char digits[10];
+  int n = 0;
+  uint32_t u = v < 0 ? 0u - (uint32_t) v : (uint32_t) v;
+
+  if (v < 0) {
+    enc_putc(data, '-');
+  }
+  do {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  while (n) {
+    enc_putc(data, digits[--n]);
+  }
+}
+
+// Integers and integral floats that fit in 32 bits, which is nearly all of
+// them, are formatted by hand; only the rest go through snprintf.
+static void enc_put_number(lua_State *L, ENC_DATA *data, int argno) {
+  char *p = data->carry + data->carry_len;
+  size_t room = ENC_CARRY_SIZE - 1 - data->carry_len;
+  int n;
+
+  if (enc_isinteger(L, argno)) {
+    lua_Integer v = lua_tointeger(L, argno);
+    if (v >= -INT32_MAX && v <= INT32_MAX) {
+      enc_put_int32(data, (int32_t) v);
+      return;
+    }
+    n = snprintf(p, room, "%lld", (long long) v);
+  } else {
+    lua_Number f = lua_tonumber(L, argno);
+    if (f != f || f - f != 0) {
+      enc_puts(data, "null");     // According to ECMA-262 section 24.5.2 Note 4
+      return;
+    }
+    if (f > -2147483648.0 && f < 2147483648.0 && f == (int32_t) f &&
+        (f != 0 || 1 / f > 0)) {
+      enc_put_int32(data, (int32_t) f);
+      return;
+    }
+    n = snprintf(p, room, SJSON_FLOAT_FMT, f);
+  }
+  data->carry_len += n < (int) room ? n : (int) room;
+}
+
+// Start the value at argno, after prefix and followed by tail (either may be 0)
+static void enc_put_value(lua_State *L, ENC_DATA *data, int argno, char prefix, char tail) {
   int type = lua_type(L, argno);
 
+  if (prefix) {
+    enc_putc(data, prefix);
+  }
+
   if (type == LUA_TSTRING) {
     // Check to see if it is the NULL value
     if (data->null_ref != LUA_REFNIL) {
       lua_rawgeti(L, LUA_REGISTRYINDEX, data->null_ref);
-      if (lua_equal(L, -1, -2)) {
+      if (lua_equal(L, -1, argno < 0 ? argno - 1 : argno)) {
         type = LUA_TNIL;
       }
       lua_pop(L, 1);
@@ -712,95 +1041,78 @@ static void encode_lua_object(lua_State *L, ENC_DATA *data, int argno, const cha
 
     case LUA_TLIGHTUSERDATA:
     case LUA_TNIL:
-      luaL_addstring(&b, "null");
+      enc_puts(data, "null");
       break;
 
     case LUA_TBOOLEAN:
-      luaL_addstring(&b, lua_toboolean(L, argno) ? "true" : "false");
+      enc_puts(data, lua_toboolean(L, argno) ? "true" : "false");
       break;
 
     case LUA_TNUMBER:
-    {
-      lua_pushvalue(L, argno);
-      char value[50];
-
-#if LUA_VERSION_NUM == 501
-#ifdef LUA_NUMBER_INTEGRAL
-        snprintf(value, sizeof(value), "%d", lua_tointeger(L, -1));
-#else
-        snprintf(value, sizeof(value), SJSON_FLOAT_FMT, lua_tonumber(L, -1));
-#endif
-#else
-      if (lua_isinteger(L, -1)) {
-        snprintf(value, sizeof(value), LUA_INTEGER_FMT, lua_tointeger(L, -1));
-      } else {
-        snprintf(value, sizeof(value), SJSON_FLOAT_FMT, lua_tonumber(L, -1));
-      }
-#endif
-      lua_pop(L, 1);
-      if (strcmp(value, "-inf") == 0 || strcmp(value, "nan") == 0 || strcmp(value, "inf") == 0) {
-        luaL_addstring(&b, "null");   // According to ECMA-262 section 24.5.2 Note 4
-      } else {
-        luaL_addstring(&b, value);
-      }
+      enc_put_number(L, data, argno);
       break;
-    }
 
     case LUA_TSTRING:
-    {
-      luaL_addchar(&b, '"');
-      size_t len;
-      const char *str = lua_tolstring(L, argno, &len);
-      while (len > 0) {
-        if ((*str & 0xff) < 0x20) {
-          char value[8];
-          value[0] = '\\';
-
-          char *d = value + 1;
-
-          switch(*str) {
-            case '\f':
-              *d++ = 'f';
-              break;
-            case '\n':
-              *d++ = 'n';
-              break;
-            case '\t':
-              *d++ = 't';
-              break;
-            case '\r':
-              *d++ = 'r';
-              break;
-            case '\b':
-              *d++ = 'b';
-              break;
-
-            default:
-              *d++ = 'u';
-              *d++ = '0';
-              *d++ = '0';
-              *d++ = "0123456789abcdef"[(*str >> 4) & 0xf];
-              *d++ = "0123456789abcdef"[(*str     ) & 0xf];
-              break;
+      // The body and closing quote are written by enc_put_string()
+      enc_putc(data, '"');
+      lua_pushvalue(L, argno);
+      data->str_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      data->str_pos = 0;
+      data->str_tail = tail;
+      return;
+  }
 
-          }
-          *d = '\0';
-          luaL_addstring(&b, value);
-        } else if (*str == '"') {
-          luaL_addstring(&b, "\\\"");
-        } else {
-          luaL_addchar(&b, *str);
-        }
-        str++;
-        len--;
-      }
-      luaL_addchar(&b, '"');
+  if (tail) {
+    enc_putc(data, tail);
+  }
+}
+
+// Put the escape sequence for c into the (empty) carry
+static void enc_put_escape(ENC_DATA *data, unsigned char c) {
+  enc_putc(data, '\\');
+  switch (c) {
+    case '\f': enc_putc(data, 'f'); break;
+    case '\n': enc_putc(data, 'n'); break;
+    case '\t': enc_putc(data, 't'); break;
+    case '\r': enc_putc(data, 'r'); break;
+    case '\b': enc_putc(data, 'b'); break;
+    case '"':  enc_putc(data, '"'); break;
+    case '\\': enc_putc(data, '\\'); break;
+    default:
+      enc_puts(data, "u00");
+      enc_putc(data, "0123456789abcdef"[(c >> 4) & 0xf]);
+      enc_putc(data, "0123456789abcdef"[(c     ) & 0xf]);
       break;
+  }
+}
+
+// Write as much of the current string body as fits; any escape goes via the carry
+static size_t enc_put_string(lua_State *L, ENC_DATA *data, char *buf, size_t len) {
+  size_t l, n = 0;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, data->str_ref);
+  const char *str = lua_tolstring(L, -1, &l);
+  lua_pop(L, 1); // Note that we still have the string referenced so it can't go away
+
+  while (data->str_pos < l && n < len) {
+    unsigned char c = str[data->str_pos++];
+    if (c < 0x20 || c == '"' || c == '\\') {
+      enc_put_escape(data, c);
+      return n;
     }
+    buf[n++] = c;
   }
 
-  luaL_addstring(&b, suffix);
-  luaL_pushresult(&b);
+  if (data->str_pos == l) {
+    luaL_unref(L, LUA_REGISTRYINDEX, data->str_ref);
+    data->str_ref = LUA_NOREF;
+    enc_putc(data, '"');
+    if (data->str_tail) {
+      enc_putc(data, data->str_tail);
+    }
+  }
+
+  return n;
 }
 
 static int sjson_encoder_next_value_is_table(lua_State *L) {
@@ -815,149 +1127,156 @@ static int sjson_encoder_next_value_is_table(lua_State *L) {
   return (lua_type(L, -1) == LUA_TTABLE);
 }
 
-static void sjson_encoder_make_next_chunk(lua_State *L, ENC_DATA *data) {
-  if (data->level < 0) {
-    return;
-  }
-
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
+// Advance the walk by one step
+static void sjson_encoder_step(lua_State *L, ENC_DATA *data) {
+  ENC_DATA_STATE *state = &data->stack[data->level];
 
-  // Ending condition
-  while (data->level >= 0 /* && !b.lvl */) {
-    ENC_DATA_STATE *state = &data->stack[data->level];
+  int finished = 0;
 
-    int finished = 0;
+  if (state->size >= 0) {
+    if (state->offset == 0) {
+      // start of object or whatever
+      enc_putc(data, '[');
+    }
+    if (state->offset == state->size << 1) {
+      enc_putc(data, ']');
+      finished = 1;
+    } else if ((state->offset & 1) == 0) {
+      if (state->offset > 0) {
+        enc_putc(data, ',');
+      }
+    } else {
+      // output the value
+      lua_rawgeti(L, LUA_REGISTRYINDEX, state->lua_object_ref);
+      lua_rawgeti(L, -1, (state->offset >> 1) + 1);
+      if (sjson_encoder_next_value_is_table(L)) {
+        enc_push_stack(L, data, -1);
+        lua_pop(L, 2);
+        state->offset++;
+        return;
+      }
+      enc_put_value(L, data, -1, 0, 0);
+      lua_pop(L, 2);
+    }
 
-    if (state->size >= 0) {
-      if (state->offset == 0) {
-        // start of object or whatever
-        luaL_addchar(&b, '[');
+    state->offset++;
+  } else {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, state->lua_object_ref);
+    // stack now contains: -1 => table
+    lua_rawgeti(L, LUA_REGISTRYINDEX, state->lua_key_ref);
+    // stack now contains: -1 => nil or key; -2 => table
+
+    if (lua_next(L, -2)) {
+      // save the key
+      if (state->offset & 1) {
+        luaL_unref(L, LUA_REGISTRYINDEX, state->lua_key_ref);
+        state->lua_key_ref = LUA_NOREF;
+        // Duplicate the key
+        lua_pushvalue(L, -2);
+        state->lua_key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
       }
-      if (state->offset == state->size << 1) {
-        luaL_addchar(&b, ']');
-        finished = 1;
-      } else if ((state->offset & 1) == 0) {
-        if (state->offset > 0) {
-          luaL_addchar(&b, ',');
-        }
+
+      if ((state->offset & 1) == 0) {
+        // copy the key so that lua_tostring does not modify the original
+        lua_pushvalue(L, -2);
+        // stack now contains: -1 => key; -2 => value; -3 => key; -4 => table
+        // key
+        lua_tostring(L, -1);
+        enc_put_value(L, data, -1, state->offset ? ',' : '{', ':');
+        lua_pop(L, 4);
       } else {
-        // output the value
-        lua_rawgeti(L, LUA_REGISTRYINDEX, state->lua_object_ref);
-        lua_rawgeti(L, -1, (state->offset >> 1) + 1);
         if (sjson_encoder_next_value_is_table(L)) {
           enc_push_stack(L, data, -1);
-          lua_pop(L, 2);
+          lua_pop(L, 3);
           state->offset++;
-          continue;
+          return;
         }
-        encode_lua_object(L, data, -1, "", "");
-        lua_remove(L, -2);
-        lua_remove(L, -2);
-        luaL_addvalue(&b);
+        enc_put_value(L, data, -1, 0, 0);
+        lua_pop(L, 3);
       }
-
-      state->offset++;
     } else {
-      lua_rawgeti(L, LUA_REGISTRYINDEX, state->lua_object_ref);
-      // stack now contains: -1 => table
-      lua_rawgeti(L, LUA_REGISTRYINDEX, state->lua_key_ref);
-      // stack now contains: -1 => nil or key; -2 => table
-
-      if (lua_next(L, -2)) {
-        // save the key
-        if (state->offset & 1) {
-          luaL_unref(L, LUA_REGISTRYINDEX, state->lua_key_ref);
-          state->lua_key_ref = LUA_NOREF;
-          // Duplicate the key
-          lua_pushvalue(L, -2);
-          state->lua_key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-        }
+      lua_pop(L, 1);
+      // We have got to the end
+      enc_putc(data, '}');
+      finished = 1;
+    }
 
-        if ((state->offset & 1) == 0) {
-          // copy the key so that lua_tostring does not modify the original
-          lua_pushvalue(L, -2);
-          // stack now contains: -1 => key; -2 => value; -3 => key; -4 => table
-          // key
-          lua_tostring(L, -1);
-          encode_lua_object(L, data, -1, state->offset ? "," : "{", ":");
-          lua_remove(L, -2);
-          lua_remove(L, -2);
-          lua_remove(L, -2);
-          lua_remove(L, -2);
-        } else {
-          if (sjson_encoder_next_value_is_table(L)) {
-            enc_push_stack(L, data, -1);
-            lua_pop(L, 3);
-            state->offset++;
-            continue;
-          }
-          encode_lua_object(L, data, -1, "", "");
-          lua_remove(L, -2);
-          lua_remove(L, -2);
-          lua_remove(L, -2);
-        }
-        luaL_addvalue(&b);
-      } else {
-        lua_pop(L, 1);
-        // We have got to the end
-        luaL_addchar(&b, '}');
-        finished = 1;
-      }
+    state->offset++;
+  }
 
-      state->offset++;
+  if (finished) {
+    enc_pop_stack(L, data);
+  }
+}
+
+// Write up to len bytes of output to buf; fewer only at the end of the document
+static size_t sjson_encoder_fill_int(lua_State *L, ENC_DATA *data, char *buf, size_t len) {
+  size_t n = 0;
+
+  while (n < len) {
+    if (data->carry_pos < data->carry_len) {
+      size_t amnt = data->carry_len - data->carry_pos;
+      if (amnt > len - n) {
+        amnt = len - n;
+      }
+      memcpy(buf + n, data->carry + data->carry_pos, amnt);
+      data->carry_pos += amnt;
+      n += amnt;
+      continue;
     }
+    data->carry_pos = data->carry_len = 0;
 
-    if (finished) {
-      enc_pop_stack(L, data);
+    if (data->str_ref != LUA_NOREF) {
+      n += enc_put_string(L, data, buf + n, len - n);
+    } else if (data->level >= 0) {
+      sjson_encoder_step(L, data);
+    } else {
+      break;
     }
   }
-  luaL_pushresult(&b);
-  data->current_str_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  data->offset = 0;
+
+  return n;
+}
+
+/*
+ * The C interface used by the pipe, file and net modules to take an encoder's
+ * output without going through Lua strings.  Copies up to len bytes of the
+ * encoder at stack ndx into buf and returns the count, which is less than len
+ * only once the document is complete, or -1 if ndx is not an encoder.  With a
+ * len of 0 it just tests for an encoder.
+ */
+int sjson_encoder_fill(lua_State *L, int ndx, char *buf, size_t len) {
+  ENC_DATA *data = (ENC_DATA *)luaL_testudata(L, ndx, "sjson.encoder");
+
+  if (!data) {
+    return -1;
+  }
+
+  return (int) sjson_encoder_fill_int(L, data, buf, len);
 }
 
 static int sjson_encoder_read_int(lua_State *L, ENC_DATA *data, int readsize) {
   luaL_Buffer b;
   luaL_buffinit(L, &b);
 
-  size_t len;
+  size_t total = 0;
 
-  do {
+  while (readsize > 0) {
     // Fill the buffer with (up to) readsize characters
-    if (data->current_str_ref != LUA_NOREF) {
-      // this is not allowed
-      lua_rawgeti(L, LUA_REGISTRYINDEX, data->current_str_ref);
-      const char *str = lua_tolstring(L, -1, &len);
-
-      lua_pop(L, 1); // Note that we still have the string referenced so it can't go away
-
-      int amnt = len - data->offset;;
-      if (amnt > readsize) {
-        amnt = readsize;
-      }
-      luaL_addlstring(&b, str + data->offset, amnt);
-      data->offset += amnt;
-      readsize -= amnt;
-
-      if (data->offset == len) {
-        luaL_unref(L, LUA_REGISTRYINDEX, data->current_str_ref);
-        data->current_str_ref = LUA_NOREF;
-      }
-    }
+    size_t want = readsize < LUAL_BUFFERSIZE ? readsize : LUAL_BUFFERSIZE;
+    size_t got = sjson_encoder_fill_int(L, data, luaL_prepbuffer(&b), want);
 
-    if (readsize > 0) {
-      // Make the next chunk
-      sjson_encoder_make_next_chunk(L, data);
+    luaL_addsize(&b, got);
+    total += got;
+    readsize -= got;
+    if (got < want) {
+      break;
     }
-
-  } while (readsize > 0 && data->current_str_ref != LUA_NOREF);
+  }
 
   luaL_pushresult(&b);
 
-  lua_tolstring(L, -1, &len);
-
-  if (len == 0) {
+  if (total == 0) {
     // we have got to the end
     lua_pop(L, 1);
     return 0;
@@ -1003,7 +1322,7 @@ static int sjson_encoder_destructor(lua_State *L) {
   }
 
   luaL_unref(L, LUA_REGISTRYINDEX, data->null_ref);
-  luaL_unref(L, LUA_REGISTRYINDEX, data->current_str_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, data->str_ref);
 
   DBG_PRINTF("Destructor called\n");
 
@@ -255,6 +255,7 @@ static void sntp_handle_result(lua_State *L) {
     tv.tv_usec -= 1000000;
     tv.tv_sec++;
   }
+  rtctime_clock_sync ((uint64_t) tv.tv_sec * 1000000 + tv.tv_usec);
   if (state->is_on_timeout && state->best.delta > SUS_TO_FRAC(-200000) && state->best.delta < SUS_TO_FRAC(200000)) {
     // Adjust rate
     // f is frequency -- f should be 1 << 32 for nominal -- but we store it as an offset
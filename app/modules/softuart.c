@@ -7,11 +7,16 @@
 #include "lauxlib.h"
 #include "task/task.h"
 #include "platform.h"
+#include "pm/swtimer.h"
 #include <stdlib.h>
 #include <string.h>
 
 #define SOFTUART_MAX_RX_BUFF 128
 #define SOFTUART_GPIO_COUNT 13
+// Edge events captured by the GPIO ISR, about 25 bytes of worst case traffic
+#define SOFTUART_EDGE_RING 256
+#define SOFTUART_EDGE_BATCH 32
+#define SOFTUART_TIME_MASK 0x7fffffff
 
 //TODO: Overflow flag as callback function + docs
 
@@ -24,24 +29,33 @@ typedef struct {
 } softuart_buffer_t;
 
 typedef struct {
-	volatile softuart_buffer_t buffer;
+	softuart_buffer_t buffer;
 	uint16_t bit_time;
 	uint16_t need_len; // Buffer length needed to run callback function
 	char end_char; // Used to run callback if last char in buffer will be the same
 	uint8_t armed;
 	uint8_t pin_rx;
 	uint8_t pin_tx;
+	// Receive decoder, rebuilding frames from the edge timestamps
+	uint32_t rx_bit16; // Bit time in 1/16 us
+	uint32_t rx_start; // Timestamp of the start bit edge in us
+	uint8_t rx_bit; // Next bit to sample, 0 while the line is idle
+	uint8_t rx_level; // Line level after the last edge
+	uint8_t rx_byte;
+	os_timer_t rx_timer; // Closes the last frame of a burst
 } softuart_t;
 
 // Array of pointers to SoftUART instances
 softuart_t * softuart_gpio_instances[SOFTUART_GPIO_COUNT] = {NULL};
 // Array of callback reference to be able to find which callback is used to which rx pin
 static int softuart_rx_cb_ref[SOFTUART_GPIO_COUNT];
-// Task for receiving data
-static task_handle_t uart_recieve_task = 0;
+// Task for decoding received edges
+static platform_task_handle_t uart_recieve_task = 0;
 // Receiving buffer for callback usage
 static char softuart_rx_buffer[SOFTUART_MAX_RX_BUFF];
 
+static void softuart_rx_timeout(void *arg);
+
 static inline int32_t asm_ccount(void) {
     int32_t r;
     asm volatile ("rsr %0, ccount" : "=r"(r));
@@ -57,94 +71,6 @@ static inline uint8_t checkbit(uint8_t data, uint8_t bit)
 	}
 }
 
-static uint32_t ICACHE_RAM_ATTR softuart_intr_handler(uint32_t ret_gpio_status)
-{
-	// Disable all interrupts
-	ets_intr_lock();
-	int32_t start_time = asm_ccount();
-	uint32_t gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
-	uint32_t gpio_bits = gpio_status;
-	for (uint8_t gpio_bit = 0; gpio_bits != 0; gpio_bit++, gpio_bits >>= 1) {
-		// Check all pins for interrupts
-		if (! (gpio_bits & 0x01)) continue;
-		// We got pin that was interrupted
-		// Load instance which has rx pin on interrupt pin attached
-		softuart_t *s = softuart_gpio_instances[pin_num_inv[gpio_bit]];
-		if (s == NULL) continue;
-		// Clear interrupt status on that pin
-		GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, gpio_status & (1 << pin_num[s->pin_rx]));
-		ret_gpio_status &= ~(1 << pin_num[s->pin_rx]);
-		if (softuart_rx_cb_ref[pin_num_inv[gpio_bit]] == LUA_NOREF) continue;
-		if (!s->armed) continue;
-		// There is an armed SoftUART rx instance on that pin
-		// Start listening to transmission
-		// TODO: inverted
-		if (! (GPIO_INPUT_GET(GPIO_ID_PIN(pin_num[s->pin_rx])))) {
-		//pin is low - therefore we have a start bit
-			unsigned byte = 0;
-			// Casting and using signed types to always be able to compute elapsed time even if there is a overflow
-			uint32_t elapsed_time = (uint32_t)(asm_ccount() - start_time);
-
-			// Wait till start bit is half over so we can sample the next one in the center
-			if (elapsed_time < s->bit_time / 2) {
-				uint16_t wait_time = s->bit_time / 2 - elapsed_time;
-				while ((uint32_t)(asm_ccount() - start_time) < wait_time);
-				start_time += wait_time;
-			}
-
-			// Sample bits
-			// TODO: How many bits? Add other configs to softuart
-			for (uint8_t i = 0; i < 8; i ++ ) {
-				while ((uint32_t)(asm_ccount() - start_time) < s->bit_time);
-				//shift d to the right
-				byte >>= 1;
-
-				// Read bit
-				if(GPIO_INPUT_GET(GPIO_ID_PIN(pin_num[s->pin_rx]))) {
-					// If high, set MSB of byte to 1
-					byte |= 0x80;
-				}
-				// Recalculate start time for next bit
-				start_time += s->bit_time;
-			}
-
-			// Store byte in buffer
-			// If buffer full, set the overflow flag and return
-			if (s->buffer.bytes_count == SOFTUART_MAX_RX_BUFF) {
-				s->buffer.buffer_overflow = 1;
-			} else if (s->buffer.bytes_count < SOFTUART_MAX_RX_BUFF) {
-				s->buffer.receive_buffer[s->buffer.buffer_last] = byte;
-				s->buffer.buffer_last++;
-				s->buffer.bytes_count++;
-
-				// Check for callback conditions
-				if (((s->need_len != 0) && (s->buffer.bytes_count >= s->need_len))  || \
-						((s->need_len == 0) && ((char)byte == s->end_char))) {
-					    // Send the pointer to task handler
-						s->armed = 0;
-						task_post_medium(uart_recieve_task, (task_param_t)s);
-				}
-			}
-			// Check for overflow after appending new byte
-			if (s->buffer.bytes_count == SOFTUART_MAX_RX_BUFF) {
-				s->buffer.buffer_overflow = 1;
-			}
-			// Roll over buffer index if necessary
-			if (s->buffer.buffer_last == SOFTUART_MAX_RX_BUFF) {
-				s->buffer.buffer_last = 0;
-			}
-			// Wait for stop bit
-			// TODO: Add config for stop bits and parity bits
-			while ((uint32_t)(asm_ccount() - start_time) < s->bit_time);
-			// Break the loop after reading of the frame
-			break;
-		}
-	}
-	// re-enable all interrupts
-	ets_intr_unlock();
-	return ret_gpio_status;
-}
-
 static void softuart_putchar(softuart_t *s, char data)
 {
 	// Disable all interrupts
@@ -181,18 +107,12 @@ static int softuart_init(softuart_t *s)
 
     // Init rx pin
     if (s->pin_rx != 0xFF) {
+		// The GPIO ISR only timestamps the edges, the frames are decoded in a task
+		if (!platform_gpio_set_batch(s->pin_rx, SOFTUART_EDGE_RING, uart_recieve_task))
+			return 0;
 		platform_gpio_mode(s->pin_rx, PLATFORM_GPIO_INT, PLATFORM_GPIO_PULLUP);
-		// Enable interrupt for pin on falling edge
-		platform_gpio_intr_init(s->pin_rx, GPIO_PIN_INTR_NEGEDGE);
+		platform_gpio_intr_init(s->pin_rx, GPIO_PIN_INTR_ANYEDGE);
 		softuart_gpio_instances[s->pin_rx] = s;
-		// Preserve other rx gpio pins
-		uint32_t mask = 0;
-		for (uint8_t i = 0; i < SOFTUART_GPIO_COUNT; i++) {
-			if (softuart_gpio_instances[i] != NULL) {
-				mask = mask | (1 << pin_num[softuart_gpio_instances[i]->pin_rx]);
-			}
-		}
-		return platform_gpio_register_intr_hook(mask, softuart_intr_handler);
     }
     return 1;
 }
@@ -243,6 +163,12 @@ static int softuart_setup(lua_State *L)
 
 	// Set bit time
     softuart->bit_time = system_get_cpu_freq() * 1000000 / baudrate;
+	softuart->rx_bit16 = 16000000 / baudrate;
+	softuart->rx_bit = 0;
+	softuart->rx_level = 1;
+	os_timer_disarm(&softuart->rx_timer);
+	os_timer_setfn(&softuart->rx_timer, softuart_rx_timeout, softuart);
+	SWTIMER_REG_CB(softuart_rx_timeout, SWTIMER_RESUME);
 
     // Set metatable
 	luaL_getmetatable(L, "softuart.port");
@@ -255,9 +181,8 @@ static int softuart_setup(lua_State *L)
 	return 1;
 }
 
-static void softuart_rx_callback(task_param_t arg)
+static void softuart_rx_callback(softuart_t *softuart)
 {
-	softuart_t *softuart = (softuart_t*)arg; //Receive pointer from ISR
 	lua_State *L = lua_getstate();
 	lua_rawgeti(L, LUA_REGISTRYINDEX, softuart_rx_cb_ref[softuart->pin_rx]);
 
@@ -265,7 +190,7 @@ static void softuart_rx_callback(task_param_t arg)
 	if(softuart->buffer.bytes_count == SOFTUART_MAX_RX_BUFF) {
 		softuart->buffer.buffer_overflow = 0;
 	}
-	// Copy volatile data to static buffer
+	// Copy ring data to static buffer
 	uint8_t buffer_length = softuart->buffer.bytes_count;
 	for (int i = 0; i < buffer_length; i++) {
 		softuart_rx_buffer[i] = softuart->buffer.receive_buffer[softuart->buffer.buffer_first];
@@ -276,10 +201,94 @@ static void softuart_rx_callback(task_param_t arg)
 		}
 	}
 	lua_pushlstring(L, softuart_rx_buffer, buffer_length);
-	softuart->armed = 1;
 	luaL_pcallx(L, 1, 0);
 }
 
+static void softuart_rx_store(softuart_t *s, uint8_t byte)
+{
+	// If buffer full, set the overflow flag and drop the byte
+	if (s->buffer.bytes_count == SOFTUART_MAX_RX_BUFF) {
+		s->buffer.buffer_overflow = 1;
+		return;
+	}
+	s->buffer.receive_buffer[s->buffer.buffer_last] = byte;
+	s->buffer.buffer_last++;
+	s->buffer.bytes_count++;
+	// Roll over buffer index if necessary
+	if (s->buffer.buffer_last == SOFTUART_MAX_RX_BUFF) {
+		s->buffer.buffer_last = 0;
+	}
+	// Check for callback conditions
+	if (s->armed && softuart_rx_cb_ref[s->pin_rx] != LUA_NOREF &&
+			(((s->need_len != 0) && (s->buffer.bytes_count >= s->need_len)) ||
+			 ((s->need_len == 0) && ((char)byte == s->end_char)))) {
+		softuart_rx_callback(s);
+	}
+}
+
+/*
+ * Sample every bit centre of the current frame before time 'until', using the
+ * line level left by the last edge.  The frame ends with the stop bit sample;
+ * a low stop bit is a framing error and the byte is dropped.
+ */
+static void softuart_rx_advance(softuart_t *s, uint32_t until)
+{
+	while (s->rx_bit) {
+		int32_t elapsed = (int32_t)(((until - s->rx_start) & SOFTUART_TIME_MASK) << 1) >> 1;
+		int32_t centre = ((2 * s->rx_bit + 1) * s->rx_bit16) >> 5;
+		if (elapsed <= centre)
+			return;
+		if (s->rx_bit <= 8) {
+			s->rx_byte = (s->rx_byte >> 1) | (s->rx_level ? 0x80 : 0);
+			s->rx_bit++;
+		} else {
+			s->rx_bit = 0;
+			if (s->rx_level)
+				softuart_rx_store(s, s->rx_byte);
+		}
+	}
+}
+
+static void softuart_rx_process(softuart_t *s)
+{
+	uint32_t ev[SOFTUART_EDGE_BATCH];
+	// Taken before the drain, so that no edge before it can still be pending
+	uint32_t now = system_get_time() & SOFTUART_TIME_MASK;
+	unsigned i, n;
+
+	os_timer_disarm(&s->rx_timer);
+	while ((n = platform_gpio_get_batch(s->pin_rx, ev, SOFTUART_EDGE_BATCH, NULL)) > 0) {
+		for (i = 0; i < n; i++) {
+			uint32_t t = PLATFORM_GPIO_BATCH_TIME(ev[i]);
+			softuart_rx_advance(s, t);
+			s->rx_level = PLATFORM_GPIO_BATCH_LEVEL(ev[i]);
+			if (!s->rx_bit && !s->rx_level) {
+				// Falling edge on an idle line is a start bit
+				s->rx_bit = 1;
+				s->rx_start = t;
+				s->rx_byte = 0;
+			}
+		}
+	}
+	softuart_rx_advance(s, now);
+	// A frame ending in 1 bits has no closing edge, so finish it later
+	if (s->rx_bit)
+		os_timer_arm(&s->rx_timer, 1, 0);
+}
+
+static void softuart_rx_task(platform_task_param_t pin, uint8_t prio)
+{
+	(void) prio;
+	softuart_t *s = pin < SOFTUART_GPIO_COUNT ? softuart_gpio_instances[pin] : NULL;
+	if (s)
+		softuart_rx_process(s);
+}
+
+static void softuart_rx_timeout(void *arg)
+{
+	softuart_rx_process((softuart_t *)arg);
+}
+
 
 // Arguments: event name, minimum buffer filled to run callback, callback function
 static int softuart_on(lua_State *L)
@@ -344,16 +353,13 @@ static int softuart_gcdelete(lua_State *L)
 	NODE_DBG("SoftUART GC called\n");
 	softuart_t *softuart = NULL;
 	softuart = (softuart_t*) luaL_checkudata(L, 1, "softuart.port");
-	uint8_t last_instance = 1;
-	for(uint8_t instance = 0; instance < SOFTUART_GPIO_COUNT; instance++)
-		if (softuart_gpio_instances[instance] != NULL && instance != softuart->pin_rx)
-			last_instance = 0;
-
+	if (softuart->pin_rx == 0xFF)
+		return 0;
+	os_timer_disarm(&softuart->rx_timer);
+	platform_gpio_intr_init(softuart->pin_rx, GPIO_PIN_INTR_DISABLE);
+	platform_gpio_set_batch(softuart->pin_rx, 0, 0);
 	softuart_gpio_instances[softuart->pin_rx] = NULL;
 	luaL_unref2(L, LUA_REGISTRYINDEX, softuart_rx_cb_ref[softuart->pin_rx]);
-	// Try to unregister the interrupt hook if this was last or the only instance
-	if (last_instance)
-		platform_gpio_register_intr_hook(0, softuart_intr_handler);
 	return 0;
 }
 
@@ -375,7 +381,7 @@ static int luaopen_softuart(lua_State *L)
 	for(int i = 0; i < SOFTUART_GPIO_COUNT; i++) {
 		softuart_rx_cb_ref[i] = LUA_NOREF;
 	}
-	uart_recieve_task = task_get_id((task_callback_t) softuart_rx_callback);
+	uart_recieve_task = platform_task_get_id(softuart_rx_task);
 	luaL_rometatable(L, "softuart.port", LROT_TABLEREF(softuart_port));
 	return 0;
 }
@@ -470,6 +470,7 @@ int somfy_lua_sendcommand(lua_State* L) { // pin, remote, command, rolling_code,
         luaL_error(L, "Unable to initialize timer");
     }
     platform_hw_timer_set_func(TIMER_OWNER, sendCommand, 0);
+    platform_hw_timer_set_priority(TIMER_OWNER, 100, "somfy");
     sync=2;
     signalindex=0; repeatindex=0;
     sendCommand(0);
@@ -271,6 +271,100 @@ static int spi_get_miso( lua_State *L )
   }
 }
 
+// Asynchronous block transfers, queued in a Lua table as triples of data,
+// callback and receive buffer. Only HSPI can run them.
+static platform_task_handle_t spi_async_task;
+static struct {
+  int queue_ref;
+  int head, tail;               // queue[head] is the next transfer to start
+  int data_ref, cb_ref, rx_ref; // of the transfer in flight
+  uint8_t *rx;
+  size_t len;
+} spi_async = { LUA_NOREF, 1, 1, LUA_NOREF, LUA_NOREF, LUA_NOREF, NULL, 0 };
+
+static void spi_async_start( lua_State *L )
+{
+  if (spi_async.cb_ref != LUA_NOREF || spi_async.head == spi_async.tail)
+    return;
+
+  const uint8_t *tx = NULL;
+  int i;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, spi_async.queue_ref );
+  for (i = 0; i < 3; i++) {
+    lua_rawgeti( L, -1 - i, spi_async.head + i );
+    lua_pushnil( L );
+    lua_rawseti( L, -3 - i, spi_async.head + i );
+  }
+  spi_async.head += 3;
+
+  // the stack holds the queue, data string or byte count, callback and buffer
+  if (lua_type( L, -3 ) == LUA_TSTRING)
+    tx = (const uint8_t *)lua_tostring( L, -3 );
+  spi_async.rx = lua_touserdata( L, -1 );
+  spi_async.len = lua_objlen( L, -1 );
+  spi_async.rx_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  spi_async.cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  spi_async.data_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_pop( L, 1 );
+
+  platform_spi_blktransfer_async( SPI_HSPI, spi_async.len, tx, spi_async.rx, spi_async_task, 0 );
+}
+
+static void spi_async_done( platform_task_param_t param, uint8_t prio )
+{
+  (void)param;
+  (void)prio;
+  lua_State *L = lua_getstate();
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, spi_async.cb_ref );
+  lua_pushlstring( L, (const char *)spi_async.rx, spi_async.len );
+  luaL_unref( L, LUA_REGISTRYINDEX, spi_async.rx_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, spi_async.cb_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, spi_async.data_ref );
+  spi_async.rx_ref = spi_async.cb_ref = spi_async.data_ref = LUA_NOREF;
+  spi_async.rx = NULL;
+
+  // keep the bus busy while the callback runs
+  spi_async_start( L );
+  luaL_pcallx( L, 1, 0 );
+}
+
+// Lua: spi.transaction( id, data, callback )
+static int spi_transaction_async( lua_State *L )
+{
+  int id = luaL_checkinteger( L, 1 );
+  size_t len;
+
+  luaL_argcheck( L, id == SPI_HSPI, 1, "only HSPI supports callbacks" );
+  if (lua_type( L, 2 ) == LUA_TSTRING)
+    len = lua_objlen( L, 2 );
+  else
+    len = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, len > 0, 2, "out of range" );
+  luaL_checktype( L, 3, LUA_TFUNCTION );
+  lua_settop( L, 3 );
+
+  if (spi_async.queue_ref == LUA_NOREF) {
+    lua_newtable( L );
+    spi_async.queue_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  if (spi_async.head == spi_async.tail)
+    spi_async.head = spi_async.tail = 1;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, spi_async.queue_ref );
+  lua_pushvalue( L, 2 );
+  lua_rawseti( L, -2, spi_async.tail );
+  lua_pushvalue( L, 3 );
+  lua_rawseti( L, -2, spi_async.tail + 1 );
+  lua_newuserdata( L, len );
+  lua_rawseti( L, -2, spi_async.tail + 2 );
+  spi_async.tail += 3;
+
+  spi_async_start( L );
+  return 0;
+}
+
 // Lua: spi.transaction( id, cmd_bitlen, cmd_data, addr_bitlen, addr_data, mosi_bitlen, dummy_bitlen, miso_bitlen )
 static int spi_transaction( lua_State *L )
 {
@@ -278,6 +372,9 @@ static int spi_transaction( lua_State *L )
 
   MOD_CHECK_ID( spi, id );
 
+  if (lua_isfunction( L, 3 ))
+    return spi_transaction_async( L );
+
   int cmd_bitlen = luaL_checkinteger( L, 2 );
   u16 cmd_data   = ( u16 )luaL_checkinteger( L, 3 );
   luaL_argcheck( L, 2, cmd_bitlen >= 0 && cmd_bitlen <= 16, "out of range" );
@@ -339,4 +436,9 @@ LROT_BEGIN(spi, NULL, 0)
 LROT_END(spi, NULL, 0)
 
 
-NODEMCU_MODULE(SPI, "spi", spi, NULL);
+int luaopen_spi( lua_State *L ) {
+  spi_async_task = platform_task_get_id( spi_async_done );
+  return 0;
+}
+
+NODEMCU_MODULE(SPI, "spi", spi, luaopen_spi);
@@ -146,10 +146,10 @@ static size_t optsize (lua_State *L, char opt, const char **fmt) {
 ** return number of bytes needed to align an element of size 'size'
 ** at current position 'len'
 */
-static int gettoalign (size_t len, Header *h, int opt, size_t size) {
+static int gettoalign (size_t len, int align, int opt, size_t size) {
   if (size == 0 || opt == 'c') return 0;
-  if (size > (size_t)h->align)
-    size = h->align;  /* respect max. alignment */
+  if (size > (size_t)align)
+    size = align;  /* respect max. alignment */
   return (size - (len & (size - 1))) & (size - 1);
 }
 
@@ -178,6 +178,111 @@ static void controloptions (lua_State *L, int opt, const char **fmt,
 }
 
 
+/*
+** {======================================================
+** Compiled formats
+**
+** A format string is decoded once into a list of ops, each a conversion
+** with the endianness and alignment in force at that point, so that pack
+** and unpack just run down the list.  struct.compile() keeps the list in a
+** userdata for reuse; a format passed as a string is decoded into a list on
+** the C stack for the call, as long as it is short.
+** =======================================================
+*/
+
+#define FORMAT_METATABLE  "struct.format"
+#define LOCAL_OPS         32
+
+typedef struct FormatOp {
+  char opt;
+  char endian;
+  char hidden;        /* unpacked as the length of a following 'c0' */
+  unsigned char align;
+  size_t size;
+} FormatOp;
+
+typedef struct Format {
+  FormatOp *ops;
+  int nops;
+  int nvalues;        /* values returned by unpack */
+  int varopt;         /* option that makes the size vary, or 0 */
+  size_t size;        /* total size when varopt is 0 */
+} Format;
+
+
+static void compile (lua_State *L, Format *f, const char *fmt) {
+  Header h;
+  int last = -1;  /* latest op unpacked as a value */
+  defaultoptions(&h);
+  f->nops = f->nvalues = f->varopt = 0;
+  f->size = 0;
+  while (*fmt != '\0') {
+    int opt = *fmt++;
+    size_t size = optsize(L, opt, &fmt);
+    switch (opt) {
+      case 'b': case 'B': case 'h': case 'H':
+      case 'l': case 'L': case 'T': case 'i': case 'I':
+#ifndef LUA_NUMBER_INTEGRAL
+      case 'f': case 'd':
+#endif
+      case 'x': case 'c': case 's': {
+        FormatOp *op = &f->ops[f->nops];
+        op->opt = opt;
+        op->endian = h.endian;
+        op->hidden = 0;
+        op->align = h.align;
+        op->size = size;
+        if (opt == 'c' && size == 0) {
+          if (last < 0 || f->ops[last].opt == 'c' || f->ops[last].opt == 's')
+            luaL_error(L, "format `c0' needs a previous size");
+          f->ops[last].hidden = 1;
+          f->nvalues--;
+        }
+        if (opt != 'x') {
+          last = f->nops;
+          f->nvalues++;
+        }
+        if (opt == 's' || (opt == 'c' && size == 0)) {
+          if (!f->varopt)
+            f->varopt = opt;
+        } else {
+          f->size += gettoalign(f->size, h.align, opt, size) + size;
+        }
+        f->nops++;
+        break;
+      }
+      default: controloptions(L, opt, &fmt, &h);
+    }
+  }
+}
+
+
+/*
+** The format at stack 1, either compiled or a string decoded into 'local'.
+** A long string is compiled into a userdata that replaces it at stack 1.
+*/
+static Format *getformat (lua_State *L, Format *local) {
+  Format *f = (Format *)luaL_testudata(L, 1, FORMAT_METATABLE);
+  if (f == NULL) {
+    size_t l;
+    const char *fmt = luaL_checklstring(L, 1, &l);
+    if (l <= LOCAL_OPS) {
+      f = local;
+    } else {
+      f = (Format *)lua_newuserdata(L, sizeof(Format) + l * sizeof(FormatOp));
+      f->ops = (FormatOp *)(f + 1);
+      luaL_getmetatable(L, FORMAT_METATABLE);
+      lua_setmetatable(L, -2);
+      lua_replace(L, 1);
+    }
+    compile(L, f, fmt);
+  }
+  return f;
+}
+
+/* }====================================================== */
+
+
 static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
                         int size) {
   int32_t n = luaL_checkinteger(L, arg);
@@ -219,23 +324,24 @@ static void correctbytes (char *b, int size, int endian) {
 
 static int b_pack (lua_State *L) {
   luaL_Buffer b;
-  const char *fmt = luaL_checkstring(L, 1);
-  Header h;
+  FormatOp local_ops[LOCAL_OPS];
+  Format local = { local_ops, 0, 0, 0, 0 };
+  Format *f = getformat(L, &local);
+  const FormatOp *op = f->ops, *end = f->ops + f->nops;
   int arg = 2;
   size_t totalsize = 0;
-  defaultoptions(&h);
   lua_pushnil(L);  /* mark to separate arguments from string buffer */
   luaL_buffinit(L, &b);
-  while (*fmt != '\0') {
-    int opt = *fmt++;
-    size_t size = optsize(L, opt, &fmt);
-    int toalign = gettoalign(totalsize, &h, opt, size);
+  for (; op < end; op++) {
+    int opt = op->opt;
+    size_t size = op->size;
+    int toalign = gettoalign(totalsize, op->align, opt, size);
     totalsize += toalign;
     while (toalign-- > 0) luaL_addchar(&b, '\0');
     switch (opt) {
       case 'b': case 'B': case 'h': case 'H':
       case 'l': case 'L': case 'T': case 'i': case 'I': {  /* integer types */
-        putinteger(L, &b, arg++, h.endian, size);
+        putinteger(L, &b, arg++, op->endian, size);
         break;
       }
       case 'x': {
@@ -245,13 +351,13 @@ static int b_pack (lua_State *L) {
 #ifndef LUA_NUMBER_INTEGRAL
       case 'f': {
         float f = (float)luaL_checknumber(L, arg++);
-        correctbytes((char *)&f, size, h.endian);
+        correctbytes((char *)&f, size, op->endian);
         luaL_addlstring(&b, (char *)&f, size);
         break;
       }
       case 'd': {
         double d = luaL_checknumber(L, arg++);
-        correctbytes((char *)&d, size, h.endian);
+        correctbytes((char *)&d, size, op->endian);
         luaL_addlstring(&b, (char *)&d, size);
         break;
       }
@@ -268,7 +374,6 @@ static int b_pack (lua_State *L) {
         }
         break;
       }
-      default: controloptions(L, opt, &fmt, &h);
     }
     totalsize += size;
   }
@@ -304,25 +409,29 @@ static int64_t getinteger (const char *buff, int endian,
 }
 
 
-static int b_unpack (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
-  size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
-  size_t pos = luaL_optinteger(L, 3, 1) - 1;
-  defaultoptions(&h);
-  lua_settop(L, 2);
-  while (*fmt) {
-    int opt = *fmt++;
-    size_t size = optsize(L, opt, &fmt);
-    pos += gettoalign(pos, &h, opt, size);
+/*
+** Unpack one record at 'pos'.  With 'cols' 0 the values are pushed;
+** otherwise value k is stored as entry 'row' of the table at stack cols+k-1.
+** Returns the position after the record.
+*/
+static size_t unpackrecord (lua_State *L, const Format *f, const char *data,
+                            size_t ld, size_t pos, int cols, int row) {
+  const FormatOp *op = f->ops, *end = f->ops + f->nops;
+  lua_Number len = -1;  /* value of the latest hidden op */
+  for (; op < end; op++) {
+    int opt = op->opt;
+    size_t size = op->size;
+    pos += gettoalign(pos, op->align, opt, size);
     luaL_argcheck(L, pos+size <= ld, 2, "data string too short");
-    luaL_checkstack(L, 2, "too many results");
     switch (opt) {
       case 'b': case 'B': case 'h': case 'H':
       case 'l': case 'L': case 'T': case 'i':  case 'I': {  /* integer types */
         int issigned = islower(opt);
-        int64_t res = getinteger(data+pos, h.endian, issigned, size);
+        int64_t res = getinteger(data+pos, op->endian, issigned, size);
+        if (op->hidden) {
+          len = res;
+          break;
+        }
         if (res >= LUA_MININTEGER && res <= LUA_MAXINTEGER) {
           lua_pushinteger(L, res);
         } else {
@@ -331,31 +440,37 @@ static int b_unpack (lua_State *L) {
         break;
       }
       case 'x': {
-        break;
+        pos += size;
+        continue;
       }
 #ifndef LUA_NUMBER_INTEGRAL
       case 'f': {
         float f;
         memcpy(&f, data+pos, size);
-        correctbytes((char *)&f, sizeof(f), h.endian);
+        correctbytes((char *)&f, sizeof(f), op->endian);
+        if (op->hidden) {
+          len = f;
+          break;
+        }
         lua_pushnumber(L, f);
         break;
       }
       case 'd': {
         double d;
         memcpy(&d, data+pos, size);
-        correctbytes((char *)&d, sizeof(d), h.endian);
+        correctbytes((char *)&d, sizeof(d), op->endian);
+        if (op->hidden) {
+          len = d;
+          break;
+        }
         lua_pushnumber(L, d);
         break;
       }
 #endif
       case 'c': {
         if (size == 0) {
-          if (!lua_isnumber(L, -1))
-            luaL_error(L, "format `c0' needs a previous size");
-          size = lua_tointeger(L, -1);
-          lua_pop(L, 1);
-          luaL_argcheck(L, pos+size <= ld, 2, "data string too short");
+          size = (size_t)len;
+          luaL_argcheck(L, len >= 0 && pos+size <= ld, 2, "data string too short");
         }
         lua_pushlstring(L, data+pos, size);
         break;
@@ -368,48 +483,118 @@ static int b_unpack (lua_State *L) {
         lua_pushlstring(L, data+pos, size - 1);
         break;
       }
-      default: controloptions(L, opt, &fmt, &h);
     }
     pos += size;
+    if (cols && !op->hidden)
+      lua_rawseti(L, cols++, row);
   }
+  return pos;
+}
+
+
+static int b_unpack (lua_State *L) {
+  FormatOp local_ops[LOCAL_OPS];
+  Format local = { local_ops, 0, 0, 0, 0 };
+  Format *f = getformat(L, &local);
+  size_t ld;
+  const char *data = luaL_checklstring(L, 2, &ld);
+  size_t pos = luaL_optinteger(L, 3, 1) - 1;
+  lua_settop(L, 2);
+  luaL_checkstack(L, f->nvalues + 1, "too many results");
+  pos = unpackrecord(L, f, data, ld, pos, 0, 0);
   lua_pushinteger(L, pos + 1);
   return lua_gettop(L) - 2;
 }
 
 
-static int b_size (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
-  size_t pos = 0;
-  defaultoptions(&h);
-  while (*fmt) {
-    int opt = *fmt++;
-    size_t size = optsize(L, opt, &fmt);
-    pos += gettoalign(pos, &h, opt, size);
-    if (opt == 's')
-      luaL_argerror(L, 1, "option 's' has no fixed size");
-    else if (opt == 'c' && size == 0)
-      luaL_argerror(L, 1, "option 'c0' has no fixed size");
-    if (!isalnum(opt))
-      controloptions(L, opt, &fmt, &h);
-    pos += size;
+/*
+** Unpack 'n' records, by default as many as the data holds, into one array
+** per value of the format.
+*/
+static int b_unpackn (lua_State *L) {
+  FormatOp local_ops[LOCAL_OPS];
+  Format local = { local_ops, 0, 0, 0, 0 };
+  Format *f = getformat(L, &local);
+  size_t ld;
+  const char *data = luaL_checklstring(L, 2, &ld);
+  size_t pos = luaL_optinteger(L, 3, 1) - 1;
+  lua_Integer n = luaL_optinteger(L, 4, -1);
+  int i, row, cols;
+  luaL_argcheck(L, pos <= ld, 3, "position out of range");
+  if (n < 0) {
+    if (f->varopt == 0)
+      n = f->size ? (ld - pos) / f->size : 0;  /* any padding excepted */
+    else
+      n = LUA_MAXINTEGER;
+  }
+  lua_settop(L, 2);
+  luaL_checkstack(L, f->nvalues + 2, "too many results");
+  cols = lua_gettop(L) + 1;
+  for (i = 0; i < f->nvalues; i++)
+    lua_createtable(L, n < LUA_MAXINTEGER && n < 1024 ? n : 0, 0);
+  for (row = 1; row <= n && pos < ld; row++)
+    pos = unpackrecord(L, f, data, ld, pos, cols, row);
+  lua_createtable(L, f->nvalues, 0);
+  for (i = f->nvalues; i > 0; i--) {
+    lua_pushvalue(L, cols + i - 1);
+    lua_rawseti(L, -2, i);
   }
-  lua_pushinteger(L, pos);
+  lua_pushinteger(L, pos + 1);
+  return 2;
+}
+
+
+static int b_size (lua_State *L) {
+  FormatOp local_ops[LOCAL_OPS];
+  Format local = { local_ops, 0, 0, 0, 0 };
+  Format *f = getformat(L, &local);
+  if (f->varopt == 's')
+    luaL_argerror(L, 1, "option 's' has no fixed size");
+  else if (f->varopt == 'c')
+    luaL_argerror(L, 1, "option 'c0' has no fixed size");
+  lua_pushinteger(L, f->size);
+  return 1;
+}
+
+
+static int b_compile (lua_State *L) {
+  size_t l;
+  const char *fmt = luaL_checklstring(L, 1, &l);
+  Format *f = (Format *)lua_newuserdata(L, sizeof(Format) + l * sizeof(FormatOp));
+  f->ops = (FormatOp *)(f + 1);
+  luaL_getmetatable(L, FORMAT_METATABLE);
+  lua_setmetatable(L, -2);
+  compile(L, f, fmt);
   return 1;
 }
 
 /* }====================================================== */
 
 
+LROT_BEGIN(format_meta, NULL, LROT_MASK_INDEX)
+  LROT_TABENTRY( __index, format_meta )
+  LROT_FUNCENTRY( pack, b_pack )
+  LROT_FUNCENTRY( unpack, b_unpack )
+  LROT_FUNCENTRY( unpackn, b_unpackn )
+  LROT_FUNCENTRY( size, b_size )
+LROT_END(format_meta, NULL, LROT_MASK_INDEX)
+
+
 LROT_BEGIN(thislib, NULL, 0)
   LROT_FUNCENTRY( pack, b_pack )
   LROT_FUNCENTRY( unpack, b_unpack )
+  LROT_FUNCENTRY( unpackn, b_unpackn )
   LROT_FUNCENTRY( size, b_size )
+  LROT_FUNCENTRY( compile, b_compile )
 LROT_END(thislib, NULL, 0)
 
 
+int luaopen_struct (lua_State *L) {
+  luaL_rometatable(L, FORMAT_METATABLE, LROT_TABLEREF(format_meta));
+  return 0;
+}
 
-NODEMCU_MODULE(STRUCT, "struct", thislib, NULL);
+NODEMCU_MODULE(STRUCT, "struct", thislib, luaopen_struct);
 
 /******************************************************************************
 * Copyright (C) 2010-2012 Lua.org, PUC-Rio.  All rights reserved.
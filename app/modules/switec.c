@@ -20,32 +20,53 @@
 #include "task/task.h"
 #include "driver/switec.h"
 
-// This is the reference to the callbacks for when the pointer
-// stops moving.
-static int stopped_callback[SWITEC_CHANNEL_COUNT] = { LUA_NOREF, LUA_NOREF, LUA_NOREF };
+// These are the references to the callbacks for when the pointer
+// completes each of the moves given to it, with the sequence numbers of
+// the moves.
+typedef struct {
+  int ref;
+  uint16_t seq;
+} CALLBACK;
+
+static struct {
+  uint8_t head;
+  uint8_t count;
+  CALLBACK cb[SWITEC_QUEUE_LEN + 1];
+} stopped_callback[SWITEC_CHANNEL_COUNT];
 static task_handle_t tasknumber;
 
 static void callback_free(lua_State* L, unsigned int id)
 {
-  luaL_unref(L, LUA_REGISTRYINDEX, stopped_callback[id]);
-  stopped_callback[id] = LUA_NOREF;
+  while (stopped_callback[id].count) {
+    luaL_unref(L, LUA_REGISTRYINDEX, stopped_callback[id].cb[stopped_callback[id].head].ref);
+    stopped_callback[id].head = (stopped_callback[id].head + 1) % (SWITEC_QUEUE_LEN + 1);
+    stopped_callback[id].count--;
+  }
 }
 
-static void callback_set(lua_State* L, unsigned int id, int argNumber)
+static void callback_set(lua_State* L, unsigned int id, int argNumber, uint16_t seq)
 {
   if (lua_isfunction(L, argNumber)) {
     lua_pushvalue(L, argNumber);  // copy argument (func) to the top of stack
-    callback_free(L, id);
-    stopped_callback[id] = luaL_ref(L, LUA_REGISTRYINDEX);
+    CALLBACK *cb = &stopped_callback[id].cb[(stopped_callback[id].head + stopped_callback[id].count) % (SWITEC_QUEUE_LEN + 1)];
+    cb->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    cb->seq = seq;
+    stopped_callback[id].count++;
   }
 }
 
-static void callback_execute(lua_State* L, unsigned int id)
+// Runs the callbacks of the moves up to and including done
+static void callback_execute(lua_State* L, unsigned int id, uint16_t done)
 {
-  if (stopped_callback[id] != LUA_NOREF) {
-    int callback = stopped_callback[id];
-    lua_rawgeti(L, LUA_REGISTRYINDEX, callback);
-    callback_free(L, id);
+  while (stopped_callback[id].count) {
+    CALLBACK *cb = &stopped_callback[id].cb[stopped_callback[id].head];
+    if ((int16_t) (done - cb->seq) < 0) {
+      break;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cb->ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, cb->ref);
+    stopped_callback[id].head = (stopped_callback[id].head + 1) % (SWITEC_QUEUE_LEN + 1);
+    stopped_callback[id].count--;
 
     luaL_pcallx(L, 0, 0);
   }
@@ -127,15 +148,30 @@ static int lswitec_moveto( lua_State* L )
   int pos;
   pos = luaL_checkinteger( L, 2 );
 
-  if (lua_gettop(L) >= 3) {
-    callback_set(L, id, 3);
-  } else {
-    callback_free(L, id);
+  uint16_t seq;
+  if (switec_moveto( id, pos, &seq )) {
+    return luaL_error( L, "Unable to move stepper." );
   }
+  callback_free(L, id);
+  callback_set(L, id, 3, seq);
+  return 0;
+}
 
-  if (switec_moveto( id, pos )) {
-    return luaL_error( L, "Unable to move stepper." );
+// Lua: queue( id, pos [, cb] )
+static int lswitec_queue( lua_State* L )
+{
+  unsigned int id;
+
+  id = luaL_checkinteger( L, 1 );
+  MOD_CHECK_ID( switec, id );
+  int pos;
+  pos = luaL_checkinteger( L, 2 );
+
+  uint16_t seq;
+  if (switec_queue( id, pos, &seq )) {
+    return luaL_error( L, "Unable to queue move." );
   }
+  callback_set(L, id, 3, seq);
   return 0;
 }
 
@@ -162,15 +198,9 @@ static int lswitec_dequeue(lua_State* L)
   int id;
 
   for (id = 0; id < SWITEC_CHANNEL_COUNT; id++) {
-    if (stopped_callback[id] != LUA_NOREF) {
-      int32_t pos;
-      int32_t dir;
-      int32_t target;
-      if (!switec_getpos( id, &pos, &dir, &target )) {
-	if (dir == 0 && pos == target) {
-	  callback_execute(L, id);
-	}
-      }
+    uint16_t done;
+    if (stopped_callback[id].count && !switec_done(id, &done)) {
+      callback_execute(L, id, done);
     }
   }
 
@@ -201,6 +231,7 @@ LROT_BEGIN(switec, NULL, 0)
   LROT_FUNCENTRY( close, lswitec_close )
   LROT_FUNCENTRY( reset, lswitec_reset )
   LROT_FUNCENTRY( moveto, lswitec_moveto )
+  LROT_FUNCENTRY( queue, lswitec_queue )
   LROT_FUNCENTRY( getpos, lswitec_getpos )
 #ifdef SQITEC_DEBUG
   LROT_FUNCENTRY( dequeue, lswitec_dequeue )
@@ -40,6 +40,8 @@ typedef struct {
   int cb_sent_ref;
   int cb_receive_ref;
   int cb_dns_ref;
+  int pipe_ref;         // pipe being sent, one record at a time from txbuf
+  char *txbuf;
 } tls_socket_ud;
 
 static int tls_socket_create( lua_State *L ) {
@@ -53,7 +55,9 @@ static int tls_socket_create( lua_State *L ) {
   ud->cb_disconnect_ref =
   ud->cb_sent_ref =
   ud->cb_receive_ref =
-  ud->cb_dns_ref = LUA_NOREF;
+  ud->cb_dns_ref =
+  ud->pipe_ref = LUA_NOREF;
+  ud->txbuf = NULL;
 
   luaL_getmetatable(L, "tls.socket");
   lua_setmetatable(L, -2);
@@ -72,6 +76,13 @@ static void tls_socket_onconnect( struct espconn *pesp_conn ) {
   }
 }
 
+static void tls_socket_release_pipe(lua_State *L, tls_socket_ud *ud) {
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->pipe_ref);
+  ud->pipe_ref = LUA_NOREF;
+  free(ud->txbuf);
+  ud->txbuf = NULL;
+}
+
 static void tls_socket_cleanup(tls_socket_ud *ud) {
   if (ud->pesp_conn.proto.tcp) {
     espconn_secure_disconnect(&ud->pesp_conn);
@@ -79,6 +90,7 @@ static void tls_socket_cleanup(tls_socket_ud *ud) {
     ud->pesp_conn.proto.tcp = NULL;
   }
   lua_State *L = lua_getstate();
+  tls_socket_release_pipe(L, ud);
   lua_gc(L, LUA_GCSTOP, 0);
   luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
   ud->self_ref = LUA_NOREF;
@@ -138,9 +150,45 @@ static void tls_socket_onrecv( struct espconn *pesp_conn, char *buf, u16 length
   }
 }
 
+extern int pipe_drain(lua_State *L, int ndx,
+                      int (*fn)(void *, const char *, size_t), void *arg);
+
+typedef struct {
+  char *buf;
+  size_t len;
+} tls_record_t;
+
+static int tls_fill_record( void *arg, const char *s, size_t l ) {
+  tls_record_t *r = (tls_record_t *)arg;
+  if (r->len + l > MBEDTLS_SSL_PLAIN_ADD)
+    return 1;                         // the rest goes in the next record
+  memcpy(r->buf + r->len, s, l);
+  r->len += l;
+  return 0;
+}
+
+/*
+ * Send the next record of the pipe being sent, taking its chunks out of the
+ * pipe.  Returns 0 and lets the pipe go once it is empty.
+ */
+static int tls_socket_send_pipe( lua_State *L, tls_socket_ud *ud ) {
+  tls_record_t r = { ud->txbuf, 0 };
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->pipe_ref);
+  pipe_drain(L, -1, tls_fill_record, &r);
+  lua_pop(L, 1);
+  if (r.len == 0) {
+    tls_socket_release_pipe(L, ud);
+    return 0;
+  }
+  espconn_secure_send(&ud->pesp_conn, (uint8 *)r.buf, r.len);
+  return 1;
+}
+
 static void tls_socket_onsent( struct espconn *pesp_conn ) {
   tls_socket_ud *ud = (tls_socket_ud *)pesp_conn;
   if (!ud || ud->self_ref == LUA_NOREF) return;
+  if (ud->pipe_ref != LUA_NOREF && tls_socket_send_pipe(lua_getstate(), ud))
+    return;                           // sent is called once the pipe is empty
   if (ud->cb_sent_ref != LUA_NOREF) {
     lua_State *L = lua_getstate();
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->cb_sent_ref);
@@ -257,13 +305,33 @@ static int tls_socket_on( lua_State *L ) {
 static int tls_socket_send( lua_State *L ) {
   tls_socket_ud *ud = (tls_socket_ud *)luaL_checkudata(L, 1, "tls.socket");
   size_t sl;
-  const char* buf = luaL_checklstring(L, 2, &sl);
+  const char* buf = NULL;
+  if (pipe_drain(L, 2, NULL, NULL) < 0)
+    buf = luaL_checklstring(L, 2, &sl);
   if(ud->pesp_conn.proto.tcp == NULL) {
     NODE_DBG("not connected");
     return 0;
   }
 
-  espconn_secure_send(&ud->pesp_conn, (void*)buf, sl);
+  if (buf) {
+    espconn_secure_send(&ud->pesp_conn, (void*)buf, sl);
+    return 0;
+  }
+  /* A pipe is sent record by record from the sent callback, and its chunks
+   * are taken out of it as they are encrypted */
+  if (ud->pipe_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->pipe_ref);
+    int same = lua_rawequal(L, -1, 2);
+    lua_pop(L, 1);
+    luaL_argcheck(L, same, 2, "another pipe is being sent");
+    return 0;                         // already under way
+  }
+  ud->txbuf = (char *)malloc(MBEDTLS_SSL_PLAIN_ADD);
+  if (!ud->txbuf)
+    return luaL_error(L, "out of memory");
+  lua_pushvalue(L, 2);
+  ud->pipe_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  tls_socket_send_pipe(L, ud);
   return 0;
 }
 
@@ -335,6 +403,7 @@ static int tls_socket_delete( lua_State *L ) {
   ud->cb_receive_ref = LUA_NOREF;
   luaL_unref(L, LUA_REGISTRYINDEX, ud->cb_sent_ref);
   ud->cb_sent_ref = LUA_NOREF;
+  tls_socket_release_pipe(L, ud);
 
   lua_gc(L, LUA_GCSTOP, 0);
   luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
@@ -463,6 +532,8 @@ static const char *fill_page_with_pem(lua_State *L, const unsigned char *flash_m
 // Lua: tls.cert.auth(true / false)
 static int tls_cert_auth(lua_State *L)
 {
+  // Sessions set up under the old trust settings must not be resumed
+  espconn_ssl_session_flush();
   if (ssl_client_options.cert_auth_callback != LUA_NOREF) {
     luaL_unref(L, LUA_REGISTRYINDEX, ssl_client_options.cert_auth_callback);
     ssl_client_options.cert_auth_callback = LUA_NOREF;
@@ -517,6 +588,8 @@ static int tls_cert_auth(lua_State *L)
 // Lua: tls.cert.verify(true / false)
 static int tls_cert_verify(lua_State *L)
 {
+  // Sessions set up under the old trust settings must not be resumed
+  espconn_ssl_session_flush();
   if (ssl_client_options.cert_verify_callback != LUA_NOREF) {
     luaL_unref(L, LUA_REGISTRYINDEX, ssl_client_options.cert_verify_callback);
     ssl_client_options.cert_verify_callback = LUA_NOREF;
@@ -567,6 +640,12 @@ static int tls_cert_verify(lua_State *L)
   return 1;
 }
 
+// Lua: tls.clearSessions()
+static int tls_clear_sessions(lua_State *L) {
+  espconn_ssl_session_flush();
+  return 0;
+}
+
 #if defined(MBEDTLS_DEBUG_C)
 static int tls_set_debug_threshold(lua_State *L) {
   mbedtls_debug_set_threshold(luaL_checkint( L, 1 ));
@@ -597,6 +676,7 @@ LROT_END(tls_cert, NULL, LROT_MASK_INDEX)
 
 LROT_BEGIN(tls, NULL, 0)
   LROT_FUNCENTRY( createConnection, tls_socket_create )
+  LROT_FUNCENTRY( clearSessions, tls_clear_sessions )
 #if defined(MBEDTLS_DEBUG_C)
   LROT_FUNCENTRY( setDebug, tls_set_debug_threshold )
 #endif
@@ -609,5 +689,5 @@ int luaopen_tls( lua_State *L ) {
   return 0;
 }
 
-NODEMCU_MODULE(TLS, "tls", tls, luaopen_tls);
+NODEMCU_MODULE_LAZY(TLS, "tls", tls, luaopen_tls);
 #endif
@@ -6,6 +6,18 @@
 #include "user_interface.h"
 
 #include "pixbuf.h"
+#include "driver/i2s_led.h"
+
+// The pin argument that streams by I2S DMA on GPIO3 instead
+#define TM1829_I2S 0x100
+
+static platform_task_handle_t i2s_done_task;
+static bool i2s_ready;
+
+// The first byte of a pixel must not be 0xFF, which would set the constant current
+static inline uint8_t tm1829_clamp(uint8_t pixel, size_t index) {
+  return (index % 3 == 0 && pixel == 0xFF) ? 0xFE : pixel;
+}
 
 static inline uint32_t _getCycleCount(void) {
   uint32_t cycles;
@@ -30,11 +42,7 @@ static void ICACHE_RAM_ATTR tm1829_write_to_pin(uint8_t pin, const uint8_t *pixe
   while (p != end) {
     register int i;
 
-    register uint8_t pixel = *p++;
-    if ((phasergb == 0) && (pixel == 0xFF)) {
-      // clamp initial byte value to avoid constant-current shenanigans.  Yuck!
-      pixel = 0xFE;
-    }
+    register uint8_t pixel = tm1829_clamp(*p++, phasergb);
     if (++phasergb == 3) {
       phasergb = 0;
     }
@@ -64,15 +72,44 @@ static void ICACHE_RAM_ATTR tm1829_write_to_pin(uint8_t pin, const uint8_t *pixe
   }
 }
 
-// Lua: tm1829.write(pin, "string")
+static void i2s_done(platform_task_param_t param, uint8_t prio) {
+  int ref = (int)param;
+  if (ref != LUA_NOREF) {
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    luaL_pcallx(L, 0, 0);
+  }
+}
+
+// The line idles high, and each bit starts low: 0111 for a 0, 0011 for a 1,
+// 0.31us and 0.62us low (spec 0.35 and 0.70 +- 0.15)
+static void tm1829_write_i2s(lua_State *L, const uint8_t *pixels, size_t length, int cb_ref) {
+  if (!i2s_ready) {
+    i2s_led_init();
+    i2s_ready = true;
+  }
+  uint32_t *out = i2s_led_frame(length);
+  if (!out) {
+    luaL_unref(L, LUA_REGISTRYINDEX, cb_ref);
+    luaL_error(L, "out of memory");
+  }
+  size_t i;
+  for (i = 0; i < length; i++)
+    out[i] = i2s_led_code(tm1829_clamp(pixels[i], i), 0x7, 0x3);
+  i2s_led_send(true, i2s_done_task, (platform_task_param_t)cb_ref);
+}
+
+// Lua: tm1829.write(pin, "string"[, callback])
 // Byte triples in the string are interpreted as GRB values.
 static int ICACHE_FLASH_ATTR tm1829_write(lua_State* L)
 {
-  const uint8_t pin = luaL_checkinteger(L, 1);
+  const unsigned pin = luaL_checkinteger(L, 1);
   const uint8_t *pixels;
   size_t length;
 
-  switch(lua_type(L, 3)) {
+  luaL_argcheck(L, pin == TM1829_I2S || platform_gpio_exists(pin), 1, "Invalid pin");
+  switch(lua_type(L, 2)) {
   case LUA_TSTRING: {
     pixels = luaL_checklstring(L, 2, &length);
     break;
@@ -90,6 +127,18 @@ static int ICACHE_FLASH_ATTR tm1829_write(lua_State* L)
     return luaL_argerror(L, 2, "String or pixbuf expected");
   }
 
+  if (pin == TM1829_I2S) {
+    // The frame is copied, so the data may be reused as soon as this returns
+    int ref = LUA_NOREF;
+    if (!lua_isnoneornil(L, 3)) {
+      luaL_checktype(L, 3, LUA_TFUNCTION);
+      lua_pushvalue(L, 3);
+      ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    tm1829_write_i2s(L, pixels, length, ref);
+    return 0;
+  }
+
   // Initialize the output pin and wait a bit
   platform_gpio_mode(pin, PLATFORM_GPIO_OUTPUT, PLATFORM_GPIO_FLOAT);
   platform_gpio_write(pin, 1);
@@ -104,11 +153,13 @@ static int ICACHE_FLASH_ATTR tm1829_write(lua_State* L)
 
 LROT_BEGIN(tm1829, NULL, 0)
   LROT_FUNCENTRY( write, tm1829_write )
+  LROT_NUMENTRY( I2S, TM1829_I2S )
 LROT_END(tm1829, NULL, 0)
 
 
 int luaopen_tm1829(lua_State *L) {
   // TODO: Make sure that the GPIO system is initialized
+  i2s_done_task = platform_task_get_id(i2s_done);
   return 0;
 }
 
@@ -13,6 +13,7 @@
 #include <stdint.h>
 #include "user_interface.h"
 #include "pm/swtimer.h"
+#include "timer_wheel.h"
 
 #define TIMER_MODE_SINGLE 0
 #define TIMER_MODE_AUTO   1
@@ -29,10 +30,12 @@
 static const uint32 MAX_TIMEOUT=MAX_TIMEOUT_DEF;
 static const char* MAX_TIMEOUT_ERR_STR = "Range: 1-"STRINGIFY(MAX_TIMEOUT_DEF);
 
+// Timers live on the platform timer wheel rather than the SDK timer list,
+// so that arming one costs the same however many there are
 typedef struct{
-  os_timer_t os;
-  sint32_t lua_ref;  /* Reference to registered callback function */
-  sint32_t self_ref;  /* Reference to UD registered slot */
+  twheel_timer_t tw;
+  luaL_Slot cb;    /* registered callback function */
+  luaL_Slot self;  /* the timer userdata, while it is armed */
   uint32_t interval;
   uint8_t mode;
 } tmr_t;
@@ -57,18 +60,18 @@ static os_timer_t rtc_timer;
 
 static void alarm_timer_common(void* arg){
   tmr_t *tmr = (tmr_t *) arg;
-  if(tmr->lua_ref > 0) {
+  if(luaL_slotisset(&tmr->cb)) {
     lua_State* L = lua_getstate();
-    lua_rawgeti(L, LUA_REGISTRYINDEX, tmr->lua_ref);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, tmr->self_ref);
+    luaL_pushslot(L, &tmr->cb);
+    luaL_pushslot(L, &tmr->self);
     if (tmr->mode != TIMER_MODE_AUTO) {
     if(tmr->mode == TIMER_MODE_SINGLE) {
-      luaL_unref2(L, LUA_REGISTRYINDEX, tmr->lua_ref);
-      luaL_unref2(L, LUA_REGISTRYINDEX, tmr->self_ref);
+      luaL_unsetslot(L, &tmr->cb);
+      luaL_unsetslot(L, &tmr->self);
       tmr->mode = TIMER_MODE_OFF;
     } else if (tmr->mode == TIMER_MODE_SEMI) {
       tmr->mode |= TIMER_IDLE_FLAG;
-      luaL_unref2(L, LUA_REGISTRYINDEX, tmr->self_ref);
+      luaL_unsetslot(L, &tmr->self);
       }
     }
     luaL_pcallx(L, 1, 0);
@@ -104,24 +107,27 @@ static int tmr_ccount(lua_State* L){
 ** stack is preserved for the following start(), so the stack MUST be balanced here.
 */
 
-// Lua: t:register( interval, mode, function )
+// Lua: t:register( interval, mode, function[, slack] )
 static int tmr_register(lua_State* L) {
   tmr_t *tmr = (tmr_t *) luaL_checkudata(L, 1, "tmr.timer");
   uint32_t interval = luaL_checkinteger(L, 2);
   uint8_t mode = luaL_checkinteger(L, 3);
+  lua_Integer slack = luaL_optinteger(L, 5, 0);
 
   luaL_argcheck(L, (interval > 0 && interval <= MAX_TIMEOUT), 2, MAX_TIMEOUT_ERR_STR);
   luaL_argcheck(L, (mode == TIMER_MODE_SINGLE || mode == TIMER_MODE_SEMI || mode == TIMER_MODE_AUTO), 3, "Invalid mode");
   luaL_argcheck(L, lua_isfunction(L, 4), 4, "Must be function");
+  luaL_argcheck(L, (slack >= 0 && (uint32_t) slack <= MAX_TIMEOUT), 5, MAX_TIMEOUT_ERR_STR);
 
   //get the lua function reference
   lua_pushvalue(L, 4);
   if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF)
-    os_timer_disarm(&tmr->os);
-  luaL_reref(L, LUA_REGISTRYINDEX, &tmr->lua_ref);
+    twheel_disarm(&tmr->tw);
+  luaL_setslot(L, &tmr->cb);
   tmr->mode = mode|TIMER_IDLE_FLAG;
   tmr->interval = interval;
-  os_timer_setfn(&tmr->os, alarm_timer_common, tmr);
+  twheel_setfn(&tmr->tw, alarm_timer_common, tmr);
+  twheel_set_slack(&tmr->tw, slack);
   return 0;
 }
 
@@ -133,23 +139,23 @@ static int tmr_start(lua_State* L){
   int restart = lua_toboolean(L, 2);
 
   lua_settop(L, 1);  /* we need to have userdata on top of the stack */
-  if (tmr->self_ref == LUA_NOREF)
-    tmr->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (!luaL_slotisset(&tmr->self))
+    luaL_setslot(L, &tmr->self);
 
   //we return false if the timer is not idle and is not to be restarted
   int idle = tmr->mode&TIMER_IDLE_FLAG;
   if(!(idle || restart)){
     lua_pushboolean(L, false);
   }else{
-    if (!idle) {os_timer_disarm(&tmr->os);}
+    if (!idle) {twheel_disarm(&tmr->tw);}
     tmr->mode &= ~TIMER_IDLE_FLAG;
-    os_timer_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
+    twheel_arm(&tmr->tw, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
     lua_pushboolean(L, true);
   }
   return 1;
 }
 
-// Lua: t:alarm( interval, repeat, function )
+// Lua: t:alarm( interval, repeat, function[, slack] )
 static int tmr_alarm(lua_State* L){
   tmr_register(L);
   /* remove tmr.alarm's other then the 1st UD parameters from Lua stack. 
@@ -162,10 +168,10 @@ static int tmr_alarm(lua_State* L){
 static int tmr_stop(lua_State* L){
   tmr_t *tmr = (tmr_t *) luaL_checkudata(L, 1, "tmr.timer");
   int idle = tmr->mode == TIMER_MODE_OFF || (tmr->mode & TIMER_IDLE_FLAG);
-  luaL_unref2(L, LUA_REGISTRYINDEX, tmr->self_ref);
+  luaL_unsetslot(L, &tmr->self);
 
   if(!idle)
-    os_timer_disarm(&tmr->os);
+    twheel_disarm(&tmr->tw);
   tmr->mode |= TIMER_IDLE_FLAG;
   lua_pushboolean(L, !idle);  /* return false if the timer is idle (or not registered) */
   return 1;
@@ -186,10 +192,10 @@ static int tmr_suspend_removed(lua_State* L){
 // Lua: t:unregister()
 static int tmr_unregister(lua_State* L){
   tmr_t *tmr =  (tmr_t *) luaL_checkudata(L, 1, "tmr.timer");
-  luaL_unref2(L, LUA_REGISTRYINDEX, tmr->self_ref);
-  luaL_unref2(L, LUA_REGISTRYINDEX, tmr->lua_ref);
+  luaL_unsetslot(L, &tmr->self);
+  luaL_unsetslot(L, &tmr->cb);
   if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF)
-    os_timer_disarm(&tmr->os);
+    twheel_disarm(&tmr->tw);
   tmr->mode = TIMER_MODE_OFF;
   return 0;
 }
@@ -202,8 +208,8 @@ static int tmr_interval(lua_State* L){
   if(tmr->mode != TIMER_MODE_OFF){
     tmr->interval = interval;
     if(!(tmr->mode&TIMER_IDLE_FLAG)){
-      os_timer_disarm(&tmr->os);
-      os_timer_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
+      twheel_disarm(&tmr->tw);
+      twheel_arm(&tmr->tw, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
     }
   }
   return 0;
@@ -283,7 +289,7 @@ static int tmr_create( lua_State *L ) {
   tmr_t *ud = (tmr_t *)lua_newuserdata(L, sizeof(*ud));
   luaL_getmetatable(L, "tmr.timer");
   lua_setmetatable(L, -2);
-  *ud = (tmr_t) {{0}, LUA_NOREF, LUA_NOREF, 0, TIMER_MODE_OFF};
+  *ud = (tmr_t) {TWHEEL_TIMER_INIT, LUAL_SLOT_INIT, LUAL_SLOT_INIT, 0, TIMER_MODE_OFF};
   return 1;
 }
 
@@ -341,9 +347,8 @@ int luaopen_tmr( lua_State *L ){
   // there is bound to be some drift in the clock, so a calibration is due.
   SWTIMER_REG_CB(rtc_callback, SWTIMER_RESUME);
 
-  // The function alarm_timer_common handles timers created by the developer via
-  // tmr.create().  No reason not to resume the timers, so resume em'.
-  SWTIMER_REG_CB(alarm_timer_common, SWTIMER_RESUME);
+  // Timers created by the developer via tmr.create() are driven by the timer
+  // wheel, which registers its own callback to be resumed.
 
   return 0;
 }
@@ -10,6 +10,8 @@
 #include "module.h"
 #include "lauxlib.h"
 
+#include <string.h>
+
 #define U8X8_USE_PINS
 #define U8X8_WITH_USER_PTR
 #include "u8g2.h"
@@ -31,9 +33,176 @@
 #endif
 
 
+// ***************************************************************************
+// Glyph cache
+//
+// Fonts normally sit in flash, and every glyph drawn is first searched for
+// and then decoded from there.  The cache keeps the glyph records drawn most
+// recently in RAM, laid out as a u8g2 font of their own, so that the drawing
+// functions can be pointed at that while all the glyphs of a string fit.
+//
+#define U8G2_FONT_HEADER  23       // U8G2_FONT_DATA_STRUCT_SIZE
+#define GLYPH_CACHE_MAX   64       // most glyphs held in a cache
+
+typedef struct {
+  const uint8_t *font;             // the font the glyphs are copied from
+  uint16_t size;                   // room for glyph records
+  uint16_t used;
+  uint16_t tick;                   // counts the strings drawn, for the LRU
+  uint8_t n;
+  uint8_t enc[GLYPH_CACHE_MAX];    // the glyphs held, in ascending order
+  uint16_t last[GLYPH_CACHE_MAX];  // tick when each was last drawn
+  uint8_t data[];                  // header, records and a 0,0 terminator
+} glyph_cache_t;
+
+static uint16_t font_get_u16( const uint8_t *p )
+{
+  return (p[0] << 8) | p[1];
+}
+
+static void font_set_u16( uint8_t *p, uint16_t v )
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+// Find the record of an 8-bit glyph in a font, as u8g2 does
+static const uint8_t *font_find_glyph( const uint8_t *font, uint8_t enc )
+{
+  const uint8_t *p = font + U8G2_FONT_HEADER;
+  if (enc >= 'a')
+    p += font_get_u16( font + 19 );
+  else if (enc >= 'A')
+    p += font_get_u16( font + 17 );
+  for (; p[1] != 0; p += p[1])
+    if (p[0] == enc)
+      return p;
+  return NULL;
+}
+
+static uint8_t *glyph_cache_record( glyph_cache_t *c, int i )
+{
+  uint8_t *p = c->data + U8G2_FONT_HEADER;
+  while (i--)
+    p += p[1];
+  return p;
+}
+
+// Point the lookup offsets of the cache font at the records now held
+static void glyph_cache_index( glyph_cache_t *c )
+{
+  uint8_t *glyphs = c->data + U8G2_FONT_HEADER;
+  uint16_t upper = c->used, lower = c->used, off = 0;
+  int i;
+  for (i = 0; i < c->n; i++) {
+    if (c->enc[i] >= 'A' && upper == c->used)
+      upper = off;
+    if (c->enc[i] >= 'a' && lower == c->used)
+      lower = off;
+    off += glyphs[off + 1];
+  }
+  glyphs[c->used] = glyphs[c->used + 1] = 0;
+  font_set_u16( c->data + 17, upper );
+  font_set_u16( c->data + 19, lower );
+  font_set_u16( c->data + 21, c->used );
+}
+
+static void glyph_cache_reset( glyph_cache_t *c, const uint8_t *font )
+{
+  c->font = font;
+  c->used = 0;
+  c->n = 0;
+  memcpy( c->data, font, U8G2_FONT_HEADER );
+  glyph_cache_index( c );
+}
+
+static void glyph_cache_evict( glyph_cache_t *c, int i )
+{
+  uint8_t *p = glyph_cache_record( c, i );
+  uint8_t len = p[1];
+  memmove( p, p + len, c->data + U8G2_FONT_HEADER + c->used - (p + len) );
+  c->used -= len;
+  c->n--;
+  memmove( c->enc + i, c->enc + i + 1, c->n - i );
+  memmove( c->last + i, c->last + i + 1, (c->n - i) * sizeof(c->last[0]) );
+}
+
+// Make sure a glyph is held, evicting those not drawn for longest; returns 0
+// if it won't fit besides the other glyphs of the string being drawn
+static int glyph_cache_add( glyph_cache_t *c, uint8_t enc )
+{
+  int i;
+  for (i = 0; i < c->n && c->enc[i] < enc; i++)
+    ;
+  if (i < c->n && c->enc[i] == enc) {
+    c->last[i] = c->tick;
+    return 1;
+  }
+
+  const uint8_t *src = font_find_glyph( c->font, enc );
+  if (!src)
+    return 1;               // not in the font, so nothing is drawn either way
+  uint8_t len = src[1];
+  if (len > c->size)
+    return 0;
+
+  while (c->used + len > c->size || c->n == GLYPH_CACHE_MAX) {
+    int j, lru = -1;
+    for (j = 0; j < c->n; j++)
+      if (c->last[j] != c->tick && (lru < 0 || c->last[j] < c->last[lru]))
+        lru = j;
+    if (lru < 0)
+      return 0;
+    glyph_cache_evict( c, lru );
+    if (lru < i)
+      i--;
+  }
+
+  uint8_t *p = glyph_cache_record( c, i );
+  memmove( p + len, p, c->data + U8G2_FONT_HEADER + c->used - p );
+  memcpy( p, src, len );
+  c->used += len;
+  memmove( c->enc + i + 1, c->enc + i, c->n - i );
+  memmove( c->last + i + 1, c->last + i, (c->n - i) * sizeof(c->last[0]) );
+  c->enc[i] = enc;
+  c->last[i] = c->tick;
+  c->n++;
+  return 1;
+}
+
+// Return the cache font holding all the glyphs of str, or NULL to draw from
+// the font itself
+static const uint8_t *glyph_cache_prepare( glyph_cache_t *c, const uint8_t *font,
+                                           const uint8_t *str, size_t len )
+{
+  int i;
+  if (!c || !font)
+    return NULL;
+  if (c->font != font)
+    glyph_cache_reset( c, font );
+  if (++c->tick == 0) {
+    for (i = 0; i < c->n; i++)
+      c->last[i] = 0;
+    c->tick = 1;
+  }
+  while (len--)
+    if (!glyph_cache_add( c, *str++ ))
+      return NULL;
+  glyph_cache_index( c );
+  return c->data;
+}
+
+
 typedef struct {
   int font_ref;
   int host_ref;
+  int shadow_ref;       // copy of the buffer as last sent, for partial updates
+  uint8_t *shadow;
+  uint8_t shadow_valid;
+  int cache_ref;
+  glyph_cache_t *cache;
+  const uint8_t *font;
+  int delta_ref;        // line hashes and batch buffer of the framebuffer delta mode
   u8g2_nodemcu_t u8g2;
 } u8g2_ud_t;
 
@@ -41,6 +210,16 @@ typedef struct {
   u8g2_ud_t *ud = (u8g2_ud_t *)luaL_checkudata( L, 1, "u8g2.display" ); \
   u8g2_t *u8g2 = (u8g2_t *)(&(ud->u8g2));
 
+// Switch to the cache font around a drawing call when it holds all the glyphs
+#define WITH_GLYPH_CACHE(str, len, draw) do { \
+    const uint8_t *cached = glyph_cache_prepare( ud->cache, ud->font, (const uint8_t *)(str), (len) ); \
+    if (cached) \
+      u8g2_SetFont( u8g2, cached ); \
+    draw; \
+    if (cached) \
+      u8g2_SetFont( u8g2, ud->font ); \
+  } while (0)
+
 static int lu8g2_clearBuffer( lua_State *L )
 {
   GET_U8G2();
@@ -151,7 +330,11 @@ static int lu8g2_drawGlyph( lua_State *L )
   int y   = luaL_checkint( L, ++stack );
   int enc = luaL_checkint( L, ++stack );
 
-  u8g2_DrawGlyph( u8g2, x, y, enc );
+  if (enc >= 0 && enc <= 255) {
+    uint8_t c = enc;
+    WITH_GLYPH_CACHE( &c, 1, u8g2_DrawGlyph( u8g2, x, y, enc ) );
+  } else
+    u8g2_DrawGlyph( u8g2, x, y, enc );
 
   return 0;
 }
@@ -239,7 +422,7 @@ static int lu8g2_drawStr( lua_State *L )
   int y = luaL_checkint( L, ++stack );
   const char *str = luaL_checkstring( L, ++stack );
 
-  u8g2_DrawStr( u8g2, x, y, str );
+  WITH_GLYPH_CACHE( str, strlen( str ), u8g2_DrawStr( u8g2, x, y, str ) );
 
   return 0;
 }
@@ -270,7 +453,14 @@ static int lu8g2_drawUTF8( lua_State *L )
   int y = luaL_checkint( L, ++stack );
   const char *str = luaL_checkstring( L, ++stack );
 
-  u8g2_DrawUTF8( u8g2, x, y, str );
+  // Only plain ASCII maps straight to 8-bit glyphs
+  const char *p;
+  for (p = str; *p && !(*p & 0x80); p++)
+    ;
+  if (*p)
+    u8g2_DrawUTF8( u8g2, x, y, str );
+  else
+    WITH_GLYPH_CACHE( str, p - str, u8g2_DrawUTF8( u8g2, x, y, str ) );
 
   return 0;
 }
@@ -344,11 +534,64 @@ static int lu8g2_getUTF8Width( lua_State *L )
   return 1;
 }
 
+// Transmit the tiles that differ from the shadow copy, coalescing each run of
+// changed tiles in a tile row into one update.
+static void send_changed_tiles( u8g2_ud_t *ud, u8g2_t *u8g2 )
+{
+  uint8_t tw = u8g2_GetBufferTileWidth( u8g2 );
+  uint8_t th = u8g2_GetBufferTileHeight( u8g2 );
+  size_t row_size = tw * 8;
+  uint8_t *buf = u8g2_GetBufferPtr( u8g2 );
+  uint8_t tx, ty;
+
+  if (!ud->shadow_valid) {
+    u8g2_UpdateDisplay( u8g2 );
+  } else {
+    for (ty = 0; ty < th; ty++) {
+      uint8_t *row = buf + ty * row_size, *old = ud->shadow + ty * row_size;
+      if (memcmp( row, old, row_size ) == 0)
+        continue;
+      for (tx = 0; tx < tw; tx++) {
+        uint8_t x0 = tx;
+        while (tx < tw && memcmp( row + tx * 8, old + tx * 8, 8 ) != 0)
+          tx++;
+        if (tx > x0)
+          u8g2_UpdateDisplayArea( u8g2, x0, ty, tx - x0, 1 );
+      }
+    }
+  }
+  memcpy( ud->shadow, buf, row_size * th );
+  ud->shadow_valid = 1;
+}
+
+static int partial_update( u8g2_ud_t *ud, u8g2_t *u8g2 )
+{
+  // page buffer modes hold only part of the screen
+  if (!ud->shadow ||
+      u8g2_GetBufferTileHeight( u8g2 ) != u8g2_GetU8x8( u8g2 )->display_info->tile_height)
+    return 0;
+  send_changed_tiles( ud, u8g2 );
+  return 1;
+}
+
+uint8_t u8x8_d_overlay(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *arg_ptr);
+
+// Deliver the lines of the framebuffer callback still batched
+static void flush_framebuffer( u8g2_ud_t *ud )
+{
+  if (ud->delta_ref != LUA_NOREF)
+    u8x8_d_fbrle_flush( &(ud->u8g2) );
+}
+
 static int lu8g2_sendBuffer( lua_State *L )
 {
   GET_U8G2();
 
-  u8g2_SendBuffer( u8g2 );
+  if (partial_update( ud, u8g2 ))
+    u8x8_RefreshDisplay( u8g2_GetU8x8( u8g2 ) );
+  else
+    u8g2_SendBuffer( u8g2 );
+  flush_framebuffer( ud );
 
   return 0;
 }
@@ -437,6 +680,9 @@ static int lu8g2_setFont( lua_State *L )
   }
   luaL_argcheck( L, font != NULL, stack, "invalid font" );
 
+  ud->font = font;
+  if (ud->cache)
+    ud->cache->font = NULL;  // a new string font may reuse the old address
   u8g2_SetFont( u8g2, font );
 
   return 0;
@@ -529,6 +775,94 @@ static int lu8g2_setFontRefHeightText( lua_State *L )
   return 0;
 }
 
+static int lu8g2_setFramebufferDelta( lua_State *L )
+{
+  GET_U8G2();
+  int stack = 1;
+  u8g2_nodemcu_t *ext_u8g2 = &(ud->u8g2);
+
+  int enable = lua_toboolean( L, ++stack );
+  int batch = luaL_optint( L, ++stack, 256 );
+  luaL_argcheck( L, batch >= 0 && batch <= 0x4000, stack, "invalid batch size" );
+  ++stack;
+  if (!lua_isnoneornil( L, stack ))
+    luaL_argcheck( L, lua_isuserdata( L, stack ) || lua_istable( L, stack ), stack, "websocket expected" );
+  if (u8g2_GetU8x8( u8g2 )->display_cb != u8x8_d_overlay)
+    return luaL_error( L, "no framebuffer callback" );
+
+  flush_framebuffer( ud );
+  luaL_unref( L, LUA_REGISTRYINDEX, ud->delta_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, ext_u8g2->overlay.ws_ref );
+  ud->delta_ref = LUA_NOREF;
+  ext_u8g2->overlay.ws_ref = LUA_NOREF;
+  ext_u8g2->overlay.line_hash = NULL;
+  ext_u8g2->overlay.batch = NULL;
+  ext_u8g2->overlay.batch_size = 0;
+
+  if (enable) {
+    size_t lines = u8g2_GetU8x8( u8g2 )->display_info->tile_height * 8;
+    uint32_t *hash = (uint32_t *)lua_newuserdata( L, lines * sizeof( uint32_t ) + batch );
+    memset( hash, 0, lines * sizeof( uint32_t ) );
+    ud->delta_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    ext_u8g2->overlay.line_hash = hash;
+    ext_u8g2->overlay.batch = (uint8_t *)(hash + lines);
+    ext_u8g2->overlay.batch_size = batch;
+    if (!lua_isnoneornil( L, stack )) {
+      lua_pushvalue( L, stack );
+      ext_u8g2->overlay.ws_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    }
+  }
+
+  return 0;
+}
+
+static int lu8g2_setGlyphCache( lua_State *L )
+{
+  GET_U8G2();
+  int stack = 1;
+
+  int size = luaL_optint( L, ++stack, 0 );
+  luaL_argcheck( L, size >= 0 && size <= 0x8000, stack, "invalid size" );
+
+  luaL_unref( L, LUA_REGISTRYINDEX, ud->cache_ref );
+  ud->cache_ref = LUA_NOREF;
+  ud->cache = NULL;
+
+  if (size > 0) {
+    glyph_cache_t *c = (glyph_cache_t *)lua_newuserdata( L, sizeof( glyph_cache_t ) +
+                                                            U8G2_FONT_HEADER + size + 2 );
+    c->font = NULL;
+    c->size = size;
+    c->tick = 0;
+    ud->cache = c;
+    ud->cache_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  (void)u8g2;
+
+  return 0;
+}
+
+static int lu8g2_setPartialUpdate( lua_State *L )
+{
+  GET_U8G2();
+  int stack = 1;
+
+  int enable = lua_toboolean( L, ++stack );
+
+  luaL_unref( L, LUA_REGISTRYINDEX, ud->shadow_ref );
+  ud->shadow_ref = LUA_NOREF;
+  ud->shadow = NULL;
+  ud->shadow_valid = 0;
+
+  if (enable) {
+    ud->shadow = (uint8_t *)lua_newuserdata( L, u8g2_GetBufferTileWidth( u8g2 ) * 8 *
+                                                u8g2_GetBufferTileHeight( u8g2 ) );
+    ud->shadow_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+
+  return 0;
+}
+
 static int lu8g2_setPowerSave( lua_State *L )
 {
   GET_U8G2();
@@ -545,7 +879,9 @@ static int lu8g2_updateDisplay( lua_State *L )
 {
   GET_U8G2();
 
-  u8g2_UpdateDisplay( u8g2 );
+  if (!partial_update( ud, u8g2 ))
+    u8g2_UpdateDisplay( u8g2 );
+  flush_framebuffer( ud );
 
   return 0;
 }
@@ -562,6 +898,20 @@ static int lu8g2_updateDisplayArea( lua_State *L )
 
   u8g2_UpdateDisplayArea( u8g2, x, y, w, h );
 
+  if (ud->shadow_valid) {
+    // record the tiles sent, clipped to the buffer
+    uint8_t tw = u8g2_GetBufferTileWidth( u8g2 );
+    uint8_t th = u8g2_GetBufferTileHeight( u8g2 );
+    size_t row_size = tw * 8;
+    uint8_t *buf = u8g2_GetBufferPtr( u8g2 );
+
+    for (; h > 0 && y >= 0 && y < th; h--, y++)
+      if (x >= 0 && x < tw && w > 0)
+        memcpy( ud->shadow + y * row_size + x * 8, buf + y * row_size + x * 8,
+                (x + w > tw ? tw - x : w) * 8 );
+  }
+  flush_framebuffer( ud );
+
   return 0;
 }
 
@@ -606,14 +956,15 @@ LROT_BEGIN(lu8g2_display, NULL, LROT_MASK_INDEX)
   LROT_FUNCENTRY( setFontRefHeightAll, lu8g2_setFontRefHeightAll )
   LROT_FUNCENTRY( setFontRefHeightExtendedText, lu8g2_setFontRefHeightExtendedText )
   LROT_FUNCENTRY( setFontRefHeightText, lu8g2_setFontRefHeightText )
+  LROT_FUNCENTRY( setFramebufferDelta, lu8g2_setFramebufferDelta )
+  LROT_FUNCENTRY( setGlyphCache, lu8g2_setGlyphCache )
+  LROT_FUNCENTRY( setPartialUpdate, lu8g2_setPartialUpdate )
   LROT_FUNCENTRY( setPowerSave, lu8g2_setPowerSave )
   LROT_FUNCENTRY( updateDisplay, lu8g2_updateDisplay )
   LROT_FUNCENTRY( updateDisplayArea, lu8g2_updateDisplayArea )
 LROT_END(lu8g2_display, NULL, LROT_MASK_INDEX)
 
 
-uint8_t u8x8_d_overlay(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *arg_ptr);
-
 typedef void (*display_setup_fn_t)(u8g2_t *u8g2, const u8g2_cb_t *rotation, u8x8_msg_cb byte_cb, u8x8_msg_cb gpio_and_delay_cb);
 
 // ***************************************************************************
@@ -646,6 +997,13 @@ static int ldisplay_i2c( lua_State *L, display_setup_fn_t setup_fn )
   u8g2_ud_t *ud = (u8g2_ud_t *)lua_newuserdata( L, sizeof( u8g2_ud_t ) );
   u8g2_nodemcu_t *ext_u8g2 = &(ud->u8g2);
   ud->font_ref = LUA_NOREF;
+  ud->shadow_ref = LUA_NOREF;
+  ud->shadow = NULL;
+  ud->shadow_valid = 0;
+  ud->cache_ref = LUA_NOREF;
+  ud->cache = NULL;
+  ud->font = NULL;
+  ud->delta_ref = LUA_NOREF;
   ud->host_ref = LUA_NOREF;
 
   u8g2_t *u8g2 = (u8g2_t *)ext_u8g2;
@@ -660,6 +1018,9 @@ static int ldisplay_i2c( lua_State *L, display_setup_fn_t setup_fn )
     ext_u8g2->overlay.template_display_cb = u8x8->display_cb;
     ext_u8g2->overlay.hardware_display_cb = NULL;
     ext_u8g2->overlay.rfb_cb_ref = LUA_NOREF;
+    ext_u8g2->overlay.line_hash = NULL;
+    ext_u8g2->overlay.batch_len = 0;
+    ext_u8g2->overlay.ws_ref = LUA_NOREF;
     u8x8->display_cb = u8x8_d_overlay;
   }
   if (id >= 0) {
@@ -739,6 +1100,13 @@ static int ldisplay_spi( lua_State *L, display_setup_fn_t setup_fn )
   u8g2_ud_t *ud = (u8g2_ud_t *)lua_newuserdata( L, sizeof( u8g2_ud_t ) );
   u8g2_nodemcu_t *ext_u8g2 = &(ud->u8g2);
   ud->font_ref = LUA_NOREF;
+  ud->shadow_ref = LUA_NOREF;
+  ud->shadow = NULL;
+  ud->shadow_valid = 0;
+  ud->cache_ref = LUA_NOREF;
+  ud->cache = NULL;
+  ud->font = NULL;
+  ud->delta_ref = LUA_NOREF;
   ud->host_ref = host_ref;
 
   u8g2_t *u8g2 = (u8g2_t *)ext_u8g2;
@@ -753,6 +1121,9 @@ static int ldisplay_spi( lua_State *L, display_setup_fn_t setup_fn )
     ext_u8g2->overlay.template_display_cb = u8x8->display_cb;
     ext_u8g2->overlay.hardware_display_cb = NULL;
     ext_u8g2->overlay.rfb_cb_ref = LUA_NOREF;
+    ext_u8g2->overlay.line_hash = NULL;
+    ext_u8g2->overlay.batch_len = 0;
+    ext_u8g2->overlay.ws_ref = LUA_NOREF;
     u8x8->display_cb = u8x8_d_overlay;
   }
   if (host) {
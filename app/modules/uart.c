@@ -10,6 +10,7 @@
 #include "driver/input.h"
 
 static int uart_receive_rf = LUA_NOREF;
+static int uart_txdone_rf[NUM_UART] = {LUA_NOREF, LUA_NOREF};
 
 void uart_on_data_cb(const char *buf, size_t len){
   lua_State *L = lua_getstate();
@@ -18,6 +19,55 @@ void uart_on_data_cb(const char *buf, size_t len){
   luaL_pcallx(L, 1, 0);
 }
 
+#define UART_IDLE_DEFAULT   2
+#define UART_RXBUF_MAX      8192
+#define UART_TXBUF_MIN      64
+#define UART_TXBUF_MAX      8192
+
+static void uart_txdone_task(platform_task_param_t id, uint8 prio)
+{
+  (void) prio;
+  if (id < NUM_UART && uart_txdone_rf[id] != LUA_NOREF) {
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, uart_txdone_rf[id]);
+    luaL_pcallx(L, 0, 0);
+  }
+}
+
+// Lua: uart.on("txdone", [id], function)
+static int uart_on_txdone( lua_State* L )
+{
+  int id = luaL_optinteger( L, 2, 0 );
+  int stack = lua_isnumber( L, 2 ) ? 3 : 2;
+  MOD_CHECK_ID( uart, id );
+
+  luaL_unref(L, LUA_REGISTRYINDEX, uart_txdone_rf[id]);
+  uart_txdone_rf[id] = LUA_NOREF;
+  if (lua_isfunction(L, stack)) {
+    lua_pushvalue(L, stack);
+    uart_txdone_rf[id] = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  return 0;
+}
+
+// Lua: uart.on("idle", [byte_times], function)
+static int uart_on_idle( lua_State* L )
+{
+  int byte_times = luaL_optinteger( L, 2, UART_IDLE_DEFAULT );
+  int stack = lua_isnumber( L, 2 ) ? 3 : 2;
+  luaL_argcheck(L, byte_times > 0 && byte_times <= UART_RX_TOUT_THRHD, 2, "wrong arg range");
+
+  luaL_unref(L, LUA_REGISTRYINDEX, uart_receive_rf);
+  uart_receive_rf = LUA_NOREF;
+  if (lua_isfunction(L, stack)) {
+    lua_pushvalue(L, stack);
+    uart_receive_rf = luaL_ref(L, LUA_REGISTRYINDEX);
+    input_setup_idle(uart_on_data_cb, byte_times);
+  } else
+    input_setup_receive(NULL, 0, 0, 1);
+  return 0;
+}
+
 // Lua: uart.on("method", [number/char], function, [run_input])
 static int l_uart_on( lua_State* L )
 {
@@ -26,6 +76,10 @@ static int l_uart_on( lua_State* L )
   char end_char = 0;
   const char *method = lua_tostring( L, 1);
   bool run_input = true;
+  if (method && !strcmp(method, "idle"))
+    return uart_on_idle(L);
+  if (method && !strcmp(method, "txdone"))
+    return uart_on_txdone(L);
   luaL_argcheck(L, method && !strcmp(method, "data"), 1, "method not supported");
 
   if (lua_type( L, stack ) == LUA_TNUMBER) {
@@ -61,7 +115,7 @@ static int l_uart_on( lua_State* L )
 }
 
 bool uart0_echo = true;
-// Lua: actualbaud = setup( id, baud, databits, parity, stopbits, echo )
+// Lua: actualbaud = setup( id, baud, databits, parity, stopbits, echo, rxbuf, txbuf )
 static int l_uart_setup( lua_State* L )
 {
   uint32_t id, databits, parity, stopbits;
@@ -77,8 +131,20 @@ static int l_uart_setup( lua_State* L )
   if (lua_isnumber(L,6)) {
     input_setecho(lua_tointeger(L,6) ? true : false);
   }
+  if (lua_isnumber(L,7)) {
+    int rxbuf = lua_tointeger(L,7);
+    luaL_argcheck(L, id == 0 && rxbuf >= LUA_MAXINPUT && rxbuf <= UART_RXBUF_MAX, 7, "wrong arg range");
+    if (!input_setup_rxbuf(rxbuf))
+      return luaL_error( L, "out of memory" );
+  }
 
   res = platform_uart_setup( id, baud, databits, parity, stopbits );
+  if (lua_isnumber(L,8)) {
+    int txbuf = lua_tointeger(L,8);
+    luaL_argcheck(L, txbuf == 0 || (txbuf >= UART_TXBUF_MIN && txbuf <= UART_TXBUF_MAX), 8, "wrong arg range");
+    if (!uart_set_tx_buffer(id, txbuf))
+      return luaL_error( L, "out of memory" );
+  }
   lua_pushinteger( L, res );
   return 1;
 }
@@ -112,7 +178,19 @@ static int l_uart_alt( lua_State* L )
   return 0;
 }
 
-// Lua: write( id, string1, [string2], ..., [stringn] )
+extern int pipe_drain(lua_State *L, int ndx,
+                      int (*fn)(void *, const char *, size_t), void *arg);
+
+static int uart_write_chunk( void *arg, const char *s, size_t l )
+{
+  unsigned id = *(unsigned *)arg;
+  size_t i;
+  for( i = 0; i < l; i ++ )
+    platform_uart_send( id, s[ i ] );
+  return 0;
+}
+
+// Lua: write( id, string1 | number | pipe, ..., [stringn] )
 static int l_uart_write( lua_State* L )
 {
   int id;
@@ -131,6 +209,12 @@ static int l_uart_write( lua_State* L )
         return luaL_error( L, "invalid number" );
       platform_uart_send( id, ( u8 )len );
     }
+    else if( lua_istable( L, s ) )
+    {
+      // send a pipe's chunks in place, emptying it
+      unsigned uid = id;
+      luaL_argcheck( L, pipe_drain( L, s, uart_write_chunk, &uid ) >= 0, s, "string or pipe expected" );
+    }
     else
     {
       luaL_checktype( L, s, LUA_TSTRING );
@@ -184,4 +268,9 @@ LROT_BEGIN(uart, NULL, 0)
 LROT_END(uart, NULL, 0)
 
 
-NODEMCU_MODULE(UART, "uart", uart, NULL);
+int luaopen_uart( lua_State *L ) {
+  uart_init_tx_task(platform_task_get_id(uart_txdone_task));
+  return 0;
+}
+
+NODEMCU_MODULE(UART, "uart", uart, luaopen_uart);
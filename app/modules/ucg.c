@@ -408,7 +408,19 @@ static int lucg_setFont( lua_State *L )
 {
   GET_UCG();
 
-  ucg_fntpgm_uint8_t *font = (ucg_fntpgm_uint8_t *)lua_touserdata( L, 2 );
+  ucg_fntpgm_uint8_t *font = NULL;
+
+  luaL_unref( L, LUA_REGISTRYINDEX, ud->font_ref );
+  ud->font_ref = LUA_NOREF;
+
+  if (lua_islightuserdata( L, 2 )) {
+    font = (ucg_fntpgm_uint8_t *)lua_touserdata( L, 2 );
+  } else if (lua_type( L, 2 ) == LUA_TSTRING) {
+    // a font loaded at runtime, say from a file or LFS; keep the string alive
+    font = (ucg_fntpgm_uint8_t *)lua_tostring( L, 2 );
+    lua_pushvalue( L, 2 );
+    ud->font_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
   if (font != NULL)
     ucg_SetFont( ucg, font );
   else
@@ -593,7 +605,13 @@ static int lucg_undoScale( lua_State *L )
 // device destructor
 static int lucg_close_display( lua_State *L )
 {
-    return 0;
+  GET_UCG();
+  (void)ucg;
+
+  luaL_unref( L, LUA_REGISTRYINDEX, ud->font_ref );
+  ud->font_ref = LUA_NOREF;
+
+  return 0;
 }
 
 
@@ -0,0 +1,154 @@
+// Hardware timed waveform player for mcp4725 and sigma_delta
+
+#include "module.h"
+#include "lauxlib.h"
+#include "platform.h"
+
+#include "hw_timer.h"
+#include "waveform.h"
+#ifdef LUA_USE_MODULES_NUMBUF
+#include "numbuf.h"
+#endif
+
+#define TIMER_OWNER ((os_param_t) 'w')
+
+static struct {
+  uint16_t *samples;
+  uint32_t count;
+  uint32_t pos;
+  uint32_t loops;       // left to play, 0 for until stopped
+  waveform_out_fn out;
+  volatile bool playing;
+  uint8_t generation;   // tells a stale completion from the current one
+  int samples_ref;
+  int cb_ref;
+} wave = { NULL, 0, 0, 0, NULL, false, 0, LUA_NOREF, LUA_NOREF };
+static platform_task_handle_t wave_task;
+
+static void ICACHE_RAM_ATTR waveform_tick( os_param_t p )
+{
+  (void)p;
+  if (!wave.playing)
+    return;
+  wave.out(wave.samples[wave.pos]);
+  if (++wave.pos < wave.count)
+    return;
+  wave.pos = 0;
+  if (wave.loops && --wave.loops == 0) {
+    wave.playing = false;
+    platform_hw_timer_close(TIMER_OWNER);
+    platform_post_low(wave_task, wave.generation);
+  }
+}
+
+static void waveform_release( lua_State *L )
+{
+  wave.samples = NULL;
+  wave.generation++;
+  luaL_unref(L, LUA_REGISTRYINDEX, wave.samples_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, wave.cb_ref);
+  wave.samples_ref = wave.cb_ref = LUA_NOREF;
+}
+
+static void waveform_done( platform_task_param_t param, uint8_t prio )
+{
+  lua_State *L = lua_getstate();
+  int ref = wave.cb_ref;
+  (void)prio;
+  if (!wave.samples || param != wave.generation)
+    return;
+  wave.cb_ref = LUA_NOREF;
+  waveform_release(L);
+  if (ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    luaL_pcallx(L, 0, 0);
+  }
+}
+
+static uint16_t checksample( lua_State *L, lua_Number v, uint16_t max )
+{
+  if (!(v >= 0 && v <= max))
+    luaL_error(L, "sample out of range 0-%d", max);
+  return (uint16_t)v;
+}
+
+int waveform_play( lua_State *L, int arg, uint16_t max, uint32_t max_rate, waveform_out_fn out )
+{
+  lua_Integer rate = luaL_checkinteger(L, arg + 1);
+  lua_Integer loops = luaL_optinteger(L, arg + 2, 1);
+  size_t i, count;
+  uint16_t *samples;
+#ifdef LUA_USE_MODULES_NUMBUF
+  numbuf *buf = numbuf_opt_from_lua_arg(L, arg);
+#else
+  void *buf = NULL;
+#endif
+
+  if (!buf)
+    luaL_checktype(L, arg, LUA_TTABLE);
+  luaL_argcheck(L, rate > 0 && rate <= max_rate, arg + 1, "rate out of range");
+  luaL_argcheck(L, loops >= 0, arg + 2, "should be a positive integer or 0");
+  if (!lua_isnoneornil(L, arg + 3))
+    luaL_checktype(L, arg + 3, LUA_TFUNCTION);
+  if (wave.samples)
+    return luaL_error(L, "waveform playing");
+
+  count = buf ? 0 : lua_objlen(L, arg);
+#ifdef LUA_USE_MODULES_NUMBUF
+  if (buf)
+    count = buf->count;
+#endif
+  luaL_argcheck(L, count > 0, arg, "no samples");
+
+  /* the copy is a userdata, anchored in the registry while it plays */
+  samples = lua_newuserdata(L, count * sizeof(uint16_t));
+  for (i = 0; i < count; i++) {
+#ifdef LUA_USE_MODULES_NUMBUF
+    if (buf) {
+      samples[i] = checksample(L, numbuf_get(buf, i), max);
+      continue;
+    }
+#endif
+    lua_rawgeti(L, arg, i + 1);
+    if (!lua_isnumber(L, -1))
+      return luaL_error(L, "sample %d is not a number", (int)i + 1);
+    samples[i] = checksample(L, lua_tonumber(L, -1), max);
+    lua_pop(L, 1);
+  }
+
+  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, TRUE))
+    return luaL_error(L, "Unable to initialize timer");
+  if (!wave_task)
+    wave_task = platform_task_get_id(waveform_done);
+  wave.samples_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  wave.samples = samples;
+  if (!lua_isnoneornil(L, arg + 3)) {
+    lua_pushvalue(L, arg + 3);
+    wave.cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  wave.count = count;
+  wave.pos = 0;
+  wave.loops = loops;
+  wave.out = out;
+  wave.playing = true;
+  platform_hw_timer_set_func(TIMER_OWNER, waveform_tick, 0);
+  platform_hw_timer_set_priority(TIMER_OWNER, 20, "waveform");
+  platform_hw_timer_arm_ticks(TIMER_OWNER, (APB_CLK_FREQ >> 4) / rate);
+  return 0;
+}
+
+bool waveform_busy( void )
+{
+  return wave.samples != NULL;
+}
+
+int waveform_stop( lua_State *L )
+{
+  if (wave.samples) {
+    wave.playing = false;
+    platform_hw_timer_close(TIMER_OWNER);
+    waveform_release(L);
+  }
+  return 0;
+}
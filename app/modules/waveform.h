@@ -0,0 +1,25 @@
+#ifndef APP_MODULES_WAVEFORM_H_
+#define APP_MODULES_WAVEFORM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A waveform player shared by the analog output modules.  The samples are
+ * copied out of Lua and written one at a time from the hardware timer, so
+ * only one waveform plays at once, whichever module started it.
+ */
+typedef void (*waveform_out_fn)(uint16_t sample);
+
+/* Lua: (samples, rate[, loops[, callback]]) starting at argument arg, where
+ * samples is a table or numbuf of values from 0 to max.  out is called from
+ * the timer interrupt. */
+int waveform_play(lua_State *L, int arg, uint16_t max, uint32_t max_rate, waveform_out_fn out);
+
+/* True from play until stop, or the end of the waveform has been handled */
+bool waveform_busy(void);
+
+/* Lua: stop(), leaving the output at the last sample written */
+int waveform_stop(lua_State *L);
+
+#endif
@@ -17,6 +17,7 @@
 #include <stddef.h>
 
 #include "websocket/websocketclient.h"
+#include "websocket/websocketserver.h"
 
 #define METATABLE_WSCLIENT "websocket.client"
 
@@ -24,6 +25,7 @@ typedef struct ws_data {
   int self_ref;
   int onConnection;
   int onReceive;
+  int onFragment;
   int onClose;
 } ws_data;
 
@@ -65,6 +67,32 @@ static void websocketclient_onReceiveCallback(ws_info *ws, int len, char *messag
   }
 }
 
+static void websocketclient_onFragmentCallback(ws_info *ws, int len, char *message, int opCode, int isFinal) {
+  NODE_DBG("websocketclient_onFragmentCallback\n");
+
+  lua_State *L = lua_getstate();
+
+  if (ws == NULL || ws->reservedData == NULL) {
+    luaL_error(L, "Client websocket is nil.\n");
+    return;
+  }
+  ws_data *data = (ws_data *) ws->reservedData;
+
+  if (data->onFragment != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->onFragment); // load the callback function
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->self_ref);  // pass itself, #1 callback argument
+    lua_pushlstring(L, message, len); // #2 callback argument
+    lua_pushinteger(L, opCode); // #3 callback argument
+    lua_pushboolean(L, isFinal); // #4 callback argument
+    luaL_pcallx(L, 4, 0);
+  }
+}
+
+// The message string was kept referenced while it was being sent
+static void websocketclient_onSentCallback(ws_info *ws, void *arg) {
+  luaL_unref(lua_getstate(), LUA_REGISTRYINDEX, (int) (intptr_t) arg);
+}
+
 static void websocketclient_onCloseCallback(ws_info *ws, int errorCode) {
   NODE_DBG("websocketclient_onCloseCallback\n");
 
@@ -97,15 +125,20 @@ static int websocket_createClient(lua_State *L) {
   ws_data *data = (ws_data *) luaM_malloc(L, sizeof(ws_data));
   data->onConnection = LUA_NOREF;
   data->onReceive = LUA_NOREF;
+  data->onFragment = LUA_NOREF;
   data->onClose = LUA_NOREF;
   data->self_ref = LUA_NOREF; // only set when ws:connect is called
 
   ws_info *ws = (ws_info *) lua_newuserdata(L, sizeof(ws_info));
   ws->connectionState = 0;
   ws->extraHeaders = NULL;
+  ws->deflateBits = 0;
   ws->onConnection = &websocketclient_onConnectionCallback;
   ws->onReceive = &websocketclient_onReceiveCallback;
   ws->onFailure = &websocketclient_onCloseCallback;
+  ws->onFragment = NULL;
+  ws->onSent = &websocketclient_onSentCallback;
+  ws->sendQueue = NULL;
   ws->reservedData = data;
 
   // set its metatable
@@ -122,7 +155,7 @@ static int websocketclient_on(lua_State *L) {
 
   ws_data *data = (ws_data *) ws->reservedData;
 
-  int handle = luaL_checkoption(L, 2, NULL, (const char * const[]){ "connection", "receive", "close", NULL });
+  int handle = luaL_checkoption(L, 2, NULL, (const char * const[]){ "connection", "receive", "close", "fragment", NULL });
   luaL_argcheck(L, lua_isnil(L,3) || lua_isfunction(L, 3), 3, "function or nil");
 
   switch (handle) {
@@ -141,6 +174,7 @@ static int websocketclient_on(lua_State *L) {
       NODE_DBG("receive\n");
 
       luaL_unref(L, LUA_REGISTRYINDEX, data->onReceive);
+  luaL_unref(L, LUA_REGISTRYINDEX, data->onFragment);
       data->onReceive = LUA_NOREF;
 
       if (!lua_isnil(L,3)) {
@@ -159,6 +193,19 @@ static int websocketclient_on(lua_State *L) {
         data->onClose = luaL_ref(L, LUA_REGISTRYINDEX);
       }
       break;
+    case 3:
+      NODE_DBG("fragment\n");
+
+      luaL_unref(L, LUA_REGISTRYINDEX, data->onFragment);
+      data->onFragment = LUA_NOREF;
+      ws->onFragment = NULL;
+
+      if (!lua_isnil(L,3)) {
+        lua_pushvalue(L, 3);  // copy argument (func) to the top of stack
+        data->onFragment = luaL_ref(L, LUA_REGISTRYINDEX);
+        ws->onFragment = &websocketclient_onFragmentCallback;
+      }
+      break;
   }
 
   return 0;
@@ -233,6 +280,16 @@ static int websocketclient_config(lua_State *L) {
   }
   lua_pop(L, 1); // pop headers
 
+  lua_getfield(L, 2, "deflate");
+  if (lua_isnumber(L, -1)) {
+    int bits = lua_tointeger(L, -1);
+    luaL_argcheck(L, bits >= WS_DEFLATE_MIN_BITS && bits <= WS_DEFLATE_MAX_BITS, 2, "deflate window bits out of range");
+    ws->deflateBits = bits;
+  } else if (!lua_isnil(L, -1)) {
+    ws->deflateBits = lua_toboolean(L, -1) ? WS_DEFLATE_BITS : 0;
+  }
+  lua_pop(L, 1); // pop deflate
+
   return 0;
 }
 
@@ -248,7 +305,7 @@ static int websocketclient_send(lua_State *L) {
     return luaL_error(L, "Websocket isn't connected.\n");
   }
 
-  int msgLength;
+  size_t msgLength;
   const char *msg = luaL_checklstring(L, 2, &msgLength);
 
   int opCode = 1; // default: text message
@@ -256,7 +313,12 @@ static int websocketclient_send(lua_State *L) {
     opCode = luaL_checkint(L, 3);
   }
 
-  ws_send(ws, opCode, msg, (unsigned short) msgLength);
+  // The message is sent from the Lua string itself, so keep it alive until then
+  lua_pushvalue(L, 2);
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (!ws_send(ws, opCode, msg, msgLength, (void *) (intptr_t) ref)) {
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  }
   return 0;
 }
 
@@ -304,8 +366,224 @@ static int websocketclient_gc(lua_State *L) {
   return 0;
 }
 
+#define METATABLE_WSSERVER "websocket.server"
+#define METATABLE_WSCONNECTION "websocket.connection"
+
+typedef struct ws_server_data {
+  int self_ref; // only set while listening
+  int onConnection;
+  int onReceive;
+  int onClose;
+} ws_server_data;
+
+// Push the Lua object of a server connection
+static void websocketserver_pushPeer(lua_State *L, ws_peer *peer) {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, (int) (intptr_t) peer->reservedData);
+}
+
+static void websocketserver_onConnectionCallback(ws_server *server, ws_peer *peer) {
+  NODE_DBG("websocketserver_onConnectionCallback\n");
+
+  lua_State *L = lua_getstate();
+  ws_server_data *data = (ws_server_data *) server->reservedData;
+
+  ws_peer **ud = (ws_peer **) lua_newuserdata(L, sizeof(ws_peer *));
+  *ud = peer;
+  luaL_getmetatable(L, METATABLE_WSCONNECTION);
+  lua_setmetatable(L, -2);
+  peer->reservedData = (void *) (intptr_t) luaL_ref(L, LUA_REGISTRYINDEX);
+
+  if (data->onConnection != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->onConnection); // load the callback function
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->self_ref);  // pass the server, #1 callback argument
+    websocketserver_pushPeer(L, peer); // #2 callback argument
+    luaL_pcallx(L, 2, 0);
+  }
+}
+
+static void websocketserver_onReceiveCallback(ws_server *server, ws_peer *peer, int len, char *message, int opCode) {
+  NODE_DBG("websocketserver_onReceiveCallback\n");
+
+  lua_State *L = lua_getstate();
+  ws_server_data *data = (ws_server_data *) server->reservedData;
+
+  if (data->onReceive != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->onReceive); // load the callback function
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->self_ref);  // pass the server, #1 callback argument
+    websocketserver_pushPeer(L, peer); // #2 callback argument
+    lua_pushlstring(L, message, len); // #3 callback argument
+    lua_pushinteger(L, opCode); // #4 callback argument
+    luaL_pcallx(L, 4, 0);
+  }
+}
+
+static void websocketserver_onCloseCallback(ws_server *server, ws_peer *peer, int code) {
+  NODE_DBG("websocketserver_onCloseCallback\n");
+
+  lua_State *L = lua_getstate();
+  ws_server_data *data = (ws_server_data *) server->reservedData;
+  int ref = (int) (intptr_t) peer->reservedData;
+
+  websocketserver_pushPeer(L, peer);
+  *(ws_peer **) lua_touserdata(L, -1) = NULL; // the connection object outlives the connection
+  lua_pop(L, 1);
+
+  if (data->onClose != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->onClose); // load the callback function
+    lua_rawgeti(L, LUA_REGISTRYINDEX, data->self_ref);  // pass the server, #1 callback argument
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref); // #2 callback argument
+    lua_pushinteger(L, code); // #3 callback argument
+    luaL_pcallx(L, 3, 0);
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
+static int websocket_createServer(lua_State *L) {
+  NODE_DBG("websocket_createServer\n");
+
+  ws_server_data *data = (ws_server_data *) luaM_malloc(L, sizeof(ws_server_data));
+  data->self_ref = LUA_NOREF;
+  data->onConnection = LUA_NOREF;
+  data->onReceive = LUA_NOREF;
+  data->onClose = LUA_NOREF;
+
+  ws_server *server = (ws_server *) lua_newuserdata(L, sizeof(ws_server));
+  memset(server, 0, sizeof(ws_server));
+  server->onConnection = &websocketserver_onConnectionCallback;
+  server->onReceive = &websocketserver_onReceiveCallback;
+  server->onClose = &websocketserver_onCloseCallback;
+  server->reservedData = data;
+
+  luaL_getmetatable(L, METATABLE_WSSERVER);
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+static int websocketserver_on(lua_State *L) {
+  NODE_DBG("websocketserver_on\n");
+
+  ws_server *server = (ws_server *) luaL_checkudata(L, 1, METATABLE_WSSERVER);
+  ws_server_data *data = (ws_server_data *) server->reservedData;
+
+  int handle = luaL_checkoption(L, 2, NULL, (const char * const[]){ "connection", "receive", "close", NULL });
+  luaL_argcheck(L, lua_isnil(L,3) || lua_isfunction(L, 3), 3, "function or nil");
+
+  int *ref = handle == 0 ? &data->onConnection : handle == 1 ? &data->onReceive : &data->onClose;
+  luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+  *ref = LUA_NOREF;
+  if (!lua_isnil(L,3)) {
+    lua_pushvalue(L, 3);  // copy argument (func) to the top of stack
+    *ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  return 0;
+}
+
+static int websocketserver_listen(lua_State *L) {
+  NODE_DBG("websocketserver_listen\n");
+
+  ws_server *server = (ws_server *) luaL_checkudata(L, 1, METATABLE_WSSERVER);
+  ws_server_data *data = (ws_server_data *) server->reservedData;
+  int port = luaL_optinteger(L, 2, 80);
+  luaL_argcheck(L, port > 0 && port <= 65535, 2, "invalid port");
+
+  if (server->pcb != NULL) {
+    return luaL_error(L, "Websocket server already listening.\n");
+  }
+
+  err_t err = ws_server_listen(server, port);
+  if (err != ERR_OK) {
+    return luaL_error(L, "cannot listen on port %d (%d)", port, err);
+  }
+
+  lua_pushvalue(L, 1);  // keep the server alive while it is listening
+  data->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+// Lua: n = srv:broadcast(message[, opcode])
+static int websocketserver_broadcast(lua_State *L) {
+  ws_server *server = (ws_server *) luaL_checkudata(L, 1, METATABLE_WSSERVER);
+  size_t msgLength;
+  const char *msg = luaL_checklstring(L, 2, &msgLength);
+  int opCode = luaL_optinteger(L, 3, WS_OPCODE_TEXT);
+
+  lua_pushinteger(L, ws_server_broadcast(server, opCode, msg, msgLength));
+  return 1;
+}
+
+static void websocketserver_stop(lua_State *L, ws_server *server) {
+  ws_server_data *data = (ws_server_data *) server->reservedData;
+
+  ws_server_close(server);
+  if (data->self_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, data->self_ref);
+    data->self_ref = LUA_NOREF;
+  }
+}
+
+static int websocketserver_close(lua_State *L) {
+  NODE_DBG("websocketserver_close\n");
+  websocketserver_stop(L, (ws_server *) luaL_checkudata(L, 1, METATABLE_WSSERVER));
+  return 0;
+}
+
+static int websocketserver_gc(lua_State *L) {
+  NODE_DBG("websocketserver_gc\n");
+
+  ws_server *server = (ws_server *) luaL_checkudata(L, 1, METATABLE_WSSERVER);
+  ws_server_data *data = (ws_server_data *) server->reservedData;
+
+  websocketserver_stop(L, server);
+  luaL_unref(L, LUA_REGISTRYINDEX, data->onConnection);
+  luaL_unref(L, LUA_REGISTRYINDEX, data->onReceive);
+  luaL_unref(L, LUA_REGISTRYINDEX, data->onClose);
+  luaM_free(L, data);
+
+  return 0;
+}
+
+static ws_peer *websocketconnection_check(lua_State *L) {
+  ws_peer *peer = *(ws_peer **) luaL_checkudata(L, 1, METATABLE_WSCONNECTION);
+  if (peer == NULL) {
+    luaL_error(L, "Websocket connection is closed.\n");
+  }
+  return peer;
+}
+
+// Lua: ok = conn:send(message[, opcode])
+static int websocketconnection_send(lua_State *L) {
+  ws_peer *peer = websocketconnection_check(L);
+  size_t msgLength;
+  const char *msg = luaL_checklstring(L, 2, &msgLength);
+  int opCode = luaL_optinteger(L, 3, WS_OPCODE_TEXT);
+
+  lua_pushboolean(L, ws_server_send(peer, opCode, msg, msgLength));
+  return 1;
+}
+
+static int websocketconnection_close(lua_State *L) {
+  ws_peer *peer = *(ws_peer **) luaL_checkudata(L, 1, METATABLE_WSCONNECTION);
+  if (peer != NULL) {
+    ws_server_close_peer(peer);
+  }
+  return 0;
+}
+
+// Lua: port, ip = conn:getpeer()
+static int websocketconnection_getpeer(lua_State *L) {
+  ws_peer *peer = websocketconnection_check(L);
+  char addr_str[16];
+  ets_sprintf(addr_str, IPSTR, IP2STR(&peer->pcb->remote_ip.addr));
+  lua_pushinteger(L, peer->pcb->remote_port);
+  lua_pushstring(L, addr_str);
+  return 2;
+}
+
 LROT_BEGIN(websocket, NULL, 0)
   LROT_FUNCENTRY( createClient, websocket_createClient )
+  LROT_FUNCENTRY( createServer, websocket_createServer )
 LROT_END(websocket, NULL, 0)
 
 
@@ -321,8 +599,28 @@ LROT_BEGIN(websocketclient, NULL, LROT_MASK_GC_INDEX)
 LROT_END(websocketclient, NULL, LROT_MASK_GC_INDEX)
 
 
+LROT_BEGIN(websocketserver, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, websocketserver_gc )
+  LROT_TABENTRY(  __index, websocketserver )
+  LROT_FUNCENTRY( on, websocketserver_on )
+  LROT_FUNCENTRY( listen, websocketserver_listen )
+  LROT_FUNCENTRY( broadcast, websocketserver_broadcast )
+  LROT_FUNCENTRY( close, websocketserver_close )
+LROT_END(websocketserver, NULL, LROT_MASK_GC_INDEX)
+
+
+LROT_BEGIN(websocketconnection, NULL, LROT_MASK_INDEX)
+  LROT_TABENTRY(  __index, websocketconnection )
+  LROT_FUNCENTRY( send, websocketconnection_send )
+  LROT_FUNCENTRY( close, websocketconnection_close )
+  LROT_FUNCENTRY( getpeer, websocketconnection_getpeer )
+LROT_END(websocketconnection, NULL, LROT_MASK_INDEX)
+
+
 int loadWebsocketModule(lua_State *L) {
   luaL_rometatable(L, METATABLE_WSCLIENT, LROT_TABLEREF( websocketclient));
+  luaL_rometatable(L, METATABLE_WSSERVER, LROT_TABLEREF( websocketserver));
+  luaL_rometatable(L, METATABLE_WSCONNECTION, LROT_TABLEREF( websocketconnection));
 
   return 0;
 }
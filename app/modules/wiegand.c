@@ -16,8 +16,12 @@
 #endif
 #endif
 
+// A frame is over when no bit has come for this long
+#define WIEGAND_FRAME_GAP_US 25000
+#define WIEGAND_MAX_BITS     64
+
 typedef struct {
-  uint32_t current_card;
+  uint64_t current_card;
   int bit_count;
   uint32_t last_card;
   uint32_t last_bit_count;
@@ -58,17 +62,23 @@ static uint32_t ICACHE_RAM_ATTR wiegand_intr(uint32_t ret_gpio_status)
       continue;
     }
 
-    ++w->bit_count;
+    // The frame is assembled here, and the task only posted for its first
+    // bit; a bit after a gap starts a new frame, dropping a stale partial one
+    uint32_t now = system_get_time();
+    if (w->bit_count && now - w->last_bit_time > WIEGAND_FRAME_GAP_US) {
+      w->bit_count = 0;
+      w->current_card = 0;
+    }
+    if (w->bit_count <= WIEGAND_MAX_BITS)
+      ++w->bit_count;
     w->current_card <<= 1;
     if (i == pin_num[w->pinD1])
       w->current_card |= 1;
 
-    w->last_bit_time = system_get_time();
+    w->last_bit_time = now;
 
-    if (!w->task_posted) {
-      task_post_medium(tasknumber, (os_param_t)w);
-      w->task_posted = 1;
-    }
+    if (!w->task_posted)
+      w->task_posted = task_post_medium(tasknumber, (os_param_t)w);
 
     GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, gpio_status & (1 << i));
     ret_gpio_status &= ~(1 << i);
@@ -77,7 +87,7 @@ static uint32_t ICACHE_RAM_ATTR wiegand_intr(uint32_t ret_gpio_status)
   return ret_gpio_status;
 }
 
-static int parity(int val)
+static int parity(uint32_t val)
 {
   int parity = 0;
   while (val > 0) {
@@ -87,28 +97,44 @@ static int parity(int val)
   return parity;
 }
 
+// Takes the frame from the ISR and checks it; false for a bad or unknown one
 static bool wiegand_store_card(volatile wiegand_t w)
 {
-  uint32_t card = w->current_card;
+  ETS_GPIO_INTR_DISABLE();
+  uint64_t card = w->current_card;
   int bit_count = w->bit_count;
   w->current_card = 0;
   w->bit_count = 0;
+  w->task_posted = 0;
+  ETS_GPIO_INTR_ENABLE();
 
   switch(bit_count) {
     case 4:
       w->last_card = card;
-      w->last_bit_count = bit_count;
-      return true;
+      break;
+    case 8:
+      // a keypress followed by its complement
+      if (((card >> 4) ^ card ^ 0xf) & 0xf)
+        return false;
+      w->last_card = card & 0xf;
+      break;
     case 26:
       // even parity over the first 13 bits, odd parity over the last 13 bits
       if (parity((card & 0x3ffe000) >> 13) != 0 || parity(card & 0x1fff) != 1)
         return false;
-
       w->last_card = (card >> 1) & 0xffffff;
-      w->last_bit_count = bit_count;
-      return true;
+      break;
+    case 34:
+      // even parity over the first 17 bits, odd parity over the last 17 bits
+      if (parity((card >> 17) & 0x1ffff) != 0 || parity(card & 0x1ffff) != 1)
+        return false;
+      w->last_card = (card >> 1) & 0xffffffff;
+      break;
+    default:
+      return false;
   }
-  return false;
+  w->last_bit_count = bit_count;
+  return true;
 }
 
 static void lwiegand_timer_done(void *param)
@@ -118,31 +144,35 @@ static void lwiegand_timer_done(void *param)
   wiegand_t w = (wiegand_t) param;
 
   os_timer_disarm(&w->timer);
+  w->timer_running = 0;
+
+  // bits may still be coming in
+  uint32_t idle = system_get_time() - w->last_bit_time;
+  if (idle < WIEGAND_FRAME_GAP_US) {
+    os_timer_arm(&w->timer, (WIEGAND_FRAME_GAP_US - idle) / 1000 + 1, 0);
+    w->timer_running = 1;
+    return;
+  }
 
-  if (wiegand_store_card(w)) {
+  if (wiegand_store_card(w) && w->cb_ref != LUA_NOREF) {
     lua_rawgeti(L, LUA_REGISTRYINDEX, w->cb_ref);
 
     lua_pushinteger(L, w->last_card);
     lua_pushinteger(L, w->last_bit_count);
 
-    lua_call(L, 2, 0);
+    luaL_pcallx(L, 2, 0);
   }
 }
 
+// Posted for the first bit of a frame; the timer then waits for its end
 static void lwiegand_cb(os_param_t param, uint8_t prio)
 {
   wiegand_t w = (wiegand_t) param;
   (void) prio;
 
-  *(volatile int *)&w->task_posted = 0;
-  if (w->timer_running)
-    os_timer_disarm(&w->timer);
-
-  int timeout = 25 - (system_get_time() - w->last_bit_time) / 1000;
-  if (timeout < 0) {
-    lwiegand_timer_done(w);
-  } else {
-    os_timer_arm(&w->timer, timeout, 0);
+  if (w->cb_ref != LUA_NOREF && !w->timer_running) {
+    os_timer_arm(&w->timer, WIEGAND_FRAME_GAP_US / 1000, 0);
+    w->timer_running = 1;
   }
 }
 
@@ -163,6 +193,7 @@ static int lwiegand_close( lua_State* L)
   w->cb_ref = LUA_NOREF;
   if (w->timer_running) {
     os_timer_disarm(&w->timer);
+    w->timer_running = 0;
   }
   luaL_unref(L, LUA_REGISTRYINDEX, w->self_ref);
   w->self_ref = LUA_NOREF;
@@ -13,6 +13,10 @@
 #include <stdint.h>
 #include "user_interface.h"
 #include "wifi_common.h"
+#include "lwip/err.h"
+#include "lwip/dns.h"
+#include "rtc/rtcaccess.h"
+#include "pm/swtimer.h"
 
 
 #ifdef WIFI_SMART_ENABLE
@@ -90,7 +94,10 @@ static void wifi_scan_done(void *arg, STATUS status)
   if (status == OK)
   {
     struct bss_info *bss_link = (struct bss_info *)arg;
-    lua_newtable( L );
+    int n = 0;
+    for (struct bss_info *b = bss_link; b != NULL; b = b->next.stqe_next)
+      n++;
+    lua_createtable( L, 0, n );
 
     while (bss_link != NULL)
     {
@@ -128,6 +135,143 @@ static void wifi_scan_done(void *arg, STATUS status)
   luaL_pcallx(L, 1, 0);
 }
 
+// A streaming scan walks the channels one at a time and hands every matching
+// record to Lua as it is found, rather than collecting them into one table
+static struct {
+  int found_ref;
+  int done_ref;
+  bool running;
+  uint8 channel;      // last one scanned
+  uint8 last_channel;
+  uint8 show_hidden;
+  sint8 min_rssi;
+  uint8 prefix_len;
+  char prefix[32];
+  uint16 count;
+} wifi_stream = { .found_ref = LUA_NOREF, .done_ref = LUA_NOREF };
+
+static task_handle_t wifi_stream_task_id;
+
+static void wifi_stream_scan_done(void *arg, STATUS status)
+{
+  lua_State* L = lua_getstate();
+  char bssid[sizeof("11:22:33:44:55:66")];
+
+  if (status == OK)
+  {
+    for (struct bss_info *b = arg; b != NULL; b = b->next.stqe_next)
+    {
+      size_t len = strnlen((const char *)b->ssid, sizeof(b->ssid));
+      if (b->rssi < wifi_stream.min_rssi || len < wifi_stream.prefix_len ||
+          memcmp(b->ssid, wifi_stream.prefix, wifi_stream.prefix_len) != 0)
+        continue;
+      wifi_stream.count++;
+      sprintf(bssid, MACSTR, MAC2STR(b->bssid));
+      lua_rawgeti(L, LUA_REGISTRYINDEX, wifi_stream.found_ref);
+      lua_pushlstring(L, (const char *)b->ssid, len);
+      lua_pushstring(L, bssid);
+      lua_pushinteger(L, b->rssi);
+      lua_pushinteger(L, b->authmode);
+      lua_pushinteger(L, b->channel);
+      luaL_pcallx(L, 5, 0);
+    }
+  }
+  // The next channel is scanned from a task, not from within the SDK callback
+  task_post_low(wifi_stream_task_id, status == OK);
+}
+
+static void wifi_stream_next(task_param_t param, uint8 priority)
+{
+  (void)priority;
+  lua_State* L = lua_getstate();
+  struct scan_config scan_cfg = {.scan_time = {.passive=120, .active = {.max=120, .min=60}}};
+
+  if (param && wifi_stream.channel < wifi_stream.last_channel &&
+      wifi_get_opmode() != SOFTAP_MODE)
+  {
+    scan_cfg.channel = ++wifi_stream.channel;
+    scan_cfg.show_hidden = wifi_stream.show_hidden;
+    if (wifi_station_scan(&scan_cfg, wifi_stream_scan_done))
+      return;
+  }
+
+  wifi_stream.running = false;
+  unregister_lua_cb(L, &wifi_stream.found_ref);
+  if (wifi_stream.done_ref != LUA_NOREF)
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, wifi_stream.done_ref);
+    unregister_lua_cb(L, &wifi_stream.done_ref);
+    lua_pushinteger(L, wifi_stream.count);
+    luaL_pcallx(L, 1, 0);
+  }
+}
+
+// Lua: wifi.sta.scan([cfg,] found_cb[, done_cb])
+static int wifi_station_scan4lua( lua_State* L )
+{
+  int cfg = lua_istable(L, 1) ? 1 : 0;
+  size_t len = 0;
+
+  if (wifi_get_opmode() == SOFTAP_MODE)
+    return luaL_error( L, "Can't scan in SOFTAP mode" );
+  if (wifi_stream.running)
+    return luaL_error( L, "scan in progress" );
+  luaL_checktype(L, cfg + 1, LUA_TFUNCTION);
+  if (!lua_isnoneornil(L, cfg + 2))
+    luaL_checktype(L, cfg + 2, LUA_TFUNCTION);
+
+  wifi_stream.min_rssi = -128;
+  wifi_stream.prefix_len = 0;
+  wifi_stream.show_hidden = 0;
+  wifi_stream.channel = 0;
+  wifi_stream.last_channel = 13;
+  if (cfg)
+  {
+    lua_getfield(L, 1, "ssid_prefix");
+    const char *prefix = luaL_optlstring(L, -1, "", &len);
+    luaL_argcheck(L, len <= sizeof(wifi_stream.prefix), 1, "ssid_prefix: length:0-32");
+    memcpy(wifi_stream.prefix, prefix, len);
+    wifi_stream.prefix_len = len;
+
+    lua_getfield(L, 1, "min_rssi");
+    int rssi = luaL_optinteger(L, -1, -128);
+    luaL_argcheck(L, rssi >= -128 && rssi <= 0, 1, "min_rssi: -128-0");
+    wifi_stream.min_rssi = rssi;
+
+    lua_getfield(L, 1, "channel");
+    int channel = luaL_optinteger(L, -1, 0);
+    luaL_argcheck(L, channel >= 0 && channel <= 13, 1, "channel: 0 or 1-13");
+    if (channel)
+    {
+      wifi_stream.channel = channel - 1;
+      wifi_stream.last_channel = channel;
+    }
+
+    lua_getfield(L, 1, "show_hidden");
+    wifi_stream.show_hidden = lua_isnumber(L, -1) ? lua_tointeger(L, -1) != 0 : lua_toboolean(L, -1);
+    lua_pop(L, 4);
+  }
+
+  lua_pushvalue(L, cfg + 1);
+  register_lua_cb(L, &wifi_stream.found_ref);
+  if (lua_isfunction(L, cfg + 2))
+  {
+    lua_pushvalue(L, cfg + 2);
+    register_lua_cb(L, &wifi_stream.done_ref);
+  }
+  else
+  {
+    unregister_lua_cb(L, &wifi_stream.done_ref);
+  }
+  wifi_stream.count = 0;
+
+  if (!wifi_stream_task_id)
+    wifi_stream_task_id = task_get_id(wifi_stream_next);
+  wifi_stream.running = true;
+  task_post_low(wifi_stream_task_id, true);
+  return 0;
+}
+
 #ifdef WIFI_SMART_ENABLE
 // Lua: smart(channel, function succeed_cb)
 // Lua: smart(type, function succeed_cb)
@@ -221,7 +365,7 @@ static int wifi_getcountry( lua_State* L ){
 
 
   if(wifi_get_country(&cfg)){
-    lua_newtable(L);
+    lua_createtable(L, 0, 4);
 
     lua_pushstring(L, "country");
     lua_pushstring(L, cfg.cc);
@@ -669,7 +813,7 @@ static int wifi_station_get_ap_info4lua( lua_State* L )
 #if defined(WIFI_DEBUG)
   char debug_temp[128];
 #endif
-  lua_newtable(L);
+  lua_createtable(L, number_of_aps, 1);
   lua_pushinteger(L, number_of_aps);
   lua_setfield(L, -2, "qty");
   WIFI_DBG("\n\t# of APs stored in flash:%d\n", number_of_aps);
@@ -677,7 +821,7 @@ static int wifi_station_get_ap_info4lua( lua_State* L )
 
   for(int i=0;i<number_of_aps;i++)
   {
-    lua_newtable(L);
+    lua_createtable(L, 0, 3);
 
     memset(temp, 0, sizeof(temp));
     memcpy(temp, config[i].ssid, sizeof(config[i].ssid));
@@ -790,7 +934,7 @@ static int wifi_station_getconfig( lua_State* L, bool get_flash_cfg)
   {
     if(lua_isboolean(L, 1) && lua_toboolean(L, 1)==true)
     {
-      lua_newtable(L);
+      lua_createtable(L, 0, 4);
       memset(temp, 0, sizeof(temp));
       memcpy(temp, sta_conf.ssid, sizeof(sta_conf.ssid));
       lua_pushstring(L, temp);
@@ -1106,16 +1250,188 @@ static int wifi_station_config( lua_State* L )
   return 1;
 }
 
-// Lua: wifi.sta.connect()
+#ifdef WIFI_SDK_EVENT_MONITOR_ENABLE
+// Fast connect keeps the channel, BSSID and DHCP lease of the last connection
+// in RTC memory slots 21-27, so that after a deep sleep the station can
+// associate without scanning and reuse the lease instead of running DHCP.
+#define FASTCONN_RTC_SLOT 21
+#define FASTCONN_MAGIC 0xFC
+#define FASTCONN_TIMEOUT_MS 2000
+
+enum { FASTCONN_IDLE, FASTCONN_TRYING, FASTCONN_LOCKED };
+
+static struct {
+  uint8 state;
+  uint8 channel;      // of the association being made
+  uint8 bssid[6];
+  uint8 saved_bssid_set; // configuration to restore on fallback
+  uint8 saved_bssid[6];
+  os_timer_t timer;
+} fastconn;
+
+static uint16 fastconn_checksum(const uint32 *slot, const uint8 *ssid)
+{
+  uint32 sum = 0x5A5A;
+  for (int i = 1; i < 7; i++)
+    sum = (sum << 5) + (sum >> 27) + slot[i];
+  for (int i = 0; i < 32 && ssid[i]; i++)
+    sum = (sum << 5) + (sum >> 27) + ssid[i];
+  return (uint16)(sum ^ (sum >> 16));
+}
+
+static bool fastconn_load(uint32 *slot, const uint8 *ssid)
+{
+  for (int i = 0; i < 7; i++)
+    slot[i] = rtc_mem_read(FASTCONN_RTC_SLOT + i);
+  return (slot[0] >> 24) == FASTCONN_MAGIC &&
+         ((slot[0] >> 16) & 0xff) >= 1 && ((slot[0] >> 16) & 0xff) <= 14 &&
+         (slot[0] & 0xffff) == fastconn_checksum(slot, ssid) && slot[3] != 0;
+}
+
+static void fastconn_invalidate(void)
+{
+  rtc_mem_write(FASTCONN_RTC_SLOT, 0);
+}
+
+static void fastconn_store(const Event_StaMode_Got_IP_t *lease)
+{
+  struct station_config conf;
+  uint32 slot[7];
+  const uint8 *b = fastconn.bssid;
+
+  if (fastconn.channel == 0)
+    return;
+  wifi_station_get_config(&conf);
+  ip_addr_t dns = dns_getserver(0);
+  slot[1] = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32)b[3] << 24);
+  slot[2] = b[4] | (b[5] << 8);
+  slot[3] = lease->ip.addr;
+  slot[4] = lease->mask.addr;
+  slot[5] = lease->gw.addr;
+  slot[6] = dns.addr;
+  slot[0] = ((uint32)FASTCONN_MAGIC << 24) | (fastconn.channel << 16) |
+            fastconn_checksum(slot, conf.ssid);
+  for (int i = 0; i < 7; i++)
+    rtc_mem_write(FASTCONN_RTC_SLOT + i, slot[i]);
+}
+
+// Puts back the configured BSSID and DHCP in place of the cached ones
+static void fastconn_restore(void)
+{
+  struct station_config conf;
+
+  os_timer_disarm(&fastconn.timer);
+  if (fastconn.state == FASTCONN_TRYING)
+    fastconn_invalidate();
+  fastconn.state = FASTCONN_IDLE;
+
+  wifi_station_get_config(&conf);
+  conf.channel = 0;
+  conf.bssid_set = fastconn.saved_bssid_set;
+  memcpy(conf.bssid, fastconn.saved_bssid, sizeof(conf.bssid));
+  wifi_station_set_config_current(&conf);
+  wifi_station_dhcpc_start();
+}
+
+// Gives up on the cached association and starts an ordinary connection,
+// which scans all channels and runs DHCP
+static void fastconn_fallback(void *arg)
+{
+  (void)arg;
+  if (fastconn.state == FASTCONN_IDLE)
+    return;
+  wifi_station_disconnect();
+  fastconn_restore();
+  wifi_station_connect();
+}
+
+// Called by the event monitor for every station event before it is queued
+void wifi_fastconnect_event(System_Event_t *evt)
+{
+  switch (evt->event) {
+    case EVENT_STAMODE_CONNECTED:
+      fastconn.channel = evt->event_info.connected.channel;
+      memcpy(fastconn.bssid, evt->event_info.connected.bssid, sizeof(fastconn.bssid));
+      break;
+    case EVENT_STAMODE_GOT_IP:
+      if (fastconn.state == FASTCONN_TRYING) {
+        os_timer_disarm(&fastconn.timer);
+        fastconn.state = FASTCONN_LOCKED;
+      } else if (fastconn.state == FASTCONN_IDLE) {
+        fastconn_store(&evt->event_info.got_ip);
+      }
+      break;
+    case EVENT_STAMODE_DISCONNECTED:
+      fastconn.channel = 0;
+      // The SDK must not keep retrying with the cached BSSID, so the switch
+      // to a full scan happens outside of the event callback
+      if (fastconn.state != FASTCONN_IDLE)
+        os_timer_arm(&fastconn.timer, 1, 0);
+      break;
+  }
+}
+
+// Applies the cached channel, BSSID and lease, if there are any for the
+// configured SSID
+static void fastconn_start(void)
+{
+  struct station_config conf;
+  struct ip_info info;
+  uint32 slot[7];
+
+  wifi_station_get_config(&conf);
+  if (!fastconn_load(slot, conf.ssid))
+    return;
+
+  fastconn.saved_bssid_set = conf.bssid_set;
+  memcpy(fastconn.saved_bssid, conf.bssid, sizeof(conf.bssid));
+  conf.channel = (slot[0] >> 16) & 0xff;
+  conf.bssid_set = 1;
+  conf.bssid[0] = slot[1];
+  conf.bssid[1] = slot[1] >> 8;
+  conf.bssid[2] = slot[1] >> 16;
+  conf.bssid[3] = slot[1] >> 24;
+  conf.bssid[4] = slot[2];
+  conf.bssid[5] = slot[2] >> 8;
+  wifi_station_set_config_current(&conf);
+
+  wifi_station_dhcpc_stop();
+  info.ip.addr = slot[3];
+  info.netmask.addr = slot[4];
+  info.gw.addr = slot[5];
+  wifi_set_ip_info(STATION_IF, &info);
+  if (slot[6]) {
+    ip_addr_t dns = { slot[6] };
+    dns_setserver(0, &dns);
+  }
+
+  fastconn.state = FASTCONN_TRYING;
+  os_timer_disarm(&fastconn.timer);
+  os_timer_setfn(&fastconn.timer, fastconn_fallback, NULL);
+  SWTIMER_REG_CB(fastconn_fallback, SWTIMER_RESUME);
+    //fastconn_fallback only gives up on the cached association, so it resumes
+  os_timer_arm(&fastconn.timer, FASTCONN_TIMEOUT_MS, 0);
+}
+#endif
+
+// Lua: wifi.sta.connect([connected_cb][, fast])
 static int wifi_station_connect4lua( lua_State* L )
 {
 #ifdef WIFI_SDK_EVENT_MONITOR_ENABLE
+  bool fast = lua_toboolean(L, lua_isfunction(L, 1) ? 2 : 1);
   if(lua_isfunction(L, 1)){
+    lua_settop(L, 1);
     lua_pushinteger(L, EVENT_STAMODE_CONNECTED);
-    lua_pushvalue(L, 1);
-    lua_remove(L, 1);
+    lua_insert(L, 1);
     wifi_event_monitor_register(L);
   }
+  // Only an idle station can be pointed at the cached access point, one that
+  // is already connecting (as with auto connect) carries on as it is
+  if (fast && fastconn.state == FASTCONN_IDLE &&
+      wifi_station_get_connect_status() == STATION_IDLE)
+  {
+    fastconn_start();
+  }
 #endif
   wifi_station_connect();
   return 0;
@@ -1126,13 +1442,17 @@ static int wifi_station_disconnect4lua( lua_State* L )
 {
 #ifdef WIFI_SDK_EVENT_MONITOR_ENABLE
   if(lua_isfunction(L, 1)){
+    lua_settop(L, 1);
     lua_pushinteger(L, EVENT_STAMODE_DISCONNECTED);
-    lua_pushvalue(L, 1);
-    lua_remove(L, 1);
+    lua_insert(L, 1);
     wifi_event_monitor_register(L);
   }
 #endif
   wifi_station_disconnect();
+#ifdef WIFI_SDK_EVENT_MONITOR_ENABLE
+  if (fastconn.state != FASTCONN_IDLE)
+    fastconn_restore();
+#endif
   return 0;
 }
 
@@ -1444,7 +1764,7 @@ static int wifi_ap_getconfig( lua_State* L, bool get_flash_cfg)
 
   if(lua_isboolean(L, 1) && lua_toboolean(L, 1)==true)
   {
-    lua_newtable(L);
+    lua_createtable(L, 0, 7);
 
     memset(temp, 0, sizeof(temp));
     memcpy(temp, config.ssid, sizeof(config.ssid));
@@ -1786,10 +2106,13 @@ static int wifi_ap_listclient( lua_State* L )
 
   char temp[64];
 
-  lua_newtable(L);
-
   struct station_info * station = wifi_softap_get_station_info();
   struct station_info * next_station;
+  int n = 0;
+  for (next_station = station; next_station != NULL; next_station = STAILQ_NEXT(next_station, next))
+    n++;
+  lua_createtable(L, 0, n);
+
   while (station != NULL)
   {
     sprintf(temp, MACSTR, MAC2STR(station->bssid));
@@ -1874,6 +2197,7 @@ LROT_BEGIN(wifi_station, NULL, 0)
   LROT_FUNCENTRY( getip, wifi_station_getip )
   LROT_FUNCENTRY( getmac, wifi_station_getmac )
   LROT_FUNCENTRY( getrssi, wifi_station_getrssi )
+  LROT_FUNCENTRY( scan, wifi_station_scan4lua )
   LROT_FUNCENTRY( setaplimit, wifi_station_ap_number_set4lua )
   LROT_FUNCENTRY( sethostname, wifi_sta_sethostname_lua )
   LROT_FUNCENTRY( setip, wifi_station_setip )
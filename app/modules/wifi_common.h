@@ -60,6 +60,7 @@ enum wifi_suspension_state{
   extern LROT_TABLE(wifi_event_monitor);
   void wifi_eventmon_init();
   int wifi_event_monitor_register(lua_State* L);
+  void wifi_fastconnect_event(System_Event_t *evt);
 #endif
 
 #ifdef LUA_USE_MODULES_WIFI_MONITOR
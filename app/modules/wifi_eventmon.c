@@ -24,6 +24,61 @@ static task_handle_t wifi_event_monitor_task_id; //variable to hold task id for
 
 static int wifi_event_cb_ref[EVENT_MAX+1] = { [0 ... EVENT_MAX] = LUA_NOREF}; //holds references to registered Lua callbacks
 
+// Events of a callback registered with an interval are coalesced, so that it
+// runs at most once an interval, with the latest event and a count of them
+typedef struct {
+  os_timer_t timer;       // runs out the rest of the interval
+  uint32_t interval;      // in us
+  uint32_t last;          // system_get_time() of the last callback
+  uint32_t count;         // events since the last callback
+  uint8_t pending;        // the latest event is queued, or timer is armed
+  System_Event_t latest;
+} wifi_event_rate_t;
+
+static wifi_event_rate_t *wifi_event_rate[EVENT_MAX+1];
+
+typedef struct {
+  System_Event_t evt;
+  uint8_t coalesced;      // stands for the events counted in wifi_event_rate
+} wifi_queued_event_t;
+
+static void wifi_event_monitor_queue(const System_Event_t *evt, uint8_t coalesced);
+
+static void wifi_event_monitor_rate_timeout(void *arg)
+{
+  wifi_event_rate_t *r = (wifi_event_rate_t *)arg;
+  wifi_event_monitor_queue(&r->latest, 1);
+}
+
+// Set the interval of the callback for event id, 0 to send every event
+static void wifi_event_monitor_set_rate(lua_State* L, uint8 id, uint32_t ms)
+{
+  wifi_event_rate_t *r = wifi_event_rate[id];
+  if (ms == 0) {
+    if (r) {
+      os_timer_disarm(&r->timer);
+      free(r);
+      wifi_event_rate[id] = NULL;
+    }
+    return;
+  }
+  if (!r) {
+    r = calloc(1, sizeof(wifi_event_rate_t));
+    if (!r)
+      luaL_error(L, "out of memory");
+    os_timer_setfn(&r->timer, wifi_event_monitor_rate_timeout, r);
+    r->last = system_get_time() - ms * 1000;  // so the first event goes at once
+    wifi_event_rate[id] = r;
+  }
+  r->interval = ms * 1000;
+}
+
+// The callback slot that handles event: its own or the EVENT_MAX default
+static uint8 wifi_event_slot(uint8 event)
+{
+  return wifi_event_cb_ref[event] != LUA_NOREF ? event : EVENT_MAX;
+}
+
 #ifdef LUA_USE_MODULES_WIFI_MONITOR
 static int (*hook_fn)(System_Event_t *);
 
@@ -44,11 +99,15 @@ int wifi_event_monitor_register(lua_State* L)
   {
     if (lua_isfunction(L, 2)) //check if 2nd item on stack is a function
     {
+      lua_Integer interval = luaL_optinteger(L, 3, 0);
+      luaL_argcheck(L, interval >= 0 && interval <= 3600000, 3, "interval must be 0-3600000 ms");
+      wifi_event_monitor_set_rate(L, id, interval);
       lua_pushvalue(L, 2);  // copy argument (func) to the top of stack
       register_lua_cb(L, &wifi_event_cb_ref[id]);  //pop function from top of the stack, register it in the LUA_REGISTRY, then assign lua_ref to wifi_event_cb_ref[id]
     }
     else // unregister user's callback
     {
+      wifi_event_monitor_set_rate(L, id, 0);
       unregister_lua_cb(L, &wifi_event_cb_ref[id]);
     }
     return 0;
@@ -60,6 +119,7 @@ static sint32_t event_queue_ref = LUA_NOREF;
 static void wifi_event_monitor_handle_event_cb(System_Event_t *evt)
 {
   EVENT_DBG("was called (Event:%d)", evt->event);
+  wifi_fastconnect_event(evt);
 
 #ifdef LUA_USE_MODULES_WIFI_MONITOR
   if (hook_fn && hook_fn(evt)) {
@@ -74,33 +134,54 @@ static void wifi_event_monitor_handle_event_cb(System_Event_t *evt)
           evt->event == EVENT_SOFTAPMODE_STADISCONNECTED || evt->event == EVENT_SOFTAPMODE_PROBEREQRECVED ||
           evt->event == EVENT_OPMODE_CHANGED)))
   {
-    lua_State* L = lua_getstate();
-    if(event_queue_ref == LUA_NOREF){ //if event queue has not been created, create it now
-      lua_newtable(L);
-      event_queue_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    wifi_event_rate_t *r = wifi_event_rate[wifi_event_slot(evt->event)];
+    if (r) //coalesce the events of a rate limited callback
+    {
+      memcpy(&r->latest, evt, sizeof(System_Event_t));
+      r->count++;
+      if (r->pending){ //the latest event is sent when the queued one is processed
+        return;
+      }
+      r->pending = 1;
+      uint32_t elapsed = system_get_time() - r->last;
+      if (elapsed < r->interval){
+        os_timer_arm(&r->timer, (r->interval - elapsed + 999) / 1000, 0);
+        return;
+      }
     }
-    lua_rawgeti(L, LUA_REGISTRYINDEX, event_queue_ref);
+    wifi_event_monitor_queue(evt, r != NULL);
+   }  //else{} //there are no callbacks registered, so the event can't be processed
+}
+
+static void wifi_event_monitor_queue(const System_Event_t *evt, uint8_t coalesced)
+{
+  lua_State* L = lua_getstate();
+  if(event_queue_ref == LUA_NOREF){ //if event queue has not been created, create it now
+    lua_newtable(L);
+    event_queue_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, event_queue_ref);
 
-    System_Event_t* evt_tmp = lua_newuserdata(L, sizeof(System_Event_t));
-    memcpy(evt_tmp, evt, sizeof(System_Event_t)); //copy event data to new struct
-    sint32_t evt_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    size_t queue_len = lua_objlen(L, -1);
+  wifi_queued_event_t* evt_tmp = lua_newuserdata(L, sizeof(wifi_queued_event_t));
+  memcpy(&evt_tmp->evt, evt, sizeof(System_Event_t)); //copy event data to new struct
+  evt_tmp->coalesced = coalesced;
+  sint32_t evt_ud_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  size_t queue_len = lua_objlen(L, -1);
 
-    //add event to queue
-    lua_pushinteger(L, queue_len+1);
-    lua_pushinteger(L, evt_ud_ref);
-    lua_rawset(L, -3);
+  //add event to queue
+  lua_pushinteger(L, queue_len+1);
+  lua_pushinteger(L, evt_ud_ref);
+  lua_rawset(L, -3);
 
-    if(queue_len == 0){ //if queue was empty, post task
-      EVENT_DBG("Posting task");
-      task_post_low(wifi_event_monitor_task_id, false);
-    }
-    else{
-      EVENT_DBG("Appending queue, items in queue: %d", lua_objlen(L, -1));
+  if(queue_len == 0){ //if queue was empty, post task
+    EVENT_DBG("Posting task");
+    task_post_low(wifi_event_monitor_task_id, false);
+  }
+  else{
+    EVENT_DBG("Appending queue, items in queue: %d", lua_objlen(L, -1));
 
-    }
-    lua_pop(L, 1);
-   }  //else{} //there are no callbacks registered, so the event can't be processed
+  }
+  lua_pop(L, 1);
 }
 
 static void wifi_event_monitor_process_event_queue(task_param_t param, uint8 priority)
@@ -124,7 +205,19 @@ static void wifi_event_monitor_process_event_queue(task_param_t param, uint8 pri
   lua_pop(L, 1);
 
   lua_rawgeti(L, LUA_REGISTRYINDEX, event_ref); //get event userdata from registry
-  System_Event_t *evt = lua_touserdata(L, -1);
+  wifi_queued_event_t *queued = lua_touserdata(L, -1);
+  System_Event_t *evt = &queued->evt;
+  uint32_t count = 0;
+
+  wifi_event_rate_t *r = wifi_event_rate[wifi_event_slot(evt->event)];
+  if (queued->coalesced && r && r->pending) //report the latest of the coalesced events
+  {
+    memcpy(evt, &r->latest, sizeof(System_Event_t));
+    count = r->count;
+    r->count = 0;
+    r->pending = 0;
+    r->last = system_get_time();
+  }
 
   lua_pop(L, 1); //pop userdata from stack
 
@@ -147,6 +240,11 @@ static void wifi_event_monitor_process_event_queue(task_param_t param, uint8 pri
   { //if user has registered an EVENT_MAX(default) callback and event is not implemented...
     lua_rawgeti(L, LUA_REGISTRYINDEX, wifi_event_cb_ref[EVENT_MAX]); //get user's callback
   }
+  else //the callback was unregistered while the event was queued
+  {
+    luaL_unref(L, LUA_REGISTRYINDEX, event_ref);
+    return;
+  }
 
   lua_newtable( L );
 
@@ -238,6 +336,11 @@ static void wifi_event_monitor_process_event_queue(task_param_t param, uint8 pri
       break;
   }
 
+  if (count > 0)
+  {
+    wifi_add_int_field(L, "count", count);
+  }
+
 
   luaL_unref(L, LUA_REGISTRYINDEX, event_ref); //the userdata containing event info is no longer needed
   event_ref = LUA_NOREF;
@@ -277,6 +277,137 @@ typedef struct {
 
 LROT_TABLE(packet_function);
 
+// A compiled filter is a list of byte compares over the sniffer buffer, all
+// of which must hold for a frame to be counted or posted
+#define FILTER_MAX_RULES 8
+#define COUNTER_DEFAULT 32
+#define COUNTER_WAYS 4          // stations that share a hash bucket
+#define HLL_BITS 8
+#define HLL_REGISTERS (1 << HLL_BITS)
+#define TRANSMITTER_OFFSET 22   // addr2 of the frame header
+
+enum { OP_EQ, OP_NE, OP_LT, OP_GT, OP_SGE };
+
+typedef struct {
+  uint8 offset;
+  uint8 len;      // 1, or 6 for an address
+  uint8 op;
+  uint8 mask;
+  uint8 value[6];
+} filter_rule_t;
+
+typedef struct {
+  uint8 mac[6];
+  sint8 rssi;     // of the latest frame
+  sint8 min_rssi;
+  sint8 max_rssi;
+  uint32 count;   // 0 for a free slot
+  uint32 last_seen;
+} counter_t;
+
+static filter_rule_t filter_rules[FILTER_MAX_RULES];
+static uint8 filter_nrules;
+static filter_rule_t compiled_rules[FILTER_MAX_RULES]; // until a filter is complete
+static uint8 compiled_nrules;
+static bool filter_deliver = true;
+// The counters form a hash table with COUNTER_WAYS slots per bucket, and a
+// new station takes the least recently seen slot of its bucket. The unique
+// station count is a HyperLogLog sketch, so it needs HLL_REGISTERS bytes
+// however many stations pass by.
+static counter_t *counters;
+static uint16 counters_size;
+static uint32 counters_clock;
+static uint32 counters_evicted;
+static uint8 *hll;
+
+static bool filter_match(const uint8 *buf) {
+  for (int i = 0; i < filter_nrules; i++) {
+    const filter_rule_t *r = &filter_rules[i];
+    const uint8 *p = buf + r->offset;
+    bool ok;
+
+    if (r->len > 1) {
+      ok = memcmp(p, r->value, r->len) == 0;
+      if (r->op == OP_NE) {
+        ok = !ok;
+      }
+    } else {
+      uint8 v = *p & r->mask;
+      switch (r->op) {
+        case OP_EQ:  ok = v == r->value[0]; break;
+        case OP_NE:  ok = v != r->value[0]; break;
+        case OP_LT:  ok = v < r->value[0]; break;
+        case OP_GT:  ok = v > r->value[0]; break;
+        default:     ok = (sint8) v >= (sint8) r->value[0]; break;
+      }
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint32 mac_hash(const uint8 *mac) {
+  uint32 h = 2166136261u;
+  for (int i = 0; i < 6; i++) {
+    h = (h ^ mac[i]) * 16777619u;
+  }
+  // FNV alone mixes the high bits poorly, which the sketch depends on
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static void hll_add(uint32 h) {
+  uint32 rest = (h << HLL_BITS) | (1 << (HLL_BITS - 1));
+  uint8 rank = __builtin_clz(rest) + 1;
+  uint8 *reg = &hll[h >> (32 - HLL_BITS)];
+  if (rank > *reg) {
+    *reg = rank;
+  }
+}
+
+static void counter_update(const struct sniffer_buf2 *snb, uint32 h) {
+  const uint8 *mac = (const uint8 *) snb + TRANSMITTER_OFFSET;
+  sint8 rssi = snb->rx_ctrl.rssi;
+  counter_t *bucket = &counters[(h % (counters_size / COUNTER_WAYS)) * COUNTER_WAYS];
+  counter_t *c = NULL;
+  counter_t *oldest = bucket;
+
+  for (int i = 0; i < COUNTER_WAYS; i++) {
+    if (bucket[i].count && memcmp(bucket[i].mac, mac, 6) == 0) {
+      c = &bucket[i];
+      break;
+    }
+    if (!bucket[i].count ||
+        (oldest->count && bucket[i].last_seen < oldest->last_seen)) {
+      oldest = &bucket[i];
+    }
+  }
+  if (!c) {
+    c = oldest;
+    if (c->count) {
+      counters_evicted++;
+    }
+    memcpy(c->mac, mac, 6);
+    c->min_rssi = c->max_rssi = rssi;
+    c->count = 0;
+  }
+  c->rssi = rssi;
+  if (rssi < c->min_rssi) {
+    c->min_rssi = rssi;
+  }
+  if (rssi > c->max_rssi) {
+    c->max_rssi = rssi;
+  }
+  c->count++;
+  c->last_seen = ++counters_clock;
+}
+
 static void wifi_rx_cb(uint8 *buf, uint16 len) {
   if (len != sizeof(struct sniffer_buf2)) {
     return;
@@ -293,6 +424,24 @@ static void wifi_rx_cb(uint8 *buf, uint16 len) {
     return;
   }
 
+  if (!filter_match(buf)) {
+    return;
+  }
+
+  if (counters || hll) {
+    uint32 h = mac_hash(buf + TRANSMITTER_OFFSET);
+    if (counters) {
+      counter_update(snb, h);
+    }
+    if (hll) {
+      hll_add(h);
+    }
+  }
+
+  if (!filter_deliver) {
+    return;
+  }
+
   packet_t *packet = (packet_t *) malloc(len + sizeof(packet_t));
   if (packet) {
     packet->len = len;
@@ -748,6 +897,232 @@ static int wifi_monitor_channel(lua_State *L) {
   return 1;
 }
 
+static filter_rule_t *filter_add_rule(lua_State *L, int offset, int len) {
+  if (compiled_nrules == FILTER_MAX_RULES) {
+    luaL_error(L, "too many filter rules (max %d)", FILTER_MAX_RULES);
+  }
+  if (offset < 0 || offset + len > sizeof(struct sniffer_buf2)) {
+    luaL_error(L, "offset (%d) is out of range", offset + 1);
+  }
+  filter_rule_t *r = &compiled_rules[compiled_nrules++];
+  memset(r, 0, sizeof(*r));
+  r->offset = offset;
+  r->len = len;
+  r->mask = 0xff;
+  return r;
+}
+
+static void filter_add_mac(lua_State *L, const char *key, int offset) {
+  lua_getfield(L, 1, key);
+  if (!lua_isnil(L, -1)) {
+    size_t len;
+    const char *mac = luaL_checklstring(L, -1, &len);
+    luaL_argcheck(L, len == 17, 1, "MAC address must be aa:bb:cc:dd:ee:ff");
+    filter_rule_t *r = filter_add_rule(L, offset, 6);
+    ets_str2macaddr(r->value, (char *) mac);
+  }
+  lua_pop(L, 1);
+}
+
+static void filter_add_field(lua_State *L, const char *key, uint8 mask, int shift) {
+  lua_getfield(L, 1, key);
+  if (!lua_isnil(L, -1)) {
+    int v = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, v >= 0 && v <= (mask >> shift), 1, key);
+    filter_rule_t *r = filter_add_rule(L, 12, 1);
+    r->mask = mask;
+    r->value[0] = v << shift;
+  }
+  lua_pop(L, 1);
+}
+
+// Compiles the filter table at index 1 into compiled_rules and returns the
+// size of the counter table it asks for
+static int filter_compile(lua_State *L, bool *unique) {
+  static const char *const ops[] = { "==", "~=", "<", ">", NULL };
+  int ncounters = 0;
+
+  filter_add_field(L, "type", 0x0C, 2);
+  filter_add_field(L, "subtype", 0xF0, 4);
+  filter_add_mac(L, "srcmac", 16);
+  filter_add_mac(L, "dstmac", 22);
+  filter_add_mac(L, "bssid", 28);
+
+  lua_getfield(L, 1, "min_rssi");
+  if (!lua_isnil(L, -1)) {
+    int rssi = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, rssi >= -128 && rssi <= 127, 1, "min_rssi");
+    filter_rule_t *r = filter_add_rule(L, 0, 1);
+    r->op = OP_SGE;
+    r->value[0] = (uint8) rssi;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "bytes");
+  if (!lua_isnil(L, -1)) {
+    luaL_checktype(L, -1, LUA_TTABLE);
+    for (int i = 1; ; i++) {
+      lua_rawgeti(L, -1, i);
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        break;
+      }
+      luaL_checktype(L, -1, LUA_TTABLE);
+      lua_rawgeti(L, -1, 1);
+      lua_rawgeti(L, -2, 2);
+      lua_rawgeti(L, -3, 3);
+      lua_rawgeti(L, -4, 4);
+      filter_rule_t *r = filter_add_rule(L, luaL_checkinteger(L, -4) - 1, 1);
+      r->mask = luaL_optinteger(L, -2, 0xff);
+      r->value[0] = luaL_checkinteger(L, -3) & r->mask;
+      r->op = luaL_checkoption(L, -1, "==", ops);
+      lua_pop(L, 5);
+    }
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "count");
+  if (lua_isnumber(L, -1)) {
+    ncounters = lua_tointeger(L, -1);
+    luaL_argcheck(L, ncounters >= 1 && ncounters <= 1024, 1, "count: 1-1024");
+  } else if (lua_toboolean(L, -1)) {
+    ncounters = COUNTER_DEFAULT;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "unique");
+  *unique = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  // whole buckets only
+  return (ncounters + COUNTER_WAYS - 1) & ~(COUNTER_WAYS - 1);
+}
+
+// Lua: wifi.monitor.filter([{type=, subtype=, srcmac=, dstmac=, bssid=,
+//        min_rssi=, bytes={{offset, value[, mask[, op]]}, ...},
+//        deliver=, count=, unique=}])
+static int wifi_monitor_filter(lua_State *L) {
+  int ncounters = 0;
+  bool unique = false;
+  bool deliver = true;
+
+  // Nothing changes until the whole filter has been compiled
+  compiled_nrules = 0;
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    ncounters = filter_compile(L, &unique);
+    lua_getfield(L, 1, "deliver");
+    deliver = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  counter_t *table = NULL;
+  uint8 *sketch = NULL;
+  if (ncounters) {
+    table = (counter_t *) calloc(ncounters, sizeof(counter_t));
+  }
+  if (unique) {
+    sketch = (uint8 *) calloc(HLL_REGISTERS, 1);
+  }
+  if ((ncounters && !table) || (unique && !sketch)) {
+    free(table);
+    free(sketch);
+    return luaL_error(L, "out of memory");
+  }
+  free(counters);
+  free(hll);
+  counters = table;
+  counters_size = ncounters;
+  counters_clock = 0;
+  counters_evicted = 0;
+  hll = sketch;
+
+  memcpy(filter_rules, compiled_rules, sizeof(filter_rules));
+  filter_nrules = compiled_nrules;
+  filter_deliver = deliver;
+  return 0;
+}
+
+// Lua: wifi.monitor.counters([reset])
+static int wifi_monitor_counters(lua_State *L) {
+  char mac[sizeof("11:22:33:44:55:66")];
+
+  if (!counters) {
+    return 0;
+  }
+  lua_newtable(L);
+  for (int i = 0; i < counters_size; i++) {
+    const counter_t *c = &counters[i];
+    if (!c->count) {
+      continue;
+    }
+    sprintf(mac, MACSTR, MAC2STR(c->mac));
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, c->count);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, c->rssi);
+    lua_setfield(L, -2, "rssi");
+    lua_pushinteger(L, c->min_rssi);
+    lua_setfield(L, -2, "min_rssi");
+    lua_pushinteger(L, c->max_rssi);
+    lua_setfield(L, -2, "max_rssi");
+    lua_pushinteger(L, (counters_clock - c->last_seen));
+    lua_setfield(L, -2, "age");
+    lua_setfield(L, -2, mac);
+  }
+  lua_pushinteger(L, counters_evicted);
+  if (lua_toboolean(L, 1)) {
+    memset(counters, 0, counters_size * sizeof(counter_t));
+    counters_clock = 0;
+    counters_evicted = 0;
+  }
+  return 2;
+}
+
+// log2(x) for x >= 1, in 16.16 fixed point
+static uint32 log2_q16(uint32 x) {
+  int n = 31 - __builtin_clz(x);
+  uint32 result = n << 16;
+  // normalise the mantissa to 1.31 and square it once per fraction bit
+  uint32 m = x << (31 - n);
+  for (uint32 bit = 1 << 15; bit; bit >>= 1) {
+    uint64_t sq = ((uint64_t) m * m) >> 31;
+    if (sq >= (1ull << 32)) {
+      sq >>= 1;
+      result |= bit;
+    }
+    m = sq;
+  }
+  return result;
+}
+
+// Lua: wifi.monitor.unique([reset])
+static int wifi_monitor_unique(lua_State *L) {
+  if (!hll) {
+    return 0;
+  }
+  // The HyperLogLog estimate alpha * m^2 / sum(2^-reg), with the sum kept in
+  // units of 2^-32, falling back to linear counting for small counts
+  uint64_t sum = 0;
+  int zeros = 0;
+  for (int i = 0; i < HLL_REGISTERS; i++) {
+    sum += (uint64_t) 1 << (32 - hll[i]);
+    zeros += hll[i] == 0;
+  }
+  const uint64_t alpha_q16 = 45740;  // 0.7213 / (1 + 1.079 / m) for m = 256
+  uint64_t m2 = (uint64_t) HLL_REGISTERS * HLL_REGISTERS;
+  uint32 estimate = (uint32) ((((alpha_q16 * m2) << 16) / sum));
+  if (estimate <= HLL_REGISTERS * 5 / 2 && zeros) {
+    // m * ln(m / zeros), with ln 2 = 45426 / 65536
+    uint32 log2_ratio = log2_q16(HLL_REGISTERS) - log2_q16(zeros);
+    estimate = ((uint64_t) HLL_REGISTERS * log2_ratio * 45426) >> 32;
+  }
+  lua_pushinteger(L, estimate);
+  if (lua_toboolean(L, 1)) {
+    memset(hll, 0, HLL_REGISTERS);
+  }
+  return 1;
+}
+
 static int wifi_monitor_stop(lua_State *L) {
   wifi_promiscuous_enable(0);
   wifi_set_opmode_current(1);
@@ -776,6 +1151,9 @@ LROT_BEGIN(wifi_monitor, NULL, 0)
   LROT_FUNCENTRY( start, wifi_monitor_start )
   LROT_FUNCENTRY( stop, wifi_monitor_stop )
   LROT_FUNCENTRY( channel, wifi_monitor_channel )
+  LROT_FUNCENTRY( filter, wifi_monitor_filter )
+  LROT_FUNCENTRY( counters, wifi_monitor_counters )
+  LROT_FUNCENTRY( unique, wifi_monitor_unique )
 LROT_END(wifi_monitor, NULL, 0)
 
 
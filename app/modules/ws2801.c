@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "osapi.h"
+#include "driver/spi.h"
 
 #include "pixbuf.h"
 
@@ -17,8 +18,17 @@
 #define PIN_CLK_DEFAULT         0
 #define PIN_DATA_DEFAULT        2
 
+/*
+ * ws2801.init(ws2801.HSPI) sends the data out of HSPI instead, MOSI on GPIO13
+ * and SCLK on GPIO14, through the 64 byte SPI W buffers.  The strip latches
+ * once the clock has been low for 500us.
+ */
+#define WS2801_HSPI             (-1)
+#define WS2801_HSPI_CLOCK_DIV   16      // 80MHz / 16 = 5MHz
+
 static uint32_t ws2801_bit_clk;
 static uint32_t ws2801_bit_data;
+static bool ws2801_hspi;
 
 static void ws2801_byte(uint8_t n) {
     uint8_t bitmask;
@@ -40,6 +50,10 @@ static void ws2801_color(uint8_t r, uint8_t g, uint8_t b) {
 }
 
 static void ws2801_strip(uint8_t const * data, uint16_t len) {
+    if (ws2801_hspi) {
+        platform_spi_blkwrite(SPI_HSPI, len, data);
+        return;
+    }
     while (len--) {
         ws2801_byte(*(data++));
     }
@@ -66,7 +80,7 @@ static void enable_pin_mux(int pin) {
     }
 }
 
-/* Lua: ws2801.init(pin_clk, pin_data)
+/* Lua: ws2801.init(pin_clk, pin_data), ws2801.init(ws2801.HSPI[, clock_div])
  * Sets up the GPIO pins
  *
  * ws2801.init(0, 2) uses GPIO0 as clock and GPIO2 as data.
@@ -78,6 +92,15 @@ static int ICACHE_FLASH_ATTR ws2801_init_lua(lua_State* L) {
     uint32_t func_gpio_clk;
     uint32_t func_gpio_data;
 
+    if (lua_isnumber(L, 1) && lua_tointeger(L, 1) == WS2801_HSPI) {
+        uint32_t clock_div = luaL_optinteger(L, 2, WS2801_HSPI_CLOCK_DIV);
+        luaL_argcheck(L, clock_div >= 2, 2, "out of range");
+        platform_spi_setup(SPI_HSPI, PLATFORM_SPI_MASTER, PLATFORM_SPI_CPOL_LOW, PLATFORM_SPI_CPHA_LOW, clock_div);
+        ws2801_hspi = true;
+        return 0;
+    }
+    ws2801_hspi = false;
+
     if (!lua_isnumber(L, 1) || !lua_isnumber(L, 2)) {
         // Use default pins if the input is omitted
         pin_clk = PIN_CLK_DEFAULT;
@@ -100,6 +123,7 @@ static int ICACHE_FLASH_ATTR ws2801_init_lua(lua_State* L) {
     gpio_output_set(0, ws2801_bit_clk | ws2801_bit_data, ws2801_bit_clk | ws2801_bit_data, 0);
 
     os_delay_us(10);
+    return 0;
 }
 
 /* Lua: ws2801.write(pin, "string")
@@ -145,6 +169,7 @@ static int ICACHE_FLASH_ATTR ws2801_writergb(lua_State* L) {
 LROT_BEGIN(ws2801, NULL, 0)
   LROT_FUNCENTRY( write, ws2801_writergb )
   LROT_FUNCENTRY( init, ws2801_init_lua )
+  LROT_NUMENTRY( HSPI, WS2801_HSPI )
 LROT_END(ws2801, NULL, 0)
 
 
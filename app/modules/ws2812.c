@@ -9,18 +9,54 @@
 #include "driver/uart.h"
 #include "osapi.h"
 #include "cpu_esp8266_irq.h"
+#include "driver/i2s_led.h"
 
 #include "pixbuf.h"
 
 #define MODE_SINGLE  0
 #define MODE_DUAL    1
+#define MODE_I2S     2
+
+// The I2S backend codes each WS2812 bit as 1000 for a 0 and 1110 for a 1
+static platform_task_handle_t i2s_done_task;
+static uint8_t ws2812_mode = MODE_SINGLE;
+
+static void i2s_done(platform_task_param_t param, uint8_t prio) {
+  int ref = (int)param;
+  if (ref != LUA_NOREF) {
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    luaL_pcallx(L, 0, 0);
+  }
+}
+
+// Encode a frame into the DMA buffer and start sending it; returns at once
+static void i2s_write_data(lua_State *L, const uint8_t *pixels, uint32_t length, int cb_ref) {
+  uint32_t *out = i2s_led_frame(length);
+  if (!out) {
+    luaL_unref(L, LUA_REGISTRYINDEX, cb_ref);
+    luaL_error(L, "out of memory");
+  }
+  uint32_t i;
+  for (i = 0; i < length; i++)
+    out[i] = i2s_led_code(pixels[i], 0x8, 0xE);
+  i2s_led_send(false, i2s_done_task, (platform_task_param_t)cb_ref);
+}
 
 // Init UART1 to be able to stream WS2812 data to GPIO2 pin
 // If DUAL mode is selected, init UART0 to stream to TXD0 as well
 // You HAVE to redirect LUA's output somewhere else
 static int ws2812_init(lua_State* L) {
   const int mode = luaL_optinteger(L, 1, MODE_SINGLE);
-  luaL_argcheck(L, mode == MODE_SINGLE || mode == MODE_DUAL, 1, "ws2812.SINGLE or ws2812.DUAL expected");
+  luaL_argcheck(L, mode == MODE_SINGLE || mode == MODE_DUAL || mode == MODE_I2S, 1,
+                "ws2812.SINGLE, ws2812.DUAL or ws2812.I2S expected");
+
+  ws2812_mode = mode;
+  if (mode == MODE_I2S) {
+    i2s_led_init();
+    return 0;
+  }
 
   // Configure UART1
   // Set baudrate of UART1 to 3200000
@@ -148,6 +184,18 @@ static int ws2812_write(lua_State* L) {
     luaL_argerror(L, 1, "pixbuf or string expected");
   }
 
+  if (ws2812_mode == MODE_I2S) {
+    // The frame is copied, so data1 may be reused as soon as this returns
+    int ref = LUA_NOREF;
+    if (!lua_isnoneornil(L, 2)) {
+      luaL_checktype(L, 2, LUA_TFUNCTION);
+      lua_pushvalue(L, 2);
+      ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    i2s_write_data(L, (const uint8_t *)buffer1, length1, ref);
+    return 0;
+  }
+
   // Second optionnal parameter
   type = lua_type(L, 2);
   if (type == LUA_TNONE || type == LUA_TNIL)
@@ -191,10 +239,12 @@ LROT_BEGIN(ws2812, NULL, 0)
   LROT_FUNCENTRY( write, ws2812_write )
   LROT_NUMENTRY( MODE_SINGLE, MODE_SINGLE )
   LROT_NUMENTRY( MODE_DUAL, MODE_DUAL )
+  LROT_NUMENTRY( MODE_I2S, MODE_I2S )
 LROT_END(ws2812, NULL, 0)
 
 static int luaopen_ws2812(lua_State *L) {
   // TODO: Make sure that the GPIO system is initialized
+  i2s_done_task = platform_task_get_id(i2s_done);
   return 0;
 }
 
@@ -52,17 +52,26 @@
 #define IDX_B 2
 #define IDX_W 3
 
+#define SEGMENTS_MAX 32
+
+/* The part of the strip a segment draws into, laid out like a pixbuf */
 typedef struct {
-  pixbuf *buffer;
-  int buffer_ref;
+  size_t npix;
+  size_t nchan;
+  uint8_t *values;
+} ws2812_view;
+
+/* Effect state of one segment of the strip */
+typedef struct {
+  ws2812_view view;
+  size_t offset;               // first pixel of the segment in the strip
+  uint32_t wait;               // ms until the next step
   uint32_t mode_delay;
   uint32_t counter_mode_call;
   uint32_t counter_mode_step;
   uint8_t mode_color_index;
   uint8_t speed;
   uint8_t brightness;
-  os_timer_t os_t;
-  uint8_t running;
   uint8_t effect_type;
   uint8_t color[4];
   int effect_int_param1;
@@ -70,6 +79,17 @@ typedef struct {
   struct pixbuf_shift_params shift;
 } ws2812_effects;
 
+/* The strip, split into segments that are all rendered into its buffer */
+static struct {
+  pixbuf *buffer;
+  int buffer_ref;
+  os_timer_t os_t;
+  uint8_t running;
+  uint8_t nseg;
+  uint32_t last_tick;          // system time of the last timer tick
+  ws2812_effects *seg;
+} strip = { .buffer_ref = LUA_NOREF };
+
 enum ws2812_effects_type {
   WS2812_EFFECT_STATIC,
   WS2812_EFFECT_BLINK,
@@ -91,7 +111,7 @@ enum ws2812_effects_type {
 };
 
 
-static ws2812_effects *state;
+static ws2812_effects *state;  // the segment the set_ functions apply to
 
 
 //-----------------
@@ -111,18 +131,18 @@ static int ws2812_effects_write(pixbuf* buffer) {
 
 // :opens_boxes -1
 static void ws2812_set_pixel(int pixel, uint32_t color) {
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
   uint8_t g = ((color & 0x00FF0000) >> 16);
   uint8_t r = ((color & 0x0000FF00) >> 8);
   uint8_t b = (color & 0x000000FF);
-  uint8_t w = pixbuf_channels(buffer) == 4 ? ((color & 0xFF000000) >> 24) : 0;
+  uint8_t w = buffer->nchan == 4 ? ((color & 0xFF000000) >> 24) : 0;
 
-  int offset = pixel * pixbuf_channels(buffer);
+  int offset = pixel * buffer->nchan;
   buffer->values[offset+IDX_R] = r;
   buffer->values[offset+IDX_G] = g;
   buffer->values[offset+IDX_B] = b;
-  if (pixbuf_channels(buffer) == 4) {
+  if (buffer->nchan == 4) {
     buffer->values[offset+IDX_W] = w;
   }
 }
@@ -152,6 +172,23 @@ static uint8_t get_random_wheel_index(uint8_t pos)
 // EFFECTS LIBRARY
 //-----------------
 
+static void ws2812_effects_init_segment(ws2812_effects *seg, size_t offset, size_t npix) {
+  memset(seg, 0, sizeof(*seg));
+  seg->view.npix = npix;
+  seg->view.nchan = pixbuf_channels(strip.buffer);
+  seg->view.values = strip.buffer->values + offset * seg->view.nchan;
+  seg->offset = offset;
+  seg->speed = SPEED_DEFAULT;
+  seg->mode_delay = DELAY_DEFAULT;
+  seg->brightness = BRIGHTNESS_DEFAULT;
+}
+
+/* Shifts rotate just the pixels of the selected segment */
+static void ws2812_effects_prepare_shift(int shift) {
+  pixbuf_prepare_shift(strip.buffer, &state->shift, shift, PIXBUF_SHIFT_CIRCULAR,
+                       state->offset + 1, state->offset + state->view.npix);
+}
+
 /**
 * initialized ws2812_effects with the buffer to use
 */
@@ -162,21 +199,26 @@ static int ws2812_effects_init(lua_State *L) {
 
   pixbuf * buffer = pixbuf_from_lua_arg(L, 1);
 
+  // Allocate memory and set all to zero
+  ws2812_effects *seg = (ws2812_effects *) calloc(1,sizeof(ws2812_effects));
+  if (seg == NULL) {
+    return luaL_error(L, "out of memory");
+  }
+
   // get rid of old state
   if (state != NULL) {
-    luaL_unref(L, LUA_REGISTRYINDEX, state->buffer_ref);
-    free((void *) state);
+    os_timer_disarm(&strip.os_t);
+    luaL_unref(L, LUA_REGISTRYINDEX, strip.buffer_ref);
+    free((void *) strip.seg);
   }
 
-  // Allocate memory and set all to zero
-  state = (ws2812_effects *) calloc(1,sizeof(ws2812_effects));
-  // initialize
-  state->speed = SPEED_DEFAULT;
-  state->mode_delay = DELAY_DEFAULT;
-  state->brightness = BRIGHTNESS_DEFAULT;
-  state->buffer = buffer;
-
-  state->buffer_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_settop(L, 1);
+  strip.buffer = buffer;
+  strip.buffer_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  strip.running = 0;
+  strip.seg = state = seg;
+  strip.nseg = 1;
+  ws2812_effects_init_segment(seg, 0, buffer->npix);
 
   return 0;
 }
@@ -246,7 +288,7 @@ static int ws2812_effects_set_brightness(lua_State* L) {
 // :opens_boxes -1
 static void ws2812_effects_fill_buffer(uint8_t r, uint8_t g, uint8_t b, uint8_t w) {
 
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
   uint8_t bright_g = g * state->brightness / BRIGHTNESS_MAX;
   uint8_t bright_r = r * state->brightness / BRIGHTNESS_MAX;
@@ -260,7 +302,7 @@ static void ws2812_effects_fill_buffer(uint8_t r, uint8_t g, uint8_t b, uint8_t
     *p++ = bright_g;
     *p++ = bright_r;
     *p++ = bright_b;
-    if (pixbuf_channels(buffer) == 4) {
+    if (buffer->nchan == 4) {
       *p++ = bright_w;
     }
   }
@@ -305,8 +347,8 @@ static int ws2812_effects_mode_blink() {
   }
   else { 
     // off
-    pixbuf * buffer = state->buffer;
-    memset(&buffer->values[0], 0, pixbuf_size(buffer));
+    ws2812_view * buffer = &state->view;
+    memset(&buffer->values[0], 0, (buffer->npix * buffer->nchan));
   }
   return 0;
 }
@@ -315,9 +357,9 @@ static int ws2812_effects_mode_blink() {
 
 static int ws2812_effects_gradient(const char *gradient_spec, size_t length1) {
 
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
-  int segments = (length1 / pixbuf_channels(buffer)) - 1;
+  int segments = (length1 / buffer->nchan) - 1;
   int segmentSize = buffer->npix / segments;
 
   uint8_t g1, r1, b1, g2, r2, b2;
@@ -327,7 +369,7 @@ static int ws2812_effects_gradient(const char *gradient_spec, size_t length1) {
   r2 = *gradient_spec++;
   b2 = *gradient_spec++;
   // skip non-rgb components
-  for (j = 3; j < pixbuf_channels(buffer); j++)
+  for (j = 3; j < buffer->nchan; j++)
   {
     *gradient_spec++;
   }
@@ -350,7 +392,7 @@ static int ws2812_effects_gradient(const char *gradient_spec, size_t length1) {
     g2 = *gradient_spec++;
     r2 = *gradient_spec++;
     b2 = *gradient_spec++;
-    for (j = 3; j < pixbuf_channels(buffer); j++)
+    for (j = 3; j < buffer->nchan; j++)
     {
       *gradient_spec++;
     }
@@ -388,7 +430,7 @@ static int ws2812_effects_gradient(const char *gradient_spec, size_t length1) {
       *p++ = ((grb & 0x0000FF00) >> 8)  * state->brightness / BRIGHTNESS_MAX;
       *p++ = (grb & 0x000000FF) * state->brightness / BRIGHTNESS_MAX;
 
-      for (j = 3; j < pixbuf_channels(buffer); j++) {
+      for (j = 3; j < buffer->nchan; j++) {
         *p++ = 0;
       }
     }
@@ -401,9 +443,9 @@ static int ws2812_effects_gradient(const char *gradient_spec, size_t length1) {
 
 static int ws2812_effects_gradient_rgb(const char *buffer1, size_t length1) {
 
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
-  int segments = (length1 / pixbuf_channels(buffer)) - 1;
+  int segments = (length1 / buffer->nchan) - 1;
   int segmentSize = buffer->npix / segments;
 
   uint8_t g1, r1, b1, g2, r2, b2;
@@ -413,7 +455,7 @@ static int ws2812_effects_gradient_rgb(const char *buffer1, size_t length1) {
   r2 = *buffer1++;
   b2 = *buffer1++;
   // skip non-rgb components
-  for (j = 3; j < pixbuf_channels(buffer); j++)
+  for (j = 3; j < buffer->nchan; j++)
   {
     *buffer1++;
   }
@@ -429,7 +471,7 @@ static int ws2812_effects_gradient_rgb(const char *buffer1, size_t length1) {
     r2 = *buffer1++;
     b2 = *buffer1++;
 
-    for (j = 3; j < pixbuf_channels(buffer); j++) {
+    for (j = 3; j < buffer->nchan; j++) {
       *buffer1++;
     }
 
@@ -446,7 +488,7 @@ static int ws2812_effects_gradient_rgb(const char *buffer1, size_t length1) {
       *p++ = (g1 + ((g2-g1) * i / steps)) * state->brightness / BRIGHTNESS_MAX;
       *p++ = (r1 + ((r2-r1) * i / steps)) * state->brightness / BRIGHTNESS_MAX;
       *p++ = (b1 + ((b2-b1) * i / steps)) * state->brightness / BRIGHTNESS_MAX;
-      for (j = 3; j < pixbuf_channels(buffer); j++)
+      for (j = 3; j < buffer->nchan; j++)
       {
         *p++ = 0;
       }
@@ -463,7 +505,7 @@ static int ws2812_effects_gradient_rgb(const char *buffer1, size_t length1) {
 */
 static int ws2812_effects_mode_random_color() {
   state->mode_color_index = get_random_wheel_index(state->mode_color_index);
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
   uint32_t color = color_wheel(state->mode_color_index);
   uint8_t r = ((color & 0x00FF0000) >> 16) * state->brightness / BRIGHTNESS_MAX;
@@ -477,7 +519,7 @@ static int ws2812_effects_mode_random_color() {
     *p++ = g;
     *p++ = r;
     *p++ = b;
-    for (j = 3; j < pixbuf_channels(buffer); j++)
+    for (j = 3; j < buffer->nchan; j++)
     {
       *p++ = 0;
     }
@@ -490,25 +532,10 @@ static int ws2812_effects_mode_random_color() {
 */
 static int ws2812_effects_mode_rainbow() {
 
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
-  uint32_t color = color_wheel(state->counter_mode_step);
-  uint8_t r = (color & 0x00FF0000) >> 16;
-  uint8_t g = (color & 0x0000FF00) >>  8;
-  uint8_t b = (color & 0x000000FF) >>  0;
-
-  // Fill buffer
-  int i,j;
-  uint8_t * p = &buffer->values[0];
-  for(i = 0; i < buffer->npix; i++) {
-    *p++ = g * state->brightness / BRIGHTNESS_MAX;
-    *p++ = r * state->brightness / BRIGHTNESS_MAX;
-    *p++ = b * state->brightness / BRIGHTNESS_MAX;
-    for (j = 3; j < pixbuf_channels(buffer); j++)
-    {
-      *p++ = 0;
-    }
-  }
+  hsv_fill(&buffer->values[0], buffer->nchan, buffer->npix,
+           state->counter_mode_step << 8, 0, 255, state->brightness, false);
 
   state->counter_mode_step = (state->counter_mode_step + 1) % 360;
   return 0;
@@ -520,24 +547,12 @@ static int ws2812_effects_mode_rainbow() {
 */
 static int ws2812_effects_mode_rainbow_cycle(int repeat_count) {
 
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
-  int i,j;
-  uint8_t * p = &buffer->values[0];
-  for(i = 0; i < buffer->npix; i++) {
-    uint16_t wheel_index = (i * 360 / buffer->npix * repeat_count) % 360;
-    uint32_t color = color_wheel(wheel_index);
-    uint8_t r = ((color & 0x00FF0000) >> 16) * state->brightness / BRIGHTNESS_MAX;
-    uint8_t g = ((color & 0x0000FF00) >>  8) * state->brightness / BRIGHTNESS_MAX;
-    uint8_t b = ((color & 0x000000FF) >>  0) * state->brightness / BRIGHTNESS_MAX;
-    *p++ = g;
-    *p++ = r;
-    *p++ = b;
-    for (j = 3; j < pixbuf_channels(buffer); j++)
-    {
-      *p++ = 0;
-    }
-  }
+  if (buffer->npix == 0)
+    return 0;
+  hsv_fill(&buffer->values[0], buffer->nchan, buffer->npix,
+           0, (360 << 8) * repeat_count / (int)buffer->npix, 255, state->brightness, false);
 
   return 0;
 }
@@ -549,7 +564,7 @@ static int ws2812_effects_mode_rainbow_cycle(int repeat_count) {
 */
 static int ws2812_effects_mode_flicker_int(uint8_t max_flicker) {
 
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
   uint8_t p_g = state->color[0];
   uint8_t p_r = state->color[1];
@@ -569,7 +584,7 @@ static int ws2812_effects_mode_flicker_int(uint8_t max_flicker) {
     *p++ = g1 * state->brightness / BRIGHTNESS_MAX;
     *p++ = r1 * state->brightness / BRIGHTNESS_MAX;
     *p++ = b1 * state->brightness / BRIGHTNESS_MAX;
-    for (j = 3; j < pixbuf_channels(buffer); j++) {
+    for (j = 3; j < buffer->nchan; j++) {
       *p++ = 0;
     }
   }
@@ -581,7 +596,7 @@ static int ws2812_effects_mode_flicker_int(uint8_t max_flicker) {
 * Halloween effect
 */
 static int ws2812_effects_mode_halloween() {
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
   int g1 = 50 * state->brightness / BRIGHTNESS_MAX;
   int r1 = 255 * state->brightness / BRIGHTNESS_MAX;
@@ -599,7 +614,7 @@ static int ws2812_effects_mode_halloween() {
     *p++ = (i % 4 < 2) ? g1 : g2;
     *p++ = (i % 4 < 2) ? r1 : r2;
     *p++ = (i % 4 < 2) ? b1 : b2;
-    for (j = 3; j < pixbuf_channels(buffer); j++)
+    for (j = 3; j < buffer->nchan; j++)
     {
       *p++ = 0;
     }
@@ -611,7 +626,7 @@ static int ws2812_effects_mode_halloween() {
 
 
 static int ws2812_effects_mode_circus_combustus() {
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
   int g1 = 0 * state->brightness / BRIGHTNESS_MAX;
   int r1 = 255 * state->brightness / BRIGHTNESS_MAX;
@@ -640,7 +655,7 @@ static int ws2812_effects_mode_circus_combustus() {
       *p++ = 0;
       *p++ = 0;
     }
-    for (j = 3; j < pixbuf_channels(buffer); j++)
+    for (j = 3; j < buffer->nchan; j++)
     {
       *p++ = 0;
     }
@@ -657,10 +672,10 @@ static int ws2812_effects_mode_circus_combustus() {
 */
 static int ws2812_effects_mode_larson_scanner() {
 
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
   int led_index = 0;
 
-  for(int i=0; i < pixbuf_size(buffer); i++) {
+  for(int i=0; i < (buffer->npix * buffer->nchan); i++) {
     buffer->values[i] = buffer->values[i] >> 2;
   }
 
@@ -671,7 +686,7 @@ static int ws2812_effects_mode_larson_scanner() {
   } else {
     pos = (buffer->npix * 2) - state->counter_mode_step - 2;
   }
-  pos = pos * pixbuf_channels(buffer);
+  pos = pos * buffer->nchan;
   buffer->values[pos + 1] = state->color[1];
   buffer->values[pos] = state->color[0];
   buffer->values[pos + 2] = state->color[2];
@@ -683,9 +698,9 @@ static int ws2812_effects_mode_larson_scanner() {
 
 static int ws2812_effects_mode_color_wipe() {
 
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
-  int led_index = (state->counter_mode_step % buffer->npix) * pixbuf_channels(buffer);
+  int led_index = (state->counter_mode_step % buffer->npix) * buffer->nchan;
 
   if (state->counter_mode_step >= buffer->npix)
   {
@@ -707,10 +722,10 @@ static int ws2812_effects_mode_color_wipe() {
 
 static int ws2812_effects_mode_random_dot(uint8_t dots) {
 
-  pixbuf * buffer = state->buffer;
+  ws2812_view * buffer = &state->view;
 
   // fade out
-  for(int i=0; i < pixbuf_size(buffer); i++) {
+  for(int i=0; i < (buffer->npix * buffer->nchan); i++) {
     buffer->values[i] = buffer->values[i] >> 1;
   }
 
@@ -719,7 +734,7 @@ static int ws2812_effects_mode_random_dot(uint8_t dots) {
     int led_index  = rand() % buffer->npix;
 
     uint32_t color = (state->color[0] << 16) | (state->color[1] << 8) | state->color[2];
-    if (pixbuf_channels(buffer) == 4) {
+    if (buffer->nchan == 4) {
       color = color | (state->color[3] << 24);
     }
     ws2812_set_pixel(led_index, color);
@@ -768,14 +783,13 @@ static uint32_t ws2812_effects_mode_delay()
 
 static void ws2812_effects_do_shift(void)
 {
-  pixbuf_shift(state->buffer, &state->shift);
-  ws2812_effects_write(state->buffer);
+  pixbuf_shift(strip.buffer, &state->shift);
 }
 
 /**
-* run loop for the effects.
+* step the effect of the selected segment by one frame.
 */
-static void ws2812_effects_loop(void* p)
+static void ws2812_effects_step(void)
 {
   if (state->effect_type == WS2812_EFFECT_BLINK)
   {
@@ -848,14 +862,40 @@ static void ws2812_effects_loop(void* p)
   state->mode_delay = ws2812_effects_mode_delay();
   // call count
   state->counter_mode_call = (state->counter_mode_call + 1) % UINT32_MAX;
+}
+
+/**
+* run loop for the effects: step each segment that is due, then write the
+* whole strip once.
+*/
+static void ws2812_effects_loop(void* p)
+{
+  uint32_t now = system_get_time();
+  uint32_t elapsed = (now - strip.last_tick) / 1000;
+  uint32_t next = UINT32_MAX;
+  ws2812_effects *selected = state;
+
+  platform_cpufreq_boost();
+  strip.last_tick += elapsed * 1000;
+  for (int i = 0; i < strip.nseg; i++) {
+    state = &strip.seg[i];
+    if (state->wait <= elapsed) {
+      ws2812_effects_step();
+      state->wait = state->mode_delay;
+    } else {
+      state->wait -= elapsed;
+    }
+    next = min(next, state->wait);
+  }
+  state = selected;
+
   // write the buffer
-  ws2812_effects_write(state->buffer);
+  ws2812_effects_write(strip.buffer);
   // set the timer
-  if (state->running == 1 && state->mode_delay >= 10)
-  if (state->running == 1 && state->mode_delay >= 10)
+  if (strip.running == 1)
   {
-    os_timer_disarm(&(state->os_t));
-    os_timer_arm(&(state->os_t), state->mode_delay, FALSE);
+    os_timer_disarm(&strip.os_t);
+    os_timer_arm(&strip.os_t, max(next, 10), FALSE);
   }
 }
 
@@ -905,13 +945,13 @@ static int ws2812_effects_set_mode(lua_State* L) {
         size_t length1;
         const char *buffer1 = lua_tolstring(L, 2, &length1);
 
-        if ((length1 / pixbuf_channels(state->buffer) < 2) || (length1 % pixbuf_channels(state->buffer) != 0))
+        if ((length1 / state->view.nchan < 2) || (length1 % state->view.nchan != 0))
         {
           luaL_argerror(L, 2, "must be at least two colors and same size as buffer colors");
         }
 
         ws2812_effects_gradient(buffer1, length1);
-        ws2812_effects_write(state->buffer);
+        ws2812_effects_write(strip.buffer);
       }
       else
       {
@@ -925,13 +965,13 @@ static int ws2812_effects_set_mode(lua_State* L) {
         size_t length1;
         const char *buffer1 = lua_tolstring(L, 2, &length1);
 
-        if ((length1 / pixbuf_channels(state->buffer) < 2) || (length1 % pixbuf_channels(state->buffer) != 0))
+        if ((length1 / state->view.nchan < 2) || (length1 % state->view.nchan != 0))
         {
           luaL_argerror(L, 2, "must be at least two colors and same size as buffer colors");
         }
 
         ws2812_effects_gradient_rgb(buffer1, length1);
-        ws2812_effects_write(state->buffer);
+        ws2812_effects_write(strip.buffer);
       }
       else
       {
@@ -947,7 +987,7 @@ static int ws2812_effects_set_mode(lua_State* L) {
       break;
     case WS2812_EFFECT_RAINBOW_CYCLE:
       ws2812_effects_mode_rainbow_cycle(effect_param != EFFECT_PARAM_INVALID ? effect_param : 1);
-      pixbuf_prepare_shift(state->buffer, &state->shift, 1, PIXBUF_SHIFT_CIRCULAR, 1, -1);
+      ws2812_effects_prepare_shift(1);
       break;
     case WS2812_EFFECT_FLICKER:
       state->effect_int_param1 = effect_param;
@@ -962,11 +1002,11 @@ static int ws2812_effects_set_mode(lua_State* L) {
       break;
     case WS2812_EFFECT_HALLOWEEN:
       ws2812_effects_mode_halloween();
-      pixbuf_prepare_shift(state->buffer, &state->shift, 1, PIXBUF_SHIFT_CIRCULAR, 1, -1);
+      ws2812_effects_prepare_shift(1);
       break;
     case WS2812_EFFECT_CIRCUS_COMBUSTUS:
       ws2812_effects_mode_circus_combustus();
-      pixbuf_prepare_shift(state->buffer, &state->shift, 1, PIXBUF_SHIFT_CIRCULAR, 1, -1);
+      ws2812_effects_prepare_shift(1);
       break;
     case WS2812_EFFECT_LARSON_SCANNER:
       ws2812_effects_mode_larson_scanner();
@@ -975,7 +1015,7 @@ static int ws2812_effects_set_mode(lua_State* L) {
       if (effect_param != EFFECT_PARAM_INVALID) {
         state->effect_int_param1 = effect_param;
       }
-      pixbuf_prepare_shift(state->buffer, &state->shift, state->effect_int_param1, PIXBUF_SHIFT_CIRCULAR, 1, -1);
+      ws2812_effects_prepare_shift(state->effect_int_param1);
       break;
     case WS2812_EFFECT_COLOR_WIPE:
       // fill buffer with black. r,g,b,w = 0
@@ -990,6 +1030,7 @@ static int ws2812_effects_set_mode(lua_State* L) {
       break;
   }
 
+  return 0;
 }
 
 
@@ -1002,13 +1043,20 @@ static int ws2812_effects_start(lua_State* L) {
   //NODE_DBG("pin:%d, level:%d \n", pin, level);
   luaL_argcheck(L, state != NULL, 1, LIBRARY_NOT_INITIALIZED_ERROR_MSG);
   if (state != NULL) {
-    os_timer_disarm(&(state->os_t));
-    state->running = 1;
-    state->counter_mode_call = 0;
-    state->counter_mode_step = 0;
+    uint32_t next = UINT32_MAX;
+    os_timer_disarm(&strip.os_t);
+    strip.running = 1;
+    for (int i = 0; i < strip.nseg; i++) {
+      ws2812_effects *seg = &strip.seg[i];
+      seg->counter_mode_call = 0;
+      seg->counter_mode_step = 0;
+      seg->wait = seg->mode_delay;
+      next = min(next, seg->wait);
+    }
+    strip.last_tick = system_get_time();
     // set the timer
-    os_timer_setfn(&(state->os_t), ws2812_effects_loop, NULL);
-    os_timer_arm(&(state->os_t), state->mode_delay, FALSE);
+    os_timer_setfn(&strip.os_t, ws2812_effects_loop, NULL);
+    os_timer_arm(&strip.os_t, next, FALSE);
   }
   return 0;
 }
@@ -1019,8 +1067,121 @@ static int ws2812_effects_start(lua_State* L) {
 static int ws2812_effects_stop(lua_State* L) {
   luaL_argcheck(L, state != NULL, 1, LIBRARY_NOT_INITIALIZED_ERROR_MSG);
   if (state != NULL) {
-    os_timer_disarm(&(state->os_t));
-    state->running = 0;
+    os_timer_disarm(&strip.os_t);
+    strip.running = 0;
+  }
+  return 0;
+}
+
+/*
+* Step every segment by one frame and return the buffer without writing it,
+* so the caller can send it with the writer of its choice.
+*/
+static int ws2812_effects_render(lua_State* L) {
+  luaL_argcheck(L, state != NULL, 1, LIBRARY_NOT_INITIALIZED_ERROR_MSG);
+  ws2812_effects *selected = state;
+  for (int i = 0; i < strip.nseg; i++) {
+    state = &strip.seg[i];
+    ws2812_effects_step();
+  }
+  state = selected;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, strip.buffer_ref);
+  return 1;
+}
+
+/*
+* Select the segment the set_ and get_ functions apply to
+*/
+static int ws2812_effects_select(lua_State* L) {
+  luaL_argcheck(L, state != NULL, 1, LIBRARY_NOT_INITIALIZED_ERROR_MSG);
+  int i = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, i >= 1 && i <= strip.nseg, 1, "no such segment");
+  state = &strip.seg[i - 1];
+  return 0;
+}
+
+/* Call a set_ function on the selected segment with field k of table t */
+static void ws2812_effects_apply_field(lua_State* L, int t, const char *k, lua_CFunction f) {
+  lua_getfield(L, t, k);
+  if (!lua_isnil(L, -1)) {
+    lua_pushcfunction(L, f);
+    lua_insert(L, -2);
+    lua_call(L, 1, 0);
+  } else {
+    lua_pop(L, 1);
+  }
+}
+
+/*
+* Split the strip into segments, each given as a pixel count or as a table
+* {pixels=, mode=, param=, color=, speed=, delay=, brightness=}
+*/
+static int ws2812_effects_set_segments(lua_State* L) {
+  luaL_argcheck(L, state != NULL, 1, LIBRARY_NOT_INITIALIZED_ERROR_MSG);
+  int n = lua_gettop(L);
+  luaL_argcheck(L, n >= 1 && n <= SEGMENTS_MAX, 1, "1 to 32 segments expected");
+
+  size_t npix[SEGMENTS_MAX], total = 0;
+  for (int i = 1; i <= n; i++) {
+    int len;
+    if (lua_istable(L, i)) {
+      lua_getfield(L, i, "pixels");
+      len = luaL_optinteger(L, -1, 0);
+      lua_pop(L, 1);
+    } else {
+      len = luaL_checkinteger(L, i);
+    }
+    // the scanning effects bounce between the ends, so need two pixels
+    luaL_argcheck(L, len > 1, i, "segment needs at least 2 pixels");
+    luaL_argcheck(L, total + len <= strip.buffer->npix, i, "segments exceed the buffer");
+    npix[i - 1] = len;
+    total += len;
+  }
+
+  ws2812_effects *segs = (ws2812_effects *) calloc(n, sizeof(ws2812_effects));
+  if (segs == NULL) {
+    return luaL_error(L, "out of memory");
+  }
+  os_timer_disarm(&strip.os_t);
+  free((void *) strip.seg);
+  strip.seg = segs;
+  strip.nseg = n;
+
+  for (int i = 0, offset = 0; i < n; offset += npix[i++]) {
+    ws2812_effects_init_segment(&segs[i], offset, npix[i]);
+    segs[i].wait = segs[i].mode_delay;
+    if (!lua_istable(L, i + 1)) {
+      continue;
+    }
+    state = &segs[i];
+    ws2812_effects_apply_field(L, i + 1, "brightness", ws2812_effects_set_brightness);
+    lua_getfield(L, i + 1, "color");
+    if (lua_istable(L, -1)) {
+      int c, t = lua_gettop(L);
+      lua_pushcfunction(L, ws2812_effects_set_color);
+      for (c = 1; c <= 4; c++) {
+        lua_rawgeti(L, t, c);
+      }
+      lua_call(L, 4, 0);
+    }
+    lua_pop(L, 1);
+    ws2812_effects_apply_field(L, i + 1, "speed", ws2812_effects_set_speed);
+    ws2812_effects_apply_field(L, i + 1, "delay", ws2812_effects_set_delay);
+    lua_getfield(L, i + 1, "mode");
+    if (!lua_isnil(L, -1)) {
+      lua_pushcfunction(L, ws2812_effects_set_mode);
+      lua_insert(L, -2);
+      lua_getfield(L, i + 1, "param");
+      lua_call(L, 2, 0);
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+  state = &segs[0];
+
+  if (strip.running) {
+    strip.last_tick = system_get_time();
+    os_timer_arm(&strip.os_t, DELAY_DEFAULT, FALSE);
   }
   return 0;
 }
@@ -1046,6 +1207,9 @@ LROT_BEGIN(ws2812_effects_map, NULL, 0)
   LROT_FUNCENTRY( set_speed, ws2812_effects_set_speed )
   LROT_FUNCENTRY( set_delay, ws2812_effects_set_delay )
   LROT_FUNCENTRY( set_mode, ws2812_effects_set_mode )
+  LROT_FUNCENTRY( set_segments, ws2812_effects_set_segments )
+  LROT_FUNCENTRY( select, ws2812_effects_select )
+  LROT_FUNCENTRY( render, ws2812_effects_render )
   LROT_FUNCENTRY( start, ws2812_effects_start )
   LROT_FUNCENTRY( stop, ws2812_effects_stop )
   LROT_FUNCENTRY( get_delay, ws2812_effects_get_delay )
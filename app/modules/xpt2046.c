@@ -7,6 +7,9 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "platform.h"
+#include "user_interface.h"
+#include "pm/swtimer.h"
+#include <string.h>
 
 // Hardware specific values
 static const uint16_t CAL_MARGIN = 0; // Set to 0: up to the application
@@ -16,6 +19,17 @@ static const uint8_t CTRL_HI_X = 0b1001  << 4;
 static const uint8_t CTRL_HI_Y = 0b1101  << 4;
 static const uint16_t ADC_MAX = 0x0fff;  // 12 bits
 
+// Conversions per axis in one burst; the median of them is used
+#ifndef XPT2046_SAMPLES
+#define XPT2046_SAMPLES 7
+#endif
+#define BURST_LEN (1 + 4 * XPT2046_SAMPLES + 2)
+
+// How long the pen must stay down before the first touch event, and the
+// interval of the events while it is held
+#define XPT2046_DEBOUNCE_MS 10
+#define XPT2046_INTERVAL_MS 50
+
 // Runtime variables
 static uint16_t _width, _height;
 static uint8_t _cs_pin, _irq_pin;
@@ -52,42 +66,56 @@ static uint16_t transfer16(uint16_t _data) {
   return t.val;
 }
 
-// reads the value from the touch panel
-static uint16_t _readLoop(uint8_t ctrl, uint8_t max_samples) {
-  uint16_t prev = 0xffff, cur = 0xffff;
-  uint8_t i = 0;
-  do {
-    prev = cur;
-    cur = platform_spi_send_recv(1, 8 , 0);
-    cur = (cur << 4) | (platform_spi_send_recv(1, 8 , ctrl) >> 4);  // 16 clocks -> 12-bits (zero-padded at end)
-  } while ((prev != cur) && (++i < max_samples));
-  return cur;
+// median of n values, sorting them in place
+static uint16_t median(uint16_t *v, int n) {
+  int i, j;
+  for (i = 1; i < n; i++) {
+    uint16_t t = v[i];
+    for (j = i; j > 0 && v[j - 1] > t; j--)
+      v[j] = v[j - 1];
+    v[j] = t;
+  }
+  return v[n / 2];
 }
 
 // Returns the raw position information
 static void getRaw(uint16_t *vi, uint16_t *vj) {
   // Implementation based on TI Technical Note http://www.ti.com/lit/an/sbaa036/sbaa036.pdf
+  // Every conversion takes 16 clocks, the control byte of the next one being
+  // sent while the last bits of this one come in. All of them go in one
+  // block transfer: the first control byte, XPT2046_SAMPLES X conversions,
+  // XPT2046_SAMPLES Y conversions, the last of which powers the ADC down
+  // (PD=0b00) as mode DFR disables PENIRQ, and a flush.
+  uint8_t buf[BURST_LEN];
+  uint16_t x[XPT2046_SAMPLES], y[XPT2046_SAMPLES];
+  int k;
+
+  memset(buf, 0, sizeof(buf));
+  buf[0] = CTRL_HI_X | CTRL_LO_DFR;
+  for (k = 0; k < 2 * XPT2046_SAMPLES; k++)
+    buf[2 + 2 * k] = k + 1 < XPT2046_SAMPLES ? CTRL_HI_X | CTRL_LO_DFR :
+                     k + 1 < 2 * XPT2046_SAMPLES ? CTRL_HI_Y | CTRL_LO_DFR :
+                     CTRL_HI_Y | CTRL_LO_SER;
 
   // Disable interrupt: reading position generates false interrupt
   ETS_GPIO_INTR_DISABLE();
 
   platform_gpio_write(_cs_pin, PLATFORM_GPIO_LOW);
-  platform_spi_send_recv(1, 8 , CTRL_HI_X | CTRL_LO_DFR);  // Send first control int
-  *vi = _readLoop(CTRL_HI_X | CTRL_LO_DFR, 255);
-  *vj = _readLoop(CTRL_HI_Y | CTRL_LO_DFR, 255);
-
-  // Turn off ADC by issuing one more read (throwaway)
-  // This needs to be done, because PD=0b11 (needed for MODE_DFR) will disable PENIRQ
-  platform_spi_send_recv(1, 8 , 0);  // Maintain 16-clocks/conversion; _readLoop always ends after issuing a control int
-  platform_spi_send_recv(1, 8 , CTRL_HI_Y | CTRL_LO_SER);
-  transfer16(0);  // Flush last read, just to be sure
-
+  platform_spi_blktransfer(1, sizeof(buf), buf, buf);
   platform_gpio_write(_cs_pin, PLATFORM_GPIO_HIGH);
 
   // Clear interrupt status
   GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, BIT(pin_num[_irq_pin]));
   // Enable interrupt again
   ETS_GPIO_INTR_ENABLE();
+
+  // 12-bits (zero-padded at end) from the 16 clocks after each control byte
+  for (k = 0; k < 2 * XPT2046_SAMPLES; k++) {
+    uint16_t v = (buf[1 + 2 * k] << 4) | (buf[2 + 2 * k] >> 4);
+    if (k < XPT2046_SAMPLES) x[k] = v; else y[k - XPT2046_SAMPLES] = v;
+  }
+  *vi = median(x, XPT2046_SAMPLES);
+  *vj = median(y, XPT2046_SAMPLES);
 }
 
 // sets the calibration of the display
@@ -101,6 +129,14 @@ static void setCalibration (uint16_t vi1, uint16_t vj1, uint16_t vi2, uint16_t v
   _cal_dvj = (int32_t)vj2 - vj1;
 }
 
+// Map to (un-rotated) display coordinates
+static void mapPosition (uint16_t vi, uint16_t vj, uint16_t *x, uint16_t *y) {
+  *x = (uint16_t)(_cal_dx * (vj - _cal_vj1) / _cal_dvj + CAL_MARGIN);
+  if (*x > 0x7fff) *x = 0;
+  *y = (uint16_t)(_cal_dy * (vi - _cal_vi1) / _cal_dvi + CAL_MARGIN);
+  if (*y > 0x7fff) *y = 0;
+}
+
 // returns the position on the screen by also applying the calibration
 static void getPosition (uint16_t *x, uint16_t *y) {
   if (isTouching() == 0) {
@@ -110,17 +146,101 @@ static void getPosition (uint16_t *x, uint16_t *y) {
   uint16_t vi, vj;
 
   getRaw(&vi, &vj);
+  mapPosition(vi, vj, x, y);
+}
 
-  // Map to (un-rotated) display coordinates
-  *x = (uint16_t)(_cal_dx * (vj - _cal_vj1) / _cal_dvj + CAL_MARGIN);
-  if (*x > 0x7fff) *x = 0;
-  *y = (uint16_t)(_cal_dy * (vi - _cal_vi1) / _cal_dvi + CAL_MARGIN);
-  if (*y > 0x7fff) *y = 0;
+#ifdef GPIO_INTERRUPT_ENABLE
+// Touch events: a falling PENIRQ wakes the module, which then samples on a
+// timer for as long as the pen is down and sleeps again once it is lifted.
+static struct {
+  int touch_ref, release_ref;
+  uint32_t interval;
+  bool pressed;
+  os_timer_t timer;
+} ev = { LUA_NOREF, LUA_NOREF, XPT2046_INTERVAL_MS };
+static platform_task_handle_t ev_task;
+
+static uint32_t ICACHE_RAM_ATTR xpt2046_interrupt(uint32_t ret_gpio_status) {
+  uint32_t bit = BIT(pin_num[_irq_pin]);
+
+  if (ret_gpio_status & bit) {
+    gpio_pin_intr_state_set(GPIO_ID_PIN(pin_num[_irq_pin]), GPIO_PIN_INTR_DISABLE);
+    GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, bit);
+    platform_post_medium(ev_task, 0);
+  }
+  return ret_gpio_status & ~bit;
 }
 
+static void ev_arm(void) {
+  GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, BIT(pin_num[_irq_pin]));
+  platform_gpio_intr_init(_irq_pin, GPIO_PIN_INTR_NEGEDGE);
+}
+
+static void ev_sample(void *arg) {
+  lua_State *L = lua_getstate();
+  uint16_t vi, vj, x, y;
+  (void)arg;
+
+  if (isTouching()) {
+    getRaw(&vi, &vj);
+    // a pen lifted during the burst leaves readings of a floating panel
+    if (isTouching()) {
+      os_timer_arm(&ev.timer, ev.interval, 0);
+      ev.pressed = true;
+      if (ev.touch_ref != LUA_NOREF) {
+        mapPosition(vi, vj, &x, &y);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ev.touch_ref);
+        lua_pushinteger(L, x);
+        lua_pushinteger(L, y);
+        luaL_pcallx(L, 2, 0);
+      }
+      return;
+    }
+  }
+
+  ev_arm();
+  if (ev.pressed) {
+    ev.pressed = false;
+    if (ev.release_ref != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ev.release_ref);
+      luaL_pcallx(L, 0, 0);
+    }
+  }
+}
+
+static void ev_wake(platform_task_param_t param, uint8_t prio) {
+  (void)param; (void)prio;
+  os_timer_arm(&ev.timer, XPT2046_DEBOUNCE_MS, 0);
+}
+
+static bool ev_active(void) {
+  return ev.touch_ref != LUA_NOREF || ev.release_ref != LUA_NOREF;
+}
+
+static void ev_start(void) {
+  os_timer_setfn(&ev.timer, ev_sample, NULL);
+  SWTIMER_REG_CB(ev_sample, SWTIMER_RESUME);
+    //the pen is checked again when the timers resume
+  platform_gpio_register_intr_hook(BIT(pin_num[_irq_pin]), xpt2046_interrupt);
+  platform_gpio_mode(_irq_pin, PLATFORM_GPIO_INT, PLATFORM_GPIO_PULLUP);
+  ev_arm();
+}
+
+static void ev_stop(void) {
+  os_timer_disarm(&ev.timer);
+  platform_gpio_intr_init(_irq_pin, GPIO_PIN_INTR_DISABLE);
+  platform_gpio_unregister_intr_hook(xpt2046_interrupt);
+  ev.pressed = false;
+}
+#endif
+
 
 // Lua: xpt2046.init(cspin, irqpin, height, width)
 static int xpt2046_init( lua_State* L ) {
+#ifdef GPIO_INTERRUPT_ENABLE
+  if (ev_active())
+    ev_stop();
+#endif
   _cs_pin  = luaL_checkinteger( L, 1 );
   _irq_pin = luaL_checkinteger( L, 2 );
   _height  = luaL_checkinteger( L, 3 );
@@ -147,6 +267,10 @@ static int xpt2046_init( lua_State* L ) {
   transfer16(0); // Flush, just to be sure
 
   platform_gpio_write(_cs_pin, PLATFORM_GPIO_HIGH);
+#ifdef GPIO_INTERRUPT_ENABLE
+  if (ev_active() && _irq_pin > 0)
+    ev_start();
+#endif
   return 0;
 }
 
@@ -202,6 +326,39 @@ static int xpt2046_getPositionAvg( lua_State* L ) {
   return 2;
 }
 
+#ifdef GPIO_INTERRUPT_ENABLE
+// Lua: xpt2046.on("touch", [function(x, y)], [interval]), xpt2046.on("release", [function()])
+static int xpt2046_on( lua_State* L ) {
+  static const char * const events[] = { "touch", "release", NULL };
+  int event = luaL_checkoption( L, 1, NULL, events );
+  int *ref = event == 0 ? &ev.touch_ref : &ev.release_ref;
+
+  if (event == 0 && !lua_isnoneornil( L, 3 )) {
+    int interval = luaL_checkinteger( L, 3 );
+    luaL_argcheck( L, interval >= XPT2046_DEBOUNCE_MS, 3, "out of range" );
+    ev.interval = interval;
+  }
+
+  bool active = ev_active();
+  luaL_unref( L, LUA_REGISTRYINDEX, *ref );
+  *ref = LUA_NOREF;
+  if (!lua_isnoneornil( L, 2 )) {
+    luaL_argcheck( L, _irq_pin > 0, 1, "no interrupts on pin 0" );
+    luaL_checktype( L, 2, LUA_TFUNCTION );
+    lua_pushvalue( L, 2 );
+    *ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+
+  if (!ev_active()) {
+    if (active)
+      ev_stop();
+  } else if (!active) {
+    ev_start();
+  }
+  return 0;
+}
+#endif
+
 // Module function map
 LROT_BEGIN(xpt2046, NULL, 0)
   LROT_FUNCENTRY( isTouched, xpt2046_isTouched )
@@ -210,8 +367,17 @@ LROT_BEGIN(xpt2046, NULL, 0)
   LROT_FUNCENTRY( getPositionAvg, xpt2046_getPositionAvg )
   LROT_FUNCENTRY( setCalibration, xpt2046_setCalibration )
   LROT_FUNCENTRY( init, xpt2046_init )
+#ifdef GPIO_INTERRUPT_ENABLE
+  LROT_FUNCENTRY( on, xpt2046_on )
+#endif
 LROT_END(xpt2046, NULL, 0)
 
 
+int luaopen_xpt2046(lua_State *L) {
+#ifdef GPIO_INTERRUPT_ENABLE
+  ev_task = platform_task_get_id(ev_wake);
+#endif
+  return 0;
+}
 
-NODEMCU_MODULE(XPT2046, "xpt2046", xpt2046, NULL);
+NODEMCU_MODULE(XPT2046, "xpt2046", xpt2046, luaopen_xpt2046);
@@ -0,0 +1,268 @@
+// Module for streaming deflate and inflate, built on uzlib
+
+#include "module.h"
+#include "lauxlib.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#include "uzlib/uzlib.h"
+
+#define DEFAULT_WINDOW_BITS     12
+
+#define ZLIB_DEFLATE_METATABLE  "zlib.deflate"
+#define ZLIB_INFLATE_METATABLE  "zlib.inflate"
+
+// The stream pointer is cleared once the stream has finished or failed,
+// which also frees its memory straight away rather than at the next GC.
+typedef struct {
+  void *stream;
+  int failed;
+} zlib_stream;
+
+static const char *const formats[] = { "raw", "zlib", "gzip", NULL };
+
+static void opt_stream(lua_State *L, int opts, int *format, int *windowBits,
+                       int minBits, int maxBits) {
+  *format = UZLIB_FORMAT_GZIP;
+  *windowBits = DEFAULT_WINDOW_BITS;
+
+  if (lua_isnoneornil(L, opts)) {
+    return;
+  }
+  luaL_checktype(L, opts, LUA_TTABLE);
+
+  lua_getfield(L, opts, "format");
+  if (!lua_isnil(L, -1)) {
+    const char *name = luaL_checkstring(L, -1);
+    for (*format = 0; formats[*format] && strcmp(formats[*format], name); (*format)++) {
+    }
+    luaL_argcheck(L, formats[*format], opts, "invalid format");
+  }
+  lua_getfield(L, opts, "windowBits");
+  if (!lua_isnil(L, -1)) {
+    *windowBits = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, *windowBits >= minBits && *windowBits <= maxBits, opts, "windowBits out of range");
+  }
+  lua_pop(L, 2);
+}
+
+static int zlib_error(lua_State *L, int res) {
+  const char *msg;
+
+  switch (res) {
+    case UZLIB_MEMORY_ERROR: msg = "not enough memory"; break;
+    case UZLIB_CHKSUM_ERROR: msg = "checksum mismatch"; break;
+    case UZLIB_DICT_ERROR:   msg = "stream needs a larger windowBits"; break;
+    default:                 msg = "invalid compressed data"; break;
+  }
+  return luaL_error(L, "zlib: %s", msg);
+}
+
+static zlib_stream *check_stream(lua_State *L, const char *metatable) {
+  zlib_stream *z = (zlib_stream *)luaL_checkudata(L, 1, metatable);
+  if (!z->stream) {
+    luaL_error(L, z->failed ? "zlib: stream has failed" : "zlib: stream has finished");
+  }
+  return z;
+}
+
+static void add_output(void *ctx, const uint8_t *data, uint32_t len) {
+  luaL_addlstring((luaL_Buffer *)ctx, (const char *)data, len);
+}
+
+#pragma mark - Deflate
+
+static zlib_stream *deflate_new(lua_State *L, int opts) {
+  int format, windowBits;
+  opt_stream(L, opts, &format, &windowBits, UZLIB_DEFLATE_MIN_WINDOW, UZLIB_DEFLATE_MAX_WINDOW);
+
+  zlib_stream *z = (zlib_stream *)lua_newuserdata(L, sizeof(zlib_stream));
+  z->failed = 0;
+  z->stream = uzlib_deflate_new(format, windowBits);
+  if (!z->stream) {
+    luaL_error(L, "zlib: not enough memory");
+  }
+  luaL_getmetatable(L, ZLIB_DEFLATE_METATABLE);
+  lua_setmetatable(L, -2);
+  return z;
+}
+
+// Compresses into a buffer which the caller has started
+static void deflate_run(lua_State *L, zlib_stream *z, const char *data, size_t len,
+                        int flush, luaL_Buffer *b) {
+  int res = uzlib_deflate_write((UZLIB_DEFLATE_STREAM *)z->stream, (const uint8_t *)data, len,
+                                flush, add_output, b);
+
+  if (res != UZLIB_OK || flush == UZLIB_FLUSH_FINISH) {
+    uzlib_deflate_free((UZLIB_DEFLATE_STREAM *)z->stream);
+    z->stream = NULL;
+    z->failed = res != UZLIB_OK;
+  }
+  if (res != UZLIB_OK) {
+    zlib_error(L, res);
+  }
+}
+
+static int deflate_write(lua_State *L, int flush) {
+  zlib_stream *z = check_stream(L, ZLIB_DEFLATE_METATABLE);
+  size_t len;
+  const char *data = flush == UZLIB_FLUSH_NONE ? luaL_checklstring(L, 2, &len)
+                                               : luaL_optlstring(L, 2, "", &len);
+  luaL_Buffer b;
+
+  luaL_buffinit(L, &b);
+  deflate_run(L, z, data, len, flush, &b);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// Lua: deflater = zlib.deflate([opts])
+static int zlib_deflate(lua_State *L) {
+  deflate_new(L, 1);
+  return 1;
+}
+
+// Lua: s = deflater:write(data)
+static int zlib_deflate_write(lua_State *L) {
+  return deflate_write(L, UZLIB_FLUSH_NONE);
+}
+
+// Lua: s = deflater:flush([data])
+static int zlib_deflate_flush(lua_State *L) {
+  return deflate_write(L, UZLIB_FLUSH_SYNC);
+}
+
+// Lua: s = deflater:finish([data])
+static int zlib_deflate_finish(lua_State *L) {
+  return deflate_write(L, UZLIB_FLUSH_FINISH);
+}
+
+// Lua: s = zlib.compress(data[, opts])
+static int zlib_compress(lua_State *L) {
+  size_t len;
+  const char *data = luaL_checklstring(L, 1, &len);
+  zlib_stream *z = deflate_new(L, 2);
+  luaL_Buffer b;
+
+  luaL_buffinit(L, &b);
+  deflate_run(L, z, data, len, UZLIB_FLUSH_FINISH, &b);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int zlib_deflate_gc(lua_State *L) {
+  zlib_stream *z = (zlib_stream *)luaL_checkudata(L, 1, ZLIB_DEFLATE_METATABLE);
+  uzlib_deflate_free((UZLIB_DEFLATE_STREAM *)z->stream);
+  z->stream = NULL;
+  return 0;
+}
+
+#pragma mark - Inflate
+
+static zlib_stream *inflate_new(lua_State *L, int opts) {
+  int format, windowBits;
+  opt_stream(L, opts, &format, &windowBits, UZLIB_INFLATE_MIN_WINDOW, UZLIB_INFLATE_MAX_WINDOW);
+
+  zlib_stream *z = (zlib_stream *)lua_newuserdata(L, sizeof(zlib_stream));
+  z->failed = 0;
+  z->stream = uzlib_inflate_new(format, windowBits);
+  if (!z->stream) {
+    luaL_error(L, "zlib: not enough memory");
+  }
+  luaL_getmetatable(L, ZLIB_INFLATE_METATABLE);
+  lua_setmetatable(L, -2);
+  return z;
+}
+
+// Decompresses into a buffer which the caller has started, and returns
+// true at the end of the stream. The stream is kept after the end so that
+// further writes can be checked.
+static int inflate_run(lua_State *L, zlib_stream *z, const char *data, size_t len,
+                       luaL_Buffer *b) {
+  int res = uzlib_inflate_write((UZLIB_INFLATE_STREAM *)z->stream, (const uint8_t *)data, len,
+                                add_output, b);
+
+  if (res < 0) {
+    uzlib_inflate_free((UZLIB_INFLATE_STREAM *)z->stream);
+    z->stream = NULL;
+    z->failed = 1;
+    zlib_error(L, res);
+  }
+  return res == UZLIB_DONE;
+}
+
+// Lua: s, done = inflater:write(data)
+static int zlib_inflate_write(lua_State *L) {
+  zlib_stream *z = check_stream(L, ZLIB_INFLATE_METATABLE);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  luaL_Buffer b;
+  int done;
+
+  luaL_buffinit(L, &b);
+  done = inflate_run(L, z, data, len, &b);
+  luaL_pushresult(&b);
+  lua_pushboolean(L, done);
+  return 2;
+}
+
+// Lua: inflater = zlib.inflate([opts])
+static int zlib_inflate(lua_State *L) {
+  inflate_new(L, 1);
+  return 1;
+}
+
+// Lua: s = zlib.decompress(data[, opts])
+static int zlib_decompress(lua_State *L) {
+  size_t len;
+  const char *data = luaL_checklstring(L, 1, &len);
+  zlib_stream *z = inflate_new(L, 2);
+  luaL_Buffer b;
+  int done;
+
+  luaL_buffinit(L, &b);
+  done = inflate_run(L, z, data, len, &b);
+  if (!done) {
+    return luaL_error(L, "zlib: compressed data is truncated");
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int zlib_inflate_gc(lua_State *L) {
+  zlib_stream *z = (zlib_stream *)luaL_checkudata(L, 1, ZLIB_INFLATE_METATABLE);
+  uzlib_inflate_free((UZLIB_INFLATE_STREAM *)z->stream);
+  z->stream = NULL;
+  return 0;
+}
+
+LROT_BEGIN(zlib_deflate_map, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, zlib_deflate_gc )
+  LROT_TABENTRY(  __index, zlib_deflate_map )
+  LROT_FUNCENTRY( write, zlib_deflate_write )
+  LROT_FUNCENTRY( flush, zlib_deflate_flush )
+  LROT_FUNCENTRY( finish, zlib_deflate_finish )
+LROT_END(zlib_deflate_map, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(zlib_inflate_map, NULL, LROT_MASK_GC_INDEX)
+  LROT_FUNCENTRY( __gc, zlib_inflate_gc )
+  LROT_TABENTRY(  __index, zlib_inflate_map )
+  LROT_FUNCENTRY( write, zlib_inflate_write )
+LROT_END(zlib_inflate_map, NULL, LROT_MASK_GC_INDEX)
+
+LROT_BEGIN(zlib, NULL, 0)
+  LROT_FUNCENTRY( deflate, zlib_deflate )
+  LROT_FUNCENTRY( inflate, zlib_inflate )
+  LROT_FUNCENTRY( compress, zlib_compress )
+  LROT_FUNCENTRY( decompress, zlib_decompress )
+LROT_END(zlib, NULL, 0)
+
+int luaopen_zlib(lua_State *L) {
+  luaL_rometatable(L, ZLIB_DEFLATE_METATABLE, LROT_TABLEREF(zlib_deflate_map));
+  luaL_rometatable(L, ZLIB_INFLATE_METATABLE, LROT_TABLEREF(zlib_inflate_map));
+  lua_pushrotable(L, LROT_TABLEREF(zlib));
+  return 1;
+}
+
+NODEMCU_MODULE(ZLIB, "zlib", zlib, luaopen_zlib);
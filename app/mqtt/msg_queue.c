@@ -4,82 +4,112 @@
 #include "msg_queue.h"
 #include "user_config.h"
 
-msg_queue_t *msg_enqueue(msg_queue_t **head, mqtt_message_t *msg, uint16_t msg_id, int msg_type, int publish_qos){
-  if(!head){
+bool msg_pool_init(msg_pool_t *q, uint16_t nodes, uint16_t size){
+  memset(q, 0, sizeof(*q));
+  q->node = (msg_queue_t *)calloc(nodes, sizeof(msg_queue_t));
+  q->data = (uint8_t *)malloc(size);
+  if(!q->node || !q->data){
+    msg_pool_free(q);
+    return false;
+  }
+  q->nodes = nodes;
+  q->size = size;
+  return true;
+}
+
+void msg_pool_free(msg_pool_t *q){
+  free(q->node);
+  free(q->data);
+  memset(q, 0, sizeof(*q));
+}
+
+/* Find a contiguous arena region of len bytes, or return NULL if full */
+static uint8_t *msg_alloc(msg_pool_t *q, uint16_t len){
+  if(q->count == 0){
+    q->wr = 0;
+  } else {
+    uint16_t rd = q->node[q->head].msg.data - q->data;
+    if(q->wr <= rd){
+      /* already wrapped, so free space runs up to the oldest message */
+      if(rd - q->wr < len)
+        return NULL;
+    } else if(q->size - q->wr < len){
+      /* no room at the end, so restart at the front of the arena */
+      if(rd < len)
+        return NULL;
+      q->wr = 0;
+    }
+  }
+  if(len > q->size)
+    return NULL;
+  uint8_t *p = q->data + q->wr;
+  q->wr += len;
+  return p;
+}
+
+msg_queue_t *msg_enqueue(msg_pool_t *q, mqtt_message_t *msg, uint16_t msg_id, int msg_type, int publish_qos){
+  if(!q || !q->node){
     return NULL;
   }
   if (!msg || !msg->data || msg->length == 0){
     NODE_DBG("empty message\n");
     return NULL;
   }
-  msg_queue_t *node = (msg_queue_t *)calloc(1,sizeof(msg_queue_t));
-  if(!node){
-    NODE_DBG("not enough memory\n");
+  if(q->count == q->nodes){
+    NODE_DBG("queue full\n");
     return NULL;
   }
-
-  node->sent = 0;
-
-  node->msg.data = (uint8_t *)calloc(1,msg->length);
-  if(!node->msg.data){
-    NODE_DBG("not enough memory\n");
-    free(node);
+  uint16_t wr = q->wr;
+  uint8_t *data = msg_alloc(q, msg->length);
+  if(!data){
+    q->wr = wr;
+    NODE_DBG("queue full\n");
     return NULL;
   }
-  memcpy(node->msg.data, msg->data, msg->length);
+
+  msg_queue_t *node = &q->node[(q->head + q->count) % q->nodes];
+  memcpy(data, msg->data, msg->length);
+  node->msg.data = data;
   node->msg.length = msg->length;
-  node->next = NULL;
   node->msg_id = msg_id;
   node->msg_type = msg_type;
   node->publish_qos = publish_qos;
-
-  msg_queue_t *tail = *head;
-  if(tail){
-    while(tail->next!=NULL) tail = tail->next;
-    tail->next = node;
-  } else {
-    *head = node;
-  }
+  node->spool_end = 0;
+  node->sent = 0;
+  q->count++;
   return node;
 }
 
-void msg_destroy(msg_queue_t *node){
-  if(!node) return;
-  if(node->msg.data){
-    free(node->msg.data);
-    node->msg.data = NULL;
+void msg_dequeue(msg_pool_t *q){
+  if(!q || q->count == 0){
+    return;
   }
-  free(node);
+  q->node[q->head].msg.data = NULL;
+  q->head = (q->head + 1) % q->nodes;
+  q->count--;
 }
 
-msg_queue_t * msg_dequeue(msg_queue_t **head){
-  if(!head || !*head){
+void msg_flush(msg_pool_t *q){
+  while(q->count)
+    msg_dequeue(q);
+}
+
+msg_queue_t * msg_peek(msg_pool_t *q){
+  if(!q || q->count == 0){
     return NULL;
   }
-  msg_queue_t *node = *head;  // fetch head.
-  *head = node->next; // update head.
-  node->next = NULL;
-  return node;
+  return &q->node[q->head];  // fetch head.
 }
 
-msg_queue_t * msg_peek(msg_queue_t **head){
-  if(!head || !*head){
+/* The message queued after node, or NULL if node is the newest */
+msg_queue_t * msg_next(msg_pool_t *q, msg_queue_t *node){
+  uint16_t i = (node - q->node + 1) % q->nodes;
+  if(((i + q->nodes - q->head) % q->nodes) >= q->count){
     return NULL;
   }
-  return *head;  // fetch head.
+  return &q->node[i];
 }
 
-int msg_size(msg_queue_t **head){
-  if(!head || !*head){
-    return 0;
-  }
-  int i = 1;
-  msg_queue_t *tail = *head;
-  if(tail){
-    while(tail->next!=NULL){
-      tail = tail->next;
-      i++;
-    }
-  }
-  return i;
+int msg_size(msg_pool_t *q){
+  return q ? q->count : 0;
 }
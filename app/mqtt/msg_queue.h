@@ -5,23 +5,42 @@
 extern "C" {
 #endif
 
-struct msg_queue_t;
-
 typedef struct msg_queue_t {
-  struct msg_queue_t *next;
   mqtt_message_t msg;
   uint16_t msg_id;
   int msg_type;
   int publish_qos;
+  uint32_t spool_end;   // spool file offset after this message, 0 if not spooled
 
   bool sent;
 } msg_queue_t;
 
-msg_queue_t * msg_enqueue(msg_queue_t **head, mqtt_message_t *msg, uint16_t msg_id, int msg_type, int publish_qos);
-void msg_destroy(msg_queue_t *node);
-msg_queue_t * msg_dequeue(msg_queue_t **head);
-msg_queue_t * msg_peek(msg_queue_t **head);
-int msg_size(msg_queue_t **head);
+/*
+ * The outbound queue is strictly FIFO, so it is kept in storage preallocated
+ * when the client is created: a ring of node slots and a ring arena holding
+ * the message bytes, each message stored contiguously.  Queueing never touches
+ * the heap, and a full queue is reported to the caller instead of fragmenting
+ * it.
+ */
+typedef struct msg_pool_t {
+  msg_queue_t *node;    // ring of node slots
+  uint8_t *data;        // payload arena
+  uint16_t nodes;       // number of node slots
+  uint16_t head;        // slot of the oldest message
+  uint16_t count;       // messages queued
+  uint16_t size;        // size of the payload arena
+  uint16_t wr;          // arena offset for the next message
+} msg_pool_t;
+
+bool msg_pool_init(msg_pool_t *q, uint16_t nodes, uint16_t size);
+void msg_pool_free(msg_pool_t *q);
+
+msg_queue_t * msg_enqueue(msg_pool_t *q, mqtt_message_t *msg, uint16_t msg_id, int msg_type, int publish_qos);
+void msg_dequeue(msg_pool_t *q);
+void msg_flush(msg_pool_t *q);
+msg_queue_t * msg_peek(msg_pool_t *q);
+msg_queue_t * msg_next(msg_pool_t *q, msg_queue_t *node);
+int msg_size(msg_pool_t *q);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,141 @@
+#include <string.h>
+#include <stdlib.h>
+#include "topic_trie.h"
+
+struct topic_node {
+  struct topic_node *child;   // first node of the next level
+  struct topic_node *next;    // next sibling at this level
+  int handler;
+  bool used;                  // a filter ends at this node
+  uint16_t len;
+  char level[];
+};
+
+/* Length of the first topic level in s */
+static size_t level_len(const char *s, size_t len){
+  const char *p = memchr(s, '/', len);
+  return p ? (size_t)(p - s) : len;
+}
+
+static bool level_is(topic_node_t *node, const char *s, size_t len){
+  return node->len == len && !memcmp(node->level, s, len);
+}
+
+static bool level_is_wild(topic_node_t *node, char c){
+  return node->len == 1 && node->level[0] == c;
+}
+
+/* Set the handler for filter, returning any handler it replaces in previous */
+bool topic_trie_set(topic_node_t **root, const char *filter, size_t len, int handler, int *previous){
+  topic_node_t **link = root, *node;
+  for(;;){
+    size_t l = level_len(filter, len);
+    for(node = *link; node && !level_is(node, filter, l); node = node->next) {}
+    if(!node){
+      node = (topic_node_t *)calloc(1, sizeof(*node) + l);
+      if(!node)
+        return false;
+      memcpy(node->level, filter, l);
+      node->len = l;
+      node->next = *link;
+      *link = node;
+    }
+    if(l == len)
+      break;
+    filter += l + 1;
+    len -= l + 1;
+    link = &node->child;
+  }
+  if(node->used && previous)
+    *previous = node->handler;
+  node->handler = handler;
+  node->used = true;
+  return true;
+}
+
+/* Remove the handler for filter, pruning any nodes that are left unused */
+bool topic_trie_remove(topic_node_t **link, const char *filter, size_t len, int *handler){
+  size_t l = level_len(filter, len);
+  topic_node_t *node;
+  bool found;
+  for(; (node = *link) != NULL; link = &node->next){
+    if(level_is(node, filter, l))
+      break;
+  }
+  if(!node)
+    return false;
+  if(l == len){
+    found = node->used;
+    if(found)
+      *handler = node->handler;
+    node->used = false;
+  } else {
+    found = topic_trie_remove(&node->child, filter + l + 1, len - l - 1, handler);
+  }
+  if(!node->used && !node->child){
+    *link = node->next;
+    free(node);
+  }
+  return found;
+}
+
+static int trie_match(topic_node_t *node, const char *topic, size_t len, bool first,
+                      topic_trie_fn fn, void *arg){
+  size_t l = level_len(topic, len);
+  int n = 0;
+  for(; node; node = node->next){
+    bool multi = level_is_wild(node, '#');
+    bool wild = multi || level_is_wild(node, '+');
+    /* wildcards must not match topics starting with '$' such as $SYS */
+    if(wild && first && len && topic[0] == '$')
+      continue;
+    if(multi){
+      if(node->used){
+        fn(arg, node->handler);
+        n++;
+      }
+      continue;
+    }
+    if(!wild && !level_is(node, topic, l))
+      continue;
+    if(l < len){
+      n += trie_match(node->child, topic + l + 1, len - l - 1, false, fn, arg);
+      continue;
+    }
+    if(node->used){
+      fn(arg, node->handler);
+      n++;
+    }
+    /* a trailing "/#" also matches the parent level itself */
+    topic_node_t *c;
+    for(c = node->child; c; c = c->next){
+      if(level_is_wild(c, '#') && c->used){
+        fn(arg, c->handler);
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+/*
+ * Call fn for the handler of every filter matching topic and return the number
+ * of matches.  fn must not modify the trie.
+ */
+int topic_trie_match(topic_node_t *root, const char *topic, size_t len, topic_trie_fn fn, void *arg){
+  return trie_match(root, topic, len, true, fn, arg);
+}
+
+/* Free the whole trie, passing each handler to fn (if given) for release */
+void topic_trie_free(topic_node_t **root, topic_trie_fn fn, void *arg){
+  topic_node_t *node = *root;
+  while(node){
+    topic_node_t *next = node->next;
+    topic_trie_free(&node->child, fn, arg);
+    if(node->used && fn)
+      fn(arg, node->handler);
+    free(node);
+    node = next;
+  }
+  *root = NULL;
+}
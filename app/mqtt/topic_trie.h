@@ -0,0 +1,29 @@
+#ifndef _TOPIC_TRIE_H
+#define _TOPIC_TRIE_H 1
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A trie of MQTT topic filters, one node per topic level, used to route each
+ * incoming PUBLISH straight to the handler of every matching subscription.
+ * The handler is an opaque int (a Lua registry reference in the client).
+ * Filters may use the '+' and '#' wildcards.
+ */
+typedef struct topic_node topic_node_t;
+
+typedef void (*topic_trie_fn)(void *arg, int handler);
+
+bool topic_trie_set(topic_node_t **root, const char *filter, size_t len, int handler, int *previous);
+bool topic_trie_remove(topic_node_t **root, const char *filter, size_t len, int *handler);
+int topic_trie_match(topic_node_t *root, const char *topic, size_t len, topic_trie_fn fn, void *arg);
+void topic_trie_free(topic_node_t **root, topic_trie_fn fn, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -215,6 +215,32 @@ static uint8 register_flag = 0;
 static uint8 mdns_flag = 0;
 static u8_t *mdns_payload;
 
+/*
+ * The answers only depend on the registered info, the transaction ID and the
+ * local address, so each one is built once and kept until the info changes.
+ * lwIP puts the UDP and IP headers in front of a pbuf that is sent, so every
+ * send still copies the image into a fresh pbuf; the ID and address are
+ * patched in the copy.
+ */
+#define MDNS_CACHE_SERVICE_TYPE   0
+#define MDNS_CACHE_SERVICE        1
+#define MDNS_CACHE_A_RR           2
+#define MDNS_CACHE_KINDS          3
+
+struct mdns_cached_packet {
+	u16_t len;
+	s16_t addr_offset;	/* where the local address goes, -1 if nowhere */
+	u8_t data[1];
+};
+
+/* [kind][unicast], the two differ in TTL and class */
+static struct mdns_cached_packet *mdns_cache[MDNS_CACHE_KINDS][2];
+
+/* RFC 6762 section 6: an answer is multicast at most once per second */
+#define MDNS_MULTICAST_INTERVAL   1000000	/* us */
+static uint32 mdns_last_multicast[MDNS_CACHE_KINDS];
+static u8_t mdns_multicast_sent;		/* bit per kind, mdns_last_multicast is valid */
+
 /**
  * Compare the "dotted" name "query" with the encoded name "response"
  * to make sure an answer from the DNS server matches the current mdns_table
@@ -350,6 +376,145 @@ static err_t send_packet(struct pbuf *p, struct ip_addr *dst_addr, u16_t dst_por
 
   return err;
 }
+static void
+mdns_cache_invalidate(void) {
+  int i, j;
+
+  for (i = 0; i < MDNS_CACHE_KINDS; i++) {
+    for (j = 0; j < 2; j++) {
+      if (mdns_cache[i][j]) {
+	os_free(mdns_cache[i][j]);
+	mdns_cache[i][j] = NULL;
+      }
+    }
+  }
+  mdns_multicast_sent = 0;
+}
+
+static void
+mdns_cache_store(int kind, struct ip_addr *dst_addr, struct pbuf *p, u8_t *addr_ptr) {
+  struct mdns_cached_packet **slot = &mdns_cache[kind][dst_addr != NULL];
+
+  if (*slot || p->next) {
+    return;
+  }
+  *slot = (struct mdns_cached_packet *) os_malloc(sizeof(**slot) + p->len);
+  if (*slot) {
+    (*slot)->len = p->len;
+    (*slot)->addr_offset = addr_ptr ? addr_ptr - (u8_t *) p->payload : -1;
+    memcpy((*slot)->data, p->payload, p->len);
+  }
+}
+
+/**
+ * Send a cached answer.
+ *
+ * @return TRUE if the answer was cached, with the send result in err
+ */
+static bool
+mdns_send_cached(int kind, u16_t id, struct ip_addr *dst_addr, u16_t dst_port, err_t *err) {
+  struct mdns_cached_packet *c = mdns_cache[kind][dst_addr != NULL];
+  struct pbuf *p;
+
+  if (!c) {
+    return FALSE;
+  }
+  p = pbuf_alloc(PBUF_TRANSPORT, c->len, PBUF_RAM);
+  if (!p) {
+    *err = ERR_MEM;
+    return TRUE;
+  }
+  memcpy(p->payload, c->data, c->len);
+  ((struct mdns_hdr *) p->payload)->id = htons(id);
+  *err = send_packet(p, dst_addr, dst_port, c->addr_offset >= 0 ? (u8_t *) p->payload + c->addr_offset : NULL);
+  return TRUE;
+}
+
+/* Returns TRUE if the answer was multicast less than a second ago */
+static bool
+mdns_rate_limited(int kind, struct ip_addr *dst_addr) {
+  uint32 now = system_get_time();
+
+  if (dst_addr) {
+    return FALSE;
+  }
+  if ((mdns_multicast_sent & (1 << kind)) && now - mdns_last_multicast[kind] < MDNS_MULTICAST_INTERVAL) {
+    MDNS_DBG("Rate limited %d\n", kind);
+    return TRUE;
+  }
+  mdns_last_multicast[kind] = now;
+  mdns_multicast_sent |= 1 << kind;
+  return FALSE;
+}
+
+static bool
+mdns_is_local_addr(const u8_t *addr) {
+  struct netif *sta_netif = (struct netif *)eagle_lwip_getif(0x00);
+  struct netif *ap_netif =  (struct netif *)eagle_lwip_getif(0x01);
+
+  return (sta_netif && memcmp(addr, &sta_netif->ip_addr, DNS_IP_ADDR_LEN) == 0) ||
+	 (ap_netif && memcmp(addr, &ap_netif->ip_addr, DNS_IP_ADDR_LEN) == 0);
+}
+
+/**
+ * Known-answer suppression, RFC 6762 section 7.1: a query lists the answers the
+ * querier already holds, and those with at least half their TTL left are not
+ * sent again.
+ *
+ * @param ptr start of the answer section
+ * @return bit per kind (MDNS_CACHE_*) that need not be answered
+ */
+static u8_t
+mdns_known_answers(struct mdns_hdr *hdr, u8_t *ptr, u8_t *end) {
+  char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
+  int nanswers = ntohs(hdr->numanswers);
+  u8_t known = 0;
+
+  while (nanswers-- > 0 && ptr < end) {
+    struct mdns_answer ans;
+    int namelen = mdns_namelen(ptr, end - ptr);
+
+    if (namelen < 0 || ptr + namelen + SIZEOF_DNS_ANSWER > end) {
+      break;
+    }
+    memcpy(&ans, ptr + namelen, SIZEOF_DNS_ANSWER);
+    u8_t *rdata = ptr + namelen + SIZEOF_DNS_ANSWER;
+    u16_t rdlen = ntohs(ans.len);
+    u32_t ttl = ntohl(ans.ttl);
+    if (rdata + rdlen > end) {
+      break;
+    }
+
+    if (ntohs(ans.type) == DNS_RRTYPE_PTR) {
+      if (ttl >= 3600 / 2 &&
+	  mdns_compare_name((unsigned char *) DNS_SD_SERVICE, ptr, (unsigned char *) hdr) == 0 &&
+	  mdns_compare_name((unsigned char *) service_name_with_suffix, rdata, (unsigned char *) hdr) == 0) {
+	known |= 1 << MDNS_CACHE_SERVICE_TYPE;
+      }
+      strlcpy(tmpBuf, ms_info->host_desc, sizeof(tmpBuf));
+      strlcat(tmpBuf, ".", sizeof(tmpBuf));
+      strlcat(tmpBuf, service_name_with_suffix, sizeof(tmpBuf));
+      if (ttl >= 300 / 2 &&
+	  mdns_compare_name((unsigned char *) service_name_with_suffix, ptr, (unsigned char *) hdr) == 0 &&
+	  mdns_compare_name((unsigned char *) tmpBuf, rdata, (unsigned char *) hdr) == 0) {
+	known |= 1 << MDNS_CACHE_SERVICE;
+      }
+    } else if (ntohs(ans.type) == DNS_RRTYPE_A && rdlen == DNS_IP_ADDR_LEN && ttl >= 300 / 2) {
+      strlcpy(tmpBuf, ms_info->host_name, sizeof(tmpBuf));
+      strlcat(tmpBuf, ".", sizeof(tmpBuf));
+      strlcat(tmpBuf, MDNS_LOCAL, sizeof(tmpBuf));
+      if (mdns_compare_name((unsigned char *) tmpBuf, ptr, (unsigned char *) hdr) == 0 &&
+	  mdns_is_local_addr(rdata)) {
+	known |= 1 << MDNS_CACHE_A_RR;
+      }
+    }
+
+    ptr = rdata + rdlen;
+  }
+
+  return known;
+}
+
 /**
  * Send a mDNS packet for the service type
  *
@@ -372,6 +537,12 @@ mdns_send_service_type(u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
 	char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
 	u8_t n;
 	u16_t length = 0;
+
+	err = ERR_OK;
+	if (mdns_rate_limited(MDNS_CACHE_SERVICE_TYPE, dst_addr) ||
+	    mdns_send_cached(MDNS_CACHE_SERVICE_TYPE, id, dst_addr, dst_port, &err)) {
+		return err;
+	}
 	/* if here, we have either a new query or a retry on a previous query to process */
 	p = pbuf_alloc(PBUF_TRANSPORT,
 			SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
@@ -433,6 +604,7 @@ mdns_send_service_type(u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
 		/* resize pbuf to the exact dns query */
 		pbuf_realloc(p, (query + length) - ((char*) (p->payload)));
 
+		mdns_cache_store(MDNS_CACHE_SERVICE_TYPE, dst_addr, p, NULL);
 		err = send_packet(p, dst_addr, dst_port, 0);
 
 	} else {
@@ -470,6 +642,14 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 	struct netif * ap_netif = NULL;
 	char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
 	u16_t dns_class = dst_addr ? DNS_RRCLASS_IN : DNS_RRCLASS_FLUSH_IN;
+
+	err = ERR_OK;
+	if (mdns_rate_limited(MDNS_CACHE_SERVICE, dst_addr)) {
+		return err;
+	}
+	if (mdns_send_cached(MDNS_CACHE_SERVICE, id, dst_addr, dst_port, &err)) {
+		goto sent;
+	}
 	/* if here, we have either a new query or a retry on a previous query to process */
 	p = pbuf_alloc(PBUF_TRANSPORT,
 			SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
@@ -707,17 +887,19 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 		/* resize pbuf to the exact dns query */
 		pbuf_realloc(p, (query) - ((char*) (p->payload)));
 
+		mdns_cache_store(MDNS_CACHE_SERVICE, dst_addr, p, addr_ptr);
 		err = send_packet(p, dst_addr, dst_port, addr_ptr);
-
-		if (!dst_addr) {
-		  // this is being sent multicast...
-		  // so reset the timer
-		  os_timer_disarm(&mdns_timer);
-		  os_timer_arm(&mdns_timer, 1000 * 280, 1);
-		}
 	} else {
 		MDNS_DBG("ERR_MEM \n");
-		err = ERR_MEM;
+		return ERR_MEM;
+	}
+
+sent:
+	if (!dst_addr) {
+	  // this is being sent multicast...
+	  // so reset the timer
+	  os_timer_disarm(&mdns_timer);
+	  os_timer_arm(&mdns_timer, 1000 * 280, 1);
 	}
 
 	return err;
@@ -810,6 +992,11 @@ static void
 mdns_send_a_rr(struct mdns_hdr *req, const char *name, struct ip_addr *dst_addr, u16_t dst_port) {
   int max_ttl = dst_addr ? 10 : 7200;
   struct pbuf *p;
+  err_t err;
+  if (mdns_rate_limited(MDNS_CACHE_A_RR, dst_addr) ||
+      mdns_send_cached(MDNS_CACHE_A_RR, ntohs(req->id), dst_addr, dst_port, &err)) {
+    return;
+  }
   p = pbuf_alloc(PBUF_TRANSPORT,
 		  SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
   if (p != NULL) {
@@ -849,6 +1036,7 @@ mdns_send_a_rr(struct mdns_hdr *req, const char *name, struct ip_addr *dst_addr,
       // Set the length code correctly
       pbuf_realloc(p, query - ((char*) (p->payload)));
 
+      mdns_cache_store(MDNS_CACHE_A_RR, dst_addr, p, (u8_t *) addr_ptr);
       send_packet(p, dst_addr, dst_port, addr_ptr);
     }
   }
@@ -894,6 +1082,18 @@ mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 		u8_t qno;
 		u8_t *qptr = (u8_t *) (hdr + 1);
 		u8_t *qend = mdns_payload + p->tot_len;
+
+		/* the answers the querier already knows follow the questions */
+		u8_t *aptr = qptr;
+		for (qno = 0; qno < nquestions && aptr < qend; qno++) {
+		  int namelen = mdns_namelen(aptr, qend - aptr);
+		  if (namelen < 0) {
+		    break;
+		  }
+		  aptr += namelen + sizeof(struct mdns_query);
+		}
+		u8_t known = qno == nquestions ? mdns_known_answers(hdr, aptr, qend) : 0;
+
 		for (qno = 0; qno < nquestions && qptr < qend; qno++) {
 		  char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
 		  struct mdns_query qry;
@@ -917,7 +1117,9 @@ mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 		  if (mdns_compare_name((unsigned char *) DNS_SD_SERVICE,
 				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
 		    if (qry_type == DNS_RRTYPE_PTR || qry_type == DNS_RRTYPE_ANY) {
-		      mdns_send_service_type(i, addr, port);
+		      if (!(known & (1 << MDNS_CACHE_SERVICE_TYPE))) {
+			mdns_send_service_type(i, addr, port);
+		      }
 		    } else {
 		      no_rr_name = DNS_SD_SERVICE;
 		      actual_rr = DNS_RRTYPE_PTR;
@@ -925,7 +1127,9 @@ mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 		  } else if (mdns_compare_name((unsigned char *) service_name_with_suffix,
 				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
 		    if (qry_type == DNS_RRTYPE_PTR || qry_type == DNS_RRTYPE_ANY) {
-		      mdns_send_service(info, i, addr, port);
+		      if (!(known & (1 << MDNS_CACHE_SERVICE))) {
+			mdns_send_service(info, i, addr, port);
+		      }
 		    } else {
 		      no_rr_name = service_name_with_suffix;
 		      actual_rr = DNS_RRTYPE_PTR;
@@ -939,7 +1143,9 @@ mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 		    if (mdns_compare_name((unsigned char *) tmpBuf,
 				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
 		      if (qry_type == DNS_RRTYPE_A || qry_type == DNS_RRTYPE_ANY) {
-			mdns_send_a_rr(hdr, tmpBuf, addr, port);
+			if (!(known & (1 << MDNS_CACHE_A_RR))) {
+			  mdns_send_a_rr(hdr, tmpBuf, addr, port);
+			}
 		      } else {
 			actual_rr = DNS_RRTYPE_A;
 		      }
@@ -992,6 +1198,7 @@ nodemcu_mdns_close(void)
   }
   mdns_payload = NULL;
   mdns_pcb = NULL;
+  mdns_cache_invalidate();
   mdns_free_info(ms_info);
   ms_info = NULL;
 }
@@ -1068,6 +1275,7 @@ nodemcu_mdns_init(struct nodemcu_mdns_info *info) {
   /* initialize default DNS server address */
   multicast_addr.addr = DNS_MULTICAST_ADDRESS;
   struct ip_info ipconfig;
+  mdns_cache_invalidate();
   mdns_free_info(ms_info);
   ms_info = mdns_dup_info(info);		// Save the passed block. We need all the data forever
 
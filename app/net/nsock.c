@@ -0,0 +1,472 @@
+/*
+ * TCP client sockets on the raw lwIP API, optionally over TLS (see nsock.h).
+ *
+ * The send queue is a list of pbufs linked through their next pointers, each
+ * standing alone (tot_len is not kept up to date).  In plain text, tcp_write
+ * is given their payloads without TCP_WRITE_FLAG_COPY, so a pbuf stays queued
+ * until lwIP has had all of it acknowledged: txwritten counts the bytes from
+ * the head of the queue that lwIP refers to, txacked those of them that are
+ * acknowledged but in a pbuf that is not yet entirely.  With TLS the queue
+ * holds the plain text, which mbed TLS encrypts into its own record buffer and
+ * which is copied into lwIP, so a pbuf goes as soon as it is encrypted and
+ * txwritten is the part of the head that is.  The received records wait in
+ * rxq, rxoff bytes of its head being read, until mbed TLS has decrypted them.
+ *
+ * A socket is freed once closed has been called, any query is answered and
+ * lwIP no longer refers to its pcb or data.
+ */
+
+#include "osapi.h"
+#include "user_interface.h"
+#include "mem.h"
+#include "lwip/tcp.h"
+#include "lwip/dns.h"
+#include "sys/espconn_mbedtls.h"
+#include "task/task.h"
+#include "nsock.h"
+#include <string.h>
+
+enum {
+  NSOCK_DNS,
+  NSOCK_CONNECTING,
+  NSOCK_HANDSHAKE,
+  NSOCK_OPEN,
+  NSOCK_CLOSED
+};
+
+struct nsock {
+  struct tcp_pcb *pcb;
+  const nsock_callbacks *cb;
+  void *arg;
+  char *host;
+  u16_t port;
+  u8_t state;
+  bool secure;
+  bool dns_pending;       // dns_gethostbyname will still call back
+  bool closed_pending;    // closed is posted but has not been called
+  bool sent_pending;      // data was queued since sent was last called
+  bool aborted;           // the pcb was aborted in the current lwIP callback
+  err_t err;
+  struct pbuf *txq;
+  u32_t txwritten;
+  u32_t txacked;
+  struct pbuf *rxq;
+  u16_t rxoff;
+  pmbedtls_msg tls;
+  esp_tcp peer;           // the server, which keys the TLS session cache
+};
+
+static task_handle_t nsock_task;
+
+static void nsock_append(struct pbuf **q, struct pbuf *p) {
+  while (*q)
+    q = &(*q)->next;
+  *q = p;
+}
+
+// Free the head of a queue
+static void nsock_pop(struct pbuf **q) {
+  struct pbuf *p = *q;
+  *q = p->next;
+  p->next = NULL;
+  p->tot_len = p->len;
+  pbuf_free(p);
+}
+
+static void nsock_freeq(struct pbuf **q) {
+  if (*q)
+    pbuf_free(*q);
+  *q = NULL;
+}
+
+static void nsock_free(nsock *s) {
+  if (s->pcb || s->dns_pending || s->closed_pending)
+    return;
+  os_free(s->host);
+  os_free(s);
+}
+
+// Let go of the pcb, which lwIP finishes or has freed
+static void nsock_detach(nsock *s) {
+  if (s->pcb) {
+    tcp_arg(s->pcb, NULL);
+    tcp_recv(s->pcb, NULL);
+    tcp_sent(s->pcb, NULL);
+    tcp_err(s->pcb, NULL);
+    s->pcb = NULL;
+  }
+  nsock_freeq(&s->txq);
+}
+
+static void nsock_closed_task(task_param_t param, uint8_t prio) {
+  nsock *s = (nsock *) param;
+  s->closed_pending = false;
+  if (s->cb->closed)
+    s->cb->closed(s->arg, s->err);
+  nsock_free(s);
+}
+
+void nsock_close(nsock *s, err_t err) {
+  if (s->state == NSOCK_CLOSED)
+    return;
+  u8_t state = s->state;
+  s->state = NSOCK_CLOSED;
+  s->err = err;
+
+  if (s->tls) {
+    if (state == NSOCK_OPEN && err == ERR_OK && s->pcb)
+      mbedtls_ssl_close_notify(&s->tls->ssl);
+    espconn_mbedtls_client_free(&s->tls);
+  }
+  nsock_freeq(&s->rxq);
+
+  if (s->pcb) {
+    tcp_recv(s->pcb, NULL);
+    // a pcb still connecting is freed by tcp_close, so reset that too
+    if (err == ERR_OK && state != NSOCK_CONNECTING && tcp_close(s->pcb) == ERR_OK) {
+      if (s->secure || s->txwritten == 0)
+        nsock_detach(s);
+    } else {
+      tcp_err(s->pcb, NULL);
+      tcp_abort(s->pcb);
+      s->pcb = NULL;
+      s->aborted = true;
+    }
+  }
+  if (!s->pcb)
+    nsock_freeq(&s->txq);
+
+  s->closed_pending = true;
+  if (!task_post_low(nsock_task, (task_param_t) s))
+    nsock_closed_task((task_param_t) s, 0);
+}
+
+#pragma mark - Sending
+
+static void nsock_push_plain(nsock *s) {
+  struct pbuf *p = s->txq;
+  u32_t skip = s->txwritten;
+
+  while (p && skip >= p->len) {
+    skip -= p->len;
+    p = p->next;
+  }
+  while (p) {
+    u16_t n = p->len - skip;
+    if (n > tcp_sndbuf(s->pcb))
+      n = tcp_sndbuf(s->pcb);
+    if (n == 0 || tcp_write(s->pcb, (u8_t *) p->payload + skip, n,
+                            p->next ? TCP_WRITE_FLAG_MORE : 0) != ERR_OK)
+      break;
+    s->txwritten += n;
+    skip += n;
+    if (skip < p->len)
+      break;
+    skip = 0;
+    p = p->next;
+  }
+  tcp_output(s->pcb);
+}
+
+static void nsock_push_tls(nsock *s) {
+  while (s->txq) {
+    struct pbuf *p = s->txq;
+    if (s->txwritten < p->len) {
+      int ret = mbedtls_ssl_write(&s->tls->ssl, (u8_t *) p->payload + s->txwritten,
+                                  p->len - s->txwritten);
+      if (ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+        break;
+      if (ret < 0) {
+        nsock_close(s, NSOCK_ERR_TLS);
+        return;
+      }
+      s->txwritten += ret;
+    }
+    if (s->txwritten == p->len) {
+      nsock_pop(&s->txq);
+      s->txwritten = 0;
+    }
+  }
+  tcp_output(s->pcb);
+}
+
+static void nsock_push(nsock *s) {
+  if (s->secure)
+    nsock_push_tls(s);
+  else
+    nsock_push_plain(s);
+}
+
+// Whether everything queued has gone to lwIP
+static bool nsock_drained(nsock *s) {
+  if (s->secure)
+    return s->txq == NULL;
+  u32_t queued = 0;
+  struct pbuf *p;
+  for (p = s->txq; p; p = p->next)
+    queued += p->len;
+  return queued == s->txwritten;
+}
+
+err_t nsock_send(nsock *s, struct pbuf *p) {
+  if (s->state == NSOCK_CLOSED) {
+    pbuf_free(p);
+    return ERR_CLSD;
+  }
+  nsock_append(&s->txq, p);
+  s->sent_pending = true;
+  if (s->state == NSOCK_OPEN)
+    nsock_push(s);
+  return ERR_OK;
+}
+
+err_t nsock_write(nsock *s, const void *data, u16_t len) {
+  struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+  if (!p)
+    return ERR_MEM;
+  memcpy(p->payload, data, len);
+  return nsock_send(s, p);
+}
+
+#pragma mark - TLS
+
+static int nsock_tls_send(void *ctx, const unsigned char *buf, size_t len) {
+  nsock *s = (nsock *) ctx;
+  if (!s->pcb)
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  u16_t n = tcp_sndbuf(s->pcb);
+  if (n > len)
+    n = len;
+  if (n == 0 || tcp_write(s->pcb, buf, n, TCP_WRITE_FLAG_COPY) != ERR_OK)
+    return MBEDTLS_ERR_SSL_WANT_WRITE;
+  return n;
+}
+
+static int nsock_tls_recv(void *ctx, unsigned char *buf, size_t len) {
+  nsock *s = (nsock *) ctx;
+  size_t got = 0;
+
+  while (s->rxq && got < len) {
+    struct pbuf *p = s->rxq;
+    u16_t n = p->len - s->rxoff;
+    if (n > len - got)
+      n = len - got;
+    memcpy(buf + got, (u8_t *) p->payload + s->rxoff, n);
+    got += n;
+    s->rxoff += n;
+    if (s->rxoff == p->len) {
+      nsock_pop(&s->rxq);
+      s->rxoff = 0;
+    }
+  }
+  return got ? (int) got : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+static void nsock_opened(nsock *s) {
+  s->state = NSOCK_OPEN;
+  os_free(s->host);
+  s->host = NULL;
+  if (s->cb->connected)
+    s->cb->connected(s->arg);
+  if (s->state == NSOCK_OPEN)
+    nsock_push(s);
+}
+
+static void nsock_handshake(nsock *s) {
+  system_soft_wdt_stop();
+  platform_cpufreq_boost();
+  uint8 cpu_freq = system_get_cpu_freq();
+  system_update_cpu_freq(160);
+  int ret = mbedtls_ssl_handshake(&s->tls->ssl);
+  system_soft_wdt_restart();
+  system_update_cpu_freq(cpu_freq);
+  if (s->pcb)
+    tcp_output(s->pcb);
+
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    return;
+  if (ret != 0 || !espconn_mbedtls_client_handshaked(s->tls, &s->peer)) {
+    NODE_DBG("nsock: handshake failed -0x%x\n", -ret);
+    nsock_close(s, NSOCK_ERR_TLS);
+    return;
+  }
+  nsock_opened(s);
+}
+
+// Decrypt the records received, in pbufs of up to one segment
+static void nsock_tls_read(nsock *s) {
+  while (s->state == NSOCK_OPEN &&
+         (s->rxq || mbedtls_ssl_get_bytes_avail(&s->tls->ssl) > 0)) {
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, MBEDTLS_SSL_PLAIN_ADD, PBUF_RAM);
+    if (!p) {
+      nsock_close(s, ERR_MEM);
+      return;
+    }
+    int ret = mbedtls_ssl_read(&s->tls->ssl, p->payload, p->len);
+    if (ret > 0) {
+      pbuf_realloc(p, ret);
+      if (s->cb->recv)
+        s->cb->recv(s->arg, p);
+      else
+        pbuf_free(p);
+      continue;
+    }
+    pbuf_free(p);
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ)
+      return;
+    nsock_close(s, (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) ? ERR_OK : NSOCK_ERR_TLS);
+    return;
+  }
+}
+
+#pragma mark - lwIP callbacks
+
+static err_t nsock_recv_cb(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+  nsock *s = (nsock *) arg;
+  s->aborted = false;
+
+  if (!p) {
+    nsock_close(s, ERR_OK);
+  } else if (s->state != NSOCK_HANDSHAKE && s->state != NSOCK_OPEN) {
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+  } else if (s->secure) {
+    tcp_recved(pcb, p->tot_len);
+    nsock_append(&s->rxq, p);
+    if (s->state == NSOCK_HANDSHAKE)
+      nsock_handshake(s);
+    nsock_tls_read(s);
+  } else {
+    tcp_recved(pcb, p->tot_len);
+    if (s->cb->recv)
+      s->cb->recv(s->arg, p);
+    else
+      pbuf_free(p);
+  }
+  return s->aborted ? ERR_ABRT : ERR_OK;
+}
+
+static err_t nsock_sent_cb(void *arg, struct tcp_pcb *pcb, u16_t len) {
+  nsock *s = (nsock *) arg;
+  s->aborted = false;
+
+  if (!s->secure) {
+    s->txacked += len;
+    while (s->txq && s->txacked >= s->txq->len) {
+      s->txacked -= s->txq->len;
+      s->txwritten -= s->txq->len;
+      nsock_pop(&s->txq);
+    }
+  }
+
+  if (s->state == NSOCK_CLOSED) {
+    if (s->txwritten == 0) {
+      nsock_detach(s);
+      nsock_free(s);
+    }
+  } else if (s->state == NSOCK_HANDSHAKE) {
+    nsock_handshake(s);
+  } else if (s->state == NSOCK_OPEN) {
+    nsock_push(s);
+    if (s->state == NSOCK_OPEN && s->sent_pending && nsock_drained(s)) {
+      s->sent_pending = false;
+      if (s->cb->sent)
+        s->cb->sent(s->arg);
+    }
+  }
+  return s->aborted ? ERR_ABRT : ERR_OK;
+}
+
+static void nsock_err_cb(void *arg, err_t err) {
+  nsock *s = (nsock *) arg;
+  s->pcb = NULL;
+  if (s->state == NSOCK_CLOSED) {
+    nsock_freeq(&s->txq);
+    nsock_free(s);
+  } else {
+    nsock_close(s, err);
+  }
+}
+
+static err_t nsock_connected_cb(void *arg, struct tcp_pcb *pcb, err_t err) {
+  nsock *s = (nsock *) arg;
+  s->aborted = false;
+
+  if (!s->secure) {
+    nsock_opened(s);
+    return s->aborted ? ERR_ABRT : ERR_OK;
+  }
+
+  s->state = NSOCK_HANDSHAKE;
+  s->tls = espconn_mbedtls_client_new(&s->peer);
+  if (!s->tls) {
+    nsock_close(s, ERR_MEM);
+    return ERR_ABRT;
+  }
+  mbedtls_ssl_set_bio(&s->tls->ssl, s, nsock_tls_send, nsock_tls_recv, NULL);
+#if defined(MBEDTLS_X509_CRT_PARSE_C)
+  mbedtls_ssl_set_hostname(&s->tls->ssl, s->host);
+#endif
+  nsock_handshake(s);
+  return s->aborted ? ERR_ABRT : ERR_OK;
+}
+
+static void nsock_dns_cb(const char *name, ip_addr_t *ipaddr, void *arg) {
+  nsock *s = (nsock *) arg;
+  s->dns_pending = false;
+
+  if (s->state != NSOCK_DNS) {
+    nsock_free(s);
+    return;
+  }
+  if (!ipaddr) {
+    nsock_close(s, NSOCK_ERR_DNS);
+    return;
+  }
+  if (!(s->pcb = tcp_new())) {
+    nsock_close(s, ERR_MEM);
+    return;
+  }
+  os_memcpy(s->peer.remote_ip, &ipaddr->addr, 4);
+  s->peer.remote_port = s->port;
+  tcp_arg(s->pcb, s);
+  tcp_err(s->pcb, nsock_err_cb);
+  tcp_recv(s->pcb, nsock_recv_cb);
+  tcp_sent(s->pcb, nsock_sent_cb);
+
+  s->state = NSOCK_CONNECTING;
+  err_t err = tcp_connect(s->pcb, ipaddr, s->port, nsock_connected_cb);
+  if (err != ERR_OK)
+    nsock_close(s, err);
+}
+
+nsock *nsock_connect(const char *host, u16_t port, bool secure,
+                     const nsock_callbacks *cb, void *arg) {
+  if (!nsock_task)
+    nsock_task = task_get_id(nsock_closed_task);
+
+  nsock *s = (nsock *) os_zalloc(sizeof(nsock));
+  if (!s)
+    return NULL;
+  if (!(s->host = (char *) os_malloc(strlen(host) + 1))) {
+    os_free(s);
+    return NULL;
+  }
+  strcpy(s->host, host);
+  s->port = port;
+  s->secure = secure;
+  s->cb = cb;
+  s->arg = arg;
+  s->state = NSOCK_DNS;
+
+  ip_addr_t addr;
+  s->dns_pending = true;
+  err_t err = dns_gethostbyname(host, &addr, nsock_dns_cb, s);
+  if (err == ERR_OK) {
+    nsock_dns_cb(host, &addr, s);
+  } else if (err != ERR_INPROGRESS) {
+    s->dns_pending = false;
+    nsock_close(s, err);
+  }
+  return s;
+}
@@ -0,0 +1,211 @@
+/*
+  This file contains the I2S driver implementation.
+
+  The samples are sent to an external I2S DAC, such as a MAX98357A, by the DMA
+  engine of the I2S peripheral. Each 8 bit sample is widened to a 16 bit frame
+  on both channels. The DMA runs through a ring of blocks, and as each one has
+  been sent the EOF interrupt refills it from the play buffers, so the CPU only
+  wakes once per block instead of once per sample.
+
+  Pins: GPIO3 (RXD0) data, GPIO15 bit clock and GPIO2 word select.
+*/
+
+#include "platform.h"
+#include "task/task.h"
+#include "driver/i2s_register.h"
+#include "driver/slc_register.h"
+#include <stdlib.h>
+
+#include "pcm.h"
+
+#define I2S_BLOCKS       3
+#define I2S_BLOCK_FRAMES 64
+#define I2S_DIV_MAX      63
+// the I2S clock is 160MHz, and a frame is 32 bit clocks
+#define I2S_FRAME_DIV    (160000000 / 32)
+
+extern void rom_i2c_writeReg_Mask(uint32_t block, uint32_t host_id, uint32_t reg_add,
+                                  uint32_t msb, uint32_t lsb, uint32_t indata);
+
+static const uint16_t drv_i2s_rate_hz[] = {1000, 2000, 4000, 5000, 8000, 10000, 12000, 16000};
+
+static struct slc_queue_item drv_i2s_desc[I2S_BLOCKS];
+static uint32_t *drv_i2s_frames;
+static cfg_t * volatile drv_i2s_cfg;
+static uint8_t drv_i2s_sample = 128, drv_i2s_left;
+
+static void ICACHE_RAM_ATTR drv_i2s_fill( uint32_t *out )
+{
+  cfg_t *cfg = drv_i2s_cfg;
+  int i;
+
+  for (i = 0; i < I2S_BLOCK_FRAMES; i++) {
+    if (drv_i2s_left == 0) {
+      // silence while there is no data
+      if (!cfg || !pcm_isr_sample( cfg, &drv_i2s_sample )) {
+        drv_i2s_sample = 128;
+      }
+      drv_i2s_left = cfg ? cfg->i2s_repeat : 1;
+    }
+    drv_i2s_left--;
+
+    uint32_t v = (uint16_t)(((int16_t)drv_i2s_sample - 128) << 8);
+    out[i] = (v << 16) | v;
+  }
+}
+
+static void ICACHE_RAM_ATTR drv_i2s_slc_isr( void *arg )
+{
+  uint32_t status = READ_PERI_REG(SLC_INT_STATUS);
+  WRITE_PERI_REG(SLC_INT_CLR, 0xffffffff);
+
+  if (status & SLC_RX_EOF_INT_ST) {
+    // refill the block just sent while the DMA carries on with the next ones
+    struct slc_queue_item *desc = (struct slc_queue_item *)READ_PERI_REG(SLC_RX_EOF_DES_ADDR);
+    drv_i2s_fill( (uint32_t *)desc->buf_ptr );
+    desc->owner = 1;
+  }
+}
+
+// Picks the dividers nearest to the sample rate
+static void drv_i2s_set_rate( cfg_t *cfg )
+{
+  uint32_t hz = drv_i2s_rate_hz[cfg->rate];
+  uint32_t div, clkm, bck, best_clkm = 2, best_bck = 2, best_err = ~0;
+
+  cfg->i2s_repeat = 1;
+  while ((div = I2S_FRAME_DIV / (hz * cfg->i2s_repeat)) > I2S_DIV_MAX * I2S_DIV_MAX) {
+    cfg->i2s_repeat++;
+  }
+
+  for (clkm = 2; clkm <= I2S_DIV_MAX; clkm++) {
+    bck = (div + clkm / 2) / clkm;
+    if (bck < 2 || bck > I2S_DIV_MAX) {
+      continue;
+    }
+    uint32_t err = abs((int)(clkm * bck) - (int)div);
+    if (err < best_err) {
+      best_err = err;
+      best_clkm = clkm;
+      best_bck = bck;
+    }
+  }
+
+  CLEAR_PERI_REG_MASK(I2SCONF, (I2S_BCK_DIV_NUM << I2S_BCK_DIV_NUM_S) |
+                               (I2S_CLKM_DIV_NUM << I2S_CLKM_DIV_NUM_S));
+  SET_PERI_REG_MASK(I2SCONF, (best_bck << I2S_BCK_DIV_NUM_S) | (best_clkm << I2S_CLKM_DIV_NUM_S));
+}
+
+static uint8_t drv_i2s_stop( cfg_t *cfg )
+{
+  CLEAR_PERI_REG_MASK(I2SCONF, I2S_I2S_TX_START);
+  SET_PERI_REG_MASK(SLC_RX_LINK, SLC_RXLINK_STOP);
+  drv_i2s_cfg = NULL;
+
+  return TRUE;
+}
+
+static uint8_t drv_i2s_close( cfg_t *cfg )
+{
+  drv_i2s_stop( cfg );
+
+  ETS_SLC_INTR_DISABLE();
+  WRITE_PERI_REG(SLC_INT_ENA, 0);
+  PIN_FUNC_SELECT(PERIPHS_IO_MUX_U0RXD_U, FUNC_U0RXD);
+
+  free( drv_i2s_frames );
+  drv_i2s_frames = NULL;
+
+  return TRUE;
+}
+
+static uint8_t drv_i2s_play( cfg_t *cfg )
+{
+  int i;
+
+  // VU control: derive callback frequency
+  cfg->vu_req_samples = (uint16_t)((1000000L / (uint32_t)cfg->vu_freq) / (uint32_t)pcm_rate_def[cfg->rate]);
+  cfg->vu_samples_tmp = 0;
+  cfg->vu_peak_tmp    = 0;
+
+  drv_i2s_set_rate( cfg );
+
+  // start on silence, the blocks are filled with samples as they are sent
+  drv_i2s_cfg = NULL;
+  drv_i2s_left = 0;
+  for (i = 0; i < I2S_BLOCKS; i++) {
+    drv_i2s_fill( drv_i2s_frames + i * I2S_BLOCK_FRAMES );
+    drv_i2s_desc[i] = (struct slc_queue_item){
+      .blocksize = I2S_BLOCK_FRAMES * 4, .datalen = I2S_BLOCK_FRAMES * 4, .eof = 1, .owner = 1,
+      .buf_ptr = (uint8_t *)(drv_i2s_frames + i * I2S_BLOCK_FRAMES),
+      .next_link_ptr = &drv_i2s_desc[(i + 1) % I2S_BLOCKS] };
+  }
+  drv_i2s_cfg = cfg;
+
+  SET_PERI_REG_MASK(SLC_RX_LINK, SLC_RXLINK_STOP);
+  CLEAR_PERI_REG_MASK(SLC_RX_LINK, SLC_RXLINK_DESCADDR_MASK);
+  SET_PERI_REG_MASK(SLC_RX_LINK, ((uint32_t)drv_i2s_desc) & SLC_RXLINK_DESCADDR_MASK);
+  SET_PERI_REG_MASK(SLC_RX_LINK, SLC_RXLINK_START);
+  SET_PERI_REG_MASK(I2SCONF, I2S_I2S_TX_START);
+
+  return TRUE;
+}
+
+static uint8_t drv_i2s_init( cfg_t *cfg )
+{
+  if (!drv_i2s_frames) {
+    drv_i2s_frames = (uint32_t *) malloc( I2S_BLOCKS * I2S_BLOCK_FRAMES * 4 );
+    if (!drv_i2s_frames) {
+      return FALSE;
+    }
+  }
+
+  // Reset the DMA engine and feed the I2S FIFO from the SLC RX link
+  SET_PERI_REG_MASK(SLC_CONF0, SLC_RXLINK_RST | SLC_TXLINK_RST);
+  CLEAR_PERI_REG_MASK(SLC_CONF0, SLC_RXLINK_RST | SLC_TXLINK_RST);
+  WRITE_PERI_REG(SLC_INT_CLR, 0xffffffff);
+  CLEAR_PERI_REG_MASK(SLC_CONF0, SLC_MODE << SLC_MODE_S);
+  SET_PERI_REG_MASK(SLC_CONF0, 1 << SLC_MODE_S);
+  SET_PERI_REG_MASK(SLC_RX_DSCR_CONF, SLC_INFOR_NO_REPLACE | SLC_TOKEN_NO_REPLACE);
+  CLEAR_PERI_REG_MASK(SLC_RX_DSCR_CONF, SLC_RX_FILL_EN | SLC_RX_EOF_MODE | SLC_RX_FILL_MODE);
+
+  ETS_SLC_INTR_ATTACH(drv_i2s_slc_isr, NULL);
+  WRITE_PERI_REG(SLC_INT_ENA, SLC_RX_EOF_INT_ENA);
+  ETS_SLC_INTR_ENABLE();
+
+  // Route the I2S outputs to their pins and enable the I2S clock
+  PIN_FUNC_SELECT(PERIPHS_IO_MUX_U0RXD_U, FUNC_I2SO_DATA);
+  PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTDO_U, FUNC_I2SO_BCK);
+  PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO2_U, FUNC_I2SO_WS);
+  rom_i2c_writeReg_Mask(i2c_bbpll, i2c_bbpll_hostid, i2c_bbpll_en_audio_clock_out,
+                        i2c_bbpll_en_audio_clock_out_msb, i2c_bbpll_en_audio_clock_out_lsb, 1);
+
+  WRITE_PERI_REG(I2SINT_CLR, I2S_I2S_INT_MASK);
+  WRITE_PERI_REG(I2SINT_ENA, 0);
+  CLEAR_PERI_REG_MASK(I2SCONF, I2S_I2S_RESET_MASK);
+  SET_PERI_REG_MASK(I2SCONF, I2S_I2S_RESET_MASK);
+  CLEAR_PERI_REG_MASK(I2SCONF, I2S_I2S_RESET_MASK);
+
+  // DMA mode, 16 bit dual channel, MSB first, I2S master
+  CLEAR_PERI_REG_MASK(I2S_FIFO_CONF, I2S_I2S_DSCR_EN |
+      (I2S_I2S_TX_FIFO_MOD << I2S_I2S_TX_FIFO_MOD_S) | (I2S_I2S_RX_FIFO_MOD << I2S_I2S_RX_FIFO_MOD_S));
+  SET_PERI_REG_MASK(I2S_FIFO_CONF, I2S_I2S_DSCR_EN);
+  CLEAR_PERI_REG_MASK(I2SCONF_CHAN, (I2S_TX_CHAN_MOD << I2S_TX_CHAN_MOD_S) | (I2S_RX_CHAN_MOD << I2S_RX_CHAN_MOD_S));
+  CLEAR_PERI_REG_MASK(I2SCONF, I2S_TRANS_SLAVE_MOD | I2S_RECE_SLAVE_MOD | (I2S_BITS_MOD << I2S_BITS_MOD_S));
+  SET_PERI_REG_MASK(I2SCONF, I2S_RIGHT_FIRST | I2S_MSB_RIGHT | I2S_RECE_MSB_SHIFT | I2S_TRANS_MSB_SHIFT);
+
+  return TRUE;
+}
+
+static uint8_t drv_i2s_fail( cfg_t *cfg )
+{
+  return FALSE;
+}
+
+const drv_t pcm_drv_i2s = {
+  .init   = drv_i2s_init,
+  .close  = drv_i2s_close,
+  .play   = drv_i2s_play,
+  .record = drv_i2s_fail,
+  .stop   = drv_i2s_stop
+};
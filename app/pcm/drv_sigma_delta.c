@@ -15,48 +15,11 @@ static const os_param_t drv_sd_hw_timer_owner = 0x70636D;   // "pcm"
 static void ICACHE_RAM_ATTR drv_sd_timer_isr( os_param_t arg )
 {
   cfg_t *cfg = (cfg_t *)arg;
-  pcm_buf_t *buf = &(cfg->bufs[cfg->rbuf_idx]);
+  uint8_t sample;
 
-  if (cfg->isr_throttled) {
-    return;
+  if (pcm_isr_sample( cfg, &sample )) {
+    platform_sigma_delta_set_target( sample );
   }
-
-  if (!buf->empty) {
-    uint16_t tmp;
-    // buffer is not empty, continue reading
-
-    tmp = abs((int16_t)(buf->data[buf->rpos]) - 128);
-    if (tmp > cfg->vu_peak_tmp) {
-      cfg->vu_peak_tmp = tmp;
-    }
-    cfg->vu_samples_tmp++;
-    if (cfg->vu_samples_tmp >= cfg->vu_req_samples) {
-      cfg->vu_peak = cfg->vu_peak_tmp;
-
-      task_post_low( pcm_data_vu_task, (os_param_t)cfg );
-
-      cfg->vu_samples_tmp = 0;
-      cfg->vu_peak_tmp    = 0;
-    }
-
-    platform_sigma_delta_set_target( buf->data[buf->rpos++] );
-    if (buf->rpos >= buf->len) {
-      // buffer data consumed, request to re-fill it
-      buf->empty = TRUE;
-      cfg->fbuf_idx = cfg->rbuf_idx;
-      task_post_high( pcm_data_play_task, (os_param_t)cfg );
-      // switch to next buffer
-      cfg->rbuf_idx ^= 1;
-      dbg_platform_gpio_write( PLATFORM_GPIO_LOW );
-    }
-  } else {
-    // flag ISR throttled
-    cfg->isr_throttled = 1;
-    dbg_platform_gpio_write( PLATFORM_GPIO_LOW );
-    cfg->fbuf_idx = cfg->rbuf_idx;
-    task_post_high( pcm_data_play_task, (os_param_t)cfg );
-  }
-
 }
 
 static uint8_t drv_sd_stop( cfg_t *cfg )
@@ -87,6 +50,7 @@ static uint8_t drv_sd_play( cfg_t *cfg )
   // (re)start hardware timer ISR to feed the sigma-delta
   if (platform_hw_timer_init( drv_sd_hw_timer_owner, FRC1_SOURCE, TRUE )) {
     platform_hw_timer_set_func( drv_sd_hw_timer_owner, drv_sd_timer_isr, (os_param_t)cfg );
+    platform_hw_timer_set_priority(drv_sd_hw_timer_owner, 100, "pcm");
     platform_hw_timer_arm_us( drv_sd_hw_timer_owner, pcm_rate_def[cfg->rate] );
 
     return TRUE;
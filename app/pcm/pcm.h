@@ -6,6 +6,7 @@
 
 #include "task/task.h"
 #include "platform.h"
+#include "lua.h"
 
 
 //#define DEBUG_PIN 2
@@ -23,9 +24,23 @@
 
 enum pcm_driver_index {
   PCM_DRIVER_SD  = 0,
-  PCM_DRIVER_END = 1
+  PCM_DRIVER_I2S = 1,
+  PCM_DRIVER_END = 2
 };
 
+// where the play buffers are filled from
+enum pcm_source {
+  PCM_SRC_LUA    = 0,   // the 'data' callback
+  PCM_SRC_FILE   = 1,
+  PCM_SRC_SOCKET = 2
+};
+
+// number of play buffers in the ring
+#define PCM_DEPTH_DEFAULT 2
+#define PCM_DEPTH_MAX     8
+// size of each play buffer for the C sources
+#define PCM_CHUNK_DEFAULT 512
+
 enum pcm_rate_index {
   PCM_RATE_1K  = 0,
   PCM_RATE_2K  = 1,
@@ -61,20 +76,33 @@ typedef struct {
   //    1 = ISR throttled
   //    0 = all running
   sint8_t isr_throttled;
-  // buffer selectors
+  // buffer selectors, the filled buffers run from rbuf_idx up to fbuf_idx
   uint8_t rbuf_idx;   // read by ISR
   uint8_t fbuf_idx;   // fill by data task
+  uint8_t nbufs;      // depth of the ring
   // callback fn refs
   int self_ref;
     int cb_data_ref, cb_drained_ref, cb_paused_ref, cb_stopped_ref, cb_vu_ref;
   // data buffers
-  pcm_buf_t bufs[2];
+  pcm_buf_t bufs[PCM_DEPTH_MAX];
+  // data source
+  uint8_t src;
+  uint8_t src_eof;
+  uint8_t src_fd_owned;
+  int src_fd;
+  int src_ref;        // the file object or socket
+  void *src_sock;
+  struct pbuf *src_pbuf;   // received and not yet copied, from src_off
+  uint16_t src_off;
+  size_t chunk;
   // vu measuring
   uint8_t  vu_freq;
   uint16_t vu_req_samples, vu_samples_tmp;
   uint16_t vu_peak_tmp, vu_peak;
   // sigma-delta: output pin
   int pin;
+  // i2s: times each sample is output, for the rates below the divider range
+  uint8_t i2s_repeat;
 } cfg_t;
 
 typedef uint8_t (*drv_fn_t)(cfg_t *);
@@ -96,6 +124,9 @@ typedef struct {
 
 void pcm_data_vu( task_param_t param, uint8 prio );
 void pcm_data_play( task_param_t param, uint8 prio );
+uint8_t pcm_isr_sample( cfg_t *cfg, uint8_t *sample );
+void *pcm_socket_attach( lua_State *L, cfg_t *cfg, int ndx );
+void pcm_source_close( cfg_t *cfg );
 
 // task handles
 extern task_handle_t pcm_data_vu_task, pcm_data_play_task, pcm_start_play_task;
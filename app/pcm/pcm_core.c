@@ -3,8 +3,12 @@
 
   pcm_data_play_task()
     Triggered by the driver ISR when further data for play mode is required.
-    It handles the play buffer allocation and forwards control to 'data' and 'drained'
-    callbacks in Lua land.
+    It handles the play buffer allocation and refills the ring of play buffers,
+    either through the 'data' callback in Lua land or straight from a file or
+    a TCP socket, and fires the 'drained' callback.
+
+  pcm_isr_sample()
+    Called by the driver ISR for each sample to play.
 
   pcm_data_rec_task() - n/a yet
     Triggered by the driver ISR when data for record mode is available.
@@ -13,11 +17,17 @@
 
 #include "lauxlib.h"
 #include "task/task.h"
+#include "vfs.h"
+#include "lwip/pbuf.h"
 #include <string.h>
 #include <stdlib.h>
 
 #include "pcm.h"
 
+extern void *net_sink_attach( lua_State *L, int ndx, void (*fn)(void *, struct pbuf *), void *arg );
+extern void net_sink_recved( void *sock, u16_t len );
+extern void net_sink_detach( void *sock );
+
 static int dispatch_callback( lua_State *L, int self_ref, int cb_ref, int returns )
 {
   if (cb_ref != LUA_NOREF) {
@@ -41,69 +51,227 @@ void pcm_data_vu( task_param_t param, uint8 prio )
   }
 }
 
-void pcm_data_play( task_param_t param, uint8 prio )
+uint8_t ICACHE_RAM_ATTR pcm_isr_sample( cfg_t *cfg, uint8_t *sample )
 {
-  cfg_t *cfg = (cfg_t *)param;
-  pcm_buf_t *buf = &(cfg->bufs[cfg->fbuf_idx]);
-  size_t string_len;
-  const char *data = NULL;
-  uint8_t need_pop = FALSE;
-  lua_State *L = lua_getstate();
+  pcm_buf_t *buf = &(cfg->bufs[cfg->rbuf_idx]);
 
-  // retrieve new data from callback
-  if ((cfg->isr_throttled >= 0) &&
-      (cfg->cb_data_ref != LUA_NOREF)) {
-    if(dispatch_callback( L, cfg->self_ref, cfg->cb_data_ref, 1 ) != LUA_OK)
-      return;
-    need_pop = TRUE;
+  if (cfg->isr_throttled) {
+    return FALSE;
+  }
 
-    if (lua_type( L, -1 ) == LUA_TSTRING) {
-      data = lua_tolstring( L, -1, &string_len );
-      if (string_len > buf->buf_size) {
-        uint8_t *new_data = (uint8_t *) malloc( string_len );
-        if (new_data) {
-          if (buf->data) free( buf->data );
-          buf->buf_size = string_len;
-          buf->data = new_data;
-        }
+  if (buf->empty) {
+    // flag ISR throttled
+    cfg->isr_throttled = 1;
+    dbg_platform_gpio_write( PLATFORM_GPIO_LOW );
+    task_post_high( pcm_data_play_task, (os_param_t)cfg );
+    return FALSE;
+  }
+
+  // buffer is not empty, continue reading
+  uint8_t s = buf->data[buf->rpos++];
+  uint16_t tmp = abs((int16_t)s - 128);
+  if (tmp > cfg->vu_peak_tmp) {
+    cfg->vu_peak_tmp = tmp;
+  }
+  cfg->vu_samples_tmp++;
+  if (cfg->vu_samples_tmp >= cfg->vu_req_samples) {
+    cfg->vu_peak = cfg->vu_peak_tmp;
+
+    task_post_low( pcm_data_vu_task, (os_param_t)cfg );
+
+    cfg->vu_samples_tmp = 0;
+    cfg->vu_peak_tmp    = 0;
+  }
+
+  if (buf->rpos >= buf->len) {
+    // buffer data consumed, request to re-fill it and switch to the next
+    buf->empty = TRUE;
+    task_post_high( pcm_data_play_task, (os_param_t)cfg );
+    if (++cfg->rbuf_idx >= cfg->nbufs) {
+      cfg->rbuf_idx = 0;
+    }
+    dbg_platform_gpio_write( PLATFORM_GPIO_LOW );
+  }
+
+  *sample = s;
+  return TRUE;
+}
+
+// Makes sure that the buffer holds at least size bytes
+static uint8_t alloc_buf( pcm_buf_t *buf, size_t size )
+{
+  if (size > buf->buf_size) {
+    uint8_t *new_data = (uint8_t *) malloc( size );
+    if (!new_data) {
+      return FALSE;
+    }
+    if (buf->data) free( buf->data );
+    buf->buf_size = size;
+    buf->data = new_data;
+  }
+  return TRUE;
+}
+
+// Copies the received data queued by the socket sink
+static size_t read_socket( cfg_t *cfg, uint8_t *data, size_t len )
+{
+  size_t got = 0;
+
+  while (cfg->src_pbuf && got < len) {
+    struct pbuf *p = cfg->src_pbuf;
+    size_t n = p->len - cfg->src_off;
+    if (n > len - got) {
+      n = len - got;
+    }
+    memcpy( data + got, (uint8_t *)p->payload + cfg->src_off, n );
+    got += n;
+    cfg->src_off += n;
+    if (cfg->src_off >= p->len) {
+      // done with the head of the chain
+      cfg->src_pbuf = p->next;
+      if (p->next) {
+        pbuf_ref( p->next );
       }
+      pbuf_free( p );
+      cfg->src_off = 0;
     }
   }
+  net_sink_recved( cfg->src_sock, got );
+  return got;
+}
 
-  if (data) {
-    size_t to_copy = string_len > buf->buf_size ? buf->buf_size : string_len;
-    memcpy( buf->data, data, to_copy );
+// Refills a buffer from the source. Returns 1 if it was filled, 0 if there
+// is no data for now and -1 if the data callback failed.
+static int fill_buf( lua_State *L, cfg_t *cfg, pcm_buf_t *buf )
+{
+  size_t len = 0;
+
+  if (cfg->src == PCM_SRC_LUA) {
+    const char *data;
 
-    buf->rpos  = 0;
-    buf->len   = to_copy;
-    buf->empty = FALSE;
-    dbg_platform_gpio_write( PLATFORM_GPIO_HIGH );
+    if (cfg->cb_data_ref == LUA_NOREF) {
+      return 0;
+    }
+    if (dispatch_callback( L, cfg->self_ref, cfg->cb_data_ref, 1 ) != LUA_OK) {
+      return -1;
+    }
+    if (lua_type( L, -1 ) == LUA_TSTRING) {
+      data = lua_tolstring( L, -1, &len );
+      alloc_buf( buf, len );
+      if (len > buf->buf_size) {
+        len = buf->buf_size;
+      }
+      memcpy( buf->data, data, len );
+    }
     lua_pop( L, 1 );
+  } else if (alloc_buf( buf, cfg->chunk )) {
+    if (cfg->src == PCM_SRC_FILE) {
+      sint32_t got = cfg->src_eof ? 0 : vfs_read( cfg->src_fd, buf->data, cfg->chunk );
+      if (got <= 0) {
+        cfg->src_eof = TRUE;
+      } else {
+        len = got;
+      }
+    } else {
+      len = read_socket( cfg, buf->data, cfg->chunk );
+    }
+  }
 
-    if (cfg->isr_throttled > 0) {
-      uint8_t other_buf = cfg->fbuf_idx ^ 1;
+  if (len == 0) {
+    return 0;
+  }
+  buf->rpos  = 0;
+  buf->len   = len;
+  buf->empty = FALSE;
+  return 1;
+}
 
-      if (cfg->bufs[other_buf].empty) {
-        // rerun data callback to get next buffer chunk
-        dbg_platform_gpio_write( PLATFORM_GPIO_LOW );
-        cfg->fbuf_idx = other_buf;
-        pcm_data_play( param, 0 );
-      }
-      // unthrottle ISR
-      cfg->isr_throttled = 0;
+void pcm_data_play( task_param_t param, uint8 prio )
+{
+  cfg_t *cfg = (cfg_t *)param;
+  lua_State *L = lua_getstate();
+  uint8_t filled = FALSE;
+
+  if (cfg->isr_throttled < 0) {
+    return;
+  }
+
+  // refill all the empty buffers of the ring, in the order they are played
+  while (cfg->bufs[cfg->fbuf_idx].empty) {
+    int rc = fill_buf( L, cfg, &(cfg->bufs[cfg->fbuf_idx]) );
+    if (rc < 0) {
+      return;
     }
-  } else {
-    dbg_platform_gpio_write( PLATFORM_GPIO_HIGH );
-    if (need_pop) lua_pop( L, 1 );
+    if (rc == 0) {
+      break;
+    }
+    filled = TRUE;
+    if (++cfg->fbuf_idx >= cfg->nbufs) {
+      cfg->fbuf_idx = 0;
+    }
+  }
+  dbg_platform_gpio_write( PLATFORM_GPIO_HIGH );
 
-    if (cfg->isr_throttled > 0) {
+  if (cfg->isr_throttled > 0) {
+    if (filled) {
+      // unthrottle ISR
+      cfg->isr_throttled = 0;
+    } else if (cfg->src != PCM_SRC_SOCKET || cfg->src_eof) {
       // ISR found no further data
       // this was the last invocation of the reader task, fire drained cb
+      // A socket which is still open just waits for the next data instead.
 
       cfg->isr_throttled = -1;
 
       dispatch_callback( L, cfg->self_ref, cfg->cb_drained_ref, 0 );
     }
   }
+}
+
+// Called by the socket for each chain of received data
+static void pcm_socket_sink( void *arg, struct pbuf *p )
+{
+  cfg_t *cfg = (cfg_t *)arg;
+
+  if (!p) {
+    cfg->src_eof = TRUE;
+  } else if (cfg->src_pbuf) {
+    pbuf_cat( cfg->src_pbuf, p );
+  } else {
+    cfg->src_pbuf = p;
+    cfg->src_off = 0;
+  }
+  // catch up if the ISR has run out
+  task_post_high( pcm_data_play_task, (os_param_t)cfg );
+}
+
+void *pcm_socket_attach( lua_State *L, cfg_t *cfg, int ndx )
+{
+  return net_sink_attach( L, ndx, pcm_socket_sink, cfg );
+}
+
+// Releases the file or socket, and returns to the data callback
+void pcm_source_close( cfg_t *cfg )
+{
+  lua_State *L = lua_getstate();
 
+  if (cfg->src == PCM_SRC_FILE && cfg->src_fd_owned) {
+    vfs_close( cfg->src_fd );
+  }
+  if (cfg->src == PCM_SRC_SOCKET) {
+    if (!cfg->src_eof) {
+      net_sink_detach( cfg->src_sock );
+    }
+    if (cfg->src_pbuf) {
+      net_sink_recved( cfg->src_sock, cfg->src_pbuf->tot_len - cfg->src_off );
+      pbuf_free( cfg->src_pbuf );
+      cfg->src_pbuf = NULL;
+    }
+  }
+  luaL_unref( L, LUA_REGISTRYINDEX, cfg->src_ref );
+  cfg->src_ref = LUA_NOREF;
+  cfg->src = PCM_SRC_LUA;
+  cfg->src_fd = 0;
+  cfg->src_sock = NULL;
+  cfg->src_eof = FALSE;
 }
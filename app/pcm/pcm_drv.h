@@ -4,6 +4,7 @@
 
 
 extern const drv_t pcm_drv_sd;
+extern const drv_t pcm_drv_i2s;
 
 
 #endif /* _PCM_DRV_H */
@@ -92,18 +92,18 @@ uint32_t platform_flash_write( const void *from, uint32_t toaddr, uint32_t size
 #else // #ifindef INTERNAL_FLASH_WRITE_UNIT_SIZE
   uint32_t temp, rest, ssize = size;
   unsigned i;
-  char tmpdata[ INTERNAL_FLASH_WRITE_UNIT_SIZE ];
+  char tmpdata[ INTERNAL_FLASH_WRITE_UNIT_SIZE ] __attribute__ ((aligned(INTERNAL_FLASH_WRITE_UNIT_SIZE)));
   const uint8_t *pfrom = ( const uint8_t* )from;
   const uint32_t blksize = INTERNAL_FLASH_WRITE_UNIT_SIZE;
   const uint32_t blkmask = INTERNAL_FLASH_WRITE_UNIT_SIZE - 1;
 
-  // Align the start
+  // Align the start. Programming can only clear bits, so the bytes of the
+  // unit outside the write are padded with 0xff rather than read back
   if( toaddr & blkmask )
   {
     rest = toaddr & blkmask;
     temp = toaddr & ~blkmask; // this is the actual aligned address
-    // memcpy( tmpdata, ( const void* )temp, blksize );
-    platform_s_flash_read( tmpdata, temp, blksize );
+    memset( tmpdata, 0xff, blksize );
     for( i = rest; size && ( i < blksize ); i ++, size --, pfrom ++ )
       tmpdata[ i ] = *pfrom;
     platform_s_flash_write( tmpdata, temp, blksize );
@@ -125,8 +125,7 @@ uint32_t platform_flash_write( const void *from, uint32_t toaddr, uint32_t size
   // And the final part of a block if needed
   if( rest )
   {
-    // memcpy( tmpdata, ( const void* )toaddr, blksize );
-    platform_s_flash_read( tmpdata, toaddr, blksize );
+    memset( tmpdata, 0xff, blksize );
     for( i = 0; size && ( i < rest ); i ++, size --, pfrom ++ )
       tmpdata[ i ] = *pfrom;
     platform_s_flash_write( tmpdata, toaddr, blksize );
@@ -6,8 +6,10 @@
 #include "user_config.h"
 #include "flash_api.h"
 #include "spi_flash.h"
+#include "platform.h"
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 
 uint32_t flash_detect_size_byte(void)
 {
@@ -160,6 +162,82 @@ uint32_t flash_rom_get_speed(void)
     return speed;
 }
 
+bool flash_rom_set_mode_speed(uint8_t mode, uint8_t speed)
+{
+    // Rewrites the header of the boot image, which takes effect on the next
+    // reset.  The sector is erased and written back, so a power loss in
+    // between leaves the module needing to be reflashed.
+    if ((mode != MODE_QIO && mode != MODE_QOUT && mode != MODE_DIO && mode != MODE_DOUT) ||
+        (speed != SPEED_40MHZ && speed != SPEED_26MHZ && speed != SPEED_20MHZ && speed != SPEED_80MHZ))
+        return false;
+
+    uint32_t *data = (uint32_t *) malloc(SPI_FLASH_SEC_SIZE);
+    if (!data)
+        return false;
+    bool ok = false;
+    if (SPI_FLASH_RESULT_OK == spi_flash_read(0, data, SPI_FLASH_SEC_SIZE))
+    {
+        SPIFlashInfo *info = (SPIFlashInfo *) data;
+        if (info->mode == mode && info->speed == speed)
+        {
+            ok = true;
+        }
+        else
+        {
+            info->mode = mode;
+            info->speed = speed;
+            ok = SPI_FLASH_RESULT_OK == spi_flash_erase_sector(0) &&
+                 SPI_FLASH_RESULT_OK == spi_flash_write(0, data, SPI_FLASH_SEC_SIZE);
+            if (ok)
+                memcpy(&spi_flash_info, info, sizeof(spi_flash_info));
+        }
+    }
+    free(data);
+    return ok;
+}
+
+// Region of mapped flash read by the benchmark, twice the size of the cache
+#define BENCH_BYTES  (64 * 1024)
+#define BENCH_STRIDE 64
+extern uint32_t _irom0_text_start[];
+
+static uint32_t NO_INTR_CODE bench_read(const volatile uint32_t *p, uint32_t n,
+                                        uint32_t step, uint32_t *sum)
+{
+    uint32_t s = 0, t0, t1;
+    t0 = CCOUNT_REG;
+    for (uint32_t i = 0; i < n; i += step)
+        s += p[i];
+    t1 = CCOUNT_REG;
+    *sum += s;
+    return t1 - t0;
+}
+
+void flash_rom_benchmark(uint32_t *read_rate, uint32_t *miss_ns)
+{
+    // Measures cached reads of the mapped flash: whole cache lines read
+    // word by word for the throughput that code and LFS constants see, and a
+    // word from every line against a word that stays in the cache for the
+    // cost of a miss.  The timed loops run from IRAM with interrupts off.
+    const volatile uint32_t *p = _irom0_text_start;
+    uint32_t n = BENCH_BYTES / 4, lines = BENCH_BYTES / BENCH_STRIDE;
+    uint32_t sum = 0, seq, miss, hit, mhz = system_get_cpu_freq();
+
+    ets_intr_lock();
+    bench_read(p + n, n, 1, &sum);          // evict the region from the cache
+    seq = bench_read(p, n, 1, &sum);
+    bench_read(p + n, n, 1, &sum);
+    miss = bench_read(p, n, BENCH_STRIDE / 4, &sum);
+    bench_read(p, lines, 1, &sum);
+    hit = bench_read(p, lines, 1, &sum);    // as many reads, all in the cache
+    ets_intr_unlock();
+
+    *read_rate = seq ? (uint32_t)((uint64_t)BENCH_BYTES * mhz * 1000000 / seq) : 0;
+    miss = miss > hit ? miss - hit : 0;
+    *miss_ns = miss * 1000 / (lines * mhz);
+    (void) sum;
+}
+
 uint8_t byte_of_aligned_array(const uint8_t *aligned_array, uint32_t index)
 {
     if ( (((uint32_t)aligned_array) % 4) != 0 )
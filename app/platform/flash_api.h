@@ -86,6 +86,8 @@ uint32_t flash_detect_size_byte(void);
 uint16_t flash_rom_get_sec_num(void);
 uint8_t flash_rom_get_mode(void);
 uint32_t flash_rom_get_speed(void);
+bool flash_rom_set_mode_speed(uint8_t mode, uint8_t speed);
+void flash_rom_benchmark(uint32_t *read_rate, uint32_t *miss_ns);
 uint8_t byte_of_aligned_array(const uint8_t* aligned_array, uint32_t index);
 uint16_t word_of_aligned_array(const uint16_t *aligned_array, uint32_t index);
 
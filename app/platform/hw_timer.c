@@ -15,6 +15,14 @@
 * e.g.   #define OWNER    ((os_param_t) module_init)
 * where module_init is a function. For builtin modules, it might be
 * a small numeric value that is known not to clash.
+*
+* Any number of owners share FRC1, each with its own one-shot or periodic
+* (autoload) schedule. When several owners are due in the same interrupt,
+* the one with the highest priority is called first. Owners may instead
+* share the NMI source, which is not masked by ets_intr_lock(), but all
+* the owners then have to ask for it, and their callbacks must be safe to
+* run in NMI context. Each owner keeps counts of its callbacks and of how
+* late they ran, see platform_hw_timer_get_stats().
 *******************************************************************************/
 #include "platform.h"
 #include <stdio.h>
@@ -51,15 +59,18 @@ typedef enum {			//timer interrupt mode
 typedef struct _timer_user {
   struct _timer_user *next;
   bool autoload;
+  bool open;
+  uint8_t priority;
   int32_t delay; // once on the active list, this is difference in delay from the preceding element
   int32_t autoload_delay;
   uint32_t expected_interrupt_time;
   os_param_t owner;
   os_param_t callback_arg;
   void (* user_hw_timer_cb)(os_param_t);
-#ifdef DEBUG_HW_TIMER
-  int cb_count;
-#endif
+  const char *name;
+  uint32_t fires;
+  uint32_t late;
+  uint32_t max_late;
 } timer_user;
 
 /*
@@ -77,14 +88,39 @@ static timer_user *inactive;
  * multiple LOCKs and then the same number of UNLOCKs are required to re-enable
  * interrupts. This is imolemeted by counting the number of times that lock is called.
  */
-static uint8_t lock_count;
+static volatile uint8_t lock_count;
 static uint8_t timer_running;
 
 static uint32_t time_next_expiry;
 static int32_t last_timer_load;
 
-#define LOCK()   do { ets_intr_lock(); lock_count++; } while (0)
-#define UNLOCK()   if (--lock_count == 0) ets_intr_unlock()
+/*
+ * The NMI cannot be masked, so when it is the source and arrives while the
+ * lists are locked, it only sets nmi_deferred. The interrupt is then handled
+ * by the UNLOCK that releases the lock, still with interrupts disabled.
+ * Within the NMI itself the intr lock calls must not be made at all.
+ */
+static volatile uint8_t in_nmi;
+static volatile uint8_t nmi_deferred;
+static uint8_t open_count;
+static uint8_t shared_source = FRC1_SOURCE;
+
+static void hw_timer_isr_cb(void *arg);
+
+#define LOCK()   do { if (!in_nmi) ets_intr_lock(); lock_count++; } while (0)
+#define UNLOCK() unlock()
+
+static void ICACHE_RAM_ATTR unlock(void) {
+  if (--lock_count == 0 && !in_nmi) {
+    while (nmi_deferred) {
+      nmi_deferred = 0;
+      lock_count++;
+      hw_timer_isr_cb(NULL);
+      lock_count--;
+    }
+    ets_intr_unlock();
+  }
+}
 
 /*
  * It is possible to reserve the timer exclusively, for one module alone.
@@ -108,8 +144,8 @@ void ICACHE_RAM_ATTR hw_timer_debug() {
   dbg_printf("timer_running=%d\n", timer_running);
   timer_user *tu;
   for (tu = active; tu; tu = tu->next) {
-    dbg_printf("Owner: 0x%x, delay=%d, autoload=%d, autoload_delay=%d, cb_count=%d\n",
-        tu->owner, tu->delay, tu->autoload, tu->autoload_delay, tu->cb_count);
+    dbg_printf("Owner: 0x%x, delay=%d, autoload=%d, autoload_delay=%d, fires=%d\n",
+        tu->owner, tu->delay, tu->autoload, tu->autoload_delay, tu->fires);
   }
 }
 #endif
@@ -129,9 +165,24 @@ static void ICACHE_RAM_ATTR set_timer(int delay, const char *caller) {
   time_next_expiry = time_next_expiry - time_left + delay;
   last_timer_load = delay;
 
+  // An NMI deferred before the reload was for the old count, and the new
+  // one raises its own
+  nmi_deferred = 0;
   timer_running = 1;
 }
 
+/*
+ * The current time on the same scale as expected_interrupt_time.
+ */
+static int32_t ICACHE_RAM_ATTR time_now(void) {
+  int32_t time_left = (RTC_REG_READ(FRC1_COUNT_ADDRESS)) & ((1 << 23) - 1);
+  if (time_left > last_timer_load) {
+    // We have missed the interrupt
+    time_left -= 1 << 23;
+  }
+  return time_next_expiry - time_left;
+}
+
 static void ICACHE_RAM_ATTR adjust_root() {
   // Can only ge called with interrupts disabled
   // change the initial active delay so that relative stuff still works
@@ -255,8 +306,10 @@ static void ICACHE_RAM_ATTR insert_active_tu(timer_user *tu) {
 
   tu->expected_interrupt_time = time_next_expiry - last_timer_load + tu->delay;
 
+  // Owners due at the same time are kept in priority order
   for (p = &active; *p; p = &((*p)->next)) {
-    if ((*p)->delay >= tu->delay) {
+    if ((*p)->delay > tu->delay ||
+        ((*p)->delay == tu->delay && (*p)->priority <= tu->priority)) {
       break;
     }
     tu->delay -= (*p)->delay;
@@ -348,9 +401,10 @@ bool platform_hw_timer_set_func(os_param_t owner, void (* user_hw_timer_cb_set)(
 /*
  * This is the timer ISR. It has to find the timer that was running and trigger the callback
  * for that timer. By this stage, the next timer may have expired as well, and so the process
- * iterates. Note that if there is an autoload timer, then it should be restarted immediately.
- * Also, the callbacks typically do re-arm the timer, so we have to be careful not to
- * assume that nothing changes during the callback.
+ * iterates, calling the highest priority of the timers which are due first. Note that if there
+ * is an autoload timer, then it should be restarted immediately. Also, the callbacks typically
+ * do re-arm the timer, so we have to be careful not to assume that nothing changes during the
+ * callback.
  */
 static void ICACHE_RAM_ATTR hw_timer_isr_cb(void *arg)
 {
@@ -359,31 +413,40 @@ static void ICACHE_RAM_ATTR hw_timer_isr_cb(void *arg)
   timer_running = 0;
 
   while (keep_going && active) {
-    keep_going = false;
+    timer_user **best = &active, **p;
+    int32_t due = active->delay;
+
+    for (p = &active->next; *p && (due += (*p)->delay) <= 0; p = &((*p)->next)) {
+      if ((*p)->priority > (*best)->priority) {
+        best = p;
+      }
+    }
 
-    timer_user *fired = active;
-    active = fired->next;
+    timer_user *fired = *best;
+    uint32_t expected = fired->expected_interrupt_time;
+    *best = fired->next;
+    if (fired->next) {
+      fired->next->delay += fired->delay;
+    }
     if (fired->autoload) {
       fired->expected_interrupt_time += fired->autoload_delay;
       fired->delay = fired->expected_interrupt_time - (time_next_expiry - last_timer_load);
       insert_active_tu(fired);
-      if (active->delay <= 0) {
-        keep_going = true;
-      }
     } else {
       fired->next = inactive;
       inactive = fired;
-      if (active) {
-        active->delay += fired->delay;
-        if (active->delay <= 0) {
-          keep_going = true;
-        }
-      }
     }
+    keep_going = active && active->delay <= 0;
+
     if (fired->user_hw_timer_cb) {
-#ifdef DEBUG_HW_TIMER
-      fired->cb_count++;
-#endif
+      int32_t late = time_now() - expected;
+      fired->fires++;
+      if (late > HW_TIMER_LATE_TICKS) {
+        fired->late++;
+      }
+      if (late > (int32_t) fired->max_late) {
+        fired->max_late = late;
+      }
       NODE_DBG("CB(%x): %x, %x\n", fired->owner, fired->user_hw_timer_cb, fired->callback_arg);
       (*(fired->user_hw_timer_cb))(fired->callback_arg);
     }
@@ -395,7 +458,13 @@ static void ICACHE_RAM_ATTR hw_timer_isr_cb(void *arg)
 
 static void ICACHE_RAM_ATTR hw_timer_nmi_cb(void)
 {
+  if (lock_count) {
+    nmi_deferred = 1;
+    return;
+  }
+  in_nmi = 1;
   hw_timer_isr_cb(NULL);
+  in_nmi = 0;
 }
 
 /******************************************************************************
@@ -415,8 +484,8 @@ uint32_t ICACHE_RAM_ATTR platform_hw_timer_get_delay_ticks(os_param_t owner)
 
   LOCK();
   adjust_root();
-  UNLOCK();
   int ret = (time_next_expiry - last_timer_load) - tu->expected_interrupt_time;
+  UNLOCK();
 
   if (ret < 0) {
     NODE_DBG("delay ticks = %d, last_timer_load=%d, tu->expected_int=%d, next_exp=%d\n", ret, last_timer_load, tu->expected_interrupt_time, time_next_expiry);
@@ -435,13 +504,21 @@ uint32_t ICACHE_RAM_ATTR platform_hw_timer_get_delay_ticks(os_param_t owner)
 * bool autoload:
 *                         0,  not autoload,
 *                         1,  autoload mode,
-* Returns      : true if it worked
+* Returns      : true if it worked, false if the timer is in use with the other source.
+*                Once the NMI source has been used, it stays routed to the NMI until
+*                restart, so the FRC1 source is no longer available.
 *******************************************************************************/
 bool platform_hw_timer_init(os_param_t owner, FRC1_TIMER_SOURCE_TYPE source_type, bool autoload)
 {
   if (reserved_exclusively) return false;
 
-  timer_user *tu = find_tu_and_remove(owner);
+  timer_user *tu = find_tu(owner);
+  if ((open_count > (tu && tu->open) || shared_source == NMI_SOURCE) &&
+      source_type != shared_source) {
+    return false;
+  }
+
+  tu = find_tu_and_remove(owner);
 
   if (!tu) {
     tu = (timer_user *) malloc(sizeof(*tu));
@@ -454,16 +531,25 @@ bool platform_hw_timer_init(os_param_t owner, FRC1_TIMER_SOURCE_TYPE source_type
 
   tu->autoload = autoload;
 
-  if (!active && !inactive) {
+  if (!open_count) {
     RTC_REG_WRITE(FRC1_CTRL_ADDRESS,
 		  DIVIDED_BY_16 | FRC1_ENABLE_TIMER | TM_EDGE_INT);
-    ETS_FRC_TIMER1_INTR_ATTACH(hw_timer_isr_cb, NULL);
+    if (source_type == NMI_SOURCE) {
+      ETS_FRC_TIMER1_NMI_INTR_ATTACH(hw_timer_nmi_cb);
+    } else {
+      ETS_FRC_TIMER1_INTR_ATTACH(hw_timer_isr_cb, NULL);
+    }
+    shared_source = source_type;
 
     TM1_EDGE_INT_ENABLE();
     ETS_FRC1_INTR_ENABLE();
   }
 
   LOCK();
+  if (!tu->open) {
+    tu->open = true;
+    open_count++;
+  }
   tu->next = inactive;
   inactive = tu;
   UNLOCK();
@@ -483,19 +569,19 @@ bool ICACHE_RAM_ATTR platform_hw_timer_close(os_param_t owner)
 
   timer_user *tu = find_tu_and_remove(owner);
 
+  LOCK();
   if (tu) {
-    if (tu == inactive) {
-      inactive == NULL;
-    } else {
-      LOCK();
-      tu->next = inactive;
-      inactive = tu;
-      UNLOCK();
+    tu->next = inactive;
+    inactive = tu;
+    if (tu->open) {
+      tu->open = false;
+      open_count--;
     }
   }
+  bool last = !open_count;
+  UNLOCK();
 
-  // This will never actually run....
-  if (!active && !inactive) {
+  if (last) {
     /* Set no reload mode */
     RTC_REG_WRITE(FRC1_CTRL_ADDRESS,
                   DIVIDED_BY_16 | TM_EDGE_INT);
@@ -507,6 +593,78 @@ bool ICACHE_RAM_ATTR platform_hw_timer_close(os_param_t owner)
   return true;
 }
 
+/******************************************************************************
+* FunctionName : platform_hw_timer_set_priority
+* Description  : set the priority of this owner, which decides the order of the
+*                callbacks when timers of several owners are due together.
+* Parameters   : os_param_t owner
+*                uint8_t priority: higher values are called first, the default is 0
+*                const char *name: a static name for the statistics, or NULL
+* Returns      : true if it worked
+*******************************************************************************/
+bool platform_hw_timer_set_priority(os_param_t owner, uint8_t priority, const char *name)
+{
+  if (reserved_exclusively) return false;
+
+  timer_user *tu = find_tu(owner);
+  if (!tu) {
+    return false;
+  }
+  tu->priority = priority;
+  if (name) {
+    tu->name = name;
+  }
+  return true;
+}
+
+/******************************************************************************
+* FunctionName : platform_hw_timer_get_stats
+* Description  : read the statistics of the index'th owner. Owners which have
+*                been closed keep their statistics.
+* Parameters   : uint32_t index
+*                hw_timer_stats_t *stats: filled in
+*                bool reset: clear the counters once they have been read
+* Returns      : true if there is such an owner
+*******************************************************************************/
+bool platform_hw_timer_get_stats(uint32_t index, hw_timer_stats_t *stats, bool reset)
+{
+  timer_user *tu = NULL;
+  int list;
+
+  LOCK();
+  for (list = 0; list < 2 && !tu; list++) {
+    for (tu = list ? active : inactive; tu && index; tu = tu->next) {
+      index--;
+    }
+  }
+  if (tu) {
+    stats->owner = tu->owner;
+    stats->name = tu->name;
+    stats->priority = tu->priority;
+    stats->open = tu->open;
+    stats->fires = tu->fires;
+    stats->late = tu->late;
+    stats->max_late = tu->max_late;
+    if (reset) {
+      tu->fires = tu->late = tu->max_late = 0;
+    }
+  }
+  UNLOCK();
+
+  return tu != NULL;
+}
+
+/******************************************************************************
+* FunctionName : platform_hw_timer_in_use
+* Description  : tells whether the timer is open for shared or exclusive use,
+*                which keeps the CPU from sleeping.
+* Returns      : true if any owner has it open
+*******************************************************************************/
+bool platform_hw_timer_in_use(void)
+{
+  return open_count > 0 || reserved_exclusively;
+}
+
 /******************************************************************************
 * FunctionName : platform_hw_timer_init_exclusive
 * Description  : initialize the hardware isr timer for exclusive use by the caller.
@@ -529,7 +687,7 @@ bool platform_hw_timer_init_exclusive(
   void (*nmi_timer_cb)(void)
   )
 {
-  if (active || inactive) return false;
+  if (open_count) return false;
   if (reserved_exclusively) return false;
   reserved_exclusively = true;
 
@@ -537,6 +695,7 @@ bool platform_hw_timer_init_exclusive(
 
   if (source_type == NMI_SOURCE) {
     ETS_FRC_TIMER1_NMI_INTR_ATTACH(nmi_timer_cb);
+    shared_source = NMI_SOURCE;   // the routing stays
   } else {
     ETS_FRC_TIMER1_INTR_ATTACH((void (*)(void *))frc1_timer_cb, (void*)arg);
   }
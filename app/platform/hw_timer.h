@@ -18,6 +18,21 @@ typedef enum {
     NMI_SOURCE = 1,
 } FRC1_TIMER_SOURCE_TYPE;
 
+// A callback which runs more than this many ticks after its time is counted as late
+#ifndef HW_TIMER_LATE_TICKS
+#define HW_TIMER_LATE_TICKS US_TO_RTC_TIMER_TICKS(10)
+#endif
+
+typedef struct {
+  os_param_t owner;
+  const char *name;
+  uint8_t priority;
+  bool open;
+  uint32_t fires;       // callbacks made
+  uint32_t late;        // callbacks made more than HW_TIMER_LATE_TICKS late
+  uint32_t max_late;    // ticks
+} hw_timer_stats_t;
+
 bool ICACHE_RAM_ATTR platform_hw_timer_arm_ticks(os_param_t owner, uint32_t ticks);
 
 bool ICACHE_RAM_ATTR platform_hw_timer_arm_us(os_param_t owner, uint32_t microseconds);
@@ -30,6 +45,12 @@ bool ICACHE_RAM_ATTR platform_hw_timer_close(os_param_t owner);
 
 uint32_t ICACHE_RAM_ATTR platform_hw_timer_get_delay_ticks(os_param_t owner);
 
+bool platform_hw_timer_set_priority(os_param_t owner, uint8_t priority, const char *name);
+
+bool platform_hw_timer_get_stats(uint32_t index, hw_timer_stats_t *stats, bool reset);
+
+bool platform_hw_timer_in_use(void);
+
 bool platform_hw_timer_init_exclusive(FRC1_TIMER_SOURCE_TYPE source_type, bool autoload, void (* frc1_timer_cb)(os_param_t), os_param_t arg, void (*nmi_timer_cb)(void) );
 
 bool ICACHE_RAM_ATTR platform_hw_timer_close_exclusive();
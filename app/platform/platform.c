@@ -13,12 +13,36 @@
 #include "driver/spi.h"
 #include "driver/uart.h"
 #include "driver/sigma_delta.h"
+#include "cpu_esp8266_irq.h"
+#include "pm/swtimer.h"
+#include "rom.h"
+#include "rtc/rtcaccess.h"
+#include "platform_trace.h"
 
 #define INTERRUPT_TYPE_IS_LEVEL(x)   ((x) >= GPIO_PIN_INTR_LOLEVEL)
 
+static int task_init_handler(void);
+
 #ifdef GPIO_INTERRUPT_ENABLE
 static platform_task_handle_t gpio_task_handle;
-static int task_init_handler(void);
+
+/*
+ * Optional per-pin single-producer / single-consumer ring of edge events.  The
+ * ISR is the only writer of head and dropped, and the consumer task is the only
+ * writer of tail.  A single task post is made per batch, with posted acting as
+ * the latch which stops the ISR posting further requests until it is drained.
+ */
+typedef struct {
+  volatile uint16_t head;
+  volatile uint16_t tail;
+  uint16_t mask;
+  volatile uint8_t posted;
+  volatile uint32_t dropped;
+  platform_task_handle_t task;
+  uint32_t ev[1];            /* (timestamp << 1) | level */
+} gpio_ring_t;
+
+static gpio_ring_t *gpio_ring[GPIO_PIN_NUM];
 
 #ifdef GPIO_INTERRUPT_HOOK_ENABLE
 struct gpio_hook_entry {
@@ -195,6 +219,26 @@ int platform_gpio_write( unsigned pin, unsigned level )
   GPIO_OUTPUT_SET(GPIO_ID_PIN(pin_num[pin]), level);
 }
 
+uint32_t platform_gpio_pin_bits( uint32_t pins )
+{
+  uint32_t bits = 0;
+  unsigned pin;
+  for (pin = 1; pin < NUM_GPIO; pin++)
+    if (pins & (1 << pin))
+      bits |= BIT(pin_num[pin]);
+  return bits;
+}
+
+void platform_gpio_write_mask( uint32_t set, uint32_t clear )
+{
+  GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, platform_gpio_pin_bits(set));
+  GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, platform_gpio_pin_bits(clear));
+  if ((set | clear) & 1) {
+    gpio16_output_conf();
+    gpio16_output_set(!(clear & 1));
+  }
+}
+
 int platform_gpio_read( unsigned pin )
 {
   // NODE_DBG("Function platform_gpio_read() is called. pin:%d\n",GPIO_ID_PIN(pin_num[pin]));
@@ -216,6 +260,7 @@ static void ICACHE_RAM_ATTR platform_gpio_intr_dispatcher (void *dummy){
   uint32_t gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
   uint32_t now = system_get_time();
   (void)(dummy);
+  PLATFORM_TRACE_EVENT(TRACE_GPIO_ISR, 0, gpio_status);
 
 #ifdef GPIO_INTERRUPT_HOOK_ENABLE
   if (gpio_status & platform_gpio_hook->all_bits) {
@@ -234,7 +279,26 @@ static void ICACHE_RAM_ATTR platform_gpio_intr_dispatcher (void *dummy){
    for (j = 0; gpio_status>0; j++, gpio_status >>= 1) {
     if (gpio_status&1) {
       int i = pin_num_inv[j];
-      if (pin_int_type[i]) {
+      if (pin_int_type[i] && gpio_ring[i]) {
+        gpio_ring_t *r = gpio_ring[i];
+        uint32_t level = 0x1 & GPIO_INPUT_GET(GPIO_ID_PIN(j));
+        uint16_t head = r->head, next = (head + 1) & r->mask;
+
+        if (INTERRUPT_TYPE_IS_LEVEL(pin_int_type[i])) {
+          gpio_pin_intr_state_set(GPIO_ID_PIN(j), GPIO_PIN_INTR_DISABLE);
+        }
+        GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, BIT(j));
+
+        if (next == r->tail) {
+          r->dropped++;
+        } else {
+          r->ev[head] = (now << 1) | level;
+          r->head = next;
+        }
+        // A failed post is retried on the next interrupt
+        if (!r->posted)
+          r->posted = platform_post_high(r->task, i);
+      } else if (pin_int_type[i]) {
         uint16_t diff = pin_counter[i].seen ^ pin_counter[i].reported;
 
         pin_counter[i].seen = 0x7fff & (pin_counter[i].seen + 1);
@@ -271,6 +335,72 @@ void platform_gpio_init( platform_task_handle_t gpio_task )
   ETS_GPIO_INTR_ATTACH(platform_gpio_intr_dispatcher, NULL);
 }
 
+/*
+ * Enable batched event capture for a pin using a ring of 2^n entries, where
+ * the size is rounded up to a power of 2.  A size of 0 releases the ring and
+ * restores the normal one-post-per-edge behaviour.  The ring is swapped with
+ * the GPIO interrupt disabled and any events left in an old ring are discarded.
+ */
+int platform_gpio_set_batch( unsigned pin, unsigned size, platform_task_handle_t task )
+{
+  gpio_ring_t *nr = NULL, *or;
+  unsigned n = 2;
+
+  if (!platform_gpio_exists(pin) || pin == 0 || size > PLATFORM_GPIO_BATCH_MAX)
+    return 0;
+  if (size) {
+    while (n < size)
+      n <<= 1;
+    nr = calloc(1, sizeof(gpio_ring_t) + (n-1)*sizeof(uint32_t));
+    if (!nr)
+      return 0;
+    nr->mask = n - 1;
+    nr->task = task;
+  }
+
+  ETS_GPIO_INTR_DISABLE();
+  or = gpio_ring[pin];
+  gpio_ring[pin] = nr;
+  ETS_GPIO_INTR_ENABLE();
+
+  free(or);
+  return 1;
+}
+
+/*
+ * Drain up to max events from the ring of a batched pin.  This must only be
+ * called from task level.  The posted latch is released before the ring is
+ * read so that any event arriving during the drain triggers a further post.
+ * The count of events dropped because the ring was full is returned and
+ * reset through dropped, if non-NULL.
+ */
+unsigned platform_gpio_get_batch( unsigned pin, uint32_t *ev, unsigned max, uint32_t *dropped )
+{
+  gpio_ring_t *r = platform_gpio_exists(pin) ? gpio_ring[pin] : NULL;
+  unsigned n = 0;
+
+  if (dropped)
+    *dropped = 0;
+  if (!r)
+    return 0;
+
+  r->posted = 0;
+  uint16_t tail = r->tail, head = r->head;
+  while (tail != head && n < max) {
+    ev[n++] = r->ev[tail];
+    tail = (tail + 1) & r->mask;
+  }
+  r->tail = tail;
+
+  if (dropped) {
+    ETS_GPIO_INTR_DISABLE();
+    *dropped = r->dropped;
+    r->dropped = 0;
+    ETS_GPIO_INTR_ENABLE();
+  }
+  return n;
+}
+
 #ifdef GPIO_INTERRUPT_HOOK_ENABLE
 /*
  * Register an ISR hook to be called from the GPIO ISR for a given GPIO bitmask.
@@ -753,6 +883,92 @@ int platform_i2c_recv_byte( unsigned id, int ack ){
   return i2c_master_readByte(id, ack);
 }
 
+/*
+ * Run a complete transfer in one call: write wlen bytes to the device, then
+ * read rlen bytes after a repeated start. With nothing to write only the read
+ * is done, and with nothing to read or write the device is just addressed.
+ * Returns 1 if the device acknowledged its address and every byte written.
+ */
+int platform_i2c_transfer( unsigned id, uint16_t address, const uint8_t *wdata, size_t wlen,
+                           uint8_t *rdata, size_t rlen ){
+  size_t i;
+  int ok = 1;
+
+  if (wlen || !rlen) {
+    i2c_master_start(id);
+    ok = platform_i2c_send_address(id, address, PLATFORM_I2C_DIRECTION_TRANSMITTER);
+    for (i = 0; ok && i < wlen; i++)
+      ok = i2c_master_writeByte(id, wdata[i]) == 1;
+  }
+  if (ok && rlen) {
+    i2c_master_start(id);
+    ok = platform_i2c_send_address(id, address, PLATFORM_I2C_DIRECTION_RECEIVER);
+    for (i = 0; ok && i < rlen; i++)
+      rdata[i] = i2c_master_readByte(id, i < rlen - 1);
+  }
+  i2c_master_stop(id);
+  return ok;
+}
+
+/*
+ * Non-blocking I2C jobs. The command of a job is written when it is submitted
+ * and its result is read once the conversion time has passed, from a timer
+ * that serves the pending job due soonest. So conversions on different
+ * devices run at the same time instead of one busy wait after another.
+ */
+static platform_i2c_job_t *i2c_jobs;   // waiting to be read, soonest first
+static os_timer_t i2c_job_timer;
+
+static void i2c_job_arm( void )
+{
+  os_timer_disarm( &i2c_job_timer );
+  if (i2c_jobs) {
+    int32_t wait = (int32_t)(i2c_jobs->due - system_get_time());
+    os_timer_arm( &i2c_job_timer, wait > 0 ? (wait + 999) / 1000 : 0, 0 );
+  }
+}
+
+static void i2c_job_run( void *arg )
+{
+  (void)arg;
+  while (i2c_jobs && (int32_t)(i2c_jobs->due - system_get_time()) <= 0) {
+    platform_i2c_job_t *job = i2c_jobs;
+    i2c_jobs = job->next;
+    if (job->ok && job->rlen)
+      job->ok = platform_i2c_transfer( job->id, job->address, NULL, 0, job->rdata, job->rlen );
+    // the callback may submit the job, or the next one, again
+    job->cb( job, job->ok );
+  }
+  i2c_job_arm();
+}
+
+int platform_i2c_submit( platform_i2c_job_t *job )
+{
+  static uint8_t timer_ready;
+  platform_i2c_job_t **p;
+
+  if (!platform_i2c_configured( job->id ) || !job->cb)
+    return PLATFORM_ERR;
+  if (!timer_ready) {
+    os_timer_setfn( &i2c_job_timer, i2c_job_run, NULL );
+    SWTIMER_REG_CB( i2c_job_run, SWTIMER_RESUME );
+    timer_ready = 1;
+  }
+
+  job->ok = 1;
+  if (job->wlen)
+    job->ok = platform_i2c_transfer( job->id, job->address, job->wdata, job->wlen, NULL, 0 );
+  // a failed job is reported at once, but never from inside this call
+  job->due = system_get_time() + (job->ok ? job->delay_us : 0);
+
+  for (p = &i2c_jobs; *p && (int32_t)((*p)->due - job->due) <= 0; p = &(*p)->next)
+    ;
+  job->next = *p;
+  *p = job;
+  i2c_job_arm();
+  return PLATFORM_OK;
+}
+
 // *****************************************************************************
 // SPI platform interface
 uint32_t platform_spi_setup( uint8_t id, int mode, unsigned cpol, unsigned cpha, uint32_t clock_div )
@@ -763,11 +979,130 @@ uint32_t platform_spi_setup( uint8_t id, int mode, unsigned cpol, unsigned cpha,
   return 1;
 }
 
+// Asynchronous block transfers on HSPI. The trans done interrupt starts each
+// 64 byte chunk as soon as the previous one has been clocked out. The SLC
+// DMA engine cannot feed the SPI master, so this is one interrupt per chunk.
+#define SPI_INT_STATUS   0x3ff00020
+#define SPI_INT_HSPI     BIT7
+
+static struct {
+  const uint8_t *mosi;          // data still to send, NULL to send 0xff
+  uint8_t *miso;                // where the next received chunk goes, or NULL
+  size_t len;                   // bytes not yet started
+  size_t chunk;                 // bytes in the chunk on the wire
+  platform_task_handle_t task;
+  platform_task_param_t param;
+  volatile uint8_t busy;
+} spi_async;
+
+static void ICACHE_RAM_ATTR spi_async_chunk( void )
+{
+  size_t i, n = spi_async.len > 64 ? 64 : spi_async.len;
+  const uint8_t *p = spi_async.mosi;
+
+  // assemble the words a byte at a time as the data need not be aligned
+  for (i = 0; i < n; i += 4) {
+    uint32_t w = 0xffffffff;
+    if (p) {
+      unsigned j, k = n - i < 4 ? n - i : 4;
+      for (w = 0, j = 0; j < k; j++)
+        w |= (uint32_t)p[i + j] << (j * 8);
+    }
+    WRITE_PERI_REG(SPI_W0(SPI_HSPI) + i, w);
+  }
+  if (p)
+    spi_async.mosi = p + n;
+  spi_async.len -= n;
+  spi_async.chunk = n;
+
+  WRITE_PERI_REG(SPI_USER1(SPI_HSPI),
+                 ((n * 8 - 1) & SPI_USR_MOSI_BITLEN) << SPI_USR_MOSI_BITLEN_S);
+  SET_PERI_REG_MASK(SPI_CMD(SPI_HSPI), SPI_USR);
+}
+
+static void ICACHE_RAM_ATTR spi_async_isr( void *arg )
+{
+  (void)arg;
+  if (!(READ_PERI_REG(SPI_INT_STATUS) & SPI_INT_HSPI))
+    return;
+  CLEAR_PERI_REG_MASK(SPI_SLAVE(SPI_HSPI), SPI_TRANS_DONE);
+  if (!spi_async.busy)
+    return;
+
+  if (spi_async.miso) {
+    size_t i;
+    for (i = 0; i < spi_async.chunk; i += 4) {
+      uint32_t w = READ_PERI_REG(SPI_W0(SPI_HSPI) + i);
+      unsigned j, k = spi_async.chunk - i < 4 ? spi_async.chunk - i : 4;
+      for (j = 0; j < k; j++)
+        spi_async.miso[i + j] = w >> (j * 8);
+    }
+    spi_async.miso += spi_async.chunk;
+  }
+
+  if (spi_async.len) {
+    spi_async_chunk();
+  } else {
+    CLEAR_PERI_REG_MASK(SPI_SLAVE(SPI_HSPI), SPI_TRANS_DONE_EN);
+    spi_async.busy = 0;
+    platform_post_low(spi_async.task, spi_async.param);
+  }
+}
+
+/*
+ * Start a full duplex block transfer of len bytes and return at once. If mosi
+ * is NULL then 0xff is sent. The received bytes are stored at miso unless it
+ * is NULL. Both buffers must stay valid until param is posted to task. Only
+ * one transfer can be in flight, and other SPI calls on the bus wait for it.
+ */
+int platform_spi_blktransfer_async( uint8_t id, size_t len, const uint8_t *mosi, uint8_t *miso,
+                                    platform_task_handle_t task, platform_task_param_t param )
+{
+  static uint8_t attached;
+
+  if (id != SPI_HSPI || len == 0 || spi_async.busy)
+    return PLATFORM_ERR;
+
+  if (!attached) {
+    ETS_SPI_INTR_ATTACH(spi_async_isr, NULL);
+    ETS_SPI_INTR_ENABLE();
+    attached = 1;
+  }
+
+  while(READ_PERI_REG(SPI_CMD(id)) & SPI_USR);
+
+  spi_async.mosi = mosi;
+  spi_async.miso = miso;
+  spi_async.len = len;
+  spi_async.task = task;
+  spi_async.param = param;
+  spi_async.busy = 1;
+
+  CLEAR_PERI_REG_MASK(SPI_USER(id), SPI_USR_COMMAND|SPI_USR_ADDR|SPI_USR_DUMMY|SPI_USR_MISO);
+  SET_PERI_REG_MASK(SPI_USER(id), SPI_USR_MOSI|SPI_DOUTDIN);
+  CLEAR_PERI_REG_MASK(SPI_SLAVE(id), SPI_TRANS_DONE);
+  SET_PERI_REG_MASK(SPI_SLAVE(id), SPI_TRANS_DONE_EN);
+
+  spi_async_chunk();
+  return PLATFORM_OK;
+}
+
+int platform_spi_busy( uint8_t id )
+{
+  return id == SPI_HSPI && spi_async.busy;
+}
+
+static void spi_async_wait( uint8_t id )
+{
+  while (platform_spi_busy( id ));
+}
+
 int platform_spi_send( uint8_t id, uint8_t bitlen, spi_data_type data )
 {
   if (bitlen > 32)
     return PLATFORM_ERR;
 
+  spi_async_wait( id );
   spi_mast_transaction( id, 0, 0, bitlen, data, 0, 0, 0 );
   return PLATFORM_OK;
 }
@@ -777,6 +1112,7 @@ spi_data_type platform_spi_send_recv( uint8_t id, uint8_t bitlen, spi_data_type
   if (bitlen > 32)
     return 0;
 
+  spi_async_wait( id );
   spi_mast_set_mosi( id, 0, bitlen, data );
   spi_mast_transaction( id, 0, 0, 0, 0, bitlen, 0, -1 );
   return spi_mast_get_miso( id, 0, bitlen );
@@ -784,6 +1120,7 @@ spi_data_type platform_spi_send_recv( uint8_t id, uint8_t bitlen, spi_data_type
 
 int platform_spi_blkwrite( uint8_t id, size_t len, const uint8_t *data )
 {
+  spi_async_wait( id );
   while (len > 0) {
     size_t chunk_len = len > 64 ? 64 : len;
 
@@ -801,6 +1138,7 @@ int platform_spi_blkread( uint8_t id, size_t len, uint8_t *data )
 {
   uint8_t mosi_idle[64];
 
+  spi_async_wait( id );
   os_memset( (void *)mosi_idle, 0xff, len > 64 ? 64 : len );
 
   while (len > 0 ) {
@@ -817,6 +1155,26 @@ int platform_spi_blkread( uint8_t id, size_t len, uint8_t *data )
   return PLATFORM_OK;
 }
 
+// Full duplex block transfer: the bytes at mosi are sent while the ones
+// received are stored at miso, which may be the same buffer
+int platform_spi_blktransfer( uint8_t id, size_t len, const uint8_t *mosi, uint8_t *miso )
+{
+  spi_async_wait( id );
+  while (len > 0) {
+    size_t chunk_len = len > 64 ? 64 : len;
+
+    spi_mast_blkset( id, chunk_len * 8, mosi );
+    spi_mast_transaction( id, 0, 0, 0, 0, chunk_len * 8, 0, -1 );
+    spi_mast_blkget( id, chunk_len * 8, miso );
+
+    mosi = &(mosi[chunk_len]);
+    miso = &(miso[chunk_len]);
+    len -= chunk_len;
+  }
+
+  return PLATFORM_OK;
+}
+
 int platform_spi_transaction( uint8_t id, uint8_t cmd_bitlen, spi_data_type cmd_data,
                               uint8_t addr_bitlen, spi_data_type addr_data,
                               uint16_t mosi_bitlen, uint8_t dummy_bitlen, int16_t miso_bitlen )
@@ -828,6 +1186,7 @@ int platform_spi_transaction( uint8_t id, uint8_t cmd_bitlen, spi_data_type cmd_
       (miso_bitlen  > 512))
     return PLATFORM_ERR;
 
+  spi_async_wait( id );
   spi_mast_transaction( id, cmd_bitlen, cmd_data, addr_bitlen, addr_data, mosi_bitlen, dummy_bitlen, miso_bitlen );
 
   return PLATFORM_OK;
@@ -841,22 +1200,29 @@ int platform_spi_transaction( uint8_t id, uint8_t cmd_bitlen, spi_data_type cmd_
  * > toaddr is INTERNAL_FLASH_WRITE_UNIT_SIZE aligned
  * > size is a multiple of INTERNAL_FLASH_WRITE_UNIT_SIZE
  */
+/*
+ * Sources that are unaligned or in mapped flash are bounced through a
+ * buffer on the stack, in chunks of FLASH_BOUNCE_SIZE
+ */
+#define FLASH_BOUNCE_SIZE 256
 uint32_t platform_s_flash_write( const void *from, uint32_t toaddr, uint32_t size )
 {
-  SpiFlashOpResult r;
+  SpiFlashOpResult r = SPI_FLASH_RESULT_OK;
   const uint32_t blkmask = INTERNAL_FLASH_WRITE_UNIT_SIZE - 1;
-  uint32_t *apbuf = NULL;
   uint32_t fromaddr = (uint32_t)from;
+  system_soft_wdt_feed ();
+  PLATFORM_TRACE_EVENT(TRACE_FLASH_WRITE, size, toaddr);
   if( (fromaddr & blkmask ) || (fromaddr >= INTERNAL_FLASH_MAPPED_ADDRESS)) {
-    apbuf = (uint32_t *)malloc(size);
-    if(!apbuf)
-      return 0;
-    memcpy(apbuf, from, size);
+    uint32_t bounce[FLASH_BOUNCE_SIZE / sizeof(uint32_t)];
+    uint32_t done, n;
+    for (done = 0; done < size && r == SPI_FLASH_RESULT_OK; done += n) {
+      n = (size - done < FLASH_BOUNCE_SIZE) ? size - done : FLASH_BOUNCE_SIZE;
+      memcpy(bounce, (const uint8_t *)from + done, n);
+      r = flash_write(toaddr + done, bounce, n);
+    }
+  } else {
+    r = flash_write(toaddr, (uint32_t *)from, size);
   }
-  system_soft_wdt_feed ();
-  r = flash_write(toaddr, apbuf?(uint32_t *)apbuf:(uint32_t *)from, size);
-  if(apbuf)
-    free(apbuf);
   if(SPI_FLASH_RESULT_OK == r)
     return size;
   else{
@@ -906,6 +1272,7 @@ uint32_t platform_s_flash_read( void *to, uint32_t fromaddr, uint32_t size )
 int platform_flash_erase_sector( uint32_t sector_id )
 {
   NODE_DBG( "flash_erase_sector(%u)\n", sector_id);
+  PLATFORM_TRACE_EVENT(TRACE_FLASH_ERASE, 0, sector_id);
   return flash_erase( sector_id ) == SPI_FLASH_RESULT_OK ? PLATFORM_OK : PLATFORM_ERR;
 }
 
@@ -995,10 +1362,52 @@ uint32_t platform_rcr_get_startup_option() {
     if (platform_rcr_read(PLATFORM_RCR_STARTUP_OPTION, (void **) &option_p) == sizeof(*option_p)) {
       option = *option_p;
     }
+    if (platform_fastwake_name()) {
+      option |= STARTUP_OPTION_NO_BANNER | STARTUP_OPTION_DELAY_MOUNT;
+    }
   }
   return option;
 }
 
+#define FASTWAKE_MAGIC 0x46570000  /* "FW" with the name length in the low byte */
+
+const char *platform_fastwake_name (void) {
+  static uint32_t name[PLATFORM_FASTWAKE_NAME_LEN / 4 + 1];
+  static int8_t state = -1;
+
+  if (state < 0) {
+    uint32_t hdr = rtc_mem_read(PLATFORM_FASTWAKE_SLOT);
+    uint32_t len = hdr & 0xff;
+    int i;
+
+    state = 0;
+    if (rtc_get_reset_reason() == 2 &&     /* a wake from deep sleep */
+        (hdr & ~0xff) == FASTWAKE_MAGIC && len > 0 && len <= PLATFORM_FASTWAKE_NAME_LEN) {
+      for (i = 0; i < PLATFORM_FASTWAKE_NAME_LEN / 4; i++) {
+        name[i] = rtc_mem_read(PLATFORM_FASTWAKE_SLOT + 1 + i);
+      }
+      ((char *) name)[len] = '\0';
+      state = 1;
+    }
+  }
+  return state ? (const char *) name : NULL;
+}
+
+void platform_fastwake_set (const char *name, size_t len) {
+  uint32_t word[PLATFORM_FASTWAKE_NAME_LEN / 4] = {0};
+  int i;
+
+  if (!name || len == 0 || len > PLATFORM_FASTWAKE_NAME_LEN) {
+    rtc_mem_write(PLATFORM_FASTWAKE_SLOT, 0);
+    return;
+  }
+  memcpy(word, name, len);
+  for (i = 0; i < PLATFORM_FASTWAKE_NAME_LEN / 4; i++) {
+    rtc_mem_write(PLATFORM_FASTWAKE_SLOT + 1 + i, word[i]);
+  }
+  rtc_mem_write(PLATFORM_FASTWAKE_SLOT, FASTWAKE_MAGIC | len);
+}
+
 uint32_t platform_rcr_delete (uint8_t rec_id) {
   uint32_t *rec = NULL;
   platform_rcr_read(rec_id, (void**)&rec);
@@ -1098,25 +1507,283 @@ void* platform_print_deprecation_note( const char *msg, const char *time_frame)
 #define TASK_PRIORITY_MASK    3
 #define TASK_PRIORITY_COUNT   3
 
+#ifndef PLATFORM_TASK_QUEUE_LEN_LOW
+#define PLATFORM_TASK_QUEUE_LEN_LOW     TASK_DEFAULT_QUEUE_LEN
+#endif
+#ifndef PLATFORM_TASK_QUEUE_LEN_MEDIUM
+#define PLATFORM_TASK_QUEUE_LEN_MEDIUM  TASK_DEFAULT_QUEUE_LEN
+#endif
+#ifndef PLATFORM_TASK_QUEUE_LEN_HIGH
+#define PLATFORM_TASK_QUEUE_LEN_HIGH    TASK_DEFAULT_QUEUE_LEN
+#endif
+
+static const uint16_t task_sdk_queue_len[TASK_PRIORITY_COUNT] = {
+  PLATFORM_TASK_QUEUE_LEN_LOW,
+  PLATFORM_TASK_QUEUE_LEN_MEDIUM,
+  PLATFORM_TASK_QUEUE_LEN_HIGH
+};
+
+/*
+ * The SDK queue for each priority is fixed once system_os_task() has been called,
+ * so extra (runtime) depth is provided by an overflow ring.  Once the overflow is
+ * in use, all posts go to it to preserve FIFO order, and each dispatch moves the
+ * head of the overflow into the slot that it has just freed in the SDK queue.
+ * The stamp ring holds the post time of every queued event in the same order, so
+ * that the dispatch latency can be measured.
+ */
+typedef struct {
+  os_event_t *sdk_Q;
+  os_event_t *ovf_Q;
+  uint32_t   *stamp;
+  uint16_t    sdk_len, ovf_len;
+  uint16_t    sdk_count, ovf_head, ovf_count, stamp_head;
+  platform_task_stats_t stats;
+} task_queue_t;
+
 /*
  * Private struct to hold the 3 event task queues and the dispatch callbacks
  */
 static struct taskQblock {
-  os_event_t *task_Q[TASK_PRIORITY_COUNT];
+  task_queue_t task_Q[TASK_PRIORITY_COUNT];
   platform_task_callback_t *task_func;
   int task_count;
+  void (*idle_hook)(void);
   } TQB = {0};
 
+/*
+ * Post an event to the given priority queue.  This can be called from ISRs, so
+ * it must be in IRAM and all queue state is updated with interrupts deferred.
+ */
+bool ICACHE_RAM_ATTR platform_post(uint8 prio, platform_task_handle_t handle, platform_task_param_t par) {
+  task_queue_t *q = TQB.task_Q + (prio & TASK_PRIORITY_MASK);
+  if (prio >= TASK_PRIORITY_COUNT || !q->stamp)
+    return false;
+
+  uint32_t now = system_get_time();
+  uint32_t state = esp8266_defer_irqs();
+  uint16_t queued = q->sdk_count + q->ovf_count;
+
+  if (q->ovf_count == 0 && q->sdk_count < q->sdk_len &&
+      system_os_post(prio, handle | prio, par)) {
+    q->sdk_count++;
+  } else if (q->ovf_count < q->ovf_len) {
+    os_event_t *e = q->ovf_Q + (q->ovf_head + q->ovf_count) % q->ovf_len;
+    e->sig = handle | prio;
+    e->par = par;
+    q->ovf_count++;
+  } else {
+    q->stats.failed++;
+    esp8266_restore_irqs(state);
+    return false;
+  }
+
+  PLATFORM_TRACE_EVENT(TRACE_TASK_POST, prio, handle);
+  q->stamp[(q->stamp_head + queued) % q->stats.depth] = now;
+  if (++queued > q->stats.high_water)
+    q->stats.high_water = queued;
+  q->stats.posted++;
+  esp8266_restore_irqs(state);
+  return true;
+}
+
+/*
+ * Account for an event just removed from the SDK queue and top up the SDK
+ * queue from the overflow ring if necessary.
+ */
+static void task_dequeue (uint8_t priority) {
+  task_queue_t *q = TQB.task_Q + priority;
+  uint32_t now = system_get_time(), posted_at;
+  uint32_t state = esp8266_defer_irqs();
+
+  if (q->sdk_count == 0) {  /* not posted through platform_post() */
+    esp8266_restore_irqs(state);
+    return;
+  }
+  q->sdk_count--;
+  posted_at = q->stamp[q->stamp_head];
+  q->stamp_head = (q->stamp_head + 1) % q->stats.depth;
+  if (q->ovf_count) {
+    os_event_t *e = q->ovf_Q + q->ovf_head;
+    if (system_os_post(priority, e->sig, e->par)) {
+      q->ovf_head = (q->ovf_head + 1) % q->ovf_len;
+      q->ovf_count--;
+      q->sdk_count++;
+    }
+  }
+  esp8266_restore_irqs(state);
+
+  uint32_t latency = now - posted_at;
+  q->stats.dispatched++;
+  q->stats.latency_total += latency;
+  if (latency > q->stats.latency_max)
+    q->stats.latency_max = latency;
+}
+
+#ifdef PLATFORM_TRACE
+/*
+ * Event trace ring.  head and tail count the entries written and read, so the
+ * ring is full when they are size apart and older entries are overwritten.
+ */
+volatile uint32_t platform_trace_mask;
+static struct {
+  platform_trace_entry_t *ring;
+  uint32_t size, head, tail;
+} trace;
+
+void ICACHE_RAM_ATTR platform_trace_event (unsigned id, unsigned a, uint32_t b) {
+  uint32_t state = esp8266_defer_irqs();
+  if (trace.ring) {
+    platform_trace_entry_t *e = trace.ring + (trace.head++ & (trace.size - 1));
+    e->ccount = CCOUNT_REG;
+    e->id = id;
+    e->a = a;
+    e->b = b;
+  }
+  esp8266_restore_irqs(state);
+}
+
+int platform_trace_start (unsigned entries, uint32_t mask) {
+  platform_trace_entry_t *ring = NULL, *old;
+  uint32_t size = 1, state;
+  if (entries) {
+    while (size < entries)
+      size <<= 1;
+    if (!(ring = (platform_trace_entry_t *) malloc(size * sizeof(*ring))))
+      return PLATFORM_ERR;
+  }
+  state = esp8266_defer_irqs();
+  old = trace.ring;
+  trace.ring = ring;
+  trace.size = size;
+  trace.head = trace.tail = 0;
+  platform_trace_mask = ring ? mask : 0;
+  esp8266_restore_irqs(state);
+  free(old);
+  return PLATFORM_OK;
+}
+
+void platform_trace_stop (void) {
+  platform_trace_mask = 0;
+}
+
+size_t platform_trace_read (platform_trace_entry_t *to, size_t max, uint32_t *lost) {
+  uint32_t state = esp8266_defer_irqs();
+  size_t n = 0;
+  *lost = 0;
+  if (trace.ring) {
+    if (trace.head - trace.tail > trace.size) {
+      *lost = trace.head - trace.tail - trace.size;
+      trace.tail = trace.head - trace.size;
+    }
+    for (; n < max && trace.tail != trace.head; n++)
+      to[n] = trace.ring[trace.tail++ & (trace.size - 1)];
+  }
+  esp8266_restore_irqs(state);
+  return n;
+}
+#endif
+
+/*
+ * CPU frequency governor.  While it is on, the CPU runs at its base frequency
+ * and is raised to 160MHz when the task queues back up or a heavy C function
+ * calls platform_cpufreq_boost().  A timer drops it back to the base once no
+ * boost has been asked for over a whole period and all the queues are empty.
+ */
+#define GOVERNOR_HOLD_MS 20
+
+static struct {
+  uint16_t backlog;         // queued events that raise the frequency, 0 if off
+  uint8_t base;             // frequency returned to when idle
+  uint8_t busy;             // a boost was asked for during this timer period
+  os_timer_t timer;
+} governor = {0, CPU80MHZ};
+
+static uint16_t task_queued (void) {
+  uint16_t n = 0;
+  int p;
+  for (p = 0; p < TASK_PRIORITY_COUNT; p++)
+    n += TQB.task_Q[p].sdk_count + TQB.task_Q[p].ovf_count;
+  return n;
+}
+
+static void set_cpufreq (uint8_t mhz) {
+  // http://www.esp8266.com/viewtopic.php?f=21&t=1369
+  if (mhz == CPU160MHZ) {
+    REG_SET_BIT(0x3ff00014, BIT(0));
+    ets_update_cpu_frequency(CPU160MHZ);
+  } else {
+    REG_CLR_BIT(0x3ff00014, BIT(0));
+    ets_update_cpu_frequency(CPU80MHZ);
+  }
+}
+
+static void governor_check (void *arg) {
+  (void) arg;
+  if (governor.busy || !platform_task_queues_empty()) {
+    governor.busy = 0;
+    return;
+  }
+  os_timer_disarm(&governor.timer);
+  set_cpufreq(governor.base);
+}
+
+void platform_cpufreq_boost (void) {
+  if (!governor.backlog)
+    return;
+  governor.busy = 1;
+  if (governor.base != CPU160MHZ && system_get_cpu_freq() != CPU160MHZ) {
+    set_cpufreq(CPU160MHZ);
+    os_timer_arm(&governor.timer, GOVERNOR_HOLD_MS, 1);
+  }
+}
+
+/*
+ * Set the CPU frequency, which becomes the base frequency of the governor if
+ * it is on.  The UART and timers run from fixed clocks, and the ROM delay
+ * loops are told of the change.
+ */
+void platform_cpufreq_set (uint8_t mhz) {
+  governor.base = mhz == CPU160MHZ ? CPU160MHZ : CPU80MHZ;
+  if (governor.backlog)
+    os_timer_disarm(&governor.timer);
+  set_cpufreq(governor.base);
+}
+
+/*
+ * Turn the governor on, raising the frequency once backlog events are queued,
+ * or off with a backlog of 0, which leaves the CPU at the base frequency.
+ */
+void platform_cpufreq_governor (uint16_t backlog) {
+  if (!governor.backlog)
+    governor.base = system_get_cpu_freq() == CPU160MHZ ? CPU160MHZ : CPU80MHZ;
+  os_timer_disarm(&governor.timer);
+  os_timer_setfn(&governor.timer, governor_check, NULL);
+  governor.backlog = backlog;
+  set_cpufreq(governor.base);
+}
+
+uint16_t platform_cpufreq_get_governor (void) {
+  return governor.backlog;
+}
+
 static void platform_task_dispatch (os_event_t *e) {
   platform_task_handle_t handle = e->sig;
+  uint8_t priority = handle & TASK_PRIORITY_MASK;
+  if (priority < TASK_PRIORITY_COUNT)
+    task_dequeue(priority);
+  if (governor.backlog && task_queued() >= governor.backlog)
+    platform_cpufreq_boost();
   if ( (handle & TH_MASK) == TH_MONIKER) {
     uint16_t entry    = (handle & TH_UNMASK) >> TH_SHIFT;
-    uint8_t  priority = handle & TASK_PRIORITY_MASK;
     if ( priority <= PLATFORM_TASK_PRIORITY_HIGH &&
          TQB.task_func &&
          entry < TQB.task_count ){
       /* call the registered task handler with the specified parameter and priority */
+      PLATFORM_TRACE_EVENT(TRACE_TASK_DISPATCH, priority, handle);
       TQB.task_func[entry](e->par, priority);
+      PLATFORM_TRACE_EVENT(TRACE_TASK_DONE, priority, handle);
+      if (TQB.idle_hook && platform_task_queues_empty())
+        TQB.idle_hook();
       return;
     }
   }
@@ -1128,20 +1795,114 @@ static void platform_task_dispatch (os_event_t *e) {
  * Initialise the task handle callback for a given priority.
  */
 static int task_init_handler (void) {
-  int p, qlen = TASK_DEFAULT_QUEUE_LEN;
+  int p;
   for (p = 0; p < TASK_PRIORITY_COUNT; p++){
-    TQB.task_Q[p] = (os_event_t *) malloc( sizeof(os_event_t)*qlen );
-    if (TQB.task_Q[p]) {
-      os_memset(TQB.task_Q[p], 0, sizeof(os_event_t)*qlen);
-      system_os_task(platform_task_dispatch, p, TQB.task_Q[p], TASK_DEFAULT_QUEUE_LEN);
+    task_queue_t *q = TQB.task_Q + p;
+    int qlen = task_sdk_queue_len[p];
+    q->sdk_Q = (os_event_t *) calloc(qlen, sizeof(os_event_t));
+    q->stamp = (uint32_t *) calloc(qlen, sizeof(uint32_t));
+    if (q->sdk_Q && q->stamp) {
+      q->sdk_len = q->stats.depth = qlen;
+      system_os_task(platform_task_dispatch, p, q->sdk_Q, qlen);
     } else {
       NODE_DBG ( "Malloc failure in platform_task_init_handler" );
       return PLATFORM_ERR;
     }
   }
+  return PLATFORM_OK;
+}
+
+/*
+ * Set the total queue depth for a priority.  This can't be less than the SDK
+ * queue length fixed at build time, with any excess allocated as an overflow
+ * ring.  The resize fails if more events are currently in the overflow than
+ * the new ring would hold.
+ */
+int platform_task_set_queue_len (uint8 prio, uint16_t len) {
+  if (prio >= TASK_PRIORITY_COUNT)
+    return PLATFORM_ERR;
+  task_queue_t *q = TQB.task_Q + prio;
+  if (len < q->sdk_len)
+    len = q->sdk_len;
+  uint16_t ovf_len = len - q->sdk_len;
+  os_event_t *ovf_Q = ovf_len ? (os_event_t *) malloc(ovf_len * sizeof(os_event_t)) : NULL;
+  uint32_t *stamp = (uint32_t *) malloc(len * sizeof(uint32_t));
+  if ((ovf_len && !ovf_Q) || !stamp) {
+    free(ovf_Q);
+    free(stamp);
+    return PLATFORM_ERR;
+  }
+
+  uint32_t state = esp8266_defer_irqs();
+  if (q->ovf_count > ovf_len) {
+    esp8266_restore_irqs(state);
+    free(ovf_Q);
+    free(stamp);
+    return PLATFORM_ERR;
+  }
+  int i, queued = q->sdk_count + q->ovf_count;
+  for (i = 0; i < q->ovf_count; i++)
+    ovf_Q[i] = q->ovf_Q[(q->ovf_head + i) % q->ovf_len];
+  for (i = 0; i < queued; i++)
+    stamp[i] = q->stamp[(q->stamp_head + i) % q->stats.depth];
+  os_event_t *old_Q = q->ovf_Q;
+  uint32_t *old_stamp = q->stamp;
+  q->ovf_Q = ovf_Q;
+  q->ovf_len = ovf_len;
+  q->ovf_head = 0;
+  q->stamp = stamp;
+  q->stamp_head = 0;
+  q->stats.depth = len;
+  esp8266_restore_irqs(state);
+
+  free(old_Q);
+  free(old_stamp);
+  return PLATFORM_OK;
+}
+
+/*
+ * Return a snapshot of the instrumentation counters for a priority, optionally
+ * resetting the high-water mark and the cumulative counters.
+ */
+void platform_task_get_stats (uint8 prio, platform_task_stats_t *stats, bool reset) {
+  if (prio >= TASK_PRIORITY_COUNT) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  task_queue_t *q = TQB.task_Q + prio;
+  uint32_t state = esp8266_defer_irqs();
+  *stats = q->stats;
+  stats->queued = q->sdk_count + q->ovf_count;
+  if (reset) {
+    uint16_t depth = q->stats.depth;
+    memset(&q->stats, 0, sizeof(q->stats));
+    q->stats.depth = depth;
+    q->stats.high_water = stats->queued;
+  }
+  esp8266_restore_irqs(state);
 }
 
 
+/*
+ * True if no event posted through platform_post() is waiting at any priority.
+ */
+bool platform_task_queues_empty (void) {
+  int p;
+  for (p = 0; p < TASK_PRIORITY_COUNT; p++) {
+    if (TQB.task_Q[p].sdk_count + TQB.task_Q[p].ovf_count)
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Set a function to be called each time a dispatch leaves all the task queues
+ * empty, such as the automatic idle sleep of pmSleep.  NULL removes it.
+ */
+void platform_task_set_idle_hook (void (*hook)(void)) {
+  TQB.idle_hook = hook;
+}
+
 /*
  * Allocate a task handle in the relevant TCB.task_Q.  Note that these Qs are resized
  * as needed growing in 4 unit bricks.  No GC is adopted so handles are permanently
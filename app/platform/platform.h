@@ -46,6 +46,12 @@ static inline int platform_gpio_exists( unsigned pin ) { return pin < NUM_GPIO;
 int platform_gpio_mode( unsigned pin, unsigned mode, unsigned pull );
 int platform_gpio_write( unsigned pin, unsigned level );
 int platform_gpio_read( unsigned pin );
+// Pin masks have bit n set for pin n. The outputs of all the pins but 0 are
+// set and then cleared with one register write each, so that they change
+// together; pin 0 follows. A pin in both masks ends up low.
+// platform_gpio_pin_bits() gives the GPIO register bits of the pins but 0.
+uint32_t platform_gpio_pin_bits( uint32_t pins );
+void platform_gpio_write_mask( uint32_t set, uint32_t clear );
 
 // Note that these functions will not be compiled in unless GPIO_INTERRUPT_ENABLE and
 // GPIO_INTERRUPT_HOOK_ENABLE are defined.
@@ -54,6 +60,14 @@ int platform_gpio_register_intr_hook(uint32_t gpio_bits, platform_hook_function
   platform_gpio_register_intr_hook(0, hook);
 void platform_gpio_intr_init( unsigned pin, GPIO_INT_TYPE type );
 void platform_gpio_init( platform_task_handle_t gpio_task );
+
+// Batched edge capture, only available if GPIO_INTERRUPT_ENABLE is defined.
+// Each event is packed as (timestamp << 1) | level with a 31-bit uSec timestamp.
+#define PLATFORM_GPIO_BATCH_MAX 256
+#define PLATFORM_GPIO_BATCH_LEVEL(ev) ((ev) & 1)
+#define PLATFORM_GPIO_BATCH_TIME(ev)  ((ev) >> 1)
+int platform_gpio_set_batch( unsigned pin, unsigned size, platform_task_handle_t task );
+unsigned platform_gpio_get_batch( unsigned pin, uint32_t *ev, unsigned max, uint32_t *dropped );
 // *****************************************************************************
 // Timer subsection
 
@@ -114,6 +128,10 @@ void platform_spi_select( unsigned id, int is_select );
 
 int platform_spi_blkwrite( uint8_t id, size_t len, const uint8_t *data );
 int platform_spi_blkread( uint8_t id, size_t len, uint8_t *data );
+int platform_spi_blktransfer( uint8_t id, size_t len, const uint8_t *mosi, uint8_t *miso );
+int platform_spi_blktransfer_async( uint8_t id, size_t len, const uint8_t *mosi, uint8_t *miso,
+                                    platform_task_handle_t task, platform_task_param_t param );
+int platform_spi_busy( uint8_t id );
 int platform_spi_transaction( uint8_t id, uint8_t cmd_bitlen, spi_data_type cmd_data,
                               uint8_t addr_bitlen, spi_data_type addr_data,
                               uint16_t mosi_bitlen, uint8_t dummy_bitlen, int16_t miso_bitlen );
@@ -259,6 +277,31 @@ void platform_i2c_send_stop( unsigned id );
 int platform_i2c_send_address( unsigned id, uint16_t address, int direction );
 int platform_i2c_send_byte( unsigned id, uint8_t data );
 int platform_i2c_recv_byte( unsigned id, int ack );
+int platform_i2c_transfer( unsigned id, uint16_t address, const uint8_t *wdata, size_t wlen,
+                           uint8_t *rdata, size_t rlen );
+
+// A non-blocking I2C job: wdata is written to the device at once, and after
+// delay_us, rlen bytes are read into rdata and cb is called at task level.
+// Jobs on different devices overlap their delays. The job and its buffers
+// must stay valid until cb has been called.
+typedef struct platform_i2c_job platform_i2c_job_t;
+typedef void (*platform_i2c_job_cb_t)( platform_i2c_job_t *job, int ok );
+struct platform_i2c_job {
+  uint8_t id;
+  uint8_t address;
+  uint8_t wlen;
+  uint8_t rlen;
+  const uint8_t *wdata;
+  uint8_t *rdata;
+  uint32_t delay_us;
+  platform_i2c_job_cb_t cb;
+  void *arg;
+  // used by the scheduler
+  platform_i2c_job_t *next;
+  uint32_t due;
+  uint8_t ok;
+};
+int platform_i2c_submit( platform_i2c_job_t *job );
 
 // *****************************************************************************
 // Ethernet specific functions
@@ -363,6 +406,18 @@ uint32_t platform_rcr_get_startup_option();
 uint32_t platform_rcr_delete (uint8_t rec_id);
 uint32_t platform_rcr_write (uint8_t rec_id, const void *rec, uint8_t size);
 
+/*
+ * A fast wake runs an LFS module in place of the startup command on the wakes
+ * from deep sleep, with the file system mount delayed until first use and no
+ * banner.  The module name is kept in RTC user memory slots 28-31, so that a
+ * reset or power up always goes through the normal startup.
+ */
+#define PLATFORM_FASTWAKE_SLOT         28
+#define PLATFORM_FASTWAKE_NAME_LEN     12
+
+const char *platform_fastwake_name (void);
+void platform_fastwake_set (const char *name, size_t len);
+
 #define PLATFORM_TASK_PRIORITY_LOW     0
 #define PLATFORM_TASK_PRIORITY_MEDIUM  1
 #define PLATFORM_TASK_PRIORITY_HIGH    2
@@ -382,9 +437,36 @@ uint32_t platform_rcr_write (uint8_t rec_id, const void *rec, uint8_t size);
 typedef void (*platform_task_callback_t)(platform_task_param_t param, uint8 prio);
 platform_task_handle_t platform_task_get_id(platform_task_callback_t t);
 
-static inline bool platform_post(uint8 prio, platform_task_handle_t handle, platform_task_param_t par) {
-  return system_os_post(prio, handle | prio, par);
-}
+bool platform_post(uint8 prio, platform_task_handle_t handle, platform_task_param_t par);
+
+/*
+* Per-priority task queue instrumentation.  The queue depth is the SDK queue length
+* fixed at build time plus an optional overflow ring which can be resized at runtime.
+* Latencies are the time in uSec between a successful post and its dispatch.
+*/
+typedef struct {
+  uint16_t depth;          // total number of events that can be queued
+  uint16_t queued;         // number of events currently queued
+  uint16_t high_water;     // maximum number of events queued at any one time
+  uint32_t posted;         // successful posts
+  uint32_t failed;         // posts rejected because the queue was full
+  uint32_t dispatched;     // events delivered to their task handler
+  uint32_t latency_max;    // worst-case post to dispatch latency
+  uint32_t latency_total;  // accumulated latency over all dispatched events
+} platform_task_stats_t;
+
+int platform_task_set_queue_len(uint8 prio, uint16_t len);
+void platform_task_get_stats(uint8 prio, platform_task_stats_t *stats, bool reset);
+bool platform_task_queues_empty(void);
+void platform_task_set_idle_hook(void (*hook)(void));
+
+// CPU frequency, in MHz as for system_get_cpu_freq()
+#define CPU80MHZ  80
+#define CPU160MHZ 160
+void platform_cpufreq_set(uint8_t mhz);
+void platform_cpufreq_governor(uint16_t backlog);
+uint16_t platform_cpufreq_get_governor(void);
+void platform_cpufreq_boost(void);
 #define platform_freeheap() system_get_free_heap_size()
 
 // Get current value of CCOUNt register
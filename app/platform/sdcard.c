@@ -251,7 +251,8 @@ static int sdcard_write_data( uint8_t token, const uint8_t *src)
   return FALSE;
 }
 
-static int sdcard_read_data( uint8_t *dst, size_t count )
+// receive one data block, leaving the card selected
+static int sdcard_receive_data( uint8_t *dst, size_t count )
 {
   to_t to;
 
@@ -273,14 +274,20 @@ static int sdcard_read_data( uint8_t *dst, size_t count )
   // discard crc
   platform_spi_transaction( m_spi_no, 16, 0xffff, 0, 0, 0, 0, 0 );
 
-  sdcard_chipselect_high();
   return TRUE;
 
   fail:
-  sdcard_chipselect_high();
   return FALSE;
 }
 
+static int sdcard_read_data( uint8_t *dst, size_t count )
+{
+  int res = sdcard_receive_data( dst, count );
+
+  sdcard_chipselect_high();
+  return res;
+}
+
 static int sdcard_read_register( uint8_t cmd, uint8_t *buf )
 {
   if (sdcard_command( cmd, 0 )) {
@@ -437,10 +444,9 @@ int platform_sdcard_read_blocks( uint8_t ss_pin, uint32_t block, size_t num, uin
     goto fail;
   }
 
-  // read required blocks
+  // read required blocks, the card stays selected until the stop command
   while (num > 0) {
-    sdcard_chipselect_low();
-    if (sdcard_read_data( dst, 512 )) {
+    if (sdcard_receive_data( dst, 512 )) {
       num--;
       dst = &(dst[512]);
     } else {
@@ -453,6 +459,10 @@ int platform_sdcard_read_blocks( uint8_t ss_pin, uint32_t block, size_t num, uin
     m_error = SD_CARD_ERROR_CMD12;
     goto fail;
   }
+  if (num > 0) {
+    // a block failed, m_error tells why
+    goto fail;
+  }
   sdcard_chipselect_high();
   return TRUE;
 
@@ -511,11 +521,18 @@ static int sdcard_write_stop( void )
     goto fail;
   }
 
+  // programming is done, check that it succeeded
+  if (sdcard_command( CMD13, 0 ) || platform_spi_send_recv( m_spi_no, 8, 0xff )) {
+    m_error = SD_CARD_ERROR_WRITE_PROGRAMMING;
+    goto fail_status;
+  }
+
   sdcard_chipselect_high();
   return TRUE;
 
   fail:
   m_error = SD_CARD_ERROR_STOP_TRAN;
+  fail_status:
   sdcard_chipselect_high();
   return FALSE;
 }
@@ -536,11 +553,9 @@ int platform_sdcard_write_blocks( uint8_t ss_pin, uint32_t block, size_t num, co
     m_error = SD_CARD_ERROR_CMD25;
     goto fail;
   }
-  sdcard_chipselect_high();
 
+  // the card stays selected for the whole transfer
   for (size_t b = 0; b < num; b++, src += 512) {
-    sdcard_chipselect_low();
-
     // wait for previous write to finish
     if (! sdcard_wait_not_busy( 100 * 1000 )) {
       goto fail_write;
@@ -548,8 +563,6 @@ int platform_sdcard_write_blocks( uint8_t ss_pin, uint32_t block, size_t num, co
     if (! sdcard_write_data( WRITE_MULTIPLE_TOKEN, src )) {
       goto fail_write;
     }
-
-    sdcard_chipselect_high();
   }
 
   return sdcard_write_stop();
@@ -0,0 +1,291 @@
+/*
+ * Hierarchical timer wheel, see timer_wheel.h
+ *
+ * There are four levels of 64 slots. Level 0 holds the timers due in the
+ * next 64 ticks, one tick per slot, and each level above covers 64 times the
+ * span of the one below. Whenever level 0 wraps, the next slot of level 1 is
+ * cascaded down into the levels below, and likewise further up. A bitmap per
+ * level marks the slots in use, so that runs of empty slots are jumped over
+ * and the driving os_timer can sleep until the next slot with work in it.
+ */
+
+#include "platform.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "pm/swtimer.h"
+#include "timer_wheel.h"
+
+#define LEVEL_BITS 6
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define LEVELS 4
+
+// The driving os_timer is re-armed at least this often, so that the 32-bit
+// microsecond clock is never read more than one wrap apart
+#define MAX_SLEEP_MS 60000
+
+static twheel_timer_t *wheel[LEVELS][LEVEL_SIZE];
+static uint64_t occupied[LEVELS];
+static twheel_timer_t *firing;  // timers of the slot being run
+static uint32_t wheel_clk;      // next tick to run, or the one being run
+static bool running;
+
+static uint32_t last_us;
+static uint32_t now_ms;
+static uint32_t now_frac_us;    // under a millisecond, kept for the next reading
+
+static os_timer_t driver;
+
+static uint32_t read_clock(void) {
+  uint32_t us = system_get_time();
+  uint32_t elapsed = us - last_us + now_frac_us;
+  last_us = us;
+  now_ms += elapsed / 1000;
+  now_frac_us = elapsed % 1000;
+  return now_ms;
+}
+
+static bool wheel_empty(void) {
+  for (int level = 0; level < LEVELS; level++) {
+    if (occupied[level]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The tick in [due, due + slack] with the most trailing zero bits
+static uint32_t apply_slack(uint32_t due, uint32_t slack) {
+  uint32_t limit = due + slack;
+  uint32_t diff = due ^ limit;
+  if (diff == 0) {
+    return due;
+  }
+  uint32_t mask = (1u << (31 - __builtin_clz(diff))) - 1;
+  return limit & ~mask;
+}
+
+static void enqueue(twheel_timer_t *t) {
+  // An overdue timer goes into the next slot to be run
+  uint32_t earliest = wheel_clk + (running ? 1 : 0);
+  if ((int32_t) (t->expires - earliest) < 0) {
+    t->expires = earliest;
+  }
+  uint32_t delta = t->expires - wheel_clk;
+  int level = 0;
+  while (level < LEVELS - 1 && delta >= (1u << (LEVEL_BITS * (level + 1)))) {
+    level++;
+  }
+  int slot = (t->expires >> (LEVEL_BITS * level)) & LEVEL_MASK;
+
+  t->next = wheel[level][slot];
+  if (t->next) {
+    t->next->pprev = &t->next;
+  }
+  wheel[level][slot] = t;
+  t->pprev = &wheel[level][slot];
+  occupied[level] |= (uint64_t) 1 << slot;
+}
+
+static void dequeue(twheel_timer_t *t) {
+  twheel_timer_t **head = t->pprev;
+
+  *head = t->next;
+  if (t->next) {
+    t->next->pprev = head;
+  }
+  t->pprev = NULL;
+
+  // Keep the bitmap exact when the last timer leaves a slot
+  ptrdiff_t idx = head - &wheel[0][0];
+  if (!*head && idx >= 0 && idx < LEVELS * LEVEL_SIZE) {
+    occupied[idx / LEVEL_SIZE] &= ~((uint64_t) 1 << (idx % LEVEL_SIZE));
+  }
+}
+
+static void cascade(int level) {
+  int slot = (wheel_clk >> (LEVEL_BITS * level)) & LEVEL_MASK;
+  twheel_timer_t *t = wheel[level][slot];
+
+  wheel[level][slot] = NULL;
+  occupied[level] &= ~((uint64_t) 1 << slot);
+  while (t) {
+    twheel_timer_t *next = t->next;
+    enqueue(t);
+    t = next;
+  }
+}
+
+// Number of slots from `slot` to the next occupied one at a level: 0 if
+// `slot` itself is occupied
+static int slots_ahead(uint64_t bits, int slot) {
+  uint64_t rotated = (bits >> slot) | (slot ? bits << (LEVEL_SIZE - slot) : 0);
+  return __builtin_ctzll(rotated);
+}
+
+// Ticks after wheel_clk at which the wheel next has work: a level 0 slot
+// with timers in it, or the cascade of an occupied slot further up
+static uint32_t ticks_to_work(void) {
+  uint32_t best = MAX_SLEEP_MS;
+
+  if (occupied[0]) {
+    best = slots_ahead(occupied[0], wheel_clk & LEVEL_MASK);
+  }
+  for (int level = 1; level < LEVELS; level++) {
+    if (!occupied[level]) {
+      continue;
+    }
+    int shift = LEVEL_BITS * level;
+    uint32_t block = wheel_clk >> shift;
+    int slot = block & LEVEL_MASK;
+    int ahead;
+    if (wheel_clk & ((1u << shift) - 1)) {
+      // The current block has been cascaded already, so start at the next one
+      ahead = slots_ahead(occupied[level], (slot + 1) & LEVEL_MASK) + 1;
+    } else {
+      ahead = slots_ahead(occupied[level], slot);
+    }
+    uint32_t ticks = ((block + ahead) << shift) - wheel_clk;
+    if (ticks < best) {
+      best = ticks;
+    }
+  }
+  return best;
+}
+
+// Runs every tick up to and including `target`
+static void run_until(uint32_t target) {
+  while ((int32_t) (target - wheel_clk) >= 0) {
+    int slot = wheel_clk & LEVEL_MASK;
+
+    if (slot == 0) {
+      for (int level = 1; level < LEVELS; level++) {
+        cascade(level);
+        if ((wheel_clk >> (LEVEL_BITS * level)) & LEVEL_MASK) {
+          break;
+        }
+      }
+    }
+
+    // Timers are moved off the slot first, so that any armed by a callback
+    // for 64 ticks on cannot be run in this pass. A callback may disarm one
+    // still waiting in `firing`.
+    running = true;
+    firing = wheel[0][slot];
+    if (firing) {
+      firing->pprev = &firing;
+    }
+    wheel[0][slot] = NULL;
+    occupied[0] &= ~((uint64_t) 1 << slot);
+
+    twheel_timer_t *t;
+    while ((t = firing) != NULL) {
+      dequeue(t);
+      if (t->period) {
+        // Periods run from the due times, so that the slack does not add up
+        t->due += t->period;
+        t->expires = apply_slack(t->due, t->slack);
+        enqueue(t);
+      }
+      t->fn(t->arg);
+    }
+    running = false;
+
+    // Jump to the next occupied slot, but not across a wrap of level 0,
+    // where the level above needs to be cascaded
+    uint32_t step = LEVEL_SIZE - slot;
+    if (occupied[0] >> slot) {
+      uint32_t ahead = __builtin_ctzll(occupied[0] >> slot);
+      if (ahead > 0 && ahead < step) {
+        step = ahead;
+      }
+    }
+    if (step > target - wheel_clk + 1) {
+      step = target - wheel_clk + 1;
+    }
+    wheel_clk += step;
+  }
+}
+
+static void arm_driver(void) {
+  os_timer_disarm(&driver);
+  if (wheel_empty()) {
+    return;
+  }
+
+  // wheel_clk is the tick that falls due at now_ms + 1 or later
+  uint32_t due = wheel_clk + ticks_to_work();
+  uint32_t now = read_clock();
+  uint32_t delay = (int32_t) (due - now) > 0 ? due - now : 1;
+  if (delay > MAX_SLEEP_MS) {
+    delay = MAX_SLEEP_MS;
+  }
+  os_timer_arm(&driver, delay, 0);
+}
+
+static void twheel_run(void *arg) {
+  (void) arg;
+  run_until(read_clock());
+  arm_driver();
+}
+
+static void twheel_init(void) {
+  static bool initialised;
+  if (initialised) {
+    return;
+  }
+  initialised = true;
+  last_us = system_get_time();
+  os_timer_disarm(&driver);
+  os_timer_setfn(&driver, twheel_run, NULL);
+  SWTIMER_REG_CB(twheel_run, SWTIMER_RESUME);
+    //twheel_run drives every wheel timer, so they are all resumed along with it
+}
+
+uint32_t twheel_now(void) {
+  twheel_init();
+  return read_clock();
+}
+
+void twheel_setfn(twheel_timer_t *t, twheel_fn_t fn, void *arg) {
+  twheel_disarm(t);
+  t->fn = fn;
+  t->arg = arg;
+}
+
+void twheel_arm(twheel_timer_t *t, uint32_t ms, bool repeat) {
+  twheel_init();
+  twheel_disarm(t);
+  if (ms == 0) {
+    ms = 1;
+  }
+  if (ms > TWHEEL_MAX_MS) {
+    ms = TWHEEL_MAX_MS;
+  }
+  // The wheel spans no further than TWHEEL_MAX_MS, slack included
+  if (t->slack > TWHEEL_MAX_MS - ms) {
+    t->slack = TWHEEL_MAX_MS - ms;
+  }
+
+  uint32_t now = read_clock();
+  if (!running && wheel_empty()) {
+    // Nothing to catch up on, and the clock may have moved on a long way
+    wheel_clk = now + 1;
+  }
+  t->due = now + ms;
+  t->expires = apply_slack(t->due, t->slack);
+  t->period = repeat ? ms : 0;
+  enqueue(t);
+  // From a callback, the driver is re-armed once the wheel has been run
+  if (!running) {
+    arm_driver();
+  }
+}
+
+void twheel_disarm(twheel_timer_t *t) {
+  if (twheel_armed(t)) {
+    // The driver may stay armed for a slot that is now empty. That costs one
+    // early wakeup, which is cheaper than looking for the next slot here.
+    dequeue(t);
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+/*
+ * Millisecond software timers on a hierarchical timer wheel.
+ *
+ * The calls mirror os_timer_setfn/arm/disarm, but arming and disarming are
+ * O(1) however many timers there are, where the SDK keeps its timers in a
+ * sorted list. All wheel timers share a single os_timer, which is only armed
+ * for the next point at which the wheel has work to do.
+ *
+ * Callbacks run in task context, like os_timer callbacks. A callback may arm
+ * or disarm any timer, including its own.
+ *
+ * A timer may be given some slack, by which it is allowed to fire late. The
+ * time it fires at is then rounded within that slack to the coarsest
+ * boundary possible, so timers whose windows overlap tend to land on the
+ * same tick and share one wakeup.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Longest interval, in ms, that a timer can be armed for (about 4.6 hours)
+#define TWHEEL_MAX_MS ((1 << 24) - (1 << 16))
+
+typedef void (*twheel_fn_t)(void *arg);
+
+typedef struct twheel_timer {
+  struct twheel_timer *next;
+  struct twheel_timer **pprev;  // NULL when the timer is not armed
+  uint32_t expires;             // in wheel ticks, with the slack applied
+  uint32_t due;                 // in wheel ticks, without it
+  uint32_t period;              // 0 for a single-shot timer
+  uint32_t slack;               // in ms
+  twheel_fn_t fn;
+  void *arg;
+} twheel_timer_t;
+
+#define TWHEEL_TIMER_INIT { NULL, NULL, 0, 0, 0, 0, NULL, NULL }
+
+void twheel_setfn(twheel_timer_t *t, twheel_fn_t fn, void *arg);
+
+// Arms t to fire after ms milliseconds (1 - TWHEEL_MAX_MS), and every ms
+// milliseconds after that if repeat is set. An armed timer is re-armed.
+void twheel_arm(twheel_timer_t *t, uint32_t ms, bool repeat);
+
+void twheel_disarm(twheel_timer_t *t);
+
+// The wheel's clock in ms, for working out deadlines. It wraps after 49
+// days, and keeps time across long gaps only while some timer is armed.
+uint32_t twheel_now(void);
+
+// Lets t fire up to ms milliseconds late, from the next time it is armed
+static inline void twheel_set_slack(twheel_timer_t *t, uint32_t ms) {
+  t->slack = ms;
+}
+
+static inline bool twheel_armed(const twheel_timer_t *t) {
+  return t->pprev != NULL;
+}
+
+#endif
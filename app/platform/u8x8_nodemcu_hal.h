@@ -14,10 +14,18 @@ typedef struct {
     u8x8_msg_cb hardware_display_cb, template_display_cb;
     int rfb_cb_ref;
     uint8_t fb_update_ongoing;
+    // delta mode: lines tagged with their position, sent only when changed
+    uint32_t *line_hash;    // hash of each line as last sent, NULL without delta
+    uint8_t *batch;         // lines waiting to be delivered together
+    uint16_t batch_size, batch_len;
+    int ws_ref;             // object whose send() gets the lines instead of rfb_cb_ref
   } overlay;
 } u8g2_nodemcu_t;
 
 
+// deliver the lines batched in delta mode
+void u8x8_d_fbrle_flush(u8g2_nodemcu_t *ext_u8g2);
+
 uint8_t u8x8_gpio_and_delay_nodemcu(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *arg_ptr);
 uint8_t u8x8_byte_nodemcu_i2c(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *arg_ptr);
 uint8_t u8x8_byte_nodemcu_spi(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *arg_ptr);
@@ -3,6 +3,8 @@
 #include <stdbool.h>
 #include "vfs.h"
 #include "vfs_int.h"
+#include "osapi.h"
+#include "pm/swtimer.h"
 
 #define LDRV_TRAVERSAL 0
 
@@ -72,197 +74,197 @@ static const char *normalize_path( const char *path )
 
 
 // ---------------------------------------------------------------------------
-// file system functions
+// path resolution
 //
-vfs_vol *vfs_mount( const char *name, int num )
+// A name is resolved by asking each file system in turn whether it holds
+// it.  Names without a drive belong to the current drive, so its file system
+// is remembered once found and such names go straight to it, as they are,
+// until vfs_chdir() changes the drive.  FATFS hands back a copy of the name,
+// which vfs_release() frees.
+//
+static vfs_fs_fns *current_fns;
+
+static vfs_fs_fns *vfs_realm( const char *name, char **outname, bool *copied )
 {
-  vfs_fs_fns *fs_fns;
   const char *normname = normalize_path( name );
-  char *outname;
+  vfs_fs_fns *fs_fns;
+
+  *copied = false;
+  if (normname[0] != '/' && current_fns) {
+    *outname = (char *)normname;
+    return current_fns;
+  }
 
 #ifdef BUILD_SPIFFS
-  if (fs_fns = myspiffs_realm( normname, &outname, FALSE )) {
-    return fs_fns->mount( outname, num );
+  if (fs_fns = myspiffs_realm( normname, outname, FALSE )) {
+    if (normname[0] != '/') current_fns = fs_fns;
+    return fs_fns;
   }
 #endif
 
 #ifdef BUILD_FATFS
-  if (fs_fns = myfatfs_realm( normname, &outname, FALSE )) {
-    vfs_vol *r = fs_fns->mount( outname, num );
-    free( outname );
-    return r;
+  if (fs_fns = myfatfs_realm( normname, outname, FALSE )) {
+    *copied = true;
+    if (normname[0] != '/') current_fns = fs_fns;
+    return fs_fns;
   }
 #endif
 
   return NULL;
 }
 
-int vfs_open( const char *name, const char *mode )
+static inline void vfs_release( char *outname, bool copied )
+{
+  if (copied) {
+    free( outname );
+  }
+}
+
+
+// ---------------------------------------------------------------------------
+// file system functions
+//
+vfs_vol *vfs_mount( const char *name, int num )
 {
-  vfs_fs_fns *fs_fns;
-  const char *normname = normalize_path( name );
   char *outname;
+  bool copied;
+  vfs_fs_fns *fs_fns = vfs_realm( name, &outname, &copied );
+  vfs_vol *r = NULL;
 
-#ifdef BUILD_SPIFFS
-  if (fs_fns = myspiffs_realm( normname, &outname, FALSE )) {
-    return (int)fs_fns->open( outname, mode );
+  if (fs_fns) {
+    r = fs_fns->mount( outname, num );
+    vfs_release( outname, copied );
   }
-#endif
+  return r;
+}
 
-#ifdef BUILD_FATFS
-  if (fs_fns = myfatfs_realm( normname, &outname, FALSE )) {
-    int r = (int)fs_fns->open( outname, mode );
-    free( outname );
-    return r;
+static int vfs_open_fs( const char *name, const char *mode );
+static int vfs_open_log( const char *name, const char *mode );
+
+int vfs_open( const char *name, const char *mode )
+{
+  if (strchr( mode, 'l' )) {
+    return vfs_open_log( name, mode );
   }
-#endif
+  return vfs_open_fs( name, mode );
+}
 
-  return 0;
+static int vfs_open_fs( const char *name, const char *mode )
+{
+  char *outname;
+  bool copied;
+  vfs_fs_fns *fs_fns = vfs_realm( name, &outname, &copied );
+  int r = 0;
+
+  if (fs_fns) {
+    r = (int)fs_fns->open( outname, mode );
+    vfs_release( outname, copied );
+  }
+  return r;
 }
 
 vfs_dir *vfs_opendir( const char *name )
 {
-  vfs_fs_fns *fs_fns;
-  const char *normname = normalize_path( name );
   char *outname;
+  bool copied;
+  vfs_fs_fns *fs_fns = vfs_realm( name, &outname, &copied );
+  vfs_dir *r = NULL;
 
-#ifdef BUILD_SPIFFS
-  if (fs_fns = myspiffs_realm( normname, &outname, FALSE )) {
-    return fs_fns->opendir( outname );
+  if (fs_fns) {
+    r = fs_fns->opendir( outname );
+    vfs_release( outname, copied );
   }
-#endif
+  return r;
+}
 
-#ifdef BUILD_FATFS
-  if (fs_fns = myfatfs_realm( normname, &outname, FALSE )) {
-    vfs_dir *r = fs_fns->opendir( outname );
-    free( outname );
-    return r;
-  }
-#endif
+int32_t vfs_readdir_batch( vfs_dir *dd, struct vfs_stat *buf, int32_t max )
+{
+  int32_t n = 0;
 
-  return NULL;
+  while (n < max && dd->fns->readdir( dd, &buf[n] ) == VFS_RES_OK) {
+    n++;
+  }
+  return n;
 }
 
 int32_t vfs_stat( const char *name, struct vfs_stat *buf )
 {
-  vfs_fs_fns *fs_fns;
-  const char *normname = normalize_path( name );
   char *outname;
+  bool copied;
+  vfs_fs_fns *fs_fns = vfs_realm( name, &outname, &copied );
+  int32_t r = VFS_RES_ERR;
 
-#ifdef BUILD_SPIFFS
-  if (fs_fns = myspiffs_realm( normname, &outname, FALSE )) {
-    return fs_fns->stat( outname, buf );
-  }
-#endif
-
-#ifdef BUILD_FATFS
-  if (fs_fns = myfatfs_realm( normname, &outname, FALSE )) {
-    int32_t r = fs_fns->stat( outname, buf );
-    free( outname );
-    return r;
+  if (fs_fns) {
+    r = fs_fns->stat( outname, buf );
+    vfs_release( outname, copied );
   }
-#endif
-
-  return VFS_RES_ERR;
+  return r;
 }
 
 int32_t vfs_remove( const char *name )
 {
-  vfs_fs_fns *fs_fns;
-  const char *normname = normalize_path( name );
   char *outname;
+  bool copied;
+  vfs_fs_fns *fs_fns = vfs_realm( name, &outname, &copied );
+  int32_t r = VFS_RES_ERR;
 
-#ifdef BUILD_SPIFFS
-  if (fs_fns = myspiffs_realm( normname, &outname, FALSE )) {
-    return fs_fns->remove( outname );
+  if (fs_fns) {
+    r = fs_fns->remove( outname );
+    vfs_release( outname, copied );
   }
-#endif
-
-#ifdef BUILD_FATFS
-  if (fs_fns = myfatfs_realm( normname, &outname, FALSE )) {
-    int32_t r = fs_fns->remove( outname );
-    free( outname );
-    return r;
-  }
-#endif
-
-  return VFS_RES_ERR;
+  return r;
 }
 
 int32_t vfs_rename( const char *oldname, const char *newname )
 {
-  vfs_fs_fns *fs_fns;
-  const char *normoldname = normalize_path( oldname );
-  const char *normnewname = normalize_path( newname );
   char *oldoutname, *newoutname;
-
-#ifdef BUILD_SPIFFS
-  if (myspiffs_realm( normoldname, &oldoutname, FALSE )) {
-    if (fs_fns = myspiffs_realm( normnewname, &newoutname, FALSE )) {
-      return fs_fns->rename( oldoutname, newoutname );
-    }
-  }
-#endif
-
-#ifdef BUILD_FATFS
-  if (myfatfs_realm( normoldname, &oldoutname, FALSE )) {
-    if (fs_fns = myfatfs_realm( normnewname, &newoutname, FALSE )) {
-      int32_t r = fs_fns->rename( oldoutname, newoutname );
-      free( oldoutname );
-      free( newoutname );
-      return r;
+  bool oldcopied, newcopied;
+  vfs_fs_fns *fs_fns = vfs_realm( oldname, &oldoutname, &oldcopied );
+  int32_t r = -1;
+
+  if (fs_fns) {
+    // both names must be on the same file system
+    vfs_fs_fns *new_fns = vfs_realm( newname, &newoutname, &newcopied );
+    if (new_fns) {
+      if (new_fns == fs_fns) {
+        r = fs_fns->rename( oldoutname, newoutname );
+      }
+      vfs_release( newoutname, newcopied );
     }
-    free( oldoutname );
+    vfs_release( oldoutname, oldcopied );
   }
-#endif
-
-  return -1;
+  return r;
 }
 
 int32_t vfs_mkdir( const char *name )
 {
-  vfs_fs_fns *fs_fns;
-  const char *normname = normalize_path( name );
   char *outname;
-
-#ifdef BUILD_SPIFFS
-  // not supported
-#endif
-
-#ifdef BUILD_FATFS
-  if (fs_fns = myfatfs_realm( normname, &outname, FALSE )) {
-    int32_t r = fs_fns->mkdir( outname );
-    free( outname );
-    return r;
+  bool copied;
+  vfs_fs_fns *fs_fns = vfs_realm( name, &outname, &copied );
+  int32_t r = VFS_RES_ERR;
+
+  if (fs_fns) {
+    // not supported by SPIFFS
+    if (fs_fns->mkdir) {
+      r = fs_fns->mkdir( outname );
+    }
+    vfs_release( outname, copied );
   }
-#endif
-
-  return VFS_RES_ERR;
+  return r;
 }
 
 int32_t vfs_fsinfo( const char *name, uint32_t *total, uint32_t *used )
 {
-  vfs_fs_fns *fs_fns;
   char *outname;
+  bool copied;
+  vfs_fs_fns *fs_fns = vfs_realm( name ? name : "", &outname, &copied );  // NULL for current drive
+  int32_t r = VFS_RES_ERR;
 
-  if (!name) name = "";  // current drive
-
-  const char *normname = normalize_path( name );
-
-#ifdef BUILD_SPIFFS
-  if (fs_fns = myspiffs_realm( normname, &outname, FALSE )) {
-    return fs_fns->fsinfo( total, used );
+  if (fs_fns) {
+    vfs_release( outname, copied );
+    r = fs_fns->fsinfo( total, used );
   }
-#endif
-
-#ifdef BUILD_FATFS
-  if (fs_fns = myfatfs_realm( normname, &outname, FALSE )) {
-    free( outname );
-    return fs_fns->fsinfo( total, used );
-  }
-#endif
-
-  return VFS_RES_ERR;
+  return r;
 }
 
 int32_t vfs_fscfg( const char *name, uint32_t *phys_addr, uint32_t *phys_size)
@@ -311,6 +313,9 @@ int32_t vfs_chdir( const char *path )
   char *outname;
   int ok = VFS_RES_ERR;
 
+  // the drive may change, find it again on the next relative name
+  current_fns = NULL;
+
 #if LDRV_TRAVERSAL
   // track dir level
   if (normpath[0] == '/') {
@@ -358,28 +363,16 @@ int32_t vfs_chdir( const char *path )
 
 int32_t vfs_errno( const char *name )
 {
-  vfs_fs_fns *fs_fns;
   char *outname;
+  bool copied;
+  vfs_fs_fns *fs_fns = vfs_realm( name ? name : "", &outname, &copied );  // NULL for current drive
+  int32_t r = VFS_RES_ERR;
 
-  if (!name) name = "";  // current drive
-
-  const char *normname = normalize_path( name );
-
-#ifdef BUILD_SPIFFS
-  if (fs_fns = myspiffs_realm( normname, &outname, FALSE )) {
-    return fs_fns->ferrno( );
-  }
-#endif
-
-#ifdef BUILD_FATFS
-  if (fs_fns = myfatfs_realm( normname, &outname, FALSE )) {
-    int32_t r = fs_fns->ferrno( );
-    free( outname );
-    return r;
+  if (fs_fns) {
+    r = fs_fns->ferrno( );
+    vfs_release( outname, copied );
   }
-#endif
-
-  return VFS_RES_ERR;
+  return r;
 }
 
 int32_t vfs_ferrno( int fd )
@@ -388,49 +381,21 @@ int32_t vfs_ferrno( int fd )
 
   if (f) {
     return f->fns->ferrno ? f->fns->ferrno( f ) : 0;
-  } else {
-    vfs_fs_fns *fs_fns;
-    const char *name = "";  // current drive
-    char *outname;
-
-#ifdef BUILD_SPIFFS
-    if (fs_fns = myspiffs_realm( name, &outname, FALSE )) {
-      return fs_fns->ferrno( );
-    }
-#endif
-
-#ifdef BUILD_FATFS
-    if (fs_fns = myfatfs_realm( name, &outname, FALSE )) {
-      int32_t r = fs_fns->ferrno( );
-      free( outname );
-      return r;
-    }
-#endif
   }
+  return vfs_errno( NULL );
 }
 
 
 void vfs_clearerr( const char *name )
 {
-  vfs_fs_fns *fs_fns;
   char *outname;
+  bool copied;
+  vfs_fs_fns *fs_fns = vfs_realm( name ? name : "", &outname, &copied );  // NULL for current drive
 
-  if (!name) name = "";  // current drive
-
-  const char *normname = normalize_path( name );
-
-#ifdef BUILD_SPIFFS
-  if (fs_fns = myspiffs_realm( normname, &outname, FALSE )) {
+  if (fs_fns) {
     fs_fns->clearerr ( );
+    vfs_release( outname, copied );
   }
-#endif
-
-#ifdef BUILD_FATFS
-  if (fs_fns = myfatfs_realm( normname, &outname, FALSE )) {
-    fs_fns->clearerr ( );
-    free( outname );
-  }
-#endif
 }
 
 const char *vfs_basename( const char *path )
@@ -450,6 +415,264 @@ const char *vfs_basename( const char *path )
 }
 
 
+// ---------------------------------------------------------------------------
+// log files
+//
+// A file opened in mode "al" or "a+l" collects appended data in RAM and
+// hands it to the file system in buffer sized chunks, so that a stream of
+// small records costs one index update per few pages instead of one per
+// write.  Data is written out when the buffer fills, when it has been held
+// for the flush interval, and on flush, close and any read or seek.
+//
+#ifndef VFS_LOG_BUF_SIZE
+#define VFS_LOG_BUF_SIZE 1024         // four SPIFFS pages
+#endif
+#ifndef VFS_LOG_INTERVAL
+#define VFS_LOG_INTERVAL 10000
+#endif
+
+struct vfs_logfile {
+  struct vfs_file vfs_file;           // fns point at vfs_log_fns
+  int fd;                             // underlying file, 0 after a failed rotation
+  char *buf;
+  uint16_t len;                       // bytes held in buf
+  uint16_t size;                      // capacity of buf
+  uint32_t interval;                  // ms data may stay in buf, 0 for no limit
+  uint32_t max_size;                  // rotate before growing past this, 0 never
+  uint8_t files;                      // old files kept as name.1 ... name.N
+  uint8_t update;                     // opened "a+"
+  os_timer_t timer;
+  char name[];
+};
+
+static vfs_file_fns vfs_log_fns;
+
+#define GET_LOGFILE(descr) \
+  struct vfs_logfile *lf = (struct vfs_logfile *)descr;
+
+static int32_t vfs_log_drain( struct vfs_logfile *lf )
+{
+  int32_t res = VFS_RES_OK;
+
+  os_timer_disarm( &lf->timer );
+  if (lf->len) {
+    if (!lf->fd || vfs_write( lf->fd, lf->buf, lf->len ) != lf->len) {
+      res = VFS_RES_ERR;
+    }
+    lf->len = 0;
+  }
+  return res;
+}
+
+static void vfs_log_timer_cb( void *arg )
+{
+  vfs_log_drain( (struct vfs_logfile *)arg );
+}
+
+// Start again in an empty file, shifting name -> name.1 -> ... -> name.N
+static int32_t vfs_log_rotate( struct vfs_logfile *lf )
+{
+  size_t n = strlen( lf->name ) + 5;
+  char *from = malloc( 2 * n ), *to = from + n;
+  int i;
+
+  if (!from) {
+    return VFS_RES_ERR;
+  }
+  vfs_close( lf->fd );
+  if (lf->files == 0) {
+    vfs_remove( lf->name );
+  }
+  for (i = lf->files; i > 0; i--) {
+    sprintf( to, "%s.%d", lf->name, i );
+    if (i == 1) {
+      strcpy( from, lf->name );
+    } else {
+      sprintf( from, "%s.%d", lf->name, i - 1 );
+    }
+    if (i == lf->files) {
+      vfs_remove( to );
+    }
+    vfs_rename( from, to );
+  }
+  free( from );
+  lf->fd = vfs_open_fs( lf->name, lf->update ? "a+" : "a" );
+  return lf->fd ? VFS_RES_OK : VFS_RES_ERR;
+}
+
+static int32_t vfs_log_close( const struct vfs_file *fd )
+{
+  GET_LOGFILE(fd);
+  int32_t res = vfs_log_drain( lf );
+
+  if (lf->fd && vfs_close( lf->fd ) != VFS_RES_OK) {
+    res = VFS_RES_ERR;
+  }
+  free( lf->buf );
+  free( lf );
+  return res;
+}
+
+static int32_t vfs_log_write( const struct vfs_file *fd, const void *ptr, size_t len )
+{
+  GET_LOGFILE(fd);
+  const char *p = (const char *)ptr;
+  size_t left = len;
+
+  if (!lf->fd) {
+    return VFS_RES_ERR;
+  }
+  if (lf->max_size && len) {
+    uint32_t size = vfs_size( lf->fd ) + lf->len;
+    // keep each write whole within one file
+    if (size && size + len > lf->max_size &&
+        (vfs_log_drain( lf ) != VFS_RES_OK || vfs_log_rotate( lf ) != VFS_RES_OK)) {
+      return VFS_RES_ERR;
+    }
+  }
+  while (left) {
+    size_t n = lf->size - lf->len;
+    if (n > left) {
+      n = left;
+    }
+    if (lf->len == 0 && lf->interval) {
+      os_timer_arm( &lf->timer, lf->interval, 0 );
+    }
+    memcpy( lf->buf + lf->len, p, n );
+    lf->len += n;
+    p += n;
+    left -= n;
+    if (lf->len == lf->size && vfs_log_drain( lf ) != VFS_RES_OK) {
+      return VFS_RES_ERR;
+    }
+  }
+  return len;
+}
+
+static int32_t vfs_log_read( const struct vfs_file *fd, void *ptr, size_t len )
+{
+  GET_LOGFILE(fd);
+  return vfs_log_drain( lf ) == VFS_RES_OK ? vfs_read( lf->fd, ptr, len ) : VFS_RES_ERR;
+}
+
+static int32_t vfs_log_lseek( const struct vfs_file *fd, int32_t off, int whence )
+{
+  GET_LOGFILE(fd);
+  return vfs_log_drain( lf ) == VFS_RES_OK ? vfs_lseek( lf->fd, off, whence ) : VFS_RES_ERR;
+}
+
+static int32_t vfs_log_eof( const struct vfs_file *fd )
+{
+  GET_LOGFILE(fd);
+  return vfs_log_drain( lf ) == VFS_RES_OK ? vfs_eof( lf->fd ) : VFS_RES_ERR;
+}
+
+static int32_t vfs_log_tell( const struct vfs_file *fd )
+{
+  GET_LOGFILE(fd);
+  return vfs_log_drain( lf ) == VFS_RES_OK ? vfs_tell( lf->fd ) : VFS_RES_ERR;
+}
+
+static int32_t vfs_log_flush( const struct vfs_file *fd )
+{
+  GET_LOGFILE(fd);
+  if (vfs_log_drain( lf ) != VFS_RES_OK) {
+    return VFS_RES_ERR;
+  }
+  return vfs_flush( lf->fd );
+}
+
+static uint32_t vfs_log_size( const struct vfs_file *fd )
+{
+  GET_LOGFILE(fd);
+  return vfs_size( lf->fd ) + lf->len;
+}
+
+static int32_t vfs_log_ferrno( const struct vfs_file *fd )
+{
+  GET_LOGFILE(fd);
+  return lf->fd ? vfs_ferrno( lf->fd ) : VFS_RES_ERR;
+}
+
+static vfs_file_fns vfs_log_fns = {
+  .close     = vfs_log_close,
+  .read      = vfs_log_read,
+  .write     = vfs_log_write,
+  .lseek     = vfs_log_lseek,
+  .eof       = vfs_log_eof,
+  .tell      = vfs_log_tell,
+  .flush     = vfs_log_flush,
+  .size      = vfs_log_size,
+  .ferrno    = vfs_log_ferrno
+};
+
+static int vfs_open_log( const char *name, const char *mode )
+{
+  struct vfs_logfile *lf;
+  int update;
+
+  if (strcmp( mode, "al" ) == 0 || strcmp( mode, "la" ) == 0) {
+    update = 0;
+  } else if (strcmp( mode, "a+l" ) == 0 || strcmp( mode, "al+" ) == 0) {
+    update = 1;
+  } else {
+    return 0;   // only appending modes can be buffered
+  }
+  if (!(lf = calloc( 1, sizeof( struct vfs_logfile ) + strlen( name ) + 1 ))) {
+    return 0;
+  }
+  if (!(lf->buf = malloc( VFS_LOG_BUF_SIZE ))) {
+    free( lf );
+    return 0;
+  }
+  if (!(lf->fd = vfs_open_fs( name, update ? "a+" : "a" ))) {
+    free( lf->buf );
+    free( lf );
+    return 0;
+  }
+  lf->vfs_file.fs_type = ((vfs_file *)lf->fd)->fs_type;
+  lf->vfs_file.fns = &vfs_log_fns;
+  lf->size = VFS_LOG_BUF_SIZE;
+  lf->interval = VFS_LOG_INTERVAL;
+  lf->update = update;
+  strcpy( lf->name, name );
+  os_timer_setfn( &lf->timer, vfs_log_timer_cb, lf );
+  SWTIMER_REG_CB( vfs_log_timer_cb, SWTIMER_RESUME );
+    //vfs_log_timer_cb only writes out buffered data, resuming it is harmless
+  return (int)lf;
+}
+
+int32_t vfs_logcfg( int fd, uint32_t buf_size, uint32_t interval, uint32_t max_size, uint8_t files )
+{
+  vfs_file *f = (vfs_file *)fd;
+  struct vfs_logfile *lf = (struct vfs_logfile *)fd;
+
+  if (!f || f->fns != &vfs_log_fns || buf_size == 0 || buf_size > UINT16_MAX) {
+    return VFS_RES_ERR;
+  }
+  if (files && strlen( vfs_basename( lf->name ) ) + 1 + (files < 10 ? 1 : files < 100 ? 2 : 3) >
+               FS_OBJ_NAME_LEN) {
+    return VFS_RES_ERR;   // no room for the suffix of rotated files
+  }
+  if (vfs_log_drain( lf ) != VFS_RES_OK) {
+    return VFS_RES_ERR;
+  }
+  if (buf_size != lf->size) {
+    char *buf = malloc( buf_size );
+    if (!buf) {
+      return VFS_RES_ERR;
+    }
+    free( lf->buf );
+    lf->buf = buf;
+    lf->size = buf_size;
+  }
+  lf->interval = interval;
+  lf->max_size = max_size;
+  lf->files = files;
+  return VFS_RES_OK;
+}
+
+
 // ---------------------------------------------------------------------------
 // supplementary functions
 //
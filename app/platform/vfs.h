@@ -108,6 +108,13 @@ static inline int32_t vfs_closedir( vfs_dir *dd ) { return dd->fns->close( dd );
 //   Returns: VFS_RES_OK if next item found, otherwise VFS_RES_ERR
 static inline int32_t vfs_readdir( vfs_dir *dd, struct vfs_stat *buf ) { return dd->fns->readdir( dd, buf ); }
 
+// vfs_readdir_batch - read up to max directory items
+//   dd: dir descriptor
+//   buf:  pre-allocated array of max stat structures to be filled in
+//   max: number of items wanted
+//   Returns: number of items read, less than max at the end of the directory
+int32_t vfs_readdir_batch( vfs_dir *dd, struct vfs_stat *buf, int32_t max );
+
 // ---------------------------------------------------------------------------
 // volume functions
 //
@@ -129,10 +136,19 @@ vfs_vol  *vfs_mount( const char *name, int num );
 
 // vfs_open - open file
 //   name: file name
-//   mode: open mode
+//   mode: open mode, "al" or "a+l" buffer appends in RAM, see vfs_logcfg
 //   Returns: File descriptor, or NULL in case of error
 int vfs_open( const char *name, const char *mode );
 
+// vfs_logcfg - set the write policy of a file opened with an "l" mode
+//   fd: file descriptor
+//   buf_size: bytes collected before they are written out
+//   interval: ms buffered data may wait to be written, 0 for no limit
+//   max_size: rotate the file before it grows past this size, 0 never
+//   files: number of rotated files kept as name.1 ... name.N, 0 discards
+//   Returns: VFS_RES_OK, or VFS_RES_ERR in case of error
+int32_t vfs_logcfg( int fd, uint32_t buf_size, uint32_t interval, uint32_t max_size, uint8_t files );
+
 // vfs_opendir - open directory
 //   name: dir name
 //   Returns: Directory descriptor, or NULL in case of error
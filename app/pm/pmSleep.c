@@ -1,5 +1,6 @@
 #include <pm/pmSleep.h>
 #ifdef  PMSLEEP_ENABLE
+#include "hw_timer.h"
 #define STRINGIFY_VAL(x) #x
 #define STRINGIFY(x) STRINGIFY_VAL(x)
 
@@ -19,6 +20,19 @@ static uint8 autosleep_setting_temp = 0;
 static os_timer_t null_mode_check_timer;
 static pmSleep_param_t current_config;
 
+// Automatic idle sleep. The wakeup takes a few ms, so the sleep ends this
+// much ahead of the next timer.
+#define AUTOSLEEP_WAKE_MS 5
+#define AUTOSLEEP_FRC2_TICKS_PER_MS 312
+static pmSleep_autosleep_param_t autosleep_config;
+static pmSleep_autosleep_stats_t autosleep_stats;
+static bool autosleep_enabled = false;
+static bool autosleep_sleeping = false;
+static bool autosleep_null_mode_flag = false;
+static uint32 autosleep_rtc_start;
+static uint32 autosleep_rtc_cal;
+static os_timer_t autosleep_probe_timer;
+
 
 /*  INTERNAL FUNCTION DECLARATIONS  */
 static void suspend_all_timers(void);
@@ -27,6 +41,8 @@ static void resume_all_timers(void);
 static inline void register_lua_cb(lua_State* L,int* cb_ref);
 static void resume_cb(void);
 static void wifi_suspended_timer_cb(int arg);
+static void autosleep_probe_cb(void* arg);
+static void autosleep_resume_cb(void);
 
 /*  INTERNAL FUNCTIONS  */
 
@@ -46,12 +62,16 @@ static void resume_all_timers(void){
   return;
 }
 
+static bool uart_tx_idle(void){
+  return (READ_PERI_REG(UART_STATUS(0)) & (UART_TXFIFO_CNT<<UART_TXFIFO_CNT_S)) == 0 &&
+         (READ_PERI_REG(UART_STATUS(1)) & (UART_TXFIFO_CNT<<UART_TXFIFO_CNT_S)) == 0;
+}
+
 static void null_mode_check_timer_cb(void* arg){
   if (wifi_get_opmode() == NULL_MODE){
     //check if uart 0 tx buffer is empty and uart 1 tx buffer is empty
     if(current_config.sleep_mode == LIGHT_SLEEP_T){
-      if((READ_PERI_REG(UART_STATUS(0)) & (UART_TXFIFO_CNT<<UART_TXFIFO_CNT_S)) == 0 &&
-         (READ_PERI_REG(UART_STATUS(1)) & (UART_TXFIFO_CNT<<UART_TXFIFO_CNT_S)) == 0){
+      if(uart_tx_idle()){
         os_timer_disarm(&null_mode_check_timer);
         suspend_all_timers();
         //Ensure UART 0/1 TX FIFO is clear
@@ -153,8 +173,132 @@ static void wifi_suspended_timer_cb(int arg){
   }
 }
 
+static void autosleep_probe_arm(uint32 ms){
+  os_timer_disarm(&autosleep_probe_timer);
+  os_timer_arm(&autosleep_probe_timer, ms, 0);
+}
+
+//the task dispatcher calls this each time it has emptied the task queues
+static void autosleep_idle_hook(void){
+  if(!autosleep_sleeping){
+    autosleep_probe_arm(1);
+  }
+}
+
+//ms until the first armed timer other than the probe is due
+static uint32 autosleep_idle_ms(void){
+  uint32 frc2_count = RTC_REG_READ(FRC2_COUNT_ADDRESS);
+  for(os_timer_t* timer_ptr = timer_list; timer_ptr != NULL; timer_ptr = timer_ptr->timer_next){
+    if(timer_ptr != &autosleep_probe_timer){
+      int32 ticks = (int32)(timer_ptr->timer_expire - frc2_count);
+      return ticks > 0 ? ticks / AUTOSLEEP_FRC2_TICKS_PER_MS : 0;
+    }
+  }
+  return PMSLEEP_SLEEP_MAX_TIME / 1000;
+}
+
+static void autosleep_probe_cb(void* arg){
+  if(!autosleep_enabled || autosleep_sleeping || !platform_task_queues_empty()){
+    return; //the dispatcher probes again once the queues are empty
+  }
+  //WiFi, a running hardware timer or a forced sleep already underway keep the CPU awake
+  if(wifi_get_opmode() != NULL_MODE || pmSleep_get_state() != PMSLEEP_AWAKE || platform_hw_timer_in_use()){
+    autosleep_probe_arm(autosleep_config.min_idle_ms);
+    return;
+  }
+  if(!uart_tx_idle()){
+    autosleep_probe_arm(2);
+    return;
+  }
+  uint32 idle_ms = autosleep_idle_ms();
+  if(idle_ms < autosleep_config.min_idle_ms){
+    //look again once the timer which is due first has run
+    autosleep_probe_arm(idle_ms + 1);
+    return;
+  }
+
+  PMSLEEP_DBG("idle for %d ms", idle_ms);
+  if(get_fpm_auto_sleep_flag() == 1){
+    autosleep_null_mode_flag = true;
+    wifi_fpm_auto_sleep_set_in_null_mode(0);
+  }
+  wifi_fpm_set_sleep_type(LIGHT_SLEEP_T);
+  wifi_fpm_open();
+  if(autosleep_config.wake_pin != 255){
+    GPIO_DIS_OUTPUT(pin_num[autosleep_config.wake_pin]);
+    PIN_FUNC_SELECT(pin_mux[autosleep_config.wake_pin], pin_func[autosleep_config.wake_pin]);
+    wifi_enable_gpio_wakeup(pin_num[autosleep_config.wake_pin], autosleep_config.int_type);
+  }
+  wifi_fpm_set_wakeup_cb(autosleep_resume_cb);
+
+  autosleep_sleeping = true;
+  autosleep_rtc_cal = system_rtc_clock_cali_proc();
+  autosleep_rtc_start = system_get_rtc_time();
+  suspend_all_timers();
+  sint8 retval = wifi_fpm_do_sleep((idle_ms - AUTOSLEEP_WAKE_MS) * 1000);
+  if(retval != 0){
+    PMSLEEP_ERR("wifi_fpm_do_sleep returned %d", retval);
+    autosleep_resume_cb();
+  }
+}
+
+// C callback for waking from an automatic idle sleep
+static void autosleep_resume_cb(void){
+  extern void swtmr_resume_timers_after(uint32 slept_us);
+
+  wifi_fpm_close();
+  if(autosleep_config.wake_pin != 255){
+    gpio_pin_wakeup_disable();
+  }
+  if(autosleep_null_mode_flag){
+    wifi_fpm_auto_sleep_set_in_null_mode(1);
+    autosleep_null_mode_flag = false;
+  }
+
+  //the RTC clock keeps running through the sleep, unlike FRC2 which the timers are counted in
+  uint32 slept_us = (uint32)(((uint64)(system_get_rtc_time() - autosleep_rtc_start) * autosleep_rtc_cal) >> 12);
+  swtmr_resume_timers_after(slept_us);
+  autosleep_sleeping = false;
+  autosleep_stats.sleeps++;
+  autosleep_stats.slept_ms += slept_us / 1000;
+  PMSLEEP_DBG("slept for %d us", slept_us);
+
+  if(autosleep_config.resume_cb_ptr != NULL){
+    autosleep_config.resume_cb_ptr(slept_us / 1000);
+  }
+  if(autosleep_enabled){
+    autosleep_probe_arm(1);
+  }
+}
+
 /*  EXTERNAL FUNCTIONS  */
 
+//this function makes the ESP8266 enter light sleep by itself whenever it is idle for long enough
+void pmSleep_autosleep_enable(pmSleep_autosleep_param_t *cfg){
+  memcpy(&autosleep_config, cfg, sizeof(autosleep_config));
+  os_timer_disarm(&autosleep_probe_timer);
+  os_timer_setfn(&autosleep_probe_timer, autosleep_probe_cb, NULL);
+    //The probe is not registered with SWTIMER_REG_CB, it is left out of the idle time and re-armed on wakeup
+  autosleep_enabled = true;
+  platform_task_set_idle_hook(autosleep_idle_hook);
+  autosleep_probe_arm(1);
+}
+
+void pmSleep_autosleep_disable(void){
+  autosleep_enabled = false;
+  platform_task_set_idle_hook(NULL);
+  os_timer_disarm(&autosleep_probe_timer);
+}
+
+bool pmSleep_autosleep_enabled(void){
+  return autosleep_enabled;
+}
+
+void pmSleep_autosleep_get_stats(pmSleep_autosleep_stats_t *stats){
+  *stats = autosleep_stats;
+}
+
+
 //this function executes the application developer's Lua callback
 void pmSleep_execute_lua_cb(int* cb_ref){
   if (*cb_ref != LUA_NOREF){
@@ -98,6 +98,7 @@ static task_handle_t cb_register_task_id = 0; //variable to hold task id for tas
 //void swtmr_cb_register(void* timer_cb_ptr, uint8 resume_policy);
 static void add_to_reg_queue(void* timer_cb_ptr, uint8 suspend_policy);
 static void process_cb_register_queue(task_param_t param, uint8 priority);
+void swtmr_resume_timers_after(uint32 slept_us);
 
 #include <pm/swtimer.h>
 
@@ -254,6 +255,13 @@ void swtmr_suspend_timers(){
 }
 
 void swtmr_resume_timers(){
+  swtmr_resume_timers_after(0);
+}
+
+/* After a light sleep of known length, the time slept is taken off what was left of each timer, as FRC2
+ * does not count while the CPU is suspended.
+ */
+void swtmr_resume_timers_after(uint32 slept_us){
   lua_State* L = lua_getstate();
 
   //get swtimer table
@@ -279,6 +287,7 @@ void swtmr_resume_timers(){
   lua_pop(L, 1); //pop swtimer table from stack
 
   volatile uint32 frc2_count = RTC_REG_READ(FRC2_COUNT_ADDRESS);
+  uint32 slept_ticks = (uint32)(((uint64)slept_us * 5) / 16); // 1 tick = 3.2 us
 
   //this section does the actual resuming of the suspended timer(s)
   while(suspended_timer_list_ptr != NULL){
@@ -287,8 +296,18 @@ void swtmr_resume_timers(){
     //the pointer to next suspended timer must be saved, the current suspended timer will be removed from the list
     os_timer_t* next_suspended_timer_ptr = suspended_timer_list_ptr->timer_next;
 
+    if(suspended_timer_list_ptr->timer_expire > slept_ticks + 2)
+      suspended_timer_list_ptr->timer_expire -= slept_ticks;
+    else
+      suspended_timer_list_ptr->timer_expire = 2;
     suspended_timer_list_ptr->timer_expire += frc2_count;
 
+    if(timer_list == NULL){
+      //timer_list is empty, the suspended timer becomes its only entry
+      suspended_timer_list_ptr->timer_next = NULL;
+      timer_list = suspended_timer_list_ptr;
+    }
+
     //traverse timer_list to determine where to insert suspended timer
     while(timer_list_ptr != NULL){
       if(suspended_timer_list_ptr->timer_expire > timer_list_ptr->timer_expire){
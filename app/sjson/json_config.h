@@ -1,7 +1,7 @@
 #ifndef __JSON_CONFIG_H__
 #define __JSON_CONFIG_H__
 
-#define JSONSL_STATE_USER_FIELDS        int lua_object_ref; int used_count;
+#define JSONSL_STATE_USER_FIELDS        int lua_object_ref; int used_count; unsigned int proj;
 #define JSONSL_NO_JPR
 
 #endif
@@ -8,9 +8,12 @@
 #include "user_interface.h"
 #endif
 
-// Turn off stats
-#define SPIFFS_CACHE_STATS 	    0
-#define SPIFFS_GC_STATS             0
+// Cache and GC stats are reported by file.stats()
+#define SPIFFS_CACHE_STATS 	    1
+#define SPIFFS_GC_STATS             1
+#ifndef NODEMCU_SPIFFS_NO_INCLUDE
+#define SPIFFS_GC_TIME_US()         system_get_time()
+#endif
 
 // Needs to align stuff
 #define SPIFFS_ALIGNED_OBJECT_INDEX_TABLES	1
@@ -25,4 +28,31 @@
 #define SPIFFS_SECURE_ERASE         0
 
 extern void myspiffs_set_automount();
+
+typedef struct {
+  uint32_t cache_pages;
+  uint32_t cache_hits;
+  uint32_t cache_misses;
+  uint32_t readahead_pages;
+  uint32_t readahead_hits;
+  uint32_t flash_reads;
+  uint32_t idle_gc_blocks;
+  uint32_t idle_gc_runs;
+  uint32_t gc_runs;
+  uint32_t gc_waits;
+  uint32_t gc_time_us;
+  uint32_t gc_max_us;
+  uint32_t written;
+  uint32_t flash_written;
+  uint32_t flash_erases;
+  uint32_t erase_count;
+} myspiffs_stats_t;
+
+extern void myspiffs_get_stats(myspiffs_stats_t *stats);
+
+// Fill age, if not NULL, with the erase age of each block, -1 for a block
+// never erased, and return the number of blocks.  erases, if not NULL, is
+// pointed at the erases of each block counted in RAM since the first call
+// asking for them, or NULL if there is no memory for the counts.
+extern int myspiffs_get_wear(int32_t *age, const uint8_t **erases);
 #endif
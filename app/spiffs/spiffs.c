@@ -18,6 +18,7 @@
  *      to be at the first valid location at the start of the partition.
  */
 #include "spiffs_nucleus.h"
+#include "pm/swtimer.h"
 
 static spiffs fs;
 
@@ -33,23 +34,113 @@ static void (*automounter)();
 static u8_t spiffs_work_buf[LOG_PAGE_SIZE*2];
 static u8_t spiffs_fds[sizeof(spiffs_fd) * SPIFFS_MAX_OPEN_FILES];
 #if SPIFFS_CACHE
-static u8_t myspiffs_cache[20 + (LOG_PAGE_SIZE+20)*4];
+#ifndef SPIFFS_CACHE_PAGES
+#define SPIFFS_CACHE_PAGES 4
+#endif
+static u8_t myspiffs_cache[sizeof(spiffs_cache) +
+                           (sizeof(spiffs_cache_page) + LOG_PAGE_SIZE) * SPIFFS_CACHE_PAGES];
+#endif
+
+#ifndef SPIFFS_READ_AHEAD_PAGES
+#define SPIFFS_READ_AHEAD_PAGES 0
+#endif
+#if SPIFFS_READ_AHEAD_PAGES == 1
+#error "SPIFFS_READ_AHEAD_PAGES must be 0 or at least 2"
+#endif
+
+static u32_t flash_reads;
+static u32_t flash_written;     // bytes programmed, file data and metadata alike
+static u32_t flash_erases;      // sectors erased
+static u32_t written;           // bytes written to files
+
+// Erases of each block since wear counting was started by myspiffs_get_wear()
+static u8_t *wear_erases;
+static u32_t wear_blocks;
+
+#ifdef SPIFFS_NAME_INDEX
+static void nidx_reset(void);
+#endif
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+static void snap_invalidate(bool erase);
+#endif
+
+#if SPIFFS_READ_AHEAD_PAGES
+/*
+ * SPIFFS reads file data one page at a time, so sequential access costs a
+ * flash read per 256 bytes.  When a page read follows on from the previous
+ * one, a window of pages is read in one go and later reads inside it are
+ * served from RAM.  Any write or erase touching the window drops it.
+ */
+static struct {
+  u32_t addr;           // flash address of the window
+  u32_t len;            // bytes held, 0 if empty
+  u32_t next;           // page address which continues a sequential run
+  u32_t hits;
+  u8_t buf[LOG_PAGE_SIZE * SPIFFS_READ_AHEAD_PAGES] __attribute__((aligned(4)));
+} ra;
+
+static void ra_drop(u32_t addr, u32_t size) {
+  if (ra.len && addr < ra.addr + ra.len && addr + size > ra.addr)
+    ra.len = 0;
+}
 #endif
 
 static s32_t my_spiffs_read(u32_t addr, u32_t size, u8_t *dst) {
+#if SPIFFS_READ_AHEAD_PAGES
+  u32_t page = addr & ~(LOG_PAGE_SIZE - 1);
+
+  if (ra.len && addr >= ra.addr && addr + size <= ra.addr + ra.len) {
+    memcpy(dst, ra.buf + (addr - ra.addr), size);
+    ra.hits++;
+    return SPIFFS_OK;
+  }
+  if (page == ra.next && size <= LOG_PAGE_SIZE &&
+      page + sizeof(ra.buf) <= fs.cfg.phys_addr + fs.cfg.phys_size) {
+    platform_flash_read(ra.buf, page, sizeof(ra.buf));
+    flash_reads++;
+    ra.addr = page;
+    ra.len = sizeof(ra.buf);
+    ra.next = page + sizeof(ra.buf);
+    memcpy(dst, ra.buf + (addr - page), size);
+    return SPIFFS_OK;
+  }
+  ra.next = page + LOG_PAGE_SIZE;
+#endif
   platform_flash_read(dst, addr, size);
+  flash_reads++;
   return SPIFFS_OK;
 }
 
 static s32_t my_spiffs_write(u32_t addr, u32_t size, u8_t *src) {
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+  snap_invalidate(FALSE);
+#endif
+#if SPIFFS_READ_AHEAD_PAGES
+  ra_drop(addr, size);
+#endif
   platform_flash_write(src, addr, size);
+  flash_written += size;
   return SPIFFS_OK;
 }
 
 static int erase_cnt = -1;  // If set to >=0 then erasing gives a ... feedback
 static s32_t my_spiffs_erase(u32_t addr, u32_t size) {
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+  snap_invalidate(TRUE);
+#endif
+#if SPIFFS_READ_AHEAD_PAGES
+  ra_drop(addr, size);
+#endif
   u32_t sect_first = platform_flash_get_sector_of_address(addr);
   u32_t sect_last = sect_first;
+  u32_t offs = addr - fs.cfg.phys_addr;
+  if (wear_erases && offs % fs.cfg.log_block_size == 0 &&
+      offs / fs.cfg.log_block_size < wear_blocks) {
+    u8_t *n = &wear_erases[offs / fs.cfg.log_block_size];
+    if (*n < 0xff)
+      (*n)++;
+  }
+  flash_erases++;
   while( sect_first <= sect_last ) {
     if (erase_cnt >= 0 && (erase_cnt++ & 0xF) == 0) {
       dbg_printf(".");
@@ -76,6 +167,185 @@ void myspiffs_check_callback(spiffs_check_type type, spiffs_check_report report,
  *
  * Returns  TRUE if FS was found.
  */
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+/*
+ * Mounting scans the object lookup pages of every block to count the free
+ * and deleted pages and to find the highest erase count.  Each time files
+ * are closed or the file system is unmounted, those counts are appended to
+ * a log kept in the SNAP_AREA after the file system, and SPIFFS clears the
+ * newest record before it next writes or erases anything.  A mount finding
+ * an intact newest record for the same layout and block erase counts uses
+ * it instead of scanning; after a crash or power loss mid-write the record
+ * has already been cleared and the normal scan runs.
+ *
+ * File systems formatted with this option are made SNAP_AREA smaller than
+ * their partition to leave room for the log; older ones are scanned.
+ */
+#define SNAP_MAGIC  0x534e4150    // "SNAP"
+#define SNAP_SECTOR INTERNAL_FLASH_SECTOR_SIZE
+#define SNAP_AREA   ALIGN         // sectors used in turn
+
+typedef struct {
+  u32_t magic;
+  u32_t seq;
+  u32_t geometry;       // hash of the layout and every block's erase count
+  u32_t erase_free;     // max_erase_count << 16 | free_blocks
+  u32_t p_allocated;
+  u32_t p_deleted;
+  u32_t cursor;         // free_cursor_block_ix << 16 | free_cursor_obj_lu_entry
+  u32_t check;          // hash of the words above
+  u32_t live;           // zeroed once out of date
+} snap_rec;
+
+static struct {
+  u32_t area;           // flash address of the log, 0 if there is none
+  u32_t sector;         // sector being filled
+  u32_t next;           // where the next record goes
+  u32_t live;           // address of the current record, 0 if none
+  u32_t seq;
+  u32_t geometry;
+  bool geometry_ok;     // erase counts unchanged since geometry was hashed
+} snap;
+
+static u32_t snap_hash(u32_t h, u32_t v) {
+  int i;
+  for (i = 0; i < 4; i++, v >>= 8)
+    h = (h ^ (v & 0xff)) * 16777619u;
+  return h;
+}
+
+static u32_t snap_check(const snap_rec *r) {
+  const u32_t *w = (const u32_t *)r;
+  u32_t h = 2166136261u;
+  while (w < &r->check)
+    h = snap_hash(h, *w++);
+  return h;
+}
+
+static u32_t snap_geometry(void) {
+  if (!snap.geometry_ok) {
+    u32_t h = snap_hash(2166136261u, fs.cfg.phys_addr);
+    spiffs_block_ix bix;
+    h = snap_hash(h, fs.cfg.phys_size);
+    h = snap_hash(h, fs.cfg.log_block_size);
+    for (bix = 0; bix < fs.block_count; bix++) {
+      spiffs_obj_id ec;
+      platform_flash_read(&ec, SPIFFS_ERASE_COUNT_PADDR(&fs, bix), sizeof(ec));
+      h = snap_hash(h, ec);
+    }
+    snap.geometry = h;
+    snap.geometry_ok = TRUE;
+  }
+  return snap.geometry;
+}
+
+// Find the log for the file system described by cfg, making room if formatting
+static void snap_place(spiffs_config *cfg, u32_t fs_end, bool force_create) {
+  if (force_create && cfg->phys_size >= SNAP_AREA + MIN_BLOCKS_FS * cfg->log_block_size)
+    cfg->phys_size -= SNAP_AREA;
+  snap.area = cfg->phys_addr + cfg->phys_size + SNAP_AREA <= fs_end ?
+              cfg->phys_addr + cfg->phys_size : 0;
+  snap.live = 0;
+  snap.geometry_ok = FALSE;
+}
+
+static void snap_invalidate(bool erase) {
+  if (snap.live) {
+    u32_t zero = 0;
+    platform_flash_write(&zero, snap.live + offsetof(snap_rec, live), sizeof(zero));
+    snap.live = 0;
+  }
+  if (erase)
+    snap.geometry_ok = FALSE;
+}
+
+static void snap_save(void) {
+  snap_rec r;
+
+  if (!snap.area || snap.live || fs.config_magic != SPIFFS_CONFIG_MAGIC)
+    return;
+  if (snap.next + sizeof(r) > snap.sector + SNAP_SECTOR) {
+    // sector full, erase the next one, which only holds older records
+    u32_t sector = snap.sector + SNAP_SECTOR;
+    if (sector >= snap.area + SNAP_AREA)
+      sector = snap.area;
+    if (platform_flash_erase_sector(platform_flash_get_sector_of_address(sector)) == PLATFORM_ERR)
+      return;
+    snap.sector = snap.next = sector;
+  }
+  r.magic = SNAP_MAGIC;
+  r.seq = ++snap.seq;
+  r.geometry = snap_geometry();
+  r.erase_free = (fs.max_erase_count << 16) | (fs.free_blocks & 0xffff);
+  r.p_allocated = fs.stats_p_allocated;
+  r.p_deleted = fs.stats_p_deleted;
+  r.cursor = (fs.free_cursor_block_ix << 16) | (fs.free_cursor_obj_lu_entry & 0xffff);
+  r.check = snap_check(&r);
+  r.live = 0xffffffff;
+  platform_flash_write(&r, snap.next, sizeof(r));
+  snap.live = snap.next;
+  snap.next += sizeof(r);
+}
+
+static void snap_erase(void) {
+  u32_t a;
+  for (a = snap.area; a && a < snap.area + SNAP_AREA; a += SNAP_SECTOR)
+    platform_flash_erase_sector(platform_flash_get_sector_of_address(a));
+  snap.sector = snap.next = snap.area;
+  snap.live = 0;
+  snap.seq = 0;
+}
+
+// Called by SPIFFS_mount() in place of the lookup scan, returns 1 on success
+int myspiffs_mount_restore(void *p) {
+  spiffs *f = (spiffs *)p;
+  snap_rec r, best;
+  u32_t a, best_at = 0;
+
+  if (f != &fs || !snap.area)
+    return 0;
+  // with no usable record the first save erases and starts the first sector
+  snap.sector = snap.area + SNAP_AREA - SNAP_SECTOR;
+  snap.next = snap.area + SNAP_AREA;
+  for (a = snap.area; a < snap.area + SNAP_AREA; a += SNAP_SECTOR) {
+    u32_t at, end = a + SNAP_SECTOR;
+    bool newest = FALSE;
+    for (at = a; at + sizeof(r) <= a + SNAP_SECTOR; at += sizeof(r)) {
+      platform_flash_read(&r, at, sizeof(r));
+      if (r.magic != SNAP_MAGIC) {
+        if (r.magic == 0xffffffff)
+          end = at;
+        break;
+      }
+      if (!best_at || (s32_t)(r.seq - best.seq) > 0) {
+        best = r;
+        best_at = at;
+        newest = TRUE;
+      }
+    }
+    if (newest) {
+      snap.sector = a;
+      snap.next = end;
+    }
+  }
+  if (!best_at)
+    return 0;
+  snap.seq = best.seq;
+  if (best.live != 0xffffffff || best.check != snap_check(&best) ||
+      best.geometry != snap_geometry())
+    return 0;
+
+  fs.max_erase_count = best.erase_free >> 16;
+  fs.free_blocks = best.erase_free & 0xffff;
+  fs.stats_p_allocated = best.p_allocated;
+  fs.stats_p_deleted = best.p_deleted;
+  fs.free_cursor_block_ix = best.cursor >> 16;
+  fs.free_cursor_obj_lu_entry = best.cursor & 0xffff;
+  snap.live = best_at;
+  return 1;
+}
+#endif
+
 static bool myspiffs_set_cfg(spiffs_config *cfg, bool force_create) {
   uint32 pt_start, pt_size, pt_end;
 
@@ -115,6 +385,10 @@ static bool myspiffs_set_cfg(spiffs_config *cfg, bool force_create) {
   }
 #endif
 
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+  snap_place(cfg, pt_end & ~(ALIGN - 1), force_create);
+#endif
+
   NODE_DBG("myspiffs set cfg block: %x  %x  %x  %x  %x  %x\n", pt_start, pt_end,
            cfg->phys_size, cfg->phys_addr, cfg->phys_size, cfg->log_block_size);
 
@@ -122,6 +396,108 @@ static bool myspiffs_set_cfg(spiffs_config *cfg, bool force_create) {
 }
 
 
+#ifndef SPIFFS_IDLE_GC_BLOCKS
+#define SPIFFS_IDLE_GC_BLOCKS 0
+#endif
+
+#if SPIFFS_IDLE_GC_BLOCKS
+/*
+ * SPIFFS garbage collects inside whichever write finds too few free blocks,
+ * and that write then pays for relocating pages and erasing blocks.  Instead,
+ * once the file system has been left alone for GC_IDLE_MS, reclaim one block
+ * per timer tick until SPIFFS_IDLE_GC_BLOCKS blocks are free, so foreground
+ * writes rarely have to erase.  Fully deleted blocks are erased first as they
+ * cost no page moves.
+ */
+#define GC_IDLE_MS 250
+#define GC_STEP_MS 10
+
+static os_timer_t gc_timer;
+static bool gc_armed;
+static u32_t gc_runs;
+
+static s32_t gc_free_pages(void) {
+  return (SPIFFS_PAGES_PER_BLOCK(&fs) - SPIFFS_OBJ_LOOKUP_PAGES(&fs)) * (fs.block_count - 2)
+         - fs.stats_p_allocated - fs.stats_p_deleted;
+}
+
+// Reclaim one block, returns TRUE if there may be more to do
+static bool gc_step(void) {
+  u32_t target = SPIFFS_IDLE_GC_BLOCKS;
+  spiffs_block_ix *cands;
+  int count;
+
+  if (!SPIFFS_mounted(&fs))
+    return FALSE;
+  if (target > fs.block_count / 2)
+    target = fs.block_count / 2;     // small partitions cannot keep as many
+  if (fs.free_blocks >= target || fs.cleaning)
+    return FALSE;
+
+  if (SPIFFS_gc_quick(&fs, 0) == SPIFFS_OK) {
+    gc_runs++;
+    return TRUE;
+  }
+  SPIFFS_clearerr(&fs);
+
+  // Moving live pages only pays when a block's worth of pages is deleted
+  if (fs.stats_p_deleted < SPIFFS_PAGES_PER_BLOCK(&fs) - SPIFFS_OBJ_LOOKUP_PAGES(&fs))
+    return FALSE;
+  if (spiffs_gc_find_candidate(&fs, &cands, &count, 0) < 0 || count == 0)
+    return FALSE;
+
+  s32_t before = gc_free_pages();
+  spiffs_block_ix cand = cands[0];
+  fs.cleaning = 1;
+  s32_t res = spiffs_gc_clean(&fs, cand);
+  fs.cleaning = 0;
+  if (res >= 0)
+    res = spiffs_gc_erase_page_stats(&fs, cand);
+  if (res >= 0)
+    res = spiffs_erase_block(&fs, cand);
+  if (res < 0)
+    return FALSE;
+#if SPIFFS_CACHE
+  u32_t i;
+  for (i = 0; i < SPIFFS_PAGES_PER_BLOCK(&fs); i++)
+    spiffs_cache_drop_page(&fs, SPIFFS_PAGE_FOR_BLOCK(&fs, cand) + i);
+#endif
+  gc_runs++;
+  return gc_free_pages() > before;
+}
+
+static void gc_timer_cb(void *arg) {
+  (void)arg;
+  gc_armed = gc_step();
+  if (gc_armed)
+    os_timer_arm(&gc_timer, GC_STEP_MS, 0);
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+  else if (SPIFFS_mounted(&fs))
+    snap_save();
+#endif
+}
+
+// Restart the idle period after every change to the file system
+static void gc_kick(void) {
+  os_timer_disarm(&gc_timer);
+  if (!gc_armed) {
+    os_timer_setfn(&gc_timer, gc_timer_cb, NULL);
+    SWTIMER_REG_CB(gc_timer_cb, SWTIMER_RESUME);
+      //gc_timer_cb reclaims space in the background, resuming it is harmless
+    gc_armed = TRUE;
+  }
+  os_timer_arm(&gc_timer, GC_IDLE_MS, 0);
+}
+
+static void gc_stop(void) {
+  os_timer_disarm(&gc_timer);
+  gc_armed = FALSE;
+}
+#define GC_KICK() gc_kick()
+#else
+#define GC_KICK()
+#endif
+
 static bool myspiffs_mount(bool force_mount) {
   STARTUP_COUNT;
   spiffs_config cfg;
@@ -146,11 +522,27 @@ static bool myspiffs_mount(bool force_mount) {
     0);
   NODE_DBG("mount res: %d, %d\n", res, fs.err_code);
   STARTUP_COUNT;
+#ifdef SPIFFS_NAME_INDEX
+  nidx_reset();
+#endif
   return res == SPIFFS_OK;
 }
 
 void myspiffs_unmount() {
+#if SPIFFS_IDLE_GC_BLOCKS
+  gc_stop();
+#endif
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+  bool mounted = SPIFFS_mounted(&fs);
+#endif
   SPIFFS_unmount(&fs);
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+  if (mounted)
+    snap_save();
+#endif
+#ifdef SPIFFS_NAME_INDEX
+  nidx_reset();
+#endif
 }
 
 // FS formatting function
@@ -165,6 +557,9 @@ int myspiffs_format( void )
   erase_cnt = 0;
   int status = SPIFFS_format(&fs);
   erase_cnt = -1;
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+  snap_erase();
+#endif
 
   return status < 0 ? 0 : myspiffs_mount(FALSE);
 }
@@ -318,6 +713,10 @@ static sint32_t myspiffs_vfs_close( const struct vfs_file *fd ) {
   GET_FILE_FH(fd);
 
   sint32_t res = SPIFFS_close( &fs, fh );
+  GC_KICK();
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+  snap_save();
+#endif
 
   // free descriptor memory
   free( (void *)fd );
@@ -337,6 +736,9 @@ static sint32_t myspiffs_vfs_write( const struct vfs_file *fd, const void *ptr,
   GET_FILE_FH(fd);
 
   sint32_t n = SPIFFS_write( &fs, fh, (void *)ptr, len );
+  GC_KICK();
+  if (n > 0)
+    written += n;
 
   return n >= 0 ? n : VFS_RES_ERR;
 }
@@ -419,6 +821,183 @@ static int fs_mode2flag(const char *mode){
   }
 }
 
+// ---------------------------------------------------------------------------
+// file name index
+//
+#ifdef SPIFFS_NAME_INDEX
+/*
+ * SPIFFS has no directory, so finding a file by name scans the object lookup
+ * pages of the whole partition.  This index maps a hash of each name to its
+ * object id and the page of its index header.  It is filled from one readdir
+ * pass on first use after a mount and kept in step by open, remove and
+ * rename, so a name missing from it is known not to exist.
+ *
+ * Header pages move when a file is written or garbage collected; an entry
+ * is only trusted after the page it names has been opened and its object id
+ * and name checked.  A stale entry falls back to the normal scan, which then
+ * refreshes it.  If the index cannot be allocated everything takes the
+ * normal path until the next mount.
+ */
+typedef struct {
+  u32_t hash;
+  spiffs_obj_id obj_id;
+  spiffs_page_ix pix;
+} nidx_slot;
+
+#define NIDX_FREE     0
+#define NIDX_DELETED  1
+#define NIDX_MIN_SIZE 32
+#define NIDX_STALE    -2   // nidx_find() could not decide
+
+static struct {
+  nidx_slot *slot;
+  u32_t size;              // power of 2
+  u32_t used;              // live and deleted slots
+  bool valid;
+  bool disabled;
+} nidx;
+
+static u32_t nidx_hash(const char *name) {
+  u32_t h = 2166136261u;   // FNV-1a
+  while (*name)
+    h = (h ^ (u8_t)*name++) * 16777619u;
+  return h > NIDX_DELETED ? h : h + 2;
+}
+
+static void nidx_drop(void) {
+  free(nidx.slot);
+  nidx.slot = NULL;
+  nidx.size = nidx.used = 0;
+  nidx.valid = FALSE;
+}
+
+static void nidx_reset(void) {
+  nidx_drop();
+  nidx.disabled = FALSE;
+}
+
+static bool nidx_put(u32_t hash, spiffs_obj_id obj_id, spiffs_page_ix pix);
+
+static bool nidx_grow(void) {
+  nidx_slot *old = nidx.slot;
+  u32_t i, old_size = nidx.size;
+  u32_t size = old_size ? old_size * 2 : NIDX_MIN_SIZE;
+
+  if (!(nidx.slot = calloc(size, sizeof(nidx_slot)))) {
+    nidx.slot = old;
+    return FALSE;
+  }
+  nidx.size = size;
+  nidx.used = 0;
+  for (i = 0; i < old_size; i++) {
+    if (old[i].hash > NIDX_DELETED)
+      nidx_put(old[i].hash, old[i].obj_id, old[i].pix);
+  }
+  free(old);
+  return TRUE;
+}
+
+static bool nidx_put(u32_t hash, spiffs_obj_id obj_id, spiffs_page_ix pix) {
+  if ((nidx.used + 1) * 4 > nidx.size * 3 && !nidx_grow())
+    return FALSE;
+  u32_t i = hash & (nidx.size - 1);
+  while (nidx.slot[i].hash > NIDX_DELETED)
+    i = (i + 1) & (nidx.size - 1);
+  if (nidx.slot[i].hash == NIDX_FREE)
+    nidx.used++;
+  nidx.slot[i].hash = hash;
+  nidx.slot[i].obj_id = obj_id;
+  nidx.slot[i].pix = pix;
+  return TRUE;
+}
+
+static bool nidx_ready(void) {
+  spiffs_DIR d;
+  struct spiffs_dirent e;
+
+  if (nidx.valid || nidx.disabled)
+    return nidx.valid;
+  nidx.disabled = TRUE;
+  if (!SPIFFS_opendir(&fs, "/", &d))
+    return FALSE;
+  nidx.valid = nidx_grow();
+  while (nidx.valid && SPIFFS_readdir(&d, &e)) {
+    if (!nidx_put(nidx_hash((const char *)e.name), e.obj_id, e.pix))
+      nidx_drop();
+  }
+  SPIFFS_closedir(&d);
+  nidx.disabled = !nidx.valid;
+  return nidx.valid;
+}
+
+/*
+ * Look up name and leave it open read-only on fh, with its stat in st.
+ * Returns the slot, -1 if the file does not exist, or NIDX_STALE if only
+ * a scan can tell.
+ */
+static int nidx_find(const char *name, spiffs_file *fh, spiffs_stat *st) {
+  u32_t hash = nidx_hash(name), mask = nidx.size - 1, i;
+  int res = -1;
+
+  for (i = hash & mask; nidx.slot[i].hash != NIDX_FREE; i = (i + 1) & mask) {
+    if (nidx.slot[i].hash != hash)
+      continue;
+    spiffs_file h = SPIFFS_open_by_page(&fs, nidx.slot[i].pix, SPIFFS_RDONLY, 0);
+    if (h > 0) {
+      if (SPIFFS_fstat(&fs, h, st) == SPIFFS_OK && st->obj_id == nidx.slot[i].obj_id &&
+          strcmp((const char *)st->name, name) == 0) {
+        *fh = h;
+        return i;
+      }
+      SPIFFS_close(&fs, h);
+    }
+    res = NIDX_STALE;
+  }
+  return res;
+}
+
+// Record where a file found by a scan or just created lives
+static void nidx_learn(spiffs_stat *st) {
+  u32_t hash = nidx_hash((const char *)st->name), mask = nidx.size - 1, i;
+
+  for (i = hash & mask; nidx.slot[i].hash != NIDX_FREE; i = (i + 1) & mask) {
+    if (nidx.slot[i].hash == hash && nidx.slot[i].obj_id == st->obj_id) {
+      nidx.slot[i].pix = st->pix;
+      return;
+    }
+  }
+  if (!nidx_put(hash, st->obj_id, st->pix))
+    nidx_drop();
+}
+#endif
+
+static spiffs_file myspiffs_open( const char *name, spiffs_flags flags ) {
+#ifdef SPIFFS_NAME_INDEX
+  if (nidx_ready()) {
+    spiffs_stat st;
+    spiffs_file fh;
+    int slot = nidx_find(name, &fh, &st);
+
+    if (slot >= 0) {
+      if (flags == SPIFFS_RDONLY)
+        return fh;
+      // reopen by page only once the page is known to hold this file
+      SPIFFS_close(&fs, fh);
+      return SPIFFS_open_by_page(&fs, st.pix, flags, 0);
+    }
+    if (slot == -1 && !(flags & SPIFFS_CREAT)) {
+      fs.err_code = SPIFFS_ERR_NOT_FOUND;
+      return SPIFFS_ERR_NOT_FOUND;
+    }
+    fh = SPIFFS_open(&fs, name, flags, 0);
+    if (fh > 0 && nidx.valid && SPIFFS_fstat(&fs, fh, &st) == SPIFFS_OK)
+      nidx_learn(&st);
+    return fh;
+  }
+#endif
+  return SPIFFS_open(&fs, name, flags, 0);
+}
+
 // ---------------------------------------------------------------------------
 // filesystem functions
 //
@@ -427,7 +1006,7 @@ static vfs_file *myspiffs_vfs_open( const char *name, const char *mode ) {
   int flags = fs_mode2flag( mode );
 
   if (fd = (struct myvfs_file *)malloc( sizeof( struct myvfs_file ) )) {
-    if (0 < (fd->fh = SPIFFS_open( &fs, name, flags, 0 ))) {
+    if (0 < (fd->fh = myspiffs_open( name, flags ))) {
       fd->vfs_file.fs_type = VFS_FS_SPIFFS;
       fd->vfs_file.fns     = &myspiffs_file_fns;
       return (vfs_file *)fd;
@@ -455,10 +1034,33 @@ static vfs_dir *myspiffs_vfs_opendir( const char *name ){
   return NULL;
 }
 
+static s32_t myspiffs_stat( const char *name, spiffs_stat *st ) {
+#ifdef SPIFFS_NAME_INDEX
+  if (nidx_ready()) {
+    spiffs_file fh;
+    int slot = nidx_find(name, &fh, st);
+
+    if (slot >= 0) {
+      SPIFFS_close(&fs, fh);
+      return SPIFFS_OK;
+    }
+    if (slot == -1) {
+      fs.err_code = SPIFFS_ERR_NOT_FOUND;
+      return SPIFFS_ERR_NOT_FOUND;
+    }
+    s32_t res = SPIFFS_stat(&fs, name, st);
+    if (res >= 0)
+      nidx_learn(st);
+    return res;
+  }
+#endif
+  return SPIFFS_stat(&fs, name, st);
+}
+
 static sint32_t myspiffs_vfs_stat( const char *name, struct vfs_stat *buf ) {
   spiffs_stat stat;
 
-  if (0 <= SPIFFS_stat( &fs, name, &stat )) {
+  if (0 <= myspiffs_stat( name, &stat )) {
     memset( buf, 0, sizeof( struct vfs_stat ) );
 
     // fill in supported stat entries
@@ -473,10 +1075,64 @@ static sint32_t myspiffs_vfs_stat( const char *name, struct vfs_stat *buf ) {
 }
 
 static sint32_t myspiffs_vfs_remove( const char *name ) {
+  GC_KICK();   // only restarts the idle period, the work is done later
+#ifdef SPIFFS_NAME_INDEX
+  if (nidx_ready()) {
+    spiffs_stat st;
+    spiffs_file fh;
+    int slot = nidx_find(name, &fh, &st), res;
+
+    if (slot == -1) {
+      fs.err_code = SPIFFS_ERR_NOT_FOUND;
+      return SPIFFS_ERR_NOT_FOUND;
+    }
+    if (slot >= 0) {
+      SPIFFS_close(&fs, fh);
+      fh = SPIFFS_open_by_page(&fs, st.pix, SPIFFS_RDWR, 0);
+      if (fh <= 0)
+        return fh;
+      res = SPIFFS_fremove(&fs, fh);
+      SPIFFS_close(&fs, fh);
+      if (res >= 0)
+        nidx.slot[slot].hash = NIDX_DELETED;
+      return res;
+    }
+    // the stale entry cannot be told apart from any others with this hash
+    res = SPIFFS_remove(&fs, name);
+    if (res >= 0)
+      nidx_drop();
+    return res;
+  }
+#endif
   return SPIFFS_remove( &fs, name );
 }
 
 static sint32_t myspiffs_vfs_rename( const char *oldname, const char *newname ) {
+  GC_KICK();
+#ifdef SPIFFS_NAME_INDEX
+  if (nidx_ready()) {
+    spiffs_stat st;
+    spiffs_file fh;
+    int slot = nidx_find(oldname, &fh, &st), res;
+
+    if (slot == -1) {
+      fs.err_code = SPIFFS_ERR_NOT_FOUND;
+      return SPIFFS_ERR_NOT_FOUND;
+    }
+    if (slot >= 0)
+      SPIFFS_close(&fs, fh);
+    res = SPIFFS_rename(&fs, oldname, newname);
+    if (res >= 0 && slot >= 0) {
+      // the object id survives a rename, the header page does not
+      nidx.slot[slot].hash = NIDX_DELETED;
+      if (!nidx_put(nidx_hash(newname), st.obj_id, 0))
+        nidx_drop();
+    } else if (res >= 0) {
+      nidx_drop();
+    }
+    return res;
+  }
+#endif
   return SPIFFS_rename( &fs, oldname, newname );
 }
 
@@ -512,6 +1168,62 @@ void myspiffs_set_automount(void (*mounter)()) {
   automounter = mounter;
 }
 
+void myspiffs_get_stats(myspiffs_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+#if SPIFFS_CACHE
+  stats->cache_pages = SPIFFS_CACHE_PAGES;
+  stats->cache_hits = fs.cache_hits;
+  stats->cache_misses = fs.cache_misses;
+#endif
+#if SPIFFS_READ_AHEAD_PAGES
+  stats->readahead_pages = SPIFFS_READ_AHEAD_PAGES;
+  stats->readahead_hits = ra.hits;
+#endif
+  stats->flash_reads = flash_reads;
+#if SPIFFS_IDLE_GC_BLOCKS
+  stats->idle_gc_blocks = SPIFFS_IDLE_GC_BLOCKS;
+  stats->idle_gc_runs = gc_runs;
+#endif
+#if SPIFFS_GC_STATS
+  stats->gc_runs = fs.stats_gc_runs;
+  stats->gc_waits = fs.stats_gc_waits;
+  stats->gc_time_us = fs.stats_gc_us;
+  stats->gc_max_us = fs.stats_gc_max_us;
+#endif
+  stats->written = written;
+  stats->flash_written = flash_written;
+  stats->flash_erases = flash_erases;
+  stats->erase_count = fs.max_erase_count;
+}
+
+int myspiffs_get_wear(int32_t *age, const uint8_t **erases) {
+  spiffs_block_ix bix;
+
+  if (!SPIFFS_mounted(&fs))
+    return 0;
+  if (erases) {
+    if (wear_blocks != fs.block_count) {
+      // counting again after the file system was formatted to another size
+      free(wear_erases);
+      wear_erases = (u8_t *)calloc(fs.block_count, 1);
+      wear_blocks = wear_erases ? fs.block_count : 0;
+    }
+    *erases = wear_erases;
+  }
+  for (bix = 0; age && bix < fs.block_count; bix++) {
+    spiffs_obj_id ec;
+    platform_flash_read(&ec, SPIFFS_ERASE_COUNT_PADDR(&fs, bix), sizeof(ec));
+    // blocks erased since, as the gc counts them for its erase age heuristic
+    if (ec == SPIFFS_OBJ_ID_FREE)
+      age[bix] = -1;
+    else if (fs.max_erase_count > ec)
+      age[bix] = fs.max_erase_count - ec;
+    else
+      age[bix] = SPIFFS_OBJ_ID_FREE - (ec - fs.max_erase_count);
+  }
+  return fs.block_count;
+}
+
 // ---------------------------------------------------------------------------
 // VFS interface functions
 //
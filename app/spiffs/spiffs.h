@@ -268,6 +268,10 @@ typedef struct spiffs_t {
 
 #if SPIFFS_GC_STATS
   u32_t stats_gc_runs;
+  // gc checks that had to collect, and the time they took
+  u32_t stats_gc_waits;
+  u32_t stats_gc_us;
+  u32_t stats_gc_max_us;
 #endif
 
 #if SPIFFS_CACHE
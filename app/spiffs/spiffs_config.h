@@ -16,6 +16,12 @@
 
 #include "user_config.h"
 
+#ifdef SPIFFS_MOUNT_SNAPSHOT
+// Restores the state normally found by the mount scan, see spiffs.c
+extern int myspiffs_mount_restore(void *fs);
+#define SPIFFS_MOUNT_RESTORE(fs) myspiffs_mount_restore(fs)
+#endif
+
 // compile time switches
 
 // Set generic spiffs debug output call.
@@ -118,6 +124,11 @@
 #define SPIFFS_GC_STATS                 1
 #endif
 
+// Microsecond clock timing the garbage collection for the gc statistics.
+#ifndef SPIFFS_GC_TIME_US
+#define SPIFFS_GC_TIME_US()             0
+#endif
+
 // Garbage collecting examines all pages in a block which and sums up
 // to a block score. Deleted pages normally gives positive score and
 // used pages normally gives a negative score (as these must be moved).
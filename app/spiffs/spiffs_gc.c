@@ -106,7 +106,7 @@ s32_t spiffs_gc_quick(
 
 // Checks if garbage collecting is necessary. If so a candidate block is found,
 // cleansed and erased
-s32_t spiffs_gc_check(
+static s32_t spiffs_gc_check_blocks(
     spiffs *fs,
     u32_t len) {
   s32_t res;
@@ -195,6 +195,27 @@ s32_t spiffs_gc_check(
   return res;
 }
 
+s32_t spiffs_gc_check(
+    spiffs *fs,
+    u32_t len) {
+#if SPIFFS_GC_STATS
+  u32_t runs = fs->stats_gc_runs;
+  u32_t start = SPIFFS_GC_TIME_US();
+  s32_t res = spiffs_gc_check_blocks(fs, len);
+  if (fs->stats_gc_runs != runs) {
+    u32_t us = SPIFFS_GC_TIME_US() - start;
+    fs->stats_gc_waits++;
+    fs->stats_gc_us += us;
+    if (us > fs->stats_gc_max_us) {
+      fs->stats_gc_max_us = us;
+    }
+  }
+  return res;
+#else
+  return spiffs_gc_check_blocks(fs, len);
+#endif
+}
+
 // Updates page statistics for a block that is about to be erased
 s32_t spiffs_gc_erase_page_stats(
     spiffs *fs,
@@ -131,7 +131,12 @@ s32_t SPIFFS_mount(spiffs *fs, spiffs_config *config, u8_t *work,
 
   fs->config_magic = SPIFFS_CONFIG_MAGIC;
 
+#ifdef SPIFFS_MOUNT_RESTORE
+  // a valid snapshot of the scan results saves scanning every block
+  res = SPIFFS_MOUNT_RESTORE(fs) ? SPIFFS_OK : spiffs_obj_lu_scan(fs);
+#else
   res = spiffs_obj_lu_scan(fs);
+#endif
   SPIFFS_API_CHECK_RES_UNLOCK(fs, res);
 
   SPIFFS_DBG("page index byte len:         "_SPIPRIi"\n", (u32_t)SPIFFS_CFG_LOG_PAGE_SZ(fs));
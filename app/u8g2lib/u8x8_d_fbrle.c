@@ -7,6 +7,7 @@
 #include "u8x8_nodemcu_hal.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 
 static const u8x8_display_info_t u8x8_fbrle_display_info =
@@ -50,6 +51,78 @@ struct fbrle_line
   struct fbrle_item items[0];
 };
 
+// A line in delta mode, covering pixels start_x to start_x + width - 1 of line y
+struct fbrle_delta
+{
+  uint8_t y;
+  uint8_t start_x;
+  uint8_t width;
+  struct fbrle_line line;
+};
+
+#define FBRLE_WS_BINARY 2
+
+static void fbrle_deliver( u8g2_nodemcu_t *ext_u8g2, const uint8_t *data, size_t len )
+{
+  lua_State *L = lua_getstate();
+
+  if (ext_u8g2->overlay.ws_ref != LUA_NOREF) {
+    // ws:send(data, websocket.BINARY)
+    lua_rawgeti( L, LUA_REGISTRYINDEX, ext_u8g2->overlay.ws_ref );
+    lua_getfield( L, -1, "send" );
+    lua_insert( L, -2 );
+    lua_pushlstring( L, (const char *)data, len );
+    lua_pushinteger( L, FBRLE_WS_BINARY );
+    luaL_pcallx( L, 3, 0 );
+  } else if (ext_u8g2->overlay.rfb_cb_ref != LUA_NOREF) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, ext_u8g2->overlay.rfb_cb_ref );
+    lua_pushlstring( L, (const char *)data, len );
+    luaL_pcallx( L, 1, 0 );
+  }
+}
+
+void u8x8_d_fbrle_flush( u8g2_nodemcu_t *ext_u8g2 )
+{
+  if (ext_u8g2->overlay.batch_len) {
+    // cleared first, a callback may draw again
+    uint16_t len = ext_u8g2->overlay.batch_len;
+    ext_u8g2->overlay.batch_len = 0;
+    fbrle_deliver( ext_u8g2, ext_u8g2->overlay.batch, len );
+  }
+}
+
+// FNV-1a, never 0, which marks a line not sent yet
+static uint32_t fbrle_hash( const uint8_t *data, size_t len )
+{
+  uint32_t h = 2166136261u;
+  while (len--)
+    h = (h ^ *data++) * 16777619u;
+  return h ? h : 1;
+}
+
+// Queue a line unless the remote end already shows it
+static void fbrle_delta_line( u8x8_t *u8x8, struct fbrle_delta *delta )
+{
+  u8g2_nodemcu_t *ext_u8g2 = (u8g2_nodemcu_t *)u8x8;
+  size_t len = sizeof( struct fbrle_delta ) + sizeof( struct fbrle_item ) * delta->line.num_valid;
+  uint32_t h = fbrle_hash( (const uint8_t *)delta, len );
+
+  if (delta->y < u8x8->display_info->tile_height * 8) {
+    if (ext_u8g2->overlay.line_hash[delta->y] == h)
+      return;
+    ext_u8g2->overlay.line_hash[delta->y] = h;
+  }
+
+  if (ext_u8g2->overlay.batch_len + len > ext_u8g2->overlay.batch_size)
+    u8x8_d_fbrle_flush( ext_u8g2 );
+  if (len > ext_u8g2->overlay.batch_size) {
+    fbrle_deliver( ext_u8g2, (const uint8_t *)delta, len );
+  } else {
+    memcpy( ext_u8g2->overlay.batch + ext_u8g2->overlay.batch_len, delta, len );
+    ext_u8g2->overlay.batch_len += len;
+  }
+}
+
 static uint8_t u8x8_d_fbrle(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *arg_ptr)
 {
   u8g2_nodemcu_t *ext_u8g2 = (u8g2_nodemcu_t *)u8x8;
@@ -76,12 +149,13 @@ static uint8_t u8x8_d_fbrle(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *ar
 
   case U8X8_MSG_DISPLAY_REFRESH:
     ext_u8g2->overlay.fb_update_ongoing = 0;
+    u8x8_d_fbrle_flush( ext_u8g2 );
     break;
 
   case U8X8_MSG_DISPLAY_DRAW_TILE:
     if (ext_u8g2->overlay.fb_update_ongoing == 0) {
       // tell rfb callback that a new framebuffer starts
-      if (ext_u8g2->overlay.rfb_cb_ref != LUA_NOREF) {
+      if (ext_u8g2->overlay.rfb_cb_ref != LUA_NOREF && ext_u8g2->overlay.ws_ref == LUA_NOREF) {
         // fire callback with nil argument
         lua_State *L = lua_getstate();
         lua_rawgeti( L, LUA_REGISTRYINDEX, ext_u8g2->overlay.rfb_cb_ref );
@@ -93,27 +167,29 @@ static uint8_t u8x8_d_fbrle(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *ar
     }
 
     {
-      // TODO: transport tile_y, needs structural change!
+      // the y position is only transported in delta mode
       uint8_t tile_x = ((u8x8_tile_t *)arg_ptr)->x_pos;
       tile_x *= 8;
       tile_x += u8x8->x_offset;
       uint8_t tile_w = ((u8x8_tile_t *)arg_ptr)->cnt * 8;
+      uint8_t tile_y = ((u8x8_tile_t *)arg_ptr)->y_pos * 8;
 
       size_t fbrle_line_size = sizeof( struct fbrle_line ) + sizeof( struct fbrle_item ) * (tile_w/2);
       int num_lines = 8; /*arg_val / (xwidth/8);*/
       uint8_t *buf = ((u8x8_tile_t *)arg_ptr)->tile_ptr;
 
-      struct fbrle_line *fbrle_line;
-      if (!(fbrle_line = (struct fbrle_line *)malloc( fbrle_line_size ))) {
+      struct fbrle_delta *delta;
+      if (!(delta = (struct fbrle_delta *)malloc( sizeof( struct fbrle_delta ) - sizeof( struct fbrle_line ) + fbrle_line_size ))) {
         break;
       }
+      struct fbrle_line *fbrle_line = &delta->line;
 
       for (int line = 0; line < num_lines; line++) {
         int start_run = -1;
         fbrle_line->num_valid = 0;
 
         for (int x = tile_x; x < tile_x+tile_w; x++) {
-          if (bit_at( buf, line, x ) == 0) {
+          if (bit_at( buf, line, x - tile_x ) == 0) {
             if (start_run >= 0) {
               // inside run, end it and enter result
               fbrle_line->items[fbrle_line->num_valid].start_x = start_run;
@@ -134,20 +210,21 @@ static uint8_t u8x8_d_fbrle(u8x8_t *u8x8, uint8_t msg, uint8_t arg_int, void *ar
         // active run?
         if (start_run >= 0 && fbrle_line->num_valid < tile_w/2) {
           fbrle_line->items[fbrle_line->num_valid].start_x = start_run;
-          fbrle_line->items[fbrle_line->num_valid++].len = tile_w - start_run;
+          fbrle_line->items[fbrle_line->num_valid++].len = tile_x + tile_w - start_run;
         }
 
         // line done, trigger callback
-        if (ext_u8g2->overlay.rfb_cb_ref != LUA_NOREF) {
-          lua_State *L = lua_getstate();
-
-          lua_rawgeti( L, LUA_REGISTRYINDEX, ext_u8g2->overlay.rfb_cb_ref );
-          lua_pushlstring( L, (const char *)fbrle_line, fbrle_line_size );
-          luaL_pcallx( L, 1, 0 );
+        if (ext_u8g2->overlay.line_hash) {
+          delta->y = tile_y + line;
+          delta->start_x = tile_x;
+          delta->width = tile_w;
+          fbrle_delta_line( u8x8, delta );
+        } else if (ext_u8g2->overlay.rfb_cb_ref != LUA_NOREF) {
+          fbrle_deliver( ext_u8g2, (const uint8_t *)fbrle_line, fbrle_line_size );
         }
       }
 
-      free( fbrle_line );
+      free( delta );
     }
     break;
 
@@ -36,6 +36,11 @@
  * Copyright (C) 1995-1998 Jean-loup Gailly and Mark Adler
  */
 #include <stdint.h>
+#include "uzlib.h"
+
+/* The unwind point and debug hook are shared by inflate and deflate */
+jmp_buf unwindAddr;
+int dbg_break(void) {return 1;}
 
 static const unsigned int tinf_crc32tab[16] = {
    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190,
@@ -60,3 +65,32 @@ uint32_t uzlib_crc32(const void *data, unsigned int length, uint32_t crc)
    // return value suitable for passing in next time, for final value invert it
    return crc/* ^ 0xffffffff*/;
 }
+
+/*
+ * Adler-32 checksum as used by the zlib format (RFC 1950). The sums are
+ * reduced every NMAX bytes, the most that cannot overflow 32 bits.
+ */
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552
+
+/* sum is previous value for incremental computation, 1 initially */
+uint32_t uzlib_adler32(const void *data, unsigned int length, uint32_t sum)
+{
+   const unsigned char *buf = (const unsigned char *)data;
+   uint32_t s1 = sum & 0xffff, s2 = sum >> 16;
+
+   while (length)
+   {
+      unsigned int n = length < ADLER_NMAX ? length : ADLER_NMAX;
+      length -= n;
+      while (n--)
+      {
+         s1 += *buf++;
+         s2 += s1;
+      }
+      s1 %= ADLER_BASE;
+      s2 %= ADLER_BASE;
+   }
+
+   return (s2 << 16) | s1;
+}
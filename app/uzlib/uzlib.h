@@ -47,6 +47,8 @@ extern jmp_buf unwindAddr;
 #define UZLIB_CHKSUM_ERROR  (-4)
 #define UZLIB_DICT_ERROR    (-5)
 #define UZLIB_MEMORY_ERROR  (-6)
+/* stream inflate: the input ran out part way through a step */
+#define UZLIB_NEED_INPUT     2
 
 /* checksum types */
 #define UZLIB_CHKSUM_NONE  0
@@ -70,8 +72,52 @@ int uzlib_inflate (uint8_t (*)(void), void (*)(uint8_t),
 int uzlib_compress (uint8_t **dest, uint32_t *destLen,
                     const uint8_t *src, uint32_t srcLen);
 
+/*
+ * Stream API
+ *
+ * Streams take their input in pieces of any size and pass their output
+ * to a callback as it is produced, so neither side of the conversion has
+ * to be held in RAM. Both use a dictionary of 2^windowBits bytes.
+ */
+
+#define UZLIB_FORMAT_RAW   0
+#define UZLIB_FORMAT_ZLIB  1
+#define UZLIB_FORMAT_GZIP  2
+
+#define UZLIB_FLUSH_NONE   0
+#define UZLIB_FLUSH_SYNC   1   /* end the output on a byte boundary */
+#define UZLIB_FLUSH_FINISH 2   /* end the stream and add the trailer */
+
+#define UZLIB_DEFLATE_MIN_WINDOW  9
+#define UZLIB_DEFLATE_MAX_WINDOW 14
+#define UZLIB_INFLATE_MIN_WINDOW  9
+#define UZLIB_INFLATE_MAX_WINDOW 15
+
+typedef void (*uzlib_out_fn)(void *ctx, const uint8_t *data, uint32_t len);
+
+typedef struct uzlib_deflate_stream UZLIB_DEFLATE_STREAM;
+typedef struct uzlib_inflate_stream UZLIB_INFLATE_STREAM;
+
+/* These return NULL if there is not enough memory */
+UZLIB_DEFLATE_STREAM *uzlib_deflate_new (int format, int windowBits);
+UZLIB_INFLATE_STREAM *uzlib_inflate_new (int format, int windowBits);
+
+/* Returns UZLIB_OK or an error */
+int uzlib_deflate_write (UZLIB_DEFLATE_STREAM *s, const uint8_t *src,
+                         uint32_t len, int flush, uzlib_out_fn out, void *ctx);
+
+/* Returns UZLIB_OK if more input is needed, UZLIB_DONE at the end of */
+/* the stream, or an error. Input after the end is a UZLIB_DATA_ERROR */
+int uzlib_inflate_write (UZLIB_INFLATE_STREAM *s, const uint8_t *src,
+                         uint32_t len, uzlib_out_fn out, void *ctx);
+
+void uzlib_deflate_free (UZLIB_DEFLATE_STREAM *s);
+void uzlib_inflate_free (UZLIB_INFLATE_STREAM *s);
+
 /* Checksum API */
 /* crc is previous value for incremental computation, 0xffffffff initially */
 uint32_t uzlib_crc32(const void *data, uint32_t length, uint32_t crc);
+/* sum is previous value for incremental computation, 1 initially */
+uint32_t uzlib_adler32(const void *data, uint32_t length, uint32_t sum);
 
 #endif /* UZLIB_INFLATE_H */
@@ -94,8 +94,6 @@ Copyright statement B for genlz77 functions:
 #include <assert.h>
 #include "uzlib.h"
 
-jmp_buf unwindAddr;
-
 /* Minimum and maximum length of matches to look for, inclusive */
 #define MIN_MATCH      3
 #define MAX_MATCH      258
@@ -130,8 +128,6 @@ int debugCounts[20];
 #define DBG_ADD_COUNT(n,m)
 #endif
 
-int dbg_break(void) {return 1;}
-
 typedef struct {
   ushort code, extraBits, min, max;
 } codeRecord;
@@ -146,7 +142,8 @@ struct dynTables {
   const uchar bitrevNibble[16];
   const codeRecord lenCodes[285-257+1];
   const codeRecord distCodes[29-0+1];
-} *dynamicTables;
+};
+static struct dynTables *dynamicTables;
 
 struct outputBuf {
   uchar *buffer;
@@ -154,7 +151,10 @@ struct outputBuf {
   uint inLen, inNdx;
   uint bits, nBits;
   uint compDisabled;
-} *oBuf;
+  uzlib_out_fn out;     /* set for streams, which pass on a full buffer */
+  void *outCtx;
+};
+static struct outputBuf *oBuf;
 
 
 /*
@@ -213,12 +213,12 @@ static void initTables (uint chainLen, uint hashSlots) {
                      chainLen * sizeof(ushort) +
                      hashSlots * sizeof(ushort);
   struct dynTables *dt = uz_malloc(dynamicSize);
-  memset(dt, 0, dynamicSize);
   dynamicTables = dt;
 
   /* Do a single malloc for dymanic tables and assign addresses */
   if(!dt )
     UZLIB_THROW(UZLIB_MEMORY_ERROR);
+  memset(dt, 0, dynamicSize);
 
   memcpy((uchar*)dt->bitrevNibble, BITREV16, 16);
   oBuf          = (struct outputBuf *)(dt+1);
@@ -246,9 +246,15 @@ static void initTables (uint chainLen, uint hashSlots) {
 /*
  * Routines to output bit streams and byte streams to the output buffer
  */
-void resizeBuffer(void) {
+static void resizeBuffer(void) {
   uchar *nb;
   DBG_COUNT(2);
+  if (oBuf->out) {
+    /* A stream has a fixed buffer which is passed on whenever it fills */
+    oBuf->out(oBuf->outCtx, oBuf->buffer, oBuf->len);
+    oBuf->len = 0;
+    return;
+  }
   /* The outbuf is given an initial size estimate but if we are running */
   /* out of space then extropolate size using current compression */
   double newEstimate = (((double) oBuf->len)*oBuf->inLen) / oBuf->inNdx;
@@ -258,7 +264,7 @@ void resizeBuffer(void) {
   oBuf->buffer = nb;
 }
 
-void outBits(ushort bits, int nBits) {
+static void outBits(ushort bits, int nBits) {
   DBG_COUNT(3);
   oBuf->bits  |= bits << oBuf->nBits;
   oBuf->nBits += nBits;
@@ -274,7 +280,7 @@ void outBits(ushort bits, int nBits) {
   }
 }
 
-void outBitsRev(uchar bits, int nBits) {
+static void outBitsRev(uchar bits, int nBits) {
   DBG_COUNT(4);
   /* Note that bit reversal only operates on an 8-bit bits field */
   uchar bitsRev = (dynamicTables->bitrevNibble[bits & 0x0f]<<4) |
@@ -282,7 +288,7 @@ void outBitsRev(uchar bits, int nBits) {
   outBits(bitsRev, nBits);
 }
 
-void outBytes(void *bytes, int nBytes) {
+static void outBytes(void *bytes, int nBytes) {
   DBG_COUNT(5);
   int i;
   if (oBuf->len >= oBuf->size - nBytes)
@@ -300,7 +306,7 @@ void outBytes(void *bytes, int nBytes) {
 /*
  * Output an literal byte as an 8 or 9 bit code
  */
-void literal (uchar c) {
+static void literal (uchar c) {
   DBG_COUNT(6);
   DBG_PRINT("sym: %02x   %c\n", c, c);
   if (oBuf->compDisabled) {
@@ -319,7 +325,7 @@ void literal (uchar c) {
 /*
  * Output a dictionary (distance, length) pars as bitstream codes
  */
-void copy (int distance, int len) {
+static void copy (int distance, int len) {
   DBG_COUNT(7);
   const codeRecord *lenCodes  = dynamicTables->lenCodes, *l;
   const codeRecord *distCodes = dynamicTables->distCodes, *d;
@@ -420,7 +426,7 @@ void copy (int distance, int len) {
  * As per RFC 1951 sec 4, we also implement a "lazy match" procedure
  */
 
-void uzlibCompressBlock(const uchar *src, uint srcLen) {
+static void uzlibCompressBlock(const uchar *src, uint srcLen) {
   int i, j, k, l;
   uint hashMask     = dynamicTables->hashMask;
   ushort *hashChain = dynamicTables->hashChain;
@@ -584,3 +590,264 @@ int uzlib_compress (uchar **dest, uint *destLen, const uchar *src, uint srcLen)
 
   return status;
 }
+
+/*
+ * Stream compression
+ *
+ * A stream keeps its input in a window buffer of twice the dictionary
+ * size. New input is appended to the buffer and compressed up to the last
+ * MAX_MATCH bytes, which are kept as lookahead until more input (or a
+ * flush) arrives. When the buffer is full its upper half is moved down
+ * and the hash tables are rebased, so the dictionary always holds at
+ * least the previous dictSize bytes. As the shift is exactly dictSize,
+ * the chain slot of a position is unchanged by the move.
+ *
+ * Buffer positions are below 2*dictSize, at most 32K, so they are held
+ * directly as ushorts in the hash tables. The compressed output is a
+ * single static Huffman block that is closed only on a flush.
+ */
+
+#define STREAM_OUT_SIZE 256
+
+struct uzlib_deflate_stream {
+  struct dynTables *tables;     /* the outputBuf follows these */
+  uchar *window;
+  uint dictSize, fill, pos;     /* pos is the next byte to compress */
+  uint lastOffset, lastLen;     /* match deferred from pos-1 */
+  uint checksum, total;
+  int format, started;
+};
+
+static void slideWindow (UZLIB_DEFLATE_STREAM *s) {
+  ushort *hashTable = s->tables->hashTable;
+  ushort *hashChain = s->tables->hashChain;
+  uint i, dictSize = s->dictSize;
+
+  memcpy(s->window, s->window + dictSize, dictSize);
+  s->fill -= dictSize;
+  s->pos  -= dictSize;
+
+  for (i = 0; i < s->tables->hashSlots; i++)
+    hashTable[i] = (hashTable[i] != NULL_OFFSET && hashTable[i] >= dictSize) ?
+                   hashTable[i] - dictSize : NULL_OFFSET;
+  for (i = 0; i < dictSize; i++)
+    hashChain[i] = (hashChain[i] != NULL_OFFSET && hashChain[i] >= dictSize) ?
+                   hashChain[i] - dictSize : NULL_OFFSET;
+}
+
+/*
+ * This is the stream version of uzlibCompressBlock(), using the same hash
+ * chains and lazy match, but with its state carried in the stream.
+ */
+static void compressWindow (UZLIB_DEFLATE_STREAM *s, int final) {
+  const uchar *src  = s->window;
+  uint hashMask     = dynamicTables->hashMask;
+  ushort *hashChain = dynamicTables->hashChain;
+  ushort *hashTable = dynamicTables->hashTable;
+  uint hashShift    = 24 - dynamicTables->hashBits;
+  uint chainMask    = s->dictSize - 1;
+  uint fill         = s->fill, i = s->pos;
+  uint limit        = final ? fill + 1 - MIN_MATCH : fill - MAX_MATCH;
+  int k, l;
+
+  if (fill < (final ? MIN_MATCH : MAX_MATCH))
+    limit = 0;
+
+  for (; i < limit; i++) {
+    const uchar *this = src + i, *comp;
+    uint maxLen      = fill - i;
+    uint matchLen    = MIN_MATCH - 1;
+    uint matchOffset = 0;
+    uint v           = (this[0] << 16) | (this[1] << 8) | this[2];
+    uint hash        = ((v >> hashShift) - v) & hashMask;
+    uint nextOffset  = hashTable[hash];
+
+    if (maxLen > MAX_MATCH)
+      maxLen = MAX_MATCH;
+
+    hashTable[hash] = i;
+    hashChain[i & chainMask] = nextOffset;
+
+    for (l = 0; nextOffset != NULL_OFFSET && l < 60; l++) {
+      if (i - nextOffset >= s->dictSize)
+        break;
+
+      for (k = 0, comp = src + nextOffset; k < maxLen && this[k] == comp[k]; k++)
+        {}
+
+      if (k > matchLen) {
+         matchOffset = i - nextOffset;
+         matchLen = k;
+      }
+      nextOffset = hashChain[nextOffset & chainMask];
+    }
+
+    if (s->lastOffset) {
+      if (matchOffset == 0 || s->lastLen >= matchLen) {
+        copy(s->lastOffset, s->lastLen);
+        i += s->lastLen - 1 - 1;
+        s->lastOffset = s->lastLen = 0;
+      } else {
+        literal(this[-1]);
+        s->lastOffset = matchOffset;
+        s->lastLen = matchLen;
+      }
+    } else if (matchOffset) {
+      s->lastOffset = matchOffset;
+      s->lastLen = matchLen;
+    } else {
+      literal(this[0]);
+    }
+  }
+
+  if (final) {
+    if (s->lastOffset) {              /* flush cached match if any */
+      copy(s->lastOffset, s->lastLen);
+      i += s->lastLen - 1;
+      s->lastOffset = s->lastLen = 0;
+    }
+    while (i < fill)
+      literal(src[i++]);
+  }
+  s->pos = i;
+}
+
+static void outBlockStart (void) {
+  outBits(0, 1); /* Not the final block */
+  outBits(1, 2); /* Static huffman block */
+}
+
+static void outHeader (UZLIB_DEFLATE_STREAM *s) {
+  if (s->format == UZLIB_FORMAT_GZIP) {
+    /* ID1 ID2 CM=deflate FLG=0 MTIME=0 XFL=fastest OS=unix */
+    uchar gzipHeader[] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 4, 3};
+    outBytes(gzipHeader, sizeof(gzipHeader));
+  } else if (s->format == UZLIB_FORMAT_ZLIB) {
+    uchar zlibHeader[2];
+    uint windowBits = 0;
+    while ((1u << windowBits) < s->dictSize)
+      windowBits++;
+    zlibHeader[0] = 8 | ((windowBits - 8) << 4);      /* CM=deflate, CINFO */
+    zlibHeader[1] = 31 - ((zlibHeader[0] << 8) % 31); /* FLEVEL=fastest, FCHECK */
+    outBytes(zlibHeader, sizeof(zlibHeader));
+  }
+  outBlockStart();
+}
+
+static void outTrailer (UZLIB_DEFLATE_STREAM *s) {
+  uchar trailer[8];
+  uint crc = ~s->checksum;
+
+  if (s->format == UZLIB_FORMAT_GZIP) {
+    trailer[0] = crc;             trailer[1] = crc >> 8;
+    trailer[2] = crc >> 16;       trailer[3] = crc >> 24;
+    trailer[4] = s->total;        trailer[5] = s->total >> 8;
+    trailer[6] = s->total >> 16;  trailer[7] = s->total >> 24;
+    outBytes(trailer, 8);
+  } else if (s->format == UZLIB_FORMAT_ZLIB) {
+    trailer[0] = s->checksum >> 24; trailer[1] = s->checksum >> 16;
+    trailer[2] = s->checksum >> 8;  trailer[3] = s->checksum;
+    outBytes(trailer, 4);
+  }
+}
+
+UZLIB_DEFLATE_STREAM *uzlib_deflate_new (int format, int windowBits) {
+  uint dictSize = 1u << windowBits;
+  UZLIB_DEFLATE_STREAM *s;
+
+  if (windowBits < UZLIB_DEFLATE_MIN_WINDOW ||
+      windowBits > UZLIB_DEFLATE_MAX_WINDOW)
+    return NULL;
+
+  s = uz_malloc(sizeof(*s) + 2*dictSize + STREAM_OUT_SIZE);
+  if (!s)
+    return NULL;
+  memset(s, 0, sizeof(*s));
+
+  if (UZLIB_SETJMP(unwindAddr) != 0) {
+    uz_free(s);
+    return NULL;
+  }
+  initTables(dictSize, dictSize >> 2);
+  dynamicTables->hashBits = windowBits - 2;
+
+  s->tables       = dynamicTables;
+  s->window       = (uchar *)(s + 1);
+  s->dictSize     = dictSize;
+  s->format       = format;
+  s->checksum     = format == UZLIB_FORMAT_ZLIB ? 1 : ~0;
+  oBuf->buffer    = s->window + 2*dictSize;
+  oBuf->size      = STREAM_OUT_SIZE;
+  return s;
+}
+
+int uzlib_deflate_write (UZLIB_DEFLATE_STREAM *s, const uchar *src, uint len,
+                         int flush, uzlib_out_fn out, void *ctx) {
+  int status;
+
+  dynamicTables = s->tables;
+  oBuf          = (struct outputBuf *)(s->tables + 1);
+  oBuf->out     = out;
+  oBuf->outCtx  = ctx;
+
+  if ((status = UZLIB_SETJMP(unwindAddr)) != 0)
+    return status;
+
+  if (!s->started) {
+    outHeader(s);
+    s->started = 1;
+  }
+
+  if (s->format == UZLIB_FORMAT_GZIP)
+    s->checksum = uzlib_crc32(src, len, s->checksum);
+  else if (s->format == UZLIB_FORMAT_ZLIB)
+    s->checksum = uzlib_adler32(src, len, s->checksum);
+  s->total += len;
+
+  while (len) {
+    uint n = 2*s->dictSize - s->fill;
+    if (n == 0) {
+      slideWindow(s);
+      n = s->dictSize;
+    }
+    if (n > len)
+      n = len;
+    memcpy(s->window + s->fill, src, n);
+    s->fill += n;
+    src     += n;
+    len     -= n;
+    compressWindow(s, 0);
+  }
+
+  if (flush != UZLIB_FLUSH_NONE) {
+    compressWindow(s, 1);
+    outBits(0, 7);               /* close block */
+    if (flush == UZLIB_FLUSH_SYNC) {
+      /* An empty stored block brings the output to a byte boundary */
+      uchar storedLen[] = {0, 0, 0xff, 0xff};
+      outBits(0, 3);
+      outBits(0, 7);             /* Make sure all bits are flushed */
+      outBytes(storedLen, sizeof(storedLen));
+      outBlockStart();
+    } else {
+      outBits(1, 1);             /* An empty final block */
+      outBits(1, 2);
+      outBits(0, 7);
+      outBits(0, 7);             /* Make sure all bits are flushed */
+      outTrailer(s);
+    }
+  }
+
+  if (oBuf->len) {
+    out(ctx, oBuf->buffer, oBuf->len);
+    oBuf->len = 0;
+  }
+  return UZLIB_OK;
+}
+
+void uzlib_deflate_free (UZLIB_DEFLATE_STREAM *s) {
+  if (s) {
+    FREE(s->tables);
+    uz_free(s);
+  }
+}
@@ -58,9 +58,6 @@ int debugCounts[20];
 
 #define SIZE(arr) (sizeof(arr) / sizeof(*(arr)))
 
-jmp_buf unwindAddr;
-int dbg_break(void) {return 1;}
-
 typedef uint8_t  uchar;
 typedef uint16_t ushort;
 typedef uint32_t uint;
@@ -376,6 +373,9 @@ static int inflate_block_data (UZLIB_DATA *d, UZLIB_TREE *lt, UZLIB_TREE *dt) {
     int dist;
     int sym = decode_symbol(d, lt);
 
+    if (sym < 0)
+      return sym;
+
     /* literal byte */
     if (sym < 256) {
        DBG_PRINT("huff sym: %02x   %c\n", sym, sym);
@@ -389,9 +389,13 @@ static int inflate_block_data (UZLIB_DATA *d, UZLIB_TREE *lt, UZLIB_TREE *dt) {
 
     /* substring from sliding dictionary */
     sym -= 257;
+    if (sym >= 29)
+      return UZLIB_DATA_ERROR;
     /* possibly get more bits from length code */
     d->curLen = read_bits(d, d->lengthBits[sym], d->lengthBase[sym]);
     dist = decode_symbol(d, dt);
+    if (dist < 0 || dist >= 30)
+      return UZLIB_DATA_ERROR;
     /* possibly get more bits from distance code */
     d->lzOffs = read_bits(d, d->distBits[dist], d->distBase[dist]);
     DBG_PRINT("huff dict: -%u for %u\n", d->lzOffs, d->curLen);
@@ -597,3 +601,284 @@ int uzlib_inflate (
 
   UZLIB_THROW(res);
 }
+
+
+/*
+ * Stream inflate
+ *
+ * uzlib_inflate() pulls its input through get_byte(), which cannot return
+ * until the byte is there. A stream is written with whatever input is to
+ * hand instead, so the decoder is run a step at a time: a block header
+ * with its trees, one symbol, one byte of a match or a stored block, or
+ * the gzip/zlib header or trailer. The decoder state is saved before each
+ * step, and if the input runs out part way through one, get_byte() throws
+ * UZLIB_NEED_INPUT, the state is restored, and the unread input from the
+ * start of the step is kept for the next write. Output is only produced
+ * once a step has read all its input, so nothing is produced twice.
+ *
+ * The output is kept in a ring buffer of the dictionary size for recall,
+ * and passed on whenever the ring is about to wrap and at the end of each
+ * write. A step never needs more than about 300 bytes of input, so this
+ * is the most that has to be kept between writes.
+ */
+
+#define PENDING_MAX 512
+
+enum { PHASE_HEADER, PHASE_BLOCKS, PHASE_TRAILER, PHASE_END };
+
+typedef struct {
+  uint tag, bitcount, curLen, lzOffs, inNdx;
+  int  bType, bFinal, phase;
+} STREAM_SAVE;
+
+struct uzlib_inflate_stream {
+  UZLIB_DATA d;
+  STREAM_SAVE save;
+  int format, phase;
+  uint windowMask, outNdx, outDone, outHave;
+  uint checksum;
+  const uchar *in;
+  uint inLen, inNdx, nPending;
+  uzlib_out_fn out;
+  void *outCtx;
+  uchar pending[PENDING_MAX];
+  uchar *window;
+};
+
+static UZLIB_INFLATE_STREAM *cur;
+
+static uchar stream_get_byte (void) {
+  UZLIB_INFLATE_STREAM *s = cur;
+  uint i = s->inNdx++;
+  if (i < s->nPending)
+    return s->pending[i];
+  if (i - s->nPending < s->inLen)
+    return s->in[i - s->nPending];
+  UZLIB_THROW(UZLIB_NEED_INPUT);
+}
+
+/* Passes on the output not yet seen by the caller */
+static void stream_emit (UZLIB_INFLATE_STREAM *s) {
+  while (s->outDone != s->outNdx) {
+    uint start = s->outDone & s->windowMask;
+    uint n = s->outNdx - s->outDone;
+    if (n > s->windowMask + 1 - start)
+      n = s->windowMask + 1 - start;
+    if (s->format == UZLIB_FORMAT_GZIP)
+      s->checksum = uzlib_crc32(s->window + start, n, s->checksum);
+    else if (s->format == UZLIB_FORMAT_ZLIB)
+      s->checksum = uzlib_adler32(s->window + start, n, s->checksum);
+    s->out(s->outCtx, s->window + start, n);
+    s->outDone += n;
+  }
+}
+
+static void stream_put_byte (uchar b) {
+  UZLIB_INFLATE_STREAM *s = cur;
+  s->window[s->outNdx++ & s->windowMask] = b;
+  if (s->outHave <= s->windowMask)
+    s->outHave++;
+  if (s->outNdx - s->outDone > s->windowMask)
+    stream_emit(s);
+}
+
+static uchar stream_recall_byte (uint offset) {
+  UZLIB_INFLATE_STREAM *s = cur;
+  if (offset == 0 || offset > s->outHave)
+    UZLIB_THROW(offset > s->windowMask ? UZLIB_DICT_ERROR : UZLIB_DATA_ERROR);
+  return s->window[(s->outNdx - offset) & s->windowMask];
+}
+
+static int stream_header (UZLIB_INFLATE_STREAM *s) {
+  UZLIB_DATA *d = &s->d;
+
+  if (s->format == UZLIB_FORMAT_GZIP)
+    return parse_gzip_header(d);
+
+  if (s->format == UZLIB_FORMAT_ZLIB) {
+    uint cmf = d->get_byte();
+    uint flg = d->get_byte();
+    if ((cmf & 0x0f) != 8 || ((cmf << 8) | flg) % 31 || (flg & 0x20))
+      return UZLIB_DATA_ERROR;     /* not deflate, bad check, or a preset dictionary */
+    if ((1u << ((cmf >> 4) + 8)) > s->windowMask + 1)
+      return UZLIB_DICT_ERROR;
+  }
+  return UZLIB_OK;
+}
+
+static int stream_trailer (UZLIB_INFLATE_STREAM *s) {
+  UZLIB_DATA *d = &s->d;
+
+  stream_emit(s);     /* so that the checksum covers all the output */
+  d->bitcount = 0;    /* the trailer starts on a byte boundary */
+
+  if (s->format == UZLIB_FORMAT_GZIP) {
+    uint crc = get_le_uint32(d);
+    uint len = get_le_uint32(d);
+    if (crc != ~s->checksum || len != s->outNdx)
+      return UZLIB_CHKSUM_ERROR;
+  } else if (s->format == UZLIB_FORMAT_ZLIB) {
+    uint sum = get_le_uint32(d);
+    sum = (sum >> 24) | ((sum >> 8) & 0xff00) | ((sum << 8) & 0xff0000) | (sum << 24);
+    if (sum != s->checksum)
+      return UZLIB_CHKSUM_ERROR;
+  }
+  return UZLIB_DONE;
+}
+
+static int stream_step (UZLIB_INFLATE_STREAM *s) {
+  UZLIB_DATA *d = &s->d;
+  int res;
+
+  switch (s->phase) {
+  case PHASE_HEADER:
+    if ((res = stream_header(s)) == UZLIB_OK)
+      s->phase = PHASE_BLOCKS;
+    return res;
+
+  case PHASE_BLOCKS:
+    if (d->bType == -1) {
+      d->bFinal = getbit(d);
+      d->bType = read_bits(d, 2, 0);
+      if (d->bType == 1) {
+        build_fixed_trees(&d->ltree, &d->dtree);
+      } else if (d->bType == 2) {
+        if ((res = decode_trees(d, &d->ltree, &d->dtree)) != UZLIB_OK)
+          return res;
+      }
+    }
+
+    switch (d->bType) {
+    case 0:
+      res = inflate_uncompressed_block(d);
+      break;
+    case 1:
+    case 2:
+      res = inflate_block_data(d, &d->ltree, &d->dtree);
+      break;
+    default:
+      return UZLIB_DATA_ERROR;
+    }
+
+    if (res == UZLIB_DONE) {
+      if (d->bFinal)
+        s->phase = PHASE_TRAILER;
+      d->bType = -1;
+      return UZLIB_OK;
+    }
+    return res;
+
+  case PHASE_TRAILER:
+    if ((res = stream_trailer(s)) == UZLIB_DONE)
+      s->phase = PHASE_END;
+    return res;
+  }
+  return UZLIB_DONE;
+}
+
+static void stream_save (UZLIB_INFLATE_STREAM *s) {
+  STREAM_SAVE *v = &s->save;
+  v->tag      = s->d.tag;
+  v->bitcount = s->d.bitcount;
+  v->curLen   = s->d.curLen;
+  v->lzOffs   = s->d.lzOffs;
+  v->bType    = s->d.bType;
+  v->bFinal   = s->d.bFinal;
+  v->phase    = s->phase;
+  v->inNdx    = s->inNdx;
+}
+
+static void stream_restore (UZLIB_INFLATE_STREAM *s) {
+  STREAM_SAVE *v = &s->save;
+  s->d.tag      = v->tag;
+  s->d.bitcount = v->bitcount;
+  s->d.curLen   = v->curLen;
+  s->d.lzOffs   = v->lzOffs;
+  s->d.bType    = v->bType;
+  s->d.bFinal   = v->bFinal;
+  s->phase      = v->phase;
+  s->inNdx      = v->inNdx;
+}
+
+/* Keeps the input that has not been consumed for the next write */
+static int stream_keep (UZLIB_INFLATE_STREAM *s) {
+  uint total = s->nPending + s->inLen;
+  uint keep = total - s->inNdx;
+
+  if (keep > PENDING_MAX)
+    return UZLIB_DATA_ERROR;
+  if (s->inNdx < s->nPending) {
+    memmove(s->pending, s->pending + s->inNdx, s->nPending - s->inNdx);
+    memcpy(s->pending + s->nPending - s->inNdx, s->in, s->inLen);
+  } else {
+    memcpy(s->pending, s->in + (s->inNdx - s->nPending), keep);
+  }
+  s->nPending = keep;
+  s->inNdx = 0;
+  return UZLIB_OK;
+}
+
+UZLIB_INFLATE_STREAM *uzlib_inflate_new (int format, int windowBits) {
+  uint windowSize = 1u << windowBits;
+  UZLIB_INFLATE_STREAM *s;
+
+  if (windowBits < UZLIB_INFLATE_MIN_WINDOW ||
+      windowBits > UZLIB_INFLATE_MAX_WINDOW)
+    return NULL;
+
+  s = (UZLIB_INFLATE_STREAM *) uz_malloc(sizeof(*s) + windowSize);
+  if (!s)
+    return NULL;
+  memset(s, 0, sizeof(*s));
+
+  s->window        = (uchar *)(s + 1);
+  s->windowMask    = windowSize - 1;
+  s->format        = format;
+  s->phase         = PHASE_HEADER;
+  s->checksum      = format == UZLIB_FORMAT_ZLIB ? 1 : ~0;
+  s->d.bType       = -1;
+  s->d.get_byte    = stream_get_byte;
+  s->d.put_byte    = stream_put_byte;
+  s->d.recall_byte = stream_recall_byte;
+
+  memcpy(s->d.clcidx, CLCIDX_INIT, sizeof(s->d.clcidx));
+  build_bits_base(s->d.lengthBits, s->d.lengthBase, 4, 3);
+  build_bits_base(s->d.distBits, s->d.distBase, 2, 1);
+  s->d.lengthBits[28] = 0;              /* fix a special case */
+  s->d.lengthBase[28] = 258;
+  return s;
+}
+
+int uzlib_inflate_write (UZLIB_INFLATE_STREAM *s, const uchar *src, uint len,
+                         uzlib_out_fn out, void *ctx) {
+  int res;
+
+  if (s->phase == PHASE_END)
+    return len ? UZLIB_DATA_ERROR : UZLIB_DONE;
+
+  cur       = s;
+  s->in     = src;
+  s->inLen  = len;
+  s->out    = out;
+  s->outCtx = ctx;
+
+  if ((res = UZLIB_SETJMP(unwindAddr)) == 0) {
+    do {
+      stream_save(s);
+    } while ((res = stream_step(s)) == UZLIB_OK);
+  }
+
+  if (res == UZLIB_NEED_INPUT) {
+    stream_restore(s);
+    res = stream_keep(s);
+  } else if (res == UZLIB_DONE && s->inNdx < s->nPending + s->inLen) {
+    res = UZLIB_DATA_ERROR;        /* there is more after the end */
+  }
+  if (res >= 0)
+    stream_emit(s);
+  return res;
+}
+
+void uzlib_inflate_free (UZLIB_INFLATE_STREAM *s) {
+  uz_free(s);
+}
@@ -24,19 +24,22 @@
 
 #include "osapi.h"
 #include "user_interface.h"
-#include "espconn.h"
 #include "mem.h"
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <ctype.h>
 
+#include "lwip/pbuf.h"
+#include "nsock.h"
 #include "websocketclient.h"
 
 // Depends on 'crypto' module for sha1
 #include "../crypto/digests.h"
 #include "../crypto/mech.h"
+#include "../uzlib/uzlib.h"
 
 #include "pm/swtimer.h"
 
@@ -51,23 +54,18 @@
                          "Host: %s:%d\r\n"
 
 #define WS_INIT_REQUEST_LENGTH 30
-#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
-#define WS_GUID_LENGTH 36
 
 #define WS_HTTP_SWITCH_PROTOCOL_HEADER "HTTP/1.1 101"
 #define WS_HTTP_SEC_WEBSOCKET_ACCEPT "Sec-WebSocket-Accept:"
+#define WS_HTTP_SEC_WEBSOCKET_EXTENSIONS "Sec-WebSocket-Extensions:"
 
 #define WS_CONNECT_TIMEOUT_MS 10 * 1000
 #define WS_PING_INTERVAL_MS 30 * 1000
 #define WS_FORCE_CLOSE_TIMEOUT_MS 5 * 1000
 #define WS_UNHEALTHY_THRESHOLD 2
 
-#define WS_OPCODE_CONTINUATION 0x0
-#define WS_OPCODE_TEXT 0x1
-#define WS_OPCODE_BINARY 0x2
-#define WS_OPCODE_CLOSE 0x8
-#define WS_OPCODE_PING 0x9
-#define WS_OPCODE_PONG 0xA
+#define WS_SEND_CHUNK 1460 // one TCP segment
+#define WS_DEFLATE_MIN 32 // shorter messages are not worth compressing
 
 static const header_t DEFAULT_HEADERS[] = {
   {"User-Agent", "ESP8266"},
@@ -76,7 +74,7 @@ static const header_t DEFAULT_HEADERS[] = {
 };
 static const header_t *EMPTY_HEADERS = DEFAULT_HEADERS + sizeof(DEFAULT_HEADERS) / sizeof(header_t) - 1;
 
-static char *cryptoSha1(char *data, unsigned int len) {
+char *cryptoSha1(char *data, unsigned int len) {
   SHA1_CTX ctx;
   SHA1Init(&ctx);
   SHA1Update(&ctx, data, len);
@@ -88,7 +86,7 @@ static char *cryptoSha1(char *data, unsigned int len) {
 
 static const char *bytes64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static char *base64Encode(char *data, unsigned int len) {
+char *base64Encode(char *data, unsigned int len) {
   int blen = (len + 2) / 3 * 4;
 
   char *out = (char *) calloc(1,blen + 1);
@@ -165,405 +163,592 @@ skip:;
   return dst;
 }
 
-static void ws_closeSentCallback(void *arg) {
-  NODE_DBG("ws_closeSentCallback \n");
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
+// A frame waiting to go out. Data frames point at the caller's message, which
+// stays valid until onSent; control frames carry a copy of their payload.
+typedef struct ws_frame {
+  struct ws_frame *next;
+  int opCode;
+  const char *data;
+  uint32_t len;
+  uint32_t sent; // payload bytes handed to the socket so far
+  bool headerSent;
+  bool copied;
+  bool closeAfter; // disconnect once the frame is out
+  char mask[4];
+  void *arg;
+  char control[];
+} ws_frame;
+
+int ws_frameHeader(char *b, int opCode, uint32_t len, bool masked) {
+  int bufOffset;
+  b[0] = 1 << 7; // has fin
+  b[0] += opCode;
+  if (len < 126) {
+    b[1] = len;
+    bufOffset = 2;
+  } else if (len < 0x10000) {
+    b[1] = 126;
+    b[2] = len >> 8;
+    b[3] = len;
+    bufOffset = 4;
+  } else {
+    b[1] = 127;
+    b[2] = b[3] = b[4] = b[5] = 0;
+    b[6] = len >> 24;
+    b[7] = len >> 16;
+    b[8] = len >> 8;
+    b[9] = len;
+    bufOffset = 10;
+  }
+  if (masked) b[1] += 1 << 7; // has mask
+  return bufOffset;
+}
 
-  if (ws == NULL) {
-    NODE_DBG("ws is unexpectly null\n");
+static void ws_abort(ws_info *ws, int failureCode) {
+  ws->knownFailureCode = failureCode;
+  nsock_close(ws->conn, ERR_OK);
+}
+
+/*
+ * Send the next segment of the frame at the head of the queue. The payload is
+ * masked straight into the pbuf that goes to the socket, so a message of any
+ * size costs one segment of heap rather than a masked copy of itself.
+ */
+static void ws_sendChunk(ws_info *ws) {
+  ws_frame *f = ws->sendQueue;
+  if (f == NULL || ws->sendBusy) {
     return;
   }
 
-  ws->knownFailureCode = -6;
+  char header[14];
+  int bufOffset = 0;
+  if (!f->headerSent) {
+    NODE_DBG("ws_sendFrame %d %d\n", f->opCode, f->len);
+    bufOffset = ws_frameHeader(header, f->opCode, f->len, true);
+    memcpy(header + bufOffset, f->mask, 4);
+    bufOffset += 4;
+  }
+
+  uint32_t i, n = f->len - f->sent;
+  if (n > WS_SEND_CHUNK - bufOffset) {
+    n = WS_SEND_CHUNK - bufOffset;
+  }
+
+  struct pbuf *p = pbuf_alloc(PBUF_RAW, bufOffset + n, PBUF_RAM);
+  if (p == NULL) {
+    NODE_DBG("Out of memory when sending message, disconnecting...\n");
+    ws_abort(ws, -16);
+    return;
+  }
+  char *b = (char *) p->payload;
+  memcpy(b, header, bufOffset);
+  for (i = 0; i < n; i++, f->sent++) {
+    b[bufOffset + i] = f->data[f->sent] ^ f->mask[f->sent % 4];
+  }
+  f->headerSent = true;
+
+  ws->sendBusy = true;
+  err_t result = nsock_send(ws->conn, p);
+  if (result != ERR_OK) {
+    NODE_DBG("Failed to send message (%d), disconnecting...\n", result);
+    ws->sendBusy = false;
+    ws_abort(ws, -16);
+  }
+}
 
-  if (ws->isSecure)
-    espconn_secure_disconnect(conn);
-  else
-    espconn_disconnect(conn);
+static void ws_sentCallback(void *arg) {
+  NODE_DBG("ws_sentCallback \n");
+  ws_info *ws = (ws_info *) arg;
+
+  ws->sendBusy = false;
+  ws_frame *f = ws->sendQueue;
+  if (f != NULL && f->headerSent && f->sent == f->len) {
+    ws->sendQueue = f->next;
+    if (f->closeAfter) {
+      os_free(f);
+      ws_abort(ws, -6);
+      return;
+    }
+    if (!f->copied && ws->onSent) ws->onSent(ws, f->arg);
+    os_free(f);
+  }
+  ws_sendChunk(ws);
 }
 
-static void ws_sendFrame(struct espconn *conn, int opCode, const char *data, unsigned short len) {
-  NODE_DBG("ws_sendFrame %d %d\n", opCode, len);
-  ws_info *ws = (ws_info *) conn->reverse;
+// Drop the frames that could not be sent, letting their owners know
+static void ws_flushQueue(ws_info *ws) {
+  while (ws->sendQueue != NULL) {
+    ws_frame *f = ws->sendQueue;
+    ws->sendQueue = f->next;
+    if (!f->copied && ws->onSent) ws->onSent(ws, f->arg);
+    os_free(f);
+  }
+  ws->sendBusy = false;
+}
 
+static bool ws_canSend(ws_info *ws) {
   if (ws->connectionState == 4) {
     NODE_DBG("already in closing state\n");
-    return;
+    return false;
   } else if (ws->connectionState != 3) {
     NODE_DBG("can't send message while not in a connected state\n");
-    return;
+    return false;
   }
+  return true;
+}
 
-  char *b = calloc(1,10 + len); // 10 bytes = worst case scenario for framming
-  if (b == NULL) {
-    NODE_DBG("Out of memory when receiving message, disconnecting...\n");
+static void ws_pushFrame(ws_info *ws, ws_frame *f) {
+  // Random mask:
+  int i;
+  for (i = 0; i < 4; i++) {
+    f->mask[i] = (char) os_random();
+  }
 
-    ws->knownFailureCode = -16;
-    if (ws->isSecure)
-      espconn_secure_disconnect(conn);
-    else
-      espconn_disconnect(conn);
-    return;
+  ws_frame **tail = &ws->sendQueue;
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
   }
+  *tail = f;
 
-  b[0] = 1 << 7; // has fin
-  b[0] += opCode;
-  b[1] = 1 << 7; // has mask
-  int bufOffset;
-  if (len < 126) {
-    b[1] += len;
-    bufOffset = 2;
-  } else if (len < 0x10000) {
-    b[1] += 126;
-    b[2] = len >> 8;
-    b[3] = len;
-    bufOffset = 4;
+  ws_sendChunk(ws);
+}
+
+static bool ws_queueFrame(ws_info *ws, int opCode, const char *data, uint32_t len, bool copy, bool closeAfter, void *arg) {
+  if (!ws_canSend(ws)) {
+    return false;
+  }
+
+  ws_frame *f = (ws_frame *) calloc(1, sizeof(ws_frame) + (copy ? len : 0));
+  if (f == NULL) {
+    NODE_DBG("Out of memory when sending message, disconnecting...\n");
+    ws_abort(ws, -16);
+    return false;
+  }
+
+  f->opCode = opCode;
+  f->len = len;
+  f->copied = copy;
+  f->closeAfter = closeAfter;
+  f->arg = arg;
+  if (copy) {
+    if (len > 0) memcpy(f->control, data, len);
+    f->data = f->control;
   } else {
-    b[1] += 127;
-    b[2] = len >> 24;
-    b[3] = len >> 16;
-    b[4] = len >> 8;
-    b[5] = len;
-    bufOffset = 6;
+    f->data = data;
   }
 
-  // Random mask:
-  b[bufOffset] = (char) os_random();
-  b[bufOffset + 1] = (char) os_random();
-  b[bufOffset + 2] = (char) os_random();
-  b[bufOffset + 3] = (char) os_random();
-  bufOffset += 4;
+  ws_pushFrame(ws, f);
+  return true;
+}
 
-  // Copy data to buffer
-  memcpy(b + bufOffset, data, len);
+typedef struct {
+  ws_frame *f;
+  uint32_t cap;   // room for payload in f
+  uint32_t limit; // output past this is no smaller than the message itself
+  bool failed;
+} ws_deflateOut;
+
+static void ws_deflateWrite(void *ctx, const uint8_t *data, uint32_t len) {
+  ws_deflateOut *o = (ws_deflateOut *) ctx;
+  uint32_t need = o->f->len + len;
+  if (o->failed || need > o->limit) {
+    o->failed = true;
+    return;
+  }
+  if (need > o->cap) {
+    uint32_t cap = need < o->limit / 2 ? need * 2 : o->limit;
+    ws_frame *f = (ws_frame *) realloc(o->f, sizeof(ws_frame) + cap);
+    if (f == NULL) {
+      o->failed = true;
+      return;
+    }
+    o->f = f;
+    o->cap = cap;
+  }
+  memcpy(o->f->control + o->f->len, data, len);
+  o->f->len = need;
+}
 
-  // Apply mask to encode payload
-  int i;
-  for (i = 0; i < len; i++) {
-    b[bufOffset + i] ^= b[bufOffset - 4 + i % 4];
+/*
+ * Compresses a message into a frame carrying its own payload, so the message
+ * is released as soon as it is queued. Returns NULL if it did not get smaller
+ * or memory ran out, and the message then goes out as it is.
+ */
+static ws_frame *ws_deflate(ws_info *ws, const char *data, uint32_t len) {
+  if (ws->deflater == NULL) {
+    ws->deflater = uzlib_deflate_new(UZLIB_FORMAT_RAW, ws->deflateSendBits);
+    if (ws->deflater == NULL) {
+      return NULL;
+    }
   }
-  bufOffset += len;
 
-  NODE_DBG("b[0] = %d \n", b[0]);
-  NODE_DBG("b[1] = %d \n", b[1]);
-  NODE_DBG("b[2] = %d \n", b[2]);
-  NODE_DBG("b[3] = %d \n", b[3]);
-  NODE_DBG("b[4] = %d \n", b[4]);
-  NODE_DBG("b[5] = %d \n", b[5]);
-  NODE_DBG("b[6] = %d \n", b[6]);
-  NODE_DBG("b[7] = %d \n", b[7]);
-  NODE_DBG("b[8] = %d \n", b[8]);
-  NODE_DBG("b[9] = %d \n", b[9]);
+  ws_deflateOut o = { .limit = len + 3 };
+  o.cap = len / 4 + 16 < o.limit ? len / 4 + 16 : o.limit;
+  o.f = (ws_frame *) calloc(1, sizeof(ws_frame) + o.cap);
+  int res = UZLIB_MEMORY_ERROR;
+  if (o.f != NULL) {
+    res = uzlib_deflate_write(ws->deflater, (const uint8_t *) data, len, UZLIB_FLUSH_SYNC, ws_deflateWrite, &o);
+  }
 
-  NODE_DBG("sending message\n");
-  if (ws->isSecure)
-    espconn_secure_send(conn, (uint8_t *) b, bufOffset);
-  else
-    espconn_send(conn, (uint8_t *) b, bufOffset);
+  // The sync flush ends in an empty stored block, which the receiver puts back
+  ws_frame *f = o.f;
+  if (res == UZLIB_OK && !o.failed && f->len >= 4 && memcmp(f->control + f->len - 4, "\0\0\xff\xff", 4) == 0) {
+    f->len -= 4;
+  } else {
+    os_free(f);
+    f = NULL;
+  }
 
-  os_free(b);
+  // A message that went out uncompressed is not in the server's window
+  if (f == NULL || ws->deflateReset) {
+    uzlib_deflate_free(ws->deflater);
+    ws->deflater = NULL;
+  }
+  return f;
 }
 
 static void ws_sendPingTimeout(void *arg) {
   NODE_DBG("ws_sendPingTimeout \n");
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
+  ws_info *ws = (ws_info *) arg;
 
   if (ws->unhealthyPoints == WS_UNHEALTHY_THRESHOLD) {
     // several pings were sent but no pongs nor messages
-    ws->knownFailureCode = -19;
-
-    if (ws->isSecure)
-      espconn_secure_disconnect(conn);
-    else
-      espconn_disconnect(conn);
+    ws_abort(ws, -19);
     return;
   }
 
-  ws_sendFrame(conn, WS_OPCODE_PING, NULL, 0);
+  ws_queueFrame(ws, WS_OPCODE_PING, NULL, 0, true, false, NULL);
   ws->unhealthyPoints += 1;
 }
 
-static void ws_receiveCallback(void *arg, char *buf, unsigned short len) {
-  NODE_DBG("ws_receiveCallback %d \n", len);
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
+int ws_headerLength(const unsigned char *h, int have) {
+  if (have < 2) {
+    return 2;
+  }
+  int length = h[1] & 0x80 ? 6 : 2;
+  if ((h[1] & 0x7f) == 126) {
+    length += 2;
+  } else if ((h[1] & 0x7f) == 127) {
+    length += 8;
+  }
+  return length;
+}
 
-  ws->unhealthyPoints = 0; // received data, connection is healthy
-  os_timer_disarm(&ws->timeoutTimer); // reset ping check
-  os_timer_arm(&ws->timeoutTimer, WS_PING_INTERVAL_MS, true);
+static bool ws_startFrame(ws_info *ws) {
+  const unsigned char *h = ws->frameHeader;
+  int opCode = h[0] & 0x0f;
+  uint64_t payloadLength = h[1] & 0x7f;
+  int bufOffset = 2;
+  if (payloadLength == 126) {
+    payloadLength = (h[2] << 8) + h[3];
+    bufOffset = 4;
+  } else if (payloadLength == 127) {
+    int i;
+    payloadLength = 0;
+    for (i = 2; i < 10; i++) {
+      payloadLength = (payloadLength << 8) + h[i];
+    }
+    bufOffset = 10;
+  }
 
+  ws->frameIsFin = h[0] & 0x80 ? 1 : 0;
+  ws->frameHasMask = h[1] & 0x80 ? 1 : 0;
+  ws->frameOpCode = opCode;
+  ws->frameMaskPos = 0;
+  if (ws->frameHasMask) {
+    memcpy(ws->frameMask, h + bufOffset, 4);
+  }
 
-  char *b = buf;
-  if (ws->frameBuffer != NULL) { // Append previous frameBuffer with new content
-    NODE_DBG("Appending new frameBuffer to old one \n");
+  NODE_DBG("isFin %d \n", ws->frameIsFin);
+  NODE_DBG("opCode %d \n", opCode);
+  NODE_DBG("hasMask %d \n", ws->frameHasMask);
+  NODE_DBG("payloadLength %d \n", (uint32_t) payloadLength);
 
-    ws->frameBuffer = realloc(ws->frameBuffer, ws->frameBufferLen + len);
-    if (ws->frameBuffer == NULL) {
-      NODE_DBG("Failed to allocate new framebuffer, disconnecting...\n");
+  if (payloadLength > UINT32_MAX) {
+    NODE_DBG("Frame too large, disconnecting...\n");
+    ws_abort(ws, -8);
+    return false;
+  }
+  ws->framePayloadLeft = payloadLength;
+
+  // Only the first frame of a data message can say it is compressed
+  bool compressed = h[0] & WS_RSV1;
+  if (compressed && (!ws->deflateOn || opCode == WS_OPCODE_CONTINUATION || (opCode & 0x8))) {
+    NODE_DBG("Got compressed bit on a frame that can't have it, disconnecting...\n");
+    ws_abort(ws, -15);
+    return false;
+  }
 
-      ws->knownFailureCode = -8;
-      if (ws->isSecure)
-        espconn_secure_disconnect(conn);
-      else
-        espconn_disconnect(conn);
-      return;
+  if (opCode & 0x8) {
+    if (!ws->frameIsFin || payloadLength > WS_CONTROL_MAX) {
+      NODE_DBG("Got fragmented or oversized control frame, disconnecting...\n");
+      ws_abort(ws, -15);
+      return false;
     }
-    memcpy(ws->frameBuffer + ws->frameBufferLen, b, len);
-
-    ws->frameBufferLen += len;
-
-    len = ws->frameBufferLen;
-    b = ws->frameBuffer;
-    NODE_DBG("New frameBufferLen: %d\n", len);
-  }
-
-  while (b != NULL) { // several frames can be present, b pointer will be moved to the next frame
-    NODE_DBG("b[0] = %d \n", b[0]);
-    NODE_DBG("b[1] = %d \n", b[1]);
-    NODE_DBG("b[2] = %d \n", b[2]);
-    NODE_DBG("b[3] = %d \n", b[3]);
-    NODE_DBG("b[4] = %d \n", b[4]);
-    NODE_DBG("b[5] = %d \n", b[5]);
-    NODE_DBG("b[6] = %d \n", b[6]);
-    NODE_DBG("b[7] = %d \n", b[7]);
-
-    int isFin = b[0] & 0x80 ? 1 : 0;
-    int opCode = b[0] & 0x0f;
-    int hasMask = b[1] & 0x80 ? 1 : 0;
-    uint64_t payloadLength = b[1] & 0x7f;
-    int bufOffset = 2;
-    if (payloadLength == 126) {
-      payloadLength = (b[2] << 8) + b[3];
-      bufOffset = 4;
-    } else if (payloadLength == 127) { // this will clearly not hold in heap, abort??
-      payloadLength = (b[2] << 24) + (b[3] << 16) + (b[4] << 8) + b[5];
-      bufOffset = 6;
+    ws->controlBufferLen = 0;
+  } else if (opCode == WS_OPCODE_CONTINUATION) {
+    if (ws->payloadOriginalOpCode == 0) {
+      NODE_DBG("Got continuation frame but didn't receive any beforehand, disconnecting...\n");
+      ws_abort(ws, -15);
+      return false;
     }
+  } else {
+    if (ws->payloadOriginalOpCode != 0) {
+      NODE_DBG("Got new message before the previous one was finished, disconnecting...\n");
+      ws_abort(ws, -15);
+      return false;
+    }
+    ws->payloadOriginalOpCode = opCode;
+    ws->frameCompressed = compressed;
+  }
+  return true;
+}
 
-    if (hasMask) {
-      int maskOffset = bufOffset;
-      bufOffset += 4;
+// Pass a piece of the current message on, or collect it until the last piece
+static bool ws_deliver(ws_info *ws, char *data, uint32_t len, int isFinal) {
+  if (ws->onFragment) {
+    ws->onFragment(ws, len, data, ws->payloadOriginalOpCode, isFinal);
+    return true;
+  }
 
-      int i;
-      for (i = 0; i < payloadLength; i++) {
-        b[bufOffset + i] ^= b[maskOffset + i % 4]; // apply mask to decode payload
-      }
+  if (len > 0) {
+    int size = ws->payloadBufferLen + len + 1;
+    char *payload = ws->payloadBuffer ? realloc(ws->payloadBuffer, size) : malloc(size);
+    if (payload == NULL) {
+      NODE_DBG("Failed to allocate payloadBuffer, disconnecting...\n");
+      ws_abort(ws, -10);
+      return false;
     }
+    memcpy(payload + ws->payloadBufferLen, data, len);
+    ws->payloadBufferLen += len;
+    payload[ws->payloadBufferLen] = '\0';
+    ws->payloadBuffer = payload;
+  }
 
-    if (payloadLength > len - bufOffset) {
-      NODE_DBG("INCOMPLETE Frame \n");
-      if (ws->frameBuffer == NULL) {
-        NODE_DBG("Allocing new frameBuffer \n");
-        ws->frameBuffer = calloc(1,len);
-        if (ws->frameBuffer == NULL) {
-          NODE_DBG("Failed to allocate framebuffer, disconnecting... \n");
-
-          ws->knownFailureCode = -9;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        memcpy(ws->frameBuffer, b, len);
-        ws->frameBufferLen = len;
-      }
-      break; // since the buffer were already concat'ed, wait for the next receive
+  if (isFinal) {
+    char empty[1] = "";
+    if (ws->onReceive) ws->onReceive(ws, ws->payloadBufferLen, ws->payloadBuffer ? ws->payloadBuffer : empty, ws->payloadOriginalOpCode);
+    if (ws->payloadBuffer != NULL) {
+      os_free(ws->payloadBuffer);
+      ws->payloadBuffer = NULL;
     }
+    ws->payloadBufferLen = 0;
+  }
+  return true;
+}
 
-    if (!isFin) {
-      NODE_DBG("PARTIAL frame! Should concat payload and later restore opcode\n");
-      if(ws->payloadBuffer == NULL) {
-        NODE_DBG("Allocing new payloadBuffer \n");
-        ws->payloadBuffer = calloc(1,payloadLength);
-        if (ws->payloadBuffer == NULL) {
-          NODE_DBG("Failed to allocate payloadBuffer, disconnecting...\n");
-
-          ws->knownFailureCode = -10;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        memcpy(ws->payloadBuffer, b + bufOffset, payloadLength);
-        ws->frameBufferLen = payloadLength;
-        ws->payloadOriginalOpCode = opCode;
-      } else {
-        NODE_DBG("Appending new payloadBuffer to old one \n");
-        ws->payloadBuffer = realloc(ws->payloadBuffer, ws->payloadBufferLen + payloadLength);
-        if (ws->payloadBuffer == NULL) {
-          NODE_DBG("Failed to allocate new framebuffer, disconnecting...\n");
-
-          ws->knownFailureCode = -11;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        memcpy(ws->payloadBuffer + ws->payloadBufferLen, b + bufOffset, payloadLength);
-
-        ws->payloadBufferLen += payloadLength;
-      }
-    } else {
-      char *payload;
-      if (opCode == WS_OPCODE_CONTINUATION) {
-        NODE_DBG("restoring original opcode\n");
-        if (ws->payloadBuffer == NULL) {
-          NODE_DBG("Got FIN continuation frame but didn't receive any beforehand, disconnecting...\n");
-
-          ws->knownFailureCode = -15;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        // concat buffer with payload
-        payload = calloc(1,ws->payloadBufferLen + payloadLength);
-
-        if (payload == NULL) {
-          NODE_DBG("Failed to allocate new framebuffer, disconnecting...\n");
-
-          ws->knownFailureCode = -12;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
-        memcpy(payload, ws->payloadBuffer, ws->payloadBufferLen);
-        memcpy(payload + ws->payloadBufferLen, b + bufOffset, payloadLength);
-
-        os_free(ws->payloadBuffer); // free previous buffer
-        ws->payloadBuffer = NULL;
+static void ws_inflateWrite(void *ctx, const uint8_t *data, uint32_t len) {
+  ws_info *ws = (ws_info *) ctx;
+  if (ws->inflateFailed) {
+    return;
+  }
+  char *buf = ws->inflateBuf ? realloc(ws->inflateBuf, ws->inflateLen + len) : malloc(len);
+  if (buf == NULL) {
+    ws->inflateFailed = true;
+    return;
+  }
+  memcpy(buf + ws->inflateLen, data, len);
+  ws->inflateBuf = buf;
+  ws->inflateLen += len;
+}
 
-        payloadLength += ws->payloadBufferLen;
-        ws->payloadBufferLen = 0;
+/*
+ * Inflates a piece of a compressed message. The output is collected and only
+ * delivered after uzlib returns, as the callbacks run Lua, which could start
+ * another stream in uzlib while this one is part way through.
+ */
+static bool ws_inflate(ws_info *ws, char *data, uint32_t len, int isFinal) {
+  static const uint8_t tail[4] = {0, 0, 0xff, 0xff};
+
+  if (ws->inflater == NULL) {
+    ws->inflater = uzlib_inflate_new(UZLIB_FORMAT_RAW, ws->inflateBits);
+    if (ws->inflater == NULL) {
+      NODE_DBG("Failed to allocate inflater, disconnecting...\n");
+      ws_abort(ws, -10);
+      return false;
+    }
+  }
 
-        opCode = ws->payloadOriginalOpCode;
-        ws->payloadOriginalOpCode = 0;
-      } else {
-        int extensionDataOffset = 0;
+  ws->inflateLen = 0;
+  ws->inflateFailed = false;
+  int res = UZLIB_OK;
+  if (len > 0) {
+    res = uzlib_inflate_write(ws->inflater, (const uint8_t *) data, len, ws_inflateWrite, ws);
+  }
+  if (res == UZLIB_OK && isFinal) { // the sender took the sync flush off
+    res = uzlib_inflate_write(ws->inflater, tail, 4, ws_inflateWrite, ws);
+  }
+  if (res == UZLIB_DONE) { // the sender ended the stream, so the next message starts a new one
+    uzlib_inflate_free(ws->inflater);
+    ws->inflater = NULL;
+  }
 
-        if (opCode == WS_OPCODE_CLOSE && payloadLength > 0) {
-          unsigned int reasonCode = b[bufOffset] << 8 + b[bufOffset + 1];
-          NODE_DBG("Closing due to: %d\n", reasonCode); // Must not be shown to client as per spec
-          extensionDataOffset += 2;
-        }
+  bool ok;
+  if (res < 0 || ws->inflateFailed) {
+    NODE_DBG("Failed to inflate message (%d), disconnecting...\n", res);
+    ws_abort(ws, ws->inflateFailed ? -10 : -15);
+    ok = false;
+  } else {
+    ok = (ws->inflateLen == 0 && !isFinal) || ws_deliver(ws, ws->inflateBuf, ws->inflateLen, isFinal);
+  }
+  if (ws->inflateBuf != NULL) {
+    os_free(ws->inflateBuf);
+    ws->inflateBuf = NULL;
+  }
+  return ok;
+}
 
-        payload = calloc(1,payloadLength - extensionDataOffset + 1);
-        if (payload == NULL) {
-          NODE_DBG("Failed to allocate payload, disconnecting...\n");
+static bool ws_controlFrame(ws_info *ws) {
+  char *payload = ws->controlBuffer;
+  int len = ws->controlBufferLen;
 
-          ws->knownFailureCode = -13;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
-        }
+  if (ws->frameOpCode == WS_OPCODE_CLOSE) {
+    if (len >= 2) {
+      NODE_DBG("Closing due to: %d\n", (payload[0] << 8) + payload[1]); // Must not be shown to client as per spec
+    }
+    ws_queueFrame(ws, WS_OPCODE_CLOSE, payload, len, true, true, NULL);
+    ws->connectionState = 4;
+    return false;
+  } else if (ws->frameOpCode == WS_OPCODE_PING) {
+    ws_queueFrame(ws, WS_OPCODE_PONG, payload, len, true, false, NULL);
+  } else if (ws->frameOpCode == WS_OPCODE_PONG) {
+    // ping alarm was already reset...
+  }
+  return true;
+}
 
-        memcpy(payload, b + bufOffset + extensionDataOffset, payloadLength - extensionDataOffset);
-        payload[payloadLength - extensionDataOffset] = '\0';
+/*
+ * Frames are parsed as the bytes arrive, so neither frames nor fragments are
+ * copied whole. The payload is unmasked in place in the receive buffer.
+ */
+// Returns false once the connection is being closed
+static bool ws_receiveFrames(ws_info *ws, char *buf, uint32_t len) {
+  NODE_DBG("ws_receiveFrames %d \n", len);
+
+  while (len > 0 && ws->connectionState == 3) {
+    if (!ws->frameStarted) { // the header can be split across receives
+      while (len > 0 && ws->frameHeaderLen < ws_headerLength(ws->frameHeader, ws->frameHeaderLen)) {
+        ws->frameHeader[ws->frameHeaderLen++] = *buf++;
+        len--;
       }
-
-      NODE_DBG("isFin %d \n", isFin);
-      NODE_DBG("opCode %d \n", opCode);
-      NODE_DBG("hasMask %d \n", hasMask);
-      NODE_DBG("payloadLength %d \n", payloadLength);
-      NODE_DBG("len %d \n", len);
-      NODE_DBG("bufOffset %d \n", bufOffset);
-
-      if (opCode == WS_OPCODE_CLOSE) {
-        NODE_DBG("Closing message: %s\n", payload); // Must not be shown to client as per spec
-
-        espconn_regist_sentcb(conn, ws_closeSentCallback);
-        ws_sendFrame(conn, WS_OPCODE_CLOSE, (const char *) (b + bufOffset), (unsigned short) payloadLength);
-        ws->connectionState = 4;
-      } else if (opCode == WS_OPCODE_PING) {
-        ws_sendFrame(conn, WS_OPCODE_PONG, (const char *) (b + bufOffset), (unsigned short) payloadLength);
-      } else if (opCode == WS_OPCODE_PONG) {
-        // ping alarm was already reset...
-      } else {
-        if (ws->onReceive) ws->onReceive(ws, payloadLength, payload, opCode);
+      if (ws->frameHeaderLen < ws_headerLength(ws->frameHeader, ws->frameHeaderLen)) {
+        return true;
+      }
+      if (!ws_startFrame(ws)) {
+        return false;
       }
-      os_free(payload);
+      ws->frameStarted = true;
     }
 
-    bufOffset += payloadLength;
-    NODE_DBG("bufOffset %d \n", bufOffset);
-    if (bufOffset == len) { // (bufOffset > len) won't happen here because it's being checked earlier
-      b = NULL;
-      if (ws->frameBuffer != NULL) { // the last frame inside buffer was processed
-        os_free(ws->frameBuffer);
-        ws->frameBuffer = NULL;
-        ws->frameBufferLen = 0;
+    uint32_t i, n = len < ws->framePayloadLeft ? len : ws->framePayloadLeft;
+    if (ws->frameHasMask) {
+      for (i = 0; i < n; i++) {
+        buf[i] ^= ws->frameMask[ws->frameMaskPos++ % 4]; // apply mask to decode payload
       }
-    } else {
-      len -= bufOffset;
-      b += bufOffset; // move b to next frame
-      if (ws->frameBuffer != NULL) {
-        NODE_DBG("Reallocing frameBuffer to remove consumed frame\n");
-
-        ws->frameBuffer = realloc(ws->frameBuffer, ws->frameBufferLen + len);
-        if (ws->frameBuffer == NULL) {
-          NODE_DBG("Failed to allocate new frame buffer, disconnecting...\n");
-
-          ws->knownFailureCode = -14;
-          if (ws->isSecure)
-            espconn_secure_disconnect(conn);
-          else
-            espconn_disconnect(conn);
-          return;
+    }
+    ws->framePayloadLeft -= n;
+
+    if (ws->frameOpCode & 0x8) {
+      memcpy(ws->controlBuffer + ws->controlBufferLen, buf, n);
+      ws->controlBufferLen += n;
+    } else if (n > 0 || ws->frameIsFin) {
+      int isFinal = ws->frameIsFin && ws->framePayloadLeft == 0;
+      if (!(ws->frameCompressed ? ws_inflate(ws, buf, n, isFinal) : ws_deliver(ws, buf, n, isFinal))) {
+        return false;
+      }
+    }
+    buf += n;
+    len -= n;
+
+    if (ws->framePayloadLeft == 0) {
+      ws->frameStarted = false;
+      ws->frameHeaderLen = 0;
+      if (ws->frameOpCode & 0x8) {
+        if (!ws_controlFrame(ws)) {
+          return false;
         }
-        memcpy(ws->frameBuffer + ws->frameBufferLen, b, len);
-
-        ws->frameBufferLen += len;
-        b = ws->frameBuffer;
+      } else if (ws->frameIsFin) {
+        ws->payloadOriginalOpCode = 0;
       }
     }
   }
+  return ws->connectionState == 3;
 }
 
-static void ws_initReceiveCallback(void *arg, char *buf, unsigned short len) {
-  NODE_DBG("ws_initReceiveCallback %d \n", len);
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
+// Takes up permessage-deflate if the server accepted the offer
+static void ws_acceptExtensions(ws_info *ws, const char *buf) {
+  const char *line = buf;
+  while ((line = strstr(line, "\r\n")) != NULL) {
+    line += 2;
+    if (line[0] == '\r') { // end of the headers
+      return;
+    }
+    if (strncasecmp(line, WS_HTTP_SEC_WEBSOCKET_EXTENSIONS, strlen(WS_HTTP_SEC_WEBSOCKET_EXTENSIONS)) == 0) {
+      break;
+    }
+  }
+  if (line == NULL || ws->deflateBits == 0) {
+    return;
+  }
+
+  char ext[128];
+  const char *end = strstr(line, "\r\n");
+  size_t i, n = end ? end - line : strlen(line);
+  if (n >= sizeof(ext)) {
+    n = sizeof(ext) - 1;
+  }
+  for (i = 0; i < n; i++) {
+    ext[i] = tolower((unsigned char) line[i]);
+  }
+  ext[n] = '\0';
+  if (strstr(ext, "permessage-deflate") == NULL) {
+    return;
+  }
+
+  // The server may ask for a smaller window than offered, or for none at all
+  int bits = ws->deflateBits < UZLIB_DEFLATE_MAX_WINDOW ? ws->deflateBits : UZLIB_DEFLATE_MAX_WINDOW;
+  const char *p = strstr(ext, "client_max_window_bits=");
+  if (p != NULL && atoi(p + 23) < bits) {
+    bits = atoi(p + 23);
+  }
+  ws->inflateBits = ws->deflateBits;
+  p = strstr(ext, "server_max_window_bits=");
+  if (p != NULL && atoi(p + 23) >= UZLIB_INFLATE_MIN_WINDOW && atoi(p + 23) < ws->inflateBits) {
+    ws->inflateBits = atoi(p + 23);
+  }
+  ws->deflateOn = true;
+  ws->deflateReset = strstr(ext, "client_no_context_takeover") != NULL;
+  ws->deflateSendBits = bits >= UZLIB_DEFLATE_MIN_WINDOW ? bits : 0;
+  NODE_DBG("permessage-deflate on, sending with %d window bits\n", ws->deflateSendBits);
+}
+
+static void ws_initReceive(ws_info *ws, char *buf, unsigned short len) {
+  NODE_DBG("ws_initReceive %d \n", len);
 
   // Check server is switch protocols
   if (strstr(buf, WS_HTTP_SWITCH_PROTOCOL_HEADER) == NULL) {
-      NODE_DBG("Server is not switching protocols\n");
-      ws->knownFailureCode = -17;
-    if (ws->isSecure)
-      espconn_secure_disconnect(conn);
-    else
-      espconn_disconnect(conn);
+    NODE_DBG("Server is not switching protocols\n");
+    ws_abort(ws, -17);
     return;
   }
 
   // Check server has valid sec key
   if (strstr(buf, ws->expectedSecKey) == NULL) {
     NODE_DBG("Server has invalid response\n");
-    ws->knownFailureCode = -7;
-    if (ws->isSecure)
-      espconn_secure_disconnect(conn);
-    else
-      espconn_disconnect(conn);
+    ws_abort(ws, -7);
     return;
   }
 
   NODE_DBG("Server response is valid, it's now a websocket!\n");
 
+  ws_acceptExtensions(ws, buf);
+
   os_timer_disarm(&ws->timeoutTimer);
-  os_timer_setfn(&ws->timeoutTimer, (os_timer_func_t *) ws_sendPingTimeout, conn);
+  os_timer_setfn(&ws->timeoutTimer, (os_timer_func_t *) ws_sendPingTimeout, ws);
   SWTIMER_REG_CB(ws_sendPingTimeout, SWTIMER_RESUME)
   os_timer_arm(&ws->timeoutTimer, WS_PING_INTERVAL_MS, true);
 
-  espconn_regist_recvcb(conn, ws_receiveCallback);
+  ws->upgraded = true;
 
   if (ws->onConnection) ws->onConnection(ws);
 
@@ -573,28 +758,65 @@ static void ws_initReceiveCallback(void *arg, char *buf, unsigned short len) {
   NODE_DBG("dataLength = %d\n", len - (data - buf) - 4);
 
   if (data != NULL && dataLength > 0) { // handshake already contained a frame
-    ws_receiveCallback(arg, data + 4, dataLength);
+    ws_receiveFrames(ws, data + 4, dataLength);
+  }
+}
+
+/*
+ * The frames are parsed straight from the segments they arrived in. The
+ * handshake response is expected in the first one, and copied to be a string.
+ */
+static void ws_receiveCallback(void *arg, struct pbuf *p) {
+  ws_info *ws = (ws_info *) arg;
+
+  if (!ws->upgraded) {
+    char *buf = (char *) os_malloc(p->tot_len + 1);
+    if (buf == NULL) {
+      ws_abort(ws, -10);
+    } else {
+      pbuf_copy_partial(p, buf, p->tot_len, 0);
+      buf[p->tot_len] = '\0';
+      ws_initReceive(ws, buf, p->tot_len);
+      os_free(buf);
+    }
+    pbuf_free(p);
+    return;
   }
+
+  ws->unhealthyPoints = 0; // received data, connection is healthy
+  os_timer_disarm(&ws->timeoutTimer); // reset ping check
+  os_timer_arm(&ws->timeoutTimer, WS_PING_INTERVAL_MS, true);
+
+  struct pbuf *q = p;
+  while (q != NULL && ws_receiveFrames(ws, (char *) q->payload, q->len)) {
+    q = q->next;
+  }
+  pbuf_free(p);
 }
 
 static void connect_callback(void *arg) {
   NODE_DBG("Connected\n");
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
+  ws_info *ws = (ws_info *) arg;
   ws->connectionState = 3;
 
-  espconn_regist_recvcb(conn, ws_initReceiveCallback);
-
   char *key;
   generateSecKeys(&key, &ws->expectedSecKey);
 
+  char extension[80];
+
   header_t headers[] = {
 	  {"Upgrade", "websocket"},
 	  {"Connection", "Upgrade"},
 	  {"Sec-WebSocket-Key", key},
 	  {"Sec-WebSocket-Version", "13"},
+	  {NULL, extension}, // offered below
 	  {0}
   };
+  if (ws->deflateBits) {
+    int bits = ws->deflateBits < UZLIB_DEFLATE_MAX_WINDOW ? ws->deflateBits : UZLIB_DEFLATE_MAX_WINDOW;
+    os_sprintf(extension, "permessage-deflate; client_max_window_bits=%d; server_max_window_bits=%d", bits, ws->deflateBits);
+    headers[4].key = "Sec-WebSocket-Extensions";
+  }
 
   const header_t *extraHeaders = ws->extraHeaders ? ws->extraHeaders : EMPTY_HEADERS;
 
@@ -613,16 +835,13 @@ static void connect_callback(void *arg) {
 
   os_free(key);
   NODE_DBG("request: %s", buf);
-  if (ws->isSecure)
-    espconn_secure_send(conn, (uint8_t *) buf, len);
-  else
-    espconn_send(conn, (uint8_t *) buf, len);
+  if (nsock_write(ws->conn, buf, len) != ERR_OK) {
+    ws_abort(ws, -16);
+  }
 }
 
-static void disconnect_callback(void *arg) {
+static void disconnect_callback(ws_info *ws) {
   NODE_DBG("disconnect_callback\n");
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
 
   ws->connectionState = 4;
 
@@ -637,24 +856,23 @@ static void disconnect_callback(void *arg) {
     os_free(ws->expectedSecKey);
   }
 
-  if (ws->frameBuffer != NULL) {
-    os_free(ws->frameBuffer);
-  }
-
   if (ws->payloadBuffer != NULL) {
     os_free(ws->payloadBuffer);
+    ws->payloadBuffer = NULL;
   }
 
-  if (conn->proto.tcp != NULL) {
-    os_free(conn->proto.tcp);
+  if (ws->deflater != NULL) {
+    uzlib_deflate_free(ws->deflater);
+    ws->deflater = NULL;
+  }
+  if (ws->inflater != NULL) {
+    uzlib_inflate_free(ws->inflater);
+    ws->inflater = NULL;
   }
 
-  NODE_DBG("conn %d\n", conn);
-  espconn_delete(conn);
-
-  NODE_DBG("freeing conn1 \n");
+  ws_flushQueue(ws);
 
-  os_free(conn);
+  // the socket frees itself once this returns
   ws->conn = NULL;
 
   if (ws->onFailure) {
@@ -665,63 +883,30 @@ static void disconnect_callback(void *arg) {
 
 static void ws_connectTimeout(void *arg) {
   NODE_DBG("ws_connectTimeout\n");
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
-
-  ws->knownFailureCode = -18;
-  disconnect_callback(arg);
-}
+  ws_info *ws = (ws_info *) arg;
 
-static void error_callback(void * arg, sint8 errType) {
-  NODE_DBG("error_callback %d\n", errType);
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
-
-  ws->knownFailureCode = ((int) errType) - 100;
-  disconnect_callback(arg);
+  ws_abort(ws, -18);
 }
 
-static void dns_callback(const char *hostname, ip_addr_t *addr, void *arg) {
-  NODE_DBG("dns_callback\n");
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
-
-  if (ws->conn == NULL || ws->connectionState == 4) {
-          return;
-  }
+static void closed_callback(void *arg, err_t err) {
+  NODE_DBG("closed_callback %d\n", err);
+  ws_info *ws = (ws_info *) arg;
 
-  if (addr == NULL)  {
+  if (err == NSOCK_ERR_DNS) {
     ws->knownFailureCode = -5;
-    disconnect_callback(arg);
-    return;
+  } else if (err != ERR_OK) {
+    ws->knownFailureCode = ((int) err) - 100;
   }
-
-  ws->connectionState = 2;
-
-  os_memcpy(conn->proto.tcp->remote_ip, addr, 4);
-
-  espconn_regist_connectcb(conn, connect_callback);
-  espconn_regist_disconcb(conn, disconnect_callback);
-  espconn_regist_reconcb(conn, error_callback);
-
-  // Set connection timeout timer
-  os_timer_disarm(&ws->timeoutTimer);
-  os_timer_setfn(&ws->timeoutTimer, (os_timer_func_t *) ws_connectTimeout, conn);
-  SWTIMER_REG_CB(ws_connectTimeout, SWTIMER_RESUME)
-  os_timer_arm(&ws->timeoutTimer, WS_CONNECT_TIMEOUT_MS, false);
-
-  if (ws->isSecure) {
-    NODE_DBG("secure connecting \n");
-    espconn_secure_connect(conn);
-  }
-  else {
-    NODE_DBG("insecure connecting \n");
-    espconn_connect(conn);
-  }
-
-  NODE_DBG("DNS found %s " IPSTR " \n", hostname, IP2STR(addr));
+  disconnect_callback(ws);
 }
 
+static const nsock_callbacks ws_callbacks = {
+  .connected = connect_callback,
+  .recv = ws_receiveCallback,
+  .sent = ws_sentCallback,
+  .closed = closed_callback,
+};
+
 void ws_connect(ws_info *ws, const char *url) {
   NODE_DBG("ws_connect called\n");
 
@@ -803,55 +988,65 @@ void ws_connect(ws_info *ws, const char *url) {
   ws->path = strdup(path);
   ws->expectedSecKey = NULL;
   ws->knownFailureCode = 0;
-  ws->frameBuffer = NULL;
-  ws->frameBufferLen = 0;
+  ws->frameStarted = false;
+  ws->frameHeaderLen = 0;
   ws->payloadBuffer = NULL;
   ws->payloadBufferLen = 0;
   ws->payloadOriginalOpCode = 0;
   ws->unhealthyPoints = 0;
+  ws->sendQueue = NULL;
+  ws->sendBusy = false;
+  ws->upgraded = false;
+  ws->deflateOn = false;
+  ws->deflateSendBits = 0;
+  ws->deflateReset = false;
+  ws->frameCompressed = false;
+  ws->deflater = NULL;
+  ws->inflater = NULL;
+  ws->inflateBuf = NULL;
+
+  // Set connection timeout timer, which also covers resolving the hostname
+  os_timer_disarm(&ws->timeoutTimer);
+  os_timer_setfn(&ws->timeoutTimer, (os_timer_func_t *) ws_connectTimeout, ws);
+  SWTIMER_REG_CB(ws_connectTimeout, SWTIMER_RESUME)
+  os_timer_arm(&ws->timeoutTimer, WS_CONNECT_TIMEOUT_MS, false);
 
-  // Prepare espconn
-  struct espconn *conn = (struct espconn *) calloc(1,sizeof(struct espconn));
-  conn->type = ESPCONN_TCP;
-  conn->state = ESPCONN_NONE;
-  conn->proto.tcp = (esp_tcp *) calloc(1,sizeof(esp_tcp));
-  conn->proto.tcp->local_port = espconn_port();
-  conn->proto.tcp->remote_port = ws->port;
-
-  conn->reverse = ws;
-  ws->conn = conn;
-
-  // Attempt to resolve hostname address
-  ip_addr_t  addr;
-  err_t result = dns_gethostbyname(hostname, &addr, dns_callback, conn);
-
-  if (result == ERR_INPROGRESS) {
-    NODE_DBG("DNS pending\n");
-  } else {
-    dns_callback(hostname, &addr, conn);
+  ws->conn = nsock_connect(hostname, port, isSecure, &ws_callbacks, ws);
+  if (ws->conn == NULL) {
+    os_timer_disarm(&ws->timeoutTimer);
+    os_free(ws->hostname);
+    os_free(ws->path);
+    ws->connectionState = 4;
+    if (ws->onFailure) ws->onFailure(ws, -16);
   }
-
-  return;
 }
 
-void ws_send(ws_info *ws, int opCode, const char *message, unsigned short length) {
+bool ws_send(ws_info *ws, int opCode, const char *message, uint32_t length, void *arg) {
   NODE_DBG("ws_send\n");
-  ws_sendFrame(ws->conn, opCode, message, length);
+  if (ws->deflateSendBits && ws_canSend(ws) && length >= WS_DEFLATE_MIN &&
+      (opCode == WS_OPCODE_TEXT || opCode == WS_OPCODE_BINARY)) {
+    ws_frame *f = ws_deflate(ws, message, length);
+    if (f != NULL) {
+      f->opCode = opCode | WS_RSV1;
+      f->copied = true;
+      f->data = f->control;
+      ws_pushFrame(ws, f);
+      if (ws->onSent) ws->onSent(ws, arg); // the message itself is no longer needed
+      return true;
+    }
+  }
+  return ws_queueFrame(ws, opCode, message, length, false, false, arg);
 }
 
 static void ws_forceCloseTimeout(void *arg) {
   NODE_DBG("ws_forceCloseTimeout\n");
-  struct espconn *conn = (struct espconn *) arg;
-  ws_info *ws = (ws_info *) conn->reverse;
+  ws_info *ws = (ws_info *) arg;
 
   if (ws->connectionState == 0 || ws->connectionState == 4) {
     return;
   }
 
-  if (ws->isSecure)
-    espconn_secure_disconnect(ws->conn);
-  else
-    espconn_disconnect(ws->conn);
+  nsock_close(ws->conn, ERR_OK);
 }
 
 void ws_close(ws_info *ws) {
@@ -862,13 +1057,13 @@ void ws_close(ws_info *ws) {
   }
 
   ws->knownFailureCode = 0; // no error as user requested to close
-  if (ws->connectionState == 1) {
-    disconnect_callback(ws->conn);
+  if (ws->connectionState != 3) {
+    nsock_close(ws->conn, ERR_OK);
   } else {
-    ws_sendFrame(ws->conn, WS_OPCODE_CLOSE, NULL, 0);
+    ws_queueFrame(ws, WS_OPCODE_CLOSE, NULL, 0, true, false, NULL);
 
     os_timer_disarm(&ws->timeoutTimer);
-    os_timer_setfn(&ws->timeoutTimer, (os_timer_func_t *) ws_forceCloseTimeout, ws->conn);
+    os_timer_setfn(&ws->timeoutTimer, (os_timer_func_t *) ws_forceCloseTimeout, ws);
     SWTIMER_REG_CB(ws_forceCloseTimeout, SWTIMER_RESUME);
     os_timer_arm(&ws->timeoutTimer, WS_FORCE_CLOSE_TIMEOUT_MS, false);
   }
@@ -27,21 +27,42 @@
 
 #include "osapi.h"
 #include "user_interface.h"
-#include "espconn.h"
+#include "osapi.h"
 #include "mem.h"
 #include <limits.h>
 #include <stdlib.h>
 
-#if defined(USES_SDK_BEFORE_V140)
-#define espconn_send espconn_sent
-#define espconn_secure_send espconn_secure_sent
-#endif
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_GUID_LENGTH 36
+
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+
+#define WS_CONTROL_MAX 125
+
+#define WS_RSV1 0x40 // the compressed bit of permessage-deflate
+
+// Window sizes of permessage-deflate the client can offer, as powers of 2
+#define WS_DEFLATE_BITS 10
+#define WS_DEFLATE_MIN_BITS 9
+#define WS_DEFLATE_MAX_BITS 15
 
 struct ws_info;
 
 typedef void (*ws_onConnectionCallback)(struct ws_info *wsInfo);
 typedef void (*ws_onReceiveCallback)(struct ws_info *wsInfo, int len, char *message, int opCode);
 typedef void (*ws_onFailureCallback)(struct ws_info *wsInfo, int errorCode);
+typedef void (*ws_onFragmentCallback)(struct ws_info *wsInfo, int len, char *data, int opCode, int isFinal);
+typedef void (*ws_onSentCallback)(struct ws_info *wsInfo, void *arg);
+
+struct ws_frame;
+struct nsock;
+struct uzlib_deflate_stream;
+struct uzlib_inflate_stream;
 
 typedef struct {
 	char *key;
@@ -58,16 +79,44 @@ typedef struct ws_info {
   char *expectedSecKey;
   header_t *extraHeaders;
 
-  struct espconn *conn;
+  struct nsock *conn;
   void *reservedData;
   int knownFailureCode;
 
-  char *frameBuffer;
-  int frameBufferLen;
+  // the frame being received
+  bool frameStarted;
+  unsigned char frameHeader[14];
+  int frameHeaderLen;
+  int frameOpCode;
+  int frameIsFin;
+  int frameHasMask;
+  char frameMask[4];
+  uint32_t frameMaskPos;
+  uint32_t framePayloadLeft;
+  char controlBuffer[125];
+  int controlBufferLen;
 
   char *payloadBuffer;
   int payloadBufferLen;
-  int payloadOriginalOpCode;
+  int payloadOriginalOpCode; // opcode of the message in progress, 0 if none
+
+  bool upgraded; // the server accepted the websocket handshake
+
+  // permessage-deflate (RFC 7692)
+  int deflateBits;        // window bits to offer, 0 not to offer the extension
+  int deflateSendBits;    // window of our compressor, 0 to send uncompressed
+  int inflateBits;        // window of the server's compressor
+  bool deflateOn;         // the server accepted the extension
+  bool deflateReset;      // the server keeps no dictionary between our messages
+  bool frameCompressed;   // the message being received is compressed
+  struct uzlib_deflate_stream *deflater;
+  struct uzlib_inflate_stream *inflater;
+  char *inflateBuf;       // output of one inflated piece
+  uint32_t inflateLen;
+  bool inflateFailed;
+
+  struct ws_frame *sendQueue;
+  bool sendBusy;
 
   os_timer_t  timeoutTimer;
   int unhealthyPoints;
@@ -75,6 +124,8 @@ typedef struct ws_info {
   ws_onConnectionCallback onConnection;
   ws_onReceiveCallback onReceive;
   ws_onFailureCallback onFailure;
+  ws_onFragmentCallback onFragment; // if set, messages are passed on piece by piece instead of to onReceive
+  ws_onSentCallback onSent;
 } ws_info;
 
 /*
@@ -83,13 +134,29 @@ typedef struct ws_info {
 void ws_connect(ws_info *wsInfo, const char *url);
 
 /*
- * Sends a message with a given opcode.
+ * Queues a message with a given opcode. The message is not copied; it must
+ * stay valid until onSent is called with arg. Returns false if it was not
+ * queued, in which case onSent is not called.
  */
-void ws_send(ws_info *wsInfo, int opCode, const char *message, unsigned short length);
+bool ws_send(ws_info *wsInfo, int opCode, const char *message, uint32_t length, void *arg);
 
 /*
  * Disconnects existing conection and frees memory.
  */
 void ws_close(ws_info *wsInfo);
 
+/*
+ * Framing helpers, shared with the server.
+ */
+
+// Both return heap memory that requires free
+char *cryptoSha1(char *data, unsigned int len);
+char *base64Encode(char *data, unsigned int len);
+
+// Length of a frame header, as far as the first "have" bytes of it tell
+int ws_headerLength(const unsigned char *header, int have);
+
+// Writes a FIN frame header, without the mask key, and returns its length
+int ws_frameHeader(char *buf, int opCode, uint32_t len, bool masked);
+
 #endif // _WEBSOCKET_H_
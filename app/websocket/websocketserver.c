@@ -0,0 +1,445 @@
+/* Websocket server implementation
+ *
+ * Accepts RFC6455 (version 13) connections over raw lwIP TCP, answers the
+ * opening handshake with the client's SHA-1 and base64 helpers and collects
+ * each message before handing it to the application.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#include "websocketserver.h"
+
+#define WS_SERVER_BAD_REQUEST "HTTP/1.1 400 Bad Request\r\n"\
+                              "Connection: close\r\n"\
+                              "\r\n"
+
+#define WS_SERVER_SWITCH_PROTOCOLS "HTTP/1.1 101 Switching Protocols\r\n"\
+                                   "Upgrade: websocket\r\n"\
+                                   "Connection: Upgrade\r\n"\
+                                   "Sec-WebSocket-Accept: %s\r\n"
+
+#define WS_SERVER_KEY_MAX 64
+
+static void ws_server_drop(ws_peer *c, int code) {
+  if (c->dead) {
+    return;
+  }
+  c->dead = true;
+
+  ws_peer **link = &c->server->peers;
+  while (*link != NULL && *link != c) {
+    link = &(*link)->next;
+  }
+  if (*link != NULL) {
+    *link = c->next;
+  }
+
+  if (c->pcb != NULL) {
+    tcp_arg(c->pcb, NULL);
+    tcp_recv(c->pcb, NULL);
+    tcp_err(c->pcb, NULL);
+    if (tcp_close(c->pcb) != ERR_OK) {
+      tcp_abort(c->pcb);
+      c->aborted = true;
+    }
+    c->pcb = NULL;
+  }
+
+  if (c->request != NULL) {
+    os_free(c->request);
+    c->request = NULL;
+  }
+  if (c->message != NULL) {
+    os_free(c->message);
+    c->message = NULL;
+  }
+
+  NODE_DBG("ws_server_drop %d\n", code);
+  if (c->upgraded && c->server->onClose) c->server->onClose(c->server, c, code);
+
+  if (!c->busy) {
+    os_free(c);
+  }
+}
+
+static bool ws_server_write(ws_peer *c, int opCode, const char *data, uint32_t len) {
+  char header[10];
+  int headerLen = ws_frameHeader(header, opCode, len, false); // servers do not mask
+
+  if (c->dead || !c->upgraded || tcp_sndbuf(c->pcb) < headerLen + len) {
+    return false;
+  }
+  if (tcp_write(c->pcb, header, headerLen, TCP_WRITE_FLAG_COPY | (len ? TCP_WRITE_FLAG_MORE : 0)) != ERR_OK) {
+    return false;
+  }
+  if (len > 0 && tcp_write(c->pcb, data, len, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+    NODE_DBG("Out of memory when sending message, disconnecting...\n");
+    ws_server_drop(c, -16); // the header went out without its payload
+    return false;
+  }
+  tcp_output(c->pcb);
+  return true;
+}
+
+// Value of a request header, or NULL
+static char *ws_server_header(char *request, const char *name, int *len) {
+  int n = strlen(name);
+  char *line = strstr(request, "\r\n");
+  while (line != NULL) {
+    line += 2;
+    if (strncasecmp(line, name, n) == 0 && line[n] == ':') {
+      char *value = line + n + 1;
+      while (*value == ' ') {
+        value++;
+      }
+      char *end = strstr(value, "\r\n");
+      *len = end ? end - value : strlen(value);
+      return value;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return NULL;
+}
+
+static void ws_server_feed(ws_peer *c, char *buf, int len);
+
+static void ws_server_handshake(ws_peer *c, char *buf, int len) {
+  if (c->requestLen + len > WS_SERVER_REQUEST_MAX) {
+    NODE_DBG("Handshake request too long\n");
+    ws_server_drop(c, -17);
+    return;
+  }
+  char *request = c->request ? realloc(c->request, c->requestLen + len + 1) : malloc(len + 1);
+  if (request == NULL) {
+    ws_server_drop(c, -8);
+    return;
+  }
+  memcpy(request + c->requestLen, buf, len);
+  c->requestLen += len;
+  request[c->requestLen] = '\0';
+  c->request = request;
+
+  char *end = strstr(request, "\r\n\r\n");
+  if (end == NULL) {
+    return;
+  }
+  end[2] = '\0'; // headers only, each ending in CRLF
+  char *rest = end + 4;
+  int restLen = c->requestLen - (rest - request);
+
+  int keyLen, upgradeLen, protocolLen = 0;
+  char *key = ws_server_header(request, "Sec-WebSocket-Key", &keyLen);
+  char *upgrade = ws_server_header(request, "Upgrade", &upgradeLen);
+  char *protocol = ws_server_header(request, "Sec-WebSocket-Protocol", &protocolLen);
+
+  if (strncmp(request, "GET ", 4) != 0 || key == NULL || keyLen > WS_SERVER_KEY_MAX ||
+      upgrade == NULL || strncasecmp(upgrade, "websocket", 9) != 0) {
+    NODE_DBG("Not a websocket handshake\n");
+    tcp_write(c->pcb, WS_SERVER_BAD_REQUEST, strlen(WS_SERVER_BAD_REQUEST), TCP_WRITE_FLAG_COPY);
+    ws_server_drop(c, -17);
+    return;
+  }
+
+  // accept = b64(sha1(key + GUID))
+  char keyWithGuid[WS_SERVER_KEY_MAX + WS_GUID_LENGTH];
+  memcpy(keyWithGuid, key, keyLen);
+  memcpy(keyWithGuid + keyLen, WS_GUID, WS_GUID_LENGTH);
+  char *digest = cryptoSha1(keyWithGuid, keyLen + WS_GUID_LENGTH);
+  char *accept = digest ? base64Encode(digest, 20) : NULL;
+  if (digest) os_free(digest);
+  if (accept == NULL) {
+    ws_server_drop(c, -8);
+    return;
+  }
+
+  // Agree to the first subprotocol offered, as clients fail the connection otherwise
+  if (protocol != NULL) {
+    int i;
+    for (i = 0; i < protocolLen && protocol[i] != ',' && protocol[i] != ' '; i++);
+    protocolLen = i;
+  }
+
+  char response[sizeof(WS_SERVER_SWITCH_PROTOCOLS) + 32 + 26 + protocolLen];
+  int responseLen = os_sprintf(response, WS_SERVER_SWITCH_PROTOCOLS, accept);
+  os_free(accept);
+  if (protocolLen > 0) {
+    responseLen += os_sprintf(response + responseLen, "Sec-WebSocket-Protocol: ");
+    memcpy(response + responseLen, protocol, protocolLen);
+    responseLen += protocolLen;
+    responseLen += os_sprintf(response + responseLen, "\r\n");
+  }
+  responseLen += os_sprintf(response + responseLen, "\r\n");
+
+  if (tcp_write(c->pcb, response, responseLen, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+    ws_server_drop(c, -16);
+    return;
+  }
+  tcp_output(c->pcb);
+
+  NODE_DBG("Client handshake is valid, it's now a websocket!\n");
+  c->request = NULL;
+  c->requestLen = 0;
+  c->upgraded = true;
+  if (c->server->onConnection) c->server->onConnection(c->server, c);
+
+  if (restLen > 0 && !c->dead) { // frames sent straight after the handshake
+    ws_server_feed(c, rest, restLen);
+  }
+  os_free(request);
+}
+
+static bool ws_server_startFrame(ws_peer *c) {
+  const unsigned char *h = c->frameHeader;
+  int opCode = h[0] & 0x0f;
+  uint32_t payloadLength = h[1] & 0x7f;
+  int bufOffset = 2;
+  if (payloadLength == 126) {
+    payloadLength = (h[2] << 8) + h[3];
+    bufOffset = 4;
+  } else if (payloadLength == 127) {
+    if (h[2] || h[3] || h[4] || h[5]) {
+      ws_server_drop(c, -8);
+      return false;
+    }
+    payloadLength = (h[6] << 24) + (h[7] << 16) + (h[8] << 8) + h[9];
+    bufOffset = 10;
+  }
+
+  if (!(h[1] & 0x80)) {
+    NODE_DBG("Client frame is not masked, disconnecting...\n");
+    ws_server_drop(c, -15);
+    return false;
+  }
+  memcpy(c->frameMask, h + bufOffset, 4);
+  c->frameMaskPos = 0;
+  c->frameIsFin = h[0] & 0x80 ? 1 : 0;
+  c->frameOpCode = opCode;
+  c->framePayloadLeft = payloadLength;
+
+  if (opCode & 0x8) {
+    if (!c->frameIsFin || payloadLength > WS_CONTROL_MAX) {
+      NODE_DBG("Got fragmented or oversized control frame, disconnecting...\n");
+      ws_server_drop(c, -15);
+      return false;
+    }
+    c->controlBufferLen = 0;
+    return true;
+  }
+
+  if (opCode == WS_OPCODE_CONTINUATION) {
+    if (c->messageOpCode == 0) {
+      ws_server_drop(c, -15);
+      return false;
+    }
+  } else if (c->messageOpCode != 0 || (opCode != WS_OPCODE_TEXT && opCode != WS_OPCODE_BINARY)) {
+    ws_server_drop(c, -15);
+    return false;
+  } else {
+    c->messageOpCode = opCode;
+  }
+
+  if (c->messageLen + payloadLength > WS_SERVER_MESSAGE_MAX) {
+    NODE_DBG("Message too large, disconnecting...\n");
+    ws_server_drop(c, -8);
+    return false;
+  }
+  return true;
+}
+
+static void ws_server_controlFrame(ws_peer *c) {
+  if (c->frameOpCode == WS_OPCODE_CLOSE) {
+    ws_server_write(c, WS_OPCODE_CLOSE, c->controlBuffer, c->controlBufferLen);
+    ws_server_drop(c, 0);
+  } else if (c->frameOpCode == WS_OPCODE_PING) {
+    ws_server_write(c, WS_OPCODE_PONG, c->controlBuffer, c->controlBufferLen);
+  }
+}
+
+static void ws_server_feed(ws_peer *c, char *buf, int len) {
+  while (len > 0 && !c->dead) {
+    if (!c->frameStarted) { // the header can be split across segments
+      while (len > 0 && c->frameHeaderLen < ws_headerLength(c->frameHeader, c->frameHeaderLen)) {
+        c->frameHeader[c->frameHeaderLen++] = *buf++;
+        len--;
+      }
+      if (c->frameHeaderLen < ws_headerLength(c->frameHeader, c->frameHeaderLen) || !ws_server_startFrame(c)) {
+        return;
+      }
+      c->frameStarted = true;
+    }
+
+    uint32_t i, n = len < c->framePayloadLeft ? len : c->framePayloadLeft;
+    for (i = 0; i < n; i++) {
+      buf[i] ^= c->frameMask[c->frameMaskPos++ % 4]; // apply mask to decode payload
+    }
+    c->framePayloadLeft -= n;
+
+    if (c->frameOpCode & 0x8) {
+      memcpy(c->controlBuffer + c->controlBufferLen, buf, n);
+      c->controlBufferLen += n;
+    } else if (n > 0) {
+      char *message = c->message ? realloc(c->message, c->messageLen + n + 1) : malloc(n + 1);
+      if (message == NULL) {
+        ws_server_drop(c, -8);
+        return;
+      }
+      memcpy(message + c->messageLen, buf, n);
+      c->messageLen += n;
+      message[c->messageLen] = '\0';
+      c->message = message;
+    }
+    buf += n;
+    len -= n;
+
+    if (c->framePayloadLeft == 0) {
+      c->frameStarted = false;
+      c->frameHeaderLen = 0;
+      if (c->frameOpCode & 0x8) {
+        ws_server_controlFrame(c);
+      } else if (c->frameIsFin) {
+        char empty[1] = "";
+        char *message = c->message;
+        uint32_t messageLen = c->messageLen;
+        int opCode = c->messageOpCode;
+        c->message = NULL;
+        c->messageLen = 0;
+        c->messageOpCode = 0;
+        if (c->server->onReceive) c->server->onReceive(c->server, c, messageLen, message ? message : empty, opCode);
+        if (message) os_free(message);
+      }
+    }
+  }
+}
+
+static err_t ws_server_recv_cb(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err) {
+  ws_peer *c = (ws_peer *) arg;
+  if (c == NULL) {
+    if (p) {
+      tcp_recved(pcb, p->tot_len);
+      pbuf_free(p);
+    }
+    return ERR_OK;
+  }
+
+  c->busy = true;
+  if (p == NULL) {
+    ws_server_drop(c, -6); // closed without a close frame
+  } else {
+    tcp_recved(pcb, p->tot_len);
+    struct pbuf *q;
+    for (q = p; q != NULL && !c->dead; q = q->next) {
+      if (c->upgraded)
+        ws_server_feed(c, (char *) q->payload, q->len);
+      else
+        ws_server_handshake(c, (char *) q->payload, q->len);
+    }
+    pbuf_free(p);
+  }
+  c->busy = false;
+
+  if (c->dead) {
+    bool aborted = c->aborted;
+    os_free(c);
+    return aborted ? ERR_ABRT : ERR_OK;
+  }
+  return ERR_OK;
+}
+
+static void ws_server_err_cb(void *arg, err_t err) {
+  ws_peer *c = (ws_peer *) arg;
+  if (c == NULL) {
+    return;
+  }
+  c->pcb = NULL; // already freed by lwIP
+  ws_server_drop(c, ((int) err) - 100);
+}
+
+static err_t ws_server_accept_cb(void *arg, struct tcp_pcb *pcb, err_t err) {
+  ws_server *server = (ws_server *) arg;
+  if (server == NULL || server->pcb == NULL) {
+    return ERR_ABRT;
+  }
+  tcp_accepted(server->pcb);
+
+  ws_peer *c = (ws_peer *) calloc(1, sizeof(ws_peer));
+  if (c == NULL) {
+    return ERR_MEM;
+  }
+  c->server = server;
+  c->pcb = pcb;
+  c->next = server->peers;
+  server->peers = c;
+
+  tcp_arg(pcb, c);
+  tcp_recv(pcb, ws_server_recv_cb);
+  tcp_err(pcb, ws_server_err_cb);
+  return ERR_OK;
+}
+
+err_t ws_server_listen(ws_server *server, uint16_t port) {
+  struct tcp_pcb *pcb = tcp_new();
+  if (pcb == NULL) {
+    return ERR_MEM;
+  }
+  pcb->so_options |= SOF_REUSEADDR;
+
+  err_t err = tcp_bind(pcb, IP_ADDR_ANY, port);
+  if (err == ERR_OK) {
+    struct tcp_pcb *lpcb = tcp_listen(pcb); // frees pcb on success
+    if (lpcb != NULL) {
+      tcp_arg(lpcb, server);
+      tcp_accept(lpcb, ws_server_accept_cb);
+      server->pcb = lpcb;
+      return ERR_OK;
+    }
+    err = ERR_MEM;
+  }
+  tcp_close(pcb);
+  return err;
+}
+
+bool ws_server_send(ws_peer *c, int opCode, const char *message, uint32_t length) {
+  return ws_server_write(c, opCode, message, length);
+}
+
+int ws_server_broadcast(ws_server *server, int opCode, const char *message, uint32_t length) {
+  int count = 0;
+  ws_peer *c, *next;
+  for (c = server->peers; c != NULL; c = next) {
+    next = c->next; // a failed write can drop the peer
+    if (ws_server_write(c, opCode, message, length)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void ws_server_close_peer(ws_peer *c) {
+  if (c->dead) {
+    return;
+  }
+  ws_server_write(c, WS_OPCODE_CLOSE, NULL, 0);
+  ws_server_drop(c, 0);
+}
+
+void ws_server_close(ws_server *server) {
+  if (server->closing) {
+    return;
+  }
+  server->closing = true;
+
+  if (server->pcb != NULL) {
+    tcp_arg(server->pcb, NULL);
+    tcp_accept(server->pcb, NULL);
+    tcp_close(server->pcb);
+    server->pcb = NULL;
+  }
+  while (server->peers != NULL) {
+    ws_server_close_peer(server->peers);
+  }
+
+  server->closing = false;
+}
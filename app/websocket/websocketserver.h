@@ -0,0 +1,94 @@
+/* Websocket server implementation
+ *
+ * Shares the handshake and framing helpers of the client. Connections are
+ * plain TCP on raw lwIP; messages are collected whole and handed to the
+ * application, which is enough for dashboards and control channels.
+ */
+
+#ifndef _WEBSOCKET_SERVER_H_
+#define _WEBSOCKET_SERVER_H_
+
+#include "websocketclient.h"
+#include "lwip/tcp.h"
+
+// Largest message, whole or reassembled from fragments, that is accepted
+#define WS_SERVER_MESSAGE_MAX 4096
+// Largest handshake request
+#define WS_SERVER_REQUEST_MAX 1024
+
+struct ws_server;
+struct ws_peer;
+
+typedef void (*ws_server_onConnectionCallback)(struct ws_server *server, struct ws_peer *peer);
+typedef void (*ws_server_onReceiveCallback)(struct ws_server *server, struct ws_peer *peer, int len, char *message, int opCode);
+typedef void (*ws_server_onCloseCallback)(struct ws_server *server, struct ws_peer *peer, int code);
+
+typedef struct ws_peer {
+  struct ws_peer *next;
+  struct ws_server *server;
+  struct tcp_pcb *pcb;
+  void *reservedData;
+
+  bool upgraded;
+  bool busy; // in the receive callback, so freeing waits until it is done
+  bool dead;
+  bool aborted;
+  char *request;
+  int requestLen;
+
+  unsigned char frameHeader[14];
+  int frameHeaderLen;
+  bool frameStarted;
+  int frameOpCode;
+  int frameIsFin;
+  char frameMask[4];
+  uint32_t frameMaskPos;
+  uint32_t framePayloadLeft;
+  char controlBuffer[WS_CONTROL_MAX];
+  int controlBufferLen;
+
+  char *message;
+  uint32_t messageLen;
+  int messageOpCode; // 0 if no message is in progress
+} ws_peer;
+
+typedef struct ws_server {
+  struct tcp_pcb *pcb;
+  ws_peer *peers;
+  bool closing;
+  void *reservedData;
+
+  ws_server_onConnectionCallback onConnection;
+  ws_server_onReceiveCallback onReceive;
+  ws_server_onCloseCallback onClose;
+} ws_server;
+
+/*
+ * Starts accepting websocket connections on the given port.
+ * Returns an lwIP error code.
+ */
+err_t ws_server_listen(ws_server *server, uint16_t port);
+
+/*
+ * Queues a message on one connection. Returns false if the connection is not
+ * open or its TCP send buffer has no room for the message right now.
+ */
+bool ws_server_send(ws_peer *peer, int opCode, const char *message, uint32_t length);
+
+/*
+ * Queues a message on every open connection and returns the number of
+ * connections it was queued on.
+ */
+int ws_server_broadcast(ws_server *server, int opCode, const char *message, uint32_t length);
+
+/*
+ * Sends a close frame and closes the connection; onClose is called with 0.
+ */
+void ws_server_close_peer(ws_peer *peer);
+
+/*
+ * Closes every connection and stops listening. The server can listen again.
+ */
+void ws_server_close(ws_server *server);
+
+#endif // _WEBSOCKET_SERVER_H_
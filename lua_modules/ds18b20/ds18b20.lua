@@ -11,9 +11,9 @@ local type, tostring, pcall, ipairs =
       type, tostring, pcall, ipairs
 -- Local functions
 local ow_setup, ow_search, ow_select, ow_read, ow_read_bytes, ow_write, ow_crc8,
-        ow_reset, ow_reset_search, ow_skip, ow_depower =
+        ow_reset, ow_reset_search, ow_skip, ow_depower, ow_search_all, ow_convert_all =
       ow.setup, ow.search, ow.select, ow.read, ow.read_bytes, ow.write, ow.crc8,
-        ow.reset, ow.reset_search, ow.skip, ow.depower
+        ow.reset, ow.reset_search, ow.skip, ow.depower, ow.search_all, ow.convert_all
 
 local node_task_post, node_task_LOW_PRIORITY = node.task.post, node.task.LOW_PRIORITY
 local string_char, string_dump = string.char, string.dump
@@ -52,54 +52,69 @@ local function to_string(addr, esc)
   end
 end
 
-local function readout(self)
-  local next = false
-  local sens = self.sens
-  local temp = self.temp
-  for i, s in ipairs(sens) do
-    if status[i] == 1 then
-      ow_reset(pin)
-      local addr = s:sub(1,8)
-      ow_select(pin, addr)   -- select the  sensor
-      ow_write(pin, READ_SCRATCHPAD, MODE)
-      local data = ow_read_bytes(pin, 9)
-
-      local t=(data:byte(1)+data:byte(2)*256)
-      -- t is actually signed so process the sign bit and adjust for fractional bits
-      -- the DS18B20 family has 4 fractional bits and the DS18S20s, 1 fractional bit
-      t = ((t <= 32767) and t or t - 65536) *
-          ((addr:byte(1) == DS18B20FAMILY) and 625 or 5000)
-      local crc, b9 = ow_crc8(string.sub(data,1,8)), data:byte(9)
-
-      t = t / 10000
-      if math_floor(t)~=85 then
-        if unit == 'F' then
-          t = t * 18/10 + 32
-        elseif unit == 'K' then
-          t = t + 27315/100
-        end
-        debugPrint(to_string(addr), t, crc, b9)
-        if crc==b9 then temp[addr]=t end
-        status[i] = 2
-      end
+-- decode the scratchpad of sensor i into self.temp
+local function decode(self, i, addr, data)
+  local t=(data:byte(1)+data:byte(2)*256)
+  -- t is actually signed so process the sign bit and adjust for fractional bits
+  -- the DS18B20 family has 4 fractional bits and the DS18S20s, 1 fractional bit
+  t = ((t <= 32767) and t or t - 65536) *
+      ((addr:byte(1) == DS18B20FAMILY) and 625 or 5000)
+  local crc, b9 = ow_crc8(string.sub(data,1,8)), data:byte(9)
+
+  t = t / 10000
+  if math_floor(t)~=85 then
+    if unit == 'F' then
+      t = t * 18/10 + 32
+    elseif unit == 'K' then
+      t = t + 27315/100
     end
-    next = next or status[i] == 0
+    debugPrint(to_string(addr), t, crc, b9)
+    if crc==b9 then self.temp[addr]=t end
+    status[i] = 2
   end
+end
+
+local function done(self)
+  local next = false
+  for i in ipairs(self.sens) do next = next or status[i] == 0 end
   if next then
     node_task_post(node_task_LOW_PRIORITY, function() return conversion(self) end)
   else
     --sens = {}
     if cb then
-      node_task_post(node_task_LOW_PRIORITY, function() return cb(temp) end)
+      node_task_post(node_task_LOW_PRIORITY, function() return cb(self.temp) end)
     end
   end
 end
 
+local function readout(self)
+  for i, s in ipairs(self.sens) do
+    if status[i] == 1 then
+      ow_reset(pin)
+      local addr = s:sub(1,8)
+      ow_select(pin, addr)   -- select the  sensor
+      ow_write(pin, READ_SCRATCHPAD, MODE)
+      decode(self, i, addr, ow_read_bytes(pin, 9))
+    end
+  end
+  done(self)
+end
+
 conversion = (function (self)
   local sens = self.sens
   local powered_only = true
   for _, s in ipairs(sens) do powered_only = powered_only and s:byte(9) ~= 1 end
-  if powered_only then
+  if powered_only and ow_convert_all then
+    debugPrint("starting bulk conversion: all sensors")
+    for i, _ in ipairs(sens) do status[i] = 1 end
+    -- the scratchpads are read in C, one sensor per task
+    return ow_convert_all(pin, sens, function(pads)
+      for i, s in ipairs(sens) do
+        if pads[i] then decode(self, i, s:sub(1,8), pads[i]) end
+      end
+      done(self)
+    end)
+  elseif powered_only then
     debugPrint("starting conversion: all sensors")
     ow_reset(pin)
     ow_skip(pin)  -- skip ROM selection, talk to all sensors
@@ -141,12 +156,20 @@ local function _search(self, lcb, lpin, search, save)
     debugPrint (#sens, "addreses found")
   end
 
+  local roms, n = nil, 0
+  local next_addr = function() return ow_search(pin) end
   ow_setup(pin)
   if search or #sens == 0 then
-    ow_reset_search(pin)
-    -- ow_target_search(pin,0x28)
+    if ow_search_all then
+      -- the whole search runs in one call, only the ROM checks are per task
+      roms = ow_search_all(pin)
+      next_addr = function() n = n + 1; return roms[n] end
+    else
+      ow_reset_search(pin)
+      -- ow_target_search(pin,0x28)
+    end
     -- search the first device
-    addr = ow_search(pin)
+    addr = next_addr()
   else
     for i, _ in ipairs(sens) do status[i] = 0 end
   end
@@ -162,7 +185,7 @@ local function _search(self, lcb, lpin, search, save)
         status[#sens] = 0
         debugPrint("contact: ", to_string(addr), parasite == 1 and "parasite" or "")
       end
-      addr = ow_search(pin)
+      addr = next_addr()
       node_task_post(node_task_LOW_PRIORITY, cycle)
     else
       ow_depower(pin)
@@ -328,7 +328,7 @@ local cxt, cmd, arg = ...
     return send("502 Active mode not supported. "..cmd.." not implemented")
   end
 
-  cxt.getData, cxt.setData = nil, nil
+  cxt.getData, cxt.setData, cxt.getFile, cxt.setFile = nil, nil, nil, nil
 
   arg = arg:gsub('^%.?/',''):gsub('^%.?/','')
 
@@ -366,17 +366,15 @@ local cxt, cmd, arg = ...
 
   elseif cmd == "RETR" then
     local f = file.open(arg, "r")
-    if f then -- define a getter to read the file
-      function cxt.getData(c) -- luacheck: ignore c -- upval: f
-        local buf = f:read(1024)
-        if not buf then f:close(); f = nil; end
-        return buf
-      end -- cxt.getData()
+    if f then -- the data socket reads the file itself, see cxt.sender()
+      cxt.getFile = f
+      function cxt.getData() end
     end
 
   elseif cmd == "STOR" then
     local f = file.open(arg, "w")
-    if f then -- define a setter to write the file
+    if f then -- the data socket writes the file itself, see cxt.receiver()
+      cxt.setFile = f
       function cxt.setData(c, rec) -- luacheck: ignore c -- upval: f (, arg)
         cxt.debug("writing %u bytes to %s", #rec, arg)
         return f:write(rec)
@@ -394,6 +392,8 @@ local cxt, cmd, arg = ...
   if cxt.getData and cxt.dataSocket then
     cxt.debug ("poking sender to initiate first xfer")
     node.task.post(function() cxt.sender(cxt.dataSocket) end)   -- upval: cxt
+  elseif cxt.setFile and cxt.dataSocket then
+    cxt.receiver(cxt.dataSocket)
   end
 
 end --[[SPLIT IGNORE]]
@@ -492,6 +492,17 @@ local cxt, dataSocket = ...
     cxt.debug ("entering sender")
     if not cxt.getData then return end
     skt = skt or cxt.dataSocket
+    local f = cxt.getFile
+    if f then -- RETR: read from SPIFFS as the send window opens
+      cxt.debug("Sending file")
+      cxt.getData, cxt.getFile = nil, nil
+      return skt:sendfile(f, function(s) -- upval: cxt, f
+        f:close()
+        s:close()
+        cxt.send("226 Transfer complete.")
+        cxt.dataSocket = nil
+      end)
+    end
     local rec = cxt:getData()
     if rec and #rec > 0 then
       cxt.debug("Sending %u data bytes", #rec)
@@ -504,12 +515,32 @@ local cxt, dataSocket = ...
     end
   end
 
+  function cxt.receiver(skt) -- upval: cxt
+    -- STOR: write to SPIFFS as each segment arrives, the window opening only
+    -- once it has been written. Anything received before this is written by
+    -- the receive callback. The cleardown closes the file and reports 226.
+    local f = cxt.setFile
+    if not f then return end
+    cxt.setFile = nil
+    cxt.debug("Receiving file")
+    skt:recvfile(f, function(_, n, err) -- upval: cxt
+      cxt.debug("Received %u bytes", n)
+      if err and cxt.setData then
+        cxt:fileClose()
+        cxt.setData = nil
+        cxt.send("552 Upload aborted. Exceeded storage allocation")
+      end
+    end)
+  end
+
   dataSocket:on("sent", cxt.sender)
   dataSocket:on("disconnection", function(skt) return cxt:cleardown(skt,1) end) -- upval: cxt
   dataSocket:on("reconnection",  function(skt) return cxt:cleardown(skt,2) end) -- upval: cxt
 
   -- if we are sending to client then kick off the first send
   if cxt.getData then cxt.sender(cxt.dataSocket) end
+  -- or hand an upload to the socket
+  cxt.receiver(cxt.dataSocket)
 
 end --[[SPLIT HERE]]
 return FTP --[[SPLIT IGNORE]]
@@ -22,10 +22,20 @@ do
   ------------------------------------------------------------------------------
   -- response methods
   ------------------------------------------------------------------------------
-  local make_res = function(csend, cfini)
-   local send = function(self, data, status)
-    -- TODO: req.send should take care of response headers!
-    if self.send_header then
+  -- content types of the files served by res:sendfile()
+  local mime = {
+    css = "text/css", gif = "image/gif", htm = "text/html", html = "text/html",
+    ico = "image/x-icon", jpg = "image/jpeg", js = "application/javascript",
+    json = "application/json", png = "image/png", svg = "image/svg+xml",
+    txt = "text/plain",
+  }
+  -- dictionary size used to inflate .gz files for clients without gzip
+  local GUNZIP_WINDOW = 14
+
+  local make_res = function(csend, cfini, req)
+   local start = function(self, status)
+    if not self.status_sent then
+      self.status_sent = true
       csend("HTTP/1.1 ")
       csend(tostring(status or 200))
       -- TODO: real HTTP status code/name table
@@ -35,13 +45,22 @@ do
       self:send_header("Transfer-Encoding", "chunked")
       -- TODO: send standard response headers, such as Server:, Date:
     end
+   end
+   local end_headers = function(self)
+    -- NB: no headers allowed after response body started
+    if self.send_header then
+      self.send_header = nil
+      -- end response headers
+      csend("\r\n")
+    end
+   end
+   local send = function(self, data, status)
+    -- TODO: req.send should take care of response headers!
+    if self.send_header then
+      start(self, status)
+    end
     if data then
-      -- NB: no headers allowed after response body started
-      if self.send_header then
-        self.send_header = nil
-        -- end response headers
-        csend("\r\n")
-      end
+      end_headers(self)
       -- chunked transfer encoding
       csend(("%X\r\n"):format(#data))
       csend(data)
@@ -56,6 +75,40 @@ do
     csend(value)
     csend("\r\n")
    end
+   -- send a file, or its pre-gzipped .gz sibling, a chunk at a time
+   local sendfile = function(self, path, ctype)
+    local gz, f, inflater, encoding = path .. ".gz"
+    if req.accept_gzip and file.exists(gz) then
+      f, encoding = file.open(gz), "gzip"
+    elseif file.exists(path) then
+      f = file.open(path)
+    elseif zlib and file.exists(gz) then
+      -- the client cannot take gzip, so inflate on the fly
+      f, inflater = file.open(gz), zlib.inflate({ windowBits = GUNZIP_WINDOW })
+    end
+    if not f then return false end
+    if self.send_header then
+      start(self, 200)
+      ctype = ctype or mime[path:match("%.(%w+)$") or ""]
+      if ctype then self:send_header("Content-Type", ctype) end
+      if encoding then self:send_header("Content-Encoding", encoding) end
+    end
+    end_headers(self)
+    -- NB: queued as a generator, so each chunk is only read once the
+    --   previous one has been sent
+    local function chunk()
+      local data = f:read(512)
+      if data and inflater then data = inflater:write(data) end
+      if not data then
+        f:close()
+        return nil
+      end
+      if #data == 0 then return "", chunk end
+      return ("%X\r\n"):format(#data) .. data .. "\r\n", chunk
+    end
+    csend(chunk)
+    return true
+   end
    -- finalize request, optionally sending data
    local finish = function(self, data, status)
     -- NB: res.send takes care of response headers
@@ -71,6 +124,7 @@ do
     local res = { }
     res.send_header = send_header
     res.send = send
+    res.sendfile = sendfile
     res.finish = finish
     return res
   end
@@ -80,7 +134,7 @@ do
   ------------------------------------------------------------------------------
   local http_handler = function(handler)
     return function(conn)
-      local csend = (require "fifosock").wrap(conn)
+      local csend = (fifosock or require "fifosock").wrap(conn)
 
       local req, res
       local buf = ""
@@ -112,6 +166,9 @@ do
         if k == "content-length" then
           cnt_len = tonumber(v)
         end
+        if k == "accept-encoding" and v:find("gzip", 1, true) then
+          req.accept_gzip = true
+        end
         if k == "expect" and v == "100-continue" then
           csend("HTTP/1.1 100 Continue\r\n")
         end
@@ -160,7 +217,7 @@ do
             if method then
               -- make request and response objects
               req = make_req(connection, method, url)
-              res = make_res(csend, cfini)
+              res = make_res(csend, cfini, req)
             end
             -- spawn request handler
             handler(req, res)
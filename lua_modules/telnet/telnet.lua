@@ -2,9 +2,9 @@
 
 --[[  A telnet server   T. Ellison,  June 2019
 
-This version of the telnet server demonstrates the use of the new stdin and stout
-pipes, which is a C implementation of the Lua fifosock concept moved into the
-Lua core.  These two pipes are referenced in the Lua registry.
+This version of the telnet server demonstrates the use of the stdin pipe, and of
+node.output() sending stdout straight to the socket from a C buffer, so that
+printing in a loop costs neither a Lua callback nor a TCP segment per print.
 
 ]]
 --luacheck: no unused args
@@ -13,28 +13,15 @@ local M = {}
 local modname = ...
 local function telnet_session(socket)
   local node = node
-  local stdout
 
-  local function output_CB(opipe)   -- upval: socket
-    stdout = opipe
-    local rec = opipe:read(1400)
-    if rec and #rec > 0 then socket:send(rec) end
-    return false -- don't repost as the on:sent will do this
-  end
-
-  local function onsent_CB(skt)     -- upval: stdout
-    local rec = stdout:read(1400)
-    if rec and #rec > 0 then skt:send(rec) end
-  end
-
-  local function disconnect_CB(skt) -- upval: socket, stdout
+  local function disconnect_CB(skt) -- upval: socket
     node.output()
-    socket, stdout = nil, nil -- set upvals to nl to allow GC
+    socket = nil -- set upval to nil to allow GC
   end
 
-  node.output(output_CB, 0)
+  -- the output is batched into TCP segments in C, see node.output()
+  node.output(socket, 0)
   socket:on("receive", function(_,rec) node.input(rec) end)
-  socket:on("sent", onsent_CB)
   socket:on("disconnection", disconnect_CB)
   print(("Welcome to NodeMCU world (%d mem free, %s)"):format(
         node.heap(), wifi.sta.getip()))
@@ -1,3 +1,6 @@
 #include <stdlib.h>
 #define MEM_DEFAULT_USE_DRAM
+#if defined(DEVELOPMENT_HEAP_PROFILE) && !defined(MEMLEAK_DEBUG)
+#define MEMLEAK_DEBUG  /* the SDK heap records the file and line of each block */
+#endif
 #include_next "mem.h"
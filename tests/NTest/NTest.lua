@@ -1,4 +1,8 @@
 local function TERMINAL_HANDLER(e, test, msg, errormsg)
+  if e == 'bench' then
+    print("  "..e.." "..test..': '..msg)
+    return
+  end
   if errormsg then
     errormsg = ": "..errormsg
   else
@@ -171,9 +175,41 @@ local function fail(handler, name, func, expected, msg)
   handler('pass', name, msg)
 end
 
+-- Benchmark timing: the CPU cycle counter on the device, os.clock() on host
+local function benchclock()
+  return tmr and tmr.ccount and tmr.ccount() or os.clock()
+end
+
+local function benchus(t0, t1)
+  if tmr and tmr.ccount then
+    local d = t1 - t0
+    if d < 0 then d = d + 4294967296 end  -- the counter has wrapped
+    return d / node.getcpufreq()
+  end
+  return (t1 - t0) * 1000000
+end
+
+-- Iterations to try next, aiming 20% over the target time
+local function benchnext(n, us, target)
+  local m = us > 0 and math.floor(n * target / us * 6 / 5) or n * 100
+  return math.max(n + 1, math.min(m, n * 100))
+end
+
+local function benchresult(n, us, bytes)
+  local r = { iterations = n, us = math.floor(us), ns_per_op = math.floor(us * 1000 / n) }
+  local msg = ("%d iterations, %d ns/op"):format(n, r.ns_per_op)
+  if bytes and us > 0 then
+    r.kB_per_s = math.floor(bytes / us * 1000)
+    msg = msg .. (", %d kB/s"):format(r.kB_per_s)
+  end
+  return msg, r
+end
+
 local nmt = {
   env = _G,
-  outputhandler = TERMINAL_HANDLER
+  outputhandler = TERMINAL_HANDLER,
+  benchtime = 100000,
+  benchmax = 1000000,
 }
 nmt.__index = nmt
 
@@ -283,6 +319,47 @@ return function(testrunname)
     testimpl(name, f, true)
   end
 
+  local function benchreport(name, n, us, bytes)
+    N.outputhandler('bench', name, benchresult(n, us, bytes))
+  end
+
+  function N.bench(name, f)
+    testimpl(name, function()
+      local n = 1
+      while true do
+        collectgarbage()
+        local t0 = benchclock()
+        local bytes = f(n)
+        local us = benchus(t0, benchclock())
+        if us >= N.benchtime or n >= N.benchmax then
+          return benchreport(name, n, us, bytes)
+        end
+        if tmr and tmr.wdclr then tmr.wdclr() end
+        n = benchnext(n, us, N.benchtime)
+      end
+    end)
+  end
+
+  function N.benchasync(name, f)
+    testimpl(name, function(done)
+      local n = 1
+      local function run()
+        collectgarbage()
+        local t0 = benchclock()
+        f(n, function(bytes)
+          local us = benchus(t0, benchclock())
+          if us >= N.benchtime or n >= N.benchmax then
+            benchreport(name, n, us, bytes)
+            return done()
+          end
+          n = benchnext(n, us, N.benchtime)
+          node.task.post(node.task.LOW_PRIORITY, run)
+        end)
+      end
+      run()
+    end, true)
+  end
+
   local currentCoName
 
   function N.testco(name, func)
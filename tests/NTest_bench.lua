@@ -0,0 +1,140 @@
+-- Benchmarks of the VM and of core modules, on the device or on the host:
+--
+--   cd tests; LUA_PATH="NTest/?.lua;utils/?.lua" ../luac.cross -e NTest_bench.lua
+--
+-- The benchmarks of modules that are not in the firmware are skipped. The TCP
+-- benchmark needs bench_peer set to the "ip:port" of a discard server, such as
+-- `nc -lk 9000 >/dev/null` on the test host.
+local N = ...
+if not N and os and os.getenv and os.getenv("NTEST_TAP") then
+  N = function(...)
+    local test = require("NTest")(...)
+    test.outputhandler = require "NTestTapOut"
+    return test
+  end
+end
+N = (N or require "NTest")("bench")
+
+local KB = string.rep("0123456789abcdef", 64)
+local sink  -- luacheck: ignore 231 (keeps results live)
+
+N.bench('table array set and get', function(n)
+  local t, s = {}, 0
+  for i = 1, n do t[i] = i end
+  for i = 1, n do s = s + t[i] end
+  sink = s
+end)
+
+N.bench('table hash set and get', function(n)
+  local keys = {"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta"}
+  local t = {}
+  for i = 1, n do
+    local k = keys[i % 8 + 1]
+    t[k] = (t[k] or 0) + 1
+  end
+  sink = t
+end)
+
+N.bench('table insert and remove', function(n)
+  local t = {}
+  for i = 1, n do table.insert(t, i) end
+  for _ = 1, n do table.remove(t) end
+end)
+
+-- ROTable access, the library tables and metatables of both VMs being ROTables
+N.bench('rotable lookup', function(n)
+  local f
+  for _ = 1, n do
+    f = string.format; f = math.floor; f = table.insert; f = string.nosuchkey
+  end
+  sink = f
+end)
+
+N.bench('string interning', function(n)
+  local s
+  for i = 1, n do s = "sensor/" .. (i % 512) .. "/temperature" end
+  sink = s
+end)
+
+N.bench('string format', function(n)
+  for i = 1, n do sink = ("%s=%d;"):format("key", i) end
+end)
+
+if sjson then
+  local doc = '{"id":"28ff4a1b2c3d","temp":21,"hum":48,"tags":["a","b","c"],"on":true}'
+  N.bench('sjson decode', function(n)
+    for _ = 1, n do sjson.decode(doc) end
+    return n * #doc
+  end)
+
+  local obj = sjson.decode(doc)
+  N.bench('sjson encode', function(n)
+    for _ = 1, n do sjson.encode(obj) end
+  end)
+end
+
+if crypto then
+  for _, algo in ipairs({"MD5", "SHA1", "SHA256"}) do
+    N.bench('crypto ' .. algo .. ' 1kB', function(n)
+      for _ = 1, n do crypto.hash(algo, KB) end
+      return n * #KB
+    end)
+  end
+end
+
+if pixbuf then
+  local buf = pixbuf.newBuffer(300, 3)
+  N.bench('pixbuf fill 300', function(n)
+    for i = 1, n do buf:fill(i % 256, 0, 255) end
+    return n * 900
+  end)
+
+  N.bench('pixbuf shift 300', function(n)
+    for _ = 1, n do buf:shift(1, pixbuf.SHIFT_CIRCULAR) end
+    return n * 900
+  end)
+end
+
+if file and file.open then
+  local name = "bench.tmp"
+
+  N.bench('file write 1kB', function(n)
+    local fd = file.open(name, "w")
+    for _ = 1, n do fd:write(KB) end
+    fd:close()
+    return n * #KB
+  end)
+
+  N.bench('file read 1kB', function(n)
+    local fd, got = file.open(name, "r"), 0
+    for _ = 1, n do
+      local s = fd:read(#KB)
+      if not s then fd:seek("set", 0); s = fd:read(#KB) end
+      got = got + #s
+    end
+    fd:close()
+    return got
+  end)
+
+  N.test('file cleanup', function()
+    file.remove(name)
+    ok(not file.exists(name), "removed")
+  end)
+end
+
+if net and bench_peer then
+  local ip, port = bench_peer:match("^(.+):(%d+)$")
+
+  N.benchasync('tcp send 1kB', function(n, done)
+    local sk, left = net.createConnection(net.TCP), n
+    local function send(s)
+      if left == 0 then s:close(); return done(n * #KB) end
+      left = left - 1
+      s:send(KB)
+    end
+    sk:on("connection", send)
+    sk:on("sent", send)
+    sk:on("reconnection", function(_, err) error("cannot connect to bench_peer: " .. err) end)
+    sk:connect(tonumber(port), ip)
+  end)
+end
@@ -59,6 +59,19 @@ N.test('getcontents more than 1K', function()
   ok(eq(#content, 1700), "long contents")
 end)
 
+N.test('write pipe', function()
+  cleanup()
+  local p = pipe.create()
+  p:write("abc", 123, ("x"):rep(300))
+  p:writef("%d:%s", 7, "end")
+  local s = p:concat()
+  local f = file.open("testfile", "w")
+  ok(f:write(p), "write pipe")
+  f:close()
+  ok(eq(p:nrec(), 0), "pipe drained")
+  ok(eq(file.getcontents("testfile"), s), "content matches")
+end)
+
 N.test('read more than 1K', function()
   cleanup()
   local f = file.open("testfile", "w")
@@ -1,6 +1,8 @@
 local N = ...
 N = (N or require "NTest")("pixbuf")
 
+local unpack = table.unpack or unpack
+
 local function initBuffer(buf, ...)
   for i,v in ipairs({...}) do
     buf:set(i, v, v*2, v*3, v*4)
@@ -102,6 +104,45 @@ N.test('fade correctly', function()
     ok(eq(buffer:dump(), string.char(0,111,27,38)), "RGBW")
 end)
 
+N.test('fade every byte value', function()
+    local buffer = pixbuf.newBuffer(85, 3) -- 255 bytes, so not a whole number of words
+    local all = {}
+    for i = 0, 254 do all[#all+1] = i end
+    buffer:replace(string.char(unpack(all)))
+    buffer:fade(7)
+    local want = {}
+    for i = 0, 254 do want[#want+1] = math.floor(i/7) end
+    ok(eq(buffer:dump(), string.char(unpack(want))), "FADE_OUT")
+
+    buffer:replace(string.char(unpack(all)))
+    buffer:fade(5, pixbuf.FADE_IN)
+    want = {}
+    for i = 0, 254 do want[#want+1] = math.min(255, i*5) end
+    ok(eq(buffer:dump(), string.char(unpack(want))), "FADE_IN")
+end)
+
+N.test('fadeI only touches intensity', function()
+    local buffer = pixbuf.newBuffer(2, 4)
+    buffer:fill(10,22,54,234)
+    buffer:fadeI(2, pixbuf.FADE_IN)
+    ok(eq(buffer:dump(), string.char(20,22,54,234,20,22,54,234)), "FADE_IN")
+    buffer:fadeI(4)
+    ok(eq(buffer:dump(), string.char(5,22,54,234,5,22,54,234)), "FADE_OUT")
+end)
+
+N.test('lookup tables', function()
+    local lut = pixbuf.lut(1)
+    ok(eq(#lut, 256), "size")
+    ok(eq(lut:byte(1), 0) and eq(lut:byte(129), 128) and eq(lut:byte(256), 255), "identity")
+    lut = pixbuf.lut(2, 128)
+    ok(eq(lut:byte(256), 128) and eq(lut:byte(129), 32), "gamma and brightness")
+
+    local buffer = pixbuf.newBuffer(3, 3)
+    buffer:fill(0, 128, 255)
+    ok(eq(buffer:apply(lut):dump(), string.char(0,32,128,0,32,128,0,32,128)), "apply")
+    fail(function() buffer:apply("abc") end, "lookup table should be 256 bytes")
+end)
+
 N.test('mix correctly issue #1736', function()
     local buffer1 = pixbuf.newBuffer(1, 3)
     local buffer2 = pixbuf.newBuffer(1, 3)
@@ -137,6 +178,31 @@ N.test('power', function()
     ok(eq(buffer:power(), 2*(10+22+54+234)))
 end)
 
+N.test('power of an odd size buffer', function()
+    local buffer = pixbuf.newBuffer(201, 3)
+    buffer:fill(255,255,255)
+    ok(eq(buffer:power(), 201*3*255))
+end)
+
+N.test('benchmark', function()
+    local buffer = pixbuf.newBuffer(600, 3)
+    local other = pixbuf.newBuffer(600, 3)
+    local lut = pixbuf.lut(2.2)
+    local runs = 20
+    local function time(name, f)
+      buffer:fill(100, 150, 200)
+      local t = tmr.now()
+      for _ = 1, runs do f() end
+      print(("  %-8s %6d us/op (600 RGB pixels)"):format(name, math.floor((tmr.now() - t) / runs)))
+    end
+    time("fade", function() buffer:fade(2) end)
+    time("fadeIn", function() buffer:fade(2, pixbuf.FADE_IN) end)
+    time("mix", function() buffer:mix(128, buffer, 128, other) end)
+    time("power", function() buffer:power() end)
+    time("apply", function() buffer:apply(lut) end)
+    ok(true)
+end)
+
 N.test('shift LOGICAL', function()
     local buffer1 = pixbuf.newBuffer(4, 4)
     local buffer2 = pixbuf.newBuffer(4, 4)
@@ -90,6 +90,18 @@ N.testco('AUTO alarm coroutine', function(getCB, waitCB)
   ok(true, "coroutine end")
 end)
 
+if coroutine.await then
+  N.testasync('SINGLE alarm await', function(next)
+    coroutine.wrap(function()
+      local t = tmr.create()
+      local timer = coroutine.await(t.alarm, t, 200, tmr.ALARM_SINGLE)
+      ok(eq(t, timer), "await returns the CB arguments")
+      next()
+    end)()
+    ok(true, "sync end")
+  end)
+end
+
 N.test('softwd set positive and negative values', function()
   tmr.softwd(22)
   tmr.softwd(0)
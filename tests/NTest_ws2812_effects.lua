@@ -25,3 +25,23 @@ N.test('set_brightness', function()
   fail(function() ws2812_effects.set_brightness(-1) end, "should be")
   fail(function() ws2812_effects.set_brightness(256) end, "should be")
 end)
+
+N.test('segments', function()
+  buffer = ws2812.newBuffer(9, 3)
+  ws2812_effects.init(buffer)
+
+  ws2812_effects.set_segments(
+    { pixels = 4, mode = "static", color = {255, 0, 0}, brightness = 255 },
+    { pixels = 5, mode = "static", color = {0, 0, 255}, brightness = 255 })
+  ok(eq({buffer:get(4)}, {255, 0, 0}), "first segment")
+  ok(eq({buffer:get(5)}, {0, 0, 255}), "second segment")
+
+  ws2812_effects.select(2)
+  ws2812_effects.set_mode("rainbow")
+  ok(eq(ws2812_effects.render(), buffer), "render returns the buffer")
+  ok(eq({buffer:get(1)}, {255, 0, 0}), "other segment untouched")
+
+  fail(function() ws2812_effects.select(3) end, "no such segment")
+  fail(function() ws2812_effects.set_segments(5, 5) end, "segments exceed the buffer")
+  fail(function() ws2812_effects.set_segments(1) end, "at least 2 pixels")
+end)
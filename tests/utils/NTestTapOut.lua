@@ -1,10 +1,32 @@
 -- This is a NTest output handler that formats its output in a way that
 -- resembles the Test Anything Protocol (though prefixed with "TAP: " so we can
 -- more readily find it in comingled output streams).
+--
+-- Benchmark results are passes, preceded by a "TAP: # BENCH" comment holding
+-- the result as a JSON object for collecting into trends.
+
+local function benchjson(test, r)
+  local info = node and node.info and node.info("sw_version")
+  local fields = { ('"name":"%s"'):format(test:gsub('[%c"\\]', "_")) }
+  for _, k in ipairs({"iterations", "us", "ns_per_op", "kB_per_s"}) do
+    if r[k] then fields[#fields + 1] = ('"%s":%d'):format(k, r[k]) end
+  end
+  fields[#fields + 1] = ('"lua":"%s"'):format(_VERSION)
+  if info then
+    fields[#fields + 1] = ('"release":"%s"'):format(info.git_release:gsub('[%c"\\]', "_"))
+  end
+  return "{" .. table.concat(fields, ",") .. "}"
+end
 
 local nrun
 return function(e, test, msg, err)
   msg = msg or ""
+  if e == "bench" then
+    print(("\nTAP: # BENCH %s"):format(benchjson(test, err)))
+    print(("\nTAP: ok %d %s # %s"):format(nrun, test, msg))
+    nrun = nrun + 1
+    return
+  end
   err = err or ""
   if     e == "pass" then
     print(("\nTAP: ok %d %s # %s"):format(nrun, test, msg))
@@ -0,0 +1,179 @@
+#!/usr/bin/env python
+#
+# IRAM promotion of hot functions
+#
+# Reads one or more PC histograms saved from the perf module and the linker
+# map of the firmware they were taken on (app/mapfile), and writes the
+# linker fragment ld/iram_hot.ld naming the functions with the most samples,
+# as many as fit the budget. ld/nodemcu.ld includes the fragment in the
+# IRAM .text section, so the next build runs those functions without going
+# through the flash cache.
+#
+# A histogram file has a "binsize <n>" line followed by "<address> <count>"
+# lines, see docs/modules/perf.md. Several files are added together.
+#
+#   python tools/iram_promote.py [--budget BYTES] [-o FILE] app/mapfile perf.txt...
+
+import argparse
+import os
+import re
+import sys
+
+IRAM_SIZE = 0x8000    # iram1_0_seg of ld/nodemcu.ld
+
+INPUT = re.compile(r'^ (\S+)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$')
+OUTPUT = re.compile(r'^(\.\S+)(\s+0x([0-9a-f]+)\s+0x([0-9a-f]+))?')
+MEMBER = re.compile(r'^.*?([^/\\]+\.a)\((.+)\)$')
+
+
+class Function(object):
+    def __init__(self, section, addr, size, path):
+        self.section = section
+        self.addr = addr
+        self.size = size
+        self.path = path
+        self.samples = 0.0
+
+    def name(self):
+        return self.section[len('.text.'):]
+
+    def pattern(self):
+        m = MEMBER.match(self.path)
+        obj = '*%s:%s' % (m.group(1), m.group(2)) if m else '*' + os.path.basename(self.path)
+        return '%s(.literal.%s %s)' % (obj, self.name(), self.section)
+
+
+def parse_map(f):
+    """The function sections in IRAM and irom0, and the IRAM in use"""
+    functions = []
+    iram_used = 0
+    output = None
+    pending = None
+    in_map = False
+
+    for line in f:
+        line = line.rstrip('\r\n')
+        if not in_map:
+            in_map = line.startswith('Linker script and memory map')
+            continue
+        if not line:
+            continue
+
+        if not line[0].isspace():
+            m = OUTPUT.match(line)
+            output = m.group(1) if m else None
+            if m and m.group(2) and output in ('.text', '.lit4'):
+                iram_used += int(m.group(4), 16)
+            pending = None
+            continue
+        if output not in ('.text', '.irom0.text'):
+            continue
+
+        if pending is not None:
+            # a long input section name puts the rest on the next line
+            line = ' ' + pending + line
+            pending = None
+        m = INPUT.match(line)
+        if not m:
+            fields = line.split()
+            if len(fields) == 1 and fields[0].startswith('.'):
+                pending = fields[0]
+            continue
+        # only -ffunction-sections sections hold exactly one function
+        section, addr, size = m.group(1), int(m.group(2), 16), int(m.group(3), 16)
+        if section and section.startswith('.text.') and size:
+            functions.append(Function(section, addr, size, m.group(4).strip()))
+
+    if not in_map:
+        raise ValueError('No memory map found, is this a linker map file?')
+    functions.sort(key=lambda fn: fn.addr)
+    return functions, iram_used
+
+
+def load_histogram(filename, functions):
+    starts = [fn.addr for fn in functions]
+    binsize = None
+    with open(filename) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) != 2:
+                continue
+            if fields[0] == 'binsize':
+                binsize = int(fields[1], 0)
+                continue
+            if binsize is None:
+                raise ValueError('%s: no binsize line before the histogram' % filename)
+            lo, count = int(fields[0], 0), int(fields[1], 0)
+            hi = lo + binsize
+            # share the bin among the functions it overlaps
+            i = max(bisect(starts, lo) - 1, 0)
+            while i < len(functions) and functions[i].addr < hi:
+                fn = functions[i]
+                overlap = min(hi, fn.addr + fn.size) - max(lo, fn.addr)
+                if overlap > 0:
+                    fn.samples += float(count) * overlap / binsize
+                i += 1
+
+
+def bisect(a, x):
+    lo, hi = 0, len(a)
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if x < a[mid]:
+            hi = mid
+        else:
+            lo = mid + 1
+    return lo
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Move the functions hottest in perf histograms into IRAM.')
+    parser.add_argument('mapfile', help='linker map of the firmware that was profiled')
+    parser.add_argument('histogram', nargs='+', help='histogram saved from perf.stop()')
+    parser.add_argument('--budget', type=int, default=2048, help='IRAM bytes to use (default 2048)')
+    parser.add_argument('-o', '--output', default='ld/iram_hot.ld', help='fragment to write (default ld/iram_hot.ld)')
+    args = parser.parse_args()
+
+    try:
+        with open(args.mapfile) as f:
+            functions, iram_used = parse_map(f)
+        # of the functions already in IRAM, only those of the earlier fragment can move
+        earlier = set()
+        if os.path.exists(args.output):
+            with open(args.output) as f:
+                earlier = set(line.strip() for line in f)
+        functions = [fn for fn in functions if fn.addr >= 0x40200000 or fn.pattern() in earlier]
+        for filename in args.histogram:
+            load_histogram(filename, functions)
+    except (IOError, ValueError) as e:
+        sys.exit('iram_promote: %s' % e)
+
+    # functions promoted by the earlier fragment free their IRAM if dropped
+    promoted = sum(fn.size for fn in functions if fn.addr < 0x40200000)
+    free = IRAM_SIZE - iram_used + promoted
+    budget = min(args.budget, free)
+    total = sum(fn.samples for fn in functions) or 1
+
+    chosen, used = [], 0
+    for fn in sorted(functions, key=lambda fn: -fn.samples):
+        if fn.samples < 1:
+            break
+        if used + fn.size <= budget:
+            chosen.append(fn)
+            used += fn.size
+
+    with open(args.output, 'w') as f:
+        f.write('/* Generated by tools/iram_promote.py from %s */\n' % ' '.join(args.histogram))
+        f.write('/* %d of %d bytes, %.1f%% of the samples in functions */\n' %
+                (used, budget, 100 * sum(fn.samples for fn in chosen) / total))
+        for fn in chosen:
+            f.write('%s\n' % fn.pattern())
+
+    for fn in chosen:
+        sys.stdout.write('%6d %5.1f%% %s\n' % (fn.size, 100 * fn.samples / total, fn.name()))
+    sys.stdout.write('%d bytes of %d budget, %d bytes of IRAM free before, written to %s\n' %
+                     (used, budget, free, args.output))
+
+
+if __name__ == '__main__':
+    main()
@@ -7,5 +7,6 @@ stds.nodemcu_libs.read_globals.nok = empty
 stds.nodemcu_libs.read_globals.eq = empty
 stds.nodemcu_libs.read_globals.fail = empty
 stds.nodemcu_libs.read_globals.spy = empty
+stds.nodemcu_libs.read_globals.bench_peer = empty
 
 std = "lua51+lua53+nodemcu_libs"
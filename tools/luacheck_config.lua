@@ -140,6 +140,18 @@ stds.nodemcu_libs = {
         temperature = empty
       }
     },
+    cluster = {
+      fields = {
+        DOWN = empty,
+        REMOVE = empty,
+        SUSPECT = empty,
+        UP = empty,
+        nodes = empty,
+        push = empty,
+        start = empty,
+        stop = empty
+      }
+    },
     coap = {
       fields = {
         CON = empty,
@@ -178,6 +190,7 @@ stds.nodemcu_libs = {
         mask = empty,
         new_hash = empty,
         new_hmac = empty,
+        new_hmac_key = empty,
         sha1 = empty,
         toBase64 = empty,
         toHex = empty
@@ -234,6 +247,11 @@ stds.nodemcu_libs = {
         stop = empty
       }
     },
+    fifosock = {
+      fields = {
+        wrap = empty
+      }
+    },
     file = {
       fields = {
         chdir = empty,
@@ -244,6 +262,7 @@ stds.nodemcu_libs = {
         fscfg = empty,
         fsinfo = empty,
         getcontents = empty,
+        iter = empty,
         list = empty,
         mount = empty,
         n = empty,
@@ -256,6 +275,8 @@ stds.nodemcu_libs = {
         rename = empty,
         seek = empty,
         stat = empty,
+        stats = empty,
+        wear = empty,
         write = empty,
         writeline = empty
       }
@@ -277,11 +298,13 @@ stds.nodemcu_libs = {
         OPENDRAIN = empty,
         OUTPUT = empty,
         PULLUP = empty,
+        bus = empty,
         mode = empty,
         read = empty,
         serout = empty,
         trig = empty,
         write = empty,
+        write_mask = empty,
         pulse = {
           fields = {
             adjust = empty,
@@ -350,7 +373,9 @@ stds.nodemcu_libs = {
         PWRDN_1K = empty,
         PWRDN_500K = empty,
         PWRDN_NONE = empty,
+        play = empty,
         read = empty,
+        stop = empty,
         write = empty
       }
     },
@@ -403,11 +428,14 @@ stds.nodemcu_libs = {
         bootreason = empty,
         chipid = empty,
         compile = empty,
+        cpugovernor = empty,
         dsleep = empty,
         dsleepMax = empty,
+        fastwake = empty,
         dsleepsetoption = empty,
         flashid = empty,
         flashindex = empty,
+        flashinfo = empty,
         flashreload = empty,
         flashsize = empty,
         getcpufreq = empty,
@@ -423,6 +451,7 @@ stds.nodemcu_libs = {
         restart = empty,
         restore = empty,
         setcpufreq = empty,
+        setflashmode = empty,
         setpartitiontable = empty,
         setonerror = empty,
         sleep = empty,
@@ -431,6 +460,7 @@ stds.nodemcu_libs = {
         egc = {
           fields = {
             setmode = empty,
+            setpressure = empty,
             meminfo = empty
          }
         },
@@ -473,6 +503,16 @@ stds.nodemcu_libs = {
         write_bytes = empty
       }
     },
+    ota = {
+      fields = {
+        abort = empty,
+        apply = empty,
+        finish = empty,
+        start = empty,
+        status = empty,
+        write = empty
+      }
+    },
     pcm = {
       fields = {
         RATE_10K = empty,
@@ -496,6 +536,10 @@ stds.nodemcu_libs = {
       fields = {
         FADE_IN = empty,
         FADE_OUT = empty,
+        MATRIX_COLUMNS = empty,
+        MATRIX_FLIP_X = empty,
+        MATRIX_FLIP_Y = empty,
+        MATRIX_SERPENTINE = empty,
         SHIFT_CIRCULAR = empty,
         SHIFT_LOGICAL = empty,
         init = empty,
@@ -532,6 +576,17 @@ stds.nodemcu_libs = {
         send = empty
       }
     },
+    redis = {
+      fields = {
+        connect = empty
+      }
+    },
+    rfrecv = {
+      fields = {
+        off = empty,
+        on = empty
+      }
+    },
     rfswitch = {
       fields = {
         send = empty
@@ -566,7 +621,11 @@ stds.nodemcu_libs = {
     },
     rtcmem = {
       fields = {
+        read = empty,
         read32 = empty,
+        restore = empty,
+        save = empty,
+        write = empty,
         write32 = empty
       }
     },
@@ -598,10 +657,12 @@ stds.nodemcu_libs = {
     sigma_delta = {
       fields = {
         close = empty,
+        play = empty,
         setprescale = empty,
         setpwmduty = empty,
         settarget = empty,
-        setup = empty
+        setup = empty,
+        stop = empty
       }
     },
     sjson = {
@@ -690,6 +751,7 @@ stds.nodemcu_libs = {
     },
     tm1829 = {
       fields = {
+        I2S = empty,
         write = empty
       }
     },
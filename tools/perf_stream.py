@@ -0,0 +1,134 @@
+#!/usr/bin/env python
+#
+# Sample stream collector
+#
+# Reads the samples sent by perf.start("stream") (see docs/modules/perf.md)
+# from a serial port or a capture of the UART output, names the addresses
+# with the symbols of the build, and writes the stacks in the folded format
+# of flamegraph.pl, one "outer;...;inner count" line per distinct stack.
+# Anything between the packets, such as console output, is ignored.
+#
+#   python tools/perf_stream.py --port /dev/ttyUSB0 [--baud 115200] [--seconds 30]
+#   python tools/perf_stream.py capture.txt > perf.folded
+#   flamegraph.pl perf.folded > perf.svg
+#
+# The symbols are read from bin/firmware.sym, which the build writes from the
+# ELF file, so it must come from the same build as the firmware.
+
+import argparse
+import bisect
+import re
+import sys
+import time
+
+PACKET = re.compile(br'\$([SsL])([0-9a-f]*)#([0-9a-f]{2})')
+
+# Frames of the sampling interrupt itself, found on the stack above the PC
+SKIP = r'^(hw_timer_cb|hw_timer_isr_cb|stack_scan|_xt_.*|_xtos_.*|ets_.*_intr.*)$'
+
+
+def load_symbols(path):
+    addrs, names = [], []
+    with open(path) as f:
+        for line in f:
+            parts = line.split()
+            if len(parts) >= 3:
+                addrs.append(int(parts[0], 16))
+                names.append(parts[2])
+    return addrs, names
+
+
+def symbol(syms, addr):
+    i = bisect.bisect_right(syms[0], addr) - 1
+    return syms[1][i] if i >= 0 else '0x%08x' % addr
+
+
+def packets(chunks):
+    """Yields (tag, words) for each packet with a good checksum"""
+    buf = b''
+    for chunk in chunks:
+        buf += chunk
+        end = 0
+        for m in PACKET.finditer(buf):
+            end = m.end()
+            tag, payload = m.group(1), m.group(2)
+            if sum(bytearray(tag + payload)) & 0xff != int(m.group(3), 16):
+                continue
+            words = [int(payload[i:i + 8], 16) for i in range(0, len(payload), 8)]
+            yield tag.decode(), words
+        # keep a partial packet for the next chunk
+        rest = buf[end:]
+        start = rest.rfind(b'$')
+        buf = rest[start:] if start >= 0 else b''
+
+
+def read_port(port, baud, seconds):
+    import serial
+    s = serial.Serial(port, baud, timeout=0.2)
+    stop = time.time() + seconds if seconds else None
+    try:
+        while stop is None or time.time() < stop:
+            yield s.read(4096)
+    except KeyboardInterrupt:
+        pass
+
+
+def read_file(f):
+    while True:
+        data = f.read(4096)
+        if not data:
+            return
+        yield data
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Collect perf.start("stream") samples')
+    parser.add_argument('--port', help='serial port to read the samples from')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--seconds', type=float, default=0,
+                        help='stop reading the port after this long (default at ^C)')
+    parser.add_argument('--symbols', default='bin/firmware.sym')
+    parser.add_argument('--skip', default=SKIP,
+                        help='regular expression of the frames to leave out')
+    parser.add_argument('capture', nargs='?', type=argparse.FileType('rb'),
+                        help='file with the UART output, instead of --port')
+    args = parser.parse_args()
+
+    syms = load_symbols(args.symbols)
+    skip = re.compile(args.skip)
+    if args.port:
+        chunks = read_port(args.port, args.baud, args.seconds)
+    else:
+        source = args.capture or getattr(sys.stdin, 'buffer', sys.stdin)
+        chunks = read_file(source)
+
+    stacks = {}
+    pc = None
+    total = lost = 0
+
+    def flush():
+        if pc is not None:
+            key = ';'.join(reversed(frames)) if frames else '[unknown]'
+            stacks[key] = stacks.get(key, 0) + 1
+
+    frames = []
+    for tag, words in packets(chunks):
+        if tag == 'S':
+            flush()
+            pc = words[0]
+            frames = [symbol(syms, pc)]
+            total += 1
+        elif tag == 's' and pc is not None:
+            callers = [symbol(syms, a) for a in words]
+            frames += [n for n in callers if not skip.match(n)]
+        elif tag == 'L':
+            lost = words[0]
+    flush()
+
+    for key in sorted(stacks, key=stacks.get, reverse=True):
+        print('%s %d' % (key, stacks[key]))
+    sys.stderr.write('%d samples, %d lost on the device\n' % (total, lost))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,177 @@
+#!/usr/bin/env python
+#
+# Firmware size report
+#
+# Reads the linker map written by the app link (app/mapfile) and prints how
+# many bytes each module places in IRAM, irom0 (flash), .data, .rodata and
+# .bss. Objects of the firmware's own libraries are listed one by one, as
+# "modules/rotary.o" say, and the SDK and toolchain libraries as a whole.
+#
+# With --baseline the report is compared against the one saved by the
+# previous run, and only the modules that changed are listed, followed by
+# the totals. The new report is then saved in its place.
+#
+#   python tools/sizereport.py [--baseline FILE] [--all] app/mapfile
+
+import argparse
+import os
+import re
+import sys
+
+COLUMNS = ('iram', 'irom0', 'data', 'rodata', 'bss')
+
+# Output sections of ld/nodemcu.ld and the column they count against
+SECTIONS = {
+    '.text': 'iram',
+    '.lit4': 'iram',
+    '.pre_init_ram': 'iram',
+    '.irom0.text': 'irom0',
+    '.data': 'data',
+    '.dport0.rodata': 'data',
+    '.dport0.literal': 'data',
+    '.dport0.data': 'data',
+    '.rodata': 'rodata',
+    '.bss': 'bss',
+}
+
+INPUT = re.compile(r'^ (\S+)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$')
+OUTPUT = re.compile(r'^(\.\S+)(\s+0x[0-9a-f]+\s+0x[0-9a-f]+)?')
+MEMBER = re.compile(r'^(.*?)([^/\\]+)\.a\((.+)\)$')
+APP_LIB = re.compile(r'[/\\]\.output[/\\]')
+
+
+def module_name(path):
+    """The name a contribution is listed under"""
+    m = MEMBER.match(path)
+    if not m:
+        return os.path.basename(path)
+    if APP_LIB.search(m.group(1)):
+        # app/<dir>/.output/<target>/<flavor>/lib/lib<dir>.a(<obj>)
+        app_dir = APP_LIB.split(m.group(1))[0]
+        return os.path.basename(app_dir) + '/' + m.group(3)
+    return m.group(2) + '.a'
+
+
+def parse_map(f):
+    sizes = {}
+    column = None
+    pending = None
+    in_map = False
+
+    for line in f:
+        line = line.rstrip('\r\n')
+        if not in_map:
+            in_map = line.startswith('Linker script and memory map')
+            continue
+        if not line:
+            continue
+
+        if not line[0].isspace():
+            m = OUTPUT.match(line)
+            column = SECTIONS.get(m.group(1)) if m else None
+            pending = None
+            continue
+        if column is None:
+            continue
+
+        if pending is not None:
+            # a long input section name puts the rest on the next line
+            line = ' ' + pending + line
+            pending = None
+        m = INPUT.match(line)
+        if not m:
+            fields = line.split()
+            if len(fields) == 1 and fields[0].startswith('.') or fields == ['COMMON']:
+                pending = fields[0]
+            continue
+        name, size, path = m.group(1), int(m.group(3), 16), m.group(4).strip()
+        if not name or name == '*fill*' or not size:
+            continue
+
+        module = sizes.setdefault(module_name(path), dict.fromkeys(COLUMNS, 0))
+        module[column] += size
+
+    if not in_map:
+        raise ValueError('No memory map found, is this a linker map file?')
+    return sizes
+
+
+def load_report(filename):
+    sizes = {}
+    with open(filename) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) != len(COLUMNS) + 1 or fields[0] in ('module', 'total'):
+                continue
+            try:
+                sizes[fields[0]] = dict(zip(COLUMNS, [int(v) for v in fields[1:]]))
+            except ValueError:
+                pass
+    return sizes
+
+
+def totals(sizes):
+    return dict((c, sum(m[c] for m in sizes.values())) for c in COLUMNS)
+
+
+def write_report(out, sizes):
+    width = max([len(k) for k in sizes] + [8])
+    fmt = '%-*s' + ' %8s' * len(COLUMNS) + '\n'
+    out.write(fmt % ((width, 'module') + COLUMNS))
+    for name in sorted(sizes, key=lambda k: (-sizes[k]['iram'], k)):
+        out.write(fmt % ((width, name) + tuple(sizes[name][c] for c in COLUMNS)))
+    out.write(fmt % ((width, 'total') + tuple(totals(sizes)[c] for c in COLUMNS)))
+
+
+def write_diff(out, old, new):
+    zero = dict.fromkeys(COLUMNS, 0)
+    width = max([len(k) for k in set(old) | set(new)] + [8])
+    fmt = '%-*s' + ' %8s' * len(COLUMNS) + '\n'
+
+    def delta(a, b):
+        return tuple('%+d' % (b[c] - a[c]) if b[c] != a[c] else '.' for c in COLUMNS)
+
+    out.write(fmt % ((width, 'module') + COLUMNS))
+    changed = 0
+    for name in sorted(set(old) | set(new)):
+        a, b = old.get(name, zero), new.get(name, zero)
+        if a != b:
+            changed += 1
+            out.write(fmt % ((width, name) + delta(a, b)))
+    if not changed:
+        out.write('no change\n')
+    out.write(fmt % ((width, 'total') + tuple(totals(new)[c] for c in COLUMNS)))
+    out.write(fmt % ((width, 'change') + delta(totals(old), totals(new))))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Per-module firmware size report from a linker map.')
+    parser.add_argument('mapfile', help='linker map, as written by -Wl,-Map')
+    parser.add_argument('--baseline', metavar='FILE',
+                        help='report of the previous build to compare with, replaced by this one')
+    parser.add_argument('--all', action='store_true',
+                        help='list every module even when comparing with a baseline')
+    args = parser.parse_args()
+
+    try:
+        with open(args.mapfile) as f:
+            sizes = parse_map(f)
+    except (IOError, ValueError) as e:
+        sys.exit('sizereport: %s' % e)
+
+    if args.baseline and os.path.exists(args.baseline):
+        old = load_report(args.baseline)
+        if args.all:
+            write_report(sys.stdout, sizes)
+            sys.stdout.write('\n')
+        write_diff(sys.stdout, old, sizes)
+    else:
+        write_report(sys.stdout, sizes)
+
+    if args.baseline:
+        with open(args.baseline, 'w') as f:
+            write_report(f, sizes)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,72 @@
+#!/usr/bin/env python
+#
+# Event trace decoder
+#
+# Prints the binary entries read with perf.trace.read() (see
+# docs/modules/perf.md), one per line: the time in µs since the first entry,
+# the time since the previous one, the event and its two arguments.  The
+# entries are 12 bytes each, the CPU cycle count, the event, a and b, in the
+# layout of platform_trace_entry_t in app/include/platform_trace.h.
+#
+#   python tools/trace_decode.py [--mhz 80|160] trace.bin
+
+import argparse
+import socket
+import struct
+import sys
+
+ENTRY = struct.Struct('<IHHI')
+
+# In the order of the TRACE_ enum, from 1
+EVENTS = ('TASK_POST', 'TASK_DISPATCH', 'TASK_DONE', 'GC_STEP', 'GC_STEP_DONE',
+          'NET_RX', 'NET_TX', 'FLASH_ERASE', 'FLASH_WRITE', 'LUA_CB',
+          'LUA_CB_DONE', 'GPIO_ISR', 'USER')
+
+
+def event_name(ev):
+    if 1 <= ev <= len(EVENTS):
+        return EVENTS[ev - 1]
+    return 'EVENT_%d' % ev
+
+
+def arg_text(name, a, b):
+    if name in ('NET_RX', 'NET_TX'):
+        return 'len=%d %s' % (a, socket.inet_ntoa(struct.pack('<I', b)))
+    if name == 'FLASH_WRITE':
+        return 'len=%d addr=0x%06x' % (a, b)
+    if name == 'GPIO_ISR':
+        return 'status=0x%04x' % b
+    if name.startswith('TASK_'):
+        return 'prio=%d handle=0x%08x' % (a, b)
+    return 'a=%d b=%d' % (a, b if b < 0x80000000 else b - 0x100000000)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a perf.trace dump')
+    parser.add_argument('--mhz', type=int, default=80,
+                        help='CPU frequency while tracing (default 80)')
+    parser.add_argument('file', type=argparse.FileType('rb'))
+    args = parser.parse_args()
+
+    data = args.file.read()
+    if len(data) % ENTRY.size:
+        sys.stderr.write('warning: %d trailing bytes ignored\n' %
+                         (len(data) % ENTRY.size))
+    prev = None
+    elapsed = 0
+    for off in range(0, len(data) - ENTRY.size + 1, ENTRY.size):
+        ccount, ev, a, b = ENTRY.unpack_from(data, off)
+        if prev is None:
+            prev = ccount
+        # the cycle counter wraps every 53s at 80MHz
+        delta = (ccount - prev) & 0xffffffff
+        elapsed += delta
+        prev = ccount
+        name = event_name(ev)
+        print('%12.1f %+10.1f  %-14s %s' % (elapsed / float(args.mhz),
+                                            delta / float(args.mhz),
+                                            name, arg_text(name, a, b)))
+
+
+if __name__ == '__main__':
+    main()